@@ -22,6 +22,7 @@
 #include <sstream>
 #include <iomanip>
 #include <string>
+#include <vector>
 #include <cstring>
 #include <cJSON.h>
 #include <fstream>
@@ -39,6 +40,9 @@ std::string Audit::hostname;
 void (*Audit::notify_io_complete)(const void *cookie,
                                   ENGINE_ERROR_CODE status);
 
+// There is a single Audit, so the ring of the thread may live here
+static AUDIT_THREAD_LOCAL EventRing *thread_event_ring;
+
 
 void Audit::log_error(const ErrorCode return_code, const char *string) {
     switch (return_code) {
@@ -433,6 +437,7 @@ bool Audit::configure(void) {
         iterator->second->sync = config.is_event_sync(iterator->first);
         iterator->second->enabled = !config.is_event_disabled(iterator->first);
     }
+    update_enabled_filter();
     // create event to say done reconfiguration
     if (is_enabled_before_reconfig || config.is_auditd_enabled()) {
         auto evt = events.find(AUDITD_AUDIT_CONFIGURED_AUDIT_DAEMON);
@@ -473,16 +478,51 @@ bool Audit::configure(void) {
 }
 
 
+/*
+ * Copy which of the events are enabled into the filter the producers
+ * check (through audit_event_enabled()) before building an event.
+ */
+void Audit::update_enabled_filter(void) {
+    std::vector<uint64_t> filter(AUDIT_FILTER_IDS / 64);
+    if (config.is_auditd_enabled()) {
+        for (auto iterator = events.begin(); iterator != events.end();
+             iterator++) {
+            uint32_t id = iterator->first;
+            if (iterator->second->enabled && id < AUDIT_FILTER_IDS) {
+                filter[id / 64] |= uint64_t(1) << (id % 64);
+            }
+        }
+    }
+    for (size_t ii = 0; ii < filter.size(); ++ii) {
+        enabled_filter[ii].store(filter[ii], std::memory_order_relaxed);
+    }
+}
+
+
 bool Audit::add_to_filleventqueue(const uint32_t event_id,
                                   const char *payload,
-                                  const size_t length) {
+                                  const size_t length,
+                                  bool binary) {
     // @todo I think we should do full validation of the content
     //       in debug mode to ensure that developers actually fill
     //       in the correct fields.. if not we should add an
     //       event to the audit trail saying it is one in an illegal
     //       format (or missing fields)
+    EventRing *ring = get_event_ring();
+    if (ring != NULL) {
+        if (!ring->push(event_id, payload, length, binary)) {
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Audit: Dropping audit event %u: %.*s",
+                        event_id, binary ? 0 : (int)length, payload);
+            dropped_events++;
+            return false;
+        }
+        notify_consumer();
+        return true;
+    }
+
     bool res;
-    Event* new_event = new Event(event_id, payload, length);
+    Event* new_event = new Event(event_id, payload, length, binary);
     cb_mutex_enter(&producer_consumer_lock);
     assert(filleventqueue != NULL);
     if (filleventqueue->size() < max_audit_queue) {
@@ -491,8 +531,8 @@ bool Audit::add_to_filleventqueue(const uint32_t event_id,
         res = true;
     } else {
         logger->log(EXTENSION_LOG_WARNING, NULL,
-                    "Audit: Dropping audit event %u: %s",
-                    new_event->id, new_event->payload.c_str());
+                    "Audit: Dropping audit event %u: %s", new_event->id,
+                    binary ? "" : new_event->payload.c_str());
         dropped_events++;
         delete new_event;
         res = false;
@@ -502,6 +542,59 @@ bool Audit::add_to_filleventqueue(const uint32_t event_id,
 }
 
 
+/*
+ * The ring of the calling thread, set up the first time the thread puts
+ * an event. Returns NULL once AUDIT_MAX_RINGS threads have one.
+ */
+EventRing *Audit::get_event_ring(void) {
+    if (thread_event_ring == NULL) {
+        cb_mutex_enter(&producer_consumer_lock);
+        int n = nrings.load(std::memory_order_relaxed);
+        if (n < AUDIT_MAX_RINGS) {
+            rings[n] = new EventRing(AUDIT_RING_SIZE);
+            thread_event_ring = rings[n];
+            nrings.store(n + 1, std::memory_order_release);
+        }
+        cb_mutex_exit(&producer_consumer_lock);
+    }
+    return thread_event_ring;
+}
+
+
+/*
+ * Any events for the audit thread? Called by the audit thread with the
+ * producer_consumer_lock held.
+ */
+bool Audit::events_pending(void) {
+    if (!filleventqueue->empty()) {
+        return true;
+    }
+    int n = nrings.load(std::memory_order_acquire);
+    for (int ii = 0; ii < n; ++ii) {
+        if (rings[ii]->available() != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+ * Wake up the audit thread after pushing to a ring. The producers only
+ * take the lock when the audit thread is going to sleep: it sets
+ * consumer_waiting before it looks at the rings a last time, and we
+ * pushed before we look at consumer_waiting, so either it sees our event
+ * or we see it waiting.
+ */
+void Audit::notify_consumer(void) {
+    if (consumer_waiting.load()) {
+        cb_mutex_enter(&producer_consumer_lock);
+        cb_cond_broadcast(&events_arrived);
+        cb_mutex_exit(&producer_consumer_lock);
+    }
+}
+
+
 bool Audit::add_reconfigure_event(const void *cookie) {
     bool res;
     ConfigureEvent* new_event = new ConfigureEvent(cookie);
@@ -545,6 +638,10 @@ void Audit::clear_events_queues(void) {
         eventqueue2.pop();
         delete event;
     }
+    int n = nrings.load(std::memory_order_acquire);
+    for (int ii = 0; ii < n; ++ii) {
+        rings[ii]->consume(rings[ii]->available());
+    }
 }
 
 
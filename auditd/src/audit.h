@@ -28,17 +28,31 @@
 #include "auditfile.h"
 #include "eventdata.h"
 #include "auditd.h"
+#include "eventring.h"
 
 class Event;
 
+// The events a single thread may have queued
+#define AUDIT_RING_SIZE 4096
+// Threads beyond this many share the (locked) fill queue
+#define AUDIT_MAX_RINGS 256
+// The event ids in the filter of the producers, the others always pass
+#define AUDIT_FILTER_IDS 65536
+
 class Audit {
 public:
     AuditConfig config;
     std::map<uint32_t,EventData*> events;
+    // The configure events (and the events of threads without a ring)
     std::queue<Event*> eventqueue1;
     std::queue<Event*> eventqueue2;
     std::queue<Event*> *filleventqueue;
     std::queue<Event*> *processeventqueue;
+    // The rings of the threads putting events, only ever added to
+    EventRing *rings[AUDIT_MAX_RINGS];
+    std::atomic<int> nrings;
+    // The audit thread is (about to start) waiting for events_arrived
+    std::atomic<bool> consumer_waiting;
     bool terminate_audit_daemon;
     std::string auditfile_open_time_string;
     std::string configfile;
@@ -52,8 +66,15 @@ public:
                                       ENGINE_ERROR_CODE status);
     AuditFile auditfile;
     std::atomic<uint32_t> dropped_events;
+    // A bit per event id, set if it is enabled and audit is on (a copy
+    // of the events map for the producers, updated by configure())
+    std::atomic<uint64_t> enabled_filter[AUDIT_FILTER_IDS / 64];
 
-    Audit(void) : dropped_events(0), max_audit_queue(50000) {
+    Audit(void) : nrings(0), consumer_waiting(false), dropped_events(0),
+                  max_audit_queue(50000) {
+        for (int ii = 0; ii < AUDIT_FILTER_IDS / 64; ++ii) {
+            enabled_filter[ii].store(0, std::memory_order_relaxed);
+        }
         processeventqueue = &eventqueue1;
         filleventqueue = &eventqueue2;
         cb_cond_initialize(&processeventqueue_empty);
@@ -63,6 +84,9 @@ public:
 
     ~Audit(void) {
         clean_up();
+        for (int ii = 0; ii < nrings; ++ii) {
+            delete rings[ii];
+        }
         cb_cond_destroy(&processeventqueue_empty);
         cb_cond_destroy(&events_arrived);
         cb_mutex_destroy(&producer_consumer_lock);
@@ -75,8 +99,21 @@ public:
     bool process_event(const Event* event);
     bool add_to_filleventqueue(const uint32_t event_id,
                                const char *payload,
-                               const size_t length);
+                               const size_t length,
+                               bool binary = false);
+    bool is_event_enabled(uint32_t event_id) const {
+        if (event_id >= AUDIT_FILTER_IDS) {
+            return true;
+        }
+        uint64_t word = enabled_filter[event_id / 64].load(
+            std::memory_order_relaxed);
+        return (word & (uint64_t(1) << (event_id % 64))) != 0;
+    }
+    void update_enabled_filter(void);
     bool add_reconfigure_event(const void *cookie);
+    EventRing *get_event_ring(void);
+    bool events_pending(void);
+    void notify_consumer(void);
     bool create_audit_event(uint32_t event_id, cJSON *payload);
     void clear_events_map(void);
     void clear_events_queues(void);
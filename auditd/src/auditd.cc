@@ -16,6 +16,7 @@
  */
 
 #include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <sstream>
 #include <cJSON.h>
@@ -26,6 +27,7 @@
 #include "config.h"
 #include "auditd_audit_events.h"
 #include "event.h"
+#include "eventring.h"
 
 Audit audit;
 
@@ -48,19 +50,53 @@ void audit_set_audit_processed_listener(void (*listener)(void)) {
 }
 
 
+static void process_event(Event &event) {
+    if (!event.process(audit)) {
+        audit.dropped_events++;
+    }
+    if (audit_processed_listener) {
+        audit_processed_listener();
+    }
+}
+
+/*
+ * Process the events the threads put in their rings. Each ring is
+ * drained in a single batch, and its slots handed back once the batch
+ * is done.
+ */
+static void process_event_rings(void) {
+    int n = audit.nrings.load(std::memory_order_acquire);
+    for (int ii = 0; ii < n; ++ii) {
+        EventRing *ring = audit.rings[ii];
+        size_t avail = ring->available();
+        for (size_t jj = 0; jj < avail; ++jj) {
+            process_event(ring->peek(jj));
+        }
+        if (avail != 0) {
+            ring->consume(avail);
+        }
+    }
+}
+
 static void consume_events(void *arg) {
     cb_mutex_enter(&audit.producer_consumer_lock);
     while (!audit.terminate_audit_daemon) {
         assert(audit.filleventqueue != NULL);
-        if (audit.filleventqueue->empty()) {
-            // wait up after 10 secs no matter what
-            cb_cond_timedwait(&audit.events_arrived,
-                              &audit.producer_consumer_lock,
-                              audit.auditfile.get_seconds_to_rotation() * 1000);
-            if (audit.filleventqueue->empty()) {
-                // We timed out, so just rotate the files
-                audit.auditfile.maybe_rotate_files();
+        if (!audit.events_pending()) {
+            // Tell the producers to wake us up, and look once more
+            audit.consumer_waiting.store(true);
+            if (!audit.events_pending()) {
+                // wake up to sync or rotate the file no matter what
+                cb_cond_timedwait(&audit.events_arrived,
+                                  &audit.producer_consumer_lock,
+                                  audit.auditfile.get_seconds_to_wakeup() * 1000);
+                if (!audit.events_pending()) {
+                    // We timed out, so just rotate (or sync) the files
+                    audit.auditfile.maybe_rotate_files();
+                    audit.auditfile.flush();
+                }
             }
+            audit.consumer_waiting.store(false);
         }
         /* now have producer_consumer lock!
          * event(s) have arrived or shutdown requested
@@ -72,20 +108,20 @@ static void consume_events(void *arg) {
         assert(audit.processeventqueue != NULL);
         while (!audit.processeventqueue->empty()) {
             Event *event = audit.processeventqueue->front();
-            if (!event->process(audit)) {
-                audit.dropped_events++;
-            }
+            process_event(*event);
             audit.processeventqueue->pop();
             delete event;
-            if (audit_processed_listener) {
-                audit_processed_listener();
-            }
         }
+        process_event_rings();
         audit.auditfile.flush();
         cb_mutex_enter(&audit.producer_consumer_lock);
     }
     cb_mutex_exit(&audit.producer_consumer_lock);
 
+    // The rings may still hold the event saying we're shutting down
+    process_event_rings();
+    audit.auditfile.flush();
+
     // close the auditfile
     audit.auditfile.close();
 }
@@ -151,6 +187,33 @@ AUDIT_ERROR_CODE put_json_audit_event(uint32_t id, cJSON *event) {
 }
 
 
+bool audit_event_enabled(uint32_t id) {
+    return audit.is_event_enabled(id);
+}
+
+
+AUDIT_ERROR_CODE put_connection_audit_event(uint32_t id,
+                                            const AUDIT_CONNECTION_EVENT *event) {
+    using namespace std::chrono;
+
+    if (!audit.config.is_auditd_enabled()) {
+        return AUDIT_SUCCESS;
+    }
+
+    AUDIT_CONNECTION_EVENT stamped = *event;
+    system_clock::duration now = system_clock::now().time_since_epoch();
+    seconds secs = duration_cast<seconds>(now);
+    stamped.timestamp = (time_t)secs.count();
+    stamped.frac_of_second =
+        (uint32_t)duration_cast<microseconds>(now - secs).count();
+    if (!audit.add_to_filleventqueue(id, (const char *)&stamped,
+                                     sizeof(stamped), true)) {
+        return AUDIT_FAILED;
+    }
+    return AUDIT_SUCCESS;
+}
+
+
 AUDIT_ERROR_CODE shutdown_auditdaemon(const char *config) {
     if (config != NULL && audit.config.is_auditd_enabled()) {
         // send event to say we are shutting down the audit daemon
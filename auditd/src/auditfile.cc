@@ -23,6 +23,11 @@
 #include <platform/dirutils.h>
 #include <memcached/isotime.h>
 #include <fstream>
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 #include "auditd.h"
 #include "audit.h"
 #include "auditfile.h"
@@ -93,7 +98,10 @@ bool AuditFile::open(void) {
         log_error(FILE_OPEN_ERROR, open_file_name.c_str());
         return false;
     }
+    // We do the buffering, so every write goes straight to the file
+    setvbuf(file, NULL, _IONBF, 0);
     current_size = 0;
+    unsynced = 0;
     open_time = auditd_time(NULL);
     return true;
 }
@@ -101,6 +109,16 @@ bool AuditFile::open(void) {
 
 void AuditFile::close_and_rotate_log(void) {
     cb_assert(file != NULL);
+    if (!buffer.empty()) {
+        write_buffer();
+    }
+    if (file == NULL) {
+        // write_buffer failed and closed the file
+        return;
+    }
+    if (unsynced != 0) {
+        sync();
+    }
     fclose(file);
     file = NULL;
     if (current_size == 0) {
@@ -227,13 +245,14 @@ bool AuditFile::write_event_to_disk(cJSON *output) {
     char *content = cJSON_PrintUnformatted(output);
     bool ret = true;
     if (content) {
-        current_size += fprintf(file, "%s\n", content);
-        if (ferror(file)) {
-            log_error(WRITING_TO_DISK_ERROR, strerror(errno));
-            ret = false;
-            close_and_rotate_log();
-        } else if (!buffered) {
+        size_t length = strlen(content);
+        buffer.append(content, length);
+        buffer.push_back('\n');
+        current_size += length + 1;
+        if (!buffered) {
             ret = flush();
+        } else if (buffer.size() >= AUDIT_WRITE_BUFFER_SIZE) {
+            ret = write_buffer();
         }
         cJSON_Free(content);
     } else {
@@ -271,14 +290,55 @@ void AuditFile::reconfigure(const AuditConfig &config) {
     buffered = config.is_buffered();
 }
 
+/*
+ * Write out the buffer with a single write. On failure the events
+ * buffered are lost and the file is closed, like the failure of a
+ * single write used to.
+ */
+bool AuditFile::write_buffer(void) {
+    size_t length = buffer.size();
+    size_t nw = fwrite(buffer.data(), 1, length, file);
+    buffer.clear();
+    if (nw != length) {
+        log_error(WRITING_TO_DISK_ERROR, strerror(errno));
+        unsynced = 0;
+        close_and_rotate_log();
+        return false;
+    }
+    if (unsynced == 0) {
+        write_time = auditd_time(NULL);
+    }
+    unsynced += length;
+    return true;
+}
+
+bool AuditFile::sync(void) {
+#ifdef WIN32
+    int ret = _commit(_fileno(file));
+#else
+    int ret = fsync(fileno(file));
+#endif
+    unsynced = 0;
+    sync_requested = false;
+    if (ret != 0) {
+        log_error(WRITING_TO_DISK_ERROR, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
 bool AuditFile::flush(void) {
     if (is_open()) {
-        if (fflush(file) != 0) {
-            log_error(WRITING_TO_DISK_ERROR, strerror(errno));
-            close_and_rotate_log();
+        if (!buffer.empty() && !write_buffer()) {
             return false;
         }
+        if (unsynced != 0 &&
+            (sync_requested || unsynced >= AUDIT_SYNC_BYTES ||
+             difftime(auditd_time(NULL), write_time) >= AUDIT_SYNC_INTERVAL)) {
+            return sync();
+        }
     }
+    sync_requested = false;
 
     return true;
 }
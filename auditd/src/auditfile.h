@@ -25,6 +25,13 @@
 #include "auditconfig.h"
 #include "auditd.h"
 
+// The events are formatted into a buffer of this size, and written in one go
+#define AUDIT_WRITE_BUFFER_SIZE (256 * 1024)
+// Sync the file once this much was written since the last sync...
+#define AUDIT_SYNC_BYTES (4 * 1024 * 1024)
+// ...or this many seconds after data was written
+#define AUDIT_SYNC_INTERVAL 1
+
 class AuditFile {
 public:
 
@@ -34,8 +41,12 @@ public:
         current_size(0),
         max_log_size(20 * 1024 * 1024),
         rotate_interval(900),
-        buffered(true)
+        buffered(true),
+        unsynced(0),
+        write_time(0),
+        sync_requested(false)
     {
+        buffer.reserve(AUDIT_WRITE_BUFFER_SIZE);
     }
 
     ~AuditFile() {
@@ -119,10 +130,20 @@ public:
     void reconfigure(const AuditConfig &config);
 
     /**
-     * Flush the buffers to the disk
+     * Write the buffered events to the file, and sync it if it's time
+     * for a group commit: a sync was requested, AUDIT_SYNC_BYTES were
+     * written or the oldest data not synced is AUDIT_SYNC_INTERVAL old.
      */
     bool flush(void);
 
+    /**
+     * Have the next flush sync the file (for the events configured as
+     * sync), so all the events written until then share the sync.
+     */
+    void request_sync(void) {
+        sync_requested = true;
+    }
+
     /**
      * get the number of seconds for the next log rotation
      */
@@ -135,12 +156,32 @@ public:
         }
     }
 
+    /**
+     * get the number of seconds until the audit thread should look at
+     * the file again: to sync the data written, or rotate it
+     */
+    uint32_t get_seconds_to_wakeup(void) {
+        uint32_t secs = get_seconds_to_rotation();
+        if (is_open() && unsynced != 0) {
+            time_t now = auditd_time(NULL);
+            uint32_t age = (uint32_t)difftime(now, write_time);
+            uint32_t sync = age < AUDIT_SYNC_INTERVAL ?
+                AUDIT_SYNC_INTERVAL - age : 0;
+            if (sync < secs) {
+                secs = sync;
+            }
+        }
+        return secs;
+    }
+
 private:
     bool open(void);
     bool time_to_rotate_log(void) const;
     void close_and_rotate_log(void);
     void set_log_directory(const std::string &new_directory);
     bool is_timestamp_format_correct(std::string& str);
+    bool write_buffer(void);
+    bool sync(void);
 
     FILE *file;
     std::string open_file_name;
@@ -150,6 +191,13 @@ private:
     size_t max_log_size;
     uint32_t rotate_interval;
     bool buffered;
+    // The events formatted but not written yet
+    std::string buffer;
+    // Bytes written (but not synced) since the last sync, and when the
+    // first of them was written
+    size_t unsynced;
+    time_t write_time;
+    bool sync_requested;
 };
 
 #endif
@@ -15,6 +15,7 @@
  *   limitations under the License.
  */
 
+#include <cstring>
 #include <sstream>
 #include <string>
 #include <cJSON.h>
@@ -22,6 +23,41 @@
 #include "event.h"
 #include "audit.h"
 
+// The string of a field of the event, which may fill it up without a '\0'
+static std::string event_string(const char *field, size_t size) {
+    return std::string(field, strnlen(field, size));
+}
+
+#define EVENT_STRING(field) event_string(field, sizeof(field))
+
+// Format an AUDIT_CONNECTION_EVENT the way memcached used to build it
+static cJSON *connection_event_to_json(const std::string &payload) {
+    AUDIT_CONNECTION_EVENT event;
+    if (payload.size() != sizeof(event)) {
+        return NULL;
+    }
+    memcpy(&event, payload.data(), sizeof(event));
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "peername",
+                            EVENT_STRING(event.peername).c_str());
+    cJSON_AddStringToObject(root, "sockname",
+                            EVENT_STRING(event.sockname).c_str());
+    cJSON *source = cJSON_CreateObject();
+    cJSON_AddStringToObject(source, "source", "memcached");
+    cJSON_AddStringToObject(source, "user", EVENT_STRING(event.user).c_str());
+    cJSON_AddItemToObject(root, "real_userid", source);
+    std::string field = EVENT_STRING(event.field);
+    if (!field.empty()) {
+        cJSON_AddStringToObject(root, field.c_str(),
+                                EVENT_STRING(event.value).c_str());
+    }
+    cJSON_AddStringToObject(root, "timestamp",
+                            ISOTime::generatetimestamp(event.timestamp,
+                                                       event.frac_of_second).c_str());
+    return root;
+}
+
 bool Event::process(Audit& audit) {
     // Audit is disabled
     if (!audit.config.is_auditd_enabled()) {
@@ -29,10 +65,19 @@ bool Event::process(Audit& audit) {
     }
 
     // convert the event.payload into JSON
-    cJSON *json_payload = cJSON_Parse(payload.c_str());
-    if (json_payload == NULL) {
-        Audit::log_error(JSON_PARSING_ERROR, payload.c_str());
-        return false;
+    cJSON *json_payload;
+    if (binary) {
+        json_payload = connection_event_to_json(payload);
+        if (json_payload == NULL) {
+            Audit::log_error(JSON_PARSING_ERROR, "<connection event>");
+            return false;
+        }
+    } else {
+        json_payload = cJSON_Parse(payload.c_str());
+        if (json_payload == NULL) {
+            Audit::log_error(JSON_PARSING_ERROR, payload.c_str());
+            return false;
+        }
     }
     cJSON *timestamp_ptr = cJSON_GetObjectItem(json_payload, "timestamp");
     std::string timestamp;
@@ -65,6 +110,10 @@ bool Event::process(Audit& audit) {
     cJSON_AddStringToObject(json_payload, "description", evt->second->description.c_str());
 
     bool success = audit.auditfile.write_event_to_disk(json_payload);
+    if (success && evt->second->sync) {
+        // Synced along with the rest of the batch
+        audit.auditfile.request_sync();
+    }
 
     // Release allocated resources
     cJSON_Delete(json_payload);
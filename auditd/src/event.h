@@ -24,17 +24,28 @@ class Audit;
 
 class Event {
 public:
-    const uint32_t id;
-    const std::string payload;
+    uint32_t id;
+    // JSON text, or an AUDIT_CONNECTION_EVENT if binary
+    std::string payload;
+    bool binary;
 
-    // Constructor required for ConfigureEvent
+    // Constructor required for ConfigureEvent (and the EventRing slots)
     Event()
-        : id(0) {}
+        : id(0), binary(false) {}
 
     Event(const uint32_t event_id, const char* p,
-          size_t length)
+          size_t length, bool bin = false)
         : id(event_id),
-          payload(p,length) {}
+          payload(p,length),
+          binary(bin) {}
+
+    // Reuse the event (as a slot of an EventRing)
+    void assign(const uint32_t event_id, const char* p, size_t length,
+                bool bin = false) {
+        id = event_id;
+        payload.assign(p, length);
+        binary = bin;
+    }
 
     virtual bool process(Audit& audit);
 
@@ -0,0 +1,84 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef EVENTRING_H
+#define EVENTRING_H
+
+#include <atomic>
+#include <vector>
+#include "event.h"
+
+#ifdef WIN32
+#define AUDIT_THREAD_LOCAL __declspec(thread)
+#else
+#define AUDIT_THREAD_LOCAL __thread
+#endif
+
+/*
+ * A single producer, single consumer ring of audit events. Every thread
+ * putting events gets a ring of its own (see Audit::get_event_ring), so
+ * the producers never share a lock with each other or with the audit
+ * thread, which drains the rings in batches.
+ *
+ * The slots are allocated up front and reused: putting an event copies
+ * the payload into the string of its slot, which only allocates when
+ * the payload is longer than any earlier one in the slot.
+ */
+class EventRing {
+public:
+    // size must be a power of 2
+    EventRing(size_t size)
+        : slots(size), mask(size - 1), head(0), tail(0) {}
+
+    // Producer side: copy in the event. Returns false if the ring is full
+    bool push(uint32_t id, const char *payload, size_t length,
+              bool binary = false) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask) {
+            return false;
+        }
+        slots[t & mask].assign(id, payload, length, binary);
+        // seq_cst, so Audit::notify_consumer sees a consumer going to sleep
+        tail.store(t + 1);
+        return true;
+    }
+
+    // Consumer side: the number of events ready to process
+    size_t available(void) const {
+        return tail.load() - head.load(std::memory_order_relaxed);
+    }
+
+    // Consumer side: the ii'th oldest of the events available
+    Event &peek(size_t ii) {
+        return slots[(head.load(std::memory_order_relaxed) + ii) & mask];
+    }
+
+    // Consumer side: hand the n oldest slots back to the producer
+    void consume(size_t n) {
+        head.store(head.load(std::memory_order_relaxed) + n,
+                   std::memory_order_release);
+    }
+
+private:
+    std::vector<Event> slots;
+    const size_t mask;
+    // Kept apart so the producer and consumer don't bounce a cache line
+    std::atomic<size_t> head;
+    char pad[64];
+    std::atomic<size_t> tail;
+};
+
+#endif
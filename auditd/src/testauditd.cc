@@ -197,6 +197,14 @@ void assertMinNumberOfFiles(const std::string &dir, size_t num) {
     }
 }
 
+void assertEventEnabled(uint32_t id, bool enabled) {
+    if (audit_event_enabled(id) != enabled) {
+        std::cerr << "FATAL: Expected event " << id << " to be "
+                  << (enabled ? "enabled" : "disabled") << std::endl;
+        _exit(EXIT_FAILURE);
+    }
+}
+
 
 int main(int argc, char *argv[]) {
     /* create the test directory */
@@ -229,6 +237,7 @@ int main(int argc, char *argv[]) {
 
     // There shouldn't be any files there
     assertNumberOfFiles(testdir, 0);
+    assertEventEnabled(AUDITD_AUDIT_SHUTTING_DOWN_AUDIT_DAEMON, false);
 
     configuration.setEnabled(true);
 
@@ -241,6 +250,7 @@ int main(int argc, char *argv[]) {
 
     // That should cause audit.log to appear
     assertNumberOfFiles(testdir, 1);
+    assertEventEnabled(AUDITD_AUDIT_SHUTTING_DOWN_AUDIT_DAEMON, true);
     testdir.assign("time-rotation-test");
     // rotate every 10 sec
     configuration.setRotationInterval(10);
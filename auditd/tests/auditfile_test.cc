@@ -292,6 +292,63 @@ static bool failed_crash_recover_test(void) {
     return true;
 }
 
+static long file_size(const char *name) {
+    FILE *fp = fopen(name, "rb");
+    long size = -1;
+    if (fp != NULL) {
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fclose(fp);
+    }
+    return size;
+}
+
+static bool buffered_write_test(void) {
+    AuditConfig config;
+    config.set_rotate_interval(3600);
+    config.set_rotate_size(1024*1024);
+    config.set_log_directory("buffered-write-test");
+
+    CouchbaseDirectoryUtilities::rmrf("buffered-write-test");
+
+    AuditFile auditfile;
+    auditfile.reconfigure(config);
+
+    cJSON *obj = create_audit_event();
+    for (int ii = 0; ii < 10; ++ii) {
+        auditfile.ensure_open();
+        auditfile.write_event_to_disk(obj);
+    }
+    cJSON_Delete(obj);
+
+    long size = file_size("buffered-write-test/audit.log");
+    if (size != 0) {
+        std::cerr << "Expected the events to be buffered, file size is "
+                  << size << std::endl;
+        return false;
+    }
+
+    auditfile.request_sync();
+    if (!auditfile.flush()) {
+        std::cerr << "Failed to flush the events" << std::endl;
+        return false;
+    }
+    size = file_size("buffered-write-test/audit.log");
+    if (size <= 0) {
+        std::cerr << "Expected the events to be written by flush"
+                  << std::endl;
+        return false;
+    }
+    if (auditfile.get_seconds_to_wakeup() != auditfile.get_seconds_to_rotation()) {
+        std::cerr << "Expected nothing left to sync" << std::endl;
+        return false;
+    }
+
+    auditfile.close();
+    CouchbaseDirectoryUtilities::rmrf("buffered-write-test");
+    return true;
+}
+
 static bool get_rollover_time_test(void) {
     CouchbaseDirectoryUtilities::mkdirp("rollover-time-test");
     AuditConfig config;
@@ -345,6 +402,7 @@ int main(void) {
     tests["successful crash recover"] = successful_crash_recover_test;
     tests["failed crash recover"] = failed_crash_recover_test;
     tests["get rollover time "] = get_rollover_time_test;
+    tests["buffered write"] = buffered_write_test;
 
     for (auto iter = tests.begin(); iter != tests.end(); ++iter) {
         std::cout << iter->first << "... ";
@@ -16,6 +16,7 @@
 
 #include "cbsasl/cbsasl.h"
 #include "cram-md5/hmac.h"
+#include "scram-sha/scram-sha.h"
 #include "util.h"
 #include <time.h>
 #include <stdlib.h>
@@ -96,6 +97,18 @@ cbsasl_error_t cbsasl_client_start(cbsasl_conn_t *conn,
         return CBSASL_BADPARAM;
     }
 
+    (void)prompt_need;
+    if (strstr(mechlist, MECH_NAME_SCRAM_SHA512) != NULL) {
+        *mech = MECH_NAME_SCRAM_SHA512;
+        return scram_client_start(conn, SCRAM_SHA512, clientout, clientoutlen);
+    } else if (strstr(mechlist, MECH_NAME_SCRAM_SHA256) != NULL) {
+        *mech = MECH_NAME_SCRAM_SHA256;
+        return scram_client_start(conn, SCRAM_SHA256, clientout, clientoutlen);
+    } else if (strstr(mechlist, MECH_NAME_SCRAM_SHA1) != NULL) {
+        *mech = MECH_NAME_SCRAM_SHA1;
+        return scram_client_start(conn, SCRAM_SHA1, clientout, clientoutlen);
+    }
+
     if (strstr(mechlist, "CRAM-MD5") == NULL) {
         if (strstr(mechlist, "PLAIN") == NULL) {
             return CBSASL_NOMECH;
@@ -144,7 +157,6 @@ cbsasl_error_t cbsasl_client_start(cbsasl_conn_t *conn,
         *clientoutlen = 0;
     }
 
-    (void)prompt_need;
     return CBSASL_OK;
 }
 
@@ -172,6 +184,11 @@ cbsasl_error_t cbsasl_client_step(cbsasl_conn_t *conn,
         return CBSASL_BADPARAM;
     }
 
+    if (conn->c.client.mech_data != NULL) {
+        return scram_client_step(conn, serverin, serverinlen,
+                                 clientout, clientoutlen);
+    }
+
     ret = conn->c.client.get_username(conn->c.client.get_username_ctx,
                                       CBSASL_CB_USER, &usernm, &usernmlen);
     if (ret != CBSASL_OK) {
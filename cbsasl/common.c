@@ -25,10 +25,16 @@ void cbsasl_dispose(cbsasl_conn_t **conn)
     if (*conn != NULL) {
         if ((*conn)->client) {
             free((*conn)->c.client.userdata);
+            if ((*conn)->c.client.mech_dispose != NULL) {
+                (*conn)->c.client.mech_dispose((*conn)->c.client.mech_data);
+            }
         } else {
             free((*conn)->c.server.username);
             free((*conn)->c.server.config);
             free((*conn)->c.server.sasl_data);
+            if ((*conn)->c.server.mech_dispose != NULL) {
+                (*conn)->c.server.mech_dispose((*conn)->c.server.mech_data);
+            }
         }
 
         free(*conn);
@@ -53,6 +53,7 @@ cbsasl_error_t cram_md5_server_step(cbsasl_conn_t *conn,
     char *user;
     char *cfg;
     char *pass;
+    user_db_t *db;
     unsigned char digest[DIGEST_LENGTH];
     char md5string[DIGEST_LENGTH * 2];
 
@@ -66,7 +67,7 @@ cbsasl_error_t cram_md5_server_step(cbsasl_conn_t *conn,
     user[userlen] = '\0';
     conn->c.server.username = user;
 
-    pass = find_pw(user, &cfg);
+    pass = find_pw(user, &cfg, &db);
     if (pass == NULL) {
         return CBSASL_NOUSER;
     }
@@ -82,10 +83,12 @@ cbsasl_error_t cram_md5_server_step(cbsasl_conn_t *conn,
                               (DIGEST_LENGTH * 2),
                               &(input[userlen + 1]),
                               (DIGEST_LENGTH * 2)) != 0) {
+        user_db_release(db);
         return CBSASL_PWERR;
     }
 
     conn->c.server.config = strdup(cfg);
+    user_db_release(db);
     *output = NULL;
     *outputlen = 0;
     return CBSASL_OK;
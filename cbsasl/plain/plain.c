@@ -54,6 +54,7 @@ cbsasl_error_t plain_server_step(cbsasl_conn_t *conn,
         const char *password = NULL;
         char *stored_password;
         size_t stored_pwlen;
+        user_db_t *db;
         while (inputpos < inputlen && input[inputpos] != '\0') {
             inputpos++;
         }
@@ -70,17 +71,19 @@ cbsasl_error_t plain_server_step(cbsasl_conn_t *conn,
         }
 
         conn->c.server.username = strdup(username);
-        if ((stored_password = find_pw(username, &cfg)) == NULL) {
+        if ((stored_password = find_pw(username, &cfg, &db)) == NULL) {
             return CBSASL_NOUSER;
         }
 
         stored_pwlen = strlen(stored_password);
         if (cbsasl_secure_compare(password, pwlen,
                                   stored_password, stored_pwlen) != 0) {
+            user_db_release(db);
             return CBSASL_PWERR;
         }
 
         conn->c.server.config = strdup(cfg);
+        user_db_release(db);
     }
 
     *output = NULL;
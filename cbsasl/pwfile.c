@@ -21,9 +21,23 @@
 #include <stdlib.h>
 #include <ctype.h>
 
+/*
+ * The user table is never changed once it's built: a refresh builds a new
+ * one (sized to the users in the file) without holding any lock, and then
+ * swaps it in. The lookups keep a reference to the table they found the
+ * user in, so the old one goes away when the last of them is done with it.
+ * The lock is only held to take a reference to (or swap) the current one.
+ * The SCRAM secrets of an entry are the only thing set later on, and
+ * they're published atomically (see scram_get_secrets()).
+ */
+struct user_db {
+    unsigned int refcount;
+    unsigned int nbuckets;      /* a power of two */
+    user_db_entry_t *buckets[];
+};
+
 static cb_mutex_t uhash_lock;
-static user_db_entry_t **user_ht;
-static const unsigned int n_uht_buckets = 12289;
+static user_db_t *user_ht;
 
 void pwfile_init(void)
 {
@@ -37,11 +51,9 @@ static void kill_whitey(char *s)
     }
 }
 
-static int u_hash_key(const char *u)
+static unsigned int u_hash_key(const user_db_t *db, const char *u)
 {
-    uint32_t h = hash(u, strlen(u), 0) % n_uht_buckets;
-    cb_assert(h < n_uht_buckets);
-    return h;
+    return hash(u, strlen(u), 0) & (db->nbuckets - 1);
 }
 
 static const char *get_isasl_filename(void)
@@ -49,34 +61,55 @@ static const char *get_isasl_filename(void)
     return getenv("ISASL_PWFILE");
 }
 
-void free_user_ht(void)
+static void free_user_entries(user_db_entry_t *e)
 {
-    if (user_ht) {
-        for (unsigned int i = 0; i < n_uht_buckets; i++) {
-            while (user_ht[i]) {
-                user_db_entry_t *e = user_ht[i];
-                user_db_entry_t *n = e->next;
-                free(e->username);
-                free(e->password);
-                free(e->config);
-                free(e);
-                user_ht[i] = n;
-            }
+    while (e) {
+        user_db_entry_t *n = e->next;
+        free(e->username);
+        free(e->password);
+        free(e->config);
+        for (int i = 0; i < SCRAM_NALGORITHMS; i++) {
+            free(e->scram[i]);
+        }
+        free(e);
+        e = n;
+    }
+}
+
+void user_db_release(user_db_t *db)
+{
+    if (db != NULL &&
+        __atomic_sub_fetch(&db->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (unsigned int i = 0; i < db->nbuckets; i++) {
+            free_user_entries(db->buckets[i]);
         }
-        free(user_ht);
-        user_ht = NULL;
+        free(db);
     }
 }
 
-static void store_pw(user_db_entry_t **ht,
-                     const char *u,
-                     const char *p,
-                     const char *cfg)
+/* Make db the current table, dropping the previous one */
+static void swap_user_ht(user_db_t *db)
+{
+    user_db_t *old;
+
+    cb_mutex_enter(&uhash_lock);
+    old = user_ht;
+    user_ht = db;
+    cb_mutex_exit(&uhash_lock);
+    user_db_release(old);
+}
+
+void free_user_ht(void)
+{
+    swap_user_ht(NULL);
+}
+
+static user_db_entry_t *new_user_entry(const char *u,
+                                       const char *p,
+                                       const char *cfg)
 {
     user_db_entry_t *e;
-    int h;
 
-    cb_assert(ht);
     cb_assert(u);
     cb_assert(p);
 
@@ -88,42 +121,82 @@ static void store_pw(user_db_entry_t **ht,
     cb_assert(e->password);
     e->config = cfg ? strdup(cfg) : NULL;
     cb_assert(!cfg || e->config);
+    return e;
+}
 
-    h = u_hash_key(u);
+/*
+ * Build a table of the users in the list (which it takes over). Later
+ * entries of a user are found first, like they always were.
+ */
+static user_db_t *build_user_db(user_db_entry_t *users, unsigned int nusers)
+{
+    unsigned int nbuckets = 16;
+    user_db_t *db;
 
-    e->next = ht[h];
-    ht[h] = e;
+    while (nbuckets < nusers) {
+        nbuckets <<= 1;
+    }
+    db = calloc(1, sizeof(*db) + nbuckets * sizeof(db->buckets[0]));
+    if (db == NULL) {
+        free_user_entries(users);
+        return NULL;
+    }
+    db->refcount = 1;
+    db->nbuckets = nbuckets;
+
+    while (users) {
+        user_db_entry_t *e = users;
+        unsigned int h = u_hash_key(db, e->username);
+        users = e->next;
+        e->next = db->buckets[h];
+        db->buckets[h] = e;
+    }
+    return db;
 }
 
-char *find_pw(const char *u, char **cfg)
+user_db_entry_t *find_user(const char *u, user_db_t **db)
 {
-    int h;
     user_db_entry_t *e;
 
     cb_assert(u);
-    cb_assert(user_ht);
 
     cb_mutex_enter(&uhash_lock);
-    h = u_hash_key(u);
+    *db = user_ht;
+    if (*db != NULL) {
+        __atomic_add_fetch(&(*db)->refcount, 1, __ATOMIC_RELAXED);
+    }
+    cb_mutex_exit(&uhash_lock);
+    cb_assert(*db);
 
-    e = user_ht[h];
+    e = (*db)->buckets[u_hash_key(*db, u)];
     while (e && strcmp(e->username, u) != 0) {
         e = e->next;
     }
 
+    if (e == NULL) {
+        user_db_release(*db);
+        *db = NULL;
+    }
+    return e;
+}
+
+char *find_pw(const char *u, char **cfg, user_db_t **db)
+{
+    user_db_entry_t *e = find_user(u, db);
+
     if (e != NULL) {
         *cfg = e->config;
-        cb_mutex_exit(&uhash_lock);
         return e->password;
     } else {
-        cb_mutex_exit(&uhash_lock);
         return NULL;
     }
 }
 
 cbsasl_error_t load_user_db(void)
 {
-    user_db_entry_t **new_ut;
+    user_db_t *new_ut;
+    user_db_entry_t *users = NULL, **tail = &users;
+    unsigned int nusers = 0;
     FILE *sfile;
     char up[128];
     const char *filename = get_isasl_filename();
@@ -138,13 +211,6 @@ cbsasl_error_t load_user_db(void)
         return CBSASL_FAIL;
     }
 
-    new_ut = calloc(n_uht_buckets, sizeof(user_db_entry_t *));
-
-    if (!new_ut) {
-        fclose(sfile);
-        return CBSASL_NOMEM;
-    }
-
     /* File has lines that are newline terminated. */
     /* File may have comment lines that must being with '#'. */
     /* Lines should look like... */
@@ -184,7 +250,9 @@ cbsasl_error_t load_user_db(void)
                     }
                 }
             }
-            store_pw(new_ut, uname, p, cfg);
+            *tail = new_user_entry(uname, p, cfg);
+            tail = &(*tail)->next;
+            nusers++;
         }
     }
 
@@ -196,11 +264,13 @@ cbsasl_error_t load_user_db(void)
      filename);
      }
      */
+    new_ut = build_user_db(users, nusers);
+    if (!new_ut) {
+        return CBSASL_NOMEM;
+    }
+
     /* Replace the current configuration with the new one */
-    cb_mutex_enter(&uhash_lock);
-    free_user_ht();
-    user_ht = new_ut;
-    cb_mutex_exit(&uhash_lock);
+    swap_user_ht(new_ut);
 
     return CBSASL_OK;
 }
@@ -18,15 +18,33 @@
 #define SRC_PWFILE_H_ 1
 
 #include "cbsasl/cbsasl.h"
+#include "scram-sha/scram-sha.h"
 
 typedef struct user_db_entry {
     char *username;
     char *password;
     char *config;
+    /*
+     * The SCRAM secrets derived from the password, set by the first
+     * exchange needing them (see scram_get_secrets())
+     */
+    struct scram_secrets *scram[SCRAM_NALGORITHMS];
     struct user_db_entry *next;
 } user_db_entry_t;
 
-char *find_pw(const char *u, char **cfg);
+typedef struct user_db user_db_t;
+
+/*
+ * Look up the password and config of user u. They belong to the user
+ * table, which the caller has to release with user_db_release(*db) once
+ * done with them (unless the user isn't found and NULL is returned).
+ */
+char *find_pw(const char *u, char **cfg, user_db_t **db);
+
+/* Look up the entry of user u, with the same rules as find_pw() */
+user_db_entry_t *find_user(const char *u, user_db_t **db);
+
+void user_db_release(user_db_t *db);
 
 cbsasl_error_t load_user_db(void);
 
@@ -0,0 +1,804 @@
+/*
+ *     Copyright 2015 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * SCRAM (rfc 5802) with SHA-1, SHA-256 and SHA-512, without channel
+ * binding. The password file keeps plain passwords, so the server picks
+ * the salt of a user itself the first time the user authenticates with
+ * an algorithm, and keeps the keys derived with it in the user's entry
+ * until the password file is reloaded.
+ */
+#include "scram-sha.h"
+#include "cbsasl/pwfile.h"
+#include "cbsasl/util.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <platform/random.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NONCE_LENGTH 18
+
+/* The gs2 header of a client without channel binding, and its base64 */
+#define GS2_HEADER "n,,"
+#define GS2_HEADER_BASE64 "biws"
+
+struct scram_server {
+    scram_algorithm_t algorithm;
+    /* 0 waits for the client-first message, 1 for the client-final */
+    int stage;
+    char *client_first_bare;
+    char *server_first;
+    char *nonce;
+    char *config;
+    struct scram_secrets secrets;
+    char *out;
+};
+
+struct scram_client {
+    scram_algorithm_t algorithm;
+    int stage;
+    char *client_first_bare;
+    char *nonce;
+    unsigned char server_signature[SCRAM_MAX_DIGEST_LENGTH];
+    char *out;
+};
+
+static const EVP_MD *scram_md(scram_algorithm_t algorithm)
+{
+    switch (algorithm) {
+    case SCRAM_SHA1:
+        return EVP_sha1();
+    case SCRAM_SHA256:
+        return EVP_sha256();
+    case SCRAM_SHA512:
+        return EVP_sha512();
+    default:
+        return NULL;
+    }
+}
+
+static unsigned int scram_digest_size(scram_algorithm_t algorithm)
+{
+    return (unsigned int)EVP_MD_size(scram_md(algorithm));
+}
+
+static void scram_hmac(scram_algorithm_t algorithm,
+                       const unsigned char *key, unsigned int keylen,
+                       const char *data, size_t datalen,
+                       unsigned char *digest)
+{
+    unsigned int len;
+    HMAC(scram_md(algorithm), key, (int)keylen, (const unsigned char *)data,
+         datalen, digest, &len);
+}
+
+static void scram_hash(scram_algorithm_t algorithm,
+                       const unsigned char *data, size_t datalen,
+                       unsigned char *digest)
+{
+    unsigned int len;
+    EVP_Digest(data, datalen, digest, &len, scram_md(algorithm), NULL);
+}
+
+/*
+ * Derive the salted password, and from it the client and server keys
+ * (the stored key is the hash of the client key).
+ */
+static cbsasl_error_t scram_derive(scram_algorithm_t algorithm,
+                                   const char *password, size_t pwlen,
+                                   const unsigned char *salt, size_t saltlen,
+                                   int iterations,
+                                   unsigned char *client_key,
+                                   unsigned char *server_key)
+{
+    unsigned char salted[SCRAM_MAX_DIGEST_LENGTH];
+    unsigned int size = scram_digest_size(algorithm);
+
+    if (PKCS5_PBKDF2_HMAC(password, (int)pwlen, salt, (int)saltlen,
+                          iterations, scram_md(algorithm), (int)size,
+                          salted) != 1) {
+        return CBSASL_FAIL;
+    }
+    scram_hmac(algorithm, salted, size, "Client Key", 10, client_key);
+    scram_hmac(algorithm, salted, size, "Server Key", 10, server_key);
+    return CBSASL_OK;
+}
+
+static char *scram_base64_encode(const unsigned char *src, size_t len)
+{
+    char *dest = malloc(4 * ((len + 2) / 3) + 1);
+    if (dest != NULL) {
+        EVP_EncodeBlock((unsigned char *)dest, src, (int)len);
+    }
+    return dest;
+}
+
+/* Returns the number of bytes decoded, or -1 if it's no (or too much) base64 */
+static int scram_base64_decode(const char *src, size_t len,
+                               unsigned char *dest, size_t destsize)
+{
+    unsigned char buffer[3 * 64];
+    int ret;
+
+    if (len == 0 || len % 4 != 0 || len / 4 * 3 > sizeof(buffer)) {
+        return -1;
+    }
+    ret = EVP_DecodeBlock(buffer, (const unsigned char *)src, (int)len);
+    if (ret < 0) {
+        return -1;
+    }
+    /* EVP_DecodeBlock counts the padding as data */
+    if (src[len - 1] == '=') {
+        --ret;
+        if (src[len - 2] == '=') {
+            --ret;
+        }
+    }
+    if ((size_t)ret > destsize) {
+        return -1;
+    }
+    memcpy(dest, buffer, ret);
+    return ret;
+}
+
+/*
+ * Find the value of attribute name in a message (a comma separated list
+ * of name=value pairs). Returns NULL if it isn't there.
+ */
+static const char *scram_attr(const char *message, char name, size_t *len)
+{
+    const char *p = message;
+
+    while (p != NULL) {
+        if (p[0] == name && p[1] == '=') {
+            const char *end = strchr(p + 2, ',');
+            *len = end ? (size_t)(end - p - 2) : strlen(p + 2);
+            return p + 2;
+        }
+        p = strchr(p, ',');
+        if (p != NULL) {
+            ++p;
+        }
+    }
+    return NULL;
+}
+
+static char *scram_strndup(const char *s, size_t len)
+{
+    char *ret = malloc(len + 1);
+    if (ret != NULL) {
+        memcpy(ret, s, len);
+        ret[len] = '\0';
+    }
+    return ret;
+}
+
+/* Join the parts with commas (for the AuthMessage) */
+static char *scram_join(const char *a, const char *b, const char *c)
+{
+    size_t len = strlen(a) + strlen(b) + strlen(c) + 3;
+    char *ret = malloc(len);
+    if (ret != NULL) {
+        snprintf(ret, len, "%s,%s,%s", a, b, c);
+    }
+    return ret;
+}
+
+/* Decode a saslname (where ',' and '=' are sent as =2C and =3D) */
+static char *scram_decode_name(const char *name, size_t len)
+{
+    char *ret = malloc(len + 1);
+    size_t ii, jj = 0;
+
+    if (ret == NULL) {
+        return NULL;
+    }
+    for (ii = 0; ii < len; ++ii) {
+        if (name[ii] != '=') {
+            ret[jj++] = name[ii];
+        } else if (ii + 2 < len && name[ii + 1] == '2' &&
+                   name[ii + 2] == 'C') {
+            ret[jj++] = ',';
+            ii += 2;
+        } else if (ii + 2 < len && name[ii + 1] == '3' &&
+                   name[ii + 2] == 'D') {
+            ret[jj++] = '=';
+            ii += 2;
+        } else {
+            free(ret);
+            return NULL;
+        }
+    }
+    ret[jj] = '\0';
+    return ret;
+}
+
+static char *scram_encode_name(const char *name, size_t len)
+{
+    char *ret = malloc(len * 3 + 1);
+    size_t ii, jj = 0;
+
+    if (ret == NULL) {
+        return NULL;
+    }
+    for (ii = 0; ii < len; ++ii) {
+        if (name[ii] == ',') {
+            memcpy(ret + jj, "=2C", 3);
+            jj += 3;
+        } else if (name[ii] == '=') {
+            memcpy(ret + jj, "=3D", 3);
+            jj += 3;
+        } else {
+            ret[jj++] = name[ii];
+        }
+    }
+    ret[jj] = '\0';
+    return ret;
+}
+
+/* A message as a string, or NULL if it holds a NUL */
+static char *scram_message(const char *input, unsigned int inputlen)
+{
+    if (input == NULL || memchr(input, '\0', inputlen) != NULL) {
+        return NULL;
+    }
+    return scram_strndup(input, inputlen);
+}
+
+/*
+ * The secrets of the user for the algorithm, derived the first time
+ * they're needed. Two exchanges doing that at the same time both derive
+ * them, and the first one to publish its copy wins.
+ */
+static const struct scram_secrets *scram_get_secrets(user_db_entry_t *e,
+                                                     scram_algorithm_t algorithm)
+{
+    struct scram_secrets *secrets, *expected = NULL;
+    unsigned char client_key[SCRAM_MAX_DIGEST_LENGTH];
+
+    secrets = __atomic_load_n(&e->scram[algorithm], __ATOMIC_ACQUIRE);
+    if (secrets != NULL) {
+        return secrets;
+    }
+
+    secrets = calloc(1, sizeof(*secrets));
+    if (secrets == NULL) {
+        return NULL;
+    }
+    if (cbsasl_secure_random((char *)secrets->salt,
+                             sizeof(secrets->salt)) != CBSASL_OK ||
+        scram_derive(algorithm, e->password, strlen(e->password),
+                     secrets->salt, sizeof(secrets->salt), SCRAM_ITERATIONS,
+                     client_key, secrets->server_key) != CBSASL_OK) {
+        free(secrets);
+        return NULL;
+    }
+    scram_hash(algorithm, client_key, scram_digest_size(algorithm),
+               secrets->stored_key);
+
+    if (!__atomic_compare_exchange_n(&e->scram[algorithm], &expected, secrets,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        free(secrets);
+        secrets = expected;
+    }
+    return secrets;
+}
+
+/*
+ * Server side
+ */
+
+static void scram_server_dispose(void *data)
+{
+    struct scram_server *state = data;
+    free(state->client_first_bare);
+    free(state->server_first);
+    free(state->nonce);
+    free(state->config);
+    free(state->out);
+    free(state);
+}
+
+static cbsasl_error_t scram_server_init(void)
+{
+    return CBSASL_OK;
+}
+
+static cbsasl_error_t scram_server_start(cbsasl_conn_t *conn,
+                                         scram_algorithm_t algorithm)
+{
+    struct scram_server *state = calloc(1, sizeof(*state));
+    if (state == NULL) {
+        return CBSASL_NOMEM;
+    }
+    state->algorithm = algorithm;
+    conn->c.server.mech_data = state;
+    conn->c.server.mech_dispose = scram_server_dispose;
+    return CBSASL_CONTINUE;
+}
+
+static cbsasl_error_t scram_sha1_server_start(cbsasl_conn_t *conn)
+{
+    return scram_server_start(conn, SCRAM_SHA1);
+}
+
+static cbsasl_error_t scram_sha256_server_start(cbsasl_conn_t *conn)
+{
+    return scram_server_start(conn, SCRAM_SHA256);
+}
+
+static cbsasl_error_t scram_sha512_server_start(cbsasl_conn_t *conn)
+{
+    return scram_server_start(conn, SCRAM_SHA512);
+}
+
+/*
+ * The client-first message: gs2 header, then n=<user>,r=<client nonce>.
+ * We answer with r=<nonce>,s=<salt>,i=<iterations>.
+ */
+static cbsasl_error_t scram_server_first(cbsasl_conn_t *conn,
+                                         struct scram_server *state,
+                                         const char *message)
+{
+    const char *bare, *name, *cnonce;
+    size_t namelen, cnoncelen;
+    unsigned char snonce[NONCE_LENGTH];
+    char *snonce64, *salt64;
+    const struct scram_secrets *secrets;
+    user_db_entry_t *e;
+    user_db_t *db;
+    size_t len;
+
+    /* No channel binding, and we don't care about the authzid */
+    if ((message[0] != 'n' && message[0] != 'y') || message[1] != ',' ||
+        (bare = strchr(message + 2, ',')) == NULL) {
+        return CBSASL_BADPARAM;
+    }
+    ++bare;
+    if (bare[0] != 'n' || bare[1] != '=' ||
+        (name = scram_attr(bare, 'n', &namelen)) == NULL ||
+        (cnonce = scram_attr(bare, 'r', &cnoncelen)) == NULL ||
+        cnoncelen == 0) {
+        return CBSASL_BADPARAM;
+    }
+
+    free(conn->c.server.username);
+    conn->c.server.username = scram_decode_name(name, namelen);
+    if (conn->c.server.username == NULL) {
+        return CBSASL_BADPARAM;
+    }
+    if ((e = find_user(conn->c.server.username, &db)) == NULL) {
+        return CBSASL_NOUSER;
+    }
+    secrets = scram_get_secrets(e, state->algorithm);
+    if (secrets != NULL) {
+        state->secrets = *secrets;
+        state->config = e->config ? strdup(e->config) : NULL;
+    }
+    user_db_release(db);
+    if (secrets == NULL) {
+        return CBSASL_FAIL;
+    }
+
+    if (cbsasl_secure_random((char *)snonce, sizeof(snonce)) != CBSASL_OK) {
+        return CBSASL_FAIL;
+    }
+    snonce64 = scram_base64_encode(snonce, sizeof(snonce));
+    salt64 = scram_base64_encode(state->secrets.salt,
+                                 sizeof(state->secrets.salt));
+    state->client_first_bare = strdup(bare);
+    len = cnoncelen + (snonce64 ? strlen(snonce64) : 0) + 1;
+    state->nonce = malloc(len);
+    if (snonce64 == NULL || salt64 == NULL ||
+        state->client_first_bare == NULL || state->nonce == NULL) {
+        free(snonce64);
+        free(salt64);
+        return CBSASL_NOMEM;
+    }
+    memcpy(state->nonce, cnonce, cnoncelen);
+    strcpy(state->nonce + cnoncelen, snonce64);
+    free(snonce64);
+
+    len = strlen(state->nonce) + strlen(salt64) + 32;
+    state->server_first = malloc(len);
+    if (state->server_first == NULL) {
+        free(salt64);
+        return CBSASL_NOMEM;
+    }
+    snprintf(state->server_first, len, "r=%s,s=%s,i=%d",
+             state->nonce, salt64, SCRAM_ITERATIONS);
+    free(salt64);
+    return CBSASL_CONTINUE;
+}
+
+/*
+ * The client-final message: c=<gs2 header>,r=<nonce>,p=<proof>. We check
+ * the proof, and answer with v=<server signature>.
+ */
+static cbsasl_error_t scram_server_final(cbsasl_conn_t *conn,
+                                         struct scram_server *state,
+                                         const char *message)
+{
+    scram_algorithm_t algorithm = state->algorithm;
+    unsigned int size = scram_digest_size(algorithm);
+    unsigned char proof[SCRAM_MAX_DIGEST_LENGTH];
+    unsigned char signature[SCRAM_MAX_DIGEST_LENGTH];
+    unsigned char stored_key[SCRAM_MAX_DIGEST_LENGTH];
+    const char *p;
+    char *without_proof, *auth_message, *signature64;
+    size_t len, plen;
+    unsigned int ii;
+
+    /* The proof comes last */
+    p = strstr(message, ",p=");
+    if (p == NULL || strchr(p + 3, ',') != NULL) {
+        return CBSASL_BADPARAM;
+    }
+    plen = strlen(p + 3);
+    if (scram_base64_decode(p + 3, plen, proof, sizeof(proof)) != (int)size) {
+        return CBSASL_BADPARAM;
+    }
+
+    without_proof = scram_strndup(message, p - message);
+    if (without_proof == NULL) {
+        return CBSASL_NOMEM;
+    }
+    len = strlen(state->nonce);
+    if (strncmp(without_proof, "c=" GS2_HEADER_BASE64 ",r=", 9) != 0 ||
+        strncmp(without_proof + 9, state->nonce, len) != 0 ||
+        without_proof[9 + len] != '\0') {
+        free(without_proof);
+        return CBSASL_BADPARAM;
+    }
+
+    auth_message = scram_join(state->client_first_bare, state->server_first,
+                              without_proof);
+    free(without_proof);
+    if (auth_message == NULL) {
+        return CBSASL_NOMEM;
+    }
+
+    /* ClientKey = ClientProof XOR HMAC(StoredKey, AuthMessage) */
+    scram_hmac(algorithm, state->secrets.stored_key, size,
+               auth_message, strlen(auth_message), signature);
+    for (ii = 0; ii < size; ++ii) {
+        proof[ii] ^= signature[ii];
+    }
+    scram_hash(algorithm, proof, size, stored_key);
+    if (cbsasl_secure_compare((char *)stored_key, size,
+                              (char *)state->secrets.stored_key, size) != 0) {
+        free(auth_message);
+        return CBSASL_PWERR;
+    }
+
+    scram_hmac(algorithm, state->secrets.server_key, size,
+               auth_message, strlen(auth_message), signature);
+    free(auth_message);
+    signature64 = scram_base64_encode(signature, size);
+    if (signature64 == NULL) {
+        return CBSASL_NOMEM;
+    }
+    len = strlen(signature64) + 3;
+    state->out = malloc(len);
+    if (state->out == NULL) {
+        free(signature64);
+        return CBSASL_NOMEM;
+    }
+    snprintf(state->out, len, "v=%s", signature64);
+    free(signature64);
+
+    free(conn->c.server.config);
+    conn->c.server.config = state->config;
+    state->config = NULL;
+    return CBSASL_OK;
+}
+
+static cbsasl_error_t scram_server_step(cbsasl_conn_t *conn,
+                                        const char *input,
+                                        unsigned inputlen,
+                                        const char **output,
+                                        unsigned *outputlen)
+{
+    struct scram_server *state = conn->c.server.mech_data;
+    cbsasl_error_t ret;
+    char *message;
+
+    if (state == NULL || state->stage > 1) {
+        return CBSASL_BADPARAM;
+    }
+    if ((message = scram_message(input, inputlen)) == NULL) {
+        return CBSASL_BADPARAM;
+    }
+
+    free(state->out);
+    state->out = NULL;
+    if (state->stage++ == 0) {
+        ret = scram_server_first(conn, state, message);
+        if (ret == CBSASL_CONTINUE) {
+            state->out = strdup(state->server_first);
+            if (state->out == NULL) {
+                ret = CBSASL_NOMEM;
+            }
+        }
+    } else {
+        ret = scram_server_final(conn, state, message);
+    }
+    free(message);
+    if (ret != CBSASL_CONTINUE) {
+        /* The exchange is over */
+        state->stage = 2;
+    }
+
+    *output = state->out;
+    *outputlen = state->out ? (unsigned)strlen(state->out) : 0;
+    return ret;
+}
+
+cbsasl_mechs_t get_scram_sha1_mechs(void)
+{
+    static cbsasl_mechs_t mechs = {
+        MECH_NAME_SCRAM_SHA1,
+        scram_server_init,
+        scram_sha1_server_start,
+        scram_server_step
+    };
+    return mechs;
+}
+
+cbsasl_mechs_t get_scram_sha256_mechs(void)
+{
+    static cbsasl_mechs_t mechs = {
+        MECH_NAME_SCRAM_SHA256,
+        scram_server_init,
+        scram_sha256_server_start,
+        scram_server_step
+    };
+    return mechs;
+}
+
+cbsasl_mechs_t get_scram_sha512_mechs(void)
+{
+    static cbsasl_mechs_t mechs = {
+        MECH_NAME_SCRAM_SHA512,
+        scram_server_init,
+        scram_sha512_server_start,
+        scram_server_step
+    };
+    return mechs;
+}
+
+/*
+ * Client side
+ */
+
+static void scram_client_dispose(void *data)
+{
+    struct scram_client *state = data;
+    free(state->client_first_bare);
+    free(state->nonce);
+    free(state->out);
+    free(state);
+}
+
+cbsasl_error_t scram_client_start(cbsasl_conn_t *conn,
+                                  scram_algorithm_t algorithm,
+                                  const char **clientout,
+                                  unsigned int *clientoutlen)
+{
+    struct scram_client *state;
+    unsigned char cnonce[NONCE_LENGTH];
+    const char *usernm = NULL;
+    unsigned int usernmlen;
+    char *name;
+    cb_rand_t rand;
+    cbsasl_error_t ret;
+    size_t len;
+
+    ret = conn->c.client.get_username(conn->c.client.get_username_ctx,
+                                      CBSASL_CB_USER, &usernm, &usernmlen);
+    if (ret != CBSASL_OK) {
+        return ret;
+    }
+
+    if (cb_rand_open(&rand) != 0) {
+        return CBSASL_FAIL;
+    }
+    if (cb_rand_get(rand, cnonce, sizeof(cnonce)) != 0) {
+        cb_rand_close(rand);
+        return CBSASL_FAIL;
+    }
+    cb_rand_close(rand);
+
+    if (conn->c.client.mech_dispose != NULL) {
+        conn->c.client.mech_dispose(conn->c.client.mech_data);
+    }
+    state = calloc(1, sizeof(*state));
+    if (state == NULL) {
+        return CBSASL_NOMEM;
+    }
+    conn->c.client.mech_data = state;
+    conn->c.client.mech_dispose = scram_client_dispose;
+    state->algorithm = algorithm;
+
+    state->nonce = scram_base64_encode(cnonce, sizeof(cnonce));
+    name = scram_encode_name(usernm, usernmlen);
+    if (state->nonce == NULL || name == NULL) {
+        free(name);
+        return CBSASL_NOMEM;
+    }
+    len = strlen(name) + strlen(state->nonce) + 7;
+    state->client_first_bare = malloc(len);
+    if (state->client_first_bare == NULL) {
+        free(name);
+        return CBSASL_NOMEM;
+    }
+    snprintf(state->client_first_bare, len, "n=%s,r=%s", name, state->nonce);
+    free(name);
+
+    len = strlen(state->client_first_bare) + sizeof(GS2_HEADER);
+    state->out = malloc(len);
+    if (state->out == NULL) {
+        return CBSASL_NOMEM;
+    }
+    snprintf(state->out, len, GS2_HEADER "%s", state->client_first_bare);
+    *clientout = state->out;
+    *clientoutlen = (unsigned int)strlen(state->out);
+    return CBSASL_OK;
+}
+
+static cbsasl_error_t scram_client_final(cbsasl_conn_t *conn,
+                                         struct scram_client *state,
+                                         const char *message)
+{
+    scram_algorithm_t algorithm = state->algorithm;
+    unsigned int size = scram_digest_size(algorithm);
+    unsigned char salt[3 * 64];
+    unsigned char client_key[SCRAM_MAX_DIGEST_LENGTH];
+    unsigned char server_key[SCRAM_MAX_DIGEST_LENGTH];
+    unsigned char stored_key[SCRAM_MAX_DIGEST_LENGTH];
+    unsigned char signature[SCRAM_MAX_DIGEST_LENGTH];
+    const char *nonce, *salt64, *iter;
+    size_t noncelen, salt64len, iterlen, len;
+    char *without_proof, *auth_message, *proof64;
+    cbsasl_secret_t *pass;
+    cbsasl_error_t ret;
+    int saltlen, iterations;
+    unsigned int ii;
+
+    if ((nonce = scram_attr(message, 'r', &noncelen)) == NULL ||
+        (salt64 = scram_attr(message, 's', &salt64len)) == NULL ||
+        (iter = scram_attr(message, 'i', &iterlen)) == NULL) {
+        return CBSASL_BADPARAM;
+    }
+    /* The server's nonce starts with ours */
+    len = strlen(state->nonce);
+    if (noncelen <= len || strncmp(nonce, state->nonce, len) != 0) {
+        return CBSASL_BADPARAM;
+    }
+    saltlen = scram_base64_decode(salt64, salt64len, salt, sizeof(salt));
+    iterations = atoi(iter);
+    if (saltlen <= 0 || iterations <= 0) {
+        return CBSASL_BADPARAM;
+    }
+
+    ret = conn->c.client.get_password(conn, conn->c.client.get_password_ctx,
+                                      CBSASL_CB_PASS, &pass);
+    if (ret != CBSASL_OK) {
+        return ret;
+    }
+    ret = scram_derive(algorithm, (const char *)pass->data, pass->len,
+                       salt, saltlen, iterations, client_key, server_key);
+    if (ret != CBSASL_OK) {
+        return ret;
+    }
+    scram_hash(algorithm, client_key, size, stored_key);
+
+    len = noncelen + 10;
+    without_proof = malloc(len);
+    if (without_proof == NULL) {
+        return CBSASL_NOMEM;
+    }
+    snprintf(without_proof, len, "c=" GS2_HEADER_BASE64 ",r=%.*s",
+             (int)noncelen, nonce);
+    auth_message = scram_join(state->client_first_bare, message,
+                              without_proof);
+    if (auth_message == NULL) {
+        free(without_proof);
+        return CBSASL_NOMEM;
+    }
+
+    /* ClientProof = ClientKey XOR HMAC(StoredKey, AuthMessage) */
+    scram_hmac(algorithm, stored_key, size,
+               auth_message, strlen(auth_message), signature);
+    for (ii = 0; ii < size; ++ii) {
+        client_key[ii] ^= signature[ii];
+    }
+    scram_hmac(algorithm, server_key, size,
+               auth_message, strlen(auth_message), state->server_signature);
+    free(auth_message);
+
+    proof64 = scram_base64_encode(client_key, size);
+    if (proof64 == NULL) {
+        free(without_proof);
+        return CBSASL_NOMEM;
+    }
+    len = strlen(without_proof) + strlen(proof64) + 4;
+    state->out = malloc(len);
+    if (state->out != NULL) {
+        snprintf(state->out, len, "%s,p=%s", without_proof, proof64);
+    }
+    free(without_proof);
+    free(proof64);
+    return state->out ? CBSASL_CONTINUE : CBSASL_NOMEM;
+}
+
+/* The server-final message: v=<server signature> */
+static cbsasl_error_t scram_client_verify(struct scram_client *state,
+                                          const char *message)
+{
+    unsigned int size = scram_digest_size(state->algorithm);
+    unsigned char signature[SCRAM_MAX_DIGEST_LENGTH];
+    const char *v;
+    size_t vlen;
+
+    if ((v = scram_attr(message, 'v', &vlen)) == NULL ||
+        scram_base64_decode(v, vlen, signature, sizeof(signature)) != (int)size) {
+        return CBSASL_BADPARAM;
+    }
+    if (cbsasl_secure_compare((char *)signature, size,
+                              (char *)state->server_signature, size) != 0) {
+        return CBSASL_PWERR;
+    }
+    return CBSASL_OK;
+}
+
+cbsasl_error_t scram_client_step(cbsasl_conn_t *conn,
+                                 const char *serverin,
+                                 unsigned int serverinlen,
+                                 const char **clientout,
+                                 unsigned int *clientoutlen)
+{
+    struct scram_client *state = conn->c.client.mech_data;
+    cbsasl_error_t ret;
+    char *message;
+
+    if (state == NULL || state->stage > 1) {
+        return CBSASL_BADPARAM;
+    }
+    if ((message = scram_message(serverin, serverinlen)) == NULL) {
+        return CBSASL_BADPARAM;
+    }
+
+    free(state->out);
+    state->out = NULL;
+    if (state->stage++ == 0) {
+        ret = scram_client_final(conn, state, message);
+    } else {
+        ret = scram_client_verify(state, message);
+    }
+    free(message);
+    if (ret != CBSASL_CONTINUE) {
+        state->stage = 2;
+    }
+
+    *clientout = state->out;
+    *clientoutlen = state->out ? (unsigned int)strlen(state->out) : 0;
+    return ret;
+}
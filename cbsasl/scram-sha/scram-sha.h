@@ -0,0 +1,75 @@
+/*
+ *     Copyright 2015 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_SCRAM_SHA_SCRAM_SHA_H_
+#define SRC_SCRAM_SHA_SCRAM_SHA_H_ 1
+
+#include "cbsasl/cbsasl.h"
+
+#define MECH_NAME_SCRAM_SHA1 "SCRAM-SHA1"
+#define MECH_NAME_SCRAM_SHA256 "SCRAM-SHA256"
+#define MECH_NAME_SCRAM_SHA512 "SCRAM-SHA512"
+
+/* The PBKDF2 iterations of the salted passwords we derive */
+#define SCRAM_ITERATIONS 10000
+#define SCRAM_SALT_LENGTH 16
+/* Large enough for the digests of all the algorithms (SHA-512) */
+#define SCRAM_MAX_DIGEST_LENGTH 64
+
+typedef enum {
+    SCRAM_SHA1,
+    SCRAM_SHA256,
+    SCRAM_SHA512,
+    SCRAM_NALGORITHMS
+} scram_algorithm_t;
+
+/*
+ * What the server needs to know of a password: deriving the salted
+ * password is by far the most expensive part of an exchange, so it's
+ * done once per user (and algorithm), and the keys are reused.
+ */
+struct scram_secrets {
+    unsigned char salt[SCRAM_SALT_LENGTH];
+    unsigned char stored_key[SCRAM_MAX_DIGEST_LENGTH];
+    unsigned char server_key[SCRAM_MAX_DIGEST_LENGTH];
+};
+
+cbsasl_mechs_t get_scram_sha1_mechs(void);
+cbsasl_mechs_t get_scram_sha256_mechs(void);
+cbsasl_mechs_t get_scram_sha512_mechs(void);
+
+/*
+ * Start the client side of an exchange, producing the client-first
+ * message. The username and password are taken from the callbacks of
+ * the connection.
+ */
+cbsasl_error_t scram_client_start(cbsasl_conn_t *conn,
+                                  scram_algorithm_t algorithm,
+                                  const char **clientout,
+                                  unsigned int *clientoutlen);
+
+/*
+ * Answer the server-first message with the client-final message
+ * (returning CBSASL_CONTINUE), and verify the server-final message
+ * (returning CBSASL_OK).
+ */
+cbsasl_error_t scram_client_step(cbsasl_conn_t *conn,
+                                 const char *serverin,
+                                 unsigned int serverinlen,
+                                 const char **clientout,
+                                 unsigned int *clientoutlen);
+
+#endif  /* SRC_SCRAM_SHA_SCRAM_SHA_H_ */
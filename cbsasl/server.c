@@ -19,6 +19,7 @@
 #include "cram-md5/cram-md5.h"
 #include "cram-md5/hmac.h"
 #include "plain/plain.h"
+#include "scram-sha/scram-sha.h"
 #include "pwfile.h"
 #include "util.h"
 #include <time.h>
@@ -33,7 +34,7 @@ static cb_rand_t randgen;
 cbsasl_error_t cbsasl_list_mechs(const char **mechs,
                                  unsigned *mechslen)
 {
-    *mechs = "CRAM-MD5 PLAIN";
+    *mechs = "SCRAM-SHA512 SCRAM-SHA256 SCRAM-SHA1 CRAM-MD5 PLAIN";
     *mechslen = (unsigned)strlen(*mechs);
     return CBSASL_OK;
 }
@@ -80,6 +81,15 @@ cbsasl_error_t cbsasl_server_start(cbsasl_conn_t **conn,
     } else if (IS_MECH(mech, MECH_NAME_CRAM_MD5) == 0) {
         cbsasl_mechs_t cram_md5_mech = get_cram_md5_mechs();
         memcpy(&(*conn)->c.server.mech, &cram_md5_mech, sizeof(cbsasl_mechs_t));
+    } else if (IS_MECH(mech, MECH_NAME_SCRAM_SHA512) == 0) {
+        cbsasl_mechs_t scram_mech = get_scram_sha512_mechs();
+        memcpy(&(*conn)->c.server.mech, &scram_mech, sizeof(cbsasl_mechs_t));
+    } else if (IS_MECH(mech, MECH_NAME_SCRAM_SHA256) == 0) {
+        cbsasl_mechs_t scram_mech = get_scram_sha256_mechs();
+        memcpy(&(*conn)->c.server.mech, &scram_mech, sizeof(cbsasl_mechs_t));
+    } else if (IS_MECH(mech, MECH_NAME_SCRAM_SHA1) == 0) {
+        cbsasl_mechs_t scram_mech = get_scram_sha1_mechs();
+        memcpy(&(*conn)->c.server.mech, &scram_mech, sizeof(cbsasl_mechs_t));
     } else {
         cbsasl_dispose(conn);
         return CBSASL_BADPARAM;
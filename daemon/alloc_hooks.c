@@ -2,6 +2,7 @@
 #include "config.h"
 #include "alloc_hooks.h"
 #include <stdbool.h>
+#include <inttypes.h>
 
 #include "memcached/visibility.h"
 
@@ -39,6 +40,9 @@ static bool (*enableThreadCache)(bool enable);
 
 static alloc_hooks_type type = none;
 
+/* If the threads asking for it get an arena of their own */
+static bool arena_per_thread = false;
+
 #ifdef HAVE_JEMALLOC
 
 /******************************************************************************
@@ -60,16 +64,26 @@ static malloc_delete_hook_t delete_hook = NULL;
 
 #if defined(INTERPOSE_MALLOC)
 
+/* The hooks of mc_set_sampling_hooks(), called after the ones above */
+static malloc_new_hook_t sampling_new_hook = NULL;
+static malloc_delete_hook_t sampling_delete_hook = NULL;
+
 static inline void invoke_new_hook(void* ptr, size_t size) {
     if (new_hook != NULL) {
         new_hook(ptr, size);
     }
+    if (sampling_new_hook != NULL) {
+        sampling_new_hook(ptr, size);
+    }
 }
 
 static inline void invoke_delete_hook(void* ptr) {
     if (delete_hook != NULL) {
         delete_hook(ptr);
     }
+    if (sampling_delete_hook != NULL) {
+        sampling_delete_hook(ptr);
+    }
 }
 
 MEMCACHED_PUBLIC_API void* malloc(size_t size) {
@@ -252,6 +266,119 @@ static void jemalloc_release_free_memory(void) {
     }
 }
 
+/* Create an arena and move the calling thread to it, -1 if we can't */
+static int jemalloc_use_thread_arena(void) {
+    unsigned int arena;
+    size_t len = sizeof(arena);
+    int err = je_mallctl("arenas.create", &arena, &len, NULL, 0);
+    if (err != 0) {
+        /* Before jemalloc 5 */
+        len = sizeof(arena);
+        err = je_mallctl("arenas.extend", &arena, &len, NULL, 0);
+    }
+    if (err != 0) {
+        get_stderr_logger()->log(EXTENSION_LOG_WARNING, NULL,
+                                 "jemalloc_use_thread_arena() error %d - "
+                                 "could not create an arena.", err);
+        return -1;
+    }
+    err = je_mallctl("thread.arena", NULL, NULL, &arena, sizeof(arena));
+    if (err != 0) {
+        get_stderr_logger()->log(EXTENSION_LOG_WARNING, NULL,
+                                 "jemalloc_use_thread_arena() error %d - "
+                                 "could not set thread.arena.", err);
+        return -1;
+    }
+    /* What the thread cache holds belongs to the old arena */
+    je_mallctl("thread.tcache.flush", NULL, NULL, NULL, 0);
+    return (int)arena;
+}
+
+static bool jemalloc_arena_stat(unsigned int arena, const char *name,
+                                size_t *value) {
+    char key[64];
+    size_t len;
+
+    snprintf(key, sizeof(key), "stats.arenas.%u.%s", arena, name);
+    if (strcmp(name, "nthreads") == 0) {
+        unsigned int n;
+        len = sizeof(n);
+        if (je_mallctl(key, &n, &len, NULL, 0) != 0) {
+            return false;
+        }
+        *value = n;
+        return true;
+    }
+    len = sizeof(*value);
+    return je_mallctl(key, value, &len, NULL, 0) == 0;
+}
+
+static void add_size_stat(ADD_STAT add_stat, const void *cookie,
+                          const char *key, size_t value) {
+    char val[32];
+    int vlen = snprintf(val, sizeof(val), "%" PRIu64, (uint64_t)value);
+    add_stat(key, (uint16_t)strlen(key), val, vlen, cookie);
+}
+
+static void jemalloc_get_arena_stats(ADD_STAT add_stat, const void *cookie) {
+    size_t epoch = 1;
+    size_t sz = sizeof(epoch);
+    unsigned int narenas, ii;
+    size_t len = sizeof(narenas);
+    size_t psize;
+    bool *initialized;
+
+    je_mallctl("epoch", &epoch, &sz, &epoch, sz);
+    if (je_mallctl("arenas.narenas", &narenas, &len, NULL, 0) != 0) {
+        return;
+    }
+    len = sizeof(psize);
+    if (je_mallctl("arenas.page", &psize, &len, NULL, 0) != 0) {
+        return;
+    }
+    initialized = calloc(narenas, sizeof(bool));
+    if (initialized == NULL) {
+        return;
+    }
+    len = narenas * sizeof(bool);
+    if (je_mallctl("arenas.initialized", initialized, &len, NULL, 0) != 0) {
+        free(initialized);
+        return;
+    }
+
+    add_size_stat(add_stat, cookie, "arenas", narenas);
+    for (ii = 0; ii < narenas; ++ii) {
+        size_t value, small, large;
+        char key[64];
+
+        if (!initialized[ii]) {
+            continue;
+        }
+        if (jemalloc_arena_stat(ii, "nthreads", &value)) {
+            snprintf(key, sizeof(key), "arena:%u:threads", ii);
+            add_size_stat(add_stat, cookie, key, value);
+        }
+        if (jemalloc_arena_stat(ii, "pactive", &value)) {
+            snprintf(key, sizeof(key), "arena:%u:active_bytes", ii);
+            add_size_stat(add_stat, cookie, key, value * psize);
+        }
+        if (jemalloc_arena_stat(ii, "pdirty", &value)) {
+            snprintf(key, sizeof(key), "arena:%u:dirty_bytes", ii);
+            add_size_stat(add_stat, cookie, key, value * psize);
+        }
+        if (jemalloc_arena_stat(ii, "mapped", &value)) {
+            snprintf(key, sizeof(key), "arena:%u:mapped_bytes", ii);
+            add_size_stat(add_stat, cookie, key, value);
+        }
+        if (jemalloc_arena_stat(ii, "small.allocated", &small) &&
+            jemalloc_arena_stat(ii, "large.allocated", &large)) {
+            snprintf(key, sizeof(key), "arena:%u:allocated_bytes", ii);
+            add_size_stat(add_stat, cookie, key, small + large);
+        }
+    }
+    free(initialized);
+}
+
 static bool jemalloc_enable_thread_cache(bool enable) {
     bool old;
     size_t size = sizeof(old);
@@ -396,6 +523,48 @@ bool mc_remove_delete_hook(void (*hook)(const void* ptr)) {
     return removeDelHook(hook) ? true : false;
 }
 
+bool mc_set_sampling_hooks(malloc_new_hook_t new_hook_,
+                           malloc_delete_hook_t delete_hook_) {
+#if defined(HAVE_TCMALLOC)
+    /* tcmalloc calls as many hooks as we give it */
+    static malloc_new_hook_t current_new = NULL;
+    static malloc_delete_hook_t current_delete = NULL;
+
+    if (current_new != NULL) {
+        MallocHook_RemoveNewHook(current_new);
+        MallocHook_RemoveDeleteHook(current_delete);
+        current_new = NULL;
+        current_delete = NULL;
+    }
+    if (new_hook_ != NULL) {
+        if (!MallocHook_AddNewHook(new_hook_)) {
+            return false;
+        }
+        if (!MallocHook_AddDeleteHook(delete_hook_)) {
+            MallocHook_RemoveNewHook(new_hook_);
+            return false;
+        }
+        current_new = new_hook_;
+        current_delete = delete_hook_;
+    }
+    return true;
+#elif defined(HAVE_JEMALLOC) && defined(INTERPOSE_MALLOC)
+    /* Set the delete hook first so we don't miss the free of a sample */
+    if (new_hook_ != NULL) {
+        sampling_delete_hook = delete_hook_;
+        sampling_new_hook = new_hook_;
+    } else {
+        sampling_new_hook = NULL;
+        sampling_delete_hook = NULL;
+    }
+    return true;
+#else
+    (void)new_hook_;
+    (void)delete_hook_;
+    return new_hook_ == NULL;
+#endif
+}
+
 int mc_get_extra_stats_size() {
     if (type == tcmalloc) {
         return 3;
@@ -498,10 +667,48 @@ void mc_get_detailed_stats(char* buffer, int size) {
     getDetailedStats(buffer, size);
 }
 
+void mc_set_arena_per_thread(bool enable) {
+    arena_per_thread = enable;
+}
+
+bool mc_use_thread_arena(void) {
+#if defined(HAVE_JEMALLOC)
+    if (arena_per_thread && type == jemalloc) {
+        return jemalloc_use_thread_arena() != -1;
+    }
+#endif
+    return false;
+}
+
+void mc_get_arena_stats(ADD_STAT add_stat, const void *cookie) {
+    const char *value = arena_per_thread ? "true" : "false";
+    add_stat("arena_per_thread", 16, value, (uint32_t)strlen(value), cookie);
+#if defined(HAVE_JEMALLOC)
+    if (type == jemalloc) {
+        jemalloc_get_arena_stats(add_stat, cookie);
+    }
+#endif
+}
+
 void mc_release_free_memory() {
     releaseFreeMemory();
 }
 
+bool mc_release_free_memory_slice(size_t bytes) {
+#if defined(HAVE_TCMALLOC)
+    MallocExtension_ReleaseToSystem(bytes);
+    return true;
+#elif defined(HAVE_JEMALLOC)
+    /* Only knows how to purge everything */
+    (void)bytes;
+    jemalloc_release_free_memory();
+    return true;
+#else
+    (void)bytes;
+    return false;
+#endif
+}
+
 bool mc_enable_thread_cache(bool enable) {
     return enableThreadCache(enable);
 }
@@ -12,6 +12,7 @@
 #endif
 
 #include "memcached/extension_loggers.h"
+#include "memcached/engine_common.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -32,13 +33,49 @@ extern "C" {
     bool mc_remove_new_hook(malloc_new_hook_t f);
     bool mc_add_delete_hook(malloc_delete_hook_t f);
     bool mc_remove_delete_hook(malloc_delete_hook_t f);
+
+    /**
+     * Install a second pair of hooks (or remove them with NULL), which
+     * don't take the place of the ones above: the heap profiler uses them
+     * next to the memory tracking of the engine. Returns false if the
+     * allocator can't call them.
+     */
+    bool mc_set_sampling_hooks(malloc_new_hook_t new_hook,
+                               malloc_delete_hook_t delete_hook);
     void mc_get_allocator_stats(allocator_stats*);
     int mc_get_extra_stats_size(void);
     size_t mc_get_allocation_size(const void*);
     void mc_get_detailed_stats(char*, int);
     void mc_release_free_memory(void);
+
+    /**
+     * Return about bytes of the free memory of the allocator to the OS
+     * (with jemalloc all of it, it can't do less). Returns false if the
+     * allocator can't.
+     */
+    bool mc_release_free_memory_slice(size_t bytes);
     bool mc_enable_thread_cache(bool enable);
 
+    /**
+     * If enabled (the "arena_per_thread" setting, jemalloc only), every
+     * thread calling mc_use_thread_arena() gets an arena of its own, so
+     * the worker and background threads don't contend for the locks of
+     * a shared one or share its cache lines.
+     */
+    void mc_set_arena_per_thread(bool enable);
+
+    /**
+     * Move the calling thread to a new arena (flushing its thread cache,
+     * which holds memory of the old one). Returns true if it did.
+     */
+    bool mc_use_thread_arena(void);
+
+    /**
+     * Add the stats of each arena ("arena:<n>:<name>") for "stats
+     * allocator".
+     */
+    void mc_get_arena_stats(ADD_STAT add_stat, const void *cookie);
+
     /**
      * Gets the value of the given property on the allocator. Each
      * allocator will have it's own namespace of properties. If the
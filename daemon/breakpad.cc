@@ -15,6 +15,18 @@
  *   limitations under the License.
  */
 
+/*
+ * With breakpad.helper the minidumps are written by a process forked at
+ * startup (a breakpad CrashGenerationServer), instead of by the signal
+ * handler of the crashed process: the crashed process only hands its
+ * context over and waits, and the helper reads its memory with ptrace.
+ * The helper can't be forked once the worker threads run, so enabling it
+ * later takes effect at the next restart. The time when the crash was
+ * caught and the directory of the dumps are shared with the helper on a
+ * page mapped before the fork, so it can log how long the dump took and
+ * follow breakpad.minidump_dir.
+ */
+
 #include "config.h"
 #include "breakpad.h"
 #if defined(HAVE_BREAKPAD)
@@ -22,23 +34,52 @@
 #    include "client/windows/handler/exception_handler.h"
 #  elif defined(linux)
 #    include "client/linux/handler/exception_handler.h"
+#    include "client/linux/crash_generation/client_info.h"
+#    include "client/linux/crash_generation/crash_generation_server.h"
 #  else
 #    error Unsupported platform for breakpad, cannot compile.
 #  endif
 
+#include "memcached.h"
 #include "memcached/extension_loggers.h"
 #include <platform/backtrace.h>
 
 #include <stdlib.h>
+#include <inttypes.h>
 
-extern "C" {
-    extern struct settings settings;
-}
+#if defined(linux)
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 using namespace google_breakpad;
 
 ExceptionHandler* handler;
 
+/* The largest minidump with content "minimal", the stacks get truncated */
+#define MINIMAL_SIZE_LIMIT (16 * 1024 * 1024)
+
+#if defined(linux)
+/* Shared with the helper process */
+struct breakpad_shared {
+    volatile hrtime_t crash_time;   /* when the crash was caught */
+    char minidump_dir[PATH_MAX];
+};
+
+static struct breakpad_shared *shared;
+static pid_t helper_pid = -1;
+static int helper_fd = -1;      /* the client end of the report channel */
+static int helper_ctl = -1;     /* the helper exits when it's closed */
+static bool first_init = true;
+#endif
+
 /* Callback function to print to the logger. */
 static void write_to_logger(void* ctx, const char* frame) {
     settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
@@ -67,12 +108,34 @@ static bool dumpCallback(const wchar_t* dump_path, const wchar_t* minidump_id,
 #endif
 
 #if defined(linux)
+/* Called when the crash is caught, before the dump is written */
+static bool filterCallback(void* context) {
+    shared->crash_time = gethrtime();
+    if (helper_fd != -1) {
+        /* No dumpCallback() after an out of process dump */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Breakpad caught crash in memcached. Helper process %d is "
+            "writing a crash dump to %s before terminating.",
+            (int)helper_pid, shared->minidump_dir);
+
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Stack backtrace of crashed thread:");
+        print_backtrace(write_to_logger, NULL);
+
+        if (settings.extensions.logger->shutdown != NULL) {
+            settings.extensions.logger->shutdown(/*force*/true);
+        }
+    }
+    return true;
+}
+
 /* Called when an exception triggers a dump, outputs details to memcached.log */
 static bool dumpCallback(const MinidumpDescriptor& descriptor,
                          void* context, bool succeeded) {
     settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-        "Breakpad caught crash in memcached. Writing crash dump to "
-        "%s before terminating.", descriptor.path());
+        "Breakpad caught crash in memcached. Wrote crash dump to "
+        "%s in %" PRIu64 " ms before terminating.", descriptor.path(),
+        (gethrtime() - shared->crash_time) / 1000000);
 
     settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                                     "Stack backtrace of crashed thread:");
@@ -84,9 +147,109 @@ static bool dumpCallback(const MinidumpDescriptor& descriptor,
     }
     return succeeded;
 }
+
+/* Called in the helper once it has written the dump of the crashed process */
+static void helperDumpCallback(void* context, const ClientInfo* client_info,
+                               const string* file_path) {
+    const char* path = file_path->c_str();
+    char moved[PATH_MAX];
+    const char* name = strrchr(path, '/');
+
+    /* Follow changes of breakpad.minidump_dir since the helper started */
+    if (name != NULL && strncmp(path, shared->minidump_dir,
+                                name - path) != 0) {
+        snprintf(moved, sizeof(moved), "%s%s", shared->minidump_dir, name);
+        if (rename(path, moved) == 0) {
+            path = moved;
+        }
+    }
+    fprintf(stderr, "Breakpad helper wrote crash dump of memcached pid %d "
+            "to %s in %" PRIu64 " ms\n", (int)client_info->pid(), path,
+            (gethrtime() - shared->crash_time) / 1000000);
+    fflush(stderr);
+}
+
+static void helper_main(int server_fd, int ctl_fd) {
+    const string dump_path(shared->minidump_dir);
+    char buf;
+    int fd;
+
+    prctl(PR_SET_NAME, "memcached-dump");
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    /* Don't keep the listening sockets (or anything else) open */
+    for (fd = 3; fd < sysconf(_SC_OPEN_MAX); ++fd) {
+        if (fd != server_fd && fd != ctl_fd) {
+            close(fd);
+        }
+    }
+
+    CrashGenerationServer server(server_fd, helperDumpCallback, NULL,
+                                 /*exit_callback*/NULL, NULL,
+                                 /*generate_dumps*/true, &dump_path);
+    if (!server.Start()) {
+        fprintf(stderr, "Failed to start the breakpad helper\n");
+        _exit(EXIT_FAILURE);
+    }
+    /* Until memcached is gone (a crashed one waits for its dump) */
+    while (read(ctl_fd, &buf, 1) == -1 && errno == EINTR) {
+    }
+    server.Stop();
+    _exit(EXIT_SUCCESS);
+}
+
+static void start_helper(void) {
+    int server_fd, client_fd;
+    int ctl[2];
+    pid_t pid;
+
+    if (!CrashGenerationServer::CreateReportChannel(&server_fd, &client_fd)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Failed to create the breakpad report channel, writing the "
+            "crash dumps in process");
+        return;
+    }
+    if (pipe(ctl) == -1) {
+        close(server_fd);
+        close(client_fd);
+        return;
+    }
+
+    if ((pid = fork()) == 0) {
+        close(client_fd);
+        close(ctl[1]);
+        helper_main(server_fd, ctl[0]);
+    }
+
+    close(server_fd);
+    close(ctl[0]);
+    if (pid == -1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Failed to fork the breakpad helper, writing the crash dumps "
+            "in process: %s", strerror(errno));
+        close(client_fd);
+        close(ctl[1]);
+        return;
+    }
+    helper_pid = pid;
+    helper_fd = client_fd;
+    helper_ctl = ctl[1];
+}
+
+static void stop_helper(void) {
+    if (helper_pid != -1) {
+        close(helper_ctl);
+        close(helper_fd);
+        waitpid(helper_pid, NULL, 0);
+        helper_pid = -1;
+        helper_fd = helper_ctl = -1;
+    }
+}
 #endif
 
-static void create_breakpad(const char* minidump_dir) {
+static void create_breakpad(const breakpad_settings_t* settings) {
+    const char* minidump_dir = settings->minidump_dir;
 #if defined(WIN32)
     // Takes a wchar_t* on Windows. Isn't the Breakpad API nice and
     // consistent? ;)
@@ -104,25 +267,66 @@ static void create_breakpad(const char* minidump_dir) {
     delete[] wc_minidump_dir;
 #elif defined(linux)
     MinidumpDescriptor descriptor(minidump_dir);
-    handler = new ExceptionHandler(descriptor, /*filter*/NULL, dumpCallback,
+    if (settings->content == CONTENT_MINIMAL) {
+        descriptor.set_size_limit(MINIMAL_SIZE_LIMIT);
+    }
+    snprintf(shared->minidump_dir, sizeof(shared->minidump_dir), "%s",
+             minidump_dir);
+    handler = new ExceptionHandler(descriptor, filterCallback, dumpCallback,
                                    /*callback-context*/NULL,
-                                   /*install_handler*/true, /*server_fd*/-1);
+                                   /*install_handler*/true,
+                                   settings->helper ? helper_fd : -1);
+    if (settings->content == CONTENT_MINIMAL) {
+        /* The stacks, and the small windows of the heap worth having */
+        handler->RegisterAppMemory(&::settings, sizeof(::settings));
+        handler->RegisterAppMemory(&stats, sizeof(stats));
+    }
 #endif /* defined({OS}) */
 }
 
 void initialize_breakpad(const breakpad_settings_t* settings) {
     // We cannot actually change any of breakpad's settings once created, only
     // remove it and re-create with new settings.
-    destroy_breakpad();
+    delete handler;
+    handler = NULL;
+
+#if defined(linux)
+    if (shared == NULL) {
+        void* page = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (page == MAP_FAILED) {
+            /* No helper then, it wouldn't see the page */
+            static struct breakpad_shared private_page;
+            shared = &private_page;
+            first_init = false;
+        } else {
+            shared = static_cast<struct breakpad_shared*>(page);
+        }
+    }
+    if (settings->enabled && settings->helper && helper_pid == -1) {
+        if (first_init) {
+            snprintf(shared->minidump_dir, sizeof(shared->minidump_dir),
+                     "%s", settings->minidump_dir);
+            start_helper();
+        } else {
+            ::settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "breakpad.helper takes effect at the next restart");
+        }
+    }
+    first_init = false;
+#endif
 
     if (settings->enabled) {
-        create_breakpad(settings->minidump_dir);
+        create_breakpad(settings);
     }
 }
 
 void destroy_breakpad(void) {
     delete handler;
     handler = NULL;
+#if defined(linux)
+    stop_helper();
+#endif
 }
 
 #else /* defined(HAVE_BREAKPAD) */
@@ -0,0 +1,278 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The inflate cache is looked up by the cas and size of the compressed
+ * value, and an entry only matches when its copy of the compressed value
+ * is identical. That makes it independent of the bucket (and key) the
+ * value came from: the same compressed bytes always inflate to the same
+ * value. The cache is only used by the thread owning it, so it needs no
+ * locking.
+ */
+#include "config.h"
+#include "compression.h"
+#include "dictionary.h"
+
+#include <snappy-c.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INFLATE_CACHE_BUCKETS 256
+
+struct inflate_entry {
+    struct inflate_entry *hnext; /* next in the hash bucket */
+    struct inflate_entry *prev;  /* LRU list, most recently used first */
+    struct inflate_entry *next;
+    uint64_t cas;
+    size_t nbytes;               /* size of the compressed value */
+    size_t ninflated;            /* size of the inflated value */
+    char data[];                 /* the compressed value, then the inflated */
+};
+
+struct inflate_cache {
+    struct inflate_entry *buckets[INFLATE_CACHE_BUCKETS];
+    struct inflate_entry *head;
+    struct inflate_entry *tail;
+    size_t size;                 /* memory used by all of the entries */
+};
+
+static struct inflate_cache *get_cache(conn *c) {
+    if (c->thread == NULL || c->thread->inflate_cache == NULL) {
+        return NULL;
+    }
+    return c->thread->inflate_cache;
+}
+
+static size_t entry_size(size_t nbytes, size_t ninflated) {
+    return sizeof(struct inflate_entry) + nbytes + ninflated;
+}
+
+static struct inflate_entry **bucket_of(struct inflate_cache *cache,
+                                        uint64_t cas, size_t nbytes) {
+    uint64_t hash = (cas ^ nbytes) * 0x9e3779b97f4a7c15ULL;
+    return &cache->buckets[hash >> 56];
+}
+
+static void lru_unlink(struct inflate_cache *cache,
+                       struct inflate_entry *entry) {
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+}
+
+static void lru_push(struct inflate_cache *cache,
+                     struct inflate_entry *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL) {
+        cache->head->prev = entry;
+    } else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+static void evict(struct inflate_cache *cache, struct inflate_entry *entry) {
+    struct inflate_entry **pp = bucket_of(cache, entry->cas, entry->nbytes);
+    while (*pp != entry) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = entry->hnext;
+    lru_unlink(cache, entry);
+    cache->size -= entry_size(entry->nbytes, entry->ninflated);
+    free(entry);
+}
+
+/* Make room for size more bytes under the current setting */
+static bool trim(struct inflate_cache *cache, size_t size) {
+    size_t limit = settings.inflate_cache_size;
+
+    while (cache->tail != NULL && cache->size + size > limit) {
+        evict(cache, cache->tail);
+    }
+    return size > 0 && cache->size + size <= limit;
+}
+
+static struct inflate_entry *lookup(struct inflate_cache *cache, uint64_t cas,
+                                    const char *value, size_t nbytes) {
+    struct inflate_entry *entry;
+
+    if (cache == NULL || settings.inflate_cache_size == 0) {
+        if (cache != NULL && cache->head != NULL) {
+            /* The cache was turned off */
+            trim(cache, 0);
+        }
+        return NULL;
+    }
+
+    for (entry = *bucket_of(cache, cas, nbytes); entry != NULL;
+         entry = entry->hnext) {
+        if (entry->cas == cas && entry->nbytes == nbytes &&
+            memcmp(entry->data, value, nbytes) == 0) {
+            lru_unlink(cache, entry);
+            lru_push(cache, entry);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void insert(struct inflate_cache *cache, uint64_t cas,
+                   const char *value, size_t nbytes,
+                   const char *inflated, size_t ninflated) {
+    struct inflate_entry **bucket;
+    struct inflate_entry *entry;
+    size_t size = entry_size(nbytes, ninflated);
+
+    if (!trim(cache, size) || (entry = malloc(size)) == NULL) {
+        return;
+    }
+
+    entry->cas = cas;
+    entry->nbytes = nbytes;
+    entry->ninflated = ninflated;
+    memcpy(entry->data, value, nbytes);
+    memcpy(entry->data + nbytes, inflated, ninflated);
+
+    bucket = bucket_of(cache, cas, nbytes);
+    entry->hnext = *bucket;
+    *bucket = entry;
+    lru_push(cache, entry);
+    cache->size += size;
+}
+
+/* Require a saving of at least 1/8 to make up for inflating it */
+static bool worth_compressing(size_t nbytes, size_t len) {
+    return len <= nbytes - nbytes / 8;
+}
+
+/* The small values go to the dictionary, if there's one yet */
+static bool compress_with_dictionary(conn *c, const char *value,
+                                     uint32_t nbytes, struct net_buf *dest) {
+    size_t max = dictionary_compress_bound(nbytes);
+    size_t len;
+
+    if (max > UINT32_MAX || !thread_buffer_alloc(c->thread, dest,
+                                                 (uint32_t)max)) {
+        return false;
+    }
+
+    len = max;
+    if (!dictionary_compress(c, value, nbytes, dest->buf, &len) ||
+        !worth_compressing(nbytes, len)) {
+        thread_buffer_release(c->thread, dest);
+        return false;
+    }
+
+    dest->bytes = (uint32_t)len;
+    STATS_NOKEY(c, values_compressed);
+    STATS_NOKEY(c, values_dict_compressed);
+    return true;
+}
+
+bool compress_value(conn *c, const char *value, uint32_t nbytes,
+                    struct net_buf *dest) {
+    size_t max;
+    size_t len;
+
+    if (!settings.datatype) {
+        return false;
+    }
+    if (nbytes <= settings.dictionary_compression_max &&
+        compress_with_dictionary(c, value, nbytes, dest)) {
+        return true;
+    }
+    if (settings.compression_threshold == 0 ||
+        nbytes < settings.compression_threshold) {
+        return false;
+    }
+
+    max = snappy_max_compressed_length(nbytes);
+    if (max > UINT32_MAX || !thread_buffer_alloc(c->thread, dest,
+                                                 (uint32_t)max)) {
+        return false;
+    }
+
+    len = max;
+    if (snappy_compress(value, nbytes, dest->buf, &len) != SNAPPY_OK ||
+        !worth_compressing(nbytes, len)) {
+        thread_buffer_release(c->thread, dest);
+        return false;
+    }
+
+    dest->bytes = (uint32_t)len;
+    STATS_NOKEY(c, values_compressed);
+    return true;
+}
+
+char *compress_value_copy(const char *value, size_t nbytes, size_t *len) {
+    char *dest = malloc(snappy_max_compressed_length(nbytes));
+
+    if (dest == NULL) {
+        return NULL;
+    }
+    *len = snappy_max_compressed_length(nbytes);
+    if (snappy_compress(value, nbytes, dest, len) != SNAPPY_OK ||
+        !worth_compressing(nbytes, *len)) {
+        free(dest);
+        return NULL;
+    }
+    return dest;
+}
+
+bool get_inflated_length(conn *c, uint64_t cas, const char *value,
+                         size_t nbytes, size_t *length) {
+    struct inflate_entry *entry = lookup(get_cache(c), cas, value, nbytes);
+    if (entry != NULL) {
+        *length = entry->ninflated;
+        return true;
+    }
+    if (dictionary_compressed(value, nbytes)) {
+        return dictionary_inflated_length(value, nbytes, length);
+    }
+    return snappy_uncompressed_length(value, nbytes, length) == SNAPPY_OK;
+}
+
+bool inflate_value(conn *c, uint64_t cas, const char *value, size_t nbytes,
+                   char *dest, size_t length) {
+    struct inflate_cache *cache = get_cache(c);
+    struct inflate_entry *entry = lookup(cache, cas, value, nbytes);
+
+    if (entry != NULL && entry->ninflated == length) {
+        memcpy(dest, entry->data + nbytes, length);
+        STATS_NOKEY(c, inflate_cache_hits);
+        return true;
+    }
+
+    if (dictionary_compressed(value, nbytes)) {
+        if (!dictionary_inflate(c, value, nbytes, dest, length)) {
+            return false;
+        }
+    } else if (snappy_uncompress(value, nbytes, dest, &length) != SNAPPY_OK) {
+        return false;
+    }
+
+    if (cache != NULL && settings.inflate_cache_size > 0) {
+        insert(cache, cas, value, nbytes, dest, length);
+        STATS_NOKEY(c, inflate_cache_misses);
+    }
+    return true;
+}
+
+struct inflate_cache *inflate_cache_create(void) {
+    return calloc(1, sizeof(struct inflate_cache));
+}
+
+void inflate_cache_destroy(struct inflate_cache *cache) {
+    if (cache != NULL) {
+        while (cache->tail != NULL) {
+            evict(cache, cache->tail);
+        }
+        free(cache);
+    }
+}
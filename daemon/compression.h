@@ -0,0 +1,61 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Snappy compression of the values stored (see the "compression_threshold"
+ * setting), and the per-thread cache of the inflated copies of compressed
+ * values handed to clients which don't support the datatype (see the
+ * "inflate_cache_size" setting).
+ */
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compress the value of a store into dest (a buffer from the thread's
+ * pool, which the caller has to release), with a dictionary if it's up
+ * to dictionary_compression_max. Returns false if the value isn't
+ * compressed, because it's below the threshold or wouldn't shrink enough
+ * to be worth inflating it again.
+ */
+bool compress_value(conn *c, const char *value, uint32_t nbytes,
+                    struct net_buf *dest);
+
+/*
+ * Compress a value into a buffer from malloc (sized for the worst case;
+ * *len is what was used). Returns NULL if it wouldn't shrink enough to
+ * be worth it.
+ */
+char *compress_value_copy(const char *value, size_t nbytes, size_t *len);
+
+/*
+ * Get the inflated size of a compressed value (with snappy or one of the
+ * dictionaries of dictionary.h). The cas of the item
+ * holding it is used to look up the value in the connection's thread's
+ * inflate cache.
+ */
+bool get_inflated_length(conn *c, uint64_t cas, const char *value,
+                         size_t nbytes, size_t *length);
+
+/*
+ * Inflate a compressed value into dest, which must hold the length
+ * returned by get_inflated_length(). The inflated value is kept in the
+ * inflate cache for the next time.
+ */
+bool inflate_value(conn *c, uint64_t cas, const char *value, size_t nbytes,
+                   char *dest, size_t length);
+
+struct inflate_cache *inflate_cache_create(void);
+void inflate_cache_destroy(struct inflate_cache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,6 +20,9 @@
 #include "config_parse.h"
 #include "connections.h"
 #include "runtime.h"
+#include "stream_compression.h"
+#include "workload_trace.h"
+#include "vbucket_stats.h"
 
 static void do_asprintf(char **strp, const char *fmt, ...)
 {
@@ -355,6 +358,21 @@ static bool get_threads(cJSON *o, struct settings *settings,
     }
 }
 
+static bool get_max_threads(cJSON *o, struct settings *settings,
+                            char **error_msg) {
+    int num;
+    if (!get_int_value(o, o->string, &num, error_msg)) {
+        return false;
+    }
+    if (num < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.max_threads = true;
+    settings->max_threads = num;
+    return true;
+}
+
 static bool get_max_packet_size(cJSON *o, struct settings *settings,
                                 char **error_msg) {
     int max_packet_size;
@@ -367,6 +385,92 @@ static bool get_max_packet_size(cJSON *o, struct settings *settings,
     }
 }
 
+static bool get_zerocopy_threshold(cJSON *o, struct settings *settings,
+                                   char **error_msg) {
+    int threshold;
+    if (!get_int_value(o, o->string, &threshold, error_msg)) {
+        return false;
+    }
+    if (threshold < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.zerocopy_threshold = true;
+    settings->zerocopy_threshold = (uint32_t)threshold;
+    return true;
+}
+
+static bool get_connection_dispatch(cJSON *o, struct settings *settings,
+                                    char **error_msg) {
+    const char *ptr = NULL;
+    bool ret = true;
+
+    if (!get_string_value(o, o->string, &ptr, error_msg)) {
+        return false;
+    }
+
+    if (strcmp(ptr, "round_robin") == 0) {
+        settings->connection_dispatch = DISPATCH_ROUND_ROBIN;
+    } else if (strcmp(ptr, "least_connections") == 0) {
+        settings->connection_dispatch = DISPATCH_LEAST_CONNECTIONS;
+    } else if (strcmp(ptr, "least_load") == 0) {
+        settings->connection_dispatch = DISPATCH_LEAST_LOAD;
+    } else if (strcmp(ptr, "incoming_cpu") == 0) {
+        settings->connection_dispatch = DISPATCH_INCOMING_CPU;
+    } else {
+        do_asprintf(error_msg, "Invalid value for %s: %s\n", o->string, ptr);
+        ret = false;
+    }
+    free((void*)ptr);
+
+    if (ret) {
+        settings->has.connection_dispatch = true;
+    }
+    return ret;
+}
+
+static bool get_hash_algorithm(cJSON *o, struct settings *settings,
+                               char **error_msg) {
+    const char *ptr = NULL;
+    bool ret = true;
+
+    if (!get_string_value(o, o->string, &ptr, error_msg)) {
+        return false;
+    }
+
+    if (strcmp(ptr, "jenkins") == 0) {
+        settings->hash_algorithm = HASH_JENKINS;
+    } else if (strcmp(ptr, "crc32c") == 0) {
+        settings->hash_algorithm = HASH_CRC32C;
+    } else {
+        do_asprintf(error_msg, "Invalid value for %s: %s\n", o->string, ptr);
+        ret = false;
+    }
+    free((void*)ptr);
+
+    if (ret) {
+        settings->has.hash_algorithm = true;
+    }
+    return ret;
+}
+
+static bool get_connection_migration_threshold(cJSON *o,
+                                               struct settings *settings,
+                                               char **error_msg) {
+    int threshold;
+    if (!get_int_value(o, o->string, &threshold, error_msg)) {
+        return false;
+    }
+    if (threshold < 0 || threshold > 100) {
+        do_asprintf(error_msg, "%s must be a percentage (0-100)\n",
+                    o->string);
+        return false;
+    }
+    settings->has.connection_migration_threshold = true;
+    settings->connection_migration_threshold = (uint32_t)threshold;
+    return true;
+}
+
 static bool get_verbosity(cJSON *o, struct settings *settings,
                           char **error_msg) {
     if (get_int_value(o, o->string, &settings->verbose, error_msg)) {
@@ -427,177 +531,837 @@ static bool get_require_init(cJSON *o, struct settings *settings,
     }
 }
 
-static bool get_require_sasl(cJSON *o, struct settings *settings,
-                             char **error_msg) {
-    if (get_bool_value(o, o->string, &settings->require_sasl, error_msg)) {
-        settings->has.require_sasl = true;
+static bool get_reuseport(cJSON *o, struct settings *settings,
+                          char **error_msg) {
+    if (get_bool_value(o, o->string, &settings->reuseport, error_msg)) {
+        settings->has.reuseport = true;
         return true;
     } else {
         return false;
     }
 }
 
-static bool get_extension(cJSON *r, struct extension_settings *ext_settings,
-                          char **error_msg) {
-    if (r->type == cJSON_Object) {
-        cJSON *p = r->child;
-        while (p != NULL) {
-            if (strcasecmp("module", p->string) == 0) {
-                if (!get_string_value(p, "extension module",
-                                      &ext_settings->soname, error_msg)) {
-                    return false;
-                }
-            } else if (strcasecmp("config", p->string) == 0) {
-                if (!get_string_value(p, "extension config",
-                                      &ext_settings->config, error_msg)) {
-                    return false;
-                }
-            } else {
-                do_asprintf(error_msg, "Unknown attribute for extension: %s\n",
-                            p->string);
-                return false;
-            }
-            p = p->next;
-        }
-        return true;
-    } else {
-        do_asprintf(error_msg, "Invalid entry for extension\n");
+static bool get_response_coalescing_usec(cJSON *o, struct settings *settings,
+                                         char **error_msg) {
+    int usec;
+    if (!get_int_value(o, o->string, &usec, error_msg)) {
         return false;
     }
+    if (usec < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.response_coalescing_usec = true;
+    settings->response_coalescing_usec = (uint32_t)usec;
+    return true;
 }
 
-static bool get_extensions(cJSON *o, struct settings *settings,
-                           char **error_msg) {
-    /* extensions is supposed to be a sub group */
-    settings->num_pending_extensions = cJSON_GetArraySize(o);
-    cJSON *e = o->child;
-    int ii = 0;
+static bool get_direct_receive_size(cJSON *o, struct settings *settings,
+                                    char **error_msg) {
+    int size;
+    if (!get_int_value(o, o->string, &size, error_msg)) {
+        return false;
+    }
+    if (size < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.direct_receive_size = true;
+    settings->direct_receive_size = (uint32_t)size;
+    return true;
+}
 
-    settings->pending_extensions = calloc(settings->num_pending_extensions,
-                                          sizeof(struct extension_settings));
+static bool get_max_outstanding_commands(cJSON *o, struct settings *settings,
+                                         char **error_msg) {
+    int max;
+    if (!get_int_value(o, o->string, &max, error_msg)) {
+        return false;
+    }
+    if (max < 0 || max > MAX_OUTSTANDING_COMMANDS) {
+        do_asprintf(error_msg, "%s must be in the range 0 - %d\n", o->string,
+                    MAX_OUTSTANDING_COMMANDS);
+        return false;
+    }
+    settings->has.max_outstanding_commands = true;
+    settings->max_outstanding_commands = (uint32_t)max;
+    return true;
+}
 
-    while (e != NULL) {
-        if (!get_extension(e, &settings->pending_extensions[ii], error_msg)) {
-            return false;
-        }
-        ++ii;
-        e = e->next;
+static bool get_compression_threshold(cJSON *o, struct settings *settings,
+                                      char **error_msg) {
+    int threshold;
+    if (!get_int_value(o, o->string, &threshold, error_msg)) {
+        return false;
     }
-    settings->has.extensions = true;
+    if (threshold < 0 ||
+        (threshold > 0 && threshold < MIN_COMPRESSION_THRESHOLD)) {
+        do_asprintf(error_msg, "%s must be 0 or at least %d\n", o->string,
+                    MIN_COMPRESSION_THRESHOLD);
+        return false;
+    }
+    settings->has.compression_threshold = true;
+    settings->compression_threshold = (uint32_t)threshold;
     return true;
 }
 
-static bool get_engine(cJSON *r, struct settings *settings, char **error_msg) {
-    const char *module = NULL;
-    const char *config = NULL;
-    if (r->type == cJSON_Object) {
-        cJSON *p = r->child;
-        while (p != NULL) {
-            if (strcasecmp("module", p->string) == 0) {
-                if (!get_string_value(p, "engine module", &module,
-                                      error_msg)) {
-                    return false;
-                }
-            } else if (strcasecmp("config", p->string) == 0) {
-                if (!get_string_value(p, "engine config", &config,
-                                      error_msg)) {
-                    return false;
-                }
-            } else {
-                do_asprintf(error_msg, "Unknown attribute for engine: %s\n",
-                            p->string);
-                return false;
-            }
-            p = p->next;
-        }
+static bool get_inflate_cache_size(cJSON *o, struct settings *settings,
+                                   char **error_msg) {
+    int size;
+    if (!get_int_value(o, o->string, &size, error_msg)) {
+        return false;
+    }
+    if (size < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.inflate_cache_size = true;
+    settings->inflate_cache_size = (uint32_t)size;
+    return true;
+}
 
-        if (module == NULL) {
-            do_asprintf(error_msg,
-                        "Mandatory attribute module not specified for engine\n");
-            return false;
-        }
+static bool get_dictionary_compression_max(cJSON *o, struct settings *settings,
+                                           char **error_msg) {
+    int max;
+    if (!get_int_value(o, o->string, &max, error_msg)) {
+        return false;
+    }
+    if (max < 0 || max > MAX_DICTIONARY_COMPRESSION) {
+        do_asprintf(error_msg, "%s must be in the range 0 - %d\n", o->string,
+                    MAX_DICTIONARY_COMPRESSION);
+        return false;
+    }
+    settings->has.dictionary_compression_max = true;
+    settings->dictionary_compression_max = (uint32_t)max;
+    return true;
+}
 
-        settings->engine_module = module;
-        settings->engine_config = config;
-        settings->has.engine = true;
-        return true;
-    } else {
-        do_asprintf(error_msg, "Invalid entry for engine\n");
+static bool get_stream_compression_level(cJSON *o, struct settings *settings,
+                                         char **error_msg) {
+    int level;
+    if (!get_int_value(o, o->string, &level, error_msg)) {
+        return false;
+    }
+    if (level < 0 || level > STREAM_COMPRESSION_MAX_LEVEL) {
+        do_asprintf(error_msg, "%s must be in the range 0 - %d\n", o->string,
+                    STREAM_COMPRESSION_MAX_LEVEL);
         return false;
     }
+    settings->has.stream_compression_level = true;
+    settings->stream_compression_level = (uint32_t)level;
+    return true;
 }
 
-/**
- * The callback function for an interface configuration section.
- * @param ii the interface index.
- * @param r the object containing the configuration value
- * @param iface The interface settings object to update.
- * @error_msg if parsing failed, set to a string describing the error. Note: it
- *            is the caller's responsibility to free() this.
- * @return true if parsed successfully, else false.
- */
-typedef bool (*interface_handler)(int ii, cJSON *r, struct interface* iface,
-                                  char **erro_msg);
+static bool get_dictionary_file(cJSON *o, struct settings *settings,
+                                char **error_msg) {
+    bool ret;
 
-static bool get_interface_maxconn(int idx, cJSON *r, struct interface* iface,
-                                  char **error_msg) {
-    return get_int_value(r, "interface maxconn", &iface->maxconn, error_msg);
+    /* Unlike the other files it's created (when the first one's trained) */
+    if (o->type != cJSON_String || o->valuestring[0] == '\0') {
+        do_asprintf(error_msg, "Invalid value specified for %s\n", o->string);
+        return false;
+    }
+
+    ret = get_absolute_file(o->valuestring, &settings->dictionary_file,
+                            error_msg);
+    settings->has.dictionary_file = ret;
+    return ret;
 }
 
-static bool get_interface_port(int idx, cJSON *r, struct interface* iface,
-                               char **error_msg) {
-    return get_in_port_value(r, "interface port", &iface->port, error_msg);
+static bool get_subdoc_index_cache_size(cJSON *o, struct settings *settings,
+                                        char **error_msg) {
+    int size;
+    if (!get_int_value(o, o->string, &size, error_msg)) {
+        return false;
+    }
+    if (size < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.subdoc_index_cache_size = true;
+    settings->subdoc_index_cache_size = (uint32_t)size;
+    return true;
 }
 
-static bool get_interface_backlog(int idx, cJSON *r, struct interface* iface,
-                                  char **error_msg) {
-    return get_int_value(r, "interface backlog", &iface->backlog, error_msg);
+static bool get_prefetch_depth(cJSON *o, struct settings *settings,
+                               char **error_msg) {
+    int depth;
+    if (!get_int_value(o, o->string, &depth, error_msg)) {
+        return false;
+    }
+    if (depth < 0 || depth > MAX_PREFETCH_DEPTH) {
+        do_asprintf(error_msg, "%s must be in the range 0 - %d\n", o->string,
+                    MAX_PREFETCH_DEPTH);
+        return false;
+    }
+    settings->has.prefetch_depth = true;
+    settings->prefetch_depth = (uint32_t)depth;
+    return true;
 }
 
-static bool get_interface_tcp_nodelay(int idx, cJSON *o,
-                                      struct interface* iface,
-                                      char **error_msg) {
-    return get_bool_value(o, o->string, &iface->tcp_nodelay, error_msg);
+static bool get_arena_per_thread(cJSON *o, struct settings *settings,
+                                 char **error_msg) {
+    if (get_bool_value(o, o->string, &settings->arena_per_thread,
+                       error_msg)) {
+        settings->has.arena_per_thread = true;
+        return true;
+    }
+    return false;
 }
 
-static bool get_interface_ipv4(int idx, cJSON *r, struct interface* iface,
-                               char **error_msg) {
-    return get_bool_value(r, r->string, &iface->ipv4, error_msg);
+static bool get_thread_affinity(cJSON *o, struct settings *settings,
+                                char **error_msg) {
+    const char *ptr = NULL;
+    int cpus[CONFIG_MAX_CPUS];
+
+    if (!get_string_value(o, o->string, &ptr, error_msg)) {
+        return false;
+    }
+
+    if (strcmp(ptr, "none") == 0) {
+        free((void*)ptr);
+        ptr = NULL;
+    } else if (strcmp(ptr, "auto") != 0 &&
+               config_parse_cpu_list(ptr, cpus, CONFIG_MAX_CPUS) == -1) {
+        do_asprintf(error_msg, "%s must be none, auto or a list of CPUs "
+                    "below %d: %s\n", o->string, CONFIG_MAX_CPUS, ptr);
+        free((void*)ptr);
+        return false;
+    }
+
+    free((void*)settings->thread_affinity);
+    settings->thread_affinity = ptr;
+    settings->has.thread_affinity = true;
+    return true;
 }
 
-static bool get_interface_ipv6(int idx, cJSON *r, struct interface* iface,
+static bool get_busy_poll_usec(cJSON *o, struct settings *settings,
                                char **error_msg) {
-    return get_bool_value(r, r->string, &iface->ipv6, error_msg);
+    int usec;
+    if (!get_int_value(o, o->string, &usec, error_msg)) {
+        return false;
+    }
+    if (usec < 0 || usec > 1000000) {
+        do_asprintf(error_msg, "%s must be between 0 and 1000000\n",
+                    o->string);
+        return false;
+    }
+    settings->has.busy_poll_usec = true;
+    settings->busy_poll_usec = (uint32_t)usec;
+    return true;
 }
 
-static bool get_interface_host(int idx, cJSON *r, struct interface* iface,
-                               char **error_msg) {
-    const char* host;
-    if (!get_host_value(r, "interface host", &host, error_msg)) {
+static bool get_io_uring(cJSON *o, struct settings *settings,
+                         char **error_msg) {
+    if (get_bool_value(o, o->string, &settings->io_uring, error_msg)) {
+        settings->has.io_uring = true;
+        return true;
+    } else {
         return false;
     }
+}
 
-    iface->host = host;
+static bool get_stats_snapshot_msec(cJSON *o, struct settings *settings,
+                                    char **error_msg) {
+    int msec;
+    if (!get_int_value(o, o->string, &msec, error_msg)) {
+        return false;
+    }
+    if (msec < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.stats_snapshot_msec = true;
+    settings->stats_snapshot_msec = (uint32_t)msec;
     return true;
 }
 
-static bool get_interface_protocol(int idx, cJSON *r, struct interface* iface,
-                                   char **error_msg) {
-    if (!get_protocol_value(r, "interface protocol",
-                            &iface->protocol, error_msg)) {
+static bool get_dcp_threads(cJSON *o, struct settings *settings,
+                            char **error_msg) {
+    int num;
+    if (!get_int_value(o, o->string, &num, error_msg)) {
         return false;
     }
+    if (num < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.dcp_threads = true;
+    settings->num_dcp_threads = num;
     return true;
 }
 
-static bool get_interface_ssl(int idx, cJSON *r, struct interface* iface,
-                              char **error_msg) {
+static bool get_near_cache_items(cJSON *o, struct settings *settings,
+                                 char **error_msg) {
+    int num;
+    if (!get_int_value(o, o->string, &num, error_msg)) {
+        return false;
+    }
+    if (num < 0 || num > 65536) {
+        do_asprintf(error_msg, "%s must be between 0 and 65536\n",
+                    o->string);
+        return false;
+    }
+    settings->has.near_cache_items = true;
+    settings->near_cache_items = (uint32_t)num;
+    return true;
+}
+
+static bool get_scheduler_slice_usec(cJSON *o, struct settings *settings,
+                                     char **error_msg) {
+    int usec;
+    if (!get_int_value(o, o->string, &usec, error_msg)) {
+        return false;
+    }
+    if (usec < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.scheduler_slice_usec = true;
+    settings->scheduler_slice_usec = (uint32_t)usec;
+    return true;
+}
+
+static bool get_max_slice_usec(cJSON *o, struct settings *settings,
+                               char **error_msg) {
+    int usec;
+    if (!get_int_value(o, o->string, &usec, error_msg)) {
+        return false;
+    }
+    if (usec < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.max_slice_usec = true;
+    settings->max_slice_usec = (uint32_t)usec;
+    return true;
+}
+
+static bool get_shed_inflight(cJSON *o, struct settings *settings,
+                              char **error_msg) {
+    int num;
+    if (!get_int_value(o, o->string, &num, error_msg)) {
+        return false;
+    }
+    if (num < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.shed_inflight = true;
+    settings->shed_inflight = (uint32_t)num;
+    return true;
+}
+
+static bool get_shed_delay_usec(cJSON *o, struct settings *settings,
+                                char **error_msg) {
+    int usec;
+    if (!get_int_value(o, o->string, &usec, error_msg)) {
+        return false;
+    }
+    if (usec < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.shed_delay_usec = true;
+    settings->shed_delay_usec = (uint32_t)usec;
+    return true;
+}
+
+static bool get_max_unsent_bytes(cJSON *o, struct settings *settings,
+                                 char **error_msg) {
+    int bytes;
+    if (!get_int_value(o, o->string, &bytes, error_msg)) {
+        return false;
+    }
+    if (bytes < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.max_unsent_bytes = true;
+    settings->max_unsent_bytes = (uint32_t)bytes;
+    return true;
+}
+
+static bool get_max_pinned_items(cJSON *o, struct settings *settings,
+                                 char **error_msg) {
+    int num;
+    if (!get_int_value(o, o->string, &num, error_msg)) {
+        return false;
+    }
+    if (num < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.max_pinned_items = true;
+    settings->max_pinned_items = (uint32_t)num;
+    return true;
+}
+
+static bool get_rate_limit_user_ops(cJSON *o, struct settings *settings,
+                                    char **error_msg) {
+    int num;
+    if (!get_int_value(o, o->string, &num, error_msg)) {
+        return false;
+    }
+    if (num < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.rate_limit_user_ops = true;
+    settings->rate_limit_user_ops = (uint32_t)num;
+    return true;
+}
+
+static bool get_rate_limit_user_bytes(cJSON *o, struct settings *settings,
+                                      char **error_msg) {
+    int num;
+    if (!get_int_value(o, o->string, &num, error_msg)) {
+        return false;
+    }
+    if (num < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.rate_limit_user_bytes = true;
+    settings->rate_limit_user_bytes = (uint32_t)num;
+    return true;
+}
+
+static bool get_rate_limit_bucket_ops(cJSON *o, struct settings *settings,
+                                      char **error_msg) {
+    int num;
+    if (!get_int_value(o, o->string, &num, error_msg)) {
+        return false;
+    }
+    if (num < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.rate_limit_bucket_ops = true;
+    settings->rate_limit_bucket_ops = (uint32_t)num;
+    return true;
+}
+
+static bool get_rate_limit_bucket_bytes(cJSON *o, struct settings *settings,
+                                        char **error_msg) {
+    int num;
+    if (!get_int_value(o, o->string, &num, error_msg)) {
+        return false;
+    }
+    if (num < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.rate_limit_bucket_bytes = true;
+    settings->rate_limit_bucket_bytes = (uint32_t)num;
+    return true;
+}
+
+static bool get_sasl_threads(cJSON *o, struct settings *settings,
+                             char **error_msg) {
+    int num;
+    if (!get_int_value(o, o->string, &num, error_msg)) {
+        return false;
+    }
+    if (num < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.sasl_threads = true;
+    settings->num_sasl_threads = num;
+    return true;
+}
+
+static bool get_trace_sample_rate(cJSON *o, struct settings *settings,
+                                  char **error_msg) {
+    int rate;
+    if (!get_int_value(o, o->string, &rate, error_msg)) {
+        return false;
+    }
+    if (rate < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.trace_sample_rate = true;
+    settings->trace_sample_rate = (uint32_t)rate;
+    return true;
+}
+
+static bool get_phase_timings(cJSON *o, struct settings *settings,
+                              char **error_msg) {
+    if (!get_bool_value(o, o->string, &settings->phase_timings, error_msg)) {
+        return false;
+    }
+    settings->has.phase_timings = true;
+    return true;
+}
+
+static bool get_slow_command_threshold(cJSON *o, struct settings *settings,
+                                       char **error_msg) {
+    int msec;
+    if (!get_int_value(o, o->string, &msec, error_msg)) {
+        return false;
+    }
+    if (msec < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.slow_command_threshold = true;
+    settings->slow_command_threshold = (uint32_t)msec;
+    return true;
+}
+
+static bool get_idle_trim_sec(cJSON *o, struct settings *settings,
+                              char **error_msg) {
+    int sec;
+    if (!get_int_value(o, o->string, &sec, error_msg)) {
+        return false;
+    }
+    if (sec < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.idle_trim_sec = true;
+    settings->idle_trim_sec = (uint32_t)sec;
+    return true;
+}
+
+static bool get_idle_timeout(cJSON *o, struct settings *settings,
+                             char **error_msg) {
+    int sec;
+    if (!get_int_value(o, o->string, &sec, error_msg)) {
+        return false;
+    }
+    if (sec < 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.idle_timeout = true;
+    settings->idle_timeout = (uint32_t)sec;
+    return true;
+}
+
+static bool get_free_memory_release_pct(cJSON *o, struct settings *settings,
+                                        char **error_msg) {
+    int pct;
+    if (!get_int_value(o, o->string, &pct, error_msg)) {
+        return false;
+    }
+    if (pct < 0 || pct > 100) {
+        do_asprintf(error_msg, "%s must be a percentage (0-100)\n",
+                    o->string);
+        return false;
+    }
+    settings->has.free_memory_release_pct = true;
+    settings->free_memory_release_pct = (uint32_t)pct;
+    return true;
+}
+
+static bool get_free_memory_release_rate(cJSON *o, struct settings *settings,
+                                         char **error_msg) {
+    int rate;
+    if (!get_int_value(o, o->string, &rate, error_msg)) {
+        return false;
+    }
+    if (rate <= 0) {
+        do_asprintf(error_msg, "%s must be a positive number\n", o->string);
+        return false;
+    }
+    settings->has.free_memory_release_rate = true;
+    settings->free_memory_release_rate = (uint32_t)rate;
+    return true;
+}
+
+static bool get_gather_writes(cJSON *o, struct settings *settings,
+                              char **error_msg) {
+    if (!get_bool_value(o, o->string, &settings->gather_writes, error_msg)) {
+        return false;
+    }
+    settings->has.gather_writes = true;
+    return true;
+}
+
+static bool get_scripts_file(cJSON *o, struct settings *settings,
+                             char **error_msg) {
+    const char *ptr = NULL;
+    if (!get_file_value(o, "scripts file", &ptr, error_msg)) {
+        return false;
+    }
+
+    if (!get_absolute_file(ptr, &settings->scripts_file, error_msg)) {
+        return false;
+    }
+
+    settings->has.scripts_file = true;
+    return true;
+}
+
+static bool get_workload_trace_dir(cJSON *o, struct settings *settings,
+                                   char **error_msg) {
+    const char *ptr = NULL;
+    struct stat st;
+    if (!get_file_value(o, "trace directory", &ptr, error_msg)) {
+        return false;
+    }
+    if (stat(ptr, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        do_asprintf(error_msg, "\"%s\" specified for \"%s\" is not a "
+                    "directory\n", ptr, o->string);
+        return false;
+    }
+
+    if (!get_absolute_file(ptr, &settings->workload_trace_dir, error_msg)) {
+        return false;
+    }
+
+    settings->has.workload_trace_dir = true;
+    return true;
+}
+
+static bool get_workload_trace_file_size(cJSON *o, struct settings *settings,
+                                         char **error_msg) {
+    int size;
+    if (!get_int_value(o, o->string, &size, error_msg)) {
+        return false;
+    }
+    if (size < WORKLOAD_TRACE_MIN_FILE_SIZE) {
+        do_asprintf(error_msg, "%s must be at least %d\n", o->string,
+                    WORKLOAD_TRACE_MIN_FILE_SIZE);
+        return false;
+    }
+    settings->has.workload_trace_file_size = true;
+    settings->workload_trace_file_size = (uint32_t)size;
+    return true;
+}
+
+static bool get_vbucket_stats(cJSON *o, struct settings *settings,
+                              char **error_msg) {
+    int count;
+    if (!get_int_value(o, o->string, &count, error_msg)) {
+        return false;
+    }
+    if (count < 0 || count > VBUCKET_STATS_MAX) {
+        do_asprintf(error_msg, "%s must be in the range 0 - %d\n",
+                    o->string, VBUCKET_STATS_MAX);
+        return false;
+    }
+    settings->has.vbucket_stats = true;
+    settings->vbucket_stats = (uint32_t)count;
+    return true;
+}
+
+static bool get_workload_trace_sample(cJSON *o, struct settings *settings,
+                                      char **error_msg) {
+    int sample;
+    if (!get_int_value(o, o->string, &sample, error_msg)) {
+        return false;
+    }
+    if (sample < 0) {
+        do_asprintf(error_msg, "%s can't be negative\n", o->string);
+        return false;
+    }
+    settings->has.workload_trace_sample = true;
+    settings->workload_trace_sample = (uint32_t)sample;
+    return true;
+}
+
+static bool get_require_sasl(cJSON *o, struct settings *settings,
+                             char **error_msg) {
+    if (get_bool_value(o, o->string, &settings->require_sasl, error_msg)) {
+        settings->has.require_sasl = true;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+static bool get_extension(cJSON *r, struct extension_settings *ext_settings,
+                          char **error_msg) {
+    if (r->type == cJSON_Object) {
+        cJSON *p = r->child;
+        while (p != NULL) {
+            if (strcasecmp("module", p->string) == 0) {
+                if (!get_string_value(p, "extension module",
+                                      &ext_settings->soname, error_msg)) {
+                    return false;
+                }
+            } else if (strcasecmp("config", p->string) == 0) {
+                if (!get_string_value(p, "extension config",
+                                      &ext_settings->config, error_msg)) {
+                    return false;
+                }
+            } else {
+                do_asprintf(error_msg, "Unknown attribute for extension: %s\n",
+                            p->string);
+                return false;
+            }
+            p = p->next;
+        }
+        return true;
+    } else {
+        do_asprintf(error_msg, "Invalid entry for extension\n");
+        return false;
+    }
+}
+
+static bool get_extensions(cJSON *o, struct settings *settings,
+                           char **error_msg) {
+    /* extensions is supposed to be a sub group */
+    settings->num_pending_extensions = cJSON_GetArraySize(o);
+    cJSON *e = o->child;
+    int ii = 0;
+
+    settings->pending_extensions = calloc(settings->num_pending_extensions,
+                                          sizeof(struct extension_settings));
+
+    while (e != NULL) {
+        if (!get_extension(e, &settings->pending_extensions[ii], error_msg)) {
+            return false;
+        }
+        ++ii;
+        e = e->next;
+    }
+    settings->has.extensions = true;
+    return true;
+}
+
+static bool get_engine(cJSON *r, struct settings *settings, char **error_msg) {
+    const char *module = NULL;
+    const char *config = NULL;
+    if (r->type == cJSON_Object) {
+        cJSON *p = r->child;
+        while (p != NULL) {
+            if (strcasecmp("module", p->string) == 0) {
+                if (!get_string_value(p, "engine module", &module,
+                                      error_msg)) {
+                    return false;
+                }
+            } else if (strcasecmp("config", p->string) == 0) {
+                if (!get_string_value(p, "engine config", &config,
+                                      error_msg)) {
+                    return false;
+                }
+            } else {
+                do_asprintf(error_msg, "Unknown attribute for engine: %s\n",
+                            p->string);
+                return false;
+            }
+            p = p->next;
+        }
+
+        if (module == NULL) {
+            do_asprintf(error_msg,
+                        "Mandatory attribute module not specified for engine\n");
+            return false;
+        }
+
+        settings->engine_module = module;
+        settings->engine_config = config;
+        settings->has.engine = true;
+        return true;
+    } else {
+        do_asprintf(error_msg, "Invalid entry for engine\n");
+        return false;
+    }
+}
+
+/**
+ * The callback function for an interface configuration section.
+ * @param ii the interface index.
+ * @param r the object containing the configuration value
+ * @param iface The interface settings object to update.
+ * @error_msg if parsing failed, set to a string describing the error. Note: it
+ *            is the caller's responsibility to free() this.
+ * @return true if parsed successfully, else false.
+ */
+typedef bool (*interface_handler)(int ii, cJSON *r, struct interface* iface,
+                                  char **erro_msg);
+
+static bool get_interface_maxconn(int idx, cJSON *r, struct interface* iface,
+                                  char **error_msg) {
+    return get_int_value(r, "interface maxconn", &iface->maxconn, error_msg);
+}
+
+static bool get_interface_port(int idx, cJSON *r, struct interface* iface,
+                               char **error_msg) {
+    return get_in_port_value(r, "interface port", &iface->port, error_msg);
+}
+
+static bool get_interface_backlog(int idx, cJSON *r, struct interface* iface,
+                                  char **error_msg) {
+    return get_int_value(r, "interface backlog", &iface->backlog, error_msg);
+}
+
+static bool get_interface_tcp_nodelay(int idx, cJSON *o,
+                                      struct interface* iface,
+                                      char **error_msg) {
+    return get_bool_value(o, o->string, &iface->tcp_nodelay, error_msg);
+}
+
+static bool get_interface_ipv4(int idx, cJSON *r, struct interface* iface,
+                               char **error_msg) {
+    return get_bool_value(r, r->string, &iface->ipv4, error_msg);
+}
+
+static bool get_interface_ipv6(int idx, cJSON *r, struct interface* iface,
+                               char **error_msg) {
+    return get_bool_value(r, r->string, &iface->ipv6, error_msg);
+}
+
+static bool get_interface_host(int idx, cJSON *r, struct interface* iface,
+                               char **error_msg) {
+    const char* host;
+    if (!get_host_value(r, "interface host", &host, error_msg)) {
+        return false;
+    }
+
+    iface->host = host;
+    return true;
+}
+
+static bool get_interface_protocol(int idx, cJSON *r, struct interface* iface,
+                                   char **error_msg) {
+    if (!get_protocol_value(r, "interface protocol",
+                            &iface->protocol, error_msg)) {
+        return false;
+    }
+    return true;
+}
+
+static bool get_interface_path(int idx, cJSON *r, struct interface* iface,
+                               char **error_msg) {
+    const char *path;
+    if (!get_string_value(r, "interface path", &path, error_msg)) {
+        return false;
+    }
+    if (path[0] == '\0' || strcmp(path, "@") == 0) {
+        do_asprintf(error_msg, "interface path must name a socket\n");
+        free((void*)path);
+        return false;
+    }
+
+    free((void*)iface->path);
+    iface->path = path;
+    return true;
+}
+
+static bool get_interface_peercred(int idx, cJSON *r, struct interface* iface,
+                                   char **error_msg) {
+    return get_bool_value(r, r->string, &iface->peercred, error_msg);
+}
+
+static bool get_interface_ssl(int idx, cJSON *r, struct interface* iface,
+                              char **error_msg) {
     const char *cert = NULL;
     const char *key = NULL;
+    bool ktls = false;
     if (r->type == cJSON_Object) {
         cJSON *p = r->child;
         while (p != NULL) {
-            if (strcasecmp("key", p->string) == 0) {
+            if (strcasecmp("ktls", p->string) == 0) {
+                if (!get_bool_value(p, "interface ssl ktls", &ktls,
+                                    error_msg)) {
+                    return false;
+                }
+            } else if (strcasecmp("key", p->string) == 0) {
                 if (!get_file_value(p, "interface key file", &key, error_msg)) {
                     return false;
                 }
@@ -621,6 +1385,7 @@ static bool get_interface_ssl(int idx, cJSON *r, struct interface* iface,
             if (!get_absolute_file(cert, &iface->ssl.cert, error_msg)) {
                 return false;
             }
+            iface->ssl.ktls = ktls;
         } else if (key || cert) {
             do_asprintf(error_msg, "You need to specify a value for cert and key\n");
             return false;
@@ -655,6 +1420,8 @@ static bool handle_interface(int idx, cJSON *r, struct interface* iface_list,
             { "tcp_nodelay", get_interface_tcp_nodelay },
             { "ssl", get_interface_ssl },
             { "protocol", get_interface_protocol },
+            { "path", get_interface_path },
+            { "peercred", get_interface_peercred },
             { NULL, NULL }
         };
         cJSON *obj = r->child;
@@ -677,422 +1444,987 @@ static bool handle_interface(int idx, cJSON *r, struct interface* iface_list,
                 }
             }
 
-            obj = obj->next;
-        }
+            obj = obj->next;
+        }
+
+        /* Perform additional checks on inter-related attributes */
+        if (!iface->ipv4 && !iface->ipv6) {
+            do_asprintf(error_msg,
+                        "IPv4 and IPv6 cannot be disabled at the same time\n");
+            return false;
+        }
+        if (iface->peercred && iface->path == NULL) {
+            do_asprintf(error_msg,
+                        "peercred needs a path for interface #%u\n", idx);
+            return false;
+        }
+        for (int ii = 0; ii < idx; ++ii) {
+            if (iface_list[ii].port == iface->port) {
+                /* port numbers are used as a unique identified inside memcached
+                 * (see for example: get_listening_port_instance(). Check user
+                 * doesn't try to use the same number twice.
+                 */
+                do_asprintf(error_msg,
+                            "Port %d is already in use by interface[%d].\n",
+                            iface_list[ii].port, ii);
+                return false;
+            }
+        }
+        /* validate !!! */
+        return true;
+    } else {
+        do_asprintf(error_msg, "Invalid entry for interface #%u\n", idx);
+        return false;
+    }
+}
+
+static bool get_interfaces(cJSON *o, struct settings *settings,
+                           char **error_msg) {
+    int total = cJSON_GetArraySize(o);
+    cJSON *c = o->child;
+    int ii = 0;
+
+    settings->interfaces = calloc(total, sizeof(struct interface));
+    settings->num_interfaces = total;
+    while (c != NULL) {
+        if (!handle_interface(ii, c, settings->interfaces, error_msg)) {
+            return false;
+        }
+        ++ii;
+        c = c->next;
+    }
+    settings->has.interfaces = true;
+    return true;
+}
+
+static bool get_bio_drain_sz(cJSON *i, struct settings *settings,
+                                    char **error_msg) {
+    int buffer_sz;
+    if (!get_int_value(i, "bio_drain_buffer_sz", &buffer_sz, error_msg)) {
+        return false;
+    } else {
+        settings->bio_drain_buffer_sz = (size_t)buffer_sz;
+        settings->has.bio_drain_buffer_sz = true;
+        return true;
+    }
+}
+
+static bool get_datatype(cJSON *o, struct settings *settings,
+                         char **error_msg) {
+    if (get_bool_value(o, o->string, &settings->datatype, error_msg)) {
+        settings->has.datatype = true;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+static bool parse_breakpad(cJSON *o, struct settings *settings,
+                           char** error_msg) {
+    if (o->type != cJSON_Object) {
+        do_asprintf(error_msg, "Invalid entry for breakpad - expected object.\n");
+        return false;
+    }
+
+    // Breakpad config defaults:
+    bool enabled = false;
+    const char* minidump_dir = NULL;
+    breakpad_content_t content = CONTENT_DEFAULT;
+    bool helper = false;
+
+    const char* content_str = NULL;
+    bool error = false;
+
+
+    for(cJSON *p = o->child; p != NULL && error == false; p = p->next) {
+        if (strcasecmp("enabled", p->string) == 0) {
+            if (!get_bool_value(p, "breapad enabled", &enabled,
+                                  error_msg)) {
+                error = true;
+            }
+        } else if (strcasecmp("minidump_dir", p->string) == 0) {
+            if (!get_string_value(p, "breakpad minidump_dir", &minidump_dir,
+                                  error_msg)) {
+                error = true;
+            }
+        } else if (strcasecmp("content", p->string) == 0) {
+            if (!get_string_value(p, "breakpad content", &content_str,
+                                  error_msg)) {
+                error = true;
+            }
+        } else if (strcasecmp("helper", p->string) == 0) {
+            if (!get_bool_value(p, "breakpad helper", &helper, error_msg)) {
+                error = true;
+            }
+        } else {
+            do_asprintf(error_msg, "Unknown attribute for breakpad: %s\n",
+                        p->string);
+            error = true;
+        }
+    }
+    if (error) {
+        free((char*)minidump_dir);
+        free((char*)content_str);
+        return false;
+    }
+
+    /* Validate parameters */
+    if (enabled) {
+        /* If 'enabled' was set, 'minidump_dir' must also be set. */
+        if (minidump_dir == NULL) {
+            do_asprintf(error_msg,
+                        "breakpad.enabled==true but minidump_dir not specified.\n");
+            error = true;
+        }
+    }
+    if (!error && content_str) {
+        if (strcmp(content_str, "default") == 0) {
+            content = CONTENT_DEFAULT;
+        } else if (strcmp(content_str, "minimal") == 0) {
+            content = CONTENT_MINIMAL;
+        } else {
+            do_asprintf(error_msg, "Invalid value for breakpad.content: %s\n",
+                        content_str);
+            error = true;
+        }
+        /* String converted to enum, no longer needed. */
+        free((char*)content_str);
+    }
+    if (error) {
+        free((char*)minidump_dir);
+        return false;
+    }
+
+    // Allow runtime-disabling of Breakpad if CB_DISABLE_BREAKPAD is set.
+    if (getenv("CB_DISABLE_BREAKPAD") != NULL) {
+        enabled = false;
+    }
+
+    /* Validated, update settings. */
+    settings->breakpad.enabled = enabled;
+    /* Empty string (as opposed to NULL string) used here to simplify compare
+       logic when checking for differences in breakpad config. */
+    settings->breakpad.minidump_dir = minidump_dir ? minidump_dir
+                                                   : strdup("");
+    settings->breakpad.content = content;
+    settings->breakpad.helper = helper;
+    settings->has.breakpad = true;
+    return true;
+}
+
+static bool parse_proxy(cJSON *o, struct settings *settings,
+                        char** error_msg) {
+    bool enabled = false;
+    const char *username = NULL;
+    const char *password = NULL;
+    int hedge_usec = 0;
+    bool error = false;
+
+    if (o->type != cJSON_Object) {
+        do_asprintf(error_msg, "Invalid entry for proxy - expected object.\n");
+        return false;
+    }
+
+    for (cJSON *p = o->child; p != NULL && error == false; p = p->next) {
+        if (strcasecmp("enabled", p->string) == 0) {
+            if (!get_bool_value(p, "proxy enabled", &enabled, error_msg)) {
+                error = true;
+            }
+        } else if (strcasecmp("username", p->string) == 0) {
+            free((char*)username);
+            if (!get_string_value(p, "proxy username", &username,
+                                  error_msg)) {
+                error = true;
+            }
+        } else if (strcasecmp("password", p->string) == 0) {
+            free((char*)password);
+            if (!get_string_value(p, "proxy password", &password,
+                                  error_msg)) {
+                error = true;
+            }
+        } else if (strcasecmp("hedge_usec", p->string) == 0) {
+            if (!get_int_value(p, "proxy hedge_usec", &hedge_usec,
+                               error_msg)) {
+                error = true;
+            } else if (hedge_usec < 0 || hedge_usec > 1000000) {
+                do_asprintf(error_msg,
+                            "Invalid value for proxy hedge_usec: %d\n",
+                            hedge_usec);
+                error = true;
+            }
+        } else {
+            do_asprintf(error_msg, "Unknown attribute for proxy: %s\n",
+                        p->string);
+            error = true;
+        }
+    }
+
+    /* The peers must not forward what they get from us again */
+    if (!error && enabled && (username == NULL || *username == '\0')) {
+        do_asprintf(error_msg,
+                    "proxy.enabled==true but username not specified.\n");
+        error = true;
+    }
+    if (error) {
+        free((char*)username);
+        free((char*)password);
+        return false;
+    }
+
+    free((char*)settings->proxy.username);
+    free((char*)settings->proxy.password);
+    settings->proxy.enabled = enabled;
+    settings->proxy.hedge_usec = (uint32_t)hedge_usec;
+    settings->proxy.username = username ? username : strdup("");
+    settings->proxy.password = password ? password : strdup("");
+    settings->has.proxy = true;
+    return true;
+}
+
+/* reconfig (dynamic config update) handlers *********************************/
+
+typedef bool (*dynamic_validate_handler)(const struct settings *new_settings,
+                                         cJSON* errors);
+
+typedef void (*dynamic_reconfig_handler)(const struct settings *new_settings);
+
+static bool dyna_validate_admin(const struct settings *new_settings,
+                                cJSON* errors) {
+    if (!new_settings->has.admin) {
+        return true;
+    }
+    if (settings.admin != NULL &&
+        new_settings->admin != NULL &&
+        strcmp(new_settings->admin, settings.admin) == 0) {
+        return true;
+    } else if (settings.admin == NULL && new_settings->admin == NULL) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'admin' is not a dynamic setting."));
+        return false;
+    }
+}
+
+static bool dyna_validate_rbac_file(const struct settings *new_settings,
+                                    cJSON* errors) {
+    if (!new_settings->has.rbac) {
+        return true;
+    }
+
+    if (settings.rbac_file != NULL &&
+        new_settings->rbac_file != NULL &&
+        strcmp(new_settings->rbac_file, settings.rbac_file) == 0) {
+        return true;
+    } else if (settings.rbac_file == NULL && new_settings->rbac_file == NULL) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'rbac_file' is not a dynamic setting."));
+        return false;
+    }
+}
+
+static bool dyna_validate_rbac_privilege_debug(const struct settings *new_settings,
+                                               cJSON* errors) {
+    return true;
+}
 
-        /* Perform additional checks on inter-related attributes */
-        if (!iface->ipv4 && !iface->ipv6) {
-            do_asprintf(error_msg,
-                        "IPv4 and IPv6 cannot be disabled at the same time\n");
-            return false;
-        }
-        for (int ii = 0; ii < idx; ++ii) {
-            if (iface_list[ii].port == iface->port) {
-                /* port numbers are used as a unique identified inside memcached
-                 * (see for example: get_listening_port_instance(). Check user
-                 * doesn't try to use the same number twice.
-                 */
-                do_asprintf(error_msg,
-                            "Port %d is already in use by interface[%d].\n",
-                            iface_list[ii].port, ii);
-                return false;
-            }
-        }
-        /* validate !!! */
+static bool dyna_validate_audit_file(const struct settings *new_settings,
+                                    cJSON* errors) {
+    if (!new_settings->has.audit) {
+        return true;
+    }
+
+    if (settings.audit_file != NULL &&
+        new_settings->audit_file != NULL &&
+        strcmp(new_settings->audit_file, settings.audit_file) == 0) {
+        return true;
+    } else if (settings.audit_file == NULL && new_settings->audit_file == NULL) {
         return true;
     } else {
-        do_asprintf(error_msg, "Invalid entry for interface #%u\n", idx);
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'audit_file' is not a dynamic setting."));
         return false;
     }
 }
 
-static bool get_interfaces(cJSON *o, struct settings *settings,
-                           char **error_msg) {
-    int total = cJSON_GetArraySize(o);
-    cJSON *c = o->child;
-    int ii = 0;
+static bool dyna_validate_root(const struct settings *new_settings,
+                               cJSON* errors) {
+    if (!new_settings->has.root) {
+        return true;
+    }
 
-    settings->interfaces = calloc(total, sizeof(struct interface));
-    settings->num_interfaces = total;
-    while (c != NULL) {
-        if (!handle_interface(ii, c, settings->interfaces, error_msg)) {
-            return false;
-        }
-        ++ii;
-        c = c->next;
+    if (settings.root != NULL &&
+        new_settings->root != NULL &&
+        strcmp(new_settings->root, settings.root) == 0) {
+        return true;
+    } else if (settings.root == NULL && new_settings->root == NULL) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'root' is not a dynamic setting."));
+        return false;
     }
-    settings->has.interfaces = true;
+}
+
+static bool dyna_validate_ssl_cipher_list(const struct settings *new_settings,
+                                          cJSON* errors) {
+    /* Its dynamic :-) */
     return true;
 }
 
-static bool get_bio_drain_sz(cJSON *i, struct settings *settings,
-                                    char **error_msg) {
-    int buffer_sz;
-    if (!get_int_value(i, "bio_drain_buffer_sz", &buffer_sz, error_msg)) {
+static bool dyna_validate_threads(const struct settings *new_settings,
+                                  cJSON* errors) {
+    if (!new_settings->has.threads ||
+        new_settings->num_threads == settings.num_threads) {
+        return true;
+    }
+    if (settings.reuseport) {
+        /* Every worker thread owns listeners of its own */
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'num_threads' cannot change dynamically with 'reuseport'."));
         return false;
-    } else {
-        settings->bio_drain_buffer_sz = (size_t)buffer_sz;
-        settings->has.bio_drain_buffer_sz = true;
+    }
+    if (new_settings->num_threads < 1 ||
+        new_settings->num_threads > settings.max_threads) {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'num_threads' must be between 1 and 'max_threads'."));
+        return false;
+    }
+    return true;
+}
+
+static bool dyna_validate_max_threads(const struct settings *new_settings,
+                                      cJSON* errors) {
+    int num_threads = new_settings->has.threads ?
+        new_settings->num_threads : settings.num_threads;
+
+    /*
+     * The worker thread slots are set up at startup, the setting may only
+     * go as low as "threads" (which is what it's raised to anyway).
+     */
+    if (!new_settings->has.max_threads ||
+        new_settings->max_threads == settings.max_threads ||
+        (new_settings->max_threads < settings.max_threads &&
+         new_settings->max_threads <= num_threads)) {
         return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'max_threads' is not a dynamic setting."));
+        return false;
     }
 }
 
-static bool get_datatype(cJSON *o, struct settings *settings,
-                         char **error_msg) {
-    if (get_bool_value(o, o->string, &settings->datatype, error_msg)) {
-        settings->has.datatype = true;
+static bool dyna_validate_max_packet_size(const struct settings *new_settings,
+                                  cJSON* errors) {
+    /* Checked against every packet received from now on */
+    return true;
+}
+
+static bool dyna_validate_zerocopy_threshold(const struct settings *new_settings,
+                                             cJSON* errors) {
+    if (!new_settings->has.zerocopy_threshold) {
+        return true;
+    }
+    if (new_settings->zerocopy_threshold == settings.zerocopy_threshold) {
         return true;
     } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'zerocopy_threshold' is not a dynamic setting."));
         return false;
     }
 }
 
-static bool parse_breakpad(cJSON *o, struct settings *settings,
-                           char** error_msg) {
-    if (o->type != cJSON_Object) {
-        do_asprintf(error_msg, "Invalid entry for breakpad - expected object.\n");
+static bool dyna_validate_connection_dispatch(const struct settings *new_settings,
+                                              cJSON* errors) {
+    /* Only affects the connections accepted from now on */
+    return true;
+}
+
+static bool dyna_validate_hash_algorithm(const struct settings *new_settings,
+                                         cJSON* errors) {
+    if (!new_settings->has.hash_algorithm) {
+        return true;
+    }
+    if (new_settings->hash_algorithm == settings.hash_algorithm) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'hash_algorithm' is not a dynamic setting."));
         return false;
     }
+}
 
-    // Breakpad config defaults:
-    bool enabled = false;
-    const char* minidump_dir = NULL;
-    breakpad_content_t content = CONTENT_DEFAULT;
+static bool dyna_validate_connection_migration_threshold(const struct settings *new_settings,
+                                                         cJSON* errors) {
+    /* Picked up by the rebalancer on its next run */
+    return true;
+}
 
-    const char* content_str = NULL;
-    bool error = false;
+/* Do the interfaces bind to the same addresses (hosts "*" and none alike) */
+static bool same_iface_address(const struct interface *a,
+                               const struct interface *b) {
+    const char *ha = a->host != NULL && strcmp(a->host, "*") != 0 ? a->host : "";
+    const char *hb = b->host != NULL && strcmp(b->host, "*") != 0 ? b->host : "";
+    return strcmp(ha, hb) == 0 && a->ipv4 == b->ipv4 && a->ipv6 == b->ipv6;
+}
 
+static bool dyna_validate_interfaces(const struct settings *new_settings,
+                                     cJSON* errors) {
+    bool valid = false;
+    if (!new_settings->has.interfaces) {
+        return true;
+    }
 
-    for(cJSON *p = o->child; p != NULL && error == false; p = p->next) {
-        if (strcasecmp("enabled", p->string) == 0) {
-            if (!get_bool_value(p, "breapad enabled", &enabled,
-                                  error_msg)) {
-                error = true;
+    /* parts of interface are dynamic, but not the overall number or name... */
+    if (new_settings->num_interfaces == settings.num_interfaces) {
+        char* tempstr = NULL;
+        valid = true;
+        int ii = 0;
+        for (ii = 0; ii < settings.num_interfaces; ii++) {
+            struct interface *cur_if = &settings.interfaces[ii];
+            struct interface *new_if = &new_settings->interfaces[ii];
+
+            /*
+             * The address may change (the listeners are replaced), but
+             * the connections are accounted to the port
+             */
+            if (settings.reuseport && !same_iface_address(new_if, cur_if)) {
+                do_asprintf(&tempstr,
+                            "interface '%d' cannot change host, IPv4 or IPv6 dynamically with 'reuseport'.",
+                            ii);
+                cJSON_AddItemToArray(errors, cJSON_CreateString(tempstr));
+                free(tempstr);
+                valid = false;
             }
-        } else if (strcasecmp("minidump_dir", p->string) == 0) {
-            if (!get_string_value(p, "breakpad minidump_dir", &minidump_dir,
-                                  error_msg)) {
-                error = true;
+            if (new_if->port != cur_if->port) {
+                do_asprintf(&tempstr,
+                            "interface '%d' cannot change port dynamically.",
+                            ii);
+                cJSON_AddItemToArray(errors, cJSON_CreateString(tempstr));
+                free(tempstr);
+                valid = false;
             }
-        } else if (strcasecmp("content", p->string) == 0) {
-            if (!get_string_value(p, "breakpad content", &content_str,
-                                  error_msg)) {
-                error = true;
+            if ((new_if->path == NULL) != (cur_if->path == NULL) ||
+                (new_if->path != NULL &&
+                 strcmp(new_if->path, cur_if->path) != 0) ||
+                new_if->peercred != cur_if->peercred) {
+                do_asprintf(&tempstr,
+                            "interface '%d' cannot change path or peercred dynamically.",
+                            ii);
+                cJSON_AddItemToArray(errors, cJSON_CreateString(tempstr));
+                free(tempstr);
+                valid = false;
             }
-        } else {
-            do_asprintf(error_msg, "Unknown attribute for breakpad: %s\n",
-                        p->string);
-            error = true;
         }
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("Number of interfaces cannot change dynamically."));
     }
-    if (error) {
-        free((char*)minidump_dir);
-        free((char*)content_str);
+    return valid;
+}
+
+static bool dyna_validate_extensions(const struct settings *new_settings,
+                                     cJSON* errors)
+{
+    if (!new_settings->has.extensions) {
+        return true;
+    }
+
+    /* extensions is not dynamic - validate it hasn't changed.*/
+    bool valid = false;
+    if (new_settings->num_pending_extensions ==
+        settings.num_pending_extensions) {
+        valid = true;
+        int ii = 0;
+        for (ii = 0; ii < settings.num_pending_extensions; ii++) {
+            /* soname must be non-NULL and equal */
+            valid &= new_settings->pending_extensions[ii].soname != NULL &&
+                     strcmp(new_settings->pending_extensions[ii].soname,
+                            settings.pending_extensions[ii].soname) == 0;
+
+            /* new 'config' should either be NULL or equal to to the old one. */
+            valid &= settings.pending_extensions[ii].config == NULL ||
+                    (new_settings->pending_extensions[ii].config != NULL &&
+                     strcmp(new_settings->pending_extensions[ii].config,
+                            settings.pending_extensions[ii].config) == 0);
+        }
+    }
+
+    if (valid) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'extensions' is not a dynamic setting."));
+        return false;
+    }
+}
+
+static bool dyna_validate_engine(const struct settings *new_settings,
+                                 cJSON* errors)
+{
+    /* engine is not dynamic. */
+    bool valid = true;
+
+    if (!new_settings->has.engine) {
+        return true;
+    }
+
+    /* module must be non-null, and the same as current.*/
+    valid &= new_settings->engine_module != NULL &&
+             strcmp(new_settings->engine_module, settings.engine_module) == 0;
+
+    /* config may be null if current is, but must be equal */
+    valid &= (settings.engine_config == NULL &&
+              new_settings->engine_config == NULL) ||
+             (settings.engine_config != NULL &&
+              new_settings->engine_config != NULL &&
+              strcmp(settings.engine_config, new_settings->engine_config) == 0);
+
+    if (valid) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'engine' is not a dynamic setting."));
         return false;
     }
+}
 
-    /* Validate parameters */
-    if (enabled) {
-        /* If 'enabled' was set, 'minidump_dir' must also be set. */
-        if (minidump_dir == NULL) {
-            do_asprintf(error_msg,
-                        "breakpad.enabled==true but minidump_dir not specified.\n");
-            error = true;
-        }
-    }
-    if (!error && content_str) {
-        /* Only valid value is 'default' currently. */
-        if (strcmp(content_str, "default") == 0) {
-            content = CONTENT_DEFAULT;
-        } else {
-            do_asprintf(error_msg, "Invalid value for breakpad.content: %s\n",
-                        content_str);
-            error = true;
-        }
-        /* String converted to enum, no longer needed. */
-        free((char*)content_str);
+static bool dyna_validate_require_init(const struct settings *new_settings,
+                                       cJSON* errors)
+{
+    if (!new_settings->has.require_init) {
+        return true;
     }
-    if (error) {
-        free((char*)minidump_dir);
+
+    if (new_settings->require_init == settings.require_init) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'require_init' is not a dynamic setting."));
         return false;
     }
+}
 
-    // Allow runtime-disabling of Breakpad if CB_DISABLE_BREAKPAD is set.
-    if (getenv("CB_DISABLE_BREAKPAD") != NULL) {
-        enabled = false;
+static bool dyna_validate_reuseport(const struct settings *new_settings,
+                                    cJSON* errors)
+{
+    if (!new_settings->has.reuseport) {
+        return true;
     }
 
-    /* Validated, update settings. */
-    settings->breakpad.enabled = enabled;
-    /* Empty string (as opposed to NULL string) used here to simplify compare
-       logic when checking for differences in breakpad config. */
-    settings->breakpad.minidump_dir = minidump_dir ? minidump_dir
-                                                   : strdup("");
-    settings->breakpad.content = content;
-    settings->has.breakpad = true;
+    if (new_settings->reuseport == settings.reuseport) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'reuseport' is not a dynamic setting."));
+        return false;
+    }
+}
+
+static bool dyna_validate_response_coalescing_usec(const struct settings *new_settings,
+                                                   cJSON* errors) {
+    /* Used by the worker threads from their next response on */
     return true;
 }
 
-/* reconfig (dynamic config update) handlers *********************************/
+static bool dyna_validate_direct_receive_size(const struct settings *new_settings,
+                                              cJSON* errors) {
+    /* Used from the next command on */
+    return true;
+}
 
-typedef bool (*dynamic_validate_handler)(const struct settings *new_settings,
-                                         cJSON* errors);
+static bool dyna_validate_max_outstanding_commands(const struct settings *new_settings,
+                                                   cJSON* errors) {
+    /* Used by the worker threads from the next blocked command on */
+    return true;
+}
 
-typedef void (*dynamic_reconfig_handler)(const struct settings *new_settings);
+static bool dyna_validate_compression_threshold(const struct settings *new_settings,
+                                                cJSON* errors) {
+    /* Used from the next store on, the values already stored are kept */
+    return true;
+}
 
-static bool dyna_validate_admin(const struct settings *new_settings,
-                                cJSON* errors) {
-    if (!new_settings->has.admin) {
-        return true;
+static bool dyna_validate_inflate_cache_size(const struct settings *new_settings,
+                                             cJSON* errors) {
+    /* The worker threads trim their caches the next time they're used */
+    return true;
+}
+
+static bool dyna_validate_dictionary_compression_max(const struct settings *new_settings,
+                                                     cJSON* errors) {
+#ifndef HAVE_ZSTD
+    if (new_settings->has.dictionary_compression_max &&
+        new_settings->dictionary_compression_max != 0) {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'dictionary_compression_max' requires zstd support."));
+        return false;
     }
-    if (settings.admin != NULL &&
-        new_settings->admin != NULL &&
-        strcmp(new_settings->admin, settings.admin) == 0) {
-        return true;
-    } else if (settings.admin == NULL && new_settings->admin == NULL) {
-        return true;
-    } else {
+#endif
+    /* Used from the next store on, the values already stored are kept */
+    return true;
+}
+
+static bool dyna_validate_stream_compression_level(const struct settings *new_settings,
+                                                   cJSON* errors) {
+#ifndef HAVE_ZSTD
+    if (new_settings->has.stream_compression_level &&
+        new_settings->stream_compression_level != 0) {
         cJSON_AddItemToArray(errors,
-                             cJSON_CreateString("'admin' is not a dynamic setting."));
+                             cJSON_CreateString("'stream_compression_level' requires zstd support."));
         return false;
     }
+#endif
+    /* Used by the next HELLO, the streams already compressed are kept */
+    return true;
 }
 
-static bool dyna_validate_rbac_file(const struct settings *new_settings,
-                                    cJSON* errors) {
-    if (!new_settings->has.rbac) {
+static bool dyna_validate_dictionary_file(const struct settings *new_settings,
+                                          cJSON* errors) {
+    if (!new_settings->has.dictionary_file) {
         return true;
     }
 
-    if (settings.rbac_file != NULL &&
-        new_settings->rbac_file != NULL &&
-        strcmp(new_settings->rbac_file, settings.rbac_file) == 0) {
+    if (settings.dictionary_file != NULL &&
+        new_settings->dictionary_file != NULL &&
+        strcmp(new_settings->dictionary_file, settings.dictionary_file) == 0) {
         return true;
-    } else if (settings.rbac_file == NULL && new_settings->rbac_file == NULL) {
+    } else if (settings.dictionary_file == NULL &&
+               new_settings->dictionary_file == NULL) {
         return true;
     } else {
         cJSON_AddItemToArray(errors,
-                             cJSON_CreateString("'rbac_file' is not a dynamic setting."));
+                             cJSON_CreateString("'dictionary_file' is not a dynamic setting."));
         return false;
     }
 }
 
-static bool dyna_validate_rbac_privilege_debug(const struct settings *new_settings,
-                                               cJSON* errors) {
+static bool dyna_validate_subdoc_index_cache_size(const struct settings *new_settings,
+                                                  cJSON* errors) {
+    /* The worker threads trim their caches the next time they're used */
     return true;
 }
 
-static bool dyna_validate_audit_file(const struct settings *new_settings,
-                                    cJSON* errors) {
-    if (!new_settings->has.audit) {
+static bool dyna_validate_prefetch_depth(const struct settings *new_settings,
+                                         cJSON* errors) {
+    /* Used by the worker threads from the next command on */
+    return true;
+}
+
+static bool dyna_validate_io_uring(const struct settings *new_settings,
+                                   cJSON* errors)
+{
+    if (!new_settings->has.io_uring) {
         return true;
     }
 
-    if (settings.audit_file != NULL &&
-        new_settings->audit_file != NULL &&
-        strcmp(new_settings->audit_file, settings.audit_file) == 0) {
-        return true;
-    } else if (settings.audit_file == NULL && new_settings->audit_file == NULL) {
+    if (new_settings->io_uring == settings.io_uring) {
         return true;
     } else {
         cJSON_AddItemToArray(errors,
-                             cJSON_CreateString("'audit_file' is not a dynamic setting."));
+                             cJSON_CreateString("'io_uring' is not a dynamic setting."));
         return false;
     }
 }
 
-static bool dyna_validate_root(const struct settings *new_settings,
-                               cJSON* errors) {
-    if (!new_settings->has.root) {
+static bool dyna_validate_thread_affinity(const struct settings *new_settings,
+                                          cJSON* errors)
+{
+    if (!new_settings->has.thread_affinity) {
         return true;
     }
 
-    if (settings.root != NULL &&
-        new_settings->root != NULL &&
-        strcmp(new_settings->root, settings.root) == 0) {
+    if (settings.thread_affinity != NULL &&
+        new_settings->thread_affinity != NULL &&
+        strcmp(new_settings->thread_affinity, settings.thread_affinity) == 0) {
         return true;
-    } else if (settings.root == NULL && new_settings->root == NULL) {
+    } else if (settings.thread_affinity == NULL &&
+               new_settings->thread_affinity == NULL) {
         return true;
     } else {
         cJSON_AddItemToArray(errors,
-                             cJSON_CreateString("'root' is not a dynamic setting."));
+                             cJSON_CreateString("'thread_affinity' is not a dynamic setting."));
         return false;
     }
 }
 
-static bool dyna_validate_ssl_cipher_list(const struct settings *new_settings,
-                                          cJSON* errors) {
-    /* Its dynamic :-) */
+static bool dyna_validate_busy_poll_usec(const struct settings *new_settings,
+                                         cJSON* errors) {
+    /* Used by the worker threads from their next pass on */
     return true;
 }
 
-static bool dyna_validate_threads(const struct settings *new_settings,
-                                  cJSON* errors) {
-    if (!new_settings->has.threads) {
+static bool dyna_validate_proxy(const struct settings *new_settings,
+                                cJSON* errors)
+{
+    /* Only enabled and hedge_usec are dynamic, the peers are logged in */
+    const char *username = settings.proxy.username;
+    const char *password = settings.proxy.password;
+
+    if (!new_settings->has.proxy) {
         return true;
     }
-    if (new_settings->num_threads == settings.num_threads) {
+    if (strcmp(new_settings->proxy.username, username ? username : "") == 0 &&
+        strcmp(new_settings->proxy.password, password ? password : "") == 0) {
         return true;
     } else {
         cJSON_AddItemToArray(errors,
-                             cJSON_CreateString("'num_threads' is not a dynamic setting."));
+                             cJSON_CreateString("'proxy.username' and 'proxy.password' are not dynamic settings."));
         return false;
     }
 }
 
-static bool dyna_validate_max_packet_size(const struct settings *new_settings,
-                                  cJSON* errors) {
-    if (!new_settings->has.max_packet_size) {
+static bool dyna_validate_arena_per_thread(const struct settings *new_settings,
+                                           cJSON* errors)
+{
+    if (!new_settings->has.arena_per_thread) {
         return true;
     }
-    if (new_settings->max_packet_size == settings.max_packet_size) {
+
+    if (new_settings->arena_per_thread == settings.arena_per_thread) {
         return true;
     } else {
         cJSON_AddItemToArray(errors,
-                             cJSON_CreateString("'max_packet_size' is not a dynamic setting."));
+                             cJSON_CreateString("'arena_per_thread' is not a dynamic setting."));
         return false;
     }
 }
 
-static bool dyna_validate_interfaces(const struct settings *new_settings,
-                                     cJSON* errors) {
-    bool valid = false;
-    if (!new_settings->has.interfaces) {
+static bool dyna_validate_stats_snapshot_msec(const struct settings *new_settings,
+                                              cJSON* errors) {
+    /* Used from the next "stats aggregate" on */
+    return true;
+}
+
+static bool dyna_validate_dcp_threads(const struct settings *new_settings,
+                                      cJSON* errors) {
+    if (!new_settings->has.dcp_threads) {
+        return true;
+    }
+    if (new_settings->num_dcp_threads == settings.num_dcp_threads) {
         return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'dcp_threads' is not a dynamic setting."));
+        return false;
     }
+}
 
-    /* parts of interface are dynamic, but not the overall number or name... */
-    if (new_settings->num_interfaces == settings.num_interfaces) {
-        char* tempstr = NULL;
-        valid = true;
-        int ii = 0;
-        for (ii = 0; ii < settings.num_interfaces; ii++) {
-            struct interface *cur_if = &settings.interfaces[ii];
-            struct interface *new_if = &new_settings->interfaces[ii];
+static bool dyna_validate_near_cache_items(const struct settings *new_settings,
+                                           cJSON* errors) {
+    if (!new_settings->has.near_cache_items) {
+        return true;
+    }
+    if (new_settings->near_cache_items == settings.near_cache_items) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'near_cache_items' is not a dynamic setting."));
+        return false;
+    }
+}
 
-            /* These settings cannot change: */
-            if (strcmp(new_if->host, cur_if->host) != 0) {
-                do_asprintf(&tempstr,
-                            "interface '%d' cannot change host dynamically.",
-                            ii);
-                cJSON_AddItemToArray(errors, cJSON_CreateString(tempstr));
-                free(tempstr);
-                valid = false;
-            }
-            if (new_if->port != cur_if->port) {
-                do_asprintf(&tempstr,
-                            "interface '%d' cannot change port dynamically.",
-                            ii);
-                cJSON_AddItemToArray(errors, cJSON_CreateString(tempstr));
-                free(tempstr);
-                valid = false;
-            }
-            if (new_if->ipv4 != cur_if->ipv4) {
-                do_asprintf(&tempstr,
-                            "interface '%d' cannot change IPv4 dynamically.",
-                            ii);
-                cJSON_AddItemToArray(errors, cJSON_CreateString(tempstr));
-                free(tempstr);
-                valid = false;
-            }
-            if (new_if->ipv6 != cur_if->ipv6) {
-                do_asprintf(&tempstr,
-                            "interface '%d' cannot change IPv6 dynamically.",
-                            ii);
-                cJSON_AddItemToArray(errors, cJSON_CreateString(tempstr));
-                free(tempstr);
-                valid = false;
-            }
-        }
+static bool dyna_validate_scheduler_slice_usec(const struct settings *new_settings,
+                                               cJSON* errors) {
+    /* Used from the next event of each connection on */
+    return true;
+}
+
+static bool dyna_validate_max_slice_usec(const struct settings *new_settings,
+                                         cJSON* errors) {
+    /* Used from the next event of each connection on */
+    return true;
+}
+
+static bool dyna_validate_shed_inflight(const struct settings *new_settings,
+                                        cJSON* errors) {
+    /* Used from the next command on */
+    return true;
+}
+
+static bool dyna_validate_shed_delay_usec(const struct settings *new_settings,
+                                          cJSON* errors) {
+    /* Used from the next command on */
+    return true;
+}
+
+static bool dyna_validate_max_unsent_bytes(const struct settings *new_settings,
+                                           cJSON* errors) {
+    /* Used from the next command on */
+    return true;
+}
+
+static bool dyna_validate_max_pinned_items(const struct settings *new_settings,
+                                           cJSON* errors) {
+    /* Used from the next response on */
+    return true;
+}
+
+static bool dyna_validate_rate_limit_user_ops(const struct settings *new_settings,
+                                              cJSON* errors) {
+    /* Used from the next command on */
+    return true;
+}
+
+static bool dyna_validate_rate_limit_user_bytes(const struct settings *new_settings,
+                                                cJSON* errors) {
+    /* Used from the next command on */
+    return true;
+}
+
+static bool dyna_validate_rate_limit_bucket_ops(const struct settings *new_settings,
+                                                cJSON* errors) {
+    /* Used from the next command on */
+    return true;
+}
+
+static bool dyna_validate_rate_limit_bucket_bytes(const struct settings *new_settings,
+                                                  cJSON* errors) {
+    /* Used from the next command on */
+    return true;
+}
+
+static bool dyna_validate_sasl_threads(const struct settings *new_settings,
+                                       cJSON* errors) {
+    if (!new_settings->has.sasl_threads) {
+        return true;
+    }
+    if (new_settings->num_sasl_threads == settings.num_sasl_threads) {
+        return true;
     } else {
         cJSON_AddItemToArray(errors,
-                             cJSON_CreateString("Number of interfaces cannot change dynamically."));
+                             cJSON_CreateString("'sasl_threads' is not a dynamic setting."));
+        return false;
     }
-    return valid;
 }
 
-static bool dyna_validate_extensions(const struct settings *new_settings,
-                                     cJSON* errors)
-{
-    if (!new_settings->has.extensions) {
+static bool dyna_validate_trace_sample_rate(const struct settings *new_settings,
+                                            cJSON* errors) {
+    /* Used from the next request sampled on */
+    return true;
+}
+
+static bool dyna_validate_phase_timings(const struct settings *new_settings,
+                                        cJSON* errors) {
+    /* Used from the next command on */
+    return true;
+}
+
+static bool dyna_validate_slow_command_threshold(const struct settings *new_settings,
+                                                 cJSON* errors) {
+    /* Used from the next command on */
+    return true;
+}
+
+static bool dyna_validate_idle_trim_sec(const struct settings *new_settings,
+                                        cJSON* errors) {
+    /* Used by the connections from their next idle timer on */
+    return true;
+}
+
+static bool dyna_validate_idle_timeout(const struct settings *new_settings,
+                                       cJSON* errors) {
+    /* Used by the connections from their next idle timer on */
+    return true;
+}
+
+static bool dyna_validate_free_memory_release_pct(const struct settings *new_settings,
+                                                  cJSON* errors) {
+    /* Used by the memory manager from its next tick on */
+    return true;
+}
+
+static bool dyna_validate_free_memory_release_rate(const struct settings *new_settings,
+                                                   cJSON* errors) {
+    return true;
+}
+
+static bool dyna_validate_gather_writes(const struct settings *new_settings,
+                                        cJSON* errors) {
+    /* Used from the next write on */
+    return true;
+}
+
+static bool dyna_validate_scripts_file(const struct settings *new_settings,
+                                       cJSON* errors) {
+    if (!new_settings->has.scripts_file) {
         return true;
     }
 
-    /* extensions is not dynamic - validate it hasn't changed.*/
-    bool valid = false;
-    if (new_settings->num_pending_extensions ==
-        settings.num_pending_extensions) {
-        valid = true;
-        int ii = 0;
-        for (ii = 0; ii < settings.num_pending_extensions; ii++) {
-            /* soname must be non-NULL and equal */
-            valid &= new_settings->pending_extensions[ii].soname != NULL &&
-                     strcmp(new_settings->pending_extensions[ii].soname,
-                            settings.pending_extensions[ii].soname) == 0;
+    if (settings.scripts_file != NULL &&
+        new_settings->scripts_file != NULL &&
+        strcmp(new_settings->scripts_file, settings.scripts_file) == 0) {
+        return true;
+    } else if (settings.scripts_file == NULL &&
+               new_settings->scripts_file == NULL) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'scripts_file' is not a dynamic setting."));
+        return false;
+    }
+}
 
-            /* new 'config' should either be NULL or equal to to the old one. */
-            valid &= settings.pending_extensions[ii].config == NULL ||
-                    (new_settings->pending_extensions[ii].config != NULL &&
-                     strcmp(new_settings->pending_extensions[ii].config,
-                            settings.pending_extensions[ii].config) == 0);
-        }
+static bool dyna_validate_workload_trace_dir(const struct settings *new_settings,
+                                             cJSON* errors) {
+    if (!new_settings->has.workload_trace_dir) {
+        return true;
     }
 
-    if (valid) {
+    if (settings.workload_trace_dir != NULL &&
+        new_settings->workload_trace_dir != NULL &&
+        strcmp(new_settings->workload_trace_dir,
+               settings.workload_trace_dir) == 0) {
+        return true;
+    } else if (settings.workload_trace_dir == NULL &&
+               new_settings->workload_trace_dir == NULL) {
         return true;
     } else {
         cJSON_AddItemToArray(errors,
-                             cJSON_CreateString("'extensions' is not a dynamic setting."));
+                             cJSON_CreateString("'workload_trace_dir' is not a dynamic setting."));
         return false;
     }
 }
 
-static bool dyna_validate_engine(const struct settings *new_settings,
-                                 cJSON* errors)
-{
-    /* engine is not dynamic. */
-    bool valid = true;
-
-    if (!new_settings->has.engine) {
+static bool dyna_validate_workload_trace_file_size(const struct settings *new_settings,
+                                                   cJSON* errors) {
+    if (!new_settings->has.workload_trace_file_size) {
         return true;
     }
-
-    /* module must be non-null, and the same as current.*/
-    valid &= new_settings->engine_module != NULL &&
-             strcmp(new_settings->engine_module, settings.engine_module) == 0;
-
-    /* config may be null if current is, but must be equal */
-    valid &= (settings.engine_config == NULL &&
-              new_settings->engine_config == NULL) ||
-             (settings.engine_config != NULL &&
-              new_settings->engine_config != NULL &&
-              strcmp(settings.engine_config, new_settings->engine_config) == 0);
-
-    if (valid) {
+    if (new_settings->workload_trace_file_size ==
+        settings.workload_trace_file_size) {
         return true;
     } else {
         cJSON_AddItemToArray(errors,
-                             cJSON_CreateString("'engine' is not a dynamic setting."));
+                             cJSON_CreateString("'workload_trace_file_size' is not a dynamic setting."));
         return false;
     }
 }
 
-static bool dyna_validate_require_init(const struct settings *new_settings,
-                                       cJSON* errors)
-{
-    if (!new_settings->has.require_init) {
+static bool dyna_validate_vbucket_stats(const struct settings *new_settings,
+                                        cJSON* errors) {
+    if (!new_settings->has.vbucket_stats) {
         return true;
     }
-
-    if (new_settings->require_init == settings.require_init) {
+    if (new_settings->vbucket_stats == settings.vbucket_stats) {
         return true;
     } else {
         cJSON_AddItemToArray(errors,
-                             cJSON_CreateString("'require_init' is not a dynamic setting."));
+                             cJSON_CreateString("'vbucket_stats' is not a dynamic setting."));
         return false;
     }
 }
 
+static bool dyna_validate_workload_trace_sample(const struct settings *new_settings,
+                                                cJSON* errors) {
+    (void)new_settings;
+    (void)errors;
+    /* Used from the next request on */
+    return true;
+}
+
 static bool dyna_validate_require_sasl(const struct settings *new_settings,
                                        cJSON* errors)
 {
@@ -1268,6 +2600,29 @@ static void dyna_reconfig_iface_ssl(const struct interface *new_if,
             cur_if->host, cur_if->port, old_key, cur_if->ssl.key);
         free((char*)old_key);
     }
+
+    if (cur_if->ssl.ktls != new_if->ssl.ktls) {
+        bool old_ktls = cur_if->ssl.ktls;
+        cur_if->ssl.ktls = new_if->ssl.ktls;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed ssl.ktls for interface %s:%hu from %s to %s",
+            cur_if->host, cur_if->port, old_ktls ? "true" : "false",
+            cur_if->ssl.ktls ? "true" : "false");
+    }
+}
+
+static void dyna_reconfig_iface_address(int idx,
+                                        const struct interface *new_if,
+                                        struct interface *cur_if) {
+    if (!same_iface_address(new_if, cur_if)) {
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Rebinding interface %s:%hu to %s:%hu",
+            cur_if->host ? cur_if->host : "*", cur_if->port,
+            new_if->host ? new_if->host : "*", new_if->port);
+        rebind_interface(idx, new_if);
+    }
 }
 
 static void dyna_reconfig_interfaces(const struct settings *new_settings) {
@@ -1276,6 +2631,7 @@ static void dyna_reconfig_interfaces(const struct settings *new_settings) {
         struct interface *cur_if = &settings.interfaces[ii];
         struct interface *new_if = &new_settings->interfaces[ii];
 
+        dyna_reconfig_iface_address(ii, new_if, cur_if);
         dyna_reconfig_iface_maxconns(new_if, cur_if);
         dyna_reconfig_iface_backlog(new_if, cur_if);
         dyna_reconfig_iface_nodelay(new_if, cur_if);
@@ -1331,6 +2687,30 @@ static void dyna_reconfig_reqs_per_event_low_priority(const struct settings *new
     }
 }
 
+static void dyna_reconfig_threads(const struct settings *new_settings) {
+    if (new_settings->has.threads &&
+        new_settings->num_threads != settings.num_threads) {
+        int old_threads = settings.num_threads;
+        threads_resize(new_settings->num_threads);
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed threads from %d to %d", old_threads,
+            settings.num_threads);
+    }
+}
+
+static void dyna_reconfig_max_packet_size(const struct settings *new_settings) {
+    if (new_settings->has.max_packet_size &&
+        new_settings->max_packet_size != settings.max_packet_size) {
+        uint32_t old_size = settings.max_packet_size;
+        settings.max_packet_size = new_settings->max_packet_size;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed max_packet_size from %u to %u", old_size,
+            settings.max_packet_size);
+    }
+}
+
 static void dyna_reconfig_verbosity(const struct settings *new_settings) {
     if (new_settings->has.verbose &&
         new_settings->verbose != settings.verbose) {
@@ -1344,6 +2724,20 @@ static void dyna_reconfig_verbosity(const struct settings *new_settings) {
     }
 }
 
+/*
+ * The file can't change but what's in it can: the live contexts are
+ * updated in place (see RBACManager::initialize()), and a file that fails
+ * to load leaves the running configuration alone.
+ */
+static void dyna_reconfig_rbac_file(const struct settings *new_settings) {
+    if (new_settings->has.rbac &&
+        load_rbac_from_file(settings.rbac_file) != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Failed to reload %s, keeping the running RBAC configuration",
+            settings.rbac_file);
+    }
+}
+
 static void dyna_reconfig_rbac_privilege_debug(const struct settings *new_settings) {
     if (new_settings->has.rbac_privilege_debug) {
         auth_set_privilege_debug(new_settings->rbac_privilege_debug);
@@ -1387,6 +2781,16 @@ static void dyna_reconfig_breakpad(const struct settings *new_settings) {
                 settings.breakpad.content);
         }
 
+        if (new_settings->breakpad.helper != settings.breakpad.helper) {
+            reconfig = true;
+            const bool old_helper = settings.breakpad.helper;
+            settings.breakpad.helper = new_settings->breakpad.helper;
+            /* TODO: change to EXTENSION_LOG_INFO */
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "Changed breakpad.helper from %d to %d", old_helper,
+                settings.breakpad.helper);
+        }
+
         if (reconfig) {
             initialize_breakpad(&(settings.breakpad));
         }
@@ -1402,6 +2806,427 @@ static void dyna_reconfig_ssl_cipher_list(const struct settings *new_settings) {
     }
 }
 
+static void dyna_reconfig_connection_dispatch(const struct settings *new_settings) {
+    if (new_settings->has.connection_dispatch &&
+        new_settings->connection_dispatch != settings.connection_dispatch) {
+        conn_dispatch_t old = settings.connection_dispatch;
+        settings.connection_dispatch = new_settings->connection_dispatch;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed connection_dispatch from %d to %d", old,
+            settings.connection_dispatch);
+    }
+}
+
+static void dyna_reconfig_connection_migration_threshold(const struct settings *new_settings) {
+    if (new_settings->has.connection_migration_threshold &&
+        new_settings->connection_migration_threshold !=
+            settings.connection_migration_threshold) {
+        uint32_t old = settings.connection_migration_threshold;
+        settings.connection_migration_threshold =
+            new_settings->connection_migration_threshold;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed connection_migration_threshold from %u to %u", old,
+            settings.connection_migration_threshold);
+    }
+}
+
+static void dyna_reconfig_response_coalescing_usec(const struct settings *new_settings) {
+    if (new_settings->has.response_coalescing_usec &&
+        new_settings->response_coalescing_usec !=
+            settings.response_coalescing_usec) {
+        uint32_t old = settings.response_coalescing_usec;
+        settings.response_coalescing_usec =
+            new_settings->response_coalescing_usec;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed response_coalescing_usec from %u to %u", old,
+            settings.response_coalescing_usec);
+    }
+}
+
+static void dyna_reconfig_direct_receive_size(const struct settings *new_settings) {
+    if (new_settings->has.direct_receive_size &&
+        new_settings->direct_receive_size != settings.direct_receive_size) {
+        uint32_t old = settings.direct_receive_size;
+        settings.direct_receive_size = new_settings->direct_receive_size;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed direct_receive_size from %u to %u", old,
+            settings.direct_receive_size);
+    }
+}
+
+static void dyna_reconfig_max_outstanding_commands(const struct settings *new_settings) {
+    if (new_settings->has.max_outstanding_commands &&
+        new_settings->max_outstanding_commands !=
+            settings.max_outstanding_commands) {
+        uint32_t old = settings.max_outstanding_commands;
+        settings.max_outstanding_commands =
+            new_settings->max_outstanding_commands;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed max_outstanding_commands from %u to %u", old,
+            settings.max_outstanding_commands);
+    }
+}
+
+static void dyna_reconfig_compression_threshold(const struct settings *new_settings) {
+    if (new_settings->has.compression_threshold &&
+        new_settings->compression_threshold !=
+            settings.compression_threshold) {
+        uint32_t old = settings.compression_threshold;
+        settings.compression_threshold = new_settings->compression_threshold;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed compression_threshold from %u to %u", old,
+            settings.compression_threshold);
+    }
+}
+
+static void dyna_reconfig_inflate_cache_size(const struct settings *new_settings) {
+    if (new_settings->has.inflate_cache_size &&
+        new_settings->inflate_cache_size != settings.inflate_cache_size) {
+        uint32_t old = settings.inflate_cache_size;
+        settings.inflate_cache_size = new_settings->inflate_cache_size;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed inflate_cache_size from %u to %u", old,
+            settings.inflate_cache_size);
+    }
+}
+
+static void dyna_reconfig_dictionary_compression_max(const struct settings *new_settings) {
+    if (new_settings->has.dictionary_compression_max &&
+        new_settings->dictionary_compression_max !=
+            settings.dictionary_compression_max) {
+        uint32_t old = settings.dictionary_compression_max;
+        settings.dictionary_compression_max =
+            new_settings->dictionary_compression_max;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed dictionary_compression_max from %u to %u", old,
+            settings.dictionary_compression_max);
+    }
+}
+
+static void dyna_reconfig_workload_trace_sample(const struct settings *new_settings) {
+    if (new_settings->has.workload_trace_sample &&
+        new_settings->workload_trace_sample != settings.workload_trace_sample) {
+        uint32_t old = settings.workload_trace_sample;
+        settings.workload_trace_sample = new_settings->workload_trace_sample;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed workload_trace_sample from %u to %u%s", old,
+            settings.workload_trace_sample,
+            settings.workload_trace_dir == NULL ?
+                " (there is no workload_trace_dir)" : "");
+    }
+}
+
+static void dyna_reconfig_stream_compression_level(const struct settings *new_settings) {
+    if (new_settings->has.stream_compression_level &&
+        new_settings->stream_compression_level !=
+            settings.stream_compression_level) {
+        uint32_t old = settings.stream_compression_level;
+        settings.stream_compression_level =
+            new_settings->stream_compression_level;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed stream_compression_level from %u to %u", old,
+            settings.stream_compression_level);
+    }
+}
+
+static void dyna_reconfig_subdoc_index_cache_size(const struct settings *new_settings) {
+    if (new_settings->has.subdoc_index_cache_size &&
+        new_settings->subdoc_index_cache_size !=
+            settings.subdoc_index_cache_size) {
+        uint32_t old = settings.subdoc_index_cache_size;
+        settings.subdoc_index_cache_size = new_settings->subdoc_index_cache_size;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed subdoc_index_cache_size from %u to %u", old,
+            settings.subdoc_index_cache_size);
+    }
+}
+
+static void dyna_reconfig_prefetch_depth(const struct settings *new_settings) {
+    if (new_settings->has.prefetch_depth &&
+        new_settings->prefetch_depth != settings.prefetch_depth) {
+        uint32_t old = settings.prefetch_depth;
+        settings.prefetch_depth = new_settings->prefetch_depth;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed prefetch_depth from %u to %u", old,
+            settings.prefetch_depth);
+    }
+}
+
+static void dyna_reconfig_scheduler_slice_usec(const struct settings *new_settings) {
+    if (new_settings->has.scheduler_slice_usec &&
+        new_settings->scheduler_slice_usec != settings.scheduler_slice_usec) {
+        uint32_t old = settings.scheduler_slice_usec;
+        settings.scheduler_slice_usec = new_settings->scheduler_slice_usec;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed scheduler_slice_usec from %u to %u", old,
+            settings.scheduler_slice_usec);
+    }
+}
+
+static void dyna_reconfig_max_slice_usec(const struct settings *new_settings) {
+    if (new_settings->has.max_slice_usec &&
+        new_settings->max_slice_usec != settings.max_slice_usec) {
+        uint32_t old = settings.max_slice_usec;
+        settings.max_slice_usec = new_settings->max_slice_usec;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed max_slice_usec from %u to %u", old,
+            settings.max_slice_usec);
+    }
+}
+
+static void dyna_reconfig_shed_inflight(const struct settings *new_settings) {
+    if (new_settings->has.shed_inflight &&
+        new_settings->shed_inflight != settings.shed_inflight) {
+        uint32_t old = settings.shed_inflight;
+        settings.shed_inflight = new_settings->shed_inflight;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed shed_inflight from %u to %u", old,
+            settings.shed_inflight);
+    }
+}
+
+static void dyna_reconfig_shed_delay_usec(const struct settings *new_settings) {
+    if (new_settings->has.shed_delay_usec &&
+        new_settings->shed_delay_usec != settings.shed_delay_usec) {
+        uint32_t old = settings.shed_delay_usec;
+        settings.shed_delay_usec = new_settings->shed_delay_usec;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed shed_delay_usec from %u to %u", old,
+            settings.shed_delay_usec);
+    }
+}
+
+static void dyna_reconfig_max_unsent_bytes(const struct settings *new_settings) {
+    if (new_settings->has.max_unsent_bytes &&
+        new_settings->max_unsent_bytes != settings.max_unsent_bytes) {
+        uint32_t old = settings.max_unsent_bytes;
+        settings.max_unsent_bytes = new_settings->max_unsent_bytes;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed max_unsent_bytes from %u to %u", old,
+            settings.max_unsent_bytes);
+    }
+}
+
+static void dyna_reconfig_max_pinned_items(const struct settings *new_settings) {
+    if (new_settings->has.max_pinned_items &&
+        new_settings->max_pinned_items != settings.max_pinned_items) {
+        uint32_t old = settings.max_pinned_items;
+        settings.max_pinned_items = new_settings->max_pinned_items;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed max_pinned_items from %u to %u", old,
+            settings.max_pinned_items);
+    }
+}
+
+static void dyna_reconfig_rate_limit_user_ops(const struct settings *new_settings) {
+    if (new_settings->has.rate_limit_user_ops &&
+        new_settings->rate_limit_user_ops != settings.rate_limit_user_ops) {
+        uint32_t old = settings.rate_limit_user_ops;
+        settings.rate_limit_user_ops = new_settings->rate_limit_user_ops;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed rate_limit_user_ops from %u to %u", old,
+            settings.rate_limit_user_ops);
+    }
+}
+
+static void dyna_reconfig_rate_limit_user_bytes(const struct settings *new_settings) {
+    if (new_settings->has.rate_limit_user_bytes &&
+        new_settings->rate_limit_user_bytes != settings.rate_limit_user_bytes) {
+        uint32_t old = settings.rate_limit_user_bytes;
+        settings.rate_limit_user_bytes = new_settings->rate_limit_user_bytes;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed rate_limit_user_bytes from %u to %u", old,
+            settings.rate_limit_user_bytes);
+    }
+}
+
+static void dyna_reconfig_rate_limit_bucket_ops(const struct settings *new_settings) {
+    if (new_settings->has.rate_limit_bucket_ops &&
+        new_settings->rate_limit_bucket_ops != settings.rate_limit_bucket_ops) {
+        uint32_t old = settings.rate_limit_bucket_ops;
+        settings.rate_limit_bucket_ops = new_settings->rate_limit_bucket_ops;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed rate_limit_bucket_ops from %u to %u", old,
+            settings.rate_limit_bucket_ops);
+    }
+}
+
+static void dyna_reconfig_rate_limit_bucket_bytes(const struct settings *new_settings) {
+    if (new_settings->has.rate_limit_bucket_bytes &&
+        new_settings->rate_limit_bucket_bytes != settings.rate_limit_bucket_bytes) {
+        uint32_t old = settings.rate_limit_bucket_bytes;
+        settings.rate_limit_bucket_bytes = new_settings->rate_limit_bucket_bytes;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed rate_limit_bucket_bytes from %u to %u", old,
+            settings.rate_limit_bucket_bytes);
+    }
+}
+
+static void dyna_reconfig_trace_sample_rate(const struct settings *new_settings) {
+    if (new_settings->has.trace_sample_rate &&
+        new_settings->trace_sample_rate != settings.trace_sample_rate) {
+        uint32_t old = settings.trace_sample_rate;
+        settings.trace_sample_rate = new_settings->trace_sample_rate;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed trace_sample_rate from %u to %u", old,
+            settings.trace_sample_rate);
+    }
+}
+
+static void dyna_reconfig_phase_timings(const struct settings *new_settings) {
+    if (new_settings->has.phase_timings &&
+        new_settings->phase_timings != settings.phase_timings) {
+        settings.phase_timings = new_settings->phase_timings;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "%s phase_timings",
+            settings.phase_timings ? "Enabled" : "Disabled");
+    }
+}
+
+static void dyna_reconfig_slow_command_threshold(const struct settings *new_settings) {
+    if (new_settings->has.slow_command_threshold &&
+        new_settings->slow_command_threshold != settings.slow_command_threshold) {
+        uint32_t old = settings.slow_command_threshold;
+        settings.slow_command_threshold = new_settings->slow_command_threshold;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed slow_command_threshold from %u to %u", old,
+            settings.slow_command_threshold);
+    }
+}
+
+static void dyna_reconfig_idle_trim_sec(const struct settings *new_settings) {
+    if (new_settings->has.idle_trim_sec &&
+        new_settings->idle_trim_sec != settings.idle_trim_sec) {
+        uint32_t old = settings.idle_trim_sec;
+        settings.idle_trim_sec = new_settings->idle_trim_sec;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed idle_trim_sec from %u to %u", old,
+            settings.idle_trim_sec);
+    }
+}
+
+static void dyna_reconfig_idle_timeout(const struct settings *new_settings) {
+    if (new_settings->has.idle_timeout &&
+        new_settings->idle_timeout != settings.idle_timeout) {
+        uint32_t old = settings.idle_timeout;
+        settings.idle_timeout = new_settings->idle_timeout;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed idle_timeout from %u to %u", old,
+            settings.idle_timeout);
+    }
+}
+
+static void dyna_reconfig_busy_poll_usec(const struct settings *new_settings) {
+    if (new_settings->has.busy_poll_usec &&
+        new_settings->busy_poll_usec != settings.busy_poll_usec) {
+        uint32_t old = settings.busy_poll_usec;
+        settings.busy_poll_usec = new_settings->busy_poll_usec;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed busy_poll_usec from %u to %u", old,
+            settings.busy_poll_usec);
+    }
+}
+
+static void dyna_reconfig_proxy(const struct settings *new_settings) {
+    if (new_settings->has.proxy &&
+        new_settings->proxy.enabled != settings.proxy.enabled) {
+        bool old = settings.proxy.enabled;
+        settings.proxy.enabled = new_settings->proxy.enabled;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed proxy.enabled from %d to %d", old,
+            settings.proxy.enabled);
+    }
+    if (new_settings->has.proxy &&
+        new_settings->proxy.hedge_usec != settings.proxy.hedge_usec) {
+        uint32_t old = settings.proxy.hedge_usec;
+        settings.proxy.hedge_usec = new_settings->proxy.hedge_usec;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed proxy.hedge_usec from %u to %u", old,
+            settings.proxy.hedge_usec);
+    }
+}
+
+static void dyna_reconfig_free_memory_release_pct(const struct settings *new_settings) {
+    if (new_settings->has.free_memory_release_pct &&
+        new_settings->free_memory_release_pct !=
+            settings.free_memory_release_pct) {
+        uint32_t old = settings.free_memory_release_pct;
+        settings.free_memory_release_pct =
+            new_settings->free_memory_release_pct;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed free_memory_release_pct from %u to %u", old,
+            settings.free_memory_release_pct);
+    }
+}
+
+static void dyna_reconfig_free_memory_release_rate(const struct settings *new_settings) {
+    if (new_settings->has.free_memory_release_rate &&
+        new_settings->free_memory_release_rate !=
+            settings.free_memory_release_rate) {
+        uint32_t old = settings.free_memory_release_rate;
+        settings.free_memory_release_rate =
+            new_settings->free_memory_release_rate;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed free_memory_release_rate from %u to %u", old,
+            settings.free_memory_release_rate);
+    }
+}
+
+static void dyna_reconfig_gather_writes(const struct settings *new_settings) {
+    if (new_settings->has.gather_writes &&
+        new_settings->gather_writes != settings.gather_writes) {
+        settings.gather_writes = new_settings->gather_writes;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "%s gather_writes",
+            settings.gather_writes ? "Enabled" : "Disabled");
+    }
+}
+
+static void dyna_reconfig_stats_snapshot_msec(const struct settings *new_settings) {
+    if (new_settings->has.stats_snapshot_msec &&
+        new_settings->stats_snapshot_msec != settings.stats_snapshot_msec) {
+        uint32_t old = settings.stats_snapshot_msec;
+        settings.stats_snapshot_msec = new_settings->stats_snapshot_msec;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed stats_snapshot_msec from %u to %u", old,
+            settings.stats_snapshot_msec);
+    }
+}
+
 /* list of handlers for each setting */
 
 struct {
@@ -1411,10 +3236,11 @@ struct {
     dynamic_reconfig_handler dyanamic_reconfig;
 } handlers[] = {
     { "admin", get_admin, dyna_validate_admin, NULL},
-    { "rbac_file", get_rbac_file, dyna_validate_rbac_file, NULL},
+    { "rbac_file", get_rbac_file, dyna_validate_rbac_file, dyna_reconfig_rbac_file},
     { "rbac_privilege_debug", get_rbac_privilege_debug, dyna_validate_rbac_privilege_debug, dyna_reconfig_rbac_privilege_debug},
     { "audit_file", get_audit_file, dyna_validate_audit_file, NULL},
-    { "threads", get_threads, dyna_validate_threads, NULL },
+    { "threads", get_threads, dyna_validate_threads, dyna_reconfig_threads },
+    { "max_threads", get_max_threads, dyna_validate_max_threads, NULL },
     { "interfaces", get_interfaces, dyna_validate_interfaces, dyna_reconfig_interfaces },
     { "extensions", get_extensions, dyna_validate_extensions, NULL },
     { "engine", get_engine, dyna_validate_engine, NULL },
@@ -1435,7 +3261,106 @@ struct {
     { "ssl_cipher_list", get_ssl_cipher_list, dyna_validate_ssl_cipher_list,
       dyna_reconfig_ssl_cipher_list },
     { "breakpad", parse_breakpad, dyna_validate_breakpad, dyna_reconfig_breakpad },
-    { "max_packet_size", get_max_packet_size, dyna_validate_max_packet_size, NULL},
+    { "max_packet_size", get_max_packet_size, dyna_validate_max_packet_size,
+      dyna_reconfig_max_packet_size },
+    { "zerocopy_threshold", get_zerocopy_threshold,
+      dyna_validate_zerocopy_threshold, NULL },
+    { "connection_dispatch", get_connection_dispatch,
+      dyna_validate_connection_dispatch, dyna_reconfig_connection_dispatch },
+    { "hash_algorithm", get_hash_algorithm, dyna_validate_hash_algorithm,
+      NULL },
+    { "connection_migration_threshold", get_connection_migration_threshold,
+      dyna_validate_connection_migration_threshold,
+      dyna_reconfig_connection_migration_threshold },
+    { "reuseport", get_reuseport, dyna_validate_reuseport, NULL },
+    { "response_coalescing_usec", get_response_coalescing_usec,
+      dyna_validate_response_coalescing_usec,
+      dyna_reconfig_response_coalescing_usec },
+    { "direct_receive_size", get_direct_receive_size,
+      dyna_validate_direct_receive_size, dyna_reconfig_direct_receive_size },
+    { "max_outstanding_commands", get_max_outstanding_commands,
+      dyna_validate_max_outstanding_commands,
+      dyna_reconfig_max_outstanding_commands },
+    { "compression_threshold", get_compression_threshold,
+      dyna_validate_compression_threshold,
+      dyna_reconfig_compression_threshold },
+    { "inflate_cache_size", get_inflate_cache_size,
+      dyna_validate_inflate_cache_size, dyna_reconfig_inflate_cache_size },
+    { "dictionary_compression_max", get_dictionary_compression_max,
+      dyna_validate_dictionary_compression_max,
+      dyna_reconfig_dictionary_compression_max },
+    { "dictionary_file", get_dictionary_file, dyna_validate_dictionary_file,
+      NULL },
+    { "stream_compression_level", get_stream_compression_level,
+      dyna_validate_stream_compression_level,
+      dyna_reconfig_stream_compression_level },
+    { "subdoc_index_cache_size", get_subdoc_index_cache_size,
+      dyna_validate_subdoc_index_cache_size,
+      dyna_reconfig_subdoc_index_cache_size },
+    { "prefetch_depth", get_prefetch_depth, dyna_validate_prefetch_depth,
+      dyna_reconfig_prefetch_depth },
+    { "io_uring", get_io_uring, dyna_validate_io_uring, NULL },
+    { "arena_per_thread", get_arena_per_thread,
+      dyna_validate_arena_per_thread, NULL },
+    { "thread_affinity", get_thread_affinity, dyna_validate_thread_affinity,
+      NULL },
+    { "busy_poll_usec", get_busy_poll_usec, dyna_validate_busy_poll_usec,
+      dyna_reconfig_busy_poll_usec },
+    { "proxy", parse_proxy, dyna_validate_proxy, dyna_reconfig_proxy },
+    { "near_cache_items", get_near_cache_items,
+      dyna_validate_near_cache_items, NULL },
+    { "stats_snapshot_msec", get_stats_snapshot_msec,
+      dyna_validate_stats_snapshot_msec, dyna_reconfig_stats_snapshot_msec },
+    { "dcp_threads", get_dcp_threads, dyna_validate_dcp_threads, NULL },
+    { "scheduler_slice_usec", get_scheduler_slice_usec,
+      dyna_validate_scheduler_slice_usec, dyna_reconfig_scheduler_slice_usec },
+    { "max_slice_usec", get_max_slice_usec, dyna_validate_max_slice_usec,
+      dyna_reconfig_max_slice_usec },
+    { "shed_inflight", get_shed_inflight, dyna_validate_shed_inflight,
+      dyna_reconfig_shed_inflight },
+    { "shed_delay_usec", get_shed_delay_usec, dyna_validate_shed_delay_usec,
+      dyna_reconfig_shed_delay_usec },
+    { "max_unsent_bytes", get_max_unsent_bytes,
+      dyna_validate_max_unsent_bytes, dyna_reconfig_max_unsent_bytes },
+    { "max_pinned_items", get_max_pinned_items,
+      dyna_validate_max_pinned_items, dyna_reconfig_max_pinned_items },
+    { "rate_limit_user_ops", get_rate_limit_user_ops,
+      dyna_validate_rate_limit_user_ops, dyna_reconfig_rate_limit_user_ops },
+    { "rate_limit_user_bytes", get_rate_limit_user_bytes,
+      dyna_validate_rate_limit_user_bytes, dyna_reconfig_rate_limit_user_bytes },
+    { "rate_limit_bucket_ops", get_rate_limit_bucket_ops,
+      dyna_validate_rate_limit_bucket_ops, dyna_reconfig_rate_limit_bucket_ops },
+    { "rate_limit_bucket_bytes", get_rate_limit_bucket_bytes,
+      dyna_validate_rate_limit_bucket_bytes, dyna_reconfig_rate_limit_bucket_bytes },
+    { "sasl_threads", get_sasl_threads, dyna_validate_sasl_threads, NULL },
+    { "trace_sample_rate", get_trace_sample_rate,
+      dyna_validate_trace_sample_rate, dyna_reconfig_trace_sample_rate },
+    { "phase_timings", get_phase_timings, dyna_validate_phase_timings,
+      dyna_reconfig_phase_timings },
+    { "slow_command_threshold", get_slow_command_threshold,
+      dyna_validate_slow_command_threshold,
+      dyna_reconfig_slow_command_threshold },
+    { "idle_trim_sec", get_idle_trim_sec, dyna_validate_idle_trim_sec,
+      dyna_reconfig_idle_trim_sec },
+    { "idle_timeout", get_idle_timeout, dyna_validate_idle_timeout,
+      dyna_reconfig_idle_timeout },
+    { "free_memory_release_pct", get_free_memory_release_pct,
+      dyna_validate_free_memory_release_pct,
+      dyna_reconfig_free_memory_release_pct },
+    { "free_memory_release_rate", get_free_memory_release_rate,
+      dyna_validate_free_memory_release_rate,
+      dyna_reconfig_free_memory_release_rate },
+    { "gather_writes", get_gather_writes, dyna_validate_gather_writes,
+      dyna_reconfig_gather_writes },
+    { "scripts_file", get_scripts_file, dyna_validate_scripts_file, NULL },
+    { "workload_trace_dir", get_workload_trace_dir,
+      dyna_validate_workload_trace_dir, NULL },
+    { "workload_trace_file_size", get_workload_trace_file_size,
+      dyna_validate_workload_trace_file_size, NULL },
+    { "workload_trace_sample", get_workload_trace_sample,
+      dyna_validate_workload_trace_sample,
+      dyna_reconfig_workload_trace_sample },
+    { "vbucket_stats", get_vbucket_stats, dyna_validate_vbucket_stats, NULL },
     { NULL, NULL, NULL, NULL }
 };
 
@@ -1598,6 +3523,7 @@ void free_settings(struct settings* s) {
         free((char*)s->interfaces[ii].host);
         free((char*)s->interfaces[ii].ssl.key);
         free((char*)s->interfaces[ii].ssl.cert);
+        free((char*)s->interfaces[ii].path);
     }
     free(s->interfaces);
     for (ii = 0; ii < s->num_pending_extensions; ii++) {
@@ -1609,5 +3535,11 @@ void free_settings(struct settings* s) {
     free((char*)s->engine_config);
     free((char*)s->config);
     free((char*)s->root);
+    free((char*)s->dictionary_file);
+    free((char*)s->scripts_file);
+    free((char*)s->workload_trace_dir);
+    free((char*)s->thread_affinity);
     free((char*)s->breakpad.minidump_dir);
+    free((char*)s->proxy.username);
+    free((char*)s->proxy.password);
 }
@@ -2,6 +2,7 @@
 #include "config.h"
 
 #include <cJSON.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -115,3 +116,38 @@ config_error_t config_load_file(const char *file, cJSON **json)
 
     return CONFIG_SUCCESS;
 }
+
+int config_parse_cpu_list(const char *list, int *cpus, int max)
+{
+    const char *ptr = list;
+    int n = 0;
+
+    do {
+        char *end;
+        unsigned long first, last;
+
+        if (!isdigit((unsigned char)*ptr)) {
+            return -1;
+        }
+        first = last = strtoul(ptr, &end, 10);
+        if (*end == '-') {
+            ptr = end + 1;
+            if (!isdigit((unsigned char)*ptr)) {
+                return -1;
+            }
+            last = strtoul(ptr, &end, 10);
+        }
+        if (first > last || last >= CONFIG_MAX_CPUS) {
+            return -1;
+        }
+        for (; first <= last; ++first) {
+            if (n == max) {
+                return -1;
+            }
+            cpus[n++] = (int)first;
+        }
+        ptr = end;
+    } while (*ptr++ == ',');
+
+    return ptr[-1] == '\0' ? n : -1;
+}
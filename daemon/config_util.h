@@ -18,6 +18,17 @@ extern "C" {
     char *config_strerror(const char *file, config_error_t error);
     config_error_t config_load_file(const char *file, cJSON **json);
 
+    /* The CPUs a list may name are below this */
+#define CONFIG_MAX_CPUS 1024
+
+    /*
+     * Parse a list of CPUs such as "0-3,8,10-11" into cpus (in the order
+     * of the list, at most max of them). Returns how many there are, or
+     * -1 if the list is empty, not valid, has too many or has a CPU of
+     * CONFIG_MAX_CPUS or above.
+     */
+    int config_parse_cpu_list(const char *list, int *cpus, int max);
+
 #ifdef __cplusplus
 }
 #endif
@@ -15,10 +15,22 @@
  *   limitations under the License.
  */
 
+#ifndef _GNU_SOURCE
+/* For struct ucred */
+#define _GNU_SOURCE
+#endif
 #include "connections.h"
 #include "runtime.h"
+#include "ssl_sessions.h"
+#include "mc_time.h"
+#include "shm_ring.h"
+#include "near_cache.h"
+#include "stream_compression.h"
 
 #include <cJSON.h>
+#ifndef WIN32
+#include <pwd.h>
+#endif
 
 /*
  * Free list management for connections.
@@ -42,17 +54,31 @@ enum loan_res {
 
 static void conn_loan_buffers(conn *c);
 static void conn_return_buffers(conn *c);
-static bool conn_reset_buffersize(conn *c);
-static enum loan_res conn_loan_single_buffer(conn *c, struct net_buf *thread_buf,
-                                             struct net_buf *conn_buf);
-static void conn_return_single_buffer(conn *c, struct net_buf *thread_buf,
-                                      struct net_buf *conn_buf);
+static void conn_release_lists(conn *c);
+static size_t conn_trim(conn *c);
+static enum loan_res conn_loan_single_buffer(conn *c, struct net_buf *conn_buf);
+static void conn_return_single_buffer(conn *c, struct net_buf *conn_buf);
 static int conn_constructor(conn *c);
 static void conn_destructor(conn *c);
-static conn *allocate_connection(void);
-static void release_connection(conn *c);
+static void conn_initialize(conn *c);
+static void conn_free_members(conn *c);
+static conn *allocate_connection(LIBEVENT_THREAD *thread);
+static void release_connection(conn *c, LIBEVENT_THREAD *thread);
+static void connection_enable_zerocopy(conn *c, SOCKET sfd);
+static void connection_enable_busy_poll(SOCKET sfd);
+static void conn_add_busy_time(conn *c, LIBEVENT_THREAD *thr, hrtime_t ns);
+static void conn_slice_sample(conn *c, LIBEVENT_THREAD *thr, int budget,
+                              hrtime_t ns);
+static void conn_phase_resume(conn *c, hrtime_t now);
 
 static cJSON* get_connection_stats(const conn *c);
+static const struct conn_names *get_socket_names(const conn *c);
+static bool is_bookmark(const conn *c);
+
+struct conn_names {
+    char *peername; /* Name of the peer if known */
+    char *sockname; /* Name of the local socket if known */
+};
 
 
 /** External functions *******************************************************/
@@ -60,16 +86,18 @@ static const char unknown[] = "unknown";
 
 const char *get_sockname(const conn *c)
 {
-    if (c->sockname) {
-        return c->sockname;
+    const struct conn_names *names = get_socket_names(c);
+    if (names->sockname) {
+        return names->sockname;
     } else {
         return unknown;
     }
 }
 const char *get_peername(const conn *c)
 {
-    if (c->peername) {
-        return c->peername;
+    const struct conn_names *names = get_socket_names(c);
+    if (names->peername) {
+        return names->peername;
     } else {
         return unknown;
     }
@@ -89,17 +117,149 @@ void destroy_connections(void)
     conn *c = connections.sentinal.all_next;
     while (c != &connections.sentinal) {
         conn *next = c->all_next;
-        conn_destructor(c);
+        if (!is_bookmark(c)) {
+            conn_destructor(c);
+        }
         c = next;
     }
     connections.sentinal.all_next = &connections.sentinal;
     connections.sentinal.all_prev = &connections.sentinal;
 }
 
+/* How often an idle timer looks again with both idle settings off */
+#define IDLE_TIMER_INTERVAL 60
+
+/*
+ * The idle timer isn't moved as the connection runs: as it fires it
+ * works out how long the connection has really been idle, and arms
+ * itself for the earliest time one of the settings could apply.
+ */
+static rel_time_t idle_deadline(const conn *c, rel_time_t now,
+                                uint32_t timeout) {
+    rel_time_t deadline = c->active_time + timeout;
+    return deadline > now ? deadline : now + timeout;
+}
+
+static void conn_idle_timer_rearm(conn *c, rel_time_t now) {
+    uint32_t trim = settings.idle_trim_sec;
+    uint32_t timeout = settings.idle_timeout;
+    rel_time_t deadline = now + IDLE_TIMER_INTERVAL;
+
+    if (c->state == conn_zerocopy_close) {
+        /* Look for the completions of its sends again */
+        deadline = now + 1;
+    } else if (trim != 0 || timeout != 0) {
+        deadline = idle_deadline(c, now, trim != 0 ? trim : timeout);
+        if (trim != 0 && timeout != 0) {
+            rel_time_t other = idle_deadline(c, now, timeout);
+            if (other < deadline) {
+                deadline = other;
+            }
+        }
+    }
+    timer_wheel_arm(&c->thread->wheel, &c->idle_timer, deadline);
+}
+
+/* Nothing is lost by closing it (the client may reconnect) */
+static bool conn_idle_closable(const conn *c) {
+    return c->state == conn_read && !c->ewouldblock && c->dcp == 0 &&
+        c->tap_iterator == NULL && c->ileft == 0 &&
+        c->unordered.outstanding == 0;
+}
+
+static void conn_idle_timer_fired(struct wheel_timer *timer, rel_time_t now) {
+    conn *c = (conn*)((char*)timer - offsetof(conn, idle_timer));
+    uint32_t timeout = settings.idle_timeout;
+    uint32_t trim = settings.idle_trim_sec;
+    rel_time_t idle = now > c->active_time ? now - c->active_time : 0;
+
+    if (c->state == conn_zerocopy_close) {
+        run_event_loop(c);
+        return;
+    }
+    if (timeout != 0 && idle >= timeout && conn_idle_closable(c)) {
+        if (settings.verbose > 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                                            "%d: Closing the connection, "
+                                            "idle for %u seconds",
+                                            c->sfd, idle);
+        }
+        STATS_NOKEY(c, idle_closes);
+        conn_set_state(c, conn_closing);
+        run_event_loop(c);
+        return;
+    }
+
+    if (trim != 0 && idle >= trim) {
+        size_t bytes = conn_trim(c);
+        if (bytes > 0) {
+            STATS_NOKEY(c, idle_trims);
+            STATS_ADD(c, idle_trimmed_bytes, bytes);
+        }
+    }
+    conn_idle_timer_rearm(c, now);
+}
+
+void conn_idle_timer_arm(conn *c) {
+    cb_assert(c->thread != NULL && c->unordered.parent == NULL);
+    if (!wheel_timer_armed(&c->idle_timer)) {
+        wheel_timer_init(&c->idle_timer, conn_idle_timer_fired);
+    }
+    conn_idle_timer_rearm(c, mc_time_get_current_time());
+}
+
+void conn_idle_timer_cancel(conn *c) {
+    if (c->thread != NULL) {
+        timer_wheel_cancel(&c->thread->wheel, &c->idle_timer);
+    }
+}
+
+void conn_drain(LIBEVENT_THREAD *thr) {
+    conn *iter;
+
+    /* A connection handed over keeps its place in the list */
+    cb_mutex_enter(&connections.mutex);
+    for (iter = connections.sentinal.all_next;
+         iter != &connections.sentinal;
+         iter = iter->all_next) {
+        if (!is_bookmark(iter) && iter->thread == thr &&
+            iter->unordered.parent == NULL) {
+            migrate_conn(iter);
+        }
+    }
+    cb_mutex_exit(&connections.mutex);
+}
+
 void run_event_loop(conn* c) {
+    LIBEVENT_THREAD *thr = NULL;
+    hrtime_t start = 0;
+    int budget = 0;
 
-    if (!is_listen_thread()) {
+    /*
+     * The children of out of order commands own their buffers, and have
+     * their time accounted to the connection which runs them.
+     */
+    if (!is_listen_thread() && c->unordered.parent == NULL) {
+        thr = c->thread;
         conn_loan_buffers(c);
+        /* Read by the callback running the connection */
+        start = thread_clock(thr);
+        budget = c->nevents;
+        thr->shed.delay = start > thr->loop.woke ? start - thr->loop.woke : 0;
+        if (c->engine_wait) {
+            c->engine_wait = false;
+    c->direct.vlen = 0;
+            --thr->shed.inflight;
+        }
+        if (c->phase.blocked != 0) {
+            conn_phase_resume(c, start);
+        }
+        if (c->notify_time != 0) {
+            if (start > c->notify_time) {
+                thread_loop_notify_wait(thr, start - c->notify_time);
+            }
+            c->notify_time = 0;
+        }
     }
 
     do {
@@ -109,7 +269,22 @@ void run_event_loop(conn* c) {
         }
     } while (c->state(c));
 
-    if (!is_listen_thread()) {
+    if (thr != NULL) {
+        hrtime_t now = thread_clock_update(thr);
+        c->active_time = mc_time_get_current_time();
+        conn_add_busy_time(c, thr, now - start);
+        conn_slice_sample(c, thr, budget, now - start);
+        if (c->ewouldblock && c->phase.active) {
+            c->phase.blocked = now;
+        }
+        if (c->ewouldblock && c->state != conn_destroyed) {
+            c->engine_wait = true;
+            ++thr->shed.inflight;
+        }
+        if (c->ewouldblock) {
+            /* Don't keep the earlier responses waiting for the engine */
+            conn_coalesce_send(c);
+        }
         conn_return_buffers(c);
     }
 
@@ -117,7 +292,10 @@ void run_event_loop(conn* c) {
         /* Actually free the memory from this connection. Unsafe to dereference
          * c after this point.
          */
-        release_connection(c);
+        release_connection(c, thr);
+        c = NULL;
+    } else if (thr != NULL && migrate_conn(c)) {
+        /* Handed over to another thread, which may already be running it */
         c = NULL;
     }
 }
@@ -139,6 +317,27 @@ static char *sockaddr_to_string(const struct sockaddr_storage *addr,
                                 socklen_t addr_len,
                                 in_port_t port)
 {
+#ifndef WIN32
+    if (addr->ss_family == AF_UNIX) {
+        const struct sockaddr_un *un = (const struct sockaddr_un *)addr;
+        size_t off = offsetof(struct sockaddr_un, sun_path);
+        int len = addr_len > off ? (int)(addr_len - off) : 0;
+        char name[sizeof(un->sun_path) + 8];
+
+        if (len == 0) {
+            /* The clients' sockets are usually unnamed */
+            snprintf(name, sizeof(name), "unix");
+        } else if (un->sun_path[0] == '\0') {
+            snprintf(name, sizeof(name), "unix:@%.*s", len - 1,
+                     un->sun_path + 1);
+        } else {
+            snprintf(name, sizeof(name), "unix:%.*s",
+                     (int)strnlen(un->sun_path, len), un->sun_path);
+        }
+        return strdup(name);
+    }
+#endif
+
     char host[50];
     int err = getnameinfo((struct sockaddr*)addr, addr_len, host, sizeof(host),
                           0, 0, NI_NUMERICHOST);
@@ -224,6 +423,87 @@ static void initialize_socket_names(const SOCKET sfd,
     }
 }
 
+/*
+ * Look the names of the socket up the first time they're asked for, and
+ * not for every accept (most connections never need them). The stats of
+ * the connections may ask from another thread, so the first one to
+ * publish its lookup wins.
+ */
+static const struct conn_names *get_socket_names(const conn *c)
+{
+    static const struct conn_names no_names;
+    struct conn_names *names = __atomic_load_n(&c->names, __ATOMIC_ACQUIRE);
+    struct conn_names *expected = NULL;
+
+    if (names != NULL) {
+        return names;
+    }
+    if (c->sfd == INVALID_SOCKET || c->state == conn_listening ||
+        (names = calloc(1, sizeof(*names))) == NULL) {
+        return &no_names;
+    }
+    initialize_socket_names(c->sfd, &names->peername, &names->sockname,
+                            c->parent_port);
+    if (!__atomic_compare_exchange_n(&((conn *)c)->names, &expected, names,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        free(names->peername);
+        free(names->sockname);
+        free(names);
+        return expected;
+    }
+    return names;
+}
+
+static void free_socket_names(conn *c)
+{
+    if (c->names != NULL) {
+        free(c->names->peername);
+        free(c->names->sockname);
+        free(c->names);
+        c->names = NULL;
+    }
+}
+
+/**
+ * Look up the local user of the process at the other end of an AF_UNIX
+ * socket.
+ *
+ * @param sfd the socket of the connection
+ * @return the name of the user, or NULL if it can't be found (caller
+ *         takes ownership of the buffer and must call free)
+ */
+static char *get_peer_user(const SOCKET sfd)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    struct passwd pwd;
+    struct passwd *result = NULL;
+    char buf[1024];
+
+    if (getsockopt(sfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "getsockopt(SO_PEERCRED): %s",
+                                        strerror(errno));
+        return NULL;
+    }
+    if (getpwuid_r(cred.uid, &pwd, buf, sizeof(buf), &result) != 0 ||
+        result == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "%d: no user for the peer uid %u",
+                                        sfd, (unsigned int)cred.uid);
+        return NULL;
+    }
+    return strdup(pwd.pw_name);
+#else
+    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                    "%d: peer credentials are not supported "
+                                    "on this platform", sfd);
+    return NULL;
+#endif
+}
+
 static void dump_cipher_list(const SSL *ssl, SOCKET sfd) {
     settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
                                     "%d: Using SSL ciphers:", sfd);
@@ -237,79 +517,96 @@ static void dump_cipher_list(const SSL *ssl, SOCKET sfd) {
 
 conn *conn_new(const SOCKET sfd, in_port_t parent_port,
                STATE_FUNC init_state, int event_flags,
-               unsigned int read_buffer_size, struct event_base *base) {
-    conn *c = allocate_connection();
+               unsigned int read_buffer_size, struct event_base *base,
+               LIBEVENT_THREAD *thread) {
+    conn *c = allocate_connection(thread);
     if (c == NULL) {
         return NULL;
     }
     c->admin = false;
     cb_assert(c->thread == NULL);
 
-    memset(&c->ssl, 0, sizeof(c->ssl));
+    cb_assert(c->ssl == NULL && c->greenstack == NULL);
+    c->protocol = PROTOCOL_MEMCACHED;
     if (init_state != conn_listening) {
-        initialize_socket_names(sfd, &c->peername, &c->sockname, parent_port);
+        /* The names are looked up by get_peername() when they're needed */
         if (c->auth_context) {
             auth_destroy(c->auth_context);
         }
-        c->auth_context = auth_create(NULL, c->peername, c->sockname);;
+        c->auth_context = auth_create(NULL, NULL, NULL);
+        c->access_mask = NULL;
 
         int ii;
         for (ii = 0; ii < settings.num_interfaces; ++ii) {
             if (parent_port == settings.interfaces[ii].port) {
                 c->protocol = settings.interfaces[ii].protocol;
-                c->nodelay = settings.interfaces[ii].tcp_nodelay;
+                c->nodelay = settings.interfaces[ii].tcp_nodelay &&
+                    settings.interfaces[ii].path == NULL;
+                if (settings.interfaces[ii].peercred) {
+                    /* Without it the client may still use SASL */
+                    c->peer_user = get_peer_user(sfd);
+                }
                 if (settings.interfaces[ii].ssl.cert != NULL) {
-                    const char *cert = settings.interfaces[ii].ssl.cert;
-                    const char *pkey = settings.interfaces[ii].ssl.key;
-
-                    c->ssl.ctx = SSL_CTX_new(SSLv23_server_method());
-
-                    /* MB-12359 - Disable SSLv2 & SSLv3 due to POODLE */
-                    SSL_CTX_set_options(c->ssl.ctx,
-                                        SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
-
-                    /* @todo don't read files, but use in-memory-copies */
-                    if (!SSL_CTX_use_certificate_chain_file(c->ssl.ctx, cert) ||
-                        !SSL_CTX_use_PrivateKey_file(c->ssl.ctx, pkey, SSL_FILETYPE_PEM)) {
-                        release_connection(c);
+                    struct conn_ssl *ssl = calloc(1, sizeof(*ssl));
+                    if (ssl == NULL ||
+                        (ssl->ctx = ssl_interface_ctx(ii)) == NULL) {
+                        free(ssl);
+                        release_connection(c, thread);
                         return NULL;
                     }
 
-                    set_ssl_ctx_cipher_list(c->ssl.ctx);
-
-                    c->ssl.enabled = true;
-                    c->ssl.error = false;
-                    c->ssl.client = NULL;
-
-                    c->ssl.in.buffer = malloc(settings.bio_drain_buffer_sz);
-                    c->ssl.out.buffer = malloc(settings.bio_drain_buffer_sz);
-
-                    if (c->ssl.in.buffer == NULL || c->ssl.out.buffer == NULL) {
-                        release_connection(c);
+                    ssl->ktls = settings.interfaces[ii].ssl.ktls;
+
+                    /*
+                     * OpenSSL reads the records straight off the socket
+                     * and writes them straight to it, so the only copies
+                     * made are the ones to and from the connection
+                     * buffers (or the items) done by SSL_read/SSL_write.
+                     */
+                    ssl->client = SSL_new(ssl->ctx);
+                    if (ssl->client == NULL ||
+                        !SSL_set_fd(ssl->client, (int)sfd)) {
+                        SSL_free(ssl->client);
+                        free(ssl);
+                        release_connection(c, thread);
                         return NULL;
                     }
-
-                    c->ssl.in.buffsz = settings.bio_drain_buffer_sz;
-                    c->ssl.out.buffsz = settings.bio_drain_buffer_sz;
-                    BIO_new_bio_pair(&c->ssl.application,
-                                     settings.bio_drain_buffer_sz,
-                                     &c->ssl.network,
-                                     settings.bio_drain_buffer_sz);
-
-                    c->ssl.client = SSL_new(c->ssl.ctx);
-                    SSL_set_bio(c->ssl.client,
-                                c->ssl.application,
-                                c->ssl.application);
+                    /* transmit() retries a partial write from an adjusted iovec */
+                    SSL_set_mode(ssl->client,
+                                 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+                    set_ssl_conn_cipher_list(ssl->client);
+                    c->ssl = ssl;
 
                     if (settings.verbose > 1) {
-                        dump_cipher_list(c->ssl.client, sfd);
+                        dump_cipher_list(ssl->client, sfd);
                     }
                 }
             }
         }
+
+        if (c->protocol == PROTOCOL_GREENSTACK &&
+            (c->greenstack = calloc(1, sizeof(*c->greenstack))) == NULL) {
+            conn_release_ssl(c);
+            release_connection(c, thread);
+            return NULL;
+        }
     }
 
-    c->request_addr_size = 0;
+    c->unordered.enabled = c->unordered.blocked = false;
+    c->unordered.failed = false;
+    c->unordered.skip = 0;
+    c->zerocopy.enabled = false;
+    c->zerocopy.used = false;
+    c->zerocopy.next = c->zerocopy.done = 0;
+    c->zerocopy.npins = 0;
+    c->zerocopy.aborted = false;
+    if (init_state != conn_listening && settings.zerocopy_threshold != 0 &&
+        c->ssl == NULL) {
+        connection_enable_zerocopy(c, sfd);
+    }
+    if (init_state != conn_listening && settings.busy_poll_usec != 0) {
+        connection_enable_busy_poll(sfd);
+    }
 
     if (settings.verbose > 1) {
         if (init_state == conn_listening) {
@@ -323,6 +620,8 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
 
     c->sfd = sfd;
     c->max_reqs_per_event = settings.default_reqs_per_event;
+    c->priority = CONN_PRIORITY_MED;
+    c->engine_wait = false;
     c->parent_port = parent_port;
     c->state = init_state;
     c->rlbytes = 0;
@@ -347,9 +646,26 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
     c->item = 0;
     c->supports_datatype = false;
     c->supports_mutation_extras = false;
+    c->supports_exptime_ms = false;
+    c->compact.enabled = false;
+    c->compact.header_iov = -1;
+    c->stream = NULL;
+    c->stream_active = false;
+    c->near_cache.pending = NEAR_CACHE_NONE;
+    c->near_cache.disabled = false;
+    c->bound.binding.v1 = NULL;
+    c->bound.tried = false;
     c->noreply = false;
+    c->trace = c->trace_request = false;
     c->cmd_context = NULL;
     c->cmd_context_dtor = NULL;
+    c->busy.since = 0;
+    c->busy.current = c->busy.previous = 0;
+    c->uring.enabled = c->uring.armed = c->uring.fallback = false;
+    c->uring.want_read = false;
+    c->uring.eof = false;
+    c->uring.error = 0;
+    c->uring.head = c->uring.tail = -1;
 
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
@@ -357,7 +673,7 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
 
     if (!register_event(c, NULL)) {
         cb_assert(c->thread == NULL);
-        release_connection(c);
+        release_connection(c, thread);
         return NULL;
     }
 
@@ -367,6 +683,10 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
 
     c->aiostat = ENGINE_SUCCESS;
     c->ewouldblock = false;
+    c->resume = 0;
+    memset(&c->throttle, 0, sizeof(c->throttle));
+    memset(&c->phase, 0, sizeof(c->phase));
+    c->notify_time = 0;
     c->refcount = 1;
 
     MEMCACHED_CONN_ALLOCATE(c->sfd);
@@ -376,17 +696,135 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
     return c;
 }
 
+conn *conn_new_unordered(conn *parent, uint32_t read_size) {
+    conn *c = allocate_connection(NULL);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    if (read_size < DATA_BUFFER_SIZE) {
+        read_size = DATA_BUFFER_SIZE;
+    }
+    if (!thread_buffer_alloc(parent->thread, &c->read, read_size) ||
+        !thread_buffer_alloc(parent->thread, &c->write, DATA_BUFFER_SIZE)) {
+        thread_buffer_release(parent->thread, &c->read);
+        release_connection(c, NULL);
+        return NULL;
+    }
+
+    /*
+     * The commands are checked against the access rights of the parent,
+     * which doesn't change them while it has any children.
+     */
+    auth_destroy(c->auth_context);
+    c->auth_context = parent->auth_context;
+    c->access_mask = NULL;
+
+    c->admin = parent->admin;
+    c->protocol = PROTOCOL_MEMCACHED;
+    c->thread = parent->thread;
+    c->parent_port = parent->parent_port;
+    c->max_reqs_per_event = parent->max_reqs_per_event;
+    c->priority = parent->priority;
+    c->supports_datatype = parent->supports_datatype;
+    c->supports_mutation_extras = parent->supports_mutation_extras;
+    c->supports_exptime_ms = parent->supports_exptime_ms;
+    c->compact.enabled = parent->compact.enabled;
+    c->compact.header_iov = -1;
+    c->stream = NULL;
+    c->stream_active = false;
+    c->near_cache.pending = NEAR_CACHE_NONE;
+    c->near_cache.disabled = parent->near_cache.disabled;
+    c->bound.binding.v1 = NULL;
+    c->bound.tried = false;
+    c->cmd = -1;
+    c->icurr = c->ilist;
+    c->temp_alloc_curr = c->temp_alloc_list;
+    c->write_and_go = conn_new_cmd;
+    c->uring.head = c->uring.tail = -1;
+    c->aiostat = ENGINE_SUCCESS;
+    c->resume = 0;
+    c->refcount = 1;
+
+    c->unordered.parent = parent;
+    c->unordered.next = parent->unordered.children;
+    parent->unordered.children = c;
+    ++parent->unordered.outstanding;
+    ++parent->refcount;
+
+    perform_callbacks(ON_CONNECT, NULL, c);
+
+    return c;
+}
+
+void conn_release_unordered(conn *c) {
+    conn *parent = c->unordered.parent;
+    conn **prev = &parent->unordered.children;
+
+    conn_cleanup_engine_allocations(c);
+    if (c->cmd_context != NULL && c->cmd_context_dtor != NULL) {
+        c->cmd_context_dtor(c->cmd_context);
+    }
+    c->cmd_context = NULL;
+    for (; c->temp_alloc_left > 0; c->temp_alloc_left--, c->temp_alloc_curr++) {
+        free(*(c->temp_alloc_curr));
+    }
+    free(c->write_and_free);
+    c->write_and_free = NULL;
+
+    perform_callbacks(ON_DISCONNECT, NULL, c);
+
+    thread_buffer_release(c->thread, &c->read);
+    thread_buffer_release(c->thread, &c->write);
+    c->auth_context = NULL;
+    c->access_mask = NULL;
+    c->thread = NULL;
+
+    while (*prev != c) {
+        prev = &(*prev)->unordered.next;
+    }
+    *prev = c->unordered.next;
+    c->unordered.next = NULL;
+    --parent->unordered.outstanding;
+    --parent->refcount;
+
+    conn_set_state(c, conn_destroyed);
+}
+
+void conn_release_get_batch(conn *c) {
+    for (; c->get_batch.next < c->get_batch.count; c->get_batch.next++) {
+        item_get_request *req = &c->get_batch.requests[c->get_batch.next];
+        if (req->status == ENGINE_SUCCESS) {
+            settings.engine.v1->release(settings.engine.v0, c, req->item);
+        }
+    }
+    c->get_batch.count = c->get_batch.next = 0;
+}
+
 void conn_cleanup_engine_allocations(conn* c) {
     if (c->item) {
         settings.engine.v1->release(settings.engine.v0, c, c->item);
         c->item = 0;
     }
+    /* The command blocked in there is gone with it */
+    c->resume = 0;
 
     if (c->ileft != 0) {
         for (; c->ileft > 0; c->ileft--,c->icurr++) {
             settings.engine.v1->release(settings.engine.v0, c, *(c->icurr));
         }
     }
+
+    conn_release_get_batch(c);
+    conn_flush_releases(c);
+
+    /* The closing connections wait for the kernel to be done with their
+     * zero copy sends (see conn_zerocopy_close()), so these are the pins
+     * of completed sends only */
+    for (; c->zerocopy.npins > 0; c->zerocopy.npins--) {
+        settings.engine.v1->release(settings.engine.v0, c,
+                                    c->zerocopy.pins[c->zerocopy.npins - 1].item);
+    }
 }
 
 static void conn_cleanup(conn *c) {
@@ -408,9 +846,13 @@ static void conn_cleanup(conn *c) {
         cbsasl_dispose(&c->sasl_conn);
         c->sasl_conn = NULL;
     }
+    free(c->peer_user);
+    c->peer_user = NULL;
+    conn_shm_release(c);
 
     c->read.curr = c->read.buf;
     c->read.bytes = 0;
+    c->prefetched = 0;
     c->write.curr = c->write.buf;
     c->write.bytes = 0;
 
@@ -418,26 +860,64 @@ static void conn_cleanup(conn *c) {
      * connection from the thread. Note we clear TAP / UDP status first, so
      * conn_return_buffers() will actually free the buffers.
      */
+    conn_engine_unbind(c);
     c->tap_iterator = NULL;
     c->dcp = 0;
+    c->dcp_migrate = false;
+    c->sasl_auth.pending = false;
+    free(c->dcp_state);
+    c->dcp_state = NULL;
+    free(c->greenstack);
+    c->greenstack = NULL;
+    stream_compressor_destroy(c->stream);
+    c->stream = NULL;
+    c->stream_active = false;
     conn_return_buffers(c);
+    conn_release_lists(c);
+    thread_buffer_release(c->thread, &c->coalesce.buf);
+    c->coalesce.queued = c->coalesce.sending = false;
+    thread_buffer_release(c->thread, &c->unordered.buf);
+    thread_buffer_release(c->thread, &c->unordered.sending);
+    c->unordered.enabled = c->unordered.blocked = false;
+    c->unordered.failed = false;
+    c->unordered.skip = 0;
 
     c->engine_storage = NULL;
 
+    conn_idle_timer_cancel(c);
     c->thread = NULL;
     cb_assert(c->next == NULL);
     c->sfd = INVALID_SOCKET;
     c->start = 0;
-    if (c->ssl.enabled) {
-        BIO_free_all(c->ssl.network);
-        SSL_free(c->ssl.client);
-        c->ssl.enabled = false;
-        c->ssl.error = false;
-        free(c->ssl.in.buffer);
-        free(c->ssl.out.buffer);
-        SSL_CTX_free(c->ssl.ctx);
-        memset(&c->ssl, 0, sizeof(c->ssl));
+    memset(&c->phase, 0, sizeof(c->phase));
+    c->notify_time = 0;
+    conn_release_ssl(c);
+}
+
+void conn_close_listener(conn *c) {
+    if (c->registered_in_libevent) {
+        unregister_event(c);
+    }
+    safe_close(c->sfd);
+    c->sfd = INVALID_SOCKET;
+    c->state = conn_destroyed;
+    release_connection(c, NULL);
+}
+
+void conn_release_ssl(conn *c) {
+    if (c->ssl != NULL) {
+        /* The socket BIO doesn't close the socket */
+        SSL_free(c->ssl->client);
+        free(c->ssl);
+        c->ssl = NULL;
+    }
+}
+
+struct conn_dcp *conn_dcp_state(conn *c) {
+    if (c->dcp_state == NULL) {
+        c->dcp_state = calloc(1, sizeof(*c->dcp_state));
     }
+    return c->dcp_state;
 }
 
 void conn_close(conn *c) {
@@ -452,7 +932,11 @@ void conn_close(conn *c) {
                                         "Current connection was in the pending-io list.. Nuking it\n");
     }
     c->thread->pending_io = list_remove(c->thread->pending_io, c);
+    STATS_BUMP(c->thread->conns_closed, 1);
 
+    if (c->uring.enabled) {
+        conn_uring_release(c);
+    }
     conn_cleanup(c);
 
     cb_assert(c->thread == NULL);
@@ -463,24 +947,17 @@ void conn_shrink(conn *c) {
     cb_assert(c != NULL);
 
     if (c->read.size > READ_BUFFER_HIGHWAT && c->read.bytes < DATA_BUFFER_SIZE) {
-        void *newbuf;
-
         if (c->read.curr != c->read.buf) {
             /* Pack the buffer */
             memmove(c->read.buf, c->read.curr, (size_t)c->read.bytes);
+            c->read.curr = c->read.buf;
         }
 
-        newbuf = realloc(c->read.buf, DATA_BUFFER_SIZE);
-
-        if (newbuf) {
-            c->read.buf = newbuf;
-            c->read.size = DATA_BUFFER_SIZE;
-        } else {
+        if (!thread_buffer_resize(c->thread, &c->read, DATA_BUFFER_SIZE)) {
             settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                             "%d: Failed to shrink read buffer down to %" PRIu64
                                             " bytes.", c->sfd, DATA_BUFFER_SIZE);
         }
-        c->read.curr = c->read.buf;
     }
 
     if (c->msgsize > MSG_LIST_HIGHWAT) {
@@ -553,13 +1030,61 @@ struct listening_port *get_listening_port_instance(const in_port_t port) {
 
 }
 
-void connection_stats(ADD_STAT add_stats, conn *cookie, const int64_t fd) {
-    const conn *iter = NULL;
+/*
+ * Between two chunks of a "stats connections", a bookmark sits in the list
+ * of connections right after the last one sent. It's a conn with no state,
+ * which every walk of the list skips. The connections created since the
+ * stats call started (at the head of the list) aren't sent, and the ones
+ * going away don't get the walk lost.
+ */
+struct connection_stats_cursor {
+    conn bookmark;
+    int64_t fd;
+};
+
+static bool is_bookmark(const conn *c) {
+    return c->state == NULL;
+}
+
+struct connection_stats_cursor *connection_stats_cursor_create(int64_t fd) {
+    struct connection_stats_cursor *cursor = calloc(1, sizeof(*cursor));
+    if (cursor == NULL) {
+        return NULL;
+    }
+    cursor->fd = fd;
+
     cb_mutex_enter(&connections.mutex);
-    for (iter = connections.sentinal.all_next;
-         iter != &connections.sentinal;
+    cursor->bookmark.all_next = connections.sentinal.all_next;
+    cursor->bookmark.all_prev = &connections.sentinal;
+    connections.sentinal.all_next->all_prev = &cursor->bookmark;
+    connections.sentinal.all_next = &cursor->bookmark;
+    cb_mutex_exit(&connections.mutex);
+
+    return cursor;
+}
+
+void connection_stats_cursor_destroy(void *arg) {
+    struct connection_stats_cursor *cursor = arg;
+
+    cb_mutex_enter(&connections.mutex);
+    cursor->bookmark.all_next->all_prev = cursor->bookmark.all_prev;
+    cursor->bookmark.all_prev->all_next = cursor->bookmark.all_next;
+    cb_mutex_exit(&connections.mutex);
+    free(cursor);
+}
+
+bool connection_stats_next(struct connection_stats_cursor *cursor,
+                           ADD_STAT add_stats, conn *cookie, int max) {
+    conn *bookmark = &cursor->bookmark;
+    conn *iter;
+    bool done;
+
+    cb_mutex_enter(&connections.mutex);
+    for (iter = bookmark->all_next;
+         iter != &connections.sentinal && max > 0;
          iter = iter->all_next) {
-        if (iter->sfd == fd || fd == -1) {
+        if (!is_bookmark(iter) && iter->state != conn_destroyed &&
+            (iter->sfd == cursor->fd || cursor->fd == -1)) {
             cJSON* stats = get_connection_stats(iter);
             /* blank key - JSON value contains all properties of the connection. */
             char key[] = " ";
@@ -568,9 +1093,23 @@ void connection_stats(ADD_STAT add_stats, conn *cookie, const int64_t fd) {
                       stats_str, (uint32_t)strlen(stats_str), cookie);
             cJSON_Free(stats_str);
             cJSON_Delete(stats);
+            --max;
         }
     }
+    done = (iter == &connections.sentinal);
+
+    /* Move the bookmark in front of the next one to send */
+    if (iter != bookmark->all_next) {
+        bookmark->all_next->all_prev = bookmark->all_prev;
+        bookmark->all_prev->all_next = bookmark->all_next;
+        bookmark->all_next = iter;
+        bookmark->all_prev = iter->all_prev;
+        iter->all_prev->all_next = bookmark;
+        iter->all_prev = bookmark;
+    }
     cb_mutex_exit(&connections.mutex);
+
+    return done;
 }
 
 bool connection_set_nodelay(conn *c, bool enable)
@@ -598,22 +1137,65 @@ bool connection_set_nodelay(conn *c, bool enable)
 
 /** Internal functions *******************************************************/
 
+static void connection_enable_zerocopy(conn *c, SOCKET sfd)
+{
+#if defined(HAVE_MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+    int flags = 1;
+    if (c->zerocopy.pins == NULL) {
+        c->zerocopy.pins = malloc(sizeof(c->zerocopy.pins[0]) *
+                                  ZEROCOPY_MAX_PINS);
+        if (c->zerocopy.pins == NULL) {
+            return;
+        }
+    }
+    if (setsockopt(sfd, SOL_SOCKET, SO_ZEROCOPY,
+                   (void *)&flags, sizeof(flags)) == 0) {
+        c->zerocopy.enabled = true;
+    } else if (settings.verbose > 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+                                        "setsockopt(SO_ZEROCOPY): %s",
+                                        strerror(errno));
+    }
+#else
+    (void)c;
+    (void)sfd;
+#endif
+}
+
+/*
+ * Let the kernel busy poll the device queue of the socket when a read finds
+ * it empty. Raising it over net.core.busy_read needs CAP_NET_ADMIN.
+ */
+static void connection_enable_busy_poll(SOCKET sfd)
+{
+#ifdef SO_BUSY_POLL
+    int usec = (int)settings.busy_poll_usec;
+    if (setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL,
+                   (void *)&usec, sizeof(usec)) != 0 &&
+        settings.verbose > 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+                                        "setsockopt(SO_BUSY_POLL): %s",
+                                        strerror(errno));
+    }
+#else
+    (void)sfd;
+#endif
+}
+
 /**
  * If the connection doesn't already have read/write buffers, ensure that it
  * does.
  *
- * In the common case, only one read/write buffer is created per worker thread,
- * and this buffer is loaned to the connection the worker is currently
- * handling. As long as the connection doesn't have a partial read/write (i.e.
- * the buffer is totally consumed) when it goes idle, the buffer is simply
- * returned back to the worker thread.
+ * The buffers are taken from the worker thread's buffer pool, and as long as
+ * the connection doesn't have a partial read/write (i.e. the buffer is
+ * totally consumed) when it goes idle, they are returned to the pool again.
  *
  * If there is a partial read/write, then the buffer is left loaned to that
- * connection and the worker thread will allocate a new one.
+ * connection, and the next connection gets another buffer from the pool.
  */
 static void conn_loan_buffers(conn *c) {
     enum loan_res res;
-    res = conn_loan_single_buffer(c, &c->thread->read, &c->read);
+    res = conn_loan_single_buffer(c, &c->read);
     if (res == loan_allocated) {
         STATS_NOKEY(c, rbufs_allocated);
     } else if (res == loan_loaned) {
@@ -622,7 +1204,7 @@ static void conn_loan_buffers(conn *c) {
         STATS_NOKEY(c, rbufs_existing);
     }
 
-    res = conn_loan_single_buffer(c, &c->thread->write, &c->write);
+    res = conn_loan_single_buffer(c, &c->write);
     if (res == loan_allocated) {
         STATS_NOKEY(c, wbufs_allocated);
     } else if (res == loan_loaned) {
@@ -634,7 +1216,7 @@ static void conn_loan_buffers(conn *c) {
  * Return any empty buffers back to the owning worker thread.
  *
  * Converse of conn_loan_buffer(); if any of the read/write buffers are empty
- * (have no partial data) then return the buffer back to the worker thread.
+ * (have no partial data) then return the buffer back to the thread's pool.
  * If there is partial data, then keep the buffer with the connection.
  */
 static void conn_return_buffers(conn *c) {
@@ -652,95 +1234,112 @@ static void conn_return_buffers(conn *c) {
         return;
     }
 
-    conn_return_single_buffer(c, &c->thread->read, &c->read);
-    conn_return_single_buffer(c, &c->thread->write, &c->write);
+    conn_return_single_buffer(c, &c->read);
+    conn_return_single_buffer(c, &c->write);
+
+    /* Waiting for the next request with all of the responses sent */
+    if (c->state == conn_read && c->ileft == 0 && c->temp_alloc_left == 0 &&
+        !c->coalesce.queued && c->unordered.sending.bytes == 0) {
+        conn_release_lists(c);
+    }
 }
 
 /**
- * Reset all of the dynamic buffers used by a connection back to their
- * default sizes. The strategy for resizing the buffers is to allocate a
- * new one of the correct size and free the old one if the allocation succeeds
- * instead of using realloc to change the buffer size (because realloc may
- * not shrink the buffers, and will also copy the memory). If the allocation
- * fails the buffer will be unchanged.
+ * Free the lists a connection builds its responses in. They are allocated
+ * again by the first response which needs them, so an idle connection
+ * doesn't hold on to them.
  *
- * @param c the connection to resize the buffers for
- * @return true if all allocations succeeded, false if one or more of the
- *         allocations failed.
+ * @param c the connection, with nothing queued to be sent
  */
-static bool conn_reset_buffersize(conn *c) {
-    bool ret = true;
-
-    /* itemlist only needed for TAP / DCP connections, so we just free when the
-     * connection is reset.
-     */
+static void conn_release_lists(conn *c) {
     free(c->ilist);
-    c->ilist = NULL;
-    c->isize = 0;
-
-    if (c->temp_alloc_size != TEMP_ALLOC_LIST_INITIAL) {
-        void *ptr = malloc(sizeof(char *) * TEMP_ALLOC_LIST_INITIAL);
-        if (ptr != NULL) {
-            free(c->temp_alloc_list);
-            c->temp_alloc_list = ptr;
-            c->temp_alloc_size = TEMP_ALLOC_LIST_INITIAL;
-        } else {
-            ret = false;
-        }
-    }
+    c->icurr = c->ilist = NULL;
+    c->isize = c->ileft = 0;
 
-    if (c->iovsize != IOV_LIST_INITIAL) {
-        void *ptr = malloc(sizeof(struct iovec) * IOV_LIST_INITIAL);
-        if (ptr != NULL) {
-            free(c->iov);
-            c->iov = ptr;
-            c->iovsize = IOV_LIST_INITIAL;
-        } else {
-            ret = false;
-        }
+    free(c->temp_alloc_list);
+    c->temp_alloc_curr = c->temp_alloc_list = NULL;
+    c->temp_alloc_size = c->temp_alloc_left = 0;
+
+    free(c->iov);
+    c->iov = NULL;
+    c->iovsize = c->iovused = 0;
+
+    free(c->msglist);
+    c->msglist = NULL;
+    c->msgsize = c->msgused = c->msgcurr = 0;
+}
+
+/**
+ * Give up the memory kept by a connection which has been idle for a while:
+ * the response lists, the buffers (DCP and TAP keep theirs while running)
+ * and the out of order and batched get state, which are all set up again
+ * on demand.
+ *
+ * @param c the connection, owned by the calling thread
+ * @return the number of bytes released
+ */
+static size_t conn_trim(conn *c) {
+    size_t bytes = 0;
+
+    if (c->state != conn_read || c->ileft != 0 || c->temp_alloc_left != 0 ||
+        c->coalesce.queued || c->unordered.outstanding != 0 ||
+        c->unordered.buf.bytes != 0 || c->unordered.sending.buf != NULL ||
+        c->get_batch.count != 0) {
+        return 0;
     }
 
-    if (c->msgsize != MSG_LIST_INITIAL) {
-        void *ptr = malloc(sizeof(struct msghdr) * MSG_LIST_INITIAL);
-        if (ptr != NULL) {
-            free(c->msglist);
-            c->msglist = ptr;
-            c->msgsize = MSG_LIST_INITIAL;
-        } else {
-            ret = false;
-        }
+    bytes += c->isize * sizeof(c->ilist[0]) +
+        c->temp_alloc_size * sizeof(c->temp_alloc_list[0]) +
+        c->iovsize * sizeof(c->iov[0]) + c->msgsize * sizeof(c->msglist[0]);
+    conn_release_lists(c);
+
+    if (c->read.bytes == 0) {
+        bytes += c->read.size;
+        thread_buffer_release(c->thread, &c->read);
+    }
+    if (c->write.bytes == 0) {
+        bytes += c->write.size;
+        thread_buffer_release(c->thread, &c->write);
+    }
+    bytes += c->coalesce.buf.size + c->unordered.buf.size;
+    thread_buffer_release(c->thread, &c->coalesce.buf);
+    thread_buffer_release(c->thread, &c->unordered.buf);
+
+    if (c->get_batch.requests != NULL) {
+        bytes += GET_BATCH_MAX * (sizeof(item_get_request) +
+                                  sizeof(uint32_t) + KEY_MAX_LENGTH);
+        free(c->get_batch.requests);
+        c->get_batch.requests = NULL;
+        c->get_batch.opaques = NULL;
+        c->get_batch.keys = NULL;
     }
 
-    return ret;
+    return bytes;
+}
+
+/*
+ * Initialize all members of a connection object but its links in the list
+ * of all connections, which the walks through the list may be following.
+ */
+static void conn_initialize(conn *c) {
+    memset(&c->sfd, 0, sizeof(*c) - offsetof(conn, sfd));
+    c->auth_context = auth_create(NULL, NULL, NULL);;
+    c->state = conn_immediate_close;
+    c->sfd = INVALID_SOCKET;
 }
 
 /**
  * Constructor for all memory allocations of connection objects. Initialize
- * all members and allocate the transfer buffers.
+ * all members (the transfer buffers and lists are allocated on demand).
  *
  * @param buffer The memory allocated by the object cache
  * @return 0 on success, 1 if we failed to allocate memory
  */
 static int conn_constructor(conn *c) {
-    memset(c, 0, sizeof(*c));
+    c->all_next = c->all_prev = NULL;
+    conn_initialize(c);
     MEMCACHED_CONN_CREATE(c);
 
-    c->auth_context = auth_create(NULL, NULL, NULL);;
-    c->state = conn_immediate_close;
-    c->sfd = INVALID_SOCKET;
-    if (!conn_reset_buffersize(c)) {
-        free(c->read.buf);
-        free(c->write.buf);
-        free(c->ilist);
-        free(c->temp_alloc_list);
-        free(c->iov);
-        free(c->msglist);
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING,
-                                        NULL,
-                                        "Failed to allocate buffers for connection\n");
-        return 1;
-    }
-
     STATS_LOCK();
     stats.conn_structs++;
     STATS_UNLOCK();
@@ -748,19 +1347,30 @@ static int conn_constructor(conn *c) {
     return 0;
 }
 
-/**
- * Destructor for all connection objects. Release all allocated resources.
- */
-static void conn_destructor(conn *c) {
+/* Release everything a connection object owns but the object itself */
+static void conn_free_members(conn *c) {
     auth_destroy(c->auth_context);
-    free(c->peername);
-    free(c->sockname);
+    free_socket_names(c);
+    free(c->peer_user);
+    conn_shm_release(c);
     free(c->read.buf);
     free(c->write.buf);
+    free(c->coalesce.buf.buf);
+    free(c->unordered.buf.buf);
+    free(c->unordered.sending.buf);
     free(c->ilist);
+    free(c->zerocopy.pins);
+    free(c->get_batch.requests);
     free(c->temp_alloc_list);
     free(c->iov);
     free(c->msglist);
+}
+
+/**
+ * Destructor for all connection objects. Release all allocated resources.
+ */
+static void conn_destructor(conn *c) {
+    conn_free_members(c);
     free(c);
 
     STATS_LOCK();
@@ -771,9 +1381,24 @@ static void conn_destructor(conn *c) {
 /** Allocate a connection, creating memory and adding it to the conections
  *  list. Returns a pointer to the newly-allocated connection if successful,
  *  else NULL.
+ *
+ *  A connection set up by a worker thread reuses an object from the pool
+ *  of the thread (see LIBEVENT_THREAD::conn_pool) when it has one, which
+ *  is already on the list.
  */
-static conn *allocate_connection(void) {
-    conn *ret = malloc(sizeof(conn));
+static conn *allocate_connection(LIBEVENT_THREAD *thread) {
+    conn *ret;
+
+    if (thread != NULL && thread->conn_pool != NULL) {
+        ret = thread->conn_pool;
+        thread->conn_pool = ret->next;
+        thread->conn_pool_size--;
+        ret->next = NULL;
+        ret->state = conn_immediate_close;
+        return ret;
+    }
+
+    ret = malloc(sizeof(conn));
     if (ret == NULL) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                                         "Failed to allocate memory for connection");
@@ -800,9 +1425,21 @@ static conn *allocate_connection(void) {
 }
 
 /** Release a connection; removing it from the connection list management
- *  and freeing the conn object.
+ *  and freeing the conn object, or putting it in the pool of the thread
+ *  (while it has room) for the next connection the thread sets up.
  */
-static void release_connection(conn *c) {
+static void release_connection(conn *c, LIBEVENT_THREAD *thread) {
+    if (thread != NULL && thread->conn_pool_size < CONN_POOL_MAX) {
+        conn_free_members(c);
+        conn_initialize(c);
+        /* The walks through all connections skip the pooled objects */
+        c->state = conn_destroyed;
+        c->next = thread->conn_pool;
+        thread->conn_pool = c;
+        thread->conn_pool_size++;
+        return;
+    }
+
     cb_mutex_enter(&connections.mutex);
     c->all_next->all_prev = c->all_prev;
     c->all_prev->all_next = c->all_next;
@@ -814,66 +1451,253 @@ static void release_connection(conn *c) {
 
 /**
  * If the connection doesn't already have a populated conn_buff, ensure that
- * it does by either loaning out the threads, or allocating a new one if
- * necessary.
+ * it does by taking one from the thread's buffer pool (which allocates a
+ * new one if it's empty).
  */
-static enum loan_res conn_loan_single_buffer(conn *c, struct net_buf *thread_buf,
-                                    struct net_buf *conn_buf)
+static enum loan_res conn_loan_single_buffer(conn *c, struct net_buf *conn_buf)
 {
+    /* Pool size class 0 holds the DATA_BUFFER_SIZE buffers */
+    bool pooled = c->thread->buffers[0].free != NULL;
+
     /* Already have a (partial) buffer - nothing to do. */
     if (conn_buf->buf != NULL) {
         return loan_existing;
     }
 
-    if (thread_buf->buf != NULL) {
-        /* Loan thread's buffer to connection. */
-        *conn_buf = *thread_buf;
-
-        thread_buf->buf = NULL;
-        thread_buf->size = 0;
-        return loan_loaned;
-    } else {
-        /* Need to allocate a new buffer. */
-        conn_buf->buf = malloc(DATA_BUFFER_SIZE);
-        if (conn_buf->buf == NULL) {
-            /* Unable to alloc a buffer for the thread. Not much we can do here
-             * other than terminate the current connection.
-             */
-            if (settings.verbose) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                    "%d: Failed to allocate new read buffer.. closing connection\n",
-                    c->sfd);
-            }
-            conn_set_state(c, conn_closing);
-            return loan_existing;
+    if (!thread_buffer_alloc(c->thread, conn_buf, DATA_BUFFER_SIZE)) {
+        /* Unable to alloc a buffer for the thread. Not much we can do here
+         * other than terminate the current connection.
+         */
+        if (settings.verbose) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: Failed to allocate new read buffer.. closing connection\n",
+                c->sfd);
         }
-        conn_buf->size = DATA_BUFFER_SIZE;
-        conn_buf->curr = conn_buf->buf;
-        conn_buf->bytes = 0;
-        return loan_allocated;
+        conn_set_state(c, conn_closing);
+        return loan_existing;
     }
+    return pooled ? loan_loaned : loan_allocated;
 }
 
 /**
  * Return an empty read buffer back to the owning worker thread.
  */
-static void conn_return_single_buffer(conn *c, struct net_buf *thread_buf,
-                                      struct net_buf *conn_buf) {
+/*
+ * Fair sharing of the worker threads between the client, DCP and TAP
+ * connections. Each kind keeps the busy time of its connections in the
+ * thread, weighed by their priority, and a kind which got more than
+ * scheduler_slice_usec ahead of the one behind it (of those which ran
+ * lately) is held back: its connections only run one command per event,
+ * and yield to the others after that. A kind which was idle for a while
+ * starts out level with the others, so it can't save up time.
+ */
+#define SCHED_ACTIVE_SLICES 10
+
+static enum sched_class conn_sched_class(const conn *c) {
+    if (c->dcp) {
+        return SCHED_DCP;
+    } else if (c->tap_iterator != NULL) {
+        return SCHED_TAP;
+    }
+    return SCHED_CLIENT;
+}
+
+/* The weight of the priority; the busy time counts 4 / weight times */
+static uint64_t conn_sched_weight(const conn *c) {
+    switch (c->priority) {
+    case CONN_PRIORITY_HIGH:
+        return 4;
+    case CONN_PRIORITY_LOW:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+void conn_set_priority(conn *c, CONN_PRIORITY priority) {
+    switch (priority) {
+    case CONN_PRIORITY_HIGH:
+        c->max_reqs_per_event = settings.reqs_per_event_high_priority;
+        break;
+    case CONN_PRIORITY_MED:
+        c->max_reqs_per_event = settings.reqs_per_event_med_priority;
+        break;
+    case CONN_PRIORITY_LOW:
+        c->max_reqs_per_event = settings.reqs_per_event_low_priority;
+        break;
+    default:
+        abort();
+    }
+    c->priority = priority;
+}
+
+/*
+ * Adaptive reqs_per_event: a pass of the event loop of a worker thread
+ * should take no longer than max_slice_usec, so a connection ready to run
+ * doesn't wait more than that for the ones ahead of it. The thread keeps
+ * a moving average of the time of a command, and splits max_slice_usec
+ * between the connections which ran in its previous pass: a connection
+ * only gets the commands fitting in its share (at least one) of
+ * reqs_per_event. A connection alone on its thread keeps them all.
+ */
+static int conn_slice_budget(conn *c, LIBEVENT_THREAD *thr, int budget) {
+    uint64_t share = (uint64_t)settings.max_slice_usec * 1000;
+    uint64_t cmd_ns = thr->slice.cmd_ns;
+    uint64_t fit;
+
+    if (share == 0 || budget <= 1 || cmd_ns == 0 || thr->slice.ready <= 1) {
+        return budget;
+    }
+    share /= thr->slice.ready;
+    fit = share / cmd_ns;
+    if (fit >= (uint64_t)budget) {
+        return budget;
+    }
+    STATS_NOKEY(c, slice_trimmed);
+    return fit == 0 ? 1 : (int)fit;
+}
+
+/*
+ * Feed the time the connection ran for the event, and the commands it
+ * got through of its budget, to the average of the thread. (A TAP
+ * connection receiving a burst of acks may run more than its budget,
+ * those events are left out.)
+ */
+static void conn_slice_sample(conn *c, LIBEVENT_THREAD *thr, int budget,
+                              hrtime_t ns) {
+    int used = budget - (c->nevents > 0 ? c->nevents : 0);
+    uint64_t cmd_ns;
+
+    if (settings.max_slice_usec == 0 || used <= 0 || used > budget) {
+        return;
+    }
+    cmd_ns = ns / used;
+    if (thr->slice.cmd_ns != 0) {
+        /* 1/8 of the new sample, to ride out a slow command */
+        cmd_ns = thr->slice.cmd_ns - thr->slice.cmd_ns / 8 + cmd_ns / 8;
+    }
+    STATS_STORE(thr->slice.cmd_ns, cmd_ns);
+}
+
+int conn_sched_budget(conn *c) {
+    LIBEVENT_THREAD *thr = c->thread;
+    hrtime_t active = (hrtime_t)settings.scheduler_slice_usec * 1000 *
+        SCHED_ACTIVE_SLICES;
+    uint64_t behind = UINT64_MAX;
+    enum sched_class cls;
+    hrtime_t now;
+    int ii;
+
+    if (thr == NULL) {
+        return c->max_reqs_per_event;
+    }
+    if (active == 0) {
+        return conn_slice_budget(c, thr, c->max_reqs_per_event);
+    }
+
+    cls = conn_sched_class(c);
+    now = thread_clock(thr);
+    for (ii = 0; ii < SCHED_CLASSES; ++ii) {
+        if (ii != cls && now - thr->sched.ran[ii] < active &&
+            thr->sched.vtime[ii] < behind) {
+            behind = thr->sched.vtime[ii];
+        }
+    }
+    if (behind == UINT64_MAX) {
+        /* Nobody to share the thread with */
+        return conn_slice_budget(c, thr, c->max_reqs_per_event);
+    }
+
+    if (now - thr->sched.ran[cls] >= active &&
+        thr->sched.vtime[cls] < behind) {
+        thr->sched.vtime[cls] = behind;
+    }
+    if (thr->sched.vtime[cls] > behind + active / SCHED_ACTIVE_SLICES) {
+        STATS_NOKEY(c, sched_throttled);
+        return 1;
+    }
+    return conn_slice_budget(c, thr, c->max_reqs_per_event);
+}
+
+/*
+ * Admission control: while shed_inflight of the connections of the thread
+ * wait for the engine, or the event waited more than shed_delay_usec for
+ * the ones ahead of it, the thread is overloaded and the low priority
+ * connections get ETMPFAIL for their data commands instead of adding to
+ * the backlog. The connections of the default priority are shed from
+ * twice the thresholds, and the high priority, admin, DCP and TAP
+ * connections never are.
+ */
+bool conn_admit(conn *c) {
+    LIBEVENT_THREAD *thr = c->thread;
+    uint64_t scale;
+
+    if ((settings.shed_inflight == 0 && settings.shed_delay_usec == 0) ||
+        thr == NULL || c->admin || c->dcp || c->tap_iterator != NULL) {
+        return true;
+    }
+
+    switch (c->priority) {
+    case CONN_PRIORITY_HIGH:
+        return true;
+    case CONN_PRIORITY_LOW:
+        scale = 1;
+        break;
+    default:
+        scale = 2;
+    }
+
+    if ((settings.shed_inflight != 0 &&
+         thr->shed.inflight >= settings.shed_inflight * scale) ||
+        (settings.shed_delay_usec != 0 &&
+         thr->shed.delay >= (hrtime_t)settings.shed_delay_usec * 1000 * scale)) {
+        STATS_NOKEY(c, cmds_shed);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Back from EWOULDBLOCK: account the wait for the engine, and the time
+ * from its notify_io_complete() until we got to run. The notification
+ * may have come before we noticed the command blocked, that's all wait.
+ */
+static void conn_phase_resume(conn *c, hrtime_t now) {
+    hrtime_t notified = c->phase.notified;
+    if (notified < c->phase.blocked || notified > now) {
+        notified = now;
+    }
+    c->phase.ewouldblock += notified - c->phase.blocked;
+    c->phase.wakeup += now - notified;
+    c->phase.blocked = 0;
+}
+
+static void conn_add_busy_time(conn *c, LIBEVENT_THREAD *thr, hrtime_t ns) {
+    rel_time_t now = mc_time_get_current_time();
+
+    STATS_BUMP(thr->busy_ns, ns);
+    if (settings.scheduler_slice_usec != 0) {
+        enum sched_class cls = conn_sched_class(c);
+        thr->sched.vtime[cls] += ns * 4 / conn_sched_weight(c);
+        thr->sched.ran[cls] = thread_clock(thr);
+    }
+    if (c->busy.since != now) {
+        c->busy.previous = (c->busy.since + 1 == now) ? c->busy.current : 0;
+        c->busy.current = 0;
+        c->busy.since = now;
+    }
+    c->busy.current += ns;
+}
+
+static void conn_return_single_buffer(conn *c, struct net_buf *conn_buf) {
     if (conn_buf->buf == NULL) {
         /* No buffer - nothing to do. */
         return;
     }
 
     if ((conn_buf->curr == conn_buf->buf) && (conn_buf->bytes == 0)) {
-        /* Buffer clean, dispose of it. */
-        if (thread_buf->buf == NULL) {
-            /* Give back to thread. */
-            *thread_buf = *conn_buf;
-        } else {
-            free(conn_buf->buf);
-        }
-        conn_buf->buf = conn_buf->curr = NULL;
-        conn_buf->size = 0;
+        /* Buffer clean, give it back to the thread's pool. */
+        thread_buffer_release(c->thread, conn_buf);
     } else {
         /* Partial data exists; leave the buffer with the connection. */
     }
@@ -929,11 +1753,14 @@ static cJSON* get_connection_stats(const conn *c) {
         default:
             cJSON_AddStringToObject(obj, "protocol", "unknown");
         }
-        if (c->peername) {
-            cJSON_AddStringToObject(obj, "peername", c->peername);
-        }
-        if (c->sockname) {
-            cJSON_AddStringToObject(obj, "sockname", c->sockname);
+        {
+            const struct conn_names *names = get_socket_names(c);
+            if (names->peername) {
+                cJSON_AddStringToObject(obj, "peername", names->peername);
+            }
+            if (names->sockname) {
+                cJSON_AddStringToObject(obj, "sockname", names->sockname);
+            }
         }
         cJSON_AddNumberToObject(obj, "nevents", c->nevents);
         if (c->sasl_conn != NULL) {
@@ -1018,6 +1845,7 @@ static cJSON* get_connection_stats(const conn *c) {
         }
         json_add_bool_to_object(obj, "noreply", c->noreply);
         json_add_bool_to_object(obj, "nodelay", c->nodelay);
+        json_add_bool_to_object(obj, "shm_ring", c->shm != NULL);
         cJSON_AddNumberToObject(obj, "refcount", c->refcount);
         {
             cJSON* dy_buf = cJSON_CreateObject();
@@ -1040,8 +1868,33 @@ static cJSON* get_connection_stats(const conn *c) {
         json_add_uintptr_to_object(obj, "thread", (uintptr_t)c->thread);
         cJSON_AddNumberToObject(obj, "aiostat", c->aiostat);
         json_add_bool_to_object(obj, "ewouldblock", c->ewouldblock);
+        json_add_bool_to_object(obj, "throttled", c->throttle.active);
         json_add_uintptr_to_object(obj, "tap_iterator",
                                    (uintptr_t)c->tap_iterator);
+        if (c->dcp && c->dcp_state != NULL) {
+            const struct conn_dcp *state = c->dcp_state;
+            cJSON *dcp = cJSON_CreateObject();
+            cJSON_AddNumberToObject(dcp, "flow_window", state->flow.window);
+            cJSON_AddNumberToObject(dcp, "flow_unacked", state->flow.unacked);
+            cJSON_AddNumberToObject(dcp, "compression_threshold",
+                                    state->compression.threshold);
+            cJSON_AddNumberToObject(dcp, "values_compressed",
+                                    (double)state->compression.values);
+            cJSON_AddNumberToObject(dcp, "compressed_bytes_in",
+                                    (double)state->compression.bytes_in);
+            cJSON_AddNumberToObject(dcp, "compressed_bytes_out",
+                                    (double)state->compression.bytes_out);
+            cJSON_AddItemToObject(obj, "dcp", dcp);
+        }
+        if (c->stream != NULL) {
+            cJSON *stream = cJSON_CreateObject();
+            uint64_t bytes_in, bytes_out;
+            stream_compressor_totals(c->stream, &bytes_in, &bytes_out);
+            json_add_bool_to_object(stream, "active", c->stream_active);
+            cJSON_AddNumberToObject(stream, "bytes_in", (double)bytes_in);
+            cJSON_AddNumberToObject(stream, "bytes_out", (double)bytes_out);
+            cJSON_AddItemToObject(obj, "stream_compression", stream);
+        }
     }
     return obj;
 }
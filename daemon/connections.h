@@ -45,15 +45,46 @@ void initialize_connections(void);
 /* Destroy all connections and reset connection management */
 void destroy_connections(void);
 
+/*
+ * Arms (or cancels) the idle timer of the connection in the timer wheel
+ * of its thread, the calling thread. While the connection stays attached
+ * to the thread the timer releases its memory once it has been idle for
+ * "idle_trim_sec", and closes it once it has been idle for "idle_timeout".
+ */
+void conn_idle_timer_arm(conn *c);
+void conn_idle_timer_cancel(conn *c);
+
+/*
+ * Hands the idle connections of thr (the calling thread, with its lock
+ * held) over to the threads in use, see threads_resize().
+ */
+void conn_drain(LIBEVENT_THREAD *thr);
+
 /* Run the connection event loop; until an event handler returns false. */
 void run_event_loop(conn* c);
 
 /* Creates a new connection. Returns a pointer to the allocated connection if
- * successful, else NULL.
+ * successful, else NULL. The connection object is taken from the pool of
+ * thread, if not NULL (it must be the calling thread).
  */
 conn *conn_new(const SOCKET sfd, in_port_t parent_port,
                STATE_FUNC init_state, int event_flags,
-               unsigned int read_buffer_size, struct event_base *base);
+               unsigned int read_buffer_size, struct event_base *base,
+               LIBEVENT_THREAD *thread);
+
+/*
+ * Creates a child of parent to execute a command out of order on (see
+ * conn::unordered), with a read buffer of at least read_size bytes. The
+ * child is the engine cookie for the command, and holds a reference on
+ * its parent until conn_release_unordered() is called.
+ */
+conn *conn_new_unordered(conn *parent, uint32_t read_size);
+
+/*
+ * Releases the engine resources of a child created by
+ * conn_new_unordered(), and moves it to conn_destroyed.
+ */
+void conn_release_unordered(conn *c);
 
 /*
  * Closes a connection. Afterwards the connection is invalid (can no longer
@@ -62,6 +93,12 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
  */
 void conn_close(conn *c);
 
+/*
+ * Closes and frees a listening connection of the dispatcher (when its
+ * interface is rebound).
+ */
+void conn_close_listener(conn *c);
+
 /*
  * Shrinks a connection's buffers if they're too big.  This prevents
  * periodic large "get" requests from permanently chewing lots of server
@@ -84,11 +121,19 @@ bool grow_dynamic_buffer(conn *c, size_t needed);
  */
 struct listening_port *get_listening_port_instance(const in_port_t port);
 
-/* Dump stats for the connection with the given fd number, or all connections
- * if fd is -1.
- * Note: We hold the connections mutex for the duration of this function.
+/*
+ * The stats of the connections are sent in chunks, from a cursor walking
+ * the connections with the given fd number, or all connections if fd is -1.
+ * connection_stats_next() adds the stats of (at most) the next max
+ * connections, holding the connections mutex while it does, and returns
+ * true once it's done with all of them.
  */
-void connection_stats(ADD_STAT add_stats, conn *c, const int64_t fd);
+struct connection_stats_cursor;
+struct connection_stats_cursor *connection_stats_cursor_create(int64_t fd);
+bool connection_stats_next(struct connection_stats_cursor *cursor,
+                           ADD_STAT add_stats, conn *c, int max);
+/* Takes a cursor, to be a cmd_context_dtor */
+void connection_stats_cursor_destroy(void *cursor);
 
 bool connection_set_nodelay(conn *c, bool enable);
 
@@ -97,6 +142,45 @@ bool connection_set_nodelay(conn *c, bool enable);
  */
 void conn_cleanup_engine_allocations(conn* c);
 
+/*
+ * Release the items looked up ahead of time for pipelined GETQ/GETKQ
+ * packets which are not going to be executed.
+ */
+void conn_release_get_batch(conn *c);
+
+/*
+ * Free the OpenSSL objects of the connection, either when it is closed
+ * or once its records have been offloaded to the kernel.
+ */
+void conn_release_ssl(conn *c);
+
+/*
+ * The DCP state of the connection, allocated by the first call. Returns
+ * NULL if we failed to allocate it.
+ */
+struct conn_dcp *conn_dcp_state(conn *c);
+
+/*
+ * Set the priority of the connection, which picks reqs_per_event and
+ * weighs its busy time for the scheduler.
+ */
+void conn_set_priority(conn *c, CONN_PRIORITY priority);
+
+/*
+ * The number of commands (or DCP/TAP steps) the connection may run for
+ * the event it got: max_reqs_per_event (cut down to its share of
+ * max_slice_usec), or one if its kind of connection got more than
+ * scheduler_slice_usec ahead of another kind competing for the thread.
+ */
+int conn_sched_budget(conn *c);
+
+/*
+ * May the connection run its next data command? False (and it should get
+ * ETMPFAIL) when its worker thread is over the shed_inflight or
+ * shed_delay_usec thresholds for its priority.
+ */
+bool conn_admit(conn *c);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
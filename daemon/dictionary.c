@@ -0,0 +1,444 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * One in DICTIONARY_SAMPLE_RATE of the values which may be compressed
+ * with a dictionary is copied to the sample buffer while a dictionary is
+ * wanted (there is none yet, or the current one is over
+ * DICTIONARY_RETRAIN_INTERVAL old), and once the buffer is full the
+ * training thread makes the next dictionary of it. Only that thread adds
+ * dictionaries, and they are never freed before the shutdown, so the
+ * worker threads look them up without a lock: an entry of versions is
+ * filled before nversions counts it. The versions stop at
+ * DICTIONARY_VERSIONS, as dropping one would lose the values it
+ * compressed.
+ *
+ * The dictionary file holds the dictionaries in the order they were
+ * trained, each preceded by its size (4 bytes in network byte order).
+ */
+#include "config.h"
+#include "dictionary.h"
+#include "mc_time.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZSTD
+
+#include <errno.h>
+#include <stdio.h>
+#include <zstd.h>
+#include <zdict.h>
+
+#define DICTIONARY_SIZE (16 * 1024)
+#define DICTIONARY_MAX_SIZE (1024 * 1024)
+#define DICTIONARY_SAMPLE_BYTES (1024 * 1024)
+#define DICTIONARY_MAX_SAMPLES 8192
+#define DICTIONARY_SAMPLE_RATE 8
+#define DICTIONARY_RETRAIN_INTERVAL 3600
+#define DICTIONARY_VERSIONS 8
+#define DICTIONARY_LEVEL 3
+
+struct dictionary {
+    uint32_t id;
+    size_t size;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+};
+
+struct dictionary_contexts {
+    ZSTD_CCtx *cctx;            /* created the first time they're used */
+    ZSTD_DCtx *dctx;
+    uint32_t skipped;           /* values not sampled since the last one */
+};
+
+static struct {
+    cb_mutex_t mutex;           /* the samples and the training thread */
+    cb_cond_t cond;
+    cb_thread_t tid;
+    bool running;
+    bool shutdown;
+    /* Set when the samples are handed to the training thread */
+    volatile bool training;
+    rel_time_t trained;
+    size_t nbytes;
+    uint32_t nsamples;
+    size_t sizes[DICTIONARY_MAX_SAMPLES];
+    char samples[DICTIONARY_SAMPLE_BYTES];
+
+    struct dictionary *volatile versions[DICTIONARY_VERSIONS];
+    volatile uint32_t nversions;
+    uint64_t bytes;
+    volatile uint64_t training_failures;
+} dicts;
+
+static struct dictionary *dictionary_find(uint32_t id) {
+    uint32_t n = dicts.nversions;
+    uint32_t ii;
+
+    for (ii = 0; ii < n; ++ii) {
+        if (dicts.versions[ii]->id == id) {
+            return dicts.versions[ii];
+        }
+    }
+    return NULL;
+}
+
+static void dictionary_free(struct dictionary *dict) {
+    ZSTD_freeCDict(dict->cdict);
+    ZSTD_freeDDict(dict->ddict);
+    free(dict);
+}
+
+/* Add the next version (by the only thread adding them) */
+static bool dictionary_add(const void *data, size_t size) {
+    uint32_t id = ZDICT_getDictID(data, size);
+    struct dictionary *dict;
+
+    if (id == 0 || dictionary_find(id) != NULL ||
+        dicts.nversions == DICTIONARY_VERSIONS) {
+        return false;
+    }
+
+    dict = calloc(1, sizeof(*dict));
+    if (dict == NULL) {
+        return false;
+    }
+    dict->id = id;
+    dict->size = size;
+    dict->cdict = ZSTD_createCDict(data, size, DICTIONARY_LEVEL);
+    dict->ddict = ZSTD_createDDict(data, size);
+    if (dict->cdict == NULL || dict->ddict == NULL) {
+        dictionary_free(dict);
+        return false;
+    }
+
+    dicts.versions[dicts.nversions] = dict;
+    __sync_synchronize();
+    dicts.nversions++;
+    dicts.bytes += size;
+    return true;
+}
+
+/* The dictionary isn't used unless it's saved, or its values would be lost */
+static bool dictionary_save(const void *data, size_t size) {
+    uint32_t len = htonl((uint32_t)size);
+    FILE *fp;
+
+    if (settings.dictionary_file == NULL) {
+        return true;
+    }
+    fp = fopen(settings.dictionary_file, "ab");
+    if (fp != NULL) {
+        bool ok = fwrite(&len, sizeof(len), 1, fp) == 1 &&
+            fwrite(data, size, 1, fp) == 1;
+        if (fclose(fp) == 0 && ok) {
+            return true;
+        }
+    }
+    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Failed to save the compression dictionary to %s: %s\n",
+            settings.dictionary_file, strerror(errno));
+    return false;
+}
+
+static bool dictionary_load(const char *file) {
+    FILE *fp = fopen(file, "rb");
+    uint32_t len;
+    bool ret = true;
+
+    if (fp == NULL) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "Failed to open the dictionary file %s: %s\n",
+                file, strerror(errno));
+        return false;
+    }
+
+    while (ret && fread(&len, sizeof(len), 1, fp) == 1) {
+        char *data;
+
+        len = ntohl(len);
+        if (len == 0 || len > DICTIONARY_MAX_SIZE ||
+            (data = malloc(len)) == NULL) {
+            ret = false;
+            break;
+        }
+        if (fread(data, len, 1, fp) != 1 ||
+            (!dictionary_add(data, len) &&
+             dictionary_find(ZDICT_getDictID(data, len)) == NULL)) {
+            ret = false;
+        }
+        free(data);
+    }
+    fclose(fp);
+
+    if (!ret) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "The dictionary file %s is corrupt\n", file);
+    }
+    return ret;
+}
+
+static void dictionary_train(void) {
+    char *data = malloc(DICTIONARY_SIZE);
+    size_t size;
+
+    if (data == NULL) {
+        dicts.training_failures++;
+        return;
+    }
+    size = ZDICT_trainFromBuffer(data, DICTIONARY_SIZE, dicts.samples,
+                                 dicts.sizes, dicts.nsamples);
+    if (ZDICT_isError(size)) {
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+                "Failed to train a compression dictionary from %u values:"
+                " %s\n", dicts.nsamples, ZDICT_getErrorName(size));
+        dicts.training_failures++;
+    } else if (dictionary_find(ZDICT_getDictID(data, size)) == NULL &&
+               dictionary_save(data, size) && dictionary_add(data, size)) {
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+                "Trained compression dictionary %u from %u values\n",
+                ZDICT_getDictID(data, size), dicts.nsamples);
+    }
+    free(data);
+}
+
+static void dictionary_main(void *arg) {
+    (void)arg;
+
+    cb_mutex_enter(&dicts.mutex);
+    while (!dicts.shutdown) {
+        if (!dicts.training) {
+            cb_cond_wait(&dicts.cond, &dicts.mutex);
+            continue;
+        }
+        /* Nothing touches the samples until training is cleared */
+        cb_mutex_exit(&dicts.mutex);
+        dictionary_train();
+        cb_mutex_enter(&dicts.mutex);
+
+        dicts.nbytes = 0;
+        dicts.nsamples = 0;
+        dicts.trained = mc_time_get_current_time();
+        dicts.training = false;
+    }
+    cb_mutex_exit(&dicts.mutex);
+}
+
+static bool dictionary_wanted(void) {
+    uint32_t n = dicts.nversions;
+
+    return dicts.running && !dicts.training && n < DICTIONARY_VERSIONS &&
+        (n == 0 || mc_time_get_current_time() - dicts.trained >=
+                       DICTIONARY_RETRAIN_INTERVAL);
+}
+
+static void dictionary_sample(struct dictionary_contexts *contexts,
+                              const char *value, size_t nbytes) {
+    if (!dictionary_wanted() ||
+        ++contexts->skipped < DICTIONARY_SAMPLE_RATE) {
+        return;
+    }
+    contexts->skipped = 0;
+
+    cb_mutex_enter(&dicts.mutex);
+    if (!dicts.training) {
+        if (dicts.nbytes + nbytes <= sizeof(dicts.samples)) {
+            memcpy(dicts.samples + dicts.nbytes, value, nbytes);
+            dicts.nbytes += nbytes;
+            dicts.sizes[dicts.nsamples++] = nbytes;
+        }
+        if (dicts.nsamples == DICTIONARY_MAX_SAMPLES ||
+            dicts.nbytes + nbytes > sizeof(dicts.samples)) {
+            dicts.training = true;
+            cb_cond_signal(&dicts.cond);
+        }
+    }
+    cb_mutex_exit(&dicts.mutex);
+}
+
+bool dictionary_init(void) {
+    int ret;
+
+    cb_mutex_initialize(&dicts.mutex);
+    cb_cond_initialize(&dicts.cond);
+    if (settings.dictionary_file != NULL &&
+        !dictionary_load(settings.dictionary_file)) {
+        return false;
+    }
+
+    ret = cb_create_thread(&dicts.tid, dictionary_main, NULL, 0);
+    if (ret != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "Can't create the dictionary training thread: %s\n",
+                strerror(ret));
+        return false;
+    }
+    dicts.running = true;
+    return true;
+}
+
+void dictionary_shutdown(void) {
+    uint32_t ii;
+
+    if (dicts.running) {
+        cb_mutex_enter(&dicts.mutex);
+        dicts.shutdown = true;
+        cb_cond_signal(&dicts.cond);
+        cb_mutex_exit(&dicts.mutex);
+        cb_join_thread(dicts.tid);
+        dicts.running = false;
+    }
+    for (ii = 0; ii < dicts.nversions; ++ii) {
+        dictionary_free(dicts.versions[ii]);
+        dicts.versions[ii] = NULL;
+    }
+    dicts.nversions = 0;
+    cb_cond_destroy(&dicts.cond);
+    cb_mutex_destroy(&dicts.mutex);
+}
+
+size_t dictionary_compress_bound(size_t nbytes) {
+    return ZSTD_compressBound(nbytes);
+}
+
+bool dictionary_compress(conn *c, const char *value, size_t nbytes,
+                         char *dest, size_t *len) {
+    struct dictionary_contexts *contexts;
+    uint32_t n = dicts.nversions;
+    size_t ret;
+
+    if (c->thread == NULL || (contexts = c->thread->dictionary) == NULL) {
+        return false;
+    }
+    dictionary_sample(contexts, value, nbytes);
+    if (n == 0) {
+        return false;
+    }
+    if (contexts->cctx == NULL &&
+        (contexts->cctx = ZSTD_createCCtx()) == NULL) {
+        return false;
+    }
+
+    ret = ZSTD_compress_usingCDict(contexts->cctx, dest, *len, value, nbytes,
+                                   dicts.versions[n - 1]->cdict);
+    if (ZSTD_isError(ret)) {
+        return false;
+    }
+    *len = ret;
+    return true;
+}
+
+bool dictionary_compressed(const char *value, size_t nbytes) {
+    static const char magic[4] = { 0x28, (char)0xb5, 0x2f, (char)0xfd };
+
+    /* A snappy stream can't start with the frame magic */
+    return nbytes >= sizeof(magic) && memcmp(value, magic, 4) == 0 &&
+        dictionary_find(ZSTD_getDictID_fromFrame(value, nbytes)) != NULL;
+}
+
+bool dictionary_inflated_length(const char *value, size_t nbytes,
+                                size_t *length) {
+    unsigned long long size = ZSTD_getFrameContentSize(value, nbytes);
+
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+        size > UINT32_MAX) {
+        return false;
+    }
+    *length = (size_t)size;
+    return true;
+}
+
+bool dictionary_inflate(conn *c, const char *value, size_t nbytes,
+                        char *dest, size_t length) {
+    struct dictionary *dict;
+    struct dictionary_contexts *contexts;
+    size_t ret;
+
+    dict = dictionary_find(ZSTD_getDictID_fromFrame(value, nbytes));
+    if (dict == NULL || c->thread == NULL ||
+        (contexts = c->thread->dictionary) == NULL) {
+        return false;
+    }
+    if (contexts->dctx == NULL &&
+        (contexts->dctx = ZSTD_createDCtx()) == NULL) {
+        return false;
+    }
+
+    ret = ZSTD_decompress_usingDDict(contexts->dctx, dest, length,
+                                     value, nbytes, dict->ddict);
+    return !ZSTD_isError(ret) && ret == length;
+}
+
+void dictionary_get_stats(struct dictionary_stats *stats) {
+    uint32_t n = dicts.nversions;
+
+    stats->versions = n;
+    stats->id = n > 0 ? dicts.versions[n - 1]->id : 0;
+    stats->bytes = dicts.bytes;
+    stats->samples = dicts.nsamples;
+    stats->training_failures = dicts.training_failures;
+}
+
+struct dictionary_contexts *dictionary_contexts_create(void) {
+    return calloc(1, sizeof(struct dictionary_contexts));
+}
+
+void dictionary_contexts_destroy(struct dictionary_contexts *contexts) {
+    if (contexts != NULL) {
+        ZSTD_freeCCtx(contexts->cctx);
+        ZSTD_freeDCtx(contexts->dctx);
+        free(contexts);
+    }
+}
+
+#else
+
+struct dictionary_contexts {
+    int unused;
+};
+
+bool dictionary_init(void) {
+    return true;
+}
+
+void dictionary_shutdown(void) {
+}
+
+size_t dictionary_compress_bound(size_t nbytes) {
+    return nbytes;
+}
+
+bool dictionary_compress(conn *c, const char *value, size_t nbytes,
+                         char *dest, size_t *len) {
+    return false;
+}
+
+bool dictionary_compressed(const char *value, size_t nbytes) {
+    return false;
+}
+
+bool dictionary_inflated_length(const char *value, size_t nbytes,
+                                size_t *length) {
+    return false;
+}
+
+bool dictionary_inflate(conn *c, const char *value, size_t nbytes,
+                        char *dest, size_t length) {
+    return false;
+}
+
+void dictionary_get_stats(struct dictionary_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+struct dictionary_contexts *dictionary_contexts_create(void) {
+    return NULL;
+}
+
+void dictionary_contexts_destroy(struct dictionary_contexts *contexts) {
+    (void)contexts;
+}
+
+#endif
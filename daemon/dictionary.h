@@ -0,0 +1,76 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * zstd compression of the small values stored (see the
+ * "dictionary_compression_max" setting) with dictionaries trained from a
+ * sample of them: for small documents snappy finds next to nothing to
+ * work with in the value itself, a dictionary of what the values have in
+ * common does. Each new dictionary is a new version, the older ones are
+ * kept for the values compressed with them (and saved in the
+ * "dictionary_file" so those survive a restart). Such values are stored
+ * with the COMPRESSED datatype like the snappy ones, but as only the
+ * server has the dictionaries they are always inflated before they are
+ * sent, whatever the client supports. Without zstd in the build nothing
+ * is compressed and no value is taken for one.
+ */
+
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Load the dictionaries of settings.dictionary_file and start the thread
+ * training the new ones. Returns false if we can't.
+ */
+bool dictionary_init(void);
+
+/* Stop the training thread and free the dictionaries */
+void dictionary_shutdown(void);
+
+/* The worst case size of the compressed copy of nbytes */
+size_t dictionary_compress_bound(size_t nbytes);
+
+/*
+ * Compress a value with the current dictionary into dest, which holds
+ * *len bytes (*len is set to what was used). The value may be sampled to
+ * train the next dictionary. Returns false if there's no dictionary yet
+ * (or it didn't work out).
+ */
+bool dictionary_compress(conn *c, const char *value, size_t nbytes,
+                         char *dest, size_t *len);
+
+/* If a COMPRESSED value was compressed with one of our dictionaries */
+bool dictionary_compressed(const char *value, size_t nbytes);
+
+/* The inflated size of a value for which dictionary_compressed() holds */
+bool dictionary_inflated_length(const char *value, size_t nbytes,
+                                size_t *length);
+
+/* Inflate it into dest, which holds the length returned by the above */
+bool dictionary_inflate(conn *c, const char *value, size_t nbytes,
+                        char *dest, size_t length);
+
+struct dictionary_stats {
+    uint32_t versions;          /* the dictionaries kept */
+    uint32_t id;                /* the one values are compressed with */
+    uint64_t bytes;             /* the size of all of them */
+    uint64_t samples;           /* the values sampled for the next one */
+    uint64_t training_failures;
+};
+
+void dictionary_get_stats(struct dictionary_stats *stats);
+
+struct dictionary_contexts *dictionary_contexts_create(void);
+void dictionary_contexts_destroy(struct dictionary_contexts *contexts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The Greenstack frames wrap the binary protocol packets. Once the frame
+ * header is taken off, a request runs through the same state machine as
+ * on any other port, and its response gets its frame header right before
+ * it is sent.
+ */
+#include "config.h"
+#include "greenstack.h"
+
+#include <string.h>
+
+static bool greenstack_parse_fields(conn *c, const uint8_t *ptr, size_t len) {
+    c->greenstack->taglen = 0;
+    c->greenstack->unsupported = false;
+
+    while (len > 0) {
+        uint8_t id;
+        uint8_t flen;
+
+        if (len < 2) {
+            return false;
+        }
+        id = ptr[0];
+        flen = ptr[1];
+        ptr += 2;
+        len -= 2;
+        if (flen > len) {
+            return false;
+        }
+
+        switch (id) {
+        case PROTOCOL_GREENSTACK_FIELD_TAG:
+            if (flen > PROTOCOL_GREENSTACK_MAX_TAG) {
+                return false;
+            }
+            memcpy(c->greenstack->tag, ptr, flen);
+            c->greenstack->taglen = flen;
+            break;
+        default:
+            if (id & PROTOCOL_GREENSTACK_FIELD_MANDATORY) {
+                c->greenstack->unsupported = true;
+            }
+        }
+
+        ptr += flen;
+        len -= flen;
+    }
+
+    return true;
+}
+
+static int greenstack_invalid_frame(conn *c, const char *reason) {
+    if (settings.verbose) {
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                                        "%d: Invalid greenstack frame: %s\n",
+                                        c->sfd, reason);
+    }
+    conn_set_state(c, conn_closing);
+    return -1;
+}
+
+int greenstack_read_frame(conn *c) {
+    protocol_greenstack_frame_header header;
+    protocol_binary_request_header req;
+    size_t fieldlen;
+    size_t prefix;
+
+    if (c->read.bytes < sizeof(header.bytes)) {
+        return 0;
+    }
+    memcpy(header.bytes, c->read.curr, sizeof(header.bytes));
+
+    if (header.frame.magic != PROTOCOL_GREENSTACK_REQ) {
+        return greenstack_invalid_frame(c, "invalid magic");
+    }
+    if (header.frame.flags != 0) {
+        return greenstack_invalid_frame(c, "unknown flags");
+    }
+    fieldlen = ntohs(header.frame.fieldlen);
+    if (fieldlen > PROTOCOL_GREENSTACK_MAX_FIELDLEN) {
+        return greenstack_invalid_frame(c, "too many header fields");
+    }
+
+    /* Don't consume anything before the packet header is available too */
+    prefix = sizeof(header.bytes) + fieldlen;
+    if (c->read.bytes < prefix + sizeof(req.bytes)) {
+        return 0;
+    }
+    memcpy(req.bytes, c->read.curr + prefix, sizeof(req.bytes));
+
+    if (ntohl(header.frame.bodylen) !=
+        sizeof(req.bytes) + ntohl(req.request.bodylen)) {
+        return greenstack_invalid_frame(c, "body isn't a single packet");
+    }
+    if (!greenstack_parse_fields(c, (const uint8_t *)c->read.curr +
+                                 sizeof(header.bytes), fieldlen)) {
+        return greenstack_invalid_frame(c, "invalid header field");
+    }
+
+    c->greenstack->stream = header.frame.stream;
+    c->read.curr += prefix;
+    c->read.bytes -= prefix;
+
+    return 1;
+}
+
+bool greenstack_frame_response(conn *c) {
+    protocol_greenstack_frame_header *header;
+    uint64_t total = 0;
+    size_t fieldlen = 0;
+    int ii;
+
+    for (ii = 0; ii < c->msgused; ++ii) {
+        size_t jj;
+        for (jj = 0; jj < (size_t)c->msglist[ii].msg_iovlen; ++jj) {
+            total += c->msglist[ii].msg_iov[jj].iov_len;
+        }
+    }
+    if (total == 0) {
+        return true;
+    }
+    if (total > UINT32_MAX) {
+        return false;
+    }
+
+    header = &c->greenstack->frame.header;
+    header->frame.magic = PROTOCOL_GREENSTACK_RES;
+    header->frame.flags = 0;
+    header->frame.stream = c->greenstack->stream;
+    header->frame.bodylen = htonl((uint32_t)total);
+
+    if (c->greenstack->taglen > 0) {
+        char *field = c->greenstack->frame.bytes + sizeof(header->bytes);
+        field[0] = PROTOCOL_GREENSTACK_FIELD_TAG;
+        field[1] = (char)c->greenstack->taglen;
+        memcpy(field + 2, c->greenstack->tag, c->greenstack->taglen);
+        fieldlen = 2 + c->greenstack->taglen;
+    }
+    header->frame.fieldlen = htons((uint16_t)fieldlen);
+
+    return insert_iov(c, c->greenstack->frame.bytes,
+                      sizeof(header->bytes) + fieldlen) == 0;
+}
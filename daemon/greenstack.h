@@ -0,0 +1,35 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The frames used on Greenstack ports (see memcached/protocol_greenstack.h).
+ */
+
+#ifndef GREENSTACK_H
+#define GREENSTACK_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Take the frame header (and its flexible fields) of the next request off
+ * the input buffer. Returns 1 if it did, and the binary protocol packet is
+ * next in the buffer, 0 if more data is needed, and -1 if the frame is
+ * invalid (the connection is then closed).
+ */
+int greenstack_read_frame(conn *c);
+
+/*
+ * Put the frame header in front of the response queued for the current
+ * request. Returns false if it can't be added.
+ */
+bool greenstack_frame_response(conn *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
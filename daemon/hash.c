@@ -10,7 +10,9 @@
  *
  */
 #include "config.h"
-#include "memcached.h"
+#include "hash.h"
+
+#include <string.h>
 
 /*
  * Since the hash function does bit manipulation, it needs to know
@@ -118,7 +120,7 @@ and these came close:
 }
 
 #if HASH_LITTLE_ENDIAN == 1
-uint32_t hash(
+static uint32_t jenkins_hash(
   const void *key,       /* the key to hash */
   size_t      length,    /* length of the key */
   const uint32_t    initval)   /* initval */
@@ -299,7 +301,7 @@ uint32_t hash(
  * from hashlittle() on all machines.  hashbig() takes advantage of
  * big-endian byte ordering.
  */
-uint32_t hash( const void *key, size_t length, const uint32_t initval)
+static uint32_t jenkins_hash( const void *key, size_t length, const uint32_t initval)
 {
   uint32_t a,b,c;
   union { const void *ptr; size_t i; } u; /* to cast key to (size_t) happily */
@@ -425,3 +427,110 @@ uint32_t hash( const void *key, size_t length, const uint32_t initval)
 #else /* HASH_XXX_ENDIAN == 1 */
 #error Must define HASH_BIG_ENDIAN or HASH_LITTLE_ENDIAN
 #endif /* HASH_XXX_ENDIAN == 1 */
+
+/*
+ * CRC32C (the Castagnoli polynomial), with the SSE4.2 crc32 instruction
+ * where the CPU has it, and a table otherwise. A CRC spreads the keys
+ * well over the bucket range, but a one bit change in the key doesn't
+ * change half of the bits of the CRC, so it's finished off with the
+ * murmur3 finalizer (the hash tables and lock stripes use the low bits).
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
+#endif
+
+static uint32_t crc32c_table[256];
+
+static void crc32c_init_table(void) {
+    uint32_t ii;
+    for (ii = 0; ii < 256; ++ii) {
+        uint32_t crc = ii;
+        int jj;
+        for (jj = 0; jj < 8; ++jj) {
+            crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        }
+        crc32c_table[ii] = crc;
+    }
+}
+
+static uint32_t fmix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t crc32c_soft_hash(const void *key, size_t length,
+                                 const uint32_t initval) {
+    const uint8_t *ptr = key;
+    uint32_t crc = ~initval;
+    size_t ii;
+
+    for (ii = 0; ii < length; ++ii) {
+        crc = crc32c_table[(crc ^ ptr[ii]) & 0xff] ^ (crc >> 8);
+    }
+    return fmix32(~crc);
+}
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42_hash(const void *key, size_t length,
+                                  const uint32_t initval) {
+    const uint8_t *ptr = key;
+    uint32_t crc = ~initval;
+
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, ptr, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        ptr += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (length >= 4) {
+        uint32_t word;
+        memcpy(&word, ptr, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+        ptr += 4;
+        length -= 4;
+    }
+    while (length > 0) {
+        crc = _mm_crc32_u8(crc, *ptr);
+        ++ptr;
+        --length;
+    }
+    return fmix32(~crc);
+}
+#endif
+
+static uint32_t (*hash_function)(const void *key, size_t length,
+                                 const uint32_t initval) = jenkins_hash;
+
+const char *hash_init(hash_algorithm_t algorithm) {
+    switch (algorithm) {
+    case HASH_JENKINS:
+        hash_function = jenkins_hash;
+        return "jenkins";
+    case HASH_CRC32C:
+#ifdef HAVE_CRC32C_SSE42
+        if (__builtin_cpu_supports("sse4.2")) {
+            hash_function = crc32c_sse42_hash;
+            return "crc32c (sse4.2)";
+        }
+#endif
+        crc32c_init_table();
+        hash_function = crc32c_soft_hash;
+        return "crc32c";
+    }
+    return NULL;
+}
+
+uint32_t hash(const void *key, size_t length, const uint32_t initval) {
+    return hash_function(key, length, initval);
+}
@@ -1,10 +1,27 @@
 #ifndef HASH_H
 #define    HASH_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef    __cplusplus
 extern "C" {
 #endif
 
+/* The hash functions the keys may be hashed with (see hash_init()) */
+typedef enum {
+    HASH_JENKINS,  /* Bob Jenkins' lookup3 (the default) */
+    HASH_CRC32C    /* CRC32C (SSE4.2 where available), then mixed */
+} hash_algorithm_t;
+
+/*
+ * Select the hash function used by hash() from now on. It has to be done
+ * before anything is hashed (at startup), because the engines keep the
+ * hash values. Returns the name of the implementation selected, or NULL
+ * if the algorithm is unknown.
+ */
+const char *hash_init(hash_algorithm_t algorithm);
+
 uint32_t hash(const void *key, size_t length, const uint32_t initval);
 
 #ifdef    __cplusplus
@@ -12,4 +29,3 @@ uint32_t hash(const void *key, size_t length, const uint32_t initval);
 #endif
 
 #endif    /* HASH_H */
-
@@ -0,0 +1,461 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Every thread counts down the bytes it allocates from a random interval
+ * of [sample_bytes / 2, 3 * sample_bytes / 2); the allocation which gets
+ * it to 0 is sampled and stands for all the bytes of the interval (or of
+ * the intervals, for an allocation larger than one), so the sums are
+ * estimates of the real ones whatever the sizes. The randomness keeps a
+ * periodic pattern of allocations from always sampling the same one.
+ *
+ * The sites are kept in an open addressing table keyed by the hash of the
+ * stack, the sampled pointers in groups of HEAP_PROFILE_PROBE slots picked
+ * by their address, so the delete hook only has to look at one group
+ * (without a lock, which is only taken to remove a match). When a table is
+ * full the sample is counted as dropped, or its free as untracked.
+ */
+#ifndef _GNU_SOURCE
+/* For dladdr() */
+#define _GNU_SOURCE
+#endif
+#include "config.h"
+#include "heap_profile.h"
+#include "alloc_hooks.h"
+
+#include <cJSON.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_BACKTRACE
+#include <dlfcn.h>
+#include <execinfo.h>
+#endif
+
+#define HEAP_PROFILE_SITES 4096
+#define HEAP_PROFILE_LIVE 65536
+#define HEAP_PROFILE_PROBE 8
+#define HEAP_PROFILE_SIZE_CLASSES 32
+/* The frames of heap_profile_sample() and the hook */
+#define HEAP_PROFILE_SKIP 2
+#define HEAP_PROFILE_NO_SITE UINT32_MAX
+
+struct heap_counts {
+    uint64_t samples;
+    uint64_t bytes;           /* the allocated bytes the samples stand for */
+    uint64_t live_bytes;      /* of them, not freed yet */
+};
+
+struct heap_site {
+    uint64_t hash;            /* of the frames, 0 if unused */
+    void *frames[HEAP_PROFILE_DEPTH];
+    int depth;
+    struct heap_counts counts;
+};
+
+struct heap_live {
+    const void *ptr;          /* NULL if unused */
+    uint32_t site;
+    uint32_t size_class;
+    uint64_t bytes;
+};
+
+static struct {
+    cb_mutex_t mutex;           /* for the tables and the counts */
+    volatile size_t sample_bytes;
+    volatile uint32_t generation;   /* bumped when sample_bytes changes */
+    volatile uint64_t nlive;        /* the slots of live used */
+    struct heap_site *sites;
+    struct heap_live *live;
+    struct heap_counts size_classes[HEAP_PROFILE_SIZE_CLASSES];
+    struct heap_counts total;
+    uint64_t dropped;
+    uint64_t untracked;
+} profile;
+
+/* The sampling state of the thread */
+static __thread int64_t countdown;
+static __thread uint64_t interval;
+static __thread uint32_t thread_generation;
+static __thread uint64_t rnd;
+static __thread bool in_profiler;
+
+void heap_profile_init(void) {
+    cb_mutex_initialize(&profile.mutex);
+}
+
+static uint64_t next_interval(size_t sample_bytes) {
+    if (rnd == 0) {
+        rnd = (uint64_t)gethrtime() ^ (uint64_t)(uintptr_t)&rnd;
+        rnd |= 1;
+    }
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 7;
+    rnd ^= rnd << 17;
+    return sample_bytes / 2 + rnd % (sample_bytes | 1);
+}
+
+static uint32_t size_class(size_t size) {
+    uint32_t cls = 0;
+    while (cls < HEAP_PROFILE_SIZE_CLASSES - 1 && ((size_t)1 << cls) < size) {
+        ++cls;
+    }
+    return cls;
+}
+
+static struct heap_live *live_group(const void *ptr) {
+    uint64_t h = (uint64_t)(uintptr_t)ptr * UINT64_C(0x9E3779B97F4A7C15);
+    size_t ngroups = HEAP_PROFILE_LIVE / HEAP_PROFILE_PROBE;
+    return &profile.live[(h >> 40) % ngroups * HEAP_PROFILE_PROBE];
+}
+
+static void count(struct heap_counts *counts, uint64_t bytes) {
+    counts->samples++;
+    counts->bytes += bytes;
+    counts->live_bytes += bytes;
+}
+
+/* The site of the stack, HEAP_PROFILE_NO_SITE if the table is full */
+static uint32_t find_site(void **frames, int depth) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+    uint32_t ii, idx;
+    int jj;
+
+    for (jj = 0; jj < depth; ++jj) {
+        hash = (hash ^ (uint64_t)(uintptr_t)frames[jj]) *
+            UINT64_C(1099511628211);
+    }
+    if (hash == 0) {
+        hash = 1;
+    }
+
+    idx = (uint32_t)(hash % HEAP_PROFILE_SITES);
+    for (ii = 0; ii < HEAP_PROFILE_SITES; ++ii) {
+        struct heap_site *site = &profile.sites[idx];
+        if (site->hash == 0) {
+            site->hash = hash;
+            site->depth = depth;
+            memcpy(site->frames, frames, depth * sizeof(void*));
+            return idx;
+        }
+        if (site->hash == hash && site->depth == depth &&
+            memcmp(site->frames, frames, depth * sizeof(void*)) == 0) {
+            return idx;
+        }
+        idx = (idx + 1) % HEAP_PROFILE_SITES;
+    }
+    return HEAP_PROFILE_NO_SITE;
+}
+
+/* Not inlined into the hook, for HEAP_PROFILE_SKIP */
+static void __attribute__((noinline)) heap_profile_sample(const void *ptr,
+                                                          size_t size) {
+    size_t sample_bytes = profile.sample_bytes;
+#ifdef HAVE_BACKTRACE
+    void *frames[HEAP_PROFILE_DEPTH + HEAP_PROFILE_SKIP];
+#endif
+    struct heap_live *group;
+    uint64_t bytes = 0;
+    uint32_t site, cls;
+    int depth = 0, ii;
+
+    if (sample_bytes == 0) {
+        return;
+    }
+    if (thread_generation != profile.generation) {
+        /* A new thread or a new interval, this one is only the start */
+        thread_generation = profile.generation;
+        interval = next_interval(sample_bytes);
+        countdown = (int64_t)interval - (int64_t)size;
+        if (countdown > 0) {
+            return;
+        }
+    }
+    while (countdown <= 0) {
+        bytes += interval;
+        interval = next_interval(sample_bytes);
+        countdown += (int64_t)interval;
+    }
+
+    /* backtrace() may allocate the first time */
+    in_profiler = true;
+#ifdef HAVE_BACKTRACE
+    depth = backtrace(frames, HEAP_PROFILE_DEPTH + HEAP_PROFILE_SKIP);
+    depth = depth > HEAP_PROFILE_SKIP ? depth - HEAP_PROFILE_SKIP : 0;
+#endif
+    cls = size_class(size);
+
+    cb_mutex_enter(&profile.mutex);
+    if (profile.sites == NULL) {
+        cb_mutex_exit(&profile.mutex);
+        in_profiler = false;
+        return;
+    }
+#ifdef HAVE_BACKTRACE
+    site = find_site(frames + HEAP_PROFILE_SKIP, depth);
+#else
+    site = find_site(NULL, depth);
+#endif
+    count(&profile.total, bytes);
+    count(&profile.size_classes[cls], bytes);
+    if (site == HEAP_PROFILE_NO_SITE) {
+        profile.dropped++;
+    } else {
+        count(&profile.sites[site].counts, bytes);
+    }
+
+    group = live_group(ptr);
+    for (ii = 0; ii < HEAP_PROFILE_PROBE; ++ii) {
+        if (group[ii].ptr == NULL) {
+            group[ii].site = site;
+            group[ii].size_class = cls;
+            group[ii].bytes = bytes;
+            __atomic_store_n(&group[ii].ptr, ptr, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&profile.nlive, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    if (ii == HEAP_PROFILE_PROBE) {
+        /* Its free won't be seen, so it looks live forever */
+        profile.untracked++;
+    }
+    cb_mutex_exit(&profile.mutex);
+    in_profiler = false;
+}
+
+static void heap_profile_new_hook(const void *ptr, size_t size) {
+    countdown -= (int64_t)size;
+    if (countdown <= 0 && ptr != NULL && !in_profiler) {
+        heap_profile_sample(ptr, size);
+        /* Not a tail call either, the frame of the hook has to be there */
+        __asm__ __volatile__("" ::: "memory");
+    }
+}
+
+static void heap_profile_forget(const void *ptr) {
+    struct heap_live *group = live_group(ptr);
+    int ii;
+
+    for (ii = 0; ii < HEAP_PROFILE_PROBE; ++ii) {
+        if (__atomic_load_n(&group[ii].ptr, __ATOMIC_ACQUIRE) != ptr) {
+            continue;
+        }
+        cb_mutex_enter(&profile.mutex);
+        if (group[ii].ptr == ptr) {
+            uint64_t bytes = group[ii].bytes;
+            profile.total.live_bytes -= bytes;
+            profile.size_classes[group[ii].size_class].live_bytes -= bytes;
+            if (group[ii].site != HEAP_PROFILE_NO_SITE) {
+                profile.sites[group[ii].site].counts.live_bytes -= bytes;
+            }
+            __atomic_store_n(&group[ii].ptr, NULL, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&profile.nlive, 1, __ATOMIC_RELAXED);
+        }
+        cb_mutex_exit(&profile.mutex);
+        return;
+    }
+}
+
+static void heap_profile_delete_hook(const void *ptr) {
+    if (ptr != NULL && __atomic_load_n(&profile.nlive, __ATOMIC_RELAXED) != 0) {
+        heap_profile_forget(ptr);
+    }
+}
+
+/* Clear everything, with the mutex held */
+static void clear_profile(void) {
+    memset(profile.sites, 0, HEAP_PROFILE_SITES * sizeof(struct heap_site));
+    memset(profile.live, 0, HEAP_PROFILE_LIVE * sizeof(struct heap_live));
+    memset(profile.size_classes, 0, sizeof(profile.size_classes));
+    memset(&profile.total, 0, sizeof(profile.total));
+    profile.dropped = 0;
+    profile.untracked = 0;
+    __atomic_store_n(&profile.nlive, 0, __ATOMIC_RELAXED);
+}
+
+ENGINE_ERROR_CODE heap_profile_set_sample_bytes(size_t sample_bytes) {
+#ifdef HAVE_BACKTRACE
+    struct heap_site *sites = NULL;
+    struct heap_live *live = NULL;
+
+    if (sample_bytes == 0) {
+        profile.sample_bytes = 0;
+        mc_set_sampling_hooks(NULL, NULL);
+        return ENGINE_SUCCESS;
+    }
+
+    if (profile.sample_bytes != 0) {
+        profile.sample_bytes = sample_bytes;
+        __atomic_add_fetch(&profile.generation, 1, __ATOMIC_RELEASE);
+        return ENGINE_SUCCESS;
+    }
+
+    /* Allocated without the lock, the hooks may still be in use */
+    if (profile.sites == NULL) {
+        sites = calloc(HEAP_PROFILE_SITES, sizeof(struct heap_site));
+        live = calloc(HEAP_PROFILE_LIVE, sizeof(struct heap_live));
+        if (sites == NULL || live == NULL) {
+            free(sites);
+            free(live);
+            return ENGINE_ENOMEM;
+        }
+    }
+
+    cb_mutex_enter(&profile.mutex);
+    if (profile.sites == NULL) {
+        profile.sites = sites;
+        profile.live = live;
+    } else {
+        clear_profile();
+    }
+    cb_mutex_exit(&profile.mutex);
+
+    profile.sample_bytes = sample_bytes;
+    __atomic_add_fetch(&profile.generation, 1, __ATOMIC_RELEASE);
+    if (!mc_set_sampling_hooks(heap_profile_new_hook,
+                               heap_profile_delete_hook)) {
+        profile.sample_bytes = 0;
+        return ENGINE_ENOTSUP;
+    }
+    return ENGINE_SUCCESS;
+#else
+    return sample_bytes == 0 ? ENGINE_SUCCESS : ENGINE_ENOTSUP;
+#endif
+}
+
+size_t heap_profile_get_sample_bytes(void) {
+    return profile.sample_bytes;
+}
+
+void heap_profile_reset(void) {
+    cb_mutex_enter(&profile.mutex);
+    if (profile.sites != NULL) {
+        clear_profile();
+    }
+    cb_mutex_exit(&profile.mutex);
+}
+
+void heap_profile_shutdown(void) {
+    heap_profile_set_sample_bytes(0);
+    cb_mutex_enter(&profile.mutex);
+    __atomic_store_n(&profile.nlive, 0, __ATOMIC_RELAXED);
+    free(profile.sites);
+    free(profile.live);
+    profile.sites = NULL;
+    profile.live = NULL;
+    cb_mutex_exit(&profile.mutex);
+}
+
+static int site_compare(const void *a, const void *b) {
+    const struct heap_counts *x = &((const struct heap_site*)a)->counts;
+    const struct heap_counts *y = &((const struct heap_site*)b)->counts;
+
+    if (x->live_bytes != y->live_bytes) {
+        return x->live_bytes < y->live_bytes ? 1 : -1;
+    }
+    if (x->bytes != y->bytes) {
+        return x->bytes < y->bytes ? 1 : -1;
+    }
+    return 0;
+}
+
+static cJSON *counts_to_json(const struct heap_counts *counts) {
+    cJSON *obj = cJSON_CreateObject();
+    cJSON_AddNumberToObject(obj, "samples", (double)counts->samples);
+    cJSON_AddNumberToObject(obj, "bytes", (double)counts->bytes);
+    cJSON_AddNumberToObject(obj, "live_bytes", (double)counts->live_bytes);
+    return obj;
+}
+
+static void add_json_stat(ADD_STAT add_stats, conn *c, const char *key,
+                          cJSON *json) {
+    char *value = cJSON_PrintUnformatted(json);
+    add_stats(key, (uint16_t)strlen(key), value, (uint32_t)strlen(value), c);
+    cJSON_Free(value);
+    cJSON_Delete(json);
+}
+
+/* "symbol+0x1f", or "library+0x1234" for the static ones */
+static void symbolize(void *frame, char *buffer, size_t size) {
+#ifdef HAVE_BACKTRACE
+    Dl_info info;
+
+    if (dladdr(frame, &info) != 0) {
+        if (info.dli_sname != NULL) {
+            snprintf(buffer, size, "%s+0x%lx", info.dli_sname,
+                     (unsigned long)((char*)frame - (char*)info.dli_saddr));
+            return;
+        } else if (info.dli_fname != NULL) {
+            const char *name = strrchr(info.dli_fname, '/');
+            snprintf(buffer, size, "%s+0x%lx",
+                     name != NULL ? name + 1 : info.dli_fname,
+                     (unsigned long)((char*)frame - (char*)info.dli_fbase));
+            return;
+        }
+    }
+#endif
+    snprintf(buffer, size, "%p", frame);
+}
+
+void heap_profile_stats(ADD_STAT add_stats, conn *c) {
+    struct heap_counts size_classes[HEAP_PROFILE_SIZE_CLASSES];
+    struct heap_counts total;
+    uint64_t dropped, untracked;
+    struct heap_site *sites;
+    int nsites = 0, ii, jj;
+    char key[64];
+
+    APPEND_STAT("heap_profile_sample_bytes", "%"PRIu64,
+                (uint64_t)profile.sample_bytes);
+
+    /* Copied out without allocating while we hold the lock */
+    sites = malloc(HEAP_PROFILE_SITES * sizeof(struct heap_site));
+    if (sites == NULL) {
+        return;
+    }
+    cb_mutex_enter(&profile.mutex);
+    if (profile.sites == NULL) {
+        cb_mutex_exit(&profile.mutex);
+        free(sites);
+        return;
+    }
+    for (ii = 0; ii < HEAP_PROFILE_SITES; ++ii) {
+        if (profile.sites[ii].hash != 0) {
+            sites[nsites++] = profile.sites[ii];
+        }
+    }
+    memcpy(size_classes, profile.size_classes, sizeof(size_classes));
+    total = profile.total;
+    dropped = profile.dropped;
+    untracked = profile.untracked;
+    cb_mutex_exit(&profile.mutex);
+
+    APPEND_STAT("heap_profile_samples", "%"PRIu64, total.samples);
+    APPEND_STAT("heap_profile_bytes", "%"PRIu64, total.bytes);
+    APPEND_STAT("heap_profile_live_bytes", "%"PRIu64, total.live_bytes);
+    APPEND_STAT("heap_profile_sites", "%d", nsites);
+    APPEND_STAT("heap_profile_dropped", "%"PRIu64, dropped);
+    APPEND_STAT("heap_profile_untracked", "%"PRIu64, untracked);
+
+    for (ii = 0; ii < HEAP_PROFILE_SIZE_CLASSES; ++ii) {
+        if (size_classes[ii].samples != 0) {
+            snprintf(key, sizeof(key), "heap_profile:size:%"PRIu64,
+                     (uint64_t)1 << ii);
+            add_json_stat(add_stats, c, key, counts_to_json(&size_classes[ii]));
+        }
+    }
+
+    qsort(sites, nsites, sizeof(struct heap_site), site_compare);
+    for (ii = 0; ii < nsites; ++ii) {
+        cJSON *json = counts_to_json(&sites[ii].counts);
+        cJSON *stack = cJSON_CreateArray();
+        for (jj = 0; jj < sites[ii].depth; ++jj) {
+            char frame[256];
+            symbolize(sites[ii].frames[jj], frame, sizeof(frame));
+            cJSON_AddItemToArray(stack, cJSON_CreateString(frame));
+        }
+        cJSON_AddItemToObject(json, "stack", stack);
+        snprintf(key, sizeof(key), "heap_profile:site:%d", ii);
+        add_json_stat(add_stats, c, key, json);
+    }
+    free(sites);
+}
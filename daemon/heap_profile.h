@@ -0,0 +1,63 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * A sampling heap profiler on top of the allocator hooks: started with the
+ * "heap_profile.sample_bytes" ioctl, it takes the stack of about one
+ * allocation every that many bytes allocated (by any thread), and counts
+ * the sampled bytes by call site and by size class, with the part of them
+ * still allocated. "stats heap_profile" returns what it has, the sites with
+ * the most live bytes first. Between two samples an allocation only costs
+ * a thread local subtraction, a free a look into the table of the sampled
+ * pointers. Needs backtrace() and an allocator with hooks (jemalloc with
+ * our malloc wrappers, or tcmalloc).
+ */
+
+#ifndef HEAP_PROFILE_H
+#define HEAP_PROFILE_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The number of frames kept of the sampled stacks */
+#define HEAP_PROFILE_DEPTH 16
+
+/* Set up the lock, before any thread may use the profiler */
+void heap_profile_init(void);
+
+/*
+ * Start sampling about every sample_bytes allocated (with the aggregates
+ * of a previous run cleared), change the interval if already running, or
+ * stop if 0 (what was collected is kept for the stats). Returns
+ * ENGINE_ENOTSUP if this build can't do it, ENGINE_ENOMEM if the tables
+ * can't be allocated.
+ */
+ENGINE_ERROR_CODE heap_profile_set_sample_bytes(size_t sample_bytes);
+
+/* The current interval, 0 if not sampling */
+size_t heap_profile_get_sample_bytes(void);
+
+/*
+ * Forget the samples taken so far (the ones still live included), the
+ * "heap_profile.reset" ioctl
+ */
+void heap_profile_reset(void);
+
+/* Stop sampling and free the tables, after the worker threads are gone */
+void heap_profile_shutdown(void);
+
+/*
+ * Add the profile to the stats: the totals as "heap_profile_<name>", then
+ * "heap_profile:size:<max bytes>" and "heap_profile:site:<n>" with JSON
+ * values (the symbolized stack for the sites).
+ */
+void heap_profile_stats(ADD_STAT add_stats, conn *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
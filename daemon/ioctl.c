@@ -19,6 +19,8 @@
 
 #include "config.h"
 #include "alloc_hooks.h"
+#include "heap_profile.h"
+#include "shm_ring.h"
 
 /*
  * Implement ioctl-style memcached commands (ioctl_get / ioctl_set).
@@ -27,6 +29,11 @@
 ENGINE_ERROR_CODE ioctl_get_property(const char* key, size_t keylen,
                                      size_t* value)
 {
+    if (strncmp("heap_profile.sample_bytes", key, keylen) == 0 &&
+        keylen == strlen("heap_profile.sample_bytes")) {
+        *value = heap_profile_get_sample_bytes();
+        return ENGINE_SUCCESS;
+    }
 #if defined(HAVE_TCMALLOC)
     if (strncmp("tcmalloc.aggressive_memory_decommit", key, keylen) == 0 &&
         keylen == strlen("tcmalloc.aggressive_memory_decommit")) {
@@ -52,6 +59,57 @@ ENGINE_ERROR_CODE ioctl_set_property(conn* c, const char* key, size_t keylen,
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                 "%d: IOCTL_SET: release_free_memory called\n", c->sfd);
         return ENGINE_SUCCESS;
+    } else if (strncmp("trace.connection", key, keylen) == 0 &&
+               keylen == strlen("trace.connection")) {
+        /* Log all the requests of this connection (see trace_sample_rate) */
+        if (vallen == 1 && (value[0] == '0' || value[0] == '1')) {
+            c->trace = value[0] == '1';
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: IOCTL_SET: 'trace.connection' set to %c\n",
+                c->sfd, value[0]);
+            return ENGINE_SUCCESS;
+        } else {
+            return ENGINE_EINVAL;
+        }
+    } else if (strncmp("heap_profile.sample_bytes", key, keylen) == 0 &&
+               keylen == strlen("heap_profile.sample_bytes")) {
+        /* Start (or stop with 0) the sampling heap profiler */
+        char val_buffer[IOCTL_VAL_LENGTH + 1];
+        uint64_t sample_bytes;
+        ENGINE_ERROR_CODE ret;
+
+        memcpy(val_buffer, value, vallen);
+        val_buffer[vallen] = '\0';
+        if (!safe_strtoull(val_buffer, &sample_bytes) ||
+            sample_bytes > UINT32_MAX) {
+            return ENGINE_EINVAL;
+        }
+        ret = heap_profile_set_sample_bytes((size_t)sample_bytes);
+        if (ret == ENGINE_SUCCESS) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: IOCTL_SET: 'heap_profile.sample_bytes' set to %" PRIu64 "\n",
+                c->sfd, sample_bytes);
+        }
+        return ret;
+    } else if (strncmp("shm_ring", key, keylen) == 0 &&
+               keylen == strlen("shm_ring")) {
+        /* Move the connection to the rings in the file (see shm_ring.h) */
+        char val_buffer[IOCTL_VAL_LENGTH + 1];
+        ENGINE_ERROR_CODE ret;
+
+        memcpy(val_buffer, value, vallen);
+        val_buffer[vallen] = '\0';
+        ret = conn_shm_attach(c, val_buffer);
+        if (ret != ENGINE_SUCCESS) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: IOCTL_SET: failed to attach 'shm_ring' %s: 0x%x\n",
+                c->sfd, val_buffer, ret);
+        }
+        return ret;
+    } else if (strncmp("heap_profile.reset", key, keylen) == 0 &&
+               keylen == strlen("heap_profile.reset")) {
+        heap_profile_reset();
+        return ENGINE_SUCCESS;
 #if defined(HAVE_TCMALLOC)
     } else if (strncmp("tcmalloc.aggressive_memory_decommit", key, keylen) == 0 &&
                keylen == strlen("tcmalloc.aggressive_memory_decommit")) {
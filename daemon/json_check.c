@@ -0,0 +1,129 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The JSON checker runs a state machine over every byte, which is what
+ * most of the values stored by clients without datatype support pay for,
+ * JSON or not. Binary values usually fail the cheap checks done here
+ * first: a JSON document starts and ends with one of a few characters,
+ * and never holds control characters other than whitespace (they have to
+ * be escaped in strings) or bytes which are invalid in UTF-8 wherever
+ * they are. The latter are looked for 16 bytes at a time with SSE2 or
+ * NEON where available.
+ */
+#include "config.h"
+#include "json_check.h"
+
+#include <JSON_checker.h>
+#include <limits.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+static bool is_space(uint8_t ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+/* Control characters other than whitespace, and 0xc0, 0xc1, 0xf5 - 0xff */
+static bool is_invalid(uint8_t ch) {
+    return (ch < 0x20 && !is_space(ch)) || (ch & 0xfe) == 0xc0 || ch >= 0xf5;
+}
+
+static bool first_and_last_match(uint8_t first, uint8_t last) {
+    switch (first) {
+    case '{':
+        return last == '}';
+    case '[':
+        return last == ']';
+    case '"':
+        return last == '"';
+    case 't':
+    case 'f':
+        return last == 'e';
+    case 'n':
+        return last == 'l';
+    case '-':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+        return last >= '0' && last <= '9';
+    default:
+        return false;
+    }
+}
+
+static bool has_invalid_bytes(const uint8_t *ptr, size_t nbytes) {
+    size_t ii = 0;
+
+#if defined(__SSE2__)
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lead = _mm_set1_epi8((char)0xfe);
+    const __m128i c0 = _mm_set1_epi8((char)0xc0);
+    const __m128i high = _mm_set1_epi8((char)0xf5);
+
+    for (; ii + 16 <= nbytes; ii += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(ptr + ii));
+        /* Unsigned v <= 0x1f (but not whitespace), v >= 0xf5, 0xc0 and 0xc1 */
+        __m128i bad = _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v);
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+                                                  _mm_cmpeq_epi8(v, cr)));
+        bad = _mm_andnot_si128(space, bad);
+        bad = _mm_or_si128(bad, _mm_cmpeq_epi8(_mm_max_epu8(v, high), v));
+        bad = _mm_or_si128(bad, _mm_cmpeq_epi8(_mm_and_si128(v, lead), c0));
+        if (_mm_movemask_epi8(bad) != 0) {
+            return true;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t ctrl = vdupq_n_u8(0x20);
+    const uint8x16_t tab = vdupq_n_u8('\t');
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    const uint8x16_t lead = vdupq_n_u8(0xfe);
+    const uint8x16_t c0 = vdupq_n_u8(0xc0);
+    const uint8x16_t high = vdupq_n_u8(0xf5);
+
+    for (; ii + 16 <= nbytes; ii += 16) {
+        uint8x16_t v = vld1q_u8(ptr + ii);
+        uint8x16_t space = vorrq_u8(vceqq_u8(v, tab),
+                                    vorrq_u8(vceqq_u8(v, nl), vceqq_u8(v, cr)));
+        uint8x16_t bad = vbicq_u8(vcltq_u8(v, ctrl), space);
+        bad = vorrq_u8(bad, vcgeq_u8(v, high));
+        bad = vorrq_u8(bad, vceqq_u8(vandq_u8(v, lead), c0));
+        if (vmaxvq_u8(bad) != 0) {
+            return true;
+        }
+    }
+#endif
+
+    for (; ii < nbytes; ++ii) {
+        if (is_invalid(ptr[ii])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool is_json(const void *data, size_t nbytes) {
+    const uint8_t *ptr = data;
+    size_t first = 0;
+    size_t last = nbytes;
+
+    while (first < nbytes && is_space(ptr[first])) {
+        ++first;
+    }
+    while (last > first && is_space(ptr[last - 1])) {
+        --last;
+    }
+    if (first == last || nbytes > INT_MAX ||
+        !first_and_last_match(ptr[first], ptr[last - 1]) ||
+        has_invalid_bytes(ptr + first, last - first)) {
+        return false;
+    }
+
+    return checkUTF8JSON(data, (int)nbytes);
+}
@@ -0,0 +1,27 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Detection of the JSON values stored by clients without datatype support
+ * (which can't tell the server the value is JSON themselves).
+ */
+
+#ifndef JSON_CHECK_H
+#define JSON_CHECK_H
+
+#include "config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Is the value a valid (UTF-8) JSON document? The values which can't be
+ * JSON because of how they start and end, or because they hold bytes that
+ * never appear in JSON, are turned down without running the JSON checker.
+ */
+bool is_json(const void *data, size_t nbytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,268 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Kernel TLS offload (see ktls.h). OpenSSL doesn't hand out the record
+ * keys, so they're derived from the session's master secret with the
+ * TLS 1.2 key expansion (RFC 5246 section 6.3).
+ */
+#include "config.h"
+#include "ktls.h"
+
+#ifdef HAVE_KTLS
+
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#define TLS_RANDOM_SIZE 32
+#define TLS_MAX_KEY_SIZE 32
+#define TLS_SALT_SIZE 4
+
+static const char key_expansion[] = "key expansion";
+
+struct ktls_cipher {
+    const char *suffix;
+    unsigned short type;
+    size_t key_size;
+    const EVP_MD *(*md)(void);
+};
+
+static const struct ktls_cipher ciphers[] = {
+    { "AES128-GCM-SHA256", TLS_CIPHER_AES_GCM_128,
+      TLS_CIPHER_AES_GCM_128_KEY_SIZE, EVP_sha256 },
+    { "AES256-GCM-SHA384", TLS_CIPHER_AES_GCM_256,
+      TLS_CIPHER_AES_GCM_256_KEY_SIZE, EVP_sha384 },
+    { NULL, 0, 0, NULL }
+};
+
+static const struct ktls_cipher *get_cipher(const SSL *ssl) {
+    const SSL_CIPHER *cipher;
+    const char *name;
+    size_t len;
+    int ii;
+
+    if (SSL_version(ssl) != TLS1_2_VERSION) {
+        return NULL;
+    }
+
+    cipher = SSL_get_current_cipher(ssl);
+    if (cipher == NULL || (name = SSL_CIPHER_get_name(cipher)) == NULL) {
+        return NULL;
+    }
+    len = strlen(name);
+
+    /* Match on the suffix to cover all of the key exchange variants */
+    for (ii = 0; ciphers[ii].suffix != NULL; ++ii) {
+        size_t slen = strlen(ciphers[ii].suffix);
+        if (len >= slen && strcmp(name + len - slen, ciphers[ii].suffix) == 0 &&
+            (len == slen || name[len - slen - 1] == '-')) {
+            return &ciphers[ii];
+        }
+    }
+
+    return NULL;
+}
+
+/* P_hash(secret, label + seed) from RFC 5246 section 5 */
+static bool tls12_prf(const EVP_MD *md,
+                      const unsigned char *secret, size_t secret_len,
+                      const unsigned char *seed, size_t seed_len,
+                      unsigned char *out, size_t out_len) {
+    unsigned char a[EVP_MAX_MD_SIZE];
+    unsigned char chunk[EVP_MAX_MD_SIZE];
+    unsigned char buf[EVP_MAX_MD_SIZE + sizeof(key_expansion) +
+                      2 * TLS_RANDOM_SIZE];
+    unsigned int alen;
+    unsigned int clen;
+    bool ret = false;
+
+    if (seed_len > sizeof(buf) - EVP_MAX_MD_SIZE) {
+        return false;
+    }
+
+    /* A(1) = HMAC(secret, seed) */
+    if (HMAC(md, secret, (int)secret_len, seed, seed_len, a, &alen) == NULL) {
+        return false;
+    }
+
+    while (out_len > 0) {
+        size_t n;
+
+        memcpy(buf, a, alen);
+        memcpy(buf + alen, seed, seed_len);
+        if (HMAC(md, secret, (int)secret_len, buf, alen + seed_len,
+                 chunk, &clen) == NULL) {
+            goto done;
+        }
+
+        n = out_len < clen ? out_len : clen;
+        memcpy(out, chunk, n);
+        out += n;
+        out_len -= n;
+
+        /* A(i + 1) = HMAC(secret, A(i)) */
+        memcpy(buf, a, alen);
+        if (HMAC(md, secret, (int)secret_len, buf, alen, a, &alen) == NULL) {
+            goto done;
+        }
+    }
+    ret = true;
+
+done:
+    OPENSSL_cleanse(a, sizeof(a));
+    OPENSSL_cleanse(chunk, sizeof(chunk));
+    OPENSSL_cleanse(buf, sizeof(buf));
+    return ret;
+}
+
+static bool get_secrets(SSL *ssl, unsigned char *master, size_t *master_len,
+                        unsigned char *client_random,
+                        unsigned char *server_random) {
+    SSL_SESSION *session = SSL_get_session(ssl);
+    if (session == NULL) {
+        return false;
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    *master_len = SSL_SESSION_get_master_key(session, master, *master_len);
+    if (SSL_get_client_random(ssl, client_random,
+                              TLS_RANDOM_SIZE) != TLS_RANDOM_SIZE ||
+        SSL_get_server_random(ssl, server_random,
+                              TLS_RANDOM_SIZE) != TLS_RANDOM_SIZE) {
+        return false;
+    }
+#else
+    if (session->master_key_length > *master_len || ssl->s3 == NULL) {
+        return false;
+    }
+    *master_len = session->master_key_length;
+    memcpy(master, session->master_key, *master_len);
+    memcpy(client_random, ssl->s3->client_random, TLS_RANDOM_SIZE);
+    memcpy(server_random, ssl->s3->server_random, TLS_RANDOM_SIZE);
+#endif
+    return *master_len > 0;
+}
+
+static bool set_crypto_info(SOCKET sfd, int direction,
+                            const struct ktls_cipher *cipher,
+                            const unsigned char *key,
+                            const unsigned char *salt) {
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes128;
+        struct tls12_crypto_info_aes_gcm_256 aes256;
+    } info;
+    /*
+     * Both sides have just sent their Finished message, which used
+     * sequence number 0. The explicit nonce only needs to be unique, and
+     * the kernel increments it per record, so start it at the sequence
+     * number as well.
+     */
+    static const unsigned char seq[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    socklen_t len;
+    int ret;
+
+    memset(&info, 0, sizeof(info));
+    if (cipher->type == TLS_CIPHER_AES_GCM_128) {
+        info.aes128.info.version = TLS_1_2_VERSION;
+        info.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(info.aes128.key, key, cipher->key_size);
+        memcpy(info.aes128.salt, salt, TLS_SALT_SIZE);
+        memcpy(info.aes128.iv, seq, sizeof(seq));
+        memcpy(info.aes128.rec_seq, seq, sizeof(seq));
+        len = sizeof(info.aes128);
+    } else {
+        info.aes256.info.version = TLS_1_2_VERSION;
+        info.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(info.aes256.key, key, cipher->key_size);
+        memcpy(info.aes256.salt, salt, TLS_SALT_SIZE);
+        memcpy(info.aes256.iv, seq, sizeof(seq));
+        memcpy(info.aes256.rec_seq, seq, sizeof(seq));
+        len = sizeof(info.aes256);
+    }
+
+    ret = setsockopt(sfd, SOL_TLS, direction, &info, len);
+    OPENSSL_cleanse(&info, sizeof(info));
+    return ret == 0;
+}
+
+ktls_result_t ktls_offload(SOCKET sfd, SSL *ssl) {
+    const struct ktls_cipher *cipher = get_cipher(ssl);
+    unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+    size_t master_len = sizeof(master);
+    unsigned char seed[sizeof(key_expansion) - 1 + 2 * TLS_RANDOM_SIZE];
+    /* client key, server key, client salt, server salt */
+    unsigned char keys[2 * TLS_MAX_KEY_SIZE + 2 * TLS_SALT_SIZE];
+    const unsigned char *client_key = keys;
+    const unsigned char *server_key;
+    const unsigned char *client_salt;
+    const unsigned char *server_salt;
+    size_t needed;
+    ktls_result_t ret = KTLS_UNSUPPORTED;
+
+    if (cipher == NULL) {
+        return KTLS_UNSUPPORTED;
+    }
+
+    /* seed = "key expansion" + server_random + client_random */
+    memcpy(seed, key_expansion, sizeof(key_expansion) - 1);
+    if (!get_secrets(ssl, master, &master_len,
+                     seed + sizeof(key_expansion) - 1 + TLS_RANDOM_SIZE,
+                     seed + sizeof(key_expansion) - 1)) {
+        goto done;
+    }
+
+    needed = 2 * cipher->key_size + 2 * TLS_SALT_SIZE;
+    if (!tls12_prf(cipher->md(), master, master_len, seed, sizeof(seed),
+                   keys, needed)) {
+        goto done;
+    }
+    server_key = client_key + cipher->key_size;
+    client_salt = server_key + cipher->key_size;
+    server_salt = client_salt + TLS_SALT_SIZE;
+
+    /* Not having the tls module is fine, nothing has changed yet */
+    if (setsockopt(sfd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+        goto done;
+    }
+
+    /*
+     * Without any keys the tls ULP passes the data through untouched, so
+     * we may still fall back to OpenSSL if the first one is rejected.
+     */
+    if (!set_crypto_info(sfd, TLS_TX, cipher, server_key, server_salt)) {
+        goto done;
+    }
+
+    if (set_crypto_info(sfd, TLS_RX, cipher, client_key, client_salt)) {
+        ret = KTLS_ENABLED;
+    } else {
+        ret = KTLS_FAILED;
+    }
+
+done:
+    OPENSSL_cleanse(master, sizeof(master));
+    OPENSSL_cleanse(keys, sizeof(keys));
+    return ret;
+}
+
+#else
+
+ktls_result_t ktls_offload(SOCKET sfd, SSL *ssl) {
+    (void)sfd;
+    (void)ssl;
+    return KTLS_UNSUPPORTED;
+}
+
+#endif
@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Kernel TLS offload. Once OpenSSL has completed the handshake the record
+ * keys are installed on the socket, and from then on the kernel encrypts
+ * and decrypts the records so the connection may use plain send and recv.
+ */
+
+#ifndef KTLS_H
+#define KTLS_H
+
+#include "config.h"
+
+#include <memcached/openssl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    /* The keys are installed, the SSL object must not be used any more */
+    KTLS_ENABLED,
+    /* The connection can't be offloaded, keep using OpenSSL */
+    KTLS_UNSUPPORTED,
+    /* The socket is only partially offloaded and must be closed */
+    KTLS_FAILED
+} ktls_result_t;
+
+/*
+ * Offload the TLS records of sfd to the kernel. Only TLS 1.2 with
+ * AES-GCM is supported, and it must be called right after the handshake
+ * completes (before any application data is sent or received).
+ */
+ktls_result_t ktls_offload(SOCKET sfd, SSL *ssl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
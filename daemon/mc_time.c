@@ -26,10 +26,11 @@
 extern volatile sig_atomic_t memcached_shutdown;
 
 /*
- * This constant defines the seconds between libevent clock callbacks.
- * This roughly equates to how frequency of gethrtime calls made.
+ * This constant defines the milliseconds between libevent clock callbacks.
+ * This roughly equates to how frequency of gethrtime calls made, and is
+ * the resolution of mc_time_get_current_time_ms().
  */
-const time_t memcached_clock_tick_seconds = 1;
+const long memcached_clock_tick_msec = 10;
 
 /*
  * This constant defines the frequency of system clock checks.
@@ -44,8 +45,9 @@ const time_t memcached_check_system_time = 60;
 const time_t memcached_maximum_relative_time = 60*60*24*30;
 
 static volatile rel_time_t memcached_uptime = 0;
+static volatile uint64_t memcached_uptime_ms = 0;
 static volatile time_t memcached_epoch = 0;
-static volatile uint64_t memcached_monotonic_start = 0;
+static volatile hrtime_t memcached_monotonic_start = 0;
 static struct event_base* main_ev_base = NULL;
 
 static void mc_time_clock_event_handler(evutil_socket_t fd, short which, void *arg);
@@ -76,7 +78,8 @@ void mc_time_init(struct event_base* ev_base) {
 static void mc_time_init_epoch(void) {
     struct timeval t;
     memcached_uptime = 0;
-    memcached_monotonic_start = cb_get_monotonic_seconds();
+    memcached_uptime_ms = 0;
+    memcached_monotonic_start = gethrtime();
     cb_get_timeofday(&t);
     memcached_epoch = t.tv_sec;
 }
@@ -89,6 +92,13 @@ rel_time_t mc_time_get_current_time(void) {
     return memcached_uptime;
 }
 
+/*
+ * The same with millisecond resolution (well, the clock tick's).
+ */
+uint64_t mc_time_get_current_time_ms(void) {
+    return memcached_uptime_ms;
+}
+
 /*
  * Given a timestamp (timestamp follows the rules of mc store protocol)
  * return the seconds from "now" it is expected to expire.
@@ -115,6 +125,19 @@ rel_time_t mc_time_convert_to_real_time(const time_t t) {
     return rv;
 }
 
+/*
+ * Given a timestamp with MC_TIME_EXPTIME_MS set, return the milliseconds
+ * since the server started it's expected to expire at. Otherwise 0: it
+ * expires with the resolution of mc_time_convert_to_real_time(). Only
+ * for a connection with PROTOCOL_BINARY_FEATURE_EXPTIME_MS.
+ */
+uint64_t mc_time_convert_to_real_time_ms(const time_t t) {
+    if ((t & MC_TIME_EXPTIME_MS) == 0) {
+        return 0;
+    }
+    return memcached_uptime_ms + (uint64_t)(t & ~(time_t)MC_TIME_EXPTIME_MS);
+}
+
 /*
  * Convert the relative time to an absolute time (relative to EPOCH ;) )
  */
@@ -124,7 +147,7 @@ time_t mc_time_convert_to_abs_time(const rel_time_t rel_time) {
 
 /*
  * clock_handler - libevent call back.
- * This method is called (ticks) every 'memcached_clock_tick_seconds' and
+ * This method is called (ticks) every 'memcached_clock_tick_msec' and
  * primarily keeps time flowing.
  */
 static void mc_time_clock_event_handler(evutil_socket_t fd, short which, void *arg) {
@@ -132,8 +155,8 @@ static void mc_time_clock_event_handler(evutil_socket_t fd, short which, void *a
     static struct event clockevent;
     struct timeval t;
 
-    t.tv_sec = (long)memcached_clock_tick_seconds;
-    t.tv_usec = 0;
+    t.tv_sec = 0;
+    t.tv_usec = memcached_clock_tick_msec * 1000;
 
     if (memcached_shutdown) {
         event_base_loopbreak(main_ev_base);
@@ -163,7 +186,8 @@ static void mc_time_clock_tick(void) {
     static struct timeval previous_time = {0, 0};
 
     /* calculate our monotonic uptime */
-    memcached_uptime = (rel_time_t)(cb_get_monotonic_seconds() - memcached_monotonic_start);
+    memcached_uptime_ms = (gethrtime() - memcached_monotonic_start) / 1000000;
+    memcached_uptime = (rel_time_t)(memcached_uptime_ms / 1000);
 
     /*
       every 'memcached_check_system_time' seconds, keep an eye on the system clock.
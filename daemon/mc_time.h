@@ -12,6 +12,14 @@
 extern "C" {
 #endif
 
+/*
+ * On a connection with PROTOCOL_BINARY_FEATURE_EXPTIME_MS, an exptime
+ * with this bit set is relative and in milliseconds (the other 31 bits,
+ * up to almost 25 days). On the others it's an absolute time after
+ * January 2038, like it always was.
+ */
+#define MC_TIME_EXPTIME_MS 0x80000000u
+
 /*
  * Initialise this module.
  */
@@ -23,6 +31,11 @@ void mc_time_init(struct event_base* ev_base);
  */
 rel_time_t mc_time_get_current_time(void);
 
+/*
+ * The same in milliseconds, advanced by the clock tick (every 10ms).
+ */
+uint64_t mc_time_get_current_time_ms(void);
+
 /*
  * Convert a relative time value to an absolute time.
  *
@@ -38,6 +51,12 @@ time_t mc_time_convert_to_abs_time(const rel_time_t rel_time);
  */
 rel_time_t mc_time_convert_to_real_time(const time_t t);
 
+/*
+ * Convert a time stamp with MC_TIME_EXPTIME_MS set to the milliseconds
+ * since the server started, 0 for the others.
+ */
+uint64_t mc_time_convert_to_real_time_ms(const time_t t);
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,10 +17,10 @@
 #include "config.h"
 #include "memcached.h"
 #include "mcaudit.h"
+#include "connections.h"
 #include "memcached_audit_events.h"
 
 #include <memcached/audit_interface.h>
-#include <cJSON.h>
 
 static const char unknown[] = "unknown";
 
@@ -66,53 +66,66 @@ static const char *get_bucketname(const conn *c)
 
 
 /**
- * Create the typical memcached audit object. It constists of a
- * timestamp, the socket endpoints and the creds. Then each audit event
- * may add event-specific content.
+ * Fill in the typical memcached audit event. It consists of the socket
+ * endpoints and the creds (the timestamp is added when it is put). Then
+ * each audit event may add its event-specific field.
  *
  * @param c the connection object
- * @return the cJSON object containing the basic information
+ * @param event where to store the basic information
  */
-static cJSON *create_memcached_audit_object(const conn *c)
+static void create_memcached_audit_event(const conn *c,
+                                         AUDIT_CONNECTION_EVENT *event)
 {
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "peername",
-                            c->peername ? c->peername : unknown);
-    cJSON_AddStringToObject(root, "sockname",
-                            c->sockname ? c->sockname : unknown);
-    cJSON *source = cJSON_CreateObject();
-    cJSON_AddStringToObject(source, "source", "memcached");
-    cJSON_AddStringToObject(source, "user", get_username(c));
-    cJSON_AddItemToObject(root, "real_userid", source);
+    snprintf(event->peername, sizeof(event->peername), "%s",
+             get_peername(c));
+    snprintf(event->sockname, sizeof(event->sockname), "%s",
+             get_sockname(c));
+    snprintf(event->user, sizeof(event->user), "%s", get_username(c));
+    event->field[0] = '\0';
+    event->value[0] = '\0';
+}
 
-    return root;
+static void set_audit_field(AUDIT_CONNECTION_EVENT *event,
+                            const char *field, const char *value)
+{
+    snprintf(event->field, sizeof(event->field), "%s", field);
+    snprintf(event->value, sizeof(event->value), "%s", value);
 }
 
 /**
- * Convert the JSON object to text and send it to the audit framework
- * and then release all allocated resources
+ * Send the event to the audit framework (which formats it on its own
+ * thread)
  *
  * @param c the connection object requesting the call
  * @param id the audit identifier
  * @param event the payload of the audit description
  * @param warn what to log if we're failing to put the audit event
  */
-static void do_audit(const conn *c, uint32_t id, cJSON *event, const char *warn) {
-    if (put_json_audit_event(id, event) != AUDIT_SUCCESS) {
-        char *text = cJSON_PrintUnformatted(event);
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c, "%s: %s",
-                                        warn, text);
-        cJSON_Free(text);
+static void do_audit(const conn *c, uint32_t id,
+                     const AUDIT_CONNECTION_EVENT *event, const char *warn) {
+    if (put_connection_audit_event(id, event) != AUDIT_SUCCESS) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "%s: peername=%s sockname=%s "
+                                        "user=%s %s%s%s", warn,
+                                        event->peername, event->sockname,
+                                        event->user, event->field,
+                                        event->field[0] ? "=" : "",
+                                        event->value);
     }
-    cJSON_Delete(event);
 }
 
 void audit_auth_failure(const conn *c, const char *reason)
 {
-    cJSON *root = create_memcached_audit_object(c);
-    cJSON_AddStringToObject(root, "reason", reason);
+    AUDIT_CONNECTION_EVENT event;
+
+    /* Don't bother with the event if the audit daemon would drop it */
+    if (!audit_event_enabled(MEMCACHED_AUDIT_AUTHENTICATION_FAILED)) {
+        return;
+    }
+    create_memcached_audit_event(c, &event);
+    set_audit_field(&event, "reason", reason);
 
-    do_audit(c, MEMCACHED_AUDIT_AUTHENTICATION_FAILED, root,
+    do_audit(c, MEMCACHED_AUDIT_AUTHENTICATION_FAILED, &event,
              "Failed to send AUTH FAILED audit event");
 }
 
@@ -121,11 +134,12 @@ void audit_dcp_open(const conn *c)
     if (c->admin) {
         settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
                                         "Open DCP stream with admin credentials");
-    } else {
-        cJSON *root = create_memcached_audit_object(c);
-        cJSON_AddStringToObject(root, "bucket", get_bucketname(c));
+    } else if (audit_event_enabled(MEMCACHED_AUDIT_OPENED_DCP_CONNECTION)) {
+        AUDIT_CONNECTION_EVENT event;
+        create_memcached_audit_event(c, &event);
+        set_audit_field(&event, "bucket", get_bucketname(c));
 
-        do_audit(c, MEMCACHED_AUDIT_OPENED_DCP_CONNECTION, root,
+        do_audit(c, MEMCACHED_AUDIT_OPENED_DCP_CONNECTION, &event,
                  "Failed to send DCP open connection "
                  "audit event to audit daemon");
     }
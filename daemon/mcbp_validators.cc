@@ -21,6 +21,7 @@
 
 #include "subdocument.h"
 
+#include <cstring>
 #include <mutex>
 #include <vector>
 
@@ -43,169 +44,55 @@ mcbp_package_validate *get_mcbp_validators(void) {
 /******************************************************************************
  *                         Package validators                                 *
  *****************************************************************************/
-static int dcp_open_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_open*>(packet);
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 8 ||
-        req->message.header.request.keylen == 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        /* INCORRECT FORMAT */
-        return -1;
-    }
-
-    return 0;
-}
-
-static int dcp_add_stream_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_add_stream *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 4 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != htonl(4) ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        /* INCORRECT FORMAT */
-        return -1;
-    }
-
-    return 0;
-}
-
-static int dcp_close_stream_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_close_stream *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        /* INCORRECT FORMAT */
-        return -1;
-    }
-
-    return 0;
-}
-
-static int dcp_get_failover_log_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_get_failover_log *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int dcp_stream_req_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_stream_req *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 5*sizeof(uint64_t) + 2*sizeof(uint32_t) ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        /* INCORRECT FORMAT */
-        return -1;
-    }
-    return 0;
-}
-
-static int dcp_stream_end_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_stream_end *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 4 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != htonl(4) ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int dcp_snapshot_marker_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_snapshot_marker *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 20 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != htonl(20) ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
 
-    return 0;
-}
-
-static int dcp_mutation_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_mutation *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != (2*sizeof(uint64_t) + 3 * sizeof(uint32_t) + sizeof(uint16_t)) + sizeof(uint8_t) ||
-        req->message.header.request.keylen == 0 ||
-        req->message.header.request.bodylen == 0) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int dcp_deletion_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_deletion *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != (2*sizeof(uint64_t) + sizeof(uint16_t)) ||
-        req->message.header.request.keylen == 0) {
-        return -1;
-    }
+/*
+ * Most of the commands are fully described by the layout of their header,
+ * so they share a single validator instantiated per layout:
+ *
+ *   Extlen: the size of the extras
+ *   Key: if the key must be present (Required), absent (None) or either
+ *   Value: the same for the value (what's left of the body after the
+ *          extras and the key)
+ *   ZeroCas: the cas must be 0
+ *   RawDatatype: the datatype must be PROTOCOL_BINARY_RAW_BYTES
+ *
+ * All of the layout is known at compile time, so each instantiation
+ * folds down to a handful of compares which are combined without
+ * branching. The few commands with additional requirements on the
+ * body wrap the validator for their layout.
+ */
+enum class Field { None, Required, Optional };
 
-    return 0;
+template <Field F>
+static inline bool invalid_length(uint32_t len) {
+    return (F == Field::None && len != 0) || (F == Field::Required && len == 0);
 }
 
-static int dcp_expiration_validator(void *packet)
+template <uint8_t Extlen, Field Key, Field Value, bool ZeroCas, bool RawDatatype>
+static int packet_validator(void *packet)
 {
-    auto req = static_cast<protocol_binary_request_dcp_deletion *>(packet);
-    uint16_t klen = ntohs(req->message.header.request.keylen);
-    uint32_t bodylen = ntohl(req->message.header.request.bodylen) - klen;
-    bodylen -= req->message.header.request.extlen;
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != (2*sizeof(uint64_t) + sizeof(uint16_t)) ||
-        req->message.header.request.keylen == 0 ||
-        bodylen != 0) {
-        return -1;
-    }
+    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
+    const auto &header = req->message.header.request;
+    const uint32_t klen = ntohs(header.keylen);
+    const uint32_t blen = ntohl(header.bodylen);
+    const uint32_t vlen = blen - Extlen - klen;
 
-    return 0;
-}
+    bool invalid = header.magic != PROTOCOL_BINARY_REQ;
+    invalid |= header.extlen != Extlen;
+    /* Only the layouts with a fixed sized value need the body to fit */
+    invalid |= Value != Field::Optional && blen < Extlen + klen;
+    invalid |= invalid_length<Key>(klen);
+    invalid |= invalid_length<Value>(vlen);
+    invalid |= ZeroCas && header.cas != 0;
+    invalid |= RawDatatype && header.datatype != PROTOCOL_BINARY_RAW_BYTES;
 
-static int dcp_flush_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_flush *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
+    return invalid ? -1 : 0;
 }
 
 static int dcp_set_vbucket_state_validator(void *packet)
 {
     auto req = static_cast<protocol_binary_request_dcp_set_vbucket_state *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 1 ||
-        req->message.header.request.keylen != 0 ||
-        ntohl(req->message.header.request.bodylen) != 1 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
+    if (packet_validator<1, Field::None, Field::None, false, true>(packet) != 0) {
         return -1;
     }
 
@@ -216,183 +103,15 @@ static int dcp_set_vbucket_state_validator(void *packet)
     return 0;
 }
 
-static int dcp_noop_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_noop *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int dcp_buffer_acknowledgement_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_buffer_acknowledgement *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 4 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != ntohl(4) ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int dcp_control_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_dcp_control *>(packet);
-    uint16_t nkey = ntohs(req->message.header.request.keylen);
-    uint32_t nval = ntohl(req->message.header.request.bodylen) - nkey;
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 || nkey == 0 || nval == 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int isasl_refresh_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int ssl_certs_refresh_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int verbosity_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 4 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.cas != 0 ||
-        ntohl(req->message.header.request.bodylen) != 4 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
 static int hello_validator(void *packet)
 {
     auto req = static_cast<protocol_binary_request_no_extras *>(packet);
     uint32_t len = ntohl(req->message.header.request.bodylen);
     len -= ntohs(req->message.header.request.keylen);
 
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 || (len % 2) != 0 ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int version_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int quit_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES ||
-        req->message.header.request.cas != 0) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int sasl_list_mech_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int sasl_auth_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen == 0 ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int noop_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES ||
-        req->message.header.request.cas != 0) {
+    /* The value is the list of 16 bit features */
+    if (packet_validator<0, Field::Optional, Field::Optional, true, true>(packet) != 0 ||
+        (len % 2) != 0) {
         return -1;
     }
 
@@ -402,158 +121,19 @@ static int noop_validator(void *packet)
 static int flush_validator(void *packet)
 {
     auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    uint8_t extlen = req->message.header.request.extlen;
-    uint32_t bodylen = ntohl(req->message.header.request.bodylen);
-
-    if (extlen != 0 && extlen != 4) {
-        return -1;
-    }
-
-    if (bodylen != extlen) {
-        return -1;
-    }
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES ||
-        req->message.header.request.cas != 0) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int add_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    /* Must have extras and key, may have value */
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 8 ||
-        req->message.header.request.keylen == 0 ||
-        req->message.header.request.cas != 0) {
-        return -1;
-    }
-    return 0;
-}
-
-static int set_replace_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    /* Must have extras and key, may have value */
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 8 ||
-        req->message.header.request.keylen == 0) {
-        return -1;
-    }
-    return 0;
-}
-
-static int append_prepend_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    /* Must not have extras, must have key, may have value */
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen == 0) {
-        return -1;
-    }
-    return 0;
-}
-
-static int get_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    uint16_t klen = ntohs(req->message.header.request.keylen);
-    uint32_t blen = ntohl(req->message.header.request.bodylen);
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        klen == 0 || klen != blen ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES ||
-        req->message.header.request.cas != 0) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int delete_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    uint16_t klen = ntohs(req->message.header.request.keylen);
-    uint32_t blen = ntohl(req->message.header.request.bodylen);
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        klen == 0 || klen != blen ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int stat_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    uint16_t klen = ntohs(req->message.header.request.keylen);
-    uint32_t blen = ntohl(req->message.header.request.bodylen);
 
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 || klen != blen ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
+    /* The expiry time in the extras is optional */
+    if (req->message.header.request.extlen == 4) {
+        return packet_validator<4, Field::None, Field::None, true, true>(packet);
     }
-
-    return 0;
-}
-
-static int arithmetic_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    uint16_t klen = ntohs(req->message.header.request.keylen);
-    uint32_t blen = ntohl(req->message.header.request.bodylen);
-    uint8_t extlen = req->message.header.request.extlen;
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        extlen != 20 || klen == 0 || (klen + extlen) != blen ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int get_cmd_timer_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    uint16_t klen = ntohs(req->message.header.request.keylen);
-    uint32_t blen = ntohl(req->message.header.request.bodylen);
-    uint8_t extlen = req->message.header.request.extlen;
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        extlen != 1 || klen != 0 || (klen + extlen) != blen ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
+    return packet_validator<0, Field::None, Field::None, true, true>(packet);
 }
 
 static int set_ctrl_token_validator(void *packet)
 {
     auto req = static_cast<protocol_binary_request_set_ctrl_token *>(packet);
 
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != sizeof(uint64_t) ||
-        req->message.header.request.keylen != 0 ||
-        ntohl(req->message.header.request.bodylen) != sizeof(uint64_t) ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES ||
+    if (packet_validator<sizeof(uint64_t), Field::None, Field::None, false, true>(packet) != 0 ||
         req->message.body.new_cas == 0) {
         return -1;
     }
@@ -561,47 +141,23 @@ static int set_ctrl_token_validator(void *packet)
     return 0;
 }
 
-static int get_ctrl_token_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static int init_complete_validator(void *packet)
+/* The opcode, optionally followed by the breakdown */
+static int get_cmd_timer_validator(void *packet)
 {
     auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
+    if (req->message.header.request.extlen == 2) {
+        return packet_validator<2, Field::None, Field::None, true, true>(packet);
     }
-
-    return 0;
+    return packet_validator<1, Field::None, Field::None, true, true>(packet);
 }
 
 static int ioctl_get_validator(void *packet)
 {
     auto req = static_cast<protocol_binary_request_ioctl_get *>(packet);
     uint16_t klen = ntohs(req->message.header.request.keylen);
-    uint32_t blen = ntohl(req->message.header.request.bodylen);
 
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        klen == 0 || klen != blen || klen > IOCTL_KEY_LENGTH ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
+    if (packet_validator<0, Field::Required, Field::None, true, true>(packet) != 0 ||
+        klen > IOCTL_KEY_LENGTH) {
         return -1;
     }
 
@@ -614,109 +170,98 @@ static int ioctl_set_validator(void *packet)
     uint16_t klen = ntohs(req->message.header.request.keylen);
     size_t vallen = ntohl(req->message.header.request.bodylen);
 
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.cas != 0 ||
-        klen == 0 || klen > IOCTL_KEY_LENGTH ||
-        vallen > IOCTL_VAL_LENGTH ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
+    if (packet_validator<0, Field::Required, Field::Optional, true, true>(packet) != 0 ||
+        klen > IOCTL_KEY_LENGTH || vallen > IOCTL_VAL_LENGTH) {
         return -1;
     }
 
     return 0;
 }
 
-static int assume_role_validator(void *packet)
+static int observe_seqno_validator(void *packet)
 {
     auto req = static_cast<protocol_binary_request_no_extras *>(packet);
-    uint16_t klen = ntohs(req->message.header.request.keylen);
-    uint32_t blen = ntohl(req->message.header.request.bodylen);
+    uint32_t bodylen = ntohl(req->message.header.request.bodylen);
 
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 || klen != blen  ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
+    /* The value is the vbucket uuid */
+    if (packet_validator<0, Field::None, Field::Required, false, true>(packet) != 0 ||
+        bodylen != 8) {
         return -1;
     }
-
     return 0;
 }
 
-static int audit_put_validator(void *packet)
+static int setm_validator(void *packet)
 {
-    auto req = static_cast<protocol_binary_request_audit_put *>(packet);
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 4 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.cas != 0 ||
-        ntohl(req->message.header.request.bodylen) <= 4 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
+    auto req = static_cast<protocol_binary_request_setm *>(packet);
+    uint32_t bodylen = ntohl(req->message.header.request.bodylen);
+    const uint8_t *ptr = req->bytes + sizeof(req->bytes);
+    uint32_t nentries = 0;
+
+    /* The entries are the value */
+    if (packet_validator<0, Field::None, Field::Required, true, false>(packet) != 0) {
         return -1;
     }
-    return 0;
-}
 
-static int audit_config_reload_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
+    while (bodylen > 0) {
+        protocol_binary_setm_entry entry;
+        uint32_t nkey, nbytes;
 
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
+        if (bodylen < sizeof(entry) ||
+            ++nentries > PROTOCOL_BINARY_SETM_MAX_ENTRIES) {
+            return -1;
+        }
+        memcpy(&entry, ptr, sizeof(entry));
+        nkey = ntohs(entry.nkey);
+        nbytes = ntohl(entry.nbytes);
+        bodylen -= sizeof(entry);
+        if (nkey == 0 || nkey > PROTOCOL_BINARY_SETM_MAX_KEYLEN ||
+            nkey > bodylen || nbytes > bodylen - nkey) {
+            return -1;
+        }
+        ptr += sizeof(entry) + nkey + nbytes;
+        bodylen -= nkey + nbytes;
     }
+
     return 0;
 }
 
-static int observe_seqno_validator(void *packet)
+static int script_exec_validator(void *packet)
 {
-    auto req = static_cast<protocol_binary_request_no_extras *>(packet);
+    auto req = static_cast<protocol_binary_request_script_exec *>(packet);
+    uint16_t klen = ntohs(req->message.header.request.keylen);
     uint32_t bodylen = ntohl(req->message.header.request.bodylen);
+    const uint8_t *ptr = req->bytes + sizeof(req->bytes) + klen;
+    uint32_t nargs = 0;
 
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        bodylen != 8 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
-    }
-    return 0;
-}
-
-static int get_adjusted_time_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_get_adjusted_time*>(packet);
-
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        req->message.header.request.keylen != 0 ||
-        req->message.header.request.bodylen != 0 ||
-        req->message.header.request.cas != 0 ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
+    /* The key is the name of the script, the value its arguments */
+    if (packet_validator<0, Field::Required, Field::Optional, true, true>(packet) != 0 ||
+        bodylen < klen) {
         return -1;
     }
-    return 0;
-}
 
-static int set_drift_counter_state_validator(void *packet)
-{
-    auto req = static_cast<protocol_binary_request_set_drift_counter_state*>(packet);
+    bodylen -= klen;
+    while (bodylen > 0) {
+        protocol_binary_script_arg arg;
+        uint32_t length;
 
-    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != sizeof(uint8_t) + sizeof(int64_t) ||
-        req->message.header.request.keylen != 0 ||
-        ntohl(req->message.header.request.bodylen) != sizeof(uint8_t) + sizeof(int64_t) ||
-        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
-        return -1;
+        if (bodylen < sizeof(arg) ||
+            ++nargs > PROTOCOL_BINARY_SCRIPT_MAX_ARGS) {
+            return -1;
+        }
+        memcpy(&arg, ptr, sizeof(arg));
+        length = ntohs(arg.length);
+        bodylen -= sizeof(arg);
+        if (length > bodylen) {
+            return -1;
+        }
+        ptr += sizeof(arg) + length;
+        bodylen -= length;
     }
+
     return 0;
 }
 
-
 static int null_validator(void *) {
     return 0;
 }
@@ -726,57 +271,92 @@ static void initialize() {
     for (int ii = 0; ii < 0x100; ++ii) {
         validators.push_back(null_validator);
     }
-    validators[PROTOCOL_BINARY_CMD_DCP_OPEN] = dcp_open_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_ADD_STREAM] = dcp_add_stream_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_CLOSE_STREAM] = dcp_close_stream_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_SNAPSHOT_MARKER] = dcp_snapshot_marker_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_DELETION] = dcp_deletion_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_EXPIRATION] = dcp_expiration_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_FLUSH] = dcp_flush_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_GET_FAILOVER_LOG] = dcp_get_failover_log_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_MUTATION] = dcp_mutation_validator;
+    /* Commands without any extras, key or value */
+    const mcbp_package_validate empty =
+        packet_validator<0, Field::None, Field::None, true, true>;
+    const mcbp_package_validate dcp_empty =
+        packet_validator<0, Field::None, Field::None, false, true>;
+
+    validators[PROTOCOL_BINARY_CMD_DCP_OPEN] =
+        packet_validator<8, Field::Required, Field::Optional, false, true>;
+    validators[PROTOCOL_BINARY_CMD_DCP_ADD_STREAM] =
+        packet_validator<4, Field::None, Field::None, false, true>;
+    validators[PROTOCOL_BINARY_CMD_DCP_CLOSE_STREAM] = dcp_empty;
+    validators[PROTOCOL_BINARY_CMD_DCP_SNAPSHOT_MARKER] =
+        packet_validator<20, Field::None, Field::None, false, true>;
+    validators[PROTOCOL_BINARY_CMD_DCP_DELETION] =
+        packet_validator<18, Field::Required, Field::Optional, false, false>;
+    validators[PROTOCOL_BINARY_CMD_DCP_EXPIRATION] =
+        packet_validator<18, Field::Required, Field::None, false, false>;
+    validators[PROTOCOL_BINARY_CMD_DCP_FLUSH] = dcp_empty;
+    validators[PROTOCOL_BINARY_CMD_DCP_GET_FAILOVER_LOG] = dcp_empty;
+    validators[PROTOCOL_BINARY_CMD_DCP_MUTATION] =
+        packet_validator<31, Field::Required, Field::Optional, false, false>;
     validators[PROTOCOL_BINARY_CMD_DCP_SET_VBUCKET_STATE] = dcp_set_vbucket_state_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_NOOP] = dcp_noop_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_BUFFER_ACKNOWLEDGEMENT] = dcp_buffer_acknowledgement_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_CONTROL] = dcp_control_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_STREAM_END] = dcp_stream_end_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_STREAM_REQ] = dcp_stream_req_validator;
-    validators[PROTOCOL_BINARY_CMD_ISASL_REFRESH] = isasl_refresh_validator;
-    validators[PROTOCOL_BINARY_CMD_SSL_CERTS_REFRESH] = ssl_certs_refresh_validator;
-    validators[PROTOCOL_BINARY_CMD_VERBOSITY] = verbosity_validator;
+    validators[PROTOCOL_BINARY_CMD_DCP_NOOP] = dcp_empty;
+    validators[PROTOCOL_BINARY_CMD_DCP_BUFFER_ACKNOWLEDGEMENT] =
+        packet_validator<4, Field::None, Field::None, false, true>;
+    validators[PROTOCOL_BINARY_CMD_DCP_CONTROL] =
+        packet_validator<0, Field::Required, Field::Required, false, true>;
+    validators[PROTOCOL_BINARY_CMD_DCP_STREAM_END] =
+        packet_validator<4, Field::None, Field::None, false, true>;
+    validators[PROTOCOL_BINARY_CMD_DCP_STREAM_REQ] =
+        packet_validator<48, Field::None, Field::Optional, false, true>;
+    validators[PROTOCOL_BINARY_CMD_ISASL_REFRESH] = empty;
+    validators[PROTOCOL_BINARY_CMD_SSL_CERTS_REFRESH] = empty;
+    validators[PROTOCOL_BINARY_CMD_VERBOSITY] =
+        packet_validator<4, Field::None, Field::None, true, true>;
     validators[PROTOCOL_BINARY_CMD_HELLO] = hello_validator;
-    validators[PROTOCOL_BINARY_CMD_VERSION] = version_validator;
-    validators[PROTOCOL_BINARY_CMD_QUIT] = quit_validator;
-    validators[PROTOCOL_BINARY_CMD_QUITQ] = quit_validator;
-    validators[PROTOCOL_BINARY_CMD_SASL_LIST_MECHS] = sasl_list_mech_validator;
-    validators[PROTOCOL_BINARY_CMD_SASL_AUTH] = sasl_auth_validator;
-    validators[PROTOCOL_BINARY_CMD_SASL_STEP] = sasl_auth_validator;
-    validators[PROTOCOL_BINARY_CMD_NOOP] = noop_validator;
+    validators[PROTOCOL_BINARY_CMD_VERSION] = empty;
+    validators[PROTOCOL_BINARY_CMD_QUIT] = empty;
+    validators[PROTOCOL_BINARY_CMD_QUITQ] = empty;
+    validators[PROTOCOL_BINARY_CMD_SASL_LIST_MECHS] = empty;
+    validators[PROTOCOL_BINARY_CMD_SASL_AUTH] =
+        packet_validator<0, Field::Required, Field::Optional, true, true>;
+    validators[PROTOCOL_BINARY_CMD_SASL_STEP] =
+        packet_validator<0, Field::Required, Field::Optional, true, true>;
+    validators[PROTOCOL_BINARY_CMD_NOOP] = empty;
     validators[PROTOCOL_BINARY_CMD_FLUSH] = flush_validator;
     validators[PROTOCOL_BINARY_CMD_FLUSHQ] = flush_validator;
-    validators[PROTOCOL_BINARY_CMD_GET] = get_validator;
-    validators[PROTOCOL_BINARY_CMD_GETQ] = get_validator;
-    validators[PROTOCOL_BINARY_CMD_GETK] = get_validator;
-    validators[PROTOCOL_BINARY_CMD_GETKQ] = get_validator;
-    validators[PROTOCOL_BINARY_CMD_DELETE] = delete_validator;
-    validators[PROTOCOL_BINARY_CMD_DELETEQ] = delete_validator;
-    validators[PROTOCOL_BINARY_CMD_STAT] = stat_validator;
-    validators[PROTOCOL_BINARY_CMD_INCREMENT] = arithmetic_validator;
-    validators[PROTOCOL_BINARY_CMD_INCREMENTQ] = arithmetic_validator;
-    validators[PROTOCOL_BINARY_CMD_DECREMENT] = arithmetic_validator;
-    validators[PROTOCOL_BINARY_CMD_DECREMENTQ] = arithmetic_validator;
+    validators[PROTOCOL_BINARY_CMD_GET] =
+        packet_validator<0, Field::Required, Field::None, true, true>;
+    validators[PROTOCOL_BINARY_CMD_GETQ] =
+        packet_validator<0, Field::Required, Field::None, true, true>;
+    validators[PROTOCOL_BINARY_CMD_GETK] =
+        packet_validator<0, Field::Required, Field::None, true, true>;
+    validators[PROTOCOL_BINARY_CMD_GETKQ] =
+        packet_validator<0, Field::Required, Field::None, true, true>;
+    validators[PROTOCOL_BINARY_CMD_GET_RANGE] =
+        packet_validator<8, Field::Required, Field::None, true, true>;
+    validators[PROTOCOL_BINARY_CMD_DELETE] =
+        packet_validator<0, Field::Required, Field::None, false, true>;
+    validators[PROTOCOL_BINARY_CMD_DELETEQ] =
+        packet_validator<0, Field::Required, Field::None, false, true>;
+    validators[PROTOCOL_BINARY_CMD_STAT] =
+        packet_validator<0, Field::Optional, Field::None, true, true>;
+    validators[PROTOCOL_BINARY_CMD_INCREMENT] =
+        packet_validator<20, Field::Required, Field::None, false, true>;
+    validators[PROTOCOL_BINARY_CMD_INCREMENTQ] =
+        packet_validator<20, Field::Required, Field::None, false, true>;
+    validators[PROTOCOL_BINARY_CMD_DECREMENT] =
+        packet_validator<20, Field::Required, Field::None, false, true>;
+    validators[PROTOCOL_BINARY_CMD_DECREMENTQ] =
+        packet_validator<20, Field::Required, Field::None, false, true>;
     validators[PROTOCOL_BINARY_CMD_GET_CMD_TIMER] = get_cmd_timer_validator;
     validators[PROTOCOL_BINARY_CMD_SET_CTRL_TOKEN] = set_ctrl_token_validator;
-    validators[PROTOCOL_BINARY_CMD_GET_CTRL_TOKEN] = get_ctrl_token_validator;
-    validators[PROTOCOL_BINARY_CMD_INIT_COMPLETE] = init_complete_validator;
+    validators[PROTOCOL_BINARY_CMD_GET_CTRL_TOKEN] = empty;
+    validators[PROTOCOL_BINARY_CMD_INIT_COMPLETE] = empty;
     validators[PROTOCOL_BINARY_CMD_IOCTL_GET] = ioctl_get_validator;
     validators[PROTOCOL_BINARY_CMD_IOCTL_SET] = ioctl_set_validator;
-    validators[PROTOCOL_BINARY_CMD_ASSUME_ROLE] = assume_role_validator;
-    validators[PROTOCOL_BINARY_CMD_AUDIT_PUT] = audit_put_validator;
-    validators[PROTOCOL_BINARY_CMD_AUDIT_CONFIG_RELOAD] = audit_config_reload_validator;
+    validators[PROTOCOL_BINARY_CMD_ASSUME_ROLE] =
+        packet_validator<0, Field::Optional, Field::None, true, true>;
+    validators[PROTOCOL_BINARY_CMD_AUDIT_PUT] =
+        packet_validator<4, Field::None, Field::Required, true, true>;
+    validators[PROTOCOL_BINARY_CMD_AUDIT_CONFIG_RELOAD] = empty;
     validators[PROTOCOL_BINARY_CMD_OBSERVE_SEQNO] = observe_seqno_validator;
-    validators[PROTOCOL_BINARY_CMD_GET_ADJUSTED_TIME] = get_adjusted_time_validator;
-    validators[PROTOCOL_BINARY_CMD_SET_DRIFT_COUNTER_STATE] = set_drift_counter_state_validator;
+    validators[PROTOCOL_BINARY_CMD_GET_ADJUSTED_TIME] = empty;
+    validators[PROTOCOL_BINARY_CMD_SET_DRIFT_COUNTER_STATE] =
+        packet_validator<sizeof(uint8_t) + sizeof(int64_t), Field::None, Field::None, false, true>;
 
 #ifndef BUILDING_VALIDATORS_TEST
     validators[PROTOCOL_BINARY_CMD_SUBDOC_GET] = subdoc_get_validator;
@@ -788,16 +368,30 @@ static void initialize() {
     validators[PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_PUSH_LAST] = subdoc_array_push_last_validator;
     validators[PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_PUSH_FIRST] = subdoc_array_push_first_validator;
     validators[PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_ADD_UNIQUE] = subdoc_array_add_unique_validator;
+    validators[PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP] = subdoc_multi_lookup_validator;
+    validators[PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION] = subdoc_multi_mutation_validator;
 #endif
 
-    validators[PROTOCOL_BINARY_CMD_SETQ] = set_replace_validator;
-    validators[PROTOCOL_BINARY_CMD_SET] = set_replace_validator;
-    validators[PROTOCOL_BINARY_CMD_ADDQ] = add_validator;
-    validators[PROTOCOL_BINARY_CMD_ADD] = add_validator;
-    validators[PROTOCOL_BINARY_CMD_REPLACEQ] = set_replace_validator;
-    validators[PROTOCOL_BINARY_CMD_REPLACE] = set_replace_validator;
-    validators[PROTOCOL_BINARY_CMD_APPENDQ] = append_prepend_validator;
-    validators[PROTOCOL_BINARY_CMD_APPEND] = append_prepend_validator;
-    validators[PROTOCOL_BINARY_CMD_PREPENDQ] = append_prepend_validator;
-    validators[PROTOCOL_BINARY_CMD_PREPEND] = append_prepend_validator;
+    validators[PROTOCOL_BINARY_CMD_SETQ] =
+        packet_validator<8, Field::Required, Field::Optional, false, false>;
+    validators[PROTOCOL_BINARY_CMD_SET] =
+        packet_validator<8, Field::Required, Field::Optional, false, false>;
+    validators[PROTOCOL_BINARY_CMD_ADDQ] =
+        packet_validator<8, Field::Required, Field::Optional, true, false>;
+    validators[PROTOCOL_BINARY_CMD_ADD] =
+        packet_validator<8, Field::Required, Field::Optional, true, false>;
+    validators[PROTOCOL_BINARY_CMD_REPLACEQ] =
+        packet_validator<8, Field::Required, Field::Optional, false, false>;
+    validators[PROTOCOL_BINARY_CMD_REPLACE] =
+        packet_validator<8, Field::Required, Field::Optional, false, false>;
+    validators[PROTOCOL_BINARY_CMD_APPENDQ] =
+        packet_validator<0, Field::Required, Field::Optional, false, false>;
+    validators[PROTOCOL_BINARY_CMD_APPEND] =
+        packet_validator<0, Field::Required, Field::Optional, false, false>;
+    validators[PROTOCOL_BINARY_CMD_PREPENDQ] =
+        packet_validator<0, Field::Required, Field::Optional, false, false>;
+    validators[PROTOCOL_BINARY_CMD_PREPEND] =
+        packet_validator<0, Field::Required, Field::Optional, false, false>;
+    validators[PROTOCOL_BINARY_CMD_SETM] = setm_validator;
+    validators[PROTOCOL_BINARY_CMD_SCRIPT_EXEC] = script_exec_validator;
 }
@@ -21,7 +21,14 @@
 #include "memcached/audit_interface.h"
 #include "alloc_hooks.h"
 #include "utilities/engine_loader.h"
+#include "utilities/executor.h"
 #include "timings.h"
+#include "slow_ops.h"
+#include "near_cache.h"
+#include "proxy.h"
+#include "scripts.h"
+#include "rate_limit.h"
+#include "openmetrics.h"
 #include "cmdline.h"
 #include "connections.h"
 #include "mcbp_validators.h"
@@ -33,6 +40,19 @@
 #include "runtime.h"
 #include "mcaudit.h"
 #include "subdocument.h"
+#include "ktls.h"
+#include "greenstack.h"
+#include "compression.h"
+#include "dictionary.h"
+#include "stream_compression.h"
+#include "workload_trace.h"
+#include "vbucket_stats.h"
+#include "heap_profile.h"
+#include "memory_manager.h"
+#include "sasl_pool.h"
+#include "shm_ring.h"
+#include "ssl_sessions.h"
+#include "json_check.h"
 
 #include <signal.h>
 #include <fcntl.h>
@@ -45,12 +65,18 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <stddef.h>
-#include <snappy-c.h>
-#include <JSON_checker.h>
 
 // MB-14649: log crashing on windows..
 #include <math.h>
 
+#ifdef HAVE_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+#ifdef HAVE_SIOCOUTQNSD
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
+
 static void cookie_set_admin(const void *cookie);
 static bool cookie_is_admin(const void *cookie);
 
@@ -58,6 +84,160 @@ static void item_set_cas(const void *cookie, item *it, uint64_t cas) {
     settings.engine.v1->item_set_cas(settings.engine.v0, cookie, it, cas);
 }
 
+/* All the segments of the value, for the engines without get_item_view */
+static bool get_item_info_holder(conn *c, const item *it,
+                                 item_info_holder *info) {
+    info->info.nvalue = IOV_MAX;
+    return settings.engine.v1->get_item_info(settings.engine.v0, c, it,
+                                             &info->info);
+}
+
+ENGINE_HANDLE_V1 *conn_engine_enter(conn *c, ENGINE_HANDLE **handle) {
+    engine_binding_t *b = &c->bound.binding;
+
+    if (b->v1 == NULL && !c->bound.tried &&
+        settings.engine.v1->bind_engine != NULL) {
+        c->bound.tried = true;
+        if (!settings.engine.v1->bind_engine(settings.engine.v0, c, b)) {
+            b->v1 = NULL;
+        }
+    }
+
+    if (b->v1 != NULL) {
+        if (*b->current != b->expected) {
+            /* Another bucket now, the old one is none of our business */
+            b->v1 = NULL;
+            c->bound.tried = false;
+        } else {
+            __atomic_add_fetch(b->clients, 1, __ATOMIC_SEQ_CST);
+            if (*b->state == b->live) {
+                *handle = b->v0;
+                return b->v1;
+            }
+            /* Going away, let the proxy engine deal with it */
+            __atomic_sub_fetch(b->clients, 1, __ATOMIC_SEQ_CST);
+            b->release(b->bucket);
+            b->v1 = NULL;
+        }
+    }
+
+    *handle = settings.engine.v0;
+    return settings.engine.v1;
+}
+
+void conn_engine_leave(conn *c, const ENGINE_HANDLE_V1 *v1) {
+    engine_binding_t *b = &c->bound.binding;
+
+    if (v1 != settings.engine.v1 && v1 == b->v1) {
+        __atomic_sub_fetch(b->clients, 1, __ATOMIC_SEQ_CST);
+        if (*b->state != b->live) {
+            b->release(b->bucket);
+            b->v1 = NULL;
+        }
+    }
+}
+
+void conn_engine_unbind(conn *c) {
+    /* Not a call in progress, so there's nothing to release */
+    conn_flush_releases(c);
+    c->bound.binding.v1 = NULL;
+    c->bound.tried = false;
+}
+
+bool get_item_view(conn *c, const item *it, item_view *view) {
+    item_info_holder info;
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *v1;
+    bool ret;
+
+    if (settings.engine.v1->get_item_view != NULL) {
+        v1 = conn_engine_enter(c, &h);
+        if (v1->get_item_view != NULL) {
+            ret = v1->get_item_view(h, c, it, view);
+            conn_engine_leave(c, v1);
+            return ret;
+        }
+        conn_engine_leave(c, v1);
+        return settings.engine.v1->get_item_view(settings.engine.v0, c, it,
+                                                 view);
+    }
+    if (!get_item_info_holder(c, it, &info)) {
+        return false;
+    }
+    view->cas = info.info.cas;
+    view->vbucket_uuid = info.info.vbucket_uuid;
+    view->seqno = info.info.seqno;
+    view->exptime = info.info.exptime;
+    view->nbytes = info.info.nbytes;
+    view->flags = info.info.flags;
+    view->datatype = info.info.datatype;
+    view->clsid = info.info.clsid;
+    view->nkey = info.info.nkey;
+    view->nsegments = info.info.nvalue;
+    view->key = info.info.key;
+    view->value = info.info.value[0];
+    return true;
+}
+
+bool get_item_segment(conn *c, const item *it, const item_view *view,
+                      uint16_t index, struct iovec *segment) {
+    item_info_holder info;
+
+    if (index == 0) {
+        *segment = view->value;
+        return true;
+    }
+    if (settings.engine.v1->get_item_segment != NULL) {
+        ENGINE_HANDLE *h;
+        ENGINE_HANDLE_V1 *v1 = conn_engine_enter(c, &h);
+        bool ret;
+
+        if (v1->get_item_segment != NULL) {
+            ret = v1->get_item_segment(h, c, it, index, segment);
+            conn_engine_leave(c, v1);
+            return ret;
+        }
+        conn_engine_leave(c, v1);
+        return settings.engine.v1->get_item_segment(settings.engine.v0, c, it,
+                                                    index, segment);
+    }
+    if (!get_item_info_holder(c, it, &info) || index >= info.info.nvalue) {
+        return false;
+    }
+    *segment = info.info.value[index];
+    return true;
+}
+
+/* Add the segments of the value of the item to the message */
+static bool add_item_value_iov(conn *c, const item *it, const item_view *view) {
+    struct iovec segment;
+    uint16_t ii;
+
+    for (ii = 0; ii < view->nsegments; ++ii) {
+        if (!get_item_segment(c, it, view, ii, &segment)) {
+            return false;
+        }
+        add_iov(c, segment.iov_base, segment.iov_len);
+    }
+    return true;
+}
+
+/* The item_info set_item_info() takes for a single segment view */
+static void item_view_to_info(const item_view *view, item_info *info) {
+    info->cas = view->cas;
+    info->vbucket_uuid = view->vbucket_uuid;
+    info->seqno = view->seqno;
+    info->exptime = view->exptime;
+    info->nbytes = view->nbytes;
+    info->flags = view->flags;
+    info->datatype = view->datatype;
+    info->clsid = view->clsid;
+    info->nkey = view->nkey;
+    info->nvalue = 1;
+    info->key = view->key;
+    info->value[0] = view->value;
+}
+
 #define MAX_SASL_MECH_LEN 32
 
 volatile sig_atomic_t memcached_shutdown;
@@ -65,6 +245,22 @@ volatile sig_atomic_t memcached_shutdown;
 /* Lock for global stats */
 static cb_mutex_t stats_lock;
 
+/**
+ * The thread stats of all of the buckets, as "stats aggregate" last
+ * summed them up. They're reused for stats_snapshot_msec, so a busy
+ * monitoring scrape only copies them instead of walking every bucket.
+ */
+static struct aggregate_snapshot {
+    cb_mutex_t mutex;
+    /* Set while a connection sums up a new snapshot */
+    bool refreshing;
+    bool valid;
+    /* Bumped by "stats reset", so a snapshot taken across it is dropped */
+    uint64_t resets;
+    hrtime_t taken;
+    struct thread_stats stats;
+} aggregate_snapshot;
+
 /**
  * Structure to save ns_server's session cas token.
  */
@@ -131,6 +327,7 @@ static void register_callback(ENGINE_HANDLE *eh,
                               ENGINE_EVENT_TYPE type,
                               EVENT_CALLBACK cb, const void *cb_data);
 static SERVER_HANDLE_V1 *get_server_api(void);
+static void process_stat_startup(ADD_STAT add_stats, conn *c);
 
 
 enum try_read_result {
@@ -155,6 +352,15 @@ static void settings_init(void);
 static void complete_nread(conn *c);
 static int ensure_iov_space(conn *c);
 static int add_msghdr(conn *c);
+static bool conn_flush_coalesced(conn *c, STATE_FUNC next);
+static int add_unordered_iov(conn *c);
+static bool conn_unordered_may_run(const conn *c);
+static void conn_unordered_dispatch(conn *c);
+static bool conn_unordered_complete(conn *c);
+static bool is_prefetch_opcode(uint8_t opcode);
+static bool direct_receive_wanted(conn *c);
+static void direct_receive_complete(conn *c, const item_view *info);
+static void get_auth_data(const void *cookie, auth_data_t *data);
 
 /** exported globals **/
 struct stats stats;
@@ -201,6 +407,9 @@ enum transmit_result {
 };
 
 static enum transmit_result transmit(conn *c);
+static bool conn_pin_item(conn *c, item *it);
+static void conn_reap_zerocopy(conn *c);
+static auth_error_t conn_check_access(conn *c, uint8_t opcode);
 
 
 /* Perform all callbacks of a given type for the given connection. */
@@ -230,6 +439,11 @@ static void stats_reset(const void *cookie) {
     STATS_UNLOCK();
     threadlocal_stats_reset(get_independent_stats(conn));
     settings.engine.v1->reset_stats(settings.engine.v0, cookie);
+
+    cb_mutex_enter(&aggregate_snapshot.mutex);
+    aggregate_snapshot.valid = false;
+    aggregate_snapshot.resets++;
+    cb_mutex_exit(&aggregate_snapshot.mutex);
 }
 
 static int get_number_of_worker_threads(void) {
@@ -284,6 +498,52 @@ static void settings_init(void) {
     settings.reqs_per_event_med_priority = 5;
     settings.reqs_per_event_low_priority = 1;
     settings.default_reqs_per_event = 20;
+    settings.connection_dispatch = DISPATCH_ROUND_ROBIN;
+    settings.hash_algorithm = HASH_JENKINS;
+    settings.connection_migration_threshold = 0;
+    settings.reuseport = false;
+    settings.io_uring = false;
+    settings.arena_per_thread = false;
+    settings.thread_affinity = NULL;
+    settings.busy_poll_usec = 0;
+    settings.proxy.enabled = false;
+    settings.proxy.username = NULL;
+    settings.proxy.password = NULL;
+    settings.proxy.hedge_usec = 0;
+    settings.near_cache_items = 0;
+    settings.response_coalescing_usec = 0;
+    settings.direct_receive_size = 0;
+    settings.max_outstanding_commands = 16;
+    settings.compression_threshold = 0;
+    settings.inflate_cache_size = 1024 * 1024;
+    settings.dictionary_compression_max = 0;
+    settings.stream_compression_level = 0;
+    settings.subdoc_index_cache_size = 256 * 1024;
+    settings.prefetch_depth = 4;
+    settings.stats_snapshot_msec = 0;
+    settings.num_dcp_threads = 0;
+    settings.num_sasl_threads = 0;
+    settings.scheduler_slice_usec = 0;
+    settings.max_slice_usec = 0;
+    settings.shed_inflight = 0;
+    settings.shed_delay_usec = 0;
+    settings.max_unsent_bytes = 0;
+    settings.max_pinned_items = 0;
+    settings.rate_limit_user_ops = 0;
+    settings.rate_limit_user_bytes = 0;
+    settings.rate_limit_bucket_ops = 0;
+    settings.rate_limit_bucket_bytes = 0;
+    settings.trace_sample_rate = 1;
+    settings.phase_timings = false;
+    settings.slow_command_threshold = 0;
+    settings.idle_trim_sec = 0;
+    settings.idle_timeout = 0;
+    settings.free_memory_release_pct = 0;
+    settings.free_memory_release_rate = 64;
+    settings.gather_writes = true;
+    settings.workload_trace_file_size = WORKLOAD_TRACE_DEFAULT_FILE_SIZE;
+    settings.workload_trace_sample = 0;
+    settings.vbucket_stats = VBUCKET_STATS_DEFAULT;
     /*
      * The max object size is 20MB. Let's allow packets up to 30MB to
      * be handled "properly" by returing E2BIG, but packets bigger
@@ -294,6 +554,7 @@ static void settings_init(void) {
     settings.breakpad.enabled = false;
     settings.breakpad.minidump_dir = NULL;
     settings.breakpad.content = CONTENT_DEFAULT;
+    settings.breakpad.helper = false;
     settings.require_init = false;
 }
 
@@ -330,13 +591,22 @@ static int add_msghdr(conn *c)
 
     cb_assert(c != NULL);
 
+    if (c->iov == NULL) {
+        /* The first response since the connection was idle */
+        c->iov = malloc(IOV_LIST_INITIAL * sizeof(struct iovec));
+        if (c->iov == NULL) {
+            return -1;
+        }
+        c->iovsize = IOV_LIST_INITIAL;
+    }
+
     if (c->msgsize == c->msgused) {
-        cb_assert(c->msgsize > 0);
-        msg = realloc(c->msglist, c->msgsize * 2 * sizeof(struct msghdr));
+        int nsize = c->msgsize != 0 ? c->msgsize * 2 : MSG_LIST_INITIAL;
+        msg = realloc(c->msglist, nsize * sizeof(struct msghdr));
         if (! msg)
             return -1;
         c->msglist = msg;
-        c->msgsize *= 2;
+        c->msgsize = nsize;
     }
 
     msg = c->msglist + c->msgused;
@@ -347,11 +617,6 @@ static int add_msghdr(conn *c)
 
     msg->msg_iov = &c->iov[c->iovused];
 
-    if (c->request_addr_size > 0) {
-        msg->msg_name = &c->request_addr;
-        msg->msg_namelen = c->request_addr_size;
-    }
-
     c->msgbytes = 0;
     c->msgused++;
     STATS_MAX(c, msgused_high_watermark, c->msgused);
@@ -382,20 +647,64 @@ static uint64_t get_listen_disabled_num(void) {
     return ret;
 }
 
-static void disable_listen(void) {
+static void set_listen_events(conn *list, bool enable) {
     conn *next;
+    for (next = list; next; next = next->next) {
+        if (enable) {
+            int backlog = 1024;
+            int ii;
+            update_event(next, EV_READ | EV_PERSIST);
+            for (ii = 0; ii < settings.num_interfaces; ++ii) {
+                if (next->parent_port == settings.interfaces[ii].port) {
+                    backlog = settings.interfaces[ii].backlog;
+                    break;
+                }
+            }
+
+            if (listen(next->sfd, backlog) != 0) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                                "listen() failed",
+                                                strerror(errno));
+            }
+        } else {
+            update_event(next, 0);
+            if (listen(next->sfd, 1) != 0) {
+                log_socket_error(EXTENSION_LOG_WARNING, NULL,
+                                 "listen() failed: %s");
+            }
+        }
+    }
+}
+
+/*
+ * Stop accepting connections on the listeners of the thread c belongs to.
+ * In reuseport mode only the worker thread owning a listener may touch it
+ * (the other ones disable theirs when they run out of file descriptors
+ * as well).
+ */
+static void disable_listen(conn *c) {
     cb_mutex_enter(&listen_state.mutex);
     listen_state.disabled = true;
     listen_state.count = 10;
     ++listen_state.num_disable;
     cb_mutex_exit(&listen_state.mutex);
 
-    for (next = listen_conn; next; next = next->next) {
-        update_event(next, 0);
-        if (listen(next->sfd, 1) != 0) {
-            log_socket_error(EXTENSION_LOG_WARNING, NULL,
-                             "listen() failed: %s");
-        }
+    if (c->thread != NULL) {
+        c->thread->listen_disabled = true;
+        set_listen_events(c->thread->listen_conns, false);
+    } else {
+        set_listen_events(listen_conn, false);
+    }
+}
+
+/*
+ * Called by a worker thread with SO_REUSEPORT listeners whenever it is
+ * notified, to enable them again once the dispatcher allows that.
+ */
+void thread_update_listen(LIBEVENT_THREAD *me) {
+    if (me->listen_disabled && !is_listen_disabled()) {
+        me->listen_disabled = false;
+        set_listen_events(me->listen_conns, true);
     }
 }
 
@@ -444,6 +753,8 @@ const char *state_text(STATE_FUNC state) {
         return "conn_nread";
     } else if (state == conn_closing) {
         return "conn_closing";
+    } else if (state == conn_zerocopy_close) {
+        return "conn_zerocopy_close";
     } else if (state == conn_mwrite) {
         return "conn_mwrite";
     } else if (state == conn_ship_log) {
@@ -462,11 +773,121 @@ const char *state_text(STATE_FUNC state) {
         return "conn_flush";
     } else if (state == conn_audit_configuring) {
         return "conn_audit_configuring";
+    } else if (state == conn_stats_stream) {
+        return "conn_stats_stream";
+    } else if (state == conn_proxy_wait) {
+        return "conn_proxy_wait";
     } else {
         return "Unknown";
     }
 }
 
+/*
+ * Start timing the phases of the command whose header was just read, if
+ * phase_timings or the slow command log want them.
+ */
+static void conn_phase_begin(conn *c, hrtime_t now) {
+    if (settings.phase_timings || settings.slow_command_threshold != 0) {
+        memset(&c->phase, 0, sizeof(c->phase));
+        c->phase.active = true;
+        c->phase.start = now;
+    } else {
+        c->phase.active = false;
+    }
+}
+
+/*
+ * A cheap reading of the time for the connection: the clock cached by
+ * the worker thread running it (the listen thread doesn't cache one).
+ */
+static hrtime_t conn_clock(const conn *c) {
+    if (c->thread == NULL || is_listen_thread()) {
+        return gethrtime();
+    }
+    return thread_clock(c->thread);
+}
+
+/* A precise reading of the time, also cached by the connection's thread */
+static hrtime_t conn_clock_update(conn *c) {
+    if (c->thread == NULL || is_listen_thread()) {
+        return gethrtime();
+    }
+    return thread_clock_update(c->thread);
+}
+
+/*
+ * The time of the command is done, with the size class of its payload,
+ * and its traffic is counted for its vbucket
+ */
+static void conn_collect_timing(conn *c, hrtime_t now) {
+    uint32_t size = c->binary_header.request.bodylen;
+    if (c->rsp_bodylen > size) {
+        size = c->rsp_bodylen;
+    }
+    collect_timing(c->thread->index, c->cmd, size, now - c->start);
+    vbucket_counters_record(c->thread->vbuckets, c);
+}
+
+/*
+ * The command is done with: its response is sent (sent) or it's held
+ * back to go out with the next ones, or there's none. Record the time of
+ * its phases and log it if it was slow. The phases it didn't get to
+ * (it failed before the executor, the response wasn't sent...) take no
+ * time.
+ */
+static void conn_phase_end(conn *c, bool sent) {
+    hrtime_t now = conn_clock_update(c);
+    hrtime_t phases[CMD_PHASE_COUNT];
+    hrtime_t read, dispatch, done, first, last, busy, blocked;
+
+    c->phase.active = false;
+    read = c->phase.read ? c->phase.read : c->phase.start;
+    dispatch = c->phase.dispatch ? c->phase.dispatch : read;
+    done = c->phase.done ? c->phase.done : now;
+    if (sent) {
+        first = c->phase.first_byte ? c->phase.first_byte : now;
+        last = now;
+    } else {
+        first = last = done;
+    }
+
+    busy = done - dispatch;
+    blocked = c->phase.ewouldblock + c->phase.wakeup;
+    phases[CMD_PHASE_READ] = read - c->phase.start;
+    phases[CMD_PHASE_PARSE] = dispatch - read;
+    phases[CMD_PHASE_ENGINE] = busy > blocked ? busy - blocked : 0;
+    phases[CMD_PHASE_EWOULDBLOCK] = c->phase.ewouldblock;
+    phases[CMD_PHASE_WAKEUP] = c->phase.wakeup;
+    phases[CMD_PHASE_SEND_WAIT] = first - done;
+    phases[CMD_PHASE_SEND] = last - first;
+
+    if (settings.phase_timings) {
+        collect_phase_timings(c->thread->index, c->cmd, phases);
+    }
+
+    if (settings.slow_command_threshold != 0 &&
+        last - c->phase.start >=
+        (hrtime_t)settings.slow_command_threshold * 1000000) {
+        char buffer[256];
+        int offset = 0;
+        int ii;
+        const char *cmd = memcached_opcode_2_text(c->cmd);
+        const char *status = memcached_status_2_text(c->phase.status);
+
+        for (ii = 0; ii < CMD_PHASE_COUNT; ++ii) {
+            offset += snprintf(buffer + offset, sizeof(buffer) - offset,
+                               "%s%s %" PRIu64, ii == 0 ? "" : ", ",
+                               cmd_phase_name((cmd_phase_t)ii),
+                               (uint64_t)(phases[ii] / 1000));
+        }
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+            "%d: Slow %s command (%s): %" PRIu64 " us (%s us)\n", c->sfd,
+            cmd ? cmd : "unknown", status ? status : "unknown",
+            (uint64_t)((last - c->phase.start) / 1000), buffer);
+        slow_op_record(c, last - c->phase.start, phases);
+    }
+}
+
 /*
  * Sets a connection's current state in the state machine. Any special
  * processing that needs to happen on certain state transitions can
@@ -476,6 +897,14 @@ void conn_set_state(conn *c, STATE_FUNC state) {
     cb_assert(c != NULL);
 
     if (state != c->state) {
+        if (c->near_cache.pending != NEAR_CACHE_NONE &&
+            (state == conn_new_cmd || state == conn_write ||
+             state == conn_mwrite || state == conn_closing)) {
+            /* The command is done, the near cache copies are out of date */
+            near_cache_invalidate(c->near_cache.pending);
+            c->near_cache.pending = NEAR_CACHE_NONE;
+        }
+
         /*
          * The connections in the "tap thread" behaves differently than
          * normal connections because they operate in a full duplex mode.
@@ -499,8 +928,16 @@ void conn_set_state(conn *c, STATE_FUNC state) {
 
         if (state == conn_write || state == conn_mwrite) {
             if (c->start != 0) {
-                collect_timing(c->cmd, gethrtime() - c->start);
+                hrtime_t now = conn_clock_update(c);
+                conn_collect_timing(c, now);
                 c->start = 0;
+                if (c->phase.active && c->phase.done == 0) {
+                    c->phase.done = now;
+                    if (c->unordered.parent != NULL) {
+                        /* The parent sends it with the others */
+                        conn_phase_end(c, false);
+                    }
+                }
             }
             MEMCACHED_PROCESS_COMMAND_END(c->sfd, c->write.buf, c->write.bytes);
         }
@@ -520,12 +957,13 @@ static int ensure_iov_space(conn *c) {
 
     if (c->iovused >= c->iovsize) {
         int i, iovnum;
+        int nsize = c->iovsize != 0 ? c->iovsize * 2 : IOV_LIST_INITIAL;
         struct iovec *new_iov = (struct iovec *)realloc(c->iov,
-                                (c->iovsize * 2) * sizeof(struct iovec));
+                                nsize * sizeof(struct iovec));
         if (! new_iov)
             return -1;
         c->iov = new_iov;
-        c->iovsize *= 2;
+        c->iovsize = nsize;
 
         /* Point all the msghdr structures at the new list. */
         for (i = 0, iovnum = 0; i < c->msgused; i++) {
@@ -593,6 +1031,33 @@ int add_iov(conn *c, const void *buf, size_t len) {
     return 0;
 }
 
+int insert_iov(conn *c, const void *buf, size_t len) {
+    int ii;
+
+    cb_assert(c != NULL);
+    cb_assert(c->msgused > 0 && c->msgcurr == 0);
+
+    if (c->msglist[0].msg_iovlen == IOV_MAX || ensure_iov_space(c) != 0) {
+        return -1;
+    }
+
+    memmove(c->iov + 1, c->iov, c->iovused * sizeof(struct iovec));
+    c->iov[0].iov_base = (void *)buf;
+    c->iov[0].iov_len = len;
+    c->iovused++;
+    STATS_MAX(c, iovused_high_watermark, c->iovused);
+
+    c->msglist[0].msg_iovlen++;
+    for (ii = 1; ii < c->msgused; ++ii) {
+        c->msglist[ii].msg_iov++;
+    }
+    if (c->msgused == 1) {
+        c->msgbytes += (int)len;
+    }
+
+    return 0;
+}
+
 /**
  * get a pointer to the start of the request struct for the current command
  */
@@ -673,6 +1138,18 @@ int add_bin_header(conn *c, uint16_t err, uint8_t ext_len, uint16_t key_len,
     if (add_msghdr(c) != 0) {
         return -1;
     }
+    c->coalesce.queued = false;
+    c->coalesce.sending = false;
+    if (c->coalesce.buf.bytes > 0) {
+        /* The held back responses go out first */
+        if (add_iov(c, c->coalesce.buf.buf, c->coalesce.buf.bytes) != 0) {
+            return -1;
+        }
+        c->coalesce.queued = true;
+    }
+    if (add_unordered_iov(c) != 0) {
+        return -1;
+    }
 
     header = (protocol_binary_response_header *)c->write.buf;
 
@@ -683,12 +1160,16 @@ int add_bin_header(conn *c, uint16_t err, uint8_t ext_len, uint16_t key_len,
     header->response.extlen = ext_len;
     header->response.datatype = datatype;
     header->response.status = (uint16_t)htons(err);
+    if (c->phase.active) {
+        c->phase.status = err;
+    }
 
     header->response.bodylen = htonl(body_len);
+    c->rsp_bodylen = body_len;
     header->response.opaque = c->opaque;
     header->response.cas = htonll(c->cas);
 
-    if (settings.verbose > 1) {
+    if (c->trace_request) {
         char buffer[1024];
         if (bytes_to_output_string(buffer, sizeof(buffer), c->sfd, false,
                                    "Writing bin response:",
@@ -697,11 +1178,92 @@ int add_bin_header(conn *c, uint16_t err, uint8_t ext_len, uint16_t key_len,
             settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
                                             "%s", buffer);
         }
+        if (memcached_packet_2_trace(header->bytes, sizeof(header->bytes),
+                                     buffer, sizeof(buffer)) != -1) {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                            "<%d %s\n", c->sfd, buffer);
+        }
     }
 
+    c->compact.header_iov = c->compact.enabled ? c->iovused : -1;
     return add_iov(c, c->write.buf, sizeof(header->response));
 }
 
+static uint8_t *encode_varint(uint8_t *dest, uint32_t val) {
+    while (val >= 0x80) {
+        *dest++ = (uint8_t)(val | 0x80);
+        val >>= 7;
+    }
+    *dest++ = (uint8_t)val;
+    return dest;
+}
+
+/*
+ * Replace the header add_bin_header() queued with the compact one (see
+ * PROTOCOL_BINARY_FEATURE_COMPACT_RESPONSE). It's done just before the
+ * response goes out, as the commands fill in the CAS after calling
+ * add_bin_header().
+ */
+static void compact_bin_header(conn *c) {
+    protocol_binary_response_header *header;
+    struct iovec *iov;
+    uint8_t buf[40];
+    uint8_t *p = buf + 2;
+    uint16_t status, keylen;
+
+    if (c->compact.header_iov < 0 || c->compact.header_iov >= c->iovused) {
+        c->compact.header_iov = -1;
+        return;
+    }
+    iov = &c->iov[c->compact.header_iov];
+    c->compact.header_iov = -1;
+    header = (protocol_binary_response_header *)c->write.buf;
+    if (iov->iov_base != (void *)c->write.buf ||
+        iov->iov_len != sizeof(header->response)) {
+        /* Split up by add_iov() */
+        return;
+    }
+
+    buf[0] = 0;
+    buf[1] = header->response.opcode;
+    status = ntohs(header->response.status);
+    if (status != 0) {
+        buf[0] |= PROTOCOL_BINARY_COMPACT_STATUS;
+        p = encode_varint(p, status);
+    }
+    if (header->response.extlen != 0) {
+        buf[0] |= PROTOCOL_BINARY_COMPACT_EXTLEN;
+        *p++ = header->response.extlen;
+    }
+    keylen = ntohs(header->response.keylen);
+    if (keylen != 0) {
+        buf[0] |= PROTOCOL_BINARY_COMPACT_KEYLEN;
+        p = encode_varint(p, keylen);
+    }
+    p = encode_varint(p, ntohl(header->response.bodylen));
+    if (header->response.datatype != PROTOCOL_BINARY_RAW_BYTES) {
+        buf[0] |= PROTOCOL_BINARY_COMPACT_DATATYPE;
+        *p++ = header->response.datatype;
+    }
+    if (header->response.opaque != 0) {
+        buf[0] |= PROTOCOL_BINARY_COMPACT_OPAQUE;
+        memcpy(p, &header->response.opaque, 4);
+        p += 4;
+    }
+    if (header->response.cas != 0) {
+        buf[0] |= PROTOCOL_BINARY_COMPACT_CAS;
+        memcpy(p, &header->response.cas, 8);
+        p += 8;
+    }
+
+    if ((size_t)(p - buf) < sizeof(header->response)) {
+        /* The extras are in iovecs of their own, past the full header */
+        memcpy(c->write.buf, buf, p - buf);
+        c->msgbytes -= (int)(sizeof(header->response) - (p - buf));
+        iov->iov_len = p - buf;
+    }
+}
+
 protocol_binary_response_status engine_error_2_protocol_error(ENGINE_ERROR_CODE e) {
     protocol_binary_response_status ret;
 
@@ -773,47 +1335,125 @@ static ENGINE_ERROR_CODE get_vb_map_cb(const void *cookie,
     return ENGINE_SUCCESS;
 }
 
-void write_bin_packet(conn *c, protocol_binary_response_status err) {
-    if (err == PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET) {
-        ENGINE_ERROR_CODE ret;
+/*
+ * Send NOT_MY_VBUCKET with the engine's vbucket map. Returns false if the
+ * engine has no map, for the caller to send the plain status.
+ */
+static bool write_not_my_vbucket(conn *c) {
+    ENGINE_ERROR_CODE ret;
 
-        ret = settings.engine.v1->get_engine_vb_map(settings.engine.v0, c,
-                                                    get_vb_map_cb);
-        if (ret == ENGINE_SUCCESS) {
-            write_and_free(c, &c->dynamic_buffer);
-        } else {
-            conn_set_state(c, conn_closing);
-        }
+    if (settings.engine.v1->get_engine_vb_map == NULL) {
+        return false;
+    }
+    ret = settings.engine.v1->get_engine_vb_map(settings.engine.v0, c,
+                                                get_vb_map_cb);
+    if (ret == ENGINE_SUCCESS) {
+        write_and_free(c, &c->dynamic_buffer);
     } else {
-        ssize_t len = 0;
-        const char *errtext = NULL;
-
-        switch (err) {
-        case PROTOCOL_BINARY_RESPONSE_SUCCESS:
-        case PROTOCOL_BINARY_RESPONSE_NOT_INITIALIZED:
-        case PROTOCOL_BINARY_RESPONSE_AUTH_STALE:
-        case PROTOCOL_BINARY_RESPONSE_NO_BUCKET:
-            break;
-        default:
-            errtext = memcached_protocol_errcode_2_text(err);
-            if (errtext != NULL) {
-                len = (ssize_t)strlen(errtext);
-            }
-        }
+        conn_set_state(c, conn_closing);
+    }
+    return true;
+}
 
-        if (errtext && settings.verbose > 1) {
-            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
-                                            ">%d Writing an error: %s\n", c->sfd,
-                                            errtext);
-        }
+/* The commands proxy mode forwards: the ones with exactly one response */
+static bool is_proxy_opcode(uint8_t opcode) {
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GET_RANGE:
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_TOUCH:
+    case PROTOCOL_BINARY_CMD_GAT:
+    case PROTOCOL_BINARY_CMD_GET_LOCKED:
+    case PROTOCOL_BINARY_CMD_UNLOCK_KEY:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Hand the request the engine failed with NOT_MY_VBUCKET to the node which
+ * owns the vbucket (see proxy.h), if the whole packet is still there in
+ * the read buffer.
+ */
+static bool conn_proxy_forward(conn *c) {
+    const protocol_binary_request_header *req;
+    const char *packet;
+    auth_data_t data;
+
+    if (!settings.proxy.enabled || c->protocol != PROTOCOL_MEMCACHED ||
+        c->unordered.parent != NULL || c->dcp || c->tap_iterator != NULL ||
+        c->direct.vlen != 0 || c->dynamic_buffer.offset != 0 ||
+        !is_proxy_opcode(c->binary_header.request.opcode) ||
+        c->read.buf == NULL) {
+        return false;
+    }
+
+    packet = c->read.curr - (sizeof(c->binary_header) +
+                             c->binary_header.request.bodylen);
+    req = (const protocol_binary_request_header *)packet;
+    if (packet < c->read.buf || req->request.magic != PROTOCOL_BINARY_REQ ||
+        req->request.opcode != c->binary_header.request.opcode ||
+        req->request.opaque != c->opaque ||
+        ntohl(req->request.bodylen) != c->binary_header.request.bodylen) {
+        return false;
+    }
+
+    get_auth_data(c, &data);
+    if (data.username != NULL &&
+        strcmp(data.username, settings.proxy.username) == 0) {
+        /* Forwarded by another node already */
+        return false;
+    }
+    return proxy_forward(c, packet, data.username);
+}
+
+/* Send the status (and the text for an error) without a body */
+static void write_bin_status(conn *c, protocol_binary_response_status err) {
+    ssize_t len = 0;
+    const char *errtext = NULL;
 
-        add_bin_header(c, err, 0, 0, len, PROTOCOL_BINARY_RAW_BYTES);
-        if (errtext) {
-            add_iov(c, errtext, len);
+    switch (err) {
+    case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+    case PROTOCOL_BINARY_RESPONSE_NOT_INITIALIZED:
+    case PROTOCOL_BINARY_RESPONSE_AUTH_STALE:
+    case PROTOCOL_BINARY_RESPONSE_NO_BUCKET:
+        break;
+    default:
+        errtext = memcached_protocol_errcode_2_text(err);
+        if (errtext != NULL) {
+            len = (ssize_t)strlen(errtext);
         }
-        conn_set_state(c, conn_mwrite);
-        c->write_and_go = conn_new_cmd;
     }
+
+    if (errtext && c->trace_request) {
+        settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                        ">%d Writing an error: %s\n", c->sfd,
+                                        errtext);
+    }
+
+    add_bin_header(c, err, 0, 0, len, PROTOCOL_BINARY_RAW_BYTES);
+    if (errtext) {
+        add_iov(c, errtext, len);
+    }
+    conn_set_state(c, conn_mwrite);
+    c->write_and_go = conn_new_cmd;
+}
+
+void write_bin_packet(conn *c, protocol_binary_response_status err) {
+    if (err == PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET &&
+        (conn_proxy_forward(c) || write_not_my_vbucket(c))) {
+        return;
+    }
+    write_bin_status(c, err);
 }
 
 /* Form and send a response to a command over the binary protocol.
@@ -834,30 +1474,322 @@ static void write_bin_response(conn *c, const void *d, int extlen, int keylen,
         c->write_and_go = conn_new_cmd;
     } else {
         if (c->start != 0) {
-            collect_timing(c->cmd, gethrtime() - c->start);
+            conn_collect_timing(c, conn_clock_update(c));
             c->start = 0;
         }
+        if (c->phase.active) {
+            conn_phase_end(c, false);
+        }
         conn_set_state(c, conn_new_cmd);
     }
 }
 
-static void process_bin_get(conn *c) {
-    item *it;
-    protocol_binary_response_get* rsp = (protocol_binary_response_get*)c->write.buf;
-    char* key = binary_get_key(c);
-    size_t nkey = c->binary_header.request.keylen;
-    uint16_t keylen;
-    uint32_t bodylen;
-    item_info_holder info;
-    int ii;
-    ENGINE_ERROR_CODE ret;
-    uint8_t datatype;
-    bool need_inflate = false;
+/*
+ * Clients implement multi-get as a pipeline of GETQ/GETKQ packets. When
+ * the first of them is executed the rest is often already in the input
+ * buffer, so look all of them up with a single engine::get_multi call.
+ * The responses are still generated one packet at a time, and anything
+ * not matching the batch (a packet rejected by a validator etc) simply
+ * drops the remaining lookups.
+ */
+static void get_batch_prepare(conn *c, const char *key, size_t nkey) {
+    const char *ptr = c->read.curr;
+    size_t avail = c->read.bytes;
+    item_get_request *requests;
+    char *keys;
+    int count = 0;
+    hrtime_t start;
+
+    /* The packets in a Greenstack input buffer are framed */
+    if (settings.engine.v1->get_multi == NULL ||
+        c->protocol == PROTOCOL_GREENSTACK) {
+        return;
+    }
 
-    memset(&info, 0, sizeof(info));
-    if (settings.verbose > 1) {
-        char buffer[1024];
-        if (key_to_printable_buffer(buffer, sizeof(buffer), c->sfd, true,
+    if (c->get_batch.requests == NULL) {
+        /* One allocation: requests, opaques and key copies */
+        char *mem = malloc(GET_BATCH_MAX * (sizeof(item_get_request) +
+                                            sizeof(uint32_t) +
+                                            KEY_MAX_LENGTH));
+        if (mem == NULL) {
+            return;
+        }
+        c->get_batch.requests = (void*)mem;
+        c->get_batch.opaques = (void*)(mem + GET_BATCH_MAX * sizeof(item_get_request));
+        c->get_batch.keys = (char*)(c->get_batch.opaques + GET_BATCH_MAX);
+    }
+
+    requests = c->get_batch.requests;
+    keys = c->get_batch.keys;
+
+    /* The packet being executed now is the first in the batch */
+    memcpy(keys, key, nkey);
+    requests[0].key = keys;
+    requests[0].nkey = (uint16_t)nkey;
+    requests[0].vbucket = c->binary_header.request.vbucket;
+    c->get_batch.opaques[0] = c->opaque;
+    keys += nkey;
+    count = 1;
+
+    while (count < GET_BATCH_MAX &&
+           avail >= sizeof(protocol_binary_request_header)) {
+        protocol_binary_request_header req;
+        uint16_t keylen;
+
+        /* The input buffer isn't necessarily aligned */
+        memcpy(&req, ptr, sizeof(req));
+        if (req.request.magic != PROTOCOL_BINARY_REQ ||
+            (req.request.opcode != PROTOCOL_BINARY_CMD_GETQ &&
+             req.request.opcode != PROTOCOL_BINARY_CMD_GETKQ) ||
+            req.request.extlen != 0 ||
+            req.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
+            break;
+        }
+
+        keylen = ntohs(req.request.keylen);
+        if (keylen == 0 || keylen > KEY_MAX_LENGTH ||
+            ntohl(req.request.bodylen) != keylen ||
+            avail < sizeof(req) + keylen) {
+            break;
+        }
+
+        memcpy(keys, ptr + sizeof(req), keylen);
+        requests[count].key = keys;
+        requests[count].nkey = keylen;
+        requests[count].vbucket = ntohs(req.request.vbucket);
+        c->get_batch.opaques[count] = req.request.opaque;
+        keys += keylen;
+        ++count;
+
+        ptr += sizeof(req) + keylen;
+        avail -= sizeof(req) + keylen;
+    }
+
+    /* The items looked up stay referenced until their packets run */
+    if (settings.max_pinned_items != 0 &&
+        count > (int)settings.max_pinned_items) {
+        count = (int)settings.max_pinned_items;
+    }
+    if (count < 2) {
+        return;
+    }
+
+    start = conn_clock_update(c);
+    if (settings.engine.v1->get_multi(settings.engine.v0, c,
+                                      requests, count) == ENGINE_SUCCESS) {
+        c->get_batch.count = count;
+        c->get_batch.next = 0;
+    }
+    collect_batch_timing(c->thread->index, c->cmd, (uint32_t)count,
+                         conn_clock_update(c) - start);
+}
+
+/*
+ * Pick up the answer for the current packet from the get batch. Returns
+ * false if the packet isn't served from the batch and should go through
+ * engine::get as usual.
+ */
+static bool get_batch_lookup(conn *c, const char *key, size_t nkey,
+                             item **it, ENGINE_ERROR_CODE *ret) {
+    item_get_request *req;
+
+    if (c->get_batch.next == c->get_batch.count) {
+        return false;
+    }
+
+    req = &c->get_batch.requests[c->get_batch.next];
+    if (req->nkey != nkey ||
+        req->vbucket != c->binary_header.request.vbucket ||
+        c->get_batch.opaques[c->get_batch.next] != c->opaque ||
+        memcmp(req->key, key, nkey) != 0) {
+        conn_release_get_batch(c);
+        return false;
+    }
+
+    if (++c->get_batch.next == c->get_batch.count) {
+        c->get_batch.count = c->get_batch.next = 0;
+    }
+
+    if (req->status != ENGINE_SUCCESS && req->status != ENGINE_KEY_ENOENT) {
+        /* Not answered, let engine::get deal with it */
+        return false;
+    }
+
+    *it = req->item;
+    *ret = req->status;
+    return true;
+}
+
+/*
+ * Answer a GET_RANGE with the part of the value asked for. The range of a
+ * plain value is sent straight from the item memory like a GET, only a
+ * compressed one is inflated first (the range is of what the client
+ * stored). Consumes the reference to the item.
+ */
+static void send_value_range(conn *c, item *it, const item_view *info,
+                             uint8_t datatype) {
+    protocol_binary_request_get_range *req = binary_get_request(c);
+    protocol_binary_response_get_range *rsp;
+    uint32_t offset = ntohl(req->message.body.offset);
+    uint32_t length = ntohl(req->message.body.length);
+    size_t nbytes = info->nbytes;
+    const bool compressed =
+        (info->datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) != 0;
+    struct iovec segment;
+    uint16_t ii;
+
+    if (compressed &&
+        (info->nsegments != 1 ||
+         !get_inflated_length(c, info->cas, info->value.iov_base,
+                              info->value.iov_len, &nbytes) ||
+         nbytes > UINT32_MAX)) {
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
+        return;
+    }
+
+    if (offset > nbytes) {
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ERANGE);
+        return;
+    }
+    if (length == 0 || length > nbytes - offset) {
+        length = (uint32_t)(nbytes - offset);
+    }
+
+    if (compressed) {
+        struct {
+            uint32_t flags;
+            uint32_t nbytes;
+        } body;
+        char *value = malloc(nbytes + 1);
+        uint16_t status = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+
+        body.flags = info->flags;
+        body.nbytes = htonl((uint32_t)nbytes);
+        if (value != NULL) {
+            if (!inflate_value(c, info->cas, info->value.iov_base,
+                               info->value.iov_len, value, nbytes)) {
+                status = PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+            } else if (binary_response_handler(NULL, 0, &body, sizeof(body),
+                                               value + offset, length,
+                                               info->datatype &
+                                               ~PROTOCOL_BINARY_DATATYPE_COMPRESSED,
+                                               PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                                               info->cas, c)) {
+                status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+            }
+            free(value);
+        }
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            write_and_free(c, &c->dynamic_buffer);
+        } else {
+            write_bin_packet(c, status);
+        }
+        return;
+    }
+
+    if (!conn_pin_item(c, it)) {
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        conn_set_state(c, conn_closing);
+        return;
+    }
+
+    rsp = (protocol_binary_response_get_range*)c->write.buf;
+    if (add_bin_header(c, 0, sizeof(rsp->message.body), 0,
+                       sizeof(rsp->message.body) + length, datatype) == -1) {
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    rsp->message.header.response.cas = htonll(info->cas);
+    rsp->message.body.flags = info->flags;
+    rsp->message.body.nbytes = htonl((uint32_t)nbytes);
+    add_iov(c, &rsp->message.body, sizeof(rsp->message.body));
+
+    /* Only the iovecs (or parts of them) holding the range */
+    for (ii = 0; ii < info->nsegments && length > 0; ++ii) {
+        size_t len;
+        if (!get_item_segment(c, it, info, ii, &segment)) {
+            conn_set_state(c, conn_closing);
+            return;
+        }
+        len = segment.iov_len;
+        if (offset >= len) {
+            offset -= (uint32_t)len;
+            continue;
+        }
+        len -= offset;
+        if (len > length) {
+            len = length;
+        }
+        add_iov(c, (char*)segment.iov_base + offset, len);
+        offset = 0;
+        length -= (uint32_t)len;
+    }
+    conn_set_state(c, conn_mwrite);
+}
+
+/*
+ * Answer the get from the near cache of the thread (see near_cache.h) if
+ * the key is in there, if not the ticket tells if it should be put in.
+ */
+static bool near_cache_get(conn *c, const char *key, uint16_t nkey,
+                           near_cache_ticket_t *ticket) {
+    near_cache_hit_t hit;
+    auth_data_t data;
+    uint16_t keylen = 0;
+
+    if (c->thread->near_cache == NULL || c->near_cache.disabled ||
+        c->cmd == PROTOCOL_BINARY_CMD_GET_RANGE ||
+        c->get_batch.count != 0) {
+        return false;
+    }
+    get_auth_data(c, &data);
+    if (!near_cache_lookup(c, data.username, key, nkey,
+                           c->binary_header.request.vbucket, &hit, ticket)) {
+        return false;
+    }
+
+    {
+        /* STATS_HIT() without the item */
+        struct thread_stats *thread_stats = get_thread_stats(c);
+        STATS_BUMP(thread_stats->slab_stats[hit.clsid].get_hits, 1);
+        STATS_BUMP(thread_stats->cmd_get, 1);
+    }
+    if ((c->cmd == PROTOCOL_BINARY_CMD_GETK) ||
+        (c->cmd == PROTOCOL_BINARY_CMD_GETKQ)) {
+        keylen = nkey;
+    }
+    if (binary_response_handler(keylen ? key : NULL, keylen, &hit.flags, 4,
+                                hit.value, hit.nvalue, hit.datatype,
+                                PROTOCOL_BINARY_RESPONSE_SUCCESS, hit.cas,
+                                c)) {
+        write_and_free(c, &c->dynamic_buffer);
+    } else {
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM);
+    }
+    return true;
+}
+
+static void process_bin_get(conn *c) {
+    item *it;
+    protocol_binary_response_get* rsp = (protocol_binary_response_get*)c->write.buf;
+    char* key = binary_get_key(c);
+    size_t nkey = c->binary_header.request.keylen;
+    uint16_t keylen;
+    uint32_t bodylen;
+    item_view info;
+    ENGINE_ERROR_CODE ret;
+    uint8_t datatype;
+    bool need_inflate = false;
+    near_cache_ticket_t ticket;
+
+    info.clsid = 0;
+    ticket.admit = false;
+    if (c->trace_request) {
+        char buffer[1024];
+        if (key_to_printable_buffer(buffer, sizeof(buffer), c->sfd, true,
                                     "GET", key, nkey) != -1) {
             settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c, "%s\n",
                                             buffer);
@@ -867,17 +1799,26 @@ static void process_bin_get(conn *c) {
     ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
     if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->get(settings.engine.v0, c, &it, key, (int)nkey,
-                                      c->binary_header.request.vbucket);
+        if (near_cache_get(c, key, (uint16_t)nkey, &ticket)) {
+            return;
+        }
+        if (c->noreply && c->get_batch.count == 0) {
+            get_batch_prepare(c, key, nkey);
+        }
+        if (!get_batch_lookup(c, key, nkey, &it, &ret)) {
+            ENGINE_HANDLE *h;
+            ENGINE_HANDLE_V1 *v1 = conn_engine_enter(c, &h);
+            ret = v1->get(h, c, &it, key, (int)nkey,
+                          c->binary_header.request.vbucket);
+            conn_engine_leave(c, v1);
+        }
     }
 
-    info.info.nvalue = IOV_MAX;
     switch (ret) {
     case ENGINE_SUCCESS:
         STATS_HIT(c, get, key, nkey);
 
-        if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
-                                               (void*)&info)) {
+        if (!get_item_view(c, it, &info)) {
             settings.engine.v1->release(settings.engine.v0, c, it);
             settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                             "%d: Failed to get item info",
@@ -885,18 +1826,36 @@ static void process_bin_get(conn *c) {
             write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
             break;
         }
+        if (ticket.admit) {
+            auth_data_t data;
+            get_auth_data(c, &data);
+            near_cache_fill(c, data.username, key, (uint16_t)nkey,
+                            c->binary_header.request.vbucket, it, &info,
+                            &ticket);
+        }
 
-        datatype = info.info.datatype;
+        datatype = info.datatype;
         if (!c->supports_datatype) {
             if ((datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) == PROTOCOL_BINARY_DATATYPE_COMPRESSED) {
                 need_inflate = true;
             } else {
                 datatype = PROTOCOL_BINARY_RAW_BYTES;
             }
+        } else if ((datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) != 0 &&
+                   info.nsegments == 1 &&
+                   dictionary_compressed(info.value.iov_base,
+                                         info.value.iov_len)) {
+            /* The client can't inflate it without the dictionary */
+            need_inflate = true;
+        }
+
+        if (c->cmd == PROTOCOL_BINARY_CMD_GET_RANGE) {
+            send_value_range(c, it, &info, datatype);
+            break;
         }
 
         keylen = 0;
-        bodylen = sizeof(rsp->message.body) + info.info.nbytes;
+        bodylen = sizeof(rsp->message.body) + info.nbytes;
 
         if ((c->cmd == PROTOCOL_BINARY_CMD_GETK) ||
             (c->cmd == PROTOCOL_BINARY_CMD_GETKQ)) {
@@ -905,44 +1864,49 @@ static void process_bin_get(conn *c) {
         }
 
         if (need_inflate) {
-            if (info.info.nvalue != 1) {
+            if (info.nsegments != 1) {
                 write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
             } else if (binary_response_handler(key, keylen,
-                                               &info.info.flags, 4,
-                                               info.info.value[0].iov_base,
-                                               (uint32_t)info.info.value[0].iov_len,
+                                               &info.flags, 4,
+                                               info.value.iov_base,
+                                               (uint32_t)info.value.iov_len,
                                                datatype,
                                                PROTOCOL_BINARY_RESPONSE_SUCCESS,
-                                               info.info.cas, c)) {
+                                               info.cas, c)) {
                 write_and_free(c, &c->dynamic_buffer);
                 settings.engine.v1->release(settings.engine.v0, c, it);
             } else {
                 write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
             }
         } else {
+            /* The value is sent straight from the item memory, so keep
+             * a reference until the response is sent */
+            if (!conn_pin_item(c, it)) {
+                settings.engine.v1->release(settings.engine.v0, c, it);
+                conn_set_state(c, conn_closing);
+                return;
+            }
             if (add_bin_header(c, 0, sizeof(rsp->message.body),
                                keylen, bodylen, datatype) == -1) {
                 conn_set_state(c, conn_closing);
                 return;
             }
-            rsp->message.header.response.cas = htonll(info.info.cas);
+            rsp->message.header.response.cas = htonll(info.cas);
 
             /* add the flags */
-            rsp->message.body.flags = info.info.flags;
+            rsp->message.body.flags = info.flags;
             add_iov(c, &rsp->message.body, sizeof(rsp->message.body));
 
             if ((c->cmd == PROTOCOL_BINARY_CMD_GETK) ||
                 (c->cmd == PROTOCOL_BINARY_CMD_GETKQ)) {
-                add_iov(c, info.info.key, nkey);
+                add_iov(c, info.key, nkey);
             }
 
-            for (ii = 0; ii < info.info.nvalue; ++ii) {
-                add_iov(c, info.info.value[ii].iov_base,
-                        info.info.value[ii].iov_len);
+            if (!add_item_value_iov(c, it, &info)) {
+                conn_set_state(c, conn_closing);
+                return;
             }
             conn_set_state(c, conn_mwrite);
-            /* Remember this item so we can garbage collect it later */
-            c->item = it;
         }
         break;
     case ENGINE_KEY_ENOENT:
@@ -1032,6 +1996,49 @@ static void append_stats(const char *key, const uint16_t klen,
     cb_assert(c->dynamic_buffer.offset <= c->dynamic_buffer.size);
 }
 
+/*
+ * Move the unread bytes to the front of the read buffer. The input isn't
+ * repacked before every read, only once the bytes still to come for the
+ * packet in the buffer don't fit behind it (see try_read_network and
+ * bin_read_chunk), so a pipeline of packets received in pieces is moved
+ * at most once per packet instead of once per read.
+ */
+static void conn_repack_read(conn *c) {
+    if (c->read.bytes != 0) {
+        memmove(c->read.buf, c->read.curr, c->read.bytes);
+        STATS_NOKEY(c, read_repacks);
+    }
+    c->read.curr = c->read.buf;
+}
+
+/* The free space behind the unread bytes */
+static uint32_t conn_read_tail(const conn *c) {
+    return c->read.size - (uint32_t)(c->read.curr - c->read.buf) -
+        c->read.bytes;
+}
+
+/*
+ * The bytes still to come for the packet at read.curr, or a buffer's worth
+ * (unknown) if its header isn't complete yet
+ */
+static uint32_t conn_read_wanted(const conn *c) {
+    const protocol_binary_request_header *req;
+    uint64_t size;
+
+    if (c->protocol == PROTOCOL_GREENSTACK ||
+        c->read.bytes < sizeof(*req)) {
+        return DATA_BUFFER_SIZE;
+    }
+    req = (const protocol_binary_request_header *)c->read.curr;
+    size = sizeof(*req) + (uint64_t)ntohl(req->request.bodylen);
+    if (size <= c->read.bytes) {
+        /* A complete packet, read what fits behind it */
+        return 1;
+    }
+    size -= c->read.bytes;
+    return size > c->read.size ? c->read.size : (uint32_t)size;
+}
+
 static void bin_read_chunk(conn *c,
                            enum bin_substates next_substate,
                            uint32_t chunk) {
@@ -1050,15 +2057,23 @@ static void bin_read_chunk(conn *c,
             nsize *= 2;
         }
 
+        if (c->read.buf != c->read.curr) {
+            /* Before a resize, so only the unread bytes are copied */
+            conn_repack_read(c);
+            if (settings.verbose > 1) {
+                settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                                "%d: Repack input buffer\n",
+                                                c->sfd);
+            }
+        }
         if (nsize != c->read.size) {
-            char *newm;
             if (settings.verbose > 1) {
                 settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
                         "%d: Need to grow buffer from %lu to %lu\n",
                         c->sfd, (unsigned long)c->read.size, (unsigned long)nsize);
             }
-            newm = realloc(c->read.buf, nsize);
-            if (newm == NULL) {
+            /* rcurr stays at the same offset in the packet */
+            if (!thread_buffer_resize(c->thread, &c->read, (uint32_t)nsize)) {
                 if (settings.verbose) {
                     settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
                             "%d: Failed to grow buffer.. closing connection\n",
@@ -1067,20 +2082,6 @@ static void bin_read_chunk(conn *c,
                 conn_set_state(c, conn_closing);
                 return;
             }
-
-            c->read.buf= newm;
-            /* rcurr should point to the same offset in the packet */
-            c->read.curr = c->read.buf + offset - sizeof(protocol_binary_request_header);
-            c->read.size = (int)nsize;
-        }
-        if (c->read.buf != c->read.curr) {
-            memmove(c->read.buf, c->read.curr, c->read.bytes);
-            c->read.curr = c->read.buf;
-            if (settings.verbose > 1) {
-                settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
-                                                "%d: Repack input buffer\n",
-                                                c->sfd);
-            }
         }
     }
 
@@ -1109,6 +2110,11 @@ static void get_auth_data(const void *cookie, auth_data_t *data) {
         data->username = NULL;
         data->config = NULL;
     }
+    if (data->username == NULL && c->peer_user != NULL) {
+        /* Authenticated by its peer credentials (until a SASL_AUTH) */
+        data->username = c->peer_user;
+        data->config = NULL;
+    }
 }
 
 static bool authenticated(conn *c) {
@@ -1128,9 +2134,12 @@ static bool authenticated(conn *c) {
             cbsasl_getprop(c->sasl_conn, CBSASL_USERNAME, &uname);
             rv = uname != NULL;
         }
+        if (c->peer_user != NULL) {
+            rv = true;
+        }
     }
 
-    if (settings.verbose > 1) {
+    if (c->trace_request) {
         settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
                 "%d: authenticated() in cmd 0x%02x is %s\n",
                 c->sfd, c->cmd, rv ? "true" : "false");
@@ -1153,6 +2162,13 @@ bool binary_response_handler(const void *key, uint16_t keylen,
     bool need_inflate = false;
     size_t inflated_length;
 
+    if ((datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) != 0 &&
+        dictionary_compressed(body, bodylen)) {
+        /* Only we have the dictionary */
+        need_inflate = true;
+        datatype &= ~PROTOCOL_BINARY_DATATYPE_COMPRESSED;
+    }
+
     if (!c->supports_datatype) {
         if ((datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) ==
                                 PROTOCOL_BINARY_DATATYPE_COMPRESSED) {
@@ -1164,8 +2180,7 @@ bool binary_response_handler(const void *key, uint16_t keylen,
 
     needed = keylen + extlen + sizeof(protocol_binary_response_header);
     if (need_inflate) {
-        if (snappy_uncompressed_length(body, bodylen,
-                                       &inflated_length) != SNAPPY_OK) {
+        if (!get_inflated_length(c, cas, body, bodylen, &inflated_length)) {
             settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                     "<%d ERROR: Failed to inflate body, "
                     "Key: %s may have an incorrect datatype, "
@@ -1221,7 +2236,7 @@ bool binary_response_handler(const void *key, uint16_t keylen,
 
     if (bodylen > 0) {
         if (need_inflate) {
-            if (snappy_uncompress(body, bodylen, buf, &inflated_length) != SNAPPY_OK) {
+            if (!inflate_value(c, cas, body, bodylen, buf, inflated_length)) {
                 settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
                         "<%d ERROR: Failed to inflate item", c->sfd);
                 return false;
@@ -1274,13 +2289,118 @@ static bool conn_setup_itemlist(conn *c) {
     return true;
 }
 
+/**
+ * Keep a reference to the item until the msghdr list referencing its
+ * memory is sent (see conn_release_items()). Returns false if we failed
+ * to grow the itemlist (the caller still owns the reference).
+ */
+static bool conn_pin_item(conn *c, item *it) {
+    ptrdiff_t used;
+
+    if (c->ileft == 0 && !conn_setup_itemlist(c)) {
+        return false;
+    }
+
+    used = c->icurr - c->ilist;
+    if (used + c->ileft == c->isize) {
+        void **ptr = realloc(c->ilist, sizeof(item *) * c->isize * 2);
+        if (ptr == NULL) {
+            return false;
+        }
+        c->ilist = ptr;
+        c->icurr = ptr + used;
+        c->isize *= 2;
+    }
+
+    c->icurr[c->ileft++] = it;
+    return true;
+}
+
+/**
+ * Free the buffer once the msghdr list referencing it is sent (see
+ * conn_release_temp_allocs()). Returns false if we failed to grow the
+ * list (the caller still owns the buffer).
+ */
+static bool conn_add_temp_alloc(conn *c, char *buf) {
+    ptrdiff_t used;
+
+    if (c->temp_alloc_left == 0) {
+        c->temp_alloc_curr = c->temp_alloc_list;
+    }
+
+    used = c->temp_alloc_curr - c->temp_alloc_list;
+    if (used + c->temp_alloc_left == c->temp_alloc_size) {
+        int nsize = c->temp_alloc_size != 0 ?
+            c->temp_alloc_size * 2 : TEMP_ALLOC_LIST_INITIAL;
+        char **ptr = realloc(c->temp_alloc_list, sizeof(char *) * nsize);
+        if (ptr == NULL) {
+            return false;
+        }
+        c->temp_alloc_list = ptr;
+        c->temp_alloc_curr = ptr + used;
+        c->temp_alloc_size = nsize;
+    }
+
+    c->temp_alloc_curr[c->temp_alloc_left++] = buf;
+    return true;
+}
+
+/*
+ * Copies data into the write buffer and queues it, growing the previous
+ * iovec instead when it ends right where the copy goes, so the headers of
+ * back to back messages go out as one.
+ */
+static int tap_add_copy(conn *c, const void *data, size_t len) {
+    struct msghdr *m = &c->msglist[c->msgused - 1];
+    char *dest = c->write.curr;
+
+    if (len == 0) {
+        return 0;
+    }
+    memcpy(dest, data, len);
+    c->write.curr += len;
+    c->write.bytes += len;
+    if (m->msg_iovlen > 0 && m->msg_iovlen < IOV_MAX &&
+        (c->msgused > 1 || c->msgbytes + len <= UDP_MAX_PAYLOAD_SIZE)) {
+        struct iovec *last = &m->msg_iov[m->msg_iovlen - 1];
+        if ((char *)last->iov_base + last->iov_len == dest) {
+            last->iov_len += len;
+            c->msgbytes += (int)len;
+            return 0;
+        }
+    }
+    return add_iov(c, dest, len);
+}
+
+/*
+ * Queues the engine specific data following a message header. It's
+ * copied to the side when it doesn't fit in what's left of the frame.
+ */
+static bool tap_add_engine_specific(conn *c, const void *engine,
+                                    uint16_t nengine) {
+    char *buf;
+
+    if (c->write.bytes + nengine <= c->write.size) {
+        return tap_add_copy(c, engine, nengine) == 0;
+    }
+    if ((buf = malloc(nengine)) == NULL) {
+        return false;
+    }
+    memcpy(buf, engine, nengine);
+    if (!conn_add_temp_alloc(c, buf)) {
+        free(buf);
+        return false;
+    }
+    return add_iov(c, buf, nengine) == 0;
+}
+
 static void ship_tap_log(conn *c) {
     bool more_data = true;
     bool send_data = false;
     bool disconnect = false;
     item *it;
     uint32_t bodylen;
-    int ii = 0;
+    size_t step_bytes = 0;
 
     c->msgcurr = 0;
     c->msgused = 0;
@@ -1293,7 +2413,17 @@ static void ship_tap_log(conn *c) {
         conn_set_state(c, conn_closing);
         return ;
     }
-    /* @todo add check for buffer overflow of c->write.buf) */
+    /*
+     * The headers of all of the messages are gathered in one (large)
+     * frame, and the keys and values are sent from the items.
+     */
+    if (c->write.size < TAP_FRAME_SIZE &&
+        !thread_buffer_resize(c->thread, &c->write, TAP_FRAME_SIZE) &&
+        settings.verbose) {
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                                        "%d: Failed to grow the tap frame, "
+                                        "sending smaller batches\n", c->sfd);
+    }
     c->write.bytes = 0;
     c->write.curr = c->write.buf;
 
@@ -1328,7 +2458,9 @@ static void ship_tap_log(conn *c) {
         item_info_holder info;
         memset(&info, 0, sizeof(info));
 
-        if (ii++ == 10) {
+        /* An event can't be handed back, so stop while there is room */
+        if (c->write.bytes + sizeof(msg) > c->write.size ||
+            c->write.bytes + step_bytes >= TAP_STEP_MAX_BYTES) {
             break;
         }
 
@@ -1351,10 +2483,7 @@ static void ship_tap_log(conn *c) {
             msg.noop.message.header.request.opcode = PROTOCOL_BINARY_CMD_NOOP;
             msg.noop.message.header.request.extlen = 0;
             msg.noop.message.header.request.bodylen = htonl(0);
-            memcpy(c->write.curr, msg.noop.bytes, sizeof(msg.noop.bytes));
-            add_iov(c, c->write.curr, sizeof(msg.noop.bytes));
-            c->write.curr += sizeof(msg.noop.bytes);
-            c->write.bytes += sizeof(msg.noop.bytes);
+            tap_add_copy(c, msg.noop.bytes, sizeof(msg.noop.bytes));
             break;
         case TAP_PAUSE :
             more_data = false;
@@ -1369,8 +2498,14 @@ static void ship_tap_log(conn *c) {
                                                 "%d: Failed to get item info\n", c->sfd);
                 break;
             }
+            if (!conn_pin_item(c, it)) {
+                settings.engine.v1->release(settings.engine.v0, c, it);
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                                "%d: Failed to grow itemlist. Shutting down tap connection\n", c->sfd);
+                conn_set_state(c, conn_closing);
+                return;
+            }
             send_data = true;
-            c->ilist[c->ileft++] = it;
 
             if (event == TAP_CHECKPOINT_START) {
                 msg.mutation.message.header.request.opcode =
@@ -1396,6 +2531,15 @@ static void ship_tap_log(conn *c) {
             msg.mutation.message.header.request.extlen = 16;
             if (c->supports_datatype) {
                 msg.mutation.message.header.request.datatype = info.info.datatype;
+                if ((info.info.datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) != 0 &&
+                    info.info.nvalue == 1 &&
+                    dictionary_compressed(info.info.value[0].iov_base,
+                                          info.info.value[0].iov_len)) {
+                    /* The other end doesn't have the dictionary */
+                    inflate = true;
+                    msg.mutation.message.header.request.datatype &=
+                        ~PROTOCOL_BINARY_DATATYPE_COMPRESSED;
+                }
             } else {
                 switch (info.info.datatype) {
                 case 0:
@@ -1419,9 +2563,10 @@ static void ship_tap_log(conn *c) {
             bodylen = 16 + info.info.nkey + nengine;
             if ((tap_flags & TAP_FLAG_NO_VALUE) == 0) {
                 if (inflate) {
-                    if (snappy_uncompressed_length(info.info.value[0].iov_base,
-                                                   info.info.nbytes,
-                                                   &inflated_length) == SNAPPY_OK) {
+                    if (get_inflated_length(c, info.info.cas,
+                                            info.info.value[0].iov_base,
+                                            info.info.nbytes,
+                                            &inflated_length)) {
                         bodylen += (uint32_t)inflated_length;
                     } else {
                         settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
@@ -1445,17 +2590,12 @@ static void ship_tap_log(conn *c) {
             msg.mutation.message.body.tap.enginespecific_length = htons(nengine);
             msg.mutation.message.body.tap.ttl = ttl;
             msg.mutation.message.body.tap.flags = htons(tap_flags);
-            memcpy(c->write.curr, msg.mutation.bytes, sizeof(msg.mutation.bytes));
-
-            add_iov(c, c->write.curr, sizeof(msg.mutation.bytes));
-            c->write.curr += sizeof(msg.mutation.bytes);
-            c->write.bytes += sizeof(msg.mutation.bytes);
-
-            if (nengine > 0) {
-                memcpy(c->write.curr, engine, nengine);
-                add_iov(c, c->write.curr, nengine);
-                c->write.curr += nengine;
-                c->write.bytes += nengine;
+            tap_add_copy(c, msg.mutation.bytes, sizeof(msg.mutation.bytes));
+            if (!tap_add_engine_specific(c, engine, nengine)) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                                "%d: Failed to queue engine specific data. Shutting down tap connection\n", c->sfd);
+                conn_set_state(c, conn_closing);
+                return;
             }
 
             add_iov(c, info.info.key, info.info.nkey);
@@ -1472,11 +2612,11 @@ static void ship_tap_log(conn *c) {
                     }
                     void *body = info.info.value[0].iov_base;
                     size_t bodylen = info.info.value[0].iov_len;
-                    if (snappy_uncompress(body, bodylen,
-                                          buf, &inflated_length) == SNAPPY_OK) {
-                        c->temp_alloc_list[c->temp_alloc_left++] = buf;
-
+                    if (inflate_value(c, info.info.cas, body, bodylen,
+                                      buf, inflated_length) &&
+                        conn_add_temp_alloc(c, buf)) {
                         add_iov(c, buf, inflated_length);
+                        step_bytes += inflated_length;
                     } else {
                         free(buf);
                         settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
@@ -1490,6 +2630,7 @@ static void ship_tap_log(conn *c) {
                         add_iov(c, info.info.value[xx].iov_base,
                                 info.info.value[xx].iov_len);
                     }
+                    step_bytes += info.info.nbytes;
                 }
             }
 
@@ -1503,8 +2644,14 @@ static void ship_tap_log(conn *c) {
                                                 "%d: Failed to get item info\n", c->sfd);
                 break;
             }
+            if (!conn_pin_item(c, it)) {
+                settings.engine.v1->release(settings.engine.v0, c, it);
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                                "%d: Failed to grow itemlist. Shutting down tap connection\n", c->sfd);
+                conn_set_state(c, conn_closing);
+                return;
+            }
             send_data = true;
-            c->ilist[c->ileft++] = it;
             msg.delete.message.header.request.opcode = PROTOCOL_BINARY_CMD_TAP_DELETE;
             msg.delete.message.header.request.cas = htonll(info.info.cas);
             msg.delete.message.header.request.keylen = htons(info.info.nkey);
@@ -1515,16 +2662,12 @@ static void ship_tap_log(conn *c) {
             }
             msg.delete.message.header.request.bodylen = htonl(bodylen);
 
-            memcpy(c->write.curr, msg.delete.bytes, sizeof(msg.delete.bytes));
-            add_iov(c, c->write.curr, sizeof(msg.delete.bytes));
-            c->write.curr += sizeof(msg.delete.bytes);
-            c->write.bytes += sizeof(msg.delete.bytes);
-
-            if (nengine > 0) {
-                memcpy(c->write.curr, engine, nengine);
-                add_iov(c, c->write.curr, nengine);
-                c->write.curr += nengine;
-                c->write.bytes += nengine;
+            tap_add_copy(c, msg.delete.bytes, sizeof(msg.delete.bytes));
+            if (!tap_add_engine_specific(c, engine, nengine)) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                                "%d: Failed to queue engine specific data. Shutting down tap connection\n", c->sfd);
+                conn_set_state(c, conn_closing);
+                return;
             }
 
             add_iov(c, info.info.key, info.info.nkey);
@@ -1534,6 +2677,7 @@ static void ship_tap_log(conn *c) {
                     add_iov(c, info.info.value[xx].iov_base,
                             info.info.value[xx].iov_len);
                 }
+                step_bytes += info.info.nbytes;
             }
 
             cb_mutex_enter(&tap_stats.mutex);
@@ -1570,15 +2714,12 @@ static void ship_tap_log(conn *c) {
             }
 
             msg.flush.message.header.request.bodylen = htonl(8 + nengine);
-            memcpy(c->write.curr, msg.flush.bytes, sizeof(msg.flush.bytes));
-            add_iov(c, c->write.curr, sizeof(msg.flush.bytes));
-            c->write.curr += sizeof(msg.flush.bytes);
-            c->write.bytes += sizeof(msg.flush.bytes);
-            if (nengine > 0) {
-                memcpy(c->write.curr, engine, nengine);
-                add_iov(c, c->write.curr, nengine);
-                c->write.curr += nengine;
-                c->write.bytes += nengine;
+            tap_add_copy(c, msg.flush.bytes, sizeof(msg.flush.bytes));
+            if (!tap_add_engine_specific(c, engine, nengine)) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                                "%d: Failed to queue engine specific data. Shutting down tap connection\n", c->sfd);
+                conn_set_state(c, conn_closing);
+                return;
             }
             break;
         default:
@@ -1798,9 +2939,8 @@ static void process_bin_tap_connect(conn *c) {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
         c->write_and_go = conn_closing;
     } else {
-        c->max_reqs_per_event = settings.reqs_per_event_high_priority;
         c->tap_iterator = iterator;
-        c->max_reqs_per_event = settings.reqs_per_event_high_priority;
+        conn_set_priority(c, CONN_PRIORITY_HIGH);
         c->which = EV_WRITE;
         conn_set_state(c, conn_ship_log);
     }
@@ -1864,7 +3004,7 @@ static void process_bin_tap_packet(tap_event_t event, conn *c) {
         if (ret == ENGINE_SUCCESS) {
             uint8_t datatype = c->binary_header.request.datatype;
             if (event == TAP_MUTATION && !c->supports_datatype) {
-                if (checkUTF8JSON((void*)data, ndata)) {
+                if (is_json(data, ndata)) {
                     datatype = PROTOCOL_BINARY_DATATYPE_JSON;
                 }
             }
@@ -2168,53 +3308,108 @@ static ENGINE_ERROR_CODE dcp_message_mutation(const void* cookie,
                                               uint8_t nru)
 {
     conn *c = (void*)cookie;
-    item_info_holder info;
+    item_view info;
     protocol_binary_request_dcp_mutation packet;
-    int xx;
 
     if (c->write.bytes + sizeof(packet.bytes) + nmeta >= c->write.size) {
         /* We don't have room in the buffer */
         return ENGINE_E2BIG;
     }
+    if (c->write.bytes != 0 &&
+        c->write.bytes + c->dcp_state->step_bytes >=
+        c->dcp_state->step_budget) {
+        /* Send what we've got before taking more */
+        return ENGINE_E2BIG;
+    }
 
-    memset(&info, 0, sizeof(info));
-    info.info.nvalue = IOV_MAX;
-
-    if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
-                                           (void*)&info)) {
+    if (!get_item_view(c, it, &info)) {
         settings.engine.v1->release(settings.engine.v0, c, it);
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                         "%d: Failed to get item info\n", c->sfd);
         return ENGINE_FAILED;
     }
 
+    if ((info.datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) != 0 &&
+        info.nsegments == 1 &&
+        dictionary_compressed(info.value.iov_base,
+                              info.value.iov_len)) {
+        /* The consumer doesn't have the dictionary */
+        size_t len;
+        char *buf = NULL;
+        if (!get_inflated_length(c, info.cas,
+                                 info.value.iov_base,
+                                 info.value.iov_len, &len) ||
+            (buf = malloc(len == 0 ? 1 : len)) == NULL ||
+            !inflate_value(c, info.cas, info.value.iov_base,
+                           info.value.iov_len, buf, len) ||
+            !conn_add_temp_alloc(c, buf)) {
+            free(buf);
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                            "%d: Failed to inflate item\n",
+                                            c->sfd);
+            return ENGINE_FAILED;
+        }
+        info.value.iov_base = buf;
+        info.value.iov_len = len;
+        info.nbytes = (uint32_t)len;
+        info.datatype &= ~PROTOCOL_BINARY_DATATYPE_COMPRESSED;
+    }
+
+    if (c->dcp_state->compression.threshold != 0 && info.nsegments == 1 &&
+        info.nbytes >= c->dcp_state->compression.threshold &&
+        (info.datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) == 0) {
+        size_t len;
+        char *buf = compress_value_copy(info.value.iov_base,
+                                        info.nbytes, &len);
+        if (buf != NULL && conn_add_temp_alloc(c, buf)) {
+            c->dcp_state->compression.values++;
+            c->dcp_state->compression.bytes_in += info.nbytes;
+            c->dcp_state->compression.bytes_out += len;
+            info.value.iov_base = buf;
+            info.value.iov_len = len;
+            info.nbytes = (uint32_t)len;
+            info.datatype |= PROTOCOL_BINARY_DATATYPE_COMPRESSED;
+        } else {
+            /* Not worth it (or no memory), send it as it is */
+            free(buf);
+        }
+    }
+
     memset(packet.bytes, 0, sizeof(packet));
     packet.message.header.request.magic =  (uint8_t)PROTOCOL_BINARY_REQ;
     packet.message.header.request.opcode = (uint8_t)PROTOCOL_BINARY_CMD_DCP_MUTATION;
     packet.message.header.request.opaque = opaque;
     packet.message.header.request.vbucket = htons(vbucket);
-    packet.message.header.request.cas = htonll(info.info.cas);
-    packet.message.header.request.keylen = htons(info.info.nkey);
+    packet.message.header.request.cas = htonll(info.cas);
+    packet.message.header.request.keylen = htons(info.nkey);
     packet.message.header.request.extlen = 31;
-    packet.message.header.request.bodylen = ntohl(31 + info.info.nkey + info.info.nbytes + nmeta);
-    packet.message.header.request.datatype = info.info.datatype;
+    packet.message.header.request.bodylen = ntohl(31 + info.nkey + info.nbytes + nmeta);
+    packet.message.header.request.datatype = info.datatype;
     packet.message.body.by_seqno = htonll(by_seqno);
     packet.message.body.rev_seqno = htonll(rev_seqno);
     packet.message.body.lock_time = htonl(lock_time);
-    packet.message.body.flags = info.info.flags;
-    packet.message.body.expiration = htonl(info.info.exptime);
+    packet.message.body.flags = info.flags;
+    packet.message.body.expiration = htonl(info.exptime);
     packet.message.body.nmeta = htons(nmeta);
     packet.message.body.nru = nru;
 
-    c->ilist[c->ileft++] = it;
+    if (!conn_pin_item(c, it)) {
+        /* The engine still owns the item, and may retry it later */
+        return c->write.bytes != 0 ? ENGINE_E2BIG : ENGINE_ENOMEM;
+    }
+    c->dcp_state->step_bytes += info.nbytes;
 
     memcpy(c->write.curr, packet.bytes, sizeof(packet.bytes));
     add_iov(c, c->write.curr, sizeof(packet.bytes));
     c->write.curr += sizeof(packet.bytes);
     c->write.bytes += sizeof(packet.bytes);
-    add_iov(c, info.info.key, info.info.nkey);
-    for (xx = 0; xx < info.info.nvalue; ++xx) {
-        add_iov(c, info.info.value[xx].iov_base, info.info.value[xx].iov_len);
+    add_iov(c, info.key, info.nkey);
+    if (!add_item_value_iov(c, it, &info)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "%d: Failed to get item segment\n",
+                                        c->sfd);
+        return ENGINE_DISCONNECT;
     }
 
     memcpy(c->write.curr, meta, nmeta);
@@ -2478,12 +3673,83 @@ static ENGINE_ERROR_CODE dcp_message_control(const void* cookie,
     return ENGINE_SUCCESS;
 }
 
-static void ship_dcp_log(conn *c) {
-    static struct dcp_message_producers producers = {
-        dcp_message_get_failover_log,
-        dcp_message_stream_req,
-        dcp_message_add_stream_response,
-        dcp_message_marker_response,
+/* The DCP_CONTROL keys the core handles for the engine */
+#define DCP_FLOW_CONTROL_KEY "connection_buffer_size"
+#define DCP_COMPRESSION_KEY "value_compression_threshold"
+
+/*
+ * Should we hold off sending more DCP messages until the consumer
+ * acknowledges some of what it has got?
+ */
+static bool dcp_flow_blocked(const conn *c) {
+    return c->dcp_state != NULL && c->dcp_state->flow.window != 0 &&
+        c->dcp_state->flow.unacked >= c->dcp_state->flow.window;
+}
+
+static void dcp_flow_sent(conn *c) {
+    uint64_t nbytes = c->dcp_state->flow.unacked;
+    int ii;
+
+    if (c->dcp_state->flow.window == 0) {
+        return;
+    }
+    for (ii = 0; ii < c->iovused; ++ii) {
+        nbytes += c->iov[ii].iov_len;
+    }
+    c->dcp_state->flow.unacked =
+        nbytes > UINT32_MAX ? UINT32_MAX : (uint32_t)nbytes;
+}
+
+static void dcp_flow_acked(conn *c, uint32_t nbytes) {
+    if (c->dcp_state == NULL) {
+        return;
+    }
+    if (nbytes > c->dcp_state->flow.unacked) {
+        nbytes = c->dcp_state->flow.unacked;
+    }
+    c->dcp_state->flow.unacked -= nbytes;
+}
+
+static bool dcp_control_key_is(const uint8_t *key, uint16_t nkey,
+                               const char *name) {
+    return nkey == strlen(name) && memcmp(key, name, nkey) == 0;
+}
+
+/*
+ * Pick up the flow control window or the compression threshold if the
+ * control message carries one of them. Returns false if it does but the
+ * value is garbage.
+ */
+static bool dcp_core_control(conn *c, const uint8_t *key, uint16_t nkey,
+                             const uint8_t *value, uint32_t nvalue,
+                             bool *handled) {
+    char buffer[32];
+    uint32_t *dest = NULL;
+    bool flow = dcp_control_key_is(key, nkey, DCP_FLOW_CONTROL_KEY);
+
+    *handled = flow || dcp_control_key_is(key, nkey, DCP_COMPRESSION_KEY);
+    if (!*handled) {
+        return true;
+    }
+    if (conn_dcp_state(c) == NULL) {
+        return false;
+    }
+    dest = flow ? &c->dcp_state->flow.window :
+        &c->dcp_state->compression.threshold;
+    if (nvalue == 0 || nvalue >= sizeof(buffer)) {
+        return false;
+    }
+    memcpy(buffer, value, nvalue);
+    buffer[nvalue] = '\0';
+    return safe_strtoul(buffer, dest);
+}
+
+static void ship_dcp_log(conn *c) {
+    static struct dcp_message_producers producers = {
+        dcp_message_get_failover_log,
+        dcp_message_stream_req,
+        dcp_message_add_stream_response,
+        dcp_message_marker_response,
         dcp_message_set_vbucket_state_response,
         dcp_message_stream_end,
         dcp_message_marker,
@@ -2497,6 +3763,7 @@ static void ship_dcp_log(conn *c) {
         dcp_message_control
     };
     ENGINE_ERROR_CODE ret;
+    struct conn_dcp *state;
 
     c->msgcurr = 0;
     c->msgused = 0;
@@ -2522,18 +3789,36 @@ static void ship_dcp_log(conn *c) {
         return;
     }
     c->icurr = c->ilist;
+    if ((state = conn_dcp_state(c)) == NULL) {
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    state->step_bytes = 0;
+    state->step_budget = DCP_STEP_MAX_BYTES;
+    if (state->flow.window != 0 &&
+        state->flow.window - state->flow.unacked < state->step_budget) {
+        /* conn_ship_log() doesn't get here with the window full */
+        state->step_budget = state->flow.window - state->flow.unacked;
+    }
 
+    /*
+     * The engine may call the producers as many times as it likes in a
+     * step; once our buffers are full they return ENGINE_E2BIG, and the
+     * whole batch goes out with one write.
+     */
     c->ewouldblock = false;
     ret = settings.engine.v1->dcp.step(settings.engine.v0, c, &producers);
     if (ret == ENGINE_SUCCESS) {
         /* the engine don't have more data to send at this moment */
         c->ewouldblock = true;
-    } else if (ret == ENGINE_WANT_MORE) {
+    } else if (ret == ENGINE_WANT_MORE ||
+               (ret == ENGINE_E2BIG && c->write.bytes != 0)) {
         /* The engine got more data it wants to send */
         ret = ENGINE_SUCCESS;
     }
 
     if (ret == ENGINE_SUCCESS) {
+        dcp_flow_sent(c);
         conn_set_state(c, conn_mwrite);
         c->write_and_go = conn_ship_log;
     } else {
@@ -2644,6 +3929,8 @@ static void dcp_open_executor(conn *c, void *packet)
         switch (ret) {
         case ENGINE_SUCCESS:
             audit_dcp_open(c);
+            c->dcp_migrate = settings.num_dcp_threads > 0 &&
+                c->thread->type != DCP;
             write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUCCESS);
             break;
 
@@ -2841,7 +4128,7 @@ static void dcp_stream_req_executor(conn *c, void *packet)
         switch (ret) {
         case ENGINE_SUCCESS:
             c->dcp = 1;
-            c->max_reqs_per_event = settings.reqs_per_event_med_priority;
+            conn_set_priority(c, CONN_PRIORITY_MED);
             if (c->dynamic_buffer.buffer != NULL) {
                 write_and_free(c, &c->dynamic_buffer);
             } else {
@@ -3212,21 +4499,31 @@ static void dcp_noop_executor(conn *c, void *packet)
 static void dcp_buffer_acknowledgement_executor(conn *c, void *packet)
 {
     protocol_binary_request_dcp_buffer_acknowledgement *req = packet;
+    uint32_t bbytes;
+
+    memcpy(&bbytes, &req->message.body.buffer_bytes, 4);
+    bbytes = ntohl(bbytes);
 
     if (settings.engine.v1->dcp.buffer_acknowledgement == NULL) {
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
+        if (c->dcp_state != NULL && c->dcp_state->flow.window != 0) {
+            /* We're doing the flow control for the engine */
+            dcp_flow_acked(c, bbytes);
+            conn_set_state(c, conn_new_cmd);
+        } else {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
+        }
     } else {
         ENGINE_ERROR_CODE ret = c->aiostat;
         c->aiostat = ENGINE_SUCCESS;
         c->ewouldblock = false;
 
         if (ret == ENGINE_SUCCESS) {
-            uint32_t bbytes;
-            memcpy(&bbytes, &req->message.body.buffer_bytes, 4);
+            /* Account it once, not again when the engine blocked */
+            dcp_flow_acked(c, bbytes);
             ret = settings.engine.v1->dcp.buffer_acknowledgement(settings.engine.v0, c,
                                                                  c->binary_header.request.opaque,
                                                                  c->binary_header.request.vbucket,
-                                                                 ntohl(bbytes));
+                                                                 bbytes);
         }
 
         switch (ret) {
@@ -3250,22 +4547,38 @@ static void dcp_buffer_acknowledgement_executor(conn *c, void *packet)
 
 static void dcp_control_executor(conn *c, void *packet)
 {
+    protocol_binary_request_dcp_control *req = packet;
+    const uint8_t *key = req->bytes + sizeof(req->bytes);
+    uint16_t nkey = ntohs(req->message.header.request.keylen);
+    const uint8_t *value = key + nkey;
+    uint32_t nvalue = ntohl(req->message.header.request.bodylen) - nkey;
+    bool core_control = false;
+
+    if (c->aiostat == ENGINE_SUCCESS &&
+        !dcp_core_control(c, key, nkey, value, nvalue, &core_control)) {
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL);
+        return;
+    }
+
     if (settings.engine.v1->dcp.control == NULL) {
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
+        if (core_control) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        } else {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
+        }
     } else {
         ENGINE_ERROR_CODE ret = c->aiostat;
         c->aiostat = ENGINE_SUCCESS;
         c->ewouldblock = false;
 
         if (ret == ENGINE_SUCCESS) {
-            protocol_binary_request_dcp_control *req = packet;
-            const uint8_t *key = req->bytes + sizeof(req->bytes);
-            uint16_t nkey = ntohs(req->message.header.request.keylen);
-            const uint8_t *value = key + nkey;
-            uint32_t nvalue = ntohl(req->message.header.request.bodylen) - nkey;
             ret = settings.engine.v1->dcp.control(settings.engine.v0, c,
                                                   c->binary_header.request.opaque,
                                                   key, nkey, value, nvalue);
+            if (ret == ENGINE_ENOTSUP && core_control) {
+                /* The engine leaves it to us */
+                ret = ENGINE_SUCCESS;
+            }
         }
 
         switch (ret) {
@@ -3375,6 +4688,10 @@ static void process_hello_packet_executor(conn *c, void *packet) {
      */
     c->supports_datatype = false;
     c->supports_mutation_extras = false;
+    c->supports_exptime_ms = false;
+    c->unordered.enabled = false;
+    c->compact.enabled = false;
+    /* ... other than the stream compression, which can't be undone */
 
     if (klen) {
         if (klen > 256) {
@@ -3422,6 +4739,46 @@ static void process_hello_packet_executor(conn *c, void *packet) {
                 added = true;
             }
             break;
+
+        case PROTOCOL_BINARY_FEATURE_EXPTIME_MS:
+            if (!c->supports_exptime_ms) {
+                c->supports_exptime_ms = true;
+                added = true;
+            }
+            break;
+
+        case PROTOCOL_BINARY_FEATURE_UNORDERED_EXECUTION:
+            /* A Greenstack frame would need the stream of each response */
+            if (settings.max_outstanding_commands > 0 &&
+                c->protocol != PROTOCOL_GREENSTACK && !c->unordered.enabled &&
+                c->stream == NULL) {
+                c->unordered.enabled = true;
+                added = true;
+            }
+            break;
+
+        case PROTOCOL_BINARY_FEATURE_COMPACT_RESPONSE:
+            /* A Greenstack frame has a header of its own */
+            if (c->protocol != PROTOCOL_GREENSTACK && !c->compact.enabled) {
+                c->compact.enabled = true;
+                added = true;
+            }
+            break;
+
+        case PROTOCOL_BINARY_FEATURE_STREAM_COMPRESSION:
+            /*
+             * The out of order responses are sent on their own, and a
+             * Greenstack frame has to stay readable to the client.
+             */
+            if (settings.stream_compression_level != 0 &&
+                c->stream == NULL && !c->unordered.enabled &&
+                c->protocol != PROTOCOL_GREENSTACK &&
+                stream_compression_supported()) {
+                c->stream = stream_compressor_create(
+                    (int)settings.stream_compression_level);
+                added = c->stream != NULL;
+            }
+            break;
         }
 
         if (added) {
@@ -3491,47 +4848,46 @@ static void sasl_list_mech_executor(conn *c, void *packet)
     write_bin_response(c, (char*)result_string, 0, 0, string_length);
 }
 
-static void sasl_auth_executor(conn *c, void *packet)
-{
-    protocol_binary_request_no_extras *req = packet;
-    char mech[1024];
-    int nkey = c->binary_header.request.keylen;
-    int vlen = c->binary_header.request.bodylen - nkey;
+/*
+ * We've successfully changed our user identity. Update the authentication
+ * context and the admin flag, and let the engine know.
+ */
+static void conn_set_user(conn *c, auth_data_t *data) {
+    auth_destroy(c->auth_context);
+    c->auth_context = auth_create(data->username, NULL, NULL);
+    c->access_mask = NULL;
 
-    if (nkey > 1023) {
-        /* too big.. */
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                "%d: sasl error. key: %d > 1023", c->sfd, nkey);
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_AUTH_ERROR);
-        return;
+    if (settings.disable_admin) {
+        /* "everyone is admins" */
+        cookie_set_admin(c);
+    } else if (settings.admin != NULL && data->username != NULL) {
+        if (strcmp(settings.admin, data->username) == 0) {
+            cookie_set_admin(c);
+        }
     }
+    /* The items put off go to the bucket they came from */
+    conn_flush_releases(c);
+    perform_callbacks(ON_AUTH, (const void*)data, c);
+    conn_engine_unbind(c);
+}
 
-    memcpy(mech, req->bytes + sizeof(req->bytes), nkey);
-    mech[nkey] = '\0';
+void conn_peer_authenticate(conn *c) {
+    auth_data_t data;
 
+    get_auth_data(c, &data);
     if (settings.verbose) {
-        settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
-                                        "%d: SASL auth with mech: '%s' with %d "
-                                        "bytes of data\n", c->sfd, mech, vlen);
-    }
-
-    char *challenge = (void*)(req->bytes + sizeof(req->bytes) + nkey);
-    if (vlen == 0) {
-        challenge = NULL;
-    }
-
-    const char *out = NULL;
-    unsigned int outlen = 0;
-    int result;
-
-    if (c->cmd == PROTOCOL_BINARY_CMD_SASL_AUTH) {
-        result = cbsasl_server_start(&c->sasl_conn, mech, challenge, vlen,
-                                     (unsigned char **)&out, &outlen);
-    } else {
-        result = cbsasl_server_step(c->sasl_conn, challenge, vlen,
-                                    &out, &outlen);
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                                        "%d: authenticated as %s by its "
+                                        "peer credentials", c->sfd,
+                                        data.username);
     }
+    conn_set_user(c, &data);
+}
 
+/* Send the response to the SASL_AUTH or SASL_STEP command */
+static void sasl_auth_complete(conn *c, int result, const char *out,
+                               unsigned int outlen)
+{
     switch(result) {
     case CBSASL_OK:
         {
@@ -3544,26 +4900,10 @@ static void sasl_auth_executor(conn *c, void *packet)
                                                 c->sfd, data.username);
             }
 
-            write_bin_response(c, NULL, 0, 0, 0);
+            /* The server-final message of SCRAM (if any) goes along */
+            write_bin_response(c, out, 0, 0, outlen);
 
-            /*
-             * We've successfully changed our user identity.
-             * Update the authentication context
-             */
-            auth_destroy(c->auth_context);
-            c->auth_context = auth_create(data.username,
-                                          c->peername,
-                                          c->sockname);
-
-            if (settings.disable_admin) {
-                /* "everyone is admins" */
-                cookie_set_admin(c);
-            } else if (settings.admin != NULL && data.username != NULL) {
-                if (strcmp(settings.admin, data.username) == 0) {
-                    cookie_set_admin(c);
-                }
-            }
-            perform_callbacks(ON_AUTH, (const void*)&data, c);
+            conn_set_user(c, &data);
             STATS_NOKEY(c, auth_cmds);
         }
         break;
@@ -3618,6 +4958,68 @@ static void sasl_auth_executor(conn *c, void *packet)
 
 }
 
+static void sasl_auth_executor(conn *c, void *packet)
+{
+    protocol_binary_request_no_extras *req = packet;
+    char mech[1024];
+    int nkey = c->binary_header.request.keylen;
+    int vlen = c->binary_header.request.bodylen - nkey;
+    const char *out = NULL;
+    unsigned int outlen = 0;
+    int result;
+
+    c->aiostat = ENGINE_SUCCESS;
+    c->ewouldblock = false;
+
+    if (c->sasl_auth.pending) {
+        /* A SASL thread is done with it */
+        c->sasl_auth.pending = false;
+        sasl_auth_complete(c, c->sasl_auth.result, c->sasl_auth.out,
+                           c->sasl_auth.outlen);
+        return;
+    }
+
+    if (nkey > 1023) {
+        /* too big.. */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: sasl error. key: %d > 1023", c->sfd, nkey);
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_AUTH_ERROR);
+        return;
+    }
+
+    memcpy(mech, req->bytes + sizeof(req->bytes), nkey);
+    mech[nkey] = '\0';
+
+    if (settings.verbose) {
+        settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                        "%d: SASL auth with mech: '%s' with %d "
+                                        "bytes of data\n", c->sfd, mech, vlen);
+    }
+
+    char *challenge = (void*)(req->bytes + sizeof(req->bytes) + nkey);
+    if (vlen == 0) {
+        challenge = NULL;
+    }
+
+    c->sasl_auth.pending = true;
+    if (sasl_pool_submit(c, c->cmd == PROTOCOL_BINARY_CMD_SASL_AUTH, mech,
+                         challenge, vlen)) {
+        c->ewouldblock = true;
+        return;
+    }
+    c->sasl_auth.pending = false;
+
+    /* Without SASL threads (or memory for the job) we run it here */
+    if (c->cmd == PROTOCOL_BINARY_CMD_SASL_AUTH) {
+        result = cbsasl_server_start(&c->sasl_conn, mech, challenge, vlen,
+                                     (unsigned char **)&out, &outlen);
+    } else {
+        result = cbsasl_server_step(c->sasl_conn, challenge, vlen,
+                                    &out, &outlen);
+    }
+    sasl_auth_complete(c, result, out, outlen);
+}
+
 static void noop_executor(conn *c, void *packet)
 {
     (void)packet;
@@ -3638,7 +5040,7 @@ static void flush_executor(conn *c, void *packet)
         exptime = ntohl(req->message.body.expiration);
     }
 
-    if (settings.verbose > 1) {
+    if (c->trace_request) {
         settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
                                         "%d: flush %ld", c->sfd,
                                         (long)exptime);
@@ -3662,95 +5064,200 @@ static void flush_executor(conn *c, void *packet)
     }
 }
 
+/*
+ * Copy a value into the segments of a newly allocated item (the engine
+ * may store a large value in more than one)
+ */
+static void copy_to_item_value(conn *c, const item *it,
+                               const item_view *info, const char *data,
+                               size_t len)
+{
+    struct iovec segment;
+    uint16_t ii;
+
+    for (ii = 0; ii < info->nsegments; ++ii) {
+        if (!get_item_segment(c, it, info, ii, &segment)) {
+            cb_assert(false);
+        }
+        cb_assert(segment.iov_len <= len);
+        memcpy(segment.iov_base, data, segment.iov_len);
+        data += segment.iov_len;
+        len -= segment.iov_len;
+    }
+    cb_assert(len == 0);
+}
+
+/*
+ * Flag the (filled in) value of a new item as JSON for the clients which
+ * don't tell the datatype themselves
+ */
+static void detect_item_json(conn *c, item *it, const item_view *view,
+                             uint8_t datatype)
+{
+    if (!c->supports_datatype && view->nsegments == 1 &&
+        (datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) == 0) {
+        if (is_json(view->value.iov_base, view->value.iov_len)) {
+            item_info info;
+            item_view_to_info(view, &info);
+            info.datatype = PROTOCOL_BINARY_DATATYPE_JSON;
+            if (!settings.engine.v1->set_item_info(settings.engine.v0, c,
+                                                   it, &info)) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                        "%d: Failed to set item info",
+                        c->sfd);
+            }
+        }
+    }
+}
+
+/*
+ * The executors of the commands which may block more than once (on each
+ * of their engine calls) resume where they did when the engine notifies
+ * the connection, rather than running again from the top and repeating
+ * the steps already done. Between EXECUTOR_BEGIN and EXECUTOR_END they're
+ * a switch on c->resume (as in protothreads), so the state they keep
+ * across a block must be in the connection (c->item, c->cas, ...) or be
+ * computed from the packet ahead of EXECUTOR_BEGIN. EXECUTOR_AWAIT runs
+ * call, and if it blocks returns and runs it again once notified (or
+ * takes the status of the notification if that's an error), so ret is
+ * never ENGINE_EWOULDBLOCK after it. process_bin_packet() goes straight
+ * to the executor of a command resumed.
+ */
+#define EXECUTOR_BEGIN(c) switch ((c)->resume) { case 0:
+
+#define EXECUTOR_AWAIT(c, ret, call)                     \
+    do {                                                 \
+        (ret) = (call);                                  \
+        if (0) {                                         \
+        case __LINE__:                                   \
+            (c)->resume = 0;                             \
+            (ret) = (c)->aiostat;                        \
+            (c)->aiostat = ENGINE_SUCCESS;               \
+            if ((ret) == ENGINE_SUCCESS) {               \
+                (ret) = (call);                          \
+            }                                            \
+        }                                                \
+        if ((ret) == ENGINE_EWOULDBLOCK) {               \
+            (c)->resume = __LINE__;                      \
+            (c)->ewouldblock = true;                     \
+            return;                                      \
+        }                                                \
+    } while (0)
+
+#define EXECUTOR_END(c) default: cb_assert((c)->resume == 0); }
+
+/*
+ * Allocate the item for the value of a store (compressed if it should be,
+ * then value and vlen are the compressed one in compressed, to go once
+ * copied in).
+ */
+static ENGINE_ERROR_CODE store_allocate(conn *c,
+                                        protocol_binary_request_add *req,
+                                        const char *key, uint16_t nkey,
+                                        item **it, const char **value,
+                                        uint32_t *vlen, uint8_t *datatype,
+                                        struct net_buf *compressed)
+{
+    uint8_t extlen = req->message.header.request.extlen;
+    rel_time_t expiration = ntohl(req->message.body.expiration);
+    ENGINE_ERROR_CODE ret;
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *v1;
+
+    *value = key + nkey;
+    *vlen = ntohl(req->message.header.request.bodylen) - nkey - extlen;
+    *datatype = req->message.header.request.datatype;
+    if ((*datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) == 0 &&
+        compress_value(c, *value, *vlen, compressed)) {
+        /* The JSON check below can't look at the compressed value */
+        if (!c->supports_datatype && is_json(*value, *vlen)) {
+            *datatype = PROTOCOL_BINARY_DATATYPE_JSON;
+        }
+        *datatype |= PROTOCOL_BINARY_DATATYPE_COMPRESSED;
+        *value = compressed->buf;
+        *vlen = compressed->bytes;
+    }
+
+    v1 = conn_engine_enter(c, &h);
+    ret = v1->allocate(h, c, it, key, nkey, *vlen, req->message.body.flags,
+                       expiration, *datatype);
+    conn_engine_leave(c, v1);
+    if (ret != ENGINE_SUCCESS) {
+        thread_buffer_release(c->thread, compressed);
+    }
+    return ret;
+}
+
+static ENGINE_ERROR_CODE conn_engine_store(conn *c, item *it,
+                                           ENGINE_STORE_OPERATION store_op,
+                                           uint16_t vbucket)
+{
+    ENGINE_ERROR_CODE ret;
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *v1 = conn_engine_enter(c, &h);
+
+    ret = v1->store(h, c, it, &c->cas, store_op, vbucket);
+    conn_engine_leave(c, v1);
+    return ret;
+}
+
 static void add_set_replace_executor(conn *c, void *packet,
                                      ENGINE_STORE_OPERATION store_op)
 {
     protocol_binary_request_add *req = packet;
-    ENGINE_ERROR_CODE ret = c->aiostat;
-    c->aiostat = ENGINE_SUCCESS;
+    ENGINE_ERROR_CODE ret;
     c->ewouldblock = false;
 
-    uint8_t extlen = req->message.header.request.extlen;
     char *key = (char*)packet + sizeof(req->bytes);
     uint16_t nkey = ntohs(req->message.header.request.keylen);
-    uint32_t vlen = ntohl(req->message.header.request.bodylen) - nkey - extlen;
-    item_info_holder info;
-    memset(&info, 0, sizeof(info));
-    info.info.nvalue = 1;
+    uint16_t vbucket = ntohs(req->message.header.request.vbucket);
+    const char *value;
+    uint32_t vlen;
+    uint8_t datatype;
+    struct net_buf compressed = { NULL, NULL, 0, 0 };
+    item *it = NULL;
+    item_view info;
+    info.clsid = 0;
 
     if (req->message.header.request.cas != 0) {
         store_op = OPERATION_CAS;
     }
 
-    if (c->item == NULL) {
-        item *it;
-
-        if (ret == ENGINE_SUCCESS) {
-            rel_time_t expiration = ntohl(req->message.body.expiration);
-            ret = settings.engine.v1->allocate(settings.engine.v0, c,
-                                               &it, key, nkey,
-                                               vlen,
-                                               req->message.body.flags,
-                                               expiration,
-                                               req->message.header.request.datatype);
-        }
+    EXECUTOR_BEGIN(c);
+    EXECUTOR_AWAIT(c, ret, store_allocate(c, req, key, nkey, &it, &value,
+                                          &vlen, &datatype, &compressed));
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        break;
+    case ENGINE_DISCONNECT:
+        conn_set_state(c, conn_closing);
+        return ;
+    default:
+        write_bin_packet(c, engine_error_2_protocol_error(ret));
+        return;
+    }
 
-        switch (ret) {
-        case ENGINE_SUCCESS:
-            break;
-        case ENGINE_EWOULDBLOCK:
-            c->ewouldblock = true;
-            return ;
-        case ENGINE_DISCONNECT:
-            conn_set_state(c, conn_closing);
-            return ;
-        default:
-            write_bin_packet(c, engine_error_2_protocol_error(ret));
-            return;
-        }
+    item_set_cas(c, it, ntohll(req->message.header.request.cas));
+    if (!get_item_view(c, it, &info)) {
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        thread_buffer_release(c->thread, &compressed);
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
+        return;
+    }
 
-        item_set_cas(c, it, ntohll(req->message.header.request.cas));
-        if (!settings.engine.v1->get_item_info(settings.engine.v0,
-                                               c, it,
-                                               (void*)&info)) {
-            settings.engine.v1->release(settings.engine.v0, c, it);
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
-            return;
-        }
+    c->item = it;
+    copy_to_item_value(c, it, &info, value, vlen);
+    thread_buffer_release(c->thread, &compressed);
+    detect_item_json(c, it, &info, datatype);
 
-        c->item = it;
-        cb_assert(info.info.value[0].iov_len == vlen);
-        memcpy(info.info.value[0].iov_base, key + nkey, vlen);
-
-        if (!c->supports_datatype) {
-            if (checkUTF8JSON((void*)info.info.value[0].iov_base,
-                              (int)info.info.value[0].iov_len)) {
-                info.info.datatype = PROTOCOL_BINARY_DATATYPE_JSON;
-                if (!settings.engine.v1->set_item_info(settings.engine.v0, c,
-                                                       it, &info.info)) {
-                    settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                            "%d: Failed to set item info",
-                            c->sfd);
-                }
-            }
-        }
-    }
-
-    if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->store(settings.engine.v0, c,
-                                        c->item, &c->cas, store_op,
-                                        ntohs(req->message.header.request.vbucket));
-    }
+    EXECUTOR_AWAIT(c, ret, conn_engine_store(c, c->item, store_op, vbucket));
+    EXECUTOR_END(c);
 
     switch (ret) {
     case ENGINE_SUCCESS:
         /* Stored */
         if (c->supports_mutation_extras) {
-            memset(&info, 0, sizeof(info));
-            info.info.nvalue = 1;
-            if (!settings.engine.v1->get_item_info(settings.engine.v0, c,
-                                                   c->item,
-                                                   (void*)&info)) {
+            if (!get_item_view(c, c->item, &info)) {
                 settings.engine.v1->release(settings.engine.v0, c, c->item);
                 settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                                 "%d: Failed to get item info",
@@ -3760,16 +5267,13 @@ static void add_set_replace_executor(conn *c, void *packet,
             }
             mutation_descr_t* const extras = (mutation_descr_t*)
                     (c->write.buf + sizeof(protocol_binary_response_no_extras));
-            extras->vbucket_uuid = htonll(info.info.vbucket_uuid);
-            extras->seqno = htonll(info.info.seqno);
+            extras->vbucket_uuid = htonll(info.vbucket_uuid);
+            extras->seqno = htonll(info.seqno);
             write_bin_response(c, extras, sizeof(*extras), 0, sizeof(*extras));
         } else {
             write_bin_response(c, NULL, 0, 0 ,0);
         }
         break;
-    case ENGINE_EWOULDBLOCK:
-        c->ewouldblock = true;
-        break;
     case ENGINE_DISCONNECT:
         c->state = conn_closing;
         break;
@@ -3804,14 +5308,11 @@ static void add_set_replace_executor(conn *c, void *packet,
         SLAB_INCR(c, cmd_set, key, nkey);
     }
 
-    if (!c->ewouldblock) {
-        /* release the c->item reference */
-        settings.engine.v1->release(settings.engine.v0, c, c->item);
-        c->item = 0;
-    }
+    /* release the c->item reference */
+    settings.engine.v1->release(settings.engine.v0, c, c->item);
+    c->item = 0;
 }
 
-
 static void add_executor(conn *c, void *packet)
 {
     c->noreply = false;
@@ -3848,88 +5349,350 @@ static void replaceq_executor(conn *c, void *packet)
     add_set_replace_executor(c, packet, OPERATION_REPLACE);
 }
 
-static void append_prepend_executor(conn *c,
-                                    void *packet,
-                                    ENGINE_STORE_OPERATION store_op)
+/*
+ * SETM stores all the entries of the batch (see protocol_binary_setm_entry)
+ * with a single engine::store_multi call, which lets the engine take its
+ * locks once for the batch instead of once per item, and responds with a
+ * bit per entry telling if it was stored. The values are stored as they
+ * are sent: they aren't compressed, or checked for being JSON.
+ */
+static void setm_executor(conn *c, void *packet)
 {
-    protocol_binary_request_append *req = packet;
-    ENGINE_ERROR_CODE ret = c->aiostat;
-    c->aiostat = ENGINE_SUCCESS;
-    c->ewouldblock = false;
+    protocol_binary_request_setm *req = packet;
+    const char *ptr = (const char*)packet + sizeof(req->bytes);
+    const char *end = ptr + c->binary_header.request.bodylen;
+    uint8_t datatype = c->binary_header.request.datatype;
+    struct thread_stats *thread_stats;
+    item_store_request *requests;
+    uint8_t *stored;
+    size_t nrequests = 0;
+    size_t nstored;
+    size_t ii;
+    ENGINE_ERROR_CODE ret;
 
-    char *key = (char*)packet + sizeof(req->bytes);
-    uint16_t nkey = ntohs(req->message.header.request.keylen);
-    uint32_t vlen = ntohl(req->message.header.request.bodylen) - nkey;
-    item_info_holder info;
-    memset(&info, 0, sizeof(info));
-    info.info.nvalue = 1;
+    if (settings.engine.v1->store_multi == NULL) {
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
+        return;
+    }
+
+    /* The validator checked that the entries add up to the body */
+    while (ptr < end) {
+        protocol_binary_setm_entry entry;
+        memcpy(&entry, ptr, sizeof(entry));
+        ptr += sizeof(entry) + ntohs(entry.nkey) + ntohl(entry.nbytes);
+        ++nrequests;
+    }
+
+    nstored = (nrequests + 7) / 8;
+    requests = calloc(nrequests, sizeof(*requests));
+    stored = calloc(nstored, 1);
+    if (requests == NULL || stored == NULL) {
+        free(requests);
+        free(stored);
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM);
+        return;
+    }
+
+    ptr = (const char*)packet + sizeof(req->bytes);
+    for (ii = 0; ii < nrequests; ++ii) {
+        item_store_request *r = &requests[ii];
+        protocol_binary_setm_entry entry;
+
+        memcpy(&entry, ptr, sizeof(entry));
+        r->key = ptr + sizeof(entry);
+        r->nkey = ntohs(entry.nkey);
+        r->value = (const char*)r->key + r->nkey;
+        r->nbytes = ntohl(entry.nbytes);
+        r->flags = entry.flags;
+        r->exptime = ntohl(entry.expiration);
+        r->vbucket = ntohs(entry.vbucket);
+        r->datatype = datatype;
+        r->operation = OPERATION_SET;
+        ptr = (const char*)r->value + r->nbytes;
+    }
+
+    ret = settings.engine.v1->store_multi(settings.engine.v0, c,
+                                          requests, nrequests);
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        for (ii = 0; ii < nrequests; ++ii) {
+            if (requests[ii].status == ENGINE_SUCCESS) {
+                stored[ii / 8] |= (uint8_t)(1 << (ii % 8));
+            }
+        }
+        /* The slab classes of the items aren't known here */
+        thread_stats = get_thread_stats(c);
+        STATS_BUMP(thread_stats->slab_stats[0].cmd_set, nrequests);
+        if (binary_response_handler(NULL, 0, NULL, 0, stored,
+                                    (uint32_t)nstored,
+                                    PROTOCOL_BINARY_RAW_BYTES,
+                                    PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                                    0, c)) {
+            write_and_free(c, &c->dynamic_buffer);
+        } else {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM);
+        }
+        break;
+    case ENGINE_DISCONNECT:
+        conn_set_state(c, conn_closing);
+        break;
+    default:
+        write_bin_packet(c, engine_error_2_protocol_error(ret));
+    }
 
-    if (c->item == NULL) {
+    free(requests);
+    free(stored);
+}
+
+/*
+ * The engines concatenate the values of an append or prepend as they are,
+ * which doesn't work for a compressed value. Replace it with the inflated
+ * value first (under its cas, so a concurrent change just makes us look
+ * again), and set cas to the cas the append must match so the value can't
+ * be compressed again in between. cas is left alone if the value isn't
+ * compressed.
+ */
+static ENGINE_ERROR_CODE inflate_stored_value(conn *c, const void *key,
+                                              uint16_t nkey, uint16_t vbucket,
+                                              uint64_t *cas)
+{
+    int tries;
+
+    for (tries = 0; tries < 10; ++tries) {
+        item *old;
         item *it;
+        item_info_holder info;
+        item_info_holder new_info;
+        size_t len;
+        rel_time_t exptime = 0;
+        uint64_t new_cas;
+        ENGINE_ERROR_CODE ret;
 
-        if (ret == ENGINE_SUCCESS) {
-            ret = settings.engine.v1->allocate(settings.engine.v0, c,
-                                               &it, key, nkey,
-                                               vlen, 0, 0,
-                                               req->message.header.request.datatype);
+        ret = settings.engine.v1->get(settings.engine.v0, c, &old, key, nkey,
+                                      vbucket);
+        if (ret == ENGINE_KEY_ENOENT) {
+            /* Let the engine fail the append */
+            return ENGINE_SUCCESS;
+        } else if (ret != ENGINE_SUCCESS) {
+            return ret;
+        }
+
+        memset(&info, 0, sizeof(info));
+        info.info.nvalue = 1;
+        if (!settings.engine.v1->get_item_info(settings.engine.v0, c, old,
+                                               (void*)&info)) {
+            settings.engine.v1->release(settings.engine.v0, c, old);
+            return ENGINE_FAILED;
+        }
+
+        if ((info.info.datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) == 0) {
+            settings.engine.v1->release(settings.engine.v0, c, old);
+            return ENGINE_SUCCESS;
+        }
+
+        if (*cas != 0 && *cas != info.info.cas) {
+            settings.engine.v1->release(settings.engine.v0, c, old);
+            return ENGINE_KEY_EEXISTS;
+        }
+
+        if (info.info.nvalue != 1 ||
+            !get_inflated_length(c, info.info.cas,
+                                 info.info.value[0].iov_base,
+                                 info.info.value[0].iov_len, &len)) {
+            settings.engine.v1->release(settings.engine.v0, c, old);
+            return ENGINE_FAILED;
+        }
+
+        if (info.info.exptime != 0) {
+            exptime = (rel_time_t)mc_time_convert_to_abs_time(info.info.exptime);
+        }
+        ret = settings.engine.v1->allocate(settings.engine.v0, c, &it,
+                                           key, nkey, len, info.info.flags,
+                                           exptime,
+                                           info.info.datatype &
+                                           ~PROTOCOL_BINARY_DATATYPE_COMPRESSED);
+        if (ret != ENGINE_SUCCESS) {
+            settings.engine.v1->release(settings.engine.v0, c, old);
+            return ret;
         }
 
+        memset(&new_info, 0, sizeof(new_info));
+        new_info.info.nvalue = 1;
+        if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
+                                               (void*)&new_info) ||
+            !inflate_value(c, info.info.cas, info.info.value[0].iov_base,
+                           info.info.value[0].iov_len,
+                           new_info.info.value[0].iov_base, len)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            settings.engine.v1->release(settings.engine.v0, c, old);
+            return ENGINE_FAILED;
+        }
+
+        item_set_cas(c, it, info.info.cas);
+        settings.engine.v1->release(settings.engine.v0, c, old);
+        ret = settings.engine.v1->store(settings.engine.v0, c, it, &new_cas,
+                                        OPERATION_CAS, vbucket);
+        settings.engine.v1->release(settings.engine.v0, c, it);
+
         switch (ret) {
         case ENGINE_SUCCESS:
+            *cas = new_cas;
+            return ENGINE_SUCCESS;
+        case ENGINE_KEY_EEXISTS:
+            /* Changed since we looked at it, so look again */
             break;
-        case ENGINE_EWOULDBLOCK:
-            c->ewouldblock = true;
-            return ;
-        case ENGINE_DISCONNECT:
-            conn_set_state(c, conn_closing);
-            return ;
+        case ENGINE_KEY_ENOENT:
+            return ENGINE_SUCCESS;
         default:
-            write_bin_packet(c, engine_error_2_protocol_error(ret));
-            return;
+            return ret;
         }
+    }
 
-        item_set_cas(c, it, ntohll(req->message.header.request.cas));
-        if (!settings.engine.v1->get_item_info(settings.engine.v0,
-                                               c, it,
-                                               (void*)&info)) {
-            settings.engine.v1->release(settings.engine.v0, c, it);
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
-            return;
-        }
+    return ENGINE_TMPFAIL;
+}
 
-        c->item = it;
-        cb_assert(info.info.value[0].iov_len == vlen);
-        memcpy(info.info.value[0].iov_base, key + nkey, vlen);
+/*
+ * Try to append (or prepend) the data to the stored value in place (see
+ * engine::splice), which saves allocating an item for the data and the
+ * engine copying the whole value into yet another one. On success c->item
+ * is the changed item and c->cas its new cas. ENGINE_NOT_STORED means it
+ * couldn't be done in place (the cas doesn't match, the value is in use or
+ * doesn't have the room for the data, ...), and it should go through the
+ * engine's store, which gives the same result as if it had.
+ */
+static ENGINE_ERROR_CODE append_in_place(conn *c, const void *key,
+                                         uint16_t nkey, const void *data,
+                                         uint32_t ndata, uint64_t cas,
+                                         uint8_t datatype, uint16_t vbucket,
+                                         ENGINE_STORE_OPERATION store_op)
+{
+    item *it;
+    item_info_holder info;
+    uint64_t new_cas;
+    ENGINE_ERROR_CODE ret;
 
-        if (!c->supports_datatype) {
-            if (checkUTF8JSON((void*)info.info.value[0].iov_base,
-                              (int)info.info.value[0].iov_len)) {
-                info.info.datatype = PROTOCOL_BINARY_DATATYPE_JSON;
-                if (!settings.engine.v1->set_item_info(settings.engine.v0, c,
-                                                       it, &info.info)) {
-                    settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                            "%d: Failed to set item info",
-                            c->sfd);
-                }
-            }
-        }
+    if (settings.engine.v1->splice == NULL ||
+        (datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) != 0) {
+        return ENGINE_NOT_STORED;
+    }
+
+    /* The stored item gets the datatype of the item stored */
+    if (!c->supports_datatype && is_json(data, ndata)) {
+        datatype = PROTOCOL_BINARY_DATATYPE_JSON;
+    }
+
+    ret = settings.engine.v1->get(settings.engine.v0, c, &it, key, nkey,
+                                  vbucket);
+    if (ret == ENGINE_KEY_ENOENT) {
+        return ENGINE_NOT_STORED;
+    } else if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.info.nvalue = 1;
+    if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
+                                           (void*)&info) ||
+        info.info.nvalue != 1 || info.info.datatype != datatype ||
+        (cas != 0 && cas != info.info.cas) ||
+        settings.engine.v1->splice(settings.engine.v0, c, it, &new_cas,
+                                   store_op == OPERATION_APPEND ?
+                                       info.info.value[0].iov_len : 0,
+                                   0, data, ndata,
+                                   vbucket) != ENGINE_SUCCESS) {
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        return ENGINE_NOT_STORED;
+    }
+
+    c->item = it;
+    c->cas = new_cas;
+    return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE append_allocate(conn *c, item **it, const void *key,
+                                        uint16_t nkey, uint32_t vlen,
+                                        uint8_t datatype)
+{
+    return settings.engine.v1->allocate(settings.engine.v0, c, it, key, nkey,
+                                        vlen, 0, 0, datatype);
+}
+
+static void append_prepend_executor(conn *c,
+                                    void *packet,
+                                    ENGINE_STORE_OPERATION store_op)
+{
+    protocol_binary_request_append *req = packet;
+    ENGINE_ERROR_CODE ret;
+    c->ewouldblock = false;
+
+    char *key = (char*)packet + sizeof(req->bytes);
+    uint16_t nkey = ntohs(req->message.header.request.keylen);
+    uint32_t vlen = ntohl(req->message.header.request.bodylen) - nkey;
+    uint16_t vbucket = ntohs(req->message.header.request.vbucket);
+    uint8_t datatype = req->message.header.request.datatype;
+    item *it = NULL;
+    item_view info;
+    info.clsid = 0;
+
+    EXECUTOR_BEGIN(c);
+    /* The cas to check, until it's the one stored */
+    c->cas = ntohll(req->message.header.request.cas);
+    EXECUTOR_AWAIT(c, ret, append_in_place(c, key, nkey, key + nkey, vlen,
+                                           c->cas, datatype, vbucket,
+                                           store_op));
+    if (ret == ENGINE_SUCCESS) {
+        /* Spliced */
+        goto done;
+    } else if (ret == ENGINE_NOT_STORED) {
+        ret = ENGINE_SUCCESS;
+    }
+
+    if (ret == ENGINE_SUCCESS && settings.datatype) {
+        /* Compressed values only exist with datatype support */
+        EXECUTOR_AWAIT(c, ret, inflate_stored_value(c, key, nkey, vbucket,
+                                                    &c->cas));
     }
 
     if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->store(settings.engine.v0, c,
-                                        c->item, &c->cas, store_op,
-                                        ntohs(req->message.header.request.vbucket));
+        EXECUTOR_AWAIT(c, ret, append_allocate(c, &it, key, nkey, vlen,
+                                               datatype));
+    }
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        break;
+    case ENGINE_DISCONNECT:
+        conn_set_state(c, conn_closing);
+        return ;
+    default:
+        /* c->cas still holds the cas of the request */
+        c->cas = 0;
+        write_bin_packet(c, engine_error_2_protocol_error(ret));
+        return;
+    }
+
+    item_set_cas(c, it, c->cas);
+    if (!get_item_view(c, it, &info)) {
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
+        return;
     }
 
+    c->item = it;
+    copy_to_item_value(c, it, &info, key + nkey, vlen);
+    detect_item_json(c, it, &info, PROTOCOL_BINARY_RAW_BYTES);
+
+    EXECUTOR_AWAIT(c, ret, settings.engine.v1->store(settings.engine.v0, c,
+                                                     c->item, &c->cas,
+                                                     store_op, vbucket));
+    EXECUTOR_END(c);
+
+done:
     switch (ret) {
     case ENGINE_SUCCESS:
         /* Stored */
         if (c->supports_mutation_extras) {
-            memset(&info, 0, sizeof(info));
-            info.info.nvalue = 1;
-            if (!settings.engine.v1->get_item_info(settings.engine.v0, c,
-                                                   c->item,
-                                                   (void*)&info)) {
+            if (!get_item_view(c, c->item, &info)) {
                 settings.engine.v1->release(settings.engine.v0, c, c->item);
                 settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                                 "%d: Failed to get item info",
@@ -3939,30 +5702,26 @@ static void append_prepend_executor(conn *c,
             }
             mutation_descr_t* const extras = (mutation_descr_t*)
                     (c->write.buf + sizeof(protocol_binary_response_no_extras));
-            extras->vbucket_uuid = htonll(info.info.vbucket_uuid);
-            extras->seqno = htonll(info.info.seqno);
+            extras->vbucket_uuid = htonll(info.vbucket_uuid);
+            extras->seqno = htonll(info.seqno);
             write_bin_response(c, extras, sizeof(*extras), 0, sizeof(*extras));
         } else {
             write_bin_response(c, NULL, 0, 0 ,0);
         }
         break;
-    case ENGINE_EWOULDBLOCK:
-        c->ewouldblock = true;
-        break;
     case ENGINE_DISCONNECT:
         c->state = conn_closing;
         break;
     default:
+        c->cas = 0;
         write_bin_packet(c, engine_error_2_protocol_error(ret));
     }
 
     SLAB_INCR(c, cmd_set, key, nkey);
 
-    if (!c->ewouldblock) {
-        /* release the c->item reference */
-        settings.engine.v1->release(settings.engine.v0, c, c->item);
-        c->item = 0;
-    }
+    /* release the c->item reference */
+    settings.engine.v1->release(settings.engine.v0, c, c->item);
+    c->item = 0;
 }
 
 static void append_executor(conn *c, void *packet)
@@ -4014,6 +5773,13 @@ static void get_executor(conn *c, void *packet)
     process_bin_get(c);
 }
 
+static void get_range_executor(conn *c, void *packet)
+{
+    (void)packet;
+    c->noreply = false;
+    process_bin_get(c);
+}
+
 static void process_bin_delete(conn *c);
 static void delete_executor(conn *c, void *packet)
 {
@@ -4026,6 +5792,49 @@ static void delete_executor(conn *c, void *packet)
     process_bin_delete(c);
 }
 
+/* ADD_STAT for the stats making up "stats openmetrics" (in cmd_context) */
+static void openmetrics_stat(const char *key, const uint16_t klen,
+                             const char *val, const uint32_t vlen,
+                             const void *cookie)
+{
+    conn *c = (conn *)cookie;
+    openmetrics_add_stat(c->cmd_context, key, klen, val, vlen);
+}
+
+/*
+ * Build the server stats (of all of the buckets), the thread stats, the
+ * command timings and the stats of the engine in one OpenMetrics
+ * exposition, and add it as a single stat.
+ */
+static ENGINE_ERROR_CODE process_stat_openmetrics(conn *c)
+{
+    struct openmetrics om;
+    ENGINE_ERROR_CODE ret;
+
+    memset(&om, 0, sizeof(om));
+    c->cmd_context = &om;
+
+    om.prefix = "memcached_";
+    server_stats(&openmetrics_stat, c, true);
+    thread_loop_stats(&openmetrics_stat, c);
+    openmetrics_add_timings(&om);
+    om.prefix = "memcached_engine_";
+    ret = settings.engine.v1->get_stats(settings.engine.v0, c, NULL, 0,
+                                        openmetrics_stat);
+    openmetrics_finish(&om);
+
+    c->cmd_context = NULL;
+    if (ret == ENGINE_SUCCESS || ret == ENGINE_EWOULDBLOCK) {
+        /* Rather not block the scrape on the engine, leave its stats out */
+        ret = om.failed ? ENGINE_ENOMEM : ENGINE_SUCCESS;
+    }
+    if (ret == ENGINE_SUCCESS) {
+        append_stats("openmetrics", 11, om.buf, (uint32_t)om.offset, c);
+    }
+    free(om.buf);
+    return ret;
+}
+
 static void stat_executor(conn *c, void *packet)
 {
     char *subcommand = binary_get_key(c);
@@ -4034,7 +5843,7 @@ static void stat_executor(conn *c, void *packet)
 
     (void)packet;
 
-    if (settings.verbose > 1) {
+    if (c->trace_request) {
         char buffer[1024];
         if (key_to_printable_buffer(buffer, sizeof(buffer), c->sfd, true,
                                     "STATS", subcommand, nkey) != -1) {
@@ -4069,8 +5878,36 @@ static void stat_executor(conn *c, void *packet)
         } else if (strncmp(subcommand, "cachedump", 9) == 0) {
             write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
             return;
+        } else if (nkey == 11 && strncmp(subcommand, "openmetrics", 11) == 0) {
+            ret = process_stat_openmetrics(c);
         } else if (strncmp(subcommand, "aggregate", 9) == 0) {
             server_stats(&append_stats, c, true);
+        } else if (nkey == 7 && strncmp(subcommand, "slowops", 7) == 0) {
+            slow_ops_stats(&append_stats, c);
+        } else if (nkey == 7 && strncmp(subcommand, "startup", 7) == 0) {
+            process_stat_startup(&append_stats, c);
+        } else if (nkey == 9 && strncmp(subcommand, "allocator", 9) == 0) {
+            mc_get_arena_stats(append_stats, c);
+        } else if (nkey == 12 && strncmp(subcommand, "heap_profile", 12) == 0) {
+            heap_profile_stats(&append_stats, c);
+        } else if (nkey == 7 && strncmp(subcommand, "threads", 7) == 0) {
+            thread_loop_stats(&append_stats, c);
+        } else if (nkey == 15 &&
+                   strncmp(subcommand, "vbucket_traffic", 15) == 0) {
+            vbucket_traffic_stats(&append_stats, c);
+        } else if (nkey >= 12 && strncmp(subcommand, "hot_vbuckets", 12) == 0) {
+            int count = HOT_VBUCKETS_DEFAULT;
+            /* Optionally followed by the number of vbuckets to return */
+            if (nkey > 13 && nkey < 12 + 8 && subcommand[12] == ' ') {
+                int32_t value;
+                char buffer[8];
+                memcpy(buffer, subcommand + 13, nkey - 13);
+                buffer[nkey - 13] = '\0';
+                if (safe_strtol(buffer, &value) && value > 0) {
+                    count = value;
+                }
+            }
+            hot_vbucket_stats(&append_stats, c, count);
         } else if (strncmp(subcommand, "connections", 11) == 0) {
             int64_t fd = -1; /* default to all connections */
             /* Check for specific connection number - allow up to 32 chars for FD */
@@ -4084,7 +5921,14 @@ static void stat_executor(conn *c, void *packet)
                     fd = key;
                 }
             }
-            connection_stats(&append_stats, c, fd);
+            c->cmd_context = connection_stats_cursor_create(fd);
+            if (c->cmd_context == NULL) {
+                ret = ENGINE_ENOMEM;
+            } else {
+                c->cmd_context_dtor = connection_stats_cursor_destroy;
+                conn_set_state(c, conn_stats_stream);
+                return;
+            }
         } else {
             ret = settings.engine.v1->get_stats(settings.engine.v0, c,
                                                 subcommand, (int)nkey,
@@ -4172,7 +6016,7 @@ static void arithmetic_executor(conn *c, void *packet)
     incr = (c->cmd == PROTOCOL_BINARY_CMD_INCREMENT ||
             c->cmd == PROTOCOL_BINARY_CMD_INCREMENTQ);
 
-    if (settings.verbose > 1) {
+    if (c->trace_request) {
         char buffer[1024];
         ssize_t nw;
         nw = key_to_printable_buffer(buffer, sizeof(buffer), c->sfd, true,
@@ -4290,44 +6134,581 @@ static void arithmetic_executor(conn *c, void *packet)
     }
 }
 
-static void get_cmd_timer_executor(conn *c, void *packet)
-{
-    protocol_binary_request_get_cmd_timer *req = packet;
+/*
+ * The state of a SCRIPT_EXEC across its steps (in c->cmd_context). A step
+ * the engine blocked on is run again once the connection is notified: a
+ * store keeps the item it allocated in pending until it's stored (and
+ * doesn't inflate the value to append to twice), the other steps just
+ * call the engine again. The arguments aren't kept, they are taken from
+ * the packet every time.
+ */
+struct script_run {
+    conn *c;
+    const script_t *script;
+    uint16_t vbucket;
+    uint32_t pc;            /* the step to run */
+    bool started;           /* the budgets were charged for it */
+    uint32_t executed;      /* steps started, restarts included */
+    hrtime_t deadline;
+    item *item;             /* of the last get, incr or decr (NULL if none) */
+    item *pending;          /* allocated by the store of the step */
+    bool inflated;          /* the store of the step inflated the value */
+    uint64_t inflated_cas;  /* and must match this cas */
+    uint64_t cas;           /* of the last change */
+    uint16_t status;        /* what a step failed with (ENGINE_FAILED) */
+    uint16_t touch_status;
+};
 
-    generate_timings(req->message.body.opcode, c);
-    write_and_free(c, &c->dynamic_buffer);
+typedef struct {
+    const char *data[PROTOCOL_BINARY_SCRIPT_MAX_ARGS];
+    uint16_t length[PROTOCOL_BINARY_SCRIPT_MAX_ARGS];
+    int count;
+} script_args_t;
+
+static void script_run_destroy(void *ctx) {
+    struct script_run *run = ctx;
+
+    if (run->item != NULL) {
+        settings.engine.v1->release(settings.engine.v0, run->c, run->item);
+    }
+    if (run->pending != NULL) {
+        settings.engine.v1->release(settings.engine.v0, run->c, run->pending);
+    }
+    free(run);
 }
 
-static void set_ctrl_token_executor(conn *c, void *packet)
-{
-    protocol_binary_request_set_ctrl_token *req = packet;
-    uint64_t old_cas = ntohll(req->message.header.request.cas);
-    uint16_t ret = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+/* The validator checked the layout of the arguments */
+static void script_parse_args(const char *ptr, uint32_t len,
+                              script_args_t *args) {
+    args->count = 0;
+    while (len > 0) {
+        protocol_binary_script_arg arg;
 
-    cb_mutex_enter(&(session_cas.mutex));
-    if (session_cas.ctr > 0) {
-        ret = PROTOCOL_BINARY_RESPONSE_EBUSY;
-    } else {
-        if (old_cas == session_cas.value || old_cas == 0) {
-            session_cas.value = ntohll(req->message.body.new_cas);
-        } else {
-            ret = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
-        }
+        memcpy(&arg, ptr, sizeof(arg));
+        args->length[args->count] = ntohs(arg.length);
+        args->data[args->count] = ptr + sizeof(arg);
+        ptr += sizeof(arg) + args->length[args->count];
+        len -= sizeof(arg) + args->length[args->count];
+        ++args->count;
     }
+}
 
-    binary_response_handler(NULL, 0, NULL, 0, NULL, 0,
-                            PROTOCOL_BINARY_RAW_BYTES,
-                            ret, session_cas.value, c);
-    cb_mutex_exit(&(session_cas.mutex));
+static bool script_operand(const script_operand_t *operand,
+                           const script_args_t *args, const char **data,
+                           uint16_t *length) {
+    if (operand->arg == -1) {
+        *data = operand->data;
+        *length = operand->length;
+        return true;
+    }
+    if (operand->arg >= args->count) {
+        return false;
+    }
+    *data = args->data[operand->arg];
+    *length = args->length[operand->arg];
+    return true;
+}
 
-    write_and_free(c, &c->dynamic_buffer);
+static ENGINE_ERROR_CODE script_fail(struct script_run *run,
+                                     uint16_t status) {
+    run->status = status;
+    return ENGINE_FAILED;
 }
 
-static void get_ctrl_token_executor(conn *c, void *packet)
-{
-    (void)packet;
-    cb_mutex_enter(&(session_cas.mutex));
-    binary_response_handler(NULL, 0, NULL, 0, NULL, 0,
+static void script_set_item(struct script_run *run, item *it) {
+    if (run->item != NULL) {
+        settings.engine.v1->release(settings.engine.v0, run->c, run->item);
+    }
+    run->item = it;
+}
+
+/* The cas of the item of the last get, 0 if there isn't one */
+static uint64_t script_item_cas(conn *c, const struct script_run *run) {
+    item_view view;
+
+    if (run->item == NULL || !get_item_view(c, run->item, &view)) {
+        return 0;
+    }
+    return view.cas;
+}
+
+static bool script_check(conn *c, const struct script_run *run,
+                         const script_step_t *step, const char *value,
+                         uint16_t nvalue) {
+    item_view view;
+    struct iovec segment;
+    uint16_t ii;
+
+    if (step->exists != -1 && (run->item != NULL) != (step->exists == 1)) {
+        return false;
+    }
+    if (!step->check_flags && !step->check_value) {
+        return true;
+    }
+    if (run->item == NULL || !get_item_view(c, run->item, &view)) {
+        return false;
+    }
+    if (step->check_flags && view.flags != htonl(step->flags)) {
+        return false;
+    }
+    if (!step->check_value) {
+        return true;
+    }
+
+    /* Compared as stored, a compressed value never matches */
+    if ((view.datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) != 0 ||
+        view.nbytes != nvalue) {
+        return false;
+    }
+    for (ii = 0; ii < view.nsegments; ++ii) {
+        if (!get_item_segment(c, run->item, &view, ii, &segment) ||
+            memcmp(segment.iov_base, value, segment.iov_len) != 0) {
+            return false;
+        }
+        value += segment.iov_len;
+    }
+    return true;
+}
+
+static ENGINE_ERROR_CODE script_store(conn *c, struct script_run *run,
+                                      const script_step_t *step,
+                                      const char *key, uint16_t nkey,
+                                      const char *value, uint16_t nvalue) {
+    ENGINE_STORE_OPERATION store_op;
+    ENGINE_ERROR_CODE ret;
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *v1;
+    uint64_t cas = 0;
+
+    switch (step->op) {
+    case SCRIPT_OP_ADD:
+        store_op = OPERATION_ADD;
+        break;
+    case SCRIPT_OP_REPLACE:
+        store_op = step->cas ? OPERATION_CAS : OPERATION_REPLACE;
+        break;
+    case SCRIPT_OP_APPEND:
+        store_op = OPERATION_APPEND;
+        break;
+    case SCRIPT_OP_PREPEND:
+        store_op = OPERATION_PREPEND;
+        break;
+    default:
+        store_op = step->cas ? OPERATION_CAS : OPERATION_SET;
+    }
+
+    if (run->pending == NULL) {
+        bool append = store_op == OPERATION_APPEND ||
+            store_op == OPERATION_PREPEND;
+        item *it;
+        item_view view;
+
+        if (step->cas && (cas = script_item_cas(c, run)) == 0) {
+            return script_fail(run, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+        }
+        if (append && settings.datatype && !run->inflated) {
+            ret = inflate_stored_value(c, key, nkey, run->vbucket, &cas);
+            if (ret != ENGINE_SUCCESS) {
+                return ret;
+            }
+            /* Not again if the allocate blocks, or it never gets there */
+            run->inflated = true;
+            run->inflated_cas = cas;
+        } else if (run->inflated) {
+            cas = run->inflated_cas;
+        }
+
+        v1 = conn_engine_enter(c, &h);
+        ret = v1->allocate(h, c, &it, key, nkey, nvalue,
+                           append ? 0 : htonl(step->flags),
+                           append ? 0 : step->exptime,
+                           PROTOCOL_BINARY_RAW_BYTES);
+        conn_engine_leave(c, v1);
+        if (ret != ENGINE_SUCCESS) {
+            return ret;
+        }
+
+        item_set_cas(c, it, cas);
+        if (!get_item_view(c, it, &view)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            return script_fail(run, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
+        }
+        copy_to_item_value(c, it, &view, value, nvalue);
+        detect_item_json(c, it, &view, PROTOCOL_BINARY_RAW_BYTES);
+        run->pending = it;
+    }
+
+    v1 = conn_engine_enter(c, &h);
+    ret = v1->store(h, c, run->pending, &cas, store_op, run->vbucket);
+    conn_engine_leave(c, v1);
+    if (ret == ENGINE_EWOULDBLOCK) {
+        return ret;
+    }
+    settings.engine.v1->release(settings.engine.v0, c, run->pending);
+    run->pending = NULL;
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        run->cas = cas;
+        break;
+    case ENGINE_NOT_STORED:
+        if (store_op == OPERATION_ADD) {
+            return script_fail(run, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
+        } else if (store_op == OPERATION_REPLACE) {
+            return script_fail(run, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+        }
+        break;
+    default:
+        ;
+    }
+    return ret;
+}
+
+/* The response of the TOUCH the touch steps send the engine */
+static bool script_touch_response(const void *key, uint16_t keylen,
+                                  const void *ext, uint8_t extlen,
+                                  const void *body, uint32_t bodylen,
+                                  uint8_t datatype, uint16_t status,
+                                  uint64_t cas, const void *cookie) {
+    conn *c = (conn*)cookie;
+    struct script_run *run = c->cmd_context;
+
+    run->touch_status = status;
+    return true;
+}
+
+static ENGINE_ERROR_CODE script_touch(conn *c, struct script_run *run,
+                                      const script_step_t *step,
+                                      const char *key, uint16_t nkey) {
+    union {
+        protocol_binary_request_touch request;
+        char bytes[sizeof(protocol_binary_request_touch) + KEY_MAX_LENGTH];
+    } touch;
+    ENGINE_ERROR_CODE ret;
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *v1;
+
+    memset(&touch, 0, sizeof(touch.request));
+    touch.request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    touch.request.message.header.request.opcode = PROTOCOL_BINARY_CMD_TOUCH;
+    touch.request.message.header.request.extlen = 4;
+    touch.request.message.header.request.keylen = htons(nkey);
+    touch.request.message.header.request.bodylen = htonl(4 + nkey);
+    touch.request.message.header.request.vbucket = htons(run->vbucket);
+    touch.request.message.body.expiration = htonl(step->exptime);
+    memcpy(touch.bytes + sizeof(touch.request.bytes), key, nkey);
+
+    run->touch_status = PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+    v1 = conn_engine_enter(c, &h);
+    ret = v1->unknown_command(h, c, &touch.request.message.header,
+                              script_touch_response);
+    conn_engine_leave(c, v1);
+    if (ret == ENGINE_SUCCESS &&
+        run->touch_status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        return script_fail(run, run->touch_status);
+    }
+    return ret;
+}
+
+/*
+ * Run the step: ENGINE_SUCCESS if it's done, ENGINE_FAILED (with the
+ * status in run->status) or an engine error if it failed, or
+ * ENGINE_EWOULDBLOCK to run it again once notified.
+ */
+static ENGINE_ERROR_CODE script_step(conn *c, struct script_run *run,
+                                     const script_step_t *step,
+                                     const script_args_t *args) {
+    const char *key = NULL;
+    const char *value = NULL;
+    uint16_t nkey = 0;
+    uint16_t nvalue = 0;
+    ENGINE_ERROR_CODE ret;
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *v1;
+    item *it = NULL;
+
+    if ((step->op != SCRIPT_OP_CHECK &&
+         (!script_operand(&step->key, args, &key, &nkey) || nkey == 0 ||
+          nkey > KEY_MAX_LENGTH)) ||
+        ((step->value.arg != -1 || step->value.data != NULL) &&
+         !script_operand(&step->value, args, &value, &nvalue))) {
+        return script_fail(run, PROTOCOL_BINARY_RESPONSE_EINVAL);
+    }
+
+    switch (step->op) {
+    case SCRIPT_OP_GET:
+        v1 = conn_engine_enter(c, &h);
+        ret = v1->get(h, c, &it, key, nkey, run->vbucket);
+        conn_engine_leave(c, v1);
+        if (ret == ENGINE_SUCCESS) {
+            script_set_item(run, it);
+        } else if (ret == ENGINE_KEY_ENOENT && step->optional) {
+            script_set_item(run, NULL);
+            ret = ENGINE_SUCCESS;
+        }
+        return ret;
+
+    case SCRIPT_OP_CHECK:
+        if (!script_check(c, run, step, value, nvalue)) {
+            return script_fail(run, step->status);
+        }
+        return ENGINE_SUCCESS;
+
+    case SCRIPT_OP_SET:
+    case SCRIPT_OP_ADD:
+    case SCRIPT_OP_REPLACE:
+    case SCRIPT_OP_APPEND:
+    case SCRIPT_OP_PREPEND:
+        ret = script_store(c, run, step, key, nkey, value, nvalue);
+        break;
+
+    case SCRIPT_OP_INCR:
+    case SCRIPT_OP_DECR:
+    {
+        uint64_t result;
+        item_view view;
+
+        v1 = conn_engine_enter(c, &h);
+        ret = v1->arithmetic(h, c, key, nkey, step->op == SCRIPT_OP_INCR,
+                             step->create, step->delta, step->initial,
+                             step->exptime, &it, PROTOCOL_BINARY_RAW_BYTES,
+                             &result, run->vbucket);
+        conn_engine_leave(c, v1);
+        if (ret == ENGINE_SUCCESS) {
+            script_set_item(run, it);
+            if (get_item_view(c, it, &view)) {
+                run->cas = view.cas;
+            }
+        } else if (ret == ENGINE_EINVAL) {
+            return script_fail(run, PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL);
+        }
+        break;
+    }
+
+    case SCRIPT_OP_TOUCH:
+        ret = script_touch(c, run, step, key, nkey);
+        break;
+
+    case SCRIPT_OP_DELETE:
+    {
+        uint64_t cas = 0;
+        mutation_descr_t info;
+
+        if (step->cas && (cas = script_item_cas(c, run)) == 0) {
+            return script_fail(run, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+        }
+        v1 = conn_engine_enter(c, &h);
+        ret = v1->remove(h, c, key, nkey, &cas, run->vbucket, &info);
+        conn_engine_leave(c, v1);
+        if (ret == ENGINE_SUCCESS) {
+            run->cas = cas;
+        }
+        break;
+    }
+
+    default:
+        abort();
+    }
+
+    if (ret == ENGINE_SUCCESS && c->thread->near_cache != NULL) {
+        near_cache_invalidate(near_cache_invalidation(step->opcode, key,
+                                                      nkey));
+    }
+    return ret;
+}
+
+/* Send the item the script ended up with (or nothing) */
+static void script_response(conn *c, struct script_run *run) {
+    item_view view;
+    char *flat = NULL;
+    const char *value;
+
+    c->cas = run->cas;
+    if (run->item == NULL) {
+        write_bin_response(c, NULL, 0, 0, 0);
+        return;
+    }
+
+    if (!get_item_view(c, run->item, &view)) {
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
+        return;
+    }
+    value = view.value.iov_base;
+    if (view.nsegments > 1) {
+        struct iovec segment;
+        size_t offset = 0;
+        uint16_t ii;
+
+        if ((flat = malloc(view.nbytes)) == NULL) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM);
+            return;
+        }
+        for (ii = 0; ii < view.nsegments; ++ii) {
+            if (!get_item_segment(c, run->item, &view, ii, &segment)) {
+                free(flat);
+                write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
+                return;
+            }
+            memcpy(flat + offset, segment.iov_base, segment.iov_len);
+            offset += segment.iov_len;
+        }
+        value = flat;
+    }
+
+    if (binary_response_handler(NULL, 0, &view.flags, sizeof(view.flags),
+                                value, view.nbytes, view.datatype,
+                                PROTOCOL_BINARY_RESPONSE_SUCCESS, view.cas,
+                                c)) {
+        write_and_free(c, &c->dynamic_buffer);
+    } else {
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM);
+    }
+    free(flat);
+}
+
+static void script_exec_executor(conn *c, void *packet)
+{
+    protocol_binary_request_script_exec *req = packet;
+    uint16_t nkey = ntohs(req->message.header.request.keylen);
+    uint32_t bodylen = ntohl(req->message.header.request.bodylen);
+    const char *name = (const char*)packet + sizeof(req->bytes);
+    struct script_run *run = c->cmd_context;
+    script_args_t args;
+    ENGINE_ERROR_CODE ret = c->aiostat;
+
+    c->aiostat = ENGINE_SUCCESS;
+    c->ewouldblock = false;
+
+    if (run == NULL) {
+        const script_t *script = script_find(name, nkey);
+
+        if (script == NULL) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+            return;
+        }
+        if ((run = calloc(1, sizeof(*run))) == NULL) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM);
+            return;
+        }
+        run->c = c;
+        run->script = script;
+        run->vbucket = ntohs(req->message.header.request.vbucket);
+        run->deadline = gethrtime() + (hrtime_t)script->max_usec * 1000;
+        c->cmd_context = run;
+        c->cmd_context_dtor = script_run_destroy;
+        ret = ENGINE_SUCCESS;
+    }
+    script_parse_args(name + nkey, bodylen - nkey, &args);
+
+    while (ret == ENGINE_SUCCESS && run->pc < run->script->nsteps) {
+        const script_step_t *step = &run->script->steps[run->pc];
+
+        if (!run->started) {
+            if (++run->executed > run->script->max_steps) {
+                STATS_NOKEY(c, script_budget_exceeded);
+                ret = script_fail(run, PROTOCOL_BINARY_RESPONSE_E2BIG);
+                break;
+            }
+            if (gethrtime() > run->deadline) {
+                STATS_NOKEY(c, script_budget_exceeded);
+                ret = script_fail(run, PROTOCOL_BINARY_RESPONSE_ETMPFAIL);
+                break;
+            }
+            switch (conn_check_access(c, step->opcode)) {
+            case AUTH_OK:
+                break;
+            case AUTH_STALE:
+                ret = script_fail(run, PROTOCOL_BINARY_RESPONSE_AUTH_STALE);
+                break;
+            default:
+                ret = script_fail(run, PROTOCOL_BINARY_RESPONSE_EACCESS);
+            }
+            if (ret != ENGINE_SUCCESS) {
+                break;
+            }
+            run->started = true;
+            STATS_NOKEY(c, script_steps);
+        }
+
+        /* For the helpers failing with ENGINE_FAILED themselves */
+        run->status = PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+        ret = script_step(c, run, step, &args);
+        if (ret == ENGINE_EWOULDBLOCK) {
+            c->ewouldblock = true;
+            return;
+        }
+        run->started = false;
+        run->inflated = false;
+        if (ret == ENGINE_KEY_EEXISTS && step->cas) {
+            /* Lost a race, look again from the top */
+            script_set_item(run, NULL);
+            run->pc = 0;
+            ret = ENGINE_SUCCESS;
+        } else if (ret == ENGINE_SUCCESS) {
+            ++run->pc;
+        }
+    }
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        script_response(c, run);
+        break;
+    case ENGINE_FAILED:
+        write_bin_packet(c, run->status);
+        break;
+    case ENGINE_DISCONNECT:
+        conn_set_state(c, conn_closing);
+        break;
+    default:
+        write_bin_packet(c, engine_error_2_protocol_error(ret));
+    }
+}
+
+static void get_cmd_timer_executor(conn *c, void *packet)
+{
+    protocol_binary_request_get_cmd_timer_breakdown *req = packet;
+
+    if (c->binary_header.request.extlen == 1 ||
+        req->message.body.breakdown == PROTOCOL_BINARY_CMD_TIMER_HISTOGRAM) {
+        generate_timings(req->message.body.opcode, c);
+    } else if (!generate_timings_breakdown(req->message.body.opcode,
+                                           req->message.body.breakdown, c)) {
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL);
+        return;
+    }
+    write_and_free(c, &c->dynamic_buffer);
+}
+
+static void set_ctrl_token_executor(conn *c, void *packet)
+{
+    protocol_binary_request_set_ctrl_token *req = packet;
+    uint64_t old_cas = ntohll(req->message.header.request.cas);
+    uint16_t ret = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+
+    cb_mutex_enter(&(session_cas.mutex));
+    if (session_cas.ctr > 0) {
+        ret = PROTOCOL_BINARY_RESPONSE_EBUSY;
+    } else {
+        if (old_cas == session_cas.value || old_cas == 0) {
+            session_cas.value = ntohll(req->message.body.new_cas);
+        } else {
+            ret = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+        }
+    }
+
+    binary_response_handler(NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            ret, session_cas.value, c);
+    cb_mutex_exit(&(session_cas.mutex));
+
+    write_and_free(c, &c->dynamic_buffer);
+}
+
+static void get_ctrl_token_executor(conn *c, void *packet)
+{
+    (void)packet;
+    cb_mutex_enter(&(session_cas.mutex));
+    binary_response_handler(NULL, 0, NULL, 0, NULL, 0,
                             PROTOCOL_BINARY_RAW_BYTES,
                             PROTOCOL_BINARY_RESPONSE_SUCCESS,
                             session_cas.value, c);
@@ -4384,7 +6765,7 @@ static void ioctl_set_executor(conn *c, void *packet)
     protocol_binary_request_ioctl_set *req = packet;
     const char* key = (const char*)(req->bytes + sizeof(req->bytes));
     size_t keylen = ntohs(req->message.header.request.keylen);
-    size_t vallen = ntohl(req->message.header.request.bodylen);
+    size_t vallen = ntohl(req->message.header.request.bodylen) - keylen;
     const char* value = key + keylen;
 
     ENGINE_ERROR_CODE status = ioctl_set_property(c, key, keylen, value,
@@ -4582,6 +6963,8 @@ static void setup_bin_packet_handlers(void) {
     executors[PROTOCOL_BINARY_CMD_FLUSH] = flush_executor;
     executors[PROTOCOL_BINARY_CMD_FLUSHQ] = flush_executor;
     executors[PROTOCOL_BINARY_CMD_SETQ] = setq_executor;
+    executors[PROTOCOL_BINARY_CMD_SETM] = setm_executor;
+    executors[PROTOCOL_BINARY_CMD_SCRIPT_EXEC] = script_exec_executor;
     executors[PROTOCOL_BINARY_CMD_SET] = set_executor;
     executors[PROTOCOL_BINARY_CMD_ADDQ] = addq_executor;
     executors[PROTOCOL_BINARY_CMD_ADD] = add_executor;
@@ -4595,6 +6978,7 @@ static void setup_bin_packet_handlers(void) {
     executors[PROTOCOL_BINARY_CMD_GETQ] = get_executor;
     executors[PROTOCOL_BINARY_CMD_GETK] = get_executor;
     executors[PROTOCOL_BINARY_CMD_GETKQ] = get_executor;
+    executors[PROTOCOL_BINARY_CMD_GET_RANGE] = get_range_executor;
     executors[PROTOCOL_BINARY_CMD_DELETE] = delete_executor;
     executors[PROTOCOL_BINARY_CMD_DELETEQ] = delete_executor;
     executors[PROTOCOL_BINARY_CMD_STAT] = stat_executor;
@@ -4623,6 +7007,8 @@ static void setup_bin_packet_handlers(void) {
     executors[PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_PUSH_LAST] = subdoc_array_push_last_executor;
     executors[PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_PUSH_FIRST] = subdoc_array_push_first_executor;
     executors[PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_ADD_UNIQUE] = subdoc_array_add_unique_executor;
+    executors[PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP] = subdoc_multi_lookup_executor;
+    executors[PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION] = subdoc_multi_mutation_executor;
 
 }
 
@@ -4642,8 +7028,8 @@ static void setup_not_supported_handlers(void) {
     }
 }
 
-static int invalid_datatype(conn *c) {
-    switch (c->binary_header.request.datatype) {
+static int invalid_datatype(const conn *c, uint8_t datatype) {
+    switch (datatype) {
     case PROTOCOL_BINARY_RAW_BYTES:
         return 0;
 
@@ -4659,37 +7045,113 @@ static int invalid_datatype(conn *c) {
     }
 }
 
+/*
+ * Check the access to the command in the bitmap of the connection's
+ * authentication context. The denied commands (and the stale contexts)
+ * go through auth_check_access(), which knows about privilege debugging.
+ */
+static auth_error_t conn_check_access(conn *c, uint8_t opcode) {
+    uint32_t generation = auth_get_generation();
+
+    if (c->access_mask == NULL || c->access_generation != generation) {
+        c->access_mask = auth_get_access_mask(c->auth_context,
+                                              &c->access_generation);
+        auth_get_rate_limits(c->auth_context, &c->rate_user, &c->rate_ops,
+                             &c->rate_bytes);
+    }
+    if (c->access_mask != NULL && c->access_generation == generation &&
+        ((c->access_mask[opcode >> 6] >> (opcode & 63)) & 1)) {
+        return AUTH_OK;
+    }
+    return auth_check_access(c->auth_context, opcode);
+}
+
 static void process_bin_packet(conn *c) {
 
-    char *packet = (c->read.curr - (c->binary_header.request.bodylen +
-                                sizeof(c->binary_header)));
+    /* A value received into the item (see conn::direct) isn't in there */
+    char *packet = (c->read.curr - (c->binary_header.request.bodylen -
+                                    c->direct.vlen +
+                                    sizeof(c->binary_header)));
 
     uint8_t opcode = c->binary_header.request.opcode;
 
     bin_package_validate validator = validators[opcode];
     bin_package_execute executor = executors[opcode];
 
-    switch (auth_check_access(c->auth_context, opcode)) {
+    if (c->resume != 0) {
+        /* Back where it blocked, the rest was done the first time round */
+        executor(c, packet);
+        return;
+    }
+
+    STATS_BUMP(c->thread->cmds, 1);
+
+    if (c->thread->trace != NULL && settings.workload_trace_sample != 0) {
+        workload_trace_record(c->thread->trace, c, packet);
+    }
+
+    if (c->phase.active && c->phase.read == 0) {
+        uint16_t nkey = c->binary_header.request.keylen;
+        c->phase.read = gethrtime();
+        c->phase.vbucket = c->binary_header.request.vbucket;
+        c->phase.nkey = nkey;
+        memcpy(c->phase.key, packet + sizeof(c->binary_header) +
+               c->binary_header.request.extlen,
+               nkey < sizeof(c->phase.key) ? nkey : sizeof(c->phase.key));
+    }
+
+    if (c->protocol == PROTOCOL_GREENSTACK && c->greenstack->unsupported) {
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
+        return;
+    }
+
+    if (c->get_batch.count != 0 && opcode != PROTOCOL_BINARY_CMD_GETQ &&
+        opcode != PROTOCOL_BINARY_CMD_GETKQ) {
+        /* Lookups from the batch must not outlive a bucket change etc */
+        conn_release_get_batch(c);
+    }
+
+    if (opcode == PROTOCOL_BINARY_CMD_SELECT_BUCKET) {
+        /*
+         * The children running the unordered commands only get their
+         * bucket from ON_CONNECT and ON_AUTH, so they'd miss this one.
+         */
+        c->unordered.enabled = false;
+        c->near_cache.disabled = true;
+        conn_engine_unbind(c);
+    }
+
+    if (c->thread->near_cache != NULL) {
+        near_cache_invalidate(c->near_cache.pending);
+        c->near_cache.pending = near_cache_invalidation(opcode,
+            packet + sizeof(c->binary_header) +
+            c->binary_header.request.extlen,
+            c->binary_header.request.keylen);
+    }
+
+    switch (conn_check_access(c, opcode)) {
     case AUTH_FAIL:
         /* @TODO Should go to audit */
-        if (c->peername) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                            "%d (%s => %s): no access to command %s",
-                                            c->sfd, c->peername,
-                                            c->sockname,
-                                            memcached_opcode_2_text(opcode));
-        } else {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                            "%d: no access to command %s",
-                                            c->sfd,
-                                            memcached_opcode_2_text(opcode));
-        }
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "%d (%s => %s): no access to command %s",
+                                        c->sfd, get_peername(c),
+                                        get_sockname(c),
+                                        memcached_opcode_2_text(opcode));
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EACCESS);
         break;
     case AUTH_OK:
         if (validator != NULL && validator(packet) != 0) {
             write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL);
+        } else if (is_prefetch_opcode(opcode) && !conn_admit(c)) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ETMPFAIL);
+        } else if (is_prefetch_opcode(opcode) &&
+                   !rate_limit_charge(c, sizeof(c->binary_header) +
+                                      c->binary_header.request.bodylen)) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_RATE_LIMITED);
         } else if (executor != NULL) {
+            if (c->phase.active && c->phase.dispatch == 0) {
+                c->phase.dispatch = gethrtime();
+            }
             executor(c, packet);
         } else {
             process_bin_unknown_packet(c);
@@ -4746,14 +7208,15 @@ static void dispatch_bin_command(conn *c) {
         return;
     }
 
-    if (invalid_datatype(c)) {
+    if (invalid_datatype(c, c->binary_header.request.datatype)) {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL);
         c->write_and_go = conn_closing;
         return;
     }
 
     if (c->start == 0) {
-        c->start = gethrtime();
+        c->start = conn_clock(c);
+        conn_phase_begin(c, c->start);
     }
 
     MEMCACHED_PROCESS_COMMAND_START(c->sfd, c->read.curr, c->read.bytes);
@@ -4773,25 +7236,169 @@ static void dispatch_bin_command(conn *c) {
     if (c->binary_header.request.bodylen > settings.max_packet_size) {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL);
         c->write_and_go = conn_closing;
+    } else if (direct_receive_wanted(c)) {
+        bin_read_chunk(c, bin_reading_set_header,
+                       c->binary_header.request.extlen + keylen);
     } else {
         bin_read_chunk(c, bin_reading_packet, c->binary_header.request.bodylen);
     }
 }
 
+/*
+ * Direct receive (see the "direct_receive_size" setting): the extras and
+ * the key of a large SET, ADD or REPLACE are read first, so the item can
+ * be allocated and the value read from the socket into it. That saves
+ * growing the read buffer to the size of the packet, and copying the
+ * value from there. The commands the engine can't allocate an item for
+ * right away fall back to reading the whole packet, and get handled (and
+ * the error reported) the usual way.
+ */
+static bool direct_receive_wanted(conn *c) {
+    uint32_t bodylen = c->binary_header.request.bodylen;
+    uint32_t nhead = c->binary_header.request.extlen +
+        c->binary_header.request.keylen;
+    uint32_t vlen;
+
+    if (settings.direct_receive_size == 0 ||
+        c->binary_header.request.magic != PROTOCOL_BINARY_REQ ||
+        c->protocol == PROTOCOL_GREENSTACK || c->unordered.enabled ||
+        c->unordered.parent != NULL || c->item != NULL ||
+        c->binary_header.request.extlen != 8 ||
+        c->binary_header.request.keylen == 0 || bodylen < nhead) {
+        return false;
+    }
+
+    switch (c->cmd) {
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+        break;
+    default:
+        return false;
+    }
+
+    vlen = bodylen - nhead;
+    if (vlen < settings.direct_receive_size) {
+        return false;
+    }
+    /* The values to compress are compressed from the read buffer */
+    if (settings.datatype &&
+        ((settings.compression_threshold != 0 &&
+          vlen >= settings.compression_threshold) ||
+         vlen <= settings.dictionary_compression_max) &&
+        (c->binary_header.request.datatype &
+         PROTOCOL_BINARY_DATATYPE_COMPRESSED) == 0) {
+        return false;
+    }
+    /* Don't allocate for commands which are going to be refused */
+    return conn_check_access(c, (uint8_t)c->cmd) == AUTH_OK;
+}
+
+/*
+ * Set up the read of the next segment of the item (from c->direct.segment
+ * on), returns false if the value is complete
+ */
+static bool direct_receive_segment(conn *c, const item_view *info) {
+    struct iovec iov;
+
+    while (c->direct.segment < info->nsegments) {
+        if (!get_item_segment(c, c->item, info, c->direct.segment, &iov)) {
+            /* The packet can't be read any further */
+            conn_set_state(c, conn_closing);
+            return true;
+        }
+        if (iov.iov_len > 0) {
+            c->ritem = iov.iov_base;
+            c->rlbytes = (uint32_t)iov.iov_len;
+            c->substate = bin_reading_value;
+            return true;
+        }
+        ++c->direct.segment;
+    }
+    return false;
+}
+
+/* Read the whole packet into the read buffer after all */
+static void direct_receive_fallback(conn *c, char *packet) {
+    uint32_t nread = (uint32_t)(c->read.curr - packet);
+    c->read.curr = packet;
+    c->read.bytes += nread;
+    bin_read_chunk(c, bin_reading_packet, c->binary_header.request.bodylen);
+    /* Past the header, as try_read_command() leaves it */
+    c->read.curr += sizeof(c->binary_header);
+    c->read.bytes -= sizeof(c->binary_header);
+}
+
+/* The extras and the key are in, allocate the item for the value */
+static void direct_receive_start(conn *c) {
+    protocol_binary_request_set *req;
+    char *packet = c->read.curr - (sizeof(c->binary_header) +
+                                   c->binary_header.request.extlen +
+                                   c->binary_header.request.keylen);
+    uint16_t nkey = c->binary_header.request.keylen;
+    uint32_t vlen = c->binary_header.request.bodylen - nkey -
+        c->binary_header.request.extlen;
+    item_view info;
+    ENGINE_ERROR_CODE ret;
+    item *it;
+
+    req = (protocol_binary_request_set *)packet;
+    ret = settings.engine.v1->allocate(settings.engine.v0, c, &it,
+                                       packet + sizeof(req->bytes), nkey,
+                                       vlen, req->message.body.flags,
+                                       ntohl(req->message.body.expiration),
+                                       c->binary_header.request.datatype);
+    if (ret != ENGINE_SUCCESS) {
+        direct_receive_fallback(c, packet);
+        return;
+    }
+
+    if (!get_item_view(c, it, &info)) {
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        direct_receive_fallback(c, packet);
+        return;
+    }
+
+    item_set_cas(c, it, c->binary_header.request.cas);
+    c->item = it;
+    c->direct.vlen = vlen;
+    c->direct.segment = 0;
+    STATS_NOKEY(c, direct_receives);
+    if (!direct_receive_segment(c, &info)) {
+        direct_receive_complete(c, &info);
+    }
+}
+
+/* A segment of the value is in, go on with the next one or the command */
+static void direct_receive_next(conn *c) {
+    item_view info;
+
+    if (!get_item_view(c, c->item, &info)) {
+        /* The packet can't be read any further */
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    ++c->direct.segment;
+    if (!direct_receive_segment(c, &info)) {
+        direct_receive_complete(c, &info);
+    }
+}
+
 static void process_bin_delete(conn *c) {
     ENGINE_ERROR_CODE ret;
     protocol_binary_request_delete* req = binary_get_request(c);
     char* key = binary_get_key(c);
     size_t nkey = c->binary_header.request.keylen;
     uint64_t cas = ntohll(req->message.header.request.cas);
-    item_info_holder info;
-    memset(&info, 0, sizeof(info));
-
-    info.info.nvalue = 1;
+    item_view info;
+    info.clsid = 0;
 
     cb_assert(c != NULL);
 
-    if (settings.verbose > 1) {
+    if (c->trace_request) {
         char buffer[1024];
         if (key_to_printable_buffer(buffer, sizeof(buffer), c->sfd, true,
                                     "DELETE", key, nkey) != -1) {
@@ -4806,10 +7413,11 @@ static void process_bin_delete(conn *c) {
 
     mutation_descr_t mut_info;
     if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->remove(settings.engine.v0, c, key, nkey,
-                                         &cas,
-                                         c->binary_header.request.vbucket,
-                                         &mut_info);
+        ENGINE_HANDLE *h;
+        ENGINE_HANDLE_V1 *v1 = conn_engine_enter(c, &h);
+        ret = v1->remove(h, c, key, nkey, &cas,
+                         c->binary_header.request.vbucket, &mut_info);
+        conn_engine_leave(c, v1);
     }
 
     /* For some reason the SLAB_INCR tries to access this... */
@@ -4850,11 +7458,24 @@ static void process_bin_delete(conn *c) {
     }
 }
 
+/* The value is in the item, run the command with it */
+static void direct_receive_complete(conn *c, const item_view *info) {
+    detect_item_json(c, c->item, info, c->binary_header.request.datatype);
+    c->substate = bin_reading_packet;
+    process_bin_packet(c);
+}
+
 static void complete_nread(conn *c) {
     cb_assert(c != NULL);
     cb_assert(c->cmd >= 0);
 
     switch(c->substate) {
+    case bin_reading_set_header:
+        direct_receive_start(c);
+        break;
+    case bin_reading_value:
+        direct_receive_next(c);
+        break;
     case bin_reading_packet:
         if (c->binary_header.request.magic == PROTOCOL_BINARY_RES) {
             RESPONSE_HANDLER handler;
@@ -4886,6 +7507,8 @@ static void reset_cmd_handler(conn *c) {
         settings.engine.v1->release(settings.engine.v0, c, c->item);
         c->item = NULL;
     }
+    c->direct.vlen = 0;
+    c->rsp_bodylen = 0;
 
     // If command context is non-NULL then call it's destructor (if set) before
     // resetting.
@@ -4948,6 +7571,52 @@ static void aggregate_callback(void *in, void *out) {
     threadlocal_stats_aggregate(in, out);
 }
 
+/*
+ * Sum up the thread stats of all of the buckets, or copy them from the
+ * snapshot if it isn't older than stats_snapshot_msec. Only one
+ * connection at a time takes a new snapshot; the others keep using the
+ * old one meanwhile (so they never wait for the engine).
+ */
+static void aggregate_thread_stats(conn *c, struct thread_stats *stats) {
+    hrtime_t max_age = (hrtime_t)settings.stats_snapshot_msec * 1000000;
+    hrtime_t now = 0;
+    uint64_t resets = 0;
+    bool refresh = false;
+
+    if (max_age != 0) {
+        now = gethrtime();
+        cb_mutex_enter(&aggregate_snapshot.mutex);
+        if (aggregate_snapshot.valid &&
+            (aggregate_snapshot.refreshing ||
+             now - aggregate_snapshot.taken < max_age)) {
+            memcpy(stats, &aggregate_snapshot.stats, sizeof(*stats));
+            cb_mutex_exit(&aggregate_snapshot.mutex);
+            return;
+        }
+        if (!aggregate_snapshot.refreshing) {
+            aggregate_snapshot.refreshing = refresh = true;
+            resets = aggregate_snapshot.resets;
+        }
+        cb_mutex_exit(&aggregate_snapshot.mutex);
+    }
+
+    settings.engine.v1->aggregate_stats(settings.engine.v0,
+                                        (const void *)c,
+                                        aggregate_callback,
+                                        stats);
+
+    if (refresh) {
+        cb_mutex_enter(&aggregate_snapshot.mutex);
+        if (resets == aggregate_snapshot.resets) {
+            memcpy(&aggregate_snapshot.stats, stats, sizeof(*stats));
+            aggregate_snapshot.taken = now;
+            aggregate_snapshot.valid = true;
+        }
+        aggregate_snapshot.refreshing = false;
+        cb_mutex_exit(&aggregate_snapshot.mutex);
+    }
+}
+
 /* return server specific stats only */
 static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
 #ifdef WIN32
@@ -4965,10 +7634,7 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     threadlocal_stats_clear(&thread_stats);
 
     if (aggregate && settings.engine.v1->aggregate_stats != NULL) {
-        settings.engine.v1->aggregate_stats(settings.engine.v0,
-                                            (const void *)c,
-                                            aggregate_callback,
-                                            &thread_stats);
+        aggregate_thread_stats(c, &thread_stats);
     } else {
         threadlocal_stats_aggregate(get_independent_stats(c),
                                     &thread_stats);
@@ -5040,6 +7706,7 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     APPEND_STAT("listen_disabled_num", "%"PRIu64, get_listen_disabled_num());
     APPEND_STAT("rejected_conns", "%" PRIu64, (uint64_t)stats.rejected_conns);
     APPEND_STAT("threads", "%d", settings.num_threads);
+    APPEND_STAT("dcp_threads", "%d", settings.num_dcp_threads);
     APPEND_STAT("conn_yields", "%" PRIu64, (uint64_t)thread_stats.conn_yields);
     APPEND_STAT("rbufs_allocated", "%" PRIu64, (uint64_t)thread_stats.rbufs_allocated);
     APPEND_STAT("rbufs_loaned", "%" PRIu64, (uint64_t)thread_stats.rbufs_loaned);
@@ -5048,8 +7715,92 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     APPEND_STAT("wbufs_loaned", "%" PRIu64, (uint64_t)thread_stats.wbufs_loaned);
     APPEND_STAT("iovused_high_watermark", "%" PRIu64, (uint64_t)thread_stats.iovused_high_watermark);
     APPEND_STAT("msgused_high_watermark", "%" PRIu64, (uint64_t)thread_stats.msgused_high_watermark);
+    APPEND_STAT("zerocopy_sends", "%" PRIu64, (uint64_t)thread_stats.zerocopy_sends);
+    APPEND_STAT("zerocopy_copied", "%" PRIu64, (uint64_t)thread_stats.zerocopy_copied);
+    APPEND_STAT("conn_migrations", "%" PRIu64, (uint64_t)thread_stats.conn_migrations);
+    APPEND_STAT("responses_coalesced", "%" PRIu64, (uint64_t)thread_stats.responses_coalesced);
+    APPEND_STAT("ssl_ktls_offloads", "%" PRIu64, (uint64_t)thread_stats.ssl_ktls_offloads);
+    APPEND_STAT("ssl_handshakes", "%" PRIu64, (uint64_t)thread_stats.ssl_handshakes);
+    APPEND_STAT("ssl_sessions_reused", "%" PRIu64, (uint64_t)thread_stats.ssl_sessions_reused);
+    APPEND_STAT("unordered_cmds", "%" PRIu64, (uint64_t)thread_stats.unordered_cmds);
+    APPEND_STAT("sched_throttled", "%" PRIu64, (uint64_t)thread_stats.sched_throttled);
+    APPEND_STAT("slice_trimmed", "%" PRIu64, (uint64_t)thread_stats.slice_trimmed);
+    APPEND_STAT("cmds_shed", "%" PRIu64, (uint64_t)thread_stats.cmds_shed);
+    APPEND_STAT("cmds_rate_limited", "%" PRIu64, (uint64_t)thread_stats.cmds_rate_limited);
+    APPEND_STAT("conns_throttled", "%" PRIu64, (uint64_t)thread_stats.conns_throttled);
+    APPEND_STAT("direct_receives", "%" PRIu64, (uint64_t)thread_stats.direct_receives);
+    APPEND_STAT("read_repacks", "%" PRIu64, (uint64_t)thread_stats.read_repacks);
+    APPEND_STAT("idle_trims", "%" PRIu64, (uint64_t)thread_stats.idle_trims);
+    APPEND_STAT("idle_trimmed_bytes", "%" PRIu64, (uint64_t)thread_stats.idle_trimmed_bytes);
+    APPEND_STAT("idle_closes", "%" PRIu64, (uint64_t)thread_stats.idle_closes);
+    APPEND_STAT("script_steps", "%" PRIu64, (uint64_t)thread_stats.script_steps);
+    APPEND_STAT("script_budget_exceeded", "%" PRIu64,
+                (uint64_t)thread_stats.script_budget_exceeded);
+    APPEND_STAT("workload_trace_records", "%" PRIu64, thread_trace_records());
+    APPEND_STAT("proxy_forwards", "%" PRIu64, (uint64_t)thread_stats.proxy_forwards);
+    APPEND_STAT("proxy_failures", "%" PRIu64, (uint64_t)thread_stats.proxy_failures);
+    APPEND_STAT("proxy_hedges", "%" PRIu64, (uint64_t)thread_stats.proxy_hedges);
+    APPEND_STAT("proxy_hedge_wins", "%" PRIu64, (uint64_t)thread_stats.proxy_hedge_wins);
+    APPEND_STAT("near_cache_hits", "%" PRIu64, (uint64_t)thread_stats.near_cache_hits);
+    APPEND_STAT("near_cache_fills", "%" PRIu64, (uint64_t)thread_stats.near_cache_fills);
+    APPEND_STAT("values_compressed", "%" PRIu64, (uint64_t)thread_stats.values_compressed);
+    APPEND_STAT("inflate_cache_hits", "%" PRIu64, (uint64_t)thread_stats.inflate_cache_hits);
+    APPEND_STAT("inflate_cache_misses", "%" PRIu64, (uint64_t)thread_stats.inflate_cache_misses);
+    APPEND_STAT("values_dict_compressed", "%" PRIu64, (uint64_t)thread_stats.values_dict_compressed);
+    APPEND_STAT("stream_compressed_bytes_in", "%" PRIu64,
+                (uint64_t)thread_stats.stream_compress_in);
+    APPEND_STAT("stream_compressed_bytes_out", "%" PRIu64,
+                (uint64_t)thread_stats.stream_compress_out);
+    if (thread_stats.stream_compress_out != 0) {
+        APPEND_STAT("stream_compression_ratio", "%.2f",
+                    (double)thread_stats.stream_compress_in /
+                    (double)thread_stats.stream_compress_out);
+    }
+    {
+        struct dictionary_stats dict;
+        dictionary_get_stats(&dict);
+        APPEND_STAT("dictionaries", "%u", dict.versions);
+        APPEND_STAT("dictionary_id", "%u", dict.id);
+        APPEND_STAT("dictionary_bytes", "%" PRIu64, dict.bytes);
+        APPEND_STAT("dictionary_samples", "%" PRIu64, dict.samples);
+        APPEND_STAT("dictionary_training_failures", "%" PRIu64,
+                    dict.training_failures);
+    }
+    {
+        struct memory_manager_stats mem;
+        memory_manager_get_stats(&mem);
+        APPEND_STAT("allocator_heap_bytes", "%" PRIu64, mem.heap_bytes);
+        APPEND_STAT("allocator_allocated_bytes", "%" PRIu64,
+                    mem.allocated_bytes);
+        APPEND_STAT("allocator_free_mapped_bytes", "%" PRIu64,
+                    mem.free_mapped_bytes);
+        APPEND_STAT("allocator_free_unmapped_bytes", "%" PRIu64,
+                    mem.free_unmapped_bytes);
+        APPEND_STAT("allocator_fragmentation_bytes", "%" PRIu64,
+                    mem.fragmentation_bytes);
+        APPEND_STAT("free_memory_releases", "%" PRIu64, mem.releases);
+        APPEND_STAT("free_memory_release_slices", "%" PRIu64, mem.slices);
+        APPEND_STAT("free_memory_released_bytes", "%" PRIu64,
+                    mem.released_bytes);
+    }
+    APPEND_STAT("subdoc_index_hits", "%" PRIu64, (uint64_t)thread_stats.subdoc_index_hits);
+    APPEND_STAT("subdoc_index_misses", "%" PRIu64, (uint64_t)thread_stats.subdoc_index_misses);
     STATS_UNLOCK();
 
+    {
+        struct buffer_pool_class pool[BUFFER_POOL_CLASSES];
+        buffer_pool_aggregate(pool);
+        for (int ii = 0; ii < BUFFER_POOL_CLASSES; ++ii) {
+            unsigned int size = DATA_BUFFER_SIZE << ii;
+            sprintf(stat_key, "bufpool_%u_hits", size);
+            APPEND_STAT(stat_key, "%" PRIu64, pool[ii].hits);
+            sprintf(stat_key, "bufpool_%u_misses", size);
+            APPEND_STAT(stat_key, "%" PRIu64, pool[ii].misses);
+            sprintf(stat_key, "bufpool_%u_free", size);
+            APPEND_STAT(stat_key, "%" PRIu64, pool[ii].nfree);
+        }
+    }
+
     /*
      * Add tap stats (only if non-zero)
      */
@@ -5148,15 +7899,62 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
             snprintf(interface + offset, sizeof(interface) - offset,
                      "-ssl-cert");
             APPEND_STAT(interface, "%s", settings.interfaces[ii].ssl.cert);
+            snprintf(interface + offset, sizeof(interface) - offset,
+                     "-ssl-ktls");
+            APPEND_STAT(interface, "%s", settings.interfaces[ii].ssl.ktls ?
+                        "true" : "false");
         } else {
             snprintf(interface + offset, sizeof(interface) - offset,
                      "-ssl");
             APPEND_STAT(interface, "%s", "false");
         }
+        if (settings.interfaces[ii].path) {
+            snprintf(interface + offset, sizeof(interface) - offset,
+                     "-path");
+            APPEND_STAT(interface, "%s", settings.interfaces[ii].path);
+            snprintf(interface + offset, sizeof(interface) - offset,
+                     "-peercred");
+            APPEND_STAT(interface, "%s", settings.interfaces[ii].peercred ?
+                        "true" : "false");
+        }
     }
 
     APPEND_STAT("verbosity", "%d", settings.verbose);
+    APPEND_STAT("trace_sample_rate", "%u", settings.trace_sample_rate);
+    APPEND_STAT("phase_timings", "%s",
+                settings.phase_timings ? "true" : "false");
+    APPEND_STAT("arena_per_thread", "%s",
+                settings.arena_per_thread ? "true" : "false");
+    APPEND_STAT("thread_affinity", "%s",
+                settings.thread_affinity ? settings.thread_affinity : "none");
+    APPEND_STAT("busy_poll_usec", "%u", settings.busy_poll_usec);
+    APPEND_STAT("proxy_enabled", "%s",
+                settings.proxy.enabled ? "true" : "false");
+    APPEND_STAT("proxy_username", "%s",
+                settings.proxy.username ? settings.proxy.username : "");
+    APPEND_STAT("proxy_hedge_usec", "%u", settings.proxy.hedge_usec);
+    APPEND_STAT("near_cache_items", "%u", settings.near_cache_items);
+    APPEND_STAT("slow_command_threshold", "%u",
+                settings.slow_command_threshold);
+    APPEND_STAT("idle_trim_sec", "%u", settings.idle_trim_sec);
+    APPEND_STAT("idle_timeout", "%u", settings.idle_timeout);
+    APPEND_STAT("free_memory_release_pct", "%u",
+                settings.free_memory_release_pct);
+    APPEND_STAT("free_memory_release_rate", "%u",
+                settings.free_memory_release_rate);
+    APPEND_STAT("gather_writes", "%s",
+                settings.gather_writes ? "true" : "false");
+    APPEND_STAT("workload_trace_file_size", "%u",
+                settings.workload_trace_file_size);
+    APPEND_STAT("workload_trace_sample", "%u",
+                settings.workload_trace_sample);
+    APPEND_STAT("vbucket_stats", "%u", settings.vbucket_stats);
     APPEND_STAT("num_threads", "%d", settings.num_threads);
+    APPEND_STAT("max_threads", "%d", settings.max_threads);
+    APPEND_STAT("num_dcp_threads", "%d", settings.num_dcp_threads);
+    APPEND_STAT("num_sasl_threads", "%d", settings.num_sasl_threads);
+    APPEND_STAT("hash_algorithm", "%s",
+                settings.hash_algorithm == HASH_CRC32C ? "crc32c" : "jenkins");
     APPEND_STAT("reqs_per_event_high_priority", "%d",
                 settings.reqs_per_event_high_priority);
     APPEND_STAT("reqs_per_event_med_priority", "%d",
@@ -5165,6 +7963,17 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
                 settings.reqs_per_event_low_priority);
     APPEND_STAT("reqs_per_event_def_priority", "%d",
                 settings.default_reqs_per_event);
+    APPEND_STAT("max_slice_usec", "%u", settings.max_slice_usec);
+    APPEND_STAT("direct_receive_size", "%u", settings.direct_receive_size);
+    APPEND_STAT("shed_inflight", "%u", settings.shed_inflight);
+    APPEND_STAT("shed_delay_usec", "%u", settings.shed_delay_usec);
+    APPEND_STAT("max_unsent_bytes", "%u", settings.max_unsent_bytes);
+    APPEND_STAT("max_pinned_items", "%u", settings.max_pinned_items);
+    APPEND_STAT("rate_limit_user_ops", "%u", settings.rate_limit_user_ops);
+    APPEND_STAT("rate_limit_user_bytes", "%u", settings.rate_limit_user_bytes);
+    APPEND_STAT("rate_limit_bucket_ops", "%u", settings.rate_limit_bucket_ops);
+    APPEND_STAT("rate_limit_bucket_bytes", "%u",
+                settings.rate_limit_bucket_bytes);
     APPEND_STAT("auth_enabled_sasl", "%s", "yes");
     APPEND_STAT("auth_sasl_engine", "%s", "cbsasl");
     APPEND_STAT("auth_required_sasl", "%s", settings.require_sasl ? "yes" : "no");
@@ -5193,12 +8002,135 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
                   settings.rbac_file, (uint32_t)strlen(settings.rbac_file), c);
     }
 
+    if (settings.scripts_file) {
+        add_stats("scripts", (uint16_t)strlen("scripts"), settings.scripts_file,
+                  (uint32_t)strlen(settings.scripts_file), c);
+    }
+
+    if (settings.workload_trace_dir) {
+        add_stats("workload_trace_dir", (uint16_t)strlen("workload_trace_dir"),
+                  settings.workload_trace_dir,
+                  (uint32_t)strlen(settings.workload_trace_dir), c);
+    }
+
     if (settings.audit_file) {
         add_stats("audit", (uint16_t)strlen("audit"),
                   settings.audit_file, (uint32_t)strlen(settings.audit_file), c);
     }
 }
 
+static bool is_prefetch_opcode(uint8_t opcode) {
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+    case PROTOCOL_BINARY_CMD_GET_RANGE:
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+    case PROTOCOL_BINARY_CMD_TOUCH:
+    case PROTOCOL_BINARY_CMD_GAT:
+    case PROTOCOL_BINARY_CMD_GATQ:
+        return true;
+    default:
+        return opcode >= PROTOCOL_BINARY_CMD_SUBDOC_GET &&
+            opcode <= PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION;
+    }
+}
+
+/*
+ * When the packet at c->read.curr is executed, the packets pipelined
+ * behind it may already be in the input buffer. Let the engine prefetch
+ * their keys in two steps, so every load has the time of a few commands
+ * to complete: the part of the index holding a key when the packet is
+ * first seen, and the item itself right before it is up next. Only
+ * complete packets are looked at, and the validators still have the final
+ * say about all of them.
+ */
+static void prefetch_pipelined_keys(conn *c) {
+    const char *ptr = c->read.curr;
+    size_t avail = c->read.bytes;
+    unsigned int depth = settings.prefetch_depth;
+    /* The packets behind the current one which had their index prefetched */
+    unsigned int ahead = c->prefetched > 0 ? c->prefetched - 1u : 0;
+    unsigned int n = 0;
+
+    if (depth == 0 || settings.engine.v1->prefetch == NULL ||
+        c->protocol == PROTOCOL_GREENSTACK) {
+        c->prefetched = 0;
+        return;
+    }
+
+    while (n <= depth && avail >= sizeof(protocol_binary_request_header)) {
+        protocol_binary_request_header req;
+        size_t total;
+
+        /* The input buffer isn't necessarily aligned */
+        memcpy(&req, ptr, sizeof(req));
+        total = sizeof(req) + ntohl(req.request.bodylen);
+        if (req.request.magic != PROTOCOL_BINARY_REQ || avail < total) {
+            break;
+        }
+
+        if (n > 0 && (n == 1 || n > ahead) &&
+            is_prefetch_opcode(req.request.opcode)) {
+            uint16_t keylen = ntohs(req.request.keylen);
+            if (keylen > 0 &&
+                sizeof(req) + req.request.extlen + keylen <= total) {
+                settings.engine.v1->prefetch(settings.engine.v0, c,
+                    ptr + sizeof(req) + req.request.extlen, keylen,
+                    ntohs(req.request.vbucket),
+                    (n <= ahead) ? ENGINE_PREFETCH_ITEM : ENGINE_PREFETCH_INDEX);
+            }
+        }
+
+        ptr += total;
+        avail -= total;
+        ++n;
+    }
+
+    c->prefetched = (uint8_t)n;
+}
+
+/*
+ * Whether the debug messages of the request just read should be logged.
+ * Formatting them (the packet dump, the printable keys) costs more than
+ * most commands, so with verbosity above 1 we only log the traced
+ * connections and 1 in trace_sample_rate of the requests of the thread.
+ */
+static bool conn_trace_request(conn *c) {
+    LIBEVENT_THREAD *thread = c->thread;
+    uint32_t rate = settings.trace_sample_rate;
+
+    if (settings.verbose <= 1) {
+        return false;
+    }
+    if (c->trace || thread == NULL) {
+        return true;
+    }
+    if (rate == 0) {
+        return false;
+    }
+    if (thread->trace_countdown == 0 || thread->trace_countdown > rate) {
+        thread->trace_countdown = rate;
+    }
+    return --thread->trace_countdown == 0;
+}
+
 /*
  * if we have a complete line in the buffer, process it.
  */
@@ -5207,6 +8139,13 @@ static int try_read_command(conn *c) {
     cb_assert(c->read.curr <= (c->read.buf + c->read.size));
     cb_assert(c->read.bytes > 0);
 
+    if (c->protocol == PROTOCOL_GREENSTACK) {
+        int ret = greenstack_read_frame(c);
+        if (ret != 1) {
+            return ret;
+        }
+    }
+
     /* Do we have the complete packet header? */
     if (c->read.bytes < sizeof(c->binary_header)) {
         /* need more data! */
@@ -5226,7 +8165,8 @@ static int try_read_command(conn *c) {
         protocol_binary_request_header* req;
         req = (protocol_binary_request_header*)c->read.curr;
 
-        if (settings.verbose > 1) {
+        c->trace_request = conn_trace_request(c);
+        if (c->trace_request) {
             /* Dump the packet before we convert it to host order */
             char buffer[1024];
             ssize_t nw;
@@ -5238,6 +8178,11 @@ static int try_read_command(conn *c) {
                 settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
                                                 "%s", buffer);
             }
+            if (memcached_packet_2_trace(req->bytes, c->read.bytes, buffer,
+                                         sizeof(buffer)) != -1) {
+                settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                                ">%d %s\n", c->sfd, buffer);
+            }
         }
 
         c->binary_header = *req;
@@ -5280,6 +8225,7 @@ static int try_read_command(conn *c) {
         /* clear the returned cas value */
         c->cas = 0;
 
+        prefetch_pipelined_keys(c);
         dispatch_bin_command(c);
 
         c->read.bytes -= sizeof(c->binary_header);
@@ -5289,108 +8235,63 @@ static int try_read_command(conn *c) {
     return 1;
 }
 
-static void drain_bio_send_pipe(conn *c) {
-    int n;
-    bool stop = false;
-
-    do {
-        if (c->ssl.out.current < c->ssl.out.total) {
-#ifdef WIN32
-            DWORD error;
-#else
-            int error;
-#endif
-            n = send(c->sfd, c->ssl.out.buffer + c->ssl.out.current,
-                     c->ssl.out.total - c->ssl.out.current, 0);
-            if (n > 0) {
-                c->ssl.out.current += n;
-                if (c->ssl.out.current == c->ssl.out.total) {
-                    c->ssl.out.current = c->ssl.out.total = 0;
-                }
-            } else {
-                if (n == -1) {
-#ifdef WIN32
-                    error = WSAGetLastError();
-#else
-                    error = errno;
-#endif
-                    if (!is_blocking(error)) {
-                        c->ssl.error = true;
-                    }
-                }
-                return ;
-            }
-        }
+/*
+ * Try to hand the record layer over to the kernel right after the
+ * handshake. That is only possible while OpenSSL doesn't hold on to any
+ * data (e.g. a client which already sent its first request keeps using
+ * OpenSSL). The socket BIO doesn't read ahead, so the rest of the data
+ * received is still in the socket. Returns -1 if the connection must be
+ * closed, and 0 otherwise (c->ssl is set while it still uses OpenSSL).
+ */
+static int do_ssl_ktls_offload(conn *c) {
+    if (SSL_pending(c->ssl->client) != 0) {
+        return 0;
+    }
 
-        if (c->ssl.out.total == 0) {
-            n = BIO_read(c->ssl.network, c->ssl.out.buffer, c->ssl.out.buffsz);
-            if (n > 0) {
-                c->ssl.out.total = n;
-            } else {
-                stop = true;
-            }
+    switch (ktls_offload(c->sfd, c->ssl->client)) {
+    case KTLS_ENABLED:
+        if (settings.verbose > 1) {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                            "%d: Offloaded %s to kernel TLS",
+                                            c->sfd,
+                                            SSL_get_cipher_name(c->ssl->client));
         }
-    } while (!stop);
-}
-
-static void drain_bio_recv_pipe(conn *c) {
-    int n;
-    bool stop = false;
-
-    do {
-        if (c->ssl.in.current < c->ssl.in.total) {
-            n = BIO_write(c->ssl.network, c->ssl.in.buffer + c->ssl.in.current,
-                          c->ssl.in.total - c->ssl.in.current);
-            if (n > 0) {
-                c->ssl.in.current += n;
-                if (c->ssl.in.current == c->ssl.in.total) {
-                    c->ssl.in.current = c->ssl.in.total = 0;
-                }
-            } else {
-                /* Our input BIO is full, no need to grab more data from
-                 * the network at this time..
-                 */
-                return ;
-            }
+        conn_release_ssl(c);
+        STATS_NOKEY(c, ssl_ktls_offloads);
+        return 0;
+    case KTLS_UNSUPPORTED:
+        if (settings.verbose > 1) {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                            "%d: Kernel TLS not available for %s",
+                                            c->sfd,
+                                            SSL_get_cipher_name(c->ssl->client));
         }
+        return 0;
+    case KTLS_FAILED:
+        break;
+    }
 
-        if (c->ssl.in.total < c->ssl.in.buffsz) {
-#ifdef WIN32
-            DWORD error;
-#else
-            int error;
-#endif
-            n = recv(c->sfd, c->ssl.in.buffer + c->ssl.in.total,
-                     c->ssl.in.buffsz - c->ssl.in.total, 0);
-            if (n > 0) {
-                c->ssl.in.total += n;
-            } else {
-                stop = true;
-                if (n == 0) {
-                    c->ssl.error = true; /* read end shutdown */
-                } else {
-#ifdef WIN32
-                    error = WSAGetLastError();
-#else
-                    error = errno;
-#endif
-                    if (!is_blocking(error)) {
-                        c->ssl.error = true;
-                    }
-                }
-            }
-        }
-    } while (!stop);
+    settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                    "%d: Failed to offload receive to kernel TLS: %s",
+                                    c->sfd, strerror(errno));
+    set_econnreset();
+    return -1;
 }
 
 static int do_ssl_pre_connection(conn *c) {
-    int r = SSL_accept(c->ssl.client);
+    int r = SSL_accept(c->ssl->client);
     if (r == 1) {
-        drain_bio_send_pipe(c);
-        c->ssl.connected = true;
+        c->ssl->connected = true;
+        STATS_NOKEY(c, ssl_handshakes);
+        if (SSL_session_reused(c->ssl->client)) {
+            STATS_NOKEY(c, ssl_sessions_reused);
+        }
+        if (c->ssl->ktls) {
+            return do_ssl_ktls_offload(c);
+        }
     } else {
-        if (SSL_get_error(c->ssl.client, r) == SSL_ERROR_WANT_READ) {
-            drain_bio_send_pipe(c);
+        int error = SSL_get_error(c->ssl->client, r);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
             set_ewouldblock();
             return -1;
         } else {
@@ -5398,7 +8299,7 @@ static int do_ssl_pre_connection(conn *c) {
             if (errmsg) {
                 int offset = sprintf(errmsg,
                                      "SSL_accept() returned %d with error %d\n",
-                                     r, SSL_get_error(c->ssl.client, r));
+                                     r, error);
 
                 ERR_error_string_n(ERR_get_error(), errmsg + offset,
                                    8192 - offset);
@@ -5420,36 +8321,21 @@ static int do_ssl_read(conn *c, char *dest, size_t nbytes) {
     int ret = 0;
 
     while (ret < nbytes) {
-        int n;
-        drain_bio_recv_pipe(c);
-        if (c->ssl.error) {
-            set_econnreset();
-            return -1;
-        }
-        n = SSL_read(c->ssl.client, dest + ret, (int)(nbytes - ret));
+        int n = SSL_read(c->ssl->client, dest + ret, (int)(nbytes - ret));
         if (n > 0) {
             ret += n;
         } else {
             /* n < 0 and n == 0 require a check of SSL error*/
-            int error = SSL_get_error(c->ssl.client, n);
+            int error = SSL_get_error(c->ssl->client, n);
 
             switch (error) {
             case SSL_ERROR_WANT_READ:
-                /*
-                 * Drain the buffers and retry if we've got data in
-                 * our input buffers
-                 */
-                if (c->ssl.in.current < c->ssl.in.total) {
-                    /* our recv buf has data feed the BIO */
-                    drain_bio_recv_pipe(c);
-                } else if (ret > 0) {
-                    /* nothing in our recv buf, return what we have */
+                if (ret > 0) {
+                    /* nothing more in the socket, return what we have */
                     return ret;
-                } else {
-                    set_ewouldblock();
-                    return -1;
                 }
-                break;
+                set_ewouldblock();
+                return -1;
 
             case SSL_ERROR_ZERO_RETURN:
                 /* The TLS/SSL connection has been closed (cleanly). */
@@ -5474,25 +8360,28 @@ static int do_ssl_read(conn *c, char *dest, size_t nbytes) {
 
 static int do_data_recv(conn *c, void *dest, size_t nbytes) {
     int res;
-    if (c->ssl.enabled) {
-        drain_bio_recv_pipe(c);
-
-        if (c->ssl.error) {
-            set_econnreset();
-            return -1;
-        }
-
-        if (!c->ssl.connected) {
+    if (c->ssl != NULL) {
+        if (!c->ssl->connected) {
             res = do_ssl_pre_connection(c);
             if (res == -1) {
                 return -1;
             }
+            if (c->ssl == NULL) {
+                /* Offloaded to kernel TLS */
+                return do_data_recv(c, dest, nbytes);
+            }
         }
 
         /* The SSL negotiation might be complete at this time */
-        if (c->ssl.connected) {
+        if (c->ssl->connected) {
             res = do_ssl_read(c, dest, nbytes);
         }
+#ifdef HAVE_IO_URING
+    } else if (c->uring.enabled) {
+        res = conn_uring_recv(c, dest, nbytes);
+#endif
+    } else if (conn_shm_active(c)) {
+        res = conn_shm_recv(c, dest, nbytes);
     } else {
 #ifdef WIN32
         res = recv(c->sfd, dest, (int)nbytes, 0);
@@ -5513,18 +8402,12 @@ static int do_ssl_write(conn *c, char *dest, size_t nbytes) {
         int n;
         int chunk;
 
-        drain_bio_send_pipe(c);
-        if (c->ssl.error) {
-            set_econnreset();
-            return -1;
-        }
-
         chunk = (int)(nbytes - ret);
         if (chunk > chunksize) {
             chunk = chunksize;
         }
 
-        n = SSL_write(c->ssl.client, dest + ret, chunk);
+        n = SSL_write(c->ssl->client, dest + ret, chunk);
         if (n > 0) {
             ret += n;
         } else {
@@ -5534,7 +8417,7 @@ static int do_ssl_write(conn *c, char *dest, size_t nbytes) {
             }
 
             if (n < 0) {
-                int error = SSL_get_error(c->ssl.client, n);
+                int error = SSL_get_error(c->ssl->client, n);
                 switch (error) {
                 case SSL_ERROR_WANT_WRITE:
                     set_ewouldblock();
@@ -5559,45 +8442,206 @@ static int do_ssl_write(conn *c, char *dest, size_t nbytes) {
 }
 
 
-static int do_data_sendmsg(conn *c, struct msghdr *m) {
-    int res;
-    if (c->ssl.enabled) {
-        int ii;
-        res = 0;
-        for (ii = 0; ii < m->msg_iovlen; ++ii) {
-            int n = do_ssl_write(c,
-                                 m->msg_iov[ii].iov_base,
-                                 m->msg_iov[ii].iov_len);
-            if (n > 0) {
-                res += n;
-            } else {
-                return res > 0 ? res : -1;
-            }
-        }
+#ifdef HAVE_MSG_ZEROCOPY
+/*
+ * May the response be sent with MSG_ZEROCOPY? Only if the memory we send
+ * from is pinned items (temp allocations are freed as soon as we're done
+ * with the msghdr list), and we have room to keep them pinned.
+ */
+static bool conn_want_zerocopy(conn *c) {
+    return c->zerocopy.enabled && c->state == conn_mwrite &&
+        c->stream == NULL &&
+        c->ileft > 0 && c->temp_alloc_left == 0 &&
+        c->zerocopy.npins + c->ileft <= ZEROCOPY_MAX_PINS &&
+        (settings.max_pinned_items == 0 ||
+         c->zerocopy.npins + c->ileft <= (int)settings.max_pinned_items);
+}
 
-        /* @todo figure out how to drain the rest of the data if we
-         * failed to send all of it...
-         */
-        drain_bio_send_pipe(c);
-        return res;
-    } else {
-        res = sendmsg(c->sfd, m, 0);
+/*
+ * Send the next run of iovecs, using MSG_ZEROCOPY for the big ones (the
+ * item values). The small ones are copied since the response headers
+ * live in connection buffers which are reused right away. transmit()
+ * calls us again for the rest of the msghdr.
+ */
+static ssize_t do_zerocopy_sendmsg(conn *c, struct msghdr *m, int flags) {
+    struct msghdr part = *m;
+    bool big = m->msg_iov[0].iov_len >= settings.zerocopy_threshold;
+    int more = flags;
+    ssize_t res;
+
+    part.msg_iovlen = 1;
+    while (part.msg_iovlen < m->msg_iovlen &&
+           (m->msg_iov[part.msg_iovlen].iov_len >= settings.zerocopy_threshold) == big) {
+        part.msg_iovlen++;
+    }
+    if (part.msg_iovlen < m->msg_iovlen) {
+        more = MSG_MORE;
+    }
+
+    if (!big) {
+        return sendmsg(c->sfd, &part, more);
     }
 
+    res = sendmsg(c->sfd, &part, MSG_ZEROCOPY | more);
+    if (res >= 0) {
+        /* The kernel numbers the zero copy sends from 0 */
+        c->zerocopy.next++;
+        c->zerocopy.used = true;
+        STATS_NOKEY(c, zerocopy_sends);
+    } else if (errno == ENOBUFS) {
+        /* Out of option memory to track the pages, just copy them */
+        res = sendmsg(c->sfd, &part, more);
+    }
     return res;
 }
+#endif
 
 /*
- * read from network as much as we can, handle buffer overflow and connection
- * close.
- * before reading, move the remaining incomplete fragment of a command
- * (if any) to the beginning of the buffer.
- *
- * To protect us from someone flooding a connection with bogus data causing
- * the connection to eat up all available memory, break out and start looking
- * at the data I've got after a number of reallocs...
- *
- * @return enum try_read_result
+ * Read the zero copy completions off the socket error queue and release
+ * the items which no longer are referenced by the kernel. TCP completes
+ * the sends in order, so (with wrapping) all ids below zerocopy.done are
+ * done.
+ */
+static void conn_reap_zerocopy(conn *c) {
+#ifdef HAVE_MSG_ZEROCOPY
+    int ii;
+
+    while (c->zerocopy.next != c->zerocopy.done) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg;
+        struct cmsghdr *cm;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c->sfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            break;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr;
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            /* ee_info .. ee_data is the (inclusive) range of completed ids */
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                STATS_ADD(c, zerocopy_copied, serr->ee_data - serr->ee_info + 1);
+            }
+            if ((int32_t)(serr->ee_data + 1 - c->zerocopy.done) > 0) {
+                c->zerocopy.done = serr->ee_data + 1;
+            }
+        }
+    }
+
+    for (ii = 0; ii < c->zerocopy.npins &&
+             (int32_t)(c->zerocopy.pins[ii].id - c->zerocopy.done) < 0; ++ii) {
+        settings.engine.v1->release(settings.engine.v0, c,
+                                    c->zerocopy.pins[ii].item);
+    }
+    if (ii > 0) {
+        c->zerocopy.npins -= ii;
+        memmove(c->zerocopy.pins, c->zerocopy.pins + ii,
+                sizeof(c->zerocopy.pins[0]) * c->zerocopy.npins);
+    }
+#else
+    (void)c;
+#endif
+}
+
+/*
+ * Release the items referenced by the msghdr list we just sent. If any
+ * of it was sent with MSG_ZEROCOPY the kernel may still be reading the
+ * item memory, so they stay pinned until the last send is completed.
+ */
+static void conn_release_items(conn *c) {
+    if (c->zerocopy.used) {
+        /* conn_want_zerocopy() made sure there is room */
+        while (c->ileft > 0) {
+            struct zerocopy_pin *pin = &c->zerocopy.pins[c->zerocopy.npins++];
+            pin->item = *(c->icurr);
+            pin->id = c->zerocopy.next - 1;
+            c->icurr++;
+            c->ileft--;
+        }
+        c->zerocopy.used = false;
+        conn_reap_zerocopy(c);
+    } else if (settings.engine.v1->release_multi != NULL &&
+               c->thread != NULL && c->thread->type != DISPATCHER) {
+        /* With the ones of the other commands run in this pass */
+        LIBEVENT_THREAD *me = c->thread;
+        while (c->ileft > 0) {
+            if (me->releases.cookie != c ||
+                me->releases.count == RELEASE_BATCH_SIZE) {
+                thread_flush_releases(me);
+                me->releases.cookie = c;
+            }
+            me->releases.items[me->releases.count++] = *(c->icurr);
+            c->icurr++;
+            c->ileft--;
+        }
+    } else {
+        while (c->ileft > 0) {
+            item *it = *(c->icurr);
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            c->icurr++;
+            c->ileft--;
+        }
+    }
+}
+
+/*
+ * flags is MSG_MORE if more of the response follows this msghdr, which
+ * only matters to plain TCP (the kernel then holds a partial segment
+ * back for what comes next).
+ */
+static int do_data_sendmsg(conn *c, struct msghdr *m, int flags) {
+    int res;
+    if (c->ssl != NULL) {
+        int ii;
+        res = 0;
+        for (ii = 0; ii < m->msg_iovlen; ++ii) {
+            int n = do_ssl_write(c,
+                                 m->msg_iov[ii].iov_base,
+                                 m->msg_iov[ii].iov_len);
+            if (n > 0) {
+                res += n;
+            } else {
+                return res > 0 ? res : -1;
+            }
+        }
+
+        return res;
+    } else if (conn_shm_active(c)) {
+        res = conn_shm_sendmsg(c, m);
+    } else {
+#ifdef HAVE_MSG_ZEROCOPY
+        if (conn_want_zerocopy(c)) {
+            return (int)do_zerocopy_sendmsg(c, m, flags);
+        }
+#endif
+        res = sendmsg(c->sfd, m, flags);
+    }
+
+    return res;
+}
+
+/*
+ * read from network as much as we can, handle buffer overflow and connection
+ * close.
+ * before reading, move the remaining incomplete fragment of a command
+ * (if any) to the beginning of the buffer.
+ *
+ * To protect us from someone flooding a connection with bogus data causing
+ * the connection to eat up all available memory, break out and start looking
+ * at the data I've got after a number of reallocs...
+ *
+ * @return enum try_read_result
  */
 static enum try_read_result try_read_network(conn *c) {
     enum try_read_result gotdata = READ_NO_DATA_RECEIVED;
@@ -5605,10 +8649,9 @@ static enum try_read_result try_read_network(conn *c) {
     int num_allocs = 0;
     cb_assert(c != NULL);
 
-    if (c->read.curr != c->read.buf) {
-        if (c->read.bytes != 0) /* otherwise there's nothing to copy */
-            memmove(c->read.buf, c->read.curr, c->read.bytes);
-        c->read.curr = c->read.buf;
+    if (c->read.curr != c->read.buf &&
+        (c->read.bytes == 0 || conn_read_tail(c) < conn_read_wanted(c))) {
+        conn_repack_read(c);
     }
 
     while (1) {
@@ -5619,15 +8662,15 @@ static enum try_read_result try_read_network(conn *c) {
         int error;
 #endif
 
+        if (conn_read_tail(c) == 0 && c->read.curr != c->read.buf) {
+            conn_repack_read(c);
+        }
         if (c->read.bytes >= c->read.size) {
-            char *new_rbuf;
-
             if (num_allocs == 4) {
                 return gotdata;
             }
             ++num_allocs;
-            new_rbuf = realloc(c->read.buf, c->read.size * 2);
-            if (!new_rbuf) {
+            if (!thread_buffer_resize(c->thread, &c->read, c->read.size * 2)) {
                 if (settings.verbose > 0) {
                     settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
                                                     "Couldn't realloc input buffer\n");
@@ -5636,12 +8679,10 @@ static enum try_read_result try_read_network(conn *c) {
                 conn_set_state(c, conn_closing);
                 return READ_MEMORY_ERROR;
             }
-            c->read.curr = c->read.buf = new_rbuf;
-            c->read.size *= 2;
         }
 
-        avail = c->read.size - c->read.bytes;
-        res = do_data_recv(c, c->read.buf + c->read.bytes, avail);
+        avail = conn_read_tail(c);
+        res = do_data_recv(c, c->read.curr + c->read.bytes, avail);
         if (res > 0) {
             STATS_ADD(c, bytes_read, res);
             gotdata = READ_DATA_RECEIVED;
@@ -5680,6 +8721,30 @@ bool register_event(conn *c, struct timeval *timeout) {
     cb_assert(!c->registered_in_libevent);
     cb_assert(c->sfd != INVALID_SOCKET);
 
+#ifdef HAVE_IO_URING
+    if (c->uring.enabled) {
+        /*
+         * Unless it fell back to polling, c->event is set up without
+         * EV_READ and the reads come from the multishot receive.
+         */
+        bool poll = c->uring.fallback || (c->ev_flags & EV_WRITE);
+        if (poll && event_add(&c->event, timeout) == -1) {
+            log_system_error(EXTENSION_LOG_WARNING,
+                             NULL,
+                             "Failed to add connection to libevent: %s");
+            return false;
+        }
+        if ((c->ev_flags & EV_READ) && !conn_uring_want_read(c)) {
+            if (poll) {
+                event_del(&c->event);
+            }
+            return false;
+        }
+        c->registered_in_libevent = true;
+        return true;
+    }
+#endif
+
     if (event_add(&c->event, timeout) == -1) {
         log_system_error(EXTENSION_LOG_WARNING,
                          NULL,
@@ -5696,6 +8761,8 @@ bool unregister_event(conn *c) {
     cb_assert(c->registered_in_libevent);
     cb_assert(c->sfd != INVALID_SOCKET);
 
+    /* Also drops a pending event_active() from the io_uring completions */
+    c->uring.want_read = false;
     if (event_del(&c->event) == -1) {
         log_system_error(EXTENSION_LOG_WARNING,
                          NULL,
@@ -5714,7 +8781,7 @@ bool update_event(conn *c, const int new_flags) {
     cb_assert(c != NULL);
     base = c->event.ev_base;
 
-    if (c->ssl.enabled && c->ssl.connected && (new_flags & EV_READ)) {
+    if (c->ssl != NULL && c->ssl->connected && (new_flags & EV_READ)) {
         /*
          * If we want more data and we have SSL, that data might be inside
          * SSL's internal buffers rather than inside the socket buffer. In
@@ -5723,7 +8790,7 @@ bool update_event(conn *c, const int new_flags) {
          */
         char dummy;
         /* SSL_pending() will not work here despite the name */
-        int rv = SSL_peek(c->ssl.client, &dummy, 1);
+        int rv = SSL_peek(c->ssl->client, &dummy, 1);
         if (rv > 0) {
             /* signal a call to the handler */
             event_active(&c->event, EV_READ, 0);
@@ -5732,6 +8799,16 @@ bool update_event(conn *c, const int new_flags) {
     }
 
     if (c->ev_flags == new_flags) {
+#ifdef HAVE_IO_URING
+        /*
+         * The multishot receive may have terminated since it was armed,
+         * or left queued data the socket won't signal any more.
+         */
+        if (c->uring.enabled && (new_flags & EV_READ) &&
+            c->registered_in_libevent) {
+            return conn_uring_want_read(c);
+        }
+#endif
         return true;
     }
 
@@ -5749,7 +8826,10 @@ bool update_event(conn *c, const int new_flags) {
         return false;
     }
 
-    event_set(&c->event, c->sfd, new_flags, event_handler, (void *)c);
+    event_set(&c->event, c->sfd,
+              (c->uring.enabled && !c->uring.fallback) ?
+                  new_flags & ~EV_READ : new_flags,
+              event_handler, (void *)c);
     event_base_set(base, &c->event);
     c->ev_flags = new_flags;
 
@@ -5764,6 +8844,117 @@ bool update_event(conn *c, const int new_flags) {
     return true;
 }
 
+/*
+ * transmit() for a connection with stream compression (see
+ * stream_compression.h): the msghdrs are fed to the compressor, and
+ * what it produced is sent before it gets any more, so the output buffer
+ * is all the memory it takes. The batch is complete once all of it went
+ * in, the stream was flushed and the flushed bytes are sent.
+ */
+static enum transmit_result transmit_compressed(conn *c) {
+    uint64_t in_before, out_before, in_after, out_after;
+    enum transmit_result ret = TRANSMIT_INCOMPLETE;
+    size_t nbytes;
+    const char *pending = stream_compressor_pending(c->stream, &nbytes);
+
+    if (pending != NULL) {
+        struct msghdr m;
+        struct iovec iov;
+        ssize_t res;
+#ifdef WIN32
+        DWORD error;
+#else
+        int error;
+#endif
+
+        iov.iov_base = (void*)pending;
+        iov.iov_len = nbytes;
+        memset(&m, 0, sizeof(m));
+        m.msg_iov = &iov;
+        m.msg_iovlen = 1;
+        res = do_data_sendmsg(c, &m, 0);
+#ifdef WIN32
+        error = WSAGetLastError();
+#else
+        error = errno;
+#endif
+        if (res > 0) {
+            STATS_ADD(c, bytes_written, res);
+            if (c->phase.active && c->phase.done != 0 &&
+                c->phase.first_byte == 0) {
+                c->phase.first_byte = gethrtime();
+            }
+            stream_compressor_sent(c->stream, (size_t)res);
+            return TRANSMIT_INCOMPLETE;
+        }
+        if (res == -1 && is_blocking(error)) {
+            short which = conn_shm_active(c) ? EV_READ : EV_WRITE;
+            if (!update_event(c, which | EV_PERSIST)) {
+                conn_set_state(c, conn_closing);
+                return TRANSMIT_HARD_ERROR;
+            }
+            return TRANSMIT_SOFT_ERROR;
+        }
+        if (res == -1) {
+            log_socket_error(EXTENSION_LOG_WARNING, c,
+                             "Failed to write, and not due to blocking: %s");
+        }
+        conn_set_state(c, conn_closing);
+        return TRANSMIT_HARD_ERROR;
+    }
+
+    stream_compressor_totals(c->stream, &in_before, &out_before);
+    while (c->msgcurr < c->msgused) {
+        struct msghdr *m = &c->msglist[c->msgcurr];
+        size_t consumed;
+
+        if (m->msg_iovlen == 0) {
+            c->msgcurr++;
+            continue;
+        }
+        if (m->msg_iov->iov_len == 0) {
+            m->msg_iovlen--;
+            m->msg_iov++;
+            continue;
+        }
+
+        consumed = m->msg_iov->iov_len;
+        if (!stream_compressor_compress(c->stream, m->msg_iov->iov_base,
+                                        &consumed)) {
+            ret = TRANSMIT_HARD_ERROR;
+            break;
+        }
+        m->msg_iov->iov_base = (char*)m->msg_iov->iov_base + consumed;
+        m->msg_iov->iov_len -= consumed;
+        if (m->msg_iov->iov_len > 0) {
+            /* The output buffer is full, send it first */
+            break;
+        }
+    }
+
+    if (ret == TRANSMIT_INCOMPLETE && c->msgcurr == c->msgused) {
+        bool done;
+        if (!stream_compressor_flush(c->stream, &done)) {
+            ret = TRANSMIT_HARD_ERROR;
+        } else if (done &&
+                   stream_compressor_pending(c->stream, &nbytes) == NULL) {
+            ret = TRANSMIT_COMPLETE;
+        }
+    }
+
+    stream_compressor_totals(c->stream, &in_after, &out_after);
+    STATS_ADD(c, stream_compress_in, in_after - in_before);
+    STATS_ADD(c, stream_compress_out, out_after - out_before);
+
+    if (ret == TRANSMIT_HARD_ERROR) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "%d: Failed to compress the stream, "
+                                        "closing connection", c->sfd);
+        conn_set_state(c, conn_closing);
+    }
+    return ret;
+}
+
 /*
  * Transmit the next chunk of data from our list of msgbuf structures.
  *
@@ -5776,6 +8967,10 @@ bool update_event(conn *c, const int new_flags) {
 static enum transmit_result transmit(conn *c) {
     cb_assert(c != NULL);
 
+    if (c->stream_active) {
+        return transmit_compressed(c);
+    }
+
     while (c->msgcurr < c->msgused &&
            c->msglist[c->msgcurr].msg_iovlen == 0) {
         /* Finished writing the current msg; advance to the next. */
@@ -5790,8 +8985,31 @@ static enum transmit_result transmit(conn *c) {
 #endif
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
+        struct msghdr gathered;
+        int flags = 0;
+
+        if (c->ssl == NULL && !conn_shm_active(c)) {
+            int last = c->msgcurr;
+            if (settings.gather_writes) {
+                /* What is left of the msghdrs is contiguous in c->iov */
+                gathered = *m;
+                while (last + 1 < c->msgused &&
+                       gathered.msg_iov + gathered.msg_iovlen ==
+                           c->msglist[last + 1].msg_iov &&
+                       gathered.msg_iovlen +
+                           c->msglist[last + 1].msg_iovlen <= IOV_MAX) {
+                    gathered.msg_iovlen += c->msglist[++last].msg_iovlen;
+                }
+                if (last > c->msgcurr) {
+                    m = &gathered;
+                }
+            }
+            if (last + 1 < c->msgused) {
+                flags = MSG_MORE;
+            }
+        }
 
-        res = do_data_sendmsg(c, m);
+        res = do_data_sendmsg(c, m, flags);
 #ifdef WIN32
         error = WSAGetLastError();
 #else
@@ -5799,13 +9017,26 @@ static enum transmit_result transmit(conn *c) {
 #endif
         if (res > 0) {
             STATS_ADD(c, bytes_written, res);
+            if (c->phase.active && c->phase.done != 0 &&
+                c->phase.first_byte == 0) {
+                c->phase.first_byte = gethrtime();
+            }
 
             /* We've written some of the data. Remove the completed
                iovec entries from the list of pending writes. */
-            while (m->msg_iovlen > 0 && res >= m->msg_iov->iov_len) {
-                res -= (ssize_t)m->msg_iov->iov_len;
-                m->msg_iovlen--;
-                m->msg_iov++;
+            m = &c->msglist[c->msgcurr];
+            for (;;) {
+                while (m->msg_iovlen > 0 && res >= m->msg_iov->iov_len) {
+                    res -= (ssize_t)m->msg_iov->iov_len;
+                    m->msg_iovlen--;
+                    m->msg_iov++;
+                }
+                if (m->msg_iovlen > 0 || res == 0 ||
+                    c->msgcurr + 1 == c->msgused) {
+                    break;
+                }
+                /* Sent gathered with the next ones */
+                m = &c->msglist[++c->msgcurr];
             }
 
             /* Might have written just part of the last iovec entry;
@@ -5818,7 +9049,9 @@ static enum transmit_result transmit(conn *c) {
         }
 
         if (res == -1 && is_blocking(error)) {
-            if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+            /* The client rings the doorbell when its ring has room */
+            short which = conn_shm_active(c) ? EV_READ : EV_WRITE;
+            if (!update_event(c, which | EV_PERSIST)) {
                 conn_set_state(c, conn_closing);
                 return TRANSMIT_HARD_ERROR;
             }
@@ -5847,17 +9080,6 @@ static enum transmit_result transmit(conn *c) {
         conn_set_state(c, conn_closing);
         return TRANSMIT_HARD_ERROR;
     } else {
-        if (c->ssl.enabled) {
-            drain_bio_send_pipe(c);
-            if (c->ssl.out.total) {
-                if (!update_event(c, EV_WRITE | EV_PERSIST)) {
-                    conn_set_state(c, conn_closing);
-                    return TRANSMIT_HARD_ERROR;
-                }
-                return TRANSMIT_SOFT_ERROR;
-            }
-        }
-
         return TRANSMIT_COMPLETE;
     }
 }
@@ -5889,7 +9111,7 @@ bool conn_listening(conn *c)
                                             "Too many open files. Current limit: %d\n",
                                             limit.rlim_cur);
 #endif
-            disable_listen();
+            disable_listen(c);
         } else if (!is_blocking(error)) {
             log_socket_error(EXTENSION_LOG_WARNING, c,
                              "Failed to accept new client: %s");
@@ -5929,8 +9151,14 @@ bool conn_listening(conn *c)
         return false;
     }
 
-    dispatch_conn_new(sfd, c->parent_port, conn_new_cmd, EV_READ | EV_PERSIST,
-                      DATA_BUFFER_SIZE);
+    if (c->thread != NULL) {
+        /* Our own SO_REUSEPORT listener; serve the connection right here */
+        accept_conn_new(c->thread, sfd, c->parent_port, conn_new_cmd,
+                        EV_READ | EV_PERSIST, DATA_BUFFER_SIZE);
+    } else {
+        dispatch_conn_new(sfd, c->parent_port, conn_new_cmd,
+                          EV_READ | EV_PERSIST, DATA_BUFFER_SIZE);
+    }
 
     return false;
 }
@@ -5979,7 +9207,10 @@ bool conn_ship_log(conn *c) {
         --c->nevents;
         if (c->nevents >= 0) {
             c->ewouldblock = false;
-            if (c->dcp) {
+            if (c->dcp && dcp_flow_blocked(c)) {
+                /* Wait for the consumer to acknowledge what it got */
+                c->ewouldblock = true;
+            } else if (c->dcp) {
                 ship_dcp_log(c);
             } else {
                 ship_tap_log(c);
@@ -6000,6 +9231,20 @@ bool conn_ship_log(conn *c) {
 }
 
 bool conn_waiting(conn *c) {
+    if (c->unordered.failed) {
+        if (!conn_flush_coalesced(c, conn_closing)) {
+            conn_set_state(c, conn_closing);
+        }
+        return true;
+    }
+    if (conn_flush_coalesced(c, conn_waiting)) {
+        return true;
+    }
+    if (conn_shm_poll(c)) {
+        /* More requests in the ring, no need to wait for the doorbell */
+        conn_set_state(c, conn_read);
+        return true;
+    }
     if (!update_event(c, EV_READ | EV_PERSIST)) {
         conn_set_state(c, conn_closing);
         return true;
@@ -6009,7 +9254,14 @@ bool conn_waiting(conn *c) {
 }
 
 bool conn_read(conn *c) {
-    int res = try_read_network(c);
+    int res;
+
+    /* Completions on the error queue wake us up as well */
+    if (c->zerocopy.next != c->zerocopy.done) {
+        conn_reap_zerocopy(c);
+    }
+
+    res = try_read_network(c);
     switch (res) {
     case READ_NO_DATA_RECEIVED:
         conn_set_state(c, conn_waiting);
@@ -6029,6 +9281,12 @@ bool conn_read(conn *c) {
 }
 
 bool conn_parse_cmd(conn *c) {
+    if (c->unordered.failed) {
+        if (!conn_flush_coalesced(c, conn_closing)) {
+            conn_set_state(c, conn_closing);
+        }
+        return true;
+    }
     if (try_read_command(c) == 0) {
         /* wee need more data! */
         conn_set_state(c, conn_waiting);
@@ -6037,8 +9295,80 @@ bool conn_parse_cmd(conn *c) {
     return !c->ewouldblock;
 }
 
+/*
+ * Output backpressure (see the "max_unsent_bytes" setting). The bytes of
+ * the responses of the connection not sent yet: the ones held back, and
+ * the ones in the socket the kernel didn't send (the client didn't make
+ * room for them). With TCP_NOTSENT_LOWAT set to the limit the socket only
+ * polls writable once they're below it.
+ */
+static uint32_t conn_unsent_bytes(conn *c) {
+    uint32_t bytes = c->coalesce.buf.bytes + c->unordered.buf.bytes;
+#ifdef HAVE_SIOCOUTQNSD
+    int unsent;
+    if (ioctl(c->sfd, SIOCOUTQNSD, &unsent) == 0 && unsent > 0) {
+        bytes += (uint32_t)unsent;
+    }
+#endif
+    return bytes;
+}
+
+/*
+ * Returns true if c may not start its next command before its client
+ * read some of the responses, after setting it up to be run again when
+ * the socket is writable (the state machine stops).
+ */
+static bool conn_output_throttled(conn *c) {
+    uint32_t limit = settings.max_unsent_bytes;
+
+    if (limit == 0 || c->dcp || c->tap_iterator != NULL ||
+        conn_unsent_bytes(c) <= limit) {
+        c->throttle.active = false;
+        return false;
+    }
+
+    if (!c->throttle.active) {
+        c->throttle.active = true;
+        STATS_NOKEY(c, conns_throttled);
+    }
+#if defined(HAVE_SIOCOUTQNSD) && defined(TCP_NOTSENT_LOWAT)
+    if (c->throttle.lowat != limit) {
+        int lowat = (int)limit;
+        if (setsockopt(c->sfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                       (void*)&lowat, sizeof(lowat)) == 0) {
+            c->throttle.lowat = limit;
+        }
+    }
+#endif
+    if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+        conn_set_state(c, conn_closing);
+        c->throttle.active = false;
+        return false;
+    }
+    return true;
+}
+
 bool conn_new_cmd(conn *c) {
+    if (c->unordered.parent != NULL) {
+        return conn_unordered_complete(c);
+    }
     c->start = 0;
+    c->phase.active = false;
+
+    if (settings.max_unsent_bytes != 0) {
+        /* The held back responses go first, they're ours to send */
+        if ((c->coalesce.buf.bytes > 0 || c->unordered.buf.bytes > 0) &&
+            conn_unsent_bytes(c) > settings.max_unsent_bytes &&
+            conn_flush_coalesced(c, conn_new_cmd)) {
+            return true;
+        }
+        if (conn_output_throttled(c)) {
+            return false;
+        }
+        if (c->state != conn_new_cmd) {
+            return true;
+        }
+    }
     --c->nevents;
 
     /*
@@ -6049,6 +9379,9 @@ bool conn_new_cmd(conn *c) {
     if (c->nevents >= 0) {
         reset_cmd_handler(c);
     } else {
+        if (conn_flush_coalesced(c, conn_new_cmd)) {
+            return true;
+        }
         STATS_NOKEY(c, conn_yields);
 
         /*
@@ -6061,9 +9394,9 @@ bool conn_new_cmd(conn *c) {
          */
         int block = (c->read.bytes > 0);
 
-        if (c->ssl.enabled) {
+        if (c->ssl != NULL) {
             char dummy;
-            block |= SSL_peek(c->ssl.client, &dummy, 1);
+            block |= SSL_peek(c->ssl->client, &dummy, 1);
         }
         /*
          * DCP and TAP connections is different from normal
@@ -6071,6 +9404,7 @@ bool conn_new_cmd(conn *c) {
          * the other end so that they'll _have_ to wait for a write event.
          */
         block |= c->dcp || (c->tap_iterator != NULL);
+        block |= conn_shm_active(c) && conn_shm_poll(c);
 
         if (block) {
             if (!update_event(c, EV_WRITE | EV_PERSIST)) {
@@ -6094,10 +9428,27 @@ bool conn_nread(conn *c) {
 
     if (c->rlbytes == 0) {
         bool block = c->ewouldblock = false;
+        if (!conn_unordered_may_run(c)) {
+            /* Run again once the children are done (see conn::unordered) */
+            c->unordered.blocked = true;
+            unregister_event(c);
+            return false;
+        }
+        c->unordered.blocked = false;
         complete_nread(c);
         if (c->ewouldblock) {
-            unregister_event(c);
+            if (c->unordered.enabled) {
+                conn_unordered_dispatch(c);
+            }
+            if (c->unordered.parent == NULL) {
+                unregister_event(c);
+            }
             block = true;
+        } else if (c->unordered.skip > 0) {
+            /* The children executed the commands following this one */
+            c->read.curr += c->unordered.skip;
+            c->read.bytes -= c->unordered.skip;
+            c->unordered.skip = 0;
         }
         return !block;
     }
@@ -6166,6 +9517,18 @@ bool conn_write(conn *c) {
      * list for TCP).
      */
     if (c->iovused == 0) {
+        c->coalesce.sending = false;
+        if (c->coalesce.buf.bytes > 0) {
+            c->coalesce.queued = true;
+            if (add_iov(c, c->coalesce.buf.buf, c->coalesce.buf.bytes) != 0) {
+                conn_set_state(c, conn_closing);
+                return true;
+            }
+        }
+        if (add_unordered_iov(c) != 0) {
+            conn_set_state(c, conn_closing);
+            return true;
+        }
         if (add_iov(c, c->write.curr, c->write.bytes) != 0) {
             if (settings.verbose > 0) {
                 settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
@@ -6179,42 +9542,494 @@ bool conn_write(conn *c) {
     return conn_mwrite(c);
 }
 
-bool conn_mwrite(conn *c) {
-    switch (transmit(c)) {
-    case TRANSMIT_COMPLETE:
-        if (c->state == conn_mwrite) {
-            while (c->ileft > 0) {
-                item *it = *(c->icurr);
-                settings.engine.v1->release(settings.engine.v0, c, it);
-                c->icurr++;
-                c->ileft--;
-            }
-            while (c->temp_alloc_left > 0) {
-                char *temp_alloc_ = *(c->temp_alloc_curr);
-                free(temp_alloc_);
-                c->temp_alloc_curr++;
-                c->temp_alloc_left--;
-            }
-            /* XXX:  I don't know why this wasn't the general case */
-            conn_set_state(c, c->write_and_go);
-        } else if (c->state == conn_write) {
-            if (c->write_and_free) {
-                free(c->write_and_free);
-                c->write_and_free = 0;
-            }
-            conn_set_state(c, c->write_and_go);
-        } else {
-            if (settings.verbose > 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
-                                                "Unexpected state %d\n", c->state);
-            }
-            conn_set_state(c, conn_closing);
-        }
-        break;
-
-    case TRANSMIT_INCOMPLETE:
-    case TRANSMIT_HARD_ERROR:
-        break;                   /* Continue in state machine. */
+static void conn_release_temp_allocs(conn *c) {
+    while (c->temp_alloc_left > 0) {
+        char *temp_alloc_ = *(c->temp_alloc_curr);
+        free(temp_alloc_);
+        c->temp_alloc_curr++;
+        c->temp_alloc_left--;
+    }
+}
+
+/*
+ * Response coalescing (see the "response_coalescing_usec" setting). While
+ * the next pipelined command is already buffered, a small response is
+ * copied into c->coalesce.buf instead of being sent. The held back
+ * responses go out as the first iovec of a later response, or on their own
+ * once the connection runs out of buffered commands (conn_waiting), yields
+ * to the other connections (conn_new_cmd) or blocks in the engine
+ * (conn_coalesce_send()). No response is held back past the deadline.
+ */
+/* add_iov() may have split the queued responses over several iovecs */
+static bool coalesce_queued_iov(const conn *c, const struct iovec *iov) {
+    const char *ptr = iov->iov_base;
+    return c->coalesce.queued && ptr >= c->coalesce.buf.buf &&
+        ptr < c->coalesce.buf.buf + c->coalesce.buf.bytes;
+}
+
+static bool conn_coalesce_response(conn *c) {
+    struct net_buf *buf = &c->coalesce.buf;
+    size_t total = 0;
+    int ii;
+
+    if (settings.response_coalescing_usec == 0 ||
+        c->write_and_go != conn_new_cmd || c->msgcurr != 0 ||
+        c->nevents <= 0 ||
+        c->read.bytes < sizeof(protocol_binary_request_header) ||
+        c->ssl != NULL || c->dcp || c->tap_iterator != NULL ||
+        c->protocol == PROTOCOL_GREENSTACK ||
+        c->unordered.buf.bytes > 0 || c->unordered.sending.buf != NULL ||
+        (c->stream != NULL && !c->stream_active)) {
+        return false;
+    }
+
+    if (buf->bytes > 0 && conn_clock(c) - c->coalesce.since >=
+        (hrtime_t)settings.response_coalescing_usec * 1000) {
+        return false;
+    }
+
+    for (ii = 0; ii < c->msgused; ++ii) {
+        const struct msghdr *m = &c->msglist[ii];
+        size_t jj;
+        for (jj = 0; jj < (size_t)m->msg_iovlen; ++jj) {
+            if (!coalesce_queued_iov(c, &m->msg_iov[jj])) {
+                total += m->msg_iov[jj].iov_len;
+            }
+        }
+    }
+
+    if (total == 0 || total > COALESCE_MAX_RESPONSE ||
+        buf->bytes + total > COALESCE_BUFFER_SIZE) {
+        return false;
+    }
+
+    if (buf->buf == NULL &&
+        !thread_buffer_alloc(c->thread, buf, COALESCE_BUFFER_SIZE)) {
+        return false;
+    }
+    if (buf->bytes == 0) {
+        c->coalesce.since = conn_clock(c);
+    }
+
+    for (ii = 0; ii < c->msgused; ++ii) {
+        const struct msghdr *m = &c->msglist[ii];
+        size_t jj;
+        for (jj = 0; jj < (size_t)m->msg_iovlen; ++jj) {
+            const struct iovec *iov = &m->msg_iov[jj];
+            if (!coalesce_queued_iov(c, iov)) {
+                memcpy(buf->buf + buf->bytes, iov->iov_base, iov->iov_len);
+                buf->bytes += (uint32_t)iov->iov_len;
+            }
+        }
+    }
+    c->coalesce.queued = false;
+    STATS_NOKEY(c, responses_coalesced);
+
+    conn_release_items(c);
+    conn_release_temp_allocs(c);
+    conn_set_state(c, c->write_and_go);
+    return true;
+}
+
+/*
+ * Sends the held back responses on their own, and continues in state next
+ * once they're out. Returns false if there is nothing to send.
+ */
+static bool conn_flush_coalesced(conn *c, STATE_FUNC next) {
+    if (c->coalesce.buf.bytes == 0 && c->unordered.buf.bytes == 0) {
+        return false;
+    }
+
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    c->coalesce.queued = false;
+    if (add_msghdr(c) != 0) {
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+    if (c->coalesce.buf.bytes > 0) {
+        if (add_iov(c, c->coalesce.buf.buf, c->coalesce.buf.bytes) != 0) {
+            conn_set_state(c, conn_closing);
+            return true;
+        }
+        c->coalesce.queued = true;
+    }
+    if (add_unordered_iov(c) != 0) {
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+    c->coalesce.sending = false;
+    c->write_and_go = next;
+    conn_set_state(c, conn_mwrite);
+    return true;
+}
+
+/* Returns true once all of buf is sent */
+static bool conn_send_held_back(conn *c, struct net_buf *buf) {
+    ssize_t nw;
+
+    if (buf->bytes == 0) {
+        return true;
+    }
+
+    nw = send(c->sfd, buf->buf, buf->bytes, 0);
+    if (nw > 0) {
+        STATS_ADD(c, bytes_written, nw);
+        buf->bytes -= (uint32_t)nw;
+        memmove(buf->buf, buf->buf + nw, buf->bytes);
+        if (buf->bytes == 0) {
+            thread_buffer_release(c->thread, buf);
+            return true;
+        }
+    }
+    return false;
+}
+
+void conn_coalesce_send(conn *c) {
+    if (c->coalesce.queued || c->ssl != NULL) {
+        return;
+    }
+
+    /* The children only ran after the responses held back were queued */
+    if (conn_send_held_back(c, &c->coalesce.buf) &&
+        c->unordered.sending.buf == NULL) {
+        conn_send_held_back(c, &c->unordered.buf);
+    }
+}
+
+/*
+ * Unordered execution (PROTOCOL_BINARY_FEATURE_UNORDERED_EXECUTION). When a
+ * command blocks in the engine, the complete commands already received
+ * behind it are copied to child connections and executed there (up to the
+ * "max_outstanding_commands" setting at a time). The input is only
+ * consumed past them once the blocked command completes. The responses of
+ * the children are copied to c->unordered.buf, which is sent right away
+ * while the connection is still blocked, and otherwise goes out in front
+ * of its next response. Only the plain data commands run out of order, and
+ * not if they use the same key as a command which is still running: any
+ * other command waits for all of the children to complete first.
+ */
+static bool unordered_command(uint8_t opcode) {
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+    case PROTOCOL_BINARY_CMD_GET_RANGE:
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* The key of a packet in host byte order (which must hold the key) */
+static const char *unordered_key(const protocol_binary_request_header *req,
+                                 const char *packet) {
+    return packet + sizeof(req->bytes) + req->request.extlen;
+}
+
+static bool unordered_key_busy(const conn *c, const char *key, uint16_t nkey) {
+    const conn *child;
+    for (child = c->unordered.children; child != NULL;
+         child = child->unordered.next) {
+        if (child->binary_header.request.keylen == nkey &&
+            memcmp(unordered_key(&child->binary_header, child->read.buf),
+                   key, nkey) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Can the command in c->binary_header run with the children running? */
+static bool conn_unordered_may_run(const conn *c) {
+    const protocol_binary_request_header *req = &c->binary_header;
+    const char *packet;
+
+    if (c->unordered.outstanding == 0) {
+        return true;
+    }
+    if (req->request.magic != PROTOCOL_BINARY_REQ ||
+        !unordered_command(req->request.opcode) ||
+        (uint32_t)req->request.extlen + req->request.keylen >
+            req->request.bodylen) {
+        return false;
+    }
+
+    packet = c->read.curr - (req->request.bodylen + sizeof(req->bytes));
+    return !unordered_key_busy(c, unordered_key(req, packet),
+                               req->request.keylen);
+}
+
+/*
+ * Start the commands following the blocked one on children. They were
+ * admitted by the same checks (dispatch_bin_command()) as the blocked
+ * command, and the outcome of these doesn't change while it is blocked.
+ */
+static void conn_unordered_dispatch(conn *c) {
+    const protocol_binary_request_header *blocked = &c->binary_header;
+    const char *packet = c->read.curr - (blocked->request.bodylen +
+                                         sizeof(blocked->bytes));
+    const char *blocked_key = unordered_key(blocked, packet);
+
+    if (blocked->request.magic != PROTOCOL_BINARY_REQ ||
+        !unordered_command(blocked->request.opcode) ||
+        c->dcp || c->tap_iterator != NULL) {
+        return;
+    }
+
+    while (!c->unordered.failed &&
+           c->unordered.outstanding < (int)settings.max_outstanding_commands &&
+           c->read.bytes - c->unordered.skip >= sizeof(blocked->bytes)) {
+        char *next = c->read.curr + c->unordered.skip;
+        uint32_t avail = c->read.bytes - c->unordered.skip;
+        protocol_binary_request_header req;
+        const char *key;
+        uint32_t size;
+        conn *child;
+        auth_data_t data;
+
+        memcpy(req.bytes, next, sizeof(req.bytes));
+        req.request.keylen = ntohs(req.request.keylen);
+        req.request.bodylen = ntohl(req.request.bodylen);
+        req.request.vbucket = ntohs(req.request.vbucket);
+        req.request.cas = ntohll(req.request.cas);
+
+        if (req.request.magic != PROTOCOL_BINARY_REQ ||
+            !unordered_command(req.request.opcode) ||
+            req.request.keylen > KEY_MAX_LENGTH ||
+            req.request.bodylen > settings.max_packet_size ||
+            req.request.bodylen > avail - sizeof(req.bytes) ||
+            (uint32_t)req.request.extlen + req.request.keylen >
+                req.request.bodylen ||
+            invalid_datatype(c, req.request.datatype)) {
+            break;
+        }
+
+        key = unordered_key(&req, next);
+        if ((req.request.keylen == blocked->request.keylen &&
+             memcmp(key, blocked_key, req.request.keylen) == 0) ||
+            unordered_key_busy(c, key, req.request.keylen)) {
+            break;
+        }
+
+        size = (uint32_t)sizeof(req.bytes) + req.request.bodylen;
+        if ((child = conn_new_unordered(c, size)) == NULL) {
+            break;
+        }
+        get_auth_data(c, &data);
+        if (data.username != NULL) {
+            /* Let the engine select the same bucket as for c */
+            perform_callbacks(ON_AUTH, (const void*)&data, child);
+        }
+
+        memcpy(child->read.buf, next, size);
+        child->read.curr = child->read.buf + size;
+        child->read.bytes = 0;
+        child->binary_header = req;
+        child->cmd = req.request.opcode;
+        child->keylen = req.request.keylen;
+        child->opaque = req.request.opaque;
+        child->start = conn_clock(c);
+        child->substate = bin_reading_packet;
+        child->rlbytes = 0;
+        c->unordered.skip += size;
+        STATS_NOKEY(c, unordered_cmds);
+
+        if (add_msghdr(child) != 0) {
+            conn_set_state(child, conn_closing);
+        } else {
+            conn_set_state(child, conn_nread);
+        }
+        run_event_loop(child);
+    }
+}
+
+/* Copy the response queued on child to the responses of c */
+static bool conn_unordered_collect(conn *c, conn *child) {
+    struct net_buf *buf = &c->unordered.buf;
+    uint64_t total = 0;
+    uint64_t needed;
+    int ii;
+
+    for (ii = 0; ii < child->msgused; ++ii) {
+        size_t jj;
+        for (jj = 0; jj < (size_t)child->msglist[ii].msg_iovlen; ++jj) {
+            total += child->msglist[ii].msg_iov[jj].iov_len;
+        }
+    }
+    if (total == 0) {
+        return true;
+    }
+
+    needed = buf->bytes + total;
+    if (needed > UINT32_MAX / 2) {
+        return false;
+    }
+    if (buf->buf == NULL) {
+        uint32_t size = DATA_BUFFER_SIZE;
+        while (size < needed) {
+            size *= 2;
+        }
+        if (!thread_buffer_alloc(c->thread, buf, size)) {
+            return false;
+        }
+    } else if (needed > buf->size) {
+        uint32_t size = buf->size;
+        while (size < needed) {
+            size *= 2;
+        }
+        if (!thread_buffer_resize(c->thread, buf, size)) {
+            return false;
+        }
+    }
+
+    for (ii = 0; ii < child->msgused; ++ii) {
+        const struct msghdr *m = &child->msglist[ii];
+        size_t jj;
+        for (jj = 0; jj < (size_t)m->msg_iovlen; ++jj) {
+            memcpy(buf->buf + buf->bytes, m->msg_iov[jj].iov_base,
+                   m->msg_iov[jj].iov_len);
+            buf->bytes += (uint32_t)m->msg_iov[jj].iov_len;
+        }
+    }
+    return true;
+}
+
+/*
+ * The state functions of a child end up here once its command is done
+ * (with or without a response queued, or with it wanting to close the
+ * connection).
+ */
+static bool conn_unordered_complete(conn *child) {
+    conn *c = child->unordered.parent;
+
+    if (c->sfd != INVALID_SOCKET) {
+        if (child->state != conn_new_cmd && child->state != conn_closing &&
+            !conn_unordered_collect(c, child)) {
+            c->unordered.failed = true;
+        }
+        if (child->state == conn_closing ||
+            child->write_and_go == conn_closing) {
+            c->unordered.failed = true;
+        }
+    }
+    conn_release_unordered(child);
+
+    if (c->ewouldblock && c->sfd != INVALID_SOCKET) {
+        /* It can't run before the engine is done with its own command */
+        conn_coalesce_send(c);
+    } else if (c->sfd == INVALID_SOCKET || c->unordered.blocked ||
+               c->unordered.failed || c->unordered.buf.bytes > 0) {
+        /* Run it from the pending io list, which leaves c->aiostat alone */
+        if (c->next == NULL && add_conn_to_pending_io_list(c)) {
+            notify_thread(c->thread);
+        }
+    }
+
+    return true;
+}
+
+static int add_unordered_iov(conn *c) {
+    if (c->unordered.sending.buf == NULL) {
+        if (c->unordered.buf.bytes == 0) {
+            return 0;
+        }
+        c->unordered.sending = c->unordered.buf;
+        memset(&c->unordered.buf, 0, sizeof(c->unordered.buf));
+    }
+    return add_iov(c, c->unordered.sending.buf, c->unordered.sending.bytes);
+}
+
+bool conn_mwrite(conn *c) {
+    if (c->compact.header_iov != -1) {
+        compact_bin_header(c);
+    }
+    if (c->unordered.parent != NULL) {
+        return conn_unordered_complete(c);
+    }
+    if (c->zerocopy.next != c->zerocopy.done) {
+        conn_reap_zerocopy(c);
+    }
+
+    if (c->protocol == PROTOCOL_GREENSTACK && !c->greenstack->framed) {
+        if (!greenstack_frame_response(c)) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                            "%d: Failed to add the frame header, closing connection",
+                                            c->sfd);
+            conn_set_state(c, conn_closing);
+            return true;
+        }
+        c->greenstack->framed = true;
+    }
+
+    if (c->state == conn_mwrite && !c->coalesce.sending &&
+        conn_coalesce_response(c)) {
+        if (c->phase.active) {
+            conn_phase_end(c, false);
+        }
+        return true;
+    }
+    c->coalesce.sending = true;
+
+    switch (transmit(c)) {
+    case TRANSMIT_COMPLETE:
+        if (c->phase.active) {
+            conn_phase_end(c, true);
+        }
+        /* The response to the HELLO went out as it was */
+        if (c->stream != NULL) {
+            c->stream_active = true;
+        }
+        c->coalesce.sending = false;
+        if (c->greenstack != NULL) {
+            c->greenstack->framed = false;
+        }
+        if (c->coalesce.queued) {
+            c->coalesce.queued = false;
+            thread_buffer_release(c->thread, &c->coalesce.buf);
+        }
+        thread_buffer_release(c->thread, &c->unordered.sending);
+        if (c->state == conn_mwrite) {
+            conn_release_items(c);
+            conn_release_temp_allocs(c);
+            /* XXX:  I don't know why this wasn't the general case */
+            conn_set_state(c, c->write_and_go);
+        } else if (c->state == conn_write) {
+            if (c->write_and_free) {
+                free(c->write_and_free);
+                c->write_and_free = 0;
+            }
+            conn_set_state(c, c->write_and_go);
+        } else {
+            if (settings.verbose > 0) {
+                settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                                                "Unexpected state %d\n", c->state);
+            }
+            conn_set_state(c, conn_closing);
+        }
+        break;
+
+    case TRANSMIT_INCOMPLETE:
+    case TRANSMIT_HARD_ERROR:
+        break;                   /* Continue in state machine. */
 
     case TRANSMIT_SOFT_ERROR:
         return false;
@@ -6261,9 +10076,8 @@ bool conn_immediate_close(conn *c) {
     return false;
 }
 
-bool conn_closing(conn *c) {
-    /* We don't want any network notifications anymore.. */
-    unregister_event(c);
+/* Close the socket and move on to releasing the connection */
+static void conn_close_socket(conn *c) {
     safe_close(c->sfd);
     c->sfd = INVALID_SOCKET;
 
@@ -6275,6 +10089,62 @@ bool conn_closing(conn *c) {
     } else {
         conn_set_state(c, conn_immediate_close);
     }
+}
+
+bool conn_closing(conn *c) {
+    /* Set without conn_set_state() */
+    near_cache_invalidate(c->near_cache.pending);
+    c->near_cache.pending = NEAR_CACHE_NONE;
+
+    if (c->unordered.parent != NULL) {
+        return conn_unordered_complete(c);
+    }
+    /* We don't want any network notifications anymore.. */
+    unregister_event(c);
+    if (c->uring.armed) {
+        /* Its final completion releases the reference and resumes us */
+        conn_uring_cancel(c);
+    }
+    if (c->zerocopy.next != c->zerocopy.done) {
+        c->zerocopy.close_time = mc_time_get_current_time();
+        conn_set_state(c, conn_zerocopy_close);
+        return true;
+    }
+    conn_close_socket(c);
+    return true;
+}
+
+/*
+ * The kernel may still be sending from the items of the zero copy sends
+ * of the closing connection, so they stay pinned (and the socket open,
+ * to read the completions) until it reports them all done. We look again
+ * every second from the idle timer. If the peer didn't take the data in
+ * ZEROCOPY_CLOSE_WAIT seconds the connection is aborted, which drops
+ * what the kernel still had to send and completes the sends.
+ */
+bool conn_zerocopy_close(conn *c) {
+    conn_reap_zerocopy(c);
+    if (c->zerocopy.next != c->zerocopy.done && !c->zerocopy.aborted &&
+        mc_time_get_current_time() - c->zerocopy.close_time >=
+        ZEROCOPY_CLOSE_WAIT) {
+        /* Disconnecting the socket resets it, but keeps it open */
+        struct sockaddr unspec;
+        memset(&unspec, 0, sizeof(unspec));
+        unspec.sa_family = AF_UNSPEC;
+        if (connect(c->sfd, &unspec, sizeof(unspec)) == -1) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                            "%d: Failed to abort the "
+                                            "connection: %s", c->sfd,
+                                            strerror(errno));
+        }
+        c->zerocopy.aborted = true;
+        conn_reap_zerocopy(c);
+    }
+    if (c->zerocopy.next != c->zerocopy.done) {
+        conn_idle_timer_arm(c);
+        return false;
+    }
+    conn_close_socket(c);
     return true;
 }
 
@@ -6363,6 +10233,76 @@ bool conn_flush(conn *c) {
     return true;
 }
 
+/* Connections per chunk of a "stats connections" */
+#define CONN_STATS_CHUNK 64
+
+/*
+ * Sends the stats of the next CONN_STATS_CHUNK connections of a "stats
+ * connections" (the cursor is the cmd_context), and comes back for the
+ * next ones once they're sent. Only a chunk of the responses is held in
+ * memory at a time, and every chunk counts as a command for the share of
+ * the connection (see conn_new_cmd()).
+ */
+bool conn_stats_stream(conn *c) {
+    if (--c->nevents < 0) {
+        STATS_NOKEY(c, conn_yields);
+        if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+            conn_set_state(c, conn_closing);
+            return true;
+        }
+        return false;
+    }
+
+    /* The previous chunk is gone, don't send its iovs again */
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    if (add_msghdr(c) != 0) {
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+
+    if (connection_stats_next(c->cmd_context, &append_stats, c,
+                              CONN_STATS_CHUNK)) {
+        append_stats(NULL, 0, NULL, 0, c);
+        write_and_free(c, &c->dynamic_buffer);
+    } else if (c->dynamic_buffer.buffer != NULL) {
+        write_and_free(c, &c->dynamic_buffer);
+        c->write_and_go = conn_stats_stream;
+    } else {
+        /* Out of memory, and part of the response may be sent already */
+        conn_set_state(c, conn_closing);
+    }
+    return true;
+}
+
+/*
+ * A request forwarded by proxy mode is back (see proxy.h), with the
+ * response in the dynamic buffer. If the node couldn't be reached the
+ * client gets the NOT_MY_VBUCKET it would have got without the proxy.
+ */
+bool conn_proxy_wait(conn *c) {
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+    c->ewouldblock = false;
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        write_and_free(c, &c->dynamic_buffer);
+        break;
+    case ENGINE_NOT_MY_VBUCKET:
+        c->dynamic_buffer.offset = 0;
+        if (!write_not_my_vbucket(c)) {
+            write_bin_status(c, PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET);
+        }
+        break;
+    default:
+        c->dynamic_buffer.offset = 0;
+        write_bin_packet(c, engine_error_2_protocol_error(ret));
+    }
+    return true;
+}
+
 bool conn_audit_configuring(conn *c) {
     ENGINE_ERROR_CODE ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
@@ -6397,6 +10337,7 @@ void event_handler(evutil_socket_t fd, short which, void *arg) {
     thr = c->thread;
     if (!is_listen_thread()) {
         cb_assert(thr);
+        thread_loop_event(thr);
         LOCK_THREAD(thr);
         /*
          * Remove the list from the list of pending io's (in case the
@@ -6411,7 +10352,7 @@ void event_handler(evutil_socket_t fd, short which, void *arg) {
     /* sanity */
     cb_assert(fd == c->sfd);
 
-    c->nevents = c->max_reqs_per_event;
+    c->nevents = conn_sched_budget(c);
 
     run_event_loop(c);
 
@@ -6437,23 +10378,9 @@ static void dispatch_event_handler(evutil_socket_t fd, short which, void *arg) {
         }
         cb_mutex_exit(&listen_state.mutex);
         if (enable) {
-            conn *next;
-            for (next = listen_conn; next; next = next->next) {
-                int backlog = 1024;
-                int ii;
-                update_event(next, EV_READ | EV_PERSIST);
-                for (ii = 0; ii < settings.num_interfaces; ++ii) {
-                    if (next->parent_port == settings.interfaces[ii].port) {
-                        backlog = settings.interfaces[ii].backlog;
-                        break;
-                    }
-                }
-
-                if (listen(next->sfd, backlog) != 0) {
-                    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                    "listen() failed",
-                                                    strerror(errno));
-                }
+            set_listen_events(listen_conn, true);
+            if (settings.reuseport) {
+                notify_listen_threads();
             }
         }
     }
@@ -6461,13 +10388,23 @@ static void dispatch_event_handler(evutil_socket_t fd, short which, void *arg) {
 
 /*
  * Sets a socket's send buffer size to the maximum allowed by the system.
+ * The maximum is the same for all the sockets, so it's only searched for
+ * on the first one and the others are set to it with a single call (the
+ * accepted sockets inherit the buffer of their listening socket).
  */
 static void maximize_sndbuf(const SOCKET sfd) {
+    static int max_sndbuf;
     socklen_t intsize = sizeof(int);
     int last_good = 0;
     int min, max, avg;
     int old_size;
 
+    if (max_sndbuf > 0 &&
+        setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void *)&max_sndbuf,
+                   intsize) == 0) {
+        return;
+    }
+
     /* Start with the default size. */
     if (getsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void *)&old_size, &intsize) != 0) {
         if (settings.verbose > 0) {
@@ -6493,32 +10430,229 @@ static void maximize_sndbuf(const SOCKET sfd) {
         }
     }
 
+    max_sndbuf = last_good;
+
     if (settings.verbose > 1) {
         settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
                  "<%d send buffer was %d, now %d\n", sfd, old_size, last_good);
     }
-}
-
-static SOCKET new_socket(struct addrinfo *ai) {
-    SOCKET sfd;
+}
+
+static SOCKET new_socket(struct addrinfo *ai) {
+    SOCKET sfd;
+
+    sfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sfd == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+
+    if (evutil_make_socket_nonblocking(sfd) == -1) {
+        safe_close(sfd);
+        return INVALID_SOCKET;
+    }
+
+    maximize_sndbuf(sfd);
+
+    return sfd;
+}
+
+/**
+ * Create a socket for one of the addresses of an interface, and bind and
+ * listen on it.
+ * @param interf the interface to bind to
+ * @param ai the address to bind to
+ * @param fatal set to true if the server shouldn't start (as opposed to
+ *        the address just not being usable)
+ * @return the socket, or INVALID_SOCKET on failure
+ */
+static SOCKET server_socket_bind(struct interface *interf,
+                                 struct addrinfo *ai, bool *fatal) {
+    SOCKET sfd;
+    struct linger ling = {0, 0};
+    int error;
+    int flags =1;
+
+    if ((sfd = new_socket(ai)) == INVALID_SOCKET) {
+        /* getaddrinfo can return "junk" addresses,
+         * we make sure at least one works before erroring.
+         */
+        return INVALID_SOCKET;
+    }
+
+#ifdef IPV6_V6ONLY
+    if (ai->ai_family == AF_INET6) {
+        error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(IPV6_V6ONLY): %s",
+                                            strerror(errno));
+            safe_close(sfd);
+            return INVALID_SOCKET;
+        }
+    }
+#endif
+
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+#ifdef SO_REUSEPORT
+    if (settings.reuseport) {
+        error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags,
+                           sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(SO_REUSEPORT): %s",
+                                            strerror(errno));
+            safe_close(sfd);
+            *fatal = true;
+            return INVALID_SOCKET;
+        }
+    }
+#endif
+    error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+    if (error != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "setsockopt(SO_KEEPALIVE): %s",
+                                        strerror(errno));
+    }
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+    if (error != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "setsockopt(SO_LINGER): %s",
+                                        strerror(errno));
+    }
+
+    if (interf->tcp_nodelay) {
+        error = setsockopt(sfd, IPPROTO_TCP,
+                           TCP_NODELAY, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(TCP_NODELAY): %s",
+                                            strerror(errno));
+        }
+    }
+
+    if (bind(sfd, ai->ai_addr, (socklen_t)ai->ai_addrlen) == SOCKET_ERROR) {
+#ifdef WIN32
+        DWORD error = WSAGetLastError();
+#else
+        int error = errno;
+#endif
+        if (!is_addrinuse(error)) {
+            log_errcode_error(EXTENSION_LOG_WARNING, NULL,
+                              "bind(): %s", error);
+            *fatal = true;
+        }
+        safe_close(sfd);
+        return INVALID_SOCKET;
+    }
+
+    if (listen(sfd, interf->backlog) == SOCKET_ERROR) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "listen(): %s",
+                                        strerror(errno));
+        safe_close(sfd);
+        *fatal = true;
+        return INVALID_SOCKET;
+    }
+
+    return sfd;
+}
+
+/* Count a listener of the port in the connection stats */
+static void count_listen_conn(in_port_t port) {
+    struct listening_port *port_instance;
+
+    STATS_LOCK();
+    ++stats.curr_conns;
+    ++stats.daemon_conns;
+    port_instance = get_listening_port_instance(port);
+    cb_assert(port_instance);
+    ++port_instance->curr_conns;
+    STATS_UNLOCK();
+}
+
+/* Let the dispatcher accept the connections of the listening socket */
+static void add_listen_conn(SOCKET sfd, in_port_t port) {
+    conn *listen_conn_add;
+
+    if (!(listen_conn_add = conn_new(sfd, port, conn_listening,
+                                     EV_READ | EV_PERSIST, 1,
+                                     main_base, NULL))) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "failed to create listening connection\n");
+        exit(EXIT_FAILURE);
+    }
+    listen_conn_add->next = listen_conn;
+    listen_conn = listen_conn_add;
+    count_listen_conn(port);
+}
+
+/**
+ * Create the AF_UNIX socket of an interface with a path, and listen on it
+ * in the dispatcher (also with reuseport: the kernel doesn't spread the
+ * connections to a path over several sockets). A path starting with '@'
+ * is in the abstract namespace, anything else is a file replacing a stale
+ * socket left by a previous run.
+ */
+static int server_socket_unix(struct interface *interf) {
+#ifndef WIN32
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    size_t len = strlen(interf->path);
+    struct stat st;
+    SOCKET sfd;
+
+    memset(&addr, 0, sizeof(addr));
+    if (len >= sizeof(addr.sun_path)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Socket path too long: %s",
+                                        interf->path);
+        return 1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, interf->path, len);
+    if (interf->path[0] == '@') {
+        /* The name of an abstract socket is all of the bytes after a NUL */
+        addr.sun_path[0] = '\0';
+        addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+    } else {
+        addrlen = (socklen_t)sizeof(addr);
+        if (lstat(interf->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(interf->path);
+        }
+    }
 
-    sfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-    if (sfd == INVALID_SOCKET) {
-        return INVALID_SOCKET;
+    if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "socket(AF_UNIX): %s",
+                                        strerror(errno));
+        return 1;
     }
-
-    if (evutil_make_socket_nonblocking(sfd) == -1) {
+    if (evutil_make_socket_nonblocking(sfd) == -1 ||
+        bind(sfd, (struct sockaddr *)&addr, addrlen) == SOCKET_ERROR ||
+        listen(sfd, interf->backlog) == SOCKET_ERROR) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to listen on %s: %s",
+                                        interf->path, strerror(errno));
         safe_close(sfd);
-        return INVALID_SOCKET;
+        return 1;
     }
-
     maximize_sndbuf(sfd);
 
-    return sfd;
+    add_listen_conn(sfd, interf->port);
+    return 0;
+#else
+    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                    "Unix domain sockets are not supported "
+                                    "on this platform: %s", interf->path);
+    return 1;
+#endif
 }
 
 /**
- * Create a socket and bind it to a specific port number
+ * Create a socket and bind it to a specific port number. In reuseport
+ * mode every worker thread gets a socket of its own for each address, and
+ * accepts the connections on it itself.
  * @param interface the interface to bind to
  * @param port the port number to bind to
  * @param portnumber_file A filepointer to write the port numbers to
@@ -6527,15 +10661,18 @@ static SOCKET new_socket(struct addrinfo *ai) {
  */
 static int server_socket(struct interface *interf, FILE *portnumber_file) {
     SOCKET sfd;
-    struct linger ling = {0, 0};
     struct addrinfo *ai;
     struct addrinfo *next;
     struct addrinfo hints;
     char port_buf[NI_MAXSERV];
     int error;
     int success = 0;
-    int flags =1;
     const char *host = NULL;
+    int nlisteners = settings.reuseport ? settings.num_threads : 1;
+
+    if (interf->path != NULL) {
+        return server_socket_unix(interf);
+    }
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_flags = AI_PASSIVE;
@@ -6575,132 +10712,178 @@ static int server_socket(struct interface *interf, FILE *portnumber_file) {
     }
 
     for (next= ai; next; next= next->ai_next) {
-        struct listening_port *port_instance;
-        conn *listen_conn_add;
-        if ((sfd = new_socket(next)) == INVALID_SOCKET) {
-            /* getaddrinfo can return "junk" addresses,
-             * we make sure at least one works before erroring.
-             */
-            continue;
-        }
+        bool fatal = false;
+        int ii;
 
-#ifdef IPV6_V6ONLY
-        if (next->ai_family == AF_INET6) {
-            error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(IPV6_V6ONLY): %s",
-                                                strerror(errno));
-                safe_close(sfd);
-                continue;
+        if ((sfd = server_socket_bind(interf, next, &fatal)) == INVALID_SOCKET) {
+            if (fatal) {
+                freeaddrinfo(ai);
+                return 1;
             }
-        }
-#endif
-
-        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
-        error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-        if (error != 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "setsockopt(SO_KEEPALIVE): %s",
-                                            strerror(errno));
-        }
-
-        error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-        if (error != 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "setsockopt(SO_LINGER): %s",
-                                            strerror(errno));
+            continue;
         }
 
-        if (interf->tcp_nodelay) {
-            error = setsockopt(sfd, IPPROTO_TCP,
-                               TCP_NODELAY, (void *)&flags, sizeof(flags));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(TCP_NODELAY): %s",
-                                                strerror(errno));
+        success++;
+        if (portnumber_file != NULL &&
+            (next->ai_addr->sa_family == AF_INET ||
+             next->ai_addr->sa_family == AF_INET6)) {
+            union {
+                struct sockaddr_in in;
+                struct sockaddr_in6 in6;
+            } my_sockaddr;
+            socklen_t len = sizeof(my_sockaddr);
+            if (getsockname(sfd, (struct sockaddr*)&my_sockaddr, &len)==0) {
+                if (next->ai_addr->sa_family == AF_INET) {
+                    fprintf(portnumber_file, "%s INET: %u\n", "TCP",
+                            ntohs(my_sockaddr.in.sin_port));
+                } else {
+                    fprintf(portnumber_file, "%s INET6: %u\n", "TCP",
+                            ntohs(my_sockaddr.in6.sin6_port));
+                }
             }
         }
 
-        if (bind(sfd, next->ai_addr, (socklen_t)next->ai_addrlen) == SOCKET_ERROR) {
-#ifdef WIN32
-            DWORD error = WSAGetLastError();
-#else
-            int error = errno;
-#endif
-            if (!is_addrinuse(error)) {
-                log_errcode_error(EXTENSION_LOG_WARNING, NULL,
-                                  "bind(): %s", error);
-                safe_close(sfd);
-                freeaddrinfo(ai);
-                return 1;
-            }
-            safe_close(sfd);
-            continue;
-        } else {
-            success++;
-            if (listen(sfd, interf->backlog) == SOCKET_ERROR) {
+        for (ii = 0; ii < nlisteners; ++ii) {
+            if (ii > 0 &&
+                (sfd = server_socket_bind(interf, next, &fatal)) == INVALID_SOCKET) {
+                /* The first one bound, so the others must bind as well */
                 settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "listen(): %s",
-                                                strerror(errno));
-                safe_close(sfd);
+                    "Failed to create SO_REUSEPORT listener %d for port %u\n",
+                    ii, (unsigned int)interf->port);
                 freeaddrinfo(ai);
                 return 1;
             }
-            if (portnumber_file != NULL &&
-                (next->ai_addr->sa_family == AF_INET ||
-                 next->ai_addr->sa_family == AF_INET6)) {
-                union {
-                    struct sockaddr_in in;
-                    struct sockaddr_in6 in6;
-                } my_sockaddr;
-                socklen_t len = sizeof(my_sockaddr);
-                if (getsockname(sfd, (struct sockaddr*)&my_sockaddr, &len)==0) {
-                    if (next->ai_addr->sa_family == AF_INET) {
-                        fprintf(portnumber_file, "%s INET: %u\n", "TCP",
-                                ntohs(my_sockaddr.in.sin_port));
-                    } else {
-                        fprintf(portnumber_file, "%s INET6: %u\n", "TCP",
-                                ntohs(my_sockaddr.in6.sin6_port));
-                    }
-                }
+
+            if (settings.reuseport) {
+                dispatch_listen_conn(ii, sfd, interf->port);
+                count_listen_conn(interf->port);
+            } else {
+                add_listen_conn(sfd, interf->port);
             }
         }
+    }
 
-        if (!(listen_conn_add = conn_new(sfd, interf->port, conn_listening,
-                                         EV_READ | EV_PERSIST, 1,
-                                         main_base))) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "failed to create listening connection\n");
-            exit(EXIT_FAILURE);
+    freeaddrinfo(ai);
+
+    /* Return zero iff we detected no errors in starting up connections */
+    return success == 0;
+}
+
+/*
+ * Interfaces whose address was changed by a config reload (see
+ * rebind_interface()). The listeners belong to the dispatcher, so it
+ * replaces them itself, looking for the pending ones once a second.
+ */
+static struct {
+    cb_mutex_t mutex;
+    bool *pending;
+    struct event timer;
+} rebind;
+
+/* Closes the listeners of the dispatcher for the port */
+static void close_listen_conns(in_port_t port) {
+    conn **prev = &listen_conn;
+
+    while (*prev != NULL) {
+        conn *c = *prev;
+        struct listening_port *port_instance;
+
+        if (c->parent_port != port) {
+            prev = &c->next;
+            continue;
         }
-        listen_conn_add->next = listen_conn;
-        listen_conn = listen_conn_add;
+        *prev = c->next;
+        c->next = NULL;
+        conn_close_listener(c);
+
         STATS_LOCK();
-        ++stats.curr_conns;
-        ++stats.daemon_conns;
-        port_instance = get_listening_port_instance(interf->port);
+        --stats.curr_conns;
+        --stats.daemon_conns;
+        port_instance = get_listening_port_instance(port);
         cb_assert(port_instance);
-        ++port_instance->curr_conns;
+        --port_instance->curr_conns;
         STATS_UNLOCK();
     }
+}
 
-    freeaddrinfo(ai);
+static void rebind_interfaces(evutil_socket_t fd, short which, void *arg) {
+    struct timeval interval = {1, 0};
+    int ii;
 
-    /* Return zero iff we detected no errors in starting up connections */
-    return success == 0;
+    (void)fd;
+    (void)which;
+    (void)arg;
+
+    cb_mutex_enter(&rebind.mutex);
+    for (ii = 0; ii < settings.num_interfaces; ++ii) {
+        struct interface *interf = settings.interfaces + ii;
+        if (!rebind.pending[ii]) {
+            continue;
+        }
+        rebind.pending[ii] = false;
+        /* The old address may overlap the new one, so it goes first */
+        close_listen_conns(interf->port);
+        if (server_socket(interf, NULL) != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "Failed to rebind interface %d to %s:%hu", ii,
+                interf->host ? interf->host : "*", interf->port);
+        } else {
+            /* TODO: change to EXTENSION_LOG_INFO */
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "Rebound interface %d to %s:%hu", ii,
+                interf->host ? interf->host : "*", interf->port);
+        }
+    }
+    cb_mutex_exit(&rebind.mutex);
+
+    evtimer_add(&rebind.timer, &interval);
+}
+
+void rebind_interface(int idx, const struct interface *interf) {
+    struct interface *cur = settings.interfaces + idx;
+    const char *old;
+
+    cb_mutex_enter(&rebind.mutex);
+    old = cur->host;
+    cur->host = interf->host ? strdup(interf->host) : NULL;
+    cur->ipv4 = interf->ipv4;
+    cur->ipv6 = interf->ipv6;
+    rebind.pending[idx] = true;
+    cb_mutex_exit(&rebind.mutex);
+    free((char*)old);
 }
 
 static int server_sockets(FILE *portnumber_file) {
     int ret = 0;
     int ii = 0;
 
+#ifndef SO_REUSEPORT
+    if (settings.reuseport) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "SO_REUSEPORT is not supported, accepting all connections "
+            "in the dispatcher thread\n");
+        settings.reuseport = false;
+    }
+#endif
+
     for (ii = 0; ii < settings.num_interfaces; ++ii) {
         stats.listening_ports[ii].port = settings.interfaces[ii].port;
         stats.listening_ports[ii].maxconns = settings.interfaces[ii].maxconn;
         ret |= server_socket(settings.interfaces + ii, portnumber_file);
     }
 
+    cb_mutex_initialize(&rebind.mutex);
+    rebind.pending = calloc(settings.num_interfaces, sizeof(bool));
+    if (rebind.pending == NULL) {
+        return 1;
+    }
+    evtimer_set(&rebind.timer, rebind_interfaces, NULL);
+    event_base_set(main_base, &rebind.timer);
+    {
+        struct timeval interval = {1, 0};
+        evtimer_add(&rebind.timer, &interval);
+    }
+
     return ret;
 }
 
@@ -6769,6 +10952,11 @@ static bool is_mutation_extras_supported(const void *cookie) {
     return c->supports_mutation_extras;
 }
 
+static bool is_exptime_ms_supported(const void *cookie) {
+    conn *c = (conn*)cookie;
+    return c->supports_exptime_ms;
+}
+
 static uint8_t get_opcode_if_ewouldblock_set(const void *cookie) {
     conn *c = (conn*)cookie;
     uint8_t opcode = PROTOCOL_BINARY_CMD_INVALID;
@@ -6854,20 +11042,7 @@ static bool cookie_is_admin(const void *cookie) {
 }
 
 static void cookie_set_priority(const void* cookie, CONN_PRIORITY priority) {
-    conn* c = (conn*)cookie;
-    switch (priority) {
-    case CONN_PRIORITY_HIGH:
-        c->max_reqs_per_event = settings.reqs_per_event_high_priority;
-        break;
-    case CONN_PRIORITY_MED:
-        c->max_reqs_per_event = settings.reqs_per_event_med_priority;
-        break;
-    case CONN_PRIORITY_LOW:
-        c->max_reqs_per_event = settings.reqs_per_event_low_priority;
-        break;
-    default:
-        abort();
-    }
+    conn_set_priority((conn*)cookie, priority);
 }
 
 static void register_callback(ENGINE_HANDLE *eh,
@@ -7114,17 +11289,21 @@ static SERVER_HANDLE_V1 *get_server_api(void)
         core_api.parse_config = parse_config;
         core_api.shutdown = shutdown_server;
         core_api.get_config = get_config;
+        core_api.get_current_time_ms = mc_time_get_current_time_ms;
+        core_api.realtime_ms = mc_time_convert_to_real_time_ms;
 
         server_cookie_api.get_auth_data = get_auth_data;
         server_cookie_api.store_engine_specific = store_engine_specific;
         server_cookie_api.get_engine_specific = get_engine_specific;
         server_cookie_api.is_datatype_supported = is_datatype_supported;
         server_cookie_api.is_mutation_extras_supported = is_mutation_extras_supported;
+        server_cookie_api.is_exptime_ms_supported = is_exptime_ms_supported;
         server_cookie_api.get_opcode_if_ewouldblock_set = get_opcode_if_ewouldblock_set;
         server_cookie_api.validate_session_cas = validate_session_cas;
         server_cookie_api.decrement_session_ctr = decrement_session_ctr;
         server_cookie_api.get_socket_fd = get_socket_fd;
         server_cookie_api.notify_io_complete = notify_io_complete;
+        server_cookie_api.notify_io_complete_multi = notify_io_complete_multi;
         server_cookie_api.reserve = reserve_cookie;
         server_cookie_api.release = release_cookie;
         server_cookie_api.set_admin = cookie_set_admin;
@@ -7156,6 +11335,7 @@ static SERVER_HANDLE_V1 *get_server_api(void)
         hooks_api.get_detailed_stats = mc_get_detailed_stats;
         hooks_api.release_free_memory = mc_release_free_memory;
         hooks_api.enable_thread_cache = mc_enable_thread_cache;
+        hooks_api.use_thread_arena = mc_use_thread_arena;
 
         rv.interface = 1;
         rv.core = &core_api;
@@ -7165,6 +11345,7 @@ static SERVER_HANDLE_V1 *get_server_api(void)
         rv.log = &server_log_api;
         rv.cookie = &server_cookie_api;
         rv.alloc_hooks = &hooks_api;
+        rv.executor = get_executor_api();
     }
 
     if (rv.engine == NULL) {
@@ -7434,7 +11615,7 @@ static void set_max_filehandles(void) {
                 "failed to getrlimit number of files\n");
         exit(EX_OSERR);
     } else {
-        int maxfiles = settings.maxconns + (3 * (settings.num_threads + 2));
+        int maxfiles = settings.maxconns + (3 * (NUM_WORKER_THREADS() + 1));
         int syslimit = rlim.rlim_cur;
         if (rlim.rlim_cur < maxfiles) {
             rlim.rlim_cur = maxfiles;
@@ -7451,7 +11632,7 @@ static void set_max_filehandles(void) {
                 "memcached as root (remember\nto use the -u parameter).\n"
                 "The maximum number of connections is set to %d.\n";
             req = settings.maxconns;
-            settings.maxconns = syslimit - (3 * (settings.num_threads + 2));
+            settings.maxconns = syslimit - (3 * (NUM_WORKER_THREADS() + 1));
             if (settings.maxconns < 0) {
                 settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                          "failed to set rlimit for open files. Try starting as"
@@ -7501,6 +11682,8 @@ static void initialize_openssl(void) {
 
     CRYPTO_set_id_callback(get_thread_id);
     CRYPTO_set_locking_callback(openssl_locking_callback);
+
+    ssl_sessions_init();
 }
 
 void calculate_maxconns(void) {
@@ -7511,18 +11694,185 @@ void calculate_maxconns(void) {
     }
 }
 
+/*
+ * The time taken by each phase of the startup, for "stats startup". The
+ * steps which don't depend on each other (the audit configuration, RBAC,
+ * SASL and the engine) run at the same time in startup_run(), so the
+ * phases add up to more than the total.
+ */
+enum startup_phase {
+    STARTUP_EXTENSIONS,
+    STARTUP_AUDIT,
+    STARTUP_RBAC,
+    STARTUP_SASL,
+    STARTUP_ENGINE_LOAD,
+    STARTUP_ENGINE_INIT,
+    STARTUP_TOTAL,
+    STARTUP_PHASES
+};
+
+static const char * const startup_phase_names[STARTUP_PHASES] = {
+    "extensions", "audit", "rbac", "sasl", "engine_load", "engine_init",
+    "total"
+};
+
+static hrtime_t startup_phase_ns[STARTUP_PHASES];
+
+static void process_stat_startup(ADD_STAT add_stats, conn *c) {
+    int ii;
+    for (ii = 0; ii < STARTUP_PHASES; ++ii) {
+        char name[64];
+        snprintf(name, sizeof(name), "startup_%s_usec",
+                 startup_phase_names[ii]);
+        APPEND_STAT(name, "%" PRIu64, (uint64_t)(startup_phase_ns[ii] / 1000));
+    }
+}
+
+struct extension_prefetch {
+    const char *soname;
+    cb_dlhandle_t handle;
+    cb_thread_t tid;
+    bool started;
+};
+
+/* Map the library and do its relocations, which is what takes the time */
+static void extension_prefetch_main(void *arg) {
+    struct extension_prefetch *prefetch = arg;
+    char *error_msg = NULL;
+
+    prefetch->handle = cb_dlopen(prefetch->soname, &error_msg);
+    /* load_extension() reports the error */
+    free(error_msg);
+}
+
+/*
+ * The extensions are opened at the same time, but initialized one after
+ * the other in the order of the settings: the later ones may use what the
+ * first registered (the logger).
+ */
 static void load_extensions(void) {
-    for (int ii = 0; ii < settings.num_pending_extensions; ii++) {
+    int num = settings.num_pending_extensions;
+    struct extension_prefetch *prefetch = NULL;
+    hrtime_t start = gethrtime();
+    int ii;
+
+    if (num > 1) {
+        prefetch = calloc(num, sizeof(*prefetch));
+    }
+    for (ii = 0; prefetch != NULL && ii < num; ++ii) {
+        prefetch[ii].soname = settings.pending_extensions[ii].soname;
+        if (prefetch[ii].soname != NULL) {
+            prefetch[ii].started =
+                cb_create_thread(&prefetch[ii].tid, extension_prefetch_main,
+                                 &prefetch[ii], 0) == 0;
+        }
+    }
+    for (ii = 0; prefetch != NULL && ii < num; ++ii) {
+        if (prefetch[ii].started) {
+            cb_join_thread(prefetch[ii].tid);
+        }
+    }
+
+    for (ii = 0; ii < num; ii++) {
         if (!load_extension(settings.pending_extensions[ii].soname,
                             settings.pending_extensions[ii].config)) {
             exit(EXIT_FAILURE);
         }
     }
+
+    /* load_extension() opened them again, they stay loaded */
+    for (ii = 0; prefetch != NULL && ii < num; ++ii) {
+        if (prefetch[ii].handle != NULL) {
+            cb_dlclose(prefetch[ii].handle);
+        }
+    }
+    free(prefetch);
+    startup_phase_ns[STARTUP_EXTENSIONS] = gethrtime() - start;
+}
+
+struct startup_task {
+    void (*run)(struct startup_task *task);
+    bool ok;
+    cb_thread_t tid;
+    bool started;
+    /* For the engine */
+    engine_reference *engine_ref;
+    ENGINE_HANDLE *engine_handle;
+};
+
+static void startup_audit(struct startup_task *task) {
+    hrtime_t start = gethrtime();
+    task->ok = configure_auditdaemon(settings.audit_file, NULL) ==
+        AUDIT_SUCCESS;
+    startup_phase_ns[STARTUP_AUDIT] = gethrtime() - start;
+}
+
+static void startup_rbac(struct startup_task *task) {
+    hrtime_t start = gethrtime();
+    task->ok = load_rbac_from_file(settings.rbac_file) == 0;
+    startup_phase_ns[STARTUP_RBAC] = gethrtime() - start;
+}
+
+static void startup_sasl(struct startup_task *task) {
+    hrtime_t start = gethrtime();
+    task->ok = cbsasl_server_init() == CBSASL_OK;
+    startup_phase_ns[STARTUP_SASL] = gethrtime() - start;
+}
+
+static void startup_engine(struct startup_task *task) {
+    hrtime_t start = gethrtime();
+    hrtime_t loaded;
+
+    task->ok = false;
+    /* The errors are already reported */
+    task->engine_ref = load_engine(settings.engine_module,
+                                   settings.extensions.logger);
+    if (task->engine_ref == NULL) {
+        return;
+    }
+    if (!create_engine_instance(task->engine_ref, get_server_api,
+                                settings.extensions.logger,
+                                &task->engine_handle)) {
+        return;
+    }
+    loaded = gethrtime();
+    startup_phase_ns[STARTUP_ENGINE_LOAD] = loaded - start;
+    task->ok = init_engine_instance(task->engine_handle,
+                                    settings.engine_config,
+                                    settings.extensions.logger);
+    startup_phase_ns[STARTUP_ENGINE_INIT] = gethrtime() - loaded;
+}
+
+static void startup_task_main(void *arg) {
+    struct startup_task *task = arg;
+    task->run(task);
+}
+
+/* Run the tasks at the same time (those we can't start in this thread) */
+static void startup_run(struct startup_task *tasks, int ntasks) {
+    int ii;
+
+    for (ii = 0; ii < ntasks; ++ii) {
+        tasks[ii].started = cb_create_thread(&tasks[ii].tid,
+                                             startup_task_main,
+                                             &tasks[ii], 0) == 0;
+        if (!tasks[ii].started) {
+            tasks[ii].run(&tasks[ii]);
+        }
+    }
+    for (ii = 0; ii < ntasks; ++ii) {
+        if (tasks[ii].started) {
+            cb_join_thread(tasks[ii].tid);
+        }
+    }
 }
 
 int main (int argc, char **argv) {
     ENGINE_HANDLE *engine_handle = NULL;
     engine_reference* engine_ref = NULL;
+    const char *hash_name;
+    struct startup_task tasks[4];
+    hrtime_t startup_start = gethrtime();
 
     // MB-14649 log() crash on windows on some CPU's
 #ifdef _WIN64
@@ -7531,12 +11881,11 @@ int main (int argc, char **argv) {
 
     initialize_openssl();
 
-    initialize_timings();
-
     /* Initialize global variables */
     cb_mutex_initialize(&listen_state.mutex);
     cb_mutex_initialize(&tap_stats.mutex);
     cb_mutex_initialize(&stats_lock);
+    cb_mutex_initialize(&aggregate_snapshot.mutex);
     cb_mutex_initialize(&session_cas.mutex);
 
     session_cas.value = 0xdeadbeef;
@@ -7546,6 +11895,7 @@ int main (int argc, char **argv) {
     cb_initialize_sockets();
 
     init_alloc_hooks();
+    heap_profile_init();
 
     /* init settings */
     settings_init();
@@ -7566,8 +11916,24 @@ int main (int argc, char **argv) {
     /* Parse command line arguments */
     parse_arguments(argc, argv);
 
+    /* Room for the worker threads a config reload may add */
+    if (settings.max_threads < settings.num_threads) {
+        settings.max_threads = settings.num_threads;
+    }
+
     settings_init_relocable_files();
 
+    /* Before anything is hashed; the engines keep the hash values */
+    if ((hash_name = hash_init(settings.hash_algorithm)) == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "FATAL: Unknown hash algorithm");
+        exit(EXIT_FAILURE);
+    }
+    if (settings.verbose) {
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+                                        "Hashing keys with %s", hash_name);
+    }
+
     set_server_initialized(!settings.require_init);
 
     /* Initialize breakpad crash catcher with our just-parsed settings. */
@@ -7588,27 +11954,6 @@ int main (int argc, char **argv) {
                                         "FATAL: Failed to start "
                                         "audit daemon");
         abort();
-    } else if (settings.audit_file) {
-        /* configure the audit daemon */
-        if (configure_auditdaemon(settings.audit_file, NULL) != AUDIT_SUCCESS) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                        "FATAL: Failed to initialize audit "
-                                        "daemon with configuation file: %s",
-                                        settings.audit_file);
-            /* we failed configuring the audit.. run without it */
-            free((void*)settings.audit_file);
-            settings.audit_file = NULL;
-        }
-    }
-
-    /* Initialize RBAC data */
-    if (load_rbac_from_file(settings.rbac_file) != 0) {
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                        "FATAL: Failed to load RBAC configuration: %s",
-                                        (settings.rbac_file) ?
-                                        settings.rbac_file :
-                                        "no file specified");
-        abort();
     }
 
     /* inform interested parties of initial verbosity level */
@@ -7628,30 +11973,47 @@ int main (int argc, char **argv) {
     /* allocate the connection array */
     initialize_connections();
 
-    cbsasl_server_init();
-
     /* initialize main thread libevent instance */
     main_base = event_base_new();
 
-    /* Load the storage engine */
-    if ((engine_ref = load_engine(settings.engine_module,
-                                  settings.extensions.logger)) == NULL) {
-        /* Error already reported */
-        exit(EXIT_FAILURE);
+    /*
+     * Configure the audit daemon, load RBAC, SASL and the storage engine
+     * at the same time. The server API is set up first, so the engine
+     * doesn't race anything initializing it.
+     */
+    (void)get_server_api();
+    memset(tasks, 0, sizeof(tasks));
+    tasks[0].run = startup_engine;
+    tasks[1].run = startup_rbac;
+    tasks[2].run = startup_sasl;
+    tasks[3].run = startup_audit;
+    startup_run(tasks, settings.audit_file != NULL ? 4 : 3);
+
+    if (settings.audit_file != NULL && !tasks[3].ok) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "FATAL: Failed to initialize audit "
+                                        "daemon with configuation file: %s",
+                                        settings.audit_file);
+        /* we failed configuring the audit.. run without it */
+        free((void*)settings.audit_file);
+        settings.audit_file = NULL;
     }
 
-    if (!create_engine_instance(engine_ref,
-                                get_server_api,
-                                settings.extensions.logger,
-                                &engine_handle)) {
-        exit(EXIT_FAILURE);
+    if (!tasks[1].ok) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "FATAL: Failed to load RBAC configuration: %s",
+                                        (settings.rbac_file) ?
+                                        settings.rbac_file :
+                                        "no file specified");
+        abort();
     }
 
-    if (!init_engine_instance(engine_handle,
-                              settings.engine_config,
-                              settings.extensions.logger)) {
+    /* Errors already reported */
+    if (!tasks[0].ok) {
         exit(EXIT_FAILURE);
     }
+    engine_ref = tasks[0].engine_ref;
+    engine_handle = tasks[0].engine_handle;
 
     if (settings.verbose > 0) {
         log_engine_details(engine_handle,settings.extensions.logger);
@@ -7677,9 +12039,65 @@ int main (int argc, char **argv) {
     }
 #endif
 
+#ifndef HAVE_ZSTD
+    if (settings.dictionary_compression_max != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "zstd is not supported, not compressing with dictionaries\n");
+        settings.dictionary_compression_max = 0;
+    }
+    if (settings.stream_compression_level != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "zstd is not supported, not compressing streams\n");
+        settings.stream_compression_level = 0;
+    }
+#endif
+
+#ifndef HAVE_IO_URING
+    if (settings.io_uring) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "io_uring is not supported, using libevent for all reads\n");
+        settings.io_uring = false;
+    }
+#endif
+
+    if (settings.arena_per_thread && get_alloc_hooks_type() != jemalloc) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "arena_per_thread needs jemalloc, all threads share the arenas\n");
+        settings.arena_per_thread = false;
+    }
+    /* Before the first thread asking for its arena is started */
+    mc_set_arena_per_thread(settings.arena_per_thread);
+
+    /* One timings shard per thread started by thread_init() */
+    initialize_timings(NUM_WORKER_THREADS());
+
     /* start up worker threads if MT mode */
     thread_init(settings.num_threads, main_base, dispatch_event_handler);
 
+    if (!sasl_pool_init(settings.num_sasl_threads)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to start the SASL threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!dictionary_init()) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to load the compression dictionaries\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!scripts_init()) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to load the scripts\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!memory_manager_init()) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to start the memory manager\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* Initialise memcached time keeping */
     mc_time_init(main_base);
 
@@ -7718,6 +12136,17 @@ int main (int argc, char **argv) {
     /* Optional parent monitor */
     setup_parent_monitor();
 
+    startup_phase_ns[STARTUP_TOTAL] = gethrtime() - startup_start;
+    if (settings.verbose > 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+            "Started in %" PRIu64 " ms (extensions %" PRIu64 " ms, engine "
+            "%" PRIu64 " ms)\n",
+            (uint64_t)(startup_phase_ns[STARTUP_TOTAL] / 1000000),
+            (uint64_t)(startup_phase_ns[STARTUP_EXTENSIONS] / 1000000),
+            (uint64_t)((startup_phase_ns[STARTUP_ENGINE_LOAD] +
+                        startup_phase_ns[STARTUP_ENGINE_INIT]) / 1000000));
+    }
+
     if (!memcached_shutdown) {
         /* enter the event loop */
         event_base_loop(main_base, 0);
@@ -7731,20 +12160,31 @@ int main (int argc, char **argv) {
     /* Close down the audit daemon cleanly */
     shutdown_auditdaemon(settings.audit_file);
 
+    /* The exchanges still queued notify the worker threads */
+    sasl_pool_shutdown();
+
     threads_shutdown();
 
     settings.engine.v1->destroy(settings.engine.v0, false);
+    /* The engines cancelled their tasks as they were destroyed */
+    executor_shutdown();
 
     threads_cleanup();
+    dictionary_shutdown();
+    scripts_shutdown();
+    memory_manager_shutdown();
+    heap_profile_shutdown();
 
     /* Free the memory used by listening_port structure */
     if (stats.listening_ports) {
         free(stats.listening_ports);
     }
+    free(rebind.pending);
 
     event_base_free(main_base);
     release_independent_stats(default_independent_stats);
     destroy_connections();
+    ssl_sessions_shutdown();
 
     if (get_alloc_hooks_type() == none) {
         unload_engine(engine_ref);
@@ -14,11 +14,13 @@
 #include <memcached/openssl.h>
 
 #include <memcached/protocol_binary.h>
+#include <memcached/protocol_greenstack.h>
 #include <memcached/engine.h>
 #include <memcached/extension.h>
 
 #include "rbac.h"
 #include "settings.h"
+#include "timer_wheel.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,6 +38,27 @@ extern "C" {
 
 /** Initial size of list of items being returned by "get". */
 #define ITEM_LIST_INITIAL 200
+/* The max number of items a connection keeps pinned for zero copy sends */
+#define ZEROCOPY_MAX_PINS 256
+/* The seconds a closing connection waits for its zero copy sends to be
+   taken by the peer before aborting (see conn_zerocopy_close()) */
+#define ZEROCOPY_CLOSE_WAIT 10
+/* The bytes a DCP step may queue before the producers push back */
+#define DCP_STEP_MAX_BYTES (1024 * 1024)
+/* The write buffer TAP connections gather their message headers in */
+#define TAP_FRAME_SIZE (DATA_BUFFER_SIZE << 5)
+/* The bytes one pass over the TAP iterator may queue */
+#define TAP_STEP_MAX_BYTES (1024 * 1024)
+/* The max number of pipelined GETQ/GETKQ packets looked up in one go */
+#define GET_BATCH_MAX 32
+/* The limit of the prefetch_depth setting (see conn::prefetched) */
+#define MAX_PREFETCH_DEPTH 16
+/* The limit of the max_outstanding_commands setting (see conn::refcount) */
+#define MAX_OUTSTANDING_COMMANDS 128
+/* The smallest compression_threshold (smaller values rarely shrink) */
+#define MIN_COMPRESSION_THRESHOLD 64
+/* The limit of dictionary_compression_max (larger values do well without) */
+#define MAX_DICTIONARY_COMPRESSION 16384
 
 /** Initial size of list of temprary auto allocates  */
 #define TEMP_ALLOC_LIST_INITIAL 20
@@ -51,6 +74,18 @@ extern "C" {
 #define IOV_LIST_HIGHWAT 50
 #define MSG_LIST_HIGHWAT 20
 
+/** Closed connection objects each worker thread keeps for reuse */
+#define CONN_POOL_MAX 256
+
+/** Size classes (DATA_BUFFER_SIZE << n) of the per-thread buffer pools */
+#define BUFFER_POOL_CLASSES 6
+/** Bytes of unused buffers each size class may keep around */
+#define BUFFER_POOL_CLASS_BYTES (1024 * 1024)
+
+/** Room for held back responses, and the largest response to hold back */
+#define COALESCE_BUFFER_SIZE (DATA_BUFFER_SIZE << 3)
+#define COALESCE_MAX_RESPONSE DATA_BUFFER_SIZE
+
 /* Slab sizing definitions. */
 #define POWER_SMALLEST 1
 #define POWER_LARGEST  200
@@ -86,7 +121,10 @@ extern "C" {
 
 enum bin_substates {
     bin_no_state,
-    bin_reading_packet
+    bin_reading_packet,
+    /* The extras and key of a SET received into the item (see conn::direct) */
+    bin_reading_set_header,
+    bin_reading_value
 };
 
 /** Stats stored per slab (and per thread). */
@@ -98,11 +136,24 @@ struct slab_stats {
     uint64_t  cas_badval;
 };
 
+/*
+ * Every thread_stats record starts on a cache line of its own, so the
+ * worker threads updating neighbouring records don't share lines.
+ */
+#define THREAD_STATS_ALIGNMENT 64
+#ifdef _MSC_VER
+#define THREAD_STATS_ALIGNED __declspec(align(THREAD_STATS_ALIGNMENT))
+#else
+#define THREAD_STATS_ALIGNED __attribute__((aligned(THREAD_STATS_ALIGNMENT)))
+#endif
+
 /**
- * Stats stored per-thread.
+ * Stats stored per-thread. Only the owning thread updates the counters
+ * (see stats.h).
  */
-struct thread_stats {
-    cb_mutex_t   mutex;
+struct THREAD_STATS_ALIGNED thread_stats {
+    /* Set by threadlocal_stats_reset(), the owner clears the record */
+    uint32_t          reset_pending;
     uint64_t          cmd_get;
     uint64_t          get_misses;
     uint64_t          delete_misses;
@@ -119,19 +170,79 @@ struct thread_stats {
     uint64_t          auth_errors;
     /* # of read buffers allocated. */
     uint64_t          rbufs_allocated;
-    /* # of read buffers which could be loaned (and hence didn't need to be allocated). */
+    /* # of read buffers taken from the thread's buffer pool (and hence didn't need to be allocated). */
     uint64_t          rbufs_loaned;
     /* # of read buffers which already existed (with partial data) on the connection
        (and hence didn't need to be allocated). */
     uint64_t          rbufs_existing;
     /* # of write buffers allocated. */
     uint64_t          wbufs_allocated;
-    /* # of write buffers which could be loaned (and hence didn't need to be allocated). */
+    /* # of write buffers taken from the thread's buffer pool (and hence didn't need to be allocated). */
     uint64_t          wbufs_loaned;
     /* Highest value iovsize has got to */
     uint64_t          iovused_high_watermark;
     /* High value conn->msgused has got to */
     uint64_t          msgused_high_watermark;
+    /* # of sendmsg calls with MSG_ZEROCOPY */
+    uint64_t          zerocopy_sends;
+    /* # of MSG_ZEROCOPY sends the kernel had to copy anyway */
+    uint64_t          zerocopy_copied;
+    /* # of connections handed over to a less busy thread */
+    uint64_t          conn_migrations;
+    /* # of responses held back to be sent together with a later one */
+    uint64_t          responses_coalesced;
+    /* # of SSL connections offloaded to kernel TLS */
+    uint64_t          ssl_ktls_offloads;
+    /* # of SSL handshakes completed, and how many resumed a session */
+    uint64_t          ssl_handshakes;
+    uint64_t          ssl_sessions_reused;
+    /* # of commands run while an earlier command was blocked */
+    uint64_t          unordered_cmds;
+    /* # of values compressed on store (see compression.h) */
+    uint64_t          values_compressed;
+    /* # of them compressed with a trained dictionary (see dictionary.h) */
+    uint64_t          values_dict_compressed;
+    /* # of bytes compressed on the streams (see stream_compression.h), and what they became */
+    uint64_t          stream_compress_in;
+    uint64_t          stream_compress_out;
+    /* # of inflated values served from / added to the inflate cache */
+    uint64_t          inflate_cache_hits;
+    uint64_t          inflate_cache_misses;
+    /* # of subdoc lookups found in / missing from the subdoc index cache */
+    uint64_t          subdoc_index_hits;
+    uint64_t          subdoc_index_misses;
+    /* # of events a connection only ran one command for (see conn_sched_budget()) */
+    uint64_t          sched_throttled;
+    /* # of events a connection got fewer commands for (see max_slice_usec) */
+    uint64_t          slice_trimmed;
+    /* # of commands failed with ETMPFAIL by conn_admit() */
+    uint64_t          cmds_shed;
+    /* # of commands failed with RATE_LIMITED (see rate_limit.h) */
+    uint64_t          cmds_rate_limited;
+    /* # of times a connection stopped reading for its unsent responses */
+    uint64_t          conns_throttled;
+    /* # of SET values received straight into the item (direct_receive_size) */
+    uint64_t          direct_receives;
+    /* # of times the unread input was moved to the front of the buffer */
+    uint64_t          read_repacks;
+    /* # of idle connections which had their memory released, and how much */
+    uint64_t          idle_trims;
+    uint64_t          idle_trimmed_bytes;
+    /* # of connections closed for being idle for idle_timeout */
+    uint64_t          idle_closes;
+    /* # of script steps run, and of runs which ran out of their budget */
+    uint64_t          script_steps;
+    uint64_t          script_budget_exceeded;
+    /* # of requests forwarded to the owner of their vbucket (see proxy.h) */
+    uint64_t          proxy_forwards;
+    /* # of them which got NOT_MY_VBUCKET as the node couldn't be reached */
+    uint64_t          proxy_failures;
+    /* # of gets also sent to a replica, and the ones it answered first */
+    uint64_t          proxy_hedges;
+    uint64_t          proxy_hedge_wins;
+    /* # of gets answered from the near cache, and items copied into it */
+    uint64_t          near_cache_hits;
+    uint64_t          near_cache_fills;
     struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
 };
 
@@ -169,10 +280,22 @@ struct engine_event_handler {
 
 extern struct stats stats;
 
+/* The kinds of connections sharing a worker thread (see conn_sched_budget()) */
+enum sched_class {
+    SCHED_CLIENT,
+    SCHED_DCP,
+    SCHED_TAP,
+    SCHED_CLASSES
+};
+
+/* The items a thread puts off releasing at most (see conn_release_items()) */
+#define RELEASE_BATCH_SIZE 256
+
 enum thread_type {
     GENERAL = 11,
     TAP = 13,
-    DISPATCHER = 15
+    DISPATCHER = 15,
+    DCP = 17
 };
 
 /**
@@ -185,6 +308,17 @@ struct net_buf {
     uint32_t bytes; /** how much data, starting from curr, do we have unparsed */
 };
 
+/**
+ * One size class of a worker thread's network buffer pool. The counters
+ * are only written by the owning thread (see stats.h).
+ */
+struct buffer_pool_class {
+    char *free;       /** unused buffers, linked through their first bytes */
+    uint64_t nfree;   /** number of buffers on the free list */
+    uint64_t hits;    /** allocations served from the free list */
+    uint64_t misses;  /** allocations which had to malloc() */
+};
+
 struct dynamic_buffer {
      char *buffer;   /** Start of the allocated buffer */
      size_t size;    /** Total allocated size */
@@ -195,22 +329,194 @@ typedef struct {
     cb_thread_t thread_id;      /* unique ID of this thread */
     struct event_base *base;    /* libevent handle this thread uses */
     struct event notify_event;  /* listen event for notify pipe */
-    SOCKET notify[2];           /* notification pipes */
+    SOCKET notify[2];           /* notification pipes (or one eventfd) */
+    bool use_eventfd;           /* notify[0] and [1] are the same eventfd */
+    long notify_pending;        /* a wakeup is already on its way */
     struct conn_queue *new_conn_queue; /* queue of new connections to handle */
     cb_mutex_t mutex;      /* Mutex to lock protect access to the pending_io */
     bool is_locked;
     struct conn *pending_io;    /* List of connection with pending async io ops */
     int index;                  /* index of this thread in the threads array */
     enum thread_type type;      /* Type of IO this thread processes */
+    bool started;               /* the slot has a running thread */
+    int cpu;                    /* bound to (see thread_affinity.h), or -1 */
 
     rel_time_t last_checked;
 
-    struct net_buf read; /** Shared read buffer for all connections serviced by this thread. */
-    struct net_buf write; /** Shared write buffer for all connections serviced by this thread. */
+    /** Read and write buffers for the connections serviced by this thread. */
+    struct buffer_pool_class buffers[BUFFER_POOL_CLASSES];
 
     subdoc_OPERATION* subdoc_op; /** Shared sub-document operation for all
                                      connections serviced by this thread. */
 
+    /**
+     * The spare buffer the subdoc commands flatten segmented documents
+     * and inflate compressed ones into; lent to one command at a time
+     * (see subdocument.cc), so it is only allocated again when the
+     * documents grow or commands overlap.
+     */
+    struct dynamic_buffer subdoc_doc;
+
+    /** Inflated copies of compressed values (see compression.h) */
+    struct inflate_cache *inflate_cache;
+
+    /** The zstd contexts of the thread (see dictionary.h) */
+    struct dictionary_contexts *dictionary;
+
+    /** Results of recent subdoc lookups (see subdoc_index.h) */
+    struct subdoc_index_cache *subdoc_index;
+
+    /** The last slow commands of the thread (see slow_ops.h) */
+    struct slow_op_log *slow_ops;
+
+    /** The request trace file of the thread (see workload_trace.h) */
+    struct workload_trace *trace;
+
+    /** The traffic of the thread by vbucket (see vbucket_stats.h) */
+    struct vbucket_counters *vbuckets;
+
+    /** The thread's share of the rate limits (see rate_limit.h) */
+    struct rate_limiter *rate_limiter;
+
+    /** The connections to the other nodes (see proxy.h) */
+    struct proxy *proxy;
+
+    /** The copies of the hot items (see near_cache.h), NULL if disabled */
+    struct near_cache *near_cache;
+
+    /*
+     * Load indicators for dispatch_conn_new(). Each counter has a single
+     * writer (see stats.h): conns_dispatched is written by the dispatcher,
+     * conns_accepted (reuseport mode), conns_closed and cmds by this thread.
+     */
+    uint64_t conns_dispatched;
+    uint64_t conns_accepted;
+    uint64_t conns_closed;
+    uint64_t cmds;
+
+    /* Requests until the next one sampled for debug logging */
+    uint32_t trace_countdown;
+
+    /* The SO_REUSEPORT listeners owned by this thread (reuseport mode) */
+    struct conn *listen_conns;
+    bool listen_disabled;
+
+    /*
+     * Connection objects closed on this thread, linked through next and
+     * kept on the list of all connections, so the next connections set
+     * up by the thread take neither the connections mutex nor malloc()
+     */
+    struct conn *conn_pool;
+    int conn_pool_size;
+
+    /*
+     * Ticks the timer wheel of the thread once a second, which runs the
+     * idle timers of its connections (see conn_idle_timer_arm())
+     */
+    struct event idle_timer;
+    struct timer_wheel wheel;
+
+    /*
+     * Connection migration (see rebalance_threads()). busy_ns is the time
+     * this thread spent running connections, and the conns_migrated
+     * counters are written by the thread the connection moved from (out)
+     * and to (in). migrate_to (-1 if none) and migrate_budget are set
+     * by the rebalancer and cleared by this thread, under the mutex.
+     */
+    uint64_t busy_ns;
+    uint64_t conns_migrated_in;
+    uint64_t conns_migrated_out;
+    int migrate_to;
+    uint64_t migrate_budget;
+
+    /*
+     * The io_uring the connections' socket reads go through (NULL unless
+     * the "io_uring" setting is enabled). Queued submissions are sent to
+     * the kernel by uring_submit_event, made active once per loop pass.
+     */
+    struct uring *uring;
+    struct event uring_event;
+    struct event uring_submit_event;
+    bool uring_submit_pending;
+
+    /*
+     * The weighted busy time of each kind of connection, and when one of
+     * them last ran (see conn_sched_budget()).
+     */
+    struct {
+        uint64_t vtime[SCHED_CLASSES];
+        hrtime_t ran[SCHED_CLASSES];
+    } sched;
+
+    /*
+     * The adaptive reqs_per_event (see max_slice_usec): the moving average
+     * of the time of a command run from an event, and the number of
+     * connections which ran in the previous pass of the loop.
+     */
+    struct {
+        uint64_t cmd_ns;
+        uint32_t ready;
+    } slice;
+
+    /*
+     * Load of the thread for the admission control (see conn_admit()):
+     * the connections waiting for the engine, and how long the event
+     * being run waited for the ones ahead of it in the pass of the loop.
+     */
+    struct {
+        uint32_t inflight;
+        hrtime_t delay;
+    } shed;
+
+    /*
+     * The time when the current callback of the event loop started, or
+     * the last time read with thread_clock_update() since. Good enough
+     * for the start of a command or the age of held back responses, for
+     * which it saves the thread a clock read per command.
+     */
+    hrtime_t clock;
+
+    /*
+     * Utilization of the event loop (see "stats threads"), only written by
+     * this thread. A pass of the loop is idle until the first callback
+     * runs (woke) and busy from there on. ready_wait is the time from the
+     * wakeup to a connection's callback (behind the ones before it), and
+     * notify_wait the time from notify_io_complete() to the connection
+     * running again. With busy_poll_usec spin is the part of the idle time
+     * spent polling without blocking, a hit a pass getting events while
+     * spinning and a miss one going on to block.
+     */
+    struct {
+        hrtime_t woke;
+        uint32_t pass_events;
+        uint64_t passes;
+        uint64_t events;
+        uint64_t max_events;
+        uint64_t idle_ns;
+        uint64_t busy_ns;
+        uint64_t ready_waits;
+        uint64_t ready_wait_ns;
+        uint64_t ready_wait_max_ns;
+        uint64_t notify_waits;
+        uint64_t notify_wait_ns;
+        uint64_t notify_wait_max_ns;
+        uint64_t spin_ns;
+        uint64_t spin_hits;
+        uint64_t spin_misses;
+    } loop;
+
+    /*
+     * The items the connections of the thread are done with, handed to
+     * engine::release_multi in one call at the end of the pass of the
+     * loop (see conn_release_items()). They're all of cookie, the items
+     * of another connection flush them first.
+     */
+    struct {
+        const void *cookie;
+        uint32_t count;
+        item *items[RELEASE_BATCH_SIZE];
+    } releases;
+
 } LIBEVENT_THREAD;
 
 #define LOCK_THREAD(t)                          \
@@ -233,6 +539,63 @@ typedef bool (*STATE_FUNC)(conn *);
 // Command context destructor function pointer.
 typedef void (*cmd_context_dtor_t)(void*);
 
+/*
+ * The state only some connections need lives out of struct conn, which
+ * stays small for the many idle connections a node may have. Each part
+ * is allocated when the connection starts to use it.
+ */
+
+/* The OpenSSL state of a connection to a TLS port */
+struct conn_ssl {
+    /* offload the records to the kernel after the handshake */
+    bool ktls;
+    SSL_CTX *ctx;
+    SSL *client;
+
+    bool connected;
+};
+
+/* The state of a DCP connection, from DCP_OPEN (or DCP_CONTROL) on */
+struct conn_dcp {
+    /* The value bytes queued by the current DCP step (see ship_dcp_log()) */
+    size_t step_bytes;
+    /* The bytes the current DCP step may queue */
+    size_t step_budget;
+    /* Producer side flow control, set up by the consumer with DCP_CONTROL */
+    struct {
+        /* The bytes the consumer is willing to buffer (0 means unlimited) */
+        uint32_t window;
+        /* The bytes sent which the consumer hasn't acknowledged yet */
+        uint32_t unacked;
+    } flow;
+    /* Value compression the consumer asked for with DCP_CONTROL */
+    struct {
+        /* Compress the values of at least this many bytes (0 for off) */
+        uint32_t threshold;
+        /* The values compressed, and their size before and after */
+        uint64_t values;
+        uint64_t bytes_in;
+        uint64_t bytes_out;
+    } compression;
+};
+
+/*
+ * The frame of the current request on a Greenstack port, and the room
+ * for the header of its response frame (see greenstack.c).
+ */
+struct conn_greenstack {
+    uint32_t stream;    /* network byte order */
+    uint8_t taglen;
+    bool unsupported;   /* the request had unknown mandatory fields */
+    bool framed;        /* the response queued has its frame header */
+    char tag[PROTOCOL_GREENSTACK_MAX_TAG];
+    union {
+        protocol_greenstack_frame_header header;
+        char bytes[sizeof(protocol_greenstack_frame_header) + 2 +
+                   PROTOCOL_GREENSTACK_MAX_TAG];
+    } frame;
+};
+
 /**
  * The structure representing a connection into memcached.
  */
@@ -242,14 +605,43 @@ struct conn {
 
     SOCKET sfd;
     protocol_t protocol; /* The protocol used by the connection */
-    char *peername; /* Name of the peer if known */
-    char *sockname; /* Name of the local socket if known */
+    struct conn_names *names; /* Looked up on first use by get_peername() */
     int max_reqs_per_event; /** The maximum requests we can process in a worker
                                 thread timeslice */
     int nevents; /** number of events this connection can process in a single
                      worker thread timeslice */
+    CONN_PRIORITY priority; /** Weighs the busy time of the connection */
+    bool engine_wait; /** Counted in the shed.inflight of the thread */
+    /*
+     * A large SET receives its value straight into the item allocated
+     * once its extras and key are in (see the "direct_receive_size"
+     * setting): vlen is the size of the value, which isn't part of the
+     * packet in the read buffer, and segment the one of the item being
+     * read into.
+     */
+    struct {
+        uint32_t vlen;
+        uint16_t segment;
+    } direct;
     bool admin;
     cbsasl_conn_t *sasl_conn;
+    /*
+     * The local user of the peer on an interface with peercred, which the
+     * connection is authenticated as until a SASL_AUTH
+     */
+    char *peer_user;
+    /* The shared memory rings replacing the socket (see shm_ring.h) */
+    struct shm_ring *shm;
+    /*
+     * The result of the SASL exchange run on a SASL thread, pending while
+     * the connection waits for it (see sasl_pool.c)
+     */
+    struct {
+        bool pending;
+        cbsasl_error_t result;
+        const char *out;
+        unsigned int outlen;
+    } sasl_auth;
     STATE_FUNC   state;
     enum bin_substates substate;
     bool   registered_in_libevent;
@@ -280,7 +672,10 @@ struct conn {
     /* data for the swallow state */
     uint32_t sbytes;    /* how many bytes to swallow */
 
-    /* data for the mwrite state */
+    /*
+     * data for the mwrite state, the lists are allocated by the first
+     * response and freed once the connection waits for input again
+     */
     struct iovec *iov;
     int    iovsize;   /* number of elements allocated in iov[] */
     int    iovused;   /* number of elements used in iov[] */
@@ -296,18 +691,112 @@ struct conn {
     void   **icurr;
     int    ileft;
 
+    /*
+     * Items sent with MSG_ZEROCOPY stay pinned until the kernel reports
+     * (on the socket error queue) that it is done with their memory.
+     */
+    struct {
+        bool enabled;  /* SO_ZEROCOPY is set on the socket */
+        bool used;     /* the current msghdr list used MSG_ZEROCOPY */
+        uint32_t next; /* the id the kernel gives the next zero copy send */
+        uint32_t done; /* all sends with a lower id are completed */
+        struct zerocopy_pin {
+            void *item;
+            uint32_t id; /* the last send referencing the item */
+        } *pins;       /* room for ZEROCOPY_MAX_PINS */
+        int npins;
+        /* When the connection started closing, and if it was aborted */
+        rel_time_t close_time;
+        bool aborted;
+    } zerocopy;
+
+    /*
+     * Set while the connection stopped reading commands for its unsent
+     * responses (see conn_output_throttled()), and the TCP_NOTSENT_LOWAT
+     * set on its socket to be woken up once they're down to the limit.
+     */
+    struct {
+        bool active;
+        uint32_t lowat;
+    } throttle;
+
+    /*
+     * Copies of the responses to pipelined commands held back to go out
+     * with a later sendmsg() (see the "response_coalescing_usec" setting).
+     * While queued, buf is the first iovec of the msghdr list.
+     */
+    struct {
+        struct net_buf buf;
+        hrtime_t since;  /* when the oldest response was held back */
+        bool queued;
+        bool sending;    /* transmit() started on the current response */
+    } coalesce;
+
+    /*
+     * Out of order execution (PROTOCOL_BINARY_FEATURE_UNORDERED_EXECUTION).
+     * While a command is blocked in the engine the complete commands
+     * already received after it run on child connections (which are the
+     * engine cookies for them), and their responses are copied to buf.
+     * buf goes out as the first iovec of a later response, where sending
+     * holds it until it's sent.
+     */
+    struct {
+        bool enabled;
+        bool blocked;   /* the next command waits for the children */
+        bool failed;    /* a child wanted the connection closed */
+        uint32_t skip;  /* input after read.curr executed by the children */
+        int outstanding;
+        struct conn *parent;   /* set on the children */
+        struct conn *children; /* the children still running... */
+        struct conn *next;     /* ...linked through their next */
+        struct net_buf buf;
+        struct net_buf sending;
+    } unordered;
+
+    /* Set on the connections to a Greenstack port */
+    struct conn_greenstack *greenstack;
+
+    /*
+     * Lookups for a run of pipelined GETQ/GETKQ packets already sitting
+     * in the input buffer, done with a single engine::get_multi call.
+     * Entry "next" holds the answer for the next packet to execute.
+     */
+    struct {
+        item_get_request *requests; /* room for GET_BATCH_MAX */
+        uint32_t *opaques;          /* the opaque of each packet */
+        char *keys;                 /* copies of the keys */
+        int count;
+        int next;
+    } get_batch;
+
+    /*
+     * How far ahead of the packet being executed the keys were prefetched
+     * (the number of packets including it), see prefetch_pipelined_keys.
+     */
+    uint8_t prefetched;
+
+    /* The body of the last response of the command (for the timings) */
+    uint32_t rsp_bodylen;
+
     char   **temp_alloc_list;
     int    temp_alloc_size;
     char   **temp_alloc_curr;
     int    temp_alloc_left;
 
-    struct sockaddr_storage request_addr; /* Who sent the most recent request */
-    socklen_t request_addr_size;
     int    hdrsize;   /* number of headers' worth of space is allocated */
 
     bool   noreply;   /* True if the reply should not be sent. */
     bool nodelay; /* Is tcp nodelay enabled? */
 
+    /*
+     * Debug logging of the requests (see conn_trace_request()): trace is
+     * set through the "trace.connection" ioctl to log all the requests of
+     * the connection rather than a sample, and trace_request is whether
+     * the current request is logged.
+     */
+    bool trace;
+    bool trace_request;
+
     /* current stats command */
 
     uint8_t refcount; /* number of references to the object */
@@ -319,6 +808,50 @@ struct conn {
      */
     bool supports_mutation_extras;
 
+    /**
+     * If the client enabled PROTOCOL_BINARY_FEATURE_EXPTIME_MS an exptime
+     * with MC_TIME_EXPTIME_MS set is in milliseconds.
+     */
+    bool supports_exptime_ms;
+
+    /**
+     * If the client enabled PROTOCOL_BINARY_FEATURE_COMPACT_RESPONSE the
+     * header add_bin_header() put in iov[header_iov] is compacted before
+     * the response goes out (-1 if there is none).
+     */
+    struct {
+        bool enabled;
+        int header_iov;
+    } compact;
+
+    /**
+     * Set by the HELLO granting PROTOCOL_BINARY_FEATURE_STREAM_COMPRESSION
+     * (see stream_compression.h), and active from the first response
+     * after the one to that HELLO.
+     */
+    struct stream_compressor *stream;
+    bool stream_active;
+
+    /**
+     * The invalidation of the near cache the current command owes when
+     * it's done (see near_cache.h), and if the connection selected a
+     * bucket the near cache doesn't know about.
+     */
+    struct {
+        int pending;
+        bool disabled;
+    } near_cache;
+
+    /**
+     * The engine the proxy engine bound the connection to for the data
+     * commands (binding.v1 is NULL if none, see conn_engine_enter()).
+     * tried is set once it was asked, until the bucket may have changed.
+     */
+    struct {
+        engine_binding_t binding;
+        bool tried;
+    } bound;
+
     struct dynamic_buffer dynamic_buffer;
 
     // Pointer to engine-specific data which the engine has requested the server
@@ -328,6 +861,63 @@ struct conn {
 
     hrtime_t start;
 
+    /* The first notify_io_complete() since the connection last ran */
+    hrtime_t notify_time;
+
+    /* When the connection last ran on its thread */
+    rel_time_t active_time;
+    /* Armed in the wheel of its thread while it is attached to it */
+    struct wheel_timer idle_timer;
+
+    /*
+     * When the current command reached its phases, if it's timed (with
+     * phase_timings or slow_command_threshold set). The EWOULDBLOCK wait
+     * and the wakeup are totals, a command may block more than once.
+     */
+    struct {
+        bool active;
+        hrtime_t start;      /* the header is read */
+        hrtime_t read;       /* the whole packet is read */
+        hrtime_t dispatch;   /* the executor is called */
+        hrtime_t blocked;    /* the engine returned EWOULDBLOCK */
+        hrtime_t notified;   /* notify_io_complete(), under the thread lock */
+        hrtime_t done;       /* the response is ready */
+        hrtime_t first_byte; /* the first byte of the response is sent */
+        hrtime_t ewouldblock;
+        hrtime_t wakeup;
+        /* What the slow command log records of the command */
+        uint16_t status;
+        uint16_t vbucket;
+        uint16_t nkey;
+        char key[32];        /* the start of it */
+    } phase;
+
+    /*
+     * Time spent running this connection in the current and the previous
+     * second, used to pick a connection to migrate.
+     */
+    struct {
+        rel_time_t since;  /* the second "current" is accumulated for */
+        hrtime_t current;
+        hrtime_t previous;
+    } busy;
+
+    /*
+     * Reads through the thread's io_uring. While the multishot receive is
+     * armed it holds a reference on the connection, and the buffers it
+     * filled are queued (oldest first) until the state machine reads them.
+     */
+    struct {
+        bool enabled;
+        bool armed;
+        bool fallback;  /* EV_READ is polled through libevent again */
+        bool want_read; /* the connection is registered for EV_READ */
+        bool eof;
+        int error;      /* errno of a failed receive, 0 if none */
+        int head;       /* queued buffer ids, -1 if none */
+        int tail;
+    } uring;
+
     /* Binary protocol stuff */
     /* This is where the binary header goes */
     protocol_binary_request_header binary_header;
@@ -342,10 +932,17 @@ struct conn {
 
     ENGINE_ERROR_CODE aiostat;
     bool ewouldblock;
+    /* Where the executor of the command blocked, 0 if it didn't (see
+     * EXECUTOR_AWAIT in memcached.c) */
+    int resume;
     TAP_ITERATOR tap_iterator;
     in_port_t parent_port; /* Listening port that creates this connection instance */
 
     int dcp;
+    /* Move over to a DCP thread once idle (see migrate_conn()) */
+    bool dcp_migrate;
+    /* NULL until the connection opens DCP (see conn_dcp_state()) */
+    struct conn_dcp *dcp_state;
 
     /** command-specific context - for use by command executors to maintain
      *  additional state while executing a command. For example
@@ -360,26 +957,23 @@ struct conn {
     void* cmd_context;
     cmd_context_dtor_t cmd_context_dtor;
 
-    /* Clean up this at one point.. */
-    struct {
-        struct {
-            char *buffer;
-            int buffsz;
-            int total;
-            int current;
-        } in, out;
-
-        bool enabled;
-        bool error;
-        SSL_CTX *ctx;
-        SSL *client;
-
-        bool connected;
-        BIO *application;
-        BIO *network;
-    } ssl;
+    /* Set on the connections to a TLS port */
+    struct conn_ssl *ssl;
 
     auth_context_t *auth_context;
+    /*
+     * The opcode bitmap of auth_context (NULL until it's looked up), and
+     * the RBAC generation of the context (see conn_check_access())
+     */
+    const uint64_t *access_mask;
+    uint32_t access_generation;
+    /*
+     * The index of the user of auth_context and its own rate limits (0
+     * for none), looked up with the access mask (see rate_limit.h)
+     */
+    uint32_t rate_user;
+    uint32_t rate_ops;
+    uint32_t rate_bytes;
 };
 
 typedef union {
@@ -409,6 +1003,28 @@ bool register_event(conn *c, struct timeval *timeout);
 bool unregister_event(conn *c);
 bool update_event(conn *c, const int new_flags);
 
+/*
+ * Look up the metadata and the first segment of the value of an item,
+ * and the other segments one at a time (index 0 is view->value). They
+ * use the engine's get_item_view and get_item_segment, or get_item_info
+ * for engines without them, so the hot paths don't need an
+ * item_info_holder.
+ */
+bool get_item_view(conn *c, const item *it, item_view *view);
+bool get_item_segment(conn *c, const item *it, const item_view *view,
+                      uint16_t index, struct iovec *segment);
+
+/*
+ * The engine to call for a data command of the connection: the one
+ * serving its bucket, if the proxy engine bound the connection to it
+ * (see engine_binding_t), or else settings.engine. Every
+ * conn_engine_enter() needs its conn_engine_leave() once the call
+ * returned.
+ */
+ENGINE_HANDLE_V1 *conn_engine_enter(conn *c, ENGINE_HANDLE **handle);
+void conn_engine_leave(conn *c, const ENGINE_HANDLE_V1 *v1);
+void conn_engine_unbind(conn *c);
+
 /*
  * Functions such as the libevent-related calls that need to do cross-thread
  * communication in multithreaded mode (rather than actually doing the work
@@ -416,14 +1032,65 @@ bool update_event(conn *c, const int new_flags);
  * also #define-d to directly call the underlying code in singlethreaded mode.
  */
 
+/*
+ * The worker thread slots (settings.max_threads, of which the first
+ * settings.num_threads are in use), the spare one (which isn't dispatched
+ * to) and the DCP threads, in the order they are indexed.
+ */
+#define NUM_WORKER_THREADS() \
+    (settings.max_threads + 1 + settings.num_dcp_threads)
+
 void thread_init(int nthreads, struct event_base *main_base,
                  void (*dispatcher_callback)(evutil_socket_t, short, void *));
+void threads_resize(int nthreads);
 void threads_shutdown(void);
 void threads_cleanup(void);
 
 void dispatch_conn_new(SOCKET sfd, int parent_port,
                        STATE_FUNC init_state, int event_flags,
                        int read_buffer_size);
+bool migrate_conn(conn *c);
+void dispatch_listen_conn(int tid, SOCKET sfd, int parent_port);
+void accept_conn_new(LIBEVENT_THREAD *me, SOCKET sfd, int parent_port,
+                     STATE_FUNC init_state, int event_flags,
+                     int read_buffer_size);
+void notify_listen_threads(void);
+void thread_update_listen(LIBEVENT_THREAD *me);
+
+/*
+ * Network buffers from the thread's pool (me may be NULL, which just uses
+ * malloc() / free()). Resizing keeps the data up to buf->curr + buf->bytes,
+ * and buf->curr at the same offset.
+ */
+bool thread_buffer_alloc(LIBEVENT_THREAD *me, struct net_buf *buf,
+                         uint32_t size);
+bool thread_buffer_resize(LIBEVENT_THREAD *me, struct net_buf *buf,
+                          uint32_t size);
+void thread_buffer_release(LIBEVENT_THREAD *me, struct net_buf *buf);
+void buffer_pool_aggregate(struct buffer_pool_class *out);
+void slow_ops_stats(ADD_STAT add_stats, conn *c);
+/* The records written to the trace files of all the threads */
+uint64_t thread_trace_records(void);
+void thread_loop_stats(ADD_STAT add_stats, conn *c);
+hrtime_t thread_loop_event(LIBEVENT_THREAD *me);
+/* The time cached by the thread (see LIBEVENT_THREAD::clock) */
+#define thread_clock(me) ((me)->clock)
+/* Read the time, and cache it as the thread's clock */
+hrtime_t thread_clock_update(LIBEVENT_THREAD *me);
+void thread_loop_notify_wait(LIBEVENT_THREAD *me, hrtime_t ns);
+/* Release the items put off by the connections of the thread */
+void thread_flush_releases(LIBEVENT_THREAD *me);
+/* The same if they're the ones of c (before c goes or changes its bucket) */
+void conn_flush_releases(conn *c);
+
+/* Socket reads through the thread's io_uring (connections in uring mode) */
+bool conn_uring_want_read(conn *c);
+void conn_uring_cancel(conn *c);
+int conn_uring_recv(conn *c, void *dest, size_t nbytes);
+void conn_uring_release(conn *c);
+
+/* Best effort send of the held back responses of a blocked connection */
+void conn_coalesce_send(conn *c);
 
 /* Lock wrappers for cache functions that are called from main loop. */
 void accept_new_conns(const bool do_accept);
@@ -443,6 +1110,9 @@ void append_stat(const char *name, ADD_STAT add_stats, conn *c,
                  const char *fmt, ...);
 
 void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status);
+void conn_peer_authenticate(conn *c);
+void notify_io_complete_multi(const void * const *cookies,
+                              const ENGINE_ERROR_CODE *status, int ncookies);
 void conn_set_state(conn *c, STATE_FUNC state);
 const char *state_text(STATE_FUNC state);
 void safe_close(SOCKET sfd);
@@ -457,6 +1127,7 @@ void enlist_conn(conn *c, conn **list);
 
 /* Aggregate the maximum number of connections */
 void calculate_maxconns(void);
+void rebind_interface(int idx, const struct interface *interf);
 
 bool load_extension(const char *soname, const char *config);
 
@@ -475,6 +1146,7 @@ bool conn_nread(conn *c);
 bool conn_pending_close(conn *c);
 bool conn_immediate_close(conn *c);
 bool conn_closing(conn *c);
+bool conn_zerocopy_close(conn *c);
 bool conn_destroyed(conn *c);
 bool conn_mwrite(conn *c);
 bool conn_ship_log(conn *c);
@@ -483,6 +1155,8 @@ bool conn_refresh_cbsasl(conn *c);
 bool conn_refresh_ssl_certs(conn *c);
 bool conn_flush(conn *c);
 bool conn_audit_configuring(conn *c);
+bool conn_stats_stream(conn *c);
+bool conn_proxy_wait(conn *c);
 
 void event_handler(evutil_socket_t fd, short which, void *arg);
 
@@ -522,6 +1196,14 @@ const char* get_server_version(void);
  */
 int add_iov(conn *c, const void *buf, size_t len);
 
+/*
+ * Puts data in front of everything added with add_iov() (before anything
+ * of it was sent).
+ *
+ * Returns 0 on success, -1 on out-of-memory.
+ */
+int insert_iov(conn *c, const void *buf, size_t len);
+
 int add_bin_header(conn *c, uint16_t err, uint8_t ext_len, uint16_t key_len,
                    uint32_t body_len, uint8_t datatype);
 
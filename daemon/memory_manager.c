@@ -0,0 +1,155 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include "memory_manager.h"
+#include "alloc_hooks.h"
+
+#include <string.h>
+
+/* Enough for the extra stats of any allocator */
+#define MEMORY_MANAGER_EXT_STATS 8
+
+static struct {
+    cb_thread_t tid;
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+    bool running;
+    bool shutdown;
+    /* Over the threshold, releasing until down to half of it */
+    bool releasing;
+    struct memory_manager_stats stats;  /* with the mutex */
+} manager;
+
+/* Read the allocator into manager.stats */
+static void memory_manager_read(void) {
+    allocator_ext_stat ext[MEMORY_MANAGER_EXT_STATS];
+    allocator_stats alloc;
+    int next = mc_get_extra_stats_size();
+
+    memset(&alloc, 0, sizeof(alloc));
+    alloc.ext_stats = ext;
+    alloc.ext_stats_size = next < MEMORY_MANAGER_EXT_STATS ?
+        next : MEMORY_MANAGER_EXT_STATS;
+    mc_get_allocator_stats(&alloc);
+
+    cb_mutex_enter(&manager.mutex);
+    manager.stats.heap_bytes = alloc.heap_size;
+    manager.stats.allocated_bytes = alloc.allocated_size;
+    manager.stats.free_mapped_bytes = alloc.free_mapped_size;
+    manager.stats.free_unmapped_bytes = alloc.free_unmapped_size;
+    manager.stats.fragmentation_bytes = alloc.fragmentation_size;
+    cb_mutex_exit(&manager.mutex);
+}
+
+static bool over_pct(uint64_t free_mapped, uint64_t heap, uint32_t pct) {
+    return heap != 0 && free_mapped * 100 > heap * pct;
+}
+
+/* One tick: release up to the budget of the tick if over the threshold */
+static void memory_manager_tick(void) {
+    uint32_t pct = settings.free_memory_release_pct;
+    uint64_t budget = (uint64_t)settings.free_memory_release_rate *
+        1024 * 1024 * MEMORY_MANAGER_TICK_MS / 1000;
+    uint64_t free_mapped, heap;
+
+    memory_manager_read();
+    if (pct == 0) {
+        manager.releasing = false;
+        return;
+    }
+
+    cb_mutex_enter(&manager.mutex);
+    free_mapped = manager.stats.free_mapped_bytes;
+    heap = manager.stats.heap_bytes;
+    if (!manager.releasing && over_pct(free_mapped, heap, pct)) {
+        manager.releasing = true;
+        manager.stats.releases++;
+    }
+    cb_mutex_exit(&manager.mutex);
+
+    while (manager.releasing && budget > 0 && !manager.shutdown) {
+        size_t slice = budget < MEMORY_MANAGER_SLICE ?
+            (size_t)budget : MEMORY_MANAGER_SLICE;
+        uint64_t before = free_mapped;
+
+        if (!over_pct(free_mapped * 2, heap, pct)) {
+            manager.releasing = false;
+            break;
+        }
+        if (!mc_release_free_memory_slice(slice)) {
+            manager.releasing = false;
+            break;
+        }
+        budget -= slice;
+
+        memory_manager_read();
+        cb_mutex_enter(&manager.mutex);
+        free_mapped = manager.stats.free_mapped_bytes;
+        heap = manager.stats.heap_bytes;
+        manager.stats.slices++;
+        if (free_mapped < before) {
+            manager.stats.released_bytes += before - free_mapped;
+        }
+        cb_mutex_exit(&manager.mutex);
+        if (get_alloc_hooks_type() == jemalloc) {
+            /* It purged everything it could */
+            break;
+        }
+    }
+}
+
+static void memory_manager_main(void *arg) {
+    (void)arg;
+
+    cb_mutex_enter(&manager.mutex);
+    while (!manager.shutdown) {
+        cb_cond_timedwait(&manager.cond, &manager.mutex,
+                          MEMORY_MANAGER_TICK_MS);
+        if (manager.shutdown) {
+            break;
+        }
+        cb_mutex_exit(&manager.mutex);
+        memory_manager_tick();
+        cb_mutex_enter(&manager.mutex);
+    }
+    cb_mutex_exit(&manager.mutex);
+}
+
+bool memory_manager_init(void) {
+    int ret;
+
+    cb_mutex_initialize(&manager.mutex);
+    cb_cond_initialize(&manager.cond);
+    if (get_alloc_hooks_type() == none) {
+        /* Nothing to read or release */
+        return true;
+    }
+
+    ret = cb_create_thread(&manager.tid, memory_manager_main, NULL, 0);
+    if (ret != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "Can't create the memory manager thread: %s\n",
+                strerror(ret));
+        return false;
+    }
+    manager.running = true;
+    return true;
+}
+
+void memory_manager_shutdown(void) {
+    if (manager.running) {
+        cb_mutex_enter(&manager.mutex);
+        manager.shutdown = true;
+        cb_cond_signal(&manager.cond);
+        cb_mutex_exit(&manager.mutex);
+        cb_join_thread(manager.tid);
+        manager.running = false;
+    }
+    cb_cond_destroy(&manager.cond);
+    cb_mutex_destroy(&manager.mutex);
+}
+
+void memory_manager_get_stats(struct memory_manager_stats *stats) {
+    cb_mutex_enter(&manager.mutex);
+    *stats = manager.stats;
+    cb_mutex_exit(&manager.mutex);
+}
@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The thread returning the free memory of the allocator to the OS: after a
+ * flush or the deletion of most of the items the allocator keeps the freed
+ * pages mapped, so the RSS stays up. Every MEMORY_MANAGER_TICK_MS the
+ * thread reads the allocator stats, and once the free but mapped memory is
+ * over "free_memory_release_pct" percent of the heap it releases it in
+ * slices of at most MEMORY_MANAGER_SLICE bytes, no more than
+ * "free_memory_release_rate" MB a second, until it is down to half of
+ * that. The allocator holds its lock for one slice at a time, so the
+ * worker threads never wait long for it (jemalloc can only purge all of
+ * its free pages at once, it gets one call per tick).
+ */
+
+#ifndef MEMORY_MANAGER_H
+#define MEMORY_MANAGER_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MEMORY_MANAGER_TICK_MS 100
+#define MEMORY_MANAGER_SLICE (1024 * 1024)
+
+/* Start the thread, returns false if we can't */
+bool memory_manager_init(void);
+
+/* Stop the thread */
+void memory_manager_shutdown(void);
+
+struct memory_manager_stats {
+    /* From the last read of the allocator */
+    uint64_t heap_bytes;
+    uint64_t allocated_bytes;
+    uint64_t free_mapped_bytes;
+    uint64_t free_unmapped_bytes;
+    uint64_t fragmentation_bytes;
+    /* What the thread did */
+    uint64_t releases;          /* the times it went over the threshold */
+    uint64_t slices;
+    uint64_t released_bytes;
+};
+
+void memory_manager_get_stats(struct memory_manager_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,275 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The near cache of a thread is direct mapped, a key only ever goes to the
+ * entry of its hash, and the sketch has four slots per entry. A slot keeps
+ * the key which has the majority of the gets hashed to it, votes for it
+ * going up on its gets and down on the others' (Boyer-Moore), so a key
+ * gets in after NEAR_CACHE_ADMIT more of its gets than the others of its
+ * slot, and the ones only read now and then never do.
+ */
+#include "config.h"
+#include "near_cache.h"
+#include "hash.h"
+#include "mc_time.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The generations the keys are hashed into, on cache lines of their own */
+#define NEAR_CACHE_GENERATIONS 1024
+
+/* The votes of its slot of the sketch a key needs to get in */
+#define NEAR_CACHE_ADMIT 8
+
+static struct {
+    uint64_t value;
+    uint8_t pad[56];
+} generations[NEAR_CACHE_GENERATIONS];
+
+static uint64_t epoch;
+
+struct near_cache_entry {
+    char *data;             /* the key and the value, NULL if empty */
+    char *bucket;           /* NULL for the default bucket */
+    uint32_t hash;
+    uint16_t nkey;
+    uint16_t vbucket;
+    uint32_t nvalue;
+    uint32_t flags;
+    uint64_t cas;
+    uint64_t generation;
+    uint64_t epoch;
+    rel_time_t exptime;
+    uint8_t datatype;
+    uint8_t clsid;
+};
+
+struct heavy_hitter {
+    uint32_t hash;
+    uint32_t votes;
+};
+
+struct near_cache {
+    struct near_cache_entry *entries;
+    uint32_t mask;
+    struct heavy_hitter *sketch;
+    uint32_t sketch_mask;
+};
+
+static bool same_bucket(const char *a, const char *b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return strcmp(a, b) == 0;
+}
+
+static void entry_clear(struct near_cache_entry *e) {
+    free(e->data);
+    free(e->bucket);
+    e->data = NULL;
+    e->bucket = NULL;
+}
+
+struct near_cache *near_cache_create(uint32_t nitems) {
+    struct near_cache *nc;
+    uint32_t size = 1;
+
+    if (nitems == 0) {
+        return NULL;
+    }
+    while (size < nitems) {
+        size <<= 1;
+    }
+    if ((nc = calloc(1, sizeof(*nc))) == NULL) {
+        return NULL;
+    }
+    nc->entries = calloc(size, sizeof(*nc->entries));
+    nc->sketch = calloc(size * 4, sizeof(*nc->sketch));
+    if (nc->entries == NULL || nc->sketch == NULL) {
+        free(nc->entries);
+        free(nc->sketch);
+        free(nc);
+        return NULL;
+    }
+    nc->mask = size - 1;
+    nc->sketch_mask = size * 4 - 1;
+    return nc;
+}
+
+void near_cache_destroy(struct near_cache *nc) {
+    uint32_t ii;
+
+    if (nc == NULL) {
+        return;
+    }
+    for (ii = 0; ii <= nc->mask; ++ii) {
+        entry_clear(&nc->entries[ii]);
+    }
+    free(nc->entries);
+    free(nc->sketch);
+    free(nc);
+}
+
+bool near_cache_lookup(conn *c, const char *bucket, const void *key,
+                       uint16_t nkey, uint16_t vbucket, near_cache_hit_t *hit,
+                       near_cache_ticket_t *ticket) {
+    struct near_cache *nc = c->thread->near_cache;
+    struct near_cache_entry *e;
+    struct heavy_hitter *hh;
+    uint32_t h = hash(key, nkey, 0);
+
+    /* Read before the engine is, so a change made meanwhile is seen */
+    ticket->hash = h;
+    ticket->generation = __atomic_load_n(
+        &generations[h % NEAR_CACHE_GENERATIONS].value, __ATOMIC_ACQUIRE);
+    ticket->epoch = __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+    ticket->admit = false;
+
+    e = &nc->entries[h & nc->mask];
+    if (e->data != NULL && e->hash == h && e->nkey == nkey &&
+        e->vbucket == vbucket && memcmp(e->data, key, nkey) == 0 &&
+        same_bucket(e->bucket, bucket)) {
+        if (e->generation == ticket->generation &&
+            e->epoch == ticket->epoch &&
+            (e->exptime == 0 || e->exptime > mc_time_get_current_time())) {
+            hit->value = e->data + e->nkey;
+            hit->nvalue = e->nvalue;
+            hit->flags = e->flags;
+            hit->cas = e->cas;
+            hit->datatype = e->datatype;
+            hit->clsid = e->clsid;
+            STATS_NOKEY(c, near_cache_hits);
+            return true;
+        }
+        entry_clear(e);
+    }
+
+    hh = &nc->sketch[h & nc->sketch_mask];
+    if (hh->hash == h) {
+        if (++hh->votes >= NEAR_CACHE_ADMIT) {
+            hh->votes = 0;
+            ticket->admit = true;
+        }
+    } else if (hh->votes == 0) {
+        hh->hash = h;
+        hh->votes = 1;
+    } else {
+        --hh->votes;
+    }
+    return false;
+}
+
+void near_cache_fill(conn *c, const char *bucket, const void *key,
+                     uint16_t nkey, uint16_t vbucket, const item *it,
+                     const item_view *info, const near_cache_ticket_t *ticket) {
+    struct near_cache *nc = c->thread->near_cache;
+    struct near_cache_entry *e;
+    struct iovec segment;
+    char *data, *copy = NULL;
+    size_t offset;
+    uint16_t ii;
+
+    if (!ticket->admit || info->nbytes > NEAR_CACHE_MAX_VALUE ||
+        (info->datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) != 0) {
+        return;
+    }
+    if ((data = malloc(nkey + info->nbytes + 1)) == NULL ||
+        (bucket != NULL && (copy = strdup(bucket)) == NULL)) {
+        free(data);
+        return;
+    }
+    memcpy(data, key, nkey);
+    offset = nkey;
+    for (ii = 0; ii < info->nsegments; ++ii) {
+        if (!get_item_segment(c, it, info, ii, &segment)) {
+            free(data);
+            free(copy);
+            return;
+        }
+        memcpy(data + offset, segment.iov_base, segment.iov_len);
+        offset += segment.iov_len;
+    }
+
+    e = &nc->entries[ticket->hash & nc->mask];
+    entry_clear(e);
+    e->data = data;
+    e->bucket = copy;
+    e->hash = ticket->hash;
+    e->nkey = nkey;
+    e->vbucket = vbucket;
+    e->nvalue = (uint32_t)(offset - nkey);
+    e->flags = info->flags;
+    e->cas = info->cas;
+    e->generation = ticket->generation;
+    e->epoch = ticket->epoch;
+    e->exptime = info->exptime;
+    e->datatype = info->datatype;
+    e->clsid = info->clsid;
+    STATS_NOKEY(c, near_cache_fills);
+}
+
+int near_cache_invalidation(uint8_t opcode, const void *key, uint16_t nkey) {
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+    case PROTOCOL_BINARY_CMD_GET_RANGE:
+    case PROTOCOL_BINARY_CMD_GET_REPLICA:
+    case PROTOCOL_BINARY_CMD_GET_META:
+    case PROTOCOL_BINARY_CMD_GETQ_META:
+    case PROTOCOL_BINARY_CMD_SUBDOC_GET:
+    case PROTOCOL_BINARY_CMD_SUBDOC_EXISTS:
+    case PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP:
+    case PROTOCOL_BINARY_CMD_NOOP:
+    case PROTOCOL_BINARY_CMD_VERSION:
+    case PROTOCOL_BINARY_CMD_STAT:
+    case PROTOCOL_BINARY_CMD_HELLO:
+    case PROTOCOL_BINARY_CMD_VERBOSITY:
+    case PROTOCOL_BINARY_CMD_QUIT:
+    case PROTOCOL_BINARY_CMD_QUITQ:
+    case PROTOCOL_BINARY_CMD_SASL_LIST_MECHS:
+    case PROTOCOL_BINARY_CMD_SASL_AUTH:
+    case PROTOCOL_BINARY_CMD_SASL_STEP:
+    case PROTOCOL_BINARY_CMD_IOCTL_GET:
+    case PROTOCOL_BINARY_CMD_CONFIG_VALIDATE:
+    case PROTOCOL_BINARY_CMD_GET_CMD_TIMER:
+    case PROTOCOL_BINARY_CMD_GET_VBUCKET:
+    case PROTOCOL_BINARY_CMD_GET_ALL_VB_SEQNOS:
+    case PROTOCOL_BINARY_CMD_GET_CLUSTER_CONFIG:
+    case PROTOCOL_BINARY_CMD_GET_RANDOM_KEY:
+    case PROTOCOL_BINARY_CMD_GET_ADJUSTED_TIME:
+    case PROTOCOL_BINARY_CMD_OBSERVE:
+    case PROTOCOL_BINARY_CMD_OBSERVE_SEQNO:
+    case PROTOCOL_BINARY_CMD_LIST_BUCKETS:
+    case PROTOCOL_BINARY_CMD_SELECT_BUCKET:
+    case PROTOCOL_BINARY_CMD_SCAN_KEYS:
+    case PROTOCOL_BINARY_CMD_DCP_OPEN:
+    case PROTOCOL_BINARY_CMD_DCP_STREAM_REQ:
+    case PROTOCOL_BINARY_CMD_DCP_GET_FAILOVER_LOG:
+    case PROTOCOL_BINARY_CMD_DCP_NOOP:
+    case PROTOCOL_BINARY_CMD_DCP_BUFFER_ACKNOWLEDGEMENT:
+    case PROTOCOL_BINARY_CMD_DCP_CONTROL:
+        return NEAR_CACHE_NONE;
+    case PROTOCOL_BINARY_CMD_SCRIPT_EXEC:
+        /* The key is the script, which invalidates the keys it changes */
+        return NEAR_CACHE_NONE;
+    case PROTOCOL_BINARY_CMD_NAMESPACE_DELETE:
+        /* The key is the prefix of the ones it deletes */
+        return NEAR_CACHE_ALL;
+    default:
+        if (nkey == 0) {
+            /* flush, vbucket states, buckets, multi key commands, ... */
+            return NEAR_CACHE_ALL;
+        }
+        return (int)(hash(key, nkey, 0) % NEAR_CACHE_GENERATIONS);
+    }
+}
+
+void near_cache_invalidate(int pending) {
+    if (pending == NEAR_CACHE_ALL) {
+        __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+    } else if (pending >= 0) {
+        __atomic_add_fetch(&generations[pending].value, 1, __ATOMIC_SEQ_CST);
+    }
+}
@@ -0,0 +1,89 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The near cache ("near_cache_items"): every worker thread keeps copies of
+ * the few keys its gets hit the most, and serves them without going to the
+ * engine, so a handful of hot keys don't have all the threads contend on
+ * the same items, locks and refcounts. The hot keys are found by a small
+ * heavy hitter sketch of the thread's gets, and a key is copied in once it
+ * keeps winning its slot of the sketch.
+ *
+ * A copy is only used while the generation of its key is the one read
+ * before the item was fetched. Every command which may change an item
+ * bumps the generation of its key (shared by all the threads, hashed into
+ * NEAR_CACHE_GENERATIONS slots) once it's done, and the ones changing
+ * items without naming them (flush, vbucket states, buckets, ...) bump
+ * the epoch of them all. A copy also goes when its item expires and is
+ * never used for another bucket: a connection which selected another
+ * bucket than the one it logged in to doesn't use the near cache.
+ */
+
+#ifndef NEAR_CACHE_H
+#define NEAR_CACHE_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Values larger than this are left to the engine */
+#define NEAR_CACHE_MAX_VALUE 16384
+
+/* conn::near_cache.pending of a command which doesn't change anything */
+#define NEAR_CACHE_NONE -1
+/* conn::near_cache.pending of a command changing items it doesn't name */
+#define NEAR_CACHE_ALL -2
+
+/* What a get must remember to put the item in the near cache */
+typedef struct {
+    uint32_t hash;
+    uint64_t generation;
+    uint64_t epoch;
+    bool admit;         /* the key is hot, copy the item */
+} near_cache_ticket_t;
+
+/* A copy of an item, valid until the next call for the thread */
+typedef struct {
+    const char *value;
+    uint32_t nvalue;
+    uint32_t flags;
+    uint64_t cas;
+    uint8_t datatype;
+    uint8_t clsid;
+} near_cache_hit_t;
+
+struct near_cache *near_cache_create(uint32_t nitems);
+void near_cache_destroy(struct near_cache *nc);
+
+/*
+ * Look the key up in the near cache of the connection's thread, for the
+ * bucket (the user the connection logged in as, NULL for the default
+ * bucket). Returns true with the copy in hit, or false with what
+ * near_cache_fill() needs in ticket (so it must be called before the
+ * engine is asked for the item).
+ */
+bool near_cache_lookup(conn *c, const char *bucket, const void *key,
+                       uint16_t nkey, uint16_t vbucket, near_cache_hit_t *hit,
+                       near_cache_ticket_t *ticket);
+
+/* Copy the item the engine returned, if the ticket says the key is hot */
+void near_cache_fill(conn *c, const char *bucket, const void *key,
+                     uint16_t nkey, uint16_t vbucket, const item *it,
+                     const item_view *info, const near_cache_ticket_t *ticket);
+
+/*
+ * Called when the command is dispatched, to remember the invalidation it
+ * owes (NEAR_CACHE_NONE for the ones not changing any item).
+ */
+int near_cache_invalidation(uint8_t opcode, const void *key, uint16_t nkey);
+
+/* Called when the command is done: bump the generation(s) it changed */
+void near_cache_invalidate(int pending);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,159 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The stats are named as in the key/value stats, with the characters not
+ * allowed in a metric name replaced by '_' and the ones with a value that
+ * isn't a number (version strings etc) left out. They go without a TYPE
+ * (they are "unknown" metrics), only the timings are typed (summaries).
+ */
+#include "config.h"
+#include "openmetrics.h"
+#include "timings.h"
+#include "utilities/protocol2text.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool om_reserve(struct openmetrics *om, size_t needed) {
+    size_t nsize = om->size ? om->size : 4096;
+    char *ptr;
+
+    if (om->failed) {
+        return false;
+    }
+    if (om->offset + needed <= om->size) {
+        return true;
+    }
+    while (om->offset + needed > nsize) {
+        nsize *= 2;
+    }
+    ptr = realloc(om->buf, nsize);
+    if (ptr == NULL) {
+        om->failed = true;
+        return false;
+    }
+    om->buf = ptr;
+    om->size = nsize;
+    return true;
+}
+
+static void om_printf(struct openmetrics *om, const char *fmt, ...) {
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0 || !om_reserve(om, (size_t)len + 1)) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(om->buf + om->offset, om->size - om->offset, fmt, ap);
+    va_end(ap);
+    om->offset += len;
+}
+
+/* Copy the name with the characters a metric name can't have as '_' */
+static void om_name(char *dest, size_t destsz, const char *prefix,
+                    const char *name, size_t nname) {
+    size_t offset = strlen(prefix);
+    size_t ii;
+
+    if (offset + nname + 1 > destsz) {
+        nname = destsz - offset - 1;
+    }
+    memcpy(dest, prefix, offset);
+    for (ii = 0; ii < nname; ++ii) {
+        char ch = name[ii];
+        dest[offset + ii] = (isalnum((unsigned char)ch) || ch == '_') ?
+            ch : '_';
+    }
+    dest[offset + nname] = '\0';
+}
+
+void openmetrics_add_stat(struct openmetrics *om,
+                          const char *key, uint16_t klen,
+                          const char *val, uint32_t vlen) {
+    char value[64];
+    char name[256];
+    char *end;
+    const char *label = NULL;
+    size_t nlabel = 0;
+
+    if (klen == 0 || vlen == 0 || vlen >= sizeof(value)) {
+        return;
+    }
+    memcpy(value, val, vlen);
+    value[vlen] = '\0';
+    (void)strtod(value, &end);
+    if (*end != '\0' || isspace((unsigned char)value[0])) {
+        return;
+    }
+
+    if (klen > 7 && memcmp(key, "thread_", 7) == 0 &&
+        isdigit((unsigned char)key[7])) {
+        /* thread_<n>_<name> */
+        label = key + 7;
+        while (nlabel < (size_t)klen - 7 &&
+               isdigit((unsigned char)label[nlabel])) {
+            ++nlabel;
+        }
+        if (nlabel + 8 < klen && label[nlabel] == '_') {
+            char stat[256];
+            size_t nstat = klen - (7 + nlabel + 1);
+            if (nstat > sizeof(stat) - 8) {
+                nstat = sizeof(stat) - 8;
+            }
+            memcpy(stat, "thread_", 7);
+            memcpy(stat + 7, label + nlabel + 1, nstat);
+            om_name(name, sizeof(name), om->prefix, stat, nstat + 7);
+            om_printf(om, "%s{thread=\"%.*s\"} %s\n", name, (int)nlabel,
+                      label, value);
+            return;
+        }
+    }
+
+    om_name(name, sizeof(name), om->prefix, key, klen);
+    om_printf(om, "%s %s\n", name, value);
+}
+
+static void om_timing(uint8_t opcode, uint64_t count,
+                      const uint64_t percentiles[3], uint64_t max,
+                      void *ctx) {
+    static const char * const quantiles[3] = { "0.5", "0.99", "0.999" };
+    struct openmetrics *om = ctx;
+    const char *name = memcached_opcode_2_text(opcode);
+    char label[64];
+    int ii;
+
+    if (name != NULL) {
+        snprintf(label, sizeof(label), "%s", name);
+    } else {
+        snprintf(label, sizeof(label), "0x%02x", opcode);
+    }
+
+    for (ii = 0; ii < 3; ++ii) {
+        om_printf(om, "memcached_cmd_duration_seconds{opcode=\"%s\","
+                  "quantile=\"%s\"} %.9f\n", label, quantiles[ii],
+                  percentiles[ii] / 1e9);
+    }
+    om_printf(om, "memcached_cmd_duration_seconds_count{opcode=\"%s\"} %"
+              PRIu64 "\n", label, count);
+    om_printf(om, "memcached_cmd_duration_max_seconds{opcode=\"%s\"} %.9f\n",
+              label, max / 1e9);
+}
+
+void openmetrics_add_timings(struct openmetrics *om) {
+    om_printf(om, "# TYPE memcached_cmd_duration_seconds summary\n");
+    om_printf(om, "# UNIT memcached_cmd_duration_seconds seconds\n");
+    om_printf(om, "# TYPE memcached_cmd_duration_max_seconds gauge\n");
+    om_printf(om, "# UNIT memcached_cmd_duration_max_seconds seconds\n");
+    generate_timing_summaries(om_timing, om);
+}
+
+void openmetrics_finish(struct openmetrics *om) {
+    om_printf(om, "# EOF\n");
+}
@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * "stats openmetrics": the server, thread and engine stats and the command
+ * timings in the OpenMetrics text exposition format, built in one buffer
+ * and returned as the value of a single stat, so a scrape is one round
+ * trip with no framing per stat.
+ */
+
+#ifndef OPENMETRICS_H
+#define OPENMETRICS_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct openmetrics {
+    char *buf;
+    size_t size;
+    size_t offset;
+    bool failed;             /* ran out of memory */
+    const char *prefix;      /* of the metric names of the stats added */
+};
+
+/*
+ * Add a stat as a metric named <prefix><key>, if its value is a number.
+ * A "thread_<n>_<name>" stat is added as <prefix>thread_<name>{thread="n"}.
+ */
+void openmetrics_add_stat(struct openmetrics *om,
+                          const char *key, uint16_t klen,
+                          const char *val, uint32_t vlen);
+
+/* Add the command timings, as a summary of each opcode seen */
+void openmetrics_add_timings(struct openmetrics *om);
+
+/* Terminate the exposition */
+void openmetrics_finish(struct openmetrics *om);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,874 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include "proxy.h"
+#include "connections.h"
+#include "mc_time.h"
+
+#include <cJSON.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <netdb.h>
+#include <netinet/tcp.h>
+#endif
+
+/* Seconds a node which couldn't be reached is left alone */
+#define PROXY_RETRY_SEC 1
+
+/* Responses handed back by one notify_io_complete_multi() */
+#define PROXY_NOTIFY_BATCH 64
+
+struct proxy_notify {
+    const void *cookies[PROXY_NOTIFY_BATCH];
+    ENGINE_ERROR_CODE status[PROXY_NOTIFY_BATCH];
+    int n;
+};
+
+/* The vbucket map of a bucket, and the owner of each vbucket in it */
+struct proxy_map {
+    struct proxy_map *next;
+    char *bucket;
+    char *json;
+    size_t len;
+    char **servers;         /* NULL for the ones we can't connect to */
+    int nservers;
+    int *owners;            /* index in servers, -1 for none */
+    int *replicas;          /* the first replica, the same */
+    int nvbuckets;
+};
+
+/*
+ * A request forwarded to the owner of its vbucket, and a get maybe to the
+ * replica as well. The first good response wins, and the other one is
+ * thrown away when it arrives.
+ */
+struct proxy_request {
+    struct proxy_request *next; /* in the hedge queue */
+    conn *c;
+    uint8_t opcode;
+    bool done;              /* the connection got its response */
+    bool failed;            /* the owner couldn't be reached */
+    bool queued;            /* in the hedge queue */
+    int pending;            /* entries in the waiting queues of backends */
+    hrtime_t hedge_time;    /* when the get goes to the replica too */
+    char *hedge;            /* the GET_REPLICA of it */
+    size_t hedgelen;
+    char *replica;          /* the server of the replica */
+    char *bucket;
+};
+
+/* A request sent on a backend, answered in the order they were sent */
+struct proxy_wait {
+    struct proxy_request *req;  /* NULL for our own ones */
+    bool hedge;
+};
+
+/* The connection of a thread to a bucket on another node */
+struct proxy_backend {
+    struct proxy_backend *next;
+    struct proxy *proxy;
+    char *server;           /* "host:port" */
+    char *bucket;           /* NULL to stay in the one of proxy.username */
+    SOCKET sfd;
+    struct event event;
+    short ev_flags;
+    bool connecting;
+    rel_time_t retry_time;  /* not tried again before */
+
+    /* The requests, from outsent on not sent yet */
+    char *out;
+    size_t outbytes;
+    size_t outsent;
+    size_t outsize;
+
+    /* The start of the responses not complete yet */
+    char *in;
+    size_t inbytes;
+    size_t insize;
+
+    /* The requests waiting for the responses */
+    struct proxy_wait *waiting;
+    size_t whead;
+    size_t wcount;
+    size_t wsize;
+};
+
+struct proxy {
+    LIBEVENT_THREAD *thread;
+    struct proxy_backend *backends;
+    struct proxy_map *maps;
+    struct proxy_map *current;  /* the one get_engine_vb_map() fills in */
+
+    /* The gets to send to the replica if still not answered by then */
+    struct proxy_request *hedge_head;
+    struct proxy_request *hedge_tail;
+    struct event hedge_timer;
+    bool hedge_armed;
+};
+
+static void proxy_backend_event(evutil_socket_t fd, short which, void *arg);
+
+static bool same_bucket(const char *a, const char *b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return strcmp(a, b) == 0;
+}
+
+static void map_clear(struct proxy_map *m) {
+    int ii;
+
+    for (ii = 0; ii < m->nservers; ++ii) {
+        free(m->servers[ii]);
+    }
+    free(m->servers);
+    free(m->owners);
+    free(m->replicas);
+    free(m->json);
+    m->servers = NULL;
+    m->owners = NULL;
+    m->replicas = NULL;
+    m->json = NULL;
+    m->nservers = m->nvbuckets = 0;
+    m->len = 0;
+}
+
+/*
+ * Parse the "vBucketServerMap" of the map. A map we can't make sense of
+ * is kept anyway (without owners), so it isn't parsed again.
+ */
+static void map_parse(struct proxy_map *m, const char *json, size_t len) {
+    cJSON *root, *servermap, *list, *vbmap, *obj;
+    int ii;
+
+    map_clear(m);
+    if ((m->json = malloc(len + 1)) == NULL) {
+        return;
+    }
+    memcpy(m->json, json, len);
+    m->json[len] = '\0';
+    m->len = len;
+
+    if ((root = cJSON_Parse(m->json)) == NULL) {
+        return;
+    }
+    servermap = cJSON_GetObjectItem(root, "vBucketServerMap");
+    list = servermap ? cJSON_GetObjectItem(servermap, "serverList") : NULL;
+    vbmap = servermap ? cJSON_GetObjectItem(servermap, "vBucketMap") : NULL;
+    if (list == NULL || list->type != cJSON_Array ||
+        vbmap == NULL || vbmap->type != cJSON_Array) {
+        cJSON_Delete(root);
+        return;
+    }
+
+    m->nservers = cJSON_GetArraySize(list);
+    m->nvbuckets = cJSON_GetArraySize(vbmap);
+    m->servers = calloc(m->nservers ? m->nservers : 1, sizeof(char*));
+    m->owners = malloc((m->nvbuckets ? m->nvbuckets : 1) * sizeof(int));
+    m->replicas = malloc((m->nvbuckets ? m->nvbuckets : 1) * sizeof(int));
+    if (m->servers == NULL || m->owners == NULL || m->replicas == NULL) {
+        cJSON_Delete(root);
+        free(m->servers);
+        free(m->owners);
+        free(m->replicas);
+        m->servers = NULL;
+        m->owners = NULL;
+        m->replicas = NULL;
+        m->nservers = m->nvbuckets = 0;
+        return;
+    }
+
+    for (ii = 0, obj = list->child; obj != NULL; ++ii, obj = obj->next) {
+        /* "$HOST" stands for the address the client used to reach us */
+        if (obj->type == cJSON_String &&
+            strstr(obj->valuestring, "$HOST") == NULL) {
+            m->servers[ii] = strdup(obj->valuestring);
+        }
+    }
+    for (ii = 0, obj = vbmap->child; obj != NULL; ++ii, obj = obj->next) {
+        cJSON *master = obj->type == cJSON_Array ? obj->child : NULL;
+        cJSON *replica = master != NULL ? master->next : NULL;
+        m->owners[ii] = m->replicas[ii] = -1;
+        if (master != NULL && master->type == cJSON_Number &&
+            master->valueint >= 0 && master->valueint < m->nservers) {
+            m->owners[ii] = master->valueint;
+        }
+        if (replica != NULL && replica->type == cJSON_Number &&
+            replica->valueint >= 0 && replica->valueint < m->nservers) {
+            m->replicas[ii] = replica->valueint;
+        }
+    }
+    cJSON_Delete(root);
+}
+
+static ENGINE_ERROR_CODE proxy_map_cb(const void *cookie, const void *map,
+                                      size_t mapsize) {
+    const conn *c = cookie;
+    struct proxy_map *m = c->thread->proxy->current;
+
+    if (m->json == NULL || m->len != mapsize ||
+        memcmp(m->json, map, mapsize) != 0) {
+        map_parse(m, map, mapsize);
+    }
+    return ENGINE_SUCCESS;
+}
+
+/*
+ * The server of the owner of the vbucket, NULL if there is none (and the
+ * one of its replica in replica, NULL if there is none).
+ */
+static const char *lookup_owner(struct proxy *p, conn *c, const char *bucket,
+                                uint16_t vbucket, const char **replica) {
+    struct proxy_map *m;
+    ENGINE_ERROR_CODE ret;
+
+    for (m = p->maps; m != NULL; m = m->next) {
+        if (same_bucket(m->bucket, bucket)) {
+            break;
+        }
+    }
+    if (m == NULL) {
+        if ((m = calloc(1, sizeof(*m))) == NULL) {
+            return NULL;
+        }
+        if (bucket != NULL && (m->bucket = strdup(bucket)) == NULL) {
+            free(m);
+            return NULL;
+        }
+        m->next = p->maps;
+        p->maps = m;
+    }
+
+    p->current = m;
+    ret = settings.engine.v1->get_engine_vb_map(settings.engine.v0, c,
+                                                proxy_map_cb);
+    p->current = NULL;
+    *replica = NULL;
+    if (ret != ENGINE_SUCCESS || vbucket >= m->nvbuckets ||
+        m->owners[vbucket] == -1) {
+        return NULL;
+    }
+    if (m->replicas[vbucket] != -1) {
+        *replica = m->servers[m->replicas[vbucket]];
+    }
+    return m->servers[m->owners[vbucket]];
+}
+
+static bool backend_update_event(struct proxy_backend *b, short flags) {
+    if (b->ev_flags == flags) {
+        return true;
+    }
+    if (b->ev_flags != 0) {
+        event_del(&b->event);
+    }
+    event_set(&b->event, b->sfd, flags, proxy_backend_event, b);
+    event_base_set(b->proxy->thread->base, &b->event);
+    if (event_add(&b->event, NULL) == -1) {
+        b->ev_flags = 0;
+        return false;
+    }
+    b->ev_flags = flags;
+    return true;
+}
+
+static bool grow_buffer(char **buf, size_t *size, size_t needed) {
+    size_t nsize = *size ? *size : 4096;
+    char *ptr;
+
+    if (needed <= *size) {
+        return true;
+    }
+    while (nsize < needed) {
+        nsize *= 2;
+    }
+    if ((ptr = realloc(*buf, nsize)) == NULL) {
+        return false;
+    }
+    *buf = ptr;
+    *size = nsize;
+    return true;
+}
+
+/* Queue the packet, with the request waiting for its response */
+static bool backend_queue(struct proxy_backend *b, const void *packet,
+                          size_t len, struct proxy_request *r, bool hedge) {
+    if (b->outsent == b->outbytes) {
+        b->outsent = b->outbytes = 0;
+    }
+    if (b->wcount == b->wsize) {
+        size_t nsize = b->wsize ? b->wsize * 2 : 16;
+        struct proxy_wait *ptr = malloc(nsize * sizeof(*ptr));
+        size_t ii;
+        if (ptr == NULL) {
+            return false;
+        }
+        for (ii = 0; ii < b->wcount; ++ii) {
+            ptr[ii] = b->waiting[(b->whead + ii) % b->wsize];
+        }
+        free(b->waiting);
+        b->waiting = ptr;
+        b->wsize = nsize;
+        b->whead = 0;
+    }
+    if (!grow_buffer(&b->out, &b->outsize, b->outbytes + len)) {
+        return false;
+    }
+
+    memcpy(b->out + b->outbytes, packet, len);
+    b->outbytes += len;
+    b->waiting[(b->whead + b->wcount) % b->wsize].req = r;
+    b->waiting[(b->whead + b->wcount) % b->wsize].hedge = hedge;
+    ++b->wcount;
+    if (r != NULL) {
+        ++r->pending;
+    }
+    return true;
+}
+
+static bool backend_queue_command(struct proxy_backend *b, uint8_t opcode,
+                                  const char *key, uint16_t keylen,
+                                  const char *body, uint32_t bodylen) {
+    protocol_binary_request_header req;
+    char packet[512];
+
+    if (sizeof(req) + keylen + bodylen > sizeof(packet)) {
+        return false;
+    }
+    memset(&req, 0, sizeof(req));
+    req.request.magic = PROTOCOL_BINARY_REQ;
+    req.request.opcode = opcode;
+    req.request.keylen = htons(keylen);
+    req.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    req.request.bodylen = htonl(keylen + bodylen);
+    memcpy(packet, req.bytes, sizeof(req));
+    memcpy(packet + sizeof(req), key, keylen);
+    memcpy(packet + sizeof(req) + keylen, body, bodylen);
+    return backend_queue(b, packet, sizeof(req) + keylen + bodylen, NULL,
+                         false);
+}
+
+/* Hand the status to the connections, PROXY_NOTIFY_BATCH at a time */
+static void notify_flush(struct proxy_notify *pn) {
+    if (pn->n > 0) {
+        notify_io_complete_multi(pn->cookies, pn->status, pn->n);
+        pn->n = 0;
+    }
+}
+
+static void notify_add(struct proxy_notify *pn, conn *c,
+                       ENGINE_ERROR_CODE status) {
+    pn->cookies[pn->n] = c;
+    pn->status[pn->n++] = status;
+    if (pn->n == PROXY_NOTIFY_BATCH) {
+        notify_flush(pn);
+    }
+}
+
+static void request_release(struct proxy_request *r) {
+    if (r->pending == 0 && !r->queued) {
+        free(r->hedge);
+        free(r->replica);
+        free(r->bucket);
+        free(r);
+    }
+}
+
+/*
+ * One of the backends is done with the request, with the response (NULL
+ * if the backend failed). The owner's response always wins, the replica's
+ * only if it found the key. The connection gets NOT_MY_VBUCKET if the
+ * owner couldn't be reached and the replica didn't have it either.
+ */
+static void request_complete(struct proxy_request *r, bool hedge,
+                             const protocol_binary_response_header *rsp,
+                             struct proxy_notify *pn) {
+    conn *c = r->c;
+
+    --r->pending;
+    if (!r->done) {
+        if (rsp != NULL &&
+            (!hedge || rsp->response.status == PROTOCOL_BINARY_RESPONSE_SUCCESS)) {
+            size_t len = sizeof(*rsp) + ntohl(rsp->response.bodylen);
+            r->done = true;
+            if (grow_dynamic_buffer(c, len)) {
+                char *ptr = c->dynamic_buffer.buffer + c->dynamic_buffer.offset;
+                memcpy(ptr, rsp, len);
+                /* The client asked for a GET, not a GET_REPLICA */
+                ((protocol_binary_response_header*)ptr)->response.opcode =
+                    r->opcode;
+                c->dynamic_buffer.offset += len;
+                notify_add(pn, c, ENGINE_SUCCESS);
+            } else {
+                notify_add(pn, c, ENGINE_ENOMEM);
+            }
+            if (hedge) {
+                STATS_NOKEY(c, proxy_hedge_wins);
+            }
+        } else {
+            if (!hedge) {
+                r->failed = true;
+            }
+            if (r->failed && r->pending == 0) {
+                r->done = true;
+                STATS_NOKEY(c, proxy_failures);
+                notify_add(pn, c, ENGINE_NOT_MY_VBUCKET);
+            }
+        }
+    }
+    request_release(r);
+}
+
+/*
+ * Close the connection and fail the requests waiting for it, which get the
+ * NOT_MY_VBUCKET response instead. The node isn't tried again for
+ * PROXY_RETRY_SEC.
+ */
+static void backend_fail(struct proxy_backend *b, const char *what, int err) {
+    struct proxy_notify pn;
+    pn.n = 0;
+
+    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                    "proxy: %s %s failed: %s\n", what,
+                                    b->server, strerror(err));
+
+    while (b->wcount > 0) {
+        struct proxy_wait w = b->waiting[b->whead];
+        b->whead = (b->whead + 1) % b->wsize;
+        --b->wcount;
+        if (w.req != NULL) {
+            request_complete(w.req, w.hedge, NULL, &pn);
+        }
+    }
+    notify_flush(&pn);
+
+    if (b->ev_flags != 0) {
+        event_del(&b->event);
+        b->ev_flags = 0;
+    }
+    if (b->sfd != INVALID_SOCKET) {
+        safe_close(b->sfd);
+        b->sfd = INVALID_SOCKET;
+    }
+    b->connecting = false;
+    b->outbytes = b->outsent = 0;
+    b->inbytes = 0;
+    b->whead = 0;
+    b->retry_time = mc_time_get_current_time() + PROXY_RETRY_SEC;
+}
+
+static bool backend_send(struct proxy_backend *b) {
+    while (b->outsent < b->outbytes) {
+        ssize_t nw = send(b->sfd, b->out + b->outsent,
+                          b->outbytes - b->outsent, 0);
+        if (nw > 0) {
+            b->outsent += nw;
+        } else if (nw == -1 && errno == EINTR) {
+            continue;
+        } else if (nw == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else {
+            return false;
+        }
+    }
+    b->outsent = b->outbytes = 0;
+    return true;
+}
+
+/*
+ * Read what's there and hand the complete responses to the connections
+ * waiting for them. Returns false if the connection has to be closed.
+ */
+static bool backend_receive(struct proxy_backend *b) {
+    struct proxy_notify pn;
+    size_t offset = 0;
+    bool ok = true;
+
+    pn.n = 0;
+    for (;;) {
+        ssize_t nr;
+        if (!grow_buffer(&b->in, &b->insize, b->inbytes + 4096)) {
+            errno = ENOMEM;
+            return false;
+        }
+        nr = recv(b->sfd, b->in + b->inbytes, b->insize - b->inbytes, 0);
+        if (nr > 0) {
+            b->inbytes += nr;
+        } else if (nr == -1 && errno == EINTR) {
+            continue;
+        } else if (nr == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            if (nr == 0) {
+                errno = ECONNRESET;
+            }
+            return false;
+        }
+    }
+
+    while (b->inbytes - offset >= sizeof(protocol_binary_response_header)) {
+        const protocol_binary_response_header *rsp =
+            (const void*)(b->in + offset);
+        size_t len = sizeof(*rsp) + ntohl(rsp->response.bodylen);
+        struct proxy_wait w;
+
+        if (rsp->response.magic != PROTOCOL_BINARY_RES || b->wcount == 0) {
+            errno = EPROTO;
+            ok = false;
+            break;
+        }
+        if (b->inbytes - offset < len) {
+            break;
+        }
+
+        w = b->waiting[b->whead];
+        b->whead = (b->whead + 1) % b->wsize;
+        --b->wcount;
+        if (w.req == NULL) {
+            /* The login or the bucket selection */
+            if (rsp->response.status != 0) {
+                errno = EACCES;
+                ok = false;
+                break;
+            }
+        } else {
+            request_complete(w.req, w.hedge, rsp, &pn);
+        }
+        offset += len;
+    }
+    notify_flush(&pn);
+
+    if (offset > 0) {
+        memmove(b->in, b->in + offset, b->inbytes - offset);
+        b->inbytes -= offset;
+    }
+    return ok;
+}
+
+static void proxy_backend_event(evutil_socket_t fd, short which, void *arg) {
+    struct proxy_backend *b = arg;
+    short flags = EV_READ | EV_PERSIST;
+    (void)fd;
+
+    if (b->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(b->sfd, SOL_SOCKET, SO_ERROR, (void*)&err,
+                       &len) != 0) {
+            err = errno;
+        }
+        if (err != 0) {
+            backend_fail(b, "connecting to", err);
+            return;
+        }
+        b->connecting = false;
+    }
+
+    if ((which & EV_WRITE) != 0 && !backend_send(b)) {
+        backend_fail(b, "sending to", errno);
+        return;
+    }
+    if ((which & EV_READ) != 0 && !backend_receive(b)) {
+        backend_fail(b, "receiving from", errno);
+        return;
+    }
+
+    if (b->outsent < b->outbytes) {
+        flags |= EV_WRITE;
+    }
+    if (!backend_update_event(b, flags)) {
+        backend_fail(b, "polling", EINVAL);
+    }
+}
+
+/* Start connecting, and queue the login (and the bucket selection) */
+static bool backend_connect(struct proxy_backend *b) {
+    struct addrinfo hints, *ai, *next;
+    char host[256];
+    char plain[512];
+    const char *port;
+    const char *user = settings.proxy.username;
+    const char *pass = settings.proxy.password ? settings.proxy.password : "";
+    size_t hlen, ulen = strlen(user), plen = strlen(pass);
+    int error, err = 0;
+
+    if ((port = strrchr(b->server, ':')) == NULL ||
+        (hlen = port - b->server) >= sizeof(host) ||
+        2 + ulen + plen > sizeof(plain)) {
+        b->retry_time = mc_time_get_current_time() + PROXY_RETRY_SEC;
+        return false;
+    }
+    memcpy(host, b->server, hlen);
+    host[hlen] = '\0';
+    if (host[0] == '[' && hlen > 1 && host[hlen - 1] == ']') {
+        /* "[::1]:11210" */
+        memmove(host, host + 1, hlen - 2);
+        host[hlen - 2] = '\0';
+    }
+    ++port;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((error = getaddrinfo(host, port, &hints, &ai)) != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "proxy: can't resolve %s: %s\n",
+                                        b->server, gai_strerror(error));
+        b->retry_time = mc_time_get_current_time() + PROXY_RETRY_SEC;
+        return false;
+    }
+
+    for (next = ai; next != NULL; next = next->ai_next) {
+        SOCKET sfd = socket(next->ai_family, next->ai_socktype,
+                            next->ai_protocol);
+        int flag = 1;
+        if (sfd == INVALID_SOCKET) {
+            continue;
+        }
+        if (evutil_make_socket_nonblocking(sfd) == -1) {
+            safe_close(sfd);
+            continue;
+        }
+        setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void*)&flag, sizeof(flag));
+        if (connect(sfd, next->ai_addr, next->ai_addrlen) == 0 ||
+            errno == EINPROGRESS || errno == EWOULDBLOCK) {
+            b->sfd = sfd;
+            break;
+        }
+        err = errno;
+        safe_close(sfd);
+    }
+    freeaddrinfo(ai);
+
+    if (b->sfd == INVALID_SOCKET) {
+        backend_fail(b, "connecting to", err);
+        return false;
+    }
+    b->connecting = true;
+
+    /* SASL PLAIN: authzid NUL authcid NUL passwd */
+    plain[0] = '\0';
+    memcpy(plain + 1, user, ulen);
+    plain[1 + ulen] = '\0';
+    memcpy(plain + 2 + ulen, pass, plen);
+    if (!backend_queue_command(b, PROTOCOL_BINARY_CMD_SASL_AUTH, "PLAIN", 5,
+                               plain, (uint32_t)(2 + ulen + plen)) ||
+        (b->bucket != NULL &&
+         !backend_queue_command(b, PROTOCOL_BINARY_CMD_SELECT_BUCKET,
+                                b->bucket, (uint16_t)strlen(b->bucket),
+                                NULL, 0)) ||
+        !backend_update_event(b, EV_WRITE | EV_PERSIST)) {
+        backend_fail(b, "connecting to", ENOMEM);
+        return false;
+    }
+    return true;
+}
+
+static struct proxy_backend *backend_get(struct proxy *p, const char *server,
+                                         const char *bucket) {
+    struct proxy_backend *b;
+
+    for (b = p->backends; b != NULL; b = b->next) {
+        if (strcmp(b->server, server) == 0 && same_bucket(b->bucket, bucket)) {
+            break;
+        }
+    }
+    if (b == NULL) {
+        if ((b = calloc(1, sizeof(*b))) == NULL ||
+            (b->server = strdup(server)) == NULL ||
+            (bucket != NULL && (b->bucket = strdup(bucket)) == NULL)) {
+            if (b != NULL) {
+                free(b->server);
+                free(b);
+            }
+            return NULL;
+        }
+        b->proxy = p;
+        b->sfd = INVALID_SOCKET;
+        b->next = p->backends;
+        p->backends = b;
+    }
+
+    if (b->sfd == INVALID_SOCKET) {
+        if (mc_time_get_current_time() < b->retry_time ||
+            !backend_connect(b)) {
+            return NULL;
+        }
+    }
+    return b;
+}
+
+static void hedge_arm(struct proxy *p, hrtime_t now) {
+    struct timeval tv;
+    hrtime_t delay;
+
+    if (p->hedge_armed || p->hedge_head == NULL) {
+        return;
+    }
+    delay = p->hedge_head->hedge_time > now ?
+        (p->hedge_head->hedge_time - now) / 1000 : 0;
+    tv.tv_sec = (long)(delay / 1000000);
+    tv.tv_usec = (long)(delay % 1000000);
+    if (evtimer_add(&p->hedge_timer, &tv) == 0) {
+        p->hedge_armed = true;
+    }
+}
+
+/* Send the gets still not answered to the replicas */
+static void hedge_event(evutil_socket_t fd, short which, void *arg) {
+    struct proxy *p = arg;
+    hrtime_t now = gethrtime();
+    (void)fd;
+    (void)which;
+
+    p->hedge_armed = false;
+    while (p->hedge_head != NULL &&
+           (p->hedge_head->done || p->hedge_head->hedge_time <= now)) {
+        struct proxy_request *r = p->hedge_head;
+        struct proxy_backend *b;
+
+        if ((p->hedge_head = r->next) == NULL) {
+            p->hedge_tail = NULL;
+        }
+        if (!r->done && (b = backend_get(p, r->replica, r->bucket)) != NULL &&
+            backend_queue(b, r->hedge, r->hedgelen, r, true)) {
+            if (!b->connecting &&
+                !backend_update_event(b, EV_READ | EV_WRITE | EV_PERSIST)) {
+                backend_fail(b, "polling", EINVAL);
+            } else {
+                STATS_NOKEY(r->c, proxy_hedges);
+            }
+        }
+        /* Only now, failing the backend may have completed it */
+        r->queued = false;
+        request_release(r);
+    }
+    hedge_arm(p, now);
+}
+
+/* Keep a copy of the get, to send it to the replica if it's slow */
+static void hedge_queue(struct proxy *p, struct proxy_request *r,
+                        const char *packet, size_t len, const char *replica,
+                        const char *bucket) {
+    protocol_binary_request_header *req;
+
+    if ((r->hedge = malloc(len)) == NULL ||
+        (r->replica = strdup(replica)) == NULL ||
+        (bucket != NULL && (r->bucket = strdup(bucket)) == NULL)) {
+        return;
+    }
+    memcpy(r->hedge, packet, len);
+    req = (void*)r->hedge;
+    req->request.opcode = PROTOCOL_BINARY_CMD_GET_REPLICA;
+    r->hedgelen = len;
+    r->hedge_time = gethrtime() +
+        (hrtime_t)settings.proxy.hedge_usec * 1000;
+    r->queued = true;
+    if (p->hedge_tail == NULL) {
+        p->hedge_head = r;
+    } else {
+        p->hedge_tail->next = r;
+    }
+    p->hedge_tail = r;
+    hedge_arm(p, gethrtime());
+}
+
+struct proxy *proxy_create(LIBEVENT_THREAD *thread) {
+    struct proxy *p = calloc(1, sizeof(*p));
+    if (p != NULL) {
+        p->thread = thread;
+        evtimer_set(&p->hedge_timer, hedge_event, p);
+        event_base_set(thread->base, &p->hedge_timer);
+    }
+    return p;
+}
+
+void proxy_destroy(struct proxy *p) {
+    if (p == NULL) {
+        return;
+    }
+    if (p->hedge_armed) {
+        evtimer_del(&p->hedge_timer);
+    }
+    while (p->hedge_head != NULL) {
+        struct proxy_request *r = p->hedge_head;
+        p->hedge_head = r->next;
+        r->queued = false;
+        request_release(r);
+    }
+    while (p->backends != NULL) {
+        struct proxy_backend *b = p->backends;
+        p->backends = b->next;
+        if (b->ev_flags != 0) {
+            event_del(&b->event);
+        }
+        if (b->sfd != INVALID_SOCKET) {
+            safe_close(b->sfd);
+        }
+        while (b->wcount > 0) {
+            struct proxy_request *r = b->waiting[b->whead].req;
+            b->whead = (b->whead + 1) % b->wsize;
+            --b->wcount;
+            if (r != NULL) {
+                --r->pending;
+                request_release(r);
+            }
+        }
+        free(b->server);
+        free(b->bucket);
+        free(b->out);
+        free(b->in);
+        free(b->waiting);
+        free(b);
+    }
+    while (p->maps != NULL) {
+        struct proxy_map *m = p->maps;
+        p->maps = m->next;
+        map_clear(m);
+        free(m->bucket);
+        free(m);
+    }
+    free(p);
+}
+
+bool proxy_forward(conn *c, const char *packet, const char *bucket) {
+    struct proxy *p = c->thread->proxy;
+    const protocol_binary_request_header *req = (const void*)packet;
+    size_t len = sizeof(*req) + ntohl(req->request.bodylen);
+    const char *server, *replica;
+    struct proxy_backend *b;
+    struct proxy_request *r;
+
+    if (p == NULL || settings.proxy.username == NULL ||
+        (server = lookup_owner(p, c, bucket, ntohs(req->request.vbucket),
+                               &replica)) == NULL ||
+        (b = backend_get(p, server, bucket)) == NULL ||
+        (r = calloc(1, sizeof(*r))) == NULL) {
+        return false;
+    }
+    r->c = c;
+    r->opcode = req->request.opcode;
+    if (!backend_queue(b, packet, len, r, false)) {
+        free(r);
+        return false;
+    }
+    if (!b->connecting &&
+        !backend_update_event(b, EV_READ | EV_WRITE | EV_PERSIST)) {
+        /* Take it back out, we answer this one ourselves */
+        --b->wcount;
+        b->outbytes -= len;
+        free(r);
+        backend_fail(b, "polling", EINVAL);
+        return false;
+    }
+
+    if (settings.proxy.hedge_usec != 0 && replica != NULL &&
+        r->opcode == PROTOCOL_BINARY_CMD_GET) {
+        hedge_queue(p, r, packet, len, replica, bucket);
+    }
+    STATS_NOKEY(c, proxy_forwards);
+    c->ewouldblock = true;
+    conn_set_state(c, conn_proxy_wait);
+    return true;
+}
@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Proxy mode ("proxy"): a request for a vbucket this node doesn't own is
+ * forwarded to the node which does, instead of failing with
+ * NOT_MY_VBUCKET, so a client which can't route by itself still gets its
+ * answer in a single hop. The owner is looked up in the vbucket map the
+ * engine would have sent back (get_engine_vb_map()), and every worker
+ * thread keeps a connection per (node, bucket) of its own, logged in as
+ * proxy.username and pipelining the requests of all of its connections.
+ * The requests forwarded during a pass of the event loop go out in one
+ * send, and the responses read together are handed back in one
+ * notify_io_complete_multi(). A connection waits in conn_proxy_wait for
+ * the response meanwhile, and falls back to the NOT_MY_VBUCKET response
+ * if the node can't be reached.
+ *
+ * With proxy.hedge_usec set a get the owner hasn't answered by then is
+ * sent to the first replica of the vbucket as well (as a GET_REPLICA), and
+ * whichever finds the key first answers the client; the owner's response
+ * is the one used if the replica doesn't have it.
+ *
+ * The connections from the other nodes are logged in as proxy.username,
+ * and their requests are never forwarded again, so a stale map costs at
+ * most one extra hop.
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct proxy *proxy_create(LIBEVENT_THREAD *thread);
+void proxy_destroy(struct proxy *proxy);
+
+/*
+ * Forward the request (the whole packet, the header in network byte order)
+ * the engine failed with NOT_MY_VBUCKET to the owner of its vbucket, on
+ * the connection to the bucket (NULL for the one proxy.username selects).
+ * Returns false if it can't be forwarded, and true if the connection
+ * is now waiting for the response in conn_proxy_wait.
+ */
+bool proxy_forward(conn *c, const char *packet, const char *bucket);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
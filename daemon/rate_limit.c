@@ -0,0 +1,145 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * A bucket holds up to a second of its rate (and at least one command),
+ * and lets a command through while it has a token for it. The bytes may go
+ * below zero for a packet larger than what's left, the next commands then
+ * wait for the debt to be paid back, so a limit smaller than the packets
+ * still lets them through at its rate.
+ */
+#include "config.h"
+#include "rate_limit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct rate_bucket {
+    double ops;
+    double bytes;
+    hrtime_t refilled;   /* 0 until the bucket is first used (full) */
+};
+
+struct rate_limiter {
+    struct rate_bucket bucket;
+    /* indexed by the user id of the RBAC configuration */
+    struct rate_bucket *users;
+    uint32_t nusers;
+};
+
+struct rate_limiter *rate_limiter_create(void) {
+    return calloc(1, sizeof(struct rate_limiter));
+}
+
+void rate_limiter_destroy(struct rate_limiter *rl) {
+    if (rl != NULL) {
+        free(rl->users);
+        free(rl);
+    }
+}
+
+/*
+ * Refill the bucket for the time since it was last refilled, at the share
+ * of the thread of ops commands and bytes per second.
+ */
+static void rate_bucket_refill(struct rate_bucket *b, double ops,
+                               double bytes, hrtime_t now) {
+    double ops_max = ops < 1 ? 1 : ops;
+    if (b->refilled == 0) {
+        b->ops = ops_max;
+        b->bytes = bytes;
+    } else if (now > b->refilled) {
+        double sec = (double)(now - b->refilled) / 1000000000.0;
+        b->ops += ops * sec;
+        if (b->ops > ops_max) {
+            b->ops = ops_max;
+        }
+        b->bytes += bytes * sec;
+        if (b->bytes > bytes) {
+            b->bytes = bytes;
+        }
+    }
+    b->refilled = now;
+}
+
+static bool rate_bucket_ok(const struct rate_bucket *b, uint32_t ops,
+                           uint32_t bytes) {
+    return (ops == 0 || b->ops >= 1) && (bytes == 0 || b->bytes > 0);
+}
+
+/* Only the limits in force are charged */
+static void rate_bucket_take(struct rate_bucket *b, uint32_t ops,
+                             uint32_t bytes, uint64_t nbytes) {
+    if (ops != 0) {
+        b->ops -= 1;
+    }
+    if (bytes != 0) {
+        b->bytes -= (double)nbytes;
+    }
+}
+
+static struct rate_bucket *rate_limiter_user(struct rate_limiter *rl,
+                                             uint32_t user) {
+    if (user >= rl->nusers) {
+        uint32_t nusers = rl->nusers ? rl->nusers * 2 : 16;
+        struct rate_bucket *users;
+        while (nusers <= user) {
+            nusers *= 2;
+        }
+        users = realloc(rl->users, nusers * sizeof(*users));
+        if (users == NULL) {
+            return NULL;
+        }
+        memset(users + rl->nusers, 0,
+               (nusers - rl->nusers) * sizeof(*users));
+        rl->users = users;
+        rl->nusers = nusers;
+    }
+    return &rl->users[user];
+}
+
+bool rate_limit_charge(conn *c, uint64_t nbytes) {
+    LIBEVENT_THREAD *thr = c->thread;
+    uint32_t user_ops = c->rate_ops ? c->rate_ops :
+        settings.rate_limit_user_ops;
+    uint32_t user_bytes = c->rate_bytes ? c->rate_bytes :
+        settings.rate_limit_user_bytes;
+    uint32_t bucket_ops = settings.rate_limit_bucket_ops;
+    uint32_t bucket_bytes = settings.rate_limit_bucket_bytes;
+    struct rate_bucket *user = NULL;
+    struct rate_bucket *bucket = NULL;
+    double nthreads;
+    hrtime_t now;
+
+    if ((user_ops | user_bytes | bucket_ops | bucket_bytes) == 0 ||
+        thr == NULL || thr->rate_limiter == NULL || c->admin) {
+        return true;
+    }
+
+    nthreads = settings.num_threads > 0 ? settings.num_threads : 1;
+    now = thread_clock(thr);
+    if ((user_ops | user_bytes) != 0 && c->rate_user != 0 &&
+        (user = rate_limiter_user(thr->rate_limiter, c->rate_user)) != NULL) {
+        rate_bucket_refill(user, user_ops / nthreads, user_bytes / nthreads,
+                           now);
+        if (!rate_bucket_ok(user, user_ops, user_bytes)) {
+            STATS_NOKEY(c, cmds_rate_limited);
+            return false;
+        }
+    }
+    if ((bucket_ops | bucket_bytes) != 0) {
+        bucket = &thr->rate_limiter->bucket;
+        rate_bucket_refill(bucket, bucket_ops / nthreads,
+                           bucket_bytes / nthreads, now);
+        if (!rate_bucket_ok(bucket, bucket_ops, bucket_bytes)) {
+            STATS_NOKEY(c, cmds_rate_limited);
+            return false;
+        }
+    }
+
+    if (user != NULL) {
+        rate_bucket_take(user, user_ops, user_bytes, nbytes);
+    }
+    if (bucket != NULL) {
+        rate_bucket_take(bucket, bucket_ops, bucket_bytes, nbytes);
+    }
+    return true;
+}
@@ -0,0 +1,37 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Token bucket rate limiting of the data commands, by user (the "limits"
+ * of its entry in the RBAC configuration, or else the rate_limit_user_ops
+ * and rate_limit_user_bytes settings) and by bucket (rate_limit_bucket_ops
+ * and rate_limit_bucket_bytes). Every worker thread has buckets of its own,
+ * refilled at its share of the limits (the limit divided by the number of
+ * worker threads), so a command is charged without taking a lock or
+ * touching memory shared with the other threads.
+ */
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rate_limiter *rate_limiter_create(void);
+void rate_limiter_destroy(struct rate_limiter *rl);
+
+/*
+ * Charge a command of nbytes (the whole packet) to the user of the
+ * connection and to the bucket, in the buckets of the connection's thread.
+ * Returns false, without charging either, if one of them is over its limit.
+ */
+bool rate_limit_charge(conn *c, uint64_t nbytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -31,6 +31,35 @@ void UserEntry::initialize(cJSON *root, bool _role) {
     parseStringList(root, "buckets", buckets);
     parseStringList(root, "profiles", profiles);
     parseStringList(root, "roles", roles);
+    parseLimits(root);
+}
+
+void UserEntry::parseLimits(cJSON *root) {
+    cJSON *obj = cJSON_GetObjectItem(root, "limits");
+    opsLimit = bytesLimit = 0;
+
+    if (obj == NULL) {
+        // object not present. Not fatal
+        return;
+    }
+
+    const char *fields[] = { "ops", "bytes" };
+    uint32_t *limits[] = { &opsLimit, &bytesLimit };
+    for (int ii = 0; ii < 2; ++ii) {
+        cJSON *c = cJSON_GetObjectItem(obj, fields[ii]);
+        if (c == NULL) {
+            continue;
+        }
+        if (c->type != cJSON_Number || c->valueint < 0) {
+            std::stringstream ss;
+            ss << "FATAL: Invalid limit for " << fields[ii] << " in object: ";
+            char *ptr = cJSON_PrintUnformatted(root);
+            ss << ptr;
+            cJSON_Free(ptr);
+            throw ss.str();
+        }
+        *limits[ii] = (uint32_t)c->valueint;
+    }
 }
 
 void UserEntry::parseStringList(cJSON *root, const char *field, StringList &list) {
@@ -190,18 +219,40 @@ RBACManager::~RBACManager() {
     cb_mutex_destroy(&mutex);
 }
 
-void RBACManager::applyProfiles(AuthContext *ctx, const StringList &pf) {
-    ctx->clearCommands();
+void RBACManager::compileProfiles(const StringList &pf,
+                                  std::array<uint64_t, ACCESS_MASK_WORDS> &cmd) {
+    cmd.fill(0);
     StringList::const_iterator ii;
     for (ii = pf.begin(); ii != pf.end(); ++ii) {
         ProfileMap::const_iterator pi;
         pi = profiles.find(*ii);
         if (pi != profiles.end()) {
-            ctx->mergeCommands(pi->second.getCommands());
+            const std::array<uint8_t, MAX_COMMANDS> &c = pi->second.getCommands();
+            for (int jj = 0; jj < MAX_COMMANDS; ++jj) {
+                if (c[jj] != 0) {
+                    cmd[jj >> 6] |= uint64_t(1) << (jj & 63);
+                }
+            }
         }
     }
 }
 
+void RBACManager::applyProfiles(AuthContext *ctx, const StringList &pf) {
+    std::array<uint64_t, ACCESS_MASK_WORDS> cmd;
+    compileProfiles(pf, cmd);
+    ctx->setCommands(cmd);
+}
+
+uint32_t RBACManager::getUserId(const std::string &name) {
+    std::map<std::string, uint32_t>::iterator iter = userIds.find(name);
+    if (iter == userIds.end()) {
+        uint32_t id = (uint32_t)userIds.size() + 1;
+        userIds[name] = id;
+        return id;
+    }
+    return iter->second;
+}
+
 AuthContext *RBACManager::createAuthContext(const std::string name,
                                             const std::string &_conn) {
     AuthContext *ret;
@@ -213,16 +264,26 @@ AuthContext *RBACManager::createAuthContext(const std::string name,
     } else {
         ret = new AuthContext(generation, name, _conn);
         applyProfiles(ret, iter->second.getProfiles());
+        ret->setRateLimits(getUserId(name), iter->second.getOpsLimit(),
+                           iter->second.getBytesLimit());
+        contexts.insert(ret);
     }
     cb_mutex_exit(&mutex);
 
     return ret;
 }
 
+void RBACManager::destroyAuthContext(AuthContext *ctx) {
+    cb_mutex_enter(&mutex);
+    contexts.erase(ctx);
+    cb_mutex_exit(&mutex);
+    delete ctx;
+}
+
 bool RBACManager::assumeRole(AuthContext *ctx, const std::string &role) {
     cb_mutex_enter(&mutex);
-    if (ctx->getGeneration() != generation) {
-        // this is an old generation of the config!
+    if (ctx->isStale()) {
+        // its user or role is gone from the config!
         cb_mutex_exit(&mutex);
         // @todo add proper objects
         throw std::string("Stale configuration");
@@ -269,8 +330,8 @@ bool RBACManager::assumeRole(AuthContext *ctx, const std::string &role) {
 
 void RBACManager::dropRole(AuthContext *ctx) {
     cb_mutex_enter(&mutex);
-    if (ctx->getGeneration() != generation) {
-        // this is an old generation of the config!
+    if (ctx->isStale()) {
+        // its user or role is gone from the config!
         cb_mutex_exit(&mutex);
         // @todo add proper objects
         throw std::string("Stale configuration");
@@ -284,14 +345,60 @@ void RBACManager::dropRole(AuthContext *ctx) {
     cb_mutex_exit(&mutex);
 }
 
+/**
+ * Bring the context up to date with the (new) configuration: the bitmap
+ * is recompiled from the profiles of its role (or user), so only the
+ * commands that changed are seen to change. The context goes stale if
+ * its user or role is gone.
+ */
+void RBACManager::refreshContext(AuthContext *ctx, uint32_t gen) {
+    UserEntryMap::const_iterator user = users.find(ctx->getName());
+    UserEntryMap::const_iterator role = roles.end();
+    if (ctx->getRole().length() != 0) {
+        role = roles.find(ctx->getRole());
+    }
+    if (user == users.end() ||
+        (ctx->getRole().length() != 0 && role == roles.end())) {
+        ctx->setStale();
+        return;
+    }
+
+    if (role != roles.end()) {
+        applyProfiles(ctx, role->second.getProfiles());
+    } else {
+        applyProfiles(ctx, user->second.getProfiles());
+    }
+    ctx->setRateLimits(ctx->getUserId(), user->second.getOpsLimit(),
+                       user->second.getBytesLimit());
+    ctx->setGeneration(gen);
+}
+
 void RBACManager::initialize(cJSON *root) {
-    roles.clear();
-    profiles.clear();
+    UserEntryMap newRoles;
+    UserEntryMap newUsers;
+    ProfileMap newProfiles;
+
+    // A broken configuration throws before anything is replaced
+    initializeUserEntry(cJSON_GetObjectItem(root, "roles"), true, newRoles);
+    initializeUserEntry(cJSON_GetObjectItem(root, "users"), false, newUsers);
+    initializeProfiles(cJSON_GetObjectItem(root, "profiles"), newProfiles);
 
-    initializeUserEntry(cJSON_GetObjectItem(root, "roles"), true);
-    initializeUserEntry(cJSON_GetObjectItem(root, "users"), false);
-    initializeProfiles(cJSON_GetObjectItem(root, "profiles"));
-    ++generation;
+    cb_mutex_enter(&mutex);
+    roles.swap(newRoles);
+    users.swap(newUsers);
+    profiles.swap(newProfiles);
+
+    // The contexts move to the new generation before the connections
+    // see it, so they only refetch the (updated) bitmaps
+    uint32_t gen = generation.load() + 1;
+    std::set<AuthContext*>::iterator iter;
+    for (iter = contexts.begin(); iter != contexts.end(); ++iter) {
+        if (!(*iter)->isStale()) {
+            refreshContext(*iter, gen);
+        }
+    }
+    generation.store(gen);
+    cb_mutex_exit(&mutex);
 }
 
 /**
@@ -299,8 +406,10 @@ void RBACManager::initialize(cJSON *root) {
  *
  * @param root the root object of the JSON array
  * @param roles true if this is roles, false for users
+ * @param entries where to add them
      */
-void RBACManager::initializeUserEntry(cJSON *root, bool role) {
+void RBACManager::initializeUserEntry(cJSON *root, bool role,
+                                      UserEntryMap &entries) {
     if (root == NULL) {
         return;
     }
@@ -339,16 +448,12 @@ void RBACManager::initializeUserEntry(cJSON *root, bool role) {
 
         UserEntry entry;
         entry.initialize(obj, role);
-        if (role) {
-            roles[entry.getName()] = entry;
-        } else {
-            users[entry.getName()] = entry;
-        }
+        entries[entry.getName()] = entry;
         obj = obj->next;
     }
 }
 
-void RBACManager::initializeProfiles(cJSON *root) {
+void RBACManager::initializeProfiles(cJSON *root, ProfileMap &entries) {
     if (root == NULL) {
         return ;
     }
@@ -375,7 +480,7 @@ void RBACManager::initializeProfiles(cJSON *root) {
 
         Profile entry;
         entry.initialize(obj);
-        profiles[entry.getName()] = entry;
+        entries[entry.getName()] = entry;
         obj = obj->next;
     }
 }
@@ -415,7 +520,9 @@ auth_context_t auth_create(const char* user,
 
 void auth_destroy(auth_context_t context)
 {
-    delete reinterpret_cast<AuthContext*>(context);
+    if (context != NULL) {
+        rbac.destroyAuthContext(reinterpret_cast<AuthContext*>(context));
+    }
 }
 
 auth_error_t auth_assume_role(auth_context_t ctx, const char *role)
@@ -463,8 +570,7 @@ auth_error_t auth_check_access(auth_context_t ctx, uint8_t opcode)
 
     AuthContext *context = reinterpret_cast<AuthContext*>(ctx);
 
-    // sloppy check to avoid lock contention
-    if (rbac.getGeneration() != context->getGeneration()) {
+    if (context->isStale()) {
         return AUTH_STALE;
     } else if (context->checkAccess(opcode)) {
         return AUTH_OK;
@@ -479,6 +585,37 @@ auth_error_t auth_check_access(auth_context_t ctx, uint8_t opcode)
     }
 }
 
+const uint64_t *auth_get_access_mask(auth_context_t ctx, uint32_t *generation)
+{
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    AuthContext *context = reinterpret_cast<AuthContext*>(ctx);
+    *generation = context->getGeneration();
+    return context->getAccessMask();
+}
+
+bool auth_get_rate_limits(auth_context_t ctx, uint32_t *user,
+                          uint32_t *ops, uint32_t *bytes)
+{
+    if (ctx == NULL) {
+        *user = *ops = *bytes = 0;
+        return false;
+    }
+
+    AuthContext *context = reinterpret_cast<AuthContext*>(ctx);
+    *user = context->getUserId();
+    *ops = context->getOpsLimit();
+    *bytes = context->getBytesLimit();
+    return true;
+}
+
+uint32_t auth_get_generation(void)
+{
+    return rbac.getGeneration();
+}
+
 void auth_set_privilege_debug(bool enable) {
     rbac.setPrivilegeDebugging(enable);
 }
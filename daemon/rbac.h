@@ -75,6 +75,44 @@ extern "C" {
      */
     auth_error_t auth_check_access(auth_context_t ctx, uint8_t opcode);
 
+    /**
+     * Get the commands of the context as a bitmap (bit opcode & 63 of
+     * word opcode >> 6 is set for the allowed ones). The bitmap belongs
+     * to the context, and follows its role changes.
+     *
+     * @param ctx the application context
+     * @param generation where to store the generation of the RBAC
+     *                   configuration the context was created from
+     * @return the bitmap, or NULL if there's no context
+     */
+    const uint64_t *auth_get_access_mask(auth_context_t ctx,
+                                         uint32_t *generation);
+
+    /**
+     * Get the rate limits of the user of the context (the "limits" of
+     * its entry, see rate_limit.h)
+     *
+     * @param ctx the application context
+     * @param user where to store the index of the user, the same for all
+     *             of its contexts and across reloads of the configuration
+     *             (0 if there's no context)
+     * @param ops where to store the commands per second (0 for no limit)
+     * @param bytes where to store the bytes per second (0 for no limit)
+     * @return false if there's no context
+     */
+    bool auth_get_rate_limits(auth_context_t ctx, uint32_t *user,
+                              uint32_t *ops, uint32_t *bytes);
+
+    /**
+     * Get the generation of the RBAC configuration, bumped every time
+     * it's loaded. The live contexts are updated in place by a reload
+     * (and move to the new generation), so a connection only has to
+     * fetch the bitmap of its context again once the generation moves.
+     * The contexts whose user or role was removed keep their generation
+     * and report AUTH_STALE.
+     */
+    uint32_t auth_get_generation(void);
+
     /**
      * Enable / disable privilege debugging
      *
@@ -5,6 +5,7 @@
 #include <string>
 #include <list>
 #include <map>
+#include <set>
 #include <array>
 #include <cJSON.h>
 #include <atomic>
@@ -19,6 +20,7 @@ typedef std::map<std::string, UserEntry> UserEntryMap;
 typedef std::map<std::string, Profile> ProfileMap;
 
 #define MAX_COMMANDS 0x100
+#define ACCESS_MASK_WORDS (MAX_COMMANDS / 64)
 
 /**
  * The Authentication Context class is used as a "holder class" for the
@@ -30,13 +32,20 @@ typedef std::map<std::string, Profile> ProfileMap;
  *
  * Clients may "assume" another role causing the effective privilege set
  * to be changed gaining access to additional buckets, roles and commands.
+ *
+ * The commands of the profiles are compiled into one bit per opcode,
+ * which the connections test directly (see auth_get_access_mask()).
+ * A reload of the configuration recompiles the bitmap of every live
+ * context in place (see RBACManager::initialize()), only the contexts
+ * whose user or role is gone go stale.
  */
 class AuthContext {
 public:
     AuthContext(uint32_t gen,
                 const std::string &nm,
                 const std::string &_connection) :
-        name(nm), generation(gen), connection(_connection)
+        name(nm), generation(gen), stale(false), connection(_connection),
+        userId(0), opsLimit(0), bytesLimit(0)
     {
         commands.fill(0);
     }
@@ -54,29 +63,72 @@ public:
     }
 
     uint32_t getGeneration(void) const {
-        return generation;
+        return generation.load();
+    }
+
+    void setGeneration(uint32_t gen) {
+        generation.store(gen);
+    }
+
+    // Its user (or role) is gone from the configuration
+    bool isStale(void) const {
+        return stale.load();
     }
 
-    void mergeCommands(const std::array<uint8_t, MAX_COMMANDS> &cmd) {
-        for (int ii = 0; ii < MAX_COMMANDS; ++ii) {
-            commands[ii] |= cmd[ii];
+    void setStale(void) {
+        stale.store(true);
+    }
+
+    /**
+     * Replace the bitmap word by word without clearing it first, the
+     * connections may be testing it meanwhile (the unchanged words
+     * aren't written at all).
+     */
+    void setCommands(const std::array<uint64_t, ACCESS_MASK_WORDS> &cmd) {
+        for (int ii = 0; ii < ACCESS_MASK_WORDS; ++ii) {
+            if (commands[ii] != cmd[ii]) {
+                commands[ii] = cmd[ii];
+            }
         }
     }
 
-    void clearCommands(void) {
-        commands.fill(0);
+    bool checkAccess(uint8_t opcode) const {
+        return (commands[opcode >> 6] >> (opcode & 63)) & 1;
     }
 
-    bool checkAccess(uint8_t opcode) {
-        return commands[opcode] != 0;
+    const uint64_t *getAccessMask(void) const {
+        return commands.data();
+    }
+
+    // The rate limits stay the ones of the user when assuming a role
+    void setRateLimits(uint32_t id, uint32_t ops, uint32_t bytes) {
+        userId = id;
+        opsLimit = ops;
+        bytesLimit = bytes;
+    }
+
+    uint32_t getUserId(void) const {
+        return userId;
+    }
+
+    uint32_t getOpsLimit(void) const {
+        return opsLimit;
+    }
+
+    uint32_t getBytesLimit(void) const {
+        return bytesLimit;
     }
 
 private:
     std::string name;
     std::string role; // if we've assumed a role, this is the current role
-    uint32_t generation;
+    std::atomic<uint32_t> generation;
+    std::atomic<bool> stale;
     std::string connection;
-    std::array<uint8_t, MAX_COMMANDS> commands;
+    std::array<uint64_t, ACCESS_MASK_WORDS> commands;
+    uint32_t userId;
+    uint32_t opsLimit;
+    uint32_t bytesLimit;
 
     friend std::ostream& operator<< (std::ostream& out,
                                      const AuthContext &context);
@@ -84,6 +136,8 @@ private:
 
 class UserEntry {
 public:
+    UserEntry() : role(false), opsLimit(0), bytesLimit(0) {}
+
     void initialize(cJSON *root, bool _role);
 
     const std::string &getName(void) const {
@@ -102,9 +156,18 @@ public:
         return profiles;
     }
 
+    uint32_t getOpsLimit(void) const {
+        return opsLimit;
+    }
+
+    uint32_t getBytesLimit(void) const {
+        return bytesLimit;
+    }
+
 private:
     void parseStringList(cJSON *root, const char *field, StringList &list);
     std::string getStringField(cJSON *root, const char *field);
+    void parseLimits(cJSON *root);
 
     std::string name;
 
@@ -117,6 +180,9 @@ private:
     StringList profiles;
     // A user/role may contain a list of buckets
     StringList buckets;
+    // A user may be limited to commands / bytes per second (0 for none)
+    uint32_t opsLimit;
+    uint32_t bytesLimit;
 };
 
 class Profile {
@@ -154,6 +220,7 @@ public:
 
     AuthContext *createAuthContext(const std::string name,
                                    const std::string &_connection);
+    void destroyAuthContext(AuthContext *ctx);
 
     bool assumeRole(AuthContext *ctx, const std::string &role);
     void dropRole(AuthContext *ctx);
@@ -173,10 +240,14 @@ public:
     }
 
 private:
-    void initializeUserEntry(cJSON *root, bool role);
-    void initializeProfiles(cJSON *root);
+    void initializeUserEntry(cJSON *root, bool role, UserEntryMap &entries);
+    void initializeProfiles(cJSON *root, ProfileMap &entries);
 
+    void compileProfiles(const StringList &pf,
+                         std::array<uint64_t, ACCESS_MASK_WORDS> &cmd);
     void applyProfiles(AuthContext *ctx, const StringList &pf);
+    void refreshContext(AuthContext *ctx, uint32_t gen);
+    uint32_t getUserId(const std::string &name);
 
     std::atomic<bool> privilegeDebugging;
     std::atomic<uint32_t> generation;
@@ -184,6 +255,10 @@ private:
     UserEntryMap roles;
     UserEntryMap users;
     ProfileMap profiles;
+    // The index of every user seen, kept across reloads (0 is no user)
+    std::map<std::string, uint32_t> userIds;
+    // Every context not yet destroyed, refreshed by a reload
+    std::set<AuthContext*> contexts;
 
 };
 
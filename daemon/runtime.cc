@@ -59,3 +59,15 @@ void set_ssl_ctx_cipher_list(SSL_CTX *ctx) {
         }
     }
 }
+
+void set_ssl_conn_cipher_list(SSL *ssl) {
+    std::lock_guard<std::mutex> lock(ssl_cipher_list_mutex);
+    if (ssl_cipher_list.length()) {
+        if (SSL_set_cipher_list(ssl, ssl_cipher_list.c_str()) == 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "Failed to select any of the "
+                                            "requested ciphers (%s)",
+                                            ssl_cipher_list.c_str());
+        }
+    }
+}
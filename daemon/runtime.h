@@ -33,6 +33,7 @@ extern "C" {
 
     void set_ssl_cipher_list(const char *new_list);
     void set_ssl_ctx_cipher_list(SSL_CTX *ctx);
+    void set_ssl_conn_cipher_list(SSL *ssl);
 
 #ifdef __cplusplus
 }
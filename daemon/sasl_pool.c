@@ -0,0 +1,173 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The queue of the pool is a plain FIFO: the exchanges are short, and
+ * the point is only to keep them off the worker threads. The connection
+ * doesn't touch its sasl_conn while blocked, and a connection closed
+ * meanwhile waits in conn_pending_close for the notification, so the
+ * thread running a job owns both until it calls notify_io_complete().
+ */
+#include "config.h"
+#include "sasl_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct sasl_job {
+    struct sasl_job *next;
+    conn *c;
+    bool start;
+    char *mech;
+    char *challenge;     /* NULL if the client sent none */
+    unsigned int challengelen;
+    char data[];         /* the mechanism, then the challenge */
+};
+
+static struct {
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+    struct sasl_job *head;
+    struct sasl_job *tail;
+    bool shutdown;
+    int nthreads;
+    cb_thread_t *tids;
+} pool;
+
+static void sasl_job_run(struct sasl_job *job)
+{
+    conn *c = job->c;
+    const char *out = NULL;
+    unsigned int outlen = 0;
+
+    if (job->start) {
+        c->sasl_auth.result = cbsasl_server_start(&c->sasl_conn, job->mech,
+                                                  job->challenge,
+                                                  job->challengelen,
+                                                  (unsigned char **)&out,
+                                                  &outlen);
+    } else {
+        c->sasl_auth.result = cbsasl_server_step(c->sasl_conn,
+                                                 job->challenge,
+                                                 job->challengelen,
+                                                 &out, &outlen);
+    }
+    c->sasl_auth.out = out;
+    c->sasl_auth.outlen = outlen;
+    notify_io_complete(c, ENGINE_SUCCESS);
+}
+
+static void sasl_pool_main(void *arg)
+{
+    (void)arg;
+
+    cb_mutex_enter(&pool.mutex);
+    for (;;) {
+        struct sasl_job *job = pool.head;
+        if (job == NULL) {
+            if (pool.shutdown) {
+                break;
+            }
+            cb_cond_wait(&pool.cond, &pool.mutex);
+            continue;
+        }
+        pool.head = job->next;
+        if (pool.head == NULL) {
+            pool.tail = NULL;
+        }
+        cb_mutex_exit(&pool.mutex);
+
+        sasl_job_run(job);
+        free(job);
+
+        cb_mutex_enter(&pool.mutex);
+    }
+    cb_mutex_exit(&pool.mutex);
+}
+
+bool sasl_pool_init(int nthreads)
+{
+    int ii;
+
+    cb_mutex_initialize(&pool.mutex);
+    cb_cond_initialize(&pool.cond);
+    if (nthreads == 0) {
+        return true;
+    }
+
+    pool.tids = calloc(nthreads, sizeof(*pool.tids));
+    if (pool.tids == NULL) {
+        return false;
+    }
+    for (ii = 0; ii < nthreads; ++ii) {
+        int ret = cb_create_thread(&pool.tids[ii], sasl_pool_main, NULL, 0);
+        if (ret != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "Can't create SASL thread: %s\n",
+                                            strerror(ret));
+            return false;
+        }
+        pool.nthreads = ii + 1;
+    }
+    return true;
+}
+
+void sasl_pool_shutdown(void)
+{
+    int ii;
+
+    cb_mutex_enter(&pool.mutex);
+    pool.shutdown = true;
+    cb_cond_broadcast(&pool.cond);
+    cb_mutex_exit(&pool.mutex);
+
+    for (ii = 0; ii < pool.nthreads; ++ii) {
+        cb_join_thread(pool.tids[ii]);
+    }
+    free(pool.tids);
+    pool.tids = NULL;
+    pool.nthreads = 0;
+    cb_cond_destroy(&pool.cond);
+    cb_mutex_destroy(&pool.mutex);
+}
+
+bool sasl_pool_submit(conn *c, bool start, const char *mech,
+                      const char *challenge, unsigned int challengelen)
+{
+    size_t nmech = strlen(mech) + 1;
+    struct sasl_job *job;
+
+    if (pool.nthreads == 0) {
+        return false;
+    }
+    job = malloc(sizeof(*job) + nmech + challengelen);
+    if (job == NULL) {
+        return false;
+    }
+    job->next = NULL;
+    job->c = c;
+    job->start = start;
+    job->mech = job->data;
+    memcpy(job->mech, mech, nmech);
+    job->challengelen = challengelen;
+    if (challenge != NULL) {
+        job->challenge = job->data + nmech;
+        memcpy(job->challenge, challenge, challengelen);
+    } else {
+        job->challenge = NULL;
+    }
+
+    cb_mutex_enter(&pool.mutex);
+    if (pool.shutdown) {
+        cb_mutex_exit(&pool.mutex);
+        free(job);
+        return false;
+    }
+    if (pool.tail == NULL) {
+        pool.head = job;
+    } else {
+        pool.tail->next = job;
+    }
+    pool.tail = job;
+    cb_cond_signal(&pool.cond);
+    cb_mutex_exit(&pool.mutex);
+    return true;
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The threads running the SASL mechanisms (see the "sasl_threads"
+ * setting). A connection sending SASL_AUTH or SASL_STEP hands the
+ * exchange over to the pool and blocks (EWOULDBLOCK) until the result is
+ * in c->sasl_auth, so the hashing doesn't hold up the other connections
+ * of its worker thread.
+ */
+
+#ifndef SASL_POOL_H
+#define SASL_POOL_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Start the threads. Returns false if we can't */
+bool sasl_pool_init(int nthreads);
+
+/* Stop the threads once the exchanges queued are done */
+void sasl_pool_shutdown(void);
+
+/*
+ * Queue the start (or the next step) of the SASL exchange of the
+ * connection. notify_io_complete() is called on the connection once
+ * the result is in c->sasl_auth. Returns false if the pool isn't
+ * running or we're out of memory.
+ */
+bool sasl_pool_submit(conn *c, bool start, const char *mech,
+                      const char *challenge, unsigned int challengelen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
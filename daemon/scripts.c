@@ -0,0 +1,430 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Compiling the scripts of the "scripts_file" (see scripts.h). They are
+ * kept sorted by name, and never change once loaded, so the worker
+ * threads look them up without a lock. The steps are run by the
+ * SCRIPT_EXEC executor.
+ */
+#include "config.h"
+#include "memcached.h"
+#include "scripts.h"
+#include "config_util.h"
+
+#include <cJSON.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct {
+    script_t *scripts;
+    uint32_t count;
+} registry;
+
+static const struct {
+    const char *name;
+    script_op_t op;
+    uint8_t opcode;
+} ops[] = {
+    { "get", SCRIPT_OP_GET, PROTOCOL_BINARY_CMD_GET },
+    { "check", SCRIPT_OP_CHECK, PROTOCOL_BINARY_CMD_GET },
+    { "set", SCRIPT_OP_SET, PROTOCOL_BINARY_CMD_SET },
+    { "add", SCRIPT_OP_ADD, PROTOCOL_BINARY_CMD_ADD },
+    { "replace", SCRIPT_OP_REPLACE, PROTOCOL_BINARY_CMD_REPLACE },
+    { "append", SCRIPT_OP_APPEND, PROTOCOL_BINARY_CMD_APPEND },
+    { "prepend", SCRIPT_OP_PREPEND, PROTOCOL_BINARY_CMD_PREPEND },
+    { "incr", SCRIPT_OP_INCR, PROTOCOL_BINARY_CMD_INCREMENT },
+    { "decr", SCRIPT_OP_DECR, PROTOCOL_BINARY_CMD_DECREMENT },
+    { "touch", SCRIPT_OP_TOUCH, PROTOCOL_BINARY_CMD_TOUCH },
+    { "delete", SCRIPT_OP_DELETE, PROTOCOL_BINARY_CMD_DELETE }
+};
+
+/* What a failed check may end the run with */
+static const struct {
+    const char *name;
+    uint16_t status;
+} statuses[] = {
+    { "not_stored", PROTOCOL_BINARY_RESPONSE_NOT_STORED },
+    { "key_enoent", PROTOCOL_BINARY_RESPONSE_KEY_ENOENT },
+    { "key_eexists", PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS },
+    { "einval", PROTOCOL_BINARY_RESPONSE_EINVAL }
+};
+
+static void log_invalid(const char *script, int step, const char *why) {
+    if (step < 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Invalid script \"%s\": %s\n",
+                                        script, why);
+    } else {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Invalid step %d of script \"%s\": %s\n",
+                                        step, script, why);
+    }
+}
+
+static bool get_uint(cJSON *o, uint64_t max, uint64_t *value) {
+    if (o->type != cJSON_Number || o->valuedouble < 0 ||
+        o->valuedouble > (double)max ||
+        o->valuedouble != (double)(uint64_t)o->valuedouble) {
+        return false;
+    }
+    *value = (uint64_t)o->valuedouble;
+    return true;
+}
+
+static bool get_bool(cJSON *o, bool *value) {
+    if (o->type != cJSON_True && o->type != cJSON_False) {
+        return false;
+    }
+    *value = o->type == cJSON_True;
+    return true;
+}
+
+static bool compile_operand(cJSON *o, uint16_t max,
+                            script_operand_t *operand) {
+    const char *str;
+    size_t len;
+
+    if (o->type != cJSON_String) {
+        return false;
+    }
+    str = o->valuestring;
+    if (str[0] == '$' && str[1] != '$') {
+        char *end;
+        long arg = strtol(str + 1, &end, 10);
+        if (str[1] == '\0' || *end != '\0' || arg < 0 ||
+            arg >= PROTOCOL_BINARY_SCRIPT_MAX_ARGS) {
+            return false;
+        }
+        operand->arg = (int)arg;
+        return true;
+    }
+    if (str[0] == '$') {
+        ++str;
+    }
+    len = strlen(str);
+    if (len > max || (operand->data = strdup(str)) == NULL) {
+        return false;
+    }
+    operand->length = (uint16_t)len;
+    return true;
+}
+
+static bool compile_status(cJSON *o, uint16_t *status) {
+    size_t ii;
+
+    if (o->type != cJSON_String) {
+        return false;
+    }
+    for (ii = 0; ii < sizeof(statuses) / sizeof(statuses[0]); ++ii) {
+        if (strcmp(o->valuestring, statuses[ii].name) == 0) {
+            *status = statuses[ii].status;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Which of the fields of a step each of the ops takes */
+static bool step_takes(script_op_t op, const char *field) {
+    if (strcmp(field, "op") == 0) {
+        return true;
+    }
+    switch (op) {
+    case SCRIPT_OP_GET:
+        return strcmp(field, "key") == 0 || strcmp(field, "optional") == 0;
+    case SCRIPT_OP_CHECK:
+        return strcmp(field, "exists") == 0 || strcmp(field, "flags") == 0 ||
+            strcmp(field, "value") == 0 || strcmp(field, "status") == 0;
+    case SCRIPT_OP_SET:
+    case SCRIPT_OP_ADD:
+    case SCRIPT_OP_REPLACE:
+        return strcmp(field, "key") == 0 || strcmp(field, "value") == 0 ||
+            strcmp(field, "flags") == 0 || strcmp(field, "exptime") == 0 ||
+            (op != SCRIPT_OP_ADD && strcmp(field, "cas") == 0);
+    case SCRIPT_OP_APPEND:
+    case SCRIPT_OP_PREPEND:
+        return strcmp(field, "key") == 0 || strcmp(field, "value") == 0 ||
+            strcmp(field, "cas") == 0;
+    case SCRIPT_OP_INCR:
+    case SCRIPT_OP_DECR:
+        return strcmp(field, "key") == 0 || strcmp(field, "delta") == 0 ||
+            strcmp(field, "initial") == 0 || strcmp(field, "exptime") == 0 ||
+            strcmp(field, "create") == 0;
+    case SCRIPT_OP_TOUCH:
+        return strcmp(field, "key") == 0 || strcmp(field, "exptime") == 0;
+    case SCRIPT_OP_DELETE:
+        return strcmp(field, "key") == 0 || strcmp(field, "cas") == 0;
+    }
+    return false;
+}
+
+static bool compile_step(const char *script, int index, cJSON *json,
+                         script_step_t *step) {
+    cJSON *o;
+    size_t ii;
+
+    memset(step, 0, sizeof(*step));
+    step->key.arg = step->value.arg = -1;
+    step->exists = -1;
+    step->create = true;
+    step->delta = 1;
+    step->status = PROTOCOL_BINARY_RESPONSE_NOT_STORED;
+
+    if (json->type != cJSON_Object ||
+        (o = cJSON_GetObjectItem(json, "op")) == NULL ||
+        o->type != cJSON_String) {
+        log_invalid(script, index, "a step must be an object with an op");
+        return false;
+    }
+    for (ii = 0; ii < sizeof(ops) / sizeof(ops[0]); ++ii) {
+        if (strcmp(o->valuestring, ops[ii].name) == 0) {
+            break;
+        }
+    }
+    if (ii == sizeof(ops) / sizeof(ops[0])) {
+        log_invalid(script, index, "unknown op");
+        return false;
+    }
+    step->op = ops[ii].op;
+    step->opcode = ops[ii].opcode;
+
+    for (o = json->child; o != NULL; o = o->next) {
+        uint64_t value;
+        bool ok = step_takes(step->op, o->string);
+
+        if (!ok) {
+            /* Fall through to the error below */
+        } else if (strcmp(o->string, "op") == 0) {
+            continue;
+        } else if (strcmp(o->string, "key") == 0) {
+            ok = compile_operand(o, KEY_MAX_LENGTH, &step->key) &&
+                (step->key.arg != -1 || step->key.length > 0);
+        } else if (strcmp(o->string, "value") == 0) {
+            ok = compile_operand(o, UINT16_MAX, &step->value);
+            step->check_value = step->op == SCRIPT_OP_CHECK;
+        } else if (strcmp(o->string, "flags") == 0) {
+            ok = get_uint(o, UINT32_MAX, &value);
+            step->flags = (uint32_t)value;
+            step->check_flags = step->op == SCRIPT_OP_CHECK;
+        } else if (strcmp(o->string, "exptime") == 0) {
+            ok = get_uint(o, UINT32_MAX, &value);
+            step->exptime = (uint32_t)value;
+        } else if (strcmp(o->string, "delta") == 0) {
+            ok = get_uint(o, UINT64_MAX, &step->delta);
+        } else if (strcmp(o->string, "initial") == 0) {
+            ok = get_uint(o, UINT64_MAX, &step->initial);
+        } else if (strcmp(o->string, "create") == 0) {
+            ok = get_bool(o, &step->create);
+        } else if (strcmp(o->string, "optional") == 0) {
+            ok = get_bool(o, &step->optional);
+        } else if (strcmp(o->string, "cas") == 0) {
+            ok = get_bool(o, &step->cas);
+        } else if (strcmp(o->string, "exists") == 0) {
+            bool exists;
+            ok = get_bool(o, &exists);
+            step->exists = exists ? 1 : 0;
+        } else if (strcmp(o->string, "status") == 0) {
+            ok = compile_status(o, &step->status);
+        }
+
+        if (!ok) {
+            char why[256];
+            snprintf(why, sizeof(why), "invalid field \"%s\"", o->string);
+            log_invalid(script, index, why);
+            return false;
+        }
+    }
+
+    if (step->op != SCRIPT_OP_CHECK && step->key.arg == -1 &&
+        step->key.data == NULL) {
+        log_invalid(script, index, "missing key");
+        return false;
+    }
+    switch (step->op) {
+    case SCRIPT_OP_SET:
+    case SCRIPT_OP_ADD:
+    case SCRIPT_OP_REPLACE:
+    case SCRIPT_OP_APPEND:
+    case SCRIPT_OP_PREPEND:
+        if (step->value.arg == -1 && step->value.data == NULL) {
+            log_invalid(script, index, "missing value");
+            return false;
+        }
+        break;
+    default:
+        ;
+    }
+    return true;
+}
+
+static void free_script(script_t *script) {
+    uint32_t ii;
+
+    for (ii = 0; ii < script->nsteps; ++ii) {
+        free((char*)script->steps[ii].key.data);
+        free((char*)script->steps[ii].value.data);
+    }
+    free(script->steps);
+    free((char*)script->name);
+}
+
+static bool compile_script(cJSON *json, script_t *script) {
+    const char *name = json->string;
+    cJSON *steps = NULL;
+    cJSON *o;
+    uint64_t value;
+
+    memset(script, 0, sizeof(*script));
+    script->max_steps = SCRIPT_DEFAULT_BUDGET;
+    script->max_usec = SCRIPT_DEFAULT_USEC;
+
+    if (strlen(name) == 0 || strlen(name) > KEY_MAX_LENGTH) {
+        log_invalid(name, -1, "the name must be 1 to 250 characters");
+        return false;
+    }
+    if (json->type != cJSON_Object) {
+        log_invalid(name, -1, "a script must be an object");
+        return false;
+    }
+    for (o = json->child; o != NULL; o = o->next) {
+        if (strcmp(o->string, "steps") == 0 && o->type == cJSON_Array) {
+            steps = o;
+        } else if (strcmp(o->string, "max_steps") == 0 &&
+                   get_uint(o, SCRIPT_MAX_BUDGET, &value) && value > 0) {
+            script->max_steps = (uint32_t)value;
+        } else if (strcmp(o->string, "max_usec") == 0 &&
+                   get_uint(o, UINT32_MAX, &value) && value > 0) {
+            script->max_usec = (uint32_t)value;
+        } else {
+            char why[256];
+            snprintf(why, sizeof(why), "invalid field \"%s\"", o->string);
+            log_invalid(name, -1, why);
+            return false;
+        }
+    }
+    if (steps == NULL || cJSON_GetArraySize(steps) == 0 ||
+        cJSON_GetArraySize(steps) > SCRIPT_MAX_STEPS) {
+        log_invalid(name, -1, "a script must have 1 to 64 steps");
+        return false;
+    }
+
+    script->steps = calloc(cJSON_GetArraySize(steps), sizeof(script_step_t));
+    script->name = strdup(name);
+    if (script->steps == NULL || script->name == NULL) {
+        free_script(script);
+        return false;
+    }
+    script->nname = (uint16_t)strlen(name);
+    for (o = steps->child; o != NULL; o = o->next) {
+        if (!compile_step(name, (int)script->nsteps, o,
+                          &script->steps[script->nsteps])) {
+            /* The step may have got as far as its literals */
+            ++script->nsteps;
+            free_script(script);
+            return false;
+        }
+        ++script->nsteps;
+    }
+    return true;
+}
+
+static int script_compare(const void *a, const void *b) {
+    const script_t *sa = a;
+    const script_t *sb = b;
+    uint16_t len = sa->nname < sb->nname ? sa->nname : sb->nname;
+    int ret = memcmp(sa->name, sb->name, len);
+
+    if (ret == 0) {
+        ret = (int)sa->nname - (int)sb->nname;
+    }
+    return ret;
+}
+
+bool scripts_init(void) {
+    config_error_t err;
+    cJSON *json;
+    cJSON *scripts;
+    cJSON *o;
+    uint32_t count = 0;
+    uint32_t ii;
+
+    if (settings.scripts_file == NULL) {
+        return true;
+    }
+
+    err = config_load_file(settings.scripts_file, &json);
+    if (err != CONFIG_SUCCESS) {
+        char *msg = config_strerror(settings.scripts_file, err);
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "%s\n", msg);
+        free(msg);
+        return false;
+    }
+
+    scripts = cJSON_GetObjectItem(json, "scripts");
+    if (scripts == NULL || scripts->type != cJSON_Object) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "\"%s\" doesn't have an object of scripts\n",
+                                        settings.scripts_file);
+        cJSON_Delete(json);
+        return false;
+    }
+
+    registry.scripts = calloc(cJSON_GetArraySize(scripts) + 1,
+                              sizeof(script_t));
+    if (registry.scripts == NULL) {
+        cJSON_Delete(json);
+        return false;
+    }
+    for (o = scripts->child; o != NULL; o = o->next) {
+        if (!compile_script(o, &registry.scripts[count])) {
+            registry.count = count;
+            scripts_shutdown();
+            cJSON_Delete(json);
+            return false;
+        }
+        ++count;
+    }
+    cJSON_Delete(json);
+
+    registry.count = count;
+    qsort(registry.scripts, count, sizeof(script_t), script_compare);
+    for (ii = 1; ii < count; ++ii) {
+        if (script_compare(&registry.scripts[ii - 1],
+                           &registry.scripts[ii]) == 0) {
+            log_invalid(registry.scripts[ii].name, -1, "defined twice");
+            scripts_shutdown();
+            return false;
+        }
+    }
+    settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+                                    "Loaded %u scripts from \"%s\"\n",
+                                    count, settings.scripts_file);
+    return true;
+}
+
+void scripts_shutdown(void) {
+    uint32_t ii;
+
+    for (ii = 0; ii < registry.count; ++ii) {
+        free_script(&registry.scripts[ii]);
+    }
+    free(registry.scripts);
+    registry.scripts = NULL;
+    registry.count = 0;
+}
+
+const script_t *script_find(const char *name, uint16_t nname) {
+    script_t key;
+
+    if (registry.count == 0) {
+        return NULL;
+    }
+    key.name = name;
+    key.nname = nname;
+    return bsearch(&key, registry.scripts, registry.count, sizeof(script_t),
+                   script_compare);
+}
+
+uint32_t scripts_count(void) {
+    return registry.count;
+}
@@ -0,0 +1,119 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The server side scripts of the "scripts_file": named lists of steps
+ * which SCRIPT_EXEC runs against the engine on the worker thread, so an
+ * operation such as "check a flag, bump a counter, append to a list and
+ * refresh a TTL" takes one round trip rather than one per step. The
+ * scripts are compiled when the file is loaded at startup, and they can't
+ * do anything but their steps: there are no loops (other than running a
+ * script again from the top when one of its CAS steps lost a race), they
+ * only see the keys they name and need the access of the connection to
+ * the command of every step. Each run has a budget of steps and of time,
+ * and fails once it has spent it (the steps already done stay done, a
+ * script isn't a transaction).
+ *
+ * The file is an object of the scripts by name:
+ *
+ *   { "scripts": { "visit": { "max_steps": 16, "max_usec": 500,
+ *                             "steps": [ { "op": "incr", "key": "$0" },
+ *                                        { "op": "touch", "key": "$1",
+ *                                          "exptime": 600 } ] } } }
+ *
+ * A key or value of "$<n>" is the argument n of the request (see
+ * protocol_binary_script_arg), "$$..." the literal "$...", anything else
+ * the literal.
+ */
+
+#ifndef SCRIPTS_H
+#define SCRIPTS_H
+
+#include "config.h"
+
+#include <memcached/protocol_binary.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The most steps of a script, and the most a run may take */
+#define SCRIPT_MAX_STEPS 64
+#define SCRIPT_MAX_BUDGET 1024
+
+/* The budgets of the scripts which don't have their own */
+#define SCRIPT_DEFAULT_BUDGET 64
+#define SCRIPT_DEFAULT_USEC 1000
+
+typedef enum {
+    /* Fetch the key: it becomes the item the other steps look at */
+    SCRIPT_OP_GET,
+    /* End the run with status unless the item looks as expected */
+    SCRIPT_OP_CHECK,
+    SCRIPT_OP_SET,
+    SCRIPT_OP_ADD,
+    SCRIPT_OP_REPLACE,
+    SCRIPT_OP_APPEND,
+    SCRIPT_OP_PREPEND,
+    /* The counter becomes the item, like a get of it would */
+    SCRIPT_OP_INCR,
+    SCRIPT_OP_DECR,
+    SCRIPT_OP_TOUCH,
+    SCRIPT_OP_DELETE
+} script_op_t;
+
+/* A key or value of a step: an argument of the request, or a literal */
+typedef struct {
+    int arg;                 /* -1 for the literal */
+    const char *data;
+    uint16_t length;
+} script_operand_t;
+
+typedef struct {
+    script_op_t op;
+    uint8_t opcode;          /* the command of the access it needs */
+    script_operand_t key;
+    script_operand_t value;
+    uint32_t flags;
+    uint32_t exptime;
+    uint64_t delta;
+    uint64_t initial;
+    bool create;             /* incr and decr of a missing counter */
+    bool optional;           /* a get of a missing key isn't a failure */
+    /*
+     * The change must match the cas of the item: if it doesn't, the run
+     * starts again from the first step.
+     */
+    bool cas;
+    /* check: the item must (or must not) exist, and have these */
+    int exists;              /* -1 if either will do */
+    bool check_flags;
+    bool check_value;
+    uint16_t status;         /* what a failed check ends the run with */
+} script_step_t;
+
+typedef struct {
+    const char *name;
+    uint16_t nname;
+    uint32_t max_steps;      /* the steps a run may take, restarts included */
+    uint32_t max_usec;       /* and how long, waits for the engine included */
+    uint32_t nsteps;
+    script_step_t *steps;
+} script_t;
+
+/*
+ * Compile the scripts of settings.scripts_file (if there is one). Returns
+ * false (with the reason logged) if any of them is invalid.
+ */
+bool scripts_init(void);
+void scripts_shutdown(void);
+
+/* The script of that name, NULL if there isn't one */
+const script_t *script_find(const char *name, uint16_t nname);
+
+/* The number of scripts loaded */
+uint32_t scripts_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
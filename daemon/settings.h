@@ -19,6 +19,8 @@
 
 #include <memcached/engine.h>
 
+#include "hash.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -39,6 +41,7 @@ struct interface {
     struct {
         const char *key;
         const char *cert;
+        bool ktls;
     } ssl;
     int maxconn;
     int backlog;
@@ -47,6 +50,13 @@ struct interface {
     bool ipv4;
     bool tcp_nodelay;
     protocol_t protocol;
+    /*
+     * Listen on this AF_UNIX socket instead of TCP ("@name" for the
+     * abstract namespace). The port just names the interface.
+     */
+    const char *path;
+    /* Authenticate the clients of path as their local user */
+    bool peercred;
 };
 
 /* pair of shared object name and config for an extension to be loaded. */
@@ -57,14 +67,24 @@ struct extension_settings {
 
 /* What information should breakpad minidumps contain? */
 typedef enum {
-    CONTENT_DEFAULT // Default content (threads+stack+env+arguments) */
+    CONTENT_DEFAULT, // Default content (threads+stack+env+arguments) */
+    CONTENT_MINIMAL  // Stacks (truncated past a size limit)+settings+stats */
 } breakpad_content_t;
 
+/* How new connections are spread over the worker threads */
+typedef enum {
+    DISPATCH_ROUND_ROBIN,      /* Each thread in turn */
+    DISPATCH_LEAST_CONNECTIONS,/* The thread serving the fewest connections */
+    DISPATCH_LEAST_LOAD,       /* The thread executing the fewest commands */
+    DISPATCH_INCOMING_CPU      /* The thread matching SO_INCOMING_CPU */
+} conn_dispatch_t;
+
 /* Settings for Breakpad crach catcher. */
 typedef struct {
     bool enabled;
     const char* minidump_dir;
     breakpad_content_t content;
+    bool helper;    /* write the minidumps from a helper process */
 } breakpad_settings_t;
 
 /* When adding a setting, be sure to update process_stat_settings */
@@ -82,6 +102,8 @@ struct settings {
     bool disable_admin;     /* true if admin disabled. */
     int num_threads;        /* number of worker (without dispatcher) libevent
                                threads to run */
+    int max_threads;        /* the most num_threads may be raised to by a
+                               config reload (at least num_threads) */
     struct interface *interfaces; /* array of interface settings we are
                                      listening on */
     int num_interfaces;     /* size of {interfaces} */
@@ -95,7 +117,7 @@ struct settings {
     bool rbac_privilege_debug; /* see manpage */
     bool require_sasl;      /* require SASL auth */
     int verbose;            /* level of versosity to log at. */
-    int bio_drain_buffer_sz; /* size of the SSL bio buffers */
+    int bio_drain_buffer_sz; /* max bytes encrypted by one SSL_write */
     bool datatype;          /* is datatype support enabled? */
     const char *root; /* The root directory of the installation */
 
@@ -114,6 +136,228 @@ struct settings {
      * the man page for more information.
      */
     uint32_t max_packet_size;
+    /**
+     * Responses of at least this many bytes are sent with MSG_ZEROCOPY
+     * straight from the item memory (0 disables zero copy sends).
+     */
+    uint32_t zerocopy_threshold;
+    conn_dispatch_t connection_dispatch; /* see conn_dispatch_t */
+    hash_algorithm_t hash_algorithm; /* the key hash (see hash_init()) */
+    /*
+     * Move idle connections away from a worker thread which is busy for
+     * this many percent of the time more than the least busy one (0
+     * disables connection migration).
+     */
+    uint32_t connection_migration_threshold;
+    /*
+     * Give every worker thread its own SO_REUSEPORT listening socket for
+     * each interface, and let it accept its connections itself.
+     */
+    bool reuseport;
+    /*
+     * Hold back the responses to pipelined commands for up to this many
+     * microseconds to send them with fewer sendmsg() calls (0 disables).
+     */
+    uint32_t response_coalescing_usec;
+    /*
+     * The SET (ADD, REPLACE) values of at least this size are received
+     * straight into the item rather than the read buffer. 0 disables it.
+     */
+    uint32_t direct_receive_size;
+    /*
+     * The number of commands a connection with unordered execution may
+     * have running behind a blocked command (0 disables the feature).
+     */
+    uint32_t max_outstanding_commands;
+    /*
+     * Store the values of at least this many bytes compressed with snappy
+     * (0 disables). Requires datatype support.
+     */
+    uint32_t compression_threshold;
+    /*
+     * The memory (in bytes) each worker thread may use to keep inflated
+     * copies of compressed values for the clients without datatype
+     * support (0 disables).
+     */
+    uint32_t inflate_cache_size;
+    /*
+     * Store the values of up to this many bytes compressed with zstd and
+     * a dictionary trained from the values stored (0 disables). Requires
+     * datatype support and a build with zstd.
+     */
+    uint32_t dictionary_compression_max;
+    /*
+     * The zstd level of the streams the clients ask for with the HELLO
+     * feature STREAM_COMPRESSION (see stream_compression.h), up to
+     * STREAM_COMPRESSION_MAX_LEVEL. 0 refuses the feature.
+     */
+    uint32_t stream_compression_level;
+    /*
+     * The file the trained dictionaries are kept in, so the values
+     * compressed with them can still be inflated after a restart.
+     */
+    const char *dictionary_file;
+    /*
+     * The memory (in bytes) each worker thread may use to remember the
+     * results of recent subdoc lookups (0 disables).
+     */
+    uint32_t subdoc_index_cache_size;
+    /*
+     * How many of the packets already received behind the one being
+     * executed get their keys prefetched by the engine (0 disables).
+     */
+    uint32_t prefetch_depth;
+    /*
+     * Read from the worker threads' sockets with io_uring multishot
+     * receives instead of polling them through libevent.
+     */
+    bool io_uring;
+    /*
+     * Give every worker thread, and every long lived background thread of
+     * the engine, a jemalloc arena of its own. Ignored with any other allocator.
+     */
+    bool arena_per_thread;
+    /*
+     * Bind the worker threads to CPUs: "auto" for one per physical core,
+     * a list of CPUs ("0-3,8") or NULL to leave them to the scheduler.
+     */
+    const char *thread_affinity;
+    /*
+     * Let the worker threads spin for new events this many microseconds
+     * before they block in the kernel, and ask the kernel to busy poll the
+     * device queue of the sockets for as long. 0 disables it.
+     */
+    uint32_t busy_poll_usec;
+    /*
+     * Forward the requests for vbuckets this node doesn't own to the node
+     * which does (see proxy.h), over connections authenticated as username
+     * (empty strings if not set). A get still not answered after
+     * hedge_usec is sent to a replica as well (0 disables it).
+     */
+    struct {
+        bool enabled;
+        const char *username;
+        const char *password;
+        uint32_t hedge_usec;
+    } proxy;
+    /*
+     * The number of hot items every worker thread keeps copies of (see
+     * near_cache.h). 0 disables it.
+     */
+    uint32_t near_cache_items;
+    /*
+     * Reuse the "stats aggregate" thread stats of all buckets for this
+     * many milliseconds (0 sums them up for every request).
+     */
+    uint32_t stats_snapshot_msec;
+    /*
+     * Number of threads serving DCP connections, which are moved over
+     * after DCP_OPEN (0 leaves them on the worker threads).
+     */
+    int num_dcp_threads;
+    /*
+     * Number of threads running the SASL mechanisms for the worker
+     * threads (0 runs them on the worker threads).
+     */
+    int num_sasl_threads;
+    /*
+     * How far (in weighted busy time) the client, DCP and TAP connections
+     * of a worker thread may get ahead of each other before the ones in
+     * front only get to run one command (or DCP/TAP step) per event. 0
+     * leaves only reqs_per_event.
+     */
+    uint32_t scheduler_slice_usec;
+    /*
+     * The time a connection should keep its worker thread busy per event
+     * while other connections are waiting: its reqs_per_event is cut down
+     * to the commands the thread gets through in this time. 0 leaves only
+     * reqs_per_event.
+     */
+    uint32_t max_slice_usec;
+    /*
+     * Admission control (see conn_admit()): the number of connections of
+     * a worker thread waiting for the engine, and the time an event may
+     * wait behind the others in the event loop, from which the data
+     * commands of the low priority connections fail with ETMPFAIL. 0
+     * disables each of them.
+     */
+    uint32_t shed_inflight;
+    uint32_t shed_delay_usec;
+    /*
+     * Output backpressure: the bytes of the responses a connection may
+     * have waiting to be sent (held back, or not sent by the kernel yet)
+     * before it stops reading commands (see conn_output_throttled()), and
+     * the items it may keep referenced past their response (MSG_ZEROCOPY
+     * sends and get batches). 0 disables each of them.
+     */
+    uint32_t max_unsent_bytes;
+    uint32_t max_pinned_items;
+    /*
+     * The commands and bytes per second of the data commands of a user
+     * without "limits" in the RBAC configuration, and of all of the users
+     * of the bucket (see rate_limit.h). 0 for no limit.
+     */
+    uint32_t rate_limit_user_ops;
+    uint32_t rate_limit_user_bytes;
+    uint32_t rate_limit_bucket_ops;
+    uint32_t rate_limit_bucket_bytes;
+    /*
+     * With verbosity above 1, only log the requests of 1 in this many
+     * (per worker thread), and those of the connections traced through
+     * the "trace.connection" ioctl. 0 logs only the traced connections.
+     */
+    uint32_t trace_sample_rate;
+    /*
+     * Time the phases of the commands (read, parse, engine, EWOULDBLOCK
+     * wait, wakeup, send) into per opcode histograms (see timings.h)
+     */
+    bool phase_timings;
+    /*
+     * Log the commands taking at least this many milliseconds, with the
+     * time of each phase. 0 disables the log.
+     */
+    uint32_t slow_command_threshold;
+    /*
+     * Release the buffers and lists kept by the connections which haven't
+     * run for this many seconds. 0 disables it.
+     */
+    uint32_t idle_trim_sec;
+    /*
+     * Close the client connections which haven't run for this many
+     * seconds (DCP and TAP connections, and the ones with a command in
+     * progress, are left alone). 0 disables it.
+     */
+    uint32_t idle_timeout;
+    /*
+     * Release the free memory of the allocator once it is over this
+     * percentage of its heap (see memory_manager.h), at most
+     * free_memory_release_rate MB a second. 0 disables it.
+     */
+    uint32_t free_memory_release_pct;
+    uint32_t free_memory_release_rate;
+    /*
+     * Send as many of the msghdrs of a response as fit in IOV_MAX iovecs
+     * with a single sendmsg (plain TCP only).
+     */
+    bool gather_writes;
+    /*
+     * The file of the scripts SCRIPT_EXEC runs (see scripts.h), loaded
+     * at startup.
+     */
+    const char *scripts_file;
+    /*
+     * The directory of the request trace files of the threads (see
+     * workload_trace.h), the size of each, and 1 in how many keys get
+     * their requests traced (0 stops the capture).
+     */
+    const char *workload_trace_dir;
+    uint32_t workload_trace_file_size;
+    uint32_t workload_trace_sample;
+    /*
+     * The number of vbuckets the worker threads count the traffic of one
+     * by one (see vbucket_stats.h), 0 disables the counters.
+     */
+    uint32_t vbucket_stats;
     bool require_init; /* Require init message from ns_server */
 
     const char *ssl_cipher_list; /* The SSL cipher list to use */
@@ -124,6 +368,7 @@ struct settings {
     struct {
         bool admin;
         bool threads;
+        bool max_threads;
         bool interfaces;
         bool extensions;
         bool engine;
@@ -141,6 +386,53 @@ struct settings {
         bool root;
         bool breakpad;
         bool max_packet_size;
+        bool zerocopy_threshold;
+        bool connection_dispatch;
+        bool hash_algorithm;
+        bool connection_migration_threshold;
+        bool reuseport;
+        bool response_coalescing_usec;
+        bool direct_receive_size;
+        bool max_outstanding_commands;
+        bool compression_threshold;
+        bool inflate_cache_size;
+        bool dictionary_compression_max;
+        bool stream_compression_level;
+        bool dictionary_file;
+        bool subdoc_index_cache_size;
+        bool prefetch_depth;
+        bool io_uring;
+        bool arena_per_thread;
+        bool thread_affinity;
+        bool busy_poll_usec;
+        bool proxy;
+        bool near_cache_items;
+        bool stats_snapshot_msec;
+        bool dcp_threads;
+        bool scheduler_slice_usec;
+        bool max_slice_usec;
+        bool shed_inflight;
+        bool shed_delay_usec;
+        bool max_unsent_bytes;
+        bool max_pinned_items;
+        bool rate_limit_user_ops;
+        bool rate_limit_user_bytes;
+        bool rate_limit_bucket_ops;
+        bool rate_limit_bucket_bytes;
+        bool sasl_threads;
+        bool trace_sample_rate;
+        bool phase_timings;
+        bool slow_command_threshold;
+        bool idle_trim_sec;
+        bool idle_timeout;
+        bool free_memory_release_pct;
+        bool free_memory_release_rate;
+        bool gather_writes;
+        bool scripts_file;
+        bool workload_trace_dir;
+        bool workload_trace_file_size;
+        bool workload_trace_sample;
+        bool vbucket_stats;
         bool require_init;
         bool ssl_cipher_list;
     } has;
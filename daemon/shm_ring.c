@@ -0,0 +1,319 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef _GNU_SOURCE
+/* For struct ucred and F_GET_SEALS */
+#define _GNU_SOURCE
+#endif
+#include "config.h"
+#include "shm_ring.h"
+
+#include <memcached/shm_ring.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(SO_PEERCRED) && defined(F_SEAL_SHRINK)
+#define HAVE_SHM_RING 1
+#endif
+
+struct shm_ring {
+    char *base;
+    size_t maplen;
+    uint64_t mask;          /* the size of each ring - 1 */
+    shm_ring_ctl_t *req;
+    shm_ring_ctl_t *rsp;
+    char *req_data;
+    char *rsp_data;
+    bool active;            /* the connection reads and writes the rings */
+};
+
+#ifdef HAVE_SHM_RING
+static uint64_t ring_used(const shm_ring_ctl_t *ctl) {
+    return ctl->produced - ctl->consumed;
+}
+
+static void ring_copy_out(const char *data, uint64_t mask, uint64_t pos,
+                          char *dest, size_t n) {
+    size_t off = (size_t)(pos & mask);
+    size_t first = (size_t)(mask + 1 - off);
+    if (first > n) {
+        first = n;
+    }
+    memcpy(dest, data + off, first);
+    memcpy(dest + first, data, n - first);
+}
+
+static void ring_copy_in(char *data, uint64_t mask, uint64_t pos,
+                         const char *src, size_t n) {
+    size_t off = (size_t)(pos & mask);
+    size_t first = (size_t)(mask + 1 - off);
+    if (first > n) {
+        first = n;
+    }
+    memcpy(data + off, src, first);
+    memcpy(data, src + first, n - first);
+}
+
+/* Wake the client up (a full socket buffer is all doorbells already) */
+static void ring_doorbell(conn *c) {
+    char bell = 0;
+    (void)send(c->sfd, &bell, 1, 0);
+}
+
+/* Wake the client up if it waits for the flag */
+static void ring_wake(conn *c, volatile uint32_t *waiting) {
+    if (*waiting && __sync_bool_compare_and_swap(waiting, 1, 0)) {
+        ring_doorbell(c);
+    }
+}
+
+/*
+ * Read the doorbells off the socket before waiting for the next one.
+ * Returns 1 if it's empty, 0 if the client closed it and -1 on errors.
+ */
+static int ring_drain(conn *c) {
+    char buf[64];
+    ssize_t n;
+
+    while ((n = recv(c->sfd, buf, sizeof(buf), 0)) == (ssize_t)sizeof(buf)) {
+        /* more of them */
+    }
+    if (n > 0) {
+        return 1;
+    } else if (n == 0) {
+        return 0;
+    }
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+}
+
+static bool ring_corrupt(conn *c, const shm_ring_ctl_t *ctl) {
+    if (ring_used(ctl) > c->shm->mask + 1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "%d: corrupt shared memory ring, "
+                                        "closing connection\n", c->sfd);
+        errno = EINVAL;
+        return true;
+    }
+    return false;
+}
+#endif
+
+ENGINE_ERROR_CODE conn_shm_attach(conn *c, const char *path) {
+#ifdef HAVE_SHM_RING
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+    shm_ring_header_t hdr;
+    struct stat st;
+    struct shm_ring *ring;
+    uint64_t filesize;
+    void *base;
+    int fd, seals;
+
+    if (c->shm != NULL || c->ssl != NULL || c->uring.enabled) {
+        return ENGINE_EINVAL;
+    }
+    if (getsockname(c->sfd, (struct sockaddr *)&addr, &addrlen) != 0 ||
+        addr.ss_family != AF_UNIX ||
+        getsockopt(c->sfd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0) {
+        return ENGINE_ENOTSUP;
+    }
+
+    if ((fd = open(path, O_RDWR | O_CLOEXEC)) == -1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "%d: Failed to open shared memory "
+                                        "ring %s: %s\n", c->sfd, path,
+                                        strerror(errno));
+        return ENGINE_EINVAL;
+    }
+    seals = fcntl(fd, F_GET_SEALS);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_uid != cred.uid || seals == -1 ||
+        (seals & F_SEAL_SHRINK) == 0) {
+        /* Only the peer's own memory, which can't be truncated under us */
+        close(fd);
+        return ENGINE_EACCESS;
+    }
+    if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        hdr.magic != SHM_RING_MAGIC || hdr.version != SHM_RING_VERSION ||
+        hdr.size < SHM_RING_MIN_SIZE || hdr.size > SHM_RING_MAX_SIZE ||
+        (hdr.size & (hdr.size - 1)) != 0 ||
+        (uint64_t)st.st_size < SHM_RING_FILE_SIZE(hdr.size)) {
+        close(fd);
+        return ENGINE_EINVAL;
+    }
+
+    filesize = SHM_RING_FILE_SIZE(hdr.size);
+    base = mmap(NULL, (size_t)filesize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return ENGINE_ENOMEM;
+    }
+    if ((ring = calloc(1, sizeof(*ring))) == NULL) {
+        munmap(base, (size_t)filesize);
+        return ENGINE_ENOMEM;
+    }
+
+    ring->base = base;
+    ring->maplen = (size_t)filesize;
+    ring->mask = hdr.size - 1;
+    ring->req = (shm_ring_ctl_t *)(ring->base + SHM_RING_CTL_OFFSET);
+    ring->rsp = ring->req + 1;
+    ring->req_data = ring->base + SHM_RING_DATA_OFFSET;
+    ring->rsp_data = ring->req_data + hdr.size;
+    /* Until it gets to conn_shm_poll() */
+    ring->req->consumer_waiting = 1;
+    c->shm = ring;
+
+    if (settings.verbose) {
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                                        "%d: attached shared memory rings "
+                                        "of %u bytes\n", c->sfd, hdr.size);
+    }
+    return ENGINE_SUCCESS;
+#else
+    (void)c;
+    (void)path;
+    return ENGINE_ENOTSUP;
+#endif
+}
+
+void conn_shm_release(conn *c) {
+    if (c->shm != NULL) {
+#ifdef HAVE_SHM_RING
+        munmap(c->shm->base, c->shm->maplen);
+#endif
+        free(c->shm);
+        c->shm = NULL;
+    }
+}
+
+bool conn_shm_active(const conn *c) {
+    return c->shm != NULL && c->shm->active;
+}
+
+bool conn_shm_poll(conn *c) {
+#ifdef HAVE_SHM_RING
+    struct shm_ring *ring = c->shm;
+
+    if (ring == NULL) {
+        return false;
+    }
+    /* The response to the ioctl is out, so from here on it's the rings */
+    ring->active = true;
+    if (ring_used(ring->req) != 0) {
+        return true;
+    }
+    ring->req->consumer_waiting = 1;
+    __sync_synchronize();
+    if (ring_used(ring->req) != 0) {
+        ring->req->consumer_waiting = 0;
+        return true;
+    }
+#else
+    (void)c;
+#endif
+    return false;
+}
+
+int conn_shm_recv(conn *c, void *dest, size_t nbytes) {
+#ifdef HAVE_SHM_RING
+    struct shm_ring *ring = c->shm;
+    shm_ring_ctl_t *ctl = ring->req;
+    uint64_t used = ring_used(ctl);
+    size_t n;
+
+    if (used == 0) {
+        int ret = ring_drain(c);
+        if (ret <= 0) {
+            return ret;
+        }
+        if (!conn_shm_poll(c)) {
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+        used = ring_used(ctl);
+    }
+    if (ring_corrupt(c, ctl)) {
+        return -1;
+    }
+
+    n = used < nbytes ? (size_t)used : nbytes;
+    __sync_synchronize();
+    ring_copy_out(ring->req_data, ring->mask, ctl->consumed, dest, n);
+    __sync_synchronize();
+    ctl->consumed += n;
+    __sync_synchronize();
+    ring_wake(c, &ctl->producer_waiting);
+    return (int)n;
+#else
+    (void)c;
+    (void)dest;
+    (void)nbytes;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+int conn_shm_sendmsg(conn *c, const struct msghdr *m) {
+#ifdef HAVE_SHM_RING
+    struct shm_ring *ring = c->shm;
+    shm_ring_ctl_t *ctl = ring->rsp;
+    uint64_t space, copied = 0;
+    int ii;
+
+    if (ring_corrupt(c, ctl)) {
+        return -1;
+    }
+    space = ring->mask + 1 - ring_used(ctl);
+    if (space == 0) {
+        /* Wait for the client to make room, it rings the doorbell */
+        int ret = ring_drain(c);
+        if (ret <= 0) {
+            if (ret == 0) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        ctl->producer_waiting = 1;
+        __sync_synchronize();
+        space = ring->mask + 1 - ring_used(ctl);
+        if (space == 0) {
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+        ctl->producer_waiting = 0;
+    }
+
+    __sync_synchronize();
+    for (ii = 0; ii < (int)m->msg_iovlen && copied < space; ++ii) {
+        size_t n = m->msg_iov[ii].iov_len;
+        if (n > space - copied) {
+            n = (size_t)(space - copied);
+        }
+        ring_copy_in(ring->rsp_data, ring->mask, ctl->produced + copied,
+                     m->msg_iov[ii].iov_base, n);
+        copied += n;
+    }
+    __sync_synchronize();
+    ctl->produced += copied;
+    __sync_synchronize();
+    ring_wake(c, &ctl->consumer_waiting);
+    return (int)copied;
+#else
+    (void)c;
+    (void)m;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
@@ -0,0 +1,49 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The server side of the shared memory transport (see
+ * memcached/shm_ring.h). A connection attached by the "shm_ring" ioctl
+ * switches to the rings once the response to the ioctl is out, and from
+ * then on do_data_recv() and do_data_sendmsg() copy from and to the rings
+ * instead of the socket, which is only read for the doorbells (and the
+ * end of the connection).
+ */
+
+#ifndef SHM_RING_DAEMON_H
+#define SHM_RING_DAEMON_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Map the rings in the file for the connection. The connection must be
+ * on a unix domain socket, and the file owned by the user of its peer.
+ */
+ENGINE_ERROR_CODE conn_shm_attach(conn *c, const char *path);
+
+/* Unmap the rings of the connection (if any) */
+void conn_shm_release(conn *c);
+
+/* If the connection has switched to the rings */
+bool conn_shm_active(const conn *c);
+
+/*
+ * Called before the connection waits for a read event: switches to the
+ * rings if they're attached, and returns true if there are requests to
+ * read (if not the client is asked to ring the doorbell).
+ */
+bool conn_shm_poll(conn *c);
+
+/* do_data_recv() and do_data_sendmsg() of an active connection */
+int conn_shm_recv(conn *c, void *dest, size_t nbytes);
+int conn_shm_sendmsg(conn *c, const struct msghdr *m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
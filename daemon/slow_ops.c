@@ -0,0 +1,163 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Every entry of the ring has a sequence number, odd while the owning
+ * thread writes it. A reader copies the entry and only keeps it if the
+ * number was even and didn't change meanwhile, so the writer never waits
+ * for the readers and the readers never see half an entry.
+ */
+#include "config.h"
+#include "slow_ops.h"
+#include "connections.h"
+#include "mc_time.h"
+#include "utilities/protocol2text.h"
+
+#include <cJSON.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOW_OP_KEY_PREFIX 32
+
+struct slow_op {
+    uint32_t seq;
+    uint64_t id;         /* its number in the log */
+    rel_time_t when;
+    uint64_t duration;
+    uint64_t phases[CMD_PHASE_COUNT];
+    uint8_t opcode;
+    uint16_t status;
+    uint16_t vbucket;
+    uint16_t nkey;
+    char key[SLOW_OP_KEY_PREFIX];
+    char peer[64];
+};
+
+struct slow_op_log {
+    /* Number of entries written so far, the next goes to next % size */
+    uint64_t next;
+    struct slow_op ops[SLOW_OPS_SIZE];
+};
+
+struct slow_op_log *slow_op_log_create(void) {
+    return calloc(1, sizeof(struct slow_op_log));
+}
+
+void slow_op_log_destroy(struct slow_op_log *log) {
+    free(log);
+}
+
+void slow_op_record(conn *c, hrtime_t duration,
+                    const hrtime_t phases[CMD_PHASE_COUNT]) {
+    struct slow_op_log *log = c->thread->slow_ops;
+    struct slow_op *op;
+    uint32_t seq;
+    size_t ii;
+
+    if (log == NULL) {
+        return;
+    }
+
+    op = &log->ops[log->next % SLOW_OPS_SIZE];
+    seq = __atomic_load_n(&op->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&op->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    op->id = log->next;
+    op->when = mc_time_get_current_time();
+    op->duration = duration;
+    for (ii = 0; ii < CMD_PHASE_COUNT; ++ii) {
+        op->phases[ii] = phases[ii];
+    }
+    op->opcode = c->cmd;
+    op->status = c->phase.status;
+    op->vbucket = c->phase.vbucket;
+    op->nkey = c->phase.nkey;
+    for (ii = 0; ii < c->phase.nkey && ii < SLOW_OP_KEY_PREFIX; ++ii) {
+        char ch = c->phase.key[ii];
+        op->key[ii] = (ch >= 0x20 && ch < 0x7f) ? ch : '.';
+    }
+    strncpy(op->peer, get_peername(c), sizeof(op->peer) - 1);
+    op->peer[sizeof(op->peer) - 1] = '\0';
+
+    __atomic_store_n(&op->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&log->next, log->next + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy the entry out, returns false if it's being written */
+static bool slow_op_read(struct slow_op *op, struct slow_op *copy) {
+    uint32_t seq = __atomic_load_n(&op->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return false;
+    }
+    memcpy(copy, op, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&op->seq, __ATOMIC_RELAXED) == seq;
+}
+
+static cJSON *slow_op_to_json(const struct slow_op *op) {
+    cJSON *obj = cJSON_CreateObject();
+    cJSON *phases = cJSON_CreateObject();
+    const char *opcode = memcached_opcode_2_text(op->opcode);
+    const char *status = memcached_status_2_text(op->status);
+    char key[SLOW_OP_KEY_PREFIX + 1];
+    size_t nkey = op->nkey < SLOW_OP_KEY_PREFIX ? op->nkey
+                                                : SLOW_OP_KEY_PREFIX;
+    int ii;
+
+    memcpy(key, op->key, nkey);
+    key[nkey] = '\0';
+
+    cJSON_AddNumberToObject(obj, "time",
+                            (double)mc_time_convert_to_abs_time(op->when));
+    if (opcode != NULL) {
+        cJSON_AddStringToObject(obj, "opcode", opcode);
+    } else {
+        cJSON_AddNumberToObject(obj, "opcode", op->opcode);
+    }
+    cJSON_AddStringToObject(obj, "key", key);
+    cJSON_AddNumberToObject(obj, "nkey", op->nkey);
+    cJSON_AddNumberToObject(obj, "vbucket", op->vbucket);
+    cJSON_AddNumberToObject(obj, "status", op->status);
+    if (status != NULL) {
+        cJSON_AddStringToObject(obj, "status_text", status);
+    }
+    cJSON_AddStringToObject(obj, "peer", op->peer);
+    cJSON_AddNumberToObject(obj, "usec", (double)(op->duration / 1000));
+    for (ii = 0; ii < CMD_PHASE_COUNT; ++ii) {
+        cJSON_AddNumberToObject(phases, cmd_phase_name((cmd_phase_t)ii),
+                                (double)(op->phases[ii] / 1000));
+    }
+    cJSON_AddItemToObject(obj, "phases_usec", phases);
+    return obj;
+}
+
+void slow_op_log_stats(struct slow_op_log *log, int thread,
+                       ADD_STAT add_stats, conn *c) {
+    uint64_t next, first, ii;
+
+    if (log == NULL) {
+        return;
+    }
+
+    next = __atomic_load_n(&log->next, __ATOMIC_ACQUIRE);
+    first = next > SLOW_OPS_SIZE ? next - SLOW_OPS_SIZE : 0;
+    for (ii = first; ii < next; ++ii) {
+        struct slow_op op;
+        char key[64];
+        char *value;
+        cJSON *json;
+
+        if (!slow_op_read(&log->ops[ii % SLOW_OPS_SIZE], &op) ||
+            op.id != ii) {
+            /* Written over since we read next */
+            continue;
+        }
+
+        json = slow_op_to_json(&op);
+        value = cJSON_PrintUnformatted(json);
+        snprintf(key, sizeof(key), "slowop:%d:%" PRIu64, thread, ii);
+        add_stats(key, (uint16_t)strlen(key), value, (uint32_t)strlen(value),
+                  c);
+        cJSON_Free(value);
+        cJSON_Delete(json);
+    }
+}
@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The log of the recent slow commands of each worker thread (the ones over
+ * the "slow_command_threshold" setting), returned by "stats slowops". Each
+ * thread writes into its own ring of the last SLOW_OPS_SIZE of them without
+ * taking any lock; the stats call copies the entries out with a sequence
+ * number check, and skips the ones being written over.
+ */
+
+#ifndef SLOW_OPS_H
+#define SLOW_OPS_H
+
+#include "config.h"
+
+#include "memcached.h"
+#include "timings.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SLOW_OPS_SIZE 64
+
+struct slow_op_log *slow_op_log_create(void);
+void slow_op_log_destroy(struct slow_op_log *log);
+
+/*
+ * Add the command of the connection, which took duration ns (spent in the
+ * phases), to the log of the connection's thread. Only called by the thread
+ * owning the log.
+ */
+void slow_op_record(conn *c, hrtime_t duration,
+                    const hrtime_t phases[CMD_PHASE_COUNT]);
+
+/*
+ * Add the entries of the log to the stats, as "slowop:<thread>:<n>" with
+ * the command as a JSON value, the oldest first.
+ */
+void slow_op_log_stats(struct slow_op_log *log, int thread,
+                       ADD_STAT add_stats, conn *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,194 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The contexts are created by the worker threads accepting the first
+ * connection of an interface, so they're guarded by a mutex; a context is
+ * never changed once it's published (the cipher list is set per
+ * connection, see set_ssl_conn_cipher_list()).
+ *
+ * The session tickets are encrypted with a key of our own (RFC 5077
+ * leaves the format to the server), which is replaced every
+ * SSL_SESSION_LIFETIME seconds. The tickets of the previous key are still
+ * accepted (and renewed) so the clients don't all fall back to a full
+ * handshake when the key rotates.
+ */
+#include "config.h"
+#include "ssl_sessions.h"
+#include "memcached.h"
+#include "mc_time.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ticket_key {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    rel_time_t created;
+    bool valid;
+};
+
+static struct {
+    cb_mutex_t mutex;
+    SSL_CTX **contexts;
+    int ncontexts;
+    /* Guarded by the mutex as well */
+    struct ticket_key current;
+    struct ticket_key previous;
+} sessions;
+
+static bool ticket_key_generate(struct ticket_key *key, rel_time_t now) {
+    if (RAND_bytes(key->name, sizeof(key->name)) != 1 ||
+        RAND_bytes(key->aes_key, sizeof(key->aes_key)) != 1 ||
+        RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) != 1) {
+        return false;
+    }
+    key->created = now;
+    key->valid = true;
+    return true;
+}
+
+/*
+ * Copy out the keys in use, replacing the current key if it's too old.
+ * Called with the mutex held.
+ */
+static void ticket_keys_get(struct ticket_key *current,
+                            struct ticket_key *previous) {
+    rel_time_t now = mc_time_get_current_time();
+
+    if (!sessions.current.valid ||
+        now - sessions.current.created >= SSL_SESSION_LIFETIME) {
+        struct ticket_key key;
+        if (ticket_key_generate(&key, now)) {
+            sessions.previous = sessions.current;
+            sessions.current = key;
+        }
+    }
+    *current = sessions.current;
+    *previous = sessions.previous;
+}
+
+static int ticket_key_callback(SSL *ssl, unsigned char *name,
+                               unsigned char *iv, EVP_CIPHER_CTX *ectx,
+                               HMAC_CTX *hctx, int enc) {
+    struct ticket_key current, previous;
+    const struct ticket_key *key;
+    int ret;
+
+    (void)ssl;
+    cb_mutex_enter(&sessions.mutex);
+    ticket_keys_get(&current, &previous);
+    cb_mutex_exit(&sessions.mutex);
+
+    if (enc) {
+        if (!current.valid ||
+            RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+            return -1;
+        }
+        memcpy(name, current.name, sizeof(current.name));
+        EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, current.aes_key, iv);
+        HMAC_Init_ex(hctx, current.hmac_key, sizeof(current.hmac_key),
+                     EVP_sha256(), NULL);
+        return 1;
+    }
+
+    if (current.valid &&
+        memcmp(name, current.name, sizeof(current.name)) == 0) {
+        key = &current;
+        ret = 1;
+    } else if (previous.valid &&
+               memcmp(name, previous.name, sizeof(previous.name)) == 0) {
+        /* Still good, but have the client pick up a ticket of the new key */
+        key = &previous;
+        ret = 2;
+    } else {
+        /* Unknown or expired, do a full handshake */
+        return 0;
+    }
+    HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key),
+                 EVP_sha256(), NULL);
+    EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key->aes_key, iv);
+    return ret;
+}
+
+static SSL_CTX *ssl_ctx_create(int ii) {
+    const char *cert = settings.interfaces[ii].ssl.cert;
+    const char *pkey = settings.interfaces[ii].ssl.key;
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_server_method());
+    char sid_ctx[32];
+
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    /* MB-12359 - Disable SSLv2 & SSLv3 due to POODLE */
+    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+
+    /* @todo don't read files, but use in-memory-copies */
+    if (!SSL_CTX_use_certificate_chain_file(ctx, cert) ||
+        !SSL_CTX_use_PrivateKey_file(ctx, pkey, SSL_FILETYPE_PEM)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to load the certificate "
+                                        "(%s) or key (%s) of port %d",
+                                        cert, pkey,
+                                        settings.interfaces[ii].port);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    /* Sessions are only resumed on the interface they were set up on */
+    snprintf(sid_ctx, sizeof(sid_ctx), "memcached:%d", ii);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)sid_ctx,
+                                   (unsigned int)strlen(sid_ctx));
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_timeout(ctx, SSL_SESSION_LIFETIME);
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_callback);
+
+    return ctx;
+}
+
+void ssl_sessions_init(void) {
+    cb_mutex_initialize(&sessions.mutex);
+}
+
+SSL_CTX *ssl_interface_ctx(int ii) {
+    SSL_CTX *ctx = NULL;
+
+    cb_mutex_enter(&sessions.mutex);
+    if (sessions.contexts == NULL) {
+        sessions.contexts = calloc(settings.num_interfaces,
+                                   sizeof(*sessions.contexts));
+        if (sessions.contexts != NULL) {
+            sessions.ncontexts = settings.num_interfaces;
+        }
+    }
+    if (ii < sessions.ncontexts) {
+        if (sessions.contexts[ii] == NULL) {
+            sessions.contexts[ii] = ssl_ctx_create(ii);
+        }
+        ctx = sessions.contexts[ii];
+    }
+    cb_mutex_exit(&sessions.mutex);
+
+    return ctx;
+}
+
+void ssl_sessions_shutdown(void) {
+    int ii;
+
+    for (ii = 0; ii < sessions.ncontexts; ++ii) {
+        if (sessions.contexts[ii] != NULL) {
+            SSL_CTX_free(sessions.contexts[ii]);
+        }
+    }
+    free(sessions.contexts);
+    sessions.contexts = NULL;
+    sessions.ncontexts = 0;
+    OPENSSL_cleanse(&sessions.current, sizeof(sessions.current));
+    OPENSSL_cleanse(&sessions.previous, sizeof(sessions.previous));
+    cb_mutex_destroy(&sessions.mutex);
+}
@@ -0,0 +1,41 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The SSL contexts of the interfaces. All the connections of an interface
+ * share its context, so a client reconnecting may resume its session
+ * (from the session cache of the context, or from a session ticket)
+ * rather than going through a full handshake again.
+ */
+
+#ifndef SSL_SESSIONS_H
+#define SSL_SESSIONS_H
+
+#include "config.h"
+
+#include <memcached/openssl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Session cache entries and ticket keys are valid for this many seconds */
+#define SSL_SESSION_LIFETIME 3600
+
+/* Called once OpenSSL is initialised */
+void ssl_sessions_init(void);
+
+/*
+ * The context of settings.interfaces[ii], created the first time it's
+ * asked for. Returns NULL if the certificate or key of the interface
+ * can't be loaded. The context is owned by the module: the connections
+ * must not free it.
+ */
+SSL_CTX *ssl_interface_ctx(int ii);
+
+/* Free the contexts once all the connections are gone */
+void ssl_sessions_shutdown(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
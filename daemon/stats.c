@@ -5,31 +5,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef WIN32
+#include <malloc.h>
+#endif
 
 struct thread_stats *default_independent_stats;
 
 static int num_independent_stats(void) {
-    return settings.num_threads + 1;
+    return NUM_WORKER_THREADS();
 }
 
 void *new_independent_stats(void) {
-    int nrecords = num_independent_stats();
-    struct thread_stats *ts = calloc(nrecords, sizeof(struct thread_stats));
-    int ii;
-    for (ii = 0; ii < nrecords; ii++) {
-        cb_mutex_initialize(&ts[ii].mutex);
+    size_t size = num_independent_stats() * sizeof(struct thread_stats);
+    void *ts;
+#ifdef WIN32
+    ts = _aligned_malloc(size, THREAD_STATS_ALIGNMENT);
+#else
+    if (posix_memalign(&ts, THREAD_STATS_ALIGNMENT, size) != 0) {
+        ts = NULL;
+    }
+#endif
+    if (ts != NULL) {
+        memset(ts, 0, size);
     }
     return ts;
 }
 
 void release_independent_stats(void *stats) {
-    int nrecords = num_independent_stats();
-    struct thread_stats *ts = stats;
-    int ii;
-    for (ii = 0; ii < nrecords; ii++) {
-        cb_mutex_destroy(&ts[ii].mutex);
-    }
-    free(ts);
+#ifdef WIN32
+    _aligned_free(stats);
+#else
+    free(stats);
+#endif
 }
 
 struct thread_stats* get_independent_stats(conn *c) {
@@ -48,6 +55,10 @@ struct thread_stats* get_independent_stats(conn *c) {
 struct thread_stats *get_thread_stats(conn *c) {
     struct thread_stats *independent_stats;
     cb_assert(c->thread->index < num_independent_stats());
-    independent_stats = get_independent_stats(c);
-    return &independent_stats[c->thread->index];
+    independent_stats = get_independent_stats(c) + c->thread->index;
+    if (STATS_RESET_PENDING(independent_stats)) {
+        threadlocal_stats_clear(independent_stats);
+        STATS_SET_RESET_PENDING(independent_stats, 0);
+    }
+    return independent_stats;
 }
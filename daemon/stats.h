@@ -12,20 +12,53 @@ void release_independent_stats(void *stats);
 struct thread_stats* get_independent_stats(conn *c);
 struct thread_stats *get_thread_stats(conn *c);
 
+/*
+ * A thread_stats record is only ever updated by the worker thread owning
+ * it (see get_thread_stats()), so the counters don't need a lock or a
+ * locked read-modify-write. The owner does a relaxed load and store, and
+ * threadlocal_stats_aggregate() reads them with relaxed loads (which is
+ * enough to never see a torn value).
+ */
+#ifdef _MSC_VER
+#define STATS_LOAD(var) (*(volatile uint64_t *)&(var))
+#define STATS_STORE(var, val) (*(volatile uint64_t *)&(var) = (val))
+#else
+#define STATS_LOAD(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define STATS_STORE(var, val) __atomic_store_n(&(var), (val), __ATOMIC_RELAXED)
+#endif
+
+#define STATS_BUMP(var, amt) STATS_STORE(var, STATS_LOAD(var) + (amt))
+
+/*
+ * Other threads can't clear a record without racing the owner, so a reset
+ * only flags the record. The owner clears it before its next update, and
+ * the aggregation treats flagged records as empty.
+ */
+#ifdef _MSC_VER
+#define STATS_RESET_PENDING(ts) (*(volatile uint32_t *)&(ts)->reset_pending)
+#define STATS_SET_RESET_PENDING(ts, val) \
+    (*(volatile uint32_t *)&(ts)->reset_pending = (val))
+#else
+#define STATS_RESET_PENDING(ts) \
+    __atomic_load_n(&(ts)->reset_pending, __ATOMIC_ACQUIRE)
+#define STATS_SET_RESET_PENDING(ts, val) \
+    __atomic_store_n(&(ts)->reset_pending, (val), __ATOMIC_RELEASE)
+#endif
+
 /*
  *  Macros for managing statistics inside memcached
  */
 
-/* The item must always be called "it" */
+/* The item_view of the item must always be called "info" */
 #define SLAB_GUTS(conn, thread_stats, slab_op, thread_op) \
-    thread_stats->slab_stats[info.info.clsid].slab_op++;
+    STATS_BUMP(thread_stats->slab_stats[info.clsid].slab_op, 1);
 
 #define THREAD_GUTS(conn, thread_stats, slab_op, thread_op) \
-    thread_stats->thread_op++;
+    STATS_BUMP(thread_stats->thread_op, 1);
 
 #define THREAD_GUTS2(conn, thread_stats, slab_op, thread_op) \
-    thread_stats->slab_op++; \
-    thread_stats->thread_op++;
+    STATS_BUMP(thread_stats->slab_op, 1); \
+    STATS_BUMP(thread_stats->thread_op, 1);
 
 #define SLAB_THREAD_GUTS(conn, thread_stats, slab_op, thread_op) \
     SLAB_GUTS(conn, thread_stats, slab_op, thread_op) \
@@ -33,9 +66,7 @@ struct thread_stats *get_thread_stats(conn *c);
 
 #define STATS_INCR1(GUTS, conn, slab_op, thread_op, key, nkey) { \
     struct thread_stats *thread_stats = get_thread_stats(conn); \
-    cb_mutex_enter(&thread_stats->mutex); \
     GUTS(conn, thread_stats, slab_op, thread_op); \
-    cb_mutex_exit(&thread_stats->mutex); \
 }
 
 #define STATS_INCR(conn, op, key, nkey) \
@@ -59,26 +90,20 @@ struct thread_stats *get_thread_stats(conn *c);
 #define STATS_NOKEY(conn, op) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    cb_mutex_enter(&thread_stats->mutex); \
-    thread_stats->op++; \
-    cb_mutex_exit(&thread_stats->mutex); \
+    STATS_BUMP(thread_stats->op, 1); \
 }
 
 #define STATS_NOKEY2(conn, op1, op2) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    cb_mutex_enter(&thread_stats->mutex); \
-    thread_stats->op1++; \
-    thread_stats->op2++; \
-    cb_mutex_exit(&thread_stats->mutex); \
+    STATS_BUMP(thread_stats->op1, 1); \
+    STATS_BUMP(thread_stats->op2, 1); \
 }
 
 #define STATS_ADD(conn, op, amt) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    cb_mutex_enter(&thread_stats->mutex); \
-    thread_stats->op += amt; \
-    cb_mutex_exit(&thread_stats->mutex); \
+    STATS_BUMP(thread_stats->op, amt); \
 }
 
 /* Set the statistic to the maximum of the current value, and the specified
@@ -86,10 +111,8 @@ struct thread_stats *get_thread_stats(conn *c);
  */
 #define STATS_MAX(conn, op, value) { \
     struct thread_stats *thread_stats = get_thread_stats(conn); \
-    if (value > thread_stats->op) { \
-        cb_mutex_enter(&thread_stats->mutex); \
-        thread_stats->op = value; \
-        cb_mutex_exit(&thread_stats->mutex); \
+    if (value > STATS_LOAD(thread_stats->op)) { \
+        STATS_STORE(thread_stats->op, value); \
     } \
 }
 
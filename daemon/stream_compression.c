@@ -0,0 +1,175 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The output buffer is ZSTD_CStreamOutSize(), enough for a full block,
+ * so every call makes progress. transmit() sends the buffer before it
+ * compresses more, which bounds the work done per call to a buffer of
+ * output.
+ */
+#include "config.h"
+#include "stream_compression.h"
+
+#include <stdlib.h>
+
+#ifdef HAVE_ZSTD
+
+#include <zstd.h>
+
+struct stream_compressor {
+    ZSTD_CCtx *cctx;
+    char *buffer;
+    size_t size;
+    /* The compressed bytes in the buffer, and how many of them were sent */
+    size_t used;
+    size_t sent;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+bool stream_compression_supported(void) {
+    return true;
+}
+
+struct stream_compressor *stream_compressor_create(int level) {
+    struct stream_compressor *stream = calloc(1, sizeof(*stream));
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    stream->size = ZSTD_CStreamOutSize();
+    stream->buffer = malloc(stream->size);
+    stream->cctx = ZSTD_createCCtx();
+    if (stream->buffer == NULL || stream->cctx == NULL ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(stream->cctx,
+                                            ZSTD_c_compressionLevel,
+                                            level)) ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(stream->cctx, ZSTD_c_windowLog,
+                                            STREAM_COMPRESSION_WINDOW_LOG))) {
+        stream_compressor_destroy(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+void stream_compressor_destroy(struct stream_compressor *stream) {
+    if (stream != NULL) {
+        ZSTD_freeCCtx(stream->cctx);
+        free(stream->buffer);
+        free(stream);
+    }
+}
+
+const char *stream_compressor_pending(const struct stream_compressor *stream,
+                                      size_t *nbytes) {
+    *nbytes = stream->used - stream->sent;
+    return *nbytes == 0 ? NULL : stream->buffer + stream->sent;
+}
+
+void stream_compressor_sent(struct stream_compressor *stream, size_t nbytes) {
+    stream->sent += nbytes;
+    if (stream->sent == stream->used) {
+        stream->sent = stream->used = 0;
+    }
+}
+
+static bool stream_compressor_run(struct stream_compressor *stream,
+                                  ZSTD_inBuffer *in, ZSTD_EndDirective mode,
+                                  size_t *left) {
+    ZSTD_outBuffer out;
+    size_t ret;
+
+    out.dst = stream->buffer;
+    out.size = stream->size;
+    out.pos = stream->used;
+    ret = ZSTD_compressStream2(stream->cctx, &out, in, mode);
+    if (ZSTD_isError(ret)) {
+        return false;
+    }
+    stream->bytes_out += out.pos - stream->used;
+    stream->used = out.pos;
+    *left = ret;
+    return true;
+}
+
+bool stream_compressor_compress(struct stream_compressor *stream,
+                                const void *data, size_t *nbytes) {
+    ZSTD_inBuffer in;
+    size_t left;
+
+    in.src = data;
+    in.size = *nbytes;
+    in.pos = 0;
+    if (!stream_compressor_run(stream, &in, ZSTD_e_continue, &left)) {
+        return false;
+    }
+    *nbytes = in.pos;
+    stream->bytes_in += in.pos;
+    return true;
+}
+
+bool stream_compressor_flush(struct stream_compressor *stream, bool *done) {
+    ZSTD_inBuffer in;
+    size_t left;
+
+    in.src = NULL;
+    in.size = in.pos = 0;
+    if (!stream_compressor_run(stream, &in, ZSTD_e_flush, &left)) {
+        return false;
+    }
+    *done = left == 0;
+    return true;
+}
+
+void stream_compressor_totals(const struct stream_compressor *stream,
+                              uint64_t *bytes_in, uint64_t *bytes_out) {
+    *bytes_in = stream->bytes_in;
+    *bytes_out = stream->bytes_out;
+}
+
+#else
+
+bool stream_compression_supported(void) {
+    return false;
+}
+
+struct stream_compressor *stream_compressor_create(int level) {
+    (void)level;
+    return NULL;
+}
+
+void stream_compressor_destroy(struct stream_compressor *stream) {
+    (void)stream;
+}
+
+const char *stream_compressor_pending(const struct stream_compressor *stream,
+                                      size_t *nbytes) {
+    (void)stream;
+    *nbytes = 0;
+    return NULL;
+}
+
+void stream_compressor_sent(struct stream_compressor *stream, size_t nbytes) {
+    (void)stream;
+    (void)nbytes;
+}
+
+bool stream_compressor_compress(struct stream_compressor *stream,
+                                const void *data, size_t *nbytes) {
+    (void)stream;
+    (void)data;
+    *nbytes = 0;
+    return false;
+}
+
+bool stream_compressor_flush(struct stream_compressor *stream, bool *done) {
+    (void)stream;
+    *done = true;
+    return false;
+}
+
+void stream_compressor_totals(const struct stream_compressor *stream,
+                              uint64_t *bytes_in, uint64_t *bytes_out) {
+    (void)stream;
+    *bytes_in = *bytes_out = 0;
+}
+
+#endif
@@ -0,0 +1,78 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Compression of all a connection sends (the HELLO feature
+ * PROTOCOL_BINARY_FEATURE_STREAM_COMPRESSION), for the DCP and TAP
+ * streams crossing the links which are bound by their bandwidth. What
+ * the server sends after the response to the HELLO is a single zstd
+ * stream, flushed at the end of every batch of responses so the client
+ * can inflate each one as soon as it arrives. Unlike the compression of
+ * each value on its own (snappy, or DCP_CONTROL "compression") the
+ * stream finds the redundancy across the values, and the headers and
+ * keys around them. Only what the server sends is compressed, and the
+ * compression can't be turned off again on the connection.
+ *
+ * The CPU it takes is bounded by the level ("stream_compression_level",
+ * 0 to refuse the feature) and by the window the compressor keeps
+ * (STREAM_COMPRESSION_WINDOW_LOG). Without zstd in the build the
+ * feature is never granted.
+ */
+
+#ifndef STREAM_COMPRESSION_H
+#define STREAM_COMPRESSION_H
+
+#include "config.h"
+
+#include <memcached/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The highest stream_compression_level, cheap enough for a send path */
+#define STREAM_COMPRESSION_MAX_LEVEL 9
+
+/* The window of the compressor, in bits (512kB) */
+#define STREAM_COMPRESSION_WINDOW_LOG 19
+
+struct stream_compressor;
+
+/* If the build has zstd, so the feature may be granted */
+bool stream_compression_supported(void);
+
+/* NULL if out of memory (or there is no zstd) */
+struct stream_compressor *stream_compressor_create(int level);
+void stream_compressor_destroy(struct stream_compressor *stream);
+
+/*
+ * The compressed bytes not sent yet (NULL if there are none). Once they
+ * are all sent (see stream_compressor_sent) more of the input may be
+ * compressed.
+ */
+const char *stream_compressor_pending(const struct stream_compressor *stream,
+                                      size_t *nbytes);
+void stream_compressor_sent(struct stream_compressor *stream, size_t nbytes);
+
+/*
+ * Compress as much of data as there is room for in the output buffer:
+ * *nbytes is set to what was consumed (the compressor keeps what it
+ * needs of it). Returns false if zstd failed.
+ */
+bool stream_compressor_compress(struct stream_compressor *stream,
+                                const void *data, size_t *nbytes);
+
+/*
+ * Flush what was compressed so far to the output buffer, so the client
+ * can inflate all of it. Sets *done unless the output buffer has to be
+ * sent first to make room for the rest. Returns false if zstd failed.
+ */
+bool stream_compressor_flush(struct stream_compressor *stream, bool *done);
+
+/* The bytes compressed and what they became */
+void stream_compressor_totals(const struct stream_compressor *stream,
+                              uint64_t *bytes_in, uint64_t *bytes_out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
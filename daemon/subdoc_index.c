@@ -0,0 +1,197 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The subdoc index cache is looked up by the key and cas of the item, the
+ * path and the optype. An entry only matches the item it was created for
+ * (the one with the same value in memory, of the same size), so a changed
+ * document (a new cas) never hits an old entry: the entries for the old
+ * document are dropped when they're found, or pushed out of the LRU. The
+ * cache is only used by the thread owning it, so it needs no locking.
+ */
+#include "config.h"
+#include "subdoc_index.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SUBDOC_INDEX_BUCKETS 4096
+
+struct index_entry {
+    struct index_entry *hnext;   /* next in the hash bucket */
+    struct index_entry *prev;    /* LRU list, most recently used first */
+    struct index_entry *next;
+    uint32_t hash;
+    uint64_t cas;
+    const void *value;           /* the item's value in memory */
+    size_t nbytes;               /* size of the item's value */
+    uint16_t nkey;
+    uint16_t npath;
+    uint8_t optype;
+    subdoc_path_index index;
+    char data[];                 /* the key, then the path */
+};
+
+struct subdoc_index_cache {
+    struct index_entry *buckets[SUBDOC_INDEX_BUCKETS];
+    struct index_entry *head;
+    struct index_entry *tail;
+    size_t size;                 /* memory used by all of the entries */
+};
+
+static struct subdoc_index_cache *get_cache(conn *c) {
+    if (c->thread == NULL || c->thread->subdoc_index == NULL) {
+        return NULL;
+    }
+    return c->thread->subdoc_index;
+}
+
+static size_t entry_size(size_t nkey, size_t npath) {
+    return sizeof(struct index_entry) + nkey + npath;
+}
+
+static uint32_t hash_of(const item_info *info, uint8_t optype,
+                        const char *path, size_t pathlen) {
+    /* Not the cas, so the entries of an older document share the bucket */
+    uint32_t h = hash(info->key, info->nkey, optype);
+    return hash(path, pathlen, h);
+}
+
+static void lru_unlink(struct subdoc_index_cache *cache,
+                       struct index_entry *entry) {
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+}
+
+static void lru_push(struct subdoc_index_cache *cache,
+                     struct index_entry *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL) {
+        cache->head->prev = entry;
+    } else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+static void evict(struct subdoc_index_cache *cache, struct index_entry *entry) {
+    struct index_entry **pp =
+        &cache->buckets[entry->hash % SUBDOC_INDEX_BUCKETS];
+    while (*pp != entry) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = entry->hnext;
+    lru_unlink(cache, entry);
+    cache->size -= entry_size(entry->nkey, entry->npath);
+    free(entry);
+}
+
+/* Make room for size more bytes under the current setting */
+static bool trim(struct subdoc_index_cache *cache, size_t size) {
+    size_t limit = settings.subdoc_index_cache_size;
+
+    while (cache->tail != NULL && cache->size + size > limit) {
+        evict(cache, cache->tail);
+    }
+    return size > 0 && cache->size + size <= limit;
+}
+
+static bool same_path(const struct index_entry *entry, const item_info *info,
+                      uint8_t optype, const char *path, size_t pathlen) {
+    return entry->optype == optype && entry->nkey == info->nkey &&
+        entry->npath == pathlen &&
+        memcmp(entry->data, info->key, info->nkey) == 0 &&
+        memcmp(entry->data + entry->nkey, path, pathlen) == 0;
+}
+
+bool subdoc_index_lookup(conn *c, const item_info *info, uint8_t optype,
+                         const char *path, size_t pathlen,
+                         subdoc_path_index *index) {
+    struct subdoc_index_cache *cache = get_cache(c);
+    struct index_entry *entry;
+    uint32_t h;
+
+    if (cache == NULL || settings.subdoc_index_cache_size == 0) {
+        if (cache != NULL && cache->head != NULL) {
+            /* The cache was turned off */
+            trim(cache, 0);
+        }
+        return false;
+    }
+
+    h = hash_of(info, optype, path, pathlen);
+    for (entry = cache->buckets[h % SUBDOC_INDEX_BUCKETS]; entry != NULL;
+         entry = entry->hnext) {
+        if (entry->hash != h ||
+            !same_path(entry, info, optype, path, pathlen)) {
+            continue;
+        }
+        if (entry->cas != info->cas || entry->value != info->value[0].iov_base ||
+            entry->nbytes != info->value[0].iov_len) {
+            /* The document changed since */
+            evict(cache, entry);
+            break;
+        }
+        lru_unlink(cache, entry);
+        lru_push(cache, entry);
+        *index = entry->index;
+        STATS_NOKEY(c, subdoc_index_hits);
+        return true;
+    }
+
+    STATS_NOKEY(c, subdoc_index_misses);
+    return false;
+}
+
+void subdoc_index_insert(conn *c, const item_info *info, uint8_t optype,
+                         const char *path, size_t pathlen,
+                         const subdoc_path_index *index) {
+    struct subdoc_index_cache *cache = get_cache(c);
+    struct index_entry **bucket;
+    struct index_entry *entry;
+    size_t size = entry_size(info->nkey, pathlen);
+
+    if (cache == NULL || settings.subdoc_index_cache_size == 0 ||
+        pathlen > UINT16_MAX || !trim(cache, size) ||
+        (entry = malloc(size)) == NULL) {
+        return;
+    }
+
+    entry->hash = hash_of(info, optype, path, pathlen);
+    entry->cas = info->cas;
+    entry->value = info->value[0].iov_base;
+    entry->nbytes = info->value[0].iov_len;
+    entry->nkey = info->nkey;
+    entry->npath = (uint16_t)pathlen;
+    entry->optype = optype;
+    entry->index = *index;
+    memcpy(entry->data, info->key, info->nkey);
+    memcpy(entry->data + info->nkey, path, pathlen);
+
+    bucket = &cache->buckets[entry->hash % SUBDOC_INDEX_BUCKETS];
+    entry->hnext = *bucket;
+    *bucket = entry;
+    lru_push(cache, entry);
+    cache->size += size;
+}
+
+struct subdoc_index_cache *subdoc_index_cache_create(void) {
+    return calloc(1, sizeof(struct subdoc_index_cache));
+}
+
+void subdoc_index_cache_destroy(struct subdoc_index_cache *cache) {
+    if (cache != NULL) {
+        while (cache->tail != NULL) {
+            evict(cache, cache->tail);
+        }
+        free(cache);
+    }
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The per-thread cache of the results of sub-document lookups (see the
+ * "subdoc_index_cache_size" setting), so the paths read over and over
+ * from a hot document aren't searched for again every time.
+ */
+
+#ifndef SUBDOC_INDEX_H
+#define SUBDOC_INDEX_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Where a path was found in the (inflated) document, as an offset from
+ * its start, or the status of the lookup if it wasn't.
+ */
+typedef struct {
+    uint16_t status;
+    uint32_t offset;
+    uint32_t length;
+} subdoc_path_index;
+
+/*
+ * Look up the result of an earlier lookup of the same path, with the same
+ * optype, in the document held by the item (which is identified by its key,
+ * cas and value, all from the item info). Returns false if there is none.
+ */
+bool subdoc_index_lookup(conn *c, const item_info *info, uint8_t optype,
+                         const char *path, size_t pathlen,
+                         subdoc_path_index *index);
+
+/*
+ * Remember the result of a lookup of path in the document held by the item.
+ */
+void subdoc_index_insert(conn *c, const item_info *info, uint8_t optype,
+                         const char *path, size_t pathlen,
+                         const subdoc_path_index *index);
+
+struct subdoc_index_cache *subdoc_index_cache_create(void);
+void subdoc_index_cache_destroy(struct subdoc_index_cache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
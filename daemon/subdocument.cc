@@ -17,11 +17,15 @@
 
 #include "subdocument.h"
 
-#include <snappy-c.h>
 #include <subdoc/operations.h>
 
+#include <string>
+#include <utility>
+
+#include "compression.h"
 #include "connections.h"
 #include "debug_helpers.h"
+#include "subdoc_index.h"
 #include "timings.h"
 #include "utilities/protocol2text.h"
 
@@ -147,6 +151,126 @@ struct cmd_traits<Cmd2Type<PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_ADD_UNIQUE> > {
           protocol_binary_subdoc_flag(0);
 };
 
+/* The multi-path commands take the traits of each path from the command in
+ * its spec; only is_mutator applies to the command itself.
+ */
+template <>
+struct cmd_traits<Cmd2Type<PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP> > {
+  static const bool is_mutator = false;
+};
+
+template <>
+struct cmd_traits<Cmd2Type<PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION> > {
+  static const bool is_mutator = true;
+};
+
+/* The traits of a command as a value, for the specs of the multi-path
+ * commands (which only know their command at runtime).
+ */
+struct SubdocSpecTraits {
+    subdoc_OPTYPE optype;
+    bool request_has_value;
+    bool allow_empty_path;
+    bool response_has_value;
+    bool is_mutator;
+    protocol_binary_subdoc_flag valid_flags;
+};
+
+template<protocol_binary_command CMD>
+static SubdocSpecTraits spec_traits() {
+    typedef cmd_traits<Cmd2Type<CMD> > traits;
+    return { traits::optype, traits::request_has_value,
+             traits::allow_empty_path, traits::response_has_value,
+             traits::is_mutator, traits::valid_flags };
+}
+
+// Get the traits of the command of a multi-path spec. Returns false if the
+// command can't be used in a spec.
+static bool get_spec_traits(uint8_t opcode, SubdocSpecTraits& traits) {
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_SUBDOC_GET:
+        traits = spec_traits<PROTOCOL_BINARY_CMD_SUBDOC_GET>();
+        return true;
+    case PROTOCOL_BINARY_CMD_SUBDOC_EXISTS:
+        traits = spec_traits<PROTOCOL_BINARY_CMD_SUBDOC_EXISTS>();
+        return true;
+    case PROTOCOL_BINARY_CMD_SUBDOC_DICT_ADD:
+        traits = spec_traits<PROTOCOL_BINARY_CMD_SUBDOC_DICT_ADD>();
+        return true;
+    case PROTOCOL_BINARY_CMD_SUBDOC_DICT_UPSERT:
+        traits = spec_traits<PROTOCOL_BINARY_CMD_SUBDOC_DICT_UPSERT>();
+        return true;
+    case PROTOCOL_BINARY_CMD_SUBDOC_DELETE:
+        traits = spec_traits<PROTOCOL_BINARY_CMD_SUBDOC_DELETE>();
+        return true;
+    case PROTOCOL_BINARY_CMD_SUBDOC_REPLACE:
+        traits = spec_traits<PROTOCOL_BINARY_CMD_SUBDOC_REPLACE>();
+        return true;
+    case PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_PUSH_LAST:
+        traits = spec_traits<PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_PUSH_LAST>();
+        return true;
+    case PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_PUSH_FIRST:
+        traits = spec_traits<PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_PUSH_FIRST>();
+        return true;
+    case PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_ADD_UNIQUE:
+        traits = spec_traits<PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_ADD_UNIQUE>();
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* A single path of a multi-path command. */
+struct SubdocMultiSpec {
+    uint8_t opcode;
+    protocol_binary_subdoc_flag flags;
+    const char* path;
+    uint16_t pathlen;
+    const char* value;
+    uint32_t vallen;
+};
+
+// Decode the spec at ptr (which must end before end), and advance ptr past
+// it. Returns false if the spec doesn't fit.
+static bool parse_multi_spec(bool mutation, const char*& ptr, const char* end,
+                             SubdocMultiSpec& spec) {
+    size_t left = end - ptr;
+
+    if (mutation) {
+        protocol_binary_subdoc_multi_mutation_spec encoded;
+        if (left < sizeof(encoded)) {
+            return false;
+        }
+        std::memcpy(&encoded, ptr, sizeof(encoded));
+        spec.opcode = encoded.opcode;
+        spec.flags = protocol_binary_subdoc_flag(encoded.subdoc_flags);
+        spec.pathlen = ntohs(encoded.pathlen);
+        spec.vallen = ntohl(encoded.valuelen);
+        ptr += sizeof(encoded);
+        left -= sizeof(encoded);
+    } else {
+        protocol_binary_subdoc_multi_lookup_spec encoded;
+        if (left < sizeof(encoded)) {
+            return false;
+        }
+        std::memcpy(&encoded, ptr, sizeof(encoded));
+        spec.opcode = encoded.opcode;
+        spec.flags = protocol_binary_subdoc_flag(encoded.subdoc_flags);
+        spec.pathlen = ntohs(encoded.pathlen);
+        spec.vallen = 0;
+        ptr += sizeof(encoded);
+        left -= sizeof(encoded);
+    }
+
+    if (spec.pathlen > left || spec.vallen > left - spec.pathlen) {
+        return false;
+    }
+    spec.path = ptr;
+    spec.value = ptr + spec.pathlen;
+    ptr += spec.pathlen + spec.vallen;
+    return true;
+}
+
 /*
  * Subdocument command validators
  */
@@ -199,6 +323,48 @@ static int subdoc_validator(void* packet) {
     return 0;
 }
 
+template<protocol_binary_command CMD>
+static int subdoc_multi_validator(void* packet) {
+    const protocol_binary_request_subdocument_multi *req =
+            reinterpret_cast<protocol_binary_request_subdocument_multi*>(packet);
+    const protocol_binary_request_header* header = &req->message.header;
+    const uint16_t keylen = ntohs(header->request.keylen);
+    const uint32_t bodylen = ntohl(header->request.bodylen);
+    const bool mutation = cmd_traits<Cmd2Type<CMD> >::is_mutator;
+
+    if ((header->request.magic != PROTOCOL_BINARY_REQ) ||
+        (keylen == 0) ||
+        (header->request.extlen != 0) ||
+        (bodylen <= keylen) ||
+        (header->request.datatype != PROTOCOL_BINARY_RAW_BYTES)) {
+        return -1;
+    }
+
+    // Every spec has to be valid for the command given in it.
+    const char* ptr = reinterpret_cast<const char*>(packet) +
+                      sizeof(*header) + keylen;
+    const char* end = reinterpret_cast<const char*>(packet) +
+                      sizeof(*header) + bodylen;
+    int nspecs = 0;
+    while (ptr < end) {
+        SubdocMultiSpec spec;
+        SubdocSpecTraits traits;
+
+        if ((++nspecs > PROTOCOL_BINARY_SUBDOC_MULTI_MAX_PATHS) ||
+            !parse_multi_spec(mutation, ptr, end, spec) ||
+            !get_spec_traits(spec.opcode, traits) ||
+            (traits.is_mutator != mutation) ||
+            (spec.pathlen > SUBDOC_PATH_MAX_LENGTH) ||
+            (traits.request_has_value != (spec.vallen != 0)) ||
+            ((spec.flags & ~traits.valid_flags) != 0) ||
+            (!traits.allow_empty_path && (spec.pathlen == 0))) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 int subdoc_get_validator(void* packet) {
     return subdoc_validator<PROTOCOL_BINARY_CMD_SUBDOC_GET>(packet);
 }
@@ -235,6 +401,14 @@ int subdoc_array_add_unique_validator(void* packet) {
     return subdoc_validator<PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_ADD_UNIQUE>(packet);
 }
 
+int subdoc_multi_lookup_validator(void* packet) {
+    return subdoc_multi_validator<PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP>(packet);
+}
+
+int subdoc_multi_mutation_validator(void* packet) {
+    return subdoc_multi_validator<PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION>(packet);
+}
+
 /******************************************************************************
  * Subdocument executors
  *****************************************************************************/
@@ -256,12 +430,54 @@ struct SubdocCmdContext {
         in_doc({NULL, 0}),
         in_cas(0),
         doc_new_len(0),
-        out_doc(NULL) {}
+        match({NULL, 0}),
+        out_doc(NULL),
+        nresults(0),
+        lookup_failed(false),
+        doc_thread(NULL),
+        doc_buffer({NULL, 0, 0}) {}
 
     ~SubdocCmdContext() {
         if (out_doc != NULL) {
             settings.engine.v1->release(settings.engine.v0, cookie, out_doc);
         }
+        release_doc_buffer();
+    }
+
+    // Get doc_buffer of (at least) size bytes, keeping what it holds.
+    // The first call borrows the spare buffer of the thread.
+    char* get_doc_buffer(LIBEVENT_THREAD* thread, size_t size) {
+        if (doc_thread == NULL) {
+            doc_thread = thread;
+            doc_buffer = thread->subdoc_doc;
+            thread->subdoc_doc.buffer = NULL;
+            thread->subdoc_doc.size = 0;
+        }
+        if (doc_buffer.size < size) {
+            char* ptr = static_cast<char*>(realloc(doc_buffer.buffer, size));
+            if (ptr == NULL) {
+                return NULL;
+            }
+            doc_buffer.buffer = ptr;
+            doc_buffer.size = size;
+        }
+        return doc_buffer.buffer;
+    }
+
+    // Give doc_buffer back to the thread, unless another command gave it
+    // a buffer meanwhile (then the smaller one goes).
+    void release_doc_buffer() {
+        if (doc_thread == NULL) {
+            return;
+        }
+        struct dynamic_buffer& spare = doc_thread->subdoc_doc;
+        if (spare.size < doc_buffer.size) {
+            std::swap(spare, doc_buffer);
+        }
+        free(doc_buffer.buffer);
+        doc_buffer.buffer = NULL;
+        doc_buffer.size = 0;
+        doc_thread = NULL;
     }
 
     // Static method passed back to memcached to destroy objects of this class.
@@ -272,8 +488,8 @@ struct SubdocCmdContext {
     void* cookie;
 
     // The expanded input JSON document. This may either refer to the raw engine
-    // item iovec; or to the connections' dynamic_buffer if the JSON document
-    // had to be decompressed. Either way, it should /not/ be free()d.
+    // item iovec; or to doc_buffer if the JSON document had to be flattened
+    // or decompressed. Either way, it should /not/ be free()d.
     sized_buffer in_doc;
 
     // CAS value of the input document. Required to ensure we only store a
@@ -285,9 +501,40 @@ struct SubdocCmdContext {
     // Number of fragments active.
     size_t doc_new_len;
 
+    // [Lookups only] Location of the value found at the path, in in_doc.
+    subdoc_LOC match;
+
     // [Mutations only] New item to store into engine. _Must_ be released
     // back to the engine using ENGINE_HANDLE_V1::release()
     item* out_doc;
+
+    // [Multi-path lookups only] The result of each of the specs. The header
+    // is sent as it is (status and length of the value, in network byte
+    // order), and the value refers to in_doc.
+    struct LookupResult {
+        char header[sizeof(uint16_t) + sizeof(uint32_t)];
+        const char* value;
+        size_t vallen;
+    };
+    LookupResult results[PROTOCOL_BINARY_SUBDOC_MULTI_MAX_PATHS];
+    size_t nresults;
+
+    // [Multi-path lookups only] Did any of the specs fail?
+    bool lookup_failed;
+
+    // [Multi-path mutations only] The document with the mutations of the
+    // specs applied so far.
+    std::string multi_doc;
+
+    // [Multi-path mutations only] Index and status of the spec which failed,
+    // as they are sent.
+    char mutation_failure[sizeof(uint8_t) + sizeof(uint16_t)];
+
+    // The buffer the document is flattened or inflated into, borrowed from
+    // doc_thread. It is kept until the command is done, as the response
+    // (and the new document) refer to it.
+    LIBEVENT_THREAD* doc_thread;
+    struct dynamic_buffer doc_buffer;
 };
 
 /*
@@ -305,6 +552,11 @@ static bool subdoc_update(conn* c, ENGINE_ERROR_CODE ret, const char* key,
                           size_t keylen, uint16_t vbucket);
 template<protocol_binary_command CMD>
 static void subdoc_response(conn* c);
+template<protocol_binary_command CMD>
+static bool subdoc_multi_operate(conn* c, const char* specs, const char* end,
+                                 uint64_t in_cas);
+template<protocol_binary_command CMD>
+static void subdoc_multi_response(conn* c);
 
 /*
  * Definitions
@@ -384,8 +636,113 @@ void subdoc_executor(conn *c, const void *packet) {
     subdoc_response<CMD>(c);
 }
 
+/* Template function which handles execution of the multi-path commands. The
+ * steps are the same as for the single path commands, except that every spec
+ * is run against the one document fetched, and the mutations are applied
+ * one after the other before the result is stored (once).
+ *
+ * @param CMD multi-path command the function is templated on.
+ * @param c connection object.
+ * @param packet request packet.
+ */
+template<protocol_binary_command CMD>
+void subdoc_multi_executor(conn *c, const void *packet) {
+
+    // 0. Parse the request and log it if debug enabled.
+    const protocol_binary_request_subdocument_multi *req =
+            reinterpret_cast<const protocol_binary_request_subdocument_multi*>(packet);
+    const protocol_binary_request_header* header = &req->message.header;
+
+    const uint16_t keylen = ntohs(header->request.keylen);
+    const uint32_t bodylen = ntohl(header->request.bodylen);
+    const uint16_t vbucket = ntohs(header->request.vbucket);
+    const uint64_t cas = ntohll(header->request.cas);
+
+    const char* key = (char*)packet + sizeof(*header);
+    const char* specs = key + keylen;
+    const char* end = key + bodylen;
+
+    if (settings.verbose > 1) {
+        char clean_key[KEY_MAX_LENGTH + 32];
+        if (key_to_printable_buffer(clean_key, sizeof(clean_key), c->sfd, true,
+                                    memcached_opcode_2_text(CMD),
+                                    key, keylen) != -1) {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c, "%s\n",
+                                            clean_key);
+        }
+    }
+
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+
+    // 1. Fetch the document.
+    if (!subdoc_fetch(c, ret, key, keylen, vbucket)) {
+        return;
+    }
+
+    // 2. Run all of the specs against it.
+    if (!subdoc_multi_operate<CMD>(c, specs, end, cas)) {
+        return;
+    }
+
+    // 3. Store the mutated document (mutations only).
+    if (!subdoc_update<CMD>(c, ret, key, keylen, vbucket)) {
+        return;
+    }
+
+    // 4. Send the results.
+    subdoc_multi_response<CMD>(c);
+}
+
+// Log that the value of the item doesn't hold what its datatype says.
+static void log_bad_document(conn* c, const item_info& info, const char* what) {
+    char clean_key[KEY_MAX_LENGTH + 32];
+    if (buf_to_printable_buffer(clean_key, sizeof(clean_key),
+                                static_cast<const char*>(info.key),
+                                info.nkey) != -1) {
+        settings.extensions.logger->log(
+                EXTENSION_LOG_WARNING, c, "<%d ERROR: Failed to %s. Key: '%s' "
+                "may have an incorrect datatype of COMPRESSED_JSON.",
+                c->sfd, what, clean_key);
+    }
+}
+
+// Copy the segments of the value of the item into the document buffer of
+// the command (at offset), and update {document} to refer to the copy.
+static protocol_binary_response_status
+flatten_document(conn* c, const item_info& info, size_t offset,
+                 sized_buffer& document) {
+    SubdocCmdContext* context =
+            reinterpret_cast<SubdocCmdContext*>(c->cmd_context);
+    size_t len = 0;
+    for (uint16_t ii = 0; ii < info.nvalue; ii++) {
+        len += info.value[ii].iov_len;
+    }
+
+    char* buffer = context->get_doc_buffer(c->thread, offset + len);
+    if (buffer == NULL) {
+        if (settings.verbose > 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                    "<%d ERROR: Failed to allocate %" PRIu64 " bytes for "
+                    "the segments of the document.", c->sfd, uint64_t(len));
+        }
+        return PROTOCOL_BINARY_RESPONSE_E2BIG;
+    }
+
+    document.buf = buffer + offset;
+    document.len = len;
+    for (uint16_t ii = 0; ii < info.nvalue; ii++) {
+        std::memcpy(buffer + offset, info.value[ii].iov_base,
+                    info.value[ii].iov_len);
+        offset += info.value[ii].iov_len;
+    }
+    return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+}
+
 /* Gets a flat, uncompressed JSON document ready for performing a subjson
- * operation on it.
+ * operation on it. A value in one segment is used as it is; when it is in
+ * several segments (or compressed) it is copied together (or inflated) into
+ * the document buffer of the command, which is borrowed from the thread.
  * Returns true if a buffer could be prepared, updating {buf} with the address
  * and size of the document and {cas} with the cas. Otherwise returns an
  * error code indicating why the document could not be obtained.
@@ -406,14 +763,6 @@ get_document_for_searching(conn* c, const item* item,
         return PROTOCOL_BINARY_RESPONSE_EINTERNAL;
     }
 
-    // Need to have the complete document in a single iovec.
-    if (info.info.nvalue != 1) {
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                        "%d: More than one iovec in document",
-                                        c->sfd);
-        return PROTOCOL_BINARY_RESPONSE_EINTERNAL;
-    }
-
     // Check CAS matches (if specified by the user)
     if ((in_cas != 0) && in_cas != info.info.cas) {
         return PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
@@ -424,63 +773,67 @@ get_document_for_searching(conn* c, const item* item,
 
     switch (info.info.datatype) {
     case PROTOCOL_BINARY_DATATYPE_JSON:
-        // Good to go using original buffer.
-        document.buf = static_cast<char*>(info.info.value[0].iov_base);
-        document.len = info.info.value[0].iov_len;
-        return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+        if (info.info.nvalue == 1) {
+            // Good to go using original buffer.
+            document.buf = static_cast<char*>(info.info.value[0].iov_base);
+            document.len = info.info.value[0].iov_len;
+            return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+        }
+        return flatten_document(c, info.info, 0, document);
 
     case PROTOCOL_BINARY_DATATYPE_COMPRESSED_JSON:
         {
-            // Need to expand before attempting to extract from it.
-            const char* compressed_buf =
-                    static_cast<char*>(info.info.value[0].iov_base);
-            const size_t compressed_len = info.info.value[0].iov_len;
-            size_t uncompressed_len;
-            if (snappy_uncompressed_length(compressed_buf, compressed_len,
-                                           &uncompressed_len) != SNAPPY_OK) {
-                char clean_key[KEY_MAX_LENGTH + 32];
-                if (buf_to_printable_buffer(clean_key, sizeof(clean_key),
-                                            static_cast<const char*>(info.info.key),
-                                            info.info.nkey) != -1) {
-                    settings.extensions.logger->log(
-                            EXTENSION_LOG_WARNING, c, "<%d ERROR: Failed to "
-                            "determine inflated body size. Key: '%s' may have an "
-                            "incorrect datatype of COMPRESSED_JSON.",
-                            c->sfd, clean_key);
+            // Need to expand before attempting to extract from it. A
+            // segmented value is copied together at the start of the
+            // buffer first, and inflated behind it.
+            sized_buffer compressed;
+            size_t offset = 0;
+            if (info.info.nvalue == 1) {
+                compressed.buf = static_cast<char*>(info.info.value[0].iov_base);
+                compressed.len = info.info.value[0].iov_len;
+            } else {
+                protocol_binary_response_status status =
+                        flatten_document(c, info.info, 0, compressed);
+                if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                    return status;
                 }
+                offset = compressed.len;
+            }
+
+            size_t uncompressed_len;
+            if (!get_inflated_length(c, info.info.cas, compressed.buf,
+                                     compressed.len, &uncompressed_len)) {
+                log_bad_document(c, info.info, "determine inflated body size");
                 return PROTOCOL_BINARY_RESPONSE_EINTERNAL;
             }
 
-            // We use the connections' dynamic buffer to uncompress into; this
-            // will later be used as the the send buffer for the subset of the
-            // document we send.
-            if (!grow_dynamic_buffer(c, uncompressed_len)) {
+            SubdocCmdContext* context =
+                    reinterpret_cast<SubdocCmdContext*>(c->cmd_context);
+            char* buffer = context->get_doc_buffer(c->thread,
+                                                   offset + uncompressed_len);
+            if (buffer == NULL) {
                 if (settings.verbose > 0) {
                     settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                            "<%d ERROR: Failed to grow dynamic buffer to %" PRIu64
-                            "for uncompressing document.",
-                            c->sfd, uncompressed_len);
+                            "<%d ERROR: Failed to grow the document buffer to "
+                            "%" PRIu64 " for uncompressing document.",
+                            c->sfd, uint64_t(offset + uncompressed_len));
                 }
                 return PROTOCOL_BINARY_RESPONSE_E2BIG;
             }
+            if (offset != 0) {
+                // It may have moved as it grew.
+                compressed.buf = buffer;
+            }
 
-            char* buffer = c->dynamic_buffer.buffer + c->dynamic_buffer.offset;
-            if (snappy_uncompress(compressed_buf, compressed_len, buffer,
-                                  &uncompressed_len) != SNAPPY_OK) {
-                char clean_key[KEY_MAX_LENGTH + 32];
-                if (buf_to_printable_buffer(clean_key, sizeof(clean_key),
-                                            static_cast<const char*>(info.info.key),
-                                            info.info.nkey) != -1) {
-                    settings.extensions.logger->log(
-                            EXTENSION_LOG_WARNING, c, "<%d ERROR: Failed to "
-                            "inflate body. Key: '%s' may have an incorrect "
-                            "datatype of COMPRESSED_JSON.", c->sfd, clean_key);
-                }
+            if (!inflate_value(c, info.info.cas, compressed.buf,
+                               compressed.len, buffer + offset,
+                               uncompressed_len)) {
+                log_bad_document(c, info.info, "inflate body");
                 return PROTOCOL_BINARY_RESPONSE_EINTERNAL;
             }
 
             // Update document to point to the uncompressed version in the buffer.
-            document.buf = buffer;
+            document.buf = buffer + offset;
             document.len = uncompressed_len;
             return PROTOCOL_BINARY_RESPONSE_SUCCESS;
         }
@@ -557,6 +910,101 @@ static bool subdoc_fetch(conn* c, ENGINE_ERROR_CODE ret, const char* key,
     return true;
 }
 
+// Map the result of a subjson operation to the status sent to the client.
+static protocol_binary_response_status subdoc_error_2_status(conn* c,
+                                                             Subdoc::Error err) {
+    switch (err) {
+    case Subdoc::Error::SUCCESS:
+        return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+
+    case Subdoc::Error::PATH_ENOENT:
+        return PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_ENOENT;
+
+    case Subdoc::Error::PATH_MISMATCH:
+        return PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_MISMATCH;
+
+    case Subdoc::Error::DOC_ETOODEEP:
+        return PROTOCOL_BINARY_RESPONSE_SUBDOC_DOC_E2DEEP;
+
+    case Subdoc::Error::PATH_EINVAL:
+        return PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_EINVAL;
+
+    case Subdoc::Error::DOC_EEXISTS:
+        return PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_EEXISTS;
+
+    case Subdoc::Error::PATH_E2BIG:
+        return PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_E2BIG;
+
+    case Subdoc::Error::VALUE_CANTINSERT:
+        return PROTOCOL_BINARY_RESPONSE_SUBDOC_VALUE_CANTINSERT;
+
+    case Subdoc::Error::VALUE_ETOODEEP:
+        return PROTOCOL_BINARY_RESPONSE_SUBDOC_VALUE_ETOODEEP;
+
+    default:
+        // TODO: handle remaining errors.
+        settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                        "Unexpected response from subdoc: %d (0x%x)", err, err);
+        return PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+    }
+}
+
+// Get the item info identifying c->item's document in the subdoc index
+// cache, or NULL if the cache isn't used.
+static const item_info* get_index_info(conn* c, item_info_holder& info) {
+    if (settings.subdoc_index_cache_size == 0) {
+        return NULL;
+    }
+    info.info.nvalue = 1;
+    if (!settings.engine.v1->get_item_info(settings.engine.v0, c, c->item,
+                                           &info.info) ||
+        info.info.nvalue != 1) {
+        return NULL;
+    }
+    return &info.info;
+}
+
+// Look up the path in the document (for GET and EXISTS). The result of a
+// lookup is kept in the thread's subdoc index cache, and used instead of
+// searching the document again for the same path of the same document
+// (the item identified by info, if not NULL).
+// On success match is set to the location of the value in the document.
+static protocol_binary_response_status
+subdoc_lookup(conn* c, const item_info* info, const sized_buffer& doc,
+              subdoc_OPTYPE optype, const char* path, size_t pathlen,
+              subdoc_LOC& match) {
+    subdoc_path_index index;
+    if (info != NULL &&
+        subdoc_index_lookup(c, info, uint8_t(optype), path, pathlen, &index) &&
+        size_t(index.offset) + index.length <= doc.len) {
+        match.at = doc.buf + index.offset;
+        match.length = index.length;
+        return protocol_binary_response_status(index.status);
+    }
+
+    Subdoc::Operation* op = c->thread->subdoc_op;
+    op->clear();
+    op->set_code(optype);
+    op->set_doc(doc.buf, doc.len);
+    protocol_binary_response_status status =
+            subdoc_error_2_status(c, op->op_exec(path, pathlen));
+
+    match.at = NULL;
+    match.length = 0;
+    index.status = uint16_t(status);
+    index.offset = 0;
+    index.length = 0;
+    if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        match = op->match.loc_match;
+        index.offset = uint32_t(match.at - doc.buf);
+        index.length = uint32_t(match.length);
+    }
+    if (info != NULL && status != PROTOCOL_BINARY_RESPONSE_EINTERNAL) {
+        subdoc_index_insert(c, info, uint8_t(optype), path, pathlen, &index);
+    }
+    return status;
+}
+
 // Operate on the document as specified by the the sub-document CMD template
 // parameter.
 // Returns true if the command was successful (and execution should continue),
@@ -584,6 +1032,20 @@ static bool subdoc_operate(conn* c, const char* path, size_t pathlen,
             return false;
         }
 
+        if (!cmd_traits<Cmd2Type<CMD>>::is_mutator) {
+            item_info_holder info;
+            status = subdoc_lookup(c, get_index_info(c, info), doc,
+                                   cmd_traits<Cmd2Type<CMD>>::optype,
+                                   path, pathlen, context->match);
+            if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                write_bin_packet(c, status);
+                return false;
+            }
+            context->in_doc = doc;
+            context->in_cas = doc_cas;
+            return true;
+        }
+
         // Prepare the specified sub-document command.
         Subdoc::Operation* op = c->thread->subdoc_op;
         op->clear();
@@ -599,60 +1061,81 @@ static bool subdoc_operate(conn* c, const char* path, size_t pathlen,
 
         // ... and execute it.
         Subdoc::Error subdoc_res = op->op_exec(path, pathlen);
+        status = subdoc_error_2_status(c, subdoc_res);
 
-        switch (subdoc_res) {
-        case Subdoc::Error::SUCCESS:
-            // Save the information necessary to construct the result of the
-            // subdoc.
-            context->in_doc = doc;
-            context->in_cas = doc_cas;
-            context->doc_new_len = op->doc_new_len;
-            for (unsigned int i = 0; i < op->doc_new_len; i++) {
-                context->doc_new[i] = op->doc_new[i];
-            }
-            break;
-
-        case Subdoc::Error::PATH_ENOENT:
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_ENOENT);
-            return false;
-
-        case Subdoc::Error::PATH_MISMATCH:
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_MISMATCH);
-            return false;
-
-        case Subdoc::Error::DOC_ETOODEEP:
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUBDOC_DOC_E2DEEP);
-            return false;
-
-        case Subdoc::Error::PATH_EINVAL:
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_EINVAL);
+        if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            write_bin_packet(c, status);
             return false;
+        }
 
-        case Subdoc::Error::DOC_EEXISTS:
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_EEXISTS);
-            return false;
+        // Save the information necessary to construct the result of the
+        // subdoc.
+        context->in_doc = doc;
+        context->in_cas = doc_cas;
+        context->doc_new_len = op->doc_new_len;
+        for (unsigned int i = 0; i < op->doc_new_len; i++) {
+            context->doc_new[i] = op->doc_new[i];
+        }
+    }
 
-        case Subdoc::Error::PATH_E2BIG:
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_E2BIG);
-            return false;
+    return true;
+}
 
-        case Subdoc::Error::VALUE_CANTINSERT:
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUBDOC_VALUE_CANTINSERT);
-            return false;
+// Try to apply the modifications to the item itself (see engine::splice),
+// which only works when the new document is the start and end of the old
+// one with something new in between, and the old one is the item's own
+// value (not an inflated copy).
+// Returns true if the document was updated, else false (and the new
+// document has to be stored as a new item).
+static bool subdoc_update_in_place(conn* c, SubdocCmdContext* context,
+                                   uint16_t vbucket) {
+    item_info_holder info;
+    info.info.nvalue = 1;
+    if (settings.engine.v1->splice == NULL ||
+        !settings.engine.v1->get_item_info(settings.engine.v0, c, c->item,
+                                           &info.info) ||
+        info.info.nvalue != 1 ||
+        info.info.value[0].iov_base != context->in_doc.buf) {
+        return false;
+    }
 
-        case Subdoc::Error::VALUE_ETOODEEP:
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUBDOC_VALUE_ETOODEEP);
-            return false;
+    // Skip the fragments which are unchanged at the start and the end.
+    const char* doc = context->in_doc.buf;
+    const subdoc_LOC* frags = context->doc_new;
+    size_t first = 0;
+    size_t last = context->doc_new_len;
+    size_t head = 0;
+    while (first < last && frags[first].at == doc + head &&
+           frags[first].length <= context->in_doc.len - head) {
+        head += frags[first].length;
+        ++first;
+    }
+    size_t tail = context->in_doc.len;
+    while (last > first && frags[last - 1].at >= doc + head &&
+           frags[last - 1].at + frags[last - 1].length == doc + tail) {
+        tail -= frags[last - 1].length;
+        --last;
+    }
 
-        default:
-            // TODO: handle remaining errors.
-            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
-                                            "Unexpected response from subdoc: %d (0x%x)", subdoc_res, subdoc_res);
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
-            return false;
-        }
+    // The rest is copied out of the way, as it may refer to the document
+    // being changed. Not worth it if that's most of the new document.
+    std::string data;
+    size_t new_doc_len = head + (context->in_doc.len - tail);
+    for (size_t ii = first; ii < last; ii++) {
+        data.append(frags[ii].at, frags[ii].length);
+    }
+    new_doc_len += data.size();
+    if (data.size() > new_doc_len / 2) {
+        return false;
     }
 
+    uint64_t new_cas;
+    if (settings.engine.v1->splice(settings.engine.v0, c, c->item, &new_cas,
+                                   head, tail - head, data.data(),
+                                   data.size(), vbucket) != ENGINE_SUCCESS) {
+        return false;
+    }
+    c->cas = new_cas;
     return true;
 }
 
@@ -681,6 +1164,12 @@ bool subdoc_update(conn* c, ENGINE_ERROR_CODE ret, const char* key,
         new_doc_len += loc.length;
     }
 
+    // A document no one else is using may be changed in place.
+    if (context->out_doc == NULL && ret == ENGINE_SUCCESS &&
+        subdoc_update_in_place(c, context, vbucket)) {
+        return true;
+    }
+
     // Allocate a new item of this size.
     if (context->out_doc == NULL) {
         item *new_doc;
@@ -772,8 +1261,8 @@ void subdoc_response(conn* c) {
     const char* value = NULL;
     size_t vallen = 0;
     if (cmd_traits<Cmd2Type<CMD>>::response_has_value) {
-        value = c->thread->subdoc_op->match.loc_match.at;
-        vallen = c->thread->subdoc_op->match.loc_match.length;
+        value = context->match.at;
+        vallen = context->match.length;
     }
 
     if (add_bin_header(c, 0, /*extlen*/0, /*keylen*/0, vallen,
@@ -789,6 +1278,165 @@ void subdoc_response(conn* c) {
     conn_set_state(c, conn_mwrite);
 }
 
+// Run every spec of a multi-path command against the document. The result of
+// each lookup is recorded for the response; the mutations are applied to a
+// copy of the document, one after the other, and the first one which fails
+// fails the command (without any change to the document).
+// Returns true if execution should continue, else false.
+template<protocol_binary_command CMD>
+static bool subdoc_multi_operate(conn* c, const char* specs, const char* end,
+                                 uint64_t in_cas) {
+    SubdocCmdContext* context =
+            reinterpret_cast<SubdocCmdContext*>(c->cmd_context);
+    cb_assert(context != NULL);
+    const bool mutation = cmd_traits<Cmd2Type<CMD>>::is_mutator;
+
+    if (context->in_doc.buf != NULL) {
+        // Already done; we're just retrying the store.
+        return true;
+    }
+
+    uint64_t doc_cas;
+    sized_buffer doc;
+    protocol_binary_response_status status =
+        get_document_for_searching(c, c->item, doc, in_cas, doc_cas);
+
+    if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        write_bin_packet(c, status);
+        return false;
+    }
+
+    Subdoc::Operation* op = c->thread->subdoc_op;
+    item_info_holder info;
+    const item_info* index_info = mutation ? NULL : get_index_info(c, info);
+    sized_buffer current = doc;
+    const char* ptr = specs;
+    uint8_t index = 0;
+    while (ptr < end) {
+        SubdocMultiSpec spec;
+        SubdocSpecTraits traits;
+
+        if (!parse_multi_spec(mutation, ptr, end, spec) ||
+            !get_spec_traits(spec.opcode, traits)) {
+            // Can't happen; the validator already checked the specs.
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL);
+            return false;
+        }
+
+        if (!mutation) {
+            subdoc_LOC match;
+            status = subdoc_lookup(c, index_info, doc, traits.optype,
+                                   spec.path, spec.pathlen, match);
+
+            SubdocCmdContext::LookupResult& result =
+                    context->results[context->nresults++];
+            result.value = NULL;
+            result.vallen = 0;
+            if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                if (traits.response_has_value) {
+                    result.value = match.at;
+                    result.vallen = match.length;
+                }
+            } else {
+                context->lookup_failed = true;
+            }
+            uint16_t encoded_status = htons(status);
+            uint32_t encoded_len = htonl(uint32_t(result.vallen));
+            std::memcpy(result.header, &encoded_status, sizeof(encoded_status));
+            std::memcpy(result.header + sizeof(encoded_status), &encoded_len,
+                        sizeof(encoded_len));
+            ++index;
+            continue;
+        }
+
+        op->clear();
+        subdoc_OPTYPE opcode = traits.optype;
+        if ((spec.flags & SUBDOC_FLAG_MKDIR_P) == SUBDOC_FLAG_MKDIR_P) {
+            opcode = subdoc_OPTYPE(opcode | SUBDOC_CMD_FLAG_MKDIR_P);
+        }
+        op->set_code(opcode);
+        op->set_doc(current.buf, current.len);
+        if (traits.request_has_value) {
+            op->set_value(spec.value, spec.vallen);
+        }
+
+        status = subdoc_error_2_status(c, op->op_exec(spec.path, spec.pathlen));
+
+        if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            uint16_t encoded_status = htons(status);
+            context->mutation_failure[0] = char(index);
+            std::memcpy(context->mutation_failure + 1, &encoded_status,
+                        sizeof(encoded_status));
+            if (add_bin_header(c, PROTOCOL_BINARY_RESPONSE_SUBDOC_MULTI_PATH_FAILURE,
+                               0, 0, sizeof(context->mutation_failure),
+                               PROTOCOL_BINARY_RAW_BYTES) == -1) {
+                conn_set_state(c, conn_closing);
+                return false;
+            }
+            add_iov(c, context->mutation_failure,
+                    sizeof(context->mutation_failure));
+            conn_set_state(c, conn_mwrite);
+            return false;
+        } else {
+            // The next spec runs against the result of this one.
+            std::string next;
+            for (size_t ii = 0; ii < op->doc_new_len; ii++) {
+                next.append(op->doc_new[ii].at, op->doc_new[ii].length);
+            }
+            context->multi_doc.swap(next);
+            current.buf = &context->multi_doc[0];
+            current.len = context->multi_doc.size();
+        }
+        ++index;
+    }
+
+    context->in_doc = doc;
+    context->in_cas = doc_cas;
+    if (mutation) {
+        context->doc_new[0].at = context->multi_doc.data();
+        context->doc_new[0].length = context->multi_doc.size();
+        context->doc_new_len = 1;
+    }
+
+    return true;
+}
+
+// Respond with the result of every lookup, or the cas of the new document.
+template<protocol_binary_command CMD>
+void subdoc_multi_response(conn* c) {
+    SubdocCmdContext* context =
+            reinterpret_cast<SubdocCmdContext*>(c->cmd_context);
+    cb_assert(context != NULL);
+
+    protocol_binary_response_subdocument* rsp =
+            reinterpret_cast<protocol_binary_response_subdocument*>(c->write.buf);
+
+    size_t bodylen = 0;
+    for (size_t ii = 0; ii < context->nresults; ii++) {
+        bodylen += sizeof(context->results[ii].header) +
+                   context->results[ii].vallen;
+    }
+
+    protocol_binary_response_status status = context->lookup_failed ?
+            PROTOCOL_BINARY_RESPONSE_SUBDOC_MULTI_PATH_FAILURE :
+            PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    if (add_bin_header(c, status, /*extlen*/0, /*keylen*/0, bodylen,
+                       PROTOCOL_BINARY_RAW_BYTES) == -1) {
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    rsp->message.header.response.cas = htonll(c->cas);
+
+    for (size_t ii = 0; ii < context->nresults; ii++) {
+        const SubdocCmdContext::LookupResult& result = context->results[ii];
+        add_iov(c, result.header, sizeof(result.header));
+        if (result.vallen > 0) {
+            add_iov(c, result.value, result.vallen);
+        }
+    }
+    conn_set_state(c, conn_mwrite);
+}
+
 void subdoc_get_executor(conn *c, void* packet) {
     return subdoc_executor<PROTOCOL_BINARY_CMD_SUBDOC_GET>(c, packet);
 }
@@ -824,3 +1472,11 @@ void subdoc_array_push_first_executor(conn *c, void *packet) {
 void subdoc_array_add_unique_executor(conn *c, void *packet) {
     return subdoc_executor<PROTOCOL_BINARY_CMD_SUBDOC_ARRAY_ADD_UNIQUE>(c, packet);
 }
+
+void subdoc_multi_lookup_executor(conn *c, void *packet) {
+    return subdoc_multi_executor<PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP>(c, packet);
+}
+
+void subdoc_multi_mutation_executor(conn *c, void *packet) {
+    return subdoc_multi_executor<PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION>(c, packet);
+}
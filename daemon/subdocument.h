@@ -42,6 +42,8 @@ int subdoc_replace_validator(void* packet);
 int subdoc_array_push_last_validator(void* packet);
 int subdoc_array_push_first_validator(void* packet);
 int subdoc_array_add_unique_validator(void* packet);
+int subdoc_multi_lookup_validator(void* packet);
+int subdoc_multi_mutation_validator(void* packet);
 
 /* Subdocument executor functions. */
 void subdoc_get_executor(conn *c, void *packet);
@@ -53,6 +55,8 @@ void subdoc_replace_executor(conn *c, void *packet);
 void subdoc_array_push_last_executor(conn *c, void *packet);
 void subdoc_array_push_first_executor(conn *c, void *packet);
 void subdoc_array_add_unique_executor(conn* c, void* packet);
+void subdoc_multi_lookup_executor(conn* c, void* packet);
+void subdoc_multi_mutation_executor(conn* c, void* packet);
 
 #if defined(__cplusplus)
 } // extern "C"
@@ -5,6 +5,18 @@
 #include "config.h"
 #include "memcached.h"
 #include "connections.h"
+#include "mc_time.h"
+#include "compression.h"
+#include "dictionary.h"
+#include "subdoc_index.h"
+#include "slow_ops.h"
+#include "workload_trace.h"
+#include "vbucket_stats.h"
+#include "near_cache.h"
+#include "proxy.h"
+#include "rate_limit.h"
+#include "alloc_hooks.h"
+#include "thread_affinity.h"
 
 #include <stdio.h>
 #include <errno.h>
@@ -15,9 +27,18 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <platform/platform.h>
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#include "uring.h"
 
 #define ITEMS_PER_ALLOC 64
 
+/* io_uring mode: submission queue size, and the provided buffers */
+#define URING_ENTRIES 256
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE 4096
+
 static char devnull[8192];
 extern volatile sig_atomic_t memcached_shutdown;
 
@@ -29,18 +50,53 @@ struct conn_queue_item {
     STATE_FUNC        init_state;
     int               event_flags;
     int               read_buffer_size;
+    conn             *migrate; /* an existing connection handed over */
     CQ_ITEM          *next;
 };
 
-/* A connection queue. */
+/*
+ * A connection queue. Any thread may push items, but only the thread
+ * owning the queue pops them, so it doesn't need a lock: a push is a
+ * compare and swap onto a stack, and the owner takes the whole stack at
+ * once and reverses it to get the items back in order.
+ */
 typedef struct conn_queue CQ;
 struct conn_queue {
-    CQ_ITEM *head;
-    CQ_ITEM *tail;
-    cb_mutex_t lock;
-    cb_cond_t  cond;
+    CQ_ITEM *head;    /* pushed items, newest first */
+    CQ_ITEM *taken;   /* items taken by the owner, oldest first */
 };
 
+#ifdef _MSC_VER
+#define CQ_TAKE(ptr) InterlockedExchangePointer((PVOID volatile *)(ptr), NULL)
+#define NOTIFY_SET_PENDING(t) InterlockedExchange(&(t)->notify_pending, 1)
+#define NOTIFY_CLEAR_PENDING(t) InterlockedExchange(&(t)->notify_pending, 0)
+#else
+#define CQ_TAKE(ptr) __atomic_exchange_n(ptr, NULL, __ATOMIC_ACQUIRE)
+#define NOTIFY_SET_PENDING(t) \
+    __atomic_exchange_n(&(t)->notify_pending, 1, __ATOMIC_SEQ_CST)
+#define NOTIFY_CLEAR_PENDING(t) \
+    __atomic_store_n(&(t)->notify_pending, 0, __ATOMIC_SEQ_CST)
+#endif
+
+/*
+ * Replaces *ptr with desired if it still is *expected. Otherwise *expected
+ * is updated to the current value.
+ */
+static bool cq_cas(CQ_ITEM **ptr, CQ_ITEM **expected, CQ_ITEM *desired) {
+#ifdef _MSC_VER
+    CQ_ITEM *old = InterlockedCompareExchangePointer((PVOID volatile *)ptr,
+                                                     desired, *expected);
+    if (old == *expected) {
+        return true;
+    }
+    *expected = old;
+    return false;
+#else
+    return __atomic_compare_exchange_n(ptr, expected, desired, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+#endif
+}
+
 /* Connection lock around accepting new connections */
 cb_mutex_t conn_lock;
 
@@ -65,34 +121,51 @@ static int init_count = 0;
 static cb_mutex_t init_lock;
 static cb_cond_t init_cond;
 
+/* Serializes threads_resize() */
+static cb_mutex_t resize_lock;
+
 static void thread_libevent_process(evutil_socket_t fd, short which, void *arg);
 
+/*
+ * The worker threads from settings.num_threads up to settings.max_threads
+ * are retired (or were never started): nothing is dispatched to them, and
+ * they hand their connections over to the others as they go idle.
+ */
+static bool thread_retired(const LIBEVENT_THREAD *thr) {
+    return thr->index >= settings.num_threads &&
+        thr->index < settings.max_threads;
+}
+
 /*
  * Initializes a connection queue.
  */
 static void cq_init(CQ *cq) {
-    cb_mutex_initialize(&cq->lock);
-    cb_cond_initialize(&cq->cond);
     cq->head = NULL;
-    cq->tail = NULL;
+    cq->taken = NULL;
 }
 
 /*
  * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
+ * one. Only to be called by the thread owning the queue.
  * Returns the item, or NULL if no item is available
  */
 static CQ_ITEM *cq_pop(CQ *cq) {
     CQ_ITEM *item;
 
-    cb_mutex_enter(&cq->lock);
-    item = cq->head;
+    if (cq->taken == NULL) {
+        CQ_ITEM *next = CQ_TAKE(&cq->head);
+        while (next != NULL) {
+            item = next;
+            next = item->next;
+            item->next = cq->taken;
+            cq->taken = item;
+        }
+    }
+
+    item = cq->taken;
     if (NULL != item) {
-        cq->head = item->next;
-        if (NULL == cq->head)
-            cq->tail = NULL;
+        cq->taken = item->next;
     }
-    cb_mutex_exit(&cq->lock);
 
     return item;
 }
@@ -101,16 +174,11 @@ static CQ_ITEM *cq_pop(CQ *cq) {
  * Adds an item to a connection queue.
  */
 static void cq_push(CQ *cq, CQ_ITEM *item) {
-    item->next = NULL;
+    CQ_ITEM *head = NULL; /* a failed swap fetches the current head */
 
-    cb_mutex_enter(&cq->lock);
-    if (NULL == cq->tail)
-        cq->head = item;
-    else
-        cq->tail->next = item;
-    cq->tail = item;
-    cb_cond_signal(&cq->cond);
-    cb_mutex_exit(&cq->lock);
+    do {
+        item->next = head;
+    } while (!cq_cas(&cq->head, &head, item));
 }
 
 /*
@@ -204,6 +272,26 @@ bool create_notification_pipe(LIBEVENT_THREAD *me)
     return true;
 }
 
+/*
+ * Worker threads are woken up through an eventfd where available, which
+ * takes a single 8 byte write or read however many notifications are
+ * pending.
+ */
+static bool create_notification_channel(LIBEVENT_THREAD *me)
+{
+#ifdef HAVE_EVENTFD
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd != -1) {
+        me->notify[0] = me->notify[1] = fd;
+        me->use_eventfd = true;
+        return true;
+    }
+    log_system_error(EXTENSION_LOG_WARNING, NULL,
+                     "Can't create eventfd, using a notify pipe: %s");
+#endif
+    return create_notification_pipe(me);
+}
+
 static void setup_dispatcher(struct event_base *main_base,
                              void (*dispatcher_callback)(evutil_socket_t, short, void *))
 {
@@ -226,6 +314,282 @@ static void setup_dispatcher(struct event_base *main_base,
     }
 }
 
+#ifdef HAVE_IO_URING
+/*
+ * Sends the requests queued during this pass of the event loop to the
+ * kernel with a single system call.
+ */
+static void thread_uring_submit(evutil_socket_t fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    (void)fd;
+    (void)which;
+
+    me->uring_submit_pending = false;
+    if (uring_submit(me->uring) < 0) {
+        log_system_error(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to submit to io_uring: %s");
+    }
+}
+
+static void schedule_uring_submit(LIBEVENT_THREAD *me) {
+    if (!me->uring_submit_pending) {
+        me->uring_submit_pending = true;
+        event_active(&me->uring_submit_event, EV_TIMEOUT, 0);
+    }
+}
+
+/*
+ * Stops using the multishot receive for c, and polls the socket for
+ * EV_READ through libevent instead. Data already queued is read first.
+ */
+static void conn_uring_fallback(conn *c) {
+    c->uring.fallback = true;
+    if (c->registered_in_libevent) {
+        event_del(&c->event);
+        event_set(&c->event, c->sfd, c->ev_flags, event_handler, (void *)c);
+        event_base_set(c->thread->base, &c->event);
+        if (event_add(&c->event, NULL) == -1) {
+            log_system_error(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to add connection to libevent: %s");
+        }
+    }
+}
+
+static void uring_completion(void *arg, uint64_t user_data, int res,
+                             int bid, bool more) {
+    LIBEVENT_THREAD *me = arg;
+    conn *c = (conn *)(uintptr_t)user_data;
+    cb_assert(c->thread == me);
+    cb_assert(c->uring.armed);
+
+    if (bid != -1) {
+        if (res > 0 && c->sfd != INVALID_SOCKET) {
+            uring_get_buf(me->uring, bid)->next = -1;
+            if (c->uring.tail == -1) {
+                c->uring.head = bid;
+            } else {
+                uring_get_buf(me->uring, c->uring.tail)->next = bid;
+            }
+            c->uring.tail = bid;
+        } else {
+            uring_recycle(me->uring, bid);
+        }
+    } else if (res == 0) {
+        c->uring.eof = true;
+    } else if (res == -ENOBUFS || res == -EINVAL) {
+        /* Out of buffers, or the kernel lacks multishot receives */
+        if (c->sfd != INVALID_SOCKET) {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                            "%u: io_uring receive failed "
+                                            "(%d), polling the socket",
+                                            (unsigned int)c->sfd, -res);
+            conn_uring_fallback(c);
+        }
+    } else if (res < 0 && res != -ECANCELED) {
+        c->uring.error = -res;
+    }
+
+    if (!more) {
+        c->uring.armed = false;
+        --c->refcount;
+        if (c->sfd == INVALID_SOCKET) {
+            /* conn_closing() cancelled it, resume the pending close */
+            if (add_conn_to_pending_io_list(c)) {
+                notify_thread(me);
+            }
+            return;
+        }
+    }
+
+    if (c->uring.want_read && (bid != -1 || !more)) {
+        event_active(&c->event, EV_READ, 0);
+    }
+}
+
+/*
+ * Called when the ring's eventfd becomes readable, to hand the received
+ * data (and terminated receives) to the connections.
+ */
+static void thread_uring_process(evutil_socket_t fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    (void)fd;
+    (void)which;
+
+    thread_loop_event(me);
+    LOCK_THREAD(me);
+    uring_reap(me->uring, uring_completion, me);
+    UNLOCK_THREAD(me);
+}
+
+static void setup_thread_uring(LIBEVENT_THREAD *me) {
+    me->uring = uring_create(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE);
+    if (me->uring == NULL) {
+        log_system_error(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to set up io_uring, using libevent: %s");
+        return;
+    }
+
+    event_set(&me->uring_event, uring_eventfd(me->uring),
+              EV_READ | EV_PERSIST, thread_uring_process, me);
+    event_base_set(me->base, &me->uring_event);
+    if (event_add(&me->uring_event, 0) == -1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Can't monitor the io_uring eventfd\n");
+        exit(1);
+    }
+
+    event_set(&me->uring_submit_event, -1, 0, thread_uring_submit, me);
+    event_base_set(me->base, &me->uring_submit_event);
+}
+
+/*
+ * Moves a connection set up by this thread over to io_uring reads. TLS
+ * connections keep using libevent (OpenSSL reads through its BIO pair),
+ * as do zero copy sends, which need the socket's error queue.
+ */
+static bool conn_uring_enable(conn *c) {
+    if (c->ssl != NULL) {
+        return true;
+    }
+    if (!unregister_event(c)) {
+        return false;
+    }
+
+    c->uring.enabled = true;
+    c->zerocopy.enabled = false;
+    event_set(&c->event, c->sfd, c->ev_flags & ~EV_READ, event_handler,
+              (void *)c);
+    event_base_set(c->thread->base, &c->event);
+    return register_event(c, NULL);
+}
+
+bool conn_uring_want_read(conn *c) {
+    c->uring.want_read = true;
+    if (c->uring.head != -1 || c->uring.eof || c->uring.error != 0) {
+        event_active(&c->event, EV_READ, 0);
+    } else if (!c->uring.armed && !c->uring.fallback) {
+        if (!uring_recv_multishot(c->thread->uring, c->sfd,
+                                  (uintptr_t)c)) {
+            log_system_error(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to queue io_uring receive: %s");
+            return false;
+        }
+        c->uring.armed = true;
+        ++c->refcount;
+        schedule_uring_submit(c->thread);
+    }
+    return true;
+}
+
+void conn_uring_cancel(conn *c) {
+    if (uring_cancel(c->thread->uring, (uintptr_t)c)) {
+        schedule_uring_submit(c->thread);
+    } else {
+        log_system_error(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to cancel io_uring receive: %s");
+    }
+}
+
+/*
+ * do_data_recv() for connections in io_uring mode: copies out what the
+ * multishot receive queued, or reads the socket directly if it isn't armed.
+ */
+int conn_uring_recv(conn *c, void *dest, size_t nbytes) {
+    struct uring *ring = c->thread->uring;
+    size_t copied = 0;
+
+    while (copied < nbytes && c->uring.head != -1) {
+        int bid = c->uring.head;
+        struct uring_buf *buf = uring_get_buf(ring, bid);
+        size_t n = buf->len - buf->offset;
+        if (n > nbytes - copied) {
+            n = nbytes - copied;
+        }
+        memcpy((char *)dest + copied, buf->data + buf->offset, n);
+        buf->offset += (uint32_t)n;
+        copied += n;
+        if (buf->offset == buf->len) {
+            c->uring.head = buf->next;
+            if (c->uring.head == -1) {
+                c->uring.tail = -1;
+            }
+            uring_recycle(ring, bid);
+        }
+    }
+
+    if (copied > 0) {
+        return (int)copied;
+    }
+    if (c->uring.error != 0) {
+        errno = c->uring.error;
+        return -1;
+    }
+    if (c->uring.eof) {
+        return 0;
+    }
+    if (!c->uring.armed) {
+        return (int)recv(c->sfd, dest, nbytes, 0);
+    }
+    errno = EWOULDBLOCK;
+    return -1;
+}
+
+/* Gives the buffers still queued for a closed connection back */
+void conn_uring_release(conn *c) {
+    cb_assert(!c->uring.armed);
+    while (c->uring.head != -1) {
+        int bid = c->uring.head;
+        c->uring.head = uring_get_buf(c->thread->uring, bid)->next;
+        uring_recycle(c->thread->uring, bid);
+    }
+    c->uring.tail = -1;
+}
+#else
+bool conn_uring_want_read(conn *c) {
+    (void)c;
+    return true;
+}
+
+void conn_uring_cancel(conn *c) {
+    (void)c;
+}
+
+int conn_uring_recv(conn *c, void *dest, size_t nbytes) {
+    (void)c;
+    (void)dest;
+    (void)nbytes;
+    errno = ENOTSUP;
+    return -1;
+}
+
+void conn_uring_release(conn *c) {
+    (void)c;
+}
+#endif
+
+/*
+ * Once a second: run the timers of the thread which are due (the idle
+ * timers of its connections), and hand the idle connections of a retired
+ * thread (see threads_resize()) over to the others.
+ */
+static void idle_sweep(evutil_socket_t fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    struct timeval interval = {1, 0};
+
+    (void)fd;
+    (void)which;
+
+    LOCK_THREAD(me);
+    timer_wheel_advance(&me->wheel, mc_time_get_current_time());
+    UNLOCK_THREAD(me);
+    if (thread_retired(me)) {
+        LOCK_THREAD(me);
+        conn_drain(me);
+        UNLOCK_THREAD(me);
+    }
+    evtimer_add(&me->idle_timer, &interval);
+}
+
 /*
  * Set up a thread's information.
  */
@@ -259,9 +623,64 @@ static void setup_thread(LIBEVENT_THREAD *me) {
     cq_init(me->new_conn_queue);
 
     cb_mutex_initialize(&me->mutex);
+    me->migrate_to = -1;
+
+    timer_wheel_init(&me->wheel, mc_time_get_current_time());
+    evtimer_set(&me->idle_timer, idle_sweep, me);
+    event_base_set(me->base, &me->idle_timer);
+    {
+        struct timeval interval = {1, 0};
+        evtimer_add(&me->idle_timer, &interval);
+    }
+
+#ifdef HAVE_IO_URING
+    if (settings.io_uring) {
+        setup_thread_uring(me);
+    }
+#endif
 
     // Initialize threads' sub-document parser / handler
     me->subdoc_op = subdoc_op_alloc();
+
+    me->inflate_cache = inflate_cache_create();
+    me->dictionary = dictionary_contexts_create();
+    me->subdoc_index = subdoc_index_cache_create();
+    me->slow_ops = slow_op_log_create();
+    me->trace = workload_trace_open(me->index);
+    me->vbuckets = vbucket_counters_create();
+    me->rate_limiter = rate_limiter_create();
+    me->proxy = proxy_create(me);
+    me->near_cache = near_cache_create(settings.near_cache_items);
+}
+
+/*
+ * Run one pass of the event loop of the thread. With busy_poll_usec the
+ * thread first polls without blocking until events arrive or the time is
+ * up, so a request arriving meanwhile doesn't wait for the thread to be
+ * woken up and scheduled again. Returns the result of event_base_loop().
+ */
+static int worker_loop_pass(LIBEVENT_THREAD *me, hrtime_t start) {
+    uint32_t usec = settings.busy_poll_usec;
+
+    if (usec != 0) {
+        hrtime_t deadline = start + (hrtime_t)usec * 1000;
+        hrtime_t now;
+        do {
+            int ret = event_base_loop(me->base, EVLOOP_NONBLOCK);
+            if (ret != 0 || event_base_got_break(me->base)) {
+                return ret;
+            }
+            if (me->loop.pass_events != 0) {
+                STATS_BUMP(me->loop.spin_ns, me->loop.woke - start);
+                STATS_BUMP(me->loop.spin_hits, 1);
+                return 0;
+            }
+            now = thread_clock_update(me);
+        } while (now < deadline);
+        STATS_BUMP(me->loop.spin_ns, now - start);
+        STATS_BUMP(me->loop.spin_misses, 1);
+    }
+    return event_base_loop(me->base, EVLOOP_ONCE);
 }
 
 /*
@@ -273,13 +692,93 @@ static void worker_libevent(void *arg) {
     /* Any per-thread setup can happen here; thread_init() will block until
      * all threads have finished initializing.
      */
+    if (me->cpu != -1 && !thread_affinity_bind(me->cpu)) {
+        me->cpu = -1;
+    }
+    mc_use_thread_arena();
 
     cb_mutex_enter(&init_lock);
     init_count++;
     cb_cond_signal(&init_cond);
     cb_mutex_exit(&init_lock);
 
-    event_base_loop(me->base, 0);
+    /* One pass at a time, to tell the wait for events from their handling */
+    thread_clock_update(me);
+    for (;;) {
+        /* The end of the previous pass */
+        hrtime_t start = thread_clock(me);
+        hrtime_t end;
+
+        me->loop.pass_events = 0;
+        if (worker_loop_pass(me, start) != 0 ||
+            event_base_got_break(me->base)) {
+            thread_flush_releases(me);
+            break;
+        }
+        thread_flush_releases(me);
+
+        end = thread_clock_update(me);
+        if (me->loop.pass_events == 0) {
+            STATS_BUMP(me->loop.idle_ns, end - start);
+        } else {
+            STATS_BUMP(me->loop.idle_ns, me->loop.woke - start);
+            STATS_BUMP(me->loop.busy_ns, end - me->loop.woke);
+            STATS_BUMP(me->loop.events, me->loop.pass_events);
+            if (me->loop.pass_events > me->loop.max_events) {
+                STATS_STORE(me->loop.max_events, me->loop.pass_events);
+            }
+        }
+        STATS_BUMP(me->loop.passes, 1);
+        me->slice.ready = me->loop.pass_events;
+    }
+}
+
+/*
+ * Called by the callbacks of the event loop of the thread when they start,
+ * returns the time.
+ */
+hrtime_t thread_loop_event(LIBEVENT_THREAD *me) {
+    hrtime_t now = thread_clock_update(me);
+    if (me->loop.pass_events++ == 0) {
+        me->loop.woke = now;
+    } else {
+        uint64_t wait = now - me->loop.woke;
+        STATS_BUMP(me->loop.ready_waits, 1);
+        STATS_BUMP(me->loop.ready_wait_ns, wait);
+        if (wait > me->loop.ready_wait_max_ns) {
+            STATS_STORE(me->loop.ready_wait_max_ns, wait);
+        }
+    }
+    return now;
+}
+
+hrtime_t thread_clock_update(LIBEVENT_THREAD *me) {
+    return me->clock = gethrtime();
+}
+
+void thread_flush_releases(LIBEVENT_THREAD *me) {
+    if (me->releases.count != 0) {
+        settings.engine.v1->release_multi(settings.engine.v0,
+                                          me->releases.cookie,
+                                          me->releases.items,
+                                          me->releases.count);
+        me->releases.count = 0;
+    }
+    me->releases.cookie = NULL;
+}
+
+void conn_flush_releases(conn *c) {
+    if (c->thread != NULL && c->thread->releases.cookie == c) {
+        thread_flush_releases(c->thread);
+    }
+}
+
+void thread_loop_notify_wait(LIBEVENT_THREAD *me, hrtime_t ns) {
+    STATS_BUMP(me->loop.notify_waits, 1);
+    STATS_BUMP(me->loop.notify_wait_ns, ns);
+    if (ns > me->loop.notify_wait_max_ns) {
+        STATS_STORE(me->loop.notify_wait_max_ns, ns);
+    }
 }
 
 int number_of_pending(conn *c, conn *list) {
@@ -292,9 +791,22 @@ int number_of_pending(conn *c, conn *list) {
     return rv;
 }
 
-static void drain_notification_channel(evutil_socket_t fd)
+static void drain_notification_channel(LIBEVENT_THREAD *me)
 {
+    evutil_socket_t fd = me->notify[0];
     int nread;
+
+#ifdef HAVE_EVENTFD
+    if (me->use_eventfd) {
+        eventfd_t count;
+        if (eventfd_read(fd, &count) == -1 && errno != EAGAIN) {
+            log_system_error(EXTENSION_LOG_WARNING, NULL,
+                             "Can't read from eventfd: %s");
+        }
+        return;
+    }
+#endif
+
     while ((nread = recv(fd, devnull, sizeof(devnull), 0)) == (int)sizeof(devnull)) {
         /* empty */
     }
@@ -305,6 +817,90 @@ static void drain_notification_channel(evutil_socket_t fd)
     }
 }
 
+/*
+ * Takes over a connection migrated from another thread (see migrate_conn()).
+ */
+static void adopt_conn(LIBEVENT_THREAD *me, conn *c) {
+    cb_assert(c->thread == NULL);
+    c->thread = me;
+    STATS_BUMP(me->conns_migrated_in, 1);
+    conn_idle_timer_arm(c);
+
+    event_set(&c->event, c->sfd, c->ev_flags, event_handler, (void *)c);
+    event_base_set(me->base, &c->event);
+    if (!register_event(c, NULL)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "Failed to add migrated connection "
+                                        "to libevent, closing it");
+        /* It was idle, so there is nothing to clean up in the engine */
+        safe_close(c->sfd);
+        c->sfd = INVALID_SOCKET;
+        LOCK_THREAD(me);
+        conn_set_state(c, conn_immediate_close);
+        run_event_loop(c);
+        UNLOCK_THREAD(me);
+    }
+}
+
+/*
+ * Creates the connection object for a socket handed to (or accepted by)
+ * this thread.
+ */
+static void setup_conn(LIBEVENT_THREAD *me, SOCKET sfd, int parent_port,
+                       STATE_FUNC init_state, int event_flags,
+                       int read_buffer_size) {
+    conn *c = conn_new(sfd, parent_port, init_state, event_flags,
+                       read_buffer_size, me->base, me);
+    if (c == NULL) {
+        if (settings.verbose > 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+                                            "Can't listen for events on fd %d\n",
+                                            sfd);
+        }
+        closesocket(sfd);
+        STATS_BUMP(me->conns_closed, 1);
+    } else {
+        cb_assert(c->thread == NULL);
+        c->thread = me;
+        c->active_time = mc_time_get_current_time();
+        conn_idle_timer_arm(c);
+        if (c->peer_user != NULL) {
+            conn_peer_authenticate(c);
+        }
+#ifdef HAVE_IO_URING
+        if (me->uring != NULL && !conn_uring_enable(c)) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                            "Failed to set up io_uring "
+                                            "reads, closing connection");
+            safe_close(c->sfd);
+            c->sfd = INVALID_SOCKET;
+            LOCK_THREAD(me);
+            conn_set_state(c, conn_immediate_close);
+            run_event_loop(c);
+            UNLOCK_THREAD(me);
+        }
+#endif
+    }
+}
+
+/*
+ * Starts listening on a SO_REUSEPORT socket given to this thread by
+ * dispatch_listen_conn().
+ */
+static void adopt_listen_conn(LIBEVENT_THREAD *me, SOCKET sfd,
+                              int parent_port) {
+    conn *c = conn_new(sfd, parent_port, conn_listening,
+                       EV_READ | EV_PERSIST, 1, me->base, me);
+    if (c == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "failed to create listening connection\n");
+        exit(EXIT_FAILURE);
+    }
+    c->thread = me;
+    c->next = me->listen_conns;
+    me->listen_conns = c;
+}
+
 /*
  * Processes an incoming "handle a new connection" item. This is called when
  * input arrives on the libevent wakeup pipe.
@@ -314,28 +910,30 @@ static void thread_libevent_process(evutil_socket_t fd, short which, void *arg)
     CQ_ITEM *item;
     conn* pending;
 
-    cb_assert(me->type == GENERAL);
-    drain_notification_channel(fd);
+    cb_assert(me->type == GENERAL || me->type == DCP);
+    thread_loop_event(me);
+    drain_notification_channel(me);
+    /*
+     * Anything queued from now on sends another notification, and
+     * everything queued before is picked up below (see notify_thread()).
+     */
+    NOTIFY_CLEAR_PENDING(me);
 
     if (memcached_shutdown) {
          event_base_loopbreak(me->base);
          return ;
     }
 
+    thread_update_listen(me);
+
     while ((item = cq_pop(me->new_conn_queue)) != NULL) {
-        conn *c = conn_new(item->sfd, item->parent_port, item->init_state,
-                           item->event_flags, item->read_buffer_size,
-                           me->base);
-        if (c == NULL) {
-            if (settings.verbose > 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
-                                                "Can't listen for events on fd %d\n",
-                                                item->sfd);
-            }
-            closesocket(item->sfd);
+        if (item->migrate != NULL) {
+            adopt_conn(me, item->migrate);
+        } else if (item->init_state == conn_listening) {
+            adopt_listen_conn(me, item->sfd, item->parent_port);
         } else {
-            cb_assert(c->thread == NULL);
-            c->thread = me;
+            setup_conn(me, item->sfd, item->parent_port, item->init_state,
+                       item->event_flags, item->read_buffer_size);
         }
         cqi_free(item);
     }
@@ -362,6 +960,9 @@ static void thread_libevent_process(evutil_socket_t fd, short which, void *arg)
         c->nevents = 1;
         run_event_loop(c);
     }
+    if (thread_retired(me)) {
+        conn_drain(me);
+    }
     UNLOCK_THREAD(me);
 }
 
@@ -424,23 +1025,46 @@ void enlist_conn(conn *c, conn **list) {
     }
 }
 
+/*
+ * Hand the status to the connection and put it on the pending_io list of
+ * its thread (with the thread lock held). *now is read the first time it
+ * is needed. Returns true if the thread needs to be notified.
+ */
+static int notify_io_complete_locked(conn *conn, ENGINE_ERROR_CODE status,
+                                     hrtime_t *now)
+{
+    settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
+                                    "Got notify from %d, status %x\n",
+                                    conn->sfd, status);
+
+    conn->aiostat = status;
+    if (conn->phase.active || conn->notify_time == 0) {
+        if (*now == 0) {
+            *now = gethrtime();
+        }
+        if (conn->phase.active) {
+            conn->phase.notified = *now;
+        }
+        if (conn->notify_time == 0) {
+            conn->notify_time = *now;
+        }
+    }
+    return add_conn_to_pending_io_list(conn);
+}
+
 void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status)
 {
     struct conn *conn = (struct conn *)cookie;
     LIBEVENT_THREAD *thr;
+    hrtime_t now = 0;
     int notify;
 
     cb_assert(conn);
     thr = conn->thread;
     cb_assert(thr);
 
-    settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
-                                    "Got notify from %d, status %x\n",
-                                    conn->sfd, status);
-
     LOCK_THREAD(thr);
-    conn->aiostat = status;
-    notify = add_conn_to_pending_io_list(conn);
+    notify = notify_io_complete_locked(conn, status, &now);
     UNLOCK_THREAD(thr);
 
     /* kick the thread in the butt */
@@ -449,9 +1073,193 @@ void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status)
     }
 }
 
+/* The threads notify_io_complete_multi() wakes up at a time */
+#define NOTIFY_MULTI_THREADS 32
+
+void notify_io_complete_multi(const void * const *cookies,
+                              const ENGINE_ERROR_CODE *status, int ncookies)
+{
+    LIBEVENT_THREAD *wake[NOTIFY_MULTI_THREADS];
+    int nwake = 0;
+    hrtime_t now = 0;
+    int ii = 0;
+
+    while (ii < ncookies) {
+        /* Take the lock of a thread once for a run of its connections */
+        LIBEVENT_THREAD *thr = ((conn *)cookies[ii])->thread;
+        int notify = 0;
+        int jj;
+
+        cb_assert(thr);
+        LOCK_THREAD(thr);
+        do {
+            notify |= notify_io_complete_locked((conn *)cookies[ii],
+                                                status[ii], &now);
+            ++ii;
+        } while (ii < ncookies && ((conn *)cookies[ii])->thread == thr);
+        UNLOCK_THREAD(thr);
+
+        if (!notify) {
+            continue;
+        }
+        for (jj = 0; jj < nwake && wake[jj] != thr; ++jj) {
+            /* empty */
+        }
+        if (jj < nwake) {
+            continue;
+        }
+        if (nwake == NOTIFY_MULTI_THREADS) {
+            for (jj = 0; jj < nwake; ++jj) {
+                notify_thread(wake[jj]);
+            }
+            nwake = 0;
+        }
+        wake[nwake++] = thr;
+    }
+
+    for (ii = 0; ii < nwake; ++ii) {
+        notify_thread(wake[ii]);
+    }
+}
+
 /* Which thread we assigned a connection to most recently. */
 static int last_thread = -1;
 
+static uint64_t get_thread_conns(LIBEVENT_THREAD *thr) {
+    return STATS_LOAD(thr->conns_dispatched) +
+        STATS_LOAD(thr->conns_accepted) +
+        STATS_LOAD(thr->conns_migrated_in) -
+        STATS_LOAD(thr->conns_closed) - STATS_LOAD(thr->conns_migrated_out);
+}
+
+static int least_connections_thread(void) {
+    uint64_t best = UINT64_MAX;
+    int tid = 0;
+    int ii;
+
+    /* Start after the last pick so that ties are spread round robin */
+    for (ii = 1; ii <= settings.num_threads; ++ii) {
+        int idx = (last_thread + ii) % settings.num_threads;
+        uint64_t conns = get_thread_conns(threads + idx);
+        if (conns < best) {
+            best = conns;
+            tid = idx;
+        }
+    }
+    return tid;
+}
+
+/*
+ * The command rate of every thread is sampled (at most) once a second.
+ * Connections given to a thread since the last sample haven't shown up
+ * in its rate yet, so each of them is counted as an average connection.
+ */
+static struct {
+    rel_time_t sampled;
+    uint64_t *cmds;      /* the cmds counters at the last sample */
+    uint64_t *rate;      /* commands executed in the last interval */
+    uint64_t *dispatched;/* the conns_dispatched counters at the last sample */
+} load_sample;
+
+static int least_loaded_thread(void) {
+    rel_time_t now = mc_time_get_current_time();
+    uint64_t total_rate = 0, total_conns = 0, per_conn, best = UINT64_MAX;
+    int tid = 0;
+    int ii;
+
+    if (load_sample.cmds == NULL) {
+        load_sample.cmds = calloc(settings.max_threads, sizeof(uint64_t));
+        load_sample.rate = calloc(settings.max_threads, sizeof(uint64_t));
+        load_sample.dispatched = calloc(settings.max_threads, sizeof(uint64_t));
+        if (load_sample.cmds == NULL || load_sample.rate == NULL ||
+            load_sample.dispatched == NULL) {
+            free(load_sample.cmds);
+            free(load_sample.rate);
+            free(load_sample.dispatched);
+            load_sample.cmds = NULL;
+            return least_connections_thread();
+        }
+    }
+
+    if (now != load_sample.sampled) {
+        for (ii = 0; ii < settings.num_threads; ++ii) {
+            uint64_t cmds = STATS_LOAD(threads[ii].cmds);
+            load_sample.rate[ii] = (cmds - load_sample.cmds[ii]) /
+                (now - load_sample.sampled);
+            load_sample.cmds[ii] = cmds;
+            load_sample.dispatched[ii] = threads[ii].conns_dispatched;
+        }
+        load_sample.sampled = now;
+    }
+
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        total_rate += load_sample.rate[ii];
+        total_conns += get_thread_conns(threads + ii);
+    }
+    per_conn = total_conns ? total_rate / total_conns : 0;
+
+    for (ii = 1; ii <= settings.num_threads; ++ii) {
+        int idx = (last_thread + ii) % settings.num_threads;
+        uint64_t load = load_sample.rate[idx] + per_conn *
+            (threads[idx].conns_dispatched - load_sample.dispatched[idx]);
+        /* Use the number of connections to break ties (ie. when idle) */
+        load = load * (total_conns + 1) + get_thread_conns(threads + idx);
+        if (load < best) {
+            best = load;
+            tid = idx;
+        }
+    }
+    return tid;
+}
+
+/*
+ * Pick the thread matching the CPU the kernel processed the socket's
+ * packets on, so the connection is served where its data is already hot
+ * in the cache (works best with the interrupts spread over the CPUs and
+ * the worker threads bound to them). Returns -1 if unknown.
+ */
+static int incoming_cpu_thread(SOCKET sfd) {
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(sfd, SOL_SOCKET, SO_INCOMING_CPU, (void*)&cpu, &len) == 0 &&
+        cpu >= 0) {
+        int ii;
+        /* With thread_affinity, the worker bound to that CPU */
+        for (ii = 0; ii < settings.num_threads; ++ii) {
+            if (threads[ii].cpu == cpu) {
+                return ii;
+            }
+        }
+        return cpu % settings.num_threads;
+    }
+#endif
+    return -1;
+}
+
+static int select_thread(SOCKET sfd) {
+    int tid = -1;
+
+    switch (settings.connection_dispatch) {
+    case DISPATCH_LEAST_CONNECTIONS:
+        tid = least_connections_thread();
+        break;
+    case DISPATCH_LEAST_LOAD:
+        tid = least_loaded_thread();
+        break;
+    case DISPATCH_INCOMING_CPU:
+        tid = incoming_cpu_thread(sfd);
+        break;
+    case DISPATCH_ROUND_ROBIN:
+        break;
+    }
+
+    if (tid == -1) {
+        tid = (last_thread + 1) % settings.num_threads;
+    }
+    return tid;
+}
+
 /*
  * Dispatches a new connection to another thread. This is only ever called
  * from the main thread, or because of an incoming connection.
@@ -460,17 +1268,19 @@ void dispatch_conn_new(SOCKET sfd, int parent_port,
                        STATE_FUNC init_state, int event_flags,
                        int read_buffer_size) {
     CQ_ITEM *item = cqi_new();
-    int tid = (last_thread + 1) % settings.num_threads;
+    int tid = select_thread(sfd);
 
     LIBEVENT_THREAD *thread = threads + tid;
 
     last_thread = tid;
+    STATS_BUMP(thread->conns_dispatched, 1);
 
     item->sfd = sfd;
     item->parent_port = parent_port;
     item->init_state = init_state;
     item->event_flags = event_flags;
     item->read_buffer_size = read_buffer_size;
+    item->migrate = NULL;
 
     cq_push(thread->new_conn_queue, item);
 
@@ -478,6 +1288,220 @@ void dispatch_conn_new(SOCKET sfd, int parent_port,
     notify_thread(thread);
 }
 
+/*
+ * Hands listening socket to worker thread tid (reuseport mode), which
+ * accepts the connections on it itself from then on.
+ */
+void dispatch_listen_conn(int tid, SOCKET sfd, int parent_port) {
+    CQ_ITEM *item = cqi_new();
+    LIBEVENT_THREAD *thread = threads + tid;
+
+    if (item == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "failed to create listening connection\n");
+        exit(EXIT_FAILURE);
+    }
+
+    item->sfd = sfd;
+    item->parent_port = parent_port;
+    item->init_state = conn_listening;
+    item->event_flags = EV_READ | EV_PERSIST;
+    item->read_buffer_size = 1;
+    item->migrate = NULL;
+
+    cq_push(thread->new_conn_queue, item);
+    notify_thread(thread);
+}
+
+/*
+ * Serves a connection accepted on one of the thread's own listeners (in
+ * reuseport mode), skipping the trip through the dispatcher.
+ */
+void accept_conn_new(LIBEVENT_THREAD *me, SOCKET sfd, int parent_port,
+                     STATE_FUNC init_state, int event_flags,
+                     int read_buffer_size) {
+    STATS_BUMP(me->conns_accepted, 1);
+    MEMCACHED_CONN_DISPATCH(sfd, (uintptr_t)me->thread_id);
+    setup_conn(me, sfd, parent_port, init_state, event_flags,
+               read_buffer_size);
+}
+
+/*
+ * Wakes up the threads owning listeners, so they enable them again.
+ */
+void notify_listen_threads(void) {
+    int ii;
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        if (threads[ii].listen_conns != NULL) {
+            notify_thread(threads + ii);
+        }
+    }
+}
+
+/*
+ * Connection migration. Once a second the rebalancer (running in the
+ * dispatcher) compares how long each worker thread spent running its
+ * connections. When the busiest one spent more than
+ * connection_migration_threshold percent of the interval more than the
+ * idlest one, the busy thread is asked to move about half the difference
+ * over, and hands over the next connection going idle whose own recent
+ * busy time fits in that budget.
+ */
+static struct {
+    struct event timer;
+    hrtime_t sampled;
+    uint64_t *busy; /* the busy_ns counters at the last sample */
+} rebalance;
+
+static void rebalance_threads(evutil_socket_t fd, short which, void *arg) {
+    struct timeval interval = {1, 0};
+    hrtime_t now = gethrtime();
+    uint64_t elapsed = now - rebalance.sampled;
+    uint64_t max = 0, min = UINT64_MAX;
+    int hot = 0, cold = 0;
+    int ii;
+
+    (void)fd;
+    (void)which;
+    (void)arg;
+
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        uint64_t busy = STATS_LOAD(threads[ii].busy_ns);
+        uint64_t delta = busy - rebalance.busy[ii];
+        rebalance.busy[ii] = busy;
+        if (delta > max) {
+            max = delta;
+            hot = ii;
+        }
+        if (delta < min) {
+            min = delta;
+            cold = ii;
+        }
+    }
+    rebalance.sampled = now;
+
+    if (settings.connection_migration_threshold > 0 && hot != cold &&
+        (max - min) * 100 > elapsed * settings.connection_migration_threshold) {
+        LIBEVENT_THREAD *thr = threads + hot;
+        LOCK_THREAD(thr);
+        thr->migrate_to = cold;
+        thr->migrate_budget = (max - min) / 2;
+        UNLOCK_THREAD(thr);
+    }
+
+    evtimer_add(&rebalance.timer, &interval);
+}
+
+/*
+ * A connection may only move while it is idle between commands: waiting
+ * for input with nothing buffered, and nothing (the engine, TAP/DCP, the
+ * kernel for zero copy sends) holding on to it for this thread.
+ */
+static bool conn_migratable(const conn *c) {
+    return c->state == conn_read && c->registered_in_libevent &&
+        c->read.bytes == 0 && c->write.bytes == 0 &&
+        c->item == NULL && c->ileft == 0 && c->temp_alloc_left == 0 &&
+        c->zerocopy.npins == 0 && c->zerocopy.next == c->zerocopy.done &&
+        c->get_batch.count == 0 && c->refcount == 1 && !c->ewouldblock &&
+        c->tap_iterator == NULL && !c->dcp && c->ssl == NULL &&
+        !c->uring.enabled && c->unordered.buf.bytes == 0 &&
+        c->list_state == 0 && c->next == NULL;
+}
+
+/*
+ * Hands the idle connection c over to the thread to, using item for the
+ * trip. Returns false (freeing item) if c couldn't leave its event base.
+ */
+static bool hand_over_conn(conn *c, LIBEVENT_THREAD *to, CQ_ITEM *item) {
+    LIBEVENT_THREAD *me = c->thread;
+
+    conn_flush_releases(c);
+    if (!unregister_event(c)) {
+        cqi_free(item);
+        return false;
+    }
+
+    STATS_BUMP(me->conns_migrated_out, 1);
+    STATS_NOKEY(c, conn_migrations);
+    conn_idle_timer_cancel(c);
+    c->thread = NULL;
+
+    item->sfd = c->sfd;
+    item->migrate = c;
+    cq_push(to->new_conn_queue, item);
+    notify_thread(to);
+    return true;
+}
+
+/*
+ * The DCP thread serving the fewest connections. They're indexed after
+ * the spare worker thread (which comes after settings.max_threads).
+ */
+static LIBEVENT_THREAD *least_connections_dcp_thread(void) {
+    LIBEVENT_THREAD *best = NULL;
+    uint64_t fewest = UINT64_MAX;
+    int ii;
+
+    for (ii = settings.max_threads + 1; ii < nthreads; ++ii) {
+        uint64_t conns = get_thread_conns(threads + ii);
+        if (conns < fewest) {
+            fewest = conns;
+            best = threads + ii;
+        }
+    }
+    return best;
+}
+
+/*
+ * Called by the thread owning c (with its lock held) once c is done
+ * running. Returns true if c was handed over to a DCP thread (after
+ * DCP_OPEN), away from a retired thread or to the thread the rebalancer
+ * asked for, in which case the caller must not touch it any more.
+ */
+bool migrate_conn(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+    LIBEVENT_THREAD *to;
+    hrtime_t busy;
+    CQ_ITEM *item;
+
+    if (c->dcp_migrate) {
+        /* Retried every time c goes idle until it gets through */
+        if (!conn_migratable(c) || (item = cqi_new()) == NULL) {
+            return false;
+        }
+        c->dcp_migrate = false;
+        if (!hand_over_conn(c, least_connections_dcp_thread(), item)) {
+            c->dcp_migrate = true;
+            return false;
+        }
+        return true;
+    }
+
+    if (thread_retired(me)) {
+        if (!conn_migratable(c) || (item = cqi_new()) == NULL) {
+            return false;
+        }
+        return hand_over_conn(c, threads + least_connections_thread(), item);
+    }
+
+    if (me->migrate_to == -1 || !conn_migratable(c)) {
+        return false;
+    }
+
+    busy = c->busy.current > c->busy.previous ?
+        c->busy.current : c->busy.previous;
+    if (busy > me->migrate_budget || (item = cqi_new()) == NULL) {
+        return false;
+    }
+
+    to = threads + me->migrate_to;
+    if (!hand_over_conn(c, to, item)) {
+        return false;
+    }
+    me->migrate_to = -1;
+    return true;
+}
+
 /*
  * Returns true if this is the thread that listens for new TCP connections.
  */
@@ -491,88 +1515,365 @@ void notify_dispatcher(void) {
 
 /******************************* GLOBAL STATS ******************************/
 
+/*
+ * The network buffer pools. Size class n holds buffers of exactly
+ * DATA_BUFFER_SIZE << n bytes, and any other size is left to malloc().
+ * The buffers are plain malloc() memory, so a buffer may be released to
+ * another thread's pool (or freed) than the one it came from.
+ */
+static struct buffer_pool_class *buffer_pool_class(LIBEVENT_THREAD *me,
+                                                   uint32_t size) {
+    int ii;
+    if (me == NULL) {
+        return NULL;
+    }
+    for (ii = 0; ii < BUFFER_POOL_CLASSES; ++ii) {
+        if (size == (uint32_t)DATA_BUFFER_SIZE << ii) {
+            return &me->buffers[ii];
+        }
+    }
+    return NULL;
+}
+
+static char *buffer_pool_get(LIBEVENT_THREAD *me, uint32_t size) {
+    struct buffer_pool_class *pc = buffer_pool_class(me, size);
+    char *ret;
+
+    if (pc == NULL) {
+        return malloc(size);
+    }
+    if ((ret = pc->free) != NULL) {
+        memcpy(&pc->free, ret, sizeof(pc->free));
+        STATS_STORE(pc->nfree, pc->nfree - 1);
+        STATS_BUMP(pc->hits, 1);
+        return ret;
+    }
+    STATS_BUMP(pc->misses, 1);
+    return malloc(size);
+}
+
+static void buffer_pool_put(LIBEVENT_THREAD *me, char *buf, uint32_t size) {
+    struct buffer_pool_class *pc = buffer_pool_class(me, size);
+
+    if (pc != NULL && pc->nfree < BUFFER_POOL_CLASS_BYTES / size) {
+        memcpy(buf, &pc->free, sizeof(pc->free));
+        pc->free = buf;
+        STATS_STORE(pc->nfree, pc->nfree + 1);
+    } else {
+        free(buf);
+    }
+}
+
+bool thread_buffer_alloc(LIBEVENT_THREAD *me, struct net_buf *buf,
+                         uint32_t size) {
+    char *ptr = buffer_pool_get(me, size);
+    if (ptr == NULL) {
+        return false;
+    }
+    buf->buf = buf->curr = ptr;
+    buf->size = size;
+    buf->bytes = 0;
+    return true;
+}
+
+bool thread_buffer_resize(LIBEVENT_THREAD *me, struct net_buf *buf,
+                          uint32_t size) {
+    size_t offset = buf->curr - buf->buf;
+    size_t used = offset + buf->bytes;
+    char *ptr = buffer_pool_get(me, size);
+
+    if (ptr == NULL) {
+        return false;
+    }
+    memcpy(ptr, buf->buf, used < size ? used : size);
+    buffer_pool_put(me, buf->buf, buf->size);
+    buf->buf = ptr;
+    buf->curr = ptr + offset;
+    buf->size = size;
+    return true;
+}
+
+void thread_buffer_release(LIBEVENT_THREAD *me, struct net_buf *buf) {
+    if (buf->buf != NULL) {
+        buffer_pool_put(me, buf->buf, buf->size);
+    }
+    buf->buf = buf->curr = NULL;
+    buf->size = buf->bytes = 0;
+}
+
+void buffer_pool_aggregate(struct buffer_pool_class *out) {
+    int ii, jj;
+
+    memset(out, 0, sizeof(*out) * BUFFER_POOL_CLASSES);
+    for (ii = 0; ii < nthreads; ++ii) {
+        for (jj = 0; jj < BUFFER_POOL_CLASSES; ++jj) {
+            const struct buffer_pool_class *pc = &threads[ii].buffers[jj];
+            out[jj].nfree += STATS_LOAD(pc->nfree);
+            out[jj].hits += STATS_LOAD(pc->hits);
+            out[jj].misses += STATS_LOAD(pc->misses);
+        }
+    }
+}
+
+void slow_ops_stats(ADD_STAT add_stats, conn *c) {
+    int ii;
+    for (ii = 0; ii < NUM_WORKER_THREADS(); ++ii) {
+        slow_op_log_stats(threads[ii].slow_ops, ii, add_stats, c);
+    }
+}
+
+uint64_t thread_trace_records(void) {
+    uint64_t total = 0;
+    int ii;
+    for (ii = 0; ii < nthreads; ++ii) {
+        total += workload_trace_written(threads[ii].trace);
+    }
+    return total;
+}
+
+void thread_vbucket_traffic(vbucket_traffic_t *totals) {
+    int ii;
+    for (ii = 0; ii < nthreads; ++ii) {
+        vbucket_counters_aggregate(threads[ii].vbuckets, totals);
+    }
+}
+
+static const char * const thread_loop_stat_names[] = {
+    "passes", "events", "max_events", "idle_ns", "busy_ns", "conn_busy_ns",
+    "ready_waits", "ready_wait_ns", "ready_wait_max_ns", "notify_waits",
+    "notify_wait_ns", "notify_wait_max_ns", "slice_cmd_ns", "spin_ns",
+    "spin_hits", "spin_misses", "cmds", "conns"
+};
+
+static uint64_t thread_loop_stat(LIBEVENT_THREAD *thr, int stat) {
+    switch (stat) {
+    case 0: return STATS_LOAD(thr->loop.passes);
+    case 1: return STATS_LOAD(thr->loop.events);
+    case 2: return STATS_LOAD(thr->loop.max_events);
+    case 3: return STATS_LOAD(thr->loop.idle_ns);
+    case 4: return STATS_LOAD(thr->loop.busy_ns);
+    case 5: return STATS_LOAD(thr->busy_ns);
+    case 6: return STATS_LOAD(thr->loop.ready_waits);
+    case 7: return STATS_LOAD(thr->loop.ready_wait_ns);
+    case 8: return STATS_LOAD(thr->loop.ready_wait_max_ns);
+    case 9: return STATS_LOAD(thr->loop.notify_waits);
+    case 10: return STATS_LOAD(thr->loop.notify_wait_ns);
+    case 11: return STATS_LOAD(thr->loop.notify_wait_max_ns);
+    case 12: return STATS_LOAD(thr->slice.cmd_ns);
+    case 13: return STATS_LOAD(thr->loop.spin_ns);
+    case 14: return STATS_LOAD(thr->loop.spin_hits);
+    case 15: return STATS_LOAD(thr->loop.spin_misses);
+    case 16: return STATS_LOAD(thr->cmds);
+    default: return get_thread_conns(thr);
+    }
+}
+
+/* A stat of all of the threads, then the next one (see openmetrics.h) */
+void thread_loop_stats(ADD_STAT add_stats, conn *c) {
+    int nstats = (int)(sizeof(thread_loop_stat_names) /
+                       sizeof(thread_loop_stat_names[0]));
+    int ii, jj;
+
+    for (jj = 0; jj < nstats; ++jj) {
+        for (ii = 0; ii < NUM_WORKER_THREADS(); ++ii) {
+            char key[64];
+            char val[32];
+            snprintf(key, sizeof(key), "thread_%d_%s", ii,
+                     thread_loop_stat_names[jj]);
+            snprintf(val, sizeof(val), "%" PRIu64,
+                     thread_loop_stat(&threads[ii], jj));
+            add_stats(key, (uint16_t)strlen(key), val, (uint32_t)strlen(val),
+                      c);
+        }
+    }
+
+    for (ii = 0; ii < NUM_WORKER_THREADS(); ++ii) {
+        if (threads[ii].cpu != -1) {
+            char key[64];
+            char val[32];
+            snprintf(key, sizeof(key), "thread_%d_cpu", ii);
+            snprintf(val, sizeof(val), "%d", threads[ii].cpu);
+            add_stats(key, (uint16_t)strlen(key), val, (uint32_t)strlen(val),
+                      c);
+        }
+    }
+}
+
+static void buffer_pool_destroy(LIBEVENT_THREAD *me) {
+    int ii;
+    for (ii = 0; ii < BUFFER_POOL_CLASSES; ++ii) {
+        struct buffer_pool_class *pc = &me->buffers[ii];
+        while (pc->free != NULL) {
+            char *buf = pc->free;
+            memcpy(&pc->free, buf, sizeof(pc->free));
+            free(buf);
+        }
+        pc->nfree = 0;
+    }
+}
+
 void threadlocal_stats_clear(struct thread_stats *stats) {
-    stats->cmd_get = 0;
-    stats->get_misses = 0;
-    stats->delete_misses = 0;
-    stats->incr_misses = 0;
-    stats->decr_misses = 0;
-    stats->incr_hits = 0;
-    stats->decr_hits = 0;
-    stats->cas_misses = 0;
-    stats->bytes_written = 0;
-    stats->bytes_read = 0;
-    stats->cmd_flush = 0;
-    stats->conn_yields = 0;
-    stats->auth_cmds = 0;
-    stats->auth_errors = 0;
-    stats->rbufs_allocated = 0;
-    stats->rbufs_loaned = 0;
-    stats->rbufs_existing = 0;
-    stats->wbufs_allocated = 0;
-    stats->wbufs_loaned = 0;
-    stats->iovused_high_watermark = 0;
-    stats->msgused_high_watermark = 0;
-
-    memset(stats->slab_stats, 0,
-           sizeof(struct slab_stats) * MAX_NUMBER_OF_SLAB_CLASSES);
+    int sid;
+
+    STATS_STORE(stats->cmd_get, 0);
+    STATS_STORE(stats->get_misses, 0);
+    STATS_STORE(stats->delete_misses, 0);
+    STATS_STORE(stats->incr_misses, 0);
+    STATS_STORE(stats->decr_misses, 0);
+    STATS_STORE(stats->incr_hits, 0);
+    STATS_STORE(stats->decr_hits, 0);
+    STATS_STORE(stats->cas_misses, 0);
+    STATS_STORE(stats->bytes_written, 0);
+    STATS_STORE(stats->bytes_read, 0);
+    STATS_STORE(stats->cmd_flush, 0);
+    STATS_STORE(stats->conn_yields, 0);
+    STATS_STORE(stats->auth_cmds, 0);
+    STATS_STORE(stats->auth_errors, 0);
+    STATS_STORE(stats->rbufs_allocated, 0);
+    STATS_STORE(stats->rbufs_loaned, 0);
+    STATS_STORE(stats->rbufs_existing, 0);
+    STATS_STORE(stats->wbufs_allocated, 0);
+    STATS_STORE(stats->wbufs_loaned, 0);
+    STATS_STORE(stats->iovused_high_watermark, 0);
+    STATS_STORE(stats->msgused_high_watermark, 0);
+    STATS_STORE(stats->zerocopy_sends, 0);
+    STATS_STORE(stats->zerocopy_copied, 0);
+    STATS_STORE(stats->conn_migrations, 0);
+    STATS_STORE(stats->responses_coalesced, 0);
+    STATS_STORE(stats->ssl_ktls_offloads, 0);
+    STATS_STORE(stats->ssl_handshakes, 0);
+    STATS_STORE(stats->ssl_sessions_reused, 0);
+    STATS_STORE(stats->unordered_cmds, 0);
+    STATS_STORE(stats->sched_throttled, 0);
+    STATS_STORE(stats->slice_trimmed, 0);
+    STATS_STORE(stats->cmds_shed, 0);
+    STATS_STORE(stats->cmds_rate_limited, 0);
+    STATS_STORE(stats->conns_throttled, 0);
+    STATS_STORE(stats->direct_receives, 0);
+    STATS_STORE(stats->read_repacks, 0);
+    STATS_STORE(stats->idle_trims, 0);
+    STATS_STORE(stats->idle_trimmed_bytes, 0);
+    STATS_STORE(stats->idle_closes, 0);
+    STATS_STORE(stats->script_steps, 0);
+    STATS_STORE(stats->script_budget_exceeded, 0);
+    STATS_STORE(stats->proxy_forwards, 0);
+    STATS_STORE(stats->proxy_failures, 0);
+    STATS_STORE(stats->proxy_hedges, 0);
+    STATS_STORE(stats->proxy_hedge_wins, 0);
+    STATS_STORE(stats->near_cache_hits, 0);
+    STATS_STORE(stats->near_cache_fills, 0);
+    STATS_STORE(stats->values_compressed, 0);
+    STATS_STORE(stats->values_dict_compressed, 0);
+    STATS_STORE(stats->stream_compress_in, 0);
+    STATS_STORE(stats->stream_compress_out, 0);
+    STATS_STORE(stats->inflate_cache_hits, 0);
+    STATS_STORE(stats->inflate_cache_misses, 0);
+    STATS_STORE(stats->subdoc_index_hits, 0);
+    STATS_STORE(stats->subdoc_index_misses, 0);
+
+    for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
+        STATS_STORE(stats->slab_stats[sid].cmd_set, 0);
+        STATS_STORE(stats->slab_stats[sid].get_hits, 0);
+        STATS_STORE(stats->slab_stats[sid].delete_hits, 0);
+        STATS_STORE(stats->slab_stats[sid].cas_hits, 0);
+        STATS_STORE(stats->slab_stats[sid].cas_badval, 0);
+    }
 }
 
 void threadlocal_stats_reset(struct thread_stats *thread_stats) {
     int ii;
-    for (ii = 0; ii < settings.num_threads; ++ii) {
-        cb_mutex_enter(&thread_stats[ii].mutex);
-        threadlocal_stats_clear(&thread_stats[ii]);
-        cb_mutex_exit(&thread_stats[ii].mutex);
+    for (ii = 0; ii < NUM_WORKER_THREADS(); ++ii) {
+        STATS_SET_RESET_PENDING(&thread_stats[ii], 1);
     }
 }
 
 void threadlocal_stats_aggregate(struct thread_stats *thread_stats, struct thread_stats *stats) {
     int ii, sid;
-    for (ii = 0; ii < settings.num_threads; ++ii) {
-        cb_mutex_enter(&thread_stats[ii].mutex);
-
-        stats->cmd_get += thread_stats[ii].cmd_get;
-        stats->get_misses += thread_stats[ii].get_misses;
-        stats->delete_misses += thread_stats[ii].delete_misses;
-        stats->decr_misses += thread_stats[ii].decr_misses;
-        stats->incr_misses += thread_stats[ii].incr_misses;
-        stats->decr_hits += thread_stats[ii].decr_hits;
-        stats->incr_hits += thread_stats[ii].incr_hits;
-        stats->cas_misses += thread_stats[ii].cas_misses;
-        stats->bytes_read += thread_stats[ii].bytes_read;
-        stats->bytes_written += thread_stats[ii].bytes_written;
-        stats->cmd_flush += thread_stats[ii].cmd_flush;
-        stats->conn_yields += thread_stats[ii].conn_yields;
-        stats->auth_cmds += thread_stats[ii].auth_cmds;
-        stats->auth_errors += thread_stats[ii].auth_errors;
-        stats->rbufs_allocated += thread_stats[ii].rbufs_allocated;
-        stats->rbufs_loaned += thread_stats[ii].rbufs_loaned;
-        stats->rbufs_existing += thread_stats[ii].rbufs_existing;
-        stats->wbufs_allocated += thread_stats[ii].wbufs_allocated;
-        stats->wbufs_loaned += thread_stats[ii].wbufs_loaned;
-
-        if (thread_stats[ii].iovused_high_watermark > stats->iovused_high_watermark) {
-            stats->iovused_high_watermark = thread_stats[ii].iovused_high_watermark;
-        }
-        if (thread_stats[ii].msgused_high_watermark > stats->msgused_high_watermark) {
-            stats->msgused_high_watermark = thread_stats[ii].msgused_high_watermark;
+    for (ii = 0; ii < NUM_WORKER_THREADS(); ++ii) {
+        struct thread_stats *ts = &thread_stats[ii];
+        uint64_t val;
+
+        if (STATS_RESET_PENDING(ts)) {
+            /* Reset, but the owner didn't get around to clearing it yet */
+            continue;
+        }
+
+        stats->cmd_get += STATS_LOAD(ts->cmd_get);
+        stats->get_misses += STATS_LOAD(ts->get_misses);
+        stats->delete_misses += STATS_LOAD(ts->delete_misses);
+        stats->decr_misses += STATS_LOAD(ts->decr_misses);
+        stats->incr_misses += STATS_LOAD(ts->incr_misses);
+        stats->decr_hits += STATS_LOAD(ts->decr_hits);
+        stats->incr_hits += STATS_LOAD(ts->incr_hits);
+        stats->cas_misses += STATS_LOAD(ts->cas_misses);
+        stats->bytes_read += STATS_LOAD(ts->bytes_read);
+        stats->bytes_written += STATS_LOAD(ts->bytes_written);
+        stats->cmd_flush += STATS_LOAD(ts->cmd_flush);
+        stats->conn_yields += STATS_LOAD(ts->conn_yields);
+        stats->auth_cmds += STATS_LOAD(ts->auth_cmds);
+        stats->auth_errors += STATS_LOAD(ts->auth_errors);
+        stats->rbufs_allocated += STATS_LOAD(ts->rbufs_allocated);
+        stats->rbufs_loaned += STATS_LOAD(ts->rbufs_loaned);
+        stats->rbufs_existing += STATS_LOAD(ts->rbufs_existing);
+        stats->wbufs_allocated += STATS_LOAD(ts->wbufs_allocated);
+        stats->wbufs_loaned += STATS_LOAD(ts->wbufs_loaned);
+        stats->zerocopy_sends += STATS_LOAD(ts->zerocopy_sends);
+        stats->zerocopy_copied += STATS_LOAD(ts->zerocopy_copied);
+        stats->conn_migrations += STATS_LOAD(ts->conn_migrations);
+        stats->responses_coalesced += STATS_LOAD(ts->responses_coalesced);
+        stats->ssl_ktls_offloads += STATS_LOAD(ts->ssl_ktls_offloads);
+        stats->ssl_handshakes += STATS_LOAD(ts->ssl_handshakes);
+        stats->ssl_sessions_reused += STATS_LOAD(ts->ssl_sessions_reused);
+        stats->unordered_cmds += STATS_LOAD(ts->unordered_cmds);
+        stats->sched_throttled += STATS_LOAD(ts->sched_throttled);
+        stats->slice_trimmed += STATS_LOAD(ts->slice_trimmed);
+        stats->cmds_shed += STATS_LOAD(ts->cmds_shed);
+        stats->cmds_rate_limited += STATS_LOAD(ts->cmds_rate_limited);
+        stats->conns_throttled += STATS_LOAD(ts->conns_throttled);
+        stats->direct_receives += STATS_LOAD(ts->direct_receives);
+        stats->read_repacks += STATS_LOAD(ts->read_repacks);
+        stats->idle_trims += STATS_LOAD(ts->idle_trims);
+        stats->idle_trimmed_bytes += STATS_LOAD(ts->idle_trimmed_bytes);
+        stats->idle_closes += STATS_LOAD(ts->idle_closes);
+        stats->script_steps += STATS_LOAD(ts->script_steps);
+        stats->script_budget_exceeded +=
+            STATS_LOAD(ts->script_budget_exceeded);
+        stats->proxy_forwards += STATS_LOAD(ts->proxy_forwards);
+        stats->proxy_failures += STATS_LOAD(ts->proxy_failures);
+        stats->proxy_hedges += STATS_LOAD(ts->proxy_hedges);
+        stats->proxy_hedge_wins += STATS_LOAD(ts->proxy_hedge_wins);
+        stats->near_cache_hits += STATS_LOAD(ts->near_cache_hits);
+        stats->near_cache_fills += STATS_LOAD(ts->near_cache_fills);
+        stats->values_compressed += STATS_LOAD(ts->values_compressed);
+        stats->values_dict_compressed += STATS_LOAD(ts->values_dict_compressed);
+        stats->stream_compress_in += STATS_LOAD(ts->stream_compress_in);
+        stats->stream_compress_out += STATS_LOAD(ts->stream_compress_out);
+        stats->inflate_cache_hits += STATS_LOAD(ts->inflate_cache_hits);
+        stats->inflate_cache_misses += STATS_LOAD(ts->inflate_cache_misses);
+        stats->subdoc_index_hits += STATS_LOAD(ts->subdoc_index_hits);
+        stats->subdoc_index_misses += STATS_LOAD(ts->subdoc_index_misses);
+
+        val = STATS_LOAD(ts->iovused_high_watermark);
+        if (val > stats->iovused_high_watermark) {
+            stats->iovused_high_watermark = val;
+        }
+        val = STATS_LOAD(ts->msgused_high_watermark);
+        if (val > stats->msgused_high_watermark) {
+            stats->msgused_high_watermark = val;
         }
 
         for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
             stats->slab_stats[sid].cmd_set +=
-                thread_stats[ii].slab_stats[sid].cmd_set;
+                STATS_LOAD(ts->slab_stats[sid].cmd_set);
             stats->slab_stats[sid].get_hits +=
-                thread_stats[ii].slab_stats[sid].get_hits;
+                STATS_LOAD(ts->slab_stats[sid].get_hits);
             stats->slab_stats[sid].delete_hits +=
-                thread_stats[ii].slab_stats[sid].delete_hits;
+                STATS_LOAD(ts->slab_stats[sid].delete_hits);
             stats->slab_stats[sid].cas_hits +=
-                thread_stats[ii].slab_stats[sid].cas_hits;
+                STATS_LOAD(ts->slab_stats[sid].cas_hits);
             stats->slab_stats[sid].cas_badval +=
-                thread_stats[ii].slab_stats[sid].cas_badval;
+                STATS_LOAD(ts->slab_stats[sid].cas_badval);
         }
-
-        cb_mutex_exit(&thread_stats[ii].mutex);
     }
 }
 
@@ -594,16 +1895,39 @@ void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out) {
     }
 }
 
+/* Starts the thread set up in slot ii, and waits for it to be running */
+static void start_thread(int ii) {
+    int target;
+
+    cb_mutex_enter(&init_lock);
+    target = init_count + 1;
+    cb_mutex_exit(&init_lock);
+
+    create_worker(worker_libevent, &threads[ii], &thread_ids[ii]);
+    threads[ii].thread_id = thread_ids[ii];
+    threads[ii].started = true;
+
+    cb_mutex_enter(&init_lock);
+    while (init_count < target) {
+        cb_cond_wait(&init_cond, &init_lock);
+    }
+    cb_mutex_exit(&init_lock);
+}
+
 /*
  * Initializes the thread subsystem, creating various worker threads.
  *
- * nthreads  Number of worker event handler threads to spawn
+ * nthreads  Number of worker event handler threads to spawn. Slots are
+ *           set up for settings.max_threads of them (see threads_resize()),
+ *           and the spare worker and the settings.num_dcp_threads DCP
+ *           threads come after those.
  * main_base Event base for main thread
  */
 void thread_init(int nthr, struct event_base *main_base,
                  void (*dispatcher_callback)(evutil_socket_t, short, void *)) {
     int i;
-    nthreads = nthr + 1;
+    cb_assert(nthr <= settings.max_threads);
+    nthreads = settings.max_threads + 1 + settings.num_dcp_threads;
 
     cqi_freelist = NULL;
 
@@ -611,6 +1935,8 @@ void thread_init(int nthr, struct event_base *main_base,
     cb_mutex_initialize(&cqi_freelist_lock);
     cb_mutex_initialize(&init_lock);
     cb_cond_initialize(&init_cond);
+    cb_mutex_initialize(&resize_lock);
+    vbucket_stats_init();
 
     threads = calloc(nthreads, sizeof(LIBEVENT_THREAD));
     if (! threads) {
@@ -628,36 +1954,82 @@ void thread_init(int nthr, struct event_base *main_base,
     }
 
     setup_dispatcher(main_base, dispatcher_callback);
+    thread_affinity_init();
 
     for (i = 0; i < nthreads; i++) {
-        if (!create_notification_pipe(&threads[i])) {
+        if (!create_notification_channel(&threads[i])) {
             exit(1);
         }
         threads[i].index = i;
+        /* Only the worker threads, not the spare or the DCP threads */
+        threads[i].cpu = i < settings.max_threads ? thread_affinity_cpu(i) : -1;
 
         setup_thread(&threads[i]);
+        if (i > settings.max_threads) {
+            threads[i].type = DCP;
+        }
     }
 
-    /* Create threads after we've done all the libevent setup. */
+    rebalance.busy = calloc(settings.max_threads, sizeof(uint64_t));
+    if (rebalance.busy == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Can't allocate rebalancer state");
+        exit(1);
+    }
+    rebalance.sampled = gethrtime();
+    evtimer_set(&rebalance.timer, rebalance_threads, NULL);
+    event_base_set(main_base, &rebalance.timer);
+    {
+        struct timeval interval = {1, 0};
+        evtimer_add(&rebalance.timer, &interval);
+    }
+
+    /*
+     * Create threads after we've done all the libevent setup. The worker
+     * slots above nthr are started once a reload raises the thread count.
+     */
     for (i = 0; i < nthreads; i++) {
-        create_worker(worker_libevent, &threads[i], &thread_ids[i]);
-        threads[i].thread_id = thread_ids[i];
+        if (i < nthr || i >= settings.max_threads) {
+            start_thread(i);
+        }
     }
+}
 
-    /* Wait for all the threads to set themselves up before returning. */
-    cb_mutex_enter(&init_lock);
-    while (init_count < nthreads) {
-        cb_cond_wait(&init_cond, &init_lock);
+/*
+ * Changes the number of worker threads connections are dispatched to
+ * (called from a config reload, see the "threads" setting). The threads
+ * taken out of use hand their connections over to the others as they go
+ * idle, and are started again if the number goes back up.
+ */
+void threads_resize(int nthr) {
+    int old = settings.num_threads;
+    int ii;
+
+    cb_assert(nthr > 0 && nthr <= settings.max_threads);
+    cb_mutex_enter(&resize_lock);
+    for (ii = old; ii < nthr; ++ii) {
+        if (!threads[ii].started) {
+            start_thread(ii);
+        }
+    }
+    /* Only the dispatcher picks threads, so it never sees one not started */
+    settings.num_threads = nthr;
+    cb_mutex_exit(&resize_lock);
+
+    /* Have the retired ones look at their connections right away */
+    for (ii = nthr; ii < old; ++ii) {
+        notify_thread(&threads[ii]);
     }
-    cb_mutex_exit(&init_lock);
 }
 
 void threads_shutdown(void)
 {
     int ii;
     for (ii = 0; ii < nthreads; ++ii) {
-        notify_thread(&threads[ii]);
-        cb_join_thread(thread_ids[ii]);
+        if (threads[ii].started) {
+            notify_thread(&threads[ii]);
+            cb_join_thread(thread_ids[ii]);
+        }
     }
 }
 
@@ -668,23 +2040,60 @@ void threads_cleanup(void)
         CQ_ITEM *it;
 
         safe_close(threads[ii].notify[0]);
-        safe_close(threads[ii].notify[1]);
+        if (!threads[ii].use_eventfd) {
+            safe_close(threads[ii].notify[1]);
+        }
         event_base_free(threads[ii].base);
 
         while ((it = cq_pop(threads[ii].new_conn_queue)) != NULL) {
             cqi_free(it);
         }
         free(threads[ii].new_conn_queue);
-        free(threads[ii].read.buf);
-        free(threads[ii].write.buf);
+#ifdef HAVE_IO_URING
+        if (threads[ii].uring != NULL) {
+            uring_destroy(threads[ii].uring);
+        }
+#endif
+        buffer_pool_destroy(&threads[ii]);
         subdoc_op_free(threads[ii].subdoc_op);
+        free(threads[ii].subdoc_doc.buffer);
+        inflate_cache_destroy(threads[ii].inflate_cache);
+        dictionary_contexts_destroy(threads[ii].dictionary);
+        subdoc_index_cache_destroy(threads[ii].subdoc_index);
+        slow_op_log_destroy(threads[ii].slow_ops);
+        workload_trace_close(threads[ii].trace);
+        vbucket_counters_destroy(threads[ii].vbuckets);
+        rate_limiter_destroy(threads[ii].rate_limiter);
+        proxy_destroy(threads[ii].proxy);
+        near_cache_destroy(threads[ii].near_cache);
     }
 
+    free(rebalance.busy);
     free(thread_ids);
     free(threads);
 }
 
 void notify_thread(LIBEVENT_THREAD *thread) {
+    /*
+     * A worker thread handles all of its queued connections and pending
+     * IO for a single wakeup, so only the first notification after it
+     * last drained its channel is sent. The dispatcher counts the bytes
+     * it receives, so it is notified every time.
+     */
+    if (thread->type != DISPATCHER && NOTIFY_SET_PENDING(thread)) {
+        return;
+    }
+
+#ifdef HAVE_EVENTFD
+    if (thread->use_eventfd) {
+        if (eventfd_write(thread->notify[1], 1) == -1) {
+            log_system_error(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to notify thread: %s");
+        }
+        return;
+    }
+#endif
+
     if (send(thread->notify[1], "", 1, 0) != 1) {
         log_socket_error(EXTENSION_LOG_WARNING, NULL,
                          "Failed to notify thread: %s");
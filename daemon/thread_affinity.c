@@ -0,0 +1,135 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include "thread_affinity.h"
+#include "config_util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_SYS_SCHED_SETAFFINITY
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define MASK_BITS (8 * sizeof(unsigned long))
+#define MASK_WORDS (CONFIG_MAX_CPUS / MASK_BITS)
+
+/* The CPUs worker n may use is cpus[n % ncpus], none if ncpus is 0 */
+static int cpus[CONFIG_MAX_CPUS];
+static int ncpus;
+
+#ifdef HAVE_SYS_SCHED_SETAFFINITY
+static bool mask_isset(const unsigned long *mask, int cpu) {
+    return (mask[cpu / MASK_BITS] >> (cpu % MASK_BITS)) & 1;
+}
+
+/*
+ * Whether the CPU is the first one of its core the process may use (the
+ * others are its hyperthreads)
+ */
+static bool first_of_core(int cpu, const unsigned long *allowed) {
+    char fname[128];
+    char line[256];
+    int siblings[CONFIG_MAX_CPUS];
+    int nsiblings, ii;
+    FILE *fp;
+
+    snprintf(fname, sizeof(fname),
+             "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+             cpu);
+    if ((fp = fopen(fname, "r")) == NULL) {
+        /* No topology, count it as a core of its own */
+        return true;
+    }
+    if (fgets(line, sizeof(line), fp) == NULL) {
+        line[0] = '\0';
+    }
+    fclose(fp);
+    line[strcspn(line, "\n")] = '\0';
+
+    nsiblings = config_parse_cpu_list(line, siblings, CONFIG_MAX_CPUS);
+    for (ii = 0; ii < nsiblings; ++ii) {
+        if (mask_isset(allowed, siblings[ii])) {
+            return siblings[ii] == cpu;
+        }
+    }
+    return true;
+}
+#endif
+
+void thread_affinity_init(void) {
+    const char *spec = settings.thread_affinity;
+#ifdef HAVE_SYS_SCHED_SETAFFINITY
+    unsigned long allowed[MASK_WORDS];
+    int list[CONFIG_MAX_CPUS];
+    int nlist, ii;
+
+    ncpus = 0;
+    if (spec == NULL) {
+        return;
+    }
+
+    memset(allowed, 0, sizeof(allowed));
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(allowed), allowed) < 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Can't get the CPUs of the process, not binding the worker "
+            "threads: %s\n", strerror(errno));
+        return;
+    }
+
+    if (strcmp(spec, "auto") == 0) {
+        for (ii = 0; ii < CONFIG_MAX_CPUS; ++ii) {
+            if (mask_isset(allowed, ii) && first_of_core(ii, allowed)) {
+                cpus[ncpus++] = ii;
+            }
+        }
+    } else {
+        /* Validated by the config parser */
+        nlist = config_parse_cpu_list(spec, list, CONFIG_MAX_CPUS);
+        for (ii = 0; ii < nlist; ++ii) {
+            if (mask_isset(allowed, list[ii])) {
+                cpus[ncpus++] = list[ii];
+            } else {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "thread_affinity: the process may not run on CPU %d, "
+                    "skipping it\n", list[ii]);
+            }
+        }
+    }
+
+    if (ncpus == 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "thread_affinity: no CPU to bind the worker threads to\n");
+    }
+#else
+    ncpus = 0;
+    if (spec != NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "thread_affinity is not supported on this platform\n");
+    }
+#endif
+}
+
+int thread_affinity_cpu(int index) {
+    return ncpus == 0 ? -1 : cpus[index % ncpus];
+}
+
+bool thread_affinity_bind(int cpu) {
+#ifdef HAVE_SYS_SCHED_SETAFFINITY
+    unsigned long mask[MASK_WORDS];
+
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / MASK_BITS] |= 1UL << (cpu % MASK_BITS);
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Failed to bind a worker thread to CPU %d: %s\n", cpu,
+            strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
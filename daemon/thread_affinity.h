@@ -0,0 +1,43 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Binding the worker threads to CPUs ("thread_affinity"), so the scheduler
+ * doesn't move them across the sockets, away from their memory. With
+ * "auto" worker n gets the first hyperthread of core n (of the CPUs the
+ * process may run on), with a list of CPUs the n:th CPU of the list, and
+ * they wrap around when there are more workers than CPUs. A worker binds
+ * itself before it allocates anything, so the memory it touches first (its
+ * net_buf pool, its pool of connections, its allocator arena) comes from
+ * its own NUMA node. With the NIC queues' interrupts spread over the same
+ * CPUs, "connection_dispatch": "incoming_cpu" then hands a connection to
+ * the worker bound to the CPU its packets arrive on.
+ */
+
+#ifndef THREAD_AFFINITY_H
+#define THREAD_AFFINITY_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Work out the CPUs from settings.thread_affinity (before any thread is
+ * bound). Falls back to no affinity, with a warning, if the platform
+ * can't bind threads or none of the CPUs can be used.
+ */
+void thread_affinity_init(void);
+
+/* The CPU the worker thread with the index should run on, -1 for any */
+int thread_affinity_cpu(int index);
+
+/* Bind the calling thread to the CPU, returns false if we can't */
+bool thread_affinity_bind(int cpu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
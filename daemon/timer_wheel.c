@@ -0,0 +1,153 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * A timer is placed by how far its expiry is from the next tick: within
+ * TIMER_WHEEL_SLOTS ticks it goes in the slot of its tick in the first
+ * wheel, otherwise in the slot of the block of ticks it falls in in the
+ * second (or third) wheel. As the wheel below completes a turn the slot
+ * of the next block is cascaded, placing its timers again, now closer.
+ */
+#include "config.h"
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/* How far the last wheel reaches */
+#define TIMER_WHEEL_SPAN ((rel_time_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static void slot_init(struct wheel_timer *head) {
+    head->next = head->prev = head;
+}
+
+static void slot_push(struct wheel_timer *head, struct wheel_timer *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void slot_unlink(struct wheel_timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+/* Move the timers of the slot over to list */
+static void slot_take(struct wheel_timer *head, struct wheel_timer *list) {
+    slot_init(list);
+    if (head->next != head) {
+        list->next = head->next;
+        list->prev = head->prev;
+        list->next->prev = list;
+        list->prev->next = list;
+        slot_init(head);
+    }
+}
+
+static void wheel_place(struct timer_wheel *wheel, struct wheel_timer *timer) {
+    rel_time_t next = wheel->now + 1;
+    rel_time_t expires = timer->expires;
+    rel_time_t delta;
+    int level;
+
+    if (expires < next) {
+        expires = next;
+    }
+    delta = expires - next;
+    if (delta >= TIMER_WHEEL_SPAN) {
+        /* Parked, it is placed again when the slot cascades */
+        expires = next + TIMER_WHEEL_SPAN - 1;
+        delta = TIMER_WHEEL_SPAN - 1;
+    }
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; ++level) {
+        if (delta < ((rel_time_t)1 << (TIMER_WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    slot_push(&wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) &
+                                   TIMER_WHEEL_MASK],
+              timer);
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, rel_time_t now) {
+    int level, slot;
+
+    wheel->now = now;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        for (slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot) {
+            slot_init(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->armed = wheel->fired = wheel->cascaded = 0;
+}
+
+void wheel_timer_init(struct wheel_timer *timer, WHEEL_TIMER_CALLBACK cb) {
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = cb;
+}
+
+void timer_wheel_arm(struct timer_wheel *wheel, struct wheel_timer *timer,
+                     rel_time_t expires) {
+    if (wheel_timer_armed(timer)) {
+        slot_unlink(timer);
+    } else {
+        wheel->armed++;
+    }
+    timer->expires = expires;
+    wheel_place(wheel, timer);
+}
+
+void timer_wheel_cancel(struct timer_wheel *wheel, struct wheel_timer *timer) {
+    if (wheel_timer_armed(timer)) {
+        slot_unlink(timer);
+        wheel->armed--;
+    }
+}
+
+/* Place the timers of the slot of the block starting at the next tick */
+static void wheel_cascade(struct timer_wheel *wheel, int level, int slot) {
+    struct wheel_timer list;
+
+    slot_take(&wheel->slots[level][slot], &list);
+    while (list.next != &list) {
+        struct wheel_timer *timer = list.next;
+        slot_unlink(timer);
+        wheel_place(wheel, timer);
+        wheel->cascaded++;
+    }
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel, rel_time_t now) {
+    while (wheel->now < now) {
+        rel_time_t tick = wheel->now + 1;
+        struct wheel_timer list;
+        int level;
+
+        /* A turn of a wheel is done, bring the next block of the one above */
+        for (level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+            if ((tick & (((rel_time_t)1 << (TIMER_WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+        }
+        while (--level > 0) {
+            wheel_cascade(wheel, level,
+                          (tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+        }
+
+        /* The callbacks arm the timers from the following tick on */
+        wheel->now = tick;
+        slot_take(&wheel->slots[0][tick & TIMER_WHEEL_MASK], &list);
+        while (list.next != &list) {
+            struct wheel_timer *timer = list.next;
+            slot_unlink(timer);
+            if (timer->expires > tick) {
+                wheel_place(wheel, timer);
+            } else {
+                wheel->armed--;
+                wheel->fired++;
+                timer->callback(timer, tick);
+            }
+        }
+    }
+}
@@ -0,0 +1,80 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * A hierarchical timing wheel of one second ticks, one per worker thread
+ * and only used by that thread. The timers are kept in the slots of
+ * three wheels of TIMER_WHEEL_SLOTS each, by how far away they are:
+ * arming and cancelling a timer is O(1) whatever the number of timers,
+ * and every tick looks at a single slot of the first wheel (the slots of
+ * the outer wheels are cascaded down once per turn of the wheel below
+ * them). Timers beyond the reach of the wheels (about 3 days) are
+ * parked in the last slot they reach and placed again as it cascades.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include "config.h"
+
+#include <memcached/types.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 3
+
+struct wheel_timer;
+typedef void (*WHEEL_TIMER_CALLBACK)(struct wheel_timer *timer,
+                                     rel_time_t now);
+
+/*
+ * Embedded in the object it is the timer of. next is NULL while it isn't
+ * armed.
+ */
+struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer *prev;
+    rel_time_t expires;
+    WHEEL_TIMER_CALLBACK callback;
+};
+
+struct timer_wheel {
+    rel_time_t now;          /* the last tick run */
+    /* The list heads of the slots */
+    struct wheel_timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t armed;          /* the timers in the wheel */
+    uint64_t fired;
+    uint64_t cascaded;
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, rel_time_t now);
+void wheel_timer_init(struct wheel_timer *timer, WHEEL_TIMER_CALLBACK cb);
+
+static inline bool wheel_timer_armed(const struct wheel_timer *timer) {
+    return timer->next != NULL;
+}
+
+/*
+ * (Re)arm the timer to fire at the first tick at or after expires (the
+ * next tick if it is already due).
+ */
+void timer_wheel_arm(struct timer_wheel *wheel, struct wheel_timer *timer,
+                     rel_time_t expires);
+
+/* Disarm the timer, if it is armed */
+void timer_wheel_cancel(struct timer_wheel *wheel, struct wheel_timer *timer);
+
+/*
+ * Run the ticks up to now, firing the timers which are due. A callback
+ * may arm its timer again, and arm or cancel any other timer.
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, rel_time_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
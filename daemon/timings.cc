@@ -6,6 +6,95 @@
 #include <string.h>
 #include <sstream>
 #include <atomic>
+#include <new>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/*
+ * Every worker thread records into its own shard, so a shard has a single
+ * writer: the counters are bumped with a relaxed load and store (no locked
+ * instructions, no cache lines bouncing between the workers) and the
+ * shards are merged when someone asks for the timings.
+ */
+template <typename T>
+static inline void bump(std::atomic<T> &counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+}
+
+/*
+ * Log-linear (HDR style) histogram of nanosecond values. Values below
+ * 2^(SUB_BITS + 1) get a bucket each, above that every power of two is
+ * split in 2^SUB_BITS buckets, so a bucket is never wider than ~3% of its
+ * values. MAX_SHIFT covers a bit over two minutes, anything slower ends up
+ * in the last bucket (max still records the real value).
+ */
+#define HDR_SUB_BITS 5
+#define HDR_MAX_SHIFT 31
+#define HDR_BUCKETS ((HDR_MAX_SHIFT + 2) << HDR_SUB_BITS)
+
+static int hdr_msb(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanReverse64(&idx, value);
+    return (int)idx;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+/*
+ * The histograms of the breakdowns (there may be one for each class of
+ * each opcode) use a coarser one, with buckets up to ~12% wide.
+ */
+#define CLASS_SUB_BITS 3
+#define CLASS_BUCKETS ((HDR_MAX_SHIFT + 2) << CLASS_SUB_BITS)
+
+static int hdr_index(uint64_t value, int sub_bits = HDR_SUB_BITS) {
+    int shift = 0;
+    if (value >= (1U << (sub_bits + 1))) {
+        shift = hdr_msb(value) - sub_bits;
+        if (shift > HDR_MAX_SHIFT) {
+            return ((HDR_MAX_SHIFT + 2) << sub_bits) - 1;
+        }
+    }
+    return (shift << sub_bits) + (int)(value >> shift);
+}
+
+/* The highest value ending up in the bucket */
+static uint64_t hdr_highest(int index, int sub_bits = HDR_SUB_BITS) {
+    int shift;
+    if (index < (1 << (sub_bits + 1))) {
+        return index;
+    }
+    shift = (index >> sub_bits) - 1;
+    return ((uint64_t)(index - (shift << sub_bits) + 1) << shift) - 1;
+}
+
+/* The log2 class of a size or a number of keys */
+static int timing_class(uint64_t value) {
+    if (value == 0) {
+        return 0;
+    }
+    int cls = hdr_msb(value) + 1;
+    return cls < TIMING_CLASSES ? cls : TIMING_CLASSES - 1;
+}
+
+/* The commands of one class of one opcode */
+typedef struct class_timings_st {
+    std::atomic<uint64_t> max;
+    std::atomic<uint32_t> hdr[CLASS_BUCKETS];
+} class_timings_t;
+
+/*
+ * The breakdowns of one opcode, the classes are allocated by the first
+ * command in them
+ */
+typedef struct breakdown_timings_st {
+    std::atomic<class_timings_t *> size[TIMING_CLASSES];
+    std::atomic<class_timings_t *> batch[TIMING_CLASSES];
+} breakdown_timings_t;
 
 typedef struct timings_st {
     /* We collect timings for <=1 us */
@@ -22,69 +111,317 @@ typedef struct timings_st {
     std::atomic<uint32_t> wayout;
 
     std::atomic<uint64_t> total;
+
+    /* The slowest command seen (in ns) */
+    std::atomic<uint64_t> max;
+
+    std::atomic<uint64_t> hdr[HDR_BUCKETS];
+
+    /* Allocated by the first command with its phases timed */
+    std::atomic<struct phase_timings_st *> phases;
+
+    /* Allocated by the first command of the opcode (see TIMING_CLASSES) */
+    std::atomic<breakdown_timings_t *> breakdown;
 } timings_t;
 
-timings_t timings[0x100];
+typedef struct phase_timings_st {
+    std::atomic<uint64_t> max[CMD_PHASE_COUNT];
+    std::atomic<uint64_t> hdr[CMD_PHASE_COUNT][HDR_BUCKETS];
+} phase_timings_t;
+
+static const char * const phase_names[CMD_PHASE_COUNT] = {
+    "read", "parse", "engine", "ewouldblock", "wakeup", "send_wait", "send"
+};
+
+const char *cmd_phase_name(cmd_phase_t phase)
+{
+    return phase_names[phase];
+}
+
+/*
+ * A shard only allocates the timings for the opcodes its thread actually
+ * sees. The owner publishes a new entry with a release store.
+ */
+typedef struct timing_shard_st {
+    std::atomic<timings_t *> cmd[0x100];
+} timing_shard_t;
+
+static timing_shard_t *shards;
+static int num_shards;
 
-void collect_timing(uint8_t cmd, hrtime_t nsec)
+static timings_t *get_timings(int shard, uint8_t cmd)
 {
-    timings_t *t = &timings[cmd];
+    timings_t *t;
+
+    if (shard < 0 || shard >= num_shards) {
+        return NULL;
+    }
+
+    t = shards[shard].cmd[cmd].load(std::memory_order_acquire);
+    if (t == NULL) {
+        t = new (std::nothrow) timings_t();
+        if (t != NULL) {
+            shards[shard].cmd[cmd].store(t, std::memory_order_release);
+        }
+    }
+    return t;
+}
+
+/* The class of the breakdown of the opcode, allocated if it's the first */
+static class_timings_t *get_class_timings(timings_t *t, bool batch, int cls)
+{
+    breakdown_timings_t *b = t->breakdown.load(std::memory_order_acquire);
+    if (b == NULL) {
+        b = new (std::nothrow) breakdown_timings_t();
+        if (b == NULL) {
+            return NULL;
+        }
+        t->breakdown.store(b, std::memory_order_release);
+    }
+
+    std::atomic<class_timings_t *> &slot = batch ? b->batch[cls] : b->size[cls];
+    class_timings_t *c = slot.load(std::memory_order_acquire);
+    if (c == NULL) {
+        c = new (std::nothrow) class_timings_t();
+        if (c != NULL) {
+            slot.store(c, std::memory_order_release);
+        }
+    }
+    return c;
+}
+
+static void collect_class_timing(timings_t *t, bool batch, uint64_t value,
+                                 hrtime_t nsec)
+{
+    class_timings_t *c = get_class_timings(t, batch, timing_class(value));
+    if (c == NULL) {
+        return;
+    }
+    bump(c->hdr[hdr_index(nsec, CLASS_SUB_BITS)]);
+    if (nsec > c->max.load(std::memory_order_relaxed)) {
+        c->max.store(nsec, std::memory_order_relaxed);
+    }
+}
+
+void collect_batch_timing(int shard, uint8_t cmd, uint32_t nkeys,
+                          hrtime_t nsec)
+{
+    timings_t *t = get_timings(shard, cmd);
+    if (t != NULL) {
+        collect_class_timing(t, true, nkeys, nsec);
+    }
+}
+
+void collect_timing(int shard, uint8_t cmd, uint64_t size, hrtime_t nsec)
+{
+    timings_t *t = get_timings(shard, cmd);
     hrtime_t usec = nsec / 1000;
     hrtime_t msec = usec / 1000;
     hrtime_t hsec = msec / 500;
 
+    if (t == NULL) {
+        return;
+    }
+
     if (usec == 0) {
-        t->ns++;
+        bump(t->ns);
     } else if (usec < 1000) {
-        t->usec[usec / 10]++;
+        bump(t->usec[usec / 10]);
     } else if (msec < 50) {
-        t->msec[msec]++;
+        bump(t->msec[msec]);
     } else if (hsec < 10) {
-        t->halfsec[hsec]++;
+        bump(t->halfsec[hsec]);
     } else {
-        t->wayout++;
+        bump(t->wayout);
     }
 
-    t->total++;
+    bump(t->hdr[hdr_index(nsec)]);
+    if (nsec > t->max.load(std::memory_order_relaxed)) {
+        t->max.store(nsec, std::memory_order_relaxed);
+    }
+    collect_class_timing(t, false, size, nsec);
+
+    bump(t->total);
+}
+
+void collect_phase_timings(int shard, uint8_t cmd,
+                           const hrtime_t phases[CMD_PHASE_COUNT])
+{
+    timings_t *t = get_timings(shard, cmd);
+    phase_timings_t *p;
+
+    if (t == NULL) {
+        return;
+    }
+
+    p = t->phases.load(std::memory_order_acquire);
+    if (p == NULL) {
+        p = new (std::nothrow) phase_timings_t();
+        if (p == NULL) {
+            return;
+        }
+        t->phases.store(p, std::memory_order_release);
+    }
+
+    for (int ii = 0; ii < CMD_PHASE_COUNT; ++ii) {
+        bump(p->hdr[ii][hdr_index(phases[ii])]);
+        if (phases[ii] > p->max[ii].load(std::memory_order_relaxed)) {
+            p->max[ii].store(phases[ii], std::memory_order_relaxed);
+        }
+    }
+}
+
+void initialize_timings(int nshards)
+{
+    shards = new timing_shard_t[nshards];
+    num_shards = nshards;
+    for (int ii = 0; ii < nshards; ++ii) {
+        for (int jj = 0; jj < 0x100; ++jj) {
+            shards[ii].cmd[jj].store(NULL);
+        }
+    }
 }
 
-void initialize_timings(void)
+/* The merged view of all shards for one opcode */
+struct merged_timings {
+    uint64_t ns;
+    uint64_t usec[100];
+    uint64_t msec[50];
+    uint64_t halfsec[10];
+    uint64_t wayout;
+    uint64_t total;
+    uint64_t max;
+    uint64_t hdr[HDR_BUCKETS];
+
+    /* Commands with their phases timed, and the histograms of the phases */
+    uint64_t phase_total;
+    uint64_t phase_max[CMD_PHASE_COUNT];
+    uint64_t phase_hdr[CMD_PHASE_COUNT][HDR_BUCKETS];
+};
+
+static void merge_timings(uint8_t opcode, struct merged_timings *m)
 {
-    int ii, jj;
-    for (ii = 0; ii < 0x100; ++ii) {
-        timings[ii].ns.store(0);
-        for (jj = 0; jj < 100; ++jj) {
-            timings[ii].usec[jj].store(0);
+    memset(m, 0, sizeof(*m));
+    for (int ii = 0; ii < num_shards; ++ii) {
+        const timings_t *t = shards[ii].cmd[opcode].load(std::memory_order_acquire);
+        if (t == NULL) {
+            continue;
+        }
+
+        m->ns += t->ns.load(std::memory_order_relaxed);
+        for (int jj = 0; jj < 100; ++jj) {
+            m->usec[jj] += t->usec[jj].load(std::memory_order_relaxed);
+        }
+        for (int jj = 0; jj < 50; ++jj) {
+            m->msec[jj] += t->msec[jj].load(std::memory_order_relaxed);
         }
-        for (jj = 0; jj < 50; ++jj) {
-            timings[ii].msec[jj].store(0);
+        for (int jj = 0; jj < 10; ++jj) {
+            m->halfsec[jj] += t->halfsec[jj].load(std::memory_order_relaxed);
+        }
+        m->wayout += t->wayout.load(std::memory_order_relaxed);
+        for (int jj = 0; jj < HDR_BUCKETS; ++jj) {
+            m->hdr[jj] += t->hdr[jj].load(std::memory_order_relaxed);
+        }
+
+        uint64_t max = t->max.load(std::memory_order_relaxed);
+        if (max > m->max) {
+            m->max = max;
+        }
+
+        const phase_timings_t *p = t->phases.load(std::memory_order_acquire);
+        if (p == NULL) {
+            continue;
         }
-        for (jj = 0; jj < 10; ++jj) {
-            timings[ii].halfsec[jj].store(0);
+        for (int ph = 0; ph < CMD_PHASE_COUNT; ++ph) {
+            for (int jj = 0; jj < HDR_BUCKETS; ++jj) {
+                m->phase_hdr[ph][jj] +=
+                    p->hdr[ph][jj].load(std::memory_order_relaxed);
+            }
+            max = p->max[ph].load(std::memory_order_relaxed);
+            if (max > m->phase_max[ph]) {
+                m->phase_max[ph] = max;
+            }
         }
-        timings[ii].wayout.store(0);
-        timings[ii].total.store(0);
+    }
+
+    /* Use the histogram for the total so the percentiles add up */
+    for (int jj = 0; jj < HDR_BUCKETS; ++jj) {
+        m->total += m->hdr[jj];
+        /* Every phase gets a sample for each command */
+        m->phase_total += m->phase_hdr[0][jj];
     }
 }
 
+/* The (highest equivalent) value below which the fraction of samples fall */
+static uint64_t hdr_percentile(const uint64_t *hdr, uint64_t total,
+                               uint64_t max, double fraction,
+                               int sub_bits = HDR_SUB_BITS)
+{
+    uint64_t wanted = (uint64_t)(fraction * total + 0.5);
+    uint64_t seen = 0;
+    const int buckets = (HDR_MAX_SHIFT + 2) << sub_bits;
+
+    if (wanted == 0) {
+        wanted = 1;
+    }
+
+    for (int jj = 0; jj < buckets; ++jj) {
+        seen += hdr[jj];
+        if (seen >= wanted) {
+            uint64_t value = hdr_highest(jj, sub_bits);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+static void add_percentiles(std::stringstream &ss, const uint64_t *hdr,
+                            uint64_t total, uint64_t max,
+                            int sub_bits = HDR_SUB_BITS)
+{
+    ss << "{\"50\":" << hdr_percentile(hdr, total, max, 0.5, sub_bits)
+       << ",\"99\":" << hdr_percentile(hdr, total, max, 0.99, sub_bits)
+       << ",\"99.9\":" << hdr_percentile(hdr, total, max, 0.999, sub_bits)
+       << "}";
+}
+
 void generate_timings(uint8_t opcode, const void *cookie)
 {
     std::stringstream ss;
-    timings_t *t = &timings[opcode];
+    struct merged_timings *m = new struct merged_timings;
+
+    merge_timings(opcode, m);
 
-    ss << "{\"ns\":" << t->ns.load() << ",\"us\":[";
+    ss << "{\"ns\":" << m->ns << ",\"us\":[";
     for (int ii = 0; ii < 99; ++ii) {
-        ss << t->usec[ii].load() << ",";
+        ss << m->usec[ii] << ",";
     }
-    ss << t->usec[99].load() << "],\"ms\":[";
+    ss << m->usec[99] << "],\"ms\":[";
     for (int ii = 1; ii < 49; ++ii) {
-        ss << t->msec[ii].load() << ",";
+        ss << m->msec[ii] << ",";
     }
-    ss << t->msec[49].load() << "],\"500ms\":[";
+    ss << m->msec[49] << "],\"500ms\":[";
     for (int ii = 0; ii < 9; ++ii) {
-        ss << t->halfsec[ii].load() << ",";
+        ss << m->halfsec[ii] << ",";
     }
-    ss << t->halfsec[9].load() << "],\"wayout\":" << t->wayout.load() << "}";
+    ss << m->halfsec[9] << "],\"wayout\":" << m->wayout;
+    if (m->total > 0) {
+        ss << ",\"percentiles\":";
+        add_percentiles(ss, m->hdr, m->total, m->max);
+        ss << ",\"max\":" << m->max;
+    }
+    if (m->phase_total > 0) {
+        ss << ",\"phases\":{\"count\":" << m->phase_total;
+        for (int ph = 0; ph < CMD_PHASE_COUNT; ++ph) {
+            ss << ",\"" << phase_names[ph] << "\":{\"percentiles\":";
+            add_percentiles(ss, m->phase_hdr[ph], m->phase_total,
+                            m->phase_max[ph]);
+            ss << ",\"max\":" << m->phase_max[ph] << "}";
+        }
+        ss << "}";
+    }
+    ss << "}";
+    delete m;
     std::string str = ss.str();
 
     binary_response_handler(NULL, 0, NULL, 0, str.data(),
@@ -94,6 +431,130 @@ void generate_timings(uint8_t opcode, const void *cookie)
                             0, cookie);
 }
 
+/* The merged view of all shards for one class of a breakdown */
+struct merged_class_timings {
+    uint64_t total;
+    uint64_t max;
+    uint64_t hdr[CLASS_BUCKETS];
+};
+
+static void merge_class_timings(uint8_t opcode, bool batch, int cls,
+                                struct merged_class_timings *m)
+{
+    memset(m, 0, sizeof(*m));
+    for (int ii = 0; ii < num_shards; ++ii) {
+        const timings_t *t = shards[ii].cmd[opcode].load(std::memory_order_acquire);
+        if (t == NULL) {
+            continue;
+        }
+        const breakdown_timings_t *b = t->breakdown.load(std::memory_order_acquire);
+        if (b == NULL) {
+            continue;
+        }
+        const class_timings_t *c = batch ?
+            b->batch[cls].load(std::memory_order_acquire) :
+            b->size[cls].load(std::memory_order_acquire);
+        if (c == NULL) {
+            continue;
+        }
+
+        for (int jj = 0; jj < CLASS_BUCKETS; ++jj) {
+            uint64_t count = c->hdr[jj].load(std::memory_order_relaxed);
+            m->hdr[jj] += count;
+            m->total += count;
+        }
+        uint64_t max = c->max.load(std::memory_order_relaxed);
+        if (max > m->max) {
+            m->max = max;
+        }
+    }
+}
+
+bool generate_timings_breakdown(uint8_t opcode, uint8_t breakdown,
+                                const void *cookie)
+{
+    bool batch;
+    switch (breakdown) {
+    case PROTOCOL_BINARY_CMD_TIMER_BY_SIZE:
+        batch = false;
+        break;
+    case PROTOCOL_BINARY_CMD_TIMER_BY_BATCH:
+        batch = true;
+        break;
+    default:
+        return false;
+    }
+
+    std::stringstream ss;
+    struct merged_class_timings *m = new struct merged_class_timings;
+    bool first = true;
+
+    ss << "{\"breakdown\":\"" << (batch ? "batch" : "size")
+       << "\",\"classes\":[";
+    for (int cls = 0; cls < TIMING_CLASSES; ++cls) {
+        merge_class_timings(opcode, batch, cls, m);
+        if (m->total == 0) {
+            continue;
+        }
+        // The last class has no upper bound
+        ss << (first ? "" : ",") << "{\"from\":"
+           << (cls == 0 ? 0 : uint64_t(1) << (cls - 1));
+        if (cls < TIMING_CLASSES - 1) {
+            ss << ",\"to\":" << (cls == 0 ? 0 : (uint64_t(1) << cls) - 1);
+        }
+        ss << ",\"count\":" << m->total << ",\"percentiles\":";
+        add_percentiles(ss, m->hdr, m->total, m->max, CLASS_SUB_BITS);
+        ss << ",\"max\":" << m->max << "}";
+        first = false;
+    }
+    ss << "]}";
+    delete m;
+    std::string str = ss.str();
+
+    binary_response_handler(NULL, 0, NULL, 0, str.data(),
+                            uint32_t(str.length()),
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                            0, cookie);
+    return true;
+}
+
+static uint64_t get_cmd_total(uint8_t opcode);
+
+void generate_timing_summaries(timing_summary_cb callback, void *ctx)
+{
+    struct merged_timings *m = new struct merged_timings;
+
+    for (int opcode = 0; opcode < 0x100; ++opcode) {
+        if (get_cmd_total(uint8_t(opcode)) == 0) {
+            continue;
+        }
+        merge_timings(uint8_t(opcode), m);
+        if (m->total == 0) {
+            continue;
+        }
+
+        uint64_t percentiles[3] = {
+            hdr_percentile(m->hdr, m->total, m->max, 0.5),
+            hdr_percentile(m->hdr, m->total, m->max, 0.99),
+            hdr_percentile(m->hdr, m->total, m->max, 0.999)
+        };
+        callback(uint8_t(opcode), m->total, percentiles, m->max, ctx);
+    }
+    delete m;
+}
+
+static uint64_t get_cmd_total(uint8_t opcode)
+{
+    uint64_t ret = 0;
+    for (int ii = 0; ii < num_shards; ++ii) {
+        const timings_t *t = shards[ii].cmd[opcode].load(std::memory_order_acquire);
+        if (t != NULL) {
+            ret += t->total.load(std::memory_order_relaxed);
+        }
+    }
+    return ret;
+}
 
 uint64_t get_aggregated_cmd_stats(cmd_stat_t type)
 {
@@ -177,7 +638,7 @@ uint64_t get_aggregated_cmd_stats(cmd_stat_t type)
     }
 
     while (*ids != PROTOCOL_BINARY_CMD_INVALID) {
-        ret += timings[*ids].total.load();
+        ret += get_cmd_total(*ids);
         ++ids;
     }
 
@@ -8,10 +8,67 @@
 extern "C" {
 #endif
 
-    void collect_timing(uint8_t cmd, hrtime_t delay);
-    void initialize_timings(void);
+    /*
+     * Record the time spent on a command with size bytes of payload (the
+     * larger of its request and response bodies), shard is the worker
+     * thread index
+     */
+    void collect_timing(int shard, uint8_t cmd, uint64_t size, hrtime_t delay);
+
+    /*
+     * Record the time of the engine::get_multi call looking up the nkeys
+     * keys of a run of quiet gets, the first of them a cmd
+     */
+    void collect_batch_timing(int shard, uint8_t cmd, uint32_t nkeys,
+                              hrtime_t delay);
+
+    /*
+     * The phases the time of a command is split in, with phase_timings
+     * enabled (see conn_phase_end())
+     */
+    typedef enum {
+        CMD_PHASE_READ,        /* header read -> whole packet read */
+        CMD_PHASE_PARSE,       /* packet read -> executor called */
+        CMD_PHASE_ENGINE,      /* executing, less the time blocked */
+        CMD_PHASE_EWOULDBLOCK, /* EWOULDBLOCK -> notify_io_complete() */
+        CMD_PHASE_WAKEUP,      /* notify_io_complete() -> running again */
+        CMD_PHASE_SEND_WAIT,   /* response ready -> first byte sent */
+        CMD_PHASE_SEND,        /* first byte sent -> last byte sent */
+        CMD_PHASE_COUNT
+    } cmd_phase_t;
+
+    const char *cmd_phase_name(cmd_phase_t phase);
+
+    /* Record the time spent in each phase of a command (in ns) */
+    void collect_phase_timings(int shard, uint8_t cmd,
+                               const hrtime_t phases[CMD_PHASE_COUNT]);
+    void initialize_timings(int nshards);
     void generate_timings(uint8_t opcode, const void *cookie);
 
+    /*
+     * The log2 classes the breakdowns split the timings of an opcode in:
+     * 0 for 0, then n for the sizes (or key counts) in [2^(n-1), 2^n)
+     */
+    #define TIMING_CLASSES 32
+
+    /*
+     * Send the timings of the opcode broken down by the size or batch
+     * classes (a protocol_binary_cmd_timer_breakdown). Returns false for
+     * an unknown breakdown.
+     */
+    bool generate_timings_breakdown(uint8_t opcode, uint8_t breakdown,
+                                    const void *cookie);
+
+    /*
+     * Call the callback with the number of commands and the 50th, 99th
+     * and 99.9th percentiles and max of their time (in ns), for every
+     * opcode seen
+     */
+    typedef void (*timing_summary_cb)(uint8_t opcode, uint64_t count,
+                                      const uint64_t percentiles[3],
+                                      uint64_t max, void *ctx);
+    void generate_timing_summaries(timing_summary_cb callback, void *ctx);
+
     bool binary_response_handler(const void *key, uint16_t keylen,
                                  const void *ext, uint8_t extlen,
                                  const void *body, uint32_t bodylen,
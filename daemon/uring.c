@@ -0,0 +1,358 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * A minimal io_uring wrapper for the worker threads (see uring.h). It
+ * talks to the kernel with the raw system calls, so it doesn't need
+ * liburing.
+ */
+#include "config.h"
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* All buffers are provided in group 0 of the ring */
+#define URING_BUF_GROUP 0
+
+struct uring {
+    int fd;
+    int efd;
+
+    /* Submission queue */
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_queued;  /* queued, but not submitted yet */
+
+    /* Completion queue */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+
+    /* Provided buffers */
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    uint16_t br_tail;
+    unsigned int nbufs;
+    unsigned int bufsize;
+    char *bufmem;
+    struct uring_buf *bufs;
+};
+
+static int sys_io_uring_setup(unsigned int entries,
+                              struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+                                 unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void provide_buf(struct uring *r, int bid) {
+    struct io_uring_buf *buf = &r->br->bufs[r->br_tail & (r->nbufs - 1)];
+    buf->addr = (uint64_t)(uintptr_t)r->bufs[bid].data;
+    buf->len = r->bufsize;
+    buf->bid = (uint16_t)bid;
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+static bool map_rings(struct uring *r, struct io_uring_params *p) {
+    char *sq, *cq;
+
+    r->sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    r->cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) {
+            r->sq_len = r->cq_len;
+        }
+        r->cq_len = 0;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        return false;
+    }
+
+    if (r->cq_len == 0) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            return false;
+        }
+    }
+
+    r->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        return false;
+    }
+
+    sq = r->sq_ptr;
+    r->sq_head = (unsigned int *)(sq + p->sq_off.head);
+    r->sq_tail = (unsigned int *)(sq + p->sq_off.tail);
+    r->sq_mask = *(unsigned int *)(sq + p->sq_off.ring_mask);
+    r->sq_entries = p->sq_entries;
+    r->sq_array = (unsigned int *)(sq + p->sq_off.array);
+
+    cq = r->cq_ptr;
+    r->cq_head = (unsigned int *)(cq + p->cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p->cq_off.tail);
+    r->cq_mask = *(unsigned int *)(cq + p->cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return true;
+}
+
+static bool setup_buffers(struct uring *r, unsigned int nbufs,
+                          unsigned int bufsize) {
+    struct io_uring_buf_reg reg;
+    unsigned int ii;
+
+    r->nbufs = nbufs;
+    r->bufsize = bufsize;
+    r->bufmem = malloc((size_t)nbufs * bufsize);
+    r->bufs = calloc(nbufs, sizeof(struct uring_buf));
+    if (r->bufmem == NULL || r->bufs == NULL) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    r->br_len = nbufs * sizeof(struct io_uring_buf);
+    r->br = mmap(NULL, r->br_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) {
+        r->br = NULL;
+        return false;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return false;
+    }
+
+    for (ii = 0; ii < nbufs; ++ii) {
+        r->bufs[ii].data = r->bufmem + (size_t)ii * bufsize;
+        r->bufs[ii].next = -1;
+        provide_buf(r, (int)ii);
+    }
+    return true;
+}
+
+struct uring *uring_create(unsigned int entries, unsigned int nbufs,
+                           unsigned int bufsize) {
+    struct io_uring_params p;
+    struct uring *r;
+    int error;
+
+    if (nbufs == 0 || (nbufs & (nbufs - 1)) != 0 || nbufs > 32768) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->efd = -1;
+
+    /* Room for a completion per provided buffer, plus the cancellations */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = nbufs + entries;
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    if (!map_rings(r, &p) || !setup_buffers(r, nbufs, bufsize)) {
+        goto fail;
+    }
+
+    r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->efd == -1 ||
+        sys_io_uring_register(r->fd, IORING_REGISTER_EVENTFD, &r->efd, 1) < 0) {
+        goto fail;
+    }
+
+    return r;
+
+fail:
+    error = errno;
+    uring_destroy(r);
+    errno = error;
+    return NULL;
+}
+
+void uring_destroy(struct uring *r) {
+    if (r == NULL) {
+        return;
+    }
+    if (r->efd != -1) {
+        close(r->efd);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    if (r->sqes != NULL) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    if (r->sq_ptr != NULL) {
+        munmap(r->sq_ptr, r->sq_len);
+    }
+    if (r->br != NULL) {
+        munmap(r->br, r->br_len);
+    }
+    free(r->bufs);
+    free(r->bufmem);
+    free(r);
+}
+
+int uring_eventfd(struct uring *r) {
+    return r->efd;
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *r) {
+    unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *r->sq_tail + r->sq_queued;
+    struct io_uring_sqe *sqe;
+
+    if (tail - head >= r->sq_entries) {
+        /* Full; hand what we have to the kernel to make room */
+        if (uring_submit(r) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        tail = *r->sq_tail;
+        if (tail - head >= r->sq_entries) {
+            return NULL;
+        }
+    }
+
+    sqe = &r->sqes[tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[tail & r->sq_mask] = tail & r->sq_mask;
+    r->sq_queued++;
+    return sqe;
+}
+
+bool uring_recv_multishot(struct uring *r, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool uring_cancel(struct uring *r, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = 0; /* the result of the cancel itself is ignored */
+    return true;
+}
+
+int uring_submit(struct uring *r) {
+    unsigned int n = r->sq_queued;
+    int ret;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->sq_queued = 0;
+    do {
+        ret = sys_io_uring_enter(r->fd, n, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+unsigned int uring_reap(struct uring *r, uring_completion_cb cb, void *arg) {
+    unsigned int head = *r->cq_head;
+    unsigned int tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned int count = 0;
+    eventfd_t dummy;
+
+    /* Reset the eventfd first, so completions arriving later signal it */
+    (void)eventfd_read(r->efd, &dummy);
+
+    while (head != tail) {
+        for (; head != tail; ++head, ++count) {
+            struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+            int bid = -1;
+
+            if (cqe->user_data == 0) {
+                continue;
+            }
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                bid = (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                r->bufs[bid].len = cqe->res > 0 ? (uint32_t)cqe->res : 0;
+                r->bufs[bid].offset = 0;
+                r->bufs[bid].next = -1;
+            }
+            cb(arg, cqe->user_data, cqe->res, bid,
+               (cqe->flags & IORING_CQE_F_MORE) != 0);
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    }
+    return count;
+}
+
+struct uring_buf *uring_get_buf(struct uring *r, int bid) {
+    return &r->bufs[bid];
+}
+
+void uring_recycle(struct uring *r, int bid) {
+    provide_buf(r, bid);
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,78 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * A minimal io_uring wrapper (using the raw system calls) for the worker
+ * threads' socket reads. Each ring has a ring of provided buffers the
+ * kernel picks from for multishot receives, and signals completions on an
+ * eventfd which is watched by the thread's libevent loop.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef HAVE_IO_URING
+
+struct uring;
+
+/* A provided buffer, and its place in the list of data queued for a conn */
+struct uring_buf {
+    char *data;
+    uint32_t len;     /* bytes received into it */
+    uint32_t offset;  /* bytes consumed so far */
+    int next;         /* next buffer id in the list, or -1 */
+};
+
+/*
+ * Called for every completion. For the receives, res is the number of
+ * bytes received into buffer bid (or a negative errno, 0 for EOF, and bid
+ * is -1 if no buffer was used), and more tells if the receive stays armed.
+ */
+typedef void (*uring_completion_cb)(void *arg, uint64_t user_data, int res,
+                                    int bid, bool more);
+
+/*
+ * Create a ring with room for entries submissions, and nbufs provided
+ * buffers (a power of two) of bufsize bytes. Returns NULL on failure
+ * (with errno set).
+ */
+struct uring *uring_create(unsigned int entries, unsigned int nbufs,
+                           unsigned int bufsize);
+void uring_destroy(struct uring *r);
+
+/* The eventfd becoming readable when completions are available */
+int uring_eventfd(struct uring *r);
+
+/*
+ * Queue a multishot receive on fd, completing with user_data (which must
+ * not be 0), or a cancellation of the requests with user_data. Nothing is
+ * sent to the kernel before uring_submit(). Returns false if the
+ * submission queue is full (and couldn't be submitted).
+ */
+bool uring_recv_multishot(struct uring *r, int fd, uint64_t user_data);
+bool uring_cancel(struct uring *r, uint64_t user_data);
+
+/* Submit all queued requests with a single system call */
+int uring_submit(struct uring *r);
+
+/* Run cb for all available completions, returns the number of them */
+unsigned int uring_reap(struct uring *r, uring_completion_cb cb, void *arg);
+
+/* Access a provided buffer, and give it back to the kernel once consumed */
+struct uring_buf *uring_get_buf(struct uring *r, int bid);
+void uring_recycle(struct uring *r, int bid);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
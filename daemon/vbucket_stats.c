@@ -0,0 +1,302 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The owning thread stores every counter with a relaxed atomic store
+ * (of its own plain read plus the amount), and the readers load them
+ * relaxed: a reader may miss the last few commands of a thread, but never
+ * sees a torn counter, and the thread never waits for it.
+ */
+#include "config.h"
+#include "vbucket_stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct vbucket_counters {
+    /* The vbuckets counted one by one, traffic[count] is the others */
+    uint32_t count;
+    vbucket_traffic_t traffic[];
+};
+
+/*
+ * The totals "stats hot_vbuckets" last saw, the next call returns the
+ * traffic since then
+ */
+static struct {
+    cb_mutex_t mutex;
+    vbucket_traffic_t *previous;
+    hrtime_t taken;
+} hot_vbuckets;
+
+void vbucket_stats_init(void) {
+    cb_mutex_initialize(&hot_vbuckets.mutex);
+    hot_vbuckets.previous = NULL;
+    hot_vbuckets.taken = gethrtime();
+}
+
+struct vbucket_counters *vbucket_counters_create(void) {
+    struct vbucket_counters *counters;
+    uint32_t count = settings.vbucket_stats;
+
+    if (count == 0) {
+        return NULL;
+    }
+    counters = calloc(1, sizeof(*counters) +
+                      (count + 1) * sizeof(vbucket_traffic_t));
+    if (counters != NULL) {
+        counters->count = count;
+    }
+    return counters;
+}
+
+void vbucket_counters_destroy(struct vbucket_counters *counters) {
+    free(counters);
+}
+
+typedef enum {
+    VBUCKET_OP_NONE,
+    VBUCKET_OP_READ,
+    VBUCKET_OP_WRITE
+} vbucket_op_t;
+
+/*
+ * The commands on a document count for the vbucket of the request, the
+ * others (stats, ioctl, sasl...) may have a key but no vbucket
+ */
+static vbucket_op_t vbucket_op(uint8_t opcode) {
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+    case PROTOCOL_BINARY_CMD_GET_RANGE:
+    case PROTOCOL_BINARY_CMD_GET_REPLICA:
+    case PROTOCOL_BINARY_CMD_GET_LOCKED:
+    case PROTOCOL_BINARY_CMD_SUBDOC_GET:
+    case PROTOCOL_BINARY_CMD_SUBDOC_EXISTS:
+    case PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP:
+        return VBUCKET_OP_READ;
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+    case PROTOCOL_BINARY_CMD_TOUCH:
+    case PROTOCOL_BINARY_CMD_GAT:
+    case PROTOCOL_BINARY_CMD_GATQ:
+    case PROTOCOL_BINARY_CMD_UNLOCK_KEY:
+        return VBUCKET_OP_WRITE;
+    default:
+        if (opcode >= PROTOCOL_BINARY_CMD_SUBDOC_DICT_ADD &&
+            opcode <= PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION) {
+            return VBUCKET_OP_WRITE;
+        }
+        return VBUCKET_OP_NONE;
+    }
+}
+
+static void counter_add(uint64_t *counter, uint64_t amount) {
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+static uint64_t counter_get(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void vbucket_counters_record(struct vbucket_counters *counters, conn *c) {
+    const protocol_binary_request_header *req = &c->binary_header;
+    vbucket_traffic_t *traffic;
+    vbucket_op_t op;
+    uint64_t bytes;
+
+    if (counters == NULL || (op = vbucket_op(c->cmd)) == VBUCKET_OP_NONE) {
+        return;
+    }
+
+    if (req->request.vbucket < counters->count) {
+        traffic = &counters->traffic[req->request.vbucket];
+    } else {
+        traffic = &counters->traffic[counters->count];
+    }
+    bytes = (uint64_t)req->request.bodylen + c->rsp_bodylen;
+    if (op == VBUCKET_OP_READ) {
+        counter_add(&traffic->read_ops, 1);
+        counter_add(&traffic->read_bytes, bytes);
+    } else {
+        counter_add(&traffic->write_ops, 1);
+        counter_add(&traffic->write_bytes, bytes);
+    }
+}
+
+void vbucket_counters_aggregate(const struct vbucket_counters *counters,
+                                vbucket_traffic_t *totals) {
+    uint32_t ii;
+
+    if (counters == NULL) {
+        return;
+    }
+    for (ii = 0; ii <= counters->count; ++ii) {
+        const vbucket_traffic_t *traffic = &counters->traffic[ii];
+        totals[ii].read_ops += counter_get(&traffic->read_ops);
+        totals[ii].read_bytes += counter_get(&traffic->read_bytes);
+        totals[ii].write_ops += counter_get(&traffic->write_ops);
+        totals[ii].write_bytes += counter_get(&traffic->write_bytes);
+    }
+}
+
+static vbucket_traffic_t *vbucket_traffic_totals(void) {
+    vbucket_traffic_t *totals;
+
+    if (settings.vbucket_stats == 0) {
+        return NULL;
+    }
+    totals = calloc(settings.vbucket_stats + 1, sizeof(*totals));
+    if (totals != NULL) {
+        thread_vbucket_traffic(totals);
+    }
+    return totals;
+}
+
+static uint64_t traffic_ops(const vbucket_traffic_t *traffic) {
+    return traffic->read_ops + traffic->write_ops;
+}
+
+static void add_traffic_stats(ADD_STAT add_stats, conn *c, const char *name,
+                              const vbucket_traffic_t *traffic) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen, vlen;
+
+    APPEND_NUM_FMT_STAT("%s:%s", name, "read_ops", "%" PRIu64,
+                        traffic->read_ops);
+    APPEND_NUM_FMT_STAT("%s:%s", name, "read_bytes", "%" PRIu64,
+                        traffic->read_bytes);
+    APPEND_NUM_FMT_STAT("%s:%s", name, "write_ops", "%" PRIu64,
+                        traffic->write_ops);
+    APPEND_NUM_FMT_STAT("%s:%s", name, "write_bytes", "%" PRIu64,
+                        traffic->write_bytes);
+}
+
+void vbucket_traffic_stats(ADD_STAT add_stats, conn *c) {
+    vbucket_traffic_t *totals = vbucket_traffic_totals();
+    uint32_t ii;
+
+    if (totals == NULL) {
+        return;
+    }
+    for (ii = 0; ii <= settings.vbucket_stats; ++ii) {
+        char name[16];
+        if (traffic_ops(&totals[ii]) == 0) {
+            continue;
+        }
+        if (ii == settings.vbucket_stats) {
+            strcpy(name, "vb_other");
+        } else {
+            snprintf(name, sizeof(name), "vb_%u", ii);
+        }
+        add_traffic_stats(add_stats, c, name, &totals[ii]);
+    }
+    free(totals);
+}
+
+void hot_vbucket_stats(ADD_STAT add_stats, conn *c, int count) {
+    vbucket_traffic_t *totals;
+    uint32_t nvbuckets = settings.vbucket_stats;
+    uint32_t hot[HOT_VBUCKETS_MAX];
+    uint32_t active = 0;
+    uint64_t ops = 0;
+    int nhot = 0;
+    hrtime_t now, interval;
+    uint32_t ii;
+    int jj;
+
+    if (nvbuckets == 0) {
+        return;
+    }
+    if (count <= 0) {
+        count = HOT_VBUCKETS_DEFAULT;
+    } else if (count > HOT_VBUCKETS_MAX) {
+        count = HOT_VBUCKETS_MAX;
+    }
+
+    /*
+     * Turn the totals into the traffic since the previous call. They're
+     * summed up with the mutex held, so the calls see them in order
+     */
+    cb_mutex_enter(&hot_vbuckets.mutex);
+    if (hot_vbuckets.previous == NULL) {
+        hot_vbuckets.previous = calloc(nvbuckets + 1,
+                                       sizeof(vbucket_traffic_t));
+    }
+    if (hot_vbuckets.previous == NULL ||
+        (totals = vbucket_traffic_totals()) == NULL) {
+        cb_mutex_exit(&hot_vbuckets.mutex);
+        return;
+    }
+    now = gethrtime();
+    interval = now - hot_vbuckets.taken;
+    hot_vbuckets.taken = now;
+    for (ii = 0; ii <= nvbuckets; ++ii) {
+        vbucket_traffic_t *previous = &hot_vbuckets.previous[ii];
+        vbucket_traffic_t current = totals[ii];
+        totals[ii].read_ops -= previous->read_ops;
+        totals[ii].read_bytes -= previous->read_bytes;
+        totals[ii].write_ops -= previous->write_ops;
+        totals[ii].write_bytes -= previous->write_bytes;
+        *previous = current;
+    }
+    cb_mutex_exit(&hot_vbuckets.mutex);
+
+    /* Keep the count busiest ones, the busiest first */
+    for (ii = 0; ii < nvbuckets; ++ii) {
+        uint64_t vbops = traffic_ops(&totals[ii]);
+        if (vbops == 0) {
+            continue;
+        }
+        ++active;
+        ops += vbops;
+        if (nhot == count && vbops <= traffic_ops(&totals[hot[nhot - 1]])) {
+            continue;
+        }
+        jj = nhot < count ? nhot++ : nhot - 1;
+        for (; jj > 0 && traffic_ops(&totals[hot[jj - 1]]) < vbops; --jj) {
+            hot[jj] = hot[jj - 1];
+        }
+        hot[jj] = ii;
+    }
+
+    APPEND_STAT("hot_vbuckets:interval_ms", "%" PRIu64,
+                (uint64_t)(interval / 1000000));
+    APPEND_STAT("hot_vbuckets:ops", "%" PRIu64, ops);
+    APPEND_STAT("hot_vbuckets:active", "%u", active);
+    APPEND_STAT("hot_vbuckets:other_ops", "%" PRIu64,
+                traffic_ops(&totals[nvbuckets]));
+    for (jj = 0; jj < nhot; ++jj) {
+        const vbucket_traffic_t *traffic = &totals[hot[jj]];
+        uint64_t vbops = traffic_ops(traffic);
+        char key_str[STAT_KEY_LEN];
+        char val_str[STAT_VAL_LEN];
+        char name[32];
+        int klen, vlen;
+
+        snprintf(name, sizeof(name), "hot_vbucket_%d", jj);
+        APPEND_NUM_FMT_STAT("%s:%s", name, "vbucket", "%u", hot[jj]);
+        add_traffic_stats(add_stats, c, name, traffic);
+        /* Its part of all the operations, and how many times the mean */
+        APPEND_NUM_FMT_STAT("%s:%s", name, "share", "%.2f",
+                            100.0 * vbops / ops);
+        APPEND_NUM_FMT_STAT("%s:%s", name, "load", "%.2f",
+                            (double)vbops * active / ops);
+    }
+    free(totals);
+}
@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The traffic of each vbucket: every worker thread counts the reads and
+ * the writes of the commands on a document, and the bytes of their
+ * requests and responses, by the vbucket of the request. Only the owning thread
+ * writes its counters, so they are bumped without a lock or an atomic
+ * read-modify-write; the stats calls sum them up over the threads.
+ *
+ * "stats vbucket_traffic" returns the totals of the vbuckets with any
+ * traffic, "stats hot_vbuckets [n]" the n vbuckets with the most
+ * operations since the previous "stats hot_vbuckets" (so a cluster
+ * manager polling it sees where the load is now, not where it was).
+ */
+
+#ifndef VBUCKET_STATS_H
+#define VBUCKET_STATS_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The range and the default of the vbucket_stats setting */
+#define VBUCKET_STATS_MAX 65536
+#define VBUCKET_STATS_DEFAULT 1024
+
+/* The vbuckets "stats hot_vbuckets" returns by default, and at most */
+#define HOT_VBUCKETS_DEFAULT 10
+#define HOT_VBUCKETS_MAX 128
+
+typedef struct {
+    uint64_t read_ops;
+    uint64_t read_bytes;
+    uint64_t write_ops;
+    uint64_t write_bytes;
+} vbucket_traffic_t;
+
+void vbucket_stats_init(void);
+
+/*
+ * The counters of a thread for the first settings.vbucket_stats vbuckets
+ * (the higher ones are counted together, as "other"). NULL if the
+ * setting is 0.
+ */
+struct vbucket_counters *vbucket_counters_create(void);
+void vbucket_counters_destroy(struct vbucket_counters *counters);
+
+/*
+ * Count the command of the connection, which is done (its response, if
+ * any, is built). Only called by the thread owning the counters.
+ */
+void vbucket_counters_record(struct vbucket_counters *counters, conn *c);
+
+/*
+ * Add the counters to totals, which has room for settings.vbucket_stats
+ * + 1 entries (the last for "other").
+ */
+void vbucket_counters_aggregate(const struct vbucket_counters *counters,
+                                vbucket_traffic_t *totals);
+
+/* Sum up the counters of all the threads into totals (see thread.c) */
+void thread_vbucket_traffic(vbucket_traffic_t *totals);
+
+void vbucket_traffic_stats(ADD_STAT add_stats, conn *c);
+void hot_vbucket_stats(ADD_STAT add_stats, conn *c, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
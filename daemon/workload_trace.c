@@ -0,0 +1,178 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The file is written through a MAP_SHARED mapping, so the records reach
+ * it without a system call per request, and what was captured is still
+ * there when the server stops (or crashes). Each start of the server
+ * truncates the files of the previous run.
+ */
+#include "config.h"
+#include "workload_trace.h"
+#include "hash.h"
+
+#include <memcached/workload_trace.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+struct workload_trace {
+    workload_trace_header_t *header;
+    workload_trace_record_t *records;
+    size_t size;
+};
+
+#ifndef WIN32
+struct workload_trace *workload_trace_open(int thread) {
+    struct workload_trace *trace;
+    char path[PATH_MAX];
+    size_t size = (size_t)settings.workload_trace_file_size;
+    struct timeval tv;
+    void *ptr;
+    int fd;
+
+    if (settings.workload_trace_dir == NULL) {
+        return NULL;
+    }
+
+    snprintf(path, sizeof(path), "%s/trace.%d", settings.workload_trace_dir,
+             thread);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1 || ftruncate(fd, (off_t)size) != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Failed to create the trace file %s: %s\n", path,
+            strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Failed to map the trace file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if ((trace = calloc(1, sizeof(*trace))) == NULL) {
+        munmap(ptr, size);
+        return NULL;
+    }
+    trace->header = ptr;
+    trace->records = (workload_trace_record_t*)(trace->header + 1);
+    trace->size = size;
+
+    gettimeofday(&tv, NULL);
+    trace->header->magic = WORKLOAD_TRACE_MAGIC;
+    trace->header->version = WORKLOAD_TRACE_VERSION;
+    trace->header->record_size = sizeof(workload_trace_record_t);
+    trace->header->capacity = (size - sizeof(workload_trace_header_t)) /
+        sizeof(workload_trace_record_t);
+    trace->header->written = 0;
+    trace->header->start_ns = gethrtime();
+    trace->header->start_usec = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    return trace;
+}
+
+void workload_trace_close(struct workload_trace *trace) {
+    if (trace != NULL) {
+        msync(trace->header, trace->size, MS_ASYNC);
+        munmap(trace->header, trace->size);
+        free(trace);
+    }
+}
+#else
+struct workload_trace *workload_trace_open(int thread) {
+    (void)thread;
+    if (settings.workload_trace_dir != NULL && thread == 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "The trace capture is not supported on this platform\n");
+    }
+    return NULL;
+}
+
+void workload_trace_close(struct workload_trace *trace) {
+    (void)trace;
+}
+#endif
+
+/* The TTL in the extras of the commands which have one */
+static uint32_t workload_trace_exptime(uint8_t opcode, const char *extras,
+                                       uint8_t extlen) {
+    size_t offset;
+    uint32_t exptime;
+
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+        offset = 4;
+        break;
+    case PROTOCOL_BINARY_CMD_TOUCH:
+    case PROTOCOL_BINARY_CMD_GAT:
+    case PROTOCOL_BINARY_CMD_GATQ:
+        offset = 0;
+        break;
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+        offset = 16;
+        break;
+    default:
+        return 0;
+    }
+    if (extlen < offset + sizeof(exptime)) {
+        return 0;
+    }
+    memcpy(&exptime, extras + offset, sizeof(exptime));
+    return ntohl(exptime);
+}
+
+void workload_trace_record(struct workload_trace *trace, conn *c,
+                           const char *packet) {
+    const protocol_binary_request_header *req = &c->binary_header;
+    const char *extras = packet + sizeof(*req);
+    const char *key = extras + req->request.extlen;
+    uint16_t nkey = req->request.keylen;
+    uint32_t sample = settings.workload_trace_sample;
+    workload_trace_header_t *header = trace->header;
+    workload_trace_record_t *record;
+    uint32_t hv;
+    hrtime_t now;
+
+    if (nkey == 0 || sample == 0) {
+        return;
+    }
+    hv = hash(key, nkey, 0);
+    if (hv % sample != 0) {
+        return;
+    }
+
+    now = thread_clock(c->thread);
+    record = &trace->records[header->written % header->capacity];
+    record->time_ns = now > header->start_ns ? now - header->start_ns : 0;
+    record->key = ((uint64_t)hash(key, nkey, hv) << 32) | hv;
+    record->nvalue = req->request.bodylen - nkey - req->request.extlen;
+    record->exptime = workload_trace_exptime(req->request.opcode, extras,
+                                              req->request.extlen);
+    record->nkey = nkey;
+    record->vbucket = req->request.vbucket;
+    record->opcode = req->request.opcode;
+    memset(record->reserved, 0, sizeof(record->reserved));
+    header->sample = sample;
+
+    /* A reader of the file must not count the record before it's there */
+    __atomic_store_n(&header->written, header->written + 1,
+                     __ATOMIC_RELEASE);
+}
+
+uint64_t workload_trace_written(const struct workload_trace *trace) {
+    return trace == NULL ? 0 :
+        __atomic_load_n(&trace->header->written, __ATOMIC_RELAXED);
+}
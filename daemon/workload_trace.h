@@ -0,0 +1,49 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The request trace capture of the worker threads: the requests for a
+ * sample of the keys go to a ring file of each thread (see
+ * <memcached/workload_trace.h> for the format), which mcreplay replays.
+ * The thread writes its file through a shared mapping without taking
+ * any lock, so a traced request costs a hash of its key and 32 bytes of
+ * memory writes, and the others only the hash.
+ */
+
+#ifndef WORKLOAD_TRACE_H
+#define WORKLOAD_TRACE_H
+
+#include "config.h"
+
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The smallest and the default workload_trace_file_size */
+#define WORKLOAD_TRACE_MIN_FILE_SIZE (1024 * 1024)
+#define WORKLOAD_TRACE_DEFAULT_FILE_SIZE (64 * 1024 * 1024)
+
+/*
+ * Create (or start over) the trace file of the thread in
+ * settings.workload_trace_dir. NULL if there is no workload_trace_dir, or
+ * if the file can't be mapped (which is logged).
+ */
+struct workload_trace *workload_trace_open(int thread);
+void workload_trace_close(struct workload_trace *trace);
+
+/*
+ * Record the request (the packet starts with the header of the
+ * connection's binary_header) if its key is sampled. Only called by the
+ * thread owning the trace, with settings.workload_trace_sample set.
+ */
+void workload_trace_record(struct workload_trace *trace, conn *c,
+                           const char *packet);
+
+/* The number of records written since the file was created */
+uint64_t workload_trace_written(const struct workload_trace *trace);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
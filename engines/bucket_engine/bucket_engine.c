@@ -7,6 +7,8 @@
 #include <unistd.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <inttypes.h>
 
 #include <memcached/engine.h>
 #include <platform/platform.h>
@@ -37,6 +39,12 @@ static int ATOMIC_CAS(volatile bucket_state_t *dest, int prev, int next) {
     return old == prev;
 }
 
+static int64_t ATOMIC_ADD64(volatile int64_t *dest, int64_t value) {
+    return InterlockedExchangeAdd64((LONGLONG*)dest, value) + value;
+}
+
+#define THREAD_LOCAL __declspec(thread)
+
 #elif defined(__SUNPRO_C)
 #include <atomic.h>
 static inline int ATOMIC_ADD(volatile int *dest, int value) {
@@ -55,14 +63,109 @@ static inline int ATOMIC_CAS(volatile bucket_state_t *dest, int prev, int next)
     return (prev == atomic_cas_uint((volatile uint_t*)dest, (uint_t)prev,
                                     (uint_t)next));
 }
+
+static inline int64_t ATOMIC_ADD64(volatile int64_t *dest, int64_t value) {
+    return atomic_add_64_nv((volatile uint64_t *)dest, value);
+}
+
+#define THREAD_LOCAL __thread
 #else
 #define ATOMIC_ADD(i, by) __sync_add_and_fetch(i, by)
 #define ATOMIC_INCR(i) ATOMIC_ADD(i, 1)
 #define ATOMIC_DECR(i) ATOMIC_ADD(i, -1)
 #define ATOMIC_CAS(ptr, oldval, newval) \
             __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define ATOMIC_ADD64(i, by) __sync_add_and_fetch(i, by)
+/* initial-exec, so getting at them never allocates (from a malloc hook) */
+#define THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
 #endif
 
+/*
+ * Every call into a bucket bumps its clients count on the way in and out,
+ * from all of the worker threads. So they don't all fight over the same
+ * cache line the count is spread over a few slots: a thread always uses
+ * the slot its id hashes to (a call enters and leaves the bucket on the
+ * same thread), and only the check for the last client to leave a bucket
+ * being shut down has to add them all up.
+ */
+static unsigned int thread_slot(void) {
+    uint64_t id = (unsigned long)cb_thread_self();
+    unsigned int slot = (unsigned int)((id * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+    return slot % BUCKET_CLIENT_SLOTS;
+}
+
+static volatile int *client_slot(proxied_engine_handle_t *peh) {
+    return &peh->clients[thread_slot()].count;
+}
+
+static int count_clients(const proxied_engine_handle_t *peh) {
+    int count = 0;
+    int ii;
+    for (ii = 0; ii < BUCKET_CLIENT_SLOTS; ++ii) {
+        count += peh->clients[ii].count;
+    }
+    return count;
+}
+
+/*
+ * With mem_tracking the allocator hooks charge what a thread allocates
+ * and frees to the bucket it is calling into (set on the way in by
+ * get_engine_handle, and cleared on the way out). The hooks only add to
+ * a thread-local delta, which goes to the bucket's count when it grows
+ * past MEM_FLUSH_BYTES or when the thread leaves the bucket; the count is
+ * spread over the same per-thread slots as the clients count.
+ */
+#define MEM_FLUSH_BYTES (64 * 1024)
+
+/* The bucket shutdowns running at once on the executor of the server */
+#define BUCKET_SHUTDOWN_TASKS 2
+
+static THREAD_LOCAL proxied_engine_handle_t *mem_bucket;
+static THREAD_LOCAL int mem_depth;
+static THREAD_LOCAL int64_t mem_delta;
+
+static void mem_flush(void) {
+    if (mem_delta != 0) {
+        ATOMIC_ADD64(&mem_bucket->mem_used[thread_slot()].bytes, mem_delta);
+        mem_delta = 0;
+    }
+}
+
+static void mem_new_hook(const void *ptr, size_t size) {
+    (void)ptr;
+    if (mem_bucket != NULL) {
+        mem_delta += (int64_t)size;
+        if (mem_delta >= MEM_FLUSH_BYTES) {
+            mem_flush();
+        }
+    }
+}
+
+static void mem_delete_hook(const void *ptr);
+
+/* Calls into a bucket from one already in a bucket are charged to it */
+static void mem_enter(proxied_engine_handle_t *peh) {
+    if (mem_depth++ == 0) {
+        mem_bucket = peh;
+    }
+}
+
+static void mem_leave(void) {
+    if (--mem_depth == 0) {
+        mem_flush();
+        mem_bucket = NULL;
+    }
+}
+
+static int64_t count_mem_used(const proxied_engine_handle_t *peh) {
+    int64_t used = 0;
+    int ii;
+    for (ii = 0; ii < BUCKET_CLIENT_SLOTS; ++ii) {
+        used += peh->mem_used[ii].bytes;
+    }
+    return used;
+}
+
 static ENGINE_ERROR_CODE (*upstream_reserve_cookie)(const void *cookie);
 static ENGINE_ERROR_CODE (*upstream_release_cookie)(const void *cookie);
 static ENGINE_ERROR_CODE bucket_engine_reserve_cookie(const void *cookie);
@@ -108,12 +211,26 @@ static ENGINE_ERROR_CODE bucket_item_delete(ENGINE_HANDLE* handle,
 static void bucket_item_release(ENGINE_HANDLE* handle,
                                 const void *cookie,
                                 item* item);
+static void bucket_item_release_multi(ENGINE_HANDLE* handle,
+                                      const void *cookie,
+                                      item **items,
+                                      size_t nitems);
 static ENGINE_ERROR_CODE bucket_get(ENGINE_HANDLE* handle,
                                     const void* cookie,
                                     item** item,
                                     const void* key,
                                     const int nkey,
                                     uint16_t vbucket);
+static ENGINE_ERROR_CODE bucket_get_multi(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          item_get_request *requests,
+                                          size_t nrequests);
+static void bucket_prefetch(ENGINE_HANDLE* handle,
+                            const void* cookie,
+                            const void* key,
+                            const int nkey,
+                            uint16_t vbucket,
+                            ENGINE_PREFETCH_STAGE stage);
 static ENGINE_ERROR_CODE bucket_get_stats(ENGINE_HANDLE* handle,
                                           const void *cookie,
                                           const char *stat_key,
@@ -132,6 +249,19 @@ static ENGINE_ERROR_CODE bucket_store(ENGINE_HANDLE* handle,
                                       uint64_t *cas,
                                       ENGINE_STORE_OPERATION operation,
                                       uint16_t vbucket);
+static ENGINE_ERROR_CODE bucket_store_multi(ENGINE_HANDLE* handle,
+                                            const void *cookie,
+                                            item_store_request *requests,
+                                            size_t nrequests);
+static ENGINE_ERROR_CODE bucket_splice(ENGINE_HANDLE* handle,
+                                       const void *cookie,
+                                       item* item,
+                                       uint64_t *cas,
+                                       size_t offset,
+                                       size_t length,
+                                       const void *data,
+                                       size_t ndata,
+                                       uint16_t vbucket);
 static ENGINE_ERROR_CODE bucket_arithmetic(ENGINE_HANDLE* handle,
                                            const void* cookie,
                                            const void* key,
@@ -159,6 +289,17 @@ static bool bucket_get_item_info(ENGINE_HANDLE *handle,
                                  const item* item,
                                  item_info *item_info);
 
+static bool bucket_get_item_view(ENGINE_HANDLE *handle,
+                                 const void *cookie,
+                                 const item* item,
+                                 item_view *item_view);
+
+static bool bucket_get_item_segment(ENGINE_HANDLE *handle,
+                                    const void *cookie,
+                                    const item* item,
+                                    uint16_t index,
+                                    struct iovec *segment);
+
 static bool bucket_set_item_info(ENGINE_HANDLE *handle,
                                  const void *cookie,
                                  item* item,
@@ -320,6 +461,10 @@ static ENGINE_ERROR_CODE bucket_get_engine_vb_map(ENGINE_HANDLE* handle,
                                                   const void * cookie,
                                                   engine_get_vb_map_cb callback);
 
+static bool bucket_bind_engine(ENGINE_HANDLE* handle,
+                               const void *cookie,
+                               engine_binding_t *binding);
+
 static bool is_authorized(ENGINE_HANDLE* handle, const void* cookie);
 
 static void free_engine_handle(proxied_engine_handle_t *);
@@ -333,6 +478,16 @@ static void maybe_start_engine_shutdown(proxied_engine_handle_t *e);
  * This is the one and only instance of the bucket engine.
  */
 struct bucket_engine bucket_engine;
+static void mem_delete_hook(const void *ptr) {
+    if (mem_bucket != NULL && ptr != NULL) {
+        ALLOCATOR_HOOKS_API *hooks = bucket_engine.upstream_server->alloc_hooks;
+        mem_delta -= (int64_t)hooks->get_allocation_size(ptr);
+        if (mem_delta <= -MEM_FLUSH_BYTES) {
+            mem_flush();
+        }
+    }
+}
+
 /**
  * To help us detect if we're using free'd memory, let's write a
  * pattern to the memory before releasing it. That makes it more easy
@@ -371,6 +526,7 @@ static const char * bucket_state_name(bucket_state_t s) {
     const char * rv = NULL;
     switch(s) {
     case STATE_NULL: rv = "NULL"; break;
+    case STATE_CREATING: rv = "creating"; break;
     case STATE_RUNNING: rv = "running"; break;
     case STATE_STOPPING: rv = "stopping"; break;
     case STATE_STOPPED: rv = "stopped"; break;
@@ -579,8 +735,13 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
     bucket_engine.engine.allocate = bucket_item_allocate;
     bucket_engine.engine.remove = bucket_item_delete;
     bucket_engine.engine.release = bucket_item_release;
+    bucket_engine.engine.release_multi = bucket_item_release_multi;
     bucket_engine.engine.get = bucket_get;
+    bucket_engine.engine.get_multi = bucket_get_multi;
+    bucket_engine.engine.prefetch = bucket_prefetch;
     bucket_engine.engine.store = bucket_store;
+    bucket_engine.engine.store_multi = bucket_store_multi;
+    bucket_engine.engine.splice = bucket_splice;
     bucket_engine.engine.arithmetic = bucket_arithmetic;
     bucket_engine.engine.flush = bucket_flush;
     bucket_engine.engine.get_stats = bucket_get_stats;
@@ -592,8 +753,11 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
     bucket_engine.engine.get_tap_iterator = bucket_get_tap_iterator;
     bucket_engine.engine.item_set_cas = bucket_item_set_cas;
     bucket_engine.engine.get_item_info = bucket_get_item_info;
+    bucket_engine.engine.get_item_view = bucket_get_item_view;
+    bucket_engine.engine.get_item_segment = bucket_get_item_segment;
     bucket_engine.engine.set_item_info = bucket_set_item_info;
     bucket_engine.engine.get_engine_vb_map = bucket_get_engine_vb_map;
+    bucket_engine.engine.bind_engine = bucket_bind_engine;
     bucket_engine.engine.dcp.step = dcp_step;
     bucket_engine.engine.dcp.open = dcp_open;
     bucket_engine.engine.dcp.add_stream = dcp_add_stream;
@@ -626,6 +790,11 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
     bucket_engine.upstream_server = gsapi();
     bucket_engine.server = *bucket_engine.upstream_server;
     bucket_engine.get_server_api = bucket_get_server_api;
+    if (bucket_engine.upstream_server->executor != NULL) {
+        /* Leave the executor to the buckets while many are deleted */
+        bucket_engine.upstream_server->executor->set_limit(&bucket_engine,
+                                                           BUCKET_SHUTDOWN_TASKS);
+    }
 
     /* Use our own callback API for inferior engines */
     bucket_engine.callback_api.register_callback = bucket_register_callback;
@@ -705,6 +874,130 @@ static proxied_engine_handle_t* retain_handle(proxied_engine_handle_t *peh) {
     return rv;
 }
 
+static size_t snapshot_index(const bucket_snapshot_t *snap,
+                             unsigned int hash) {
+    return (hash * 0x9E3779B1u) & snap->mask;
+}
+
+static void snapshot_add(const void *key, size_t nkey,
+                         const void *val, size_t nval,
+                         void *arg) {
+    bucket_snapshot_t *snap = arg;
+    unsigned int hash = (unsigned int)genhash_string_hash(key, nkey);
+    size_t n = snapshot_index(snap, hash);
+    (void)nval;
+
+    while (snap->entries[n].peh != NULL) {
+        n = (n + 1) & snap->mask;
+    }
+    snap->entries[n].hash = hash;
+    snap->entries[n].peh = (proxied_engine_handle_t *)val;
+}
+
+static int count_snapshot_readers(int parity) {
+    int count = 0;
+    int ii;
+    for (ii = 0; ii < BUCKET_CLIENT_SLOTS; ++ii) {
+        count += bucket_engine.snapshot_readers[parity][ii].count;
+    }
+    return count;
+}
+
+/**
+ * Replace the snapshot find_bucket uses with a copy of the engines
+ * table as it is now. This waits for the readers which may still be
+ * looking at the old copy (they never block, so that's quick) before
+ * freeing it, so once this returns nobody can get to a bucket which
+ * was removed from the table without holding a reference to it.
+ *
+ * You must wrap this call with (un)lock_engines(), and call it after
+ * every change to the engines table.
+ */
+static void publish_snapshot_UNLOCKED(void) {
+    bucket_snapshot_t *old = bucket_engine.snapshot;
+    bucket_snapshot_t *snap;
+    size_t size = 2;
+    int parity;
+
+    while (size < 2 * (size_t)genhash_size(bucket_engine.engines)) {
+        size <<= 1;
+    }
+    snap = calloc(1, sizeof(*snap) + size * sizeof(bucket_snapshot_entry_t));
+    if (snap != NULL) {
+        snap->mask = size - 1;
+        snap->entries = (bucket_snapshot_entry_t *)(snap + 1);
+        genhash_iter(bucket_engine.engines, snapshot_add, snap);
+    }
+    /* Without memory for a copy find_bucket falls back to the lock */
+    bucket_engine.snapshot = snap;
+
+    /* The new readers go in the other count, so this one drains */
+    parity = ATOMIC_INCR(&bucket_engine.snapshot_gen) - 1;
+    while (count_snapshot_readers(parity & 1) != 0) {
+#ifdef WIN32
+        Sleep(0);
+#else
+        usleep(1);
+#endif
+    }
+    free(old);
+}
+
+/**
+ * Count ourself in as a reader of the current snapshot, so it (and the
+ * buckets in it) isn't freed until snapshot_leave() is called with the
+ * returned counter.
+ */
+static volatile int *snapshot_enter(void) {
+    volatile int *readers;
+    unsigned int slot = thread_slot();
+    int gen;
+
+    /* If a new one was published meanwhile the writer may not have
+     * seen us */
+    for (;;) {
+        gen = bucket_engine.snapshot_gen;
+        readers = &bucket_engine.snapshot_readers[gen & 1][slot].count;
+        ATOMIC_INCR(readers);
+        if (gen == bucket_engine.snapshot_gen) {
+            return readers;
+        }
+        ATOMIC_DECR(readers);
+    }
+}
+
+static void snapshot_leave(volatile int *readers) {
+    ATOMIC_DECR(readers);
+}
+
+/**
+ * Look up a bucket in the snapshot of the engines table, and retain it
+ * (see retain_handle). Returns false if there is no snapshot to look in.
+ */
+static bool find_bucket_snapshot(const char *name,
+                                 proxied_engine_handle_t **peh) {
+    volatile int *readers = snapshot_enter();
+    bucket_snapshot_t *snap;
+    size_t nkey = strlen(name);
+    unsigned int hash = (unsigned int)genhash_string_hash(name, nkey);
+
+    *peh = NULL;
+    snap = bucket_engine.snapshot;
+    if (snap != NULL) {
+        size_t n = snapshot_index(snap, hash);
+        for (; snap->entries[n].peh != NULL; n = (n + 1) & snap->mask) {
+            proxied_engine_handle_t *p = snap->entries[n].peh;
+            if (snap->entries[n].hash == hash && p->name_len == nkey &&
+                memcmp(p->name, name, nkey) == 0) {
+                *peh = retain_handle(p);
+                break;
+            }
+        }
+    }
+    snapshot_leave(readers);
+    return snap != NULL;
+}
+
 /**
  * Search the list of buckets for a named bucket. If the bucket
  * exists and is in a runnable state, it's reference count is
@@ -713,6 +1006,9 @@ static proxied_engine_handle_t* retain_handle(proxied_engine_handle_t *peh) {
 */
 static proxied_engine_handle_t *find_bucket(const char *name) {
     proxied_engine_handle_t *rv;
+    if (find_bucket_snapshot(name, &rv)) {
+        return rv;
+    }
     lock_engines();
     rv = retain_handle(find_bucket_inner(name));
     unlock_engines();
@@ -741,11 +1037,11 @@ static ENGINE_ERROR_CODE init_engine_handle(proxied_engine_handle_t *peh,
         return ENGINE_ENOMEM;
     }
     if (bucket_engine.topkeys != 0) {
-        int i;
-        peh->topkeys = calloc(TK_SHARDS, sizeof(topkeys_t *));
-        for (i = 0; i < TK_SHARDS; i++) {
-            peh->topkeys[i] = topkeys_init(bucket_engine.topkeys);
-        }
+        /* The same hash as the engines, so it's chosen in one place */
+        topkeys_hash_t keyhash = bucket_engine.upstream_server->core->hash;
+        int sample = bucket_engine.topkeys_sample > INT_MAX ?
+            INT_MAX : (int)bucket_engine.topkeys_sample;
+        peh->topkeys = topkeys_init(bucket_engine.topkeys, sample, keyhash);
         if (peh->topkeys == NULL) {
             bucket_engine.upstream_server->stat->release_stats(peh->stats);
             peh->stats = NULL;
@@ -775,11 +1071,7 @@ static ENGINE_ERROR_CODE init_engine_handle(proxied_engine_handle_t *peh,
 static void uninit_engine_handle(proxied_engine_handle_t *peh) {
     bucket_engine.upstream_server->stat->release_stats(peh->stats);
     if (peh->topkeys != NULL) {
-        int i;
-        for (i = 0; i < TK_SHARDS; i++) {
-            topkeys_free(peh->topkeys[i]);
-        }
-        free(peh->topkeys);
+        topkeys_free(peh->topkeys);
     }
     release_memory((void*)peh->name, peh->name_len);
 
@@ -797,20 +1089,125 @@ static void free_engine_handle(proxied_engine_handle_t *peh) {
     release_memory(peh, sizeof(*peh));
 }
 
+static const char *priority_name(CONN_PRIORITY priority) {
+    switch (priority) {
+    case CONN_PRIORITY_HIGH:
+        return "high";
+    case CONN_PRIORITY_MED:
+        return "med";
+    case CONN_PRIORITY_LOW:
+        return "low";
+    }
+    return "unknown";
+}
+
+static bool parse_bucket_option(proxied_engine_handle_t *peh,
+                                const char *opt, size_t len,
+                                char *msg, size_t msglen) {
+    if (len > sizeof("bucket_ops_limit=") - 1 &&
+        strncmp(opt, "bucket_ops_limit=", sizeof("bucket_ops_limit=") - 1) == 0) {
+        char *end;
+        long limit = strtol(opt + sizeof("bucket_ops_limit=") - 1, &end, 10);
+        if (end != opt + len || limit < 0 || limit > INT_MAX) {
+            if (msg) {
+                snprintf(msg, msglen, "Invalid bucket_ops_limit.");
+            }
+            return false;
+        }
+        peh->ops_limit = (int)limit;
+    } else {
+        const char *val = opt + sizeof("bucket_priority=") - 1;
+        size_t vlen = len - (sizeof("bucket_priority=") - 1);
+        if (vlen == 4 && memcmp(val, "high", 4) == 0) {
+            peh->priority = CONN_PRIORITY_HIGH;
+        } else if (vlen == 3 && memcmp(val, "med", 3) == 0) {
+            peh->priority = CONN_PRIORITY_MED;
+        } else if (vlen == 3 && memcmp(val, "low", 3) == 0) {
+            peh->priority = CONN_PRIORITY_LOW;
+        } else {
+            if (msg) {
+                snprintf(msg, msglen, "Invalid bucket_priority.");
+            }
+            return false;
+        }
+        peh->has_priority = true;
+    }
+    return true;
+}
+
+/**
+ * Take the options bucket_engine handles itself (bucket_ops_limit and
+ * bucket_priority) out of the configuration of a bucket. The rest of it
+ * is returned for the engine, and has to be freed by the caller.
+ */
+static char *extract_bucket_options(proxied_engine_handle_t *peh,
+                                    const char *config,
+                                    char *msg, size_t msglen) {
+    size_t len = strlen(config);
+    char *rest = malloc(len + 1);
+    size_t nrest = 0;
+    size_t start = 0;
+    size_t ii;
+
+    if (rest == NULL) {
+        return NULL;
+    }
+
+    for (ii = 0; ii <= len; ++ii) {
+        if (config[ii] == '\\' && config[ii + 1] != '\0') {
+            /* An escaped character is never a separator */
+            ++ii;
+            continue;
+        }
+        if (config[ii] == ';' || config[ii] == '\0') {
+            const char *opt = config + start;
+            size_t optlen = ii - start;
+            while (optlen > 0 && isspace((unsigned char)*opt)) {
+                ++opt;
+                --optlen;
+            }
+            if (strncmp(opt, "bucket_ops_limit=", sizeof("bucket_ops_limit=") - 1) == 0 ||
+                strncmp(opt, "bucket_priority=", sizeof("bucket_priority=") - 1) == 0) {
+                if (!parse_bucket_option(peh, opt, optlen, msg, msglen)) {
+                    free(rest);
+                    return NULL;
+                }
+            } else if (optlen > 0) {
+                if (nrest > 0) {
+                    rest[nrest++] = ';';
+                }
+                memcpy(rest + nrest, opt, optlen);
+                nrest += optlen;
+            }
+            start = ii + 1;
+        }
+    }
+    rest[nrest] = '\0';
+    return rest;
+}
+
 /**
  * Creates bucket and places it's handle into *e_out. NOTE: that
  * caller is responsible for calling release_handle on that handle
+ *
+ * The engine table is only locked to claim the name and to drop it
+ * again if the engine fails to start: loading and initializing the
+ * engine (which may take a while for a big bucket) happens with the
+ * bucket in STATE_CREATING, so lookups, listings and the creation of
+ * other buckets go on meanwhile. Nobody gets a handle to the bucket
+ * before it is running.
  */
-static ENGINE_ERROR_CODE create_bucket_UNLOCKED(struct bucket_engine *e,
-                                                const char *bucket_name,
-                                                const char *path,
-                                                const char *config,
-                                                proxied_engine_handle_t **e_out,
-                                                char *msg, size_t msglen) {
+static ENGINE_ERROR_CODE create_bucket(struct bucket_engine *e,
+                                       const char *bucket_name,
+                                       const char *path,
+                                       const char *config,
+                                       proxied_engine_handle_t **e_out,
+                                       char *msg, size_t msglen) {
 
     ENGINE_ERROR_CODE rv;
     proxied_engine_handle_t *peh;
     proxied_engine_handle_t *tmppeh;
+    char *engine_config;
 
     if (!has_valid_bucket_name(bucket_name)) {
         return ENGINE_EINVAL;
@@ -825,62 +1222,82 @@ static ENGINE_ERROR_CODE create_bucket_UNLOCKED(struct bucket_engine *e,
         release_memory(peh, sizeof(*peh));
         return rv;
     }
+    peh->state = STATE_CREATING;
 
-    rv = ENGINE_FAILED;
-
-    if ((peh->engine_ref = load_engine(path, logger)) == NULL) {
-        free_engine_handle(peh);
+    engine_config = NULL;
+    if (config != NULL) {
         if (msg) {
-            snprintf(msg, msglen, "Failed to load engine.");
+            msg[0] = '\0';
         }
-        return ENGINE_FAILED;
-    }
-
-    if (!create_engine_instance(peh->engine_ref,
-                                bucket_engine.get_server_api,
-                                logger,
-                                &peh->pe.v0)) {
-        free_engine_handle(peh);
-        if (msg) {
-            snprintf(msg, msglen, "Failed to create engine instance.");
+        engine_config = extract_bucket_options(peh, config, msg, msglen);
+        if (engine_config == NULL) {
+            free_engine_handle(peh);
+            return (msg && msg[0]) ? ENGINE_EINVAL : ENGINE_ENOMEM;
         }
-        return ENGINE_FAILED;
     }
 
+    lock_engines();
     tmppeh = find_bucket_inner(bucket_name);
     if (tmppeh == NULL) {
         genhash_update(e->engines, bucket_name, strlen(bucket_name), peh, 0);
+        publish_snapshot_UNLOCKED();
+    } else if (msg) {
+        snprintf(msg, msglen,
+                 "Bucket exists: %s", bucket_state_name(tmppeh->state));
+    }
+    unlock_engines();
+
+    if (tmppeh != NULL) {
+        free(engine_config);
+        free_engine_handle(peh);
+        return ENGINE_KEY_EEXISTS;
+    }
 
+    rv = ENGINE_FAILED;
+    if ((peh->engine_ref = load_engine(path, logger)) == NULL) {
+        if (msg) {
+            snprintf(msg, msglen, "Failed to load engine.");
+        }
+    } else if (!create_engine_instance(peh->engine_ref,
+                                       bucket_engine.get_server_api,
+                                       logger,
+                                       &peh->pe.v0)) {
+        if (msg) {
+            snprintf(msg, msglen, "Failed to create engine instance.");
+        }
+    } else {
         /* This was already verified, but we'll check it anyway */
         cb_assert(peh->pe.v0->interface == 1);
 
-        rv = ENGINE_SUCCESS;
-
-        if (peh->pe.v1->initialize(peh->pe.v0, config) != ENGINE_SUCCESS) {
+        rv = peh->pe.v1->initialize(peh->pe.v0, engine_config);
+        if (rv != ENGINE_SUCCESS) {
             peh->pe.v1->destroy(peh->pe.v0, false);
-            genhash_delete_all(e->engines, bucket_name, strlen(bucket_name));
             if (msg) {
                 snprintf(msg, msglen,
                          "Failed to initialize instance. Error code: %d\n", rv);
             }
             rv = ENGINE_FAILED;
         }
-    } else {
-        if (msg) {
-            snprintf(msg, msglen,
-                     "Bucket exists: %s", bucket_state_name(tmppeh->state));
-        }
-        peh->pe.v1->destroy(peh->pe.v0, true);
-        rv = ENGINE_KEY_EEXISTS;
     }
+    free(engine_config);
 
     if (rv == ENGINE_SUCCESS) {
+        /* A full barrier, so the engine is set up before anyone uses it */
+        ATOMIC_CAS(&peh->state, STATE_CREATING, STATE_RUNNING);
         if (e_out) {
-            *e_out = peh;
-        } else {
-            release_handle(peh);
+            *e_out = retain_handle(peh);
         }
-    } else {
+    }
+
+    /* The table keeps the bucket if it's running */
+    if (rv != ENGINE_SUCCESS) {
+        lock_engines();
+        genhash_delete_all(e->engines, bucket_name, strlen(bucket_name));
+        publish_snapshot_UNLOCKED();
+        unlock_engines();
+    }
+    release_handle(peh);
+    if (rv != ENGINE_SUCCESS) {
         free_engine_handle(peh);
     }
 
@@ -895,15 +1312,47 @@ static ENGINE_ERROR_CODE create_bucket_UNLOCKED(struct bucket_engine *e,
  * @param engine the proxied engine
  */
 static void release_engine_handle(proxied_engine_handle_t *engine) {
+    volatile int *slot = client_slot(engine);
     int count;
-    cb_assert(engine->clients > 0);
-    count = ATOMIC_DECR(&engine->clients);
+    cb_assert(*slot > 0);
+    if (bucket_engine.mem_tracking) {
+        /* While our count still keeps the bucket around */
+        mem_leave();
+    }
+    count = ATOMIC_DECR(slot);
     cb_assert(count >= 0);
+    /* Any other client sharing the slot checks when it leaves */
     if (count == 0 && engine->state == STATE_STOPPING) {
         maybe_start_engine_shutdown(engine);
     }
 }
 
+/**
+ * Count an operation against the ops/s limit of the bucket, returning
+ * true if it is over the limit (and should fail with ENGINE_TMPFAIL).
+ * The count is a fixed window of a second of the server clock.
+ */
+static bool bucket_throttled(proxied_engine_handle_t *peh) {
+    rel_time_t now;
+
+    if (peh->ops_limit == 0) {
+        return false;
+    }
+
+    now = get_current_time();
+    if (peh->ops_window != now) {
+        /* Threads racing past here may each reset the count, which only
+         * lets a few more operations into the new second */
+        peh->ops_window = now;
+        peh->ops_count = 0;
+    }
+    if (ATOMIC_INCR(&peh->ops_count) <= peh->ops_limit) {
+        return false;
+    }
+    ATOMIC_INCR(&peh->ops_throttled);
+    return true;
+}
+
 /**
  * Returns engine handle for this connection.
  * All access to underlying engine must go through this function, because
@@ -920,7 +1369,8 @@ static void release_engine_handle(proxied_engine_handle_t *engine) {
  * observed to be STATE_RUNNING in this function. And because we never
  * change from running to stopped it changed twice. Because STATE_RUNNING was seen after incrementing clients count here's sequence of inter-dependendent events:
  *
- * - we bump clients count
+ * - we bump clients count (our slot of it, which is included in the
+     sum maybe_start_engine_shutdown looks at)
  *
  * - we observe STATE_RUNNING (and that also implies didn't
      have STATE_STOPPED & STATE_STOPPING in past because we don't
@@ -955,8 +1405,11 @@ static proxied_engine_handle_t *get_engine_handle(ENGINE_HANDLE *h,
         }
     }
 
-    count = ATOMIC_INCR(&peh->clients);
+    count = ATOMIC_INCR(client_slot(peh));
     cb_assert(count > 0);
+    if (e->mem_tracking) {
+        mem_enter(peh);
+    }
 
     if (peh->state != STATE_RUNNING) {
         release_engine_handle(peh);
@@ -987,8 +1440,11 @@ static proxied_engine_handle_t *try_get_engine_handle(ENGINE_HANDLE *h,
     peh = es->peh;
     ret = peh;
 
-    count = ATOMIC_INCR(&peh->clients);
+    count = ATOMIC_INCR(client_slot(peh));
     cb_assert(count > 0);
+    if (e->mem_tracking) {
+        mem_enter(peh);
+    }
     if (peh->state != STATE_RUNNING) {
         release_engine_handle(peh);
         ret = NULL;
@@ -1031,6 +1487,10 @@ static proxied_engine_handle_t* set_engine_handle(ENGINE_HANDLE *h,
     old = es->peh;
     /* In with the new */
     es->peh = retain_handle(peh);
+    if (peh != NULL && peh->has_priority) {
+        bucket_engine.upstream_server->cookie->set_priority(cookie,
+                                                            peh->priority);
+    }
 
     /* out with the old (this may be NULL if we did't have an associated */
     /* strucure... */
@@ -1239,11 +1699,9 @@ static void handle_connect(const void *cookie,
         /* Assign a default named bucket (if there is one). */
         peh = find_bucket(e->default_bucket_name);
         if (!peh && e->auto_create) {
-            lock_engines();
-            create_bucket_UNLOCKED(e, e->default_bucket_name,
-                                   e->default_engine_path,
-                                   e->default_bucket_config, &peh, NULL, 0);
-            unlock_engines();
+            create_bucket(e, e->default_bucket_name,
+                          e->default_engine_path,
+                          e->default_bucket_config, &peh, NULL, 0);
         }
     } else {
         /* Assign the default bucket (if there is one). */
@@ -1281,11 +1739,9 @@ static void handle_auth(const void *cookie,
     cb_assert(type == ON_AUTH);
 
     if (!peh && e->auto_create) {
-        lock_engines();
-        create_bucket_UNLOCKED(e, auth_data->username, e->default_engine_path,
-                               auth_data->config ? auth_data->config : "",
-                               &peh, NULL, 0);
-        unlock_engines();
+        create_bucket(e, auth_data->username, e->default_engine_path,
+                      auth_data->config ? auth_data->config : "",
+                      &peh, NULL, 0);
     }
     set_engine_handle((ENGINE_HANDLE*)e, cookie, peh);
     release_handle(peh);
@@ -1370,6 +1826,22 @@ static ENGINE_ERROR_CODE bucket_initialize(ENGINE_HANDLE* handle,
         return ret;
     }
 
+    if (se->mem_tracking) {
+        ALLOCATOR_HOOKS_API *hooks = se->upstream_server->alloc_hooks;
+        if (hooks == NULL || !hooks->add_new_hook(mem_new_hook)) {
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Failed to add the allocator hooks, not tracking "
+                        "the memory used by the buckets");
+            se->mem_tracking = false;
+        } else if (!hooks->add_delete_hook(mem_delete_hook)) {
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Failed to add the allocator hooks, not tracking "
+                        "the memory used by the buckets");
+            hooks->remove_new_hook(mem_new_hook);
+            se->mem_tracking = false;
+        }
+    }
+
     my_hash_ops.hashfunc = genhash_string_hash;
     my_hash_ops.hasheq = my_hash_eq;
     my_hash_ops.dupKey = hash_strdup;
@@ -1377,10 +1849,14 @@ static ENGINE_ERROR_CODE bucket_initialize(ENGINE_HANDLE* handle,
     my_hash_ops.freeKey = free;
     my_hash_ops.freeValue = engine_hash_free;
 
-    se->engines = genhash_init(1, my_hash_ops);
+    se->engines = genhash_init_layout(1, my_hash_ops,
+                                      GENHASH_OPEN_ADDRESSING);
     if (se->engines == NULL) {
         return ENGINE_ENOMEM;
     }
+    lock_engines();
+    publish_snapshot_UNLOCKED();
+    unlock_engines();
 
     se->upstream_server->callback->register_callback(handle, ON_CONNECT,
                                                      handle_connect, se);
@@ -1457,6 +1933,10 @@ static void bucket_destroy(ENGINE_HANDLE* handle,
                      &bucket_engine.shutdown.mutex);
     }
     cb_mutex_exit(&bucket_engine.shutdown.mutex);
+    /* The shutdowns not started yet would skip it all anyway */
+    if (se->upstream_server->executor != NULL) {
+        se->upstream_server->executor->cancel_all(&bucket_engine);
+    }
 
     genhash_iter(se->engines, bucket_shutdown_engine, NULL);
 
@@ -1464,8 +1944,16 @@ static void bucket_destroy(ENGINE_HANDLE* handle,
         uninit_engine_handle(&se->default_engine);
     }
 
+    if (se->mem_tracking) {
+        se->upstream_server->alloc_hooks->remove_new_hook(mem_new_hook);
+        se->upstream_server->alloc_hooks->remove_delete_hook(mem_delete_hook);
+        se->mem_tracking = false;
+    }
+
     genhash_free(se->engines);
     se->engines = NULL;
+    free(se->snapshot);
+    se->snapshot = NULL;
     free(se->default_engine_path);
     se->default_engine_path = NULL;
     free(se->admin_user);
@@ -1537,6 +2025,7 @@ static void engine_shutdown_thread(void *arg) {
     cb_assert(upd == 1);
     cb_assert(genhash_find(bucket_engine.engines,
                         peh->name, peh->name_len) == NULL);
+    publish_snapshot_UNLOCKED();
     unlock_engines();
 
     if (peh->cookie != NULL) {
@@ -1600,10 +2089,14 @@ static void maybe_start_engine_shutdown(proxied_engine_handle_t *e) {
     cb_assert(e->state == STATE_STOPPING || e->state == STATE_STOPPED || e->state == STATE_NULL);
     /* observing 'state' before clients == 0 is _crucial_. See
      * get_engine_handle. */
-    if (e->state == STATE_STOPPING && e->clients == 0 && ATOMIC_CAS(&e->state, STATE_STOPPING, STATE_STOPPED)) {
-        /* Spin off a new thread to shut down the engine.. */
+    if (e->state == STATE_STOPPING && count_clients(e) == 0 && ATOMIC_CAS(&e->state, STATE_STOPPING, STATE_STOPPED)) {
+        /* Spin off a task (or a thread) to shut down the engine.. */
+        SERVER_EXECUTOR_API *executor = bucket_engine.upstream_server->executor;
         cb_thread_t tid;
-        if (cb_create_thread(&tid, engine_shutdown_thread, e, 1) != 0) {
+        if ((executor == NULL ||
+             executor->submit(&bucket_engine, EXECUTOR_PRIORITY_HIGH,
+                              engine_shutdown_thread, e) == 0) &&
+            cb_create_thread(&tid, engine_shutdown_thread, e, 1) != 0) {
             logger->log(EXTENSION_LOG_WARNING, NULL,
                         "Failed to start shutdown of \"%s\"!", e->name);
             abort();
@@ -1630,6 +2123,10 @@ static ENGINE_ERROR_CODE bucket_item_allocate(ENGINE_HANDLE* handle,
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh) {
         ENGINE_ERROR_CODE ret;
+        if (bucket_throttled(peh)) {
+            release_engine_handle(peh);
+            return ENGINE_TMPFAIL;
+        }
         ret = peh->pe.v1->allocate(peh->pe.v0, cookie, itm, key,
                                    nkey, nbytes, flags, exptime,
                                    datatype);
@@ -1656,6 +2153,10 @@ static ENGINE_ERROR_CODE bucket_item_delete(ENGINE_HANDLE* handle,
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh) {
         ENGINE_ERROR_CODE ret;
+        if (bucket_throttled(peh)) {
+            release_engine_handle(peh);
+            return ENGINE_TMPFAIL;
+        }
         ret = peh->pe.v1->remove(peh->pe.v0, cookie, key, nkey, cas, vbucket,
                                  mut_info);
         release_engine_handle(peh);
@@ -1690,6 +2191,28 @@ static void bucket_item_release(ENGINE_HANDLE* handle,
     }
 }
 
+static void bucket_item_release_multi(ENGINE_HANDLE* handle,
+                                      const void *cookie,
+                                      item **items,
+                                      size_t nitems) {
+    proxied_engine_handle_t *peh = try_get_engine_handle(handle, cookie);
+    if (peh) {
+        if (peh->pe.v1->release_multi) {
+            peh->pe.v1->release_multi(peh->pe.v0, cookie, items, nitems);
+        } else {
+            size_t ii;
+            for (ii = 0; ii < nitems; ++ii) {
+                peh->pe.v1->release(peh->pe.v0, cookie, items[ii]);
+            }
+        }
+        release_engine_handle(peh);
+    } else {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Potential memory leak. Failed to get engine handle for %p",
+                    cookie);
+    }
+}
+
 /**
  * Implementation of the "get" function in the engine
  * specification. Look up the correct engine and call into the
@@ -1705,6 +2228,10 @@ static ENGINE_ERROR_CODE bucket_get(ENGINE_HANDLE* handle,
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh) {
         ENGINE_ERROR_CODE ret;
+        if (bucket_throttled(peh)) {
+            release_engine_handle(peh);
+            return ENGINE_TMPFAIL;
+        }
         ret = peh->pe.v1->get(peh->pe.v0, cookie, itm, key, nkey, vbucket);
 
         if (ret == ENGINE_SUCCESS || ret == ENGINE_KEY_ENOENT) {
@@ -1718,6 +2245,54 @@ static ENGINE_ERROR_CODE bucket_get(ENGINE_HANDLE* handle,
     }
 }
 
+static ENGINE_ERROR_CODE bucket_get_multi(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          item_get_request *requests,
+                                          size_t nrequests) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh) {
+        ENGINE_ERROR_CODE ret = ENGINE_ENOTSUP;
+        size_t ii;
+
+        /* Buckets without get_multi are served key by key by the caller,
+         * and so are limited ones (so each key counts against the limit) */
+        if (peh->pe.v1->get_multi && peh->ops_limit == 0) {
+            ret = peh->pe.v1->get_multi(peh->pe.v0, cookie,
+                                        requests, nrequests);
+        }
+
+        if (ret == ENGINE_SUCCESS) {
+            for (ii = 0; ii < nrequests; ++ii) {
+                if (requests[ii].status == ENGINE_SUCCESS ||
+                    requests[ii].status == ENGINE_KEY_ENOENT) {
+                    topkeys_update(peh->topkeys, requests[ii].key,
+                                   requests[ii].nkey, get_current_time());
+                }
+            }
+        }
+
+        release_engine_handle(peh);
+        return ret;
+    } else {
+        return ENGINE_NO_BUCKET;
+    }
+}
+
+static void bucket_prefetch(ENGINE_HANDLE* handle,
+                            const void* cookie,
+                            const void* key,
+                            const int nkey,
+                            uint16_t vbucket,
+                            ENGINE_PREFETCH_STAGE stage) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh) {
+        if (peh->pe.v1->prefetch) {
+            peh->pe.v1->prefetch(peh->pe.v0, cookie, key, nkey, vbucket, stage);
+        }
+        release_engine_handle(peh);
+    }
+}
+
 static void add_engine(const void *key, size_t nkey,
                        const void *val, size_t nval,
                        void *arg) {
@@ -1772,7 +2347,28 @@ static ENGINE_ERROR_CODE bucket_aggregate_stats(ENGINE_HANDLE* handle,
     struct bucket_engine *e = (struct bucket_engine*)handle;
     struct bucket_list *blist = NULL;
     struct bucket_list *p;
+    volatile int *readers;
+    bucket_snapshot_t *snap;
     (void)cookie;
+
+    /* Sum up the buckets in the snapshot of the engines table, so the
+     * scrape neither takes the lock nor retains every bucket */
+    readers = snapshot_enter();
+    snap = e->snapshot;
+    if (snap != NULL) {
+        size_t n;
+        for (n = 0; n <= snap->mask; ++n) {
+            proxied_engine_handle_t *peh = snap->entries[n].peh;
+            if (peh != NULL && peh->state == STATE_RUNNING) {
+                callback(peh->stats, stats);
+            }
+        }
+    }
+    snapshot_leave(readers);
+    if (snap != NULL) {
+        return ENGINE_SUCCESS;
+    }
+
     if (! list_buckets(e, &blist)) {
         return ENGINE_FAILED;
     }
@@ -1833,6 +2429,43 @@ static ENGINE_ERROR_CODE get_bucket_stats(ENGINE_HANDLE* handle,
     return ENGINE_SUCCESS;
 }
 
+/**
+ * Get the load of the hash table the buckets are looked up in
+ */
+static ENGINE_ERROR_CODE get_bucket_map_stats(ENGINE_HANDLE* handle,
+                                              const void *cookie,
+                                              ADD_STAT add_stat) {
+    struct bucket_engine *e;
+    struct genhash_stats hs;
+    char statval[32];
+
+    if (!is_authorized(handle, cookie)) {
+        return ENGINE_FAILED;
+    }
+
+    e = (struct bucket_engine*)handle;
+    lock_engines();
+    genhash_get_stats(e->engines, &hs);
+    unlock_engines();
+
+    snprintf(statval, sizeof(statval), "%lu", (unsigned long)hs.entries);
+    add_stat("entries", sizeof("entries") - 1, statval,
+             (uint32_t)strlen(statval), cookie);
+    snprintf(statval, sizeof(statval), "%lu", (unsigned long)hs.buckets);
+    add_stat("buckets", sizeof("buckets") - 1, statval,
+             (uint32_t)strlen(statval), cookie);
+    snprintf(statval, sizeof(statval), "%.3f", hs.load_factor);
+    add_stat("load_factor", sizeof("load_factor") - 1, statval,
+             (uint32_t)strlen(statval), cookie);
+    snprintf(statval, sizeof(statval), "%lu", (unsigned long)hs.max_probe);
+    add_stat("max_probe", sizeof("max_probe") - 1, statval,
+             (uint32_t)strlen(statval), cookie);
+    snprintf(statval, sizeof(statval), "%lu", (unsigned long)hs.resizes);
+    add_stat("resizes", sizeof("resizes") - 1, statval,
+             (uint32_t)strlen(statval), cookie);
+    return ENGINE_SUCCESS;
+}
+
 /**
  * Implementation of the "get_stats" function in the engine
  * specification. Look up the correct engine and call into the
@@ -1852,6 +2485,10 @@ static ENGINE_ERROR_CODE bucket_get_stats(ENGINE_HANDLE* handle,
         memcmp("bucket", stat_key, nkey) == 0) {
         return get_bucket_stats(handle, cookie, add_stat);
     }
+    if (nkey == (sizeof("bucket_map") - 1) &&
+        memcmp("bucket_map", stat_key, nkey) == 0) {
+        return get_bucket_map_stats(handle, cookie, add_stat);
+    }
 
     rc = ENGINE_NO_BUCKET;
     peh = get_engine_handle(handle, cookie);
@@ -1859,19 +2496,37 @@ static ENGINE_ERROR_CODE bucket_get_stats(ENGINE_HANDLE* handle,
     if (peh) {
         if (nkey == (sizeof("topkeys") - 1) &&
             memcmp("topkeys", stat_key, nkey) == 0) {
-            rc = topkeys_stats(peh->topkeys, TK_SHARDS, cookie, get_current_time(),
+            rc = topkeys_stats(peh->topkeys, cookie, get_current_time(),
                                add_stat);
         } else {
             rc = peh->pe.v1->get_stats(peh->pe.v0, cookie, stat_key,
                                        nkey, add_stat);
             if (nkey == 0) {
-                char statval[20];
+                char statval[24];
                 snprintf(statval, sizeof(statval), "%d", peh->refcount - 1);
                 add_stat("bucket_conns", sizeof("bucket_conns") - 1, statval,
                          (uint32_t)strlen(statval), cookie);
-                snprintf(statval, sizeof(statval), "%d", peh->clients);
+                snprintf(statval, sizeof(statval), "%d", count_clients(peh));
                 add_stat("bucket_active_conns", sizeof("bucket_active_conns") -1,
                          statval, (uint32_t)strlen(statval), cookie);
+                snprintf(statval, sizeof(statval), "%d", peh->ops_limit);
+                add_stat("bucket_ops_limit", sizeof("bucket_ops_limit") - 1,
+                         statval, (uint32_t)strlen(statval), cookie);
+                snprintf(statval, sizeof(statval), "%d", peh->ops_throttled);
+                add_stat("bucket_ops_throttled",
+                         sizeof("bucket_ops_throttled") - 1,
+                         statval, (uint32_t)strlen(statval), cookie);
+                if (peh->has_priority) {
+                    const char *prio = priority_name(peh->priority);
+                    add_stat("bucket_priority", sizeof("bucket_priority") - 1,
+                             prio, (uint32_t)strlen(prio), cookie);
+                }
+                if (bucket_engine.mem_tracking) {
+                    snprintf(statval, sizeof(statval), "%" PRId64,
+                             count_mem_used(peh));
+                    add_stat("bucket_mem_used", sizeof("bucket_mem_used") - 1,
+                             statval, (uint32_t)strlen(statval), cookie);
+                }
             }
         }
         release_engine_handle(peh);
@@ -1933,6 +2588,71 @@ static ENGINE_ERROR_CODE bucket_store(ENGINE_HANDLE* handle,
     }
 }
 
+static ENGINE_ERROR_CODE bucket_store_multi(ENGINE_HANDLE* handle,
+                                            const void *cookie,
+                                            item_store_request *requests,
+                                            size_t nrequests) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh) {
+        ENGINE_ERROR_CODE ret = ENGINE_ENOTSUP;
+        size_t ii;
+
+        /* Buckets without store_multi are served item by item by the caller */
+        if (peh->pe.v1->store_multi) {
+            ret = peh->pe.v1->store_multi(peh->pe.v0, cookie,
+                                          requests, nrequests);
+        }
+
+        if (ret == ENGINE_SUCCESS && peh->topkeys) {
+            for (ii = 0; ii < nrequests; ++ii) {
+                if (requests[ii].status == ENGINE_SUCCESS ||
+                    requests[ii].status == ENGINE_KEY_EEXISTS ||
+                    requests[ii].status == ENGINE_KEY_ENOENT) {
+                    topkeys_update(peh->topkeys, requests[ii].key,
+                                   requests[ii].nkey, get_current_time());
+                }
+            }
+        }
+
+        release_engine_handle(peh);
+        return ret;
+    } else {
+        return ENGINE_NO_BUCKET;
+    }
+}
+
+static ENGINE_ERROR_CODE bucket_splice(ENGINE_HANDLE* handle,
+                                       const void *cookie,
+                                       item* itm,
+                                       uint64_t *cas,
+                                       size_t offset,
+                                       size_t length,
+                                       const void *data,
+                                       size_t ndata,
+                                       uint16_t vbucket) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh) {
+        /* Buckets without splice get a new item stored by the caller */
+        ENGINE_ERROR_CODE ret = ENGINE_NOT_STORED;
+        if (peh->pe.v1->splice) {
+            ret = peh->pe.v1->splice(peh->pe.v0, cookie, itm, cas, offset,
+                                     length, data, ndata, vbucket);
+        }
+        if (ret == ENGINE_SUCCESS && peh->topkeys) {
+            item_info itm_info;
+            itm_info.nvalue = 1;
+            if (peh->pe.v1->get_item_info(peh->pe.v0, cookie, itm, &itm_info)) {
+                topkeys_update(peh->topkeys, itm_info.key, itm_info.nkey,
+                               get_current_time());
+            }
+        }
+        release_engine_handle(peh);
+        return ret;
+    } else {
+        return ENGINE_NO_BUCKET;
+    }
+}
+
 /**
  * Implementation of the "arithmetic" function in the engine
  * specification. Look up the correct engine and call into the
@@ -1955,6 +2675,10 @@ static ENGINE_ERROR_CODE bucket_arithmetic(ENGINE_HANDLE* handle,
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh) {
         ENGINE_ERROR_CODE ret;
+        if (bucket_throttled(peh)) {
+            release_engine_handle(peh);
+            return ENGINE_TMPFAIL;
+        }
         ret = peh->pe.v1->arithmetic(peh->pe.v0, cookie, key, nkey,
                                 increment, create, delta, initial,
                                 exptime, item, datatype, result, vbucket);
@@ -2022,6 +2746,90 @@ static bool bucket_get_item_info(ENGINE_HANDLE *handle,
     return ret;
 }
 
+typedef union {
+    item_info info;
+    char bytes[sizeof(item_info) + ((IOV_MAX - 1) * sizeof(struct iovec))];
+} item_info_holder;
+
+/*
+ * The segments of the value of an item of a bucket without get_item_view,
+ * looked up with get_item_info
+ */
+static bool bucket_get_item_segments(proxied_engine_handle_t *peh,
+                                     const void *cookie,
+                                     const item* itm,
+                                     item_info *itm_info) {
+    itm_info->nvalue = IOV_MAX;
+    return peh->pe.v1->get_item_info(peh->pe.v0, cookie, itm, itm_info);
+}
+
+/**
+ * Implementation of the "get_item_view" function in the engine
+ * specification. Buckets without it get their view made from
+ * get_item_info.
+ */
+static bool bucket_get_item_view(ENGINE_HANDLE *handle,
+                                 const void *cookie,
+                                 const item* itm,
+                                 item_view *itm_view) {
+    bool ret = false;
+    proxied_engine_handle_t *peh = try_get_engine_handle(handle, cookie);
+    if (peh) {
+        if (peh->pe.v1->get_item_view) {
+            ret = peh->pe.v1->get_item_view(peh->pe.v0, cookie, itm, itm_view);
+        } else {
+            item_info_holder holder;
+            ret = bucket_get_item_segments(peh, cookie, itm, &holder.info);
+            if (ret) {
+                itm_view->cas = holder.info.cas;
+                itm_view->vbucket_uuid = holder.info.vbucket_uuid;
+                itm_view->seqno = holder.info.seqno;
+                itm_view->exptime = holder.info.exptime;
+                itm_view->nbytes = holder.info.nbytes;
+                itm_view->flags = holder.info.flags;
+                itm_view->datatype = holder.info.datatype;
+                itm_view->clsid = holder.info.clsid;
+                itm_view->nkey = holder.info.nkey;
+                itm_view->nsegments = holder.info.nvalue;
+                itm_view->key = holder.info.key;
+                itm_view->value = holder.info.value[0];
+            }
+        }
+        release_engine_handle(peh);
+    }
+
+    return ret;
+}
+
+/**
+ * Implementation of the "get_item_segment" function in the engine
+ * specification.
+ */
+static bool bucket_get_item_segment(ENGINE_HANDLE *handle,
+                                    const void *cookie,
+                                    const item* itm,
+                                    uint16_t index,
+                                    struct iovec *segment) {
+    bool ret = false;
+    proxied_engine_handle_t *peh = try_get_engine_handle(handle, cookie);
+    if (peh) {
+        if (peh->pe.v1->get_item_segment) {
+            ret = peh->pe.v1->get_item_segment(peh->pe.v0, cookie, itm,
+                                               index, segment);
+        } else {
+            item_info_holder holder;
+            ret = bucket_get_item_segments(peh, cookie, itm, &holder.info) &&
+                index < holder.info.nvalue;
+            if (ret) {
+                *segment = holder.info.value[index];
+            }
+        }
+        release_engine_handle(peh);
+    }
+
+    return ret;
+}
+
 /**
  * Implementation of the "set_item_info" function in the engine
  * specification. Look up the correct engine and call into the
@@ -2600,6 +3408,60 @@ static ENGINE_ERROR_CODE bucket_get_engine_vb_map(ENGINE_HANDLE* handle,
     return ret;
 }
 
+/*
+ * The frontend dropped its client count of a bucket it found stopping,
+ * the last one out starts the shutdown (see release_engine_handle)
+ */
+static void bucket_binding_release(void *bucket) {
+    proxied_engine_handle_t *peh = bucket;
+    if (peh->state != STATE_RUNNING) {
+        maybe_start_engine_shutdown(peh);
+    }
+}
+
+/**
+ * Implementation of the "bind_engine" function in the engine
+ * specification. The connection gets the engine of its bucket if the
+ * bucket has nothing for us to do on the data path: no ops limit, no
+ * topkeys and no memory tracking (which are set when it's created). The
+ * connection holds a reference to the bucket while es->peh is the one
+ * bound, and the client count is the same one get_engine_handle bumps.
+ */
+static bool bucket_bind_engine(ENGINE_HANDLE* handle,
+                               const void *cookie,
+                               engine_binding_t *binding) {
+    struct bucket_engine *e = (struct bucket_engine*)handle;
+    engine_specific_t *es;
+    proxied_engine_handle_t *peh;
+
+    es = e->upstream_server->cookie->get_engine_specific(cookie);
+    if (es == NULL || e->mem_tracking) {
+        return false;
+    }
+    peh = es->peh;
+    if (peh == NULL) {
+        if (e->default_engine.pe.v0 == NULL) {
+            return false;
+        }
+        peh = &e->default_engine;
+    }
+    if (peh->state != STATE_RUNNING || peh->ops_limit != 0 ||
+        peh->topkeys != NULL) {
+        return false;
+    }
+
+    binding->v0 = peh->pe.v0;
+    binding->v1 = peh->pe.v1;
+    binding->clients = client_slot(peh);
+    binding->state = (const volatile int *)&peh->state;
+    binding->live = STATE_RUNNING;
+    binding->current = (void *const volatile *)&es->peh;
+    binding->expected = es->peh;
+    binding->release = bucket_binding_release;
+    binding->bucket = peh;
+    return true;
+}
+
 /**
  * Initialize configuration is called during the initialization of
  * bucket_engine. It tries to parse the configuration string to pick
@@ -2611,11 +3473,14 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
     ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
 
     me->auto_create = true;
+    me->topkeys_sample = 1;
 
     if (cfg_str != NULL) {
+        static struct config_schema *config_schema;
+        const struct config_schema *schema;
         int r;
         int ii = 0;
-#define CONFIG_SIZE 8
+#define CONFIG_SIZE 10
         struct config_item items[CONFIG_SIZE];
         memset(&items, 0, sizeof(items));
 
@@ -2649,6 +3514,16 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
         items[ii].value.dt_bool = &me->auto_create;
         ++ii;
 
+        items[ii].key = "topkeys_sample";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &me->topkeys_sample;
+        ++ii;
+
+        items[ii].key = "mem_tracking";
+        items[ii].datatype = DT_BOOL;
+        items[ii].value.dt_bool = &me->mem_tracking;
+        ++ii;
+
         items[ii].key = "config_file";
         items[ii].datatype = DT_CONFIGFILE;
         ++ii;
@@ -2658,7 +3533,8 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
         cb_assert(ii == CONFIG_SIZE);
 #undef CONFIG_SIZE
 
-        r = me->upstream_server->core->parse_config(cfg_str, items, stderr);
+        schema = config_schema_get(&config_schema, items);
+        r = parse_config_schema(cfg_str, schema, items, stderr);
         if (r == 0) {
             if (!items[0].found) {
                 me->default_engine_path = NULL;
@@ -2752,9 +3628,7 @@ static ENGINE_ERROR_CODE handle_create_bucket(ENGINE_HANDLE* handle,
     }
 
     msg[0] = 0;
-    lock_engines();
-    ret = create_bucket_UNLOCKED(e, keyz, spec, config, NULL, msg, MSGLEN);
-    unlock_engines();
+    ret = create_bucket(e, keyz, spec, config, NULL, msg, MSGLEN);
 
     switch(ret) {
     case ENGINE_SUCCESS:
@@ -2856,7 +3730,7 @@ static ENGINE_ERROR_CODE handle_delete_bucket(ENGINE_HANDLE* handle,
             /* bumped clients count protects transition from
              * STATE_RUNNING to STATE_STOPPED while peh->cookie is not
              * yet set. */
-            int count = ATOMIC_INCR(&peh->clients);
+            int count = ATOMIC_INCR(client_slot(peh));
             cb_assert(count > 0);
             if (ATOMIC_CAS(&peh->state, STATE_RUNNING, STATE_STOPPING)) {
                 peh->cookie = cookie;
@@ -3162,7 +4036,7 @@ static ENGINE_ERROR_CODE bucket_engine_reserve_cookie(const void *cookie)
     /* This can only be reliably called form engine up-call so that
      * it's impossible to transition to STATE_STOPPED while we're
      * here. */
-    cb_assert(peh->clients >= 0);
+    cb_assert(count_clients(peh) >= 0);
 
     if (peh->state != STATE_RUNNING) {
         return ENGINE_FAILED;
@@ -15,17 +15,34 @@ typedef union proxied_engine {
 
 typedef enum {
     STATE_NULL,
+    /* In the engine table (so the name is taken), but still initializing */
+    STATE_CREATING,
     STATE_RUNNING,
     STATE_STOPPING,
     STATE_STOPPED
 } bucket_state_t;
 
+/* The number of slots the clients count of a bucket is spread over */
+#define BUCKET_CLIENT_SLOTS 16
+
+/* A part of the clients count, alone in its cache line */
+typedef struct {
+    volatile int count;
+    char pad[64 - sizeof(int)];
+} bucket_client_slot_t;
+
+/* A part of the memory used by a bucket, alone in its cache line */
+typedef struct {
+    volatile int64_t bytes;
+    char pad[64 - sizeof(int64_t)];
+} bucket_mem_slot_t;
+
 typedef struct proxied_engine_handle {
     const char          *name;
     size_t               name_len;
     proxied_engine_t     pe;
     void                *stats;
-    topkeys_t          **topkeys;
+    topkeys_t           *topkeys;
     TAP_ITERATOR         tap_iterator;
     bool                 tap_iterator_disabled;
     /* ON_DISCONNECT handling */
@@ -50,12 +67,45 @@ typedef struct proxied_engine_handle {
      * only happen when bucket is deleted (but can happen later
      * because some connection can hold pointer longer) */
     volatile int         refcount;
-    volatile int clients; /* # of clients currently calling functions in the engine */
+    /* # of clients currently calling functions in the engine, spread
+     * over a few cache lines (see client_slot) */
+    bucket_client_slot_t clients[BUCKET_CLIENT_SLOTS];
     const void *cookie;
     engine_reference* engine_ref;
     volatile bucket_state_t state;
+    /* Operations per second let into the bucket (0 for no limit) */
+    int ops_limit;
+    /* The second ops_count is for, and the operations counted in it */
+    volatile rel_time_t ops_window;
+    volatile int ops_count;
+    /* Operations turned away for going over ops_limit */
+    volatile int ops_throttled;
+    /* The priority given to the connections of the bucket, if set */
+    bool has_priority;
+    CONN_PRIORITY priority;
+    /* Memory allocated (less freed) by the threads calling into the
+     * bucket, spread like the clients count (see mem_flush) */
+    bucket_mem_slot_t mem_used[BUCKET_CLIENT_SLOTS];
 } proxied_engine_handle_t;
 
+/* A bucket in the read-only copy of the engines table */
+typedef struct {
+    unsigned int hash;
+    proxied_engine_handle_t *peh;
+} bucket_snapshot_entry_t;
+
+/*
+ * An open addressing copy of the engines table (a power of two entries,
+ * at most half of them used) find_bucket looks in without taking
+ * engines_mutex. It is never modified: every change to the engines table
+ * publishes a new one, and frees the old one once the readers which may
+ * have seen it are gone.
+ */
+typedef struct {
+    size_t mask;
+    bucket_snapshot_entry_t *entries;
+} bucket_snapshot_t;
+
 #define ES_CONNECTED_FLAG 0x1000
 
 /**
@@ -93,6 +143,12 @@ struct bucket_engine {
     engine_reference* default_engine_ref;
     cb_mutex_t engines_mutex;
     genhash_t *engines;
+    /* The current copy of engines for find_bucket (NULL to use the lock) */
+    bucket_snapshot_t * volatile snapshot;
+    /* Bumped for every snapshot published; its low bit picks which of the
+     * reader counts the readers go in */
+    volatile int snapshot_gen;
+    bucket_client_slot_t snapshot_readers[2][BUCKET_CLIENT_SLOTS];
     GET_SERVER_API get_server_api;
     SERVER_HANDLE_V1 server;
     SERVER_CALLBACK_API callback_api;
@@ -123,6 +179,10 @@ struct bucket_engine {
     } info;
 
     int topkeys;
+    /* Every topkeys_sample'th access is counted in the topkeys */
+    size_t topkeys_sample;
+    /* Hook the allocator to account the memory used by every bucket */
+    bool mem_tracking;
 };
 
 #endif
@@ -4,6 +4,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <math.h>
 #include <platform/cbassert.h>
 
@@ -18,6 +20,15 @@ static int prime_size_table[]={
     1610612741
 };
 
+#define PRIME_TABLE_SIZE (sizeof(prime_size_table) / sizeof(int))
+
+/* Buckets (or slots) of the old table moved over by every update */
+#define REHASH_STEP 8
+
+/* Marks a slot of an old open addressing table which is no longer used */
+static struct genhash_entry_t tombstone;
+#define TOMBSTONE (&tombstone)
+
 static void* dup_key(genhash_t *h, const void *key, size_t klen)
 {
     if (h->ops.dupKey != NULL) {
@@ -58,15 +69,218 @@ static int estimate_table_size(int est)
     magn = (int)(log((double)est) / log(2));
     magn--;
     magn = ((int)magn < 0) ? 0 : magn;
-    cb_assert(magn < (sizeof(prime_size_table) / sizeof(int)));
+    cb_assert(magn < PRIME_TABLE_SIZE);
     rv=prime_size_table[magn];
     return rv;
 }
 
-genhash_t* genhash_init(int est, struct hash_ops ops)
+/* The size of a grown table, or 0 if it can't grow any more */
+static size_t grown_table_size(genhash_t *h)
+{
+    size_t ii;
+    if (h->layout == GENHASH_OPEN_ADDRESSING) {
+        return h->table.size * 2;
+    }
+    for (ii = 0; ii < PRIME_TABLE_SIZE; ++ii) {
+        if ((size_t)prime_size_table[ii] > h->table.size) {
+            return prime_size_table[ii];
+        }
+    }
+    return 0;
+}
+
+static unsigned int key_hash(genhash_t *h, const void *k, size_t klen)
+{
+    return (unsigned int)h->ops.hashfunc(k, klen);
+}
+
+static bool entry_matches(genhash_t *h, const struct genhash_entry_t *p,
+                          unsigned int hash, const void *k, size_t klen)
+{
+    return p->hash == hash && h->ops.hasheq(k, klen, p->key, p->nkey);
+}
+
+/* Home slot of a hash in an open addressing table (size is a power of 2) */
+static size_t slot_index(unsigned int hash, size_t size)
+{
+    unsigned int x = hash * 0x9E3779B1u;
+    x ^= x >> 15;
+    return x & (size - 1);
+}
+
+static bool table_alloc(genhash_t *h, struct genhash_table_t *t, size_t size)
+{
+    t->size = size;
+    t->used = 0;
+    if (h->layout == GENHASH_OPEN_ADDRESSING) {
+        t->u.slots = calloc(size, sizeof(struct genhash_slot_t));
+        return t->u.slots != NULL;
+    }
+    t->u.buckets = calloc(size, sizeof(struct genhash_entry_t *));
+    return t->u.buckets != NULL;
+}
+
+static void table_free(genhash_t *h, struct genhash_table_t *t)
+{
+    if (h->layout == GENHASH_OPEN_ADDRESSING) {
+        free(t->u.slots);
+    } else {
+        free(t->u.buckets);
+    }
+    memset(t, 0, sizeof(*t));
+}
+
+/**************************** OPEN ADDRESSING ******************************/
+
+static struct genhash_slot_t *find_slot(genhash_t *h,
+                                        struct genhash_table_t *t,
+                                        unsigned int hash,
+                                        const void *k, size_t klen)
+{
+    size_t n;
+    if (t->size == 0) {
+        return NULL;
+    }
+    for (n = slot_index(hash, t->size); t->u.slots[n].entry != NULL;
+         n = (n + 1) & (t->size - 1)) {
+        struct genhash_slot_t *s = &t->u.slots[n];
+        if (s->entry != TOMBSTONE && s->hash == hash &&
+            h->ops.hasheq(k, klen, s->entry->key, s->entry->nkey)) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* Add the values (newest first) of a key not in the table */
+static void insert_slot(struct genhash_table_t *t, unsigned int hash,
+                        struct genhash_entry_t *entry)
+{
+    size_t n = slot_index(hash, t->size);
+    while (t->u.slots[n].entry != NULL) {
+        n = (n + 1) & (t->size - 1);
+    }
+    t->u.slots[n].hash = hash;
+    t->u.slots[n].entry = entry;
+    ++t->used;
+}
+
+/* Remove the slot, moving back the ones which can't be found across it */
+static void remove_slot(struct genhash_table_t *t, struct genhash_slot_t *s)
+{
+    size_t mask = t->size - 1;
+    size_t pos = (size_t)(s - t->u.slots);
+    size_t next;
+
+    t->u.slots[pos].entry = NULL;
+    --t->used;
+    for (next = (pos + 1) & mask; t->u.slots[next].entry != NULL;
+         next = (next + 1) & mask) {
+        size_t home = slot_index(t->u.slots[next].hash, t->size);
+        if (((next - home) & mask) >= ((next - pos) & mask)) {
+            t->u.slots[pos] = t->u.slots[next];
+            t->u.slots[next].entry = NULL;
+            pos = next;
+        }
+    }
+}
+
+/* Add older values for a key at the end of its values in the table */
+static void append_values(genhash_t *h, struct genhash_table_t *t,
+                          unsigned int hash, struct genhash_entry_t *values)
+{
+    struct genhash_slot_t *s = find_slot(h, t, hash,
+                                         values->key, values->nkey);
+    if (s != NULL) {
+        struct genhash_entry_t *p = s->entry;
+        while (p->next != NULL) {
+            p = p->next;
+        }
+        p->next = values;
+    } else {
+        insert_slot(t, hash, values);
+    }
+}
+
+/******************************* REHASHING *********************************/
+
+static void migrate_bucket(genhash_t *h, size_t n)
+{
+    if (h->layout == GENHASH_OPEN_ADDRESSING) {
+        struct genhash_slot_t *s = &h->old.u.slots[n];
+        if (s->entry != NULL && s->entry != TOMBSTONE) {
+            append_values(h, &h->table, s->hash, s->entry);
+            /* Keeps the probe sequences of the old table intact */
+            s->entry = TOMBSTONE;
+            --h->old.used;
+        }
+    } else {
+        struct genhash_entry_t *p = h->old.u.buckets[n];
+        h->old.u.buckets[n] = NULL;
+        while (p != NULL) {
+            /* Appended, so the newer values of a key stay in front */
+            struct genhash_entry_t *next = p->next;
+            struct genhash_entry_t **tail =
+                &h->table.u.buckets[p->hash % h->table.size];
+            while (*tail != NULL) {
+                tail = &(*tail)->next;
+            }
+            p->next = NULL;
+            *tail = p;
+            p = next;
+        }
+    }
+}
+
+static void rehash_step(genhash_t *h, size_t nbuckets)
+{
+    if (h->old.size == 0) {
+        return;
+    }
+    for (; nbuckets > 0 && h->migrated < h->old.size; --nbuckets) {
+        migrate_bucket(h, h->migrated++);
+    }
+    if (h->migrated == h->old.size) {
+        table_free(h, &h->old);
+        h->migrated = 0;
+    }
+}
+
+static void maybe_grow(genhash_t *h)
+{
+    struct genhash_table_t grown;
+    size_t size;
+
+    if (h->layout == GENHASH_OPEN_ADDRESSING) {
+        /* Short probe sequences need at least half of the slots free */
+        if (h->table.used * 2 <= h->table.size) {
+            return;
+        }
+    } else if (h->nentries <= h->table.size) {
+        return;
+    }
+
+    /* Not expected to happen, but an old table must be gone first */
+    rehash_step(h, h->old.size);
+
+    size = grown_table_size(h);
+    if (size == 0 || !table_alloc(h, &grown, size)) {
+        /* Keep using the table we have */
+        return;
+    }
+    h->old = h->table;
+    h->table = grown;
+    h->migrated = 0;
+    h->resizes++;
+}
+
+/***************************************************************************/
+
+genhash_t* genhash_init_layout(int est, struct hash_ops ops,
+                               enum genhash_layout layout)
 {
     genhash_t* rv=NULL;
-    int size=0;
+    size_t size=0;
     if (est < 1) {
         return NULL;
     }
@@ -76,20 +290,37 @@ genhash_t* genhash_init(int est, struct hash_ops ops)
     cb_assert((ops.dupKey != NULL && ops.freeKey != NULL) || ops.freeKey == NULL);
     cb_assert((ops.dupValue != NULL && ops.freeValue != NULL) || ops.freeValue == NULL);
 
-    size=estimate_table_size(est);
-    rv=calloc(1, sizeof(genhash_t)
-              + (size * sizeof(struct genhash_entry_t *)));
+    rv=calloc(1, sizeof(genhash_t));
     cb_assert(rv != NULL);
-    rv->size=size;
     rv->ops=ops;
+    rv->layout=layout;
+
+    if (layout == GENHASH_OPEN_ADDRESSING) {
+        size = 8;
+        while (size < 2 * (size_t)est) {
+            size <<= 1;
+        }
+    } else {
+        size=estimate_table_size(est);
+    }
+    if (!table_alloc(rv, &rv->table, size)) {
+        free(rv);
+        return NULL;
+    }
 
     return rv;
 }
 
+genhash_t* genhash_init(int est, struct hash_ops ops)
+{
+    return genhash_init_layout(est, ops, GENHASH_CHAINED);
+}
+
 void genhash_free(genhash_t* h)
 {
     if(h != NULL) {
         genhash_clear(h);
+        table_free(h, &h->table);
         free(h);
     }
 }
@@ -97,14 +328,10 @@ void genhash_free(genhash_t* h)
 void genhash_store(genhash_t *h, const void* k, size_t klen,
                    const void* v, size_t vlen)
 {
-    size_t n=0;
     struct genhash_entry_t *p;
 
     cb_assert(h != NULL);
-
-    n=h->ops.hashfunc(k, klen) % h->size;
-    cb_assert((int)n >= 0);
-    cb_assert(n < h->size);
+    rehash_step(h, REHASH_STEP);
 
     p=calloc(1, sizeof(struct genhash_entry_t));
     cb_assert(p);
@@ -113,24 +340,62 @@ void genhash_store(genhash_t *h, const void* k, size_t klen,
     p->nkey = klen;
     p->value=dup_value(h, v, vlen);
     p->nvalue = vlen;
+    p->hash = key_hash(h, k, klen);
+
+    /* The new table is looked in first, so this is the most recent value */
+    if (h->layout == GENHASH_OPEN_ADDRESSING) {
+        struct genhash_slot_t *s = find_slot(h, &h->table, p->hash, k, klen);
+        if (s != NULL) {
+            p->next = s->entry;
+            s->entry = p;
+        } else {
+            insert_slot(&h->table, p->hash, p);
+        }
+    } else {
+        size_t n = p->hash % h->table.size;
+        p->next=h->table.u.buckets[n];
+        h->table.u.buckets[n]=p;
+    }
+    h->nentries++;
 
-    p->next=h->buckets[n];
-    h->buckets[n]=p;
+    maybe_grow(h);
+}
+
+/* The most recent value for the key in the table */
+static struct genhash_entry_t *table_find_entry(genhash_t *h,
+                                                struct genhash_table_t *t,
+                                                unsigned int hash,
+                                                const void* k,
+                                                size_t klen)
+{
+    struct genhash_entry_t *p;
+
+    if (h->layout == GENHASH_OPEN_ADDRESSING) {
+        struct genhash_slot_t *s = find_slot(h, t, hash, k, klen);
+        return s ? s->entry : NULL;
+    }
+    if (t->size == 0) {
+        return NULL;
+    }
+
+    for(p=t->u.buckets[hash % t->size];
+        p && !entry_matches(h, p, hash, k, klen); p=p->next);
+    return p;
 }
 
 static struct genhash_entry_t *genhash_find_entry(genhash_t *h,
                                                   const void* k,
                                                   size_t klen)
 {
-    size_t n=0;
+    unsigned int hash;
     struct genhash_entry_t *p;
 
     cb_assert(h != NULL);
-    n=h->ops.hashfunc(k, klen) % h->size;
-    cb_assert((int)n >= 0);
-    cb_assert(n < h->size);
-
-    for(p=h->buckets[n]; p && !h->ops.hasheq(k, klen, p->key, p->nkey); p=p->next);
+    hash = key_hash(h, k, klen);
+    p = table_find_entry(h, &h->table, hash, k, klen);
+    if (p == NULL && h->old.size != 0) {
+        p = table_find_entry(h, &h->old, hash, k, klen);
+    }
     return p;
 }
 
@@ -205,34 +470,63 @@ static void free_item(genhash_t *h, struct genhash_entry_t *i)
     free(i);
 }
 
-int genhash_delete(genhash_t* h, const void* k, size_t klen)
+/* Unlink the most recent value for the key from the table */
+static struct genhash_entry_t *table_unlink(genhash_t *h,
+                                            struct genhash_table_t *t,
+                                            unsigned int hash,
+                                            const void *k, size_t klen)
 {
     struct genhash_entry_t *deleteme=NULL;
-    size_t n=0;
-    int rv=0;
 
-    cb_assert(h != NULL);
-    n=h->ops.hashfunc(k, klen) % h->size;
-    cb_assert((int)n >= 0);
-    cb_assert(n < h->size);
-
-    if(h->buckets[n] != NULL) {
-        /* Special case the first one */
-        if(h->ops.hasheq(h->buckets[n]->key, h->buckets[n]->nkey, k, klen)) {
-            deleteme=h->buckets[n];
-            h->buckets[n]=deleteme->next;
-        } else {
-            struct genhash_entry_t *p=NULL;
-            for(p=h->buckets[n]; deleteme==NULL && p->next != NULL; p=p->next) {
-                if(h->ops.hasheq(p->next->key, p->next->nkey, k, klen)) {
-                    deleteme=p->next;
-                    p->next=deleteme->next;
+    if (t->size == 0) {
+        return NULL;
+    }
+
+    if (h->layout == GENHASH_OPEN_ADDRESSING) {
+        struct genhash_slot_t *s = find_slot(h, t, hash, k, klen);
+        if (s != NULL) {
+            deleteme = s->entry;
+            s->entry = deleteme->next;
+            if (s->entry == NULL) {
+                if (t == &h->old) {
+                    /* The rehash relies on old slots staying put */
+                    s->entry = TOMBSTONE;
+                    --t->used;
+                } else {
+                    remove_slot(t, s);
                 }
             }
         }
+    } else {
+        struct genhash_entry_t **pp = &t->u.buckets[hash % t->size];
+        while (*pp != NULL && !entry_matches(h, *pp, hash, k, klen)) {
+            pp = &(*pp)->next;
+        }
+        if (*pp != NULL) {
+            deleteme = *pp;
+            *pp = deleteme->next;
+        }
+    }
+    return deleteme;
+}
+
+int genhash_delete(genhash_t* h, const void* k, size_t klen)
+{
+    struct genhash_entry_t *deleteme=NULL;
+    unsigned int hash;
+    int rv=0;
+
+    cb_assert(h != NULL);
+    rehash_step(h, REHASH_STEP);
+
+    hash = key_hash(h, k, klen);
+    deleteme = table_unlink(h, &h->table, hash, k, klen);
+    if (deleteme == NULL && h->old.size != 0) {
+        deleteme = table_unlink(h, &h->old, hash, k, klen);
     }
     if(deleteme != NULL) {
         free_item(h, deleteme);
+        h->nentries--;
         rv++;
     }
 
@@ -248,36 +542,77 @@ int genhash_delete_all(genhash_t* h, const void* k, size_t klen)
     return rv;
 }
 
-void genhash_iter(genhash_t* h,
-                  void (*iterfunc)(const void* key, size_t nkey,
-                                   const void* val, size_t nval,
-                                   void *arg), void *arg)
+/* The values in a bucket (or slot) of the table, or NULL */
+static struct genhash_entry_t *bucket_values(genhash_t *h,
+                                             struct genhash_table_t *t,
+                                             size_t n)
+{
+    if (h->layout == GENHASH_OPEN_ADDRESSING) {
+        struct genhash_entry_t *p = t->u.slots[n].entry;
+        return (p == TOMBSTONE) ? NULL : p;
+    }
+    return t->u.buckets[n];
+}
+
+static void table_iter(genhash_t *h, struct genhash_table_t *t,
+                       void (*iterfunc)(const void* key, size_t nkey,
+                                        const void* val, size_t nval,
+                                        void *arg), void *arg)
 {
     size_t i=0;
     struct genhash_entry_t *p=NULL;
-    cb_assert(h != NULL);
 
-    for(i=0; i<h->size; i++) {
-        for(p=h->buckets[i]; p!=NULL; p=p->next) {
+    for(i=0; i<t->size; i++) {
+        for(p=bucket_values(h, t, i); p!=NULL; p=p->next) {
             iterfunc(p->key, p->nkey, p->value, p->nvalue, arg);
         }
     }
 }
 
-int genhash_clear(genhash_t *h)
+void genhash_iter(genhash_t* h,
+                  void (*iterfunc)(const void* key, size_t nkey,
+                                   const void* val, size_t nval,
+                                   void *arg), void *arg)
+{
+    cb_assert(h != NULL);
+    table_iter(h, &h->table, iterfunc, arg);
+    table_iter(h, &h->old, iterfunc, arg);
+}
+
+static int table_clear(genhash_t *h, struct genhash_table_t *t)
 {
     size_t i = 0;
     int rv = 0;
-    cb_assert(h != NULL);
 
-    for(i = 0; i < h->size; i++) {
-        while(h->buckets[i]) {
-            struct genhash_entry_t *p = NULL;
-            p = h->buckets[i];
-            h->buckets[i] = p->next;
+    for(i = 0; i < t->size; i++) {
+        struct genhash_entry_t *p = bucket_values(h, t, i);
+        while (p != NULL) {
+            struct genhash_entry_t *next = p->next;
             free_item(h, p);
+            p = next;
+            rv++;
         }
     }
+    if (t->size != 0) {
+        size_t nbytes = (h->layout == GENHASH_OPEN_ADDRESSING) ?
+            sizeof(struct genhash_slot_t) : sizeof(struct genhash_entry_t *);
+        memset(h->layout == GENHASH_OPEN_ADDRESSING ?
+               (void*)t->u.slots : (void*)t->u.buckets, 0, t->size * nbytes);
+    }
+    t->used = 0;
+    return rv;
+}
+
+int genhash_clear(genhash_t *h)
+{
+    int rv = 0;
+    cb_assert(h != NULL);
+
+    rv += table_clear(h, &h->table);
+    rv += table_clear(h, &h->old);
+    table_free(h, &h->old);
+    h->migrated = 0;
+    h->nentries = 0;
 
     return rv;
 }
@@ -294,10 +629,8 @@ static void count_entries(const void *key, size_t klen,
 }
 
 int genhash_size(genhash_t* h) {
-    int rv=0;
     cb_assert(h != NULL);
-    genhash_iter(h, count_entries, &rv);
-    return rv;
+    return (int)h->nentries;
 }
 
 int genhash_size_for_key(genhash_t* h, const void* k, size_t klen)
@@ -308,24 +641,90 @@ int genhash_size_for_key(genhash_t* h, const void* k, size_t klen)
     return rv;
 }
 
+static void table_iter_key(genhash_t *h, struct genhash_table_t *t,
+                           unsigned int hash, const void* key, size_t klen,
+                           void (*iterfunc)(const void* key, size_t klen,
+                                            const void* val, size_t vlen,
+                                            void *arg), void *arg)
+{
+    struct genhash_entry_t *p=NULL;
+
+    if (t->size == 0) {
+        return;
+    }
+    if (h->layout == GENHASH_OPEN_ADDRESSING) {
+        /* All of the values in the slot are for the key */
+        for (p=table_find_entry(h, t, hash, key, klen); p!=NULL; p=p->next) {
+            iterfunc(p->key, p->nkey, p->value, p->nvalue, arg);
+        }
+        return;
+    }
+
+    for(p=t->u.buckets[hash % t->size]; p!=NULL; p=p->next) {
+        if(entry_matches(h, p, hash, key, klen)) {
+            iterfunc(p->key, p->nkey, p->value, p->nvalue, arg);
+        }
+    }
+}
+
 void genhash_iter_key(genhash_t* h, const void* key, size_t klen,
                       void (*iterfunc)(const void* key, size_t klen,
                                        const void* val, size_t vlen,
                                        void *arg), void *arg)
 {
-    size_t n=0;
-    struct genhash_entry_t *p=NULL;
+    unsigned int hash;
 
     cb_assert(h != NULL);
-    n=h->ops.hashfunc(key, klen) % h->size;
-    cb_assert((int)n >= 0);
-    cb_assert(n < h->size);
+    hash = key_hash(h, key, klen);
+    table_iter_key(h, &h->table, hash, key, klen, iterfunc, arg);
+    table_iter_key(h, &h->old, hash, key, klen, iterfunc, arg);
+}
 
-    for(p=h->buckets[n]; p!=NULL; p=p->next) {
-        if(h->ops.hasheq(key, klen, p->key, p->nkey)) {
-            iterfunc(p->key, p->nkey, p->value, p->nvalue, arg);
+static size_t table_max_probe(genhash_t *h, struct genhash_table_t *t)
+{
+    size_t max = 0;
+    size_t i;
+
+    for (i = 0; i < t->size; i++) {
+        size_t len = 0;
+        if (h->layout == GENHASH_OPEN_ADDRESSING) {
+            struct genhash_slot_t *s = &t->u.slots[i];
+            if (s->entry != NULL && s->entry != TOMBSTONE) {
+                len = ((i - slot_index(s->hash, t->size)) & (t->size - 1)) + 1;
+            }
+        } else {
+            struct genhash_entry_t *p;
+            for (p = t->u.buckets[i]; p != NULL; p = p->next) {
+                len++;
+            }
+        }
+        if (len > max) {
+            max = len;
         }
     }
+    return max;
+}
+
+void genhash_get_stats(genhash_t *h, struct genhash_stats *stats)
+{
+    size_t old_probe;
+
+    cb_assert(h != NULL);
+    stats->entries = h->nentries;
+    stats->buckets = h->table.size;
+    if (h->layout == GENHASH_OPEN_ADDRESSING) {
+        stats->load_factor = (double)(h->table.used + h->old.used) /
+            h->table.size;
+    } else {
+        stats->load_factor = (double)h->nentries / h->table.size;
+    }
+    stats->max_probe = table_max_probe(h, &h->table);
+    old_probe = table_max_probe(h, &h->old);
+    if (old_probe > stats->max_probe) {
+        stats->max_probe = old_probe;
+    }
+    stats->resizes = h->resizes;
+    stats->rehashing = h->old.size != 0;
 }
 
 int genhash_string_hash(const void* p, size_t nkey)
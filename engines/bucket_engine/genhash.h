@@ -77,9 +77,44 @@ enum update_type {
     NEW           /**< This update is creating a new entry */
 };
 
+/**
+ * How the entries are laid out in the hash table.
+ */
+enum genhash_layout {
+    /** Buckets of chained entries */
+    GENHASH_CHAINED,
+    /**
+     * Open addressing (linear probing) over slots holding the hash of the
+     * key, so a lookup rarely looks at an entry which isn't the one
+     */
+    GENHASH_OPEN_ADDRESSING
+};
+
+/**
+ * Statistics about the layout of a hash table.
+ */
+struct genhash_stats {
+    /** The number of values stored */
+    size_t entries;
+    /** The number of buckets (or slots) of the table */
+    size_t buckets;
+    /** Keys (open addressing) or values (chained) per bucket */
+    double load_factor;
+    /** The longest chain, or probe sequence */
+    size_t max_probe;
+    /** The number of times the table was grown */
+    size_t resizes;
+    /** Set if the entries are being moved over to a grown table */
+    int rehashing;
+};
+
 /**
  * Create a new generic hashtable.
  *
+ * The table is grown as entries are added. Every update moves a few
+ * buckets of the old table over, so no single operation pays for the
+ * whole rehash.
+ *
  * @param est the estimated number of items to store (must be > 0)
  * @param ops the key and value operations
  *
@@ -88,6 +123,19 @@ enum update_type {
 MEMCACHED_PUBLIC_API
 genhash_t* genhash_init(int est, struct hash_ops ops);
 
+/**
+ * Create a new generic hashtable with the given layout.
+ *
+ * @param est the estimated number of items to store (must be > 0)
+ * @param ops the key and value operations
+ * @param layout how to lay out the entries
+ *
+ * @return the new genhash_t or NULL if one cannot be created
+ */
+MEMCACHED_PUBLIC_API
+genhash_t* genhash_init_layout(int est, struct hash_ops ops,
+                               enum genhash_layout layout);
+
 /**
  * Free a gen hash.
  *
@@ -237,6 +285,15 @@ int genhash_clear(genhash_t *h);
 MEMCACHED_PUBLIC_API
 int genhash_size_for_key(genhash_t *h, const void *k, size_t nkey);
 
+/**
+ * Get statistics about the layout of the hash table.
+ *
+ * @param h the genhash
+ * @param stats where to store them
+ */
+MEMCACHED_PUBLIC_API
+void genhash_get_stats(genhash_t *h, struct genhash_stats *stats);
+
 /**
  * Convenient hash function for strings.
  *
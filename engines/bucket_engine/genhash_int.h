@@ -10,12 +10,52 @@ struct genhash_entry_t {
     void *value;
     /** Size of the value */
     size_t nvalue;
-    /** Pointer to the next entry */
+    /**
+     * Pointer to the next entry: the next one in the bucket in a chained
+     * table, and the next (older) value of the same key in an open
+     * addressing table.
+     */
     struct genhash_entry_t *next;
+    /** The hash of the key, so it is only computed once */
+    unsigned int hash;
 };
 
-struct _genhash {
+/**
+ * \private
+ * A slot in an open addressing table.
+ */
+struct genhash_slot_t {
+    /** The hash of the key, so most probes don't look at the entry */
+    unsigned int hash;
+    /** The most recent value for the key (NULL if unused) */
+    struct genhash_entry_t *entry;
+};
+
+/**
+ * \private
+ */
+struct genhash_table_t {
+    /** The number of buckets (or slots) */
     size_t size;
+    /** The number of slots in use (open addressing only) */
+    size_t used;
+    union {
+        struct genhash_entry_t **buckets;
+        struct genhash_slot_t *slots;
+    } u;
+};
+
+struct _genhash {
     struct hash_ops ops;
-   struct genhash_entry_t *buckets[1]; /* It is actually variable size */
+    enum genhash_layout layout;
+    /** Number of values stored */
+    size_t nentries;
+    /** The table new entries go to */
+    struct genhash_table_t table;
+    /** The table being moved over to the new one while rehashing */
+    struct genhash_table_t old;
+    /** How far we've gotten moving the old table */
+    size_t migrated;
+    /** Number of times the table was grown */
+    size_t resizes;
 };
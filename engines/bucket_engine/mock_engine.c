@@ -309,6 +309,18 @@ static ENGINE_ERROR_CODE mock_initialize(ENGINE_HANDLE* handle,
 
     cb_assert(my_hash_ops.dupKey);
 
+    if (strcmp(config_str, "slow_init") == 0) {
+        /* Take a while, like a big bucket warming up */
+        int ii;
+        for (ii = 0; ii < 200; ++ii) {
+#ifdef WIN32
+            Sleep(10);
+#else
+            usleep(10000);
+#endif
+        }
+    }
+
     if (strcmp(config_str, "no_alloc") != 0) {
         se->hashtbl = genhash_init(1, my_hash_ops);
         cb_assert(se->hashtbl);
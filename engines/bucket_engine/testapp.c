@@ -91,6 +91,7 @@ struct connstruct {
     void *engine_data;
     bool connected;
     bool admin;
+    CONN_PRIORITY priority;
     struct connstruct *next;
 };
 
@@ -243,6 +244,11 @@ static bool cookie_is_admin(const void *cookie) {
     return ((struct connstruct *)cookie)->admin;
 }
 
+static void cookie_set_priority(const void *cookie, CONN_PRIORITY priority) {
+    cb_assert(cookie);
+    ((struct connstruct *)cookie)->priority = priority;
+}
+
 static void *create_stats(void) {
     /* XXX: Not sure if ``big buffer'' is right in faking this part of
        the server. */
@@ -303,6 +309,47 @@ static rel_time_t get_current_time(void) {
     return (rel_time_t)time(NULL);
 }
 
+static uint32_t key_hash(const void *key, size_t length, const uint32_t initval) {
+    const unsigned char *ptr = key;
+    uint32_t h = initval;
+    size_t ii;
+    for (ii = 0; ii < length; ++ii) {
+        h = h * 31 + ptr[ii];
+    }
+    return h;
+}
+
+static void (*test_new_hook)(const void *ptr, size_t size);
+static void (*test_delete_hook)(const void *ptr);
+
+static bool add_new_hook(void (*hook)(const void *ptr, size_t size)) {
+    test_new_hook = hook;
+    return true;
+}
+
+static bool remove_new_hook(void (*hook)(const void *ptr, size_t size)) {
+    cb_assert(test_new_hook == hook);
+    test_new_hook = NULL;
+    return true;
+}
+
+static bool add_delete_hook(void (*hook)(const void *ptr)) {
+    test_delete_hook = hook;
+    return true;
+}
+
+static bool remove_delete_hook(void (*hook)(const void *ptr)) {
+    cb_assert(test_delete_hook == hook);
+    test_delete_hook = NULL;
+    return true;
+}
+
+/* Everything "freed" through test_delete_hook is this big */
+static size_t get_allocation_size(const void *ptr) {
+    (void)ptr;
+    return 1000;
+}
+
 /**
  * Callback the engines may call to get the public server interface
  * @param interface the requested interface from the server
@@ -316,11 +363,13 @@ static SERVER_HANDLE_V1 *get_server_api(void)
     static SERVER_STAT_API server_stat_api;
     static SERVER_EXTENSION_API extension_api;
     static SERVER_CALLBACK_API callback_api;
+    static ALLOCATOR_HOOKS_API hooks_api;
     static SERVER_HANDLE_V1 rv;
 
     core_api.server_version = get_server_version;
     core_api.get_current_time = get_current_time;
     core_api.parse_config = parse_config;
+    core_api.hash = key_hash;
 
     cookie_api.get_auth_data = get_auth_data;
     cookie_api.store_engine_specific = store_engine_specific;
@@ -332,6 +381,7 @@ static SERVER_HANDLE_V1 *get_server_api(void)
     cookie_api.release = release_cookie;
     cookie_api.set_admin = cookie_set_admin;
     cookie_api.is_admin = cookie_is_admin;
+    cookie_api.set_priority = cookie_set_priority;
 
     server_stat_api.new_stats = create_stats;
     server_stat_api.release_stats = destroy_stats;
@@ -341,12 +391,19 @@ static SERVER_HANDLE_V1 *get_server_api(void)
     callback_api.register_callback = register_callback;
     callback_api.perform_callbacks = perform_callbacks;
 
+    hooks_api.add_new_hook = add_new_hook;
+    hooks_api.remove_new_hook = remove_new_hook;
+    hooks_api.add_delete_hook = add_delete_hook;
+    hooks_api.remove_delete_hook = remove_delete_hook;
+    hooks_api.get_allocation_size = get_allocation_size;
+
     rv.interface = 1;
     rv.core = &core_api;
     rv.stat = &server_stat_api;
     rv.extension = &extension_api;
     rv.callback = &callback_api;
     rv.cookie = &cookie_api;
+    rv.alloc_hooks = &hooks_api;
 
     return &rv;
 }
@@ -626,6 +683,33 @@ static enum test_result test_two_engines(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+static enum test_result test_bind_engine(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1) {
+    const void *cookie1 = mk_conn("user1", NULL), *cookie2 = mk_conn("user2", NULL);
+    const char *key = "somekey";
+    item *itm, *fetched = NULL;
+    engine_binding_t binding;
+    ENGINE_ERROR_CODE rv;
+
+    cb_assert(h1->bind_engine != NULL);
+    cb_assert(h1->bind_engine(h, cookie1, &binding));
+    cb_assert(binding.v1 != h1);
+    cb_assert(*binding.current == binding.expected);
+    cb_assert(*binding.state == binding.live);
+
+    /* Stored through the binding, it's in the bucket of the connection */
+    store(binding.v0, binding.v1, cookie1, key, "some value", &itm);
+    rv = h1->get(h, cookie1, &fetched, key, (int)strlen(key), 0);
+    cb_assert(rv == ENGINE_SUCCESS);
+    assert_item_eq(h, h1, cookie1, itm, cookie1, fetched);
+    binding.v1->release(binding.v0, cookie1, itm);
+
+    rv = h1->get(h, cookie2, &fetched, key, (int)strlen(key), 0);
+    cb_assert(rv == ENGINE_KEY_ENOENT);
+
+    return SUCCESS;
+}
+
 static enum test_result test_two_engines_del(ENGINE_HANDLE *h,
                                              ENGINE_HANDLE_V1 *h1) {
     item *item1, *item2, *fetched_item1 = NULL, *fetched_item2 = NULL;
@@ -1404,13 +1488,17 @@ static enum test_result test_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
 
     rv = h1->get_stats(h, mk_conn("user", NULL), NULL, 0, add_stats);
     cb_assert(rv == ENGINE_SUCCESS);
-    cb_assert(genhash_size(stats_hash) == 2);
+    cb_assert(genhash_size(stats_hash) == 4);
 
     cb_assert(memcmp("0",
                   genhash_find(stats_hash, "bucket_conns", strlen("bucket_conns")),
                   1) == 0);
     cb_assert(genhash_find(stats_hash, "bucket_active_conns",
                         strlen("bucket_active_conns")) != NULL);
+    cb_assert(strcmp("0", genhash_find(stats_hash, "bucket_ops_limit",
+                                       strlen("bucket_ops_limit"))) == 0);
+    cb_assert(strcmp("0", genhash_find(stats_hash, "bucket_ops_throttled",
+                                       strlen("bucket_ops_throttled"))) == 0);
 
     return SUCCESS;
 }
@@ -1443,6 +1531,357 @@ static enum test_result test_stats_bucket(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+static uint16_t slow_create_status;
+
+static bool slow_create_response(const void *key, uint16_t keylen,
+                                 const void *ext, uint8_t extlen,
+                                 const void *body, uint32_t bodylen,
+                                 uint8_t datatype, uint16_t status,
+                                 uint64_t cas, const void *cookie) {
+    (void)key; (void)keylen; (void)ext; (void)extlen;
+    (void)body; (void)bodylen; (void)datatype; (void)cas; (void)cookie;
+    slow_create_status = status;
+    return true;
+}
+
+static void slow_create_bucket_thread(void *arg) {
+    struct handle_pair *hp = arg;
+    void *pkt = create_create_bucket_pkt("slowbucket", ENGINE_PATH,
+                                         "slow_init");
+    ENGINE_ERROR_CODE rv = hp->h1->unknown_command(hp->h, mk_conn("admin", NULL),
+                                                   pkt, slow_create_response);
+    cb_assert(rv == ENGINE_SUCCESS);
+    free(pkt);
+}
+
+static const char *bucket_state_of(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                   const char *name) {
+    ENGINE_ERROR_CODE rv;
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, mk_conn("admin", NULL), "bucket", 6, add_stats);
+    cb_assert(rv == ENGINE_SUCCESS);
+    return genhash_find(stats_hash, name, strlen(name));
+}
+
+static enum test_result test_create_bucket_concurrent(ENGINE_HANDLE *h,
+                                                      ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    struct handle_pair hp;
+    cb_thread_t tid;
+    const char *state;
+    item *itm;
+    ENGINE_ERROR_CODE rv;
+    void *pkt;
+    int r;
+
+    hp.h = h;
+    hp.h1 = h1;
+    slow_create_status = 0xffff;
+    r = cb_create_thread(&tid, slow_create_bucket_thread, &hp, 0);
+    cb_assert(r == 0);
+
+    while ((state = bucket_state_of(h, h1, "slowbucket")) == NULL) {
+        delay();
+    }
+    cb_assert(strcmp(state, "creating") == 0);
+
+    /* Nobody gets to use it before it's up */
+    rv = h1->get(h, mk_conn("slowbucket", NULL), &itm, "k", 1, 0);
+    cb_assert(rv == ENGINE_NO_BUCKET);
+    pkt = create_create_bucket_pkt("slowbucket", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
+
+    /* Other buckets come and go meanwhile */
+    pkt = create_create_bucket_pkt("fastbucket", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == 0);
+    cb_assert(strcmp(bucket_state_of(h, h1, "fastbucket"), "running") == 0);
+    cb_assert(strcmp(bucket_state_of(h, h1, "slowbucket"), "creating") == 0);
+
+    r = cb_join_thread(tid);
+    cb_assert(r == 0);
+    cb_assert(slow_create_status == 0);
+    cb_assert(strcmp(bucket_state_of(h, h1, "slowbucket"), "running") == 0);
+
+    return SUCCESS;
+}
+
+static enum test_result test_find_bucket_unlocked(ENGINE_HANDLE *h,
+                                                  ENGINE_HANDLE_V1 *h1) {
+    struct bucket_engine *bucket_engine = (struct bucket_engine *)h;
+    const void *adm_cookie = mk_conn("admin", NULL);
+    const char *key = "somekey";
+    ENGINE_ERROR_CODE rv;
+    item *itm;
+    void *pkt;
+
+    pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == 0);
+
+    /* Auth finds the bucket while the engines table is locked */
+    cb_mutex_enter(&bucket_engine->engines_mutex);
+    rv = h1->get(h, mk_conn("someuser", NULL), &itm, key, (int)strlen(key), 0);
+    cb_assert(rv == ENGINE_KEY_ENOENT);
+    rv = h1->get(h, mk_conn("nobucket", NULL), &itm, key, (int)strlen(key), 0);
+    cb_assert(rv == ENGINE_NO_BUCKET);
+    cb_mutex_exit(&bucket_engine->engines_mutex);
+
+    /* and no longer finds it once it's deleted */
+    pkt = create_packet(PROTOCOL_BINARY_CMD_DELETE_BUCKET, "someuser", "force=false");
+    cb_mutex_enter(&notify_mutex);
+    notify_code = ENGINE_FAILED;
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    cb_assert(rv == ENGINE_EWOULDBLOCK);
+    cb_cond_wait(&notify_cond, &notify_mutex);
+    cb_mutex_exit(&notify_mutex);
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == 0);
+
+    rv = h1->get(h, mk_conn("someuser", NULL), &itm, key, (int)strlen(key), 0);
+    cb_assert(rv == ENGINE_NO_BUCKET);
+
+    return SUCCESS;
+}
+
+static int aggregated_buckets;
+
+static void count_aggregated(void *in, void *out) {
+    cb_assert(in != NULL);
+    cb_assert(out == &aggregated_buckets);
+    ++aggregated_buckets;
+}
+
+static enum test_result test_aggregate_stats_unlocked(ENGINE_HANDLE *h,
+                                                      ENGINE_HANDLE_V1 *h1) {
+    struct bucket_engine *bucket_engine = (struct bucket_engine *)h;
+    const void *adm_cookie = mk_conn("admin", NULL);
+    ENGINE_ERROR_CODE rv;
+    void *pkt;
+
+    pkt = create_create_bucket_pkt("bucket1", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == 0);
+    pkt = create_create_bucket_pkt("bucket2", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == 0);
+
+    /* The buckets are summed up while the engines table is locked */
+    aggregated_buckets = 0;
+    cb_mutex_enter(&bucket_engine->engines_mutex);
+    rv = h1->aggregate_stats(h, adm_cookie, count_aggregated,
+                             &aggregated_buckets);
+    cb_mutex_exit(&bucket_engine->engines_mutex);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(aggregated_buckets == 2);
+
+    return SUCCESS;
+}
+
+/* While the bucket serves a stats call, "allocate" or "free" memory */
+static int hook_calls;
+static size_t hook_alloc;
+
+static void hooked_add_stats(const char *key, const uint16_t klen,
+                             const char *val, const uint32_t vlen,
+                             const void *cookie) {
+    if (hook_alloc != 0) {
+        test_new_hook(cookie, hook_alloc);
+    } else {
+        test_delete_hook(cookie);
+    }
+    ++hook_calls;
+    add_stats(key, klen, val, vlen, cookie);
+}
+
+static long long bucket_mem_used(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                 const void *cookie) {
+    const char *val;
+    ENGINE_ERROR_CODE rv;
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, cookie, NULL, 0, add_stats);
+    cb_assert(rv == ENGINE_SUCCESS);
+    val = genhash_find(stats_hash, "bucket_mem_used",
+                       strlen("bucket_mem_used"));
+    cb_assert(val != NULL);
+    return atoll(val);
+}
+
+static enum test_result test_bucket_mem_used(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    const void *user_cookie;
+    ENGINE_ERROR_CODE rv;
+    int allocs, frees;
+    void *pkt;
+
+    cb_assert(test_new_hook != NULL && test_delete_hook != NULL);
+
+    pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == 0);
+    user_cookie = mk_conn("someuser", NULL);
+    cb_assert(bucket_mem_used(h, h1, user_cookie) == 0);
+
+    /* Small ones add up on the thread until it leaves the bucket */
+    hook_calls = 0;
+    hook_alloc = 3000;
+    rv = h1->get_stats(h, user_cookie, NULL, 0, hooked_add_stats);
+    cb_assert(rv == ENGINE_SUCCESS);
+    allocs = hook_calls;
+    cb_assert(allocs > 0);
+    cb_assert(bucket_mem_used(h, h1, user_cookie) == 3000LL * allocs);
+
+    /* As do big ones, which go straight to the bucket */
+    hook_calls = 0;
+    hook_alloc = 100000;
+    rv = h1->get_stats(h, user_cookie, NULL, 0, hooked_add_stats);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(hook_calls == allocs);
+    cb_assert(bucket_mem_used(h, h1, user_cookie) == 103000LL * allocs);
+
+    hook_calls = 0;
+    hook_alloc = 0;
+    rv = h1->get_stats(h, user_cookie, NULL, 0, hooked_add_stats);
+    cb_assert(rv == ENGINE_SUCCESS);
+    frees = hook_calls;
+    cb_assert(bucket_mem_used(h, h1, user_cookie) ==
+              103000LL * allocs - 1000LL * frees);
+
+    /* Nothing is charged outside of a call into a bucket */
+    test_new_hook(user_cookie, 5000);
+    test_delete_hook(user_cookie);
+    cb_assert(bucket_mem_used(h, h1, user_cookie) ==
+              103000LL * allocs - 1000LL * frees);
+
+    /* and other buckets have their own count */
+    pkt = create_create_bucket_pkt("otheruser", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(bucket_mem_used(h, h1, mk_conn("otheruser", NULL)) == 0);
+
+    return SUCCESS;
+}
+
+static enum test_result test_bucket_ops_limit(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    struct connstruct *user_cookie;
+    const char *key = "somekey";
+    int ii, throttled = 0;
+    item *itm;
+    ENGINE_ERROR_CODE rv;
+    void *pkt;
+
+    pkt = create_create_bucket_pkt("badbucket", ENGINE_PATH,
+                                   "bucket_priority=urgent");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == PROTOCOL_BINARY_RESPONSE_NOT_STORED);
+
+    pkt = create_create_bucket_pkt("someuser", ENGINE_PATH,
+                                   "bucket_ops_limit=5;bucket_priority=low");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == 0);
+
+    user_cookie = mk_conn("someuser", NULL);
+    cb_assert(user_cookie->priority == CONN_PRIORITY_LOW);
+
+    /* More than a second worth, even if the clock ticks in between */
+    for (ii = 0; ii < 20; ++ii) {
+        rv = h1->get(h, user_cookie, &itm, key, (int)strlen(key), 0);
+        if (rv == ENGINE_TMPFAIL) {
+            ++throttled;
+        } else {
+            cb_assert(rv == ENGINE_KEY_ENOENT);
+        }
+    }
+    cb_assert(throttled > 0);
+
+    rv = h1->get_stats(h, user_cookie, NULL, 0, add_stats);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(strcmp("5", genhash_find(stats_hash, "bucket_ops_limit",
+                                       strlen("bucket_ops_limit"))) == 0);
+    cb_assert(atoi(genhash_find(stats_hash, "bucket_ops_throttled",
+                                strlen("bucket_ops_throttled"))) == throttled);
+    cb_assert(strcmp("low", genhash_find(stats_hash, "bucket_priority",
+                                         strlen("bucket_priority"))) == 0);
+
+    return SUCCESS;
+}
+
+static enum test_result test_bind_engine_ops_limit(ENGINE_HANDLE *h,
+                                                   ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    engine_binding_t binding;
+    ENGINE_ERROR_CODE rv;
+    void *pkt;
+
+    pkt = create_create_bucket_pkt("someuser", ENGINE_PATH,
+                                   "bucket_ops_limit=5");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == 0);
+
+    /* The proxy has to count its ops, so it stays in the call path */
+    cb_assert(!h1->bind_engine(h, mk_conn("someuser", NULL), &binding));
+
+    return SUCCESS;
+}
+
+static enum test_result test_stats_bucket_map(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+    const void *adm_cookie = mk_conn("admin", NULL);
+    char name[32];
+    int ii;
+
+    for (ii = 0; ii < 20; ++ii) {
+        void *pkt;
+        snprintf(name, sizeof(name), "bucket%d", ii);
+        pkt = create_create_bucket_pkt(name, ENGINE_PATH, "");
+        rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+        free(pkt);
+        cb_assert(rv == ENGINE_SUCCESS);
+        cb_assert(last_status == 0);
+    }
+
+    rv = h1->get_stats(h, mk_conn("user", NULL), "bucket_map", 10, add_stats);
+    cb_assert(rv == ENGINE_FAILED);
+    cb_assert(genhash_size(stats_hash) == 0);
+
+    rv = h1->get_stats(h, adm_cookie, "bucket_map", 10, add_stats);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(genhash_size(stats_hash) == 5);
+    cb_assert(strcmp("20", genhash_find(stats_hash, "entries", 7)) == 0);
+    cb_assert(atoi(genhash_find(stats_hash, "buckets", 7)) >= 40);
+    cb_assert(atoi(genhash_find(stats_hash, "resizes", 7)) > 0);
+    cb_assert(atof(genhash_find(stats_hash, "load_factor", 11)) <= 0.5);
+    cb_assert(atoi(genhash_find(stats_hash, "max_probe", 9)) > 0);
+
+    return SUCCESS;
+}
+
 static enum test_result test_unknown_call_no_bucket(ENGINE_HANDLE *h,
                                                     ENGINE_HANDLE_V1 *h1) {
 
@@ -1658,6 +2097,41 @@ static enum test_result test_topkeys(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_topkeys_heavy_hitters(ENGINE_HANDLE *h,
+                                                   ENGINE_HANDLE_V1 *h1) {
+    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+    const void *adm_cookie = mk_conn("admin", NULL);
+    char key[32];
+    char *val;
+    int ii;
+    void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    cb_assert(rv == ENGINE_SUCCESS);
+    free(pkt);
+
+    /* Far more keys accessed once than there is room for, and a hot one */
+    for (ii = 0; ii < 50; ++ii) {
+        pkt = create_packet(PROTOCOL_BINARY_CMD_GET_REPLICA, "hotkey", "someval");
+        rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+        cb_assert(rv == ENGINE_SUCCESS);
+        free(pkt);
+
+        snprintf(key, sizeof(key), "coldkey_%d", ii);
+        pkt = create_packet(PROTOCOL_BINARY_CMD_GET_REPLICA, key, "someval");
+        rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+        cb_assert(rv == ENGINE_SUCCESS);
+        free(pkt);
+    }
+
+    rv = h1->get_stats(h, adm_cookie, "topkeys", 7, add_stats);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(genhash_size(stats_hash) == 10);
+    val = genhash_find(stats_hash, "hotkey", strlen("hotkey"));
+    cb_assert(val != NULL);
+    cb_assert(strstr(val, "get_hits=50,") != NULL);
+    return SUCCESS;
+}
+
 static engine_reference* engine_ref = NULL;
 
 static ENGINE_HANDLE_V1 *start_your_engines(const char *cfg) {
@@ -1772,6 +2246,80 @@ static void* hash_strdup(const void *x, size_t n) {
     return memcpy(rv, x, n);
 }
 
+static void check_genhash_layout(enum genhash_layout layout) {
+    struct hash_ops ops;
+    struct genhash_stats hs;
+    genhash_t *h;
+    char key[32];
+    int ii;
+
+    memset(&ops, 0, sizeof(ops));
+    ops.hashfunc = genhash_string_hash;
+    ops.hasheq = hash_key_eq;
+    ops.dupKey = hash_strdup;
+    ops.freeKey = free;
+
+    h = genhash_init_layout(1, ops, layout);
+    cb_assert(h);
+
+    /* Grow the table a number of times */
+    for (ii = 0; ii < 5000; ++ii) {
+        snprintf(key, sizeof(key), "key%d", ii);
+        genhash_store(h, key, strlen(key), (void*)(uintptr_t)(ii + 1), 0);
+    }
+    cb_assert(genhash_size(h) == 5000);
+    for (ii = 0; ii < 5000; ++ii) {
+        snprintf(key, sizeof(key), "key%d", ii);
+        cb_assert(genhash_find(h, key, strlen(key)) ==
+                  (void*)(uintptr_t)(ii + 1));
+    }
+    cb_assert(genhash_find(h, "nokey", 5) == NULL);
+
+    genhash_get_stats(h, &hs);
+    cb_assert(hs.entries == 5000);
+    cb_assert(hs.buckets >= 2500);
+    cb_assert(hs.resizes > 0);
+    cb_assert(hs.load_factor <= 1.0);
+    cb_assert(hs.max_probe > 0);
+
+    /* The most recent value of a key is the one found and deleted */
+    cb_assert(genhash_update(h, "key7", 4, (void*)1, 0) == MODIFICATION);
+    genhash_store(h, "key7", 4, (void*)2, 0);
+    genhash_store(h, "key7", 4, (void*)3, 0);
+    cb_assert(genhash_size_for_key(h, "key7", 4) == 3);
+    cb_assert(genhash_find(h, "key7", 4) == (void*)3);
+    cb_assert(genhash_delete(h, "key7", 4) == 1);
+    cb_assert(genhash_find(h, "key7", 4) == (void*)2);
+    cb_assert(genhash_delete_all(h, "key7", 4) == 2);
+    cb_assert(genhash_find(h, "key7", 4) == NULL);
+    cb_assert(genhash_size(h) == 4999);
+
+    /* Everything else survives the deletes */
+    for (ii = 0; ii < 5000; ii += 2) {
+        snprintf(key, sizeof(key), "key%d", ii);
+        genhash_delete(h, key, strlen(key));
+    }
+    cb_assert(genhash_size(h) == 2499);
+    for (ii = 1; ii < 5000; ii += 2) {
+        snprintf(key, sizeof(key), "key%d", ii);
+        cb_assert(genhash_find(h, key, strlen(key)) ==
+                  (ii == 7 ? NULL : (void*)(uintptr_t)(ii + 1)));
+    }
+
+    cb_assert(genhash_clear(h) == 2499);
+    cb_assert(genhash_size(h) == 0);
+    cb_assert(genhash_find(h, "key1", 4) == NULL);
+    genhash_free(h);
+}
+
+static enum test_result test_genhash(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    (void)h;
+    (void)h1;
+    check_genhash_layout(GENHASH_CHAINED);
+    check_genhash_layout(GENHASH_OPEN_ADDRESSING);
+    return SUCCESS;
+}
+
 static int execute_test(struct test test) {
     enum test_result ret = PENDING;
 
@@ -1897,11 +2445,23 @@ int main(int argc, char **argv) {
         {"flush from one of two nodes", test_two_engines_flush,
          DEFAULT_CONFIG_AC},
         {"isolated arithmetic", test_arith, DEFAULT_CONFIG_AC},
+        {"bind engine", test_bind_engine, DEFAULT_CONFIG_AC},
+        {"no bind engine with an ops limit", test_bind_engine_ops_limit,
+         DEFAULT_CONFIG_NO_DEF},
         {"create bucket", test_create_bucket, DEFAULT_CONFIG_NO_DEF},
+        {"concurrent create bucket", test_create_bucket_concurrent,
+         DEFAULT_CONFIG_NO_DEF},
         {"double create bucket", test_double_create_bucket,
          DEFAULT_CONFIG_NO_DEF},
         {"create bucket with params", test_create_bucket_with_params,
          DEFAULT_CONFIG_NO_DEF},
+        {"bucket ops limit", test_bucket_ops_limit, DEFAULT_CONFIG_NO_DEF},
+        {"find bucket without the lock", test_find_bucket_unlocked,
+         DEFAULT_CONFIG_NO_DEF},
+        {"aggregate stats without the lock", test_aggregate_stats_unlocked,
+         DEFAULT_CONFIG_NO_DEF},
+        {"bucket mem_used", test_bucket_mem_used,
+         DEFAULT_CONFIG_NO_DEF ";mem_tracking=true"},
         {"create bucket with cas", test_create_bucket_with_cas,
          DEFAULT_CONFIG_NO_DEF},
         {"bucket name verification", test_bucket_name_validation, NULL},
@@ -1924,6 +2484,7 @@ int main(int argc, char **argv) {
          test_select_no_bucket, NULL},
         {"stats call", test_stats, NULL},
         {"stats bucket call", test_stats_bucket, NULL},
+        {"stats bucket_map call", test_stats_bucket_map, NULL},
         {"release call", test_release, NULL},
         {"unknown call delegation", test_unknown_call, NULL},
         {"unknown call delegation (no bucket)", test_unknown_call_no_bucket,
@@ -1938,6 +2499,8 @@ int main(int argc, char **argv) {
         {"concurrent connect/disconnect (tap)",
          test_concurrent_connect_disconnect_tap, NULL },
         {"topkeys", test_topkeys, NULL },
+        {"topkeys heavy hitters", test_topkeys_heavy_hitters, NULL },
+        {"genhash layouts", test_genhash, NULL },
         {NULL, NULL, NULL}
     };
 
@@ -1956,6 +2519,10 @@ int main(int argc, char **argv) {
             fprintf(stderr, "Invalid test specified\n");
             exit(EXIT_FAILURE);
         }
+        if (tests[testno].tfun == test_bind_engine) {
+            /* The topkeys keep the proxy engine in the way */
+            putenv("MEMCACHED_TOP_KEYS=0");
+        }
 
         exit(execute_test(tests[testno]));
     } else {
@@ -6,185 +6,331 @@
 #include <platform/platform.h>
 #include "topkeys.h"
 
-static topkey_item_t *topkey_item_init(const void *key, int nkey, rel_time_t ct) {
-    topkey_item_t *it = calloc(sizeof(topkey_item_t) + nkey, 1);
-    cb_assert(it);
-    cb_assert(key);
-    cb_assert(nkey > 0);
-    it->ti_nkey = nkey;
-    it->ti_ctime = ct;
-    it->ti_atime = ct;
-    /* Copy the key into the part trailing the struct */
-    memcpy(it + 1, key, nkey);
-    return it;
-}
+#define TK_EMPTY -1
 
-static size_t topkey_item_size(const topkey_item_t *it) {
-    return sizeof(topkey_item_t) + it->ti_nkey;
+static void tk_slot_free(tk_slot_t *slot) {
+    free(slot->items);
+    free(slot->heap);
+    free(slot->index);
 }
 
-static topkey_item_t* topkeys_tail(topkeys_t *tk) {
-    return (topkey_item_t*)(tk->list.prev);
-}
-
-static int my_hash_eq(const void *k1, size_t nkey1,
-                      const void *k2, size_t nkey2) {
-    return nkey1 == nkey2 && memcmp(k1, k2, nkey1) == 0;
-}
-
-topkeys_t *topkeys_init(int max_keys) {
-    static struct hash_ops my_hash_ops;
+topkeys_t *topkeys_init(int max_keys, int sample, topkeys_hash_t keyhash) {
     topkeys_t *tk = calloc(sizeof(topkeys_t), 1);
+    uint32_t nindex = 1;
+    int ii;
+
     if (tk == NULL) {
         return NULL;
     }
 
-    my_hash_ops.hashfunc = genhash_string_hash;
-    my_hash_ops.hasheq = my_hash_eq;
-    my_hash_ops.dupKey = NULL;
-    my_hash_ops.dupValue = NULL;
-    my_hash_ops.freeKey = NULL;
-    my_hash_ops.freeValue = NULL;
-
-    cb_mutex_initialize(&tk->mutex);
+    tk->keyhash = keyhash;
     tk->max_keys = max_keys;
-    tk->list.next = &tk->list;
-    tk->list.prev = &tk->list;
+    tk->sample = (sample > 0) ? sample : 1;
+    /* Keep the index no more than half full */
+    while (nindex < 2 * (uint32_t)max_keys) {
+        nindex <<= 1;
+    }
+    tk->index_mask = nindex - 1;
 
-    tk->hash = genhash_init(max_keys, my_hash_ops);
-    if (tk->hash == NULL) {
-        return NULL;
+    for (ii = 0; ii < TK_SLOTS; ++ii) {
+        cb_mutex_initialize(&tk->slots[ii].mutex);
+    }
+    for (ii = 0; ii < TK_SLOTS; ++ii) {
+        tk_slot_t *slot = &tk->slots[ii];
+        slot->items = calloc(max_keys, sizeof(topkey_item_t));
+        slot->heap = calloc(max_keys, sizeof(int));
+        slot->index = malloc(nindex * sizeof(int));
+        if (slot->items == NULL || slot->heap == NULL || slot->index == NULL) {
+            topkeys_free(tk);
+            return NULL;
+        }
+        memset(slot->index, 0xff, nindex * sizeof(int)); /* TK_EMPTY */
     }
 
     return tk;
 }
 
 void topkeys_free(topkeys_t *tk) {
-    dlist_t *p;
-    cb_mutex_destroy(&tk->mutex);
-    genhash_free(tk->hash);
-    p = tk->list.next;
-    while (p != &tk->list) {
-        dlist_t *tmp = p->next;
-        free(p);
-        p = tmp;
+    int ii;
+    for (ii = 0; ii < TK_SLOTS; ++ii) {
+        cb_mutex_destroy(&tk->slots[ii].mutex);
+        tk_slot_free(&tk->slots[ii]);
     }
     free(tk);
 }
 
-static void dlist_remove(dlist_t *list) {
-    cb_assert(list->prev->next == list);
-    cb_assert(list->next->prev == list);
-    list->prev->next = list->next;
-    list->next->prev = list->prev;
+/*
+ * The same slot for all of the updates done by a thread. Threads hashing
+ * to the same slot share it (and its lock).
+ */
+static tk_slot_t *tk_thread_slot(topkeys_t *tk) {
+    uint64_t id = (unsigned long)cb_thread_self();
+    unsigned int slot = (unsigned int)((id * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+    return &tk->slots[slot % TK_SLOTS];
+}
+
+static bool tk_key_matches(const topkey_item_t *it, uint32_t hash,
+                           const void *key, size_t nkey) {
+    return it->hash == hash && it->nkey == nkey &&
+        memcmp(it->key, key, nkey) == 0;
+}
+
+/******************************** MIN HEAP *********************************/
+
+static void tk_heap_swap(tk_slot_t *slot, int a, int b) {
+    int tmp = slot->heap[a];
+    slot->heap[a] = slot->heap[b];
+    slot->heap[b] = tmp;
+    slot->items[slot->heap[a]].heap_pos = a;
+    slot->items[slot->heap[b]].heap_pos = b;
+}
+
+static uint32_t tk_heap_count(const tk_slot_t *slot, int pos) {
+    return slot->items[slot->heap[pos]].count;
+}
+
+static void tk_heap_sift_up(tk_slot_t *slot, int pos) {
+    while (pos > 0 && tk_heap_count(slot, (pos - 1) / 2) > tk_heap_count(slot, pos)) {
+        tk_heap_swap(slot, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
 }
 
-static void dlist_insert_after(dlist_t *list, dlist_t *new) {
-    new->next = list->next;
-    new->prev = list;
-    list->next->prev = new;
-    list->next = new;
+/* The count of the item at pos grew */
+static void tk_heap_sift_down(tk_slot_t *slot, int pos) {
+    for (;;) {
+        int child = 2 * pos + 1;
+        if (child >= slot->nitems) {
+            return;
+        }
+        if (child + 1 < slot->nitems &&
+            tk_heap_count(slot, child + 1) < tk_heap_count(slot, child)) {
+            ++child;
+        }
+        if (tk_heap_count(slot, pos) <= tk_heap_count(slot, child)) {
+            return;
+        }
+        tk_heap_swap(slot, pos, child);
+        pos = child;
+    }
 }
 
-static void dlist_iter(dlist_t *list,
-                              void (*iterfunc)(dlist_t *item, void *arg),
-                              void *arg)
-{
-    dlist_t *p = list;
-    while ((p = p->next) != list) {
-        iterfunc(p, arg);
+/********************************** INDEX **********************************/
+
+static topkey_item_t *tk_index_find(topkeys_t *tk, tk_slot_t *slot,
+                                    uint32_t hash,
+                                    const void *key, size_t nkey) {
+    uint32_t pos = hash & tk->index_mask;
+    while (slot->index[pos] != TK_EMPTY) {
+        topkey_item_t *it = &slot->items[slot->index[pos]];
+        if (tk_key_matches(it, hash, key, nkey)) {
+            return it;
+        }
+        pos = (pos + 1) & tk->index_mask;
     }
+    return NULL;
 }
 
-static void topkeys_item_delete(topkeys_t *tk, topkey_item_t *it) {
-    genhash_delete(tk->hash, it + 1, it->ti_nkey);
-    dlist_remove(&it->ti_list);
-    --tk->nkeys;
-    free(it);
+static void tk_index_insert(topkeys_t *tk, tk_slot_t *slot, int item) {
+    uint32_t pos = slot->items[item].hash & tk->index_mask;
+    while (slot->index[pos] != TK_EMPTY) {
+        pos = (pos + 1) & tk->index_mask;
+    }
+    slot->index[pos] = item;
 }
 
-topkey_item_t *topkeys_item_get_or_create(topkeys_t *tk, const void *key, size_t nkey, const rel_time_t ct) {
-    topkey_item_t *it = genhash_find(tk->hash, key, nkey);
-    if (it == NULL) {
-        it = topkey_item_init(key, (int)nkey, ct);
-        if (it != NULL) {
-            if (++tk->nkeys > tk->max_keys) {
-                topkeys_item_delete(tk, topkeys_tail(tk));
-            }
-            genhash_update(tk->hash, it + 1, it->ti_nkey,
-                           it, topkey_item_size(it));
-        } else {
-            return NULL;
+static void tk_index_delete(topkeys_t *tk, tk_slot_t *slot, int item) {
+    uint32_t mask = tk->index_mask;
+    uint32_t pos = slot->items[item].hash & mask;
+    uint32_t next;
+
+    while (slot->index[pos] != item) {
+        pos = (pos + 1) & mask;
+    }
+    slot->index[pos] = TK_EMPTY;
+
+    /* Move back the entries which can't be found across the hole */
+    for (next = (pos + 1) & mask; slot->index[next] != TK_EMPTY;
+         next = (next + 1) & mask) {
+        uint32_t home = slot->items[slot->index[next]].hash & mask;
+        if (((next - home) & mask) >= ((next - pos) & mask)) {
+            slot->index[pos] = slot->index[next];
+            slot->index[next] = TK_EMPTY;
+            pos = next;
         }
-    } else {
-        dlist_remove(&it->ti_list);
-    }
-    dlist_insert_after(&tk->list, &it->ti_list);
-    return it;
-}
-
-struct tk_context {
-    const void *cookie;
-    ADD_STAT add_stat;
-    rel_time_t current_time;
-};
-
-static void tk_iterfunc(dlist_t *list, void *arg) {
-    struct tk_context *c = arg;
-    topkey_item_t *it = (topkey_item_t*)list;
-    char val_str[TK_MAX_VAL_LEN];
-    int vlen = snprintf(val_str, sizeof(val_str) - 1, "get_hits=%d,"
-                        "get_misses=0,cmd_set=0,incr_hits=0,incr_misses=0,"
-                        "decr_hits=0,decr_misses=0,delete_hits=0,"
-                        "delete_misses=0,evictions=0,cas_hits=0,cas_badval=0,"
-                        "cas_misses=0,get_replica=0,evict=0,getl=0,unlock=0,"
-                        "get_meta=0,set_meta=0,del_meta=0,ctime=%"PRIu32
-                        ",atime=%"PRIu32, it->access_count,
-                        c->current_time - it->ti_ctime,
-                        c->current_time - it->ti_atime);
-    c->add_stat((char*)(it + 1), it->ti_nkey, val_str, vlen, c->cookie);
-}
-
-ENGINE_ERROR_CODE topkeys_stats(topkeys_t **tks, size_t shards,
-                                const void *cookie,
-                                const rel_time_t current_time,
-                                ADD_STAT add_stat) {
-    struct tk_context context;
-    size_t i;
-    context.cookie = cookie;
-    context.add_stat = add_stat;
-    context.current_time = current_time;
-    for (i = 0; i < shards; i++) {
-        topkeys_t *tk = tks[i];
-        cb_assert(tk);
-        cb_mutex_enter(&tk->mutex);
-        dlist_iter(&tk->list, tk_iterfunc, &context);
-        cb_mutex_exit(&tk->mutex);
     }
-    return ENGINE_SUCCESS;
 }
 
-topkeys_t *tk_get_shard(topkeys_t **tks, const void *key, size_t nkey) {
-    /* This is special-cased for 8 */
-    int khash;
-    cb_assert(TK_SHARDS == 8);
-    khash = genhash_string_hash(key, nkey);
-    return tks[khash & 0x07];
+/***************************************************************************/
+
+/* Count an access in the sketch, returning the estimated number of them */
+static uint32_t tk_sketch_count(tk_slot_t *slot, uint32_t h1, uint32_t h2,
+                                uint32_t weight) {
+    uint32_t estimate = UINT32_MAX;
+    uint32_t ii;
+    for (ii = 0; ii < TK_SKETCH_DEPTH; ++ii) {
+        uint32_t *c = &slot->sketch[ii][(h1 + ii * h2) % TK_SKETCH_WIDTH];
+        *c = (*c > UINT32_MAX - weight) ? UINT32_MAX : *c + weight;
+        if (*c < estimate) {
+            estimate = *c;
+        }
+    }
+    return estimate;
+}
+
+static void tk_slot_count(topkeys_t *tk, tk_slot_t *slot,
+                          const void *key, size_t nkey, rel_time_t t) {
+    uint32_t weight = (uint32_t)tk->sample;
+    uint32_t hash = tk->keyhash(key, nkey, 0);
+    uint32_t estimate = tk_sketch_count(slot, hash,
+                                        tk->keyhash(key, nkey, hash) | 1,
+                                        weight);
+    topkey_item_t *it = tk_index_find(tk, slot, hash, key, nkey);
+    int item;
+
+    if (it != NULL) {
+        it->count += weight;
+        it->atime = t;
+        tk_heap_sift_down(slot, it->heap_pos);
+        return;
+    }
+
+    if (slot->nitems < tk->max_keys) {
+        item = slot->nitems++;
+        it = &slot->items[item];
+        it->count = weight;
+        it->heap_pos = item;
+        slot->heap[item] = item;
+    } else {
+        /* Replace the key counted the least, if this one beats it */
+        item = slot->heap[0];
+        it = &slot->items[item];
+        if (estimate <= it->count) {
+            return;
+        }
+        tk_index_delete(tk, slot, item);
+        it->count += weight;
+    }
+
+    it->hash = hash;
+    it->nkey = (uint16_t)nkey;
+    memcpy(it->key, key, nkey);
+    it->ctime = it->atime = t;
+    tk_heap_sift_up(slot, it->heap_pos);
+    tk_heap_sift_down(slot, it->heap_pos);
+    tk_index_insert(tk, slot, item);
 }
 
 /* Update the access_count for any valid operation */
-void topkeys_update(topkeys_t **tks, const void *key, size_t nkey,
+void topkeys_update(topkeys_t *tk, const void *key, size_t nkey,
                     rel_time_t operation_time) {
-    if (tks) {
-        cb_assert(key);
-        cb_assert(nkey > 0);
-        topkeys_t *tk = tk_get_shard(tks, key, nkey);
-        cb_mutex_enter(&tk->mutex);
-        topkey_item_t *tmp = topkeys_item_get_or_create(tk, key, nkey,
-                                                        operation_time);
-        if (tmp != NULL) {
-            tmp->access_count++;
+    tk_slot_t *slot;
+
+    if (tk == NULL) {
+        return;
+    }
+    cb_assert(key);
+    cb_assert(nkey > 0);
+
+    slot = tk_thread_slot(tk);
+    /* Racy if another thread shares the slot, but it's only sampling */
+    if (--slot->countdown > 0) {
+        return;
+    }
+    slot->countdown = tk->sample;
+    if (nkey > TK_MAX_KEY_LEN) {
+        return;
+    }
+
+    cb_mutex_enter(&slot->mutex);
+    tk_slot_count(tk, slot, key, nkey, operation_time);
+    cb_mutex_exit(&slot->mutex);
+}
+
+/* Merge the counts of a key tracked by several slots */
+static void tk_merge(topkey_item_t *merged, int *nmerged, int *index,
+                     uint32_t mask, const topkey_item_t *it) {
+    uint32_t pos = it->hash & mask;
+    while (index[pos] != TK_EMPTY) {
+        topkey_item_t *m = &merged[index[pos]];
+        if (tk_key_matches(m, it->hash, it->key, it->nkey)) {
+            m->count += it->count;
+            if (it->ctime < m->ctime) {
+                m->ctime = it->ctime;
+            }
+            if (it->atime > m->atime) {
+                m->atime = it->atime;
+            }
+            return;
         }
-        cb_mutex_exit(&tk->mutex);
+        pos = (pos + 1) & mask;
     }
+    index[pos] = *nmerged;
+    merged[(*nmerged)++] = *it;
+}
+
+static int tk_count_compare(const void *a, const void *b) {
+    const topkey_item_t *x = a;
+    const topkey_item_t *y = b;
+    if (x->count != y->count) {
+        return (x->count > y->count) ? -1 : 1;
+    }
+    return 0;
+}
+
+ENGINE_ERROR_CODE topkeys_stats(topkeys_t *tk,
+                                const void *cookie,
+                                const rel_time_t current_time,
+                                ADD_STAT add_stat) {
+    size_t nitems = (size_t)TK_SLOTS * tk->max_keys;
+    uint32_t nindex = 1;
+    topkey_item_t *merged;
+    int *index;
+    int nmerged = 0;
+    int ii, jj;
+
+    if (tk == NULL) {
+        return ENGINE_SUCCESS;
+    }
+
+    while (nindex < 2 * nitems) {
+        nindex <<= 1;
+    }
+    merged = malloc(nitems * sizeof(topkey_item_t));
+    index = malloc(nindex * sizeof(int));
+    if (merged == NULL || index == NULL) {
+        free(merged);
+        free(index);
+        return ENGINE_ENOMEM;
+    }
+    memset(index, 0xff, nindex * sizeof(int)); /* TK_EMPTY */
+
+    for (ii = 0; ii < TK_SLOTS; ++ii) {
+        tk_slot_t *slot = &tk->slots[ii];
+        cb_mutex_enter(&slot->mutex);
+        for (jj = 0; jj < slot->nitems; ++jj) {
+            tk_merge(merged, &nmerged, index, nindex - 1, &slot->items[jj]);
+        }
+        cb_mutex_exit(&slot->mutex);
+    }
+    free(index);
+
+    qsort(merged, nmerged, sizeof(topkey_item_t), tk_count_compare);
+    for (ii = 0; ii < nmerged && ii < tk->max_keys; ++ii) {
+        topkey_item_t *it = &merged[ii];
+        char val_str[TK_MAX_VAL_LEN];
+        int vlen = snprintf(val_str, sizeof(val_str) - 1, "get_hits=%"PRIu32","
+                            "get_misses=0,cmd_set=0,incr_hits=0,incr_misses=0,"
+                            "decr_hits=0,decr_misses=0,delete_hits=0,"
+                            "delete_misses=0,evictions=0,cas_hits=0,cas_badval=0,"
+                            "cas_misses=0,get_replica=0,evict=0,getl=0,unlock=0,"
+                            "get_meta=0,set_meta=0,del_meta=0,ctime=%"PRIu32
+                            ",atime=%"PRIu32, it->count,
+                            current_time - it->ctime,
+                            current_time - it->atime);
+        add_stat(it->key, it->nkey, val_str, vlen, cookie);
+    }
+    free(merged);
+
+    return ENGINE_SUCCESS;
 }
@@ -4,45 +4,66 @@
 
 #include <platform/cbassert.h>
 #include <memcached/engine.h>
-#include "genhash.h"
 
 #define TK_MAX_VAL_LEN 500
 
-#define TK_SHARDS 8
+/* The longest key tracked (the longest key memcached accepts) */
+#define TK_MAX_KEY_LEN 250
 
-typedef struct dlist {
-    struct dlist *next;
-    struct dlist *prev;
-} dlist_t;
+/* The number of slots the worker threads spread their updates over */
+#define TK_SLOTS 16
 
+/* The size of the count-min sketch of each slot */
+#define TK_SKETCH_DEPTH 4
+#define TK_SKETCH_WIDTH 512
+
+typedef uint32_t (*topkeys_hash_t)(const void *key, size_t nkey,
+                                   uint32_t seed);
+
+/* A key tracked by a slot (the Space-Saving counters) */
 typedef struct topkey_item {
-    dlist_t ti_list; /* Must be at the beginning because we downcast! */
-    int ti_nkey;
-    rel_time_t ti_ctime, ti_atime; /* Time this item was created/last accessed */
-    int access_count; /* Int count for number of times key has been accessed */
-    /* char ti_key[]; /\* A variable length array in the struct itself *\/ */
+    uint32_t hash;
+    uint32_t count;      /* accesses (may include those of the key it replaced) */
+    int heap_pos;        /* position in the slot's min heap of counts */
+    rel_time_t ctime, atime; /* Time this item was created/last accessed */
+    uint16_t nkey;
+    char key[TK_MAX_KEY_LEN];
 } topkey_item_t;
 
-typedef struct topkeys {
-    dlist_t list;
+/*
+ * The updates of a worker thread go to the slot its id hashes to, so the
+ * threads don't contend with each other: each slot counts the accesses it
+ * sees in a count-min sketch, and keeps the max_keys keys with the most of
+ * them with the Space-Saving algorithm (a key not tracked replaces the one
+ * counted the least, once the sketch says it was accessed more often).
+ * The slots are only merged when the stats are requested.
+ */
+typedef struct tk_slot {
     cb_mutex_t mutex;
-    genhash_t *hash;
-    int nkeys;
+    volatile int countdown;  /* updates to skip until the next sample */
+    int nitems;
+    topkey_item_t *items;    /* max_keys of them */
+    int *heap;               /* the items, by count (least first) */
+    int *index;              /* open addressing, the items by key hash */
+    uint32_t sketch[TK_SKETCH_DEPTH][TK_SKETCH_WIDTH];
+} tk_slot_t;
+
+typedef struct topkeys {
+    topkeys_hash_t keyhash;
     int max_keys;
+    int sample;              /* every sample'th update is counted */
+    uint32_t index_mask;
+    tk_slot_t slots[TK_SLOTS];
 } topkeys_t;
 
-topkeys_t *topkeys_init(int max_keys);
+topkeys_t *topkeys_init(int max_keys, int sample, topkeys_hash_t keyhash);
 void topkeys_free(topkeys_t *topkeys);
-topkeys_t *tk_get_shard(topkeys_t **tk, const void *key, size_t nkey);
-topkey_item_t *topkeys_item_get_or_create(topkeys_t *tk,
-                                          const void *key,
-                                          size_t nkey,
-                                          const rel_time_t ctime);
+
 /* Update the access_count for any valid operation */
-void topkeys_update(topkeys_t **tks, const void *key, size_t nkey,
+void topkeys_update(topkeys_t *tk, const void *key, size_t nkey,
                     rel_time_t operation_time);
 
-ENGINE_ERROR_CODE topkeys_stats(topkeys_t **tk, size_t n,
+ENGINE_ERROR_CODE topkeys_stats(topkeys_t *tk,
                                 const void *cookie,
                                 const rel_time_t current_time,
                                 ADD_STAT add_stat);
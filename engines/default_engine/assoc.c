@@ -16,32 +16,105 @@
 #define hashsize(n) ((size_t)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
+/* Bucketed buckets are aligned to this boundary */
+#define ASSOC_CACHE_LINE 64
+
+/* The largest table assoc_init presizes */
+#define ASSOC_MAX_HASHPOWER 30
+
+/* The item size assumed when the table is presized from the memory limit */
+#define ASSOC_PRESIZE_ITEM_SIZE 256
+
+/* Each thread of a parallel expansion moves at least this many buckets */
+#define ASSOC_MIGRATE_MIN_BUCKETS 16384
+
+static assoc_bucket *assoc_alloc_buckets(size_t nbuckets, void **mem) {
+    char *ptr = calloc(nbuckets * sizeof(assoc_bucket) + ASSOC_CACHE_LINE - 1, 1);
+    *mem = ptr;
+    if (ptr == NULL) {
+        return NULL;
+    }
+    return (assoc_bucket*)(((uintptr_t)ptr + ASSOC_CACHE_LINE - 1) &
+                           ~((uintptr_t)ASSOC_CACHE_LINE - 1));
+}
+
+/*
+ * The number of buckets (a power of 2) the chained table needs for the
+ * expected number of items (see config.expected_items and
+ * config.presize_hashtable) without being expanded.
+ */
+static unsigned int assoc_initial_hashpower(struct default_engine *engine) {
+    unsigned int hashpower = engine->assoc.hashpower;
+    size_t nitems = engine->config.expected_items;
+
+    if (nitems == 0 && engine->config.presize_hashtable) {
+        nitems = engine->config.maxbytes / ASSOC_PRESIZE_ITEM_SIZE;
+    }
+    /* Same load factor as assoc_insert expands at */
+    while (hashpower < ASSOC_MAX_HASHPOWER &&
+           (hashsize(hashpower) * 3) / 2 < nitems) {
+        ++hashpower;
+    }
+    return hashpower;
+}
+
 ENGINE_ERROR_CODE assoc_init(struct default_engine *engine) {
+    engine->assoc.hashpower = assoc_initial_hashpower(engine);
+    if (engine->config.bucketed_index) {
+        /*
+         * Each bucket holds several items, so start out with fewer buckets
+         * to end up with roughly the same capacity before the first
+         * expansion as the chained table.
+         */
+        engine->assoc.bucketed = true;
+        engine->assoc.hashpower -= 2;
+        engine->assoc.primary_buckets =
+            assoc_alloc_buckets(hashsize(engine->assoc.hashpower),
+                                &engine->assoc.primary_mem);
+        return (engine->assoc.primary_buckets != NULL) ? ENGINE_SUCCESS : ENGINE_ENOMEM;
+    }
+
     engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower),
                                              sizeof(hash_item*));
     return (engine->assoc.primary_hashtable != NULL) ? ENGINE_SUCCESS : ENGINE_ENOMEM;
 }
 
 void assoc_destroy(struct default_engine *engine) {
-    while (engine->assoc.expanding) {
-#ifdef WIN32
-        Sleep(1);
-#else
-        usleep(250);
-#endif
-    }
+    /* Any expansion in progress is completed before the thread stops */
+    stop_assoc_maintenance_thread(engine);
     free(engine->assoc.primary_hashtable);
+    free(engine->assoc.primary_mem);
 }
 
-hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
+/*
+ * Returns true (and the bucket number in the old table) if the key with
+ * the given hash should be looked up in the old table. The buckets of
+ * the old table are moved in any order (see assoc_migrate), and once a
+ * bucket is empty nothing is added to it again: the keys with the hash
+ * are in the old table as long as their bucket there isn't empty.
+ */
+static bool assoc_use_old_table(struct default_engine *engine, uint32_t hash,
+                                unsigned int *oldbucket) {
+    if (!engine->assoc.expanding) {
+        return false;
+    }
+    *oldbucket = hash & hashmask(engine->assoc.hashpower - 1);
+    if (engine->assoc.bucketed) {
+        const assoc_bucket *b = &engine->assoc.old_buckets[*oldbucket];
+        return b->used != 0 || b->overflow != NULL;
+    }
+    return engine->assoc.old_hashtable[*oldbucket] != NULL;
+}
+
+/******************************* CHAINED TABLE ******************************/
+
+static hash_item *chained_find(struct default_engine *engine, uint32_t hash,
+                               const char *key, const size_t nkey,
+                               int *depth) {
     hash_item *it;
     unsigned int oldbucket;
-    hash_item *ret = NULL;
-    int depth = 0;
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
+    if (assoc_use_old_table(engine, hash, &oldbucket)) {
         it = engine->assoc.old_hashtable[oldbucket];
     } else {
         it = engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
@@ -49,161 +122,593 @@ hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *
 
     while (it) {
         if ((nkey == it->nkey) && (memcmp(key, item_get_key(it), nkey) == 0)) {
-            ret = it;
-            break;
+            return it;
         }
-        it = it->h_next;
-        ++depth;
+        it = item_h_next(engine, it);
+        ++*depth;
     }
-    MEMCACHED_ASSOC_FIND(key, nkey, depth);
-    return ret;
+    return NULL;
 }
 
-/* returns the address of the item pointer before the key.  if *item == 0,
-   the item wasn't found */
+/* returns the address of the bucket the key hashes to */
+static hash_item** chained_bucket(struct default_engine *engine,
+                                  uint32_t hash) {
+    unsigned int oldbucket;
+
+    if (assoc_use_old_table(engine, hash, &oldbucket)) {
+        return &engine->assoc.old_hashtable[oldbucket];
+    }
+    return &engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
+}
+
+static void chained_insert(struct default_engine *engine, uint32_t hash,
+                           hash_item *it) {
+    hash_item **bucket = chained_bucket(engine, hash);
+    item_set_h_next(engine, it, *bucket);
+    *bucket = it;
+}
+
+/*
+ * Unlink the first item in the chain matching the key. The chain links
+ * may be handles (see config.compact_items), so we track the item before
+ * the match rather than the address of the link.
+ */
+static bool chain_delete(struct default_engine *engine, hash_item **head,
+                         const char *key, const size_t nkey) {
+    hash_item *prev = NULL;
+    hash_item *it = *head;
+
+    while (it && ((nkey != it->nkey) || memcmp(key, item_get_key(it), nkey))) {
+        prev = it;
+        it = item_h_next(engine, it);
+    }
+
+    if (it) {
+        hash_item *nxt = item_h_next(engine, it);
+        item_set_h_next(engine, it, NULL);   /* probably pointless, but whatever. */
+        if (prev) {
+            item_set_h_next(engine, prev, nxt);
+        } else {
+            *head = nxt;
+        }
+        return true;
+    }
+    return false;
+}
+
+static bool chained_delete(struct default_engine *engine, uint32_t hash,
+                           const char *key, const size_t nkey) {
+    return chain_delete(engine, chained_bucket(engine, hash), key, nkey);
+}
+
+static void chained_migrate_bucket(struct default_engine *engine, size_t ii) {
+    hash_item *it, *next;
+
+    for (it = engine->assoc.old_hashtable[ii]; NULL != it; it = next) {
+        size_t bucket;
+        next = item_h_next(engine, it);
+
+        bucket = engine->server.core->hash(item_get_key(it), it->nkey, 0)
+            & hashmask(engine->assoc.hashpower);
+        item_set_h_next(engine, it, engine->assoc.primary_hashtable[bucket]);
+        engine->assoc.primary_hashtable[bucket] = it;
+    }
 
-static hash_item** _hashitem_before(struct default_engine *engine,
-                                    uint32_t hash,
-                                    const char *key,
-                                    const size_t nkey) {
-    hash_item **pos;
+    engine->assoc.old_hashtable[ii] = NULL;
+}
+
+/****************************** BUCKETED TABLE ******************************/
+
+/*
+ * The bucketed table keeps a short tag (8 bits of the hash value) next to
+ * each item pointer, so a probe only has to dereference the items whose
+ * tag matches. Items which don't fit in the slots of their bucket are
+ * chained off the bucket through h_next, so a key never moves outside
+ * the bucket (and item lock stripe) it hashes to.
+ */
+
+static uint8_t assoc_tag(uint32_t hash) {
+    return (uint8_t)(hash >> 24);
+}
+
+static assoc_bucket *bucket_for(struct default_engine *engine, uint32_t hash) {
     unsigned int oldbucket;
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        pos = &engine->assoc.old_hashtable[oldbucket];
+    if (assoc_use_old_table(engine, hash, &oldbucket)) {
+        return &engine->assoc.old_buckets[oldbucket];
+    }
+    return &engine->assoc.primary_buckets[hash & hashmask(engine->assoc.hashpower)];
+}
+
+/*
+ * Quick test if any of the tag bytes in the bucket could match the tag.
+ * All of the tags (and the used/spare bytes, which may cause a false
+ * positive) are compared at once as a single 64 bit word: a byte in x is
+ * zero where the tag matches.
+ */
+static bool bucket_may_contain(const assoc_bucket *b, uint8_t tag) {
+    uint64_t word, x;
+    memcpy(&word, b->tags, sizeof(word));
+    x = word ^ (UINT64_C(0x0101010101010101) * tag);
+    return ((x - UINT64_C(0x0101010101010101)) & ~x &
+            UINT64_C(0x8080808080808080)) != 0;
+}
+
+static bool item_key_matches(const hash_item *it,
+                             const char *key, const size_t nkey) {
+    return (nkey == it->nkey) && (memcmp(key, item_get_key(it), nkey) == 0);
+}
+
+static hash_item *bucketed_find(struct default_engine *engine, uint32_t hash,
+                                const char *key, const size_t nkey,
+                                int *depth) {
+    assoc_bucket *b = bucket_for(engine, hash);
+    uint8_t tag = assoc_tag(hash);
+    hash_item *it;
+
+    if (b->used != 0 && bucket_may_contain(b, tag)) {
+        int ii;
+        for (ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+            if ((b->used & (1 << ii)) && b->tags[ii] == tag) {
+                if (item_key_matches(b->items[ii], key, nkey)) {
+                    return b->items[ii];
+                }
+                ++*depth;
+            }
+        }
+    }
+
+    for (it = b->overflow; it != NULL; it = item_h_next(engine, it)) {
+        if (item_key_matches(it, key, nkey)) {
+            return it;
+        }
+        ++*depth;
+    }
+    return NULL;
+}
+
+static void bucket_insert(struct default_engine *engine, assoc_bucket *b,
+                          uint8_t tag, hash_item *it) {
+    int ii;
+    for (ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+        if ((b->used & (1 << ii)) == 0) {
+            b->items[ii] = it;
+            b->tags[ii] = tag;
+            b->used |= (uint8_t)(1 << ii);
+            item_set_h_next(engine, it, NULL);
+            return;
+        }
+    }
+
+    item_set_h_next(engine, it, b->overflow);
+    b->overflow = it;
+}
+
+static void bucketed_insert(struct default_engine *engine, uint32_t hash,
+                            hash_item *it) {
+    bucket_insert(engine, bucket_for(engine, hash), assoc_tag(hash), it);
+}
+
+static bool bucketed_delete(struct default_engine *engine, uint32_t hash,
+                            const char *key, const size_t nkey) {
+    assoc_bucket *b = bucket_for(engine, hash);
+    uint8_t tag = assoc_tag(hash);
+    int ii;
+
+    for (ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+        if ((b->used & (1 << ii)) && b->tags[ii] == tag &&
+            item_key_matches(b->items[ii], key, nkey)) {
+            hash_item *ov = b->overflow;
+            if (ov != NULL) {
+                /* Pull the first overflow item into the free slot */
+                b->overflow = item_h_next(engine, ov);
+                item_set_h_next(engine, ov, NULL);
+                b->items[ii] = ov;
+                b->tags[ii] = assoc_tag(engine->server.core->hash(item_get_key(ov),
+                                                                  ov->nkey, 0));
+            } else {
+                b->items[ii] = NULL;
+                b->used &= (uint8_t)~(1 << ii);
+            }
+            return true;
+        }
+    }
+
+    return chain_delete(engine, &b->overflow, key, nkey);
+}
+
+static void bucketed_move_item(struct default_engine *engine, hash_item *it) {
+    uint32_t hash = engine->server.core->hash(item_get_key(it), it->nkey, 0);
+    bucket_insert(engine,
+                  &engine->assoc.primary_buckets[hash & hashmask(engine->assoc.hashpower)],
+                  assoc_tag(hash), it);
+}
+
+static void bucketed_migrate_bucket(struct default_engine *engine, size_t ii) {
+    assoc_bucket *b = &engine->assoc.old_buckets[ii];
+    hash_item *it, *next;
+    int jj;
+
+    for (jj = 0; jj < ASSOC_BUCKET_SLOTS; ++jj) {
+        if (b->used & (1 << jj)) {
+            bucketed_move_item(engine, b->items[jj]);
+        }
+    }
+    for (it = b->overflow; it != NULL; it = next) {
+        next = item_h_next(engine, it);
+        bucketed_move_item(engine, it);
+    }
+    memset(b, 0, sizeof(*b));
+}
+
+/****************************************************************************/
+
+hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
+    hash_item *ret;
+    int depth = 0;
+
+    if (engine->assoc.bucketed) {
+        ret = bucketed_find(engine, hash, key, nkey, &depth);
     } else {
-        pos = &engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
+        ret = chained_find(engine, hash, key, nkey, &depth);
     }
+    MEMCACHED_ASSOC_FIND(key, nkey, depth);
+    return ret;
+}
+
+bool assoc_contains(struct default_engine *engine, uint32_t hash,
+                    const hash_item *item) {
+    hash_item *it;
 
-    while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, item_get_key(*pos), nkey))) {
-        pos = &(*pos)->h_next;
+    if (engine->assoc.bucketed) {
+        assoc_bucket *b = bucket_for(engine, hash);
+        int ii;
+        for (ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+            if ((b->used & (1 << ii)) && b->items[ii] == item) {
+                return true;
+            }
+        }
+        it = b->overflow;
+    } else {
+        it = *chained_bucket(engine, hash);
+    }
+
+    for (; it != NULL; it = item_h_next(engine, it)) {
+        if (it == item) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Only a hint: the bucket is prefetched first, and the items it refers to
+ * once it had the time to reach the cache (reading the bucket before that
+ * would stall just like the lookup would).
+ */
+void assoc_prefetch(struct default_engine *engine, uint32_t hash, bool items) {
+    if (engine->assoc.bucketed) {
+        assoc_bucket *b = bucket_for(engine, hash);
+        if (!items) {
+            __builtin_prefetch(b);
+        } else {
+            uint8_t tag = assoc_tag(hash);
+            int ii;
+            for (ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+                if ((b->used & (1 << ii)) && b->tags[ii] == tag) {
+                    __builtin_prefetch(b->items[ii]);
+                }
+            }
+            if (b->overflow != NULL) {
+                __builtin_prefetch(b->overflow);
+            }
+        }
+    } else {
+        hash_item **head = chained_bucket(engine, hash);
+        if (!items) {
+            __builtin_prefetch(head);
+        } else if (*head != NULL) {
+            __builtin_prefetch(*head);
+        }
     }
-    return pos;
 }
 
 static void assoc_maintenance_thread(void *arg);
 
-/* grows the hashtable to the next power of 2. */
-static void assoc_expand(struct default_engine *engine) {
+/*
+ * Grows the hashtable to the next power of 2. Called from the maintenance
+ * thread without any locks held. The new table is allocated up front so
+ * that all of the item locks are only held for the pointer swap itself;
+ * this (and retiring the old table) are the only points where foreground
+ * traffic is blocked by the expansion.
+ */
+static bool assoc_expand(struct default_engine *engine) {
+    hash_item **table = NULL;
+    assoc_bucket *buckets = NULL;
+    void *mem = NULL;
+
+    if (engine->assoc.bucketed) {
+        buckets = assoc_alloc_buckets(hashsize(engine->assoc.hashpower + 1),
+                                      &mem);
+        if (buckets == NULL) {
+            return false;
+        }
+    } else {
+        table = calloc(hashsize(engine->assoc.hashpower + 1),
+                       sizeof(hash_item *));
+        if (table == NULL) {
+            /* Bad news, but we can keep running. */
+            return false;
+        }
+    }
+
+    item_lock_all(engine);
     engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
+    engine->assoc.primary_hashtable = table;
+    engine->assoc.old_buckets = engine->assoc.primary_buckets;
+    engine->assoc.old_mem = engine->assoc.primary_mem;
+    engine->assoc.primary_buckets = buckets;
+    engine->assoc.primary_mem = mem;
+    engine->assoc.hashpower++;
+    engine->assoc.expanding = true;
+    item_unlock_all(engine);
 
-    engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower + 1),
-                                             sizeof(hash_item *));
-    if (engine->assoc.primary_hashtable) {
-        int ret = 0;
-        cb_thread_t tid;
-
-        engine->assoc.hashpower++;
-        engine->assoc.expanding = true;
-        engine->assoc.expand_bucket = 0;
-
-        /* start a thread to do the expansion */
-        if ((ret = cb_create_thread(&tid, assoc_maintenance_thread, engine, 1)) != 0)
-        {
-            EXTENSION_LOGGER_DESCRIPTOR *logger;
-            logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-            logger->log(EXTENSION_LOG_WARNING, NULL,
-                        "Can't create thread: %s\n", strerror(ret));
-            engine->assoc.hashpower--;
-            engine->assoc.expanding = false;
-            free(engine->assoc.primary_hashtable);
-            engine->assoc.primary_hashtable =engine->assoc.old_hashtable;
+    return true;
+}
+
+/*
+ * Move the buckets [first, last) of the old table over to the new one. A
+ * bucket in the old table only contains keys protected by a single item
+ * lock (the number of lock stripes never exceeds the number of buckets),
+ * so we only need to hold that lock while we move it.
+ */
+static void assoc_migrate_range(struct default_engine *engine,
+                                size_t first, size_t last) {
+    size_t ii;
+
+    for (ii = first; ii < last; ++ii) {
+        item_lock(engine, (uint32_t)ii);
+        if (engine->assoc.bucketed) {
+            bucketed_migrate_bucket(engine, ii);
+        } else {
+            chained_migrate_bucket(engine, ii);
         }
+        item_unlock(engine, (uint32_t)ii);
+    }
+}
+
+struct assoc_migrator {
+    struct default_engine *engine;
+    size_t first;
+    size_t last;
+    cb_thread_t tid;
+    bool started;
+};
+
+static void assoc_migrator_main(void *arg) {
+    struct assoc_migrator *m = arg;
+    assoc_migrate_range(m->engine, m->first, m->last);
+}
+
+/*
+ * Move all of the items from the old table over to the new one. Large
+ * tables are split in ranges moved by up to config.hash_expand_threads
+ * threads at the same time (the maintenance thread being one of them).
+ */
+static void assoc_migrate(struct default_engine *engine) {
+    size_t nbuckets = hashsize(engine->assoc.hashpower - 1);
+    size_t nthreads = engine->config.hash_expand_threads;
+    struct assoc_migrator *helpers = NULL;
+    size_t ii;
+
+    if (nthreads > nbuckets / ASSOC_MIGRATE_MIN_BUCKETS) {
+        nthreads = nbuckets / ASSOC_MIGRATE_MIN_BUCKETS;
+    }
+    if (nthreads > 1) {
+        helpers = calloc(nthreads - 1, sizeof(*helpers));
+    }
+
+    if (helpers == NULL) {
+        assoc_migrate_range(engine, 0, nbuckets);
     } else {
-        engine->assoc.primary_hashtable = engine->assoc.old_hashtable;
-        /* Bad news, but we can keep running. */
+        for (ii = 0; ii < nthreads - 1; ++ii) {
+            struct assoc_migrator *m = &helpers[ii];
+            m->engine = engine;
+            m->first = (ii + 1) * nbuckets / nthreads;
+            m->last = (ii + 2) * nbuckets / nthreads;
+            m->started = cb_create_thread(&m->tid, assoc_migrator_main,
+                                          m, 0) == 0;
+        }
+        assoc_migrate_range(engine, 0, nbuckets / nthreads);
+        for (ii = 0; ii < nthreads - 1; ++ii) {
+            struct assoc_migrator *m = &helpers[ii];
+            if (m->started) {
+                cb_join_thread(m->tid);
+            } else {
+                assoc_migrate_range(engine, m->first, m->last);
+            }
+        }
+        free(helpers);
+    }
+
+    /*
+     * Lookups check if their bucket in the old table is empty until the
+     * expansion is over, so the old table may only go away once nobody
+     * holds an item lock.
+     */
+    item_lock_all(engine);
+    engine->assoc.expanding = false;
+    item_unlock_all(engine);
+    free(engine->assoc.old_hashtable);
+    engine->assoc.old_hashtable = NULL;
+    free(engine->assoc.old_mem);
+    engine->assoc.old_mem = NULL;
+    engine->assoc.old_buckets = NULL;
+
+    if (engine->config.verbose > 1) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "Hash table expansion done (%lu threads)\n",
+                    (unsigned long)(helpers == NULL ? 1 : nthreads));
     }
 }
 
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
 int assoc_insert(struct default_engine *engine, uint32_t hash, hash_item *it) {
-    unsigned int oldbucket;
+    unsigned int hash_items;
+    size_t limit;
 
     cb_assert(assoc_find(engine, hash, item_get_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        it->h_next = engine->assoc.old_hashtable[oldbucket];
-        engine->assoc.old_hashtable[oldbucket] = it;
+    if (engine->assoc.bucketed) {
+        bucketed_insert(engine, hash, it);
+        limit = (hashsize(engine->assoc.hashpower) * ASSOC_BUCKET_SLOTS * 3) / 4;
     } else {
-        it->h_next = engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
-        engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)] = it;
+        chained_insert(engine, hash, it);
+        limit = (hashsize(engine->assoc.hashpower) * 3) / 2;
     }
 
-    engine->assoc.hash_items++;
-    if (! engine->assoc.expanding && engine->assoc.hash_items > (hashsize(engine->assoc.hashpower) * 3) / 2) {
-        assoc_expand(engine);
+    cb_mutex_enter(&engine->assoc.lock);
+    hash_items = ++engine->assoc.hash_items;
+    if (!engine->assoc.expanding && !engine->assoc.expand_requested &&
+        hash_items > limit) {
+        engine->assoc.expand_requested = true;
+        cb_cond_signal(&engine->assoc.cond);
     }
+    cb_mutex_exit(&engine->assoc.lock);
 
-    MEMCACHED_ASSOC_INSERT(item_get_key(it), it->nkey, engine->assoc.hash_items);
+    MEMCACHED_ASSOC_INSERT(item_get_key(it), it->nkey, hash_items);
     return 1;
 }
 
 void assoc_delete(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
-    hash_item **before = _hashitem_before(engine, hash, key, nkey);
+    bool found;
 
-    if (*before) {
-        hash_item *nxt;
+    if (engine->assoc.bucketed) {
+        found = bucketed_delete(engine, hash, key, nkey);
+    } else {
+        found = chained_delete(engine, hash, key, nkey);
+    }
+
+    if (found) {
+        cb_mutex_enter(&engine->assoc.lock);
         engine->assoc.hash_items--;
         /* The DTrace probe cannot be triggered as the last instruction
          * due to possible tail-optimization by the compiler
          */
         MEMCACHED_ASSOC_DELETE(key, nkey, engine->assoc.hash_items);
-        nxt = (*before)->h_next;
-        (*before)->h_next = 0;   /* probably pointless, but whatever. */
-        *before = nxt;
+        cb_mutex_exit(&engine->assoc.lock);
         return;
     }
     /* Note:  we never actually get here.  the callers don't delete things
        they can't find. */
-    cb_assert(*before != 0);
+    cb_assert(found);
+}
+
+static void chain_walk(struct default_engine *engine, hash_item *it,
+                       void (*fn)(hash_item *it, void *arg), void *arg) {
+    while (it != NULL) {
+        hash_item *next = item_h_next(engine, it);
+        fn(it, arg);
+        it = next;
+    }
 }
 
+static void bucket_walk(struct default_engine *engine, assoc_bucket *b,
+                        void (*fn)(hash_item *it, void *arg), void *arg) {
+    int ii;
+    for (ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+        if (b->used & (1 << ii)) {
+            fn(b->items[ii], arg);
+        }
+    }
+    chain_walk(engine, b->overflow, fn, arg);
+}
 
+/*
+ * The stripe of a key is the low bits of its hash value, and there are
+ * never more stripes than buckets, so the stripe covers every nstripes'th
+ * bucket in both tables. The buckets in the old table which have been
+ * moved already are empty; the others can't move while we hold the lock.
+ */
+void assoc_walk_stripe(struct default_engine *engine, uint32_t stripe,
+                       uint32_t nstripes,
+                       void (*fn)(hash_item *it, void *arg), void *arg) {
+    size_t ii;
 
-#define DEFAULT_HASH_BULK_MOVE 1
-int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
+    for (ii = stripe; ii < hashsize(engine->assoc.hashpower); ii += nstripes) {
+        if (engine->assoc.bucketed) {
+            bucket_walk(engine, &engine->assoc.primary_buckets[ii], fn, arg);
+        } else {
+            chain_walk(engine, engine->assoc.primary_hashtable[ii], fn, arg);
+        }
+    }
+
+    if (!engine->assoc.expanding) {
+        return;
+    }
+    for (ii = stripe; ii < hashsize(engine->assoc.hashpower - 1); ii += nstripes) {
+        if (engine->assoc.bucketed) {
+            bucket_walk(engine, &engine->assoc.old_buckets[ii], fn, arg);
+        } else {
+            chain_walk(engine, engine->assoc.old_hashtable[ii], fn, arg);
+        }
+    }
+}
 
 static void assoc_maintenance_thread(void *arg) {
     struct default_engine *engine = arg;
-    bool done = false;
-    do {
-        int ii;
-        cb_mutex_enter(&engine->cache_lock);
+    engine_thread_started(engine);
 
-        for (ii = 0; ii < hash_bulk_move && engine->assoc.expanding; ++ii) {
-            hash_item *it, *next;
-            int bucket;
+    cb_mutex_enter(&engine->assoc.lock);
+    while (engine->assoc.maintenance_running) {
+        if (!engine->assoc.expand_requested) {
+            cb_cond_wait(&engine->assoc.cond, &engine->assoc.lock);
+            continue;
+        }
+        cb_mutex_exit(&engine->assoc.lock);
 
-            for (it = engine->assoc.old_hashtable[engine->assoc.expand_bucket];
-                 NULL != it; it = next) {
-                next = it->h_next;
+        if (assoc_expand(engine)) {
+            assoc_migrate(engine);
+        }
 
-                bucket = engine->server.core->hash(item_get_key(it), it->nkey, 0)
-                    & hashmask(engine->assoc.hashpower);
-                it->h_next = engine->assoc.primary_hashtable[bucket];
-                engine->assoc.primary_hashtable[bucket] = it;
-            }
+        cb_mutex_enter(&engine->assoc.lock);
+        engine->assoc.expand_requested = false;
+    }
+    cb_mutex_exit(&engine->assoc.lock);
+}
 
-            engine->assoc.old_hashtable[engine->assoc.expand_bucket] = NULL;
-            engine->assoc.expand_bucket++;
-            if (engine->assoc.expand_bucket == hashsize(engine->assoc.hashpower - 1)) {
-                engine->assoc.expanding = false;
-                free(engine->assoc.old_hashtable);
-                if (engine->config.verbose > 1) {
-                    EXTENSION_LOGGER_DESCRIPTOR *logger;
-                    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-                    logger->log(EXTENSION_LOG_INFO, NULL,
-                                "Hash table expansion done\n");
-                }
-            }
-        }
-        if (!engine->assoc.expanding) {
-            done = true;
-        }
-        cb_mutex_exit(&engine->cache_lock);
-    } while (!done);
+int start_assoc_maintenance_thread(struct default_engine *engine) {
+    int ret;
+
+    cb_mutex_enter(&engine->assoc.lock);
+    engine->assoc.maintenance_running = true;
+    cb_mutex_exit(&engine->assoc.lock);
+
+    if ((ret = cb_create_thread(&engine->assoc.maintenance_tid,
+                                assoc_maintenance_thread, engine, 0)) != 0) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Can't create thread: %s\n", strerror(ret));
+        engine->assoc.maintenance_running = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+void stop_assoc_maintenance_thread(struct default_engine *engine) {
+    bool running;
+
+    cb_mutex_enter(&engine->assoc.lock);
+    running = engine->assoc.maintenance_running;
+    engine->assoc.maintenance_running = false;
+    cb_cond_signal(&engine->assoc.cond);
+    cb_mutex_exit(&engine->assoc.lock);
+
+    if (running) {
+        cb_join_thread(engine->assoc.maintenance_tid);
+    }
 }
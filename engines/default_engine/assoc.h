@@ -1,6 +1,21 @@
 #ifndef ASSOC_H
 #define ASSOC_H
 
+#define ASSOC_BUCKET_SLOTS 6
+
+/*
+ * A bucket in the bucketed hash index. It is one cache line on 64 bit
+ * platforms: the tags (the top 8 bits of the hash value of each item)
+ * can be checked without touching the items themselves.
+ */
+typedef struct {
+    uint8_t tags[ASSOC_BUCKET_SLOTS];
+    uint8_t used;   /* bitmask of the slots in use */
+    uint8_t spare;
+    hash_item *items[ASSOC_BUCKET_SLOTS];
+    hash_item *overflow; /* chained through h_next once the slots are full */
+} assoc_bucket;
+
 struct assoc {
    /* how many powers of 2's worth of buckets we use */
    unsigned int hashpower;
@@ -22,10 +37,30 @@ struct assoc {
    bool expanding;
 
    /*
-    * During expansion we migrate values with bucket granularity; this is how
-    * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+    * Set if the bucketed index layout is used instead of the chained
+    * primary/old hashtable (see config.bucketed_index).
+    */
+   bool bucketed;
+   assoc_bucket *primary_buckets;
+   assoc_bucket *old_buckets;
+   /* The (unaligned) allocations backing the bucket arrays */
+   void *primary_mem;
+   void *old_mem;
+
+   /*
+    * Protects hash_items and the maintenance thread state below. The
+    * tables themselves are protected by the item locks.
     */
-   unsigned int expand_bucket;
+   cb_mutex_t lock;
+
+   /* Signalled when the table should be expanded (or the thread stopped) */
+   cb_cond_t cond;
+
+   /* Set when assoc_insert wants the maintenance thread to grow the table */
+   bool expand_requested;
+
+   bool maintenance_running;
+   cb_thread_t maintenance_tid;
 };
 
 /* associative array */
@@ -33,10 +68,25 @@ ENGINE_ERROR_CODE assoc_init(struct default_engine *engine);
 void assoc_destroy(struct default_engine *engine);
 hash_item *assoc_find(struct default_engine *engine, uint32_t hash,
                       const char *key, const size_t nkey);
+/* Prefetch the bucket the hash maps to, or the items in it */
+void assoc_prefetch(struct default_engine *engine, uint32_t hash, bool items);
 int assoc_insert(struct default_engine *engine, uint32_t hash,
                  hash_item *item);
 void assoc_delete(struct default_engine *engine, uint32_t hash,
                   const char *key, const size_t nkey);
+/*
+ * Is the item (which may have been freed) in the table under the hash?
+ * Only the addresses are compared, item isn't looked at.
+ */
+bool assoc_contains(struct default_engine *engine, uint32_t hash,
+                    const hash_item *item);
+/*
+ * Call fn for every item guarded by the given item lock stripe (nstripes
+ * is the number of stripes). The caller must hold the stripe lock.
+ */
+void assoc_walk_stripe(struct default_engine *engine, uint32_t stripe,
+                       uint32_t nstripes,
+                       void (*fn)(hash_item *it, void *arg), void *arg);
 int start_assoc_maintenance_thread(struct default_engine *engine);
 void stop_assoc_maintenance_thread(struct default_engine *engine);
 
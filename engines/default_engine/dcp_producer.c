@@ -0,0 +1,487 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * A DCP connection carrying many vbucket streams. Walking the LRUs, the
+ * hash table and the seqlog for the next batch of a stream is what most
+ * of the time goes to, so it's left to helper threads: the streams are
+ * split over config.dcp_helper_threads of them by vbucket, and each one
+ * prepares the next batch of its streams while the previous ones are
+ * sent. The step on the connection's worker thread then only hands the
+ * prepared items to the daemon.
+ *
+ * A stream is owned by its helper until its batch is prepared, and by the
+ * step from then on (until it's sent), so the batches are never touched
+ * by two threads at once.
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+/* A stream of the helper which should prepare its next batch */
+static struct dcp_producer_stream *dcp_helper_next(struct dcp_producer_helper *helper)
+{
+    struct dcp_producer *producer = helper->producer;
+    int ii;
+
+    for (ii = 0; ii < producer->nstreams; ++ii) {
+        struct dcp_producer_stream *stream = producer->streams[ii];
+        if (!stream->prepared && !stream->ended &&
+            stream->connection->vbucket % producer->nhelpers == helper->index) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+static void dcp_helper_main(void *arg)
+{
+    struct dcp_producer_helper *helper = arg;
+    struct dcp_producer *producer = helper->producer;
+    struct default_engine *engine = producer->engine;
+
+    engine_thread_started(engine);
+    cb_mutex_enter(&producer->mutex);
+    while (!producer->shutdown) {
+        struct dcp_producer_stream *stream = dcp_helper_next(helper);
+        ENGINE_ERROR_CODE status;
+        bool notify = false;
+
+        if (stream == NULL) {
+            cb_cond_wait(&producer->cond, &producer->mutex);
+            continue;
+        }
+        cb_mutex_exit(&producer->mutex);
+
+        status = item_dcp_prepare(engine, stream->connection);
+
+        cb_mutex_enter(&producer->mutex);
+        stream->status = status;
+        stream->prepared = true;
+        if (producer->waiting && status != ENGINE_EWOULDBLOCK) {
+            /* A stream waiting for more changes won't wake anyone up */
+            producer->waiting = false;
+            notify = true;
+        }
+        if (notify) {
+            cb_mutex_exit(&producer->mutex);
+            engine->server.cookie->notify_io_complete(producer->cookie,
+                                                      ENGINE_SUCCESS);
+            cb_mutex_enter(&producer->mutex);
+        }
+    }
+    cb_mutex_exit(&producer->mutex);
+}
+
+struct dcp_producer *dcp_producer_create(struct default_engine *engine,
+                                         const void *cookie)
+{
+    struct dcp_producer *producer = calloc(1, sizeof(*producer));
+    int ii;
+
+    if (producer == NULL) {
+        return NULL;
+    }
+    producer->engine = engine;
+    producer->cookie = cookie;
+    cb_mutex_initialize(&producer->mutex);
+    cb_cond_initialize(&producer->cond);
+
+    if (engine->config.dcp_helper_threads == 0) {
+        return producer;
+    }
+    producer->helpers = calloc(engine->config.dcp_helper_threads,
+                               sizeof(*producer->helpers));
+    if (producer->helpers == NULL) {
+        dcp_producer_destroy(producer);
+        return NULL;
+    }
+    for (ii = 0; ii < (int)engine->config.dcp_helper_threads; ++ii) {
+        struct dcp_producer_helper *helper = &producer->helpers[ii];
+        int ret;
+        helper->producer = producer;
+        helper->index = ii;
+        if ((ret = cb_create_thread(&helper->tid, dcp_helper_main,
+                                    helper, 0)) != 0) {
+            EXTENSION_LOGGER_DESCRIPTOR *logger;
+            logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Can't create DCP helper thread: %s\n", strerror(ret));
+            dcp_producer_destroy(producer);
+            return NULL;
+        }
+        /* Streams are only spread over the helpers which are running */
+        producer->nhelpers = ii + 1;
+    }
+    return producer;
+}
+
+bool dcp_producer_add_stream(struct dcp_producer *producer,
+                             struct dcp_connection *connection)
+{
+    struct dcp_producer_stream *stream = calloc(1, sizeof(*stream));
+
+    if (stream == NULL) {
+        return false;
+    }
+    stream->connection = connection;
+
+    cb_mutex_enter(&producer->mutex);
+    if (producer->nstreams == producer->streamsize) {
+        int size = producer->streamsize ? producer->streamsize * 2 : 16;
+        struct dcp_producer_stream **streams;
+        streams = realloc(producer->streams, size * sizeof(*streams));
+        if (streams == NULL) {
+            cb_mutex_exit(&producer->mutex);
+            free(stream);
+            return false;
+        }
+        producer->streams = streams;
+        producer->streamsize = size;
+    }
+    producer->streams[producer->nstreams++] = stream;
+    cb_cond_broadcast(&producer->cond);
+    cb_mutex_exit(&producer->mutex);
+    return true;
+}
+
+static void dcp_stream_free(struct default_engine *engine,
+                            struct dcp_producer_stream *stream)
+{
+    item_dcp_release(engine, stream->connection);
+    free(stream->connection);
+    free(stream);
+}
+
+/*
+ * Whether the batch of the stream is ready to be sent. Without helpers
+ * it's prepared right here.
+ */
+static bool dcp_stream_prepared(struct dcp_producer *producer,
+                                struct dcp_producer_stream *stream)
+{
+    bool prepared;
+
+    if (producer->nhelpers == 0) {
+        if (!stream->prepared) {
+            stream->status = item_dcp_prepare(producer->engine,
+                                              stream->connection);
+            stream->prepared = true;
+        }
+        return true;
+    }
+    cb_mutex_enter(&producer->mutex);
+    prepared = stream->prepared;
+    cb_mutex_exit(&producer->mutex);
+    return prepared;
+}
+
+/* Give the stream back to its helper for the next batch */
+static void dcp_stream_hand_back(struct dcp_producer *producer,
+                                 struct dcp_producer_stream *stream)
+{
+    cb_mutex_enter(&producer->mutex);
+    stream->prepared = false;
+    cb_cond_broadcast(&producer->cond);
+    cb_mutex_exit(&producer->mutex);
+}
+
+/*
+ * One pass over the streams, starting where the last step stopped so
+ * that every stream gets its turn.
+ */
+static ENGINE_ERROR_CODE dcp_producer_pass(struct dcp_producer *producer,
+                                           struct dcp_message_producers *producers,
+                                           int *sent)
+{
+    struct default_engine *engine = producer->engine;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    bool idle = true;
+    int ii;
+
+    for (ii = 0; ii < producer->nstreams; ++ii) {
+        int idx = (producer->next + ii) % producer->nstreams;
+        struct dcp_producer_stream *stream = producer->streams[idx];
+        struct dcp_connection *connection = stream->connection;
+
+        if (stream->ended || !dcp_stream_prepared(producer, stream)) {
+            continue;
+        }
+
+        switch (stream->status) {
+        case ENGINE_SUCCESS:
+            idle = false;
+            ret = item_dcp_send_prepared(engine, connection, producer->cookie,
+                                         producers, sent);
+            if (ret == ENGINE_SUCCESS) {
+                dcp_stream_hand_back(producer, stream);
+            }
+            break;
+        case ENGINE_EWOULDBLOCK:
+            /* Look for more changes once the next step comes along */
+            dcp_stream_hand_back(producer, stream);
+            break;
+        case ENGINE_DISCONNECT:
+            idle = false;
+            ret = producers->stream_end(producer->cookie, connection->opaque,
+                                        connection->vbucket, 0 /* ok */);
+            if (ret == ENGINE_SUCCESS) {
+                stream->ended = true;
+                ++*sent;
+            }
+            break;
+        default:
+            ret = stream->status;
+        }
+
+        if (ret != ENGINE_SUCCESS) {
+            /* Pick up with this stream */
+            producer->next = idx;
+            return ret;
+        }
+    }
+
+    if (producer->nstreams != 0) {
+        producer->next = (producer->next + 1) % producer->nstreams;
+    }
+    return idle ? ENGINE_EWOULDBLOCK : ENGINE_SUCCESS;
+}
+
+/* Drop the streams which ended */
+static void dcp_producer_reap(struct dcp_producer *producer)
+{
+    int ii, jj = 0;
+
+    cb_mutex_enter(&producer->mutex);
+    for (ii = 0; ii < producer->nstreams; ++ii) {
+        struct dcp_producer_stream *stream = producer->streams[ii];
+        if (stream->ended) {
+            dcp_stream_free(producer->engine, stream);
+        } else {
+            producer->streams[jj++] = stream;
+        }
+    }
+    producer->nstreams = jj;
+    if (producer->next >= producer->nstreams) {
+        producer->next = 0;
+    }
+    cb_mutex_exit(&producer->mutex);
+}
+
+/*
+ * Whether a helper finished a batch since the pass looked at its stream,
+ * in which case we should do another pass. Otherwise the helpers are
+ * told to wake us up once they finish one.
+ */
+static bool dcp_producer_recheck(struct dcp_producer *producer)
+{
+    bool ready = false;
+    bool preparing = false;
+    int ii;
+
+    if (producer->nhelpers == 0) {
+        return false;
+    }
+    cb_mutex_enter(&producer->mutex);
+    for (ii = 0; ii < producer->nstreams; ++ii) {
+        struct dcp_producer_stream *stream = producer->streams[ii];
+        if (!stream->prepared) {
+            preparing = true;
+        } else if (stream->status != ENGINE_EWOULDBLOCK) {
+            ready = true;
+        }
+    }
+    producer->waiting = !ready && preparing;
+    cb_mutex_exit(&producer->mutex);
+    return ready;
+}
+
+ENGINE_ERROR_CODE dcp_producer_step(struct dcp_producer *producer,
+                                    struct dcp_message_producers *producers)
+{
+    ENGINE_ERROR_CODE ret;
+    int sent = 0;
+
+    do {
+        do {
+            ret = dcp_producer_pass(producer, producers, &sent);
+            dcp_producer_reap(producer);
+        } while (ret == ENGINE_SUCCESS && producer->nstreams != 0);
+        /* The streams are all waiting for a batch, or for more changes */
+    } while (ret == ENGINE_EWOULDBLOCK && dcp_producer_recheck(producer));
+
+    /* A connection without streams (left) waits for the next request */
+    return item_dcp_step_result(ret, sent);
+}
+
+void dcp_producer_destroy(struct dcp_producer *producer)
+{
+    int ii;
+
+    cb_mutex_enter(&producer->mutex);
+    producer->shutdown = true;
+    cb_cond_broadcast(&producer->cond);
+    cb_mutex_exit(&producer->mutex);
+    for (ii = 0; ii < producer->nhelpers; ++ii) {
+        cb_join_thread(producer->helpers[ii].tid);
+    }
+
+    for (ii = 0; ii < producer->nstreams; ++ii) {
+        dcp_stream_free(producer->engine, producer->streams[ii]);
+    }
+    free(producer->streams);
+    free(producer->helpers);
+    cb_cond_destroy(&producer->cond);
+    cb_mutex_destroy(&producer->mutex);
+    free(producer);
+}
+
+/* Take the producer of the connection off the engine's list */
+static struct dcp_producer *dcp_unlink(struct default_engine *engine,
+                                       const void *cookie)
+{
+    struct dcp_producer **prev, *producer;
+
+    cb_mutex_enter(&engine->dcp.lock);
+    for (prev = &engine->dcp.list; (producer = *prev) != NULL;
+         prev = &producer->next_producer) {
+        if (producer->cookie == cookie) {
+            *prev = producer->next_producer;
+            break;
+        }
+    }
+    cb_mutex_exit(&engine->dcp.lock);
+    return producer;
+}
+
+static void dcp_on_disconnect(const void *cookie, ENGINE_EVENT_TYPE type,
+                              const void *event_data, const void *cb_data)
+{
+    const struct dcp_disconnect_hook *hook = cb_data;
+    struct default_engine *engine = hook->engine;
+    struct dcp_producer *producer;
+
+    if (engine == NULL) {
+        /* The engine is gone (with its producers) */
+        return;
+    }
+    if ((producer = dcp_unlink(engine, cookie)) != NULL) {
+        engine->server.cookie->store_engine_specific(cookie, NULL);
+        dcp_producer_destroy(producer);
+    }
+}
+
+ENGINE_ERROR_CODE dcp_init(struct default_engine *engine)
+{
+    struct dcp_disconnect_hook *hook = calloc(1, sizeof(*hook));
+
+    if (hook == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    hook->engine = engine;
+    engine->dcp.hook = hook;
+    engine->server.callback->register_callback((ENGINE_HANDLE*)engine,
+                                               ON_DISCONNECT,
+                                               dcp_on_disconnect, hook);
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE dcp_open(struct default_engine *engine,
+                           const void *cookie, uint32_t flags)
+{
+    struct dcp_producer *producer;
+
+    if ((flags & DCP_OPEN_PRODUCER) == 0) {
+        return ENGINE_ENOTSUP;
+    }
+    if (engine->server.cookie->get_engine_specific(cookie) != NULL) {
+        return ENGINE_KEY_EEXISTS;
+    }
+    if ((producer = dcp_producer_create(engine, cookie)) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+
+    cb_mutex_enter(&engine->dcp.lock);
+    producer->next_producer = engine->dcp.list;
+    engine->dcp.list = producer;
+    cb_mutex_exit(&engine->dcp.lock);
+    engine->server.cookie->store_engine_specific(cookie, producer);
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE dcp_stream_req(struct default_engine *engine,
+                                 const void *cookie, uint32_t flags,
+                                 uint32_t opaque, uint16_t vbucket,
+                                 uint64_t start_seqno, uint64_t end_seqno,
+                                 uint64_t vbucket_uuid,
+                                 uint64_t *rollback_seqno,
+                                 dcp_add_failover_log callback)
+{
+    struct dcp_producer *producer;
+    struct dcp_connection *connection;
+    vbucket_failover_t failover;
+    ENGINE_ERROR_CODE ret;
+
+    producer = engine->server.cookie->get_engine_specific(cookie);
+    if (producer == NULL) {
+        return ENGINE_EINVAL;
+    }
+    if ((connection = calloc(1, sizeof(*connection))) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    connection->flags = flags;
+    connection->opaque = opaque;
+    connection->vbucket = vbucket;
+    connection->start_seqno = start_seqno;
+    connection->end_seqno = end_seqno;
+    connection->vbucket_uuid = vbucket_uuid;
+
+    if (!link_dcp_log(engine, connection)) {
+        if (start_seqno != 0) {
+            /* What changed since then is gone, start over */
+            free(connection);
+            *rollback_seqno = 0;
+            return ENGINE_ROLLBACK;
+        }
+        link_dcp_backfill(engine, connection);
+    }
+
+    /* The vbuckets have a single history, starting at 0 */
+    failover.uuid = 0;
+    failover.seqno = 0;
+    if ((ret = callback(&failover, 1, cookie)) != ENGINE_SUCCESS) {
+        free(connection);
+        return ret;
+    }
+    if (!dcp_producer_add_stream(producer, connection)) {
+        free(connection);
+        return ENGINE_ENOMEM;
+    }
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE dcp_step(struct default_engine *engine, const void *cookie,
+                           struct dcp_message_producers *producers)
+{
+    struct dcp_producer *producer;
+
+    producer = engine->server.cookie->get_engine_specific(cookie);
+    if (producer == NULL) {
+        return ENGINE_DISCONNECT;
+    }
+    return dcp_producer_step(producer, producers);
+}
+
+void dcp_destroy(struct default_engine *engine)
+{
+    struct dcp_producer *producer;
+
+    if (engine->dcp.hook != NULL) {
+        engine->dcp.hook->engine = NULL;
+    }
+    while ((producer = engine->dcp.list) != NULL) {
+        engine->dcp.list = producer->next_producer;
+        dcp_producer_destroy(producer);
+    }
+}
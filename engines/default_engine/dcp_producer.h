@@ -0,0 +1,114 @@
+/* A DCP connection carrying many streams (see dcp_producer.c) */
+#ifndef DCP_PRODUCER_H
+#define DCP_PRODUCER_H
+
+struct dcp_producer_stream {
+    struct dcp_connection *connection;
+    /*
+     * Set once the next batch of the stream is prepared; the step owns
+     * the batch from then on, and hands the stream back to its helper
+     * after sending it. status is what item_dcp_prepare() returned.
+     */
+    bool prepared;
+    ENGINE_ERROR_CODE status;
+    /* The stream end was sent, so the stream goes away */
+    bool ended;
+};
+
+struct dcp_producer_helper {
+    struct dcp_producer *producer;
+    /* The helper prepares the streams of the vbuckets with this index */
+    int index;
+    cb_thread_t tid;
+};
+
+struct dcp_producer {
+    struct default_engine *engine;
+    const void *cookie;
+    /* The next producer of the engine (see struct dcp_producers) */
+    struct dcp_producer *next_producer;
+    /* Protects the prepared flags, waiting and shutdown */
+    cb_mutex_t mutex;
+    /* Signalled when a stream is handed back to the helpers */
+    cb_cond_t cond;
+    /* Only changed by the thread stepping the producer */
+    struct dcp_producer_stream **streams;
+    int nstreams;
+    int streamsize;
+    /* The stream the next step starts with */
+    int next;
+    /* A step found nothing to send while batches were being prepared */
+    bool waiting;
+    bool shutdown;
+    /* config.dcp_helper_threads (0 prepares the batches in the step) */
+    int nhelpers;
+    struct dcp_producer_helper *helpers;
+};
+
+/*
+ * What the disconnect callback is registered with. The server has no way
+ * to unregister it, so it outlives the engine, which leaves it once it
+ * goes away.
+ */
+struct dcp_disconnect_hook {
+    struct default_engine *engine;
+};
+
+/* The producers of the DCP connections open on the engine */
+struct dcp_producers {
+    /* Protects list; a leaf lock */
+    cb_mutex_t lock;
+    struct dcp_producer *list;
+    struct dcp_disconnect_hook *hook;
+};
+
+/*
+ * The DCP entry points of the engine. dcp_open() sets up a producer for
+ * the connection (the engine is no consumer), which is given streams by
+ * dcp_stream_req() and stepped by dcp_step(). It goes away with the
+ * connection, or with the engine (dcp_destroy()).
+ *
+ * A stream from start_seqno is served from the seqlog if it goes back
+ * that far. A stream from 0 is a backfill of the hash table otherwise,
+ * and any other one has to roll back to 0.
+ */
+ENGINE_ERROR_CODE dcp_init(struct default_engine *engine);
+ENGINE_ERROR_CODE dcp_open(struct default_engine *engine,
+                           const void *cookie, uint32_t flags);
+ENGINE_ERROR_CODE dcp_stream_req(struct default_engine *engine,
+                                 const void *cookie, uint32_t flags,
+                                 uint32_t opaque, uint16_t vbucket,
+                                 uint64_t start_seqno, uint64_t end_seqno,
+                                 uint64_t vbucket_uuid,
+                                 uint64_t *rollback_seqno,
+                                 dcp_add_failover_log callback);
+ENGINE_ERROR_CODE dcp_step(struct default_engine *engine, const void *cookie,
+                           struct dcp_message_producers *producers);
+void dcp_destroy(struct default_engine *engine);
+
+/*
+ * Set up a producer for the DCP connection cookie, starting its helper
+ * threads. Returns NULL if we're out of memory (or threads).
+ */
+struct dcp_producer *dcp_producer_create(struct default_engine *engine,
+                                         const void *cookie);
+
+/*
+ * Add a stream (set up with one of the link_dcp_ functions) to the
+ * producer. The producer takes over connection, and releases and frees
+ * it once the stream ended. Returns false if we're out of memory.
+ */
+bool dcp_producer_add_stream(struct dcp_producer *producer,
+                             struct dcp_connection *connection);
+
+/*
+ * Send the batches prepared for the streams, round robin, for as long as
+ * the daemon takes them.
+ */
+ENGINE_ERROR_CODE dcp_producer_step(struct dcp_producer *producer,
+                                    struct dcp_message_producers *producers);
+
+/* Stop the helpers, and release and free the producer and its streams */
+void dcp_producer_destroy(struct dcp_producer *producer);
+
+#endif
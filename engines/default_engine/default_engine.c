@@ -39,12 +39,25 @@ static ENGINE_ERROR_CODE default_item_delete(ENGINE_HANDLE* handle,
 
 static void default_item_release(ENGINE_HANDLE* handle, const void *cookie,
                                  item* item);
+static void default_item_release_multi(ENGINE_HANDLE* handle,
+                                       const void *cookie,
+                                       item **items, size_t nitems);
 static ENGINE_ERROR_CODE default_get(ENGINE_HANDLE* handle,
                                      const void* cookie,
                                      item** item,
                                      const void* key,
                                      const int nkey,
                                      uint16_t vbucket);
+static ENGINE_ERROR_CODE default_get_multi(ENGINE_HANDLE* handle,
+                                           const void* cookie,
+                                           item_get_request *requests,
+                                           size_t nrequests);
+static void default_prefetch(ENGINE_HANDLE* handle,
+                             const void* cookie,
+                             const void* key,
+                             const int nkey,
+                             uint16_t vbucket,
+                             ENGINE_PREFETCH_STAGE stage);
 static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
                   const void *cookie,
                   const char *stat_key,
@@ -57,6 +70,19 @@ static ENGINE_ERROR_CODE default_store(ENGINE_HANDLE* handle,
                                        uint64_t *cas,
                                        ENGINE_STORE_OPERATION operation,
                                        uint16_t vbucket);
+static ENGINE_ERROR_CODE default_store_multi(ENGINE_HANDLE* handle,
+                                             const void *cookie,
+                                             item_store_request *requests,
+                                             size_t nrequests);
+static ENGINE_ERROR_CODE default_splice(ENGINE_HANDLE* handle,
+                                        const void *cookie,
+                                        item* item,
+                                        uint64_t *cas,
+                                        size_t offset,
+                                        size_t length,
+                                        const void *data,
+                                        size_t ndata,
+                                        uint16_t vbucket);
 static ENGINE_ERROR_CODE default_arithmetic(ENGINE_HANDLE* handle,
                                             const void* cookie,
                                             const void* key,
@@ -72,6 +98,28 @@ static ENGINE_ERROR_CODE default_arithmetic(ENGINE_HANDLE* handle,
                                             uint16_t vbucket);
 static ENGINE_ERROR_CODE default_flush(ENGINE_HANDLE* handle,
                                        const void* cookie, time_t when);
+static ENGINE_ERROR_CODE default_dcp_step(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          struct dcp_message_producers *producers);
+static ENGINE_ERROR_CODE default_dcp_open(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          uint32_t opaque,
+                                          uint32_t seqno,
+                                          uint32_t flags,
+                                          void *name,
+                                          uint16_t nname);
+static ENGINE_ERROR_CODE default_dcp_stream_req(ENGINE_HANDLE* handle,
+                                                const void* cookie,
+                                                uint32_t flags,
+                                                uint32_t opaque,
+                                                uint16_t vbucket,
+                                                uint64_t start_seqno,
+                                                uint64_t end_seqno,
+                                                uint64_t vbucket_uuid,
+                                                uint64_t snap_start_seqno,
+                                                uint64_t snap_end_seqno,
+                                                uint64_t *rollback_seqno,
+                                                dcp_add_failover_log callback);
 static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
                                                  const char *cfg_str);
 static ENGINE_ERROR_CODE default_unknown_command(ENGINE_HANDLE* handle,
@@ -91,6 +139,7 @@ static void set_vbucket_state(struct default_engine *e,
     vi.c = e->vbucket_infos[vbid];
     vi.v.state = to;
     e->vbucket_infos[vbid] = vi.c;
+    vbucket_index_set_state(e, vbid, to == vbucket_state_dead);
 }
 
 static vbucket_state_t get_vbucket_state(struct default_engine *e,
@@ -111,6 +160,13 @@ static bool handled_vbucket(struct default_engine *e, uint16_t vbid) {
 static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
                           const item* item, item_info *item_info);
 
+static bool get_item_view(ENGINE_HANDLE *handle, const void *cookie,
+                          const item* item, item_view *item_view);
+
+static bool get_item_segment(ENGINE_HANDLE *handle, const void *cookie,
+                             const item* item, uint16_t index,
+                             struct iovec *segment);
+
 static bool set_item_info(ENGINE_HANDLE *handle, const void *cookie,
                           item* item, const item_info *itm_info);
 
@@ -119,6 +175,7 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
                                   ENGINE_HANDLE **handle) {
    SERVER_HANDLE_V1 *api = get_server_api();
    struct default_engine *engine;
+   int ii;
 
    if (interface != 1 || api == NULL) {
       return ENGINE_ENOTSUP;
@@ -129,7 +186,25 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
    }
 
    cb_mutex_initialize(&engine->slabs.lock);
-   cb_mutex_initialize(&engine->cache_lock);
+   cb_mutex_initialize(&engine->slabs.rebalance.lock);
+   cb_cond_initialize(&engine->slabs.rebalance.cond);
+   cb_mutex_initialize(&engine->assoc.lock);
+   cb_cond_initialize(&engine->assoc.cond);
+   cb_mutex_initialize(&engine->seqlog.lock);
+   cb_mutex_initialize(&engine->dcp.lock);
+   cb_mutex_initialize(&engine->expiry.lock);
+   cb_cond_initialize(&engine->expiry.cond);
+   cb_mutex_initialize(&engine->ext.lock);
+   cb_cond_initialize(&engine->ext.cond);
+   cb_cond_initialize(&engine->ext.io_cond);
+   cb_mutex_initialize(&engine->items.maintainer_lock);
+   cb_mutex_initialize(&engine->items.cursor_lock);
+   cb_cond_initialize(&engine->items.maintainer_cond);
+   cb_mutex_initialize(&engine->items.reclaim_lock);
+   cb_cond_initialize(&engine->items.reclaim_cond);
+   for (ii = 0; ii < POWER_LARGEST; ++ii) {
+      cb_mutex_initialize(&engine->items.lru_locks[ii]);
+   }
    cb_mutex_initialize(&engine->stats.lock);
    cb_mutex_initialize(&engine->scrubber.lock);
 
@@ -140,16 +215,26 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
    engine->engine.allocate = default_item_allocate;
    engine->engine.remove = default_item_delete;
    engine->engine.release = default_item_release;
+   engine->engine.release_multi = default_item_release_multi;
    engine->engine.get = default_get;
+   engine->engine.get_multi = default_get_multi;
+   engine->engine.prefetch = default_prefetch;
    engine->engine.get_stats = default_get_stats;
    engine->engine.reset_stats = default_reset_stats;
    engine->engine.store = default_store;
+   engine->engine.store_multi = default_store_multi;
+   engine->engine.splice = default_splice;
    engine->engine.arithmetic = default_arithmetic;
    engine->engine.flush = default_flush;
    engine->engine.unknown_command = default_unknown_command;
    engine->engine.item_set_cas = item_set_cas;
    engine->engine.get_item_info = get_item_info;
+   engine->engine.get_item_view = get_item_view;
+   engine->engine.get_item_segment = get_item_segment;
    engine->engine.set_item_info = set_item_info;
+   engine->engine.dcp.step = default_dcp_step;
+   engine->engine.dcp.open = default_dcp_open;
+   engine->engine.dcp.stream_req = default_dcp_stream_req;
    engine->server = *api;
    engine->get_server_api = get_server_api;
    engine->initialized = true;
@@ -163,6 +248,14 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
    engine->config.factor = 1.25;
    engine->config.chunk_size = 48;
    engine->config.item_size_max= 1024 * 1024;
+   engine->config.lock_stripes = 1;
+   engine->config.ext_segment_size = 64 * 1024 * 1024;
+   engine->config.ext_item_min = 512;
+   engine->config.ext_item_age = 3600;
+   engine->config.ext_io_threads = 2;
+   engine->config.hash_expand_threads = 1;
+   engine->config.namespace_depth = 1;
+   engine->restart.fd = -1;
    engine->info.engine_info.description = "Default engine v0.1";
    engine->info.engine_info.num_features = 1;
    engine->info.engine_info.features[0].feature = ENGINE_FEATURE_LRU;
@@ -201,36 +294,202 @@ static ENGINE_ERROR_CODE default_initialize(ENGINE_HANDLE* handle,
        se->info.engine_info.features[se->info.engine_info.num_features++].feature = ENGINE_FEATURE_CAS;
    }
 
+   /* A partitioned engine leaves the cache to engines of its own */
+   if (se->partitions.parent != NULL) {
+      ret = partitions_configure(se);
+      if (ret != ENGINE_SUCCESS) {
+         return ret;
+      }
+   } else if (se->config.partitions > 1) {
+      return partitions_init(se, config_str);
+   }
+
+   if (se->partitions.parent == NULL) {
+      /* The producers go away with their connections */
+      ret = dcp_init(se);
+      if (ret != ENGINE_SUCCESS) {
+         return ret;
+      }
+   }
+
+   /* Before restart_init, which checks the arena was carved with them */
+   ret = slabs_plan(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   /* Sizes the hash table when the cache is restored */
+   ret = restart_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
    ret = assoc_init(se);
    if (ret != ENGINE_SUCCESS) {
       return ret;
    }
 
-   ret = slabs_init(se, se->config.maxbytes, se->config.factor,
-                    se->config.preallocate);
+   ret = items_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = seqlog_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = expiry_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = namespaces_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = miss_filter_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = vbucket_index_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = mrc_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = ext_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = slabs_init(se, se->config.maxbytes, se->config.preallocate);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = restart_rebuild(se);
    if (ret != ENGINE_SUCCESS) {
       return ret;
    }
 
+   if (start_assoc_maintenance_thread(se) != 0) {
+      return ENGINE_FAILED;
+   }
+
+   if ((se->config.lru_maintainer || se->config.evict_reserve != 0) &&
+       !item_start_lru_maintainer(se)) {
+      return ENGINE_FAILED;
+   }
+
+   if (!expiry_start(se)) {
+      return ENGINE_FAILED;
+   }
+
+   if (!ext_start(se)) {
+      return ENGINE_FAILED;
+   }
+
+   if (!vbucket_index_start(se)) {
+      return ENGINE_FAILED;
+   }
+
+   /* The rebalancer gives up the pages other buckets ask for */
+   if ((se->config.slab_reassign || se->config.shared_pool_size != 0) &&
+       !slabs_start_rebalancer(se)) {
+      return ENGINE_FAILED;
+   }
+
    return ENGINE_SUCCESS;
 }
 
 static void default_destroy(ENGINE_HANDLE* handle, const bool force) {
     struct default_engine* se = get_handle(handle);
-    (void)force;
 
     if (se->initialized) {
-        /* Destroy the association table */
-        assoc_destroy(se);
+        int ii;
 
-        /* Destory the slabs cache */
-        slabs_destroy(se);
+        if (se->partitions.engines != NULL) {
+            /* It has no cache of its own (see partitions.c) */
+            partitions_destroy(se, force);
+        } else {
+            /* The producers hold on to items, and have threads of their own */
+            dcp_destroy(se);
+
+            /* Stop the background threads (and tasks) before tearing down */
+            if (se->server.executor != NULL) {
+                se->server.executor->cancel_all(se);
+            }
+            slabs_stop_rebalancer(se);
+            item_stop_lru_maintainer(se);
+            item_stop_flush_reclaimer(se);
+            expiry_stop(se);
+            ext_stop(se);
+            vbucket_index_stop(se);
+
+            /* The deletes of namespaces don't outlive a restart */
+            if (se->restart.arena != NULL) {
+                item_reclaim_namespaces(se);
+            }
+
+            /* Destroy the association table */
+            assoc_destroy(se);
+
+            /* Leave the slab arena to the next process (see restart.c) */
+            restart_save(se);
+
+            /* Destory the slabs cache */
+            slabs_destroy(se);
+            restart_destroy(se);
+
+            /* Release the item lock stripes */
+            items_destroy(se);
+
+            seqlog_destroy(se);
+            expiry_destroy(se);
+            namespaces_destroy(se);
+            miss_filter_destroy(se);
+            vbucket_index_destroy(se);
+            mrc_destroy(se);
+            ext_destroy(se);
+        }
 
         free(se->config.uuid);
+        free(se->config.hugepages);
+        free(se->config.numa_policy);
+        free(se->config.ext_path);
+        free(se->config.restart_file);
+        free(se->config.slab_sizes);
+        free(se->config.eviction_policy);
+        free(se->config.namespace_separator);
 
         /* Clean up the mutexes */
-        cb_mutex_destroy(&se->cache_lock);
+        for (ii = 0; ii < POWER_LARGEST; ++ii) {
+            cb_mutex_destroy(&se->items.lru_locks[ii]);
+        }
+        cb_mutex_destroy(&se->seqlog.lock);
+        cb_mutex_destroy(&se->dcp.lock);
+        cb_cond_destroy(&se->expiry.cond);
+        cb_mutex_destroy(&se->expiry.lock);
+        cb_cond_destroy(&se->ext.cond);
+        cb_cond_destroy(&se->ext.io_cond);
+        cb_mutex_destroy(&se->ext.lock);
+        cb_cond_destroy(&se->items.maintainer_cond);
+        cb_mutex_destroy(&se->items.maintainer_lock);
+        cb_cond_destroy(&se->items.reclaim_cond);
+        cb_mutex_destroy(&se->items.reclaim_lock);
+        cb_mutex_destroy(&se->items.cursor_lock);
+        cb_cond_destroy(&se->assoc.cond);
+        cb_mutex_destroy(&se->assoc.lock);
         cb_mutex_destroy(&se->stats.lock);
+        cb_cond_destroy(&se->slabs.rebalance.cond);
+        cb_mutex_destroy(&se->slabs.rebalance.lock);
         cb_mutex_destroy(&se->slabs.lock);
         cb_mutex_destroy(&se->scrubber.lock);
         se->initialized = false;
@@ -248,21 +507,19 @@ static ENGINE_ERROR_CODE default_item_allocate(ENGINE_HANDLE* handle,
                                                const rel_time_t exptime,
                                                uint8_t datatype) {
    hash_item *it;
-   unsigned int id;
    struct default_engine* engine = get_handle(handle);
-   size_t ntotal = sizeof(hash_item) + nkey + nbytes;
-   if (engine->config.use_cas) {
-      ntotal += sizeof(uint64_t);
-   }
-   id = slabs_clsid(engine, ntotal);
-   if (id == 0) {
+   uint16_t frac;
+
+   if (!item_size_ok(engine, nkey, nbytes)) {
       return ENGINE_E2BIG;
    }
 
-   it = item_alloc(engine, key, nkey, flags, engine->server.core->realtime(exptime),
+   it = item_alloc(engine, key, nkey, flags,
+                   item_realtime(engine, cookie, exptime, &frac),
                    (uint32_t)nbytes, cookie, datatype);
 
    if (it != NULL) {
+      it->iflag |= frac;
       *item = it;
       return ENGINE_SUCCESS;
    } else {
@@ -296,10 +553,10 @@ static ENGINE_ERROR_CODE default_item_delete(ENGINE_HANDLE* handle,
       return ENGINE_KEY_EEXISTS;
    }
 
-   /* vbucket UUID / seqno arn't supported by default engine, so just return
-      zeros. */
+   /* vbucket UUIDs aren't supported by default engine, so just return
+      zero. */
    mut_info->vbucket_uuid = 0;
-   mut_info->seqno = 0;
+   mut_info->seqno = seqlog_record(engine, vbucket, key, (uint16_t)nkey, true);
 
    return ENGINE_SUCCESS;
 }
@@ -310,6 +567,12 @@ static void default_item_release(ENGINE_HANDLE* handle,
    item_release(get_handle(handle), get_real_item(item));
 }
 
+static void default_item_release_multi(ENGINE_HANDLE* handle,
+                                       const void *cookie,
+                                       item **items, size_t nitems) {
+   item_release_multi(get_handle(handle), (hash_item**)items, nitems);
+}
+
 static ENGINE_ERROR_CODE default_get(ENGINE_HANDLE* handle,
                                      const void* cookie,
                                      item** item,
@@ -320,11 +583,65 @@ static ENGINE_ERROR_CODE default_get(ENGINE_HANDLE* handle,
    VBUCKET_GUARD(engine, vbucket);
 
    *item = item_get(engine, key, nkey);
-   if (*item != NULL) {
-      return ENGINE_SUCCESS;
-   } else {
+   if (*item == NULL) {
+      mrc_get(engine, key, nkey, 0);
       return ENGINE_KEY_ENOENT;
    }
+   if ((get_real_item(*item)->iflag & ITEM_EXTERNAL) != 0) {
+      /* The value is read back in the background, and the get retried */
+      ENGINE_ERROR_CODE ret = ext_schedule(engine, cookie,
+                                           get_real_item(*item));
+      if (ret != ENGINE_EWOULDBLOCK) {
+         item_release(engine, get_real_item(*item));
+      }
+      *item = NULL;
+      return ret;
+   }
+   mrc_get(engine, key, nkey, item_get_bytes(engine, get_real_item(*item)));
+   return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE default_get_multi(ENGINE_HANDLE* handle,
+                                           const void* cookie,
+                                           item_get_request *requests,
+                                           size_t nrequests) {
+   struct default_engine *engine = get_handle(handle);
+   size_t ii;
+
+   for (ii = 0; ii < nrequests; ++ii) {
+      item_get_request *req = &requests[ii];
+      req->item = NULL;
+      if (!handled_vbucket(engine, req->vbucket)) {
+         req->status = ENGINE_NOT_MY_VBUCKET;
+         continue;
+      }
+      req->item = item_get(engine, req->key, req->nkey);
+      req->status = req->item ? ENGINE_SUCCESS : ENGINE_KEY_ENOENT;
+      if (req->item != NULL &&
+          (get_real_item(req->item)->iflag & ITEM_EXTERNAL) != 0) {
+         /* Left to engine::get, which waits for the value */
+         item_release(engine, get_real_item(req->item));
+         req->item = NULL;
+         req->status = ENGINE_EWOULDBLOCK;
+      } else {
+         mrc_get(engine, req->key, req->nkey, req->item == NULL ? 0 :
+                 item_get_bytes(engine, get_real_item(req->item)));
+      }
+   }
+
+   return ENGINE_SUCCESS;
+}
+
+static void default_prefetch(ENGINE_HANDLE* handle,
+                             const void* cookie,
+                             const void* key,
+                             const int nkey,
+                             uint16_t vbucket,
+                             ENGINE_PREFETCH_STAGE stage) {
+   struct default_engine *engine = get_handle(handle);
+   if (handled_vbucket(engine, vbucket)) {
+      item_prefetch(engine, key, nkey, stage == ENGINE_PREFETCH_ITEM);
+   }
 }
 
 static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
@@ -353,13 +670,83 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
       add_stat("reclaimed", 9, val, len, cookie);
       len = sprintf(val, "%"PRIu64, (uint64_t)engine->config.maxbytes);
       add_stat("engine_maxbytes", 15, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, (uint64_t)item_header_size(engine));
+      add_stat("item_header_size", 16, val, len, cookie);
+      if (engine->config.lease_timeout != 0) {
+         len = sprintf(val, "%"PRIu64, engine->stats.leases_granted);
+         add_stat("leases_granted", 14, val, len, cookie);
+         len = sprintf(val, "%"PRIu64, engine->stats.lease_waits);
+         add_stat("lease_waits", 11, val, len, cookie);
+         len = sprintf(val, "%"PRIu64, engine->stats.stale_hits);
+         add_stat("stale_hits", 10, val, len, cookie);
+      }
       cb_mutex_exit(&engine->stats.lock);
+      expiry_stats(engine, add_stat, cookie);
+      namespace_stats(engine, add_stat, cookie);
+      miss_filter_stats(engine, add_stat, cookie);
+      vbucket_index_stats(engine, add_stat, cookie);
+      ext_stats(engine, add_stat, cookie);
+      restart_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "slabs", 5) == 0) {
       slabs_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "slab_sizes", 10) == 0) {
+      slabs_stats_sizes(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "items", 5) == 0) {
       item_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "sizes", 5) == 0) {
       item_stats_sizes(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "ages", 4) == 0) {
+      item_stats_ages(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "mrc", 3) == 0) {
+      mrc_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "vbucket-seqno", 13) == 0) {
+      char key[32];
+      char val[32];
+      int ii;
+
+      for (ii = 0; ii < NUM_VBUCKETS; ++ii) {
+         uint64_t seqno = seqlog_high_seqno(engine, (uint16_t)ii);
+         if (seqno != 0 ||
+             get_vbucket_state(engine, (uint16_t)ii) == vbucket_state_active) {
+            int klen = sprintf(key, "vb_%d:high_seqno", ii);
+            int vlen = sprintf(val, "%"PRIu64, seqno);
+            add_stat(key, klen, val, vlen, cookie);
+         }
+      }
+   } else if (strncmp(stat_key, "vbucket-details", 15) == 0) {
+      static const char *const states[] = {
+         "none", "active", "replica", "pending", "dead"
+      };
+      char key[32];
+      char val[32];
+      int ii;
+
+      /* The counts are only there with the vbucket index */
+      for (ii = 0; ii < NUM_VBUCKETS; ++ii) {
+         vbucket_state_t state = get_vbucket_state(engine, (uint16_t)ii);
+         uint64_t items = 0, bytes = 0;
+         bool indexed = vbucket_index_counts(engine, (uint16_t)ii,
+                                             &items, &bytes);
+         int klen, vlen;
+
+         if (state == 0 && items == 0) {
+            continue;
+         }
+         klen = sprintf(key, "vb_%d", ii);
+         add_stat(key, klen, states[state], (uint32_t)strlen(states[state]),
+                  cookie);
+         if (indexed) {
+            klen = sprintf(key, "vb_%d:num_items", ii);
+            vlen = sprintf(val, "%"PRIu64, items);
+            add_stat(key, klen, val, vlen, cookie);
+            klen = sprintf(key, "vb_%d:mem_bytes", ii);
+            vlen = sprintf(val, "%"PRIu64, bytes);
+            add_stat(key, klen, val, vlen, cookie);
+         }
+         klen = sprintf(key, "vb_%d:high_seqno", ii);
+         vlen = sprintf(val, "%"PRIu64, seqlog_high_seqno(engine, (uint16_t)ii));
+         add_stat(key, klen, val, vlen, cookie);
+      }
    } else if (strncmp(stat_key, "uuid", 4) == 0) {
        if (engine->config.uuid) {
            add_stat("uuid", 4, engine->config.uuid,
@@ -367,6 +754,8 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
        } else {
            add_stat("uuid", 4, "", 0, cookie);
        }
+   } else if (strncmp(stat_key, "flush", 5) == 0) {
+      item_flush_reclaim_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "scrub", 5) == 0) {
       char val[128];
       int len;
@@ -405,9 +794,58 @@ static ENGINE_ERROR_CODE default_store(ENGINE_HANDLE* handle,
                                        ENGINE_STORE_OPERATION operation,
                                        uint16_t vbucket) {
     struct default_engine *engine = get_handle(handle);
+    hash_item *it = get_real_item(item);
+    ENGINE_ERROR_CODE ret;
+
+    VBUCKET_GUARD(engine, vbucket);
+    item_set_vbucket(it, vbucket);
+    ret = store_item(engine, it, cas, operation, cookie);
+    if (ret == ENGINE_SUCCESS) {
+        seqlog_record(engine, vbucket, item_get_key(it), it->nkey, false);
+    }
+    return ret;
+}
+
+static ENGINE_ERROR_CODE default_store_multi(ENGINE_HANDLE* handle,
+                                             const void *cookie,
+                                             item_store_request *requests,
+                                             size_t nrequests) {
+   struct default_engine *engine = get_handle(handle);
+   size_t ii;
+
+   for (ii = 0; ii < nrequests; ++ii) {
+      requests[ii].status = handled_vbucket(engine, requests[ii].vbucket) ?
+         ENGINE_SUCCESS : ENGINE_NOT_MY_VBUCKET;
+   }
+   store_items(engine, requests, nrequests, cookie);
+   for (ii = 0; ii < nrequests; ++ii) {
+      if (requests[ii].status == ENGINE_SUCCESS) {
+         seqlog_record(engine, requests[ii].vbucket, requests[ii].key,
+                       requests[ii].nkey, false);
+      }
+   }
+   return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE default_splice(ENGINE_HANDLE* handle,
+                                        const void *cookie,
+                                        item* item,
+                                        uint64_t *cas,
+                                        size_t offset,
+                                        size_t length,
+                                        const void *data,
+                                        size_t ndata,
+                                        uint16_t vbucket) {
+    struct default_engine *engine = get_handle(handle);
+    hash_item *it = get_real_item(item);
+    ENGINE_ERROR_CODE ret;
+
     VBUCKET_GUARD(engine, vbucket);
-    return store_item(engine, get_real_item(item), cas, operation,
-                      cookie);
+    ret = splice_item(engine, it, cas, offset, length, data, ndata);
+    if (ret == ENGINE_SUCCESS) {
+        seqlog_record(engine, vbucket, item_get_key(it), it->nkey, false);
+    }
+    return ret;
 }
 
 static ENGINE_ERROR_CODE default_arithmetic(ENGINE_HANDLE* handle,
@@ -424,20 +862,69 @@ static ENGINE_ERROR_CODE default_arithmetic(ENGINE_HANDLE* handle,
                                             uint64_t *result,
                                             uint16_t vbucket) {
    struct default_engine *engine = get_handle(handle);
+   ENGINE_ERROR_CODE ret;
    VBUCKET_GUARD(engine, vbucket);
 
-   return arithmetic(engine, cookie, key, nkey, increment,
-                     create, delta, initial, engine->server.core->realtime(exptime),
-                     item, datatype, result);
+   ret = arithmetic(engine, cookie, key, nkey, vbucket, increment,
+                    create, delta, initial, engine->server.core->realtime(exptime),
+                    item, datatype, result);
+   if (ret == ENGINE_SUCCESS) {
+      seqlog_record(engine, vbucket, key, (uint16_t)nkey, false);
+   }
+   return ret;
 }
 
 static ENGINE_ERROR_CODE default_flush(ENGINE_HANDLE* handle,
                                        const void* cookie, time_t when) {
    item_flush_expired(get_handle(handle), when);
+   /* The log can't tell which keys the flush took */
+   seqlog_purge(get_handle(handle));
 
    return ENGINE_SUCCESS;
 }
 
+static ENGINE_ERROR_CODE default_dcp_step(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          struct dcp_message_producers *producers) {
+   return dcp_step(get_handle(handle), cookie, producers);
+}
+
+static ENGINE_ERROR_CODE default_dcp_open(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          uint32_t opaque,
+                                          uint32_t seqno,
+                                          uint32_t flags,
+                                          void *name,
+                                          uint16_t nname) {
+   struct default_engine *engine = get_handle(handle);
+
+   if (engine->partitions.engines != NULL) {
+      /* A stream would have to merge the ones of every partition */
+      return ENGINE_ENOTSUP;
+   }
+   return dcp_open(engine, cookie, flags);
+}
+
+static ENGINE_ERROR_CODE default_dcp_stream_req(ENGINE_HANDLE* handle,
+                                                const void* cookie,
+                                                uint32_t flags,
+                                                uint32_t opaque,
+                                                uint16_t vbucket,
+                                                uint64_t start_seqno,
+                                                uint64_t end_seqno,
+                                                uint64_t vbucket_uuid,
+                                                uint64_t snap_start_seqno,
+                                                uint64_t snap_end_seqno,
+                                                uint64_t *rollback_seqno,
+                                                dcp_add_failover_log callback) {
+   struct default_engine *engine = get_handle(handle);
+   VBUCKET_GUARD(engine, vbucket);
+
+   return dcp_stream_req(engine, cookie, flags, opaque, vbucket,
+                         start_seqno, end_seqno, vbucket_uuid,
+                         rollback_seqno, callback);
+}
+
 static void default_reset_stats(ENGINE_HANDLE* handle, const void *cookie) {
    struct default_engine *engine = get_handle(handle);
    item_stats_reset(engine);
@@ -446,6 +933,9 @@ static void default_reset_stats(ENGINE_HANDLE* handle, const void *cookie) {
    engine->stats.evictions = 0;
    engine->stats.reclaimed = 0;
    engine->stats.total_items = 0;
+   engine->stats.leases_granted = 0;
+   engine->stats.lease_waits = 0;
+   engine->stats.stale_hits = 0;
    cb_mutex_exit(&engine->stats.lock);
 }
 
@@ -456,7 +946,9 @@ static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
    se->config.vb0 = true;
 
    if (cfg_str != NULL) {
-       struct config_item items[13];
+       static struct config_schema *config_schema;
+       const struct config_schema *schema;
+       struct config_item items[54];
        int ii = 0;
 
        memset(&items, 0, sizeof(items));
@@ -519,128 +1011,1017 @@ static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
        items[ii].value.dt_string = &se->config.uuid;
        ++ii;
 
-       items[ii].key = NULL;
+       items[ii].key = "lock_stripes";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.lock_stripes;
        ++ii;
-       cb_assert(ii == 13);
-       ret = se->server.core->parse_config(cfg_str, items, stderr);
-   }
 
-   if (se->config.vb0) {
-       set_vbucket_state(se, 0, vbucket_state_active);
-   }
+       items[ii].key = "bucketed_index";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.bucketed_index;
+       ++ii;
 
-   return ret;
-}
+       items[ii].key = "lru_maintainer";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.lru_maintainer;
+       ++ii;
 
-static bool set_vbucket(struct default_engine *e,
-                        const void* cookie,
-                        protocol_binary_request_set_vbucket *req,
-                        ADD_RESPONSE response) {
-    vbucket_state_t state;
-    size_t bodylen = ntohl(req->message.header.request.bodylen)
-        - ntohs(req->message.header.request.keylen);
-    if (bodylen != sizeof(vbucket_state_t)) {
-        const char *msg = "Incorrect packet format";
-        return response(NULL, 0, NULL, 0, msg, (uint32_t)strlen(msg),
-                        PROTOCOL_BINARY_RAW_BYTES,
-                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
-    }
-    memcpy(&state, &req->message.body.state, sizeof(state));
-    state = ntohl(state);
+       items[ii].key = "slab_reassign";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.slab_reassign;
+       ++ii;
 
-    if (!is_valid_vbucket_state_t(state)) {
-        const char *msg = "Invalid vbucket state";
-        return response(NULL, 0, NULL, 0, msg, (uint32_t)strlen(msg),
-                        PROTOCOL_BINARY_RAW_BYTES,
-                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
-    }
+       items[ii].key = "slab_automove";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.slab_automove;
+       ++ii;
 
-    set_vbucket_state(e, ntohs(req->message.header.request.vbucket), state);
-    return response(NULL, 0, NULL, 0, &state, sizeof(state),
-                    PROTOCOL_BINARY_RAW_BYTES,
-                    PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
-}
+       items[ii].key = "slab_compact";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.slab_compact;
+       ++ii;
 
-static bool get_vbucket(struct default_engine *e,
-                        const void* cookie,
-                        protocol_binary_request_get_vbucket *req,
-                        ADD_RESPONSE response) {
-    vbucket_state_t state;
-    state = get_vbucket_state(e, ntohs(req->message.header.request.vbucket));
-    state = ntohl(state);
+       items[ii].key = "slab_sizes";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.slab_sizes;
+       ++ii;
 
-    return response(NULL, 0, NULL, 0, &state, sizeof(state),
-                    PROTOCOL_BINARY_RAW_BYTES,
-                    PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
-}
+       items[ii].key = "slab_learn";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.slab_learn;
+       ++ii;
 
-static bool rm_vbucket(struct default_engine *e,
-                       const void *cookie,
-                       protocol_binary_request_header *req,
-                       ADD_RESPONSE response) {
-    set_vbucket_state(e, ntohs(req->request.vbucket), vbucket_state_dead);
-    return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
-                    PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
-}
+       items[ii].key = "hugepages";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.hugepages;
+       ++ii;
 
-static bool scrub_cmd(struct default_engine *e,
-                      const void *cookie,
-                      protocol_binary_request_header *request,
-                      ADD_RESPONSE response) {
+       items[ii].key = "numa_policy";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.numa_policy;
+       ++ii;
 
-    protocol_binary_response_status res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
-    if (!item_start_scrub(e)) {
-        res = PROTOCOL_BINARY_RESPONSE_EBUSY;
-    }
+       items[ii].key = "prefault_threads";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.prefault_threads;
+       ++ii;
 
-    return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
-                    res, 0, cookie);
-}
+       items[ii].key = "slab_magazine_size";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.slab_magazine_size;
+       ++ii;
 
-static bool touch(struct default_engine *e, const void *cookie,
-                  protocol_binary_request_header *request,
-                  ADD_RESPONSE response) {
+       items[ii].key = "compact_items";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.compact_items;
+       ++ii;
 
-    protocol_binary_request_touch *t;
-    void *key;
-    uint32_t exptime;
-    uint16_t nkey;
-    hash_item *item;
+       items[ii].key = "lease_timeout";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.lease_timeout;
+       ++ii;
 
+       items[ii].key = "stale_grace";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.stale_grace;
+       ++ii;
 
-    if (request->request.extlen != 4 || request->request.keylen == 0) {
-        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
-                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
-    }
+       items[ii].key = "seqlog_size";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.seqlog_size;
+       ++ii;
 
-    t = (void*)request;
-    key = t->bytes + sizeof(t->bytes);
-    exptime = ntohl(t->message.body.expiration);
-    nkey = ntohs(request->request.keylen);
-    item = touch_item(e, key, nkey, e->server.core->realtime(exptime));
+       items[ii].key = "dcp_helper_threads";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.dcp_helper_threads;
+       ++ii;
 
-    if (item == NULL) {
-        if (request->request.opcode == PROTOCOL_BINARY_CMD_GATQ) {
-            return true;
-        } else {
-            return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
-                            PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, cookie);
-        }
-    } else {
-        bool ret;
-        if (request->request.opcode == PROTOCOL_BINARY_CMD_TOUCH) {
+       items[ii].key = "expiry_index_size";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.expiry_index_size;
+       ++ii;
+
+       items[ii].key = "large_item_size_max";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.large_item_size_max;
+       ++ii;
+
+       items[ii].key = "ext_path";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.ext_path;
+       ++ii;
+
+       items[ii].key = "ext_size";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.ext_size;
+       ++ii;
+
+       items[ii].key = "ext_segment_size";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.ext_segment_size;
+       ++ii;
+
+       items[ii].key = "ext_item_min";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.ext_item_min;
+       ++ii;
+
+       items[ii].key = "ext_item_age";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.ext_item_age;
+       ++ii;
+
+       items[ii].key = "ext_io_threads";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.ext_io_threads;
+       ++ii;
+
+       items[ii].key = "restart_file";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.restart_file;
+       ++ii;
+
+       items[ii].key = "eviction_policy";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.eviction_policy;
+       ++ii;
+
+       items[ii].key = "evict_reserve";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.evict_reserve;
+       ++ii;
+
+       items[ii].key = "expected_items";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.expected_items;
+       ++ii;
+
+       items[ii].key = "presize_hashtable";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.presize_hashtable;
+       ++ii;
+
+       items[ii].key = "hash_expand_threads";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.hash_expand_threads;
+       ++ii;
+
+       items[ii].key = "namespace_separator";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.namespace_separator;
+       ++ii;
+
+       items[ii].key = "namespace_depth";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.namespace_depth;
+       ++ii;
+
+       items[ii].key = "miss_filter_items";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.miss_filter_items;
+       ++ii;
+
+       items[ii].key = "mrc_keys";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.mrc_keys;
+       ++ii;
+
+       items[ii].key = "shared_pool_size";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.shared_pool_size;
+       ++ii;
+
+       items[ii].key = "hard_quota";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.hard_quota;
+       ++ii;
+
+       items[ii].key = "tiny_items";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.tiny_items;
+       ++ii;
+
+       items[ii].key = "vbucket_index";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.vbucket_index;
+       ++ii;
+
+       items[ii].key = "item_sample";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.item_sample;
+       ++ii;
+
+       items[ii].key = "partitions";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.partitions;
+       ++ii;
+
+       items[ii].key = NULL;
+       ++ii;
+       cb_assert(ii == 54);
+       /* Compiled once for all of the buckets */
+       schema = config_schema_get(&config_schema, items);
+       ret = parse_config_schema(cfg_str, schema, items, stderr);
+   }
+
+   if (se->config.vb0) {
+       set_vbucket_state(se, 0, vbucket_state_active);
+   }
+
+   return ret;
+}
+
+static bool set_vbucket(struct default_engine *e,
+                        const void* cookie,
+                        protocol_binary_request_set_vbucket *req,
+                        ADD_RESPONSE response) {
+    vbucket_state_t state;
+    size_t bodylen = ntohl(req->message.header.request.bodylen)
+        - ntohs(req->message.header.request.keylen);
+    if (bodylen != sizeof(vbucket_state_t)) {
+        const char *msg = "Incorrect packet format";
+        return response(NULL, 0, NULL, 0, msg, (uint32_t)strlen(msg),
+                        PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+    memcpy(&state, &req->message.body.state, sizeof(state));
+    state = ntohl(state);
+
+    if (!is_valid_vbucket_state_t(state)) {
+        const char *msg = "Invalid vbucket state";
+        return response(NULL, 0, NULL, 0, msg, (uint32_t)strlen(msg),
+                        PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    set_vbucket_state(e, ntohs(req->message.header.request.vbucket), state);
+    return response(NULL, 0, NULL, 0, &state, sizeof(state),
+                    PROTOCOL_BINARY_RAW_BYTES,
+                    PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+}
+
+static bool get_vbucket(struct default_engine *e,
+                        const void* cookie,
+                        protocol_binary_request_get_vbucket *req,
+                        ADD_RESPONSE response) {
+    vbucket_state_t state;
+    state = get_vbucket_state(e, ntohs(req->message.header.request.vbucket));
+    state = ntohl(state);
+
+    return response(NULL, 0, NULL, 0, &state, sizeof(state),
+                    PROTOCOL_BINARY_RAW_BYTES,
+                    PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+}
+
+static bool rm_vbucket(struct default_engine *e,
+                       const void *cookie,
+                       protocol_binary_request_header *req,
+                       ADD_RESPONSE response) {
+    set_vbucket_state(e, ntohs(req->request.vbucket), vbucket_state_dead);
+    return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                    PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+}
+
+static bool scrub_cmd(struct default_engine *e,
+                      const void *cookie,
+                      protocol_binary_request_header *request,
+                      ADD_RESPONSE response) {
+
+    protocol_binary_response_status res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    if (!item_start_scrub(e)) {
+        res = PROTOCOL_BINARY_RESPONSE_EBUSY;
+    }
+
+    return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                    res, 0, cookie);
+}
+
+static bool slab_reassign_cmd(struct default_engine *e,
+                              const void *cookie,
+                              protocol_binary_request_header *request,
+                              ADD_RESPONSE response) {
+
+    protocol_binary_request_slab_reassign *req = (void*)request;
+    protocol_binary_response_status res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+
+    if (request->request.extlen != 8 || request->request.keylen != 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    switch (slabs_reassign(e, ntohl(req->message.body.src),
+                           ntohl(req->message.body.dst))) {
+    case REASSIGN_OK:
+        break;
+    case REASSIGN_RUNNING:
+        res = PROTOCOL_BINARY_RESPONSE_EBUSY;
+        break;
+    case REASSIGN_BADCLASS:
+    case REASSIGN_NOSPARE:
+    case REASSIGN_SRC_DST_SAME:
+        res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+        break;
+    case REASSIGN_DISABLED:
+        res = PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+        break;
+    }
+
+    return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                    res, 0, cookie);
+}
+
+static protocol_binary_response_status snapshot_status(ENGINE_ERROR_CODE ret) {
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    case ENGINE_ENOMEM:
+        return PROTOCOL_BINARY_RESPONSE_ENOMEM;
+    default:
+        return PROTOCOL_BINARY_RESPONSE_EINVAL;
+    }
+}
+
+static bool snapshot_dump_cmd(struct default_engine *e,
+                              const void *cookie,
+                              protocol_binary_request_header *request,
+                              ADD_RESPONSE response) {
+    protocol_binary_request_snapshot_dump *req = (void*)request;
+    protocol_binary_response_snapshot_dump rsp;
+    ENGINE_ERROR_CODE ret;
+    char *data;
+    size_t ndata;
+    uint32_t next;
+    bool sent;
+
+    if (request->request.extlen != 8 || request->request.keylen != 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    ret = snapshot_dump(e, ntohl(req->message.body.first),
+                        ntohl(req->message.body.last), &data, &ndata, &next);
+    if (ret != ENGINE_SUCCESS) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        snapshot_status(ret), 0, cookie);
+    }
+    rsp.message.body.next = htonl(next);
+    rsp.message.body.nslices = htonl(snapshot_slices(e));
+    sent = response(NULL, 0, &rsp.message.body, sizeof(rsp.message.body),
+                    data, (uint32_t)ndata, PROTOCOL_BINARY_RAW_BYTES,
+                    PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+    free(data);
+    return sent;
+}
+
+static bool scan_keys_cmd(struct default_engine *e,
+                          const void *cookie,
+                          protocol_binary_request_header *request,
+                          ADD_RESPONSE response) {
+    protocol_binary_request_scan_keys *req = (void*)request;
+    protocol_binary_response_scan_keys rsp;
+    ENGINE_ERROR_CODE ret;
+    uint16_t nkey = ntohs(request->request.keylen);
+    char *data;
+    size_t ndata;
+    uint32_t next;
+    bool sent;
+
+    if (request->request.extlen != 8 ||
+        ntohl(request->request.bodylen) != 8 + (uint32_t)nkey) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    ret = snapshot_scan(e, ntohl(req->message.body.cursor),
+                        ntohl(req->message.body.count),
+                        req->bytes + sizeof(req->bytes), nkey,
+                        &data, &ndata, &next);
+    if (ret != ENGINE_SUCCESS) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        snapshot_status(ret), 0, cookie);
+    }
+    rsp.message.body.next = htonl(next);
+    rsp.message.body.nslices = htonl(snapshot_slices(e));
+    sent = response(NULL, 0, &rsp.message.body, sizeof(rsp.message.body),
+                    data, (uint32_t)ndata, PROTOCOL_BINARY_RAW_BYTES,
+                    PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+    free(data);
+    return sent;
+}
+
+static bool snapshot_load_cmd(struct default_engine *e,
+                              const void *cookie,
+                              protocol_binary_request_header *request,
+                              ADD_RESPONSE response) {
+    protocol_binary_response_snapshot_load rsp;
+    ENGINE_ERROR_CODE ret;
+    uint32_t stored, skipped;
+
+    if (request->request.extlen != 0 || request->request.keylen != 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    ret = snapshot_load(e, cookie, (const char*)(request + 1),
+                        ntohl(request->request.bodylen), &stored, &skipped);
+    rsp.message.body.stored = htonl(stored);
+    rsp.message.body.skipped = htonl(skipped);
+    return response(NULL, 0, &rsp.message.body, sizeof(rsp.message.body),
+                    NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                    snapshot_status(ret), 0, cookie);
+}
+
+static bool namespace_delete_cmd(struct default_engine *e,
+                                 const void *cookie,
+                                 protocol_binary_request_header *request,
+                                 ADD_RESPONSE response) {
+    protocol_binary_request_namespace_delete *req = (void*)request;
+    protocol_binary_response_namespace_delete rsp;
+    protocol_binary_response_status res;
+    uint32_t flags = 0;
+    uint64_t nitems;
+    uint16_t nkey = ntohs(request->request.keylen);
+
+    if ((request->request.extlen != 0 && request->request.extlen != 4) ||
+        nkey == 0 ||
+        ntohl(request->request.bodylen) != request->request.extlen + nkey) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+    if (request->request.extlen == 4) {
+        flags = ntohl(req->message.body.flags);
+    }
+
+    switch (item_delete_namespace(e, (const char*)request + sizeof(*request) +
+                                  request->request.extlen, nkey,
+                                  (flags & PROTOCOL_BINARY_NAMESPACE_DELETE_LAZY) == 0,
+                                  &nitems)) {
+    case ENGINE_SUCCESS:
+        res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+        break;
+    case ENGINE_KEY_ENOENT:
+        res = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+        break;
+    default:
+        res = PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+        break;
+    }
+    rsp.message.body.items = htonll(nitems);
+    return response(NULL, 0, &rsp.message.body, sizeof(rsp.message.body),
+                    NULL, 0, PROTOCOL_BINARY_RAW_BYTES, res, 0, cookie);
+}
+
+static uint16_t incrm_status(ENGINE_ERROR_CODE ret) {
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    case ENGINE_KEY_ENOENT:
+        return PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+    case ENGINE_KEY_EEXISTS:
+    case ENGINE_NOT_STORED:
+        return PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+    case ENGINE_EINVAL:
+        return PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL;
+    case ENGINE_ENOMEM:
+        return PROTOCOL_BINARY_RESPONSE_ENOMEM;
+    case ENGINE_TMPFAIL:
+        return PROTOCOL_BINARY_RESPONSE_ETMPFAIL;
+    default:
+        return PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+    }
+}
+
+static bool incrm_cmd(struct default_engine *e,
+                      const void *cookie,
+                      protocol_binary_request_header *request,
+                      ADD_RESPONSE response) {
+    const char *body = (const char*)(request + 1);
+    uint32_t bodylen = ntohl(request->request.bodylen);
+    uint16_t vbucket = ntohs(request->request.vbucket);
+    item_arithmetic_request *requests;
+    protocol_binary_incrm_result *results;
+    size_t nrequests = 0;
+    uint32_t offset = 0;
+    size_t ii;
+    bool sent;
+
+    if (request->request.extlen != 0 || request->request.keylen != 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+    if (!handled_vbucket(e, vbucket)) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET, 0, cookie);
+    }
+
+    /* Count (and check) the entries first */
+    while (offset < bodylen) {
+        protocol_binary_incrm_entry entry;
+        uint16_t nkey;
+
+        if (bodylen - offset < sizeof(entry) ||
+            nrequests == PROTOCOL_BINARY_SETM_MAX_ENTRIES) {
+            break;
+        }
+        memcpy(&entry, body + offset, sizeof(entry));
+        nkey = ntohs(entry.nkey);
+        if (nkey == 0 || nkey > PROTOCOL_BINARY_SETM_MAX_KEYLEN ||
+            bodylen - offset - sizeof(entry) < nkey) {
+            break;
+        }
+        offset += (uint32_t)sizeof(entry) + nkey;
+        ++nrequests;
+    }
+    if (offset != bodylen || nrequests == 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    requests = calloc(nrequests, sizeof(*requests));
+    results = calloc(nrequests, sizeof(*results));
+    if (requests == NULL || results == NULL) {
+        free(requests);
+        free(results);
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
+    }
+
+    offset = 0;
+    for (ii = 0; ii < nrequests; ++ii) {
+        protocol_binary_incrm_entry entry;
+        uint32_t expiration;
+
+        memcpy(&entry, body + offset, sizeof(entry));
+        expiration = ntohl(entry.expiration);
+        requests[ii].key = body + offset + sizeof(entry);
+        requests[ii].nkey = ntohs(entry.nkey);
+        requests[ii].vbucket = vbucket;
+        requests[ii].incr = (ntohs(entry.flags) & PROTOCOL_BINARY_INCRM_DECR) == 0;
+        requests[ii].create = expiration != 0xffffffff;
+        requests[ii].delta = ntohll(entry.delta);
+        requests[ii].initial = ntohll(entry.initial);
+        requests[ii].exptime = requests[ii].create ?
+            e->server.core->realtime(expiration) : 0;
+        offset += (uint32_t)sizeof(entry) + requests[ii].nkey;
+    }
+
+    arithmetic_items(e, requests, nrequests, request->request.datatype,
+                     cookie);
+
+    for (ii = 0; ii < nrequests; ++ii) {
+        results[ii].status = htons(incrm_status(requests[ii].status));
+        if (requests[ii].status == ENGINE_SUCCESS) {
+            results[ii].value = htonll(requests[ii].value);
+            results[ii].cas = htonll(requests[ii].cas);
+            seqlog_record(e, vbucket, requests[ii].key, requests[ii].nkey,
+                          false);
+        }
+    }
+    free(requests);
+
+    sent = response(NULL, 0, NULL, 0, results,
+                    (uint32_t)(nrequests * sizeof(*results)),
+                    PROTOCOL_BINARY_RAW_BYTES,
+                    PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+    free(results);
+    return sent;
+}
+
+static uint16_t casm_status(ENGINE_ERROR_CODE ret) {
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    case ENGINE_KEY_ENOENT:
+        return PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+    case ENGINE_KEY_EEXISTS:
+        return PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+    case ENGINE_EINVAL:
+        return PROTOCOL_BINARY_RESPONSE_EINVAL;
+    case ENGINE_E2BIG:
+        return PROTOCOL_BINARY_RESPONSE_E2BIG;
+    case ENGINE_ENOMEM:
+        return PROTOCOL_BINARY_RESPONSE_ENOMEM;
+    default:
+        return PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+    }
+}
+
+static bool casm_cmd(struct default_engine *e,
+                     const void *cookie,
+                     protocol_binary_request_header *request,
+                     ADD_RESPONSE response) {
+    const char *body = (const char*)(request + 1);
+    uint32_t bodylen = ntohl(request->request.bodylen);
+    uint16_t vbucket = ntohs(request->request.vbucket);
+    item_store_request *requests;
+    protocol_binary_casm_result *results;
+    size_t nrequests = 0;
+    uint32_t offset = 0;
+    ENGINE_ERROR_CODE ret;
+    size_t ii;
+    bool sent;
+
+    if (request->request.extlen != 0 || request->request.keylen != 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+    if (!handled_vbucket(e, vbucket)) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET, 0, cookie);
+    }
+
+    /* Count (and check) the entries first */
+    while (offset < bodylen) {
+        protocol_binary_casm_entry entry;
+        uint16_t nkey;
+        uint32_t nbytes;
+
+        if (bodylen - offset < sizeof(entry) ||
+            nrequests == PROTOCOL_BINARY_SETM_MAX_ENTRIES) {
+            break;
+        }
+        memcpy(&entry, body + offset, sizeof(entry));
+        nkey = ntohs(entry.nkey);
+        nbytes = ntohl(entry.nbytes);
+        offset += (uint32_t)sizeof(entry);
+        if (nkey == 0 || nkey > PROTOCOL_BINARY_SETM_MAX_KEYLEN ||
+            bodylen - offset < nkey || bodylen - offset - nkey < nbytes) {
+            break;
+        }
+        offset += nkey + nbytes;
+        ++nrequests;
+    }
+    if (offset != bodylen || nrequests == 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    requests = calloc(nrequests, sizeof(*requests));
+    results = calloc(nrequests, sizeof(*results));
+    if (requests == NULL || results == NULL) {
+        free(requests);
+        free(results);
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
+    }
+
+    offset = 0;
+    for (ii = 0; ii < nrequests; ++ii) {
+        protocol_binary_casm_entry entry;
+
+        memcpy(&entry, body + offset, sizeof(entry));
+        offset += (uint32_t)sizeof(entry);
+        requests[ii].key = body + offset;
+        requests[ii].nkey = ntohs(entry.nkey);
+        requests[ii].value = body + offset + requests[ii].nkey;
+        requests[ii].nbytes = ntohl(entry.nbytes);
+        requests[ii].flags = entry.flags;
+        requests[ii].exptime = e->server.core->realtime(ntohl(entry.expiration));
+        requests[ii].vbucket = vbucket;
+        requests[ii].datatype = request->request.datatype;
+        requests[ii].operation = OPERATION_CAS;
+        requests[ii].cas = ntohll(entry.cas);
+        offset += requests[ii].nkey + requests[ii].nbytes;
+    }
+
+    ret = cas_items(e, requests, nrequests, cookie);
+    for (ii = 0; ii < nrequests; ++ii) {
+        results[ii].status = htons(casm_status(requests[ii].status));
+        if (ret == ENGINE_SUCCESS) {
+            results[ii].cas = htonll(requests[ii].cas);
+            seqlog_record(e, vbucket, requests[ii].key, requests[ii].nkey,
+                          false);
+        }
+    }
+    free(requests);
+
+    sent = response(NULL, 0, NULL, 0, results,
+                    (uint32_t)(nrequests * sizeof(*results)),
+                    PROTOCOL_BINARY_RAW_BYTES, casm_status(ret), 0, cookie);
+    free(results);
+    return sent;
+}
+
+/*
+ * The responses take the value as a single buffer, so a chained item is
+ * sent from a copy (in *copy, NULL if the item's own data will do), as is
+ * one in the extended storage, read back right away.
+ * Returns false if out of memory (or the value in the extended storage
+ * is lost).
+ */
+static bool get_value(struct default_engine *e, const hash_item *item,
+                      char **copy) {
+    *copy = NULL;
+    if ((item->iflag & (ITEM_CHAINED|ITEM_EXTERNAL)) == 0) {
+        return true;
+    }
+    *copy = item_get_value_copy(e, item);
+    return *copy != NULL;
+}
+
+static bool touch(struct default_engine *e, const void *cookie,
+                  protocol_binary_request_header *request,
+                  ADD_RESPONSE response) {
+
+    protocol_binary_request_touch *t;
+    void *key;
+    uint32_t exptime;
+    uint16_t frac;
+    uint16_t nkey;
+    hash_item *item;
+
+
+    if (request->request.extlen != 4 || request->request.keylen == 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    t = (void*)request;
+    key = t->bytes + sizeof(t->bytes);
+    exptime = ntohl(t->message.body.expiration);
+    nkey = ntohs(request->request.keylen);
+    exptime = item_realtime(e, cookie, exptime, &frac);
+    item = touch_item(e, key, nkey, exptime, frac);
+
+    if (item == NULL) {
+        if (request->request.opcode == PROTOCOL_BINARY_CMD_GATQ) {
+            return true;
+        } else {
+            return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, cookie);
+        }
+    } else {
+        bool ret;
+        char *copy = NULL;
+        if (request->request.opcode == PROTOCOL_BINARY_CMD_TOUCH) {
             ret = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
                            PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+        } else if (!get_value(e, item, &copy)) {
+            ret = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                           PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
         } else {
             ret = response(NULL, 0, &item->flags, sizeof(item->flags),
-                           item_get_data(item), item->nbytes,
+                           copy ? copy : item_get_data(item), item->nbytes,
                            PROTOCOL_BINARY_RAW_BYTES,
                            PROTOCOL_BINARY_RESPONSE_SUCCESS,
                            item_get_cas(item), cookie);
         }
+        free(copy);
+        item_release(e, item);
+        return ret;
+    }
+}
+
+/*
+ * TOUCHM and GATM: the expiration of the extras for all the keys of the
+ * body in one call into the engine (see protocol_binary_touchm_entry).
+ */
+static bool touchm_cmd(struct default_engine *e,
+                       const void *cookie,
+                       protocol_binary_request_header *request,
+                       ADD_RESPONSE response) {
+    protocol_binary_request_touchm *req = (void*)request;
+    const char *body = (const char*)(req->bytes + sizeof(req->bytes));
+    uint32_t bodylen = ntohl(request->request.bodylen);
+    uint16_t vbucket = ntohs(request->request.vbucket);
+    bool get = request->request.opcode == PROTOCOL_BINARY_CMD_GATM;
+    item_touch_request *requests;
+    char **copies = NULL;
+    size_t nrequests = 0;
+    size_t nbitmap;
+    size_t total;
+    uint32_t offset = 0;
+    uint32_t exptime;
+    uint16_t frac;
+    uint16_t res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    char *rsp;
+    size_t ii;
+    bool sent;
+
+    if (request->request.extlen != 4 || request->request.keylen != 0 ||
+        bodylen < 4) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+    if (!handled_vbucket(e, vbucket)) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET, 0, cookie);
+    }
+
+    /* Count (and check) the entries first */
+    bodylen -= 4;
+    while (offset < bodylen) {
+        protocol_binary_touchm_entry entry;
+        uint16_t nkey;
+
+        if (bodylen - offset < sizeof(entry) ||
+            nrequests == PROTOCOL_BINARY_SETM_MAX_ENTRIES) {
+            break;
+        }
+        memcpy(&entry, body + offset, sizeof(entry));
+        nkey = ntohs(entry.nkey);
+        if (nkey == 0 || nkey > PROTOCOL_BINARY_SETM_MAX_KEYLEN ||
+            bodylen - offset - sizeof(entry) < nkey) {
+            break;
+        }
+        offset += (uint32_t)sizeof(entry) + nkey;
+        ++nrequests;
+    }
+    if (offset != bodylen || nrequests == 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    requests = calloc(nrequests, sizeof(*requests));
+    if (get) {
+        copies = calloc(nrequests, sizeof(*copies));
+    }
+    if (requests == NULL || (get && copies == NULL)) {
+        free(requests);
+        free(copies);
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
+    }
+
+    offset = 0;
+    for (ii = 0; ii < nrequests; ++ii) {
+        protocol_binary_touchm_entry entry;
+
+        memcpy(&entry, body + offset, sizeof(entry));
+        requests[ii].key = body + offset + sizeof(entry);
+        requests[ii].nkey = ntohs(entry.nkey);
+        requests[ii].get = get;
+        offset += (uint32_t)sizeof(entry) + requests[ii].nkey;
+    }
+
+    exptime = item_realtime(e, cookie, ntohl(req->message.body.expiration),
+                            &frac);
+    touch_items(e, requests, nrequests, exptime, frac);
+
+    /* The bitmap, and the touched items after it if they were asked for */
+    nbitmap = (nrequests + 7) / 8;
+    total = nbitmap;
+    for (ii = 0; ii < nrequests; ++ii) {
+        hash_item *it = requests[ii].item;
+        if (it == NULL) {
+            continue;
+        }
+        if (!get_value(e, it, &copies[ii])) {
+            res = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+        }
+        total += sizeof(protocol_binary_gatm_result) + it->nbytes;
+    }
+    if (total > UINT32_MAX) {
+        res = PROTOCOL_BINARY_RESPONSE_E2BIG;
+    }
+
+    rsp = NULL;
+    if (res == PROTOCOL_BINARY_RESPONSE_SUCCESS &&
+        (rsp = calloc(1, total)) == NULL) {
+        res = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+    }
+    offset = (uint32_t)nbitmap;
+    for (ii = 0; ii < nrequests; ++ii) {
+        hash_item *it = requests[ii].item;
+        if (rsp != NULL && requests[ii].status == ENGINE_SUCCESS) {
+            rsp[ii / 8] |= (char)(1 << (ii % 8));
+        }
+        if (it == NULL) {
+            continue;
+        }
+        if (rsp != NULL) {
+            protocol_binary_gatm_result result;
+            result.cas = htonll(item_get_cas(it));
+            result.flags = it->flags;
+            result.nbytes = htonl(it->nbytes);
+            memcpy(rsp + offset, &result, sizeof(result));
+            offset += (uint32_t)sizeof(result);
+            memcpy(rsp + offset, copies[ii] ? copies[ii] : item_get_data(it),
+                   it->nbytes);
+            offset += it->nbytes;
+        }
+        free(copies[ii]);
+        item_release(e, it);
+    }
+    free(copies);
+    free(requests);
+
+    if (rsp == NULL) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        res, 0, cookie);
+    }
+    sent = response(NULL, 0, NULL, 0, rsp, (uint32_t)total,
+                    PROTOCOL_BINARY_RAW_BYTES,
+                    PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+    free(rsp);
+    return sent;
+}
+
+/*
+ * A get from a replica vbucket, for the clients (and the proxy hedging a
+ * slow get) willing to read a value which may be slightly behind.
+ */
+static bool get_replica(struct default_engine *e, const void *cookie,
+                        protocol_binary_request_header *request,
+                        ADD_RESPONSE response) {
+    void *key;
+    uint16_t nkey;
+    uint16_t vbucket;
+    hash_item *item;
+    char *copy = NULL;
+    bool ret;
+
+    if (request->request.extlen != 0 || request->request.keylen == 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    vbucket = ntohs(request->request.vbucket);
+    if (!e->config.ignore_vbucket &&
+        get_vbucket_state(e, vbucket) != vbucket_state_replica) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET, 0, cookie);
+    }
+
+    key = (char*)request + sizeof(*request);
+    nkey = ntohs(request->request.keylen);
+    item = item_get(e, key, nkey);
+    if (item == NULL) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, cookie);
+    }
+
+    if (!get_value(e, item, &copy)) {
+        ret = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                       PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
+    } else {
+        ret = response(NULL, 0, &item->flags, sizeof(item->flags),
+                       copy ? copy : item_get_data(item), item->nbytes,
+                       item->datatype, PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                       item_get_cas(item), cookie);
+    }
+    free(copy);
+    item_release(e, item);
+    return ret;
+}
+
+static bool get_lease(struct default_engine *e, const void *cookie,
+                      protocol_binary_request_header *request,
+                      ADD_RESPONSE response) {
+    void *key;
+    uint16_t nkey;
+    hash_item *item;
+    uint64_t token;
+    bool stale;
+    protocol_binary_response_status res;
+    char *copy = NULL;
+    bool ret;
+
+    if (e->config.lease_timeout == 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, 0, cookie);
+    }
+    if (request->request.extlen != 0 || request->request.keylen == 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    key = (char*)request + sizeof(*request);
+    nkey = ntohs(request->request.keylen);
+    switch (item_get_lease(e, key, nkey, &item, &token, &stale)) {
+    case ENGINE_SUCCESS:
+        if (!get_value(e, item, &copy)) {
+            ret = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                           PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
+        } else if (stale) {
+            /* The CAS is the lease to refresh it with (if we got it) */
+            uint32_t extras[2];
+            extras[0] = item->flags;
+            extras[1] = htonl(PROTOCOL_BINARY_GET_LEASE_STALE);
+            ret = response(NULL, 0, extras, sizeof(extras),
+                           copy ? copy : item_get_data(item), item->nbytes,
+                           item->datatype, PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                           token, cookie);
+        } else {
+            ret = response(NULL, 0, &item->flags, sizeof(item->flags),
+                           copy ? copy : item_get_data(item), item->nbytes,
+                           item->datatype, PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                           item_get_cas(item), cookie);
+        }
+        free(copy);
         item_release(e, item);
         return ret;
+    case ENGINE_TMPFAIL:
+        /* Someone else is refilling it, try again in a moment */
+        res = PROTOCOL_BINARY_RESPONSE_ETMPFAIL;
+        break;
+    default:
+        /* The CAS (if not 0) is the lease to store the key with */
+        res = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+        break;
     }
+    return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                    res, token, cookie);
 }
 
 static ENGINE_ERROR_CODE default_unknown_command(ENGINE_HANDLE* handle,
@@ -655,6 +2036,9 @@ static ENGINE_ERROR_CODE default_unknown_command(ENGINE_HANDLE* handle,
     case PROTOCOL_BINARY_CMD_SCRUB:
         sent = scrub_cmd(e, cookie, request, response);
         break;
+    case PROTOCOL_BINARY_CMD_SLAB_REASSIGN:
+        sent = slab_reassign_cmd(e, cookie, request, response);
+        break;
     case PROTOCOL_BINARY_CMD_DEL_VBUCKET:
         sent = rm_vbucket(e, cookie, request, response);
         break;
@@ -669,6 +2053,34 @@ static ENGINE_ERROR_CODE default_unknown_command(ENGINE_HANDLE* handle,
     case PROTOCOL_BINARY_CMD_GATQ:
         sent = touch(e, cookie, request, response);
         break;
+    case PROTOCOL_BINARY_CMD_TOUCHM:
+    case PROTOCOL_BINARY_CMD_GATM:
+        sent = touchm_cmd(e, cookie, request, response);
+        break;
+    case PROTOCOL_BINARY_CMD_GET_LEASE:
+        sent = get_lease(e, cookie, request, response);
+        break;
+    case PROTOCOL_BINARY_CMD_GET_REPLICA:
+        sent = get_replica(e, cookie, request, response);
+        break;
+    case PROTOCOL_BINARY_CMD_SNAPSHOT_DUMP:
+        sent = snapshot_dump_cmd(e, cookie, request, response);
+        break;
+    case PROTOCOL_BINARY_CMD_SNAPSHOT_LOAD:
+        sent = snapshot_load_cmd(e, cookie, request, response);
+        break;
+    case PROTOCOL_BINARY_CMD_NAMESPACE_DELETE:
+        sent = namespace_delete_cmd(e, cookie, request, response);
+        break;
+    case PROTOCOL_BINARY_CMD_SCAN_KEYS:
+        sent = scan_keys_cmd(e, cookie, request, response);
+        break;
+    case PROTOCOL_BINARY_CMD_INCRM:
+        sent = incrm_cmd(e, cookie, request, response);
+        break;
+    case PROTOCOL_BINARY_CMD_CASM:
+        sent = casm_cmd(e, cookie, request, response);
+        break;
     default:
         sent = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
                         PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND, 0, cookie);
@@ -683,26 +2095,67 @@ static ENGINE_ERROR_CODE default_unknown_command(ENGINE_HANDLE* handle,
 }
 
 
+/* The CAS (if any) follows the header, which depends on the layout */
+static char *item_get_header_end(const hash_item* item)
+{
+    if (item->iflag & ITEM_COMPACT) {
+        return (char*)item + ITEM_COMPACT_HEADER_SIZE;
+    }
+    if (item->iflag & ITEM_VBUCKET) {
+        return (char*)(item + 1) + sizeof(struct item_vbucket_link);
+    }
+    return (char*)(item + 1);
+}
+
 uint64_t item_get_cas(const hash_item* item)
 {
     if (item->iflag & ITEM_WITH_CAS) {
-        return *(uint64_t*)(item + 1);
+        /* The CAS of compact items isn't 8 byte aligned */
+        uint64_t cas;
+        memcpy(&cas, item_get_header_end(item), sizeof(cas));
+        return cas;
     }
     return 0;
 }
 
+void engine_thread_started(struct default_engine *engine)
+{
+   ALLOCATOR_HOOKS_API *hooks = engine->server.alloc_hooks;
+   if (hooks != NULL && hooks->use_thread_arena != NULL) {
+      hooks->use_thread_arena();
+   }
+}
+
+bool engine_run_task(struct default_engine *engine, EXECUTOR_PRIORITY priority,
+                     EXECUTOR_TASK task, void *arg)
+{
+   SERVER_EXECUTOR_API *executor = engine->server.executor;
+   cb_thread_t t;
+
+   if (executor != NULL) {
+      return executor->submit(engine, priority, task, arg) != 0;
+   }
+   return cb_create_thread(&t, task, arg, 1) == 0;
+}
+
+bool engine_task_cancelled(struct default_engine *engine)
+{
+   SERVER_EXECUTOR_API *executor = engine->server.executor;
+   return executor != NULL && executor->is_cancelled(engine);
+}
+
 void item_set_cas(ENGINE_HANDLE *handle, const void *cookie,
                   item* item, uint64_t val)
 {
     hash_item* it = get_real_item(item);
     if (it->iflag & ITEM_WITH_CAS) {
-        *(uint64_t*)(it + 1) = val;
+        memcpy(item_get_header_end(it), &val, sizeof(val));
     }
 }
 
 const void* item_get_key(const hash_item* item)
 {
-    char *ret = (void*)(item + 1);
+    char *ret = item_get_header_end(item);
     if (item->iflag & ITEM_WITH_CAS) {
         ret += sizeof(uint64_t);
     }
@@ -723,8 +2176,11 @@ uint8_t item_get_clsid(const hash_item* item)
 static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
                           const item* item, item_info *item_info)
 {
+    struct default_engine *engine = get_handle(handle);
     hash_item* it = (hash_item*)item;
-    if (item_info->nvalue < 1) {
+    int nvalue = item_get_segments(engine, it, item_info->value,
+                                   item_info->nvalue);
+    if (nvalue < 0) {
         return false;
     }
     item_info->cas = item_get_cas(it);
@@ -735,14 +2191,44 @@ static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
     item_info->flags = it->flags;
     item_info->clsid = it->slabs_clsid;
     item_info->nkey = it->nkey;
-    item_info->nvalue = 1;
+    item_info->nvalue = (uint16_t)nvalue;
     item_info->key = item_get_key(it);
-    item_info->value[0].iov_base = item_get_data(it);
-    item_info->value[0].iov_len = it->nbytes;
     item_info->datatype = it->datatype;
     return true;
 }
 
+static bool get_item_view(ENGINE_HANDLE *handle, const void *cookie,
+                          const item* item, item_view *item_view)
+{
+    struct default_engine *engine = get_handle(handle);
+    hash_item* it = (hash_item*)item;
+    int nsegments = item_get_segment(engine, it, 0, &item_view->value);
+    if (nsegments < 0) {
+        return false;
+    }
+    item_view->cas = item_get_cas(it);
+    item_view->vbucket_uuid = 0;
+    item_view->seqno = 0;
+    item_view->exptime = it->exptime;
+    item_view->nbytes = it->nbytes;
+    item_view->flags = it->flags;
+    item_view->clsid = it->slabs_clsid;
+    item_view->nkey = it->nkey;
+    item_view->nsegments = (uint16_t)nsegments;
+    item_view->key = item_get_key(it);
+    item_view->datatype = it->datatype;
+    return true;
+}
+
+static bool get_item_segment(ENGINE_HANDLE *handle, const void *cookie,
+                             const item* item, uint16_t index,
+                             struct iovec *segment)
+{
+    struct default_engine *engine = get_handle(handle);
+    return item_get_segment(engine, (const hash_item*)item, index,
+                            segment) >= 0;
+}
+
 static bool set_item_info(ENGINE_HANDLE *handle, const void *cookie,
                           item* item, const item_info *itm_info)
 {
@@ -11,6 +11,7 @@
 #include "config.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include <memcached/engine.h>
 #include <memcached/util.h>
@@ -21,6 +22,10 @@
 #define POWER_SMALLEST 1
 #define POWER_LARGEST  200
 #define CHUNK_ALIGN_BYTES 8
+
+/* The largest key and value of a tiny item (see config.tiny_items) */
+#define TINY_ITEM_KEY 16
+#define TINY_ITEM_VALUE 8
 #define DONT_PREALLOC_SLABS
 #define MAX_NUMBER_OF_SLAB_CLASSES (POWER_LARGEST + 1)
 
@@ -31,11 +36,26 @@
 
 /* Forward decl */
 struct default_engine;
+struct restart_fixup;
+struct restart_counts;
 
 #include "trace.h"
+#include "seqlog.h"
 #include "items.h"
+#include "dcp_producer.h"
 #include "assoc.h"
 #include "slabs.h"
+#include "expiry.h"
+#include "ext.h"
+#include "restart.h"
+#include "snapshot.h"
+#include "sketch.h"
+#include "namespaces.h"
+#include "miss_filter.h"
+#include "mrc.h"
+#include "slab_pool.h"
+#include "vbuckets.h"
+#include "partitions.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -44,15 +64,41 @@ extern "C" {
    /* Flags */
 #define ITEM_WITH_CAS 1
 
+/*
+ * An expiry given in milliseconds (see item_realtime) ends this many
+ * 128ths of a second into the second before exptime, 0 is at exptime
+ */
+#define ITEM_EXPTIME_FRAC (0x7f<<1)
+#define ITEM_EXPTIME_FRAC_SHIFT 1
+
 #define ITEM_LINKED (1<<8)
 
 /* temp */
 #define ITEM_SLABBED (2<<8)
 
+/* The item was accessed since it was last moved in the LRU */
+#define ITEM_ACTIVE (4<<8)
+
+/* The item uses the compact header (see config.compact_items) */
+#define ITEM_COMPACT (8<<8)
+
+/* The value is in a chain of chunks (see config.large_item_size_max) */
+#define ITEM_CHAINED (16<<8)
+
+/* The value is in the extended storage (see config.ext_path) */
+#define ITEM_EXTERNAL (32<<8)
+
+/* The header is followed by a vbucket link (see config.vbucket_index) */
+#define ITEM_VBUCKET (64<<8)
+
+/* The item was read since it was stored */
+#define ITEM_FETCHED (128<<8)
+
 struct config {
    bool use_cas;
    size_t verbose;
    rel_time_t oldest_live;
+   uint64_t flush_cas;        /* the items up to it are flushed */
    bool evict_to_free;
    size_t maxbytes;
    bool preallocate;
@@ -62,6 +108,47 @@ struct config {
    bool ignore_vbucket;
    bool vb0;
    char *uuid;
+   size_t lock_stripes;
+   bool bucketed_index;
+   bool lru_maintainer;
+   bool slab_reassign;
+   bool slab_automove;
+   bool slab_compact;
+   char *slab_sizes;          /* the chunk sizes, instead of factor's */
+   bool slab_learn;           /* relearn them at a warm restart */
+   char *hugepages;
+   char *numa_policy;
+   size_t prefault_threads;   /* 0 leaves the arena to fault in as used */
+   size_t slab_magazine_size;
+   bool compact_items;
+   size_t lease_timeout;
+   size_t stale_grace;
+   size_t seqlog_size;
+   size_t expiry_index_size;
+   size_t large_item_size_max;
+   char *ext_path;
+   size_t ext_size;
+   size_t ext_segment_size;
+   size_t ext_item_min;
+   size_t ext_item_age;
+   size_t ext_io_threads;
+   char *restart_file;
+   size_t dcp_helper_threads;
+   char *eviction_policy;
+   size_t evict_reserve;
+   size_t expected_items;     /* the hash table is sized for them up front */
+   bool presize_hashtable;    /* ...or for what fits in maxbytes */
+   size_t hash_expand_threads;
+   char *namespace_separator; /* the namespace index is off if NULL */
+   size_t namespace_depth;
+   size_t miss_filter_items;  /* the keys the miss filter is sized for */
+   size_t mrc_keys;           /* the keys sampled for the miss ratio curve */
+   size_t shared_pool_size;   /* the pages come from the shared pool */
+   size_t hard_quota;         /* the most the bucket takes from it */
+   bool tiny_items;           /* slab class 1 fits exactly a tiny item */
+   bool vbucket_index;        /* the items are listed by their vbucket */
+   size_t item_sample;        /* 1 in item_sample keys is in the histograms */
+   size_t partitions;         /* the keys are split over them (see partitions.h) */
 };
 
 MEMCACHED_PUBLIC_API
@@ -82,6 +169,9 @@ struct engine_stats {
    uint64_t curr_bytes;
    uint64_t curr_items;
    uint64_t total_items;
+   uint64_t leases_granted;
+   uint64_t lease_waits;
+   uint64_t stale_hits;
 };
 
 struct engine_scrubber {
@@ -94,7 +184,8 @@ struct engine_scrubber {
 };
 
 struct vbucket_info {
-    int state : 2;
+    /* Unsigned and wide enough for vbucket_state_dead (4) */
+    unsigned int state : 3;
 };
 
 #define NUM_VBUCKETS 65536
@@ -117,12 +208,29 @@ struct default_engine {
    struct assoc assoc;
    struct slabs slabs;
    struct items items;
+   struct seqlog seqlog;
+   struct expiry expiry;
+   struct ext ext;
+   struct restart restart;
+   struct sketch sketch;
+   struct key_namespaces namespaces;
+   struct miss_filter miss_filter;
+   struct mrc mrc;
+   struct slab_pool_member pool;
+   struct vbucket_index vbuckets;
+   struct partitions partitions;
+   struct dcp_producers dcp;
 
-   /**
-    * The cache layer (item_* and assoc_*) is currently protected by
-    * this single mutex
+   /*
+    * The cache layer is protected by a set of finer grained locks. They
+    * must be acquired in the following order:
+    *   item lock (items.item_locks) -> LRU lock (items.lru_locks) ->
+    *   slab class lock -> slabs.lock
+    * assoc.lock, seqlog.lock, dcp.lock, stats.lock, ext.lock, the expiry
+    * wheel locks, the namespace shard locks and the vbucket index locks
+    * are leaf locks (the CAS values are handed out without a lock, see
+    * get_cas_id).
     */
-   cb_mutex_t cache_lock;
 
    struct config config;
    struct engine_stats stats;
@@ -143,4 +251,114 @@ void item_set_cas(ENGINE_HANDLE *handle, const void *cookie,
                   item* item, uint64_t val);
 uint64_t item_get_cas(const hash_item* item);
 uint8_t item_get_clsid(const hash_item* item);
+
+/*
+ * Called first by the background threads of the engine living as long as
+ * it does: gives the thread an allocator arena of its own if the server
+ * does that (arena_per_thread). The arenas are never freed, so the
+ * threads started for one job (the scrubber, the restart workers...)
+ * stay in the shared ones.
+ */
+void engine_thread_started(struct default_engine *engine);
+
+/*
+ * Run a job of the engine (one which ends by itself, like the scrubber)
+ * on the executor of the server, or on a detached thread of its own if
+ * the server has none. The jobs on the executor should return soon once
+ * engine_task_cancelled() is true: the engine cancels them as it is
+ * destroyed, and waits for the ones running.
+ */
+bool engine_run_task(struct default_engine *engine, EXECUTOR_PRIORITY priority,
+                     EXECUTOR_TASK task, void *arg);
+bool engine_task_cancelled(struct default_engine *engine);
+
+/*
+ * Compact items link to each other through 32 bit handles: 0 is NULL,
+ * handles from ITEM_CURSOR_HANDLE and up index items.cursors, and the
+ * others are the offset of the item in the slab arena (in units of
+ * CHUNK_ALIGN_BYTES) plus one.
+ */
+#define ITEM_CURSOR_HANDLE (UINT32_MAX - ITEM_MAX_CURSORS)
+
+/* The max size of the slab arena for compact items */
+#define ITEM_COMPACT_MAX_ARENA ((uint64_t)(ITEM_CURSOR_HANDLE - 1) * CHUNK_ALIGN_BYTES)
+
+static inline hash_item *item_handle_decode(const struct default_engine *engine,
+                                            uint32_t handle) {
+    if (handle == 0) {
+        return NULL;
+    }
+    if (handle >= ITEM_CURSOR_HANDLE) {
+        return engine->items.cursors[handle - ITEM_CURSOR_HANDLE];
+    }
+    return (hash_item*)((char*)engine->slabs.mem_base +
+                        (size_t)(handle - 1) * CHUNK_ALIGN_BYTES);
+}
+
+static inline uint32_t item_handle_encode(const struct default_engine *engine,
+                                          const hash_item *it) {
+    if (it == NULL) {
+        return 0;
+    }
+    if (it->nkey == 0 && it->nbytes == 0) {
+        /* cursors keep their index in flags */
+        return ITEM_CURSOR_HANDLE + it->flags;
+    }
+    return (uint32_t)(((const char*)it - (const char*)engine->slabs.mem_base) /
+                      CHUNK_ALIGN_BYTES) + 1;
+}
+
+static inline hash_item *item_next(const struct default_engine *engine,
+                                   const hash_item *it) {
+    return engine->config.compact_items ?
+        item_handle_decode(engine, it->link.handle.next) : it->link.ptr.next;
+}
+
+static inline hash_item *item_prev(const struct default_engine *engine,
+                                   const hash_item *it) {
+    return engine->config.compact_items ?
+        item_handle_decode(engine, it->link.handle.prev) : it->link.ptr.prev;
+}
+
+static inline hash_item *item_h_next(const struct default_engine *engine,
+                                     const hash_item *it) {
+    return engine->config.compact_items ?
+        item_handle_decode(engine, it->link.handle.h_next) : it->link.ptr.h_next;
+}
+
+static inline void item_set_next(const struct default_engine *engine,
+                                 hash_item *it, hash_item *next) {
+    if (engine->config.compact_items) {
+        it->link.handle.next = item_handle_encode(engine, next);
+    } else {
+        it->link.ptr.next = next;
+    }
+}
+
+static inline void item_set_prev(const struct default_engine *engine,
+                                 hash_item *it, hash_item *prev) {
+    if (engine->config.compact_items) {
+        it->link.handle.prev = item_handle_encode(engine, prev);
+    } else {
+        it->link.ptr.prev = prev;
+    }
+}
+
+static inline void item_set_h_next(const struct default_engine *engine,
+                                   hash_item *it, hash_item *h_next) {
+    if (engine->config.compact_items) {
+        it->link.handle.h_next = item_handle_encode(engine, h_next);
+    } else {
+        it->link.ptr.h_next = h_next;
+    }
+}
+
+/* The size of the item header (without the CAS), with its vbucket link */
+static inline size_t item_header_size(const struct default_engine *engine) {
+    if (engine->config.vbucket_index) {
+        return sizeof(hash_item) + sizeof(struct item_vbucket_link);
+    }
+    return engine->config.compact_items ?
+        ITEM_COMPACT_HEADER_SIZE : sizeof(hash_item);
+}
 #endif
@@ -0,0 +1,331 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The expiry index (config.expiry_index_size): the items with a TTL are
+ * added to a timing wheel when they are linked, and a background thread
+ * turns the wheels once a second, reclaiming the items in the slot which
+ * expires. Memory held by expired items is freed without waiting for a
+ * lookup, the scrubber or the LRU tail to get to them.
+ *
+ * A wheel's "now" is the next second to be looked at: the slots of the
+ * earlier seconds are empty. An item expiring in less than EXPIRY_SLOTS
+ * seconds goes in the level 0 slot of its second; one expiring later in
+ * the slot of the first level whose slots span its time to live. When
+ * the wheel comes to the start of the span of a slot of a higher level,
+ * the slot is emptied and its entries are added again, which puts them
+ * closer to the bottom.
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+/* How often the expired items are reclaimed (ms) */
+#define EXPIRY_INTERVAL 1000
+
+/* The longest TTL the levels of the wheel span */
+#define EXPIRY_SPAN (((rel_time_t)1 << (EXPIRY_SLOT_BITS * EXPIRY_LEVELS)) - 1)
+
+ENGINE_ERROR_CODE expiry_init(struct default_engine *engine) {
+    struct expiry *expiry = &engine->expiry;
+    rel_time_t now = engine->server.core->get_current_time();
+    int ii;
+
+    if (engine->config.expiry_index_size == 0) {
+        return ENGINE_SUCCESS;
+    }
+
+    expiry->wheels = calloc(EXPIRY_SHARDS, sizeof(struct expiry_wheel));
+    if (expiry->wheels == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    for (ii = 0; ii < EXPIRY_SHARDS; ++ii) {
+        cb_mutex_initialize(&expiry->wheels[ii].lock);
+        expiry->wheels[ii].now = now;
+    }
+    expiry->max_entries = engine->config.expiry_index_size / EXPIRY_SHARDS;
+    if (expiry->max_entries == 0) {
+        expiry->max_entries = 1;
+    }
+    return ENGINE_SUCCESS;
+}
+
+void expiry_destroy(struct default_engine *engine) {
+    struct expiry *expiry = &engine->expiry;
+    int ii, level, slot;
+
+    if (expiry->wheels == NULL) {
+        return;
+    }
+    for (ii = 0; ii < EXPIRY_SHARDS; ++ii) {
+        struct expiry_wheel *wheel = &expiry->wheels[ii];
+        for (level = 0; level < EXPIRY_LEVELS; ++level) {
+            for (slot = 0; slot < EXPIRY_SLOTS; ++slot) {
+                free(wheel->slots[level][slot].entries);
+            }
+        }
+        cb_mutex_destroy(&wheel->lock);
+    }
+    free(expiry->wheels);
+    expiry->wheels = NULL;
+}
+
+static bool expiry_slot_append(struct expiry_slot *slot,
+                               const struct expiry_entry *entry) {
+    if (slot->count == slot->size) {
+        uint32_t size = slot->size ? slot->size * 2 : 16;
+        struct expiry_entry *entries;
+        entries = realloc(slot->entries, size * sizeof(*entries));
+        if (entries == NULL) {
+            return false;
+        }
+        slot->entries = entries;
+        slot->size = size;
+    }
+    slot->entries[slot->count++] = *entry;
+    return true;
+}
+
+/* The slot the entry goes in, with the wheel at wheel->now */
+static struct expiry_slot *expiry_slot_for(struct expiry_wheel *wheel,
+                                           rel_time_t exptime) {
+    rel_time_t delta;
+    int level;
+
+    if (exptime < wheel->now) {
+        /* Already expired, it goes with the next second looked at */
+        exptime = wheel->now;
+    }
+    delta = exptime - wheel->now;
+    if (delta > EXPIRY_SPAN) {
+        /* Beyond the top level, it comes back here when the slot does */
+        delta = EXPIRY_SPAN;
+        exptime = wheel->now + delta;
+    }
+
+    for (level = 0; level < EXPIRY_LEVELS - 1; ++level) {
+        if (delta < ((rel_time_t)1 << (EXPIRY_SLOT_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    return &wheel->slots[level][(exptime >> (EXPIRY_SLOT_BITS * level)) &
+                                (EXPIRY_SLOTS - 1)];
+}
+
+void expiry_add(struct default_engine *engine, hash_item *it, uint32_t hv) {
+    struct expiry *expiry = &engine->expiry;
+    struct expiry_wheel *wheel;
+    struct expiry_entry entry;
+
+    if (expiry->wheels == NULL || it->exptime == 0) {
+        return;
+    }
+
+    entry.it = it;
+    entry.hv = hv;
+    entry.exptime = it->exptime;
+    wheel = &expiry->wheels[hv % EXPIRY_SHARDS];
+
+    cb_mutex_enter(&wheel->lock);
+    if (wheel->entries < expiry->max_entries &&
+        expiry_slot_append(expiry_slot_for(wheel, entry.exptime), &entry)) {
+        ++wheel->entries;
+    } else {
+        ++wheel->dropped;
+    }
+    cb_mutex_exit(&wheel->lock);
+}
+
+/* Empty the slot of a higher level into the lower ones */
+static void expiry_cascade(struct expiry_wheel *wheel, int level) {
+    rel_time_t now = wheel->now;
+    struct expiry_slot *slot;
+    struct expiry_slot moved;
+    uint32_t ii;
+
+    slot = &wheel->slots[level][(now >> (EXPIRY_SLOT_BITS * level)) &
+                                (EXPIRY_SLOTS - 1)];
+    moved = *slot;
+    memset(slot, 0, sizeof(*slot));
+
+    for (ii = 0; ii < moved.count; ++ii) {
+        if (!expiry_slot_append(expiry_slot_for(wheel, moved.entries[ii].exptime),
+                                &moved.entries[ii])) {
+            /* The item is still reclaimed by the lazy checks */
+            --wheel->entries;
+            ++wheel->dropped;
+        }
+    }
+    free(moved.entries);
+}
+
+/*
+ * Turn the wheel up to (and including) the second current_time, moving
+ * the entries of the seconds passed to due.
+ */
+static void expiry_turn(struct expiry_wheel *wheel, rel_time_t current_time,
+                        struct expiry_slot *due) {
+    while (wheel->now <= current_time) {
+        rel_time_t now = wheel->now;
+        struct expiry_slot *slot;
+        int level;
+
+        /* The higher levels first, they may fill the slots below */
+        for (level = EXPIRY_LEVELS - 1; level > 0; --level) {
+            rel_time_t span = (rel_time_t)1 << (EXPIRY_SLOT_BITS * level);
+            if ((now & (span - 1)) == 0) {
+                expiry_cascade(wheel, level);
+            }
+        }
+
+        slot = &wheel->slots[0][now & (EXPIRY_SLOTS - 1)];
+        wheel->entries -= slot->count;
+        if (due->count == 0) {
+            /* Swap the arrays rather than copy the entries */
+            struct expiry_slot spare = *due;
+            *due = *slot;
+            *slot = spare;
+        } else {
+            uint32_t ii;
+            for (ii = 0; ii < slot->count; ++ii) {
+                if (!expiry_slot_append(due, &slot->entries[ii])) {
+                    ++wheel->dropped;
+                }
+            }
+            slot->count = 0;
+        }
+        ++wheel->now;
+    }
+}
+
+static void expiry_reclaim(struct default_engine *engine,
+                           struct expiry_slot *due) {
+    uint64_t reclaimed = 0, stale = 0, busy = 0;
+    uint32_t ii;
+
+    for (ii = 0; ii < due->count; ++ii) {
+        switch (item_reclaim_expired(engine, due->entries[ii].it,
+                                     due->entries[ii].hv)) {
+        case ITEM_EXPIRED_RECLAIMED:
+            ++reclaimed;
+            break;
+        case ITEM_EXPIRED_BUSY:
+            ++busy;
+            break;
+        case ITEM_EXPIRED_STALE:
+            ++stale;
+            break;
+        }
+    }
+    due->count = 0;
+
+    cb_mutex_enter(&engine->expiry.lock);
+    engine->expiry.reclaimed += reclaimed;
+    engine->expiry.stale += stale;
+    engine->expiry.busy += busy;
+    cb_mutex_exit(&engine->expiry.lock);
+}
+
+static void expiry_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct expiry *expiry = &engine->expiry;
+    struct expiry_slot due;
+
+    engine_thread_started(engine);
+    memset(&due, 0, sizeof(due));
+    cb_mutex_enter(&expiry->lock);
+    while (expiry->running) {
+        rel_time_t current_time;
+        int ii;
+        cb_mutex_exit(&expiry->lock);
+
+        current_time = engine->server.core->get_current_time();
+        for (ii = 0; ii < EXPIRY_SHARDS; ++ii) {
+            struct expiry_wheel *wheel = &expiry->wheels[ii];
+            cb_mutex_enter(&wheel->lock);
+            expiry_turn(wheel, current_time, &due);
+            cb_mutex_exit(&wheel->lock);
+
+            /* The item locks come before the wheel lock */
+            expiry_reclaim(engine, &due);
+        }
+
+        cb_mutex_enter(&expiry->lock);
+        if (expiry->running) {
+            cb_cond_timedwait(&expiry->cond, &expiry->lock, EXPIRY_INTERVAL);
+        }
+    }
+    cb_mutex_exit(&expiry->lock);
+    free(due.entries);
+}
+
+bool expiry_start(struct default_engine *engine) {
+    struct expiry *expiry = &engine->expiry;
+    bool ret = true;
+
+    if (expiry->wheels == NULL) {
+        return true;
+    }
+
+    cb_mutex_enter(&expiry->lock);
+    if (!expiry->running) {
+        expiry->running = true;
+        if (cb_create_thread(&expiry->tid, expiry_main, engine, 0) != 0) {
+            expiry->running = false;
+            ret = false;
+        }
+    }
+    cb_mutex_exit(&expiry->lock);
+    return ret;
+}
+
+void expiry_stop(struct default_engine *engine) {
+    struct expiry *expiry = &engine->expiry;
+    bool running;
+
+    cb_mutex_enter(&expiry->lock);
+    running = expiry->running;
+    expiry->running = false;
+    cb_cond_signal(&expiry->cond);
+    cb_mutex_exit(&expiry->lock);
+
+    if (running) {
+        cb_join_thread(expiry->tid);
+    }
+}
+
+void expiry_stats(struct default_engine *engine,
+                  ADD_STAT add_stat, const void *cookie) {
+    struct expiry *expiry = &engine->expiry;
+    uint64_t entries = 0, dropped = 0;
+    char val[32];
+    int len;
+    int ii;
+
+    if (expiry->wheels == NULL) {
+        return;
+    }
+
+    for (ii = 0; ii < EXPIRY_SHARDS; ++ii) {
+        cb_mutex_enter(&expiry->wheels[ii].lock);
+        entries += expiry->wheels[ii].entries;
+        dropped += expiry->wheels[ii].dropped;
+        cb_mutex_exit(&expiry->wheels[ii].lock);
+    }
+
+    len = sprintf(val, "%"PRIu64, entries);
+    add_stat("expiry_index_entries", 20, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, dropped);
+    add_stat("expiry_index_dropped", 20, val, len, cookie);
+
+    cb_mutex_enter(&expiry->lock);
+    len = sprintf(val, "%"PRIu64, expiry->reclaimed);
+    add_stat("expiry_index_reclaimed", 22, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, expiry->stale);
+    add_stat("expiry_index_stale", 18, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, expiry->busy);
+    add_stat("expiry_index_busy", 17, val, len, cookie);
+    cb_mutex_exit(&expiry->lock);
+}
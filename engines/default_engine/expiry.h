@@ -0,0 +1,81 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* An index of the items with a TTL by the time they expire */
+#ifndef EXPIRY_H
+#define EXPIRY_H
+
+/*
+ * The index is a hierarchical timing wheel per shard: EXPIRY_SLOTS one
+ * second slots, EXPIRY_SLOTS slots of EXPIRY_SLOTS seconds, and so on.
+ * An item lands in the slot of the level its time to live fits in, and
+ * the slots of the higher levels are spread over the lower ones as the
+ * wheel turns, so every second only the one slot which expires is
+ * looked at.
+ */
+#define EXPIRY_LEVELS 3
+#define EXPIRY_SLOT_BITS 8
+#define EXPIRY_SLOTS (1 << EXPIRY_SLOT_BITS)
+#define EXPIRY_SHARDS 16
+
+/*
+ * An item in the index. The entry isn't removed when the item goes or
+ * its time to live changes, so the item is only trusted once it is
+ * found in the hash table under the item lock for hv.
+ */
+struct expiry_entry {
+    hash_item *it;
+    uint32_t hv;
+    rel_time_t exptime;
+};
+
+struct expiry_slot {
+    struct expiry_entry *entries;
+    uint32_t count;
+    uint32_t size;
+};
+
+struct expiry_wheel {
+    /* Protects the wheel; a leaf lock taken with the item lock held */
+    cb_mutex_t lock;
+    /* The next second to look at, the slots before it are empty */
+    rel_time_t now;
+    size_t entries;
+    uint64_t dropped;    /* items not indexed because the wheel was full */
+    struct expiry_slot slots[EXPIRY_LEVELS][EXPIRY_SLOTS];
+};
+
+struct expiry {
+    /* EXPIRY_SHARDS wheels (NULL if disabled), picked by the hash value */
+    struct expiry_wheel *wheels;
+    /* The most entries in a wheel (config.expiry_index_size / shards) */
+    size_t max_entries;
+
+    /* The background thread reclaiming the expired items */
+    cb_mutex_t lock;
+    cb_cond_t cond;
+    bool running;
+    cb_thread_t tid;
+
+    /* Protected by lock */
+    uint64_t reclaimed;  /* expired items unlinked */
+    uint64_t stale;      /* entries of items gone or given a new TTL */
+    uint64_t busy;       /* expired items in use when their slot came up */
+};
+
+ENGINE_ERROR_CODE expiry_init(struct default_engine *engine);
+void expiry_destroy(struct default_engine *engine);
+
+/* Start and stop the background thread turning the wheels */
+bool expiry_start(struct default_engine *engine);
+void expiry_stop(struct default_engine *engine);
+
+/*
+ * Add the item with the hash value hv to the index (if it has a TTL).
+ * Called when the item is linked or its exptime is changed, with the
+ * item lock held.
+ */
+void expiry_add(struct default_engine *engine, hash_item *it, uint32_t hv);
+
+void expiry_stats(struct default_engine *engine,
+                  ADD_STAT add_stat, const void *cookie);
+
+#endif
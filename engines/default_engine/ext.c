@@ -0,0 +1,400 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The extended storage (config.ext_path): a file on flash the values of
+ * the cold items are moved to, leaving only their key and header in RAM.
+ *
+ * A writer thread looks at the tails of the LRUs every EXT_INTERVAL ms
+ * and moves the items idle for config.ext_item_age seconds (or all it
+ * finds once memory is getting short) to the file in large appends, see
+ * item_ext_flush. A lookup finding such an item hands it to one of the
+ * I/O threads, which reads the value back into a new item, swaps it in
+ * and notifies the connection to retry, see item_ext_load.
+ *
+ * The file is written as a ring of segments, the oldest segment being
+ * overwritten once the file is full. The items with their value in it
+ * are lost when they are next looked up (their header stays until then,
+ * or until it is evicted).
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+/* How often the writer looks at the LRU tails (ms) */
+#define EXT_INTERVAL 100
+
+static void ext_log(struct default_engine *engine, const char *msg) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+    logger->log(EXTENSION_LOG_WARNING, NULL, "%s: %s\n",
+                engine->config.ext_path, msg);
+}
+
+ENGINE_ERROR_CODE ext_init(struct default_engine *engine) {
+    struct ext *ext = &engine->ext;
+    struct config *config = &engine->config;
+
+    ext->fd = -1;
+    if (config->ext_path == NULL) {
+        return ENGINE_SUCCESS;
+    }
+
+#ifdef WIN32
+    ext_log(engine, "The extended storage is not supported on this platform");
+    return ENGINE_SUCCESS;
+#else
+    /* A segment takes a full batch, which is up to an item in size */
+    if (config->ext_segment_size < config->item_size_max) {
+        config->ext_segment_size = config->item_size_max;
+    }
+    if (config->ext_size < config->ext_segment_size) {
+        config->ext_size = config->ext_segment_size;
+    }
+    /* The location takes the place of the value of the item in RAM */
+    if (config->ext_item_min < sizeof(struct ext_loc)) {
+        config->ext_item_min = sizeof(struct ext_loc);
+    }
+    if (config->ext_io_threads == 0) {
+        config->ext_io_threads = 1;
+    }
+
+    ext->nsegments = (uint32_t)(config->ext_size / config->ext_segment_size);
+    ext->segments = calloc(ext->nsegments, sizeof(struct ext_segment));
+    ext->io_tids = calloc(config->ext_io_threads, sizeof(cb_thread_t));
+    if (ext->segments == NULL || ext->io_tids == NULL) {
+        free(ext->segments);
+        free(ext->io_tids);
+        ext->segments = NULL;
+        ext->io_tids = NULL;
+        return ENGINE_ENOMEM;
+    }
+
+    ext->fd = open(config->ext_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (ext->fd == -1) {
+        ext_log(engine, strerror(errno));
+        return ENGINE_FAILED;
+    }
+    if (ftruncate(ext->fd, (off_t)ext->nsegments *
+                  (off_t)config->ext_segment_size) != 0) {
+        ext_log(engine, strerror(errno));
+        close(ext->fd);
+        ext->fd = -1;
+        return ENGINE_FAILED;
+    }
+
+    /* The first write opens segment 0 */
+    ext->write_segment = ext->nsegments - 1;
+    ext->write_offset = config->ext_segment_size;
+    return ENGINE_SUCCESS;
+#endif
+}
+
+void ext_destroy(struct default_engine *engine) {
+    struct ext *ext = &engine->ext;
+
+#ifndef WIN32
+    if (ext->fd != -1) {
+        close(ext->fd);
+        unlink(engine->config.ext_path);
+    }
+#endif
+    ext->fd = -1;
+    free(ext->segments);
+    free(ext->io_tids);
+    ext->segments = NULL;
+    ext->io_tids = NULL;
+}
+
+#ifndef WIN32
+bool ext_write(struct default_engine *engine, const void *buf, size_t len,
+               struct ext_loc *loc) {
+    struct ext *ext = &engine->ext;
+    uint64_t segment_size = engine->config.ext_segment_size;
+    const char *ptr = buf;
+    off_t offset;
+
+    cb_mutex_enter(&ext->lock);
+    if (ext->write_offset + len > segment_size) {
+        struct ext_segment *segment;
+        ext->write_segment = (ext->write_segment + 1) % ext->nsegments;
+        segment = &ext->segments[ext->write_segment];
+        if (segment->generation != 0) {
+            ++ext->segments_reused;
+        }
+        /* The values left in it are lost from here on */
+        ++segment->generation;
+        while (segment->readers != 0) {
+            cb_cond_wait(&ext->io_cond, &ext->lock);
+        }
+        ext->write_offset = 0;
+    }
+    loc->segment = ext->write_segment;
+    loc->generation = ext->segments[ext->write_segment].generation;
+    loc->offset = (uint64_t)ext->write_segment * segment_size +
+                  ext->write_offset;
+    ext->write_offset += len;
+    cb_mutex_exit(&ext->lock);
+
+    /* Only the writer writes, and only in the segment it just claimed */
+    offset = (off_t)loc->offset;
+    while (len > 0) {
+        ssize_t nw = pwrite(ext->fd, ptr, len, offset);
+        if (nw == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ext_log(engine, strerror(errno));
+            return false;
+        }
+        ptr += nw;
+        offset += nw;
+        len -= (size_t)nw;
+    }
+
+    cb_mutex_enter(&ext->lock);
+    ++ext->writes;
+    ext->bytes_written += (uint64_t)(ptr - (const char*)buf);
+    cb_mutex_exit(&ext->lock);
+    return true;
+}
+
+bool ext_read(struct default_engine *engine, const struct ext_loc *loc,
+              void *buf, size_t nbytes) {
+    struct ext *ext = &engine->ext;
+    struct ext_segment *segment;
+    char *ptr = buf;
+    off_t offset = (off_t)loc->offset;
+    size_t left = nbytes;
+    bool ret = true;
+
+    cb_mutex_enter(&ext->lock);
+    if (loc->segment >= ext->nsegments ||
+        ext->segments[loc->segment].generation != loc->generation) {
+        ++ext->lost;
+        cb_mutex_exit(&ext->lock);
+        return false;
+    }
+    segment = &ext->segments[loc->segment];
+    ++segment->readers;
+    cb_mutex_exit(&ext->lock);
+
+    while (left > 0) {
+        ssize_t nr = pread(ext->fd, ptr, left, offset);
+        if (nr == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nr <= 0) {
+            ext_log(engine, nr == 0 ? "short read" : strerror(errno));
+            ret = false;
+            break;
+        }
+        ptr += nr;
+        offset += nr;
+        left -= (size_t)nr;
+    }
+
+    cb_mutex_enter(&ext->lock);
+    if (--segment->readers == 0) {
+        cb_cond_broadcast(&ext->io_cond);
+    }
+    if (ret) {
+        ++ext->reads;
+        ext->read_bytes += nbytes;
+    } else {
+        ++ext->lost;
+    }
+    cb_mutex_exit(&ext->lock);
+    return ret;
+}
+#else
+bool ext_write(struct default_engine *engine, const void *buf, size_t len,
+               struct ext_loc *loc) {
+    (void)engine;
+    (void)buf;
+    (void)len;
+    (void)loc;
+    return false;
+}
+
+bool ext_read(struct default_engine *engine, const struct ext_loc *loc,
+              void *buf, size_t nbytes) {
+    (void)engine;
+    (void)loc;
+    (void)buf;
+    (void)nbytes;
+    return false;
+}
+#endif
+
+ENGINE_ERROR_CODE ext_schedule(struct default_engine *engine,
+                               const void *cookie, hash_item *it) {
+    struct ext *ext = &engine->ext;
+    struct ext_job *job = malloc(sizeof(*job));
+
+    if (job == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    job->cookie = cookie;
+    job->it = it;
+    job->next = NULL;
+
+    cb_mutex_enter(&ext->lock);
+    if (ext->tail == NULL) {
+        ext->head = job;
+    } else {
+        ext->tail->next = job;
+    }
+    ext->tail = job;
+    cb_cond_broadcast(&ext->io_cond);
+    cb_mutex_exit(&ext->lock);
+    return ENGINE_EWOULDBLOCK;
+}
+
+static void ext_io_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct ext *ext = &engine->ext;
+
+    engine_thread_started(engine);
+    cb_mutex_enter(&ext->lock);
+    while (ext->running) {
+        struct ext_job *job = ext->head;
+        ENGINE_ERROR_CODE ret;
+
+        if (job == NULL) {
+            cb_cond_wait(&ext->io_cond, &ext->lock);
+            continue;
+        }
+        ext->head = job->next;
+        if (ext->head == NULL) {
+            ext->tail = NULL;
+        }
+        cb_mutex_exit(&ext->lock);
+
+        ret = item_ext_load(engine, job->it);
+        item_release(engine, job->it);
+        if (job->cookie != NULL) {
+            engine->server.cookie->notify_io_complete(job->cookie, ret);
+        }
+        free(job);
+
+        cb_mutex_enter(&ext->lock);
+    }
+    cb_mutex_exit(&ext->lock);
+}
+
+static void ext_writer_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct ext *ext = &engine->ext;
+
+    engine_thread_started(engine);
+    cb_mutex_enter(&ext->lock);
+    while (ext->running) {
+        cb_mutex_exit(&ext->lock);
+        item_ext_flush(engine);
+        cb_mutex_enter(&ext->lock);
+        if (ext->running) {
+            cb_cond_timedwait(&ext->cond, &ext->lock, EXT_INTERVAL);
+        }
+    }
+    cb_mutex_exit(&ext->lock);
+}
+
+bool ext_start(struct default_engine *engine) {
+    struct ext *ext = &engine->ext;
+    bool ret = true;
+
+    if (ext->fd == -1) {
+        return true;
+    }
+
+    cb_mutex_enter(&ext->lock);
+    if (!ext->running) {
+        ext->running = true;
+        if (cb_create_thread(&ext->writer_tid, ext_writer_main,
+                             engine, 0) != 0) {
+            ret = false;
+        } else {
+            ext->writer_started = true;
+        }
+        while (ret && ext->nio_started < engine->config.ext_io_threads) {
+            if (cb_create_thread(&ext->io_tids[ext->nio_started], ext_io_main,
+                                 engine, 0) != 0) {
+                ret = false;
+            } else {
+                ++ext->nio_started;
+            }
+        }
+    }
+    cb_mutex_exit(&ext->lock);
+
+    if (!ret) {
+        ext_stop(engine);
+    }
+    return ret;
+}
+
+void ext_stop(struct default_engine *engine) {
+    struct ext *ext = &engine->ext;
+    struct ext_job *job;
+    uint32_t ii;
+
+    cb_mutex_enter(&ext->lock);
+    ext->running = false;
+    cb_cond_signal(&ext->cond);
+    cb_cond_broadcast(&ext->io_cond);
+    cb_mutex_exit(&ext->lock);
+
+    if (ext->writer_started) {
+        cb_join_thread(ext->writer_tid);
+        ext->writer_started = false;
+    }
+    for (ii = 0; ii < ext->nio_started; ++ii) {
+        cb_join_thread(ext->io_tids[ii]);
+    }
+    ext->nio_started = 0;
+
+    /* Nobody is left to wait for the lookups still queued */
+    while ((job = ext->head) != NULL) {
+        ext->head = job->next;
+        item_release(engine, job->it);
+        free(job);
+    }
+    ext->tail = NULL;
+}
+
+void ext_stats(struct default_engine *engine,
+               ADD_STAT add_stat, const void *cookie) {
+    struct ext *ext = &engine->ext;
+    char val[32];
+    int len;
+
+    if (ext->fd == -1) {
+        return;
+    }
+
+    cb_mutex_enter(&ext->lock);
+    len = sprintf(val, "%"PRIu64, ext->items_written);
+    add_stat("ext_items_written", 17, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, ext->bytes_written);
+    add_stat("ext_bytes_written", 17, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, ext->writes);
+    add_stat("ext_writes", 10, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, ext->reads);
+    add_stat("ext_reads", 9, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, ext->read_bytes);
+    add_stat("ext_read_bytes", 14, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, ext->lost);
+    add_stat("ext_lost", 8, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, ext->segments_reused);
+    add_stat("ext_segments_reused", 19, val, len, cookie);
+    cb_mutex_exit(&ext->lock);
+}
@@ -0,0 +1,103 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* The extended storage: cold values in a file on flash */
+#ifndef EXT_H
+#define EXT_H
+
+/*
+ * The file (config.ext_path) is split in segments of ext_segment_size
+ * bytes, written one after the other in large appends. Once the last one
+ * is full the first one is written again, which loses the values left in
+ * it: every segment has a generation, bumped when it is reused, and a
+ * value is only read if its segment still has the generation it was
+ * written with.
+ *
+ * An item with its value in the file (ITEM_EXTERNAL) keeps the key and
+ * the header in RAM as usual, with the location of the value as its data
+ * and nbytes the size of the value.
+ */
+struct ext_loc {
+    uint32_t segment;
+    uint32_t generation;
+    uint64_t offset;     /* in the file */
+};
+
+struct ext_segment {
+    uint32_t generation;
+    uint32_t readers;    /* reads in progress, the segment can't be reused */
+};
+
+/* A lookup waiting for the value of an item to be read */
+struct ext_job {
+    const void *cookie;
+    hash_item *it;       /* the caller's reference */
+    struct ext_job *next;
+};
+
+struct ext {
+    int fd;              /* -1 if disabled */
+    struct ext_segment *segments;
+    uint32_t nsegments;
+
+    /* Protects the segments, and everything below */
+    cb_mutex_t lock;
+    cb_cond_t cond;      /* wakes the writer (to stop) */
+    cb_cond_t io_cond;   /* wakes the I/O threads, and the writer waiting
+                            for the readers of a segment */
+    bool running;
+
+    /* The thread moving the values from the LRU tails to the file */
+    cb_thread_t writer_tid;
+    bool writer_started;
+    uint32_t write_segment;
+    uint64_t write_offset;   /* in the segment */
+
+    /* The threads reading the values back, and their queue */
+    cb_thread_t *io_tids;
+    uint32_t nio_started;
+    struct ext_job *head;
+    struct ext_job *tail;
+
+    uint64_t items_written;
+    uint64_t bytes_written;
+    uint64_t writes;
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t lost;           /* values found overwritten */
+    uint64_t segments_reused;
+};
+
+ENGINE_ERROR_CODE ext_init(struct default_engine *engine);
+void ext_destroy(struct default_engine *engine);
+
+/* Start and stop the writer and the I/O threads */
+bool ext_start(struct default_engine *engine);
+void ext_stop(struct default_engine *engine);
+
+/*
+ * Write the batch of values in buf (len bytes) to the file, and give the
+ * location of its start in loc (the values are at loc->offset plus their
+ * offset in buf). Only called by the writer thread.
+ */
+bool ext_write(struct default_engine *engine, const void *buf, size_t len,
+               struct ext_loc *loc);
+
+/*
+ * Read nbytes of the value at loc into buf. Returns false if the value
+ * was overwritten (or the read failed).
+ */
+bool ext_read(struct default_engine *engine, const struct ext_loc *loc,
+              void *buf, size_t nbytes);
+
+/*
+ * Have an I/O thread bring the value of the item (ITEM_EXTERNAL) back in
+ * RAM and notify the cookie. Returns ENGINE_EWOULDBLOCK, having taken
+ * over the caller's reference, or ENGINE_ENOMEM. May be called with the
+ * item lock held.
+ */
+ENGINE_ERROR_CODE ext_schedule(struct default_engine *engine,
+                               const void *cookie, hash_item *it);
+
+void ext_stats(struct default_engine *engine,
+               ADD_STAT add_stat, const void *cookie);
+
+#endif
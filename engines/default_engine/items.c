@@ -20,14 +20,26 @@ static hash_item *do_item_alloc(struct default_engine *engine,
                                 const void *cookie,
                                 uint8_t datatype);
 static hash_item *do_item_get(struct default_engine *engine,
-                              const char *key, const size_t nkey);
-static int do_item_link(struct default_engine *engine, hash_item *it);
+                              const char *key, const size_t nkey,
+                              uint32_t hv);
+static hash_item *do_item_get_stale(struct default_engine *engine,
+                                    const char *key, const size_t nkey,
+                                    uint32_t hv, bool *stale);
+static int do_item_link(struct default_engine *engine, hash_item *it,
+                        uint64_t prev_cas);
 static void do_item_unlink(struct default_engine *engine, hash_item *it);
+static void do_item_unlink_lru_locked(struct default_engine *engine,
+                                      hash_item *it);
 static void do_item_release(struct default_engine *engine, hash_item *it);
 static void do_item_update(struct default_engine *engine, hash_item *it);
+static void do_item_lru_bump(struct default_engine *engine, hash_item *it,
+                             rel_time_t current_time);
 static int do_item_replace(struct default_engine *engine,
                             hash_item *it, hash_item *new_it);
 static void item_free(struct default_engine *engine, hash_item *it);
+static void do_item_swap(struct default_engine *engine, hash_item *it,
+                         hash_item *new_it, bool refresh);
+static void item_flush_reclaim(struct default_engine *engine);
 
 /*
  * We only reposition items in the LRU queue if they haven't been repositioned
@@ -35,34 +47,639 @@ static void item_free(struct default_engine *engine, hash_item *it);
  * items.
  */
 #define ITEM_UPDATE_INTERVAL 60
+/*
+ * How often (in ms) the LRU maintainer thread inspects the tail of each
+ * LRU.
+ */
+#define LRU_MAINTAINER_INTERVAL 100
 /*
  * To avoid scanning through the complete cache in some circumstances we'll
  * just give up and return an error after inspecting a fixed number of objects.
  */
 static const int search_items = 50;
 
+/*
+ * The leases are kept in chains hashed on the key, with at least this
+ * many chains, and at most this many leases in each chain (a miss gets
+ * no lease when its chain is full).
+ */
+#define LEASE_MIN_CHAINS 1024
+#define LEASE_MAX_PER_CHAIN 8
+
+struct item_lease {
+    struct item_lease *next;
+    uint64_t token;
+    rel_time_t expires;
+    uint16_t nkey;
+    char key[1];
+};
+
+/*
+ * The average size of an item the frequency sketch is sized for, more
+ * items than that are still counted but the estimates get less accurate
+ */
+#define ITEM_SKETCH_ITEM_SIZE 64
+
+static ENGINE_ERROR_CODE items_init_policy(struct default_engine *engine) {
+    const char *policy = engine->config.eviction_policy;
+
+    if (policy == NULL || strcmp(policy, "clock") == 0) {
+        engine->items.policy = ITEM_POLICY_CLOCK;
+    } else if (strcmp(policy, "lru") == 0) {
+        engine->items.policy = ITEM_POLICY_LRU;
+    } else if (strcmp(policy, "tinylfu") == 0) {
+        engine->items.policy = ITEM_POLICY_TINYLFU;
+        return sketch_init(&engine->sketch,
+                           engine->config.maxbytes / ITEM_SKETCH_ITEM_SIZE);
+    } else {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "eviction_policy must be clock, lru or tinylfu\n");
+        return ENGINE_EINVAL;
+    }
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE items_init(struct default_engine *engine) {
+    size_t max = (size_t)1 << (engine->assoc.hashpower - 1);
+    size_t nlocks = 1;
+    size_t ii;
+    ENGINE_ERROR_CODE ret;
+
+    if ((ret = items_init_policy(engine)) != ENGINE_SUCCESS) {
+        return ret;
+    }
+
+    while (nlocks < engine->config.lock_stripes && nlocks < max) {
+        nlocks <<= 1;
+    }
+
+    if (nlocks != engine->config.lock_stripes &&
+        engine->config.lock_stripes != 0) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "Using %lu lock stripes (requested %lu)\n",
+                    (unsigned long)nlocks,
+                    (unsigned long)engine->config.lock_stripes);
+    }
+
+    engine->items.item_locks = calloc(nlocks, sizeof(cb_mutex_t));
+    if (engine->items.item_locks == NULL) {
+        return ENGINE_ENOMEM;
+    }
+
+    for (ii = 0; ii < nlocks; ++ii) {
+        cb_mutex_initialize(&engine->items.item_locks[ii]);
+    }
+    engine->items.item_lock_mask = (uint32_t)(nlocks - 1);
+    engine->config.lock_stripes = nlocks;
+    /* A tick back, so the clock never reads 0 */
+    engine->items.cas_epoch = gethrtime() - 1;
+
+    if (engine->config.lease_timeout != 0) {
+        size_t nchains = nlocks < LEASE_MIN_CHAINS ? LEASE_MIN_CHAINS : nlocks;
+        engine->items.leases = calloc(nchains, sizeof(struct item_lease *));
+        if (engine->items.leases == NULL) {
+            return ENGINE_ENOMEM;
+        }
+        engine->items.lease_mask = (uint32_t)(nchains - 1);
+    }
+
+    if (engine->config.item_sample != 0) {
+        /* 1 in item_sample keys, rounded down to a power of two */
+        uint32_t sample = 1;
+        while (sample <= engine->config.item_sample / 2 &&
+               sample < (UINT32_C(1) << 31)) {
+            sample <<= 1;
+        }
+        engine->items.sample_mask = sample - 1;
+        engine->items.histograms = calloc(POWER_LARGEST,
+                                          sizeof(item_histogram_t));
+        if (engine->items.histograms == NULL) {
+            return ENGINE_ENOMEM;
+        }
+    }
+
+    return ENGINE_SUCCESS;
+}
+
+void items_destroy(struct default_engine *engine) {
+    if (engine->items.item_locks != NULL) {
+        uint32_t ii;
+        for (ii = 0; ii <= engine->items.item_lock_mask; ++ii) {
+            cb_mutex_destroy(&engine->items.item_locks[ii]);
+        }
+        free(engine->items.item_locks);
+        engine->items.item_locks = NULL;
+    }
+    if (engine->items.leases != NULL) {
+        uint32_t ii;
+        for (ii = 0; ii <= engine->items.lease_mask; ++ii) {
+            while (engine->items.leases[ii] != NULL) {
+                struct item_lease *lease = engine->items.leases[ii];
+                engine->items.leases[ii] = lease->next;
+                free(lease);
+            }
+        }
+        free(engine->items.leases);
+        engine->items.leases = NULL;
+    }
+    free(engine->items.histograms);
+    engine->items.histograms = NULL;
+    sketch_destroy(&engine->sketch);
+}
+
+static uint32_t item_hash(struct default_engine *engine,
+                          const hash_item *it) {
+    return engine->server.core->hash(item_get_key(it), it->nkey, 0);
+}
+
+/* The bucket of the histograms for a number of seconds */
+static int item_age_bucket(rel_time_t seconds) {
+    int bucket = 0;
+    while (seconds != 0 && bucket < ITEM_AGE_BUCKETS - 1) {
+        seconds >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+/*
+ * Count the item evicted (or reclaimed once expired), and sample it
+ * into the histograms of its slab class. The caller holds the LRU lock.
+ */
+static void item_count_eviction(struct default_engine *engine,
+                                const hash_item *it, bool expired,
+                                rel_time_t current_time) {
+    itemstats_t *stats = &engine->items.itemstats[it->slabs_clsid];
+    item_histogram_t *histogram;
+
+    if ((it->iflag & ITEM_FETCHED) == 0) {
+        if (expired) {
+            stats->expired_unfetched++;
+        } else {
+            stats->evicted_unfetched++;
+        }
+    }
+    if (expired || engine->items.histograms == NULL ||
+        (item_hash(engine, it) & engine->items.sample_mask) != 0) {
+        return;
+    }
+    histogram = &engine->items.histograms[it->slabs_clsid];
+    histogram->evicted_idle[item_age_bucket(current_time - it->time)]++;
+    histogram->evicted++;
+    if ((it->iflag & ITEM_FETCHED) == 0) {
+        histogram->evicted_unfetched++;
+    }
+}
+
+/* Flag the item as read, and sample the TTL it has left */
+static void item_count_access(struct default_engine *engine, hash_item *it,
+                              uint32_t hv) {
+    item_histogram_t *histogram;
+    rel_time_t current_time;
+
+    if ((it->iflag & ITEM_FETCHED) == 0) {
+        it->iflag |= ITEM_FETCHED;
+    }
+    if (engine->items.histograms == NULL ||
+        (hv & engine->items.sample_mask) != 0) {
+        return;
+    }
+    histogram = &engine->items.histograms[it->slabs_clsid];
+    __sync_add_and_fetch(&histogram->accessed, 1);
+    if (it->exptime == 0) {
+        __sync_add_and_fetch(&histogram->accessed_no_ttl, 1);
+    } else {
+        current_time = engine->server.core->get_current_time();
+        __sync_add_and_fetch(&histogram->access_ttl[item_age_bucket(
+            it->exptime > current_time ? it->exptime - current_time : 0)], 1);
+    }
+}
+
+static cb_mutex_t *item_get_lock(struct default_engine *engine, uint32_t hv) {
+    return &engine->items.item_locks[hv & engine->items.item_lock_mask];
+}
+
+void item_lock(struct default_engine *engine, uint32_t hv) {
+    cb_mutex_enter(item_get_lock(engine, hv));
+}
+
+void item_unlock(struct default_engine *engine, uint32_t hv) {
+    cb_mutex_exit(item_get_lock(engine, hv));
+}
+
+bool item_trylock(struct default_engine *engine, uint32_t hv) {
+    return cb_mutex_try_enter(item_get_lock(engine, hv)) == 0;
+}
+
+void item_lock_all(struct default_engine *engine) {
+    uint32_t ii;
+    for (ii = 0; ii <= engine->items.item_lock_mask; ++ii) {
+        cb_mutex_enter(&engine->items.item_locks[ii]);
+    }
+}
+
+void item_unlock_all(struct default_engine *engine) {
+    uint32_t ii;
+    for (ii = 0; ii <= engine->items.item_lock_mask; ++ii) {
+        cb_mutex_exit(&engine->items.item_locks[ii]);
+    }
+}
+
+/*
+ * Items found while walking an LRU may belong to any lock stripe. The
+ * lock order is item lock -> LRU lock, so while holding the LRU lock the
+ * item lock may only be tried. "held" is the item lock the caller already
+ * owns (or NULL). Returns the lock protecting the item (to be released
+ * with item_unlock_lru_item), or NULL if it is busy.
+ */
+static cb_mutex_t *item_trylock_lru_item(struct default_engine *engine,
+                                         const hash_item *it,
+                                         cb_mutex_t *held) {
+    cb_mutex_t *lock = item_get_lock(engine, item_hash(engine, it));
+    if (lock == held) {
+        return lock;
+    }
+    if (cb_mutex_try_enter(lock) != 0) {
+        return NULL;
+    }
+    return lock;
+}
+
+static void item_unlock_lru_item(cb_mutex_t *lock, cb_mutex_t *held) {
+    if (lock != held) {
+        cb_mutex_exit(lock);
+    }
+}
+
+static void item_lru_lock(struct default_engine *engine, unsigned int id) {
+    cb_mutex_enter(&engine->items.lru_locks[id]);
+}
+
+static void item_lru_unlock(struct default_engine *engine, unsigned int id) {
+    cb_mutex_exit(&engine->items.lru_locks[id]);
+}
+
 void item_stats_reset(struct default_engine *engine) {
-    cb_mutex_enter(&engine->cache_lock);
-    memset(engine->items.itemstats, 0, sizeof(engine->items.itemstats));
-    cb_mutex_exit(&engine->cache_lock);
+    int ii;
+    for (ii = 0; ii < POWER_LARGEST; ++ii) {
+        item_lru_lock(engine, ii);
+        memset(&engine->items.itemstats[ii], 0,
+               sizeof(engine->items.itemstats[ii]));
+        if (engine->items.histograms != NULL) {
+            memset(&engine->items.histograms[ii], 0,
+                   sizeof(engine->items.histograms[ii]));
+        }
+        item_lru_unlock(engine, ii);
+    }
+}
+
+
+/*
+ * A value too large for the largest slab class (config.item_size_max) is
+ * stored in a chain of chunks: the item in the hash table and the LRU is
+ * a header with ITEM_CHAINED set, whose data is the array of the chunks,
+ * and nbytes the size of the whole value. A chunk is an item of the
+ * largest class which is never linked, with the same key and a piece of
+ * the value as its data. The header holds the only reference to them,
+ * and they are freed with it, so the rest of the engine only has to care
+ * about the header (the value is more than one segment to get_item_info).
+ */
+
+/* The size of the item for a key and value, ignoring chaining */
+static size_t item_ntotal_flat(struct default_engine *engine,
+                               size_t nkey, size_t nbytes) {
+    size_t ret = item_header_size(engine) + nkey + nbytes;
+    if (engine->config.use_cas) {
+        ret += sizeof(uint64_t);
+    }
+    return ret;
+}
+
+/* The number of bytes of the value in each chunk of a chained item */
+static size_t item_chunk_nbytes(struct default_engine *engine, size_t nkey) {
+    return engine->config.item_size_max - item_ntotal_flat(engine, nkey, 0);
+}
+
+/*
+ * The number of chunks the value is stored in, 0 if it fits in a single
+ * item (or it doesn't, and the large items are disabled)
+ */
+static uint32_t item_nchunks(struct default_engine *engine,
+                             size_t nkey, size_t nbytes) {
+    size_t chunk;
+    if (engine->config.large_item_size_max == 0 ||
+        item_ntotal_flat(engine, nkey, nbytes) <= engine->config.item_size_max) {
+        return 0;
+    }
+    chunk = item_chunk_nbytes(engine, nkey);
+    return (uint32_t)((nbytes + chunk - 1) / chunk);
+}
+
+bool item_size_ok(struct default_engine *engine, size_t nkey, size_t nbytes) {
+    if (item_ntotal_flat(engine, nkey, nbytes) <= engine->config.item_size_max) {
+        return true;
+    }
+    return nbytes <= engine->config.large_item_size_max &&
+        item_ntotal_flat(engine, nkey, 0) < engine->config.item_size_max;
 }
 
+static hash_item **item_get_chain(const hash_item *it) {
+    return (hash_item**)item_get_data(it);
+}
 
 /* warning: don't use these macros with a function, as it evals its arg twice */
 static size_t ITEM_ntotal(struct default_engine *engine,
                           const hash_item *item) {
-    size_t ret = sizeof(*item) + item->nkey + item->nbytes;
-    if (engine->config.use_cas) {
-        ret += sizeof(uint64_t);
+    if ((item->iflag & ITEM_EXTERNAL) != 0) {
+        return item_ntotal_flat(engine, item->nkey, sizeof(struct ext_loc));
+    }
+    if ((item->iflag & ITEM_CHAINED) != 0) {
+        return item_ntotal_flat(engine, item->nkey,
+                                item_nchunks(engine, item->nkey, item->nbytes) *
+                                sizeof(hash_item*));
+    }
+    return item_ntotal_flat(engine, item->nkey, item->nbytes);
+}
+
+/* Count an item of ntotal bytes in (delta 1) or out of (-1) "stats sizes" */
+static void item_size_count(struct default_engine *engine, size_t ntotal,
+                            int delta) {
+    size_t bucket = (ntotal + ITEM_SIZE_BUCKET - 1) / ITEM_SIZE_BUCKET;
+    if (bucket < ITEM_SIZE_BUCKETS) {
+        if (delta > 0) {
+            __sync_add_and_fetch(&engine->items.size_histogram[bucket], 1);
+        } else {
+            __sync_sub_and_fetch(&engine->items.size_histogram[bucket], 1);
+        }
+    }
+}
+
+/* The bytes the item takes up, with its chunks */
+static size_t item_bytes(struct default_engine *engine, const hash_item *it) {
+    size_t ret = ITEM_ntotal(engine, it);
+    if ((it->iflag & ITEM_CHAINED) != 0) {
+        ret += item_nchunks(engine, it->nkey, it->nbytes) *
+            item_ntotal_flat(engine, it->nkey, 0) + it->nbytes;
+    }
+    return ret;
+}
+
+/*
+ * Free the chunks of a chained item (if it is one). The caller holds the
+ * item lock for it.
+ */
+static void item_free_chain(struct default_engine *engine, hash_item *it) {
+    hash_item **chain;
+    uint32_t ii, nchunks;
+
+    if ((it->iflag & ITEM_CHAINED) == 0) {
+        return;
+    }
+    chain = item_get_chain(it);
+    nchunks = item_nchunks(engine, it->nkey, it->nbytes);
+    for (ii = 0; ii < nchunks; ++ii) {
+        if (chain[ii] != NULL) {
+            chain[ii]->refcount = 0;
+            item_free(engine, chain[ii]);
+            chain[ii] = NULL;
+        }
+    }
+    it->iflag &= ~ITEM_CHAINED;
+}
+
+int item_get_segments(struct default_engine *engine, const hash_item *it,
+                      struct iovec *iov, int niov) {
+    hash_item **chain;
+    uint32_t ii, nchunks;
+
+    if ((it->iflag & ITEM_EXTERNAL) != 0) {
+        /* The value isn't in RAM */
+        return -1;
+    }
+    if ((it->iflag & ITEM_CHAINED) == 0) {
+        if (niov < 1) {
+            return -1;
+        }
+        iov[0].iov_base = item_get_data(it);
+        iov[0].iov_len = it->nbytes;
+        return 1;
+    }
+
+    nchunks = item_nchunks(engine, it->nkey, it->nbytes);
+    if ((uint32_t)niov < nchunks) {
+        return -1;
+    }
+    chain = item_get_chain(it);
+    for (ii = 0; ii < nchunks; ++ii) {
+        iov[ii].iov_base = item_get_data(chain[ii]);
+        iov[ii].iov_len = chain[ii]->nbytes;
+    }
+    return (int)nchunks;
+}
+
+int item_get_segment(struct default_engine *engine, const hash_item *it,
+                     uint32_t index, struct iovec *iov) {
+    hash_item **chain;
+    uint32_t nchunks;
+
+    if ((it->iflag & ITEM_EXTERNAL) != 0) {
+        return -1;
+    }
+    if ((it->iflag & ITEM_CHAINED) == 0) {
+        if (index != 0) {
+            return -1;
+        }
+        iov->iov_base = item_get_data(it);
+        iov->iov_len = it->nbytes;
+        return 1;
+    }
+
+    nchunks = item_nchunks(engine, it->nkey, it->nbytes);
+    if (index >= nchunks) {
+        return -1;
     }
+    chain = item_get_chain(it);
+    iov->iov_base = item_get_data(chain[index]);
+    iov->iov_len = chain[index]->nbytes;
+    return (int)nchunks;
+}
+
+size_t item_get_bytes(struct default_engine *engine, const hash_item *it) {
+    return item_bytes(engine, it);
+}
+
+/* Copy len bytes of data to the value of the item, starting at offset */
+static void item_write_value(struct default_engine *engine, hash_item *it,
+                             size_t offset, const char *data, size_t len) {
+    hash_item **chain;
+    size_t chunk;
+    uint32_t ii;
+
+    if ((it->iflag & ITEM_CHAINED) == 0) {
+        memcpy(item_get_data(it) + offset, data, len);
+        return;
+    }
+
+    chain = item_get_chain(it);
+    chunk = item_chunk_nbytes(engine, it->nkey);
+    ii = (uint32_t)(offset / chunk);
+    offset %= chunk;
+    while (len > 0) {
+        size_t n = chain[ii]->nbytes - offset;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(item_get_data(chain[ii]) + offset, data, n);
+        data += n;
+        len -= n;
+        offset = 0;
+        ++ii;
+    }
+}
+
+/* Copy the value of src to the value of dst, starting at offset */
+static void item_copy_value(struct default_engine *engine, hash_item *dst,
+                            size_t offset, const hash_item *src) {
+    hash_item **chain;
+    uint32_t ii, nchunks;
+
+    if ((src->iflag & ITEM_CHAINED) == 0) {
+        item_write_value(engine, dst, offset, item_get_data(src), src->nbytes);
+        return;
+    }
+
+    chain = item_get_chain(src);
+    nchunks = item_nchunks(engine, src->nkey, src->nbytes);
+    for (ii = 0; ii < nchunks; ++ii) {
+        item_write_value(engine, dst, offset, item_get_data(chain[ii]),
+                         chain[ii]->nbytes);
+        offset += chain[ii]->nbytes;
+    }
+}
+
+char *item_get_value_copy(struct default_engine *engine, const hash_item *it) {
+    char *ret = malloc(it->nbytes ? it->nbytes : 1);
+    hash_item **chain;
+    uint32_t ii, nchunks;
+    size_t offset = 0;
 
+    if (ret == NULL) {
+        return NULL;
+    }
+    if ((it->iflag & ITEM_EXTERNAL) != 0) {
+        struct ext_loc loc;
+        memcpy(&loc, item_get_data(it), sizeof(loc));
+        if (!ext_read(engine, &loc, ret, it->nbytes)) {
+            free(ret);
+            return NULL;
+        }
+        return ret;
+    }
+    if ((it->iflag & ITEM_CHAINED) == 0) {
+        memcpy(ret, item_get_data(it), it->nbytes);
+        return ret;
+    }
+    chain = item_get_chain(it);
+    nchunks = item_nchunks(engine, it->nkey, it->nbytes);
+    for (ii = 0; ii < nchunks; ++ii) {
+        memcpy(ret + offset, item_get_data(chain[ii]), chain[ii]->nbytes);
+        offset += chain[ii]->nbytes;
+    }
     return ret;
 }
 
-/* Get the next CAS id for a new item. */
-static uint64_t get_cas_id(void) {
-    static uint64_t cas_id = 0;
-    return ++cas_id;
+/*
+ * The CAS values come from a hybrid logical clock instead of a shared
+ * counter: the high bits are the nanoseconds since the engine started,
+ * the low ITEM_CAS_SLOT_BITS the slot of the thread asking (a thread
+ * always uses the slot its id hashes to). A slot that is asked faster
+ * than the clock ticks hands out one tick more than its last value, so
+ * a slot never hands out the same value twice and no two slots hand out
+ * the same low bits, which makes the values unique. The threads hashing
+ * to the same slot share it with a compare and swap, the others never
+ * touch its cache line.
+ *
+ * The value is also larger than any read of the clock before it
+ * (get_current_cas_id), which the DCP backfill relies on to tell the
+ * items changed since a snapshot started, and larger than the previous
+ * CAS of the item (passed in as prev, 0 for a new one), so it still goes
+ * up with every change of a key when two threads race on it.
+ *
+ * 58 bits of nanoseconds wrap after 9 years of uptime.
+ */
+static unsigned int cas_slot(void) {
+    uint64_t id = (unsigned long)cb_thread_self();
+    unsigned int slot = (unsigned int)((id * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+    return slot % ITEM_CAS_SLOTS;
+}
+
+static uint64_t cas_clock(struct default_engine *engine) {
+    return (uint64_t)(gethrtime() - engine->items.cas_epoch) <<
+        ITEM_CAS_SLOT_BITS;
+}
+
+/* Get the next CAS id for a new item, or a change of one with CAS prev. */
+static uint64_t get_cas_id(struct default_engine *engine, uint64_t prev) {
+    unsigned int slot = cas_slot();
+    volatile uint64_t *last = &engine->items.cas_slots[slot].last;
+    uint64_t floor = cas_clock(engine);
+    uint64_t old, next;
+
+    /* The lowest value of this slot over both prev and the clock */
+    if (prev >= floor) {
+        floor = (prev | (ITEM_CAS_SLOTS - 1)) + 1;
+    }
+    floor |= slot;
+
+    do {
+        old = *last;
+        next = old < floor ? floor : old + ITEM_CAS_SLOTS;
+    } while (!__sync_bool_compare_and_swap(last, old, next));
+
+    return next;
+}
+
+/* Every CAS handed out from now on is larger than the value returned */
+static uint64_t get_current_cas_id(struct default_engine *engine) {
+    return cas_clock(engine) - 1;
+}
+
+/* Whether a CAS larger than cas was handed out */
+static bool item_cas_since(struct default_engine *engine, uint64_t cas) {
+    int ii;
+
+    for (ii = 0; ii < ITEM_CAS_SLOTS; ++ii) {
+        if (engine->items.cas_slots[ii].last > cas) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * An item is flushed when it was last touched before the oldest_live time
+ * of a flush (once that time has come), or when its CAS is from before
+ * an immediate flush: flush_cas is what tells the items stored in the
+ * second of the flush apart from the ones stored after it. The items of
+ * a deleted namespace (see namespaces.h) are flushed the same way.
+ */
+static bool item_is_flushed(struct default_engine *engine,
+                            const hash_item *it, rel_time_t current_time) {
+    rel_time_t oldest_live = engine->config.oldest_live;
+    uint64_t flush_cas = engine->config.flush_cas;
+
+    if (oldest_live != 0 && oldest_live <= current_time &&
+        it->time <= oldest_live) {
+        return true;
+    }
+    if (flush_cas != 0 && item_get_cas(it) <= flush_cas) {
+        return true;
+    }
+    return namespace_is_deleted(engine, it);
 }
 
 /* Enable this for reference-count debugging. */
@@ -88,31 +705,47 @@ hash_item *do_item_alloc(struct default_engine *engine,
                          uint8_t datatype) {
     hash_item *it = NULL;
     int tries = search_items;
-    hash_item *search;
-    rel_time_t oldest_live;
+    hash_item *search, *prev;
     rel_time_t current_time;
     unsigned int id;
-
-    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
-    if (engine->config.use_cas) {
-        ntotal += sizeof(uint64_t);
-    }
+    cb_mutex_t *held;
+    cb_mutex_t *lock;
+    uint32_t stripe;
+    uint32_t hv;
+    unsigned int frequency = 0;
+    unsigned int bumped = 0;
+    uint32_t nchunks = item_nchunks(engine, nkey, nbytes);
+    size_t ntotal = item_ntotal_flat(engine, nkey,
+                                     nchunks ? nchunks * sizeof(hash_item*) :
+                                     (size_t)nbytes);
 
     if ((id = slabs_clsid(engine, ntotal)) == 0) {
         return 0;
     }
 
+    /* The caller holds the item lock for the key we're allocating */
+    hv = engine->server.core->hash(key, nkey, 0);
+    stripe = hv & engine->items.item_lock_mask;
+    held = &engine->items.item_locks[stripe];
+
     /* do a quick check if we have any expired items in the tail.. */
     tries = search_items;
-    oldest_live = engine->config.oldest_live;
     current_time = engine->server.core->get_current_time();
 
+    item_lru_lock(engine, id);
     for (search = engine->items.tails[id];
          tries > 0 && search != NULL;
-         tries--, search=search->prev) {
+         tries--, search = item_prev(engine, search)) {
         if (search->refcount == 0 &&
-            ((search->time < oldest_live) || /* dead by flush */
+            (item_is_flushed(engine, search, current_time) ||
              (search->exptime != 0 && search->exptime < current_time))) {
+            if ((lock = item_trylock_lru_item(engine, search, held)) == NULL) {
+                continue;
+            }
+            if (search->refcount != 0) {
+                item_unlock_lru_item(lock, held);
+                continue;
+            }
             it = search;
             /* I don't want to actually free the object, just steal
              * the item to avoid to grab the slab mutex twice ;-)
@@ -123,15 +756,19 @@ hash_item *do_item_alloc(struct default_engine *engine,
             engine->items.itemstats[id].reclaimed++;
             it->refcount = 1;
             slabs_adjust_mem_requested(engine, it->slabs_clsid, ITEM_ntotal(engine, it), ntotal);
-            do_item_unlink(engine, it);
+            do_item_unlink_lru_locked(engine, it);
+            item_free_chain(engine, it);
+            item_unlock_lru_item(lock, held);
             /* Initialize the item block: */
             it->slabs_clsid = 0;
             it->refcount = 0;
             break;
         }
     }
+    item_lru_unlock(engine, id);
 
-    if (it == NULL && (it = slabs_alloc(engine, ntotal, id)) == NULL) {
+    if (it == NULL &&
+        (it = slabs_alloc_cached(engine, ntotal, id, stripe)) == NULL) {
         /*
         ** Could not find an expired item at the tail, and memory allocation
         ** failed. Try to evict some items!
@@ -142,8 +779,20 @@ hash_item *do_item_alloc(struct default_engine *engine,
          * we're out of luck at this point...
          */
 
+        if (engine->items.policy == ITEM_POLICY_TINYLFU) {
+            /* Counting the lookup of the store about to happen */
+            frequency = sketch_estimate(&engine->sketch, hv) + 1;
+        }
+
+        if (engine->config.evict_reserve != 0) {
+            /* The reserve ran out, have the maintainer top it up now */
+            cb_cond_signal(&engine->items.maintainer_cond);
+        }
+
+        item_lru_lock(engine, id);
         if (engine->config.evict_to_free == 0) {
             engine->items.itemstats[id].outofmemory++;
+            item_lru_unlock(engine, id);
             return NULL;
         }
 
@@ -156,11 +805,53 @@ hash_item *do_item_alloc(struct default_engine *engine,
 
         if (engine->items.tails[id] == 0) {
             engine->items.itemstats[id].outofmemory++;
+            item_lru_unlock(engine, id);
             return NULL;
         }
 
-        for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
+        for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=prev) {
+            prev = item_prev(engine, search);
             if (search->refcount == 0) {
+                if ((lock = item_trylock_lru_item(engine, search, held)) == NULL) {
+                    continue;
+                }
+                if (search->refcount != 0) {
+                    item_unlock_lru_item(lock, held);
+                    continue;
+                }
+                if ((search->iflag & ITEM_ACTIVE) != 0 &&
+                    (search->exptime == 0 || search->exptime > current_time)) {
+                    /* Accessed since it was queued; give it another round.
+                       That takes no try (or a tail full of read items would
+                       fail the store), the walk ends up at the bumped ones
+                       which are no longer active at the latest. */
+                    do_item_lru_bump(engine, search, current_time);
+                    item_unlock_lru_item(lock, held);
+                    if (bumped++ < engine->items.sizes[id]) {
+                        ++tries;
+                    }
+                    if (prev == NULL) {
+                        /* It was the whole LRU, look at it again */
+                        prev = search;
+                    }
+                    continue;
+                }
+                if (engine->items.policy == ITEM_POLICY_TINYLFU &&
+                    tries > search_items / 2 &&
+                    (search->exptime == 0 || search->exptime > current_time) &&
+                    sketch_estimate(&engine->sketch,
+                                    item_hash(engine, search)) > frequency) {
+                    /* More popular than the new key; keep it (in the
+                       second half of the search anything goes) */
+                    do_item_lru_bump(engine, search, current_time);
+                    engine->items.itemstats[id].kept++;
+                    item_unlock_lru_item(lock, held);
+                    continue;
+                }
+                item_count_eviction(engine, search,
+                                    search->exptime != 0 &&
+                                    search->exptime <= current_time,
+                                    current_time);
                 if (search->exptime == 0 || search->exptime > current_time) {
                     engine->items.itemstats[id].evicted++;
                     engine->items.itemstats[id].evicted_time = current_time - search->time;
@@ -179,12 +870,26 @@ hash_item *do_item_alloc(struct default_engine *engine,
                     engine->stats.reclaimed++;
                     cb_mutex_exit(&engine->stats.lock);
                 }
-                do_item_unlink(engine, search);
+                /* Reuse the memory of the evicted item, so that it doesn't
+                   end up in the magazine of another lock stripe */
+                it = search;
+                it->refcount = 1;
+                slabs_adjust_mem_requested(engine, it->slabs_clsid, ITEM_ntotal(engine, it), ntotal);
+                do_item_unlink_lru_locked(engine, it);
+                item_free_chain(engine, it);
+                item_unlock_lru_item(lock, held);
+                it->slabs_clsid = 0;
+                it->refcount = 0;
                 break;
             }
         }
-        it = slabs_alloc(engine, ntotal, id);
+        item_lru_unlock(engine, id);
+
+        if (it == NULL) {
+            it = slabs_alloc_cached(engine, ntotal, id, stripe);
+        }
         if (it == 0) {
+            item_lru_lock(engine, id);
             engine->items.itemstats[id].outofmemory++;
             /* Last ditch effort. There is a very rare bug which causes
              * refcount leaks. We've fixed most of them, but it still happens,
@@ -194,15 +899,20 @@ hash_item *do_item_alloc(struct default_engine *engine,
              * free it anyway.
              */
             tries = search_items;
-            for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
+            for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search = item_prev(engine, search)) {
                 if (search->refcount != 0 && search->time + TAIL_REPAIR_TIME < current_time) {
+                    if ((lock = item_trylock_lru_item(engine, search, held)) == NULL) {
+                        continue;
+                    }
                     engine->items.itemstats[id].tailrepairs++;
                     search->refcount = 0;
-                    do_item_unlink(engine, search);
+                    do_item_unlink_lru_locked(engine, search);
+                    item_unlock_lru_item(lock, held);
                     break;
                 }
             }
-            it = slabs_alloc(engine, ntotal, id);
+            item_lru_unlock(engine, id);
+            it = slabs_alloc_cached(engine, ntotal, id, stripe);
             if (it == 0) {
                 return NULL;
             }
@@ -215,16 +925,44 @@ hash_item *do_item_alloc(struct default_engine *engine,
 
     cb_assert(it != engine->items.heads[it->slabs_clsid]);
 
-    it->next = it->prev = it->h_next = 0;
+    item_set_next(engine, it, NULL);
+    item_set_prev(engine, it, NULL);
+    item_set_h_next(engine, it, NULL);
     it->refcount = 1;     /* the caller will have a reference */
     DEBUG_REFCNT(it, '*');
     it->iflag = engine->config.use_cas ? ITEM_WITH_CAS : 0;
+    if (engine->config.compact_items) {
+        it->iflag |= ITEM_COMPACT;
+    }
+    if (engine->config.vbucket_index) {
+        it->iflag |= ITEM_VBUCKET;
+        memset(it + 1, 0, sizeof(struct item_vbucket_link));
+    }
     it->nkey = (uint16_t)nkey;
     it->nbytes = nbytes;
     it->flags = flags;
     it->datatype = datatype;
     memcpy((void*)item_get_key(it), key, nkey);
     it->exptime = exptime;
+
+    if (nchunks != 0) {
+        hash_item **chain = item_get_chain(it);
+        size_t chunk = item_chunk_nbytes(engine, nkey);
+        uint32_t ii;
+
+        memset(chain, 0, nchunks * sizeof(hash_item*));
+        it->iflag |= ITEM_CHAINED;
+        for (ii = 0; ii < nchunks; ++ii) {
+            size_t n = ii + 1 < nchunks ? chunk : nbytes - ii * chunk;
+            chain[ii] = do_item_alloc(engine, key, nkey, flags, exptime,
+                                      (int)n, cookie, datatype);
+            if (chain[ii] == NULL) {
+                it->refcount = 0;
+                item_free(engine, it);
+                return NULL;
+            }
+        }
+    }
     return it;
 }
 
@@ -236,12 +974,19 @@ static void item_free(struct default_engine *engine, hash_item *it) {
     cb_assert(it != engine->items.tails[it->slabs_clsid]);
     cb_assert(it->refcount == 0);
 
-    /* so slab size changer can tell later if item is already free or not */
+    /* slabs_free marks the chunk ITEM_SLABBED (under the slab class lock)
+       so slab page mover can tell later if item is already free or not */
+    item_free_chain(engine, it);
     clsid = it->slabs_clsid;
     it->slabs_clsid = 0;
-    it->iflag |= ITEM_SLABBED;
     DEBUG_REFCNT(it, 'F');
-    slabs_free(engine, it, ntotal, clsid);
+    if (engine->slabs.magazines != NULL) {
+        /* The caller holds the item lock for the item */
+        slabs_free_cached(engine, it, ntotal, clsid,
+                          item_hash(engine, it) & engine->items.item_lock_mask);
+    } else {
+        slabs_free(engine, it, ntotal, clsid);
+    }
 }
 
 static void item_link_q(struct default_engine *engine, hash_item *it) { /* item is the new head */
@@ -253,9 +998,9 @@ static void item_link_q(struct default_engine *engine, hash_item *it) { /* item
     tail = &engine->items.tails[it->slabs_clsid];
     cb_assert(it != *head);
     cb_assert((*head && *tail) || (*head == 0 && *tail == 0));
-    it->prev = 0;
-    it->next = *head;
-    if (it->next) it->next->prev = it;
+    item_set_prev(engine, it, NULL);
+    item_set_next(engine, it, *head);
+    if (*head) item_set_prev(engine, *head, it);
     *head = it;
     if (*tail == 0) *tail = it;
     engine->items.sizes[it->slabs_clsid]++;
@@ -264,62 +1009,81 @@ static void item_link_q(struct default_engine *engine, hash_item *it) { /* item
 
 static void item_unlink_q(struct default_engine *engine, hash_item *it) {
     hash_item **head, **tail;
+    hash_item *next = item_next(engine, it);
+    hash_item *prev = item_prev(engine, it);
     cb_assert(it->slabs_clsid < POWER_LARGEST);
     head = &engine->items.heads[it->slabs_clsid];
     tail = &engine->items.tails[it->slabs_clsid];
 
     if (*head == it) {
-        cb_assert(it->prev == 0);
-        *head = it->next;
+        cb_assert(prev == 0);
+        *head = next;
     }
     if (*tail == it) {
-        cb_assert(it->next == 0);
-        *tail = it->prev;
+        cb_assert(next == 0);
+        *tail = prev;
     }
-    cb_assert(it->next != it);
-    cb_assert(it->prev != it);
+    cb_assert(next != it);
+    cb_assert(prev != it);
 
-    if (it->next) it->next->prev = it->prev;
-    if (it->prev) it->prev->next = it->next;
+    if (next) item_set_prev(engine, next, prev);
+    if (prev) item_set_next(engine, prev, next);
     engine->items.sizes[it->slabs_clsid]--;
     return;
 }
 
-int do_item_link(struct default_engine *engine, hash_item *it) {
+int do_item_link(struct default_engine *engine, hash_item *it,
+                 uint64_t prev_cas) {
+    uint32_t hv;
     MEMCACHED_ITEM_LINK(item_get_key(it), it->nkey, it->nbytes);
     cb_assert((it->iflag & (ITEM_LINKED|ITEM_SLABBED)) == 0);
-    cb_assert(it->nbytes < (1024 * 1024));  /* 1MB max size */
+    cb_assert(it->nbytes < (1024 * 1024) ||  /* 1MB max size */
+              (it->iflag & ITEM_CHAINED) != 0);
     it->iflag |= ITEM_LINKED;
     it->time = engine->server.core->get_current_time();
-    assoc_insert(engine, engine->server.core->hash(item_get_key(it),
-                                                        it->nkey, 0),
-                 it);
+    hv = item_hash(engine, it);
+    assoc_insert(engine, hv, it);
+    expiry_add(engine, it, hv);
+    namespace_link(engine, it);
+    miss_filter_add(engine, hv);
+    vbucket_link(engine, it, item_bytes(engine, it));
 
     cb_mutex_enter(&engine->stats.lock);
-    engine->stats.curr_bytes += ITEM_ntotal(engine, it);
+    engine->stats.curr_bytes += item_bytes(engine, it);
     engine->stats.curr_items += 1;
     engine->stats.total_items += 1;
     cb_mutex_exit(&engine->stats.lock);
+    item_size_count(engine, ITEM_ntotal(engine, it), 1);
 
     /* Allocate a new CAS ID on link. */
-    item_set_cas(NULL, NULL, it, get_cas_id());
+    item_set_cas(NULL, NULL, it, get_cas_id(engine, prev_cas));
 
+    item_lru_lock(engine, it->slabs_clsid);
     item_link_q(engine, it);
+    item_lru_unlock(engine, it->slabs_clsid);
 
     return 1;
 }
 
-void do_item_unlink(struct default_engine *engine, hash_item *it) {
+/*
+ * Unlink the item from the hash table and the LRU. The caller must hold
+ * both the item lock and the LRU lock for the item's slab class.
+ */
+static void do_item_unlink_lru_locked(struct default_engine *engine,
+                                      hash_item *it) {
     MEMCACHED_ITEM_UNLINK(item_get_key(it), it->nkey, it->nbytes);
     if ((it->iflag & ITEM_LINKED) != 0) {
+        uint32_t hv = item_hash(engine, it);
         it->iflag &= ~ITEM_LINKED;
         cb_mutex_enter(&engine->stats.lock);
-        engine->stats.curr_bytes -= ITEM_ntotal(engine, it);
+        engine->stats.curr_bytes -= item_bytes(engine, it);
         engine->stats.curr_items -= 1;
         cb_mutex_exit(&engine->stats.lock);
-        assoc_delete(engine, engine->server.core->hash(item_get_key(it),
-                                                            it->nkey, 0),
-                     item_get_key(it), it->nkey);
+        item_size_count(engine, ITEM_ntotal(engine, it), -1);
+        assoc_delete(engine, hv, item_get_key(it), it->nkey);
+        namespace_unlink(engine, it);
+        miss_filter_remove(engine, hv);
+        vbucket_unlink(engine, it, item_bytes(engine, it));
         item_unlink_q(engine, it);
         if (it->refcount == 0) {
             item_free(engine, it);
@@ -327,6 +1091,13 @@ void do_item_unlink(struct default_engine *engine, hash_item *it) {
     }
 }
 
+void do_item_unlink(struct default_engine *engine, hash_item *it) {
+    unsigned int id = it->slabs_clsid;
+    item_lru_lock(engine, id);
+    do_item_unlink_lru_locked(engine, it);
+    item_lru_unlock(engine, id);
+}
+
 void do_item_release(struct default_engine *engine, hash_item *it) {
     MEMCACHED_ITEM_REMOVE(item_get_key(it), it->nkey, it->nbytes);
     if (it->refcount != 0) {
@@ -338,28 +1109,63 @@ void do_item_release(struct default_engine *engine, hash_item *it) {
     }
 }
 
+/*
+ * Accessing an item doesn't move it in the LRU (that would make every GET
+ * write to the shared list heads). The item is only flagged as active,
+ * and moved to the head once it reaches the tail of the LRU (by the
+ * eviction code or the LRU maintainer). With the lru policy it is moved
+ * right away instead (at most once every ITEM_UPDATE_INTERVAL). The
+ * caller must hold the item lock.
+ */
 void do_item_update(struct default_engine *engine, hash_item *it) {
     rel_time_t current_time = engine->server.core->get_current_time();
     MEMCACHED_ITEM_UPDATE(item_get_key(it), it->nkey, it->nbytes);
-    if (it->time < current_time - ITEM_UPDATE_INTERVAL) {
+    if ((it->iflag & ITEM_ACTIVE) == 0 &&
+        it->time < current_time - ITEM_UPDATE_INTERVAL) {
         cb_assert((it->iflag & ITEM_SLABBED) == 0);
-
-        if ((it->iflag & ITEM_LINKED) != 0) {
-            item_unlink_q(engine, it);
-            it->time = current_time;
-            item_link_q(engine, it);
+        if (engine->items.policy == ITEM_POLICY_LRU) {
+            unsigned int id = it->slabs_clsid;
+            item_lru_lock(engine, id);
+            if ((it->iflag & ITEM_LINKED) != 0) {
+                item_unlink_q(engine, it);
+                it->time = current_time;
+                item_link_q(engine, it);
+            }
+            item_lru_unlock(engine, id);
+        } else {
+            it->iflag |= ITEM_ACTIVE;
         }
     }
 }
 
+/*
+ * Move an active item back to the head of its LRU. The caller must hold
+ * both the item lock and the LRU lock.
+ */
+static void do_item_lru_bump(struct default_engine *engine, hash_item *it,
+                             rel_time_t current_time) {
+    item_unlink_q(engine, it);
+    it->iflag &= ~ITEM_ACTIVE;
+    it->time = current_time;
+    item_link_q(engine, it);
+    engine->items.itemstats[it->slabs_clsid].bumped++;
+}
+
 int do_item_replace(struct default_engine *engine,
                     hash_item *it, hash_item *new_it) {
+    uint64_t prev_cas = item_get_cas(it);
+    uint32_t hv = item_hash(engine, new_it);
+    int ret;
     MEMCACHED_ITEM_REPLACE(item_get_key(it), it->nkey, it->nbytes,
                            item_get_key(new_it), new_it->nkey, new_it->nbytes);
     cb_assert((it->iflag & ITEM_SLABBED) == 0);
 
+    /* The gets checking the miss filter don't wait for the item lock */
+    miss_filter_add(engine, hv);
     do_item_unlink(engine, it);
-    return do_item_link(engine, new_it);
+    ret = do_item_link(engine, new_it, prev_cas);
+    miss_filter_remove(engine, hv);
+    return ret;
 }
 
 /*@null@*/
@@ -396,7 +1202,7 @@ static char *do_item_cachedump(const unsigned int slabs_clsid,
         memcpy(buffer + bufcurr, temp, len);
         bufcurr += len;
         shown++;
-        it = it->next;
+        it = item_next(engine, it);
     }
 
 
@@ -417,25 +1223,33 @@ static void do_item_stats(struct default_engine *engine,
     int i;
     rel_time_t current_time = engine->server.core->get_current_time();
     for (i = 0; i < POWER_LARGEST; i++) {
+        item_lru_lock(engine, i);
         if (engine->items.tails[i] != NULL) {
             const char *prefix = "items";
             int search = search_items;
             while (search > 0 &&
                    engine->items.tails[i] != NULL &&
-                   ((engine->config.oldest_live != 0 && /* Item flushd */
-                     engine->config.oldest_live <= current_time &&
-                     engine->items.tails[i]->time <= engine->config.oldest_live) ||
+                   (item_is_flushed(engine, engine->items.tails[i],
+                                    current_time) ||
                     (engine->items.tails[i]->exptime != 0 && /* and not expired */
                      engine->items.tails[i]->exptime < current_time))) {
+                hash_item *it = engine->items.tails[i];
+                cb_mutex_t *lock;
                 --search;
-                if (engine->items.tails[i]->refcount == 0) {
-                    do_item_unlink(engine, engine->items.tails[i]);
+                if ((lock = item_trylock_lru_item(engine, it, NULL)) == NULL) {
+                    break;
+                }
+                if (it->refcount == 0) {
+                    do_item_unlink_lru_locked(engine, it);
+                    item_unlock_lru_item(lock, NULL);
                 } else {
+                    item_unlock_lru_item(lock, NULL);
                     break;
                 }
             }
             if (engine->items.tails[i] == NULL) {
                 /* We removed all of the items in this slab class */
+                item_lru_unlock(engine, i);
                 continue;
             }
 
@@ -455,7 +1269,18 @@ static void do_item_stats(struct default_engine *engine,
                            "%u", engine->items.itemstats[i].tailrepairs);;
             add_statistics(c, add_stats, prefix, i, "reclaimed",
                            "%u", engine->items.itemstats[i].reclaimed);;
+            add_statistics(c, add_stats, prefix, i, "bumped",
+                           "%u", engine->items.itemstats[i].bumped);
+            add_statistics(c, add_stats, prefix, i, "kept",
+                           "%u", engine->items.itemstats[i].kept);
+            add_statistics(c, add_stats, prefix, i, "reserved",
+                           "%u", engine->items.itemstats[i].reserved);
+            add_statistics(c, add_stats, prefix, i, "evicted_unfetched",
+                           "%u", engine->items.itemstats[i].evicted_unfetched);
+            add_statistics(c, add_stats, prefix, i, "expired_unfetched",
+                           "%u", engine->items.itemstats[i].expired_unfetched);
         }
+        item_lru_unlock(engine, i);
     }
 }
 
@@ -463,55 +1288,104 @@ static void do_item_stats(struct default_engine *engine,
 /*@null@*/
 static void do_item_stats_sizes(struct default_engine *engine,
                                 ADD_STAT add_stats, const void *c) {
+    uint64_t nitems;
+    int i;
 
-    /* max 1MB object, divided into 32 bytes size buckets */
-    const int num_buckets = 32768;
-    unsigned int *histogram = calloc(num_buckets, sizeof(unsigned int));
+    /* Good enough while they change: no lock, and no walk of the LRUs */
+    for (i = 0; i < ITEM_SIZE_BUCKETS; i++) {
+        unsigned int count = engine->items.size_histogram[i];
+        if (count != 0) {
+            char key[8], val[32];
+            int klen, vlen;
+            klen = snprintf(key, sizeof(key), "%d", i * ITEM_SIZE_BUCKET);
+            vlen = snprintf(val, sizeof(val), "%u", count);
+            cb_assert(klen < sizeof(key));
+            cb_assert(vlen < sizeof(val));
+            add_stats(key, klen, val, vlen, c);
+        }
+    }
 
-    if (histogram != NULL) {
-        int i;
+    if (engine->config.compact_items) {
+        cb_mutex_enter(&engine->stats.lock);
+        nitems = engine->stats.curr_items;
+        cb_mutex_exit(&engine->stats.lock);
+        add_statistics(c, add_stats, NULL, -1, "header_bytes_saved",
+                       "%"PRIu64, nitems *
+                       (sizeof(hash_item) - ITEM_COMPACT_HEADER_SIZE));
+    }
+}
 
-        /* build the histogram */
-        for (i = 0; i < POWER_LARGEST; i++) {
-            hash_item *iter = engine->items.heads[i];
-            while (iter) {
-                size_t ntotal = ITEM_ntotal(engine, iter);
-                size_t bucket = ntotal / 32;
-                if ((ntotal % 32) != 0) {
-                    bucket++;
-                }
-                if (bucket < num_buckets) {
-                    histogram[bucket]++;
-                }
-                iter = iter->next;
-            }
-        }
+rel_time_t item_realtime(struct default_engine *engine, const void *cookie,
+                         rel_time_t exptime, uint16_t *frac) {
+    uint64_t ms = 0;
+    rel_time_t rel;
+    uint64_t base, part;
+
+    *frac = 0;
+    if (cookie != NULL && engine->server.core->realtime_ms != NULL &&
+        engine->server.cookie->is_exptime_ms_supported != NULL &&
+        engine->server.cookie->is_exptime_ms_supported(cookie)) {
+        ms = engine->server.core->realtime_ms(exptime);
+    }
+    if (ms == 0) {
+        return engine->server.core->realtime(exptime);
+    }
 
-        /* write the buffer */
-        for (i = 0; i < num_buckets; i++) {
-            if (histogram[i] != 0) {
-                char key[8], val[32];
-                int klen, vlen;
-                klen = snprintf(key, sizeof(key), "%d", i * 32);
-                vlen = snprintf(val, sizeof(val), "%u", histogram[i]);
-                cb_assert(klen < sizeof(key));
-                cb_assert(vlen < sizeof(val));
-                add_stats(key, klen, val, vlen, c);
-            }
-        }
-        free(histogram);
+    /* The second it ends in, and how far into the one before that */
+    rel = (rel_time_t)((ms + 999) / 1000);
+    if (rel == 0) {
+        rel = 1;
+    }
+    base = (uint64_t)(rel - 1) * 1000;
+    part = ms > base ? ((ms - base) * 128 + 999) / 1000 : 1;
+    if (part < 128) {
+        *frac = (uint16_t)(part << ITEM_EXPTIME_FRAC_SHIFT);
+    }
+    return rel;
+}
+
+bool item_is_expired(struct default_engine *engine, const hash_item *it,
+                     rel_time_t current_time) {
+    uint16_t frac = (it->iflag & ITEM_EXPTIME_FRAC) >> ITEM_EXPTIME_FRAC_SHIFT;
+
+    if (it->exptime == 0) {
+        return false;
+    }
+    if (it->exptime <= current_time) {
+        return true;
+    }
+    if (frac != 0 && it->exptime == current_time + 1 &&
+        engine->server.core->get_current_time_ms != NULL) {
+        uint64_t ends = (uint64_t)current_time * 1000 + frac * 1000 / 128;
+        return engine->server.core->get_current_time_ms() >= ends;
     }
+    return false;
 }
 
 /** wrapper around assoc_find which does the lazy expiration logic */
 hash_item *do_item_get(struct default_engine *engine,
-                       const char *key, const size_t nkey) {
+                       const char *key, const size_t nkey,
+                       uint32_t hv) {
+    return do_item_get_stale(engine, key, nkey, hv, NULL);
+}
+
+/*
+ * Expired items are kept for config.stale_grace seconds. If stale isn't
+ * NULL such an item is returned (with stale set to true), otherwise it
+ * is treated as missing but left in place for the stale readers.
+ */
+static hash_item *do_item_get_stale(struct default_engine *engine,
+                                    const char *key, const size_t nkey,
+                                    uint32_t hv, bool *stale) {
     rel_time_t current_time = engine->server.core->get_current_time();
-    hash_item *it = assoc_find(engine, engine->server.core->hash(key,
-                                                                      nkey, 0),
-                               key, nkey);
+    hash_item *it = assoc_find(engine, hv, key, nkey);
     int was_found = 0;
 
+    if (engine->items.policy == ITEM_POLICY_TINYLFU) {
+        /* Misses count too, so a key can build up a frequency to get in */
+        sketch_add(&engine->sketch, hv);
+    }
+
     if (engine->config.verbose > 2) {
         EXTENSION_LOGGER_DESCRIPTOR *logger;
         logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
@@ -526,10 +1400,8 @@ hash_item *do_item_get(struct default_engine *engine,
         }
     }
 
-    if (it != NULL && engine->config.oldest_live != 0 &&
-        engine->config.oldest_live <= current_time &&
-        it->time <= engine->config.oldest_live) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
+    if (it != NULL && item_is_flushed(engine, it, current_time)) {
+        do_item_unlink(engine, it);           /* MTSAFE - item lock held */
         it = NULL;
     }
 
@@ -540,9 +1412,22 @@ hash_item *do_item_get(struct default_engine *engine,
         was_found--;
     }
 
-    if (it != NULL && it->exptime != 0 && it->exptime <= current_time) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
-        it = NULL;
+    if (stale != NULL) {
+        *stale = false;
+    }
+    if (it != NULL && item_is_expired(engine, it, current_time)) {
+        if (current_time < it->exptime ||
+            current_time - it->exptime <
+            (rel_time_t)engine->config.stale_grace) {
+            if (stale != NULL) {
+                *stale = true;
+            } else {
+                it = NULL;
+            }
+        } else {
+            do_item_unlink(engine, it);       /* MTSAFE - item lock held */
+            it = NULL;
+        }
     }
 
     if (it == NULL && was_found) {
@@ -561,9 +1446,68 @@ hash_item *do_item_get(struct default_engine *engine,
     return it;
 }
 
+/*
+ * Find the lease on a key, and drop the expired leases in its chain on
+ * the way. The number of leases left in the chain is stored in nleases.
+ * Must be called with the item lock of the key held.
+ */
+static struct item_lease *do_lease_find(struct default_engine *engine,
+                                        const void *key, uint16_t nkey,
+                                        uint32_t hv, int *nleases) {
+    rel_time_t now = engine->server.core->get_current_time();
+    struct item_lease **prev;
+    struct item_lease *found = NULL;
+
+    *nleases = 0;
+    if (engine->items.leases == NULL) {
+        return NULL;
+    }
+
+    prev = &engine->items.leases[hv & engine->items.lease_mask];
+    while (*prev != NULL) {
+        struct item_lease *lease = *prev;
+        if (lease->expires <= now) {
+            *prev = lease->next;
+            free(lease);
+            continue;
+        }
+        if (lease->nkey == nkey && memcmp(lease->key, key, nkey) == 0) {
+            found = lease;
+        }
+        ++*nleases;
+        prev = &lease->next;
+    }
+    return found;
+}
+
+/*
+ * Drop the lease on a key (if any) once it is stored, so the clients
+ * told to wait for it find the item. Must be called with the item lock
+ * of the key held.
+ */
+static void do_lease_release(struct default_engine *engine,
+                             const void *key, uint16_t nkey, uint32_t hv) {
+    struct item_lease **prev;
+
+    if (engine->items.leases == NULL) {
+        return;
+    }
+
+    prev = &engine->items.leases[hv & engine->items.lease_mask];
+    while (*prev != NULL) {
+        struct item_lease *lease = *prev;
+        if (lease->nkey == nkey && memcmp(lease->key, key, nkey) == 0) {
+            *prev = lease->next;
+            free(lease);
+            return;
+        }
+        prev = &lease->next;
+    }
+}
+
 /*
  * Stores an item in the cache according to the semantics of one of the set
- * commands. In threaded mode, this is protected by the cache lock.
+ * commands. In threaded mode, this is protected by the item lock.
  *
  * Returns the state of storage.
  */
@@ -571,12 +1515,21 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
                                        hash_item *it,
                                        ENGINE_STORE_OPERATION operation,
                                        const void *cookie,
-                                       hash_item** stored_item) {
+                                       hash_item** stored_item,
+                                       uint32_t hv) {
     const char *key = item_get_key(it);
-    hash_item *old_it = do_item_get(engine, key, it->nkey);
+    bool stale;
+    hash_item *old_it = do_item_get_stale(engine, key, it->nkey, hv, &stale);
     ENGINE_ERROR_CODE stored = ENGINE_NOT_STORED;
 
     hash_item *new_it = NULL;
+    /* A stale item counts as missing, but is replaced when linking */
+    hash_item *stale_it = NULL;
+
+    if (stale) {
+        stale_it = old_it;
+        old_it = NULL;
+    }
 
     if (old_it != NULL && operation == OPERATION_ADD) {
         /* add only adds a nonexistent item, but promote to head of LRU */
@@ -588,8 +1541,20 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
     } else if (operation == OPERATION_CAS) {
         /* validate cas operation */
         if(old_it == NULL) {
-            /* LRU expired */
-            stored = ENGINE_KEY_ENOENT;
+            /* LRU expired, unless the CAS is the lease on the key */
+            int nleases;
+            struct item_lease *lease = do_lease_find(engine, key, it->nkey,
+                                                     hv, &nleases);
+            if (lease != NULL && lease->token == item_get_cas(it)) {
+                if (stale_it != NULL) {
+                    do_item_replace(engine, stale_it, it);
+                } else {
+                    do_item_link(engine, it, 0);
+                }
+                stored = ENGINE_SUCCESS;
+            } else {
+                stored = ENGINE_KEY_ENOENT;
+            }
         }
         else if (item_get_cas(it) == item_get_cas(old_it)) {
             /* cas validates */
@@ -624,9 +1589,19 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
                 }
             }
 
+            if (stored == ENGINE_NOT_STORED &&
+                (old_it->iflag & ITEM_EXTERNAL) != 0) {
+                /* Bring the value back first, the append is retried */
+                stored = ext_schedule(engine, cookie, old_it);
+                if (stored == ENGINE_EWOULDBLOCK) {
+                    old_it = NULL;
+                }
+            }
+
             if (stored == ENGINE_NOT_STORED) {
                 size_t total = it->nbytes + old_it->nbytes;
-                if (total > engine->config.item_size_max) {
+                if (!item_size_ok(engine, it->nkey, total)) {
+                    do_item_release(engine, old_it);
                     return ENGINE_E2BIG;
                 }
 
@@ -645,15 +1620,18 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
                     return ENGINE_NOT_STORED;
                 }
 
+                new_it->iflag |= old_it->iflag & ITEM_EXPTIME_FRAC;
+                item_set_vbucket(new_it, item_get_vbucket(it));
+
                 /* copy data from it and old_it to new_it */
 
                 if (operation == OPERATION_APPEND) {
-                    memcpy(item_get_data(new_it), item_get_data(old_it), old_it->nbytes);
-                    memcpy(item_get_data(new_it) + old_it->nbytes, item_get_data(it), it->nbytes);
+                    item_copy_value(engine, new_it, 0, old_it);
+                    item_copy_value(engine, new_it, old_it->nbytes, it);
                 } else {
                     /* OPERATION_PREPEND */
-                    memcpy(item_get_data(new_it), item_get_data(it), it->nbytes);
-                    memcpy(item_get_data(new_it) + it->nbytes, item_get_data(old_it), old_it->nbytes);
+                    item_copy_value(engine, new_it, 0, it);
+                    item_copy_value(engine, new_it, it->nbytes, old_it);
                 }
 
                 it = new_it;
@@ -663,8 +1641,10 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
         if (stored == ENGINE_NOT_STORED) {
             if (old_it != NULL) {
                 do_item_replace(engine, old_it, it);
+            } else if (stale_it != NULL) {
+                do_item_replace(engine, stale_it, it);
             } else {
-                do_item_link(engine, it);
+                do_item_link(engine, it, 0);
             }
 
             *stored_item = it;
@@ -676,6 +1656,10 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
         do_item_release(engine, old_it);         /* release our reference */
     }
 
+    if (stale_it != NULL) {
+        do_item_release(engine, stale_it);
+    }
+
     if (new_it != NULL) {
         do_item_release(engine, new_it);
     }
@@ -688,6 +1672,55 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
 }
 
 
+/*
+ * Parse the value of a counter: the digits, then nothing but the spaces
+ * an in place decrement pads it with. Anything else goes through
+ * safe_strtoull, which does the same for these.
+ */
+static bool counter_value(const char *ptr, uint32_t nbytes, uint64_t *value) {
+    char buf[80];
+    uint64_t val = 0;
+    uint32_t ii = 0;
+
+    while (ii < nbytes && ptr[ii] >= '0' && ptr[ii] <= '9') {
+        uint64_t digit = (uint64_t)(ptr[ii] - '0');
+        if (val > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+        val = val * 10 + digit;
+        ++ii;
+    }
+    if (ii > 0) {
+        uint32_t jj = ii;
+        while (jj < nbytes && ptr[jj] == ' ') {
+            ++jj;
+        }
+        if (jj == nbytes) {
+            *value = val;
+            return true;
+        }
+    }
+
+    if (nbytes >= (sizeof(buf) - 1)) {
+        return false;
+    }
+    memcpy(buf, ptr, nbytes);
+    buf[nbytes] = '\0';
+    return safe_strtoull(buf, value);
+}
+
+/* Format the value (into the end of buf), returning where it starts */
+static char *counter_format(uint64_t value, char *buf, size_t size,
+                            int *len) {
+    char *ptr = buf + size;
+    do {
+        *--ptr = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    *len = (int)(buf + size - ptr);
+    return ptr;
+}
+
 /*
  * adds a delta value to a numeric item.
  *
@@ -699,26 +1732,23 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
  *              ENGINE_SUCCESS is returned. Caller is responsible for calling
  *              do_item_release() on this when finished with it.
  *
+ * The value is changed in the item when no one else is using it and the
+ * new value still belongs in its slab class (like splice_item), so
+ * counters only get a new item when they outgrow it.
+ *
  * returns a response code to send back to the client.
  */
 static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
                                       hash_item *it, const bool incr,
                                       const int64_t delta, item** ritem,
                                       uint64_t *result, const void *cookie) {
-    const char *ptr;
     uint64_t value;
-    char buf[80];
+    char buf[24];
+    char *ptr;
     int res;
 
-    if (it->nbytes >= (sizeof(buf) - 1)) {
-        return ENGINE_EINVAL;
-    }
-
-    ptr = item_get_data(it);
-    memcpy(buf, ptr, it->nbytes);
-    buf[it->nbytes] = '\0';
-
-    if (!safe_strtoull(buf, &value)) {
+    if ((it->iflag & ITEM_CHAINED) != 0 ||
+        !counter_value(item_get_data(it), it->nbytes, &value)) {
         return ENGINE_EINVAL;
     }
 
@@ -733,15 +1763,33 @@ static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
     }
 
     *result = value;
-    if ((res = snprintf(buf, sizeof(buf), "%" PRIu64, value)) == -1) {
-        return ENGINE_EINVAL;
-    }
+    ptr = counter_format(value, buf, sizeof(buf), &res);
 
     if (it->refcount == 1 && res <= (int)it->nbytes) {
         /* we can do inline replacement */
-        memcpy(item_get_data(it), buf, res);
+        memcpy(item_get_data(it), ptr, res);
         memset(item_get_data(it) + res, ' ', it->nbytes - res);
-        item_set_cas(NULL, NULL, it, get_cas_id());
+        item_set_cas(NULL, NULL, it, get_cas_id(engine, item_get_cas(it)));
+        *ritem = it;
+    } else if (it->refcount == 1 && (it->iflag & ITEM_LINKED) != 0 &&
+               slabs_clsid(engine, ITEM_ntotal(engine, it) + res - it->nbytes)
+                   == it->slabs_clsid) {
+        /* it grows within its chunk */
+        size_t ntotal = ITEM_ntotal(engine, it);
+        size_t new_ntotal = ntotal + res - it->nbytes;
+
+        memcpy(item_get_data(it), ptr, res);
+        it->nbytes = (uint32_t)res;
+        slabs_adjust_mem_requested(engine, it->slabs_clsid, ntotal,
+                                   new_ntotal);
+        cb_mutex_enter(&engine->stats.lock);
+        engine->stats.curr_bytes += new_ntotal;
+        engine->stats.curr_bytes -= ntotal;
+        cb_mutex_exit(&engine->stats.lock);
+        item_size_count(engine, ntotal, -1);
+        item_size_count(engine, new_ntotal, 1);
+        vbucket_resize(engine, it, ntotal, new_ntotal);
+        item_set_cas(NULL, NULL, it, get_cas_id(engine, item_get_cas(it)));
         *ritem = it;
     } else {
         hash_item *new_it = do_item_alloc(engine, item_get_key(it),
@@ -752,7 +1800,9 @@ static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
             do_item_unlink(engine, it);
             return ENGINE_ENOMEM;
         }
-        memcpy(item_get_data(new_it), buf, res);
+        memcpy(item_get_data(new_it), ptr, res);
+        new_it->iflag |= it->iflag & ITEM_EXPTIME_FRAC;
+        item_set_vbucket(new_it, item_get_vbucket(it));
         do_item_replace(engine, it, new_it);
         *ritem = new_it;
     }
@@ -770,10 +1820,11 @@ hash_item *item_alloc(struct default_engine *engine,
                       rel_time_t exptime, int nbytes, const void *cookie,
                       uint8_t datatype) {
     hash_item *it;
-    cb_mutex_enter(&engine->cache_lock);
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
+    item_lock(engine, hv);
     it = do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie,
                        datatype);
-    cb_mutex_exit(&engine->cache_lock);
+    item_unlock(engine, hv);
     return it;
 }
 
@@ -784,35 +1835,148 @@ hash_item *item_alloc(struct default_engine *engine,
 hash_item *item_get(struct default_engine *engine,
                     const void *key, const size_t nkey) {
     hash_item *it;
-    cb_mutex_enter(&engine->cache_lock);
-    it = do_item_get(engine, key, nkey);
-    cb_mutex_exit(&engine->cache_lock);
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
+    if (!miss_filter_maybe(engine, hv)) {
+        if (engine->items.policy == ITEM_POLICY_TINYLFU) {
+            sketch_add(&engine->sketch, hv);
+        }
+        return NULL;
+    }
+    item_lock(engine, hv);
+    it = do_item_get(engine, key, nkey, hv);
+    if (it != NULL) {
+        item_count_access(engine, it, hv);
+    }
+    item_unlock(engine, hv);
+    if (it == NULL && engine->miss_filter.table != NULL) {
+        __sync_add_and_fetch(&engine->miss_filter.false_positives, 1);
+    }
     return it;
 }
 
+ENGINE_ERROR_CODE item_get_lease(struct default_engine *engine,
+                                 const void *key, uint16_t nkey,
+                                 hash_item **it, uint64_t *token,
+                                 bool *stale) {
+    ENGINE_ERROR_CODE ret = ENGINE_KEY_ENOENT;
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
+    struct item_lease *lease = NULL;
+    int nleases;
+
+    *token = 0;
+    item_lock(engine, hv);
+    *it = do_item_get_stale(engine, key, nkey, hv, stale);
+    if (*it != NULL) {
+        item_count_access(engine, *it, hv);
+        ret = ENGINE_SUCCESS;
+    }
+    if (*it != NULL && !*stale) {
+        /* A hit */
+    } else if (do_lease_find(engine, key, nkey, hv, &nleases) != NULL) {
+        /* Someone else refreshes it, so only a stale copy is returned */
+        if (*it == NULL) {
+            ret = ENGINE_TMPFAIL;
+        }
+    } else if (nleases < LEASE_MAX_PER_CHAIN &&
+               (lease = malloc(sizeof(*lease) + nkey)) != NULL) {
+        struct item_lease **chain;
+        chain = &engine->items.leases[hv & engine->items.lease_mask];
+        lease->token = get_cas_id(engine, 0);
+        lease->expires = engine->server.core->get_current_time() +
+            (rel_time_t)engine->config.lease_timeout;
+        lease->nkey = nkey;
+        memcpy(lease->key, key, nkey);
+        lease->next = *chain;
+        *chain = lease;
+        *token = lease->token;
+    }
+    item_unlock(engine, hv);
+
+    if (ret == ENGINE_TMPFAIL || lease != NULL || *stale) {
+        cb_mutex_enter(&engine->stats.lock);
+        if (lease != NULL) {
+            engine->stats.leases_granted++;
+        } else if (ret == ENGINE_TMPFAIL) {
+            engine->stats.lease_waits++;
+        }
+        if (*stale) {
+            engine->stats.stale_hits++;
+        }
+        cb_mutex_exit(&engine->stats.lock);
+    }
+    return ret;
+}
+
+void item_prefetch(struct default_engine *engine,
+                   const void *key, const size_t nkey, bool items) {
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
+    /* The table may be swapped (and freed) unless we hold the lock */
+    if (item_trylock(engine, hv)) {
+        assoc_prefetch(engine, hv, items);
+        item_unlock(engine, hv);
+    }
+}
+
 /*
  * Decrements the reference count on an item and adds it to the freelist if
  * needed.
  */
 void item_release(struct default_engine *engine, hash_item *item) {
-    cb_mutex_enter(&engine->cache_lock);
+    uint32_t hv = item_hash(engine, item);
+    item_lock(engine, hv);
     do_item_release(engine, item);
-    cb_mutex_exit(&engine->cache_lock);
+    item_unlock(engine, hv);
+}
+
+/* The items of a release_multi batch grouped by stripe at a time */
+#define ITEM_RELEASE_CHUNK 64
+
+void item_release_multi(struct default_engine *engine, hash_item **items,
+                        size_t nitems) {
+    cb_mutex_t *locks[ITEM_RELEASE_CHUNK];
+    size_t base, n, ii, jj;
+
+    for (base = 0; base < nitems; base += n) {
+        n = nitems - base;
+        if (n > ITEM_RELEASE_CHUNK) {
+            n = ITEM_RELEASE_CHUNK;
+        }
+        for (ii = 0; ii < n; ++ii) {
+            locks[ii] = item_get_lock(engine, item_hash(engine,
+                                                        items[base + ii]));
+        }
+        for (ii = 0; ii < n; ++ii) {
+            cb_mutex_t *lock = locks[ii];
+            if (lock == NULL) {
+                continue;
+            }
+            cb_mutex_enter(lock);
+            for (jj = ii; jj < n; ++jj) {
+                if (locks[jj] == lock) {
+                    do_item_release(engine, items[base + jj]);
+                    locks[jj] = NULL;
+                }
+            }
+            cb_mutex_exit(lock);
+        }
+    }
 }
 
 /*
  * Unlinks an item from the LRU and hashtable.
  */
 void item_unlink(struct default_engine *engine, hash_item *item) {
-    cb_mutex_enter(&engine->cache_lock);
+    uint32_t hv = item_hash(engine, item);
+    item_lock(engine, hv);
     do_item_unlink(engine, item);
-    cb_mutex_exit(&engine->cache_lock);
+    item_unlock(engine, hv);
 }
 
 static ENGINE_ERROR_CODE do_arithmetic(struct default_engine *engine,
                                        const void* cookie,
                                        const void* key,
                                        const int nkey,
+                                       uint16_t vbucket,
                                        const bool increment,
                                        const bool create,
                                        const uint64_t delta,
@@ -820,9 +1984,11 @@ static ENGINE_ERROR_CODE do_arithmetic(struct default_engine *engine,
                                        const rel_time_t exptime,
                                        item **result_item,
                                        uint8_t datatype,
-                                       uint64_t *result)
+                                       uint64_t *result,
+                                       uint32_t hv,
+                                       const bool block)
 {
-   hash_item *item = do_item_get(engine, key, nkey);
+   hash_item *item = do_item_get(engine, key, nkey, hv);
    ENGINE_ERROR_CODE ret;
 
    if (item == NULL) {
@@ -839,13 +2005,21 @@ static ENGINE_ERROR_CODE do_arithmetic(struct default_engine *engine,
             return ENGINE_ENOMEM;
          }
          memcpy((void*)item_get_data(item), buffer, len);
+         item_set_vbucket(item, vbucket);
          if ((ret = do_store_item(engine, item, OPERATION_ADD, cookie,
-                                  (hash_item**)result_item)) == ENGINE_SUCCESS) {
+                                  (hash_item**)result_item,
+                                  hv)) == ENGINE_SUCCESS) {
              *result = initial;
          } else {
              do_item_release(engine, item);
          }
       }
+   } else if ((item->iflag & ITEM_EXTERNAL) != 0) {
+      /* Bring the value back first, the operation is retried */
+      ret = block ? ext_schedule(engine, cookie, item) : ENGINE_TMPFAIL;
+      if (ret != ENGINE_EWOULDBLOCK) {
+         do_item_release(engine, item);
+      }
    } else {
       ret = do_add_delta(engine, item, increment, delta, result_item, result,
                          cookie);
@@ -858,6 +2032,7 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
                              const void* cookie,
                              const void* key,
                              const int nkey,
+                             uint16_t vbucket,
                              const bool increment,
                              const bool create,
                              const uint64_t delta,
@@ -868,15 +2043,32 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
                              uint64_t *result)
 {
     ENGINE_ERROR_CODE ret;
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
 
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_arithmetic(engine, cookie, key, nkey, increment,
+    item_lock(engine, hv);
+    ret = do_arithmetic(engine, cookie, key, nkey, vbucket, increment,
                         create, delta, initial, exptime, item,
-                        datatype, result);
-    cb_mutex_exit(&engine->cache_lock);
+                        datatype, result, hv, true);
+    item_unlock(engine, hv);
     return ret;
 }
 
+static void do_arithmetic_request(struct default_engine *engine,
+                                  item_arithmetic_request *req,
+                                  uint8_t datatype, uint32_t hv,
+                                  const void *cookie) {
+    item *it = NULL;
+
+    req->status = do_arithmetic(engine, cookie, req->key, req->nkey,
+                                req->vbucket, req->incr, req->create, req->delta,
+                                req->initial, req->exptime, &it, datatype,
+                                &req->value, hv, false);
+    if (req->status == ENGINE_SUCCESS) {
+        req->cas = item_get_cas(it);
+        do_item_release(engine, it);
+    }
+}
+
 /*
  * Stores an item in the cache (high level, obeys set/add/replace semantics)
  */
@@ -886,24 +2078,363 @@ ENGINE_ERROR_CODE store_item(struct default_engine *engine,
                              const void *cookie) {
     ENGINE_ERROR_CODE ret;
     hash_item* stored_item = NULL;
+    uint32_t hv = item_hash(engine, item);
 
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_store_item(engine, item, operation, cookie, &stored_item);
+    item_lock(engine, hv);
+    ret = do_store_item(engine, item, operation, cookie, &stored_item, hv);
     if (ret == ENGINE_SUCCESS) {
         *cas = item_get_cas(stored_item);
+        do_lease_release(engine, item_get_key(item), item->nkey, hv);
+    }
+    item_unlock(engine, hv);
+    return ret;
+}
+
+/* Allocate, fill in and store the item of a store_multi request */
+static void do_store_request(struct default_engine *engine,
+                             item_store_request *req, uint32_t hv,
+                             const void *cookie) {
+    hash_item *it;
+    hash_item *stored_item = NULL;
+    uint16_t frac;
+
+    if (!item_size_ok(engine, req->nkey, req->nbytes)) {
+        req->status = ENGINE_E2BIG;
+        return;
+    }
+    it = do_item_alloc(engine, req->key, req->nkey, req->flags,
+                       item_realtime(engine, cookie, req->exptime, &frac),
+                       (int)req->nbytes, cookie, req->datatype);
+    if (it == NULL) {
+        req->status = ENGINE_ENOMEM;
+        return;
+    }
+    it->iflag |= frac;
+    item_write_value(engine, it, 0, req->value, req->nbytes);
+    item_set_cas(NULL, cookie, it, req->cas);
+    item_set_vbucket(it, req->vbucket);
+
+    req->status = do_store_item(engine, it, req->operation, cookie,
+                                &stored_item, hv);
+    if (req->status == ENGINE_SUCCESS) {
+        req->cas = item_get_cas(stored_item);
+        do_lease_release(engine, req->key, req->nkey, hv);
+    }
+    do_item_release(engine, it);
+}
+
+struct batch_slot {
+    uint32_t hv;
+    uint32_t stripe;
+    size_t idx;
+};
+
+/* By lock stripe, and in the order of the batch within a stripe */
+static int batch_slot_compare(const void *a, const void *b) {
+    const struct batch_slot *sa = a;
+    const struct batch_slot *sb = b;
+    if (sa->stripe != sb->stripe) {
+        return sa->stripe < sb->stripe ? -1 : 1;
+    }
+    return sa->idx < sb->idx ? -1 : (sa->idx > sb->idx ? 1 : 0);
+}
+
+void store_items(struct default_engine *engine,
+                 item_store_request *requests, size_t nrequests,
+                 const void *cookie) {
+    struct batch_slot *slots = malloc(nrequests * sizeof(*slots));
+    size_t nslots = 0;
+    size_t ii;
+
+    if (slots == NULL) {
+        /* Item by item then */
+        for (ii = 0; ii < nrequests; ++ii) {
+            item_store_request *req = &requests[ii];
+            uint32_t hv;
+            if (req->status != ENGINE_SUCCESS) {
+                continue;
+            }
+            hv = engine->server.core->hash(req->key, req->nkey, 0);
+            item_lock(engine, hv);
+            do_store_request(engine, req, hv, cookie);
+            item_unlock(engine, hv);
+        }
+        return;
+    }
+
+    for (ii = 0; ii < nrequests; ++ii) {
+        if (requests[ii].status == ENGINE_SUCCESS) {
+            slots[nslots].hv = engine->server.core->hash(requests[ii].key,
+                                                         requests[ii].nkey, 0);
+            slots[nslots].stripe = slots[nslots].hv &
+                engine->items.item_lock_mask;
+            slots[nslots].idx = ii;
+            ++nslots;
+        }
+    }
+    qsort(slots, nslots, sizeof(*slots), batch_slot_compare);
+
+    ii = 0;
+    while (ii < nslots) {
+        uint32_t hv = slots[ii].hv;
+        item_lock(engine, hv);
+        do {
+            do_store_request(engine, &requests[slots[ii].idx],
+                             slots[ii].hv, cookie);
+            ++ii;
+        } while (ii < nslots && slots[ii].stripe == slots[ii - 1].stripe);
+        item_unlock(engine, hv);
+    }
+    free(slots);
+}
+
+void arithmetic_items(struct default_engine *engine,
+                      item_arithmetic_request *requests, size_t nrequests,
+                      uint8_t datatype, const void *cookie) {
+    struct batch_slot *slots = malloc(nrequests * sizeof(*slots));
+    size_t ii;
+
+    if (slots == NULL) {
+        for (ii = 0; ii < nrequests; ++ii) {
+            uint32_t hv = engine->server.core->hash(requests[ii].key,
+                                                    requests[ii].nkey, 0);
+            item_lock(engine, hv);
+            do_arithmetic_request(engine, &requests[ii], datatype, hv, cookie);
+            item_unlock(engine, hv);
+        }
+        return;
+    }
+
+    for (ii = 0; ii < nrequests; ++ii) {
+        slots[ii].hv = engine->server.core->hash(requests[ii].key,
+                                                 requests[ii].nkey, 0);
+        slots[ii].stripe = slots[ii].hv & engine->items.item_lock_mask;
+        slots[ii].idx = ii;
+    }
+    qsort(slots, nrequests, sizeof(*slots), batch_slot_compare);
+
+    ii = 0;
+    while (ii < nrequests) {
+        uint32_t hv = slots[ii].hv;
+        item_lock(engine, hv);
+        do {
+            do_arithmetic_request(engine, &requests[slots[ii].idx],
+                                  datatype, slots[ii].hv, cookie);
+            ++ii;
+        } while (ii < nrequests && slots[ii].stripe == slots[ii - 1].stripe);
+        item_unlock(engine, hv);
+    }
+    free(slots);
+}
+
+/*
+ * Check every entry of a cas_items transaction, and only if all of them
+ * check out and their new items could be allocated, replace them all.
+ * The caller holds the locks of all the stripes of the batch, and the
+ * items looked at are referenced (so they can't be evicted or expired by
+ * the allocations of the other entries) until the end.
+ */
+static ENGINE_ERROR_CODE do_cas_items(struct default_engine *engine,
+                                      item_store_request *requests,
+                                      const struct batch_slot *slots,
+                                      size_t nslots,
+                                      hash_item **olds, hash_item **news,
+                                      const void *cookie) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    size_t ii;
+
+    for (ii = 0; ii < nslots; ++ii) {
+        size_t idx = slots[ii].idx;
+        item_store_request *req = &requests[idx];
+        bool stale;
+        bool missing;
+
+        olds[idx] = do_item_get_stale(engine, req->key, req->nkey,
+                                      slots[ii].hv, &stale);
+        missing = olds[idx] == NULL || stale;
+        if (req->cas == 0) {
+            req->status = missing ? ENGINE_SUCCESS : ENGINE_KEY_EEXISTS;
+        } else if (missing) {
+            req->status = ENGINE_KEY_ENOENT;
+        } else {
+            req->status = item_get_cas(olds[idx]) == req->cas ?
+                ENGINE_SUCCESS : ENGINE_KEY_EEXISTS;
+        }
+
+        if (req->status == ENGINE_SUCCESS && ret == ENGINE_SUCCESS) {
+            uint16_t frac;
+            if (!item_size_ok(engine, req->nkey, req->nbytes)) {
+                req->status = ENGINE_E2BIG;
+            } else if ((news[idx] = do_item_alloc(engine, req->key, req->nkey,
+                                                  req->flags,
+                                                  item_realtime(engine,
+                                                                cookie,
+                                                                req->exptime,
+                                                                &frac),
+                                                  (int)req->nbytes, cookie,
+                                                  req->datatype)) == NULL) {
+                req->status = ENGINE_ENOMEM;
+            } else {
+                news[idx]->iflag |= frac;
+                item_set_vbucket(news[idx], req->vbucket);
+                item_write_value(engine, news[idx], 0, req->value,
+                                 req->nbytes);
+            }
+        }
+        if (req->status != ENGINE_SUCCESS && ret == ENGINE_SUCCESS) {
+            ret = req->status;
+        }
+    }
+
+    if (ret == ENGINE_SUCCESS) {
+        for (ii = 0; ii < nslots; ++ii) {
+            size_t idx = slots[ii].idx;
+            if (olds[idx] != NULL) {
+                do_item_replace(engine, olds[idx], news[idx]);
+            } else {
+                do_item_link(engine, news[idx], 0);
+            }
+            requests[idx].cas = item_get_cas(news[idx]);
+            do_lease_release(engine, requests[idx].key, requests[idx].nkey,
+                             slots[ii].hv);
+        }
+    }
+
+    for (ii = 0; ii < nslots; ++ii) {
+        size_t idx = slots[ii].idx;
+        if (olds[idx] != NULL) {
+            do_item_release(engine, olds[idx]);
+        }
+        if (news[idx] != NULL) {
+            do_item_release(engine, news[idx]);
+        }
+    }
+    return ret;
+}
+
+ENGINE_ERROR_CODE cas_items(struct default_engine *engine,
+                            item_store_request *requests, size_t nrequests,
+                            const void *cookie) {
+    struct batch_slot *slots = malloc(nrequests * sizeof(*slots));
+    hash_item **items = calloc(nrequests * 2, sizeof(*items));
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    size_t ii, jj;
+
+    if (slots == NULL || items == NULL) {
+        free(slots);
+        free(items);
+        return ENGINE_ENOMEM;
+    }
+
+    for (ii = 0; ii < nrequests; ++ii) {
+        slots[ii].hv = engine->server.core->hash(requests[ii].key,
+                                                 requests[ii].nkey, 0);
+        slots[ii].stripe = slots[ii].hv & engine->items.item_lock_mask;
+        slots[ii].idx = ii;
+        requests[ii].status = ENGINE_SUCCESS;
+    }
+    qsort(slots, nrequests, sizeof(*slots), batch_slot_compare);
+
+    /* A key may only be in the transaction once */
+    for (ii = 0; ii < nrequests; ++ii) {
+        for (jj = ii + 1;
+             jj < nrequests && slots[jj].stripe == slots[ii].stripe; ++jj) {
+            item_store_request *a = &requests[slots[ii].idx];
+            item_store_request *b = &requests[slots[jj].idx];
+            if (slots[jj].hv == slots[ii].hv && a->nkey == b->nkey &&
+                memcmp(a->key, b->key, a->nkey) == 0) {
+                b->status = ret = ENGINE_EINVAL;
+            }
+        }
+    }
+
+    if (ret == ENGINE_SUCCESS) {
+        /* In the order of the stripes, like any other holder of many */
+        for (ii = 0; ii < nrequests; ++ii) {
+            if (ii == 0 || slots[ii].stripe != slots[ii - 1].stripe) {
+                item_lock(engine, slots[ii].hv);
+            }
+        }
+        ret = do_cas_items(engine, requests, slots, nrequests,
+                           items, items + nrequests, cookie);
+        for (ii = nrequests; ii > 0; --ii) {
+            if (ii == 1 || slots[ii - 1].stripe != slots[ii - 2].stripe) {
+                item_unlock(engine, slots[ii - 1].hv);
+            }
+        }
+    }
+
+    free(items);
+    free(slots);
+    return ret;
+}
+
+/*
+ * Replaces a range of the value of an item without allocating a new one,
+ * if no one else is using the item and the new size still belongs in the
+ * slab class of the item (so it's where a new item would go anyway).
+ */
+ENGINE_ERROR_CODE splice_item(struct default_engine *engine,
+                              hash_item *item,
+                              uint64_t *cas,
+                              size_t offset,
+                              size_t length,
+                              const void *data,
+                              size_t ndata) {
+    ENGINE_ERROR_CODE ret = ENGINE_NOT_STORED;
+    uint32_t hv = item_hash(engine, item);
+
+    item_lock(engine, hv);
+    /* The caller's reference must be the only one */
+    if (item->refcount == 1 && (item->iflag & ITEM_LINKED) != 0 &&
+        (item->iflag & (ITEM_CHAINED|ITEM_EXTERNAL)) == 0 &&
+        offset <= item->nbytes && length <= item->nbytes - offset) {
+        size_t ntotal = ITEM_ntotal(engine, item);
+        size_t nbytes = item->nbytes - length + ndata;
+        size_t new_ntotal = ntotal - item->nbytes + nbytes;
+
+        if (nbytes < (1024 * 1024) &&
+            slabs_clsid(engine, new_ntotal) == item->slabs_clsid) {
+            char *value = item_get_data(item);
+
+            memmove(value + offset + ndata, value + offset + length,
+                    item->nbytes - offset - length);
+            memcpy(value + offset, data, ndata);
+            item->nbytes = (uint32_t)nbytes;
+
+            slabs_adjust_mem_requested(engine, item->slabs_clsid, ntotal,
+                                       new_ntotal);
+            cb_mutex_enter(&engine->stats.lock);
+            engine->stats.curr_bytes += new_ntotal;
+            engine->stats.curr_bytes -= ntotal;
+            cb_mutex_exit(&engine->stats.lock);
+            item_size_count(engine, ntotal, -1);
+            item_size_count(engine, new_ntotal, 1);
+
+            item_set_cas(NULL, NULL, item,
+                         get_cas_id(engine, item_get_cas(item)));
+            do_item_update(engine, item);
+            *cas = item_get_cas(item);
+            ret = ENGINE_SUCCESS;
+        }
     }
-    cb_mutex_exit(&engine->cache_lock);
+    item_unlock(engine, hv);
+
     return ret;
 }
 
 static hash_item *do_touch_item(struct default_engine *engine,
                                      const void *key,
                                      uint16_t nkey,
-                                     uint32_t exptime)
+                                     uint32_t exptime,
+                                     uint16_t frac,
+                                     uint32_t hv)
 {
-   hash_item *item = do_item_get(engine, key, nkey);
+   hash_item *item = do_item_get(engine, key, nkey, hv);
    if (item != NULL) {
        item->exptime = exptime;
+       item->iflag = (item->iflag & ~ITEM_EXPTIME_FRAC) | frac;
+       expiry_add(engine, item, hv);
    }
    return item;
 }
@@ -911,24 +2442,98 @@ static hash_item *do_touch_item(struct default_engine *engine,
 hash_item *touch_item(struct default_engine *engine,
                            const void *key,
                            uint16_t nkey,
-                           uint32_t exptime)
+                           uint32_t exptime,
+                           uint16_t frac)
 {
     hash_item *ret;
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
 
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_touch_item(engine, key, nkey, exptime);
-    cb_mutex_exit(&engine->cache_lock);
+    item_lock(engine, hv);
+    ret = do_touch_item(engine, key, nkey, exptime, frac, hv);
+    item_unlock(engine, hv);
     return ret;
 }
 
+static void do_touch_request(struct default_engine *engine,
+                             item_touch_request *req,
+                             uint32_t exptime, uint16_t frac, uint32_t hv) {
+    hash_item *it = do_touch_item(engine, req->key, req->nkey,
+                                  exptime, frac, hv);
+    if (it == NULL) {
+        req->status = ENGINE_KEY_ENOENT;
+        return;
+    }
+    req->status = ENGINE_SUCCESS;
+    if (req->get) {
+        req->item = it;
+    } else {
+        do_item_release(engine, it);
+    }
+}
+
+void touch_items(struct default_engine *engine,
+                 item_touch_request *requests, size_t nrequests,
+                 uint32_t exptime, uint16_t frac) {
+    struct batch_slot *slots = malloc(nrequests * sizeof(*slots));
+    size_t ii;
+
+    if (slots == NULL) {
+        for (ii = 0; ii < nrequests; ++ii) {
+            uint32_t hv = engine->server.core->hash(requests[ii].key,
+                                                    requests[ii].nkey, 0);
+            item_lock(engine, hv);
+            do_touch_request(engine, &requests[ii], exptime, frac, hv);
+            item_unlock(engine, hv);
+        }
+        return;
+    }
+
+    for (ii = 0; ii < nrequests; ++ii) {
+        slots[ii].hv = engine->server.core->hash(requests[ii].key,
+                                                 requests[ii].nkey, 0);
+        slots[ii].stripe = slots[ii].hv & engine->items.item_lock_mask;
+        slots[ii].idx = ii;
+    }
+    qsort(slots, nrequests, sizeof(*slots), batch_slot_compare);
+
+    ii = 0;
+    while (ii < nrequests) {
+        uint32_t hv = slots[ii].hv;
+        item_lock(engine, hv);
+        do {
+            do_touch_request(engine, &requests[slots[ii].idx],
+                             exptime, frac, slots[ii].hv);
+            ++ii;
+        } while (ii < nrequests && slots[ii].stripe == slots[ii - 1].stripe);
+        item_unlock(engine, hv);
+    }
+    free(slots);
+}
+
 /*
- * Flushes expired items after a flush_all call
+ * Flushes expired items after a flush_all call. An immediate flush only
+ * moves the markers item_is_flushed checks; the flushed items are then
+ * dropped as they are looked up (or reach the tail of their LRU), and
+ * reclaimed in the background by the flush reclaimer. Without CAS the
+ * items of the current second can't be told apart from the ones stored
+ * after the flush, so they are unlinked right away with all of the item
+ * locks held.
  */
 void item_flush_expired(struct default_engine *engine, time_t when) {
     int i;
     hash_item *iter, *next;
 
-    cb_mutex_enter(&engine->cache_lock);
+    if (when == 0 && engine->config.use_cas) {
+        rel_time_t current_time = engine->server.core->get_current_time();
+        engine->config.flush_cas = get_current_cas_id(engine);
+        /* Nothing may see the new oldest_live with the old flush_cas */
+        __sync_synchronize();
+        engine->config.oldest_live = current_time > 0 ? current_time - 1 : 0;
+        item_flush_reclaim(engine);
+        return;
+    }
+
+    item_lock_all(engine);
 
     if (when == 0) {
         engine->config.oldest_live = engine->server.core->get_current_time() - 1;
@@ -938,6 +2543,7 @@ void item_flush_expired(struct default_engine *engine, time_t when) {
 
     if (engine->config.oldest_live != 0) {
         for (i = 0; i < POWER_LARGEST; i++) {
+            item_lru_lock(engine, i);
             /*
              * The LRU is sorted in decreasing time order, and an item's
              * timestamp is never newer than its last access time, so we
@@ -947,18 +2553,20 @@ void item_flush_expired(struct default_engine *engine, time_t when) {
              */
             for (iter = engine->items.heads[i]; iter != NULL; iter = next) {
                 if (iter->time >= engine->config.oldest_live) {
-                    next = iter->next;
+                    next = item_next(engine, iter);
                     if ((iter->iflag & ITEM_SLABBED) == 0) {
-                        do_item_unlink(engine, iter);
+                        do_item_unlink_lru_locked(engine, iter);
                     }
                 } else {
                     /* We've hit the first old item. Continue to the next queue. */
                     break;
                 }
             }
+            item_lru_unlock(engine, i);
         }
     }
-    cb_mutex_exit(&engine->cache_lock);
+    item_unlock_all(engine);
+    item_flush_reclaim(engine);
 }
 
 /*
@@ -968,148 +2576,1238 @@ char *item_cachedump(struct default_engine *engine,
                      const unsigned int slabs_clsid,
                      const unsigned int limit,
                      unsigned int *bytes) {
-    char *ret;
-
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_item_cachedump(slabs_clsid, limit, bytes);
-    cb_mutex_exit(&engine->cache_lock);
-    return ret;
+    (void)engine;
+    return do_item_cachedump(slabs_clsid, limit, bytes);
 }
 
 void item_stats(struct default_engine *engine,
                    ADD_STAT add_stat, const void *cookie)
 {
-    cb_mutex_enter(&engine->cache_lock);
     do_item_stats(engine, add_stat, cookie);
-    cb_mutex_exit(&engine->cache_lock);
 }
 
 
 void item_stats_sizes(struct default_engine *engine,
                       ADD_STAT add_stat, const void *cookie)
 {
-    cb_mutex_enter(&engine->cache_lock);
     do_item_stats_sizes(engine, add_stat, cookie);
-    cb_mutex_exit(&engine->cache_lock);
 }
 
-static void do_item_link_cursor(struct default_engine *engine,
-                                hash_item *cursor, int ii)
+/* A histogram as <id>:<name>:<low end of the bucket>, without the empty */
+static void item_stats_histogram(const unsigned int *buckets, int id,
+                                 const char *name,
+                                 ADD_STAT add_stat, const void *cookie)
 {
-    cursor->slabs_clsid = (uint8_t)ii;
-    cursor->next = NULL;
-    cursor->prev = engine->items.tails[ii];
-    engine->items.tails[ii]->next = cursor;
-    engine->items.tails[ii] = cursor;
-    engine->items.sizes[ii]++;
+    char key[64], val[32];
+    int ii, klen, vlen;
+
+    for (ii = 0; ii < ITEM_AGE_BUCKETS; ++ii) {
+        if (buckets[ii] != 0) {
+            klen = snprintf(key, sizeof(key), "%d:%s:%u", id, name,
+                            ii == 0 ? 0 : 1u << (ii - 1));
+            vlen = snprintf(val, sizeof(val), "%u", buckets[ii]);
+            add_stat(key, klen, val, vlen, cookie);
+        }
+    }
 }
 
-typedef ENGINE_ERROR_CODE (*ITERFUNC)(struct default_engine *engine,
-                                      hash_item *item, void *cookie);
-
-static bool do_item_walk_cursor(struct default_engine *engine,
-                                hash_item *cursor,
-                                int steplength,
-                                ITERFUNC itemfunc,
-                                void* itemdata,
-                                ENGINE_ERROR_CODE *error)
+void item_stats_ages(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie)
 {
-    int ii = 0;
-    *error = ENGINE_SUCCESS;
+    char key[64], val[32];
+    int id, klen, vlen;
 
-    while (cursor->prev != NULL && ii < steplength) {
-        /* Move cursor */
-        hash_item *ptr = cursor->prev;
+    if (engine->items.histograms == NULL) {
+        return;
+    }
+    vlen = snprintf(val, sizeof(val), "%u", engine->items.sample_mask + 1);
+    add_stat("sample", 6, val, vlen, cookie);
+
+    for (id = 0; id < POWER_LARGEST; ++id) {
+        item_histogram_t histogram;
+
+        /* The evictions are counted under the LRU lock */
+        item_lru_lock(engine, id);
+        histogram = engine->items.histograms[id];
+        item_lru_unlock(engine, id);
+        if (histogram.evicted == 0 && histogram.accessed == 0) {
+            continue;
+        }
+
+        klen = snprintf(key, sizeof(key), "%d:evicted", id);
+        vlen = snprintf(val, sizeof(val), "%u", histogram.evicted);
+        add_stat(key, klen, val, vlen, cookie);
+        klen = snprintf(key, sizeof(key), "%d:evicted_unfetched", id);
+        vlen = snprintf(val, sizeof(val), "%u", histogram.evicted_unfetched);
+        add_stat(key, klen, val, vlen, cookie);
+        item_stats_histogram(histogram.evicted_idle, id, "evicted_idle",
+                             add_stat, cookie);
+        klen = snprintf(key, sizeof(key), "%d:accessed", id);
+        vlen = snprintf(val, sizeof(val), "%u", histogram.accessed);
+        add_stat(key, klen, val, vlen, cookie);
+        klen = snprintf(key, sizeof(key), "%d:accessed_no_ttl", id);
+        vlen = snprintf(val, sizeof(val), "%u", histogram.accessed_no_ttl);
+        add_stat(key, klen, val, vlen, cookie);
+        item_stats_histogram(histogram.access_ttl, id, "access_ttl",
+                             add_stat, cookie);
+    }
+}
+
+/*
+ * Give the cursor a slot in items.cursors so compact items may link to
+ * it (the cursor keeps the index in its flags). Returns false if all of
+ * the slots are in use.
+ */
+static bool item_register_cursor(struct default_engine *engine,
+                                 hash_item *cursor)
+{
+    bool ret = false;
+    uint32_t ii;
+
+    if (!engine->config.compact_items) {
+        return true;
+    }
+
+    cb_mutex_enter(&engine->items.cursor_lock);
+    for (ii = 0; ii < ITEM_MAX_CURSORS && !ret; ++ii) {
+        if (engine->items.cursors[ii] == NULL) {
+            engine->items.cursors[ii] = cursor;
+            cursor->flags = ii;
+            ret = true;
+        }
+    }
+    cb_mutex_exit(&engine->items.cursor_lock);
+    return ret;
+}
+
+/* The cursor must not be linked into an LRU */
+static void item_unregister_cursor(struct default_engine *engine,
+                                   hash_item *cursor)
+{
+    if (engine->config.compact_items) {
+        cb_mutex_enter(&engine->items.cursor_lock);
+        engine->items.cursors[cursor->flags] = NULL;
+        cb_mutex_exit(&engine->items.cursor_lock);
+    }
+}
+
+/* Caller must hold the LRU lock for slab class ii */
+static void do_item_link_cursor(struct default_engine *engine,
+                                hash_item *cursor, int ii)
+{
+    cursor->slabs_clsid = (uint8_t)ii;
+    item_set_next(engine, cursor, NULL);
+    item_set_prev(engine, cursor, engine->items.tails[ii]);
+    item_set_next(engine, engine->items.tails[ii], cursor);
+    engine->items.tails[ii] = cursor;
+    engine->items.sizes[ii]++;
+}
+
+/*
+ * Link the (unlinked) cursor at the tail of the first non-empty LRU
+ * starting at slab class ii. Returns false if there are no more items.
+ */
+static bool do_item_link_cursor_from(struct default_engine *engine,
+                                     hash_item *cursor, int ii)
+{
+    bool linked = false;
+    for (; ii < POWER_LARGEST && !linked; ++ii) {
+        item_lru_lock(engine, ii);
+        if (engine->items.heads[ii] != NULL) {
+            /* add the item at the tail */
+            do_item_link_cursor(engine, cursor, ii);
+            linked = true;
+        }
+        item_lru_unlock(engine, ii);
+    }
+    return linked;
+}
+
+typedef ENGINE_ERROR_CODE (*ITERFUNC)(struct default_engine *engine,
+                                      hash_item *item, void *cookie);
+
+/*
+ * Move the cursor up to steplength items towards the head of its LRU,
+ * calling itemfunc for each item passed. The caller must hold the LRU lock
+ * for the cursor's slab class; itemfunc is called with the item lock held
+ * as well. If an item is locked by someone else the walk stops early (and
+ * returns true) so the caller can drop the LRU lock and retry.
+ */
+static bool do_item_walk_cursor(struct default_engine *engine,
+                                hash_item *cursor,
+                                int steplength,
+                                ITERFUNC itemfunc,
+                                void* itemdata,
+                                ENGINE_ERROR_CODE *error)
+{
+    int ii = 0;
+    *error = ENGINE_SUCCESS;
+
+    while (item_prev(engine, cursor) != NULL && ii < steplength) {
+        /* Move cursor */
+        hash_item *ptr = item_prev(engine, cursor);
         bool done = false;
+        bool is_cursor = (ptr->nkey == 0 && ptr->nbytes == 0);
+        cb_mutex_t *lock = NULL;
+
+        if (!is_cursor) {
+            if ((lock = item_trylock_lru_item(engine, ptr, NULL)) == NULL) {
+                return true;
+            }
+        }
 
         ++ii;
         item_unlink_q(engine, cursor);
 
-        if (ptr == engine->items.heads[cursor->slabs_clsid]) {
-            done = true;
-            cursor->prev = NULL;
-        } else {
-            cursor->next = ptr;
-            cursor->prev = ptr->prev;
-            cursor->prev->next = cursor;
-            ptr->prev = cursor;
+        if (ptr == engine->items.heads[cursor->slabs_clsid]) {
+            done = true;
+            item_set_prev(engine, cursor, NULL);
+        } else {
+            hash_item *before = item_prev(engine, ptr);
+            item_set_next(engine, cursor, ptr);
+            item_set_prev(engine, cursor, before);
+            item_set_next(engine, before, cursor);
+            item_set_prev(engine, ptr, cursor);
+            engine->items.sizes[cursor->slabs_clsid]++;
+        }
+
+        /* Ignore cursors */
+        if (is_cursor) {
+            --ii;
+        } else {
+            *error = itemfunc(engine, ptr, itemdata);
+            item_unlock_lru_item(lock, NULL);
+            if (*error != ENGINE_SUCCESS) {
+                return false;
+            }
+        }
+
+        if (done) {
+            return false;
+        }
+    }
+
+    if (item_prev(engine, cursor) == NULL &&
+        engine->items.heads[cursor->slabs_clsid] == cursor) {
+        /* Everything in front of the cursor was unlinked behind our back */
+        item_unlink_q(engine, cursor);
+    }
+
+    return (item_prev(engine, cursor) != NULL);
+}
+
+static ENGINE_ERROR_CODE item_scrub(struct default_engine *engine,
+                                    hash_item *item,
+                                    void *cookie) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    (void)cookie;
+    engine->scrubber.visited++;
+    if (item->refcount == 0 &&
+        (item->exptime != 0 && item->exptime < current_time)) {
+        do_item_unlink_lru_locked(engine, item);
+        engine->scrubber.cleaned++;
+    }
+    return ENGINE_SUCCESS;
+}
+
+static void item_scrub_class(struct default_engine *engine,
+                             hash_item *cursor) {
+
+    ENGINE_ERROR_CODE ret;
+    bool more;
+    do {
+        unsigned int id = cursor->slabs_clsid;
+        item_lru_lock(engine, id);
+        if (engine_task_cancelled(engine)) {
+            /* The engine is going away, stop half way through the LRU */
+            item_unlink_q(engine, cursor);
+            ret = ENGINE_FAILED;
+            more = false;
+        } else {
+            more = do_item_walk_cursor(engine, cursor, 200, item_scrub,
+                                       NULL, &ret);
+        }
+        item_lru_unlock(engine, id);
+        if (ret != ENGINE_SUCCESS) {
+            break;
+        }
+    } while (more);
+}
+
+static void item_scubber_main(void *arg)
+{
+    struct default_engine *engine = arg;
+    hash_item cursor;
+    int ii;
+
+    memset(&cursor, 0, sizeof(cursor));
+    cursor.refcount = 1;
+    if (!item_register_cursor(engine, &cursor)) {
+        ii = POWER_LARGEST;
+    } else {
+        ii = 0;
+    }
+    for (; ii < POWER_LARGEST; ++ii) {
+        bool skip = false;
+        item_lru_lock(engine, ii);
+        if (engine->items.heads[ii] == NULL) {
+            skip = true;
+        } else {
+            /* add the item at the tail */
+            do_item_link_cursor(engine, &cursor, ii);
+        }
+        item_lru_unlock(engine, ii);
+
+        if (!skip) {
+            item_scrub_class(engine, &cursor);
+        }
+    }
+    item_unregister_cursor(engine, &cursor);
+
+    cb_mutex_enter(&engine->scrubber.lock);
+    engine->scrubber.stopped = time(NULL);
+    engine->scrubber.running = false;
+    cb_mutex_exit(&engine->scrubber.lock);
+}
+
+/*
+ * Walk from the tail of the LRU for the given slab class (with the LRU
+ * lock held), moving active items back to the head and reclaiming
+ * expired ones. Stops at the first item which needs no work.
+ */
+static void do_item_lru_maintain_class(struct default_engine *engine,
+                                       unsigned int id) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    hash_item *search, *prev;
+    int tries;
+
+    for (search = engine->items.tails[id], tries = search_items;
+         search != NULL && tries > 0;
+         search = prev, --tries) {
+        cb_mutex_t *lock;
+        prev = item_prev(engine, search);
+
+        /* Ignore cursors */
+        if (search->nkey == 0 && search->nbytes == 0) {
+            continue;
+        }
+        if ((lock = item_trylock_lru_item(engine, search, NULL)) == NULL) {
+            continue;
+        }
+
+        if (search->refcount == 0 &&
+            (item_is_flushed(engine, search, current_time) ||
+             (search->exptime != 0 && search->exptime < current_time))) {
+            engine->items.itemstats[id].reclaimed++;
+            cb_mutex_enter(&engine->stats.lock);
+            engine->stats.reclaimed++;
+            cb_mutex_exit(&engine->stats.lock);
+            do_item_unlink_lru_locked(engine, search);
+        } else if ((search->iflag & ITEM_ACTIVE) != 0) {
+            do_item_lru_bump(engine, search, current_time);
+        } else if (search->refcount == 0) {
+            item_unlock_lru_item(lock, NULL);
+            break;
+        }
+        item_unlock_lru_item(lock, NULL);
+    }
+}
+
+/*
+ * Evict up to want items from the tail of the LRU for the given slab class
+ * (with the LRU lock held), putting their chunks straight on the free list
+ * of the class so any allocation can take them. Returns how many it got.
+ */
+static unsigned int do_item_lru_reserve_class(struct default_engine *engine,
+                                              unsigned int id,
+                                              unsigned int want) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    hash_item *search, *prev;
+    unsigned int ret = 0;
+    unsigned int bumped = 0;
+    int tries;
+
+    for (search = engine->items.tails[id], tries = search_items;
+         search != NULL && tries > 0 && ret < want;
+         search = prev, --tries) {
+        cb_mutex_t *lock;
+        size_t ntotal;
+        prev = item_prev(engine, search);
+
+        /* Ignore cursors */
+        if (search->nkey == 0 && search->nbytes == 0) {
+            continue;
+        }
+        if (search->refcount != 0 ||
+            (lock = item_trylock_lru_item(engine, search, NULL)) == NULL) {
+            continue;
+        }
+        if (search->refcount != 0) {
+            item_unlock_lru_item(lock, NULL);
+            continue;
+        }
+
+        if ((search->iflag & ITEM_ACTIVE) != 0 &&
+            (search->exptime == 0 || search->exptime > current_time)) {
+            /* Not counted as a try, as in do_item_alloc() */
+            do_item_lru_bump(engine, search, current_time);
+            item_unlock_lru_item(lock, NULL);
+            if (bumped++ < engine->items.sizes[id]) {
+                ++tries;
+            }
+            if (prev == NULL) {
+                prev = search;
+            }
+            continue;
+        }
+        item_count_eviction(engine, search,
+                            search->exptime != 0 &&
+                            search->exptime <= current_time, current_time);
+        if (search->exptime == 0 || search->exptime > current_time) {
+            engine->items.itemstats[id].evicted++;
+            engine->items.itemstats[id].evicted_time = current_time - search->time;
+            if (search->exptime != 0) {
+                engine->items.itemstats[id].evicted_nonzero++;
+            }
+            cb_mutex_enter(&engine->stats.lock);
+            engine->stats.evictions++;
+            cb_mutex_exit(&engine->stats.lock);
+            /* No stat->evicting(), there is no connection to charge */
+        } else {
+            engine->items.itemstats[id].reclaimed++;
+            cb_mutex_enter(&engine->stats.lock);
+            engine->stats.reclaimed++;
+            cb_mutex_exit(&engine->stats.lock);
+        }
+        engine->items.itemstats[id].reserved++;
+
+        /* Hold on to the chunk so it isn't freed into a magazine */
+        search->refcount = 1;
+        do_item_unlink_lru_locked(engine, search);
+        ntotal = ITEM_ntotal(engine, search);
+        item_free_chain(engine, search);
+        search->refcount = 0;
+        search->slabs_clsid = 0;
+        slabs_free(engine, search, ntotal, id);
+        item_unlock_lru_item(lock, NULL);
+        ++ret;
+    }
+    return ret;
+}
+
+/*
+ * Keep config.evict_reserve free chunks (at most a page worth) in every
+ * slab class once the memory is full, so the allocations seldom have to
+ * evict themselves.
+ */
+static void item_lru_reserve(struct default_engine *engine, unsigned int id) {
+    unsigned int want = (unsigned int)engine->config.evict_reserve;
+    unsigned int avail;
+
+    if (want > engine->slabs.slabclass[id].perslab) {
+        want = engine->slabs.slabclass[id].perslab;
+    }
+    while ((avail = slabs_available(engine, id)) < want) {
+        unsigned int got;
+        item_lru_lock(engine, id);
+        got = engine->items.tails[id] == NULL ? 0 :
+            do_item_lru_reserve_class(engine, id, want - avail);
+        item_lru_unlock(engine, id);
+        if (got == 0) {
+            break;
+        }
+    }
+}
+
+static void item_lru_maintainer_main(void *arg)
+{
+    struct default_engine *engine = arg;
+
+    engine_thread_started(engine);
+    cb_mutex_enter(&engine->items.maintainer_lock);
+    while (engine->items.maintainer_running) {
+        unsigned int ii;
+        cb_mutex_exit(&engine->items.maintainer_lock);
+
+        for (ii = 0; ii < POWER_LARGEST; ++ii) {
+            if (engine->config.lru_maintainer) {
+                item_lru_lock(engine, ii);
+                if (engine->items.tails[ii] != NULL) {
+                    do_item_lru_maintain_class(engine, ii);
+                }
+                item_lru_unlock(engine, ii);
+            }
+            if (engine->config.evict_reserve != 0 &&
+                engine->config.evict_to_free) {
+                item_lru_reserve(engine, ii);
+            }
+        }
+
+        cb_mutex_enter(&engine->items.maintainer_lock);
+        if (engine->items.maintainer_running) {
+            cb_cond_timedwait(&engine->items.maintainer_cond,
+                              &engine->items.maintainer_lock,
+                              LRU_MAINTAINER_INTERVAL);
+        }
+    }
+    cb_mutex_exit(&engine->items.maintainer_lock);
+}
+
+bool item_start_lru_maintainer(struct default_engine *engine)
+{
+    bool ret = true;
+    cb_mutex_enter(&engine->items.maintainer_lock);
+    if (!engine->items.maintainer_running) {
+        engine->items.maintainer_running = true;
+        if (cb_create_thread(&engine->items.maintainer_tid,
+                             item_lru_maintainer_main, engine, 0) != 0) {
+            engine->items.maintainer_running = false;
+            ret = false;
+        }
+    }
+    cb_mutex_exit(&engine->items.maintainer_lock);
+    return ret;
+}
+
+void item_stop_lru_maintainer(struct default_engine *engine)
+{
+    bool running;
+    cb_mutex_enter(&engine->items.maintainer_lock);
+    running = engine->items.maintainer_running;
+    engine->items.maintainer_running = false;
+    cb_cond_signal(&engine->items.maintainer_cond);
+    cb_mutex_exit(&engine->items.maintainer_lock);
+
+    if (running) {
+        cb_join_thread(engine->items.maintainer_tid);
+    }
+}
+
+/* The most items looked at with an LRU lock held by the flush reclaimer */
+#define FLUSH_RECLAIM_SLICE 200
+
+/* How often the flush reclaimer checks if a delayed flush is due (ms) */
+#define FLUSH_RECLAIM_INTERVAL 1000
+
+struct flush_reclaim_slice {
+    rel_time_t current_time;
+    uint64_t visited;
+    uint64_t reclaimed;
+};
+
+static ENGINE_ERROR_CODE item_reclaim_flushed(struct default_engine *engine,
+                                              hash_item *item,
+                                              void *cookie) {
+    struct flush_reclaim_slice *slice = cookie;
+    ++slice->visited;
+    if (item->refcount == 0 &&
+        item_is_flushed(engine, item, slice->current_time)) {
+        do_item_unlink_lru_locked(engine, item);
+        ++slice->reclaimed;
+    }
+    return ENGINE_SUCCESS;
+}
+
+/*
+ * Walk every LRU from the tail with a cursor, reclaiming the flushed
+ * items FLUSH_RECLAIM_SLICE at a time, so the LRU lock is only held for
+ * short stretches. Gives up early when the reclaimer is stopped.
+ */
+static void item_flush_reclaim_pass(struct default_engine *engine)
+{
+    hash_item cursor;
+    bool running = true;
+    int ii;
+
+    memset(&cursor, 0, sizeof(cursor));
+    cursor.refcount = 1;
+    if (!item_register_cursor(engine, &cursor)) {
+        /* The flushed items are still dropped as they are looked at */
+        return;
+    }
+
+    for (ii = 0; ii < POWER_LARGEST && running; ++ii) {
+        ENGINE_ERROR_CODE ret;
+        bool more;
+
+        item_lru_lock(engine, ii);
+        more = engine->items.heads[ii] != NULL;
+        if (more) {
+            do_item_link_cursor(engine, &cursor, ii);
+        }
+        item_lru_unlock(engine, ii);
+
+        while (more) {
+            struct flush_reclaim_slice slice;
+            slice.current_time = engine->server.core->get_current_time();
+            slice.visited = slice.reclaimed = 0;
+
+            item_lru_lock(engine, ii);
+            if (running) {
+                more = do_item_walk_cursor(engine, &cursor,
+                                           FLUSH_RECLAIM_SLICE,
+                                           item_reclaim_flushed, &slice,
+                                           &ret);
+            } else {
+                /* Stopped half way through the LRU */
+                item_unlink_q(engine, &cursor);
+                more = false;
+            }
+            item_lru_unlock(engine, ii);
+
+            cb_mutex_enter(&engine->items.reclaim_lock);
+            engine->items.reclaim_visited += slice.visited;
+            engine->items.reclaim_reclaimed += slice.reclaimed;
+            running = engine->items.reclaim_running;
+            cb_mutex_exit(&engine->items.reclaim_lock);
+        }
+    }
+    item_unregister_cursor(engine, &cursor);
+}
+
+static void item_flush_reclaimer_main(void *arg)
+{
+    struct default_engine *engine = arg;
+
+    engine_thread_started(engine);
+    cb_mutex_enter(&engine->items.reclaim_lock);
+    while (engine->items.reclaim_running) {
+        rel_time_t current_time = engine->server.core->get_current_time();
+        if (engine->items.reclaim_pending &&
+            engine->config.oldest_live <= current_time) {
+            engine->items.reclaim_pending = false;
+            engine->items.reclaim_active = true;
+            cb_mutex_exit(&engine->items.reclaim_lock);
+
+            item_flush_reclaim_pass(engine);
+
+            cb_mutex_enter(&engine->items.reclaim_lock);
+            engine->items.reclaim_active = false;
+            ++engine->items.reclaim_passes;
+        } else {
+            cb_cond_timedwait(&engine->items.reclaim_cond,
+                              &engine->items.reclaim_lock,
+                              FLUSH_RECLAIM_INTERVAL);
+        }
+    }
+    cb_mutex_exit(&engine->items.reclaim_lock);
+}
+
+/*
+ * Have the flush reclaimer walk the LRUs (again) once the last flush is
+ * due, starting it on the first flush.
+ */
+static void item_flush_reclaim(struct default_engine *engine)
+{
+    cb_mutex_enter(&engine->items.reclaim_lock);
+    engine->items.reclaim_pending = true;
+    if (!engine->items.reclaim_running) {
+        engine->items.reclaim_running = true;
+        if (cb_create_thread(&engine->items.reclaim_tid,
+                             item_flush_reclaimer_main, engine, 0) != 0) {
+            EXTENSION_LOGGER_DESCRIPTOR *logger;
+            logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Failed to start the flush reclaimer; flushed items"
+                        " are only dropped as they are looked at\n");
+            engine->items.reclaim_running = false;
+        }
+    }
+    cb_cond_signal(&engine->items.reclaim_cond);
+    cb_mutex_exit(&engine->items.reclaim_lock);
+}
+
+ENGINE_ERROR_CODE item_delete_namespace(struct default_engine *engine,
+                                        const void *prefix, uint16_t nprefix,
+                                        bool reclaim, uint64_t *nitems)
+{
+    ENGINE_ERROR_CODE ret = namespace_delete(engine, prefix, nprefix,
+                                             get_current_cas_id(engine),
+                                             nitems);
+    if (ret == ENGINE_SUCCESS && reclaim) {
+        item_flush_reclaim(engine);
+    }
+    return ret;
+}
+
+void item_reclaim_namespaces(struct default_engine *engine)
+{
+    if (namespaces_deleted(engine)) {
+        item_flush_reclaim_pass(engine);
+    }
+}
+
+void item_stop_flush_reclaimer(struct default_engine *engine)
+{
+    bool running;
+    cb_mutex_enter(&engine->items.reclaim_lock);
+    running = engine->items.reclaim_running;
+    engine->items.reclaim_running = false;
+    cb_cond_signal(&engine->items.reclaim_cond);
+    cb_mutex_exit(&engine->items.reclaim_lock);
+
+    if (running) {
+        cb_join_thread(engine->items.reclaim_tid);
+    }
+}
+
+void item_flush_reclaim_stats(struct default_engine *engine,
+                              ADD_STAT add_stat, const void *cookie)
+{
+    char val[32];
+    int len;
+
+    cb_mutex_enter(&engine->items.reclaim_lock);
+    if (engine->items.reclaim_active) {
+        add_stat("flush_reclaim:status", 20, "running", 7, cookie);
+    } else if (engine->items.reclaim_pending &&
+               engine->items.reclaim_running) {
+        add_stat("flush_reclaim:status", 20, "pending", 7, cookie);
+    } else {
+        add_stat("flush_reclaim:status", 20, "idle", 4, cookie);
+    }
+    len = sprintf(val, "%"PRIu64, engine->items.reclaim_passes);
+    add_stat("flush_reclaim:passes", 20, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, engine->items.reclaim_visited);
+    add_stat("flush_reclaim:visited", 21, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, engine->items.reclaim_reclaimed);
+    add_stat("flush_reclaim:reclaimed", 23, val, len, cookie);
+    cb_mutex_exit(&engine->items.reclaim_lock);
+}
+
+item_expired_t item_reclaim_expired(struct default_engine *engine,
+                                    hash_item *it, uint32_t hv)
+{
+    rel_time_t current_time = engine->server.core->get_current_time();
+    item_expired_t ret = ITEM_EXPIRED_STALE;
+
+    item_lock(engine, hv);
+    if (assoc_contains(engine, hv, it) &&
+        it->exptime != 0 && it->exptime <= current_time) {
+        if (it->refcount == 0) {
+            do_item_unlink(engine, it);
+            ret = ITEM_EXPIRED_RECLAIMED;
+        } else {
+            ret = ITEM_EXPIRED_BUSY;
+        }
+    }
+    item_unlock(engine, hv);
+
+    if (ret == ITEM_EXPIRED_RECLAIMED) {
+        cb_mutex_enter(&engine->stats.lock);
+        engine->stats.reclaimed++;
+        cb_mutex_exit(&engine->stats.lock);
+    }
+    return ret;
+}
+
+bool item_unlink_vbucket_item(struct default_engine *engine, hash_item *it,
+                              uint32_t hv, uint16_t vbucket)
+{
+    bool ret = false;
+
+    item_lock(engine, hv);
+    if (assoc_contains(engine, hv, it) && item_get_vbucket(it) == vbucket) {
+        do_item_unlink(engine, it);
+        ret = true;
+    }
+    item_unlock(engine, hv);
+    return ret;
+}
+
+bool item_unlink_for_reassign(struct default_engine *engine,
+                              hash_item *it, size_t chunk_size)
+{
+    uint32_t hv;
+    bool ret = false;
+
+    /*
+     * The page mover doesn't hold any locks while looking at the chunk,
+     * so the key may be garbage if the item isn't linked. It is only
+     * trusted once we hold the item lock and the item is still linked
+     * under the same hash value.
+     */
+    if ((it->iflag & ITEM_LINKED) == 0 ||
+        item_header_size(engine) + it->nkey > chunk_size) {
+        return false;
+    }
+
+    hv = item_hash(engine, it);
+    item_lock(engine, hv);
+    if ((it->iflag & ITEM_LINKED) != 0 && it->refcount == 0 &&
+        item_hash(engine, it) == hv) {
+        do_item_unlink(engine, it);
+        ret = true;
+    }
+    item_unlock(engine, hv);
+    return ret;
+}
+
+bool item_relocate_for_compact(struct default_engine *engine,
+                               hash_item *it, size_t chunk_size,
+                               void *chunk)
+{
+    hash_item *new_it = chunk;
+    uint32_t hv;
+    bool ret = false;
+
+    /* The key is only trusted under the item lock (see above) */
+    if ((it->iflag & ITEM_LINKED) == 0 ||
+        item_header_size(engine) + it->nkey > chunk_size) {
+        return false;
+    }
+
+    hv = item_hash(engine, it);
+    item_lock(engine, hv);
+    if ((it->iflag & ITEM_LINKED) != 0 && it->refcount == 0 &&
+        item_hash(engine, it) == hv) {
+        size_t ntotal = ITEM_ntotal(engine, it);
+
+        /* The chunks of a chained item go with its header */
+        memcpy(new_it, it, ntotal);
+        new_it->iflag &= ~ITEM_LINKED;
+        new_it->refcount = 0;
+        slabs_adjust_mem_requested(engine, it->slabs_clsid, 0, ntotal);
+
+        /* Keep it from being freed by the unlink */
+        it->refcount = 1;
+        do_item_swap(engine, it, new_it, false);
+        it->iflag &= ~ITEM_CHAINED;
+        it->refcount = 0;
+        item_free(engine, it);
+        ret = true;
+    }
+    item_unlock(engine, hv);
+    return ret;
+}
+
+unsigned int item_evicted(struct default_engine *engine, unsigned int id)
+{
+    unsigned int ret;
+    item_lru_lock(engine, id);
+    ret = engine->items.itemstats[id].evicted;
+    item_lru_unlock(engine, id);
+    return ret;
+}
+
+/*
+ * Put new_it in the place of it as the same version of the item, so it
+ * keeps the CAS (and, unless refresh is set, its age). The caller holds
+ * the item lock.
+ */
+static void do_item_swap(struct default_engine *engine, hash_item *it,
+                         hash_item *new_it, bool refresh)
+{
+    uint64_t cas = item_get_cas(it);
+    rel_time_t time = it->time;
+
+    item_set_vbucket(new_it, item_get_vbucket(it));
+    new_it->iflag |= it->iflag & ITEM_FETCHED;
+    do_item_unlink(engine, it);
+    do_item_link(engine, new_it, cas);
+    item_set_cas(NULL, NULL, new_it, cas);
+    if (!refresh) {
+        new_it->time = time;
+    }
+
+    cb_mutex_enter(&engine->stats.lock);
+    engine->stats.total_items -= 1;
+    cb_mutex_exit(&engine->stats.lock);
+}
+
+/* The most items moved to the extended storage from an LRU in a pass */
+#define EXT_FLUSH_TRIES 50
+
+struct ext_flush_entry {
+    hash_item *it;
+    uint64_t cas;
+    size_t offset;       /* of the value in the batch */
+};
+
+/*
+ * Replace the items in the batch, written to the extended storage at
+ * loc, with headers pointing there. The items changed since they were
+ * copied (or whose header can't be allocated) stay as they are.
+ */
+static uint64_t item_ext_swap_batch(struct default_engine *engine,
+                                    struct ext_flush_entry *batch, int n,
+                                    const struct ext_loc *loc, bool written)
+{
+    uint64_t swapped = 0;
+    int ii;
+
+    for (ii = 0; ii < n; ++ii) {
+        hash_item *it = batch[ii].it;
+        uint32_t hv = item_hash(engine, it);
+
+        item_lock(engine, hv);
+        if (written && (it->iflag & ITEM_LINKED) != 0 &&
+            item_get_cas(it) == batch[ii].cas) {
+            struct ext_loc where = *loc;
+            hash_item *header;
+
+            where.offset += batch[ii].offset;
+            header = do_item_alloc(engine, item_get_key(it), it->nkey,
+                                   it->flags, it->exptime, sizeof(where),
+                                   NULL, it->datatype);
+            if (header != NULL) {
+                memcpy(item_get_data(header), &where, sizeof(where));
+                header->iflag |= ITEM_EXTERNAL |
+                                 (it->iflag & ITEM_EXPTIME_FRAC);
+                header->nbytes = it->nbytes;
+                do_item_swap(engine, it, header, false);
+                do_item_release(engine, header);
+                ++swapped;
+            }
+        }
+        do_item_release(engine, it);
+        item_unlock(engine, hv);
+    }
+    return swapped;
+}
+
+void item_ext_flush(struct default_engine *engine)
+{
+    rel_time_t current_time = engine->server.core->get_current_time();
+    rel_time_t age = (rel_time_t)engine->config.ext_item_age;
+    size_t bufsize = engine->config.item_size_max;
+    struct ext_flush_entry batch[EXT_FLUSH_TRIES];
+    bool pressure;
+    char *buf;
+    unsigned int id;
+
+    /* Once memory is getting short, the age doesn't matter */
+    cb_mutex_enter(&engine->stats.lock);
+    pressure = engine->stats.curr_bytes >=
+        engine->config.maxbytes - engine->config.maxbytes / 8;
+    cb_mutex_exit(&engine->stats.lock);
+
+    if ((buf = malloc(bufsize)) == NULL) {
+        return;
+    }
+
+    for (id = POWER_SMALLEST; id < POWER_LARGEST; ++id) {
+        hash_item *search;
+        int tries = EXT_FLUSH_TRIES;
+        int n = 0;
+        size_t used = 0;
+        struct ext_loc loc;
+        bool written;
+        uint64_t swapped;
+
+        if (engine->items.tails[id] == NULL) {
+            continue;
+        }
+
+        item_lru_lock(engine, id);
+        for (search = engine->items.tails[id];
+             tries > 0 && search != NULL;
+             tries--, search = item_prev(engine, search)) {
+            cb_mutex_t *lock;
+
+            if (search->refcount != 0 ||
+                (search->iflag & (ITEM_EXTERNAL|ITEM_CHAINED)) != 0 ||
+                search->nbytes < engine->config.ext_item_min ||
+                used + search->nbytes > bufsize ||
+                (!pressure && current_time - search->time < age) ||
+                (search->exptime != 0 && search->exptime <= current_time) ||
+                item_is_flushed(engine, search, current_time)) {
+                continue;
+            }
+            if ((lock = item_trylock_lru_item(engine, search, NULL)) == NULL) {
+                continue;
+            }
+            if (search->refcount == 0 &&
+                (search->iflag & ITEM_LINKED) != 0) {
+                memcpy(buf + used, item_get_data(search), search->nbytes);
+                ++search->refcount;
+                batch[n].it = search;
+                batch[n].cas = item_get_cas(search);
+                batch[n].offset = used;
+                used += search->nbytes;
+                ++n;
+            }
+            item_unlock_lru_item(lock, NULL);
+        }
+        item_lru_unlock(engine, id);
+
+        if (n == 0) {
+            continue;
+        }
+
+        /* The items are ours to read until we drop the references */
+        written = ext_write(engine, buf, used, &loc);
+        swapped = item_ext_swap_batch(engine, batch, n, &loc, written);
+
+        cb_mutex_enter(&engine->ext.lock);
+        engine->ext.items_written += swapped;
+        cb_mutex_exit(&engine->ext.lock);
+    }
+    free(buf);
+}
+
+ENGINE_ERROR_CODE item_ext_load(struct default_engine *engine, hash_item *it)
+{
+    uint32_t hv = item_hash(engine, it);
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    hash_item *new_it;
+    char *value;
+
+    /* The header never changes, and we hold a reference to it */
+    value = item_get_value_copy(engine, it);
+
+    item_lock(engine, hv);
+    if ((it->iflag & ITEM_LINKED) == 0) {
+        /* Someone else got to it first */
+    } else if (value == NULL) {
+        /* The value was overwritten (or unreadable), drop the item */
+        do_item_unlink(engine, it);
+    } else if ((new_it = do_item_alloc(engine, item_get_key(it), it->nkey,
+                                       it->flags, it->exptime, it->nbytes,
+                                       NULL, it->datatype)) != NULL) {
+        memcpy(item_get_data(new_it), value, it->nbytes);
+        new_it->iflag |= it->iflag & ITEM_EXPTIME_FRAC;
+        do_item_swap(engine, it, new_it, true);
+        do_item_release(engine, new_it);
+    } else {
+        ret = ENGINE_ENOMEM;
+    }
+    item_unlock(engine, hv);
+
+    free(value);
+    return ret;
+}
+
+/* Whether an item found in the restart file is kept, with its times now */
+static bool item_restart_keep(struct default_engine *engine, hash_item *it,
+                              const struct restart_fixup *fixup) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    int64_t when;
+
+    if ((it->iflag & ITEM_EXTERNAL) != 0) {
+        /* The extended storage starts out empty */
+        return false;
+    }
+    if ((fixup->oldest_live != 0 && fixup->oldest_live <= fixup->shutdown &&
+         it->time <= fixup->oldest_live) ||
+        (fixup->flush_cas != 0 && item_get_cas(it) <= fixup->flush_cas)) {
+        return false;
+    }
+
+    when = (int64_t)it->time + fixup->time_delta;
+    it->time = when > 0 ? (rel_time_t)when : 0;
+    if (it->exptime != 0) {
+        when = (int64_t)it->exptime + fixup->time_delta;
+        if (when <= (int64_t)current_time) {
+            return false;
         }
+        it->exptime = (rel_time_t)when;
+    }
+    return true;
+}
 
-        /* Ignore cursors */
-        if (ptr->nkey == 0 && ptr->nbytes == 0) {
-            --ii;
-        } else {
-            *error = itemfunc(engine, ptr, itemdata);
-            if (*error != ENGINE_SUCCESS) {
-                return false;
+void item_restart_chunk(struct default_engine *engine, int pass,
+                        hash_item *it, unsigned int id,
+                        const struct restart_fixup *fixup,
+                        struct restart_counts *counts) {
+    switch (pass) {
+    case 0:
+        /* Nothing refers to the chunk any more */
+        it->refcount = 0;
+        if ((it->iflag & ITEM_LINKED) != 0 &&
+            !item_restart_keep(engine, it, fixup)) {
+            /* Its chunks (if any) are left to be freed */
+            it->iflag &= ~(ITEM_LINKED|ITEM_CHAINED);
+            counts->dropped++;
+        }
+        break;
+
+    case 1:
+        /* The chunks of a chained item have one reference, its own */
+        if ((it->iflag & (ITEM_LINKED|ITEM_CHAINED)) ==
+            (ITEM_LINKED|ITEM_CHAINED)) {
+            hash_item **chain = item_get_chain(it);
+            uint32_t ii, nchunks = item_nchunks(engine, it->nkey, it->nbytes);
+            for (ii = 0; ii < nchunks; ++ii) {
+                chain[ii] = (hash_item*)((char*)chain[ii] + fixup->delta);
+                chain[ii]->refcount = 1;
+                slabs_adjust_mem_requested(engine, chain[ii]->slabs_clsid, 0,
+                                           ITEM_ntotal(engine, chain[ii]));
             }
         }
+        break;
 
-        if (done) {
-            return false;
+    case 2:
+        if ((it->iflag & ITEM_LINKED) != 0) {
+            uint32_t hv = item_hash(engine, it);
+            uint64_t cas = item_get_cas(it);
+
+            cb_assert(it->slabs_clsid == id);
+            item_lock(engine, hv);
+            assoc_insert(engine, hv, it);
+            expiry_add(engine, it, hv);
+            namespace_link(engine, it);
+            miss_filter_add(engine, hv);
+            vbucket_link(engine, it, item_bytes(engine, it));
+            item_lru_lock(engine, id);
+            item_link_q(engine, it);
+            item_lru_unlock(engine, id);
+            item_unlock(engine, hv);
+            slabs_adjust_mem_requested(engine, id, 0, ITEM_ntotal(engine, it));
+
+            item_size_count(engine, ITEM_ntotal(engine, it), 1);
+            counts->items++;
+            counts->bytes += item_bytes(engine, it);
+            if (cas > counts->max_cas) {
+                counts->max_cas = cas;
+            }
+        } else if (it->refcount == 0) {
+            /* Free, or in use by the last process */
+            it->iflag = 0;
+            it->slabs_clsid = 0;
+            slabs_free(engine, it, 0, id);
         }
+        break;
     }
+}
+
+void item_restart_done(struct default_engine *engine,
+                       const struct restart_counts *counts) {
+    /* The CAS values go on from the largest one found */
+    engine->items.cas_epoch = gethrtime() -
+        (hrtime_t)(counts->max_cas >> ITEM_CAS_SLOT_BITS) - 1;
 
-    return (cursor->prev != NULL);
+    cb_mutex_enter(&engine->stats.lock);
+    engine->stats.curr_bytes += counts->bytes;
+    engine->stats.curr_items += counts->items;
+    engine->stats.total_items += counts->items;
+    cb_mutex_exit(&engine->stats.lock);
 }
 
-static ENGINE_ERROR_CODE item_scrub(struct default_engine *engine,
-                                    hash_item *item,
-                                    void *cookie) {
-    rel_time_t current_time = engine->server.core->get_current_time();
-    (void)cookie;
-    engine->scrubber.visited++;
-    if (item->refcount == 0 &&
-        (item->exptime != 0 && item->exptime < current_time)) {
-        do_item_unlink(engine, item);
-        engine->scrubber.cleaned++;
+struct item_snapshot_slice {
+    struct default_engine *engine;
+    rel_time_t current_time;
+    hash_item **items;
+    size_t nitems;
+    size_t size;
+    bool enomem;
+};
+
+static void item_snapshot_add(hash_item *it, void *arg) {
+    struct item_snapshot_slice *slice = arg;
+
+    if ((it->exptime != 0 && it->exptime <= slice->current_time) ||
+        item_is_flushed(slice->engine, it, slice->current_time) ||
+        slice->enomem) {
+        return;
     }
-    return ENGINE_SUCCESS;
+    if (slice->nitems == slice->size) {
+        size_t size = slice->size ? slice->size * 2 : 64;
+        hash_item **items = realloc(slice->items, size * sizeof(*items));
+        if (items == NULL) {
+            slice->enomem = true;
+            return;
+        }
+        slice->items = items;
+        slice->size = size;
+    }
+    slice->items[slice->nitems++] = it;
+    ++it->refcount;
 }
 
-static void item_scrub_class(struct default_engine *engine,
-                             hash_item *cursor) {
+struct item_slice_walk {
+    struct default_engine *engine;
+    rel_time_t current_time;
+    void (*fn)(struct default_engine *engine, hash_item *it, void *arg);
+    void *arg;
+};
 
-    ENGINE_ERROR_CODE ret;
-    bool more;
-    do {
-        cb_mutex_enter(&engine->cache_lock);
-        more = do_item_walk_cursor(engine, cursor, 200, item_scrub, NULL, &ret);
-        cb_mutex_exit(&engine->cache_lock);
-        if (ret != ENGINE_SUCCESS) {
-            break;
-        }
-    } while (more);
+static void item_slice_walk_live(hash_item *it, void *arg) {
+    struct item_slice_walk *walk = arg;
+
+    if ((it->exptime == 0 || it->exptime > walk->current_time) &&
+        !item_is_flushed(walk->engine, it, walk->current_time)) {
+        walk->fn(walk->engine, it, walk->arg);
+    }
 }
 
-static void item_scubber_main(void *arg)
+void item_walk_slice(struct default_engine *engine,
+                     uint32_t slice, uint32_t nslices,
+                     void (*fn)(struct default_engine *engine,
+                                hash_item *it, void *arg),
+                     void *arg)
 {
-    struct default_engine *engine = arg;
-    hash_item cursor;
-    int ii;
+    struct item_slice_walk walk;
+    uint32_t stripe = slice & engine->items.item_lock_mask;
 
-    memset(&cursor, 0, sizeof(cursor));
-    cursor.refcount = 1;
-    for (ii = 0; ii < POWER_LARGEST; ++ii) {
-        bool skip = false;
-        cb_mutex_enter(&engine->cache_lock);
-        if (engine->items.heads[ii] == NULL) {
-            skip = true;
-        } else {
-            /* add the item at the tail */
-            do_item_link_cursor(engine, &cursor, ii);
-        }
-        cb_mutex_exit(&engine->cache_lock);
+    walk.engine = engine;
+    walk.current_time = engine->server.core->get_current_time();
+    walk.fn = fn;
+    walk.arg = arg;
 
-        if (!skip) {
-            item_scrub_class(engine, &cursor);
+    item_lock(engine, stripe);
+    assoc_walk_stripe(engine, slice, nslices, item_slice_walk_live, &walk);
+    item_unlock(engine, stripe);
+}
+
+ENGINE_ERROR_CODE item_snapshot_collect(struct default_engine *engine,
+                                        uint32_t slice, uint32_t nslices,
+                                        hash_item ***items, size_t *nitems)
+{
+    struct item_snapshot_slice collect;
+    uint32_t stripe = slice & engine->items.item_lock_mask;
+
+    memset(&collect, 0, sizeof(collect));
+    collect.engine = engine;
+    collect.current_time = engine->server.core->get_current_time();
+
+    /* The buckets of the slice are all guarded by the same stripe */
+    item_lock(engine, stripe);
+    assoc_walk_stripe(engine, slice, nslices, item_snapshot_add, &collect);
+    if (collect.enomem) {
+        size_t ii;
+        for (ii = 0; ii < collect.nitems; ++ii) {
+            do_item_release(engine, collect.items[ii]);
         }
     }
+    item_unlock(engine, stripe);
 
-    cb_mutex_enter(&engine->scrubber.lock);
-    engine->scrubber.stopped = time(NULL);
-    engine->scrubber.running = false;
-    cb_mutex_exit(&engine->scrubber.lock);
+    if (collect.enomem) {
+        free(collect.items);
+        return ENGINE_ENOMEM;
+    }
+    *items = collect.items;
+    *nitems = collect.nitems;
+    return ENGINE_SUCCESS;
+}
+
+/*
+ * The item to stream: the item itself, or for one in the extended storage
+ * a copy of it with its value read back (which isn't linked, so the item
+ * stays where it is). Takes over the caller's reference. Returns NULL if
+ * the value is lost or there is no memory for it.
+ */
+static hash_item *item_ext_resolve(struct default_engine *engine,
+                                   hash_item *it)
+{
+    hash_item *copy = NULL;
+    char *value;
+
+    if ((it->iflag & ITEM_EXTERNAL) == 0) {
+        return it;
+    }
+
+    if ((value = item_get_value_copy(engine, it)) != NULL &&
+        (copy = item_alloc(engine, item_get_key(it), it->nkey, it->flags,
+                           it->exptime, it->nbytes, NULL,
+                           it->datatype)) != NULL) {
+        memcpy(item_get_data(copy), value, it->nbytes);
+        copy->iflag |= it->iflag & ITEM_EXPTIME_FRAC;
+        item_set_cas(NULL, NULL, copy, item_get_cas(it));
+    }
+    free(value);
+    item_release(engine, it);
+    return copy;
 }
 
 bool item_start_scrub(struct default_engine *engine)
@@ -1117,16 +3815,14 @@ bool item_start_scrub(struct default_engine *engine)
     bool ret = false;
     cb_mutex_enter(&engine->scrubber.lock);
     if (!engine->scrubber.running) {
-        cb_thread_t t;
-
         engine->scrubber.started = time(NULL);
         engine->scrubber.stopped = 0;
         engine->scrubber.visited = 0;
         engine->scrubber.cleaned = 0;
         engine->scrubber.running = true;
 
-        if (cb_create_thread(&t, item_scubber_main, engine, 1) != 0)
-        {
+        if (!engine_run_task(engine, EXECUTOR_PRIORITY_LOW,
+                             item_scubber_main, engine)) {
             engine->scrubber.running = false;
         } else {
             ret = true;
@@ -1172,23 +3868,26 @@ static tap_event_t do_item_tap_walker(struct default_engine *engine,
     client->it = NULL;
 
     do {
-        if (!do_item_walk_cursor(engine, &client->cursor, 1, item_tap_iterfunc, client, &r)) {
+        unsigned int id = client->cursor.slabs_clsid;
+        bool more;
+        item_lru_lock(engine, id);
+        more = do_item_walk_cursor(engine, &client->cursor, 1,
+                                   item_tap_iterfunc, client, &r);
+        item_lru_unlock(engine, id);
+        if (client->it != NULL) {
+            client->it = item_ext_resolve(engine, client->it);
+        }
+        if (!more) {
             /* find next slab class to look at.. */
-            bool linked = false;
-            int ii;
-            for (ii = client->cursor.slabs_clsid + 1; ii < POWER_LARGEST && !linked;  ++ii) {
-                if (engine->items.heads[ii] != NULL) {
-                    /* add the item at the tail */
-                    do_item_link_cursor(engine, &client->cursor, ii);
-                    linked = true;
-                }
-            }
-            if (!linked) {
+            if (!do_item_link_cursor_from(engine, &client->cursor, id + 1)) {
                 break;
             }
         }
     } while (client->it == NULL);
     *itm = client->it;
+    if (client->it != NULL) {
+        *vbucket = item_get_vbucket(client->it);
+    }
 
     return (*itm == NULL) ? TAP_DISCONNECT : TAP_MUTATION;
 }
@@ -1199,132 +3898,484 @@ tap_event_t item_tap_walker(ENGINE_HANDLE* handle,
                             uint16_t *flags, uint32_t *seqno,
                             uint16_t *vbucket)
 {
-    tap_event_t ret;
     struct default_engine *engine = (struct default_engine*)handle;
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_item_tap_walker(engine, cookie, itm, es, nes, ttl, flags, seqno, vbucket);
-    cb_mutex_exit(&engine->cache_lock);
-
-    return ret;
+    return do_item_tap_walker(engine, cookie, itm, es, nes, ttl, flags,
+                              seqno, vbucket);
 }
 
 bool initialize_item_tap_walker(struct default_engine *engine,
                                 const void* cookie)
 {
-    bool linked = false;
-    int ii;
     struct tap_client *client = calloc(1, sizeof(*client));
     if (client == NULL) {
         return false;
     }
     client->cursor.refcount = 1;
+    if (!item_register_cursor(engine, &client->cursor)) {
+        free(client);
+        return false;
+    }
 
     /* Link the cursor! */
-    for (ii = 0; ii < POWER_LARGEST && !linked; ++ii) {
-        cb_mutex_enter(&engine->cache_lock);
-        if (engine->items.heads[ii] != NULL) {
-            /* add the item at the tail */
-            do_item_link_cursor(engine, &client->cursor, ii);
-            linked = true;
-        }
-        cb_mutex_exit(&engine->cache_lock);
-    }
+    do_item_link_cursor_from(engine, &client->cursor, 0);
 
     engine->server.cookie->store_engine_specific(cookie, client);
     return true;
 }
 
-void link_dcp_walker(struct default_engine *engine,
+bool link_dcp_walker(struct default_engine *engine,
                      struct dcp_connection *connection)
 {
-    bool linked = false;
-    int ii;
     connection->cursor.refcount = 1;
+    if (!item_register_cursor(engine, &connection->cursor)) {
+        return false;
+    }
 
     /* Link the cursor! */
-    for (ii = 0; ii < POWER_LARGEST && !linked; ++ii) {
-        cb_mutex_enter(&engine->cache_lock);
-        if (engine->items.heads[ii] != NULL) {
-            /* add the item at the tail */
-            do_item_link_cursor(engine, &connection->cursor, ii);
-            linked = true;
-        }
-        cb_mutex_exit(&engine->cache_lock);
-    }
+    do_item_link_cursor_from(engine, &connection->cursor, 0);
+    return true;
 }
 
 static ENGINE_ERROR_CODE item_dcp_iterfunc(struct default_engine *engine,
                                            hash_item *item,
                                            void *cookie) {
     struct dcp_connection *connection = cookie;
-    connection->it = item;
-    ++connection->it->refcount;
+    connection->batch[connection->nbatch++] = item;
+    ++item->refcount;
     return ENGINE_SUCCESS;
 }
 
-static ENGINE_ERROR_CODE do_item_dcp_step(struct default_engine *engine,
+/*
+ * Take the next batch of items off the LRUs, holding the LRU lock once
+ * for the whole batch. Returns false when there are no more items.
+ */
+static bool do_item_dcp_fill_batch(struct default_engine *engine,
+                                   struct dcp_connection *connection)
+{
+    connection->nbatch = connection->ibatch = 0;
+    while (connection->nbatch == 0) {
+        unsigned int id = connection->cursor.slabs_clsid;
+        ENGINE_ERROR_CODE ret;
+        bool more;
+        item_lru_lock(engine, id);
+        more = do_item_walk_cursor(engine, &connection->cursor,
+                                   DCP_STEP_BATCH, item_dcp_iterfunc,
+                                   connection, &ret);
+        item_lru_unlock(engine, id);
+        if (!more) {
+            /* find next slab class to look at.. */
+            if (!do_item_link_cursor_from(engine, &connection->cursor,
+                                          id + 1)) {
+                break;
+            }
+        }
+    }
+    return connection->nbatch != 0;
+}
+
+static ENGINE_ERROR_CODE do_item_dcp_send(struct default_engine *engine,
                                           struct dcp_connection *connection,
                                           const void *cookie,
-                                          struct dcp_message_producers *producers)
+                                          struct dcp_message_producers *producers,
+                                          hash_item **slot)
 {
-    ENGINE_ERROR_CODE ret = ENGINE_DISCONNECT;
+    rel_time_t current_time = engine->server.core->get_current_time();
+    hash_item *it = *slot;
+    ENGINE_ERROR_CODE ret;
 
-    while (connection->it == NULL) {
-        if (!do_item_walk_cursor(engine, &connection->cursor, 1,
-                                 item_dcp_iterfunc, connection, &ret)) {
-            /* find next slab class to look at.. */
-            bool linked = false;
-            int ii;
-            for (ii = connection->cursor.slabs_clsid + 1; ii < POWER_LARGEST && !linked;  ++ii) {
-                if (engine->items.heads[ii] != NULL) {
-                    /* add the item at the tail */
-                    do_item_link_cursor(engine, &connection->cursor, ii);
-                    linked = true;
-                }
+    if (it->exptime != 0 && it->exptime < current_time) {
+        ret = producers->expiration(cookie, connection->opaque,
+                                    item_get_key(it), it->nkey,
+                                    item_get_cas(it), 0, 0, 0, NULL, 0);
+        if (ret == ENGINE_SUCCESS) {
+            uint32_t hv = item_hash(engine, it);
+            item_lock(engine, hv);
+            do_item_unlink(engine, it);
+            do_item_release(engine, it);
+            item_unlock(engine, hv);
+        }
+    } else {
+        if ((it->iflag & ITEM_EXTERNAL) != 0) {
+            /* Send a copy with the value, skipping the item if it's lost */
+            if ((*slot = it = item_ext_resolve(engine, it)) == NULL) {
+                return ENGINE_SUCCESS;
+            }
+        }
+        /* The daemon keeps our reference until the mutation is sent. A
+           backfill goes by the CAS, which its snapshots are bounded by */
+        ret = producers->mutation(cookie, connection->opaque,
+                                  it, item_get_vbucket(it),
+                                  connection->backfill ? item_get_cas(it) : 0,
+                                  0, 0, NULL, 0, 0);
+    }
+    return ret;
+}
+
+bool link_dcp_backfill(struct default_engine *engine,
+                       struct dcp_connection *connection)
+{
+    connection->backfill = true;
+    /* Without the vbucket index the items don't know their vbucket */
+    connection->match_vbucket = engine->config.vbucket_index;
+    connection->backfill_done = false;
+    connection->enomem = false;
+    connection->stripe = 0;
+    connection->deferred = false;
+    connection->snap_start_seqno = connection->start_seqno;
+    connection->snap_end_seqno = get_current_cas_id(engine);
+    connection->marker_due = true;
+    connection->nslice = connection->islice = 0;
+    return true;
+}
+
+static void item_dcp_slice_add(hash_item *it, void *arg) {
+    struct dcp_connection *connection = arg;
+    uint64_t cas = item_get_cas(it);
+
+    if (connection->match_vbucket &&
+        item_get_vbucket(it) != connection->vbucket) {
+        return;
+    }
+    if (cas > connection->snap_end_seqno) {
+        /* Changed since the pass started; it goes in the next snapshot */
+        connection->deferred = true;
+        return;
+    }
+    if (cas < connection->snap_start_seqno) {
+        return;
+    }
+    if (connection->nslice == connection->slicesize) {
+        size_t size = connection->slicesize ? connection->slicesize * 2 : 64;
+        hash_item **slice = realloc(connection->slice, size * sizeof(*slice));
+        if (slice == NULL) {
+            connection->enomem = true;
+            return;
+        }
+        connection->slice = slice;
+        connection->slicesize = size;
+    }
+    connection->slice[connection->nslice++] = it;
+    ++it->refcount;
+}
+
+/*
+ * Take the items in the snapshot off the next item lock stripe, starting
+ * the next pass (and snapshot) once all of the stripes are walked. Only
+ * the one stripe is locked at a time, so the foreground traffic barely
+ * notices. Returns false when there is nothing to send right now: the
+ * backfill is done, or every item seen keeps changing under us (we
+ * don't start more than one new pass per call to keep the step short).
+ */
+static bool do_item_dcp_fill_slice(struct default_engine *engine,
+                                   struct dcp_connection *connection)
+{
+    uint32_t nstripes = engine->items.item_lock_mask + 1;
+    bool restarted = false;
+
+    connection->nslice = connection->islice = 0;
+    while (connection->nslice == 0) {
+        if (connection->stripe == nstripes) {
+            /* The stripes walked before the changes don't show them */
+            if (item_cas_since(engine, connection->snap_end_seqno)) {
+                connection->deferred = true;
+            }
+            if (!connection->deferred ||
+                (connection->end_seqno != 0 &&
+                 connection->snap_end_seqno >= connection->end_seqno)) {
+                connection->backfill_done = true;
+                return false;
             }
-            if (!linked) {
+            if (restarted) {
+                return false;
+            }
+            connection->snap_start_seqno = connection->snap_end_seqno + 1;
+            connection->snap_end_seqno = get_current_cas_id(engine);
+            connection->marker_due = true;
+            connection->deferred = false;
+            connection->stripe = 0;
+            restarted = true;
+        }
+
+        item_lock(engine, connection->stripe);
+        assoc_walk_stripe(engine, connection->stripe, nstripes,
+                          item_dcp_slice_add, connection);
+        item_unlock(engine, connection->stripe);
+        if (connection->enomem) {
+            /* We can't skip any of the stripe, so give up on the stream */
+            return false;
+        }
+        ++connection->stripe;
+    }
+    return true;
+}
+
+bool link_dcp_log(struct default_engine *engine,
+                  struct dcp_connection *connection)
+{
+    if (!seqlog_seek(engine, connection->vbucket, connection->start_seqno,
+                     &connection->log_pos)) {
+        return false;
+    }
+    connection->from_log = true;
+    connection->nlog = connection->ilog = 0;
+    connection->snap_end_seqno = connection->start_seqno;
+    return true;
+}
+
+/*
+ * Drop the logged changes of the batch which a later change of the same
+ * key makes redundant (we'd send the current state of the key for each
+ * of them). Returns the number of entries left, in their order.
+ */
+static int do_item_dcp_dedup(struct default_engine *engine,
+                             struct seqlog_entry *log, int nlog)
+{
+    int8_t slots[DCP_DEDUP_SLOTS];
+    bool keep[DCP_STEP_BATCH];
+    int ii, jj = 0;
+
+    memset(slots, 0xff, sizeof(slots));
+    for (ii = nlog - 1; ii >= 0; --ii) {
+        const struct seqlog_entry *entry = &log[ii];
+        uint32_t pos = engine->server.core->hash(entry->key, entry->nkey,
+                                                 entry->vbucket);
+        pos %= DCP_DEDUP_SLOTS;
+        keep[ii] = true;
+        while (slots[pos] != -1) {
+            const struct seqlog_entry *later = &log[slots[pos]];
+            if (later->vbucket == entry->vbucket &&
+                later->nkey == entry->nkey &&
+                memcmp(later->key, entry->key, entry->nkey) == 0) {
+                keep[ii] = false;
                 break;
             }
+            pos = (pos + 1) % DCP_DEDUP_SLOTS;
+        }
+        if (keep[ii]) {
+            slots[pos] = (int8_t)ii;
+        }
+    }
+
+    for (ii = 0; ii < nlog; ++ii) {
+        if (keep[ii]) {
+            if (jj != ii) {
+                log[jj] = log[ii];
+            }
+            ++jj;
         }
     }
+    return jj;
+}
 
-    if (connection->it != NULL) {
-        rel_time_t current_time = engine->server.core->get_current_time();
-        rel_time_t exptime = connection->it->exptime;
-
-        if (exptime != 0 && exptime < current_time) {
-            ret = producers->expiration(cookie, connection->opaque,
-                                        item_get_key(connection->it),
-                                        connection->it->nkey,
-                                        item_get_cas(connection->it),
-                                        0, 0, 0, NULL, 0);
+/*
+ * Send the current state of the key in the next logged change: the item
+ * if it's still there, or a deletion if it isn't.
+ */
+static ENGINE_ERROR_CODE do_item_dcp_send_logged(struct default_engine *engine,
+                                                 struct dcp_connection *connection,
+                                                 const void *cookie,
+                                                 struct dcp_message_producers *producers,
+                                                 const struct seqlog_entry *entry)
+{
+    ENGINE_ERROR_CODE ret;
+    hash_item *it = NULL;
+
+    if (!entry->deleted) {
+        it = item_get(engine, entry->key, entry->nkey);
+    }
+    if (it != NULL) {
+        it = item_ext_resolve(engine, it);
+    }
+    if (it == NULL) {
+        return producers->deletion(cookie, connection->opaque,
+                                   entry->key, entry->nkey, 0,
+                                   entry->vbucket, entry->seqno, 0, NULL, 0);
+    }
+
+    /* The daemon keeps our reference until the mutation is sent */
+    ret = producers->mutation(cookie, connection->opaque, it,
+                              entry->vbucket, entry->seqno, 0, 0, NULL, 0, 0);
+    if (ret != ENGINE_SUCCESS) {
+        item_release(engine, it);
+    }
+    return ret;
+}
+
+void item_dcp_release(struct default_engine *engine,
+                      struct dcp_connection *connection)
+{
+    for (; connection->ibatch < connection->nbatch; ++connection->ibatch) {
+        item_release(engine, connection->batch[connection->ibatch]);
+    }
+    for (; connection->islice < connection->nslice; ++connection->islice) {
+        item_release(engine, connection->slice[connection->islice]);
+    }
+    free(connection->slice);
+    connection->slice = NULL;
+    connection->nslice = connection->islice = connection->slicesize = 0;
+}
+
+/* Whether the stream holds items (or logged changes) still to be sent */
+static bool do_item_dcp_pending(const struct dcp_connection *connection)
+{
+    if (connection->from_log) {
+        return connection->ilog < connection->nlog;
+    }
+    if (connection->backfill) {
+        return connection->islice < connection->nslice;
+    }
+    return connection->ibatch < connection->nbatch;
+}
+
+ENGINE_ERROR_CODE item_dcp_prepare(struct default_engine *engine,
+                                   struct dcp_connection *connection)
+{
+    if (connection->from_log) {
+        if (connection->log_done) {
+            return ENGINE_DISCONNECT;
+        }
+        connection->ilog = 0;
+        connection->nlog = seqlog_read(engine, connection->vbucket,
+                                       &connection->log_pos,
+                                       connection->log, DCP_STEP_BATCH);
+        if (connection->nlog < 0) {
+            /* We fell behind the log, the consumer has to backfill */
+            connection->nlog = 0;
+            return ENGINE_ROLLBACK;
+        }
+        while (connection->end_seqno != 0 && connection->nlog > 0 &&
+               connection->log[connection->nlog - 1].seqno >=
+               connection->end_seqno) {
+            /* The log is in order, there is nothing more to send */
+            connection->log_done = true;
+            if (connection->log[connection->nlog - 1].seqno ==
+                connection->end_seqno) {
+                break;
+            }
+            --connection->nlog;
+        }
+        if (connection->nlog == 0) {
+            return connection->log_done ? ENGINE_DISCONNECT :
+                ENGINE_EWOULDBLOCK;
+        }
+        connection->nlog = do_item_dcp_dedup(engine, connection->log,
+                                             connection->nlog);
+        /* The last change logged is always kept, and carries the top seqno */
+        connection->snap_start_seqno = connection->snap_end_seqno + 1;
+        connection->snap_end_seqno =
+            connection->log[connection->nlog - 1].seqno;
+        connection->marker_due = true;
+        return ENGINE_SUCCESS;
+    }
+    if (connection->backfill) {
+        if (do_item_dcp_fill_slice(engine, connection)) {
+            return ENGINE_SUCCESS;
+        }
+        if (connection->enomem) {
+            return ENGINE_ENOMEM;
+        }
+        return connection->backfill_done ? ENGINE_DISCONNECT :
+            ENGINE_EWOULDBLOCK;
+    }
+    return do_item_dcp_fill_batch(engine, connection) ? ENGINE_SUCCESS :
+        ENGINE_DISCONNECT;
+}
+
+ENGINE_ERROR_CODE item_dcp_send_prepared(struct default_engine *engine,
+                                         struct dcp_connection *connection,
+                                         const void *cookie,
+                                         struct dcp_message_producers *producers,
+                                         int *sent)
+{
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    while (ret == ENGINE_SUCCESS && do_item_dcp_pending(connection)) {
+        if (connection->marker_due) {
+            /* A snapshot has to be taken as a whole */
+            ret = producers->marker(cookie, connection->opaque,
+                                    connection->vbucket,
+                                    connection->snap_start_seqno,
+                                    connection->snap_end_seqno,
+                                    connection->from_log ?
+                                    DCP_MARKER_FLAG_MEMORY :
+                                    DCP_MARKER_FLAG_DISK);
+            if (ret != ENGINE_SUCCESS) {
+                break;
+            }
+            connection->marker_due = false;
+            ++*sent;
+        }
+
+        if (connection->from_log) {
+            ret = do_item_dcp_send_logged(engine, connection, cookie,
+                                          producers,
+                                          &connection->log[connection->ilog]);
+            if (ret == ENGINE_SUCCESS) {
+                ++connection->ilog;
+                ++*sent;
+            }
+        } else if (connection->backfill) {
+            ret = do_item_dcp_send(engine, connection, cookie, producers,
+                                   &connection->slice[connection->islice]);
             if (ret == ENGINE_SUCCESS) {
-                do_item_unlink(engine, connection->it);
-                do_item_release(engine, connection->it);
+                ++connection->islice;
             }
         } else {
-            ret = producers->mutation(cookie, connection->opaque,
-                                      connection->it, 0, 0, 0, 0, NULL, 0, 0);
+            ret = do_item_dcp_send(engine, connection, cookie, producers,
+                                   &connection->batch[connection->ibatch]);
+            if (ret == ENGINE_SUCCESS) {
+                ++connection->ibatch;
+            }
         }
-
         if (ret == ENGINE_SUCCESS) {
-            connection->it = NULL;
+            ++*sent;
         }
-    } else {
-        return ENGINE_DISCONNECT;
     }
-
     return ret;
 }
 
+ENGINE_ERROR_CODE item_dcp_step_result(ENGINE_ERROR_CODE ret, int sent)
+{
+    if (ret == ENGINE_EWOULDBLOCK) {
+        /* Try again once the consumer talks to us */
+        ret = ENGINE_SUCCESS;
+    }
+    if (sent == 0 || ret == ENGINE_ROLLBACK) {
+        return ret;
+    }
+    return ret == ENGINE_E2BIG ? ENGINE_WANT_MORE : ENGINE_SUCCESS;
+}
+
+/*
+ * Send as many items as the daemon takes in one step; once its buffers
+ * are full (ENGINE_E2BIG) the rest is left for the next step.
+ */
+static ENGINE_ERROR_CODE do_item_dcp_step(struct default_engine *engine,
+                                          struct dcp_connection *connection,
+                                          const void *cookie,
+                                          struct dcp_message_producers *producers)
+{
+    ENGINE_ERROR_CODE ret;
+    int sent = 0;
+
+    do {
+        if (!do_item_dcp_pending(connection)) {
+            ret = item_dcp_prepare(engine, connection);
+            if (ret != ENGINE_SUCCESS) {
+                break;
+            }
+        }
+        ret = item_dcp_send_prepared(engine, connection, cookie, producers,
+                                     &sent);
+    } while (ret == ENGINE_SUCCESS);
+
+    return item_dcp_step_result(ret, sent);
+}
+
 ENGINE_ERROR_CODE item_dcp_step(struct default_engine *engine,
                                 struct dcp_connection *connection,
                                 const void *cookie,
                                 struct dcp_message_producers *producers)
 {
-    ENGINE_ERROR_CODE ret;
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_item_dcp_step(engine, connection, cookie, producers);
-    cb_mutex_exit(&engine->cache_lock);
-    return ret;
+    return do_item_dcp_step(engine, connection, cookie, producers);
 }
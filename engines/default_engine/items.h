@@ -6,9 +6,6 @@
  * functions.
  */
 typedef struct _hash_item {
-    struct _hash_item *next;
-    struct _hash_item *prev;
-    struct _hash_item *h_next; /* hash chain next */
     rel_time_t time;  /* least recent access */
     rel_time_t exptime; /**< When the item will expire (relative to process
                          * startup) */
@@ -16,13 +13,37 @@ typedef struct _hash_item {
     uint32_t flags; /**< Flags associated with the item (in network byte order)*/
     uint16_t nkey; /**< The total length of the key (in bytes) */
     uint16_t iflag; /**< Intermal flags. lower 8 bit is reserved for the core
-                     * server, the upper 8 bits is reserved for engine
-                     * implementation. */
+                     * server (bits 1-7 hold the sub-second expiry), the
+                     * upper 8 bits is reserved for engine implementation. */
     unsigned short refcount;
     uint8_t slabs_clsid;/* which slab class we're in */
     uint8_t datatype;/* to identify the type of the data */
+    /**
+     * The LRU and hash chain links. Compact items (config.compact_items)
+     * store 32 bit handles instead of pointers, and the key starts right
+     * after the handles. Use the item_next()/item_set_next() family of
+     * functions to access them.
+     */
+    union {
+        struct {
+            struct _hash_item *next;
+            struct _hash_item *prev;
+            struct _hash_item *h_next; /* hash chain next */
+        } ptr;
+        struct {
+            uint32_t next;
+            uint32_t prev;
+            uint32_t h_next;
+        } handle;
+    } link;
 } hash_item;
 
+/* The size of the header of a compact item */
+#define ITEM_COMPACT_HEADER_SIZE (offsetof(hash_item, link) + 3 * sizeof(uint32_t))
+
+/* The max number of cursors (tap, dcp, scrubber) for compact items */
+#define ITEM_MAX_CURSORS 4096
+
 typedef struct {
     unsigned int evicted;
     unsigned int evicted_nonzero;
@@ -30,15 +51,173 @@ typedef struct {
     unsigned int outofmemory;
     unsigned int tailrepairs;
     unsigned int reclaimed;
+    unsigned int bumped;
+    unsigned int kept;
+    unsigned int reserved;
+    unsigned int evicted_unfetched;  /* never read since they were stored */
+    unsigned int expired_unfetched;
 } itemstats_t;
 
+/*
+ * The sampled histograms of a slab class (see config.item_sample), in
+ * power of two buckets of seconds: bucket 0 holds 0, and bucket n (up to
+ * the last, which holds the rest) from 2^(n-1) to 2^n - 1.
+ */
+#define ITEM_AGE_BUCKETS 24
+
+typedef struct {
+    /* The time since their last use of the items evicted */
+    unsigned int evicted_idle[ITEM_AGE_BUCKETS];
+    unsigned int evicted;
+    unsigned int evicted_unfetched;
+    /* The TTL left on the items read (the ones without one apart) */
+    unsigned int access_ttl[ITEM_AGE_BUCKETS];
+    unsigned int accessed;
+    unsigned int accessed_no_ttl;
+} item_histogram_t;
+
+/* The eviction policies (see config.eviction_policy) */
+enum item_policy {
+    /* Hits flag the item, which gets another round when it reaches the tail */
+    ITEM_POLICY_CLOCK,
+    /* Hits move the item to the head of the LRU */
+    ITEM_POLICY_LRU,
+    /* Clock, and a victim looked up more often than the new key is kept */
+    ITEM_POLICY_TINYLFU
+};
+
+/*
+ * The number of slots the CAS clock is spread over, the low bits of every
+ * CAS value are the slot it came from
+ */
+#define ITEM_CAS_SLOT_BITS 6
+#define ITEM_CAS_SLOTS (1 << ITEM_CAS_SLOT_BITS)
+
+/*
+ * The "stats sizes" histogram: the linked items by their size (as of
+ * ITEM_ntotal, rounded up to ITEM_SIZE_BUCKET bytes), up to 1MB
+ */
+#define ITEM_SIZE_BUCKET 32
+#define ITEM_SIZE_BUCKETS 32768
+
+/* The last CAS value handed out from a slot, alone in its cache line */
+typedef struct {
+    volatile uint64_t last;
+    char pad[64 - sizeof(uint64_t)];
+} item_cas_slot_t;
+
 struct items {
    hash_item *heads[POWER_LARGEST];
    hash_item *tails[POWER_LARGEST];
    itemstats_t itemstats[POWER_LARGEST];
+   enum item_policy policy;
    unsigned int sizes[POWER_LARGEST];
+   /* Kept up to date as the items are linked and unlinked (atomically) */
+   unsigned int size_histogram[ITEM_SIZE_BUCKETS];
+   /*
+    * The histograms of each slab class (NULL unless config.item_sample),
+    * for the keys whose hash value has the bits of sample_mask clear.
+    * Updated atomically, the eviction ones with the LRU lock held.
+    */
+   item_histogram_t *histograms;
+   uint32_t sample_mask;
+   /* Protects heads, tails, sizes and itemstats for each slab class */
+   cb_mutex_t lru_locks[POWER_LARGEST];
+   /* Striped locks protecting the items and their hash buckets */
+   cb_mutex_t *item_locks;
+   uint32_t item_lock_mask;
+   /* The CAS clock (see get_cas_id), started at cas_epoch */
+   hrtime_t cas_epoch;
+   item_cas_slot_t cas_slots[ITEM_CAS_SLOTS];
+
+   /*
+    * Compact items can't store the address of a cursor (which lives out
+    * of the slab arena), so the cursors are registered here and linked
+    * through a handle with their index. Written under cursor_lock before
+    * the cursor is linked into an LRU.
+    */
+   hash_item *cursors[ITEM_MAX_CURSORS];
+   cb_mutex_t cursor_lock;
+
+   /*
+    * The leases handed out on missing keys (see config.lease_timeout).
+    * There are at least as many chains as item lock stripes, so all of
+    * the leases in a chain are protected by the same item lock.
+    */
+   struct item_lease **leases;
+   uint32_t lease_mask;
+
+   /* The background LRU maintainer thread (see config.lru_maintainer) */
+   cb_mutex_t maintainer_lock;
+   cb_cond_t maintainer_cond;
+   bool maintainer_running;
+   cb_thread_t maintainer_tid;
+
+   /*
+    * The background flush reclaimer, started by the first flush. Every
+    * flush sets reclaim_pending, and the thread walks all of the LRUs
+    * once it finds it set (and the flush is due).
+    */
+   cb_mutex_t reclaim_lock;
+   cb_cond_t reclaim_cond;
+   bool reclaim_running;
+   bool reclaim_pending;
+   bool reclaim_active;
+   cb_thread_t reclaim_tid;
+   uint64_t reclaim_passes;
+   uint64_t reclaim_visited;
+   uint64_t reclaim_reclaimed;
 };
 
+/**
+ * Allocate the item lock stripes. Must be called after the hash table
+ * is sized (the number of stripes is capped by the number of buckets).
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS or ENGINE_ENOMEM
+ */
+ENGINE_ERROR_CODE items_init(struct default_engine *engine);
+
+/**
+ * Release the item lock stripes
+ * @param engine handle to the storage engine
+ */
+void items_destroy(struct default_engine *engine);
+
+/**
+ * Lock the stripe protecting all items with the hash value hv
+ * @param engine handle to the storage engine
+ * @param hv the hash value of the key
+ */
+void item_lock(struct default_engine *engine, uint32_t hv);
+
+/**
+ * Unlock the stripe protecting all items with the hash value hv
+ * @param engine handle to the storage engine
+ * @param hv the hash value of the key
+ */
+void item_unlock(struct default_engine *engine, uint32_t hv);
+
+/**
+ * Try to lock the stripe protecting all items with the hash value hv
+ * @param engine handle to the storage engine
+ * @param hv the hash value of the key
+ * @return true if the lock was acquired
+ */
+bool item_trylock(struct default_engine *engine, uint32_t hv);
+
+/**
+ * Lock all of the item lock stripes (used by flush and hash table
+ * expansion)
+ * @param engine handle to the storage engine
+ */
+void item_lock_all(struct default_engine *engine);
+
+/**
+ * Unlock all of the item lock stripes
+ * @param engine handle to the storage engine
+ */
+void item_unlock_all(struct default_engine *engine);
+
 
 /**
  * Allocate and initialize a new item structure
@@ -66,6 +245,40 @@ hash_item *item_alloc(struct default_engine *engine,
 hash_item *item_get(struct default_engine *engine,
                     const void *key, const size_t nkey);
 
+/**
+ * Get an item from the cache, or hand out a lease on the key if it is
+ * missing (or stale), so only the client holding the lease refills it.
+ * The lease is used by storing the key with its token as the CAS.
+ *
+ * @param engine handle to the storage engine
+ * @param key the key for the item to get
+ * @param nkey the number of bytes in the key
+ * @param it where to store the item (OUT)
+ * @param token where to store the lease token, 0 if no lease could be
+ *              handed out (OUT)
+ * @param stale set if the item expired less than config.stale_grace
+ *              seconds ago (OUT)
+ * @return ENGINE_SUCCESS if the item (or a stale copy) exists,
+ *         ENGINE_KEY_ENOENT if it doesn't, or ENGINE_TMPFAIL if another
+ *         client holds the lease
+ */
+ENGINE_ERROR_CODE item_get_lease(struct default_engine *engine,
+                                 const void *key, uint16_t nkey,
+                                 hash_item **it, uint64_t *token,
+                                 bool *stale);
+
+/**
+ * Prefetch the part of the hash table holding the key, or the item(s)
+ * in it. Nothing is done if the item lock is taken.
+ *
+ * @param engine handle to the storage engine
+ * @param key the key for the item to prefetch
+ * @param nkey the number of bytes in the key
+ * @param items true to prefetch the items, false for the hash table
+ */
+void item_prefetch(struct default_engine *engine,
+                   const void *key, const size_t nkey, bool items);
+
 /**
  * Reset the item statistics
  * @param engine handle to the storage engine
@@ -93,6 +306,16 @@ void item_stats(struct default_engine *engine,
 void item_stats_sizes(struct default_engine *engine,
                       ADD_STAT add_stat, const void *cookie);
 
+/**
+ * Get the sampled age histograms of the slab classes (config.item_sample)
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void item_stats_ages(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie);
+
 /**
  * Dump items from the cache
  * @param engine handle to the storage engine
@@ -122,6 +345,16 @@ void  item_flush_expired(struct default_engine *engine, time_t when);
  */
 void item_release(struct default_engine *engine, hash_item *it);
 
+/**
+ * Release our references to a batch of items, taking the lock of each
+ * stripe once for the items of the batch it protects
+ * @param engine handle to the storage engine
+ * @param items the items to release
+ * @param nitems the number of items
+ */
+void item_release_multi(struct default_engine *engine, hash_item **items,
+                        size_t nitems);
+
 /**
  * Unlink the item from the hash table (make it inaccessible)
  * @param engine handle to the storage engine
@@ -129,18 +362,62 @@ void item_release(struct default_engine *engine, hash_item *it);
  */
 void item_unlink(struct default_engine *engine, hash_item *it);
 
+/**
+ * Convert an expiration time given by a client
+ * @param engine handle to the storage engine
+ * @param cookie the client's connection, which may send its expiration
+ *               times in milliseconds (NULL if there is none)
+ * @param exptime the expiration time (see SERVER_CORE_API::realtime_ms)
+ * @param frac where to store the fraction of the last second (see
+ *             ITEM_EXPTIME_FRAC)
+ * @return the expiration time relative to process startup
+ */
+rel_time_t item_realtime(struct default_engine *engine, const void *cookie,
+                         rel_time_t exptime, uint16_t *frac);
+
+/**
+ * Has the item expired (by current_time or, for a sub-second expiry, by
+ * the current millisecond)
+ */
+bool item_is_expired(struct default_engine *engine, const hash_item *it,
+                     rel_time_t current_time);
+
 /**
  * Set the expiration time for an object
  * @param engine handle to the storage engine
  * @param key the key to set
  * @param nkey the number of characters in key..
  * @param exptime the expiration time
+ * @param frac the fraction of the last second (see item_realtime)
  * @return The (updated) item if it exists
  */
 hash_item *touch_item(struct default_engine *engine,
                       const void *key,
                       uint16_t nkey,
-                      uint32_t exptime);
+                      uint32_t exptime,
+                      uint16_t frac);
+
+/* A key of a touch_items batch */
+typedef struct {
+    const void *key;
+    uint16_t nkey;
+    bool get;                   /* keep the item for the caller */
+    ENGINE_ERROR_CODE status;   /* OUT */
+    hash_item *item;            /* OUT, if get (to be released) */
+} item_touch_request;
+
+/**
+ * Set the expiration time of all the keys of a batch, taking the lock of
+ * every item lock stripe once for all the keys in it (like store_items).
+ * @param engine handle to the storage engine
+ * @param requests the keys (ENGINE_KEY_ENOENT for the ones missing)
+ * @param nrequests the number of entries in requests
+ * @param exptime the expiration time of all of them
+ * @param frac the fraction of the last second (see item_realtime)
+ */
+void touch_items(struct default_engine *engine,
+                 item_touch_request *requests, size_t nrequests,
+                 uint32_t exptime, uint16_t frac);
 
 /**
  * Store an item in the cache
@@ -159,10 +436,89 @@ ENGINE_ERROR_CODE store_item(struct default_engine *engine,
                              ENGINE_STORE_OPERATION operation,
                              const void *cookie);
 
+/**
+ * Allocate and store the items of a store_multi batch, taking the lock of
+ * every item lock stripe once for all the items in it (the items of a
+ * stripe are stored in the order of the batch).
+ * @param engine handle to the storage engine
+ * @param requests the items to store, the ones with a status other than
+ *                 ENGINE_SUCCESS are skipped
+ * @param nrequests the number of entries in requests
+ */
+void store_items(struct default_engine *engine,
+                 item_store_request *requests, size_t nrequests,
+                 const void *cookie);
+
+/**
+ * Check if a value of nbytes can be stored with a key of nkey bytes,
+ * either in a single item or chained (see config.large_item_size_max).
+ */
+bool item_size_ok(struct default_engine *engine, size_t nkey, size_t nbytes);
+
+/**
+ * Get the segments the value of an item is stored in (more than one for
+ * a value too large for a single item).
+ * @param engine handle to the storage engine
+ * @param it the item, the caller must hold a reference to it
+ * @param iov where to store the segments
+ * @param niov the number of elements in iov
+ * @return the number of segments, or -1 if there are more than niov
+ */
+int item_get_segments(struct default_engine *engine, const hash_item *it,
+                      struct iovec *iov, int niov);
+
+/**
+ * Get a single segment of the value of an item.
+ * @param engine handle to the storage engine
+ * @param it the item, the caller must hold a reference to it
+ * @param index the segment (0 is the first one)
+ * @param iov where to store it
+ * @return the number of segments, or -1 if there's no such segment
+ */
+int item_get_segment(struct default_engine *engine, const hash_item *it,
+                     uint32_t index, struct iovec *iov);
+
+/**
+ * Get the memory an item takes up, with the chunks of its value.
+ * @param engine handle to the storage engine
+ * @param it the item, the caller must hold a reference to it
+ * @return the bytes it takes up
+ */
+size_t item_get_bytes(struct default_engine *engine, const hash_item *it);
+
+/**
+ * Copy the value of an item into a single buffer (reading it back from
+ * the extended storage for an ITEM_EXTERNAL one).
+ * @return the copy (to be released with free()), or NULL if out of memory
+ *         or the value in the extended storage is lost
+ */
+char *item_get_value_copy(struct default_engine *engine, const hash_item *it);
+
+/**
+ * Replace a range of the value of an item in place (see engine::splice).
+ * @param engine handle to the storage engine
+ * @param item the item to change, the caller must hold a reference to it
+ * @param cas the new cas value (OUT)
+ * @param offset where the range starts in the value
+ * @param length the size of the range
+ * @param data the bytes to put in its place
+ * @param ndata the number of bytes in data
+ * @return ENGINE_SUCCESS on success, ENGINE_NOT_STORED if the item can't
+ *         be changed in place
+ */
+ENGINE_ERROR_CODE splice_item(struct default_engine *engine,
+                              hash_item *item,
+                              uint64_t *cas,
+                              size_t offset,
+                              size_t length,
+                              const void *data,
+                              size_t ndata);
+
 ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
                              const void* cookie,
                              const void* key,
                              const int nkey,
+                             uint16_t vbucket,
                              const bool increment,
                              const bool create,
                              const uint64_t delta,
@@ -173,12 +529,250 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
                              uint64_t *result);
 
 
+/* A counter of an arithmetic_items batch */
+typedef struct {
+    const void *key;
+    uint16_t nkey;
+    uint16_t vbucket;           /* of a counter created */
+    bool incr;
+    bool create;
+    uint64_t delta;
+    uint64_t initial;
+    rel_time_t exptime;
+    ENGINE_ERROR_CODE status;   /* OUT */
+    uint64_t value;             /* OUT */
+    uint64_t cas;               /* OUT */
+} item_arithmetic_request;
+
+/**
+ * Increment (or decrement) the counters of a batch, taking the lock of
+ * every item lock stripe once for all the counters in it (like
+ * store_items). A counter in the extended storage gets ENGINE_TMPFAIL,
+ * as the batch can't block on reading it back.
+ * @param engine handle to the storage engine
+ * @param requests the counters
+ * @param nrequests the number of entries in requests
+ * @param datatype the datatype of the counters created
+ */
+void arithmetic_items(struct default_engine *engine,
+                      item_arithmetic_request *requests, size_t nrequests,
+                      uint8_t datatype, const void *cookie);
+
+/**
+ * Replace the items of a batch if and only if all of them still have the
+ * CAS of the request (0 for a key which must not exist). The locks of all
+ * the item lock stripes of the batch are taken in the order of the
+ * stripes, and held while the entries are checked, the new items
+ * allocated and then all of them linked, so no one sees a part of it.
+ * @param engine handle to the storage engine
+ * @param requests the new items, the status of every entry is set to
+ *                 the outcome of its check (ENGINE_EINVAL for a key
+ *                 repeated), the cas to the one of its new item if the
+ *                 transaction went through
+ * @param nrequests the number of entries in requests
+ * @return ENGINE_SUCCESS if every item was replaced, otherwise the status
+ *         of the first entry (by lock stripe) which failed, and nothing
+ *         was changed
+ */
+ENGINE_ERROR_CODE cas_items(struct default_engine *engine,
+                            item_store_request *requests, size_t nrequests,
+                            const void *cookie);
+
 /**
  * Start the item scrubber
  * @param engine handle to the storage engine
  */
 bool item_start_scrub(struct default_engine *engine);
 
+/**
+ * Start the background LRU maintainer thread, which moves items that
+ * were accessed while queued back to the head of their LRU and reclaims
+ * expired items from the tail.
+ * @param engine handle to the storage engine
+ * @return true if the thread is running
+ */
+bool item_start_lru_maintainer(struct default_engine *engine);
+
+/**
+ * Stop the LRU maintainer thread (if running) and wait for it to exit
+ * @param engine handle to the storage engine
+ */
+void item_stop_lru_maintainer(struct default_engine *engine);
+
+typedef enum {
+    ITEM_EXPIRED_RECLAIMED,
+    ITEM_EXPIRED_BUSY,   /* expired, but someone holds a reference */
+    ITEM_EXPIRED_STALE   /* gone, or not expired (any more) */
+} item_expired_t;
+
+/**
+ * Unlink the item if it is still in the cache under the hash value and
+ * has expired (used by the expiry index, whose items may be gone)
+ * @param engine handle to the storage engine
+ * @param it the item, which isn't looked at unless it is found
+ * @param hv the hash value of its key
+ */
+item_expired_t item_reclaim_expired(struct default_engine *engine,
+                                    hash_item *it, uint32_t hv);
+
+/**
+ * Unlink the item if it is still in the cache under the hash value and
+ * in the vbucket (used by the vbucket index to delete a dead vbucket)
+ * @param engine handle to the storage engine
+ * @param it the item, which isn't looked at unless it is found
+ * @param hv the hash value of its key
+ * @param vbucket the vbucket being deleted
+ * @return true if the item was unlinked
+ */
+bool item_unlink_vbucket_item(struct default_engine *engine, hash_item *it,
+                              uint32_t hv, uint16_t vbucket);
+
+/**
+ * Delete the items of a namespace (see namespaces.h) stored until now.
+ * They are flushed at once, and unlinked by the flush reclaimer if reclaim
+ * is set; otherwise they are only dropped as they are looked at.
+ * @param engine handle to the storage engine
+ * @param prefix the namespace
+ * @param nprefix the length of the namespace
+ * @param reclaim whether to have the flush reclaimer unlink them
+ * @param nitems where to return the number of items of the namespace
+ * @return ENGINE_SUCCESS, ENGINE_KEY_ENOENT if the namespace has no items
+ *         or ENGINE_ENOTSUP if the namespace index is disabled
+ */
+ENGINE_ERROR_CODE item_delete_namespace(struct default_engine *engine,
+                                        const void *prefix, uint16_t nprefix,
+                                        bool reclaim, uint64_t *nitems);
+
+/**
+ * Unlink the items of the deleted namespaces right away (at shutdown,
+ * with the flush reclaimer stopped, as a restart doesn't keep the index)
+ * @param engine handle to the storage engine
+ */
+void item_reclaim_namespaces(struct default_engine *engine);
+
+/**
+ * Stop the flush reclaimer thread (if running) and wait for it to exit
+ * @param engine handle to the storage engine
+ */
+void item_stop_flush_reclaimer(struct default_engine *engine);
+
+/**
+ * Add the progress of the flush reclaimer to the stats
+ * @param engine handle to the storage engine
+ * @param add_stat callback to add the stats with
+ * @param cookie the cookie passed to add_stat
+ */
+void item_flush_reclaim_stats(struct default_engine *engine,
+                              ADD_STAT add_stat, const void *cookie);
+
+/**
+ * Unlink an item stored in a slab page which is being moved to another
+ * slab class. The item is freed (and marked ITEM_SLABBED) if nobody
+ * holds a reference to it.
+ * @param engine handle to the storage engine
+ * @param it the chunk in the page (not necessarily a linked item)
+ * @param chunk_size the chunk size of the slab class
+ * @return true if the item was unlinked
+ */
+bool item_unlink_for_reassign(struct default_engine *engine,
+                              hash_item *it, size_t chunk_size);
+
+/**
+ * Move an item stored in a slab page which is being compacted to another
+ * chunk of its slab class, if nobody holds a reference to it. The old
+ * chunk is freed (and marked ITEM_SLABBED).
+ * @param engine handle to the storage engine
+ * @param it the chunk in the page (not necessarily a linked item)
+ * @param chunk_size the chunk size of the slab class
+ * @param chunk the free chunk to move it to (taken off the freelist)
+ * @return true if the item was moved
+ */
+bool item_relocate_for_compact(struct default_engine *engine,
+                               hash_item *it, size_t chunk_size,
+                               void *chunk);
+
+/**
+ * Get the number of items evicted from a slab class
+ * @param engine handle to the storage engine
+ * @param id the slab class
+ */
+unsigned int item_evicted(struct default_engine *engine, unsigned int id);
+
+/**
+ * Move the values of the items idle at the tails of the LRUs to the
+ * extended storage (called by its writer thread, see ext.h)
+ * @param engine handle to the storage engine
+ */
+void item_ext_flush(struct default_engine *engine);
+
+/**
+ * Bring the value of an item in the extended storage back in RAM,
+ * replacing the item with a full copy (or dropping it if the value is
+ * lost). Called by the I/O threads of the extended storage.
+ * @param engine handle to the storage engine
+ * @param it the item (ITEM_EXTERNAL), the caller must hold a reference
+ * @return ENGINE_SUCCESS, or ENGINE_ENOMEM if the copy can't be allocated
+ */
+ENGINE_ERROR_CODE item_ext_load(struct default_engine *engine, hash_item *it);
+
+/**
+ * Rebuild a chunk of a page found in the restart file (see restart.c).
+ * All of the chunks go through pass 0 (drop the flushed and expired
+ * items), then pass 1 (claim the chunks of the chained items) and pass 2
+ * (link the items, free the rest), each pass over all of them before the
+ * next one. May be run on several threads.
+ * @param engine handle to the storage engine
+ * @param pass the pass, 0 to 2
+ * @param it the chunk
+ * @param id the slab class of its page
+ * @param fixup how the arena and the clock moved since the shutdown
+ * @param counts what was found, updated
+ */
+void item_restart_chunk(struct default_engine *engine, int pass,
+                        hash_item *it, unsigned int id,
+                        const struct restart_fixup *fixup,
+                        struct restart_counts *counts);
+
+/**
+ * Account for the items rebuilt, and start the CAS clock after them
+ * @param engine handle to the storage engine
+ * @param counts what all of the calls to item_restart_chunk() found
+ */
+void item_restart_done(struct default_engine *engine,
+                       const struct restart_counts *counts);
+
+/**
+ * Call fn for each of the live items in a slice of the hash table (see
+ * snapshot.h) with the item lock stripe guarding it held, so fn must not
+ * block or take an item lock
+ * @param engine handle to the storage engine
+ * @param slice the slice, the items with slice as their hash modulo nslices
+ * @param nslices a multiple of the number of item lock stripes, at most
+ *                the size of the hash table
+ * @param fn the function to call
+ * @param arg passed to fn
+ */
+void item_walk_slice(struct default_engine *engine,
+                     uint32_t slice, uint32_t nslices,
+                     void (*fn)(struct default_engine *engine,
+                                hash_item *it, void *arg),
+                     void *arg);
+
+/**
+ * Take a reference to each of the live items in a slice of the hash
+ * table (see snapshot.h), locking only the item lock stripe guarding it.
+ * @param engine handle to the storage engine
+ * @param slice the slice, the items with slice as their hash modulo nslices
+ * @param nslices a multiple of the number of item lock stripes, at most
+ *                the size of the hash table
+ * @param items the items, to be released and the array freed (OUT)
+ * @param nitems the number of items (OUT)
+ * @return ENGINE_SUCCESS or ENGINE_ENOMEM
+ */
+ENGINE_ERROR_CODE item_snapshot_collect(struct default_engine *engine,
+                                        uint32_t slice, uint32_t nslices,
+                                        hash_item ***items, size_t *nitems);
+
 /**
  * The tap walker to walk the hashtables
  */
@@ -192,6 +786,11 @@ bool initialize_item_tap_walker(struct default_engine *engine,
                                 const void* cookie);
 
 
+/* The max number of items a DCP step takes off an LRU in one go */
+#define DCP_STEP_BATCH 32
+/* The slots of the set finding the keys logged twice in a batch */
+#define DCP_DEDUP_SLOTS (2 * DCP_STEP_BATCH)
+
 struct dcp_connection {
     void *gid;
     size_t ngid;
@@ -204,14 +803,90 @@ struct dcp_connection {
     uint64_t snap_start_seqno;
     uint64_t snap_end_seqno;
     hash_item cursor;
-    hash_item *it;
+    /* The items walked past, batch[ibatch] is the next one to send */
+    hash_item *batch[DCP_STEP_BATCH];
+    int nbatch;
+    int ibatch;
+    /* Set when the stream is a hash backfill (see link_dcp_backfill()) */
+    bool backfill;
+    /* Only the items of the vbucket are sent (with the vbucket index) */
+    bool match_vbucket;
+    /* The snapshot marker for [snap_start_seqno, snap_end_seqno] is due */
+    bool marker_due;
+    /* Items past snap_end_seqno were seen, so another pass is needed */
+    bool deferred;
+    /* Set once a pass found nothing which changed while it ran */
+    bool backfill_done;
+    /* Set if we failed to take a whole stripe */
+    bool enomem;
+    /* The next item lock stripe to walk in this pass */
+    uint32_t stripe;
+    /* The items taken from the last stripe, slice[islice] is the next one */
+    hash_item **slice;
+    size_t nslice;
+    size_t islice;
+    size_t slicesize;
+    /* Set when the stream is served from the seqlog (see link_dcp_log()) */
+    bool from_log;
+    /* The position of the stream in the log */
+    uint64_t log_pos;
+    /* The log reached end_seqno, so the stream ends after this batch */
+    bool log_done;
+    /*
+     * The logged changes read, log[ilog] is the next one to send. Each
+     * batch is sent as a snapshot [snap_start_seqno, snap_end_seqno], so
+     * only the last change of a key in it is kept.
+     */
+    struct seqlog_entry log[DCP_STEP_BATCH];
+    int nlog;
+    int ilog;
 };
 
-void link_dcp_walker(struct default_engine *engine,
+bool link_dcp_walker(struct default_engine *engine,
                      struct dcp_connection *connection);
+/*
+ * Set up the stream as a backfill of the hash table instead of an LRU
+ * walk. The table is walked one item lock stripe at a time, and every
+ * pass is sent as a snapshot of the items with a CAS up to the one at
+ * the start of the pass.
+ */
+bool link_dcp_backfill(struct default_engine *engine,
+                       struct dcp_connection *connection);
+/*
+ * Set up the stream to send the changes in the vbucket after start_seqno
+ * from the seqlog. Returns false if the log doesn't go back that far, in
+ * which case the stream needs a backfill.
+ */
+bool link_dcp_log(struct default_engine *engine,
+                  struct dcp_connection *connection);
+/* Release the items the stream still holds on to */
+void item_dcp_release(struct default_engine *engine,
+                      struct dcp_connection *connection);
 ENGINE_ERROR_CODE item_dcp_step(struct default_engine *engine,
                                 struct dcp_connection *connection,
                                 const void *cookie,
                                 struct dcp_message_producers *producers);
+/*
+ * Take the next batch of the stream off the LRUs, the hash table or the
+ * seqlog, without sending anything (so it may run on another thread than
+ * the one sending the stream). Returns ENGINE_SUCCESS if there is
+ * something to send, ENGINE_EWOULDBLOCK if the stream has to wait for
+ * more changes, ENGINE_DISCONNECT once it's done, or the error to end the
+ * stream with.
+ */
+ENGINE_ERROR_CODE item_dcp_prepare(struct default_engine *engine,
+                                   struct dcp_connection *connection);
+/*
+ * Send what item_dcp_prepare() took, counting the messages in sent.
+ * Returns ENGINE_SUCCESS once all of it is sent, or what the producers
+ * failed with (ENGINE_E2BIG when the daemon's buffers are full).
+ */
+ENGINE_ERROR_CODE item_dcp_send_prepared(struct default_engine *engine,
+                                         struct dcp_connection *connection,
+                                         const void *cookie,
+                                         struct dcp_message_producers *producers,
+                                         int *sent);
+/* What a step which sent that many messages and stopped on ret returns */
+ENGINE_ERROR_CODE item_dcp_step_result(ENGINE_ERROR_CODE ret, int sent);
 
 #endif
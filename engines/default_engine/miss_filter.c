@@ -0,0 +1,124 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The miss filter (config.miss_filter_items): a get first looks at the
+ * counters of the key, and answers a miss without taking the item lock
+ * or walking the hash chain when one of them is 0. With
+ * MISS_FILTER_COUNTERS_PER_KEY counters for every key expected and
+ * MISS_FILTER_DEPTH counters per key about 0.6% of the misses still go
+ * to the hash table (more once there are more keys than expected).
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <inttypes.h>
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+#define MISS_FILTER_DEPTH 4
+#define MISS_FILTER_COUNTERS_PER_KEY 12
+
+static const uint64_t miss_filter_seeds[MISS_FILTER_DEPTH] = {
+    UINT64_C(0xA0761D6478BD642F), UINT64_C(0xE7037ED1A0B428DB),
+    UINT64_C(0x8EBC6AF09C88C6E3), UINT64_C(0x589965CC75374CC3)
+};
+
+ENGINE_ERROR_CODE miss_filter_init(struct default_engine *engine) {
+    struct miss_filter *filter = &engine->miss_filter;
+    uint64_t nkeys = engine->config.miss_filter_items;
+    uint64_t ncounters = 1024;
+    uint32_t bits = 10;
+
+    if (nkeys == 0) {
+        return ENGINE_SUCCESS;
+    }
+    while (ncounters < nkeys * MISS_FILTER_COUNTERS_PER_KEY && bits < 32) {
+        ncounters <<= 1;
+        ++bits;
+    }
+    filter->bytes = (size_t)(ncounters / 16) * sizeof(uint64_t);
+    filter->table = calloc((size_t)(ncounters / 16), sizeof(uint64_t));
+    if (filter->table == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    filter->shift = 64 - bits;
+    return ENGINE_SUCCESS;
+}
+
+void miss_filter_destroy(struct default_engine *engine) {
+    free(engine->miss_filter.table);
+    engine->miss_filter.table = NULL;
+}
+
+static uint64_t miss_filter_index(const struct miss_filter *filter,
+                                  uint32_t hv, int row) {
+    return ((uint64_t)hv * miss_filter_seeds[row]) >> filter->shift;
+}
+
+/* Count the key in or out, the counters stuck at the max are left */
+static void miss_filter_count(struct miss_filter *filter, uint32_t hv,
+                              bool add) {
+    int row;
+
+    for (row = 0; row < MISS_FILTER_DEPTH; ++row) {
+        uint64_t index = miss_filter_index(filter, hv, row);
+        volatile uint64_t *word = &filter->table[index >> 4];
+        unsigned int shift = (unsigned int)(index & 15) * 4;
+        uint64_t one = (uint64_t)1 << shift;
+        uint64_t old, count;
+
+        do {
+            old = *word;
+            count = (old >> shift) & 15;
+            if (count == MISS_FILTER_MAX || (!add && count == 0)) {
+                break;
+            }
+        } while (!__sync_bool_compare_and_swap(word, old,
+                                               add ? old + one : old - one));
+    }
+}
+
+void miss_filter_add(struct default_engine *engine, uint32_t hv) {
+    if (engine->miss_filter.table != NULL) {
+        miss_filter_count(&engine->miss_filter, hv, true);
+    }
+}
+
+void miss_filter_remove(struct default_engine *engine, uint32_t hv) {
+    if (engine->miss_filter.table != NULL) {
+        miss_filter_count(&engine->miss_filter, hv, false);
+    }
+}
+
+bool miss_filter_maybe(struct default_engine *engine, uint32_t hv) {
+    struct miss_filter *filter = &engine->miss_filter;
+    int row;
+
+    if (filter->table == NULL) {
+        return true;
+    }
+    for (row = 0; row < MISS_FILTER_DEPTH; ++row) {
+        uint64_t index = miss_filter_index(filter, hv, row);
+        if (((filter->table[index >> 4] >> ((index & 15) * 4)) & 15) == 0) {
+            __sync_add_and_fetch(&filter->negatives, 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+void miss_filter_stats(struct default_engine *engine,
+                       ADD_STAT add_stat, const void *cookie) {
+    struct miss_filter *filter = &engine->miss_filter;
+    char val[32];
+    int len;
+
+    if (filter->table == NULL) {
+        return;
+    }
+    len = sprintf(val, "%"PRIu64, (uint64_t)filter->bytes);
+    add_stat("miss_filter_bytes", 17, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, (uint64_t)filter->negatives);
+    add_stat("miss_filter_negatives", 21, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, (uint64_t)filter->false_positives);
+    add_stat("miss_filter_false_positives", 27, val, len, cookie);
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* A counting Bloom filter of the linked keys, to answer misses early */
+#ifndef MISS_FILTER_H
+#define MISS_FILTER_H
+
+/*
+ * The keys are counted in 4 bit counters, 16 to a word, picked by their
+ * hash like in the frequency sketch: a key's counters go up when it is
+ * linked and down when it is unlinked, so a key with one of them at 0
+ * isn't in the hash table. A counter which reaches MISS_FILTER_MAX
+ * stays there, as it no longer knows how many keys it counts. The
+ * counters are updated through compare and swap (with the item lock of
+ * the key held) and read without a lock.
+ */
+struct miss_filter {
+    uint64_t *table;     /* NULL if disabled */
+    uint32_t shift;      /* 64 - log2(the number of counters) */
+    size_t bytes;
+
+    volatile uint64_t negatives;        /* lookups answered by the filter */
+    volatile uint64_t false_positives;  /* and let through which missed */
+};
+
+#define MISS_FILTER_MAX 15
+
+/* Allocate a filter for config.miss_filter_items keys (if not 0) */
+ENGINE_ERROR_CODE miss_filter_init(struct default_engine *engine);
+void miss_filter_destroy(struct default_engine *engine);
+
+/* Count the key with the hash hv in (or out), with its item lock held */
+void miss_filter_add(struct default_engine *engine, uint32_t hv);
+void miss_filter_remove(struct default_engine *engine, uint32_t hv);
+
+/* False if the key with the hash hv is certainly not linked */
+bool miss_filter_maybe(struct default_engine *engine, uint32_t hv);
+
+void miss_filter_stats(struct default_engine *engine,
+                       ADD_STAT add_stat, const void *cookie);
+
+#endif
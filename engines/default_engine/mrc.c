@@ -0,0 +1,295 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The miss ratio curve (config.mrc_keys): "stats mrc" answers what the
+ * miss ratio of the gets would have been with a cache of a fraction or
+ * a multiple of maxbytes, from the reuse distances of the sampled keys
+ * (see mrc.h). A get of a key which isn't sampled only costs a hash.
+ *
+ * The distances are in bytes, the sizes of the keys as of their last
+ * hit (a key which only missed so far takes up nothing).
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+/* The seeds of the hash sampling the keys, and of their ids */
+#define MRC_SAMPLE_SEED 0x53484152u
+#define MRC_ID_SEED 0x4d5243u
+
+struct mrc_key {
+    uint64_t id;
+    uint32_t time;      /* of its last get */
+    uint32_t size;
+    uint32_t next;      /* in its chain or the free list (index + 1) */
+};
+
+/* The cache sizes reported, in granules (maxbytes / 8 to 8 * maxbytes) */
+static const uint32_t mrc_sizes[] = {
+    8, 16, 32, 48, 64, 80, 96, 128, 192, 256, 384, 512
+};
+
+/* Spread the bits of the hash, the sample must be uniform whatever it is */
+static uint32_t mrc_mix(uint32_t hv) {
+    hv ^= hv >> 16;
+    hv *= 0x85ebca6bu;
+    hv ^= hv >> 13;
+    hv *= 0xc2b2ae35u;
+    hv ^= hv >> 16;
+    return hv;
+}
+
+static void mrc_tree_add(struct mrc *mrc, uint32_t time, uint64_t delta,
+                         bool add) {
+    uint32_t ii;
+
+    for (ii = time + 1; ii <= mrc->ntimes; ii += ii & (~ii + 1)) {
+        if (add) {
+            mrc->tree[ii] += delta;
+        } else {
+            mrc->tree[ii] -= delta;
+        }
+    }
+}
+
+/* The sizes of the keys read last before time */
+static uint64_t mrc_tree_sum(const struct mrc *mrc, uint32_t time) {
+    uint64_t sum = 0;
+    uint32_t ii;
+
+    for (ii = time; ii > 0; ii -= ii & (~ii + 1)) {
+        sum += mrc->tree[ii];
+    }
+    return sum;
+}
+
+ENGINE_ERROR_CODE mrc_init(struct default_engine *engine) {
+    struct mrc *mrc = &engine->mrc;
+    size_t nkeys = engine->config.mrc_keys;
+    uint32_t nchains = 1;
+    uint32_t ii;
+
+    if (nkeys == 0) {
+        return ENGINE_SUCCESS;
+    }
+    if (nkeys > UINT32_MAX / 4) {
+        nkeys = UINT32_MAX / 4;
+    }
+    while (nchains < nkeys) {
+        nchains <<= 1;
+    }
+
+    mrc->max_keys = (uint32_t)nkeys;
+    mrc->ntimes = 2 * mrc->max_keys;
+    mrc->keys = calloc(nkeys, sizeof(*mrc->keys));
+    mrc->chains = calloc(nchains, sizeof(*mrc->chains));
+    mrc->owners = calloc(mrc->ntimes, sizeof(*mrc->owners));
+    mrc->tree = calloc((size_t)mrc->ntimes + 1, sizeof(*mrc->tree));
+    if (mrc->keys == NULL || mrc->chains == NULL || mrc->owners == NULL ||
+        mrc->tree == NULL) {
+        mrc_destroy(engine);
+        return ENGINE_ENOMEM;
+    }
+    for (ii = 0; ii < mrc->max_keys; ++ii) {
+        mrc->keys[ii].next = ii + 2 <= mrc->max_keys ? ii + 2 : 0;
+    }
+    mrc->free = 1;
+    mrc->chain_mask = nchains - 1;
+    mrc->threshold = MRC_SAMPLE_SPACE;
+    mrc->granule = engine->config.maxbytes / MRC_GRANULES;
+    if (mrc->granule == 0) {
+        mrc->granule = 1;
+    }
+    cb_mutex_initialize(&mrc->lock);
+    return ENGINE_SUCCESS;
+}
+
+void mrc_destroy(struct default_engine *engine) {
+    struct mrc *mrc = &engine->mrc;
+
+    if (mrc->keys != NULL) {
+        cb_mutex_destroy(&mrc->lock);
+    }
+    free(mrc->keys);
+    free(mrc->chains);
+    free(mrc->owners);
+    free(mrc->tree);
+    mrc->keys = NULL;
+    mrc->chains = NULL;
+    mrc->owners = NULL;
+    mrc->tree = NULL;
+}
+
+static uint32_t *mrc_chain(struct mrc *mrc, uint64_t id) {
+    return &mrc->chains[(uint32_t)(id >> 32) & mrc->chain_mask];
+}
+
+/* Halve the sampling rate, dropping the keys no longer sampled */
+static void mrc_resample(struct mrc *mrc) {
+    uint32_t ii;
+
+    if (mrc->threshold > 1) {
+        mrc->threshold /= 2;
+    }
+    ++mrc->resamples;
+    for (ii = 0; ii <= mrc->chain_mask; ++ii) {
+        uint32_t *link = &mrc->chains[ii];
+        while (*link != 0) {
+            struct mrc_key *k = &mrc->keys[*link - 1];
+            if ((uint32_t)(k->id & (MRC_SAMPLE_SPACE - 1)) >= mrc->threshold) {
+                uint32_t index = *link;
+                mrc_tree_add(mrc, k->time, k->size, false);
+                mrc->owners[k->time] = 0;
+                *link = k->next;
+                k->next = mrc->free;
+                mrc->free = index;
+                --mrc->nkeys;
+            } else {
+                link = &k->next;
+            }
+        }
+    }
+}
+
+/* Renumber the times of the keys from 0, once they ran out */
+static void mrc_compact(struct mrc *mrc) {
+    uint32_t time, now = 0;
+
+    memset(mrc->tree, 0, ((size_t)mrc->ntimes + 1) * sizeof(*mrc->tree));
+    for (time = 0; time < mrc->now; ++time) {
+        uint32_t owner = mrc->owners[time];
+        if (owner != 0) {
+            mrc->owners[time] = 0;
+            mrc->owners[now] = owner;
+            mrc->keys[owner - 1].time = now;
+            mrc_tree_add(mrc, now, mrc->keys[owner - 1].size, true);
+            ++now;
+        }
+    }
+    mrc->now = now;
+}
+
+void mrc_get(struct default_engine *engine, const void *key, size_t nkey,
+             size_t size) {
+    struct mrc *mrc = &engine->mrc;
+    uint32_t hv, *chain, index;
+    struct mrc_key *k = NULL;
+    uint64_t id;
+
+    if (mrc->keys == NULL) {
+        return;
+    }
+    hv = mrc_mix(engine->server.core->hash(key, nkey, MRC_SAMPLE_SEED));
+    if ((hv & (MRC_SAMPLE_SPACE - 1)) >= mrc->threshold) {
+        return;
+    }
+    id = ((uint64_t)mrc_mix(engine->server.core->hash(key, nkey,
+                                                      MRC_ID_SEED)) << 32) | hv;
+    if (size > UINT32_MAX) {
+        size = UINT32_MAX;
+    }
+
+    cb_mutex_enter(&mrc->lock);
+    if ((hv & (MRC_SAMPLE_SPACE - 1)) >= mrc->threshold) {
+        /* Resampled meanwhile */
+        cb_mutex_exit(&mrc->lock);
+        return;
+    }
+    ++mrc->gets;
+    chain = mrc_chain(mrc, id);
+    for (index = *chain; index != 0; index = mrc->keys[index - 1].next) {
+        if (mrc->keys[index - 1].id == id) {
+            k = &mrc->keys[index - 1];
+            break;
+        }
+    }
+
+    if (k != NULL) {
+        uint64_t bytes = mrc_tree_sum(mrc, mrc->now) -
+            mrc_tree_sum(mrc, k->time + 1);
+        double distance = (double)bytes * MRC_SAMPLE_SPACE / mrc->threshold +
+            (size != 0 ? size : k->size);
+        double bucket = distance / mrc->granule;
+
+        if (bucket < MRC_BUCKETS) {
+            ++mrc->histogram[(int)bucket];
+        } else {
+            ++mrc->beyond;
+        }
+        mrc_tree_add(mrc, k->time, k->size, false);
+        mrc->owners[k->time] = 0;
+    } else {
+        ++mrc->cold;
+        while (mrc->nkeys == mrc->max_keys && mrc->threshold > 1) {
+            mrc_resample(mrc);
+        }
+        if ((hv & (MRC_SAMPLE_SPACE - 1)) >= mrc->threshold ||
+            mrc->nkeys == mrc->max_keys) {
+            /* No longer sampled itself */
+            --mrc->cold;
+            --mrc->gets;
+            cb_mutex_exit(&mrc->lock);
+            return;
+        }
+        index = mrc->free;
+        k = &mrc->keys[index - 1];
+        mrc->free = k->next;
+        k->id = id;
+        k->size = 0;
+        k->next = *chain;
+        *chain = index;
+        ++mrc->nkeys;
+    }
+
+    if (size != 0) {
+        k->size = (uint32_t)size;
+    }
+    if (mrc->now == mrc->ntimes) {
+        mrc_compact(mrc);
+    }
+    k->time = mrc->now++;
+    mrc->owners[k->time] = (uint32_t)(k - mrc->keys) + 1;
+    mrc_tree_add(mrc, k->time, k->size, true);
+    cb_mutex_exit(&mrc->lock);
+}
+
+void mrc_stats(struct default_engine *engine,
+               ADD_STAT add_stat, const void *cookie) {
+    struct mrc *mrc = &engine->mrc;
+    uint64_t hits = 0;
+    uint32_t bucket = 0;
+    char key[64], val[32];
+    int klen, vlen;
+    size_t ii;
+
+    if (mrc->keys == NULL) {
+        return;
+    }
+    cb_mutex_enter(&mrc->lock);
+    vlen = sprintf(val, "%u", mrc->nkeys);
+    add_stat("mrc_keys", 8, val, vlen, cookie);
+    vlen = sprintf(val, "%.6f", (double)mrc->threshold / MRC_SAMPLE_SPACE);
+    add_stat("mrc_sample_rate", 15, val, vlen, cookie);
+    vlen = sprintf(val, "%"PRIu64, mrc->resamples);
+    add_stat("mrc_resamples", 13, val, vlen, cookie);
+    vlen = sprintf(val, "%"PRIu64, mrc->gets);
+    add_stat("mrc_gets", 8, val, vlen, cookie);
+    vlen = sprintf(val, "%"PRIu64, mrc->cold);
+    add_stat("mrc_cold_misses", 15, val, vlen, cookie);
+
+    /* The gets with a distance below the size hit */
+    for (ii = 0; ii < sizeof(mrc_sizes) / sizeof(mrc_sizes[0]); ++ii) {
+        for (; bucket < mrc_sizes[ii]; ++bucket) {
+            hits += mrc->histogram[bucket];
+        }
+        klen = snprintf(key, sizeof(key), "mrc_miss_ratio_%"PRIu64,
+                        mrc->granule * mrc_sizes[ii]);
+        vlen = sprintf(val, "%.6f", mrc->gets == 0 ? 0.0 :
+                       (double)(mrc->gets - hits) / mrc->gets);
+        add_stat(key, klen, val, vlen, cookie);
+    }
+    cb_mutex_exit(&mrc->lock);
+}
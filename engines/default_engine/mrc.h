@@ -0,0 +1,61 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* The miss ratio curve of the gets, over the cache sizes (for sizing) */
+#ifndef MRC_H
+#define MRC_H
+
+/*
+ * The gets of a sample of the keys (the ones whose hash is below
+ * threshold, out of MRC_SAMPLE_SPACE) are run through an LRU stack of
+ * every cache size at once: the reuse distance of a get is the bytes of
+ * the sampled keys read since the key was read last, scaled up by the
+ * sampling rate, and the get hits in the caches larger than that. The
+ * sizes are kept in a Fenwick tree by the time of the last get of their
+ * key, so the bytes read since are a difference of two prefix sums. The
+ * distances are counted in histogram, in granule (maxbytes /
+ * MRC_GRANULES) wide buckets up to MRC_BUCKETS of them.
+ *
+ * Once max_keys keys are sampled the threshold is halved and the keys
+ * above it are dropped (fixed size SHARDS), so the memory doesn't grow
+ * with the traffic. Everything but the threshold is under lock, which
+ * is only taken for the sampled gets.
+ */
+#define MRC_SAMPLE_SPACE (1u << 24)
+#define MRC_GRANULES 64
+#define MRC_BUCKETS (8 * MRC_GRANULES)
+
+struct mrc_key;
+
+struct mrc {
+    cb_mutex_t lock;
+    struct mrc_key *keys;   /* NULL if disabled */
+    uint32_t *chains;       /* of the keys, by their id */
+    uint32_t chain_mask;
+    uint32_t *owners;       /* the key read last at every time */
+    uint64_t *tree;         /* their sizes by time */
+    uint32_t ntimes;
+    uint32_t now;
+    uint32_t nkeys;
+    uint32_t max_keys;
+    uint32_t free;          /* the unused keys */
+    volatile uint32_t threshold;
+    uint64_t granule;
+
+    uint64_t histogram[MRC_BUCKETS];
+    uint64_t beyond;        /* gets with a longer distance */
+    uint64_t cold;          /* with no earlier get of the key */
+    uint64_t gets;
+    uint64_t resamples;
+};
+
+/* Allocate the sample for config.mrc_keys keys (if not 0) */
+ENGINE_ERROR_CODE mrc_init(struct default_engine *engine);
+void mrc_destroy(struct default_engine *engine);
+
+/* Count a get of the key, of an item of size bytes (0 for a miss) */
+void mrc_get(struct default_engine *engine, const void *key, size_t nkey,
+             size_t size);
+
+void mrc_stats(struct default_engine *engine,
+               ADD_STAT add_stat, const void *cookie);
+
+#endif
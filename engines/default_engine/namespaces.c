@@ -0,0 +1,307 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The namespace index (config.namespace_separator): every namespace with
+ * linked items has an entry counting them, in a hash table split in
+ * NAMESPACE_SHARDS shards so linking and unlinking the items of different
+ * namespaces seldom contend. Deleting a namespace is then O(1): the entry
+ * records the CAS it was deleted at, the items are flushed from then on,
+ * and the flush reclaimer unlinks them in the background (the lookups,
+ * the LRU tails and the maintainer drop the ones they get to first).
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+/* The buckets of a shard to start with, it doubles past 2 entries each */
+#define NAMESPACE_INITIAL_BUCKETS 64
+
+ENGINE_ERROR_CODE namespaces_init(struct default_engine *engine) {
+    struct key_namespaces *ns = &engine->namespaces;
+    const char *separator = engine->config.namespace_separator;
+    int ii;
+
+    if (separator == NULL || separator[0] == '\0') {
+        return ENGINE_SUCCESS;
+    }
+    if (separator[1] != '\0' || engine->config.namespace_depth == 0 ||
+        engine->config.namespace_depth > UINT16_MAX) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "namespace_separator must be a single character and"
+                    " namespace_depth at least 1\n");
+        return ENGINE_EINVAL;
+    }
+
+    ns->shards = calloc(NAMESPACE_SHARDS, sizeof(struct namespace_shard));
+    if (ns->shards == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    for (ii = 0; ii < NAMESPACE_SHARDS; ++ii) {
+        struct namespace_shard *shard = &ns->shards[ii];
+        cb_mutex_initialize(&shard->lock);
+        shard->buckets = calloc(NAMESPACE_INITIAL_BUCKETS,
+                                sizeof(struct namespace_entry*));
+        if (shard->buckets == NULL) {
+            namespaces_destroy(engine);
+            return ENGINE_ENOMEM;
+        }
+        shard->nbuckets = NAMESPACE_INITIAL_BUCKETS;
+    }
+    ns->separator = separator[0];
+    ns->depth = (uint32_t)engine->config.namespace_depth;
+    return ENGINE_SUCCESS;
+}
+
+void namespaces_destroy(struct default_engine *engine) {
+    struct key_namespaces *ns = &engine->namespaces;
+    int ii;
+
+    if (ns->shards == NULL) {
+        return;
+    }
+    for (ii = 0; ii < NAMESPACE_SHARDS; ++ii) {
+        struct namespace_shard *shard = &ns->shards[ii];
+        uint32_t bucket;
+        for (bucket = 0; shard->buckets && bucket < shard->nbuckets; ++bucket) {
+            while (shard->buckets[bucket] != NULL) {
+                struct namespace_entry *entry = shard->buckets[bucket];
+                shard->buckets[bucket] = entry->next;
+                free(entry);
+            }
+        }
+        free(shard->buckets);
+        cb_mutex_destroy(&shard->lock);
+    }
+    free(ns->shards);
+    ns->shards = NULL;
+}
+
+/* The length of the namespace of the key, 0 if it isn't in one */
+static uint16_t namespace_length(const struct key_namespaces *ns,
+                                 const char *key, uint16_t nkey) {
+    uint32_t found = 0;
+    uint16_t ii;
+
+    for (ii = 0; ii < nkey; ++ii) {
+        if (key[ii] == ns->separator && ++found == ns->depth) {
+            return ii;
+        }
+    }
+    return 0;
+}
+
+static struct namespace_entry **namespace_find(struct namespace_shard *shard,
+                                               uint32_t hv,
+                                               const char *prefix,
+                                               uint16_t nprefix) {
+    struct namespace_entry **pos = &shard->buckets[hv % shard->nbuckets];
+    while (*pos != NULL && ((*pos)->nprefix != nprefix ||
+                            memcmp((*pos)->prefix, prefix, nprefix) != 0)) {
+        pos = &(*pos)->next;
+    }
+    return pos;
+}
+
+/* Double the buckets of the shard (it stays as it is without memory) */
+static void namespace_grow(struct default_engine *engine,
+                           struct namespace_shard *shard) {
+    uint32_t nbuckets = shard->nbuckets * 2;
+    struct namespace_entry **buckets;
+    uint32_t ii;
+
+    buckets = calloc(nbuckets, sizeof(struct namespace_entry*));
+    if (buckets == NULL) {
+        return;
+    }
+    for (ii = 0; ii < shard->nbuckets; ++ii) {
+        while (shard->buckets[ii] != NULL) {
+            struct namespace_entry *entry = shard->buckets[ii];
+            uint32_t hv = engine->server.core->hash(entry->prefix,
+                                                    entry->nprefix, 0);
+            shard->buckets[ii] = entry->next;
+            entry->next = buckets[hv % nbuckets];
+            buckets[hv % nbuckets] = entry;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+}
+
+static struct namespace_shard *namespace_shard(struct key_namespaces *ns,
+                                               uint32_t hv) {
+    return &ns->shards[(hv >> 28) % NAMESPACE_SHARDS];
+}
+
+void namespace_link(struct default_engine *engine, const hash_item *it) {
+    struct key_namespaces *ns = &engine->namespaces;
+    const char *key = item_get_key(it);
+    struct namespace_shard *shard;
+    struct namespace_entry **pos;
+    uint16_t nprefix;
+    uint32_t hv;
+
+    if (ns->shards == NULL ||
+        (nprefix = namespace_length(ns, key, it->nkey)) == 0) {
+        return;
+    }
+
+    hv = engine->server.core->hash(key, nprefix, 0);
+    shard = namespace_shard(ns, hv);
+    cb_mutex_enter(&shard->lock);
+    pos = namespace_find(shard, hv, key, nprefix);
+    if (*pos == NULL) {
+        struct namespace_entry *entry = malloc(sizeof(*entry) + nprefix);
+        if (entry == NULL) {
+            /* The item is left out of a delete of its namespace */
+            cb_mutex_exit(&shard->lock);
+            __sync_add_and_fetch(&ns->untracked, 1);
+            return;
+        }
+        entry->next = NULL;
+        entry->items = 0;
+        entry->deleted_cas = 0;
+        entry->nprefix = nprefix;
+        memcpy(entry->prefix, key, nprefix);
+        *pos = entry;
+        shard->entry_bytes += sizeof(*entry) + nprefix;
+        if (++shard->count > shard->nbuckets * 2) {
+            namespace_grow(engine, shard);
+            pos = namespace_find(shard, hv, key, nprefix);
+        }
+    }
+    ++(*pos)->items;
+    shard->prefix_bytes += nprefix + 1;
+    cb_mutex_exit(&shard->lock);
+}
+
+void namespace_unlink(struct default_engine *engine, const hash_item *it) {
+    struct key_namespaces *ns = &engine->namespaces;
+    const char *key = item_get_key(it);
+    struct namespace_shard *shard;
+    struct namespace_entry **pos;
+    uint16_t nprefix;
+    uint32_t hv;
+
+    if (ns->shards == NULL ||
+        (nprefix = namespace_length(ns, key, it->nkey)) == 0) {
+        return;
+    }
+
+    hv = engine->server.core->hash(key, nprefix, 0);
+    shard = namespace_shard(ns, hv);
+    cb_mutex_enter(&shard->lock);
+    pos = namespace_find(shard, hv, key, nprefix);
+    /* Not there if the item wasn't counted */
+    if (*pos != NULL) {
+        shard->prefix_bytes -= nprefix + 1;
+    }
+    if (*pos != NULL && --(*pos)->items == 0) {
+        struct namespace_entry *entry = *pos;
+        *pos = entry->next;
+        --shard->count;
+        shard->entry_bytes -= sizeof(*entry) + nprefix;
+        if (entry->deleted_cas != 0) {
+            __sync_sub_and_fetch(&ns->deleted, 1);
+        }
+        free(entry);
+    }
+    cb_mutex_exit(&shard->lock);
+}
+
+bool namespace_is_deleted(struct default_engine *engine, const hash_item *it) {
+    struct key_namespaces *ns = &engine->namespaces;
+    const char *key = item_get_key(it);
+    struct namespace_shard *shard;
+    struct namespace_entry *entry;
+    uint16_t nprefix;
+    uint32_t hv;
+    bool deleted;
+
+    if (ns->deleted == 0 ||
+        (nprefix = namespace_length(ns, key, it->nkey)) == 0) {
+        return false;
+    }
+
+    hv = engine->server.core->hash(key, nprefix, 0);
+    shard = namespace_shard(ns, hv);
+    cb_mutex_enter(&shard->lock);
+    entry = *namespace_find(shard, hv, key, nprefix);
+    deleted = entry != NULL && item_get_cas(it) <= entry->deleted_cas;
+    cb_mutex_exit(&shard->lock);
+    return deleted;
+}
+
+ENGINE_ERROR_CODE namespace_delete(struct default_engine *engine,
+                                   const void *prefix, uint16_t nprefix,
+                                   uint64_t cas, uint64_t *nitems) {
+    struct key_namespaces *ns = &engine->namespaces;
+    struct namespace_shard *shard;
+    struct namespace_entry *entry;
+    uint32_t hv;
+
+    *nitems = 0;
+    if (ns->shards == NULL) {
+        return ENGINE_ENOTSUP;
+    }
+
+    hv = engine->server.core->hash(prefix, nprefix, 0);
+    shard = namespace_shard(ns, hv);
+    cb_mutex_enter(&shard->lock);
+    entry = *namespace_find(shard, hv, prefix, nprefix);
+    if (entry != NULL) {
+        if (entry->deleted_cas == 0) {
+            __sync_add_and_fetch(&ns->deleted, 1);
+        }
+        entry->deleted_cas = cas;
+        *nitems = entry->items;
+    }
+    cb_mutex_exit(&shard->lock);
+
+    if (entry == NULL) {
+        return ENGINE_KEY_ENOENT;
+    }
+    __sync_add_and_fetch(&ns->deletes, 1);
+    return ENGINE_SUCCESS;
+}
+
+bool namespaces_deleted(struct default_engine *engine) {
+    return engine->namespaces.deleted != 0;
+}
+
+void namespace_stats(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie) {
+    struct key_namespaces *ns = &engine->namespaces;
+    uint64_t count = 0, prefix_bytes = 0, entry_bytes = 0;
+    char val[32];
+    int len, ii;
+
+    if (ns->shards == NULL) {
+        return;
+    }
+    for (ii = 0; ii < NAMESPACE_SHARDS; ++ii) {
+        cb_mutex_enter(&ns->shards[ii].lock);
+        count += ns->shards[ii].count;
+        prefix_bytes += ns->shards[ii].prefix_bytes;
+        entry_bytes += ns->shards[ii].entry_bytes;
+        cb_mutex_exit(&ns->shards[ii].lock);
+    }
+
+    len = sprintf(val, "%"PRIu64, count);
+    add_stat("namespaces", 10, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, (uint64_t)ns->deleted);
+    add_stat("namespaces_deleted", 18, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, (uint64_t)ns->deletes);
+    add_stat("namespace_deletes", 17, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, (uint64_t)ns->untracked);
+    add_stat("namespace_untracked", 19, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, prefix_bytes);
+    add_stat("namespace_prefix_bytes", 22, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, entry_bytes);
+    add_stat("namespace_entry_bytes", 21, val, len, cookie);
+}
@@ -0,0 +1,76 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* An index of the linked items by the namespace (key prefix) of their key */
+#ifndef NAMESPACES_H
+#define NAMESPACES_H
+
+/*
+ * The namespace of a key is what comes before the config.namespace_depth'th
+ * config.namespace_separator in it ("user" for "user:42" with ':'), a key
+ * with fewer separators isn't in one. Only the number of linked items of
+ * every namespace is kept, not the items: deleting a namespace records the
+ * CAS it was deleted at, and its items up to that CAS are flushed (see
+ * item_is_flushed). The entry goes once the last of its items is
+ * unlinked. The stats tell how much the keys spend on their prefixes.
+ */
+struct namespace_entry {
+    struct namespace_entry *next;
+    uint64_t items;
+    uint64_t deleted_cas;   /* 0 if not deleted */
+    uint16_t nprefix;
+    char prefix[1];
+};
+
+#define NAMESPACE_SHARDS 16
+
+struct namespace_shard {
+    /* Protects the shard; a leaf lock taken with the item lock held */
+    cb_mutex_t lock;
+    struct namespace_entry **buckets;
+    uint32_t nbuckets;
+    uint32_t count;
+    /*
+     * The bytes of the prefixes of its items (with their separator), and
+     * of its entries: what the keys would be smaller by, and what it
+     * would cost, with the prefixes stored once.
+     */
+    uint64_t prefix_bytes;
+    uint64_t entry_bytes;
+};
+
+struct key_namespaces {
+    /* NAMESPACE_SHARDS shards (NULL if disabled), picked by the hash */
+    struct namespace_shard *shards;
+    char separator;
+    uint32_t depth;
+    /* The entries with deleted_cas set, nothing is looked up while 0 */
+    volatile uint32_t deleted;
+    volatile uint64_t deletes;
+    volatile uint64_t untracked;  /* items not counted for lack of memory */
+};
+
+ENGINE_ERROR_CODE namespaces_init(struct default_engine *engine);
+void namespaces_destroy(struct default_engine *engine);
+
+/* Count the item in (or out of) its namespace, with the item lock held */
+void namespace_link(struct default_engine *engine, const hash_item *it);
+void namespace_unlink(struct default_engine *engine, const hash_item *it);
+
+/* If the item was stored before its namespace was deleted */
+bool namespace_is_deleted(struct default_engine *engine, const hash_item *it);
+
+/*
+ * Delete the items of the namespace stored up to cas, returning the
+ * number of items it has in *nitems. ENGINE_KEY_ENOENT if it has none and
+ * ENGINE_ENOTSUP if the index is disabled.
+ */
+ENGINE_ERROR_CODE namespace_delete(struct default_engine *engine,
+                                   const void *prefix, uint16_t nprefix,
+                                   uint64_t cas, uint64_t *nitems);
+
+/* If a deleted namespace still has items */
+bool namespaces_deleted(struct default_engine *engine);
+
+void namespace_stats(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie);
+
+#endif
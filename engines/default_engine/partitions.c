@@ -0,0 +1,823 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The engine calls of a partitioned engine: each one is handed to the
+ * partition (or the partitions) it's for. The partitions are default
+ * engines of their own, which only know they are partitions when their
+ * configuration is set up (partitions_configure).
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "default_engine_internal.h"
+
+/*
+ * The seed of the hash choosing the partition of a key. It isn't the one
+ * of the hash tables, or the keys of a partition would all share the
+ * bits picking it, and crowd a part of its hash table.
+ */
+#define PARTITION_HASH_SEED 0x9e3779b9
+
+/* The requests of a get_multi or store_multi are split up by this many */
+#define PARTITION_BATCH 64
+
+static struct default_engine *get_handle(ENGINE_HANDLE *handle) {
+    return (struct default_engine*)handle;
+}
+
+static void partitions_log(struct default_engine *engine, const char *msg) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+    logger->log(EXTENSION_LOG_WARNING, NULL, "%s\n", msg);
+}
+
+static unsigned int partition_index(struct default_engine *engine,
+                                    const void *key, size_t nkey) {
+    uint32_t hv = engine->server.core->hash(key, nkey, PARTITION_HASH_SEED);
+    /* The high bits of the hash, scaled to the partitions */
+    return (unsigned int)(((uint64_t)hv * engine->partitions.count) >> 32);
+}
+
+static struct default_engine *partition_of_key(struct default_engine *engine,
+                                               const void *key, size_t nkey) {
+    return engine->partitions.engines[partition_index(engine, key, nkey)];
+}
+
+/* An item is released (and looked at) by the partition of its key */
+static struct default_engine *partition_of_item(struct default_engine *engine,
+                                                const item *item) {
+    const hash_item *it = item;
+    return partition_of_key(engine, item_get_key(it), it->nkey);
+}
+
+static ENGINE_HANDLE *handle_of(struct default_engine *partition) {
+    return (ENGINE_HANDLE*)&partition->engine;
+}
+
+/*
+ * Sort the n (at most PARTITION_BATCH) requests by their partition part[]:
+ * the ones of partition p are order[first[p]] to order[first[p + 1] - 1].
+ */
+static void partition_order(unsigned int count, const unsigned int *part,
+                            size_t n, size_t *order, size_t *first) {
+    size_t next[PARTITIONS_MAX];
+    size_t ii;
+    unsigned int p;
+
+    memset(first, 0, (count + 1) * sizeof(*first));
+    for (ii = 0; ii < n; ++ii) {
+        ++first[part[ii] + 1];
+    }
+    for (p = 0; p < count; ++p) {
+        first[p + 1] += first[p];
+        next[p] = first[p];
+    }
+    for (ii = 0; ii < n; ++ii) {
+        order[next[part[ii]]++] = ii;
+    }
+}
+
+static ENGINE_ERROR_CODE partitioned_allocate(ENGINE_HANDLE *handle,
+                                              const void *cookie,
+                                              item **item,
+                                              const void *key,
+                                              const size_t nkey,
+                                              const size_t nbytes,
+                                              const int flags,
+                                              const rel_time_t exptime,
+                                              uint8_t datatype) {
+    struct default_engine *p = partition_of_key(get_handle(handle), key, nkey);
+    return p->engine.allocate(handle_of(p), cookie, item, key, nkey, nbytes,
+                              flags, exptime, datatype);
+}
+
+static ENGINE_ERROR_CODE partitioned_remove(ENGINE_HANDLE *handle,
+                                            const void *cookie,
+                                            const void *key,
+                                            const size_t nkey,
+                                            uint64_t *cas,
+                                            uint16_t vbucket,
+                                            mutation_descr_t *mut_info) {
+    struct default_engine *p = partition_of_key(get_handle(handle), key, nkey);
+    return p->engine.remove(handle_of(p), cookie, key, nkey, cas, vbucket,
+                            mut_info);
+}
+
+static void partitioned_release(ENGINE_HANDLE *handle, const void *cookie,
+                                item *item) {
+    struct default_engine *p = partition_of_item(get_handle(handle), item);
+    p->engine.release(handle_of(p), cookie, item);
+}
+
+static void partitioned_release_multi(ENGINE_HANDLE *handle,
+                                      const void *cookie,
+                                      item **items, size_t nitems) {
+    struct default_engine *engine = get_handle(handle);
+    struct default_engine *run = NULL;
+    size_t first = 0;
+    size_t ii;
+
+    /* The runs of items of the same partition are released together */
+    for (ii = 0; ii < nitems; ++ii) {
+        struct default_engine *p = partition_of_item(engine, items[ii]);
+        if (p != run) {
+            if (run != NULL) {
+                run->engine.release_multi(handle_of(run), cookie,
+                                          items + first, ii - first);
+            }
+            run = p;
+            first = ii;
+        }
+    }
+    if (run != NULL) {
+        run->engine.release_multi(handle_of(run), cookie, items + first,
+                                  nitems - first);
+    }
+}
+
+static ENGINE_ERROR_CODE partitioned_get(ENGINE_HANDLE *handle,
+                                         const void *cookie,
+                                         item **item,
+                                         const void *key,
+                                         const int nkey,
+                                         uint16_t vbucket) {
+    struct default_engine *p = partition_of_key(get_handle(handle), key, nkey);
+    return p->engine.get(handle_of(p), cookie, item, key, nkey, vbucket);
+}
+
+static ENGINE_ERROR_CODE partitioned_get_multi(ENGINE_HANDLE *handle,
+                                               const void *cookie,
+                                               item_get_request *requests,
+                                               size_t nrequests) {
+    struct default_engine *engine = get_handle(handle);
+    unsigned int count = engine->partitions.count;
+    item_get_request batch[PARTITION_BATCH];
+    unsigned int part[PARTITION_BATCH];
+    size_t order[PARTITION_BATCH];
+    size_t first[PARTITIONS_MAX + 1];
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    size_t done, n, ii;
+    unsigned int p;
+
+    for (done = 0; done < nrequests; done += n) {
+        item_get_request *reqs = requests + done;
+
+        n = nrequests - done;
+        if (n > PARTITION_BATCH) {
+            n = PARTITION_BATCH;
+        }
+        for (ii = 0; ii < n; ++ii) {
+            part[ii] = partition_index(engine, reqs[ii].key, reqs[ii].nkey);
+        }
+        partition_order(count, part, n, order, first);
+        for (ii = 0; ii < n; ++ii) {
+            batch[ii] = reqs[order[ii]];
+        }
+        for (p = 0; p < count; ++p) {
+            struct default_engine *partition = engine->partitions.engines[p];
+            ENGINE_ERROR_CODE r;
+            if (first[p + 1] == first[p]) {
+                continue;
+            }
+            r = partition->engine.get_multi(handle_of(partition), cookie,
+                                            batch + first[p],
+                                            first[p + 1] - first[p]);
+            if (ret == ENGINE_SUCCESS) {
+                ret = r;
+            }
+        }
+        for (ii = 0; ii < n; ++ii) {
+            reqs[order[ii]] = batch[ii];
+        }
+    }
+    return ret;
+}
+
+static void partitioned_prefetch(ENGINE_HANDLE *handle,
+                                 const void *cookie,
+                                 const void *key,
+                                 const int nkey,
+                                 uint16_t vbucket,
+                                 ENGINE_PREFETCH_STAGE stage) {
+    struct default_engine *p = partition_of_key(get_handle(handle), key, nkey);
+    p->engine.prefetch(handle_of(p), cookie, key, nkey, vbucket, stage);
+}
+
+static ENGINE_ERROR_CODE partitioned_store(ENGINE_HANDLE *handle,
+                                           const void *cookie,
+                                           item *item,
+                                           uint64_t *cas,
+                                           ENGINE_STORE_OPERATION operation,
+                                           uint16_t vbucket) {
+    struct default_engine *p = partition_of_item(get_handle(handle), item);
+    return p->engine.store(handle_of(p), cookie, item, cas, operation,
+                           vbucket);
+}
+
+static ENGINE_ERROR_CODE partitioned_store_multi(ENGINE_HANDLE *handle,
+                                                 const void *cookie,
+                                                 item_store_request *requests,
+                                                 size_t nrequests) {
+    struct default_engine *engine = get_handle(handle);
+    unsigned int count = engine->partitions.count;
+    item_store_request batch[PARTITION_BATCH];
+    unsigned int part[PARTITION_BATCH];
+    size_t order[PARTITION_BATCH];
+    size_t first[PARTITIONS_MAX + 1];
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    size_t done, n, ii;
+    unsigned int p;
+
+    for (done = 0; done < nrequests; done += n) {
+        item_store_request *reqs = requests + done;
+
+        n = nrequests - done;
+        if (n > PARTITION_BATCH) {
+            n = PARTITION_BATCH;
+        }
+        for (ii = 0; ii < n; ++ii) {
+            part[ii] = partition_index(engine, reqs[ii].key, reqs[ii].nkey);
+        }
+        partition_order(count, part, n, order, first);
+        for (ii = 0; ii < n; ++ii) {
+            batch[ii] = reqs[order[ii]];
+        }
+        for (p = 0; p < count; ++p) {
+            struct default_engine *partition = engine->partitions.engines[p];
+            ENGINE_ERROR_CODE r;
+            if (first[p + 1] == first[p]) {
+                continue;
+            }
+            r = partition->engine.store_multi(handle_of(partition), cookie,
+                                              batch + first[p],
+                                              first[p + 1] - first[p]);
+            if (ret == ENGINE_SUCCESS) {
+                ret = r;
+            }
+        }
+        for (ii = 0; ii < n; ++ii) {
+            reqs[order[ii]] = batch[ii];
+        }
+    }
+    return ret;
+}
+
+static ENGINE_ERROR_CODE partitioned_splice(ENGINE_HANDLE *handle,
+                                           const void *cookie,
+                                           item *item,
+                                           uint64_t *cas,
+                                           size_t offset,
+                                           size_t length,
+                                           const void *data,
+                                           size_t ndata,
+                                           uint16_t vbucket) {
+    struct default_engine *p = partition_of_item(get_handle(handle), item);
+    return p->engine.splice(handle_of(p), cookie, item, cas, offset, length,
+                            data, ndata, vbucket);
+}
+
+static ENGINE_ERROR_CODE partitioned_arithmetic(ENGINE_HANDLE *handle,
+                                                const void *cookie,
+                                                const void *key,
+                                                const int nkey,
+                                                const bool increment,
+                                                const bool create,
+                                                const uint64_t delta,
+                                                const uint64_t initial,
+                                                const rel_time_t exptime,
+                                                item **item,
+                                                uint8_t datatype,
+                                                uint64_t *result,
+                                                uint16_t vbucket) {
+    struct default_engine *p = partition_of_key(get_handle(handle), key, nkey);
+    return p->engine.arithmetic(handle_of(p), cookie, key, nkey, increment,
+                                create, delta, initial, exptime, item,
+                                datatype, result, vbucket);
+}
+
+static ENGINE_ERROR_CODE partitioned_flush(ENGINE_HANDLE *handle,
+                                           const void *cookie, time_t when) {
+    struct default_engine *engine = get_handle(handle);
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    unsigned int p;
+
+    for (p = 0; p < engine->partitions.count; ++p) {
+        struct default_engine *partition = engine->partitions.engines[p];
+        ENGINE_ERROR_CODE r;
+        r = partition->engine.flush(handle_of(partition), cookie, when);
+        if (ret == ENGINE_SUCCESS) {
+            ret = r;
+        }
+    }
+    return ret;
+}
+
+/* A general stat, as summed up over the partitions */
+struct merged_stat {
+    char *key;            /* followed by the value of the first partition */
+    uint16_t klen;
+    uint32_t vlen;
+    bool count;           /* all the partitions gave a number */
+    uint64_t value;
+};
+
+/*
+ * The partitions get stat_merge as the cookie of their get_stats (which
+ * is only handed back to add_stat)
+ */
+struct stat_merge {
+    struct merged_stat *stats;
+    size_t nstats;
+    size_t size;
+    size_t next;          /* where the next stat of a partition should be */
+    bool failed;
+};
+
+/* The general stats which aren't counts of the whole cache */
+static bool stat_is_max(const char *key, uint16_t klen) {
+    static const char *const names[] = {
+        "item_header_size", "restart_rebuild_ms", "namespaces", NULL
+    };
+    int ii;
+
+    for (ii = 0; names[ii] != NULL; ++ii) {
+        if (strlen(names[ii]) == klen && memcmp(names[ii], key, klen) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool stat_count(const char *val, uint32_t vlen, uint64_t *value) {
+    uint32_t ii;
+
+    if (vlen == 0 || vlen > 19) {
+        return false;
+    }
+    *value = 0;
+    for (ii = 0; ii < vlen; ++ii) {
+        if (val[ii] < '0' || val[ii] > '9') {
+            return false;
+        }
+        *value = *value * 10 + (uint64_t)(val[ii] - '0');
+    }
+    return true;
+}
+
+static struct merged_stat *find_stat(struct stat_merge *merge,
+                                     const char *key, uint16_t klen) {
+    size_t ii;
+
+    /* The partitions add the same stats in the same order */
+    if (merge->next < merge->nstats &&
+        merge->stats[merge->next].klen == klen &&
+        memcmp(merge->stats[merge->next].key, key, klen) == 0) {
+        return &merge->stats[merge->next];
+    }
+    for (ii = 0; ii < merge->nstats; ++ii) {
+        if (merge->stats[ii].klen == klen &&
+            memcmp(merge->stats[ii].key, key, klen) == 0) {
+            return &merge->stats[ii];
+        }
+    }
+    return NULL;
+}
+
+static void merge_stat(const char *key, const uint16_t klen,
+                       const char *val, const uint32_t vlen,
+                       const void *cookie) {
+    struct stat_merge *merge = (void*)cookie;
+    struct merged_stat *stat;
+    uint64_t value = 0;
+    bool count;
+
+    if (merge->failed) {
+        return;
+    }
+    count = stat_count(val, vlen, &value);
+    stat = find_stat(merge, key, klen);
+    if (stat == NULL) {
+        if (merge->nstats == merge->size) {
+            size_t size = merge->size ? merge->size * 2 : 64;
+            void *stats = realloc(merge->stats, size * sizeof(*stat));
+            if (stats == NULL) {
+                merge->failed = true;
+                return;
+            }
+            merge->stats = stats;
+            merge->size = size;
+        }
+        stat = &merge->stats[merge->nstats];
+        if ((stat->key = malloc((size_t)klen + vlen)) == NULL) {
+            merge->failed = true;
+            return;
+        }
+        memcpy(stat->key, key, klen);
+        memcpy(stat->key + klen, val, vlen);
+        stat->klen = klen;
+        stat->vlen = vlen;
+        stat->count = count;
+        stat->value = value;
+        ++merge->nstats;
+    } else if (!count) {
+        stat->count = false;
+    } else if (stat->count) {
+        if (!stat_is_max(key, klen)) {
+            stat->value += value;
+        } else if (value > stat->value) {
+            stat->value = value;
+        }
+    }
+    merge->next = (size_t)(stat - merge->stats) + 1;
+}
+
+static ENGINE_ERROR_CODE general_stats(struct default_engine *engine,
+                                       const void *cookie,
+                                       ADD_STAT add_stat) {
+    struct stat_merge merge;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    char val[32];
+    int len;
+    unsigned int p;
+    size_t ii;
+
+    memset(&merge, 0, sizeof(merge));
+    for (p = 0; p < engine->partitions.count && ret == ENGINE_SUCCESS; ++p) {
+        struct default_engine *partition = engine->partitions.engines[p];
+        merge.next = 0;
+        ret = partition->engine.get_stats(handle_of(partition), &merge,
+                                          NULL, 0, merge_stat);
+    }
+    if (ret == ENGINE_SUCCESS && merge.failed) {
+        ret = ENGINE_ENOMEM;
+    }
+
+    if (ret == ENGINE_SUCCESS) {
+        len = sprintf(val, "%u", engine->partitions.count);
+        add_stat("partitions", 10, val, len, cookie);
+    }
+    for (ii = 0; ii < merge.nstats; ++ii) {
+        struct merged_stat *stat = &merge.stats[ii];
+        if (ret == ENGINE_SUCCESS) {
+            if (stat->count) {
+                len = sprintf(val, "%"PRIu64, stat->value);
+                add_stat(stat->key, stat->klen, val, len, cookie);
+            } else {
+                add_stat(stat->key, stat->klen, stat->key + stat->klen,
+                         stat->vlen, cookie);
+            }
+        }
+        free(stat->key);
+    }
+    free(merge.stats);
+    return ret;
+}
+
+/*
+ * The other stat groups are per partition, with their keys prefixed by
+ * "partition_<n>:". The partitions get stat_prefix as the cookie.
+ */
+struct stat_prefix {
+    const void *cookie;
+    ADD_STAT add_stat;
+    unsigned int index;
+};
+
+static void prefix_stat(const char *key, const uint16_t klen,
+                        const char *val, const uint32_t vlen,
+                        const void *cookie) {
+    const struct stat_prefix *prefix = cookie;
+    char name[256];
+    int len = snprintf(name, sizeof(name), "partition_%u:%.*s",
+                       prefix->index, (int)klen, key);
+
+    if (len > 0 && (size_t)len < sizeof(name)) {
+        prefix->add_stat(name, (uint16_t)len, val, vlen, prefix->cookie);
+    }
+}
+
+static ENGINE_ERROR_CODE partitioned_get_stats(ENGINE_HANDLE *handle,
+                                               const void *cookie,
+                                               const char *stat_key,
+                                               int nkey,
+                                               ADD_STAT add_stat) {
+    struct default_engine *engine = get_handle(handle);
+    struct default_engine *first = engine->partitions.engines[0];
+    struct stat_prefix prefix;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    unsigned int p;
+
+    if (stat_key == NULL) {
+        return general_stats(engine, cookie, add_stat);
+    }
+    /* The partitions have the uuid of the engine */
+    if (strncmp(stat_key, "uuid", 4) == 0) {
+        return first->engine.get_stats(handle_of(first), cookie, stat_key,
+                                       nkey, add_stat);
+    }
+
+    prefix.cookie = cookie;
+    prefix.add_stat = add_stat;
+    for (p = 0; p < engine->partitions.count && ret == ENGINE_SUCCESS; ++p) {
+        struct default_engine *partition = engine->partitions.engines[p];
+        prefix.index = p;
+        ret = partition->engine.get_stats(handle_of(partition), &prefix,
+                                          stat_key, nkey, prefix_stat);
+    }
+    return ret;
+}
+
+static void partitioned_reset_stats(ENGINE_HANDLE *handle,
+                                    const void *cookie) {
+    struct default_engine *engine = get_handle(handle);
+    unsigned int p;
+
+    for (p = 0; p < engine->partitions.count; ++p) {
+        struct default_engine *partition = engine->partitions.engines[p];
+        partition->engine.reset_stats(handle_of(partition), cookie);
+    }
+}
+
+/*
+ * The response of a command sent to all the partitions, which are given
+ * the broadcast as the cookie (the commands only hand it to the response)
+ */
+struct broadcast {
+    uint16_t status;      /* the first failure, SUCCESS if none */
+    char body[128];       /* ...and the message it came with */
+    uint32_t bodylen;
+    bool succeeded;       /* a partition succeeded */
+    uint64_t items;       /* the sum of the NAMESPACE_DELETE counts */
+};
+
+static bool broadcast_response(const void *key, uint16_t keylen,
+                               const void *ext, uint8_t extlen,
+                               const void *body, uint32_t bodylen,
+                               uint8_t datatype, uint16_t status,
+                               uint64_t cas, const void *cookie) {
+    struct broadcast *b = (void*)cookie;
+    uint64_t items;
+
+    if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        b->succeeded = true;
+    } else if (b->status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        b->status = status;
+        b->bodylen = bodylen < sizeof(b->body) ? bodylen : sizeof(b->body);
+        memcpy(b->body, body, b->bodylen);
+    }
+    if (extlen == sizeof(items)) {
+        memcpy(&items, ext, sizeof(items));
+        b->items += ntohll(items);
+    }
+    return true;
+}
+
+static void broadcast(struct default_engine *engine, unsigned int from,
+                      protocol_binary_request_header *request,
+                      struct broadcast *b) {
+    unsigned int p;
+
+    memset(b, 0, sizeof(*b));
+    for (p = from; p < engine->partitions.count; ++p) {
+        struct default_engine *partition = engine->partitions.engines[p];
+        partition->engine.unknown_command(handle_of(partition), b, request,
+                                          broadcast_response);
+    }
+}
+
+static ENGINE_ERROR_CODE partitioned_unknown_command(ENGINE_HANDLE *handle,
+                                                     const void *cookie,
+                                                     protocol_binary_request_header *request,
+                                                     ADD_RESPONSE response) {
+    struct default_engine *engine = get_handle(handle);
+    struct default_engine *first = engine->partitions.engines[0];
+    struct default_engine *p;
+    struct broadcast b;
+    bool sent;
+
+    switch (request->request.opcode) {
+    case PROTOCOL_BINARY_CMD_TOUCH:
+    case PROTOCOL_BINARY_CMD_GAT:
+    case PROTOCOL_BINARY_CMD_GATQ:
+    case PROTOCOL_BINARY_CMD_GET_LEASE:
+    case PROTOCOL_BINARY_CMD_GET_REPLICA:
+        p = partition_of_key(engine, (const char*)request + sizeof(*request) +
+                             request->request.extlen,
+                             ntohs(request->request.keylen));
+        return p->engine.unknown_command(handle_of(p), cookie, request,
+                                         response);
+    case PROTOCOL_BINARY_CMD_SET_VBUCKET:
+    case PROTOCOL_BINARY_CMD_DEL_VBUCKET:
+    case PROTOCOL_BINARY_CMD_SCRUB:
+        /* The first partition answers once the others are done */
+        broadcast(engine, 1, request, &b);
+        if (b.status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            return first->engine.unknown_command(handle_of(first), cookie,
+                                                 request, response);
+        }
+        sent = response(NULL, 0, NULL, 0, b.body, b.bodylen,
+                        PROTOCOL_BINARY_RAW_BYTES, b.status, 0, cookie);
+        break;
+    case PROTOCOL_BINARY_CMD_GET_VBUCKET:
+        /* The partitions all have the same vbucket states */
+        return first->engine.unknown_command(handle_of(first), cookie,
+                                             request, response);
+    case PROTOCOL_BINARY_CMD_NAMESPACE_DELETE:
+        broadcast(engine, 0, request, &b);
+        if (b.succeeded) {
+            protocol_binary_response_namespace_delete rsp;
+            rsp.message.body.items = htonll(b.items);
+            sent = response(NULL, 0, &rsp.message.body,
+                            sizeof(rsp.message.body), NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+        } else {
+            sent = response(NULL, 0, NULL, 0, b.body, b.bodylen,
+                            PROTOCOL_BINARY_RAW_BYTES, b.status, 0, cookie);
+        }
+        break;
+    case PROTOCOL_BINARY_CMD_TOUCHM:
+    case PROTOCOL_BINARY_CMD_GATM:
+    case PROTOCOL_BINARY_CMD_INCRM:
+    case PROTOCOL_BINARY_CMD_CASM:
+    case PROTOCOL_BINARY_CMD_SNAPSHOT_DUMP:
+    case PROTOCOL_BINARY_CMD_SNAPSHOT_LOAD:
+    case PROTOCOL_BINARY_CMD_SCAN_KEYS:
+    case PROTOCOL_BINARY_CMD_SLAB_REASSIGN:
+        sent = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, 0, cookie);
+        break;
+    default:
+        return first->engine.unknown_command(handle_of(first), cookie,
+                                             request, response);
+    }
+
+    return sent ? ENGINE_SUCCESS : ENGINE_FAILED;
+}
+
+static void partitioned_item_set_cas(ENGINE_HANDLE *handle,
+                                     const void *cookie,
+                                     item *item, uint64_t cas) {
+    struct default_engine *p = partition_of_item(get_handle(handle), item);
+    p->engine.item_set_cas(handle_of(p), cookie, item, cas);
+}
+
+static bool partitioned_get_item_info(ENGINE_HANDLE *handle,
+                                      const void *cookie,
+                                      const item *item,
+                                      item_info *item_info) {
+    struct default_engine *p = partition_of_item(get_handle(handle), item);
+    return p->engine.get_item_info(handle_of(p), cookie, item, item_info);
+}
+
+static bool partitioned_get_item_view(ENGINE_HANDLE *handle,
+                                      const void *cookie,
+                                      const item *item,
+                                      item_view *item_view) {
+    struct default_engine *p = partition_of_item(get_handle(handle), item);
+    return p->engine.get_item_view(handle_of(p), cookie, item, item_view);
+}
+
+static bool partitioned_get_item_segment(ENGINE_HANDLE *handle,
+                                         const void *cookie,
+                                         const item *item,
+                                         uint16_t index,
+                                         struct iovec *segment) {
+    struct default_engine *p = partition_of_item(get_handle(handle), item);
+    return p->engine.get_item_segment(handle_of(p), cookie, item, index,
+                                      segment);
+}
+
+static bool partitioned_set_item_info(ENGINE_HANDLE *handle,
+                                      const void *cookie,
+                                      item *item,
+                                      const item_info *itm_info) {
+    struct default_engine *p = partition_of_item(get_handle(handle), item);
+    return p->engine.set_item_info(handle_of(p), cookie, item, itm_info);
+}
+
+ENGINE_ERROR_CODE partitions_init(struct default_engine *engine,
+                                  const char *config_str) {
+    size_t count = engine->config.partitions;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    size_t ii;
+
+    if (count > PARTITIONS_MAX) {
+        partitions_log(engine, "partitions must be at most 64");
+        return ENGINE_EINVAL;
+    }
+
+    engine->partitions.engines = calloc(count, sizeof(struct default_engine*));
+    if (engine->partitions.engines == NULL) {
+        return ENGINE_ENOMEM;
+    }
+
+    for (ii = 0; ii < count && ret == ENGINE_SUCCESS; ++ii) {
+        struct default_engine *partition;
+        ENGINE_HANDLE *handle;
+
+        ret = create_instance(1, engine->get_server_api, &handle);
+        if (ret != ENGINE_SUCCESS) {
+            break;
+        }
+        partition = get_handle(handle);
+        partition->partitions.parent = engine;
+        partition->partitions.index = (unsigned int)ii;
+        engine->partitions.engines[ii] = partition;
+        engine->partitions.count = (unsigned int)ii + 1;
+        ret = partition->engine.initialize(handle, config_str);
+    }
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+
+    engine->engine.allocate = partitioned_allocate;
+    engine->engine.remove = partitioned_remove;
+    engine->engine.release = partitioned_release;
+    engine->engine.release_multi = partitioned_release_multi;
+    engine->engine.get = partitioned_get;
+    engine->engine.get_multi = partitioned_get_multi;
+    engine->engine.prefetch = partitioned_prefetch;
+    engine->engine.get_stats = partitioned_get_stats;
+    engine->engine.reset_stats = partitioned_reset_stats;
+    engine->engine.store = partitioned_store;
+    engine->engine.store_multi = partitioned_store_multi;
+    engine->engine.splice = partitioned_splice;
+    engine->engine.arithmetic = partitioned_arithmetic;
+    engine->engine.flush = partitioned_flush;
+    engine->engine.unknown_command = partitioned_unknown_command;
+    engine->engine.item_set_cas = partitioned_item_set_cas;
+    engine->engine.get_item_info = partitioned_get_item_info;
+    engine->engine.get_item_view = partitioned_get_item_view;
+    engine->engine.get_item_segment = partitioned_get_item_segment;
+    engine->engine.set_item_info = partitioned_set_item_info;
+    return ENGINE_SUCCESS;
+}
+
+/* Give the file of the partition a name of its own: <path>.<index> */
+static bool partition_path(char **path, unsigned int index) {
+    char *name;
+
+    if (*path == NULL) {
+        return true;
+    }
+    if ((name = malloc(strlen(*path) + 12)) == NULL) {
+        return false;
+    }
+    sprintf(name, "%s.%u", *path, index);
+    free(*path);
+    *path = name;
+    return true;
+}
+
+ENGINE_ERROR_CODE partitions_configure(struct default_engine *partition) {
+    struct config *config = &partition->config;
+    size_t count = partition->partitions.parent->config.partitions;
+    unsigned int index = partition->partitions.index;
+
+    /* The sizes given for the cache are split up */
+    config->maxbytes /= count;
+    config->expected_items /= count;
+    config->miss_filter_items /= count;
+    config->ext_size /= count;
+    config->hard_quota /= count;
+
+    if (!partition_path(&config->restart_file, index) ||
+        !partition_path(&config->ext_path, index)) {
+        return ENGINE_ENOMEM;
+    }
+
+    /* Bind the arena of each partition to the next node */
+    if (config->numa_policy != NULL &&
+        strcmp(config->numa_policy, "spread") == 0) {
+        int node = slabs_numa_node(index);
+        char *policy = malloc(32);
+
+        if (policy == NULL) {
+            return ENGINE_ENOMEM;
+        }
+        if (node < 0) {
+            strcpy(policy, "default");
+        } else {
+            sprintf(policy, "bind:%d", node);
+        }
+        free(config->numa_policy);
+        config->numa_policy = policy;
+    }
+    return ENGINE_SUCCESS;
+}
+
+void partitions_destroy(struct default_engine *engine, bool force) {
+    unsigned int p;
+
+    for (p = 0; p < engine->partitions.count; ++p) {
+        struct default_engine *partition = engine->partitions.engines[p];
+        partition->engine.destroy(handle_of(partition), force);
+    }
+    free(engine->partitions.engines);
+    engine->partitions.engines = NULL;
+    engine->partitions.count = 0;
+}
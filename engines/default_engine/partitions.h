@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* The shared-nothing partitions of an engine (see config.partitions) */
+#ifndef PARTITIONS_H
+#define PARTITIONS_H
+
+/*
+ * With config.partitions set to N > 1 the engine keeps no cache of its
+ * own: it creates N default engines (the partitions) and hands every key
+ * to one of them by a hash of the key. Each partition has its own hash
+ * table, slab allocator, LRUs, locks and background threads, so two
+ * keys of different partitions never touch the same memory or lock. A
+ * partition gets 1/N of maxbytes (and of the other sizes given for the
+ * whole cache), a restart_file and an ext_path of its own, and with
+ * numa_policy "spread" an arena bound to a NUMA node in turn.
+ *
+ * The operations on a key (or an item) run in its partition, on the
+ * calling thread. The batched ones are split up by partition, flush,
+ * the vbucket states and the namespace deletes go to all of them, and
+ * the general stats are summed up over them. The commands walking the
+ * whole cache (snapshots, key scans, slab moves) and the multi key ones
+ * aren't supported.
+ */
+
+/* The most partitions an engine may have */
+#define PARTITIONS_MAX 64
+
+struct partitions {
+    /* The partitions this engine routes to, NULL unless partitioned */
+    struct default_engine **engines;
+    unsigned int count;
+
+    /* In a partition: the engine routing to it, and its number there */
+    struct default_engine *parent;
+    unsigned int index;
+};
+
+/*
+ * Create and initialize the config.partitions partitions (with the
+ * configuration of the engine), and route the engine's calls to them.
+ * What was created is left to partitions_destroy on a failure.
+ */
+ENGINE_ERROR_CODE partitions_init(struct default_engine *engine,
+                                  const char *config_str);
+
+/*
+ * Called by a partition with its configuration parsed, to scale it down
+ * to its share of the cache and give it files of its own.
+ */
+ENGINE_ERROR_CODE partitions_configure(struct default_engine *partition);
+
+void partitions_destroy(struct default_engine *engine, bool force);
+
+#endif
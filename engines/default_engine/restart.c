@@ -0,0 +1,566 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Warm restarts (config.restart_file): the slab arena is a shared mapping
+ * of a file, on tmpfs or a DAX device, so a new process finds the items
+ * of the last one in it instead of starting with an empty cache.
+ *
+ * At a clean shutdown the header is written with what can't be told from
+ * the items: the slab class of every page, how far the last page of each
+ * class was carved, the address the arena was at and the clock. When the
+ * next process maps the file with the same memory settings, the pages
+ * are handed back to their slab classes and the items linked into a new
+ * hash table and the LRUs, by RESTART_THREADS threads. The hash table is
+ * started out as large as it was.
+ *
+ * The header is marked dirty as soon as the arena is in use, so the file
+ * is only trusted after a clean shutdown; after a crash the cache starts
+ * out empty. The LRUs are rebuilt in the order of the pages, the leases,
+ * the sequence log and the values in the extended storage are lost.
+ *
+ * With config.slab_learn the header also gets the slab classes learned
+ * from the sizes of the items (see slabs_learn) when they waste enough
+ * less than the ones in use. The next process carves the arena with
+ * them instead, so it starts out empty once.
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+#define RESTART_MAGIC UINT64_C(0x6d63646573746172)
+#define RESTART_VERSION 4
+
+/* How much less slack the learned classes must have to be saved (%) */
+#define RESTART_LEARN_GAIN 10
+
+/* The threads rebuilding the cache */
+#define RESTART_THREADS 4
+
+/* The header is padded to this, so the arena starts page aligned */
+#define RESTART_HEADER_ALIGN 4096
+
+struct restart_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t clean;
+
+    /* The settings the arena was carved with, which must not change */
+    uint64_t maxbytes;
+    uint64_t item_size_max;
+    uint64_t chunk_size;
+    uint64_t large_item_size_max;
+    float factor;
+    uint32_t use_cas;
+    uint32_t compact_items;
+    uint32_t tiny_items;
+    uint32_t vbucket_index;
+    uint32_t npages_max;
+    /* The chunk sizes of the slab classes (see slabs.plan) */
+    uint32_t nplan;
+    uint32_t plan[MAX_NUMBER_OF_SLAB_CLASSES];
+
+    /*
+     * The chunk sizes learned from the items at the shutdown (see
+     * config.slab_learn), nlearned is 0 if they weren't better enough
+     */
+    uint32_t nlearned;
+    uint32_t learned[MAX_NUMBER_OF_SLAB_CLASSES];
+
+    /* The state at the shutdown */
+    uint64_t base;            /* the address of the arena */
+    int64_t started;          /* the time of rel_time_t 0 */
+    rel_time_t shutdown;
+    rel_time_t oldest_live;
+    uint64_t flush_cas;
+    uint32_t npages;          /* pages carved from the arena */
+    uint32_t hashpower;
+    uint32_t bucketed;
+    struct {
+        uint32_t page;        /* 1 + the index of the page partly carved */
+        uint32_t free;        /* the chunks of it not carved */
+    } ends[MAX_NUMBER_OF_SLAB_CLASSES];
+
+    /* The slab class of each page (0 for a page in no class) */
+    uint8_t page_class[];
+};
+
+static void restart_log(struct default_engine *engine, const char *msg) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+    logger->log(EXTENSION_LOG_WARNING, NULL, "%s: %s\n",
+                engine->config.restart_file, msg);
+}
+
+static size_t restart_header_size(uint32_t npages_max) {
+    size_t size = sizeof(struct restart_header) + npages_max;
+    return (size + RESTART_HEADER_ALIGN - 1) & ~(size_t)(RESTART_HEADER_ALIGN - 1);
+}
+
+#ifndef WIN32
+/* Whether the arena was carved with the slab classes planned now */
+static bool restart_plan_ok(struct default_engine *engine,
+                            const struct restart_header *header) {
+    unsigned int ii;
+
+    if (header->nplan != engine->slabs.nplan) {
+        return false;
+    }
+    for (ii = 0; ii < header->nplan; ++ii) {
+        if (header->plan[ii] != engine->slabs.plan[ii]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Plan the slab classes learned before the restart, instead of the ones of
+ * the settings. If the arena was carved with other classes it is started
+ * out empty.
+ */
+static void restart_use_learned(struct default_engine *engine,
+                                const struct restart_header *header) {
+    if (header->nlearned <= POWER_SMALLEST ||
+        header->nlearned > MAX_NUMBER_OF_SLAB_CLASSES) {
+        return;
+    }
+    memset(engine->slabs.plan, 0, sizeof(engine->slabs.plan));
+    memcpy(engine->slabs.plan, header->learned,
+           header->nlearned * sizeof(header->learned[0]));
+    engine->slabs.nplan = header->nlearned;
+    engine->slabs.learned = true;
+    if (!restart_plan_ok(engine, header)) {
+        restart_log(engine, "Using the slab classes learned before the "
+                    "restart, the cache starts out empty");
+    }
+}
+
+/* Whether the header describes an arena we may take over as it is */
+static bool restart_header_ok(struct default_engine *engine,
+                              const struct restart_header *header,
+                              uint32_t npages_max) {
+    const struct config *config = &engine->config;
+    return header->magic == RESTART_MAGIC &&
+        header->version == RESTART_VERSION &&
+        header->clean != 0 &&
+        header->maxbytes == config->maxbytes &&
+        header->item_size_max == config->item_size_max &&
+        header->chunk_size == config->chunk_size &&
+        header->large_item_size_max == config->large_item_size_max &&
+        header->factor == config->factor &&
+        header->use_cas == (uint32_t)config->use_cas &&
+        header->compact_items == (uint32_t)config->compact_items &&
+        header->tiny_items == (uint32_t)config->tiny_items &&
+        header->vbucket_index == (uint32_t)config->vbucket_index &&
+        header->npages_max == npages_max &&
+        header->npages <= npages_max &&
+        restart_plan_ok(engine, header);
+}
+#endif
+
+ENGINE_ERROR_CODE restart_init(struct default_engine *engine) {
+    struct restart *restart = &engine->restart;
+    const struct config *config = &engine->config;
+
+    restart->fd = -1;
+    if (config->restart_file == NULL) {
+        return ENGINE_SUCCESS;
+    }
+
+#ifdef WIN32
+    restart_log(engine, "Warm restarts are not supported on this platform");
+    return ENGINE_SUCCESS;
+#else
+    {
+        uint32_t npages_max;
+        size_t header_size;
+        struct restart_header old;
+        void *hint = NULL;
+        struct stat st;
+
+        if (!config->preallocate) {
+            restart_log(engine, "restart_file requires preallocate");
+            return ENGINE_EINVAL;
+        }
+
+        npages_max = (uint32_t)(config->maxbytes / config->item_size_max);
+        header_size = restart_header_size(npages_max);
+        restart->map_size = header_size + config->maxbytes;
+
+        restart->fd = open(config->restart_file, O_RDWR | O_CREAT, 0600);
+        if (restart->fd == -1 || fstat(restart->fd, &st) != 0) {
+            restart_log(engine, strerror(errno));
+            return ENGINE_FAILED;
+        }
+
+        memset(&old, 0, sizeof(old));
+        if ((size_t)st.st_size != restart->map_size ||
+            pread(restart->fd, &old, sizeof(old), 0) != sizeof(old)) {
+            memset(&old, 0, sizeof(old));
+        } else if (old.magic == RESTART_MAGIC &&
+                   old.version == RESTART_VERSION && old.clean != 0 &&
+                   config->slab_learn) {
+            restart_use_learned(engine, &old);
+        }
+        if (restart_header_ok(engine, &old, npages_max)) {
+            restart->attach = true;
+            /* Try for the same address, to spare the fixups */
+            hint = (char*)(uintptr_t)old.base - header_size;
+        } else if (ftruncate(restart->fd, 0) != 0 ||
+                   ftruncate(restart->fd, (off_t)restart->map_size) != 0) {
+            /* Truncating first drops whatever was left in it */
+            restart_log(engine, strerror(errno));
+            return ENGINE_FAILED;
+        }
+
+        restart->map = mmap(hint, restart->map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, restart->fd, 0);
+        if (restart->map == MAP_FAILED) {
+            restart->map = NULL;
+            restart_log(engine, strerror(errno));
+            return ENGINE_FAILED;
+        }
+        restart->header = restart->map;
+        restart->arena = (char*)restart->map + header_size;
+
+        if (restart->attach) {
+            struct restart_header *header = restart->header;
+            struct restart_fixup *fixup = &restart->fixup;
+
+            fixup->delta = (intptr_t)((uintptr_t)restart->arena -
+                                      (uintptr_t)header->base);
+            fixup->time_delta = header->started -
+                (int64_t)engine->server.core->abstime(0);
+            fixup->shutdown = header->shutdown;
+            fixup->oldest_live = header->oldest_live;
+            fixup->flush_cas = header->flush_cas;
+
+            /* Start out with the hash table as large as it was */
+            if (header->bucketed == (uint32_t)config->bucketed_index) {
+                engine->assoc.hashpower = header->hashpower +
+                    (header->bucketed ? 2 : 0);
+            }
+        } else {
+            memset(restart->header, 0, header_size);
+            restart->header->magic = RESTART_MAGIC;
+            restart->header->version = RESTART_VERSION;
+        }
+
+        /* Until the next clean shutdown the arena can't be trusted */
+        restart->header->clean = 0;
+        msync(restart->header, header_size, MS_SYNC);
+        return ENGINE_SUCCESS;
+    }
+#endif
+}
+
+/* A page to rebuild, and the chunks carved from it */
+struct restart_page {
+    char *page;
+    unsigned int id;
+    unsigned int nchunks;
+};
+
+struct restart_worker {
+    struct default_engine *engine;
+    struct restart_page *pages;
+    size_t npages;
+    volatile size_t *next;
+    int pass;
+    struct restart_counts counts;
+    cb_thread_t tid;
+};
+
+static void restart_worker_main(void *arg) {
+    struct restart_worker *worker = arg;
+    struct default_engine *engine = worker->engine;
+    size_t ii;
+
+    while ((ii = __sync_fetch_and_add(worker->next, 1)) < worker->npages) {
+        struct restart_page *page = &worker->pages[ii];
+        unsigned int size = engine->slabs.slabclass[page->id].size;
+        unsigned int jj;
+
+        for (jj = 0; jj < page->nchunks; ++jj) {
+            item_restart_chunk(engine, worker->pass,
+                               (hash_item*)(page->page + (size_t)jj * size),
+                               page->id, &engine->restart.fixup,
+                               &worker->counts);
+        }
+    }
+}
+
+/*
+ * Run a pass over all of the pages, split between the threads (or in
+ * this thread if they can't be started)
+ */
+static void restart_run_pass(struct default_engine *engine,
+                             struct restart_worker *workers,
+                             struct restart_page *pages, size_t npages,
+                             int pass) {
+    volatile size_t next = 0;
+    bool started[RESTART_THREADS];
+    int ii;
+
+    for (ii = 0; ii < RESTART_THREADS; ++ii) {
+        workers[ii].engine = engine;
+        workers[ii].pages = pages;
+        workers[ii].npages = npages;
+        workers[ii].next = &next;
+        workers[ii].pass = pass;
+        started[ii] = cb_create_thread(&workers[ii].tid, restart_worker_main,
+                                       &workers[ii], 0) == 0;
+    }
+    for (ii = 0; ii < RESTART_THREADS; ++ii) {
+        if (started[ii]) {
+            cb_join_thread(workers[ii].tid);
+        }
+    }
+    /* Whatever the threads didn't get to */
+    restart_worker_main(&workers[0]);
+}
+
+ENGINE_ERROR_CODE restart_rebuild(struct default_engine *engine) {
+    struct restart *restart = &engine->restart;
+    struct restart_header *header = restart->header;
+    struct restart_worker workers[RESTART_THREADS];
+    struct restart_counts total;
+    struct restart_page *pages;
+    size_t npages = 0;
+    hrtime_t start = gethrtime();
+    uint32_t ii;
+    int jj;
+
+    if (!restart->attach) {
+        return ENGINE_SUCCESS;
+    }
+
+    if ((pages = calloc(header->npages + 1, sizeof(*pages))) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+
+    /* Give the pages back to their slab classes */
+    for (ii = 0; ii < header->npages; ++ii) {
+        unsigned int id = header->page_class[ii];
+        char *page = (char*)restart->arena +
+            (size_t)ii * engine->config.item_size_max;
+        unsigned int nchunks;
+
+        if (id < POWER_SMALLEST || id > engine->slabs.power_largest) {
+            /* A spare page (or one being moved between classes) */
+            if (!slabs_restart_spare(engine, page)) {
+                free(pages);
+                return ENGINE_ENOMEM;
+            }
+            continue;
+        }
+        nchunks = engine->slabs.slabclass[id].perslab;
+        if (header->ends[id].page == ii + 1) {
+            nchunks -= header->ends[id].free;
+        }
+        if (!slabs_restart_page(engine, id, page, nchunks)) {
+            free(pages);
+            return ENGINE_ENOMEM;
+        }
+        pages[npages].page = page;
+        pages[npages].id = id;
+        pages[npages].nchunks = nchunks;
+        ++npages;
+    }
+    slabs_restart_arena(engine, (size_t)header->npages *
+                        engine->config.item_size_max);
+
+    /*
+     * The passes can't overlap: the chunks of the chained items are
+     * claimed once all references have been reset, and the rest is only
+     * freed once all of them are claimed.
+     */
+    memset(workers, 0, sizeof(workers));
+    restart_run_pass(engine, workers, pages, npages, 0);
+    restart_run_pass(engine, workers, pages, npages, 1);
+    restart_run_pass(engine, workers, pages, npages, 2);
+    free(pages);
+
+    memset(&total, 0, sizeof(total));
+    for (jj = 0; jj < RESTART_THREADS; ++jj) {
+        total.items += workers[jj].counts.items;
+        total.bytes += workers[jj].counts.bytes;
+        total.dropped += workers[jj].counts.dropped;
+        if (workers[jj].counts.max_cas > total.max_cas) {
+            total.max_cas = workers[jj].counts.max_cas;
+        }
+    }
+    item_restart_done(engine, &total);
+
+    /* A flush set for later still happens */
+    if (header->oldest_live > header->shutdown) {
+        int64_t when = (int64_t)header->oldest_live + restart->fixup.time_delta;
+        engine->config.oldest_live = when > 0 ? (rel_time_t)when : 1;
+    }
+
+    restart->items = total.items;
+    restart->dropped = total.dropped;
+    restart->rebuild_ms = (uint64_t)((gethrtime() - start) / 1000000);
+    return ENGINE_SUCCESS;
+}
+
+#ifndef WIN32
+/*
+ * Learn the slab classes for the next process, if they waste at least
+ * RESTART_LEARN_GAIN percent less than the ones in use (which are
+ * dropped with the cache, so they must be worth it). Classes learned
+ * before are kept otherwise.
+ */
+static void restart_save_learned(struct default_engine *engine,
+                                 struct restart_header *header) {
+    unsigned int sizes[MAX_NUMBER_OF_SLAB_CLASSES];
+    uint64_t slack, learned_slack;
+    unsigned int n;
+
+    header->nlearned = 0;
+    memset(header->learned, 0, sizeof(header->learned));
+    if (!engine->config.slab_learn) {
+        return;
+    }
+    n = slabs_learn(engine, sizes, &slack, &learned_slack);
+    if (n != 0 && learned_slack * 100 <= slack * (100 - RESTART_LEARN_GAIN)) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        header->nlearned = n;
+        memcpy(header->learned, sizes, sizeof(header->learned));
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "%s: Learned %u slab classes wasting %"PRIu64" bytes "
+                    "instead of %"PRIu64", used at the next start\n",
+                    engine->config.restart_file, n - POWER_SMALLEST,
+                    learned_slack, slack);
+    } else if (engine->slabs.learned) {
+        header->nlearned = engine->slabs.nplan;
+        memcpy(header->learned, engine->slabs.plan, sizeof(header->learned));
+    }
+}
+#endif
+
+void restart_save(struct default_engine *engine) {
+#ifndef WIN32
+    struct restart *restart = &engine->restart;
+    struct restart_header *header = restart->header;
+    const struct config *config = &engine->config;
+    uint32_t npages_max;
+    uint32_t npages;
+    unsigned int id;
+
+    if (header == NULL) {
+        return;
+    }
+
+    npages_max = (uint32_t)(config->maxbytes / config->item_size_max);
+    npages = (uint32_t)(((char*)engine->slabs.mem_current -
+                         (char*)restart->arena) / config->item_size_max);
+    memset(header->page_class, 0, npages_max);
+    memset(header->ends, 0, sizeof(header->ends));
+
+    for (id = POWER_SMALLEST; id <= engine->slabs.power_largest; ++id) {
+        slabclass_t *p = &engine->slabs.slabclass[id];
+        unsigned int ii;
+
+        if (p->killing != 0) {
+            /* A page move didn't finish, leave the header dirty */
+            restart_log(engine, "A slab page is being moved, the cache "
+                        "won't be restored");
+            return;
+        }
+        for (ii = 0; ii < p->slabs; ++ii) {
+            size_t page = (size_t)((char*)p->slab_list[ii] -
+                                   (char*)restart->arena) /
+                config->item_size_max;
+            header->page_class[page] = (uint8_t)id;
+        }
+        if (p->end_page_ptr != NULL) {
+            size_t page = (size_t)((char*)p->end_page_ptr -
+                                   (char*)restart->arena) /
+                config->item_size_max;
+            header->ends[id].page = (uint32_t)page + 1;
+            header->ends[id].free = p->end_page_free;
+        }
+    }
+
+    header->maxbytes = config->maxbytes;
+    header->item_size_max = config->item_size_max;
+    header->chunk_size = config->chunk_size;
+    header->large_item_size_max = config->large_item_size_max;
+    header->factor = config->factor;
+    header->use_cas = (uint32_t)config->use_cas;
+    header->compact_items = (uint32_t)config->compact_items;
+    header->tiny_items = (uint32_t)config->tiny_items;
+    header->vbucket_index = (uint32_t)config->vbucket_index;
+    header->npages_max = npages_max;
+    header->nplan = engine->slabs.nplan;
+    memcpy(header->plan, engine->slabs.plan, sizeof(header->plan));
+    restart_save_learned(engine, header);
+    header->base = (uint64_t)(uintptr_t)restart->arena;
+    header->started = (int64_t)engine->server.core->abstime(0);
+    header->shutdown = engine->server.core->get_current_time();
+    header->oldest_live = config->oldest_live;
+    header->flush_cas = config->flush_cas;
+    header->npages = npages;
+    header->hashpower = engine->assoc.hashpower;
+    header->bucketed = (uint32_t)engine->assoc.bucketed;
+
+    /* The items first, then the header saying they may be used */
+    msync(restart->map, restart->map_size, MS_SYNC);
+    header->clean = 1;
+    msync(header, restart_header_size(npages_max), MS_SYNC);
+#else
+    (void)engine;
+#endif
+}
+
+void restart_destroy(struct default_engine *engine) {
+    struct restart *restart = &engine->restart;
+
+#ifndef WIN32
+    if (restart->map != NULL) {
+        munmap(restart->map, restart->map_size);
+    }
+    if (restart->fd != -1) {
+        close(restart->fd);
+    }
+#endif
+    restart->map = NULL;
+    restart->header = NULL;
+    restart->arena = NULL;
+    restart->fd = -1;
+}
+
+void restart_stats(struct default_engine *engine,
+                   ADD_STAT add_stat, const void *cookie) {
+    struct restart *restart = &engine->restart;
+    char val[32];
+    int len;
+
+    if (restart->arena == NULL) {
+        return;
+    }
+
+    if (restart->attach) {
+        add_stat("restart_status", 14, "restored", 8, cookie);
+    } else {
+        add_stat("restart_status", 14, "empty", 5, cookie);
+    }
+    len = sprintf(val, "%"PRIu64, restart->items);
+    add_stat("restart_items", 13, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, restart->dropped);
+    add_stat("restart_dropped", 15, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, restart->rebuild_ms);
+    add_stat("restart_rebuild_ms", 18, val, len, cookie);
+}
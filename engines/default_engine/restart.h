@@ -0,0 +1,69 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* Warm restarts: the slab arena in a file which outlives the process */
+#ifndef RESTART_H
+#define RESTART_H
+
+/*
+ * The file (config.restart_file) holds a header page followed by the
+ * slab arena, mapped shared so the items are still in it when the next
+ * process maps it again. Only what isn't in the items themselves is in
+ * the header, written at a clean shutdown: the class of every page, the
+ * pages partly carved, and where the arena and the clock were. The hash
+ * table and the LRUs are rebuilt from the items at startup.
+ */
+struct restart_fixup {
+    intptr_t delta;          /* the address of the arena now minus before */
+    int64_t time_delta;      /* rel_time_t now minus before, for a time */
+    rel_time_t shutdown;     /* the (old) time of the shutdown */
+    rel_time_t oldest_live;  /* and the flush markers then */
+    uint64_t flush_cas;
+};
+
+/* What a worker found rebuilding its share of the pages */
+struct restart_counts {
+    uint64_t items;
+    uint64_t bytes;
+    uint64_t dropped;        /* flushed, or with their value elsewhere */
+    uint64_t max_cas;
+};
+
+struct restart {
+    int fd;                  /* -1 if disabled */
+    void *map;
+    size_t map_size;
+    struct restart_header *header;
+    /* The slab arena in the file, NULL if disabled */
+    void *arena;
+
+    /* Set if the arena was left by a clean shutdown and is rebuilt */
+    bool attach;
+    struct restart_fixup fixup;
+
+    /* The outcome of the rebuild */
+    uint64_t items;
+    uint64_t dropped;
+    uint64_t rebuild_ms;
+};
+
+/*
+ * Map the file and check whether what is in it may be used. Called
+ * before the hash table is allocated, which is sized as it was.
+ */
+ENGINE_ERROR_CODE restart_init(struct default_engine *engine);
+
+/* Rebuild the slab classes, hash table and LRUs, after slabs_init */
+ENGINE_ERROR_CODE restart_rebuild(struct default_engine *engine);
+
+/*
+ * Write the header, so the next process may use the arena. Called at
+ * shutdown with all of the background threads stopped.
+ */
+void restart_save(struct default_engine *engine);
+
+/* Unmap the file, after slabs_destroy */
+void restart_destroy(struct default_engine *engine);
+
+void restart_stats(struct default_engine *engine,
+                   ADD_STAT add_stat, const void *cookie);
+
+#endif
@@ -0,0 +1,136 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Per vbucket sequence numbers, and a ring with the recent changes so a
+ * DCP stream picking up from a recent sequence number doesn't have to
+ * walk the whole cache.
+ *
+ * The log only names the keys which changed, not their values: a stream
+ * sends the current value of the key (or a deletion if it's gone) for
+ * each entry.
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+ENGINE_ERROR_CODE seqlog_init(struct default_engine *engine) {
+    struct seqlog *log = &engine->seqlog;
+
+    log->seqnos = calloc(NUM_VBUCKETS, sizeof(uint64_t));
+    if (log->seqnos == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    if (engine->config.seqlog_size == 0) {
+        return ENGINE_SUCCESS;
+    }
+
+    log->purged = calloc(NUM_VBUCKETS, sizeof(uint64_t));
+    log->ring = calloc(engine->config.seqlog_size, sizeof(*log->ring));
+    if (log->purged == NULL || log->ring == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    log->size = engine->config.seqlog_size;
+    return ENGINE_SUCCESS;
+}
+
+void seqlog_destroy(struct default_engine *engine) {
+    struct seqlog *log = &engine->seqlog;
+    free(log->seqnos);
+    free(log->purged);
+    free(log->ring);
+    log->seqnos = log->purged = NULL;
+    log->ring = NULL;
+}
+
+uint64_t seqlog_record(struct default_engine *engine, uint16_t vbucket,
+                       const void *key, uint16_t nkey, bool deleted) {
+    struct seqlog *log = &engine->seqlog;
+    uint64_t seqno;
+
+    cb_mutex_enter(&log->lock);
+    seqno = ++log->seqnos[vbucket];
+    if (log->ring != NULL && nkey <= SEQLOG_KEY_MAX) {
+        struct seqlog_entry *entry = &log->ring[log->head % log->size];
+        if (log->head - log->tail == log->size) {
+            /* Overwrite the oldest one */
+            log->purged[entry->vbucket] = entry->seqno;
+            ++log->tail;
+        }
+        entry->seqno = seqno;
+        entry->vbucket = vbucket;
+        entry->nkey = nkey;
+        entry->deleted = deleted;
+        memcpy(entry->key, key, nkey);
+        ++log->head;
+    } else if (log->ring != NULL) {
+        /* We can't log it, so streams must not rely on the log */
+        log->purged[vbucket] = seqno;
+    }
+    cb_mutex_exit(&log->lock);
+    return seqno;
+}
+
+uint64_t seqlog_high_seqno(struct default_engine *engine, uint16_t vbucket) {
+    uint64_t seqno;
+    cb_mutex_enter(&engine->seqlog.lock);
+    seqno = engine->seqlog.seqnos[vbucket];
+    cb_mutex_exit(&engine->seqlog.lock);
+    return seqno;
+}
+
+void seqlog_purge(struct default_engine *engine) {
+    struct seqlog *log = &engine->seqlog;
+
+    cb_mutex_enter(&log->lock);
+    if (log->ring != NULL) {
+        memcpy(log->purged, log->seqnos, NUM_VBUCKETS * sizeof(uint64_t));
+        log->tail = log->head;
+    }
+    cb_mutex_exit(&log->lock);
+}
+
+bool seqlog_seek(struct default_engine *engine, uint16_t vbucket,
+                 uint64_t start_seqno, uint64_t *pos) {
+    struct seqlog *log = &engine->seqlog;
+    bool ret = false;
+
+    cb_mutex_enter(&log->lock);
+    if (log->ring != NULL && start_seqno >= log->purged[vbucket] &&
+        start_seqno <= log->seqnos[vbucket]) {
+        uint64_t ii;
+        for (ii = log->tail; ii < log->head; ++ii) {
+            const struct seqlog_entry *entry = &log->ring[ii % log->size];
+            if (entry->vbucket == vbucket && entry->seqno > start_seqno) {
+                break;
+            }
+        }
+        *pos = ii;
+        ret = true;
+    }
+    cb_mutex_exit(&log->lock);
+    return ret;
+}
+
+int seqlog_read(struct default_engine *engine, uint16_t vbucket,
+                uint64_t *pos, struct seqlog_entry *entries, int max) {
+    struct seqlog *log = &engine->seqlog;
+    int nentries = 0;
+    uint64_t ii;
+
+    cb_mutex_enter(&log->lock);
+    if (*pos < log->tail) {
+        cb_mutex_exit(&log->lock);
+        return -1;
+    }
+    for (ii = *pos; ii < log->head && nentries < max; ++ii) {
+        const struct seqlog_entry *entry = &log->ring[ii % log->size];
+        if (entry->vbucket == vbucket) {
+            entries[nentries++] = *entry;
+        }
+    }
+    *pos = ii;
+    cb_mutex_exit(&log->lock);
+    return nentries;
+}
@@ -0,0 +1,70 @@
+/* Per vbucket sequence numbers and the log of recent mutations */
+#ifndef SEQLOG_H
+#define SEQLOG_H
+
+/* The longest key the protocol allows */
+#define SEQLOG_KEY_MAX 250
+
+/* A mutation (or deletion) of a key in the log */
+struct seqlog_entry {
+    uint64_t seqno;
+    uint16_t vbucket;
+    uint16_t nkey;
+    bool deleted;
+    char key[SEQLOG_KEY_MAX];
+};
+
+struct seqlog {
+    /* Protects everything below; a leaf lock */
+    cb_mutex_t lock;
+    /* The last sequence number handed out in each vbucket */
+    uint64_t *seqnos;
+    /*
+     * The highest sequence number of each vbucket which is no longer in
+     * the log (it was overwritten, or the log was cleared by a flush).
+     * A stream starting below it can't be served from the log.
+     */
+    uint64_t *purged;
+    /* The ring of entries (config.seqlog_size, NULL if disabled) */
+    struct seqlog_entry *ring;
+    size_t size;
+    /*
+     * The entries ever appended (head) and the first one still valid
+     * (tail). Entry n lives in ring[n % size].
+     */
+    uint64_t head;
+    uint64_t tail;
+};
+
+ENGINE_ERROR_CODE seqlog_init(struct default_engine *engine);
+void seqlog_destroy(struct default_engine *engine);
+
+/*
+ * Hand out the next sequence number of the vbucket for a change of the
+ * key, and log it. Returns the sequence number.
+ */
+uint64_t seqlog_record(struct default_engine *engine, uint16_t vbucket,
+                       const void *key, uint16_t nkey, bool deleted);
+
+/* The last sequence number handed out in the vbucket */
+uint64_t seqlog_high_seqno(struct default_engine *engine, uint16_t vbucket);
+
+/* Forget the logged changes (everything changed, e.g. by a flush) */
+void seqlog_purge(struct default_engine *engine);
+
+/*
+ * Find where a stream of the changes in the vbucket after start_seqno
+ * begins in the log. Returns false if the log doesn't go back that far.
+ */
+bool seqlog_seek(struct default_engine *engine, uint16_t vbucket,
+                 uint64_t start_seqno, uint64_t *pos);
+
+/*
+ * Copy out (up to max of) the logged changes in the vbucket from pos,
+ * and move pos past them. Returns the number of entries, or -1 if the
+ * entries at pos were overwritten before the stream got to them.
+ */
+int seqlog_read(struct default_engine *engine, uint16_t vbucket,
+                uint64_t *pos, struct seqlog_entry *entries, int max);
+
+#endif
@@ -0,0 +1,105 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+#define SKETCH_DEPTH 4
+
+/* The counters per key expected, and the lookups between two resets */
+#define SKETCH_COUNTERS_PER_KEY 4
+#define SKETCH_SAMPLE_PER_KEY 10
+
+static const uint64_t sketch_seeds[SKETCH_DEPTH] = {
+    UINT64_C(0x9E3779B97F4A7C15), UINT64_C(0xC2B2AE3D27D4EB4F),
+    UINT64_C(0x165667B19E3779F9), UINT64_C(0xD6E8FEB86659FD93)
+};
+
+ENGINE_ERROR_CODE sketch_init(struct sketch *sketch, size_t nkeys) {
+    uint64_t ncounters = 1024;
+    uint32_t bits = 10;
+
+    while (ncounters < (uint64_t)nkeys * SKETCH_COUNTERS_PER_KEY &&
+           bits < 32) {
+        ncounters <<= 1;
+        ++bits;
+    }
+    sketch->table = calloc((size_t)(ncounters / 16), sizeof(uint64_t));
+    if (sketch->table == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    sketch->shift = 64 - bits;
+    sketch->sample = ncounters / SKETCH_COUNTERS_PER_KEY *
+        SKETCH_SAMPLE_PER_KEY;
+    sketch->additions = 0;
+    sketch->resets = 0;
+    return ENGINE_SUCCESS;
+}
+
+void sketch_destroy(struct sketch *sketch) {
+    free(sketch->table);
+    sketch->table = NULL;
+}
+
+static uint64_t sketch_index(const struct sketch *sketch, uint32_t hv,
+                             int row) {
+    return ((uint64_t)hv * sketch_seeds[row]) >> sketch->shift;
+}
+
+/* Halve all of the counters (each word at once, the others may count) */
+static void sketch_reset(struct sketch *sketch) {
+    size_t nwords = (size_t)(((uint64_t)1 << (64 - sketch->shift)) / 16);
+    size_t ii;
+
+    for (ii = 0; ii < nwords; ++ii) {
+        uint64_t old;
+        do {
+            old = sketch->table[ii];
+        } while (!__sync_bool_compare_and_swap(&sketch->table[ii], old,
+                  (old >> 1) & UINT64_C(0x7777777777777777)));
+    }
+    ++sketch->resets;
+}
+
+void sketch_add(struct sketch *sketch, uint32_t hv) {
+    uint64_t additions;
+    int row;
+
+    for (row = 0; row < SKETCH_DEPTH; ++row) {
+        uint64_t index = sketch_index(sketch, hv, row);
+        volatile uint64_t *word = &sketch->table[index >> 4];
+        unsigned int shift = (unsigned int)(index & 15) * 4;
+        uint64_t old;
+
+        do {
+            old = *word;
+            if (((old >> shift) & 15) == SKETCH_MAX) {
+                break;
+            }
+        } while (!__sync_bool_compare_and_swap(word, old,
+                                               old + ((uint64_t)1 << shift)));
+    }
+
+    /* The thread taking the count back to 0 does the reset */
+    additions = __sync_add_and_fetch(&sketch->additions, 1);
+    if (additions >= sketch->sample &&
+        __sync_bool_compare_and_swap(&sketch->additions, additions, 0)) {
+        sketch_reset(sketch);
+    }
+}
+
+unsigned int sketch_estimate(const struct sketch *sketch, uint32_t hv) {
+    unsigned int ret = SKETCH_MAX;
+    int row;
+
+    for (row = 0; row < SKETCH_DEPTH; ++row) {
+        uint64_t index = sketch_index(sketch, hv, row);
+        unsigned int count = (unsigned int)
+            ((sketch->table[index >> 4] >> ((index & 15) * 4)) & 15);
+        if (count < ret) {
+            ret = count;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,34 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* A frequency sketch of the keys looked up (for the TinyLFU policy) */
+#ifndef SKETCH_H
+#define SKETCH_H
+
+/*
+ * A count-min sketch with 4 bit counters, 16 to a word: a key is counted
+ * in 4 counters picked by its hash, and its estimate is the lowest of
+ * them. Once as many keys as sample have been counted all of the
+ * counters are halved, so the estimates follow the recent traffic.
+ * Counting races with the other threads through compare and swap.
+ */
+struct sketch {
+    uint64_t *table;     /* NULL if disabled */
+    uint32_t shift;      /* 64 - log2(the number of counters) */
+    uint64_t sample;
+    volatile uint64_t additions;
+    uint64_t resets;
+};
+
+/* The highest estimate */
+#define SKETCH_MAX 15
+
+/* Allocate a sketch for about nkeys keys */
+ENGINE_ERROR_CODE sketch_init(struct sketch *sketch, size_t nkeys);
+void sketch_destroy(struct sketch *sketch);
+
+/* Count a lookup of the key with the hash hv */
+void sketch_add(struct sketch *sketch, uint32_t hv);
+
+/* How many times the key was counted lately (up to SKETCH_MAX) */
+unsigned int sketch_estimate(const struct sketch *sketch, uint32_t hv);
+
+#endif
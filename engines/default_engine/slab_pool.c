@@ -0,0 +1,222 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The shared slab page pool (config.shared_pool_size, see slab_pool.h).
+ * There is a single pool in the process, as all of the buckets of
+ * bucket_engine are instances of the same library. It is created by the
+ * first bucket configured to use it (and grows to the largest size any
+ * of them asked for), and freed with the last one.
+ *
+ * The free pages are kept in a list threaded through their first word,
+ * a page is zeroed by the slab class it goes to anyway.
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+static struct {
+    volatile int state;     /* of the lock: 0, 1 (being set up) or 2 */
+    cb_mutex_t lock;
+    size_t size;
+    size_t page_size;
+    size_t malloced;
+    void *free;
+    size_t nfree;
+    struct default_engine *members;
+    unsigned int nmembers;
+} pool;
+
+static void slab_pool_lock(void) {
+    if (pool.state != 2) {
+        if (__sync_bool_compare_and_swap(&pool.state, 0, 1)) {
+            cb_mutex_initialize(&pool.lock);
+            __sync_synchronize();
+            pool.state = 2;
+        }
+        while (pool.state != 2) {
+            /* Someone else is setting it up */
+            __sync_synchronize();
+        }
+    }
+    cb_mutex_enter(&pool.lock);
+}
+
+static void slab_pool_unlock(void) {
+    cb_mutex_exit(&pool.lock);
+}
+
+static void slab_pool_log(struct default_engine *engine, const char *msg) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+    logger->log(EXTENSION_LOG_WARNING, NULL, "%s\n", msg);
+}
+
+ENGINE_ERROR_CODE slab_pool_attach(struct default_engine *engine) {
+    struct slab_pool_member *m = &engine->pool;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    if (engine->config.shared_pool_size == 0) {
+        return ENGINE_SUCCESS;
+    }
+    if (engine->config.preallocate || engine->restart.arena != NULL) {
+        slab_pool_log(engine, "shared_pool_size can't be used with "
+                      "preallocate or a restart file");
+        return ENGINE_EINVAL;
+    }
+
+    slab_pool_lock();
+    if (pool.members == NULL) {
+        pool.page_size = engine->config.item_size_max;
+        pool.size = engine->config.shared_pool_size;
+    }
+    if (pool.page_size != engine->config.item_size_max) {
+        slab_pool_log(engine, "All of the buckets using the shared pool "
+                      "must have the same item_size_max");
+        ret = ENGINE_EINVAL;
+    } else {
+        if (engine->config.shared_pool_size > pool.size) {
+            pool.size = engine->config.shared_pool_size;
+        }
+        m->attached = true;
+        m->pages = 0;
+        m->soft_quota = engine->config.maxbytes;
+        m->hard_quota = engine->config.hard_quota;
+        m->next = pool.members;
+        pool.members = engine;
+        pool.nmembers++;
+    }
+    slab_pool_unlock();
+    return ret;
+}
+
+void slab_pool_detach(struct default_engine *engine) {
+    struct default_engine **link;
+
+    if (!engine->pool.attached) {
+        return;
+    }
+
+    slab_pool_lock();
+    for (link = &pool.members; *link != NULL; link = &(*link)->pool.next) {
+        if (*link == engine) {
+            *link = engine->pool.next;
+            break;
+        }
+    }
+    engine->pool.attached = false;
+    pool.nmembers--;
+    if (pool.members == NULL) {
+        /* The last bucket is gone, and the pages it gave back with it */
+        while (pool.free != NULL) {
+            void *page = pool.free;
+            pool.free = *(void**)page;
+            free(page);
+        }
+        pool.nfree = 0;
+        pool.malloced = 0;
+    }
+    slab_pool_unlock();
+}
+
+/* The member the furthest above its soft quota (other than engine) */
+static struct default_engine *slab_pool_victim(struct default_engine *engine) {
+    struct default_engine *victim = NULL;
+    struct default_engine *e;
+    size_t most = 0;
+
+    for (e = pool.members; e != NULL; e = e->pool.next) {
+        size_t bytes = e->pool.pages * pool.page_size;
+        if (e != engine && bytes > e->pool.soft_quota &&
+            bytes - e->pool.soft_quota > most) {
+            most = bytes - e->pool.soft_quota;
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+void *slab_pool_get(struct default_engine *engine) {
+    struct slab_pool_member *m = &engine->pool;
+    void *page = NULL;
+
+    slab_pool_lock();
+    if (m->hard_quota != 0 &&
+        (m->pages + 1) * pool.page_size > m->hard_quota) {
+        /* Only ever above the soft quota */
+    } else if (pool.free != NULL) {
+        page = pool.free;
+        pool.free = *(void**)page;
+        pool.nfree--;
+    } else if (pool.malloced + pool.page_size <= pool.size &&
+               (page = malloc(pool.page_size)) != NULL) {
+        pool.malloced += pool.page_size;
+    } else if (m->pages * pool.page_size < m->soft_quota) {
+        struct default_engine *victim = slab_pool_victim(engine);
+        if (victim != NULL) {
+            /* This allocation evicts, the next ones get its page */
+            slabs_give_page(victim);
+            m->steals++;
+        }
+    }
+    if (page != NULL) {
+        m->pages++;
+    }
+    slab_pool_unlock();
+    return page;
+}
+
+void slab_pool_put(struct default_engine *engine, void *page, bool given) {
+    slab_pool_lock();
+    *(void**)page = pool.free;
+    pool.free = page;
+    pool.nfree++;
+    engine->pool.pages--;
+    if (given) {
+        engine->pool.given++;
+    }
+    slab_pool_unlock();
+}
+
+bool slab_pool_full(struct default_engine *engine) {
+    struct slab_pool_member *m = &engine->pool;
+    bool ret;
+
+    slab_pool_lock();
+    ret = (m->hard_quota != 0 &&
+           (m->pages + 1) * pool.page_size > m->hard_quota) ||
+        (pool.free == NULL && pool.malloced + pool.page_size > pool.size);
+    slab_pool_unlock();
+    return ret;
+}
+
+void slab_pool_stats(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie) {
+    struct slab_pool_member *m = &engine->pool;
+
+    if (!m->attached) {
+        return;
+    }
+    slab_pool_lock();
+    add_statistics(cookie, add_stat, NULL, -1, "shared_pool_size", "%"PRIu64,
+                   (uint64_t)pool.size);
+    add_statistics(cookie, add_stat, NULL, -1, "shared_pool_malloced",
+                   "%"PRIu64, (uint64_t)pool.malloced);
+    add_statistics(cookie, add_stat, NULL, -1, "shared_pool_free_pages",
+                   "%"PRIu64, (uint64_t)pool.nfree);
+    add_statistics(cookie, add_stat, NULL, -1, "shared_pool_buckets", "%u",
+                   pool.nmembers);
+    add_statistics(cookie, add_stat, NULL, -1, "shared_pool_pages", "%"PRIu64,
+                   (uint64_t)m->pages);
+    add_statistics(cookie, add_stat, NULL, -1, "shared_pool_soft_quota",
+                   "%"PRIu64, (uint64_t)m->soft_quota);
+    add_statistics(cookie, add_stat, NULL, -1, "shared_pool_hard_quota",
+                   "%"PRIu64, (uint64_t)m->hard_quota);
+    add_statistics(cookie, add_stat, NULL, -1, "shared_pool_steals",
+                   "%"PRIu64, m->steals);
+    add_statistics(cookie, add_stat, NULL, -1, "shared_pool_pages_given",
+                   "%"PRIu64, m->given);
+    slab_pool_unlock();
+}
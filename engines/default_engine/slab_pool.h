@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* The slab pages shared by the buckets of the process (for bucket_engine) */
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+/*
+ * With config.shared_pool_size set a bucket doesn't get its own memory:
+ * its slab pages come from a pool of that many bytes shared by all the
+ * buckets in the process, and go back there when the bucket goes away
+ * (or the compactor empties them). The cache size of the bucket is its
+ * soft quota and config.hard_quota (if not 0) its hard one: it never
+ * holds more than the hard quota, and once the pool is used up a bucket
+ * below its soft quota takes a page from the bucket the furthest above
+ * its own, whose rebalancer evicts one (see slabs_give_page()).
+ *
+ * Everything is under the lock of the pool, which is taken after the
+ * slabs lock of a bucket and before its rebalance lock.
+ */
+struct slab_pool_member {
+    bool attached;
+    struct default_engine *next;  /* in the members of the pool */
+    size_t pages;                 /* the pages the bucket holds */
+    size_t soft_quota;
+    size_t hard_quota;
+    uint64_t steals;              /* pages asked from the others */
+    uint64_t given;               /* pages given up for the others */
+};
+
+/* Join the pool (created by the first bucket), if configured */
+ENGINE_ERROR_CODE slab_pool_attach(struct default_engine *engine);
+
+/* Leave the pool, once all of the bucket's pages are back */
+void slab_pool_detach(struct default_engine *engine);
+
+/*
+ * A page for the bucket, or NULL if it may not have one now (after
+ * asking a bucket above its soft quota for one, if this one is below).
+ */
+void *slab_pool_get(struct default_engine *engine);
+
+/* Give one of the bucket's pages back to the pool */
+void slab_pool_put(struct default_engine *engine, void *page, bool given);
+
+/* Whether the bucket would be refused a page */
+bool slab_pool_full(struct default_engine *engine);
+
+void slab_pool_stats(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie);
+
+#endif
@@ -16,15 +16,49 @@
 #include <string.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #include "default_engine_internal.h"
 
+#ifdef HAVE_SYS_MBIND
+#include <sys/syscall.h>
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+#endif
+
 /*
  * Forward Declarations
  */
 static int do_slabs_newslab(struct default_engine *engine, const unsigned int id);
 static void *memory_allocate(struct default_engine *engine, size_t size);
 
+/* How many times to walk a page being moved before giving up on it */
+#define SLAB_REASSIGN_TRIES 1000
+/* Wait (in ms) between the walks over a page with busy items */
+#define SLAB_REASSIGN_RETRY_DELAY 1
+/* The length (in seconds) of the windows used by automove */
+#define SLAB_AUTOMOVE_WINDOW 10
+/* How many times to walk a page being compacted before giving up on it */
+#define SLAB_COMPACT_TRIES 100
+/* How often (in seconds) the compactor looks for sparse pages */
+#define SLAB_COMPACT_INTERVAL 1
+/* The most sizes slabs_learn may end a class at */
+#define SLAB_LEARN_POINTS 512
+/* The mapped arena is rounded up to a multiple of the huge page size */
+#define ARENA_HUGEPAGE_SIZE (2 * 1024 * 1024)
+/* The max number of NUMA nodes we may bind the arena to */
+#define ARENA_MAX_NUMA_NODES 1024
+/* The arena is prefaulted in pieces of this size (see config.prefault_threads) */
+#define ARENA_PREFAULT_CHUNK (64 * 1024 * 1024)
+/* The most threads config.prefault_threads may ask for */
+#define ARENA_MAX_PREFAULT_THREADS 64
+/* The max number of CPUs the prefault threads may be bound to */
+#define ARENA_MAX_CPUS 4096
+
 #ifndef DONT_PREALLOC_SLABS
 /* Preallocate as many slab pages as possible (called from slabs_init)
    on start-up, so users don't get confused out-of-memory errors when
@@ -75,40 +109,566 @@ static void *my_allocate(struct default_engine *e, size_t size) {
     return ptr;
 }
 
+static void arena_log(struct default_engine *engine, const char *msg) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+    logger->log(EXTENSION_LOG_WARNING, NULL, "%s\n", msg);
+}
+
+#if defined(HAVE_SYS_MBIND) || defined(HAVE_SYS_SCHED_SETAFFINITY)
+/*
+ * Set the bits (below max) for a list in sysfs ("0-3,5"). Returns false
+ * if it can't be read.
+ */
+static bool arena_read_list(const char *path, unsigned long *mask,
+                            unsigned long max) {
+    char buffer[1024];
+    char *ptr = buffer;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL || fgets(buffer, sizeof(buffer), fp) == NULL) {
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return false;
+    }
+    fclose(fp);
+
+    while (*ptr != '\0') {
+        char *end;
+        unsigned long first = strtoul(ptr, &end, 10);
+        unsigned long last = first;
+        if (end == ptr) {
+            break;
+        }
+        if (*end == '-') {
+            ptr = end + 1;
+            last = strtoul(ptr, &end, 10);
+        }
+        for (; first <= last && first < max; ++first) {
+            mask[first / (8 * sizeof(long))] |= 1UL << (first % (8 * sizeof(long)));
+        }
+        ptr = (*end == ',') ? end + 1 : end;
+        if (*ptr == '\n') {
+            break;
+        }
+    }
+    return true;
+}
+#endif
+
+#ifdef HAVE_SYS_MBIND
+/* Set the bits for the online NUMA nodes */
+static void arena_online_nodes(unsigned long *mask) {
+    if (!arena_read_list("/sys/devices/system/node/online", mask,
+                         ARENA_MAX_NUMA_NODES)) {
+        mask[0] |= 1;
+    }
+}
+#endif
+
+int slabs_numa_node(unsigned int index) {
+#ifdef HAVE_SYS_MBIND
+    unsigned long mask[ARENA_MAX_NUMA_NODES / (8 * sizeof(long))];
+    const unsigned int bits = 8 * sizeof(long);
+    unsigned int nnodes = 0;
+    unsigned int node;
+
+    memset(mask, 0, sizeof(mask));
+    arena_online_nodes(mask);
+    for (node = 0; node < ARENA_MAX_NUMA_NODES; ++node) {
+        nnodes += (mask[node / bits] >> (node % bits)) & 1;
+    }
+    index %= nnodes;
+    for (node = 0; node < ARENA_MAX_NUMA_NODES; ++node) {
+        if (((mask[node / bits] >> (node % bits)) & 1) && index-- == 0) {
+            break;
+        }
+    }
+    return (int)node;
+#else
+    (void)index;
+    return -1;
+#endif
+}
+
+/*
+ * Apply the NUMA policy to the (not yet touched) arena. The policy is only
+ * a hint, so failures are logged and the arena is used as is.
+ */
+static void arena_bind(struct default_engine *engine, void *ptr, size_t size) {
+    const char *policy = engine->config.numa_policy;
+#ifdef HAVE_SYS_MBIND
+    unsigned long mask[ARENA_MAX_NUMA_NODES / (8 * sizeof(long))];
+    unsigned int node;
+    int mode;
+
+    engine->slabs.arena.numa_policy = "default";
+    if (policy == NULL || strcmp(policy, "default") == 0) {
+        return;
+    }
+
+    memset(mask, 0, sizeof(mask));
+    if (strcmp(policy, "interleave") == 0) {
+        mode = MPOL_INTERLEAVE;
+        arena_online_nodes(mask);
+    } else {
+        /* Validated by slabs_init */
+        sscanf(policy, "bind:%u", &node);
+        mode = MPOL_BIND;
+        mask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+    }
+
+    if (syscall(SYS_mbind, ptr, size, mode, mask,
+                (unsigned long)ARENA_MAX_NUMA_NODES, 0) == 0) {
+        engine->slabs.arena.numa_policy = policy;
+    } else {
+        arena_log(engine, "Failed to set the NUMA policy for the slab arena");
+    }
+#else
+    (void)ptr;
+    (void)size;
+    engine->slabs.arena.numa_policy = "default";
+    if (policy != NULL && strcmp(policy, "default") != 0) {
+        arena_log(engine, "NUMA policies are not supported on this platform");
+    }
+#endif
+}
+
+/*
+ * Allocate the arena used in preallocate mode. Unless huge pages or a
+ * NUMA policy is requested this is a plain malloc. Otherwise the arena
+ * is mapped, so that we may control the page size and placement before
+ * the memory is touched.
+ */
+static void *arena_allocate(struct default_engine *engine, size_t size) {
+    const char *hugepages = engine->config.hugepages;
+    const char *policy = engine->config.numa_policy;
+
+    engine->slabs.arena.page_type = "default";
+    engine->slabs.arena.numa_policy = "default";
+    if ((hugepages == NULL || strcmp(hugepages, "off") == 0) &&
+        (policy == NULL || strcmp(policy, "default") == 0)) {
+        return my_allocate(engine, size);
+    }
+
+#ifdef WIN32
+    arena_log(engine, "Huge pages and NUMA policies are not supported "
+              "on this platform");
+    return my_allocate(engine, size);
+#else
+    {
+        void *ptr = MAP_FAILED;
+
+        if (size % ARENA_HUGEPAGE_SIZE) {
+            size += ARENA_HUGEPAGE_SIZE - (size % ARENA_HUGEPAGE_SIZE);
+        }
+
+        if (hugepages != NULL && strcmp(hugepages, "explicit") == 0) {
+#ifdef HAVE_MAP_HUGETLB
+            ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (ptr != MAP_FAILED) {
+                engine->slabs.arena.page_type = "hugetlb";
+            } else {
+                arena_log(engine, "Failed to map the slab arena with "
+                          "MAP_HUGETLB, trying transparent huge pages");
+            }
+#else
+            arena_log(engine, "MAP_HUGETLB is not supported on this "
+                      "platform, trying transparent huge pages");
+#endif
+        }
+
+        if (ptr == MAP_FAILED) {
+            ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ptr == MAP_FAILED) {
+                return NULL;
+            }
+            if (hugepages != NULL && strcmp(hugepages, "off") != 0) {
+#ifdef HAVE_MADV_HUGEPAGE
+                if (madvise(ptr, size, MADV_HUGEPAGE) == 0) {
+                    engine->slabs.arena.page_type = "transparent_hugepage";
+                } else {
+                    arena_log(engine, "madvise(MADV_HUGEPAGE) failed for "
+                              "the slab arena");
+                }
+#else
+                arena_log(engine, "Transparent huge pages are not supported "
+                          "on this platform");
+#endif
+            }
+        }
+
+        arena_bind(engine, ptr, size);
+        engine->slabs.arena.mapped = true;
+        engine->slabs.arena.size = size;
+        return ptr;
+    }
+#endif
+}
+
+struct arena_prefault {
+    struct default_engine *engine;
+    char *base;
+    size_t size;
+    size_t nchunks;
+    volatile size_t next;
+    volatile size_t done;
+#ifdef HAVE_SYS_SCHED_SETAFFINITY
+    /* The CPUs of the node the arena is bound to (none if it isn't) */
+    unsigned long cpus[ARENA_MAX_CPUS / (8 * sizeof(long))];
+    bool bind;
+#endif
+};
+
+static void arena_prefault_main(void *arg) {
+    struct arena_prefault *prefault = arg;
+    size_t ii;
+
+#ifdef HAVE_SYS_SCHED_SETAFFINITY
+    if (prefault->bind) {
+        /* Not being able to is only slower */
+        (void)syscall(SYS_sched_setaffinity, 0, sizeof(prefault->cpus),
+                      prefault->cpus);
+    }
+#endif
+
+    while ((ii = __sync_fetch_and_add(&prefault->next, 1)) <
+           prefault->nchunks) {
+        size_t offset = ii * ARENA_PREFAULT_CHUNK;
+        size_t len = prefault->size - offset;
+        size_t done;
+
+        if (len > ARENA_PREFAULT_CHUNK) {
+            len = ARENA_PREFAULT_CHUNK;
+        }
+        memset(prefault->base + offset, 0, len);
+
+        done = __sync_add_and_fetch(&prefault->done, 1);
+        if (done * 10 / prefault->nchunks !=
+            (done - 1) * 10 / prefault->nchunks) {
+            EXTENSION_LOGGER_DESCRIPTOR *logger;
+            logger = (void*)prefault->engine->server.extension->get_extension(EXTENSION_LOGGER);
+            logger->log(EXTENSION_LOG_INFO, NULL,
+                        "Prefaulted %zu%% of the slab arena\n",
+                        done * 100 / prefault->nchunks);
+        }
+    }
+}
+
+/*
+ * Touch (and zero) all of the new arena before the engine is used, from
+ * config.prefault_threads threads, so the page faults aren't taken on
+ * the request path. When the arena is bound to a node the threads run
+ * on the CPUs of that node.
+ */
+static void arena_prefault(struct default_engine *engine) {
+    struct arena_prefault *prefault;
+    cb_thread_t *tids;
+    bool *started;
+    size_t nthreads = engine->config.prefault_threads;
+    hrtime_t start = gethrtime();
+    size_t ii;
+
+    prefault = calloc(1, sizeof(*prefault));
+    tids = calloc(nthreads, sizeof(*tids));
+    started = calloc(nthreads, sizeof(*started));
+    if (prefault == NULL || tids == NULL || started == NULL) {
+        arena_log(engine, "Failed to allocate the prefault threads, the "
+                  "slab arena is faulted in as it is used");
+        free(prefault);
+        free(tids);
+        free(started);
+        return;
+    }
+
+    prefault->engine = engine;
+    prefault->base = engine->slabs.mem_base;
+    prefault->size = engine->slabs.mem_limit;
+    prefault->nchunks = (prefault->size + ARENA_PREFAULT_CHUNK - 1) /
+        ARENA_PREFAULT_CHUNK;
+#ifdef HAVE_SYS_SCHED_SETAFFINITY
+    {
+        const char *policy = engine->config.numa_policy;
+        unsigned int node;
+        if (policy != NULL && strcmp(engine->slabs.arena.numa_policy,
+                                     policy) == 0 &&
+            sscanf(policy, "bind:%u", &node) == 1) {
+            char path[128];
+            snprintf(path, sizeof(path),
+                     "/sys/devices/system/node/node%u/cpulist", node);
+            prefault->bind = arena_read_list(path, prefault->cpus,
+                                             ARENA_MAX_CPUS);
+        }
+    }
+#endif
+
+    for (ii = 0; ii < nthreads; ++ii) {
+        started[ii] = cb_create_thread(&tids[ii], arena_prefault_main,
+                                       prefault, 0) == 0;
+    }
+    for (ii = 0; ii < nthreads; ++ii) {
+        if (started[ii]) {
+            cb_join_thread(tids[ii]);
+        }
+    }
+    /* Whatever the threads didn't get to */
+    arena_prefault_main(prefault);
+
+    engine->slabs.arena.prefaulted = prefault->size;
+    engine->slabs.arena.prefault_usec = (gethrtime() - start) / 1000;
+    {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Prefaulted the slab arena (%zu bytes) with %zu threads "
+                    "in %"PRIu64" ms\n", prefault->size, nthreads,
+                    engine->slabs.arena.prefault_usec / 1000);
+    }
+    free(prefault);
+    free(tids);
+    free(started);
+}
+
+/* Check the hugepages and numa_policy settings */
+static bool arena_validate_config(struct default_engine *engine) {
+    const char *hugepages = engine->config.hugepages;
+    const char *policy = engine->config.numa_policy;
+    unsigned int node;
+    char extra;
+
+    if (hugepages != NULL && strcmp(hugepages, "off") != 0 &&
+        strcmp(hugepages, "transparent") != 0 &&
+        strcmp(hugepages, "explicit") != 0) {
+        arena_log(engine, "hugepages must be off, transparent or explicit");
+        return false;
+    }
+
+    if (policy != NULL && strcmp(policy, "default") != 0 &&
+        strcmp(policy, "interleave") != 0 &&
+        (sscanf(policy, "bind:%u%c", &node, &extra) != 1 ||
+         node >= ARENA_MAX_NUMA_NODES)) {
+        arena_log(engine, "numa_policy must be default, interleave, "
+                  "bind:<node> or (with partitions) spread");
+        return false;
+    }
+
+    if (engine->config.prefault_threads > ARENA_MAX_PREFAULT_THREADS) {
+        arena_log(engine, "prefault_threads must be at most 64");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Allocate a magazine for each item lock stripe in each slab class.
+ * Classes with few chunks per page don't get magazines, as the chunks
+ * held in them would be a large share of the memory.
+ */
+static ENGINE_ERROR_CODE slabs_init_magazines(struct default_engine *engine) {
+    uint32_t nstripes = engine->items.item_lock_mask + 1;
+    unsigned int nclasses = engine->slabs.power_largest + 1;
+    size_t nslots = 0;
+    unsigned int ii;
+    uint32_t jj;
+    void **slots;
+
+    for (ii = POWER_SMALLEST; ii < nclasses; ++ii) {
+        slabclass_t *p = &engine->slabs.slabclass[ii];
+        p->magazine_size = p->perslab / 2;
+        if (p->magazine_size > engine->config.slab_magazine_size) {
+            p->magazine_size = (unsigned int)engine->config.slab_magazine_size;
+        }
+        nslots += p->magazine_size;
+    }
+
+    engine->slabs.magazines = calloc((size_t)nstripes * nclasses,
+                                     sizeof(slab_magazine_t));
+    engine->slabs.magazine_slots = calloc(nslots * nstripes, sizeof(void*));
+    if (engine->slabs.magazines == NULL ||
+        engine->slabs.magazine_slots == NULL) {
+        free(engine->slabs.magazines);
+        free(engine->slabs.magazine_slots);
+        engine->slabs.magazines = NULL;
+        engine->slabs.magazine_slots = NULL;
+        return ENGINE_ENOMEM;
+    }
+
+    slots = engine->slabs.magazine_slots;
+    for (jj = 0; jj < nstripes; ++jj) {
+        for (ii = POWER_SMALLEST; ii < nclasses; ++ii) {
+            engine->slabs.magazines[jj * nclasses + ii].chunks = slots;
+            slots += engine->slabs.slabclass[ii].magazine_size;
+        }
+    }
+    engine->slabs.nmagazines = nstripes;
+
+    return ENGINE_SUCCESS;
+}
+
+/* The chunk size of the tiny class (see config.tiny_items) */
+static unsigned int slabs_tiny_size(struct default_engine *engine) {
+    /*
+     * The smallest class holds exactly the largest tiny item (the
+     * counters and flags), instead of wasting most of a chunk sized
+     * for chunk_size bytes of data on them. An item outgrowing it is
+     * stored again in a larger class like any other.
+     */
+    unsigned int size = (unsigned int)item_header_size(engine) +
+        TINY_ITEM_KEY + TINY_ITEM_VALUE;
+    if (engine->config.use_cas) {
+        size += sizeof(uint64_t);
+    }
+    if (size <= 64) {
+        /* A cache line each */
+        size = 64;
+    }
+    return size;
+}
+
+/* Plan the classes of config.slab_sizes ("96-128-1024"), after the tiny one */
+static ENGINE_ERROR_CODE slabs_plan_sizes(struct default_engine *engine,
+                                          unsigned int i) {
+    const char *ptr = engine->config.slab_sizes;
+    unsigned int prev = i < POWER_SMALLEST ? 0 : engine->slabs.plan[i];
+
+    if (*ptr == '\0') {
+        arena_log(engine, "slab_sizes must have a chunk size");
+        return ENGINE_EINVAL;
+    }
+    while (*ptr != '\0') {
+        char *end;
+        unsigned long size = strtoul(ptr, &end, 10);
+
+        if (end == ptr || (*end != '-' && *end != '\0')) {
+            arena_log(engine, "slab_sizes must be chunk sizes separated "
+                      "by '-'");
+            return ENGINE_EINVAL;
+        }
+        if (size <= prev || size % CHUNK_ALIGN_BYTES != 0 ||
+            size < item_header_size(engine) ||
+            size > engine->config.item_size_max / 2) {
+            arena_log(engine, "slab_sizes must grow, be multiples of 8 "
+                      "and hold an item header, up to half of "
+                      "item_size_max");
+            return ENGINE_EINVAL;
+        }
+        if (++i >= POWER_LARGEST) {
+            arena_log(engine, "slab_sizes has too many chunk sizes");
+            return ENGINE_EINVAL;
+        }
+        engine->slabs.plan[i] = (unsigned int)size;
+        prev = (unsigned int)size;
+        ptr = *end == '-' ? end + 1 : end;
+    }
+
+    /* And the class of item_size_max */
+    engine->slabs.nplan = i + 2;
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE slabs_plan(struct default_engine *engine) {
+    const double factor = engine->config.factor;
+    unsigned int i = POWER_SMALLEST - 1;
+    unsigned int size = (unsigned int)item_header_size(engine) +
+        (unsigned int)engine->config.chunk_size;
+    const unsigned int first = size;
+
+    memset(engine->slabs.plan, 0, sizeof(engine->slabs.plan));
+    engine->slabs.learned = false;
+
+    if (engine->config.tiny_items) {
+        size = slabs_tiny_size(engine);
+    }
+
+    if (engine->config.slab_sizes != NULL) {
+        ENGINE_ERROR_CODE ret;
+        if (engine->config.tiny_items) {
+            engine->slabs.plan[++i] = size;
+        }
+        ret = slabs_plan_sizes(engine, i);
+        if (ret != ENGINE_SUCCESS) {
+            return ret;
+        }
+    } else {
+        while (++i < POWER_LARGEST &&
+               size <= engine->config.item_size_max / factor) {
+            /* Make sure items are always n-byte aligned */
+            if (size % CHUNK_ALIGN_BYTES)
+                size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+
+            engine->slabs.plan[i] = size;
+            size = (unsigned int)(size * factor);
+            if (size < first) {
+                /* Past the tiny class */
+                size = first;
+            }
+        }
+        engine->slabs.nplan = i + 1;
+    }
+
+    engine->slabs.plan[engine->slabs.nplan - 1] =
+        (unsigned int)engine->config.item_size_max;
+    return ENGINE_SUCCESS;
+}
+
 /**
- * Determines the chunk sizes and initializes the slab class descriptors
- * accordingly.
+ * Initializes the slab class descriptors with the chunk sizes planned.
  */
 ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
                              const size_t limit,
-                             const double factor,
                              const bool prealloc) {
-    int i = POWER_SMALLEST - 1;
-    unsigned int size = sizeof(hash_item) + (unsigned int)engine->config.chunk_size;
+    unsigned int i;
 
     engine->slabs.mem_limit = limit;
+    engine->slabs.arena.page_type = "default";
+    engine->slabs.arena.numa_policy = "default";
+
+    if (!arena_validate_config(engine)) {
+        return ENGINE_EINVAL;
+    }
+
+    if (slab_pool_attach(engine) != ENGINE_SUCCESS) {
+        return ENGINE_EINVAL;
+    }
+
+    /* Compact items address each other relative to the arena */
+    if (engine->config.compact_items &&
+        (!prealloc || limit > ITEM_COMPACT_MAX_ARENA)) {
+        arena_log(engine, "compact_items requires preallocate and a cache "
+                  "size below 32GB");
+        return ENGINE_EINVAL;
+    }
 
-    if (prealloc) {
-        /* Allocate everything in a big chunk with malloc */
-        engine->slabs.mem_base = my_allocate(engine, engine->slabs.mem_limit);
+    if (prealloc && engine->restart.arena != NULL) {
+        /* The arena is in the restart file (see restart.c) */
+        engine->slabs.mem_base = engine->restart.arena;
+        engine->slabs.mem_current = engine->slabs.mem_base;
+        engine->slabs.mem_avail = engine->slabs.mem_limit;
+    } else if (prealloc) {
+        /* Allocate everything in a big chunk */
+        engine->slabs.mem_base = arena_allocate(engine, engine->slabs.mem_limit);
         if (engine->slabs.mem_base != NULL) {
             engine->slabs.mem_current = engine->slabs.mem_base;
             engine->slabs.mem_avail = engine->slabs.mem_limit;
         } else {
             return ENGINE_ENOMEM;
         }
+        if (engine->config.prefault_threads != 0) {
+            arena_prefault(engine);
+        }
     }
 
     memset(engine->slabs.slabclass, 0, sizeof(engine->slabs.slabclass));
+    for (i = 0; i < MAX_NUMBER_OF_SLAB_CLASSES; ++i) {
+        cb_mutex_initialize(&engine->slabs.slabclass[i].lock);
+    }
 
-    while (++i < POWER_LARGEST && size <= engine->config.item_size_max / factor) {
-        /* Make sure items are always n-byte aligned */
-        if (size % CHUNK_ALIGN_BYTES)
-            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
-
-        engine->slabs.slabclass[i].size = size;
+    for (i = POWER_SMALLEST; i < engine->slabs.nplan; ++i) {
+        engine->slabs.slabclass[i].size = engine->slabs.plan[i];
         engine->slabs.slabclass[i].perslab = (unsigned int)engine->config.item_size_max / engine->slabs.slabclass[i].size;
-        size = (unsigned int)(size * factor);
         if (engine->config.verbose > 1) {
             EXTENSION_LOGGER_DESCRIPTOR *logger;
             logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
@@ -118,17 +678,13 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
                         engine->slabs.slabclass[i].perslab);
         }
     }
+    engine->slabs.power_largest = engine->slabs.nplan - 1;
 
-    engine->slabs.power_largest = i;
-    engine->slabs.slabclass[engine->slabs.power_largest].size = (unsigned int)engine->config.item_size_max;
-    engine->slabs.slabclass[engine->slabs.power_largest].perslab = 1;
-    if (engine->config.verbose > 1) {
-        EXTENSION_LOGGER_DESCRIPTOR *logger;
-        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-        logger->log(EXTENSION_LOG_INFO, NULL,
-                    "slab class %3d: chunk size %9u perslab %7u\n",
-                    i, engine->slabs.slabclass[i].size,
-                    engine->slabs.slabclass[i].perslab);
+    if (engine->config.slab_magazine_size != 0) {
+        ENGINE_ERROR_CODE ret = slabs_init_magazines(engine);
+        if (ret != ENGINE_SUCCESS) {
+            return ret;
+        }
     }
 
     /* for the test suite:  faking of how much we've already malloc'd */
@@ -185,30 +741,79 @@ static int grow_slab_list (struct default_engine *engine, const unsigned int id)
     return 1;
 }
 
+/* The size of a new page for the slab class */
+static int slabs_page_size(struct default_engine *engine,
+                           const slabclass_t *p) {
+    /* All pages must be the same size to be moved between classes, or
+       to be found again in the restart file */
+    return (engine->config.slab_reassign || engine->restart.arena != NULL ||
+            engine->pool.attached) ?
+        (int)engine->config.item_size_max : (int)(p->size * p->perslab);
+}
+
+/* The caller must hold the slab class lock */
 static int do_slabs_newslab(struct default_engine *engine, const unsigned int id) {
     slabclass_t *p = &engine->slabs.slabclass[id];
-    int len = p->size * p->perslab;
+    int len = slabs_page_size(engine, p);
     char *ptr;
 
-    if ((engine->slabs.mem_limit && engine->slabs.mem_malloced + len > engine->slabs.mem_limit && p->slabs > 0) ||
+    cb_mutex_enter(&engine->slabs.lock);
+    if (engine->slabs.spare.count != 0 && grow_slab_list(engine, id) != 0) {
+        /* A page emptied by the compactor, already accounted for */
+        ptr = engine->slabs.spare.pages[--engine->slabs.spare.count];
+    } else if (engine->pool.attached) {
+        /* The bucket's quotas are checked by the pool */
+        if (grow_slab_list(engine, id) == 0 ||
+            (ptr = slab_pool_get(engine)) == NULL) {
+            cb_mutex_exit(&engine->slabs.lock);
+            MEMCACHED_SLABS_SLABCLASS_ALLOCATE_FAILED(id);
+            return 0;
+        }
+        engine->slabs.mem_malloced += len;
+    } else if ((engine->slabs.mem_limit && engine->slabs.mem_malloced + len > engine->slabs.mem_limit && p->slabs > 0) ||
         (grow_slab_list(engine, id) == 0) ||
         ((ptr = memory_allocate(engine, (size_t)len)) == 0)) {
 
+        cb_mutex_exit(&engine->slabs.lock);
         MEMCACHED_SLABS_SLABCLASS_ALLOCATE_FAILED(id);
         return 0;
+    } else {
+        engine->slabs.mem_malloced += len;
     }
+    cb_mutex_exit(&engine->slabs.lock);
 
     memset(ptr, 0, (size_t)len);
     p->end_page_ptr = ptr;
     p->end_page_free = p->perslab;
 
     p->slab_list[p->slabs++] = ptr;
-    engine->slabs.mem_malloced += len;
     MEMCACHED_SLABS_SLABCLASS_ALLOCATE(id);
 
     return 1;
 }
 
+/*
+ * Take a chunk off the freelist (or the end page) of the slab class,
+ * without allocating a new page. The caller must hold the slab class lock.
+ */
+static void *do_slabs_take_free(slabclass_t *p) {
+    void *ret = NULL;
+
+    if (p->sl_curr != 0) {
+        /* return off our freelist */
+        ret = p->slots[--p->sl_curr];
+    } else if (p->end_page_ptr != NULL) {
+        /* if we recently allocated a whole page, return from that */
+        ret = p->end_page_ptr;
+        if (--p->end_page_free != 0) {
+            p->end_page_ptr = ((unsigned char *)p->end_page_ptr) + p->size;
+        } else {
+            p->end_page_ptr = 0;
+        }
+    }
+    return ret;
+}
+
 /*@null@*/
 static void *do_slabs_alloc(struct default_engine *engine, const size_t size, unsigned int id) {
     slabclass_t *p;
@@ -222,11 +827,14 @@ static void *do_slabs_alloc(struct default_engine *engine, const size_t size, un
     p = &engine->slabs.slabclass[id];
 
 #ifdef USE_SYSTEM_MALLOC
+    cb_mutex_enter(&engine->slabs.lock);
     if (engine->slabs.mem_limit && engine->slabs.mem_malloced + size > engine->slabs.mem_limit) {
+        cb_mutex_exit(&engine->slabs.lock);
         MEMCACHED_SLABS_ALLOCATE_FAILED(size, id);
         return 0;
     }
     engine->slabs.mem_malloced += size;
+    cb_mutex_exit(&engine->slabs.lock);
     ret = malloc(size);
     MEMCACHED_SLABS_ALLOCATE(size, id, 0, ret);
     return ret;
@@ -238,18 +846,9 @@ static void *do_slabs_alloc(struct default_engine *engine, const size_t size, un
            do_slabs_newslab(engine, id) != 0)) {
         /* We don't have more memory available */
         ret = NULL;
-    } else if (p->sl_curr != 0) {
-        /* return off our freelist */
-        ret = p->slots[--p->sl_curr];
     } else {
-        /* if we recently allocated a whole page, return from that */
-        cb_assert(p->end_page_ptr != NULL);
-        ret = p->end_page_ptr;
-        if (--p->end_page_free != 0) {
-            p->end_page_ptr = ((unsigned char *)p->end_page_ptr) + p->size;
-        } else {
-            p->end_page_ptr = 0;
-        }
+        ret = do_slabs_take_free(p);
+        cb_assert(ret != NULL);
     }
 
     if (ret) {
@@ -262,6 +861,28 @@ static void *do_slabs_alloc(struct default_engine *engine, const size_t size, un
     return ret;
 }
 
+/* Put a chunk on the freelist. The caller must hold the slab class lock */
+static bool do_slabs_push_free(slabclass_t *p, void *ptr) {
+    if (p->sl_curr == p->sl_total) { /* need more space on the free list */
+        int new_size = (p->sl_total != 0) ? p->sl_total * 2 : 16;  /* 16 is arbitrary */
+        void **new_slots = realloc(p->slots, new_size * sizeof(void *));
+        if (new_slots == 0)
+            return false;
+        p->slots = new_slots;
+        p->sl_total = new_size;
+    }
+    p->slots[p->sl_curr++] = ptr;
+    return true;
+}
+
+/* Is ptr within the given page? */
+static bool slabs_page_contains(struct default_engine *engine,
+                                const void *page, const void *ptr) {
+    const char *start = page;
+    return (const char*)ptr >= start &&
+        (const char*)ptr < start + engine->config.item_size_max;
+}
+
 static void do_slabs_free(struct default_engine *engine, void *ptr, const size_t size, unsigned int id) {
     slabclass_t *p;
 
@@ -272,20 +893,24 @@ static void do_slabs_free(struct default_engine *engine, void *ptr, const size_t
     p = &engine->slabs.slabclass[id];
 
 #ifdef USE_SYSTEM_MALLOC
+    cb_mutex_enter(&engine->slabs.lock);
     engine->slabs.mem_malloced -= size;
+    cb_mutex_exit(&engine->slabs.lock);
     free(ptr);
     return;
 #endif
 
-    if (p->sl_curr == p->sl_total) { /* need more space on the free list */
-        int new_size = (p->sl_total != 0) ? p->sl_total * 2 : 16;  /* 16 is arbitrary */
-        void **new_slots = realloc(p->slots, new_size * sizeof(void *));
-        if (new_slots == 0)
-            return;
-        p->slots = new_slots;
-        p->sl_total = new_size;
+    ((hash_item*)ptr)->iflag |= ITEM_SLABBED;
+    if (p->killing != 0 &&
+        slabs_page_contains(engine, p->slab_list[p->killing - 1], ptr)) {
+        /* The page is being moved to another slab class; keep the chunk
+           off the freelist */
+        p->requested -= size;
+        return;
     }
-    p->slots[p->sl_curr++] = ptr;
+
+    if (!do_slabs_push_free(p, ptr))
+        return;
     p->requested -= size;
     return;
 }
@@ -331,6 +956,7 @@ static void do_slabs_stats(struct default_engine *engine, ADD_STAT add_stats, co
     total = 0;
     for(i = POWER_SMALLEST; i <= engine->slabs.power_largest; i++) {
         slabclass_t *p = &engine->slabs.slabclass[i];
+        cb_mutex_enter(&p->lock);
         if (p->slabs != 0) {
             uint32_t perslab, slabs;
             slabs = p->slabs;
@@ -366,13 +992,83 @@ static void do_slabs_stats(struct default_engine *engine, ADD_STAT add_stats, co
 #endif
             total++;
         }
+        cb_mutex_exit(&p->lock);
     }
 
     /* add overall slab stats and append terminator */
 
     add_statistics(cookie, add_stats, NULL, -1, "active_slabs", "%d", total);
+    cb_mutex_enter(&engine->slabs.lock);
     add_statistics(cookie, add_stats, NULL, -1, "total_malloced", "%"PRIu64,
                    (uint64_t)engine->slabs.mem_malloced);
+    cb_mutex_exit(&engine->slabs.lock);
+    if (engine->slabs.magazines != NULL) {
+        uint64_t alloc_hits = 0, alloc_misses = 0;
+        uint64_t free_hits = 0, free_misses = 0;
+        uint64_t chunks = 0;
+        unsigned int nclasses = engine->slabs.power_largest + 1;
+        uint32_t jj;
+
+        for (jj = 0; jj < engine->slabs.nmagazines; ++jj) {
+            item_lock(engine, jj);
+            for (i = POWER_SMALLEST; i < nclasses; i++) {
+                slab_magazine_t *m = &engine->slabs.magazines[jj * nclasses + i];
+                alloc_hits += m->alloc_hits;
+                alloc_misses += m->alloc_misses;
+                free_hits += m->free_hits;
+                free_misses += m->free_misses;
+                chunks += m->count;
+            }
+            item_unlock(engine, jj);
+        }
+
+        add_statistics(cookie, add_stats, NULL, -1, "magazine_chunks",
+                       "%"PRIu64, chunks);
+        add_statistics(cookie, add_stats, NULL, -1, "magazine_alloc_hits",
+                       "%"PRIu64, alloc_hits);
+        add_statistics(cookie, add_stats, NULL, -1, "magazine_alloc_misses",
+                       "%"PRIu64, alloc_misses);
+        add_statistics(cookie, add_stats, NULL, -1, "magazine_free_hits",
+                       "%"PRIu64, free_hits);
+        add_statistics(cookie, add_stats, NULL, -1, "magazine_free_misses",
+                       "%"PRIu64, free_misses);
+        add_statistics(cookie, add_stats, NULL, -1, "magazine_hit_ratio",
+                       "%.2f", (alloc_hits + free_hits) == 0 ? 0.0 :
+                       (double)(alloc_hits + free_hits) /
+                       (double)(alloc_hits + alloc_misses +
+                                free_hits + free_misses));
+    }
+
+    add_statistics(cookie, add_stats, NULL, -1, "arena_page_type", "%s",
+                   engine->slabs.arena.page_type);
+    add_statistics(cookie, add_stats, NULL, -1, "arena_numa_policy", "%s",
+                   engine->slabs.arena.numa_policy);
+    add_statistics(cookie, add_stats, NULL, -1, "arena_prefaulted_bytes",
+                   "%"PRIu64, (uint64_t)engine->slabs.arena.prefaulted);
+    add_statistics(cookie, add_stats, NULL, -1, "arena_prefault_usec",
+                   "%"PRIu64, engine->slabs.arena.prefault_usec);
+
+    cb_mutex_enter(&engine->slabs.rebalance.lock);
+    add_statistics(cookie, add_stats, NULL, -1, "slab_reassign_running", "%d",
+                   engine->slabs.rebalance.busy ? 1 : 0);
+    add_statistics(cookie, add_stats, NULL, -1, "slabs_moved", "%"PRIu64,
+                   engine->slabs.rebalance.pages_moved);
+    add_statistics(cookie, add_stats, NULL, -1, "slab_reassign_evictions",
+                   "%"PRIu64, engine->slabs.rebalance.evictions);
+    add_statistics(cookie, add_stats, NULL, -1, "slab_reassign_busy_items",
+                   "%"PRIu64, engine->slabs.rebalance.busy_items);
+    add_statistics(cookie, add_stats, NULL, -1, "slab_compact_pages",
+                   "%"PRIu64, engine->slabs.rebalance.pages_compacted);
+    add_statistics(cookie, add_stats, NULL, -1, "slab_compact_items_moved",
+                   "%"PRIu64, engine->slabs.rebalance.items_relocated);
+    cb_mutex_exit(&engine->slabs.rebalance.lock);
+
+    cb_mutex_enter(&engine->slabs.lock);
+    add_statistics(cookie, add_stats, NULL, -1, "slab_spare_pages", "%u",
+                   engine->slabs.spare.count);
+    cb_mutex_exit(&engine->slabs.lock);
+
+    slab_pool_stats(engine, add_stats, cookie);
 }
 
 static void *memory_allocate(struct default_engine *engine, size_t size) {
@@ -407,28 +1103,459 @@ static void *memory_allocate(struct default_engine *engine, size_t size) {
 void *slabs_alloc(struct default_engine *engine, size_t size, unsigned int id) {
     void *ret;
 
-    cb_mutex_enter(&engine->slabs.lock);
+    if (id < POWER_SMALLEST || id > engine->slabs.power_largest) {
+        MEMCACHED_SLABS_ALLOCATE_FAILED(size, 0);
+        return NULL;
+    }
+
+    cb_mutex_enter(&engine->slabs.slabclass[id].lock);
     ret = do_slabs_alloc(engine, size, id);
-    cb_mutex_exit(&engine->slabs.lock);
+    cb_mutex_exit(&engine->slabs.slabclass[id].lock);
     return ret;
 }
 
 void slabs_free(struct default_engine *engine, void *ptr, size_t size, unsigned int id) {
-    cb_mutex_enter(&engine->slabs.lock);
+    if (id < POWER_SMALLEST || id > engine->slabs.power_largest) {
+        return;
+    }
+
+    cb_mutex_enter(&engine->slabs.slabclass[id].lock);
     do_slabs_free(engine, ptr, size, id);
-    cb_mutex_exit(&engine->slabs.lock);
+    cb_mutex_exit(&engine->slabs.slabclass[id].lock);
 }
 
-void slabs_stats(struct default_engine *engine, ADD_STAT add_stats, const void *c) {
-    cb_mutex_enter(&engine->slabs.lock);
-    do_slabs_stats(engine, add_stats, c);
-    cb_mutex_exit(&engine->slabs.lock);
+/*
+ * Get the magazine for the slab class in the given stripe, or NULL if the
+ * class doesn't use magazines. The caller must hold the item lock for the
+ * stripe.
+ */
+static slab_magazine_t *slabs_magazine(struct default_engine *engine,
+                                       unsigned int id, uint32_t stripe) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    if (engine->slabs.magazines == NULL || p->magazine_size == 0 ||
+        p->magazines_off) {
+        return NULL;
+    }
+    return &engine->slabs.magazines[stripe * (engine->slabs.power_largest + 1) + id];
 }
 
-void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id, size_t old, size_t ntotal)
-{
-    slabclass_t *p;
-    cb_mutex_enter(&engine->slabs.lock);
+/*
+ * Return all but keep chunks of the magazine to the slab class. The
+ * caller must hold the slab class lock (and the item lock owning the
+ * magazine).
+ */
+static void do_slabs_magazine_drain(struct default_engine *engine,
+                                    unsigned int id, slab_magazine_t *m,
+                                    unsigned int keep) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    p->requested += m->requested;
+    m->requested = 0;
+    while (m->count > keep) {
+        do_slabs_free(engine, m->chunks[--m->count], 0, id);
+    }
+}
+
+/*
+ * The slab class is out of chunks, but the other stripes may hold free
+ * chunks in their magazines. We already hold an item lock, so the other
+ * stripes may only be tried.
+ */
+static void slabs_magazine_reclaim(struct default_engine *engine,
+                                   unsigned int id, uint32_t stripe) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    uint32_t ii;
+
+    for (ii = 0; ii < engine->slabs.nmagazines; ++ii) {
+        slab_magazine_t *m;
+        if (ii == stripe || !item_trylock(engine, ii)) {
+            continue;
+        }
+        m = slabs_magazine(engine, id, ii);
+        if (m != NULL && m->count != 0) {
+            cb_mutex_enter(&p->lock);
+            do_slabs_magazine_drain(engine, id, m, 0);
+            cb_mutex_exit(&p->lock);
+        }
+        item_unlock(engine, ii);
+    }
+}
+
+void *slabs_alloc_cached(struct default_engine *engine, size_t size,
+                         unsigned int id, uint32_t stripe) {
+    slab_magazine_t *m;
+    slabclass_t *p;
+    void *ret;
+
+    if (id < POWER_SMALLEST || id > engine->slabs.power_largest) {
+        MEMCACHED_SLABS_ALLOCATE_FAILED(size, 0);
+        return NULL;
+    }
+
+    if ((m = slabs_magazine(engine, id, stripe)) == NULL) {
+        return slabs_alloc(engine, size, id);
+    }
+
+    p = &engine->slabs.slabclass[id];
+    if (m->count != 0) {
+        m->alloc_hits++;
+    } else {
+        /* Refill half of the magazine with a single trip to the class */
+        m->alloc_misses++;
+        cb_mutex_enter(&p->lock);
+        p->requested += m->requested;
+        m->requested = 0;
+        while (m->count < (p->magazine_size + 1) / 2) {
+            void *ptr = do_slabs_alloc(engine, 0, id);
+            if (ptr == NULL) {
+                break;
+            }
+            m->chunks[m->count++] = ptr;
+        }
+        cb_mutex_exit(&p->lock);
+
+        if (m->count == 0) {
+            slabs_magazine_reclaim(engine, id, stripe);
+            return slabs_alloc(engine, size, id);
+        }
+    }
+
+    ret = m->chunks[--m->count];
+    m->requested += size;
+    MEMCACHED_SLABS_ALLOCATE(size, id, p->size, ret);
+    return ret;
+}
+
+void slabs_free_cached(struct default_engine *engine, void *ptr, size_t size,
+                       unsigned int id, uint32_t stripe) {
+    slab_magazine_t *m;
+
+    if (id < POWER_SMALLEST || id > engine->slabs.power_largest) {
+        return;
+    }
+
+    if ((m = slabs_magazine(engine, id, stripe)) == NULL) {
+        slabs_free(engine, ptr, size, id);
+        return;
+    }
+
+    MEMCACHED_SLABS_FREE(size, id, ptr);
+    if (m->count == engine->slabs.slabclass[id].magazine_size) {
+        /* Drain half of the magazine with a single trip to the class */
+        slabclass_t *p = &engine->slabs.slabclass[id];
+        m->free_misses++;
+        cb_mutex_enter(&p->lock);
+        do_slabs_magazine_drain(engine, id, m, p->magazine_size / 2);
+        cb_mutex_exit(&p->lock);
+    } else {
+        m->free_hits++;
+    }
+
+    ((hash_item*)ptr)->iflag |= ITEM_SLABBED;
+    m->chunks[m->count++] = ptr;
+    m->requested -= size;
+}
+
+/*
+ * Stop (or resume) using the magazines for a slab class, returning the
+ * chunks in them to the class. The caller must hold all item locks.
+ */
+static void slabs_magazines_off(struct default_engine *engine,
+                                unsigned int id, bool off) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    uint32_t ii;
+
+    if (engine->slabs.magazines == NULL || p->magazine_size == 0) {
+        return;
+    }
+
+    if (off) {
+        cb_mutex_enter(&p->lock);
+        for (ii = 0; ii < engine->slabs.nmagazines; ++ii) {
+            slab_magazine_t *m = slabs_magazine(engine, id, ii);
+            if (m != NULL) {
+                do_slabs_magazine_drain(engine, id, m, 0);
+            }
+        }
+        cb_mutex_exit(&p->lock);
+    }
+    p->magazines_off = off;
+}
+
+void slabs_stats(struct default_engine *engine, ADD_STAT add_stats, const void *c) {
+    do_slabs_stats(engine, add_stats, c);
+}
+
+/* The slack of the items of the histogram in the classes of sizes */
+static uint64_t slabs_learn_slack(const unsigned int *sizes, unsigned int n,
+                                  const unsigned int *counts) {
+    unsigned int id = POWER_SMALLEST;
+    uint64_t slack = 0;
+    unsigned int b;
+
+    for (b = 1; b < ITEM_SIZE_BUCKETS && id < n; ++b) {
+        uint64_t size = (uint64_t)b * ITEM_SIZE_BUCKET;
+        if (counts[b] == 0) {
+            continue;
+        }
+        while (id < n && sizes[id] < size) {
+            ++id;
+        }
+        if (id < n) {
+            slack += counts[b] * (sizes[id] - size);
+        }
+    }
+    return slack;
+}
+
+unsigned int slabs_learn(struct default_engine *engine,
+                         unsigned int sizes[MAX_NUMBER_OF_SLAB_CLASSES],
+                         uint64_t *slack, uint64_t *learned_slack) {
+    const unsigned int *plan = engine->slabs.plan;
+    const unsigned int nplan = engine->slabs.nplan;
+    /* The tiny class stays as it is */
+    const unsigned int lo = engine->config.tiny_items ?
+        POWER_SMALLEST + 1 : POWER_SMALLEST;
+    const uint64_t floor = lo > POWER_SMALLEST ? plan[POWER_SMALLEST] : 0;
+    unsigned int *counts = NULL;
+    unsigned int *points = NULL;
+    uint64_t *count_sum = NULL, *byte_sum = NULL;
+    uint64_t *prev = NULL, *cur = NULL;
+    uint16_t *from = NULL;
+    uint64_t limit, total = 0, acc = 0;
+    unsigned int bounds[MAX_NUMBER_OF_SLAB_CLASSES];
+    unsigned int npoints = 0, nclasses = 0, keep, b, j, k, id, n = 0;
+
+    *slack = *learned_slack = 0;
+    if (nplan < lo + 2) {
+        /* Nothing but the class of item_size_max to place */
+        return 0;
+    }
+    /* Larger items go to the class of item_size_max, as they do now */
+    limit = plan[nplan - 2];
+
+    counts = malloc(ITEM_SIZE_BUCKETS * sizeof(*counts));
+    points = malloc(ITEM_SIZE_BUCKETS * sizeof(*points));
+    if (counts == NULL || points == NULL) {
+        goto done;
+    }
+    /* Good enough while they change, as for "stats sizes" */
+    for (b = 0; b < ITEM_SIZE_BUCKETS; ++b) {
+        counts[b] = engine->items.size_histogram[b];
+    }
+    *slack = slabs_learn_slack(plan, nplan, counts);
+
+    for (b = 1; b < ITEM_SIZE_BUCKETS; ++b) {
+        uint64_t size = (uint64_t)b * ITEM_SIZE_BUCKET;
+        if (counts[b] != 0 && size > floor && size <= limit) {
+            points[npoints++] = b;
+            total += counts[b];
+        }
+    }
+    if (npoints == 0) {
+        goto done;
+    }
+
+    /*
+     * A class may only end at the size of the items of a point, and with
+     * too many sizes seen only at the ones which split the items into
+     * SLAB_LEARN_POINTS groups of about as many
+     */
+    if (npoints > SLAB_LEARN_POINTS) {
+        for (j = keep = 0; j < npoints; ++j) {
+            acc += counts[points[j]];
+            if (acc * SLAB_LEARN_POINTS >= (keep + 1) * total ||
+                j == npoints - 1) {
+                points[keep++] = points[j];
+            }
+        }
+        npoints = keep;
+    }
+
+    /* As many classes as now up to the one of the largest item seen */
+    for (id = lo; id <= nplan - 2; ++id) {
+        ++nclasses;
+        if (plan[id] >= (uint64_t)points[npoints - 1] * ITEM_SIZE_BUCKET) {
+            break;
+        }
+    }
+    if (nclasses > npoints) {
+        nclasses = npoints;
+    }
+
+    count_sum = malloc(npoints * sizeof(*count_sum));
+    byte_sum = malloc(npoints * sizeof(*byte_sum));
+    prev = malloc(npoints * sizeof(*prev));
+    cur = malloc(npoints * sizeof(*cur));
+    from = malloc((size_t)nclasses * npoints * sizeof(*from));
+    if (count_sum == NULL || byte_sum == NULL || prev == NULL ||
+        cur == NULL || from == NULL) {
+        goto done;
+    }
+
+    /* The items (and their bytes) up to each point, to cost a class in O(1) */
+    acc = 0;
+    total = 0;
+    for (b = 1, j = 0; j < npoints; ++b) {
+        uint64_t size = (uint64_t)b * ITEM_SIZE_BUCKET;
+        if (size > floor) {
+            acc += counts[b];
+            total += counts[b] * size;
+        }
+        if (b == points[j]) {
+            count_sum[j] = acc;
+            byte_sum[j] = total;
+            ++j;
+        }
+    }
+
+    /*
+     * prev[j] is the least slack of the items up to point j with k classes,
+     * the last one ending at it: the slack of a class from past point i
+     * to point j is its size times its items, less their bytes.
+     */
+#define SLAB_LEARN_COST(i, j) \
+    ((uint64_t)points[j] * ITEM_SIZE_BUCKET * \
+     (count_sum[j] - ((i) < 0 ? 0 : count_sum[i])) - \
+     (byte_sum[j] - ((i) < 0 ? 0 : byte_sum[i])))
+
+    for (j = 0; j < npoints; ++j) {
+        prev[j] = SLAB_LEARN_COST(-1, (int)j);
+    }
+    for (k = 1; k < nclasses; ++k) {
+        for (j = 0; j < npoints; ++j) {
+            uint64_t best = UINT64_MAX;
+            unsigned int i;
+
+            for (i = k - 1; i < j; ++i) {
+                uint64_t cost;
+                if (prev[i] == UINT64_MAX) {
+                    continue;
+                }
+                cost = prev[i] + SLAB_LEARN_COST((int)i, (int)j);
+                if (cost < best) {
+                    best = cost;
+                    from[(size_t)k * npoints + j] = (uint16_t)i;
+                }
+            }
+            cur[j] = best;
+        }
+        memcpy(prev, cur, npoints * sizeof(*prev));
+    }
+#undef SLAB_LEARN_COST
+
+    /* The last class ends at the largest item, walk back from it */
+    for (j = npoints - 1, k = nclasses; k-- > 0;) {
+        bounds[k] = points[j] * ITEM_SIZE_BUCKET;
+        if (k > 0) {
+            j = from[(size_t)k * npoints + j];
+        }
+    }
+
+    memset(sizes, 0, MAX_NUMBER_OF_SLAB_CLASSES * sizeof(*sizes));
+    n = POWER_SMALLEST;
+    if (lo > POWER_SMALLEST) {
+        sizes[n++] = plan[POWER_SMALLEST];
+    }
+    for (k = 0; k < nclasses; ++k) {
+        sizes[n++] = bounds[k];
+    }
+    for (id = lo; id < nplan; ++id) {
+        if (plan[id] > bounds[nclasses - 1]) {
+            sizes[n++] = plan[id];
+        }
+    }
+    *learned_slack = slabs_learn_slack(sizes, n, counts);
+
+done:
+    free(counts);
+    free(points);
+    free(count_sum);
+    free(byte_sum);
+    free(prev);
+    free(cur);
+    free(from);
+    return n;
+}
+
+void slabs_stats_sizes(struct default_engine *engine, ADD_STAT add_stats,
+                       const void *cookie) {
+    unsigned int sizes[MAX_NUMBER_OF_SLAB_CLASSES];
+    uint64_t slack, learned_slack, total = 0;
+    unsigned int i, n;
+
+    for (i = POWER_SMALLEST; i <= engine->slabs.power_largest; i++) {
+        slabclass_t *p = &engine->slabs.slabclass[i];
+        cb_mutex_enter(&p->lock);
+        if (p->slabs != 0) {
+            uint64_t used = (uint64_t)p->slabs * p->perslab - p->sl_curr -
+                p->end_page_free;
+            uint64_t bytes = used * p->size;
+            uint64_t s = bytes > p->requested ? bytes - p->requested : 0;
+            add_statistics(cookie, add_stats, NULL, i, "chunk_size", "%u",
+                           p->size);
+            add_statistics(cookie, add_stats, NULL, i, "slack_bytes",
+                           "%"PRIu64, s);
+            total += s;
+        }
+        cb_mutex_exit(&p->lock);
+    }
+    add_statistics(cookie, add_stats, NULL, -1, "slack_bytes", "%"PRIu64,
+                   total);
+    add_statistics(cookie, add_stats, NULL, -1, "slab_sizes_learned", "%d",
+                   engine->slabs.learned ? 1 : 0);
+
+    n = slabs_learn(engine, sizes, &slack, &learned_slack);
+    if (n != 0) {
+        /* As slab_sizes takes them: without the tiny class or the last */
+        char buffer[MAX_NUMBER_OF_SLAB_CLASSES * 12];
+        size_t len = 0;
+
+        i = engine->config.tiny_items ? POWER_SMALLEST + 1 : POWER_SMALLEST;
+        for (; i < n - 1; ++i) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, "%s%u",
+                            len == 0 ? "" : "-", sizes[i]);
+        }
+        add_statistics(cookie, add_stats, NULL, -1, "est_slack_bytes",
+                       "%"PRIu64, slack);
+        add_statistics(cookie, add_stats, NULL, -1, "learned_slack_bytes",
+                       "%"PRIu64, learned_slack);
+        add_statistics(cookie, add_stats, NULL, -1, "learned_classes", "%u",
+                       n - POWER_SMALLEST);
+        add_statistics(cookie, add_stats, NULL, -1, "learned_slab_sizes",
+                       "%s", buffer);
+    }
+}
+
+unsigned int slabs_available(struct default_engine *engine, unsigned int id) {
+    slabclass_t *p;
+    unsigned int ret;
+    bool full;
+
+    if (id < POWER_SMALLEST || id > engine->slabs.power_largest) {
+        return 0;
+    }
+
+    p = &engine->slabs.slabclass[id];
+    cb_mutex_enter(&p->lock);
+    ret = p->sl_curr + (p->end_page_ptr != NULL ? p->end_page_free : 0);
+    cb_mutex_enter(&engine->slabs.lock);
+    if (engine->pool.attached) {
+        full = engine->slabs.spare.count == 0 && slab_pool_full(engine);
+    } else {
+        full = engine->slabs.mem_limit != 0 && p->slabs > 0 &&
+            engine->slabs.spare.count == 0 &&
+            engine->slabs.mem_malloced + slabs_page_size(engine, p) >
+            engine->slabs.mem_limit;
+    }
+    cb_mutex_exit(&engine->slabs.lock);
+    cb_mutex_exit(&p->lock);
+
+    return full ? ret : UINT_MAX;
+}
+
+void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id, size_t old, size_t ntotal)
+{
+    slabclass_t *p;
     if (id < POWER_SMALLEST || id > engine->slabs.power_largest) {
         EXTENSION_LOGGER_DESCRIPTOR *logger;
         logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
@@ -438,8 +1565,9 @@ void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id,
     }
 
     p = &engine->slabs.slabclass[id];
+    cb_mutex_enter(&p->lock);
     p->requested = p->requested - old + ntotal;
-    cb_mutex_exit(&engine->slabs.lock);
+    cb_mutex_exit(&p->lock);
 }
 
 void slabs_destroy(struct default_engine *e)
@@ -448,10 +1576,30 @@ void slabs_destroy(struct default_engine *e)
     size_t ii;
     unsigned int jj;
 
+    /* The pages of a bucket using the shared pool go back there */
+    if (e->pool.attached) {
+        for (jj = POWER_SMALLEST; jj <= e->slabs.power_largest; jj++) {
+            slabclass_t *p = &e->slabs.slabclass[jj];
+            for (ii = 0; ii < p->slabs; ++ii) {
+                slab_pool_put(e, p->slab_list[ii], false);
+            }
+        }
+        slab_pool_detach(e);
+    }
+
     for (ii = 0; ii < e->slabs.allocs.next; ++ii) {
         free(e->slabs.allocs.ptrs[ii]);
     }
     free(e->slabs.allocs.ptrs);
+    free(e->slabs.magazines);
+    free(e->slabs.magazine_slots);
+    /* The spare pages are in allocs (or the arena) */
+    free(e->slabs.spare.pages);
+#ifndef WIN32
+    if (e->slabs.arena.mapped) {
+        munmap(e->slabs.mem_base, e->slabs.arena.size);
+    }
+#endif
 
     /* Release the freelists */
     for (jj = POWER_SMALLEST; jj <= e->slabs.power_largest; jj++) {
@@ -459,4 +1607,721 @@ void slabs_destroy(struct default_engine *e)
         free(p->slots);
         free(p->slab_list);
     }
+
+    /* The slab class locks are only initialized by slabs_init */
+    if (e->slabs.power_largest != 0) {
+        for (jj = 0; jj < MAX_NUMBER_OF_SLAB_CLASSES; ++jj) {
+            cb_mutex_destroy(&e->slabs.slabclass[jj].lock);
+        }
+    }
+}
+
+bool slabs_restart_page(struct default_engine *engine, unsigned int id,
+                        void *page, unsigned int ncarved) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    bool ret = false;
+
+    cb_mutex_enter(&p->lock);
+    if (grow_slab_list(engine, id) != 0) {
+        p->slab_list[p->slabs++] = page;
+        if (ncarved < p->perslab) {
+            p->end_page_ptr = (char*)page + (size_t)ncarved * p->size;
+            p->end_page_free = p->perslab - ncarved;
+        }
+        ret = true;
+    }
+    cb_mutex_exit(&p->lock);
+    return ret;
+}
+
+/* Put an emptied page in the spare pool. Returns false if out of memory */
+static bool slabs_spare_put(struct default_engine *engine, void *page) {
+    bool ret = true;
+
+    cb_mutex_enter(&engine->slabs.lock);
+    if (engine->pool.attached) {
+        /* For any of the buckets */
+        engine->slabs.mem_malloced -= engine->config.item_size_max;
+        slab_pool_put(engine, page, false);
+        cb_mutex_exit(&engine->slabs.lock);
+        return true;
+    }
+    if (engine->slabs.spare.count == engine->slabs.spare.size) {
+        unsigned int new_size = engine->slabs.spare.size != 0 ?
+            engine->slabs.spare.size * 2 : 16;
+        void **new_pages = realloc(engine->slabs.spare.pages,
+                                   new_size * sizeof(void*));
+        if (new_pages == NULL) {
+            ret = false;
+        } else {
+            engine->slabs.spare.pages = new_pages;
+            engine->slabs.spare.size = new_size;
+        }
+    }
+    if (ret) {
+        engine->slabs.spare.pages[engine->slabs.spare.count++] = page;
+    }
+    cb_mutex_exit(&engine->slabs.lock);
+    return ret;
+}
+
+bool slabs_restart_spare(struct default_engine *engine, void *page) {
+    return slabs_spare_put(engine, page);
+}
+
+void slabs_restart_arena(struct default_engine *engine, size_t used) {
+    cb_mutex_enter(&engine->slabs.lock);
+    engine->slabs.mem_current = (char*)engine->slabs.mem_base + used;
+    engine->slabs.mem_avail = engine->slabs.mem_limit - used;
+    engine->slabs.mem_malloced = used;
+    cb_mutex_exit(&engine->slabs.lock);
+}
+
+/*
+ * Carve a page into chunks for the given slab class and put them on the
+ * freelist. The caller must hold the slab class lock.
+ */
+static bool do_slabs_add_page(struct default_engine *engine,
+                              unsigned int id, char *page) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    unsigned int ii;
+
+    if (grow_slab_list(engine, id) == 0) {
+        return false;
+    }
+
+    memset(page, 0, engine->config.item_size_max);
+    for (ii = 0; ii < p->perslab; ++ii) {
+        hash_item *it = (void*)(page + ii * p->size);
+        it->iflag = ITEM_SLABBED;
+        do_slabs_push_free(p, it);
+    }
+    p->slab_list[p->slabs++] = page;
+    return true;
+}
+
+/* Pick a class (other than dst) which may give up a page */
+static unsigned int slabs_pick_source(struct default_engine *engine,
+                                      unsigned int dst) {
+    unsigned int ii;
+    unsigned int id = dst;
+
+    for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        slabclass_t *p;
+        bool spare;
+        if (++id > engine->slabs.power_largest) {
+            id = POWER_SMALLEST;
+        }
+        if (id == dst) {
+            continue;
+        }
+        p = &engine->slabs.slabclass[id];
+        cb_mutex_enter(&p->lock);
+        spare = p->slabs > 1;
+        cb_mutex_exit(&p->lock);
+        if (spare) {
+            return id;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Take a page of the slab class out of use while it is being emptied:
+ * nothing is allocated from it, and the chunks freed in it stay off the
+ * freelist (see do_slabs_free). The caller must hold the slab class lock.
+ */
+static void do_slabs_claim_page(struct default_engine *engine,
+                                slabclass_t *s, unsigned int index) {
+    char *page = s->slab_list[index];
+    unsigned int ii;
+
+    s->killing = index + 1;
+    if (s->end_page_ptr != NULL &&
+        slabs_page_contains(engine, page, s->end_page_ptr)) {
+        char *chunk = s->end_page_ptr;
+        for (ii = 0; ii < s->end_page_free; ++ii, chunk += s->size) {
+            ((hash_item*)chunk)->iflag = ITEM_SLABBED;
+        }
+        s->end_page_ptr = NULL;
+        s->end_page_free = 0;
+    }
+    for (ii = 0; ii < s->sl_curr;) {
+        if (slabs_page_contains(engine, page, s->slots[ii])) {
+            s->slots[ii] = s->slots[--s->sl_curr];
+        } else {
+            ++ii;
+        }
+    }
+}
+
+/*
+ * Done with the claimed page: it is taken out of the slab class if it was
+ * emptied, otherwise its free chunks go back on the freelist. The caller
+ * must hold the slab class lock. Returns the page if it was taken out.
+ */
+static char *do_slabs_unclaim_page(slabclass_t *s, bool empty) {
+    unsigned int index = s->killing - 1;
+    char *page = s->slab_list[index];
+    unsigned int ii;
+
+    s->killing = 0;
+    if (!empty) {
+        for (ii = 0; ii < s->perslab; ++ii) {
+            hash_item *it = (void*)(page + ii * s->size);
+            if ((it->iflag & ITEM_SLABBED) != 0) {
+                do_slabs_push_free(s, it);
+            }
+        }
+        return NULL;
+    }
+    memmove(s->slab_list + index, s->slab_list + index + 1,
+            (s->slabs - index - 1) * sizeof(void*));
+    s->slabs--;
+    return page;
+}
+
+/* Move an item of the page being compacted to a free chunk of its class */
+static bool slabs_relocate_chunk(struct default_engine *engine,
+                                 unsigned int id, hash_item *it) {
+    slabclass_t *s = &engine->slabs.slabclass[id];
+    void *chunk;
+
+    cb_mutex_enter(&s->lock);
+    chunk = do_slabs_take_free(s);
+    cb_mutex_exit(&s->lock);
+    if (chunk == NULL) {
+        return false;
+    }
+    if (item_relocate_for_compact(engine, it, s->size, chunk)) {
+        return true;
+    }
+    cb_mutex_enter(&s->lock);
+    ((hash_item*)chunk)->iflag = ITEM_SLABBED;
+    do_slabs_push_free(s, chunk);
+    cb_mutex_exit(&s->lock);
+    return false;
+}
+
+/*
+ * Walk the claimed page of slab class id until it is empty, unlinking the
+ * items stored in it (or moving them to other chunks of the class, if
+ * relocate is set) as soon as nobody holds a reference to them. The
+ * number of items unlinked (or moved) is added to done. Returns the
+ * number of items still in the page once it gives up.
+ */
+static unsigned int slabs_empty_page(struct default_engine *engine,
+                                     unsigned int id, char *page,
+                                     bool relocate, int max_tries,
+                                     uint64_t *done) {
+    slabclass_t *s = &engine->slabs.slabclass[id];
+    unsigned int busy = 0;
+    int tries;
+
+    for (tries = 0; tries < max_tries; ++tries) {
+        unsigned int ii;
+        bool running;
+        busy = 0;
+        for (ii = 0; ii < s->perslab; ++ii) {
+            hash_item *it = (void*)(page + ii * s->size);
+            bool slabbed;
+
+            cb_mutex_enter(&s->lock);
+            slabbed = (it->iflag & ITEM_SLABBED) != 0;
+            cb_mutex_exit(&s->lock);
+
+            if (slabbed) {
+                continue;
+            }
+            if (relocate ? slabs_relocate_chunk(engine, id, it) :
+                item_unlink_for_reassign(engine, it, s->size)) {
+                ++*done;
+            } else {
+                ++busy;
+            }
+        }
+
+        if (busy == 0) {
+            break;
+        }
+
+        /* Someone is using the item (or it isn't linked yet), retry */
+        cb_mutex_enter(&engine->slabs.rebalance.lock);
+        engine->slabs.rebalance.busy_items += busy;
+        running = engine->slabs.rebalance.running;
+        if (running) {
+            cb_cond_timedwait(&engine->slabs.rebalance.cond,
+                              &engine->slabs.rebalance.lock,
+                              SLAB_REASSIGN_RETRY_DELAY);
+        }
+        cb_mutex_exit(&engine->slabs.rebalance.lock);
+        if (!running) {
+            break;
+        }
+    }
+    return busy;
+}
+
+/* Give an empty page to slab class dst, or to the shared pool (dst 0) */
+static bool slabs_deliver_page(struct default_engine *engine,
+                               unsigned int dst, char *page) {
+    slabclass_t *d;
+    bool ret;
+
+    if (dst == 0) {
+        cb_mutex_enter(&engine->slabs.lock);
+        engine->slabs.mem_malloced -= engine->config.item_size_max;
+        cb_mutex_exit(&engine->slabs.lock);
+        slab_pool_put(engine, page, true);
+        return true;
+    }
+    d = &engine->slabs.slabclass[dst];
+    cb_mutex_enter(&d->lock);
+    ret = do_slabs_add_page(engine, dst, page);
+    cb_mutex_exit(&d->lock);
+    return ret;
+}
+
+/*
+ * Move the first page of slab class src to slab class dst (or to the
+ * shared pool, if dst is 0). The page is taken out of use, and the items
+ * stored in it are unlinked as soon as nobody holds a reference to them.
+ * If the page can't be emptied it is given back to src. With src 0 a
+ * spare page is used if there is one.
+ */
+static bool slabs_move_page(struct default_engine *engine,
+                            unsigned int src, unsigned int dst) {
+    slabclass_t *s;
+    char *page;
+    unsigned int busy;
+    uint64_t evicted = 0;
+    bool moved;
+
+    if (src == 0) {
+        page = NULL;
+        cb_mutex_enter(&engine->slabs.lock);
+        if (engine->slabs.spare.count != 0) {
+            page = engine->slabs.spare.pages[--engine->slabs.spare.count];
+        }
+        cb_mutex_exit(&engine->slabs.lock);
+        if (page != NULL) {
+            moved = slabs_deliver_page(engine, dst, page);
+            if (!moved) {
+                slabs_spare_put(engine, page);
+                return false;
+            }
+            cb_mutex_enter(&engine->slabs.rebalance.lock);
+            engine->slabs.rebalance.pages_moved++;
+            cb_mutex_exit(&engine->slabs.rebalance.lock);
+            return true;
+        }
+        if ((src = slabs_pick_source(engine, dst)) == 0) {
+            return false;
+        }
+    }
+
+    s = &engine->slabs.slabclass[src];
+
+    /* The chunks in the magazines are invisible to us */
+    item_lock_all(engine);
+    slabs_magazines_off(engine, src, true);
+    item_unlock_all(engine);
+
+    cb_mutex_enter(&s->lock);
+    if (s->slabs < 2 || s->killing != 0) {
+        cb_mutex_exit(&s->lock);
+        item_lock_all(engine);
+        slabs_magazines_off(engine, src, false);
+        item_unlock_all(engine);
+        return false;
+    }
+    page = s->slab_list[0];
+    do_slabs_claim_page(engine, s, 0);
+    cb_mutex_exit(&s->lock);
+
+    busy = slabs_empty_page(engine, src, page, false, SLAB_REASSIGN_TRIES,
+                            &evicted);
+
+    cb_mutex_enter(&s->lock);
+    moved = do_slabs_unclaim_page(s, busy == 0) != NULL;
+    cb_mutex_exit(&s->lock);
+
+    item_lock_all(engine);
+    slabs_magazines_off(engine, src, false);
+    item_unlock_all(engine);
+
+    if (moved) {
+        moved = slabs_deliver_page(engine, dst, page);
+        if (!moved) {
+            /* src just released a slot in its page list */
+            cb_mutex_enter(&s->lock);
+            do_slabs_add_page(engine, src, page);
+            cb_mutex_exit(&s->lock);
+        }
+    }
+
+    cb_mutex_enter(&engine->slabs.rebalance.lock);
+    engine->slabs.rebalance.evictions += evicted;
+    if (moved) {
+        engine->slabs.rebalance.pages_moved++;
+    }
+    cb_mutex_exit(&engine->slabs.rebalance.lock);
+
+    return moved;
+}
+
+/*
+ * The number of items in a page of the slab class (the chunks not yet
+ * carved out of the end page are free). The caller must hold the slab
+ * class lock.
+ */
+static unsigned int do_slabs_page_items(struct default_engine *engine,
+                                        const slabclass_t *s,
+                                        const char *page) {
+    unsigned int ii, n = s->perslab;
+    unsigned int nitems = 0;
+
+    if (s->end_page_ptr != NULL &&
+        slabs_page_contains(engine, page, s->end_page_ptr)) {
+        n = (unsigned int)(((char*)s->end_page_ptr - page) / s->size);
+    }
+    for (ii = 0; ii < n; ++ii) {
+        const hash_item *it = (const void*)(page + ii * s->size);
+        if ((it->iflag & ITEM_SLABBED) == 0) {
+            ++nitems;
+        }
+    }
+    return nitems;
+}
+
+/* The free chunks of the slab class. The caller holds its lock */
+static unsigned int do_slabs_free_chunks(const slabclass_t *s) {
+    return s->sl_curr + (s->end_page_ptr != NULL ? s->end_page_free : 0);
+}
+
+/*
+ * Pick the slab class with the most pages' worth of free chunks (at
+ * least one page, out of at least two) to be compacted. The chunks in the
+ * magazines are read without their locks, it's only a guess.
+ */
+static unsigned int slabs_pick_compact(struct default_engine *engine) {
+    unsigned int ii;
+    unsigned int id = 0;
+    double best = 1.0;
+
+    for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        slabclass_t *p = &engine->slabs.slabclass[ii];
+        unsigned int nfree = 0;
+        uint32_t jj;
+        double pages;
+
+        for (jj = 0; jj < engine->slabs.nmagazines; ++jj) {
+            slab_magazine_t *m = slabs_magazine(engine, ii, jj);
+            if (m != NULL) {
+                nfree += m->count;
+            }
+        }
+        cb_mutex_enter(&p->lock);
+        pages = p->slabs > 1 && p->killing == 0 ?
+            (double)(do_slabs_free_chunks(p) + nfree) / p->perslab : 0.0;
+        cb_mutex_exit(&p->lock);
+        if (pages >= best) {
+            best = pages;
+            id = ii;
+        }
+    }
+    return id;
+}
+
+/*
+ * Compact a slab class with a lot of free chunks: the items in its
+ * emptiest page are moved to the free chunks of the other pages, and the
+ * page goes to the spare pool. Nothing is evicted, and the page is given
+ * back if its items can't be moved. Only called from the rebalancer
+ * thread.
+ */
+static bool slabs_compact(struct default_engine *engine) {
+    unsigned int id = slabs_pick_compact(engine);
+    slabclass_t *s;
+    unsigned int ii, index = 0;
+    unsigned int nitems = UINT_MAX;
+    unsigned int busy;
+    uint64_t relocated = 0;
+    char *page = NULL;
+
+    if (id == 0) {
+        return false;
+    }
+    s = &engine->slabs.slabclass[id];
+
+    item_lock_all(engine);
+    slabs_magazines_off(engine, id, true);
+    item_unlock_all(engine);
+
+    /* Only this thread takes pages out of the class, the list stays put */
+    cb_mutex_enter(&s->lock);
+    for (ii = 0; ii < s->slabs && nitems != 0; ++ii) {
+        unsigned int n = do_slabs_page_items(engine, s, s->slab_list[ii]);
+        if (n < nitems) {
+            nitems = n;
+            index = ii;
+        }
+        /* Let the workers in between the pages */
+        cb_mutex_exit(&s->lock);
+        cb_mutex_enter(&s->lock);
+    }
+    if (s->killing == 0 && s->slabs > 1 && index < s->slabs) {
+        /* The other pages must have room for its items */
+        page = s->slab_list[index];
+        nitems = do_slabs_page_items(engine, s, page);
+        if (do_slabs_free_chunks(s) >= s->perslab &&
+            do_slabs_free_chunks(s) - (s->perslab - nitems) >= nitems) {
+            do_slabs_claim_page(engine, s, index);
+        } else {
+            page = NULL;
+        }
+    }
+    cb_mutex_exit(&s->lock);
+
+    if (page != NULL) {
+        busy = slabs_empty_page(engine, id, page, true, SLAB_COMPACT_TRIES,
+                                &relocated);
+        cb_mutex_enter(&s->lock);
+        page = do_slabs_unclaim_page(s, busy == 0);
+        if (page != NULL && !slabs_spare_put(engine, page)) {
+            /* The class just released a slot in its page list */
+            do_slabs_add_page(engine, id, page);
+            page = NULL;
+        }
+        cb_mutex_exit(&s->lock);
+    }
+
+    item_lock_all(engine);
+    slabs_magazines_off(engine, id, false);
+    item_unlock_all(engine);
+
+    cb_mutex_enter(&engine->slabs.rebalance.lock);
+    engine->slabs.rebalance.items_relocated += relocated;
+    if (page != NULL) {
+        engine->slabs.rebalance.pages_compacted++;
+    }
+    cb_mutex_exit(&engine->slabs.rebalance.lock);
+
+    return page != NULL;
+}
+
+/*
+ * Look at the evictions during the last window. A class which hasn't
+ * evicted anything for 3 windows (and has more than 2 pages) gives a page
+ * to the class with the most evictions, if it has been the top evictor
+ * for 3 windows in a row. Only called from the rebalancer thread.
+ */
+static bool slabs_automove_decision(struct default_engine *engine,
+                                    unsigned int *src, unsigned int *dst) {
+    unsigned int source = 0;
+    unsigned int highest = 0;
+    unsigned int highest_id = 0;
+    unsigned int ii;
+
+    for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        unsigned int evicted = item_evicted(engine, ii);
+        unsigned int prev = engine->slabs.rebalance.evicted_prev[ii];
+        /* The counter goes back to zero if the stats are reset */
+        unsigned int diff = evicted >= prev ? evicted - prev : evicted;
+        unsigned int pages;
+
+        engine->slabs.rebalance.evicted_prev[ii] = evicted;
+
+        cb_mutex_enter(&engine->slabs.slabclass[ii].lock);
+        pages = engine->slabs.slabclass[ii].slabs;
+        cb_mutex_exit(&engine->slabs.slabclass[ii].lock);
+
+        if (diff == 0 && pages > 2) {
+            if (++engine->slabs.rebalance.zero_windows[ii] >= 3 &&
+                source == 0) {
+                source = ii;
+            }
+        } else {
+            engine->slabs.rebalance.zero_windows[ii] = 0;
+            if (diff > highest) {
+                highest = diff;
+                highest_id = ii;
+            }
+        }
+    }
+
+    if (highest_id != 0 && highest_id == engine->slabs.rebalance.winner) {
+        engine->slabs.rebalance.wins++;
+    } else {
+        engine->slabs.rebalance.winner = highest_id;
+        engine->slabs.rebalance.wins = 1;
+    }
+
+    if (source != 0 && highest_id != 0 &&
+        engine->slabs.rebalance.wins >= 3) {
+        *src = source;
+        *dst = highest_id;
+        engine->slabs.rebalance.wins = 0;
+        return true;
+    }
+    return false;
+}
+
+static void slabs_rebalancer_main(void *arg) {
+    struct default_engine *engine = arg;
+
+    engine_thread_started(engine);
+    cb_mutex_enter(&engine->slabs.rebalance.lock);
+    while (engine->slabs.rebalance.running) {
+        unsigned int src, dst;
+
+        if (engine->slabs.rebalance.dst != 0) {
+            src = engine->slabs.rebalance.src;
+            dst = engine->slabs.rebalance.dst;
+            engine->slabs.rebalance.dst = 0;
+            engine->slabs.rebalance.busy = true;
+            cb_mutex_exit(&engine->slabs.rebalance.lock);
+
+            slabs_move_page(engine, src, dst);
+
+            cb_mutex_enter(&engine->slabs.rebalance.lock);
+            engine->slabs.rebalance.busy = false;
+            continue;
+        }
+
+        if (engine->slabs.rebalance.give) {
+            /* Another bucket of the shared pool wants a page */
+            engine->slabs.rebalance.give = false;
+            engine->slabs.rebalance.busy = true;
+            cb_mutex_exit(&engine->slabs.rebalance.lock);
+
+            slabs_move_page(engine, 0, 0);
+
+            cb_mutex_enter(&engine->slabs.rebalance.lock);
+            engine->slabs.rebalance.busy = false;
+            continue;
+        }
+
+        if (engine->config.slab_automove) {
+            rel_time_t now = engine->server.core->get_current_time();
+            if (now >= engine->slabs.rebalance.next_window) {
+                bool found;
+                engine->slabs.rebalance.next_window = now + SLAB_AUTOMOVE_WINDOW;
+                cb_mutex_exit(&engine->slabs.rebalance.lock);
+
+                found = slabs_automove_decision(engine, &src, &dst);
+
+                cb_mutex_enter(&engine->slabs.rebalance.lock);
+                if (found && engine->slabs.rebalance.dst == 0) {
+                    engine->slabs.rebalance.src = src;
+                    engine->slabs.rebalance.dst = dst;
+                }
+                continue;
+            }
+        }
+
+        if (engine->config.slab_compact) {
+            rel_time_t now = engine->server.core->get_current_time();
+            if (now >= engine->slabs.rebalance.next_compact) {
+                engine->slabs.rebalance.next_compact = now + SLAB_COMPACT_INTERVAL;
+                engine->slabs.rebalance.busy = true;
+                /* One page after the other, until a move is requested */
+                while (engine->slabs.rebalance.running &&
+                       engine->slabs.rebalance.dst == 0) {
+                    bool compacted;
+                    cb_mutex_exit(&engine->slabs.rebalance.lock);
+                    compacted = slabs_compact(engine);
+                    cb_mutex_enter(&engine->slabs.rebalance.lock);
+                    if (!compacted) {
+                        break;
+                    }
+                }
+                engine->slabs.rebalance.busy = false;
+                continue;
+            }
+        }
+
+        cb_cond_timedwait(&engine->slabs.rebalance.cond,
+                          &engine->slabs.rebalance.lock, 1000);
+    }
+    cb_mutex_exit(&engine->slabs.rebalance.lock);
+}
+
+void slabs_give_page(struct default_engine *engine) {
+    cb_mutex_enter(&engine->slabs.rebalance.lock);
+    engine->slabs.rebalance.give = true;
+    cb_cond_signal(&engine->slabs.rebalance.cond);
+    cb_mutex_exit(&engine->slabs.rebalance.lock);
+}
+
+bool slabs_start_rebalancer(struct default_engine *engine) {
+    bool ret = true;
+    cb_mutex_enter(&engine->slabs.rebalance.lock);
+    if (!engine->slabs.rebalance.running) {
+        engine->slabs.rebalance.running = true;
+        if (cb_create_thread(&engine->slabs.rebalance.tid,
+                             slabs_rebalancer_main, engine, 0) != 0) {
+            engine->slabs.rebalance.running = false;
+            ret = false;
+        }
+    }
+    cb_mutex_exit(&engine->slabs.rebalance.lock);
+    return ret;
+}
+
+void slabs_stop_rebalancer(struct default_engine *engine) {
+    bool running;
+    cb_mutex_enter(&engine->slabs.rebalance.lock);
+    running = engine->slabs.rebalance.running;
+    engine->slabs.rebalance.running = false;
+    cb_cond_signal(&engine->slabs.rebalance.cond);
+    cb_mutex_exit(&engine->slabs.rebalance.lock);
+
+    if (running) {
+        cb_join_thread(engine->slabs.rebalance.tid);
+    }
+}
+
+enum reassign_result_type slabs_reassign(struct default_engine *engine,
+                                         unsigned int src,
+                                         unsigned int dst) {
+    enum reassign_result_type ret = REASSIGN_OK;
+
+    if (!engine->config.slab_reassign) {
+        return REASSIGN_DISABLED;
+    }
+
+    if (src == dst) {
+        return REASSIGN_SRC_DST_SAME;
+    }
+
+    if (dst < POWER_SMALLEST || dst > engine->slabs.power_largest ||
+        (src != 0 && (src < POWER_SMALLEST ||
+                      src > engine->slabs.power_largest))) {
+        return REASSIGN_BADCLASS;
+    }
+
+    if (src != 0) {
+        bool spare;
+        cb_mutex_enter(&engine->slabs.slabclass[src].lock);
+        spare = engine->slabs.slabclass[src].slabs > 1;
+        cb_mutex_exit(&engine->slabs.slabclass[src].lock);
+        if (!spare) {
+            return REASSIGN_NOSPARE;
+        }
+    }
+
+    cb_mutex_enter(&engine->slabs.rebalance.lock);
+    if (!engine->slabs.rebalance.running) {
+        ret = REASSIGN_DISABLED;
+    } else if (engine->slabs.rebalance.busy ||
+               engine->slabs.rebalance.dst != 0) {
+        ret = REASSIGN_RUNNING;
+    } else {
+        engine->slabs.rebalance.src = src;
+        engine->slabs.rebalance.dst = dst;
+        cb_cond_signal(&engine->slabs.rebalance.cond);
+    }
+    cb_mutex_exit(&engine->slabs.rebalance.lock);
+    return ret;
 }
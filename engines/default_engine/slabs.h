@@ -24,14 +24,44 @@ typedef struct {
 
     unsigned int killing;  /* index+1 of dying slab, or zero if none */
     size_t requested; /* The number of requested bytes */
+
+    cb_mutex_t lock; /* Protects the freelist and pages of this class */
+
+    unsigned int magazine_size; /* capacity of the magazines, 0 if none */
+    bool magazines_off; /* don't use the magazines (set with all item locks held) */
 } slabclass_t;
 
+/*
+ * A small cache of free chunks of one slab class, owned by one item lock
+ * stripe. Everything in it is protected by that item lock, which the
+ * caller already holds while allocating or freeing an item.
+ */
+typedef struct {
+    void **chunks;
+    unsigned int count;
+    /* Requested bytes not yet accounted in the slab class */
+    int64_t requested;
+    uint64_t alloc_hits;
+    uint64_t alloc_misses;
+    uint64_t free_hits;
+    uint64_t free_misses;
+} slab_magazine_t;
+
 struct slabs {
    slabclass_t slabclass[MAX_NUMBER_OF_SLAB_CLASSES];
    size_t mem_limit;
    size_t mem_malloced;
    unsigned int power_largest;
 
+   /*
+    * The chunk sizes slabs_init gives the classes (see slabs_plan), by
+    * class id up to nplan. learned is set if they were learned from the
+    * sizes of the items before the restart.
+    */
+   unsigned int plan[MAX_NUMBER_OF_SLAB_CLASSES];
+   unsigned int nplan;
+   bool learned;
+
    void *mem_base;
    void *mem_current;
    size_t mem_avail;
@@ -43,27 +73,114 @@ struct slabs {
    } allocs;
 
    /**
-    * Access to the slab allocator is protected by this lock
+    * Each slab class is protected by its own lock. This lock protects
+    * the global memory accounting (mem_malloced, mem_current, mem_avail
+    * and allocs), and is acquired after the slab class lock.
     */
    cb_mutex_t lock;
+
+   /*
+    * Magazines (see config.slab_magazine_size), one per item lock stripe
+    * and slab class: magazines[stripe * (power_largest + 1) + id]
+    */
+   slab_magazine_t *magazines;
+   void **magazine_slots;
+   uint32_t nmagazines;
+
+   /* The preallocated arena (see config.hugepages and config.numa_policy) */
+   struct {
+      /* mem_base is mapped with mmap (and not in allocs) */
+      bool mapped;
+      size_t size;
+      const char *page_type;
+      const char *numa_policy;
+      /* What arena_prefault() touched at startup, and how long it took */
+      size_t prefaulted;
+      uint64_t prefault_usec;
+   } arena;
+
+   /*
+    * The pages emptied by the compactor, given to the next class which
+    * needs a page. Their memory is already in mem_malloced. Protected by
+    * lock.
+    */
+   struct {
+      void **pages;
+      unsigned int count;
+      unsigned int size;
+   } spare;
+
+   /* Slab page reassignment (see config.slab_reassign) */
+   struct {
+      /* Protects everything in this struct. Never held while moving a page */
+      cb_mutex_t lock;
+      cb_cond_t cond;
+      bool running;
+      cb_thread_t tid;
+      /* The pending move request, dst is 0 if there is none */
+      unsigned int src;
+      unsigned int dst;
+      /* Set while the thread is moving a page */
+      bool busy;
+      /* A page is wanted for the shared pool (see slab_pool.h) */
+      bool give;
+      uint64_t pages_moved;
+      uint64_t evictions;
+      uint64_t busy_items;
+      /* Automove state: evictions seen at the end of the previous window */
+      unsigned int evicted_prev[MAX_NUMBER_OF_SLAB_CLASSES];
+      /* Number of consecutive windows without evictions */
+      unsigned int zero_windows[MAX_NUMBER_OF_SLAB_CLASSES];
+      /* The class with most evictions, and how many windows in a row */
+      unsigned int winner;
+      unsigned int wins;
+      rel_time_t next_window;
+      /* Compaction (see config.slab_compact) */
+      uint64_t pages_compacted;
+      uint64_t items_relocated;
+      rel_time_t next_compact;
+   } rebalance;
+};
+
+enum reassign_result_type {
+    REASSIGN_OK,
+    REASSIGN_RUNNING,
+    REASSIGN_BADCLASS,
+    REASSIGN_NOSPARE,
+    REASSIGN_SRC_DST_SAME,
+    REASSIGN_DISABLED
 };
 
 
 
 
+/**
+ * Plan the chunk sizes of the slab classes: the ones of config.slab_sizes
+ * if set, else a geometric series growing by config.factor (each class
+ * chunk_size times the previous one). The last class always holds
+ * item_size_max. Called before restart_init, which may replace the plan
+ * with the one learned before the restart (see config.slab_learn).
+ * @return ENGINE_EINVAL (logged) if slab_sizes is invalid
+ */
+ENGINE_ERROR_CODE slabs_plan(struct default_engine *engine);
+
 /** Init the subsystem. 1st argument is the limit on no. of bytes to allocate,
-    0 if no limit. 2nd argument is the growth factor; each slab will use a chunk
-    size equal to the previous slab's chunk size times this factor.
-    3rd argument specifies if the slab allocator should allocate all memory
+    0 if no limit. The slab classes get the sizes of slabs.plan.
+    2nd argument specifies if the slab allocator should allocate all memory
     up front (if true), or allocate memory in chunks as it is needed (if false)
 */
 ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
                              const size_t limit,
-                             const double factor,
                              const bool prealloc);
 
 void slabs_destroy(struct default_engine *engine);
 
+/**
+ * The index'th online NUMA node (wrapping around), for a numa_policy
+ * bind:<node>. -1 if the platform has no NUMA policies.
+ */
+int slabs_numa_node(unsigned int index);
+
 /**
  * Given object size, return id to use when allocating/freeing memory for object
  * 0 means error: can't store such a large object
@@ -77,12 +194,114 @@ void *slabs_alloc(struct default_engine *engine, size_t size, unsigned int id);
 /** Free previously allocated object */
 void slabs_free(struct default_engine *engine, void *ptr, size_t size, unsigned int id);
 
+/**
+ * Allocate object of given length from the magazine of the given item
+ * lock stripe, refilling it from the slab class in a batch when it is
+ * empty. The caller must hold the item lock for the stripe.
+ * @return the chunk or NULL on error
+ */
+void *slabs_alloc_cached(struct default_engine *engine, size_t size,
+                         unsigned int id, uint32_t stripe);
+
+/**
+ * Free previously allocated object into the magazine of the given item
+ * lock stripe, draining half of it to the slab class when it is full.
+ * The caller must hold the item lock for the stripe.
+ */
+void slabs_free_cached(struct default_engine *engine, void *ptr, size_t size,
+                       unsigned int id, uint32_t stripe);
+
+/**
+ * The number of chunks the slab class can hand out without an eviction:
+ * the free ones (not counting the magazines), or UINT_MAX if the class
+ * can still get a new page
+ */
+unsigned int slabs_available(struct default_engine *engine, unsigned int id);
+
 /** Adjust the stats for memory requested */
 void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id, size_t old, size_t ntotal);
 
 /** Fill buffer with stats */ /*@null@*/
 void slabs_stats(struct default_engine *engine, ADD_STAT add_stats, const void *c);
 
+/**
+ * Learn the chunk sizes fitting the items of the "stats sizes" histogram
+ * best: as many classes as there are now up to the largest item seen,
+ * placed to waste the fewest bytes past the end of the items in their
+ * chunks (the slack), followed by the larger classes of the current plan.
+ * @param sizes the chunk sizes learned, by class id
+ * @param slack the slack of the items with the current classes
+ * @param learned_slack and with the learned ones
+ * @return the number of classes learned, 0 if there are no items to
+ *         learn from
+ */
+unsigned int slabs_learn(struct default_engine *engine,
+                         unsigned int sizes[MAX_NUMBER_OF_SLAB_CLASSES],
+                         uint64_t *slack, uint64_t *learned_slack);
+
+/** The "stats slab_sizes": the slack of the classes and what was learned */
+void slabs_stats_sizes(struct default_engine *engine, ADD_STAT add_stats,
+                       const void *c);
+
+/**
+ * Start the thread moving slab pages between slab classes. The thread
+ * serves slabs_reassign() requests, and picks pages to move by itself
+ * if config.slab_automove is set.
+ * @param engine handle to the storage engine
+ * @return true if the thread is running
+ */
+bool slabs_start_rebalancer(struct default_engine *engine);
+
+/**
+ * Stop the slab rebalancer thread (if running) and wait for it to
+ * terminate.
+ * @param engine handle to the storage engine
+ */
+void slabs_stop_rebalancer(struct default_engine *engine);
+
+/**
+ * Ask the rebalancer thread to give a page (of any slab class) back to
+ * the shared pool, evicting the items stored in it.
+ * @param engine handle to the storage engine
+ */
+void slabs_give_page(struct default_engine *engine);
+
+/**
+ * Request that a slab page is moved from one slab class to another.
+ * The page is moved asynchronously by the rebalancer thread; all items
+ * stored in it are evicted.
+ * @param engine handle to the storage engine
+ * @param src the slab class to take the page from (0 picks any class
+ *            with more than one page)
+ * @param dst the slab class to give the page to
+ * @return REASSIGN_OK if the request was queued
+ */
+enum reassign_result_type slabs_reassign(struct default_engine *engine,
+                                         unsigned int src,
+                                         unsigned int dst);
+
+/**
+ * Give a page found in the restart file back to its slab class (see
+ * restart.c). Its chunks are put on the freelist by the caller, which
+ * frees them; ncarved is how many of them were ever handed out.
+ * @return false if out of memory
+ */
+bool slabs_restart_page(struct default_engine *engine, unsigned int id,
+                        void *page, unsigned int ncarved);
+
+/**
+ * Give a page found in the restart file without a slab class back to
+ * the spare pool (it was emptied by the compactor).
+ * @return false if out of memory
+ */
+bool slabs_restart_spare(struct default_engine *engine, void *page);
+
+/**
+ * Account for the first used bytes of the arena, which hold the pages
+ * given back with slabs_restart_page().
+ */
+void slabs_restart_arena(struct default_engine *engine, size_t used);
+
 void add_statistics(const void *cookie, ADD_STAT add_stats,
                     const char *prefix, int num, const char *key,
                     const char *fmt, ...);
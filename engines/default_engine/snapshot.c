@@ -0,0 +1,277 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+/*
+ * The number of slices of the hash table. It must not be larger than the
+ * smallest table (the old one during an expansion of the initial one) for
+ * a slice to be the same keys all the way through a dump.
+ */
+#define SNAPSHOT_SLICES 4096
+
+/* A dump stops after the slice which takes the response over this size */
+#define SNAPSHOT_BATCH_SIZE (1024 * 1024)
+
+/* The keys a scan lists if the client doesn't say */
+#define SNAPSHOT_SCAN_KEYS 1000
+
+uint32_t snapshot_slices(struct default_engine *engine) {
+    uint32_t nstripes = engine->items.item_lock_mask + 1;
+    return nstripes > SNAPSHOT_SLICES ? nstripes : SNAPSHOT_SLICES;
+}
+
+/* Make room for size more bytes in the dump */
+static bool snapshot_reserve(char **data, size_t *ndata, size_t *size,
+                             size_t more) {
+    if (*ndata + more > *size) {
+        size_t nsize = *size ? *size : 4096;
+        char *ptr;
+        while (nsize < *ndata + more) {
+            nsize *= 2;
+        }
+        if ((ptr = realloc(*data, nsize)) == NULL) {
+            return false;
+        }
+        *data = ptr;
+        *size = nsize;
+    }
+    return true;
+}
+
+/* Append the item to the dump, skipping it if its value is lost */
+static bool snapshot_add(struct default_engine *engine, hash_item *it,
+                         char **data, size_t *ndata, size_t *size) {
+    protocol_binary_snapshot_item header;
+    const char *value = item_get_data(it);
+    char *copy = NULL;
+    bool ret = true;
+
+    if ((it->iflag & (ITEM_CHAINED|ITEM_EXTERNAL)) != 0 &&
+        (value = copy = item_get_value_copy(engine, it)) == NULL) {
+        return (it->iflag & ITEM_EXTERNAL) != 0;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.cas = htonll(item_get_cas(it));
+    header.flags = it->flags;
+    header.exptime = it->exptime == 0 ? 0 :
+        htonl((uint32_t)engine->server.core->abstime(it->exptime));
+    header.nbytes = htonl(it->nbytes);
+    header.nkey = htons(it->nkey);
+    header.datatype = it->datatype;
+
+    if (snapshot_reserve(data, ndata, size,
+                         sizeof(header) + it->nkey + it->nbytes)) {
+        memcpy(*data + *ndata, &header, sizeof(header));
+        *ndata += sizeof(header);
+        memcpy(*data + *ndata, item_get_key(it), it->nkey);
+        *ndata += it->nkey;
+        memcpy(*data + *ndata, value, it->nbytes);
+        *ndata += it->nbytes;
+    } else {
+        ret = false;
+    }
+    free(copy);
+    return ret;
+}
+
+ENGINE_ERROR_CODE snapshot_dump(struct default_engine *engine,
+                                uint32_t first, uint32_t last,
+                                char **data, size_t *ndata, uint32_t *next) {
+    uint32_t nslices = snapshot_slices(engine);
+    size_t size = 0;
+    uint32_t slice;
+
+    *data = NULL;
+    *ndata = 0;
+    if (last > nslices) {
+        last = nslices;
+    }
+
+    for (slice = first; slice < last && *ndata < SNAPSHOT_BATCH_SIZE;
+         ++slice) {
+        ENGINE_ERROR_CODE ret;
+        hash_item **items;
+        size_t nitems, ii;
+        bool ok = true;
+
+        ret = item_snapshot_collect(engine, slice, nslices, &items, &nitems);
+        if (ret != ENGINE_SUCCESS) {
+            free(*data);
+            return ret;
+        }
+        /* The values are copied without any lock, we hold a reference */
+        for (ii = 0; ii < nitems; ++ii) {
+            if (ok) {
+                ok = snapshot_add(engine, items[ii], data, ndata, &size);
+            }
+            item_release(engine, items[ii]);
+        }
+        free(items);
+        if (!ok) {
+            free(*data);
+            return ENGINE_ENOMEM;
+        }
+    }
+
+    *next = slice;
+    return ENGINE_SUCCESS;
+}
+
+struct snapshot_scan_slice {
+    const char *prefix;
+    uint16_t nprefix;
+    char **data;
+    size_t *ndata;
+    size_t *size;
+    uint32_t nkeys;
+    bool enomem;
+};
+
+/* Called with the item lock held, so only the header and key are copied */
+static void snapshot_scan_add(struct default_engine *engine, hash_item *it,
+                              void *arg) {
+    struct snapshot_scan_slice *scan = arg;
+    protocol_binary_snapshot_item header;
+
+    if (scan->enomem || it->nkey < scan->nprefix ||
+        memcmp(item_get_key(it), scan->prefix, scan->nprefix) != 0) {
+        return;
+    }
+    if (!snapshot_reserve(scan->data, scan->ndata, scan->size,
+                          sizeof(header) + it->nkey)) {
+        scan->enomem = true;
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.cas = htonll(item_get_cas(it));
+    header.flags = it->flags;
+    header.exptime = it->exptime == 0 ? 0 :
+        htonl((uint32_t)engine->server.core->abstime(it->exptime));
+    header.nbytes = htonl(it->nbytes);
+    header.nkey = htons(it->nkey);
+    header.datatype = it->datatype;
+    memcpy(*scan->data + *scan->ndata, &header, sizeof(header));
+    *scan->ndata += sizeof(header);
+    memcpy(*scan->data + *scan->ndata, item_get_key(it), it->nkey);
+    *scan->ndata += it->nkey;
+    ++scan->nkeys;
+}
+
+ENGINE_ERROR_CODE snapshot_scan(struct default_engine *engine,
+                                uint32_t first, uint32_t maxkeys,
+                                const void *prefix, uint16_t nprefix,
+                                char **data, size_t *ndata, uint32_t *next) {
+    uint32_t nslices = snapshot_slices(engine);
+    struct snapshot_scan_slice scan;
+    size_t size = 0;
+    uint32_t slice;
+
+    *data = NULL;
+    *ndata = 0;
+    memset(&scan, 0, sizeof(scan));
+    scan.prefix = prefix;
+    scan.nprefix = nprefix;
+    scan.data = data;
+    scan.ndata = ndata;
+    scan.size = &size;
+    if (maxkeys == 0) {
+        maxkeys = SNAPSHOT_SCAN_KEYS;
+    }
+
+    for (slice = first; slice < nslices && scan.nkeys < maxkeys &&
+             *ndata < SNAPSHOT_BATCH_SIZE; ++slice) {
+        item_walk_slice(engine, slice, nslices, snapshot_scan_add, &scan);
+        if (scan.enomem) {
+            free(*data);
+            *data = NULL;
+            return ENGINE_ENOMEM;
+        }
+    }
+
+    *next = slice;
+    return ENGINE_SUCCESS;
+}
+
+/* Copy the value into the (possibly chained) item */
+static bool snapshot_fill(struct default_engine *engine, hash_item *it,
+                          const char *value, size_t nbytes) {
+    struct iovec iov[16];
+    struct iovec *segments = iov;
+    int nsegments = 16, ii;
+
+    if (nbytes / (engine->config.item_size_max / 2) + 2 > 16) {
+        nsegments = (int)(nbytes / (engine->config.item_size_max / 2) + 2);
+        if ((segments = malloc(nsegments * sizeof(*segments))) == NULL) {
+            return false;
+        }
+    }
+    nsegments = item_get_segments(engine, it, segments, nsegments);
+    for (ii = 0; ii < nsegments; ++ii) {
+        memcpy(segments[ii].iov_base, value, segments[ii].iov_len);
+        value += segments[ii].iov_len;
+    }
+    if (segments != iov) {
+        free(segments);
+    }
+    return nsegments > 0;
+}
+
+ENGINE_ERROR_CODE snapshot_load(struct default_engine *engine,
+                                const void *cookie,
+                                const char *data, size_t ndata,
+                                uint32_t *stored, uint32_t *skipped) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    time_t now = engine->server.core->abstime(current_time);
+    size_t offset = 0;
+
+    *stored = *skipped = 0;
+    while (offset < ndata) {
+        protocol_binary_snapshot_item header;
+        const char *key;
+        const char *value;
+        uint32_t nbytes, exptime;
+        uint16_t nkey;
+        hash_item *it;
+        uint64_t cas = 0;
+
+        if (ndata - offset < sizeof(header)) {
+            return ENGINE_EINVAL;
+        }
+        memcpy(&header, data + offset, sizeof(header));
+        nkey = ntohs(header.nkey);
+        nbytes = ntohl(header.nbytes);
+        exptime = ntohl(header.exptime);
+        if (nkey == 0 ||
+            ndata - offset - sizeof(header) < (size_t)nkey + nbytes) {
+            return ENGINE_EINVAL;
+        }
+        key = data + offset + sizeof(header);
+        value = key + nkey;
+        offset += sizeof(header) + nkey + nbytes;
+
+        if ((exptime != 0 && (time_t)exptime <= now) ||
+            !item_size_ok(engine, nkey, nbytes) ||
+            (it = item_alloc(engine, key, nkey, (int)header.flags,
+                             exptime == 0 ? 0 :
+                             engine->server.core->realtime(exptime),
+                             (int)nbytes, cookie, header.datatype)) == NULL) {
+            ++*skipped;
+            continue;
+        }
+        if (snapshot_fill(engine, it, value, nbytes) &&
+            store_item(engine, it, &cas, OPERATION_ADD,
+                       cookie) == ENGINE_SUCCESS) {
+            ++*stored;
+        } else {
+            ++*skipped;
+        }
+        item_release(engine, it);
+    }
+    return ENGINE_SUCCESS;
+}
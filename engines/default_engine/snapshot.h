@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* Snapshots: the live items dumped and loaded in bulk */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * A snapshot is a stream of items, each a protocol_binary_snapshot_item
+ * followed by the key and the value. It is dumped one slice of the hash
+ * table at a time, the slice being the items with that number as their
+ * hash modulo the number of slices, so the client can split the slices
+ * between connections and only one item lock stripe is held at a time.
+ * The number of slices is fixed, so a slice is the same set of keys
+ * throughout a dump even as the table grows.
+ */
+
+/* The number of slices (a multiple of the number of item lock stripes) */
+uint32_t snapshot_slices(struct default_engine *engine);
+
+/*
+ * Dump the live items in the slices from first (up to last, but no more
+ * than about one batch of bytes) into a buffer allocated in *data, which
+ * the caller frees. *next is the first slice not dumped.
+ */
+ENGINE_ERROR_CODE snapshot_dump(struct default_engine *engine,
+                                uint32_t first, uint32_t last,
+                                char **data, size_t *ndata, uint32_t *next);
+
+/*
+ * List the live keys (and what is in their item header) of the slices from
+ * first, up to about maxkeys of them (0 for the default) or one batch of
+ * bytes, which start with the prefix (if nprefix isn't 0). The entries are
+ * in a buffer allocated in *data, which the caller frees. *next is the
+ * first slice not listed.
+ */
+ENGINE_ERROR_CODE snapshot_scan(struct default_engine *engine,
+                                uint32_t first, uint32_t maxkeys,
+                                const void *prefix, uint16_t nprefix,
+                                char **data, size_t *ndata, uint32_t *next);
+
+/*
+ * Add the items of a snapshot, counting the ones stored and the ones
+ * skipped (already there, expired or too large). Returns ENGINE_EINVAL
+ * if the snapshot is corrupt, having stored the items before the error.
+ */
+ENGINE_ERROR_CODE snapshot_load(struct default_engine *engine,
+                                const void *cookie,
+                                const char *data, size_t ndata,
+                                uint32_t *stored, uint32_t *skipped);
+
+#endif
@@ -0,0 +1,321 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The vbucket index (config.vbucket_index): a list per vbucket threaded
+ * through the items (see vbuckets.h), and its counters. The lists are
+ * doubly linked, so an item is added and removed in O(1) under the lock
+ * of its vbucket, and deleting a vbucket costs a walk of its own items
+ * rather than of the cache.
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+/* How long the deleter sleeps without a vbucket dying (ms) */
+#define VBUCKET_DELETE_INTERVAL 1000
+
+static struct item_vbucket_link *item_vbucket(const hash_item *it) {
+    return (struct item_vbucket_link*)(it + 1);
+}
+
+static cb_mutex_t *vbucket_lock(struct vbucket_index *index,
+                                uint16_t vbucket) {
+    return &index->locks[vbucket % VBUCKET_LOCKS];
+}
+
+ENGINE_ERROR_CODE vbucket_index_init(struct default_engine *engine) {
+    struct vbucket_index *index = &engine->vbuckets;
+    int ii;
+
+    if (!engine->config.vbucket_index) {
+        return ENGINE_SUCCESS;
+    }
+    if (engine->config.compact_items) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "vbucket_index can't be used with compact_items\n");
+        return ENGINE_EINVAL;
+    }
+
+    index->lists = calloc(NUM_VBUCKETS, sizeof(struct vbucket_list));
+    if (index->lists == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    for (ii = 0; ii < VBUCKET_LOCKS; ++ii) {
+        cb_mutex_initialize(&index->locks[ii]);
+    }
+    cb_mutex_initialize(&index->lock);
+    cb_cond_initialize(&index->cond);
+    return ENGINE_SUCCESS;
+}
+
+void vbucket_index_destroy(struct default_engine *engine) {
+    struct vbucket_index *index = &engine->vbuckets;
+    int ii;
+
+    if (index->lists == NULL) {
+        return;
+    }
+    for (ii = 0; ii < VBUCKET_LOCKS; ++ii) {
+        cb_mutex_destroy(&index->locks[ii]);
+    }
+    cb_mutex_destroy(&index->lock);
+    cb_cond_destroy(&index->cond);
+    free(index->lists);
+    index->lists = NULL;
+}
+
+uint16_t item_get_vbucket(const hash_item *it) {
+    if ((it->iflag & ITEM_VBUCKET) == 0) {
+        return 0;
+    }
+    return item_vbucket(it)->vbucket;
+}
+
+void item_set_vbucket(hash_item *it, uint16_t vbucket) {
+    /* A linked item stays in the list it is in */
+    if ((it->iflag & (ITEM_VBUCKET|ITEM_LINKED)) == ITEM_VBUCKET) {
+        item_vbucket(it)->vbucket = vbucket;
+    }
+}
+
+void vbucket_link(struct default_engine *engine, hash_item *it,
+                  size_t nbytes) {
+    struct vbucket_index *index = &engine->vbuckets;
+    struct item_vbucket_link *link;
+    struct vbucket_list *list;
+
+    if (index->lists == NULL || (it->iflag & ITEM_VBUCKET) == 0) {
+        return;
+    }
+
+    link = item_vbucket(it);
+    list = &index->lists[link->vbucket];
+    cb_mutex_enter(vbucket_lock(index, link->vbucket));
+    link->prev = NULL;
+    link->next = list->head;
+    if (list->head != NULL) {
+        item_vbucket(list->head)->prev = it;
+    }
+    list->head = it;
+    list->items++;
+    list->bytes += nbytes;
+    cb_mutex_exit(vbucket_lock(index, link->vbucket));
+}
+
+void vbucket_unlink(struct default_engine *engine, hash_item *it,
+                    size_t nbytes) {
+    struct vbucket_index *index = &engine->vbuckets;
+    struct item_vbucket_link *link;
+    struct vbucket_list *list;
+
+    if (index->lists == NULL || (it->iflag & ITEM_VBUCKET) == 0) {
+        return;
+    }
+
+    link = item_vbucket(it);
+    list = &index->lists[link->vbucket];
+    cb_mutex_enter(vbucket_lock(index, link->vbucket));
+    if (link->prev != NULL) {
+        item_vbucket(link->prev)->next = link->next;
+    } else {
+        cb_assert(list->head == it);
+        list->head = link->next;
+    }
+    if (link->next != NULL) {
+        item_vbucket(link->next)->prev = link->prev;
+    }
+    link->next = link->prev = NULL;
+    list->items--;
+    list->bytes -= nbytes;
+    cb_mutex_exit(vbucket_lock(index, link->vbucket));
+}
+
+void vbucket_resize(struct default_engine *engine, const hash_item *it,
+                    size_t old_nbytes, size_t new_nbytes) {
+    struct vbucket_index *index = &engine->vbuckets;
+    uint16_t vbucket;
+
+    if (index->lists == NULL || (it->iflag & ITEM_VBUCKET) == 0) {
+        return;
+    }
+
+    vbucket = item_vbucket(it)->vbucket;
+    cb_mutex_enter(vbucket_lock(index, vbucket));
+    index->lists[vbucket].bytes += new_nbytes;
+    index->lists[vbucket].bytes -= old_nbytes;
+    cb_mutex_exit(vbucket_lock(index, vbucket));
+}
+
+void vbucket_index_set_state(struct default_engine *engine, uint16_t vbucket,
+                             bool dead) {
+    struct vbucket_index *index = &engine->vbuckets;
+
+    if (index->lists == NULL) {
+        return;
+    }
+
+    cb_mutex_enter(vbucket_lock(index, vbucket));
+    index->lists[vbucket].dead = dead;
+    cb_mutex_exit(vbucket_lock(index, vbucket));
+
+    if (dead) {
+        cb_mutex_enter(&index->lock);
+        index->pending = true;
+        cb_cond_signal(&index->cond);
+        cb_mutex_exit(&index->lock);
+    }
+}
+
+bool vbucket_index_counts(struct default_engine *engine, uint16_t vbucket,
+                          uint64_t *items, uint64_t *bytes) {
+    struct vbucket_index *index = &engine->vbuckets;
+
+    if (index->lists == NULL) {
+        return false;
+    }
+
+    cb_mutex_enter(vbucket_lock(index, vbucket));
+    *items = index->lists[vbucket].items;
+    *bytes = index->lists[vbucket].bytes;
+    cb_mutex_exit(vbucket_lock(index, vbucket));
+    return true;
+}
+
+/*
+ * Unlink the items of the vbucket for as long as it is dead. The item
+ * at the head is only trusted under its item lock (which comes before
+ * the vbucket lock), see item_unlink_vbucket_item().
+ */
+static uint64_t vbucket_delete_items(struct default_engine *engine,
+                                     uint16_t vbucket) {
+    struct vbucket_index *index = &engine->vbuckets;
+    struct vbucket_list *list = &index->lists[vbucket];
+    uint64_t deleted = 0;
+
+    while (index->running) {
+        hash_item *it;
+        uint32_t hv;
+
+        cb_mutex_enter(vbucket_lock(index, vbucket));
+        if (!list->dead || (it = list->head) == NULL) {
+            cb_mutex_exit(vbucket_lock(index, vbucket));
+            break;
+        }
+        /* It can't be unlinked (or its key change) while we hold the lock */
+        hv = engine->server.core->hash(item_get_key(it), it->nkey, 0);
+        cb_mutex_exit(vbucket_lock(index, vbucket));
+
+        if (item_unlink_vbucket_item(engine, it, hv, vbucket)) {
+            ++deleted;
+        }
+    }
+    return deleted;
+}
+
+static void vbucket_index_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct vbucket_index *index = &engine->vbuckets;
+
+    engine_thread_started(engine);
+    cb_mutex_enter(&index->lock);
+    while (index->running) {
+        uint64_t deleted = 0;
+        int vbucket;
+
+        if (!index->pending) {
+            cb_cond_timedwait(&index->cond, &index->lock,
+                              VBUCKET_DELETE_INTERVAL);
+            continue;
+        }
+        index->pending = false;
+        cb_mutex_exit(&index->lock);
+
+        for (vbucket = 0; vbucket < NUM_VBUCKETS; ++vbucket) {
+            /* A peek, vbucket_delete_items() looks again under the lock */
+            if (index->lists[vbucket].dead &&
+                index->lists[vbucket].head != NULL) {
+                deleted += vbucket_delete_items(engine, (uint16_t)vbucket);
+            }
+        }
+
+        cb_mutex_enter(&index->lock);
+        index->deleted += deleted;
+        index->passes++;
+    }
+    cb_mutex_exit(&index->lock);
+}
+
+bool vbucket_index_start(struct default_engine *engine) {
+    struct vbucket_index *index = &engine->vbuckets;
+    bool ret = true;
+
+    if (index->lists == NULL) {
+        return true;
+    }
+
+    cb_mutex_enter(&index->lock);
+    if (!index->running) {
+        index->running = true;
+        if (cb_create_thread(&index->tid, vbucket_index_main, engine, 0) != 0) {
+            index->running = false;
+            ret = false;
+        }
+    }
+    cb_mutex_exit(&index->lock);
+    return ret;
+}
+
+void vbucket_index_stop(struct default_engine *engine) {
+    struct vbucket_index *index = &engine->vbuckets;
+    bool running;
+
+    if (index->lists == NULL) {
+        return;
+    }
+
+    cb_mutex_enter(&index->lock);
+    running = index->running;
+    index->running = false;
+    cb_cond_signal(&index->cond);
+    cb_mutex_exit(&index->lock);
+
+    if (running) {
+        cb_join_thread(index->tid);
+    }
+}
+
+void vbucket_index_stats(struct default_engine *engine,
+                         ADD_STAT add_stat, const void *cookie) {
+    struct vbucket_index *index = &engine->vbuckets;
+    uint64_t dead = 0, dead_items = 0;
+    char val[32];
+    int len, ii;
+
+    if (index->lists == NULL) {
+        return;
+    }
+    for (ii = 0; ii < NUM_VBUCKETS; ++ii) {
+        struct vbucket_list *list = &index->lists[ii];
+        if (list->dead && list->items != 0) {
+            /* Racy, but only for the stats */
+            ++dead;
+            dead_items += list->items;
+        }
+    }
+
+    len = sprintf(val, "%"PRIu64, dead);
+    add_stat("vbuckets_deleting", 17, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, dead_items);
+    add_stat("vbucket_delete_pending", 22, val, len, cookie);
+    cb_mutex_enter(&index->lock);
+    len = sprintf(val, "%"PRIu64, index->deleted);
+    add_stat("vbucket_deleted_items", 21, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, index->passes);
+    add_stat("vbucket_delete_passes", 21, val, len, cookie);
+    cb_mutex_exit(&index->lock);
+}
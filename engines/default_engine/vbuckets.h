@@ -0,0 +1,85 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* An index of the linked items by their vbucket */
+#ifndef VBUCKETS_H
+#define VBUCKETS_H
+
+/*
+ * With config.vbucket_index set every item header is followed by the
+ * vbucket the item was stored in, and the links of the list of the items
+ * of that vbucket (ITEM_VBUCKET). The list and the counters of each
+ * vbucket are kept up to date as the items are linked and unlinked, so
+ * the items of a vbucket are found without walking the cache: once a
+ * vbucket is dead (set_vbucket or rm_vbucket) a background thread
+ * unlinks its items, and "stats vbucket-details" is read off the
+ * counters.
+ */
+struct item_vbucket_link {
+    hash_item *next;
+    hash_item *prev;
+    uint16_t vbucket;
+};
+
+struct vbucket_list {
+    hash_item *head;
+    uint64_t items;
+    uint64_t bytes;
+    bool dead;            /* its items are being deleted */
+};
+
+/* The vbuckets are spread over the locks by their low bits */
+#define VBUCKET_LOCKS 64
+
+struct vbucket_index {
+    /* One per vbucket (NULL if disabled), the locks are leaf locks */
+    struct vbucket_list *lists;
+    cb_mutex_t locks[VBUCKET_LOCKS];
+
+    /* The background thread deleting the items of the dead vbuckets */
+    cb_mutex_t lock;
+    cb_cond_t cond;
+    bool running;
+    bool pending;         /* a vbucket died since the last pass */
+    cb_thread_t tid;
+
+    /* Protected by lock */
+    uint64_t deleted;     /* items unlinked as their vbucket died */
+    uint64_t passes;
+};
+
+ENGINE_ERROR_CODE vbucket_index_init(struct default_engine *engine);
+bool vbucket_index_start(struct default_engine *engine);
+void vbucket_index_stop(struct default_engine *engine);
+void vbucket_index_destroy(struct default_engine *engine);
+
+/* The vbucket the item was stored in (0 without the index) */
+uint16_t item_get_vbucket(const hash_item *it);
+void item_set_vbucket(hash_item *it, uint16_t vbucket);
+
+/*
+ * Add the item (of nbytes, with its chunks) to (or remove it from) the
+ * list of its vbucket, with the item lock held.
+ */
+void vbucket_link(struct default_engine *engine, hash_item *it,
+                  size_t nbytes);
+void vbucket_unlink(struct default_engine *engine, hash_item *it,
+                    size_t nbytes);
+
+/* The linked item changed size in place */
+void vbucket_resize(struct default_engine *engine, const hash_item *it,
+                    size_t old_nbytes, size_t new_nbytes);
+
+/*
+ * The vbucket changed state: the items of a dead vbucket are deleted in
+ * the background, until it comes back to life.
+ */
+void vbucket_index_set_state(struct default_engine *engine, uint16_t vbucket,
+                             bool dead);
+
+/* The indexed items and bytes of the vbucket */
+bool vbucket_index_counts(struct default_engine *engine, uint16_t vbucket,
+                          uint64_t *items, uint64_t *bytes);
+
+void vbucket_index_stats(struct default_engine *engine,
+                         ADD_STAT add_stat, const void *cookie);
+
+#endif
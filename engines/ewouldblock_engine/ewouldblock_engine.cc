@@ -43,13 +43,32 @@
  * See the 'Modes' enum below for the possible modes. The mode can be selected
  * by sending a `request_ewouldblock_ctl` command
  *  (opcode PROTOCOL_BINARY_CMD_EWOULDBLOCK_CTL).
+ *
+ * Simulation:
+ * To stand in for a disk backed engine when benchmarking the server, the
+ * completions can be delayed by a latency drawn from a distribution, the
+ * RATES mode blocks a percentage of the calls of each function, and the
+ * completions are notified by a pool of threads. All of it is set up
+ * with the CONFIGURE "mode", whose key is a list of settings separated
+ * by ';':
+ *
+ *   latency=none|fixed:<us>|exponential:<mean us>|
+ *           bimodal:<fast us>:<slow us>:<slow percent>
+ *   threads=<the number of completion threads, 1 to 64>
+ *   allocate|remove|get|store|arithmetic|get_stats|unknown_command=<percent>
+ *
+ * for instance "latency=bimodal:100:5000:2;threads=4;get=20;store=100".
  */
 
 #include "config.h"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstring>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -57,16 +76,174 @@
 #include <random>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <memcached/engine.h>
 #include "utilities/engine_loader.h"
 
-// Shared state between the main thread of execution and the background
-// thread processing pending io ops.
-static std::mutex mutex;
-static std::condition_variable condvar;
-static std::queue<const void*> pending_io_ops;
-std::atomic_bool stop_notification_thread;
+/*
+ * The threads completing the pending io ops. Every thread has a shard of
+ * its own, a queue of the cookies to notify by when they are due, and the
+ * cookies are spread over the shards round robin so the threads don't
+ * contend on a single lock. The first shard runs as long as the pool, so
+ * a cookie pushed to a shard being stopped goes there instead.
+ */
+class CompletionPool {
+public:
+    static const size_t MAX_THREADS = 64;
+
+    typedef std::chrono::steady_clock Clock;
+
+    CompletionPool(SERVER_HANDLE_V1* server_)
+        : server(server_), active(0), next(0) {
+        for (auto& shard : shards) {
+            shard.reset(new Shard);
+        }
+    }
+
+    ~CompletionPool() {
+        // The pending cookies are dropped with the engine
+        resize(0, false);
+    }
+
+    // Run n threads, the cookies of the threads stopped are notified
+    // right away if complete is set.
+    void resize(size_t n, bool complete = true) {
+        std::lock_guard<std::mutex> guard(resize_mutex);
+        size_t old = active.load();
+        if (n < old) {
+            active = std::max<size_t>(n, 1);
+            for (size_t ii = old; ii > n; --ii) {
+                stop(*shards[ii - 1], complete);
+            }
+            active = n;
+        } else {
+            for (size_t ii = old; ii < n; ++ii) {
+                start(*shards[ii]);
+            }
+            active = n;
+        }
+    }
+
+    size_t size() const {
+        return active.load();
+    }
+
+    // Notify the cookie once the delay has passed
+    void push(const void* cookie, std::chrono::microseconds delay) {
+        const Pending pending{Clock::now() + delay, cookie};
+        size_t n = active.load();
+        Shard* shard = shards[n > 1 ? next++ % n : 0].get();
+        std::unique_lock<std::mutex> lk(shard->mutex);
+
+        if (!shard->running && shard != shards[0].get()) {
+            lk.unlock();
+            shard = shards[0].get();
+            lk = std::unique_lock<std::mutex>(shard->mutex);
+        }
+        if (!shard->running) {
+            // The pool is stopped with the engine
+            return;
+        }
+        shard->queue.push(pending);
+        lk.unlock();
+        shard->cond.notify_one();
+    }
+
+private:
+    struct Pending {
+        Clock::time_point due;
+        const void* cookie;
+
+        bool operator>(const Pending& other) const {
+            return due > other.due;
+        }
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::priority_queue<Pending, std::vector<Pending>,
+                            std::greater<Pending> > queue;
+        bool running = false;
+        bool complete = false;
+        std::thread thread;
+    };
+
+    void start(Shard& shard) {
+        shard.running = true;
+        shard.thread = std::thread(&CompletionPool::run, this, std::ref(shard));
+    }
+
+    void stop(Shard& shard, bool complete) {
+        {
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            shard.running = false;
+            shard.complete = complete;
+        }
+        shard.cond.notify_all();
+        shard.thread.join();
+    }
+
+    // Notify all of the cookies at once, so each worker thread is only
+    // woken up once for them.
+    void notify(const std::vector<const void*>& cookies) {
+        if (server->cookie->notify_io_complete_multi != nullptr) {
+            std::vector<ENGINE_ERROR_CODE> status(cookies.size(),
+                                                  ENGINE_SUCCESS);
+            server->cookie->notify_io_complete_multi(cookies.data(),
+                                                     status.data(),
+                                                     int(cookies.size()));
+        } else {
+            for (const void* cookie : cookies) {
+                server->cookie->notify_io_complete(cookie, ENGINE_SUCCESS);
+            }
+        }
+    }
+
+    void run(Shard& shard) {
+        std::unique_lock<std::mutex> lk(shard.mutex);
+        std::vector<const void*> due;
+        while (shard.running) {
+            if (shard.queue.empty()) {
+                shard.cond.wait(lk);
+                continue;
+            }
+            const Clock::time_point now = Clock::now();
+            if (shard.queue.top().due > now) {
+                shard.cond.wait_until(lk, shard.queue.top().due);
+                continue;
+            }
+            while (!shard.queue.empty() && shard.queue.top().due <= now) {
+                due.push_back(shard.queue.top().cookie);
+                shard.queue.pop();
+            }
+            // The server may hold the lock of the cookie while it calls
+            // into us (and we take the mutex to queue the cookie), so don't
+            // hold the mutex while notifying.
+            lk.unlock();
+            notify(due);
+            due.clear();
+            lk.lock();
+        }
+
+        while (!shard.queue.empty()) {
+            due.push_back(shard.queue.top().cookie);
+            shard.queue.pop();
+        }
+        if (shard.complete && !due.empty()) {
+            lk.unlock();
+            notify(due);
+            lk.lock();
+        }
+    }
+
+    SERVER_HANDLE_V1* server;
+    std::array<std::unique_ptr<Shard>, MAX_THREADS> shards;
+    std::atomic<size_t> active;
+    std::atomic<size_t> next;
+    std::mutex resize_mutex;
+};
 
 
 /* Public API declaration ****************************************************/
@@ -124,11 +301,19 @@ public:
                 // back to failing again.
                 // In other words, return EWOULDBLOCK iif the previous function
                 // was not this one.
+        RATES,  // Return EWOULDBLOCK for the percentage of the calls of each
+                // function set with CONFIGURE (none by default).
+        CONFIGURE, // Not a mode: the key of the request has the settings of
+                   // the simulation (see the top of the file), and the
+                   // current mode stays.
     };
 
+    // How long it takes for a call to complete once it returned EWOULDBLOCK
+    enum class Latency { NONE, FIXED, EXPONENTIAL, BIMODAL };
+
 private:
     enum class Cmd { NONE, GET_INFO, ALLOCATE, REMOVE, GET, STORE, ARITHMETIC,
-                     FLUSH, GET_STATS, UNKNOWN_COMMAND };
+                     FLUSH, GET_STATS, UNKNOWN_COMMAND, COUNT };
 
 public:
     EWB_Engine(GET_SERVER_API gsa_);
@@ -155,10 +340,8 @@ public:
                 break;
             case Mode::RANDOM:
             {
-                std::random_device rd;
-                std::mt19937 gen(rd());
                 std::uniform_int_distribution<uint32_t> dis(1, 100);
-                if (dis(gen) < value) {
+                if (dis(generator()) < value) {
                     block = true;
                 }
                 break;
@@ -170,17 +353,152 @@ public:
                 static Cmd prev_cmd = Cmd::NONE;
                 block = prev_cmd != cmd;
                 prev_cmd = cmd;
+                break;
             }
+            case Mode::RATES:
+            {
+                // Like with a disk engine, the call retried once the cookie
+                // was notified goes through. The mark is left out if the
+                // real engine has something stored for the cookie.
+                SERVER_COOKIE_API* api = gsa()->cookie;
+                void* specific = cookie ? api->get_engine_specific(cookie) : NULL;
+                if (specific == &retry_mark) {
+                    api->store_engine_specific(cookie, NULL);
+                    break;
+                }
+                uint32_t rate = rates[static_cast<size_t>(cmd)];
+                std::uniform_int_distribution<uint32_t> dis(1, 100);
+                block = cookie != NULL && specific == NULL && rate != 0 &&
+                        dis(generator()) <= rate;
+                if (block) {
+                    api->store_engine_specific(cookie, &retry_mark);
+                }
+                break;
+            }
+            case Mode::CONFIGURE:
+                break;
         }
 
         if (block) {
+            completions->push(cookie, sample_latency());
+        }
+        return block;
+    }
+
+    // What we store for a cookie blocked in RATES mode
+    static char retry_mark;
+
+    // Each thread calling into the engine has a generator of its own
+    static std::mt19937_64& generator() {
+        static thread_local std::mt19937_64 gen(std::random_device{}());
+        return gen;
+    }
+
+    // Draw the delay of a completion from the distribution set up
+    std::chrono::microseconds sample_latency() {
+        const uint32_t fast = latency_us;
+        switch (latency.load()) {
+            case Latency::NONE:
+                return std::chrono::microseconds(0);
+            case Latency::FIXED:
+                return std::chrono::microseconds(fast);
+            case Latency::EXPONENTIAL:
             {
-                std::lock_guard<std::mutex> guard(mutex);
-                pending_io_ops.push(cookie);
+                std::exponential_distribution<double> dis(1.0 / std::max(fast, 1u));
+                return std::chrono::microseconds(static_cast<uint64_t>(dis(generator())));
+            }
+            case Latency::BIMODAL:
+            {
+                std::uniform_int_distribution<uint32_t> dis(1, 100);
+                return std::chrono::microseconds(
+                        dis(generator()) <= slow_percent ? slow_latency_us.load()
+                                                         : fast);
             }
-            condvar.notify_one();
         }
-        return block;
+        return std::chrono::microseconds(0);
+    }
+
+    // Apply the settings of a CONFIGURE request, nothing is changed if one
+    // of them is invalid.
+    bool configure(const std::string& settings) {
+        static const std::map<std::string, Cmd> functions = {
+            {"allocate", Cmd::ALLOCATE}, {"remove", Cmd::REMOVE},
+            {"get", Cmd::GET}, {"store", Cmd::STORE},
+            {"arithmetic", Cmd::ARITHMETIC}, {"get_stats", Cmd::GET_STATS},
+            {"unknown_command", Cmd::UNKNOWN_COMMAND}
+        };
+        Latency new_latency = latency;
+        uint32_t new_fast = latency_us, new_slow = slow_latency_us;
+        uint32_t new_percent = slow_percent;
+        size_t new_threads = completions->size();
+        std::map<Cmd, uint32_t> new_rates;
+
+        size_t pos = 0;
+        while (pos < settings.size()) {
+            size_t end = settings.find(';', pos);
+            if (end == std::string::npos) {
+                end = settings.size();
+            }
+            const std::string setting = settings.substr(pos, end - pos);
+            pos = end + 1;
+            if (setting.empty()) {
+                continue;
+            }
+
+            const size_t eq = setting.find('=');
+            if (eq == std::string::npos) {
+                return false;
+            }
+            const std::string name = setting.substr(0, eq);
+            const std::string val = setting.substr(eq + 1);
+            unsigned int a = 0, b = 0, c = 0;
+            char extra;
+
+            if (name == "latency") {
+                if (val == "none") {
+                    new_latency = Latency::NONE;
+                } else if (sscanf(val.c_str(), "fixed:%u%c", &a, &extra) == 1) {
+                    new_latency = Latency::FIXED;
+                    new_fast = a;
+                } else if (sscanf(val.c_str(), "exponential:%u%c", &a, &extra) == 1) {
+                    new_latency = Latency::EXPONENTIAL;
+                    new_fast = a;
+                } else if (sscanf(val.c_str(), "bimodal:%u:%u:%u%c", &a, &b, &c,
+                                  &extra) == 3 && c <= 100) {
+                    new_latency = Latency::BIMODAL;
+                    new_fast = a;
+                    new_slow = b;
+                    new_percent = c;
+                } else {
+                    return false;
+                }
+            } else if (name == "threads") {
+                if (sscanf(val.c_str(), "%u%c", &a, &extra) != 1 || a == 0 ||
+                    a > CompletionPool::MAX_THREADS) {
+                    return false;
+                }
+                new_threads = a;
+            } else if (functions.count(name) != 0) {
+                if (sscanf(val.c_str(), "%u%c", &a, &extra) != 1 || a > 100) {
+                    return false;
+                }
+                new_rates[functions.at(name)] = a;
+            } else {
+                return false;
+            }
+        }
+
+        latency_us = new_fast;
+        slow_latency_us = new_slow;
+        slow_percent = new_percent;
+        latency = new_latency;
+        for (const auto& rate : new_rates) {
+            rates[static_cast<size_t>(rate.first)] = rate.second;
+        }
+        if (new_threads != completions->size()) {
+            completions->resize(new_threads);
+        }
+        return true;
     }
 
     /* Implementation of all the engine functions. ***************************/
@@ -310,6 +628,20 @@ public:
         }
     }
 
+    // The daemon can't resume a batch blocked half way, so it's passed
+    // through as it is.
+    static ENGINE_ERROR_CODE store_multi(ENGINE_HANDLE* handle,
+                                         const void *cookie,
+                                         item_store_request *requests,
+                                         size_t nrequests) {
+        EWB_Engine* ewb = to_engine(handle);
+        if (ewb->real_engine->store_multi == NULL) {
+            return ENGINE_ENOTSUP;
+        }
+        return ewb->real_engine->store_multi(ewb->real_handle, cookie,
+                                             requests, nrequests);
+    }
+
     static ENGINE_ERROR_CODE arithmetic(ENGINE_HANDLE* handle,
                                         const void* cookie, const void* key,
                                         const int nkey, const bool increment,
@@ -388,6 +720,24 @@ public:
                     ewb->mode = mode;
                     fprintf(stderr, "EWB_Engine(): First requests to each function will return EWOULDBLOCK.\n");
                     return ENGINE_SUCCESS;
+                case Mode::RATES:
+                    ewb->mode = mode;
+                    fprintf(stderr, "EWB_Engine(): The configured rate of requests to each function will return EWOULDBLOCK.\n");
+                    return ENGINE_SUCCESS;
+                case Mode::CONFIGURE:
+                {
+                    const char* key = reinterpret_cast<const char*>(request) +
+                            sizeof(request->bytes) + request->request.extlen;
+                    const std::string settings(key, ntohs(request->request.keylen));
+                    if (!ewb->configure(settings)) {
+                        fprintf(stderr, "EWB_Engine(): Invalid settings '%s'.\n",
+                                settings.c_str());
+                        return ENGINE_EINVAL;
+                    }
+                    fprintf(stderr, "EWB_Engine(): Simulating '%s'.\n",
+                            settings.c_str());
+                    return ENGINE_SUCCESS;
+                }
                 default:
                     abort();
             }
@@ -440,29 +790,35 @@ private:
     // Value associated with the current mode.
     uint32_t value;
 
-    // Handle of the notification thread.
-    std::thread notification_thread;
+    // The percentage of the calls of every function blocked in RATES mode
+    std::array<std::atomic<uint32_t>, static_cast<size_t>(Cmd::COUNT)> rates;
+
+    // The latency distribution of the completions: the (mean) latency, and
+    // the latency of the slow completions and their percentage if bimodal.
+    std::atomic<Latency> latency;
+    std::atomic<uint32_t> latency_us;
+    std::atomic<uint32_t> slow_latency_us;
+    std::atomic<uint32_t> slow_percent;
+
+    // The threads performing the IO notifications.
+    std::unique_ptr<CompletionPool> completions;
 };
 
-void process_pending_queue(SERVER_HANDLE_V1* server) {
-    std::unique_lock<std::mutex> lk(mutex);
-    while (!stop_notification_thread) {
-        condvar.wait(lk);
-        if (!pending_io_ops.empty()) {
-            const void* cookie = pending_io_ops.front();
-            server->cookie->notify_io_complete(cookie, ENGINE_SUCCESS);
-            pending_io_ops.pop();
-        }
-    }
-}
+char EWB_Engine::retry_mark;
 
 EWB_Engine::EWB_Engine(GET_SERVER_API gsa_)
   : gsa(gsa_),
     real_engine(NULL),
     mode(Mode::FIRST),
     value(0),
-    notification_thread(process_pending_queue, gsa())
+    latency(Latency::NONE),
+    latency_us(0),
+    slow_latency_us(0),
+    slow_percent(0)
 {
+    for (auto& rate : rates) {
+        rate = 0;
+    }
     interface.interface = 1;
     ENGINE_HANDLE_V1::get_info = get_info;
     ENGINE_HANDLE_V1::initialize = initialize;
@@ -471,7 +827,12 @@ EWB_Engine::EWB_Engine(GET_SERVER_API gsa_)
     ENGINE_HANDLE_V1::remove = remove;
     ENGINE_HANDLE_V1::release = release;
     ENGINE_HANDLE_V1::get = get;
+    ENGINE_HANDLE_V1::release_multi = NULL;
+    ENGINE_HANDLE_V1::get_multi = NULL;
+    ENGINE_HANDLE_V1::prefetch = NULL;
     ENGINE_HANDLE_V1::store = store;
+    ENGINE_HANDLE_V1::store_multi = store_multi;
+    ENGINE_HANDLE_V1::splice = NULL;
     ENGINE_HANDLE_V1::arithmetic = arithmetic;
     ENGINE_HANDLE_V1::flush = flush;
     ENGINE_HANDLE_V1::get_stats = get_stats;
@@ -482,8 +843,11 @@ EWB_Engine::EWB_Engine(GET_SERVER_API gsa_)
     ENGINE_HANDLE_V1::get_tap_iterator = NULL;
     ENGINE_HANDLE_V1::item_set_cas = item_set_cas;
     ENGINE_HANDLE_V1::get_item_info = get_item_info;
+    ENGINE_HANDLE_V1::get_item_view = NULL;
+    ENGINE_HANDLE_V1::get_item_segment = NULL;
     ENGINE_HANDLE_V1::set_item_info = set_item_info;
     ENGINE_HANDLE_V1::get_engine_vb_map = NULL;
+    ENGINE_HANDLE_V1::bind_engine = NULL;
     ENGINE_HANDLE_V1::get_stats_struct = NULL;
 
     std::memset(&info, 0, sizeof(info.buffer));
@@ -492,13 +856,12 @@ EWB_Engine::EWB_Engine(GET_SERVER_API gsa_)
     info.eng_info.features[info.eng_info.num_features++].feature = ENGINE_FEATURE_DATATYPE;
 
     // Spin up a background thread to perform IO notifications.
+    completions.reset(new CompletionPool(gsa()));
+    completions->resize(1);
 }
 
 EWB_Engine::~EWB_Engine() {
-    stop_notification_thread = true;
-    condvar.notify_all();
-    notification_thread.join();
-
+    completions.reset();
 }
 
 ENGINE_ERROR_CODE create_instance(uint64_t interface,
@@ -4,10 +4,13 @@
 #include "tap_mock_engine.h"
 
 #include <cassert>
+#include <cinttypes>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <map>
 #include <string>
+#include <vector>
 #include <platform/platform.h>
 
 using namespace std;
@@ -105,6 +108,36 @@ extern "C" {
     static bool set_item_info(ENGINE_HANDLE *handle, const void *cookie,
                               item* item, const item_info *itm_info);
 
+    static ENGINE_ERROR_CODE dcp_step(ENGINE_HANDLE* handle,
+                                      const void* cookie,
+                                      struct dcp_message_producers *producers);
+
+    static ENGINE_ERROR_CODE dcp_open(ENGINE_HANDLE* handle,
+                                      const void* cookie,
+                                      uint32_t opaque,
+                                      uint32_t seqno,
+                                      uint32_t flags,
+                                      void *name,
+                                      uint16_t nname);
+
+    static ENGINE_ERROR_CODE dcp_close_stream(ENGINE_HANDLE* handle,
+                                              const void* cookie,
+                                              uint32_t opaque,
+                                              uint16_t vbucket);
+
+    static ENGINE_ERROR_CODE dcp_stream_req(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            uint32_t flags,
+                                            uint32_t opaque,
+                                            uint16_t vbucket,
+                                            uint64_t start_seqno,
+                                            uint64_t end_seqno,
+                                            uint64_t vbucket_uuid,
+                                            uint64_t snap_start_seqno,
+                                            uint64_t snap_end_seqno,
+                                            uint64_t *rollback_seqno,
+                                            dcp_add_failover_log callback);
+
     static void handle_disconnect(const void *cookie,
                                   ENGINE_EVENT_TYPE type,
                                   const void *event_data,
@@ -130,6 +163,17 @@ public:
         data = new char[nbytes];
     }
 
+    // A mutation of the benchmark, laid out as a stored item is
+    Item(const string &k, const string &value) :
+        key(k), nbytes(value.length()), flags(0), exptime(0), cas(rand()),
+        datatype(PROTOCOL_BINARY_RAW_BYTES)
+    {
+        data = new char[nbytes + 2];
+        *(data) = FLEX_META_CODE;
+        *(data + FLEX_DATA_OFFSET) = datatype;
+        memcpy(data + FLEX_DATA_OFFSET + EXT_META_LEN, value.data(), nbytes);
+    }
+
     Item(const Item &o) : key(o.key), nbytes(o.nbytes), flags(o.flags),
                           exptime(o.exptime), cas(o.cas), datatype(o.datatype)
     {
@@ -368,6 +412,22 @@ private:
     map<string, Item*> datastore;
 };
 
+// A DCP stream of the benchmark
+struct BenchStream {
+    BenchStream(uint32_t o, uint16_t vb, uint64_t start, uint64_t end) :
+        opaque(o), vbucket(vb), seqno(start), snapEnd(start), endSeqno(end),
+        ended(false)
+    {
+    }
+
+    uint32_t opaque;
+    uint16_t vbucket;
+    uint64_t seqno;     // of the last mutation sent
+    uint64_t snapEnd;   // of the current snapshot
+    uint64_t endSeqno;
+    bool ended;
+};
+
 class TapConnection {
 public:
     TapConnection(const void* c,
@@ -376,11 +436,59 @@ public:
                   uint32_t flags,
                   const void* userdata,
                   size_t nuserdat) :
-        cookie(c), disconnect(false), blocked(false), reserved(false)
+        cookie(c), disconnect(false), blocked(false), reserved(false),
+        sent(0), start(gethrtime()), next(0)
     {
 
     }
 
+    /*
+     * Count a mutation of the benchmark against the rate (per second),
+     * false if it's ahead of it and has to wait
+     */
+    bool pace(uint64_t rate) {
+        if (rate != 0 &&
+            sent >= rate * (gethrtime() - start) / 1000000000ULL) {
+            return false;
+        }
+        ++sent;
+        return true;
+    }
+
+    // Take back the last pace(), its mutation didn't go out
+    void unpace(void) {
+        --sent;
+    }
+
+    uint64_t getSent(void) const {
+        return sent;
+    }
+
+    void addStream(const BenchStream &stream) {
+        streams.push_back(stream);
+    }
+
+    // The next DCP stream which didn't end (round robin), NULL if none
+    BenchStream *nextStream(void) {
+        for (size_t ii = 0; ii < streams.size(); ++ii) {
+            BenchStream *s = &streams[(next + ii) % streams.size()];
+            if (!s->ended) {
+                next = (next + ii + 1) % streams.size();
+                return s;
+            }
+        }
+        return NULL;
+    }
+
+    BenchStream *findStream(uint16_t vbucket) {
+        for (size_t ii = 0; ii < streams.size(); ++ii) {
+            if (streams[ii].vbucket == vbucket && !streams[ii].ended) {
+                return &streams[ii];
+            }
+        }
+        return NULL;
+    }
+
     void setBlocked(bool value) {
         blocked = value;
     }
@@ -421,6 +529,11 @@ private:
     bool disconnect;
     bool blocked;
     bool reserved;
+    // The mutations of the benchmark so far and since when
+    uint64_t sent;
+    hrtime_t start;
+    vector<BenchStream> streams;
+    size_t next;
 };
 
 class TapConnMap {
@@ -452,6 +565,21 @@ public:
         return ret;
     }
 
+    // As get(), but NULL for a cookie without a connection
+    TapConnection* find(const void *cookie) {
+        map<const void *, TapConnection*>::iterator iter;
+        TapConnection *ret = NULL;
+        mutex.lock();
+        iter = connmap.find(cookie);
+        if (iter != connmap.end()) {
+            ret = iter->second;
+            ret->reserve();
+        }
+        mutex.unlock();
+
+        return ret;
+    }
+
     void del(const void *cookie) {
         mutex.lock();
         del_locked(cookie);
@@ -566,9 +694,33 @@ private:
     map<const void *, TapConnection*> connmap;
 };
 
+/*
+ * The benchmark mode (bench=true in the config string) measures the
+ * replication paths of the core on their own: every TAP connection and
+ * DCP stream gets generated mutations of value_size bytes over keys
+ * distinct keys, at up to rate a second per connection (0 for as fast
+ * as the core takes them), and ends after items of them (0 for never,
+ * or the end seqno of the stream). The DCP streams mark a snapshot every
+ * batch mutations. See programs/mcreplbench for the consumer side.
+ */
+struct BenchConfig {
+    BenchConfig() : enabled(false), rate(0), items(0), value_size(256),
+                    keys(100000), batch(64)
+    {
+    }
+
+    bool enabled;
+    size_t rate;
+    size_t items;
+    size_t value_size;
+    size_t keys;
+    size_t batch;
+};
+
 class MockEngine {
 public:
-    MockEngine(SERVER_HANDLE_V1 *api) : sapi(api), running(false) {
+    MockEngine(SERVER_HANDLE_V1 *api) : sapi(api), running(false),
+                                        benchMutations(0), benchBytes(0) {
         memset(&info, 0, sizeof(info));
         info.description = "TAP mock engine v0.1";
     }
@@ -585,8 +737,44 @@ public:
         return &info;
     }
 
-    ENGINE_ERROR_CODE initialize(ENGINE_HANDLE* handle, const char* ) {
+    ENGINE_ERROR_CODE initialize(ENGINE_HANDLE* handle, const char* cfg) {
         void *cookie = reinterpret_cast<void*>(this);
+
+        if (cfg != NULL) {
+            struct config_item items[7];
+            memset(items, 0, sizeof(items));
+            items[0].key = "bench";
+            items[0].datatype = DT_BOOL;
+            items[0].value.dt_bool = &bench.enabled;
+            items[1].key = "rate";
+            items[1].datatype = DT_SIZE;
+            items[1].value.dt_size = &bench.rate;
+            items[2].key = "items";
+            items[2].datatype = DT_SIZE;
+            items[2].value.dt_size = &bench.items;
+            items[3].key = "value_size";
+            items[3].datatype = DT_SIZE;
+            items[3].value.dt_size = &bench.value_size;
+            items[4].key = "keys";
+            items[4].datatype = DT_SIZE;
+            items[4].value.dt_size = &bench.keys;
+            items[5].key = "batch";
+            items[5].datatype = DT_SIZE;
+            items[5].value.dt_size = &bench.batch;
+            items[6].key = NULL;
+
+            if (sapi->core->parse_config(cfg, items, stderr) != 0) {
+                return ENGINE_FAILED;
+            }
+            if (bench.keys == 0) {
+                bench.keys = 1;
+            }
+            if (bench.batch == 0) {
+                bench.batch = 1;
+            }
+            benchValue.assign(bench.value_size, 'x');
+        }
+
         sapi->callback->register_callback(handle, ON_DISCONNECT,
                                           ::handle_disconnect, cookie);
 
@@ -680,7 +868,7 @@ public:
         return ENGINE_SUCCESS;
     }
 
-    ENGINE_ERROR_CODE getStats(const void *, // cookie
+    ENGINE_ERROR_CODE getStats(const void *cookie,
                                const char *, // stat_key
                                int nkey,
                                ADD_STAT add_stat)
@@ -689,6 +877,16 @@ public:
             return ENGINE_KEY_ENOENT;
         }
 
+        if (bench.enabled) {
+            char val[32];
+            int vlen;
+            vlen = snprintf(val, sizeof(val), "%" PRIu64,
+                            __sync_fetch_and_add(&benchMutations, 0));
+            add_stat("bench_mutations", 15, val, vlen, cookie);
+            vlen = snprintf(val, sizeof(val), "%" PRIu64,
+                            __sync_fetch_and_add(&benchBytes, 0));
+            add_stat("bench_bytes", 11, val, vlen, cookie);
+        }
         return ENGINE_SUCCESS;
     }
 
@@ -784,6 +982,12 @@ public:
         *seqno = 0;
         *flags = 0;
 
+        if (bench.enabled) {
+            ret = benchTapWalker(connection, itm, seqno, vbucket);
+            tapconnmap.release(connection);
+            return ret;
+        }
+
         long r = rand() % 4;
         if (r < 1) {
             ret = TAP_NOOP;
@@ -796,6 +1000,133 @@ public:
         return ret;
     }
 
+    ENGINE_ERROR_CODE dcpOpen(const void *cookie, uint32_t flags)
+    {
+        if (!bench.enabled || (flags & DCP_OPEN_PRODUCER) == 0) {
+            return ENGINE_ENOTSUP;
+        }
+
+        TapConnection *conn = tapconnmap.find(cookie);
+        if (conn != NULL) {
+            tapconnmap.release(conn);
+            return ENGINE_KEY_EEXISTS;
+        }
+        conn = new TapConnection(cookie, NULL, 0, flags, NULL, 0);
+        sapi->cookie->reserve(cookie);
+        tapconnmap.add(conn);
+        return ENGINE_SUCCESS;
+    }
+
+    ENGINE_ERROR_CODE dcpStreamReq(const void *cookie,
+                                   uint32_t opaque,
+                                   uint16_t vbucket,
+                                   uint64_t start_seqno,
+                                   uint64_t end_seqno,
+                                   dcp_add_failover_log callback)
+    {
+        TapConnection *connection = tapconnmap.find(cookie);
+        if (connection == NULL) {
+            return ENGINE_DISCONNECT;
+        }
+
+        ENGINE_ERROR_CODE ret = ENGINE_KEY_EEXISTS;
+        if (connection->findStream(vbucket) == NULL) {
+            vbucket_failover_t entry;
+            entry.uuid = BENCH_VBUCKET_UUID;
+            entry.seqno = 0;
+            if (bench.items != 0 && bench.items < end_seqno) {
+                end_seqno = bench.items;
+            }
+            ret = callback(&entry, 1, cookie);
+            if (ret == ENGINE_SUCCESS) {
+                connection->addStream(BenchStream(opaque, vbucket,
+                                                  start_seqno, end_seqno));
+            }
+        }
+        tapconnmap.release(connection);
+        return ret;
+    }
+
+    ENGINE_ERROR_CODE dcpCloseStream(const void *cookie, uint16_t vbucket)
+    {
+        TapConnection *connection = tapconnmap.find(cookie);
+        if (connection == NULL) {
+            return ENGINE_DISCONNECT;
+        }
+
+        ENGINE_ERROR_CODE ret = ENGINE_KEY_ENOENT;
+        BenchStream *stream = connection->findStream(vbucket);
+        if (stream != NULL) {
+            stream->ended = true;
+            ret = ENGINE_SUCCESS;
+        }
+        tapconnmap.release(connection);
+        return ret;
+    }
+
+    /*
+     * Hand the core mutations until its buffers are full (ENGINE_E2BIG,
+     * the item goes again in the next step), the streams ended or the
+     * connection is ahead of the rate (and waits for the io thread).
+     */
+    ENGINE_ERROR_CODE dcpStep(const void *cookie,
+                              struct dcp_message_producers *producers)
+    {
+        TapConnection *connection = tapconnmap.find(cookie);
+        if (connection == NULL) {
+            return ENGINE_DISCONNECT;
+        }
+
+        ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+        BenchStream *stream;
+        while (ret == ENGINE_SUCCESS &&
+               (stream = connection->nextStream()) != NULL) {
+            if (stream->seqno >= stream->endSeqno) {
+                ret = producers->stream_end(cookie, stream->opaque,
+                                            stream->vbucket, 0 /* ok */);
+                if (ret == ENGINE_SUCCESS) {
+                    stream->ended = true;
+                }
+                continue;
+            }
+
+            if (!connection->pace(bench.rate)) {
+                connection->setBlocked(true);
+                break;
+            }
+            if (stream->seqno == stream->snapEnd) {
+                uint64_t end = stream->seqno + bench.batch;
+                if (end > stream->endSeqno || end < stream->seqno) {
+                    end = stream->endSeqno;
+                }
+                ret = producers->marker(cookie, stream->opaque,
+                                        stream->vbucket, stream->seqno + 1,
+                                        end, 1 /* memory */);
+                if (ret != ENGINE_SUCCESS) {
+                    connection->unpace();
+                    break;
+                }
+                stream->snapEnd = end;
+            }
+
+            Item *it = newBenchItem(stream->seqno + 1);
+            ret = producers->mutation(cookie, stream->opaque,
+                                      reinterpret_cast<item*>(it),
+                                      stream->vbucket, stream->seqno + 1,
+                                      1, 0, NULL, 0, 0);
+            if (ret == ENGINE_E2BIG) {
+                delete it;
+                connection->unpace();
+            } else if (ret == ENGINE_SUCCESS) {
+                ++stream->seqno;
+                countBenchItem();
+            }
+        }
+
+        tapconnmap.release(connection);
+        return ret;
+    }
+
     void handleDisconnect(const void *cookie, const void *event_data)
     {
         tapconnmap.setDisconnect(cookie);
@@ -819,6 +1150,40 @@ public:
     }
 
 protected:
+    // The uuid in the failover log of every vbucket
+    static const uint64_t BENCH_VBUCKET_UUID = 0xbe4c;
+
+    Item *newBenchItem(uint64_t seqno) {
+        char key[32];
+        snprintf(key, sizeof(key), "bench-%" PRIu64,
+                 (uint64_t)(seqno % bench.keys));
+        return new Item(key, benchValue);
+    }
+
+    void countBenchItem(void) {
+        __sync_fetch_and_add(&benchMutations, 1);
+        __sync_fetch_and_add(&benchBytes, (uint64_t)benchValue.length());
+    }
+
+    tap_event_t benchTapWalker(TapConnection *connection, item **itm,
+                               uint32_t *seqno, uint16_t *vbucket)
+    {
+        if (bench.items != 0 && connection->getSent() >= bench.items) {
+            return TAP_DISCONNECT;
+        }
+        if (!connection->pace(bench.rate)) {
+            connection->setBlocked(true);
+            return TAP_PAUSE;
+        }
+
+        *itm = reinterpret_cast<item*>(
+            newBenchItem(connection->getSent()));
+        *seqno = (uint32_t)connection->getSent();
+        *vbucket = 0;
+        countBenchItem();
+        return TAP_MUTATION;
+    }
+
     ENGINE_ERROR_CODE dispatchNotification(const void *cookie) {
         NotificationData *nd = new NotificationData(cookie, sapi);
         if (cb_create_thread(NULL, dispatch_notification,
@@ -837,6 +1202,10 @@ private:
     TapConnMap tapconnmap;
     volatile bool running;
     cb_thread_t io_thread;
+    BenchConfig bench;
+    string benchValue;
+    uint64_t benchMutations;
+    uint64_t benchBytes;
 };
 
 
@@ -850,9 +1219,14 @@ struct EngineGlue {
         interface.remove = item_delete;
         interface.release = item_release;
         interface.get = get;
+        interface.release_multi = NULL;
+        interface.get_multi = NULL;
+        interface.prefetch = NULL;
         interface.get_stats = get_stats;
         interface.reset_stats = reset_stats;
         interface.store = store;
+        interface.store_multi = NULL;
+        interface.splice = NULL;
         interface.arithmetic = NULL;
         interface.flush = flush;
         interface.unknown_command = unknown_command;
@@ -860,7 +1234,15 @@ struct EngineGlue {
         interface.get_tap_iterator = get_tap_iterator;
         interface.item_set_cas = item_set_cas;
         interface.get_item_info = get_item_info;
+        interface.get_item_view = NULL;
+        interface.get_item_segment = NULL;
         interface.set_item_info = set_item_info;
+        interface.bind_engine = NULL;
+        memset(&interface.dcp, 0, sizeof(interface.dcp));
+        interface.dcp.step = dcp_step;
+        interface.dcp.open = dcp_open;
+        interface.dcp.close_stream = dcp_close_stream;
+        interface.dcp.stream_req = dcp_stream_req;
     }
 
     ENGINE_HANDLE_V1 interface;
@@ -1043,6 +1425,44 @@ static bool set_item_info(ENGINE_HANDLE *handle, const void *cookie,
     return getHandle(handle).setItemInfo(cookie, item, itm_info);
 }
 
+static ENGINE_ERROR_CODE dcp_step(ENGINE_HANDLE* handle, const void* cookie,
+                                  struct dcp_message_producers *producers)
+{
+    return getHandle(handle).dcpStep(cookie, producers);
+}
+
+static ENGINE_ERROR_CODE dcp_open(ENGINE_HANDLE* handle, const void* cookie,
+                                  uint32_t opaque, uint32_t seqno,
+                                  uint32_t flags, void *name, uint16_t nname)
+{
+    return getHandle(handle).dcpOpen(cookie, flags);
+}
+
+static ENGINE_ERROR_CODE dcp_close_stream(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          uint32_t opaque,
+                                          uint16_t vbucket)
+{
+    return getHandle(handle).dcpCloseStream(cookie, vbucket);
+}
+
+static ENGINE_ERROR_CODE dcp_stream_req(ENGINE_HANDLE* handle,
+                                        const void* cookie,
+                                        uint32_t flags,
+                                        uint32_t opaque,
+                                        uint16_t vbucket,
+                                        uint64_t start_seqno,
+                                        uint64_t end_seqno,
+                                        uint64_t vbucket_uuid,
+                                        uint64_t snap_start_seqno,
+                                        uint64_t snap_end_seqno,
+                                        uint64_t *rollback_seqno,
+                                        dcp_add_failover_log callback)
+{
+    return getHandle(handle).dcpStreamReq(cookie, opaque, vbucket,
+                                           start_seqno, end_seqno, callback);
+}
+
 static void handle_disconnect(const void *cookie,
                               ENGINE_EVENT_TYPE type,
                               const void *event_data,
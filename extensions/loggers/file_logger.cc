@@ -12,7 +12,9 @@
 #include <strings.h>
 #include <stdlib.h>
 #include <time.h>
+#include <atomic>
 #include <iostream>
+#include <new>
 
 #ifdef WIN32
 #include <io.h>
@@ -28,7 +30,6 @@
 
 #include <memcached/extension.h>
 #include <memcached/engine.h>
-#include <memcached/syslog.h>
 #include <memcached/isotime.h>
 
 #include "extensions/protocol_extension.h"
@@ -54,39 +55,83 @@ static EXTENSION_LOG_LEVEL output_level = EXTENSION_LOG_WARNING;
 static size_t cyclesz = 100 * 1024 * 1024;
 
 /*
- * We're using two buffers for logging. We'll be inserting data into one,
- * while we're working on writing the other one to disk. Given that the disk
- * is way slower than our CPU, we might end up in a situation that we'll be
- * blocking the frontend threads if you're logging too much.
+ * Every thread logging gets a ring of its own (see struct log_ring), so a
+ * log call only formats the message and copies it into memory no other
+ * frontend thread touches. The logger thread drains the rings, formats
+ * the timestamps and writes the entries (oldest first) through a single
+ * file buffer.
  */
+struct log_entry {
+    /* The size of the entry, message included, rounded up to a multiple
+     * of sizeof(log_entry). 0 marks that the ring wraps here */
+    uint32_t size;
+    uint32_t msglen;
+    uint32_t severity;
+    uint32_t usec;
+    int64_t sec;
+};
+
+/* The longest message we log (the rest is cut) */
+#define LOG_MAX_MESSAGE 2048
+
+struct log_ring {
+    char *data;
+    size_t size;
+    /* Where the logger thread reads the next entry */
+    std::atomic<size_t> head;
+    /* Where the thread owning the ring writes the next entry */
+    std::atomic<size_t> tail;
+    /* Where the logger thread stops draining the ring this time */
+    size_t end;
+    struct log_ring *next;
+};
+
+#ifdef WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* The rings of the threads which logged, newest first */
+static std::atomic<struct log_ring *> rings;
+
+/* Bumped every time the logger is initialized, so the threads don't use
+ * the rings of an earlier instance */
+static std::atomic<unsigned int> generation;
+static THREAD_LOCAL struct log_ring *thread_ring;
+static THREAD_LOCAL unsigned int thread_ring_generation;
+
+/* The logger thread formats the entries into this buffer */
 static struct logbuffer {
     /* Pointer to beginning of the datasegment of this buffer */
     char *data;
     /* The current offset of the buffer */
     size_t offset;
-} buffers[2];
+    /* The size of the buffer */
+    size_t size;
+} outbuf;
 
-/* The index in the buffers where we're currently inserting more data */
-static int currbuffer;
+/* Is the logger thread running? */
+static volatile int run = 1;
 
 /* Are we running in a unit test (don't print warnings to stderr) */
 static bool unit_test = false;
 
-/* The size of the buffers (this may be tuned by the buffersize configuration
- * parameter */
+/* The size of the ring of each thread (this may be tuned by the
+ * buffersize configuration parameter */
 static size_t buffersz = 2048 * 1024;
 
 /* The sleeptime between each forced flush of the buffer */
 static size_t sleeptime = 60;
 
-/* To avoid race condition we're protecting our shared resources with a
- * single mutex. */
+/* The mutex is only used to sleep on the condition variables, the rings
+ * themselves are lock free */
 static cb_mutex_t mutex;
 
-/* The thread performing the disk IO will be waiting for the input buffers
- * to be filled by sleeping on the following condition variable. The
- * frontend threads will notify the condition variable when the buffer is
- * > 75% full
+/* The thread performing the disk IO will be waiting for the rings to be
+ * filled by sleeping on the following condition variable. The frontend
+ * threads will notify the condition variable when their ring is > 75%
+ * full
  */
 static cb_cond_t cond;
 
@@ -103,16 +148,14 @@ static pid_t pid;
 /* To avoid the logs beeing flooded by the same log messages we try to
  * de-duplicate the messages and instead print out:
  *   "message repeated xxx times"
+ * Only used by the logger thread.
  */
 static struct {
-    /* The last message being added to the log */
+    /* The message of the last entry added to the log */
     char buffer[512];
+    size_t length;
     /* The number of times we've seen this message */
     int count;
-    /* The offset into the buffer for where the text start (after the
-     * timestamp)
-     */
-    int offset;
     /* The sec when the entry was added (used for flushing of the
      * dedupe log)
      */
@@ -148,74 +191,118 @@ struct io_ops {
 
 static const char *extension = "txt";
 
-static void do_add_log_entry(const char *msg, size_t size) {
-    /* wait until there is room in the current buffer */
-    while ((buffers[currbuffer].offset + size) >= buffersz) {
-        if (!unit_test) {
-            fprintf(stderr, "WARNING: waiting for log space to be available\n");
-        }
-        cb_cond_wait(&space_cond, &mutex);
-    }
+/* The size of the rings, a multiple of sizeof(struct log_entry) */
+static size_t ringsz;
 
-    /* We could have performed the memcpy outside the locked region,
-     * but then we would need to handle the situation where we're
-     * flipping the ownership of the buffer (otherwise we could be
-     * writing rubbish to the file) */
-    memcpy(buffers[currbuffer].data + buffers[currbuffer].offset,
-           msg, size);
-    buffers[currbuffer].offset += size;
-    if (buffers[currbuffer].offset > (buffersz * 0.75)) {
-        /* we're getting full.. time get the logger to start doing stuff! */
-        cb_cond_signal(&cond);
-    }
-}
+/* The largest entry we may add to a ring */
+#define LOG_MAX_ENTRY (sizeof(struct log_entry) * 2 + LOG_MAX_MESSAGE)
 
-static void flush_last_log(bool timebased) {
-    if (lastlog.count > 1) {
-        ISOTime::ISO8601String timestamp;
-        ISOTime::generatetimestamp(timestamp);
+/* How much of the ring is in use (called by the thread owning it) */
+static size_t log_ring_used(const struct log_ring *ring) {
+    return ring->tail.load(std::memory_order_relaxed) -
+        ring->head.load(std::memory_order_acquire);
+}
 
-        char buffer[512];
-        int offset = snprintf(buffer, sizeof(buffer),
-                              "%s Message repeated %u times\n",
-                              timestamp.data(), lastlog.count);
+/* The ring of the calling thread, NULL if we're out of memory */
+static struct log_ring *get_log_ring(void) {
+    unsigned int gen = generation.load(std::memory_order_acquire);
+    if (thread_ring != NULL && thread_ring_generation == gen) {
+        return thread_ring;
+    }
 
-        // Only try to flush if there is enough free space, otherwise
-        // we'll be causing a deadlock
-        if (timebased && ((buffers[currbuffer].offset + offset) >= buffersz)) {
-            return ;
-        }
+    struct log_ring *ring = new (std::nothrow) log_ring;
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->data = reinterpret_cast<char*>(malloc(ringsz));
+    if (ring->data == NULL) {
+        delete ring;
+        return NULL;
+    }
+    ring->size = ringsz;
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->end = 0;
+    ring->next = rings.load(std::memory_order_relaxed);
+    while (!rings.compare_exchange_weak(ring->next, ring,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+        /* ring->next was updated, retry */
+    }
+    thread_ring = ring;
+    thread_ring_generation = gen;
+    return ring;
+}
 
-        do_add_log_entry(buffer, offset);
-        lastlog.buffer[0] = '\0';
-        lastlog.count = 0;
-        lastlog.offset = 0;
-        lastlog.created = 0;
+/*
+ * Copy the message into the ring. The entries never wrap: if an entry
+ * doesn't fit at the end of the ring the rest of it is skipped (marked
+ * by an entry of size 0). Returns false if the ring is full.
+ */
+static bool log_ring_push(struct log_ring *ring, const struct timeval *tv,
+                          EXTENSION_LOG_LEVEL severity,
+                          const char *msg, size_t len) {
+    const size_t hdr = sizeof(struct log_entry);
+    size_t size = (hdr + len + hdr - 1) / hdr * hdr;
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    size_t offset = tail % ring->size;
+    size_t skip = 0;
+
+    if (ring->size - offset < size) {
+        skip = ring->size - offset;
+    }
+    if (ring->size - log_ring_used(ring) < skip + size) {
+        return false;
     }
+    if (skip != 0) {
+        reinterpret_cast<struct log_entry*>(ring->data + offset)->size = 0;
+        offset = 0;
+    }
+
+    struct log_entry *entry = reinterpret_cast<struct log_entry*>(ring->data + offset);
+    entry->size = (uint32_t)size;
+    entry->msglen = (uint32_t)len;
+    entry->severity = (uint32_t)severity;
+    entry->usec = (uint32_t)tv->tv_usec;
+    entry->sec = (int64_t)tv->tv_sec;
+    memcpy(entry + 1, msg, len);
+    ring->tail.store(tail + skip + size, std::memory_order_release);
+    return true;
 }
 
-static void add_log_entry(time_t now, const char *msg, int prefixlen, size_t size)
-{
-    cb_mutex_enter(&mutex);
+static void add_log_entry(const struct timeval *tv,
+                          EXTENSION_LOG_LEVEL severity,
+                          const char *msg, size_t len) {
+    struct log_ring *ring = get_log_ring();
+    if (ring == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the log\n");
+        return;
+    }
 
-    if (size < sizeof(lastlog.buffer)) {
-        if (memcmp(lastlog.buffer + lastlog.offset, msg + prefixlen, size-prefixlen) == 0) {
-            ++lastlog.count;
-        } else {
-            flush_last_log(false);
-            do_add_log_entry(msg, size);
-            memcpy(lastlog.buffer, msg, size);
-            lastlog.offset = prefixlen;
-            lastlog.created = now;
+    size_t before = log_ring_used(ring);
+    while (!log_ring_push(ring, tv, severity, msg, len)) {
+        if (!run) {
+            /* Nobody left to drain the ring */
+            return;
         }
-    } else {
-        flush_last_log(false);
-        do_add_log_entry(msg, size);
+        if (!unit_test) {
+            fprintf(stderr, "WARNING: waiting for log space to be available\n");
+        }
+        cb_mutex_enter(&mutex);
+        cb_cond_signal(&cond);
+        cb_cond_timedwait(&space_cond, &mutex, 100);
+        cb_mutex_exit(&mutex);
+        before = 0;
     }
 
-    cb_mutex_exit(&mutex);
+    size_t watermark = (size_t)(ring->size * 0.75);
+    if (before <= watermark && log_ring_used(ring) > watermark) {
+        /* we're getting full.. time get the logger to start doing stuff! */
+        cb_mutex_enter(&mutex);
+        cb_cond_signal(&cond);
+        cb_mutex_exit(&mutex);
+    }
 }
-
 static const char *severity2string(EXTENSION_LOG_LEVEL sev) {
     switch (sev) {
     case EXTENSION_LOG_WARNING:
@@ -231,162 +318,64 @@ static const char *severity2string(EXTENSION_LOG_LEVEL sev) {
     }
 }
 
-/* Takes the syslog compliant event and calls the native logging functionality */
-static void syslog_event_receiver(SyslogEvent *event) {
-    uint8_t syslog_severity = event->prival & 7; /* Mask out all but 3 least-significant bits */
-    EXTENSION_LOG_LEVEL severity = EXTENSION_LOG_WARNING;
-
-    switch (syslog_severity) {
-    case SYSLOG_WARNING:
-        severity = EXTENSION_LOG_WARNING;
-        break;
-    case SYSLOG_NOTICE:
-        severity = EXTENSION_LOG_INFO;
-        break;
-    case SYSLOG_INFORMATIONAL:
-        severity = EXTENSION_LOG_DEBUG;
-        break;
-    case SYSLOG_DEBUG:
-        severity = EXTENSION_LOG_DETAIL;
-        break;
-    default:
-        fprintf(stderr, "ERROR: Unknown syslog_severity\n");
-    }
-
-    struct tm tval;
-    tval.tm_sec = event->time_second;
-    tval.tm_min = event->time_minute + event->offset_minute;
-    tval.tm_hour = event->time_hour + event->offset_hour;
-    tval.tm_mday = event->date_mday;
-    tval.tm_mon = event->date_month - 1;
-    tval.tm_year = event->date_fullyear - 1900;
-    tval.tm_isdst = -1;
-    tval.tm_wday = -1;
-    tval.tm_yday = -1;
-
-    time_t nsec = mktime(&tval);
-
-    char buffer[2048];
-    ISOTime::ISO8601String timestamp;
-    ISOTime::generatetimestamp(timestamp, nsec, event->time_secfrac);
-    int offset = snprintf(buffer, sizeof(buffer), "%s %s ", timestamp.data(),
-                          severity2string(severity));
-    int prefixlen = offset;
-    int datalen = static_cast<int>(strlen(event->msg));
-
-    if (static_cast<size_t>((prefixlen + datalen)) >= sizeof(buffer)) {
-        std::cerr << buffer
-                  << "Message too big to fit in event. Full message: "
-                  << event->msg;
-        std::cerr.flush();
-
-        memcpy(buffer + offset, event->msg, sizeof(buffer) - prefixlen - 7);
-        memcpy(buffer + sizeof(buffer) - 7, " [cut]", 6);
-        buffer[sizeof(buffer) - 1] = '\0';
-    } else {
-        strcat(buffer + offset, event->msg);
-    }
-
-    if (severity >= current_log_level || severity >= output_level) {
-        if (severity >= output_level) {
-            std::cerr << buffer;
-            std::cerr.flush();
-        }
-
-        if (severity >= current_log_level) {
-            add_log_entry(nsec, buffer, prefixlen, strlen(buffer));
-        }
-    }
-}
-
-
-/* Takes the current logging format and produces syslogd compliant event */
 static void logger_log_wrapper(EXTENSION_LOG_LEVEL severity,
                                const void* client_cookie,
                                const char *fmt, ...) {
     (void)client_cookie;
-    SyslogEvent event;
-    size_t avail_char_in_msg = sizeof(event.msg) - 1; /*space excluding terminating char */
+    char msg[LOG_MAX_MESSAGE];
     struct timeval now;
     va_list ap;
     int len;
-    uint8_t facility = 16;  /* Facility - defaulting to local0 */
-    uint8_t syslog_severity;
 
-    /* RFC5424 uses version 1 of syslog protocol */
-    event.version = 1;
-    event.msgid = GENERIC_EVENT;
-    strcpy(event.app_name, "memcached");
-    strcpy(event.hostname, hostname);
-    event.procid = (uint64_t)pid;
+    if (severity < current_log_level && severity < output_level) {
+        return;
+    }
 
     va_start(ap, fmt);
-    len = vsnprintf(event.msg, avail_char_in_msg, fmt, ap);
+    len = vsnprintf(msg, sizeof(msg), fmt, ap);
     va_end(ap);
 
     /* If an encoding error occurs with vsnprintf a -ive number is returned */
-    if ((len <= static_cast<int>(avail_char_in_msg)) && (len >= 0)) {
-        /* add a new line to the message if not already there */
-        if (event.msg[len - 1] != '\n') {
-            event.msg[len++] = '\n';
-            event.msg[len] ='\0';
+    if (len < 0) {
+        fprintf(stderr, "Log message dropped... encoding error\n");
+        return;
+    }
+    if (len >= (int)sizeof(msg)) {
+        fprintf(stderr, "Log message too big, cut at %u bytes\n",
+                (unsigned int)sizeof(msg));
+        len = (int)sizeof(msg) - 1;
+        msg[len - 1] = '\n';
+    }
+    /* add a new line to the message if not already there */
+    if (len == 0 || msg[len - 1] != '\n') {
+        if (len == (int)sizeof(msg) - 1) {
+            msg[len - 1] = '\n';
+        } else {
+            msg[len++] = '\n';
         }
-    } else {
-        fprintf(stderr, "Syslog message dropped... too big \n");
     }
 
-    switch (severity) {
-    case EXTENSION_LOG_WARNING:
-        syslog_severity = SYSLOG_WARNING;
-        break;
-    case EXTENSION_LOG_INFO:
-        syslog_severity = SYSLOG_NOTICE;
-        break;
-    case EXTENSION_LOG_DEBUG:
-        syslog_severity = SYSLOG_INFORMATIONAL;
-        break;
-    case EXTENSION_LOG_DETAIL:
-        syslog_severity = SYSLOG_DEBUG;
-        break;
-    default:
-        fprintf(stderr, "Unknown severity\n");
-        syslog_severity = SYSLOG_UNKNOWN;
+    if (cb_get_timeofday(&now) != 0) {
+        fprintf(stderr, "gettimeofday failed in file_logger.c: %s\n", strerror(errno));
+        return;
     }
 
-    /*
-       To produce the priority_value multiply facility by 8
-       i.e. shift to left 3 places. Then add the syslog_severity
-     */
-    event.prival = (facility << 3) + syslog_severity;
-
-    /* Fill-in date structure */
-    if (cb_get_timeofday(&now) == 0) {
-        struct tm localval, utcval;
-        time_t nsec = (time_t)now.tv_sec;
-
-        cb_gmtime_r(&nsec, &utcval);
-        cb_localtime_r(&nsec, &localval);
-
-        event.date_fullyear = 1900 + utcval.tm_year;
-        event.date_month = 1 + utcval.tm_mon;
-        event.date_mday = utcval.tm_mday;
-        event.time_hour = utcval.tm_hour;
-        event.time_minute = utcval.tm_min;
-        event.time_second = utcval.tm_sec;
-        event.time_secfrac = now.tv_usec;
-        /* Calculate the offset from UTC to local-time */
-        event.offset_hour = localval.tm_hour - utcval.tm_hour;
-        event.offset_minute = localval.tm_min - utcval.tm_min;
+    if (severity >= output_level) {
+        ISOTime::ISO8601String timestamp;
+        ISOTime::generatetimestamp(timestamp, (time_t)now.tv_sec,
+                                   (uint32_t)now.tv_usec);
+        std::cerr << timestamp.data() << " " << severity2string(severity)
+                  << " ";
+        std::cerr.write(msg, len);
+        std::cerr.flush();
+    }
 
-    } else {
-        fprintf(stderr, "gettimeofday failed in file_logger.c: %s\n", strerror(errno));
-        return;
+    if (severity >= current_log_level) {
+        /* The timestamp is formatted by the logger thread */
+        add_log_entry(&now, severity, msg, len);
     }
-    /* Send the syslog event */
-    syslog_event_receiver(&event);
 }
 
-
 static FILE *open_logfile(const char *fnm) {
     static unsigned int next_id = 0;
     char fname[1024];
@@ -432,74 +421,190 @@ static size_t flush_pending_io(FILE *file, struct logbuffer *lb) {
     return ret;
 }
 
-static void flush_all_buffers_to_file(FILE *file) {
-    while (buffers[currbuffer].offset) {
-        int curr  = currbuffer;
-        currbuffer = (currbuffer == 0) ? 1 : 0;
-        flush_pending_io(file, buffers + curr);
+static cb_thread_t tid;
+static FILE *fp;
+static const char *logname;
+static size_t currsize;
+
+/* Write the file buffer, and move on to the next file if it's time */
+static void write_outbuf(void) {
+    if (fp == NULL) {
+        outbuf.offset = 0;
+        return;
+    }
+    currsize += flush_pending_io(fp, &outbuf);
+    if (currsize > cyclesz) {
+        fp = reopen_logfile(fp, logname);
+        currsize = 0;
     }
 }
 
-static volatile int run = 1;
-static cb_thread_t tid;
-static FILE *fp;
+/* Make room for size bytes in the file buffer */
+static char *outbuf_reserve(size_t size) {
+    if (outbuf.offset + size > outbuf.size) {
+        write_outbuf();
+    }
+    return outbuf.data + outbuf.offset;
+}
+
+static void flush_last_log(void) {
+    if (lastlog.count > 0) {
+        ISOTime::ISO8601String timestamp;
+        ISOTime::generatetimestamp(timestamp);
+
+        char buffer[512];
+        int offset = snprintf(buffer, sizeof(buffer),
+                              "%s Message repeated %u times\n",
+                              timestamp.data(), lastlog.count);
+        memcpy(outbuf_reserve(offset), buffer, offset);
+        outbuf.offset += offset;
+        lastlog.count = 0;
+        lastlog.length = 0;
+        lastlog.created = 0;
+    }
+}
+
+static void write_entry(const struct log_entry *entry) {
+    const char *msg = reinterpret_cast<const char*>(entry + 1);
+
+    if (lastlog.length != 0 && entry->msglen == lastlog.length &&
+        memcmp(lastlog.buffer, msg, entry->msglen) == 0) {
+        ++lastlog.count;
+        return;
+    }
+    flush_last_log();
+
+    ISOTime::ISO8601String timestamp;
+    char prefix[64];
+    ISOTime::generatetimestamp(timestamp, (time_t)entry->sec, entry->usec);
+    int prefixlen = snprintf(prefix, sizeof(prefix), "%s %s ", timestamp.data(),
+                             severity2string((EXTENSION_LOG_LEVEL)entry->severity));
+
+    char *ptr = outbuf_reserve(prefixlen + entry->msglen);
+    memcpy(ptr, prefix, prefixlen);
+    memcpy(ptr + prefixlen, msg, entry->msglen);
+    outbuf.offset += prefixlen + entry->msglen;
+
+    if (entry->msglen < sizeof(lastlog.buffer)) {
+        memcpy(lastlog.buffer, msg, entry->msglen);
+        lastlog.length = entry->msglen;
+        lastlog.created = (time_t)entry->sec;
+    } else {
+        lastlog.length = 0;
+    }
+}
+
+/* The oldest entry of the ring not written yet, NULL if none */
+static const struct log_entry *log_ring_peek(struct log_ring *ring) {
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    while (head != ring->end) {
+        size_t offset = head % ring->size;
+        const struct log_entry *entry =
+            reinterpret_cast<const struct log_entry*>(ring->data + offset);
+        if (entry->size != 0) {
+            return entry;
+        }
+        /* The rest of the ring was skipped */
+        head += ring->size - offset;
+        ring->head.store(head, std::memory_order_release);
+    }
+    return NULL;
+}
+
+/*
+ * Write the entries of all the rings to the file buffer, oldest first.
+ * Only the entries in the rings when we start are written, so a thread
+ * logging a lot can't keep us here forever.
+ */
+static void drain_rings(void) {
+    struct log_ring *list = rings.load(std::memory_order_acquire);
+    struct log_ring *ring;
+
+    for (ring = list; ring != NULL; ring = ring->next) {
+        ring->end = ring->tail.load(std::memory_order_acquire);
+    }
+
+    for (;;) {
+        const struct log_entry *oldest = NULL;
+        struct log_ring *from = NULL;
+        for (ring = list; ring != NULL; ring = ring->next) {
+            const struct log_entry *entry = log_ring_peek(ring);
+            if (entry != NULL &&
+                (oldest == NULL || entry->sec < oldest->sec ||
+                 (entry->sec == oldest->sec && entry->usec < oldest->usec))) {
+                oldest = entry;
+                from = ring;
+            }
+        }
+        if (oldest == NULL) {
+            return;
+        }
+        write_entry(oldest);
+        from->head.store(from->head.load(std::memory_order_relaxed) + oldest->size,
+                         std::memory_order_release);
+    }
+}
+
+/* Is any of the rings getting full? Called with the mutex held */
+static bool rings_filling(void) {
+    struct log_ring *ring;
+    for (ring = rings.load(std::memory_order_acquire); ring != NULL;
+         ring = ring->next) {
+        if (ring->tail.load(std::memory_order_acquire) -
+            ring->head.load(std::memory_order_relaxed) > ring->size * 0.75) {
+            return true;
+        }
+    }
+    return false;
+}
 
 static void logger_thead_main(void* arg)
 {
-    size_t currsize = 0;
-    fp = open_logfile(reinterpret_cast<const char*>(arg));
-
-    struct timeval tp;
-    cb_get_timeofday(&tp);
-    time_t next = (time_t)tp.tv_sec;
+    logname = reinterpret_cast<const char*>(arg);
+    currsize = 0;
+    fp = open_logfile(logname);
 
     cb_mutex_enter(&mutex);
     while (run) {
-        cb_get_timeofday(&tp);
+        struct timeval tp;
 
-        while ((time_t)tp.tv_sec >= next  ||
-               buffers[currbuffer].offset > (buffersz * 0.75)) {
-            int curr  = currbuffer;
-            next = (time_t)tp.tv_sec + 1;
-            currbuffer = (currbuffer == 0) ? 1 : 0;
-            /* Let people who is blocked for space continue */
-            cb_cond_broadcast(&space_cond);
-
-            /* Perform file IO without the lock */
-            cb_mutex_exit(&mutex);
-
-            currsize += flush_pending_io(fp, buffers + curr);
-            if (currsize > cyclesz) {
-                fp = reopen_logfile(fp, reinterpret_cast<const char*>(arg));
-                currsize = 0;
-            }
-            cb_mutex_enter(&mutex);
-        }
+        /* Perform file IO without the lock */
+        cb_mutex_exit(&mutex);
+        drain_rings();
 
         // Only run dedupe for ~5 seconds
+        cb_get_timeofday(&tp);
         if (lastlog.count > 0 && (lastlog.created + 4 < tp.tv_sec)) {
-            flush_last_log(true);
+            flush_last_log();
         }
+        write_outbuf();
+        cb_mutex_enter(&mutex);
 
-        cb_get_timeofday(&tp);
-        next = (time_t)tp.tv_sec + (time_t)sleeptime;
+        /* Let people who is blocked for space continue */
+        cb_cond_broadcast(&space_cond);
 
-        if (unit_test) {
-            cb_cond_timedwait(&cond, &mutex, 100);
-        } else {
-            cb_cond_timedwait(&cond, &mutex, (unsigned int)(1000 * sleeptime));
+        if (run && !rings_filling()) {
+            if (unit_test) {
+                cb_cond_timedwait(&cond, &mutex, 100);
+            } else {
+                cb_cond_timedwait(&cond, &mutex, (unsigned int)(1000 * sleeptime));
+            }
         }
     }
+    cb_mutex_exit(&mutex);
 
     if (fp) {
-        flush_all_buffers_to_file(fp);
+        drain_rings();
+        flush_last_log();
+        write_outbuf();
         close_logfile(fp);
+        fp = NULL;
     }
 
-    cb_mutex_exit(&mutex);
     free(arg);
-    free(buffers[0].data);
-    free(buffers[1].data);
+    /* Threads may still be logging, so the rings stay */
+    free(outbuf.data);
+    outbuf.data = NULL;
 }
 
 static void exit_handler(void) {
@@ -536,7 +641,9 @@ static void logger_shutdown(bool force) {
         // Don't bother attempting to take any mutexes - other threads may
         // never run again. Just flush the buffers asap.
         if (fp) {
-            flush_all_buffers_to_file(fp);
+            drain_rings();
+            flush_last_log();
+            write_outbuf();
             close_logfile(fp);
             fp = NULL;
         }
@@ -545,7 +652,6 @@ static void logger_shutdown(bool force) {
 
     int running;
     cb_mutex_enter(&mutex);
-    flush_last_log(false);
     running = run;
     run = 0;
     cb_cond_signal(&cond);
@@ -656,22 +762,28 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
         fname = strdup("memcached");
     }
 
-    buffers[0].data = reinterpret_cast<char*>(malloc(buffersz));
-    buffers[1].data = reinterpret_cast<char*>(malloc(buffersz));
-
-    if (buffers[0].data == NULL || buffers[1].data == NULL || fname == NULL) {
+    /* Every ring must be able to hold the largest entry, and the file
+     * buffer the largest line */
+    ringsz = buffersz < 2 * LOG_MAX_ENTRY ? 2 * LOG_MAX_ENTRY : buffersz;
+    ringsz = ringsz / sizeof(struct log_entry) * sizeof(struct log_entry);
+    outbuf.size = buffersz < LOG_MAX_ENTRY + 64 ? LOG_MAX_ENTRY + 64 : buffersz;
+    outbuf.offset = 0;
+    outbuf.data = reinterpret_cast<char*>(malloc(outbuf.size));
+    rings.store(NULL);
+    generation++;
+    run = 1;
+
+    if (outbuf.data == NULL || fname == NULL) {
         fprintf(stderr, "Failed to allocate memory for the logger\n");
         free(fname);
-        free(buffers[0].data);
-        free(buffers[1].data);
+        free(outbuf.data);
         return EXTENSION_FATAL;
     }
 
     if (cb_create_thread(&tid, logger_thead_main, fname, 0) < 0) {
         fprintf(stderr, "Failed to initialize the logger\n");
         free(fname);
-        free(buffers[0].data);
-        free(buffers[1].data);
+        free(outbuf.data);
         return EXTENSION_FATAL;
     }
     atexit(exit_handler);
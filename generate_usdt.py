@@ -0,0 +1,134 @@
+#!/usr/bin/python
+
+#     Copyright 2015 Couchbase, Inc
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#       http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+
+# Generates the USDT (SystemTap / bpftrace) probes from the DTrace probe
+# definitions in memcached_dtrace.d, for the Linux builds without DTrace:
+#
+#   generate_usdt.py memcached_dtrace.d memcached_usdt.h memcached_usdt.c
+#
+# The header defines the same MEMCACHED_<PROBE>() and _ENABLED() macros as
+# the header generated by dtrace -h, on top of <sys/sdt.h>. Every probe has
+# a semaphore, which the tracer bumps when it attaches to the probe, and
+# the arguments of a probe are only evaluated when its semaphore is set.
+# The C file defines the semaphores, and is linked into every module
+# firing the probes (each one gets its own copy).
+
+from __future__ import print_function
+import re
+import sys
+
+
+def parse_probes(source):
+    """The (provider, [(probe, number of arguments)]) of the definition"""
+    # Drop the comments, they may contain anything
+    source = re.sub(r"/\*.*?\*/", "", source, flags=re.S)
+    source = re.sub(r"//[^\n]*", "", source)
+
+    provider = re.search(r"provider\s+(\w+)\s*{", source)
+    if provider is None:
+        raise ValueError("No provider found")
+
+    probes = []
+    for m in re.finditer(r"probe\s+(\w+)\s*\(([^)]*)\)\s*;", source):
+        args = m.group(2).strip()
+        if args == "" or args == "void":
+            nargs = 0
+        else:
+            nargs = len(args.split(","))
+        if nargs > 12:
+            raise ValueError("{0}: too many arguments".format(m.group(1)))
+        probes.append((m.group(1), nargs))
+    return (provider.group(1), probes)
+
+
+def macro_name(provider, probe):
+    return "{0}_{1}".format(provider, probe.replace("__", "_")).upper()
+
+
+def write_header(out, provider, probes):
+    guard = "{0}_USDT_H".format(provider.upper())
+    print("/* Generated by generate_usdt.py, do not edit */", file=out)
+    print("#ifndef {0}".format(guard), file=out)
+    print("#define {0}".format(guard), file=out)
+    print("", file=out)
+    print("#define _SDT_HAS_SEMAPHORES 1", file=out)
+    print("#include <sys/sdt.h>", file=out)
+    print("", file=out)
+    print("#ifdef __cplusplus", file=out)
+    print("extern \"C\" {", file=out)
+    print("#endif", file=out)
+    print("", file=out)
+    print("#define {0}_USDT_SEMAPHORE \\".format(provider.upper()), file=out)
+    print("    __attribute__((section(\".probes\"), visibility(\"hidden\")))",
+          file=out)
+    print("", file=out)
+
+    for (probe, nargs) in probes:
+        name = macro_name(provider, probe)
+        semaphore = "{0}_{1}_semaphore".format(provider, probe)
+        args = ["arg{0}".format(ii) for ii in range(nargs)]
+
+        print("extern unsigned short {0} {1}_USDT_SEMAPHORE;".format(
+            semaphore, provider.upper()), file=out)
+        print("#define {0}_ENABLED() __builtin_expect({1} != 0, 0)".format(
+            name, semaphore), file=out)
+        print("#define {0}({1}) \\".format(name, ", ".join(args)), file=out)
+        print("    do { \\", file=out)
+        print("        if ({0}_ENABLED()) {{ \\".format(name), file=out)
+        if nargs == 0:
+            print("            STAP_PROBE({0}, {1}); \\".format(
+                provider, probe), file=out)
+        else:
+            print("            STAP_PROBE{0}({1}, {2}, {3}); \\".format(
+                nargs, provider, probe, ", ".join(args)), file=out)
+        print("        } \\", file=out)
+        print("    } while (0)", file=out)
+        print("", file=out)
+
+    print("#ifdef __cplusplus", file=out)
+    print("}", file=out)
+    print("#endif", file=out)
+    print("", file=out)
+    print("#endif", file=out)
+
+
+def write_source(out, header, provider, probes):
+    print("/* Generated by generate_usdt.py, do not edit */", file=out)
+    print("#include \"{0}\"".format(header), file=out)
+    print("", file=out)
+    for (probe, _) in probes:
+        print("unsigned short {0}_{1}_semaphore {2}_USDT_SEMAPHORE = 0;"
+              .format(provider, probe, provider.upper()), file=out)
+
+
+def main():
+    if len(sys.argv) != 4:
+        print("Usage: {0} probes.d header.h source.c".format(sys.argv[0]),
+              file=sys.stderr)
+        return 1
+
+    with open(sys.argv[1]) as f:
+        (provider, probes) = parse_probes(f.read())
+
+    with open(sys.argv[2], "w") as out:
+        write_header(out, provider, probes)
+    with open(sys.argv[3], "w") as out:
+        write_source(out, sys.argv[2].split("/")[-1], provider, probes)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -69,6 +69,9 @@ extern "C" {
         int (*get_password)(cbsasl_conn_t *conn, void *context, int id,
                             cbsasl_secret_t **psecret);
         void *get_password_ctx;
+        /* The state of a mechanism exchanging several messages */
+        void *mech_data;
+        void (*mech_dispose)(void *mech_data);
     };
 
     struct cbsasl_server_conn_t {
@@ -77,6 +80,8 @@ extern "C" {
         char *sasl_data;
         unsigned int sasl_data_len;
         cbsasl_mechs_t mech;
+        void *mech_data;
+        void (*mech_dispose)(void *mech_data);
     };
 
     struct cbsasl_conn_st {
@@ -123,6 +123,13 @@ typedef struct engine_allocator_hooks_v1 {
      */
     bool (*enable_thread_cache)(bool enable);
 
+    /**
+     * Gives the calling thread an allocator arena of its own, if the
+     * server is set up for that. Called by the background threads of
+     * the engines when they start. Returns true if it did.
+     */
+    bool (*use_thread_arena)(void);
+
 } ALLOCATOR_HOOKS_API;
 
 #ifdef __cplusplus
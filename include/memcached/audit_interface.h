@@ -54,6 +54,23 @@ typedef struct {
                                ENGINE_ERROR_CODE status);
 }AUDIT_EXTENSION_DATA;
 
+/*
+ * The fields of the events memcached puts about its connections. They
+ * are copied as they are into the queue of the audit thread, and only
+ * turned into JSON there. The strings are cut to fit.
+ */
+typedef struct {
+    char peername[64];
+    char sockname[64];
+    char user[128];
+    /* The name of the one event specific field, "" if none */
+    char field[16];
+    char value[128];
+    /* Set by put_connection_audit_event */
+    time_t timestamp;
+    uint32_t frac_of_second;
+} AUDIT_CONNECTION_EVENT;
+
 
 MEMCACHED_PUBLIC_API
 AUDIT_ERROR_CODE start_auditdaemon(const AUDIT_EXTENSION_DATA *extension_data);
@@ -74,6 +91,28 @@ AUDIT_ERROR_CODE put_audit_event(const uint32_t audit_eventid, const void *paylo
 MEMCACHED_PUBLIC_API
 AUDIT_ERROR_CODE put_json_audit_event(uint32_t audit_eventid, cJSON *root);
 
+/**
+ * Is the event enabled (and audit on)? Doesn't lock, so it may be seen
+ * late after a reconfiguration, it is meant for skipping the building
+ * of the events which would be dropped anyway.
+ *
+ * @param audit_eventid the audit identifier
+ * @return false if the event would be dropped
+ */
+MEMCACHED_PUBLIC_API
+bool audit_event_enabled(uint32_t audit_eventid);
+
+/**
+ * Put an event about a connection into the audit log (stamped now)
+ *
+ * @param audit_eventid the audit identifier
+ * @param event the fields of the event
+ * @return AUDIT_SUCCESS upon success, AUDIT_FAILURE otherwise
+ */
+MEMCACHED_PUBLIC_API
+AUDIT_ERROR_CODE put_connection_audit_event(uint32_t audit_eventid,
+                                            const AUDIT_CONNECTION_EVENT *event);
+
 MEMCACHED_PUBLIC_API
 AUDIT_ERROR_CODE shutdown_auditdaemon(const char *config);
 
@@ -61,6 +61,46 @@ struct config_item {
  */
 MEMCACHED_PUBLIC_API int parse_config(const char *str, struct config_item items[], FILE *error);
 
+/**
+ * The keys of a config item array compiled into a perfect hash table, so
+ * that parse_config_schema finds the item of a key with a single probe
+ * instead of comparing it to all of them. Compile it once for an array
+ * and use it for all of the parses of arrays with the same keys in the
+ * same order (only the value pointers may change).
+ */
+struct config_schema;
+
+/**
+ * Compile the schema of the items.
+ *
+ * @param items the config items, terminated by a NULL key
+ * @return the schema (release with config_schema_free), or NULL if it
+ *         can't be allocated or the keys aren't unique
+ */
+MEMCACHED_PUBLIC_API struct config_schema *config_schema_compile(const struct config_item items[]);
+
+MEMCACHED_PUBLIC_API void config_schema_free(struct config_schema *schema);
+
+/**
+ * Get the schema of the items from the cache, compiling it into the cache
+ * the first time. Safe to call from several threads at once; the schema
+ * stays in the cache for the lifetime of the process.
+ *
+ * @param cache where to keep the schema (a static pointer set to NULL)
+ * @param items the config items, used to compile the schema
+ * @return the schema, or NULL if it can't be compiled
+ */
+MEMCACHED_PUBLIC_API const struct config_schema *config_schema_get(struct config_schema **cache,
+                                                                   const struct config_item items[]);
+
+/**
+ * Parse the configuration argument like parse_config, looking the keys up
+ * in the compiled schema of the items (or like parse_config if the schema
+ * is NULL).
+ */
+MEMCACHED_PUBLIC_API int parse_config_schema(const char *str, const struct config_schema *schema,
+                                             struct config_item items[], FILE *error);
+
 #ifdef __cplusplus
 }
 #endif
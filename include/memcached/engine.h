@@ -77,6 +77,7 @@ extern "C" {
         SERVER_LOG_API *log;
         SERVER_COOKIE_API *cookie;
         ALLOCATOR_HOOKS_API *alloc_hooks;
+        SERVER_EXECUTOR_API *executor; /**< NULL if the server has none */
     };
 
     typedef enum { TAP_MUTATION = 1,
@@ -193,6 +194,75 @@ extern "C" {
         feature_info features[1];
     } engine_info;
 
+    /**
+     * One lookup in a batched get_multi call. The caller fills in the
+     * key, nkey and vbucket fields; the engine fills in status and, on
+     * ENGINE_SUCCESS, item (which must be released by the caller).
+     */
+    typedef struct {
+        const void *key;
+        uint16_t nkey;
+        uint16_t vbucket;
+        item *item;
+        ENGINE_ERROR_CODE status;
+    } item_get_request;
+
+    /**
+     * One item of a batched store_multi call. The caller fills in all
+     * but the status and cas fields; the engine allocates the item, copies
+     * the value into it and stores it, and fills in status and, on
+     * ENGINE_SUCCESS, the CAS of the stored item.
+     */
+    typedef struct {
+        const void *key;
+        const void *value;
+        uint32_t nbytes;
+        uint32_t flags;
+        rel_time_t exptime;
+        uint16_t nkey;
+        uint16_t vbucket;
+        uint8_t datatype;
+        ENGINE_STORE_OPERATION operation;
+        uint64_t cas;
+        ENGINE_ERROR_CODE status;
+    } item_store_request;
+
+    /**
+     * What engine::prefetch should pull into the cache for a key.
+     */
+    typedef enum {
+        /** The part of the engine's index the key is found in */
+        ENGINE_PREFETCH_INDEX,
+        /** The item itself, once its part of the index was prefetched */
+        ENGINE_PREFETCH_ITEM
+    } ENGINE_PREFETCH_STAGE;
+
+    struct engine_interface_v1;
+
+    /**
+     * The engine a proxy engine (such as bucket_engine) serves a
+     * connection with, for the frontend to call directly (see
+     * engine::bind_engine).
+     *
+     * The binding is only good while *current == expected (the
+     * connection is still in the bucket, which keeps it around). The
+     * frontend bumps *clients around every call, and only makes the
+     * call if it then reads *state == live. If it reads anything else
+     * (before the call, or once it dropped *clients after it), it calls
+     * release(bucket) and stops using the binding.
+     */
+    typedef struct {
+        ENGINE_HANDLE *v0;
+        struct engine_interface_v1 *v1;
+        volatile int *clients;
+        const volatile int *state;
+        int live;
+        void *const volatile *current;
+        const void *expected;
+        void (*release)(void *bucket);
+        void *bucket;
+    } engine_binding_t;
+
     /**
      * Definition of the first version of the engine interface
      */
@@ -290,6 +360,23 @@ extern "C" {
                         void *cookie,
                         item* item);
 
+        /**
+         * Release a batch of items in one call (optional, may be NULL),
+         * as if release() was called for each of them. The engine may
+         * release them in any order (to take each of its locks once for
+         * the batch). An item may be in the batch more than once, for
+         * the references the caller holds.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie the items were obtained with
+         * @param items the items to be released
+         * @param nitems the number of entries in items
+         */
+        void (*release_multi)(ENGINE_HANDLE* handle,
+                              const void *cookie,
+                              item **items,
+                              size_t nitems);
+
         /**
          * Retrieve an item.
          *
@@ -309,6 +396,49 @@ extern "C" {
                                  const int nkey,
                                  uint16_t vbucket);
 
+        /**
+         * Retrieve a batch of items in one call (optional, may be NULL).
+         *
+         * Every request gets its own status: ENGINE_SUCCESS (with the
+         * item set), ENGINE_KEY_ENOENT or an error code. The frontend
+         * treats any other per-request status as "not answered" and
+         * retries that key through get().
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param requests the lookups to perform
+         * @param nrequests the number of entries in requests
+         *
+         * @return ENGINE_SUCCESS if the batch was processed, any other
+         *         value means no request in the batch was answered
+         */
+        ENGINE_ERROR_CODE (*get_multi)(ENGINE_HANDLE* handle,
+                                       const void* cookie,
+                                       item_get_request *requests,
+                                       size_t nrequests);
+
+        /**
+         * Hint that the key is about to be accessed (optional, may be
+         * NULL). The frontend calls it for the keys of the requests it
+         * already received behind the one it is executing: first for the
+         * INDEX stage, and for the ITEM stage right before the request is
+         * executed. The engine may start loading the memory it needs for
+         * the key into the cache, but must not block or change anything.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param key the key to prefetch
+         * @param nkey the length of the key
+         * @param vbucket the virtual bucket id
+         * @param stage what to prefetch
+         */
+        void (*prefetch)(ENGINE_HANDLE* handle,
+                         const void* cookie,
+                         const void* key,
+                         const int nkey,
+                         uint16_t vbucket,
+                         ENGINE_PREFETCH_STAGE stage);
+
         /**
          * Store an item.
          *
@@ -328,6 +458,60 @@ extern "C" {
                                    ENGINE_STORE_OPERATION operation,
                                    uint16_t vbucket);
 
+        /**
+         * Allocate and store a batch of items in one call (optional, may
+         * be NULL). The engine may order the work as it likes (to take
+         * each of its locks once for the batch), but stores the items of
+         * the same key in the order of the batch. It must not block: an
+         * item it can't store right away gets an error status.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param requests the items to store
+         * @param nrequests the number of entries in requests
+         *
+         * @return ENGINE_SUCCESS if the batch was processed, any other
+         *         value means no item in the batch was stored
+         */
+        ENGINE_ERROR_CODE (*store_multi)(ENGINE_HANDLE* handle,
+                                         const void *cookie,
+                                         item_store_request *requests,
+                                         size_t nrequests);
+
+        /**
+         * Replace a range of the value of an item in place (optional, may
+         * be NULL).
+         *
+         * The length bytes at offset in the value are replaced by the
+         * ndata bytes of data, without allocating a new item. The engine
+         * only does so if the item is still the current version of its key,
+         * the caller holds the only reference to it and the new value fits
+         * the memory the item already occupies. Otherwise it returns
+         * ENGINE_NOT_STORED, and the caller should store a new item
+         * instead. It never returns ENGINE_EWOULDBLOCK.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param item the item to change (as returned by get())
+         * @param cas the new CAS value of the item (OUT)
+         * @param offset where the range starts in the value
+         * @param length the size of the range
+         * @param data the bytes to put in its place (not in the item)
+         * @param ndata the number of bytes in data
+         * @param vbucket the virtual bucket id
+         *
+         * @return ENGINE_SUCCESS if the value was changed
+         */
+        ENGINE_ERROR_CODE (*splice)(ENGINE_HANDLE* handle,
+                                    const void *cookie,
+                                    item* item,
+                                    uint64_t *cas,
+                                    size_t offset,
+                                    size_t length,
+                                    const void *data,
+                                    size_t ndata,
+                                    uint16_t vbucket);
+
         /**
          * Perform an increment or decrement operation on an item.
          *
@@ -540,6 +724,41 @@ extern "C" {
                               const item* item,
                               item_info *item_info);
 
+        /**
+         * Get information about an item and the first segment of its value
+         * (optional, may be NULL). Unlike get_item_info the caller doesn't
+         * need room for all the segments of the value, so it's what the
+         * frontend uses for every item it sends or fills in.
+         *
+         * @param handle the engine that owns the object
+         * @param cookie connection cookie for this item
+         * @param item the item to request information about
+         * @param item_view where to put it
+         * @return true if successful
+         */
+        bool (*get_item_view)(ENGINE_HANDLE *handle,
+                              const void *cookie,
+                              const item* item,
+                              item_view *item_view);
+
+        /**
+         * Get a segment of the value of an item (optional, may be NULL, but
+         * must be set if get_item_view is). Together with get_item_view it
+         * iterates the value one segment at a time.
+         *
+         * @param handle the engine that owns the object
+         * @param cookie connection cookie for this item
+         * @param item the item to request the segment of
+         * @param index the segment, below item_view::nsegments
+         * @param segment where to put it
+         * @return true if successful
+         */
+        bool (*get_item_segment)(ENGINE_HANDLE *handle,
+                                 const void *cookie,
+                                 const item* item,
+                                 uint16_t index,
+                                 struct iovec *segment);
+
         /**
          * Set information of an item.
          *
@@ -569,6 +788,23 @@ extern "C" {
                                                const void * cookie,
                                                engine_get_vb_map_cb callback);
 
+        /**
+         * Get the engine serving the connection, for the frontend to call
+         * it directly for the data commands instead of through the proxy
+         * (optional, may be NULL). Only a proxy engine implements it, and
+         * only binds a connection when the calls it would skip do nothing
+         * but pass the call on. Must be called by the thread serving the
+         * connection.
+         *
+         * @param handle the engine handle
+         * @param cookie The connection cookie
+         * @param binding where to put the engine and its guard
+         * @return true if the connection was bound
+         */
+        bool (*bind_engine)(ENGINE_HANDLE* handle,
+                            const void *cookie,
+                            engine_binding_t *binding);
+
         struct dcp_interface dcp;
     } ENGINE_HANDLE_V1;
 
@@ -41,6 +41,7 @@ struct test_harness {
     void (*destroy_bucket)(ENGINE_HANDLE* h, ENGINE_HANDLE_V1* h1, bool force);
     void(*reload_bucket)(ENGINE_HANDLE **, ENGINE_HANDLE_V1 **,
                          const char *, bool, bool);
+    void (*set_exptime_ms_handling)(const void *cookie, bool enable);
 };
 
 /*
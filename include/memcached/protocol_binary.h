@@ -114,6 +114,9 @@ extern "C"
          * node, and the Cluster manager has not yet granted all
          * users access to the cluster. */
         PROTOCOL_BINARY_RESPONSE_NOT_INITIALIZED = 0x25,
+        /** The user or the bucket is over its rate limit of commands or
+         * bytes per second. Retry after backing off for a bit. */
+        PROTOCOL_BINARY_RESPONSE_RATE_LIMITED = 0x26,
         /** The server have no idea what this command is for */
         PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND = 0x81,
         /** Not enough memory */
@@ -181,7 +184,12 @@ extern "C"
 
         /** [For mutations only] Inserting the value would cause the document
          * to be too deep. */
-        PROTOCOL_BINARY_RESPONSE_SUBDOC_VALUE_ETOODEEP = 0xca
+        PROTOCOL_BINARY_RESPONSE_SUBDOC_VALUE_ETOODEEP = 0xca,
+
+        /** [For multi-path commands only] One or more of the paths failed;
+         * the body has the status of each of them (see
+         * protocol_binary_request_subdocument_multi). */
+        PROTOCOL_BINARY_RESPONSE_SUBDOC_MULTI_PATH_FAILURE = 0xcc
 
     } protocol_binary_response_status;
 
@@ -239,6 +247,9 @@ extern "C"
         PROTOCOL_BINARY_CMD_AUDIT_PUT = 0x27,
         PROTOCOL_BINARY_CMD_AUDIT_CONFIG_RELOAD = 0x28,
 
+        /* Get a byte range of a value */
+        PROTOCOL_BINARY_CMD_GET_RANGE = 0x29,
+
         /* These commands are used for range operations and exist within
          * this header for use in other projects.  Range operations are
          * not expected to be implemented in the memcached server itself.
@@ -424,6 +435,19 @@ extern "C"
         PROTOCOL_BINARY_CMD_SUBDOC_INCREMENT = 0xce,
         PROTOCOL_BINARY_CMD_SUBDOC_DECREMENT = 0xcf,
 
+        /* Multi-path commands */
+        PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP = 0xd0,
+        PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION = 0xd1,
+
+        /* Run a server side script (see daemon/scripts.h) */
+        PROTOCOL_BINARY_CMD_SCRIPT_EXEC = 0xec,
+
+        /* Touch (or get and touch) a batch of keys of the default engine */
+        PROTOCOL_BINARY_CMD_GATM = 0xed,
+        PROTOCOL_BINARY_CMD_TOUCHM = 0xee,
+
+        /* Replace the items of a batch if all of them still have a CAS */
+        PROTOCOL_BINARY_CMD_CASM = 0xef,
 
         /* Scrub the data */
         PROTOCOL_BINARY_CMD_SCRUB = 0xf0,
@@ -440,6 +464,28 @@ extern "C"
         /* ns_server - memcached internal communication */
         PROTOCOL_BINARY_CMD_INIT_COMPLETE = 0xf6,
 
+        /* Move a slab page between slab classes in the default engine */
+        PROTOCOL_BINARY_CMD_SLAB_REASSIGN = 0xf7,
+
+        /* Get a key, or a lease to refill it if it's missing */
+        PROTOCOL_BINARY_CMD_GET_LEASE = 0xf8,
+
+        /* Dump and load the items of the default engine in bulk */
+        PROTOCOL_BINARY_CMD_SNAPSHOT_DUMP = 0xf9,
+        PROTOCOL_BINARY_CMD_SNAPSHOT_LOAD = 0xfa,
+
+        /* Set a batch of items with a single call into the engine */
+        PROTOCOL_BINARY_CMD_SETM = 0xfb,
+
+        /* Delete the items of a key prefix namespace of the default engine */
+        PROTOCOL_BINARY_CMD_NAMESPACE_DELETE = 0xfc,
+
+        /* List the keys of the default engine a batch at a time */
+        PROTOCOL_BINARY_CMD_SCAN_KEYS = 0xfd,
+
+        /* Increment (or decrement) a batch of counters of the default engine */
+        PROTOCOL_BINARY_CMD_INCRM = 0xfe,
+
         /* Reserved for being able to signal invalid opcode */
         PROTOCOL_BINARY_CMD_INVALID = 0xff
     } protocol_binary_command;
@@ -564,6 +610,38 @@ extern "C"
     typedef protocol_binary_response_get protocol_binary_response_getk;
     typedef protocol_binary_response_get protocol_binary_response_getkq;
 
+    /**
+     * Definition of the packet used by the get range command: the bytes
+     * [offset, offset + length) of the value are returned (up to the end
+     * of the value, which is all that's left of it if length is 0). An
+     * offset past the end of the value fails with ERANGE.
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint32_t offset;
+                uint32_t length;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 8];
+    } protocol_binary_request_get_range;
+
+    /**
+     * Definition of the packet returned from a successful get range, the
+     * flags of the item are followed by the length of the whole value.
+     */
+    typedef union {
+        struct {
+            protocol_binary_response_header header;
+            struct {
+                uint32_t flags;
+                uint32_t nbytes;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_response_header) + 8];
+    } protocol_binary_response_get_range;
+
     /**
      * Definition of the packet used by the delete command
      * See section 4
@@ -815,6 +893,54 @@ extern "C"
     } protocol_binary_request_subdocument;
 
 
+    /**
+     * Definition of the packet used by the multi-path SUBDOCUMENT commands,
+     * which run up to PROTOCOL_BINARY_SUBDOC_MULTI_MAX_PATHS lookups
+     * (SUBDOC_GET and SUBDOC_EXISTS) or mutations against the same document.
+     * The mutations are applied together, with a single store of the
+     * document, or not at all.
+     *
+     *   Header:                        24 @0: <protocol_binary_request_header>
+     *   Extras:                         0
+     *   Body:
+     *     Key                      keylen @24: <variable>
+     *     Specs                           @24+keylen: <variable>
+     *
+     * Each of the lookup specs is a protocol_binary_subdoc_multi_lookup_spec
+     * followed by the path, and each of the mutation specs is a
+     * protocol_binary_subdoc_multi_mutation_spec followed by the path and
+     * the value (the fields are in network byte order).
+     *
+     * The response to a lookup has the result of every spec, in order: the
+     * status (2 bytes), the length of the value (4 bytes) and the value
+     * (only SUBDOC_GET has one). Its status is SUBDOC_MULTI_PATH_FAILURE if
+     * one or more of the specs failed. The response to a mutation has no
+     * body, unless one of the specs failed: the status is then
+     * SUBDOC_MULTI_PATH_FAILURE, and the body has the index of the first
+     * spec which failed (1 byte) and its status (2 bytes).
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header)];
+    } protocol_binary_request_subdocument_multi;
+
+    typedef struct {
+        uint8_t  opcode;       // SUBDOC_GET or SUBDOC_EXISTS
+        uint8_t  subdoc_flags; // See protocol_binary_subdoc_flag
+        uint16_t pathlen;
+    } protocol_binary_subdoc_multi_lookup_spec;
+
+    typedef struct {
+        uint8_t  opcode;       // Any of the single path mutations
+        uint8_t  subdoc_flags; // See protocol_binary_subdoc_flag
+        uint16_t pathlen;
+        uint32_t valuelen;
+    } protocol_binary_subdoc_multi_mutation_spec;
+
+#define PROTOCOL_BINARY_SUBDOC_MULTI_MAX_PATHS 16
+
     /** Definition of the packet used by SUBDOCUMENT responses.
      */
     typedef union {
@@ -1042,6 +1168,294 @@ extern "C"
      */
     typedef protocol_binary_response_no_extras protocol_binary_response_scrub;
 
+    /**
+     * Definition of the packet used by slab reassign. The source
+     * and destination slab class ids are passed as extras; a source
+     * of 0 lets the engine pick the class with the fewest evictions.
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint32_t src;
+                uint32_t dst;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 8];
+    } protocol_binary_request_slab_reassign;
+
+    /**
+     * Definition of the packet returned from slab reassign.
+     */
+    typedef protocol_binary_response_no_extras protocol_binary_response_slab_reassign;
+
+    /**
+     * Definition of the packet used by get lease. A hit is returned like
+     * a get; a miss (KEY_ENOENT) carries the lease token in the CAS (0 if
+     * no lease was handed out), which the client stores the key with.
+     * While another client holds the lease ETMPFAIL is returned.
+     */
+    typedef protocol_binary_request_no_extras protocol_binary_request_get_lease;
+
+    /**
+     * An item which expired within the stale grace period of the engine
+     * is returned with a second word in the extras, with
+     * PROTOCOL_BINARY_GET_LEASE_STALE set. The CAS is then the lease to
+     * refresh it with (0 if someone else holds it).
+     */
+    typedef union {
+        struct {
+            protocol_binary_response_header header;
+            struct {
+                uint32_t flags;
+                uint32_t lease_flags;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_response_header) + 8];
+    } protocol_binary_response_get_lease;
+
+#define PROTOCOL_BINARY_GET_LEASE_STALE 0x01
+
+    /**
+     * The hash table is split in slices, which the snapshot dump hands
+     * out a range of at a time: the request asks for the slices from
+     * first up to (not including) last, and the response has the number
+     * of the first slice it didn't get to (last once it is done), the
+     * number of slices there are, and the live items of the slices it
+     * covered as the body. A request for an empty range only returns the
+     * number of slices, so a client may split them between connections.
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint32_t first;
+                uint32_t last;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 8];
+    } protocol_binary_request_snapshot_dump;
+
+    typedef union {
+        struct {
+            protocol_binary_response_header header;
+            struct {
+                uint32_t next;
+                uint32_t nslices;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_response_header) + 8];
+    } protocol_binary_response_snapshot_dump;
+
+    /**
+     * An item in a snapshot: this header (in network byte order, the flags
+     * as they are stored), then the key and the value. The expiry time is
+     * absolute (0 for none).
+     */
+    typedef struct {
+        uint64_t cas;
+        uint32_t flags;
+        uint32_t exptime;
+        uint32_t nbytes;
+        uint16_t nkey;
+        uint8_t datatype;
+        uint8_t reserved;
+    } protocol_binary_snapshot_item;
+
+    /**
+     * The snapshot load takes items as the body, and adds them (the keys
+     * already there are kept). The response has how many were stored and
+     * how many weren't (because of the key already being there, or the
+     * item having expired or not fitting).
+     */
+    typedef protocol_binary_request_no_extras protocol_binary_request_snapshot_load;
+
+    typedef union {
+        struct {
+            protocol_binary_response_header header;
+            struct {
+                uint32_t stored;
+                uint32_t skipped;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_response_header) + 8];
+    } protocol_binary_response_snapshot_load;
+
+    /**
+     * A scan walks the slices of the hash table like a snapshot dump. The
+     * request has the cursor (the first slice to list, 0 to start) and
+     * about how many keys to return at most (0 for the default), and the
+     * key is an optional prefix the keys must start with. The response
+     * has the cursor to go on from (the number of slices once done) and
+     * the number of slices, and as its body an entry for every key: a
+     * protocol_binary_snapshot_item (nbytes is the size of the value)
+     * followed by the key only. A response ends at the end of a slice.
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint32_t cursor;
+                uint32_t count;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 8];
+    } protocol_binary_request_scan_keys;
+
+    typedef protocol_binary_response_snapshot_dump protocol_binary_response_scan_keys;
+
+    /**
+     * SETM has no extras and no key, the body is a sequence of entries of
+     * this header (in network byte order, the flags as they are stored)
+     * followed by the key (1 to PROTOCOL_BINARY_SETM_MAX_KEYLEN bytes, the
+     * key limit of the other commands) and the value, which are set with the
+     * datatype of the request. The response has a bit per entry (the
+     * lowest bit of the first byte for the first entry) which is set if
+     * its item was stored, so the client only has to retry the others.
+     */
+    typedef struct {
+        uint32_t flags;
+        uint32_t expiration;
+        uint32_t nbytes;
+        uint16_t nkey;
+        uint16_t vbucket;
+    } protocol_binary_setm_entry;
+
+#define PROTOCOL_BINARY_SETM_MAX_ENTRIES 4096
+#define PROTOCOL_BINARY_SETM_MAX_KEYLEN 250
+
+    typedef protocol_binary_request_no_extras protocol_binary_request_setm;
+
+    /**
+     * INCRM has no extras and no key, the body is a sequence of entries of
+     * this header (in network byte order) followed by the key (1 to
+     * PROTOCOL_BINARY_SETM_MAX_KEYLEN bytes). Every entry is an increment
+     * (or a decrement with PROTOCOL_BINARY_INCRM_DECR) like the binary
+     * INCR and DECR, in the vbucket of the request: a missing counter is
+     * created with the initial value unless the expiration is 0xffffffff.
+     * The response has a protocol_binary_incrm_result for every entry, in
+     * the order of the request. An entry of a counter the engine has to
+     * read back from its extended storage first fails with ETMPFAIL.
+     */
+    typedef struct {
+        uint64_t delta;
+        uint64_t initial;
+        uint32_t expiration;
+        uint16_t nkey;
+        uint16_t flags;
+    } protocol_binary_incrm_entry;
+
+#define PROTOCOL_BINARY_INCRM_DECR 0x01
+
+    typedef struct {
+        uint64_t value;
+        uint64_t cas;
+        uint16_t status;
+        uint16_t reserved[3];
+    } protocol_binary_incrm_result;
+
+    typedef protocol_binary_request_no_extras protocol_binary_request_incrm;
+
+    /**
+     * CASM has no extras and no key, the body is a sequence of entries of
+     * this header (in network byte order, the flags as they are stored)
+     * followed by the key (1 to PROTOCOL_BINARY_SETM_MAX_KEYLEN bytes) and
+     * the value, all of them in the vbucket of the request and set with its
+     * datatype. Either every item is replaced or none is: an entry's item
+     * must still have its CAS, or not exist if the CAS is 0, and a key may
+     * only be in the batch once. The response status is SUCCESS if all the
+     * items were replaced, otherwise the status of an entry which failed,
+     * and the body has a protocol_binary_casm_result for every entry, in
+     * the order of the request (with the new CAS if it went through).
+     */
+    typedef struct {
+        uint64_t cas;
+        uint32_t flags;
+        uint32_t expiration;
+        uint32_t nbytes;
+        uint16_t nkey;
+        uint16_t reserved;
+    } protocol_binary_casm_entry;
+
+    typedef struct {
+        uint64_t cas;
+        uint16_t status;
+        uint16_t reserved[3];
+    } protocol_binary_casm_result;
+
+    typedef protocol_binary_request_no_extras protocol_binary_request_casm;
+
+    /**
+     * TOUCHM and GATM have the expiration in the extras (like TOUCH) and no
+     * key, the body is a sequence of entries of this header (in network
+     * byte order) followed by the key (1 to PROTOCOL_BINARY_SETM_MAX_KEYLEN
+     * bytes), all of them in the vbucket of the request. Every key found is
+     * given the expiration. The response has a bit per entry (the lowest
+     * bit of the first byte for the first entry) which is set if its key
+     * was touched. The bitmap of GATM is followed by a
+     * protocol_binary_gatm_result and the value of every key touched, in
+     * the order of the request.
+     */
+    typedef struct {
+        uint16_t nkey;
+    } protocol_binary_touchm_entry;
+
+    typedef struct {
+        uint64_t cas;
+        uint32_t flags;             /* as they are stored */
+        uint32_t nbytes;
+    } protocol_binary_gatm_result;
+
+    typedef protocol_binary_request_touch protocol_binary_request_touchm;
+
+    /**
+     * SCRIPT_EXEC runs the script named by the key, in the vbucket of the
+     * request. The value is its arguments (at most
+     * PROTOCOL_BINARY_SCRIPT_MAX_ARGS), each of them this header (in
+     * network byte order) followed by its bytes. The response is the one
+     * of a GET of the item the script ended up with (the one of its last
+     * get, incr or decr step), or has no extras and no value if there is
+     * none. A step which fails ends the script with its status; E2BIG if
+     * it ran out of steps, ETMPFAIL out of time.
+     */
+#define PROTOCOL_BINARY_SCRIPT_MAX_ARGS 8
+
+    typedef struct {
+        uint16_t length;
+    } protocol_binary_script_arg;
+
+    typedef protocol_binary_request_no_extras protocol_binary_request_script_exec;
+
+    /**
+     * Definition of the packet used by namespace delete: the key is the
+     * namespace, and the optional extras flags. The items of the namespace
+     * are gone at once, and unlinked in the background unless
+     * PROTOCOL_BINARY_NAMESPACE_DELETE_LAZY is set (they are then only
+     * dropped as the engine comes across them). The response has the
+     * number of items the namespace had. KEY_ENOENT if it had none.
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint32_t flags;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 4];
+    } protocol_binary_request_namespace_delete;
+
+#define PROTOCOL_BINARY_NAMESPACE_DELETE_LAZY 0x01
+
+    typedef union {
+        struct {
+            protocol_binary_response_header header;
+            struct {
+                uint64_t items;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_response_header) + 8];
+    } protocol_binary_response_namespace_delete;
+
 
     /**
      * Definition of the packet used by set vbucket
@@ -1094,18 +1508,74 @@ extern "C"
         PROTOCOL_BINARY_FEATURE_TLS = 0x2,
         PROTOCOL_BINARY_FEATURE_TCPNODELAY = 0x03,
         PROTOCOL_BINARY_FEATURE_MUTATION_SEQNO = 0x04,
-        PROTOCOL_BINARY_FEATURE_TCPDELAY = 0x05
+        PROTOCOL_BINARY_FEATURE_TCPDELAY = 0x05,
+        /**
+         * Allow the server to execute the commands of the connection out
+         * of order, so the responses must be matched by their opaque
+         * instead of by the order they arrive in.
+         */
+        PROTOCOL_BINARY_FEATURE_UNORDERED_EXECUTION = 0x06,
+        /**
+         * Allow the server to send the common responses with the compact
+         * header below instead of protocol_binary_response_header.
+         */
+        PROTOCOL_BINARY_FEATURE_COMPACT_RESPONSE = 0x07,
+        /**
+         * Allow the server to compress everything it sends on the
+         * connection after the response to the HELLO as a single zstd
+         * stream, flushed at the end of every batch of responses. Once
+         * granted it can't be turned off again on the connection.
+         */
+        PROTOCOL_BINARY_FEATURE_STREAM_COMPRESSION = 0x08,
+        /**
+         * Read an expiration with the top bit of its 32 bits set as a
+         * time relative to now in milliseconds (in the other 31 bits).
+         * Without it such an expiration is an absolute time, as always.
+         */
+        PROTOCOL_BINARY_FEATURE_EXPTIME_MS = 0x09
     } protocol_binary_hello_features;
 
     #define MEMCACHED_FIRST_HELLO_FEATURE 0x01
-    #define MEMCACHED_TOTAL_HELLO_FEATURES 0x05
+    #define MEMCACHED_TOTAL_HELLO_FEATURES 0x09
+
+    /**
+     * The compact response header (PROTOCOL_BINARY_FEATURE_COMPACT_RESPONSE)
+     * starts with a byte of the flags below, which is always less than
+     * PROTOCOL_BINARY_RES so a client can tell it from a full header (the
+     * server still sends those for some responses, and whenever the compact
+     * one wouldn't be smaller). The opcode follows, and then the fields with
+     * their flag set, in this order:
+     *
+     *   status    varint
+     *   extlen    1 byte
+     *   keylen    varint
+     *   bodylen   varint (always there)
+     *   datatype  1 byte
+     *   opaque    4 bytes, as sent in the request
+     *   cas       8 bytes, network byte order
+     *
+     * A varint is 7 bits per byte, least significant first, with the high
+     * bit set on all but the last byte. The fields left out are 0 (the
+     * datatype PROTOCOL_BINARY_RAW_BYTES), so send a non-zero opaque to get
+     * it back.
+     */
+    #define PROTOCOL_BINARY_COMPACT_STATUS 0x01
+    #define PROTOCOL_BINARY_COMPACT_EXTLEN 0x02
+    #define PROTOCOL_BINARY_COMPACT_KEYLEN 0x04
+    #define PROTOCOL_BINARY_COMPACT_DATATYPE 0x08
+    #define PROTOCOL_BINARY_COMPACT_OPAQUE 0x10
+    #define PROTOCOL_BINARY_COMPACT_CAS 0x20
 
 #define protocol_feature_2_text(a) \
     (a == PROTOCOL_BINARY_FEATURE_DATATYPE) ? "Datatype" : \
     (a == PROTOCOL_BINARY_FEATURE_TLS) ? "TLS" : \
     (a == PROTOCOL_BINARY_FEATURE_TCPNODELAY) ? "TCP NODELAY" : \
     (a == PROTOCOL_BINARY_FEATURE_MUTATION_SEQNO) ? "Mutation seqno" : \
-    (a == PROTOCOL_BINARY_FEATURE_TCPDELAY) ? "TCP DELAY" : "Unknown"
+    (a == PROTOCOL_BINARY_FEATURE_TCPDELAY) ? "TCP DELAY" : \
+    (a == PROTOCOL_BINARY_FEATURE_UNORDERED_EXECUTION) ? "Unordered execution" : \
+    (a == PROTOCOL_BINARY_FEATURE_COMPACT_RESPONSE) ? "Compact response" : \
+    (a == PROTOCOL_BINARY_FEATURE_STREAM_COMPRESSION) ? "Stream compression" : \
+    (a == PROTOCOL_BINARY_FEATURE_EXPTIME_MS) ? "Millisecond expiry" : "Unknown"
 
     /**
      * The HELLO command is used by the client and the server to agree
@@ -1294,6 +1764,11 @@ extern "C"
             struct {
                 uint64_t start_seqno;
                 uint64_t end_seqno;
+                /*
+                 * The following flags are defined
+                 */
+#define DCP_MARKER_FLAG_MEMORY 1
+#define DCP_MARKER_FLAG_DISK   2
                 uint32_t flags;
             } body;
         } message;
@@ -1390,6 +1865,30 @@ extern "C"
         uint8_t bytes[sizeof(protocol_binary_request_header) + 1];
     } protocol_binary_request_get_cmd_timer;
 
+    /**
+     * The breakdowns of the timings of an opcode GET_CMD_TIMER returns when
+     * the request has a second byte of extras: the commands by the log2
+     * class of the size of their payload (the larger of the request and
+     * the response body), or the engine::get_multi calls of the quiet get
+     * runs by the log2 class of the number of keys in them.
+     */
+    typedef enum {
+        PROTOCOL_BINARY_CMD_TIMER_HISTOGRAM = 0,
+        PROTOCOL_BINARY_CMD_TIMER_BY_SIZE = 1,
+        PROTOCOL_BINARY_CMD_TIMER_BY_BATCH = 2
+    } protocol_binary_cmd_timer_breakdown;
+
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint8_t opcode;
+                uint8_t breakdown;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 2];
+    } protocol_binary_request_get_cmd_timer_breakdown;
+
     typedef protocol_binary_response_no_extras protocol_binary_response_get_cmd_timer;
 
     typedef protocol_binary_request_no_extras protocol_binary_request_create_bucket;
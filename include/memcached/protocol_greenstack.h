@@ -0,0 +1,98 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Summary: The framing used on ports configured with the Greenstack
+ *          protocol.
+ *
+ * A Greenstack connection carries a sequence of length-prefixed frames.
+ * Each frame starts with a fixed size header, followed by a set of
+ * flexible header fields and the frame body:
+ *
+ *   +--------+--------+-----------------+
+ *   | magic  | flags  | fieldlen        |
+ *   +--------+--------+-----------------+
+ *   | stream                            |
+ *   +-----------------------------------+
+ *   | bodylen                           |
+ *   +-----------------------------------+
+ *   | fields (fieldlen bytes)           |
+ *   +-----------------------------------+
+ *   | body (bodylen bytes)              |
+ *   +-----------------------------------+
+ *
+ * The body of a request frame is exactly one binary protocol packet, and
+ * the body of a response frame holds all of the binary protocol packets
+ * generated for it (e.g. a STAT request gets all the stats in a single
+ * frame). Quiet commands which don't send a response don't get a frame
+ * back either.
+ *
+ * The stream is picked by the client and echoed in the response. The
+ * server is free to complete the frames of a connection in any order, so
+ * clients must match the responses by their stream and not rely on the
+ * order they're sent in. Frames the server pushes on its own (DCP and TAP)
+ * use the stream of the request which set up the stream.
+ *
+ * All multibyte fields are in network byte order.
+ */
+
+#ifndef PROTOCOL_GREENSTACK_H
+#define PROTOCOL_GREENSTACK_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * The legal magic values of a frame
+     */
+    typedef enum {
+        PROTOCOL_GREENSTACK_REQ = 0xa0,
+        PROTOCOL_GREENSTACK_RES = 0xa1
+    } protocol_greenstack_magic;
+
+    /**
+     * The frame header
+     */
+    typedef union {
+        struct {
+            uint8_t magic;
+            /** Reserved for future use, must be 0 */
+            uint8_t flags;
+            /** The total size of the flexible header fields */
+            uint16_t fieldlen;
+            uint32_t stream;
+            uint32_t bodylen;
+        } frame;
+        uint8_t bytes[12];
+    } protocol_greenstack_frame_header;
+
+    /**
+     * The flexible header fields. Each field is a one byte id and a one
+     * byte length followed by its value. The server silently ignores the
+     * fields it doesn't know, unless the PROTOCOL_GREENSTACK_FIELD_MANDATORY
+     * bit is set in the id. A request with an unknown mandatory field is
+     * rejected with PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED.
+     */
+    typedef enum {
+        /**
+         * An opaque value (up to PROTOCOL_GREENSTACK_MAX_TAG bytes) echoed
+         * back in the response frame, e.g. to carry a client side trace id
+         */
+        PROTOCOL_GREENSTACK_FIELD_TAG = 0x01
+    } protocol_greenstack_field;
+
+#define PROTOCOL_GREENSTACK_FIELD_MANDATORY 0x80
+#define PROTOCOL_GREENSTACK_MAX_TAG 32
+
+    /**
+     * The maximum size of the flexible header fields of a request
+     */
+#define PROTOCOL_GREENSTACK_MAX_FIELDLEN 256
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROTOCOL_GREENSTACK_H */
@@ -59,6 +59,23 @@ extern "C" {
          */
         bool (*get_config)(struct config_item items[]);
 
+        /**
+         * The current time in milliseconds (since the server started).
+         * May be NULL if the server doesn't keep time in milliseconds.
+         */
+        uint64_t (*get_current_time_ms)(void);
+
+        /**
+         * Get the expiry of a time_t value given in milliseconds (exptime
+         * with the top bit of its 32 bits set), in milliseconds since the
+         * server started. 0 if exptime isn't one: realtime() is as
+         * precise as it gets. Only for the exptimes of the connections
+         * which support them (see is_exptime_ms_supported), for the
+         * others realtime() reads the top bit as part of an absolute
+         * time. May be NULL, like get_current_time_ms.
+         */
+        uint64_t (*realtime_ms)(const time_t exptime);
+
     } SERVER_CORE_API;
 
     typedef struct {
@@ -145,6 +162,16 @@ extern "C" {
          */
         bool (*is_mutation_extras_supported)(const void *cookie);
 
+        /**
+         * Check if the connection sends its expiry times in milliseconds
+         * (PROTOCOL_BINARY_FEATURE_EXPTIME_MS, see realtime_ms).
+         *
+         * @param cookie The cookie provided by the frontend
+         *
+         * @return true if supported or else false.
+         */
+        bool (*is_exptime_ms_supported)(const void *cookie);
+
         /**
          * Retrieve the opcode of the connection, if
          * ewouldblock flag is set. Please note that the ewouldblock
@@ -185,6 +212,19 @@ extern "C" {
         void (*notify_io_complete)(const void *cookie,
                                    ENGINE_ERROR_CODE status);
 
+        /**
+         * Let a number of connections know that their IO has completed,
+         * the same as calling notify_io_complete() for each of them but
+         * waking up the thread of each connection only once. Cookies of
+         * the same thread next to each other are handled under one lock.
+         * @param cookies the cookies representing the connections
+         * @param status the status for the io operation of each of them
+         * @param ncookies the number of cookies
+         */
+        void (*notify_io_complete_multi)(const void * const *cookies,
+                                         const ENGINE_ERROR_CODE *status,
+                                         int ncookies);
+
         /**
          * Notify the core that we're holding on to this cookie for
          * future use. (The core guarantees it will not invalidate the
@@ -216,6 +256,63 @@ extern "C" {
 
     } SERVER_COOKIE_API;
 
+    /* The tasks of a higher priority are run first */
+    typedef enum {
+        EXECUTOR_PRIORITY_HIGH,
+        EXECUTOR_PRIORITY_NORMAL,
+        EXECUTOR_PRIORITY_LOW
+    } EXECUTOR_PRIORITY;
+
+#define EXECUTOR_PRIORITIES 3
+
+    typedef void (*EXECUTOR_TASK)(void *arg);
+
+    /**
+     * A pool of threads shared by all the engines (and buckets) of the
+     * server for their background work, instead of threads of their own.
+     * The tasks belong to an owner (the engine), which bounds how many of
+     * them may run at once and drops them at its shutdown.
+     */
+    typedef struct {
+        /**
+         * Queue a task to run on a thread of the pool
+         *
+         * @param owner who the task belongs to
+         * @param priority the queue the task goes to
+         * @param task the function to run
+         * @param arg passed to the task
+         * @return the id of the task, 0 if it couldn't be queued (out of
+         *         memory, or the owner is being cancelled)
+         */
+        uint64_t (*submit)(const void *owner, EXECUTOR_PRIORITY priority,
+                           EXECUTOR_TASK task, void *arg);
+
+        /**
+         * Drop a task which hasn't started yet
+         *
+         * @return true if the task won't run
+         */
+        bool (*cancel)(uint64_t id);
+
+        /**
+         * Drop the queued tasks of the owner, and wait for the ones running
+         * (which should check is_cancelled() now and then) to return. Not
+         * to be called from a task of the owner.
+         */
+        void (*cancel_all)(const void *owner);
+
+        /**
+         * Has cancel_all() been called for the owner?
+         */
+        bool (*is_cancelled)(const void *owner);
+
+        /**
+         * Limit the number of tasks of the owner running at the same time
+         * (0 for no limit), the others wait in their queue
+         */
+        void (*set_limit)(const void *owner, int running);
+    } SERVER_EXECUTOR_API;
+
 #ifdef WIN32
 #undef interface
 #endif
@@ -0,0 +1,88 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Summary: The shared memory transport for clients on the same host.
+ *
+ * A client connected to a unix domain socket interface (see "path" in
+ * memcached.json(4)) may move the byte streams of the connection into
+ * memory it shares with the server, so the requests and responses no
+ * longer go through the kernel. The client creates a memfd, sizes it and
+ * seals it against shrinking (F_SEAL_SHRINK, so the server can't fault on
+ * a truncated mapping), lays it out as below and sends IOCTL_SET with the
+ * key "shm_ring" and the path of the memfd ("/proc/<pid>/fd/<fd>") as the
+ * value. The response still comes on the socket; from then on the client
+ * must only use the rings:
+ *
+ *   +-----------------------------+ 0
+ *   | shm_ring_header_t           |
+ *   +-----------------------------+ SHM_RING_CTL_OFFSET
+ *   | shm_ring_ctl_t  requests    |
+ *   +-----------------------------+
+ *   | shm_ring_ctl_t  responses   |
+ *   +-----------------------------+ SHM_RING_DATA_OFFSET
+ *   | request bytes  (size)       |
+ *   +-----------------------------+
+ *   | response bytes (size)       |
+ *   +-----------------------------+ SHM_RING_FILE_SIZE(size)
+ *
+ * Each ring carries the same bytes the socket would (binary protocol
+ * packets, or Greenstack frames on a Greenstack port). The producer copies
+ * to data[produced % size] and then advances produced, the consumer copies
+ * from data[consumed % size] and then advances consumed, with a full
+ * memory barrier between the copy and the store.
+ *
+ * The socket is only used as a doorbell: a side which finds nothing to
+ * read (or no room to write) sets consumer_waiting (or producer_waiting)
+ * of the ring, checks the ring again and then blocks reading the socket.
+ * The other side, after advancing the ring, swaps the flag from 1 to 0
+ * and if it did writes a byte to the socket. So neither side makes a
+ * system call while the other one keeps it busy. The server starts out
+ * with consumer_waiting of the request ring set. Closing the socket
+ * closes the connection.
+ */
+
+#ifndef MEMCACHED_SHM_RING_H
+#define MEMCACHED_SHM_RING_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define SHM_RING_MAGIC 0x4d435352 /* "MCSR" */
+#define SHM_RING_VERSION 1
+
+/* The size of each ring, a power of two between these */
+#define SHM_RING_MIN_SIZE 4096
+#define SHM_RING_MAX_SIZE (64 * 1024 * 1024)
+
+    typedef struct {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t size;
+        uint32_t reserved;
+        uint8_t pad[48];
+    } shm_ring_header_t;
+
+    /* The indexes of a ring, on cache lines of their own */
+    typedef struct {
+        volatile uint64_t produced;
+        uint8_t pad0[56];
+        volatile uint64_t consumed;
+        uint8_t pad1[56];
+        volatile uint32_t consumer_waiting;
+        volatile uint32_t producer_waiting;
+        uint8_t pad2[56];
+    } shm_ring_ctl_t;
+
+#define SHM_RING_CTL_OFFSET sizeof(shm_ring_header_t)
+#define SHM_RING_DATA_OFFSET \
+    (SHM_RING_CTL_OFFSET + 2 * sizeof(shm_ring_ctl_t))
+#define SHM_RING_FILE_SIZE(size) (SHM_RING_DATA_OFFSET + 2 * (uint64_t)(size))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
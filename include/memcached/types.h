@@ -89,6 +89,28 @@ extern "C" {
         struct iovec value[1];
     } item_info;
 
+    /**
+     * The metadata of an item and the first segment of its value (see
+     * get_item_view), without an array sized for the most segments a
+     * value may be in. The others are read one at a time with
+     * get_item_segment.
+     */
+    typedef struct {
+        uint64_t cas;
+        uint64_t vbucket_uuid;
+        uint64_t seqno;
+        rel_time_t exptime; /**< When the item will expire (relative to process
+                             * startup) */
+        uint32_t nbytes; /**< The total size of the data (in bytes) */
+        uint32_t flags; /**< Flags associated with the item (in network byte order)*/
+        uint8_t datatype;
+        uint8_t clsid; /** class id for the object */
+        uint16_t nkey; /**< The total length of the key (in bytes) */
+        uint16_t nsegments; /**< The number of segments the value is in */
+        const void *key;
+        struct iovec value; /**< The first segment of the value */
+    } item_view;
+
     typedef struct {
         const char *username;
         const char *config;
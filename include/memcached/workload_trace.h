@@ -0,0 +1,71 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Summary: The files of the request trace capture.
+ *
+ * With "workload_trace_dir" set every worker thread of the server maps a
+ * file of "workload_trace_file_size" bytes,
+ * "<workload_trace_dir>/trace.<thread>", and while "workload_trace_sample"
+ * isn't 0 it writes a record for the requests with a key it reads: the
+ * keys are sampled by their hash, 1 in workload_trace_sample of them, so
+ * all of the requests for a sampled key are in the trace (and the
+ * popularity of the keys, and who comes after whom, stays as it was).
+ * The keys themselves aren't kept, only their hash.
+ *
+ *   +-----------------------------+ 0
+ *   | workload_trace_header_t     |
+ *   +-----------------------------+ sizeof(workload_trace_header_t)
+ *   | workload_trace_record_t     |
+ *   | ... (capacity of them)      |
+ *   +-----------------------------+
+ *
+ * The records are a ring: record n goes to n % capacity, so once written
+ * is past the capacity the oldest record is the one at written %
+ * capacity. The owning thread only advances written after the record is
+ * in place, so a reader copying the file while the server runs only has
+ * to skip the capacity - (written - copied) oldest ones it may have seen
+ * half written. All of the fields are in the byte order of the server.
+ * mcreplay(1) replays the files against a server.
+ */
+
+#ifndef MEMCACHED_WORKLOAD_TRACE_H
+#define MEMCACHED_WORKLOAD_TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define WORKLOAD_TRACE_MAGIC 0x4d435754 /* "MCWT" */
+#define WORKLOAD_TRACE_VERSION 1
+
+    typedef struct {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t record_size;     /* sizeof(workload_trace_record_t) */
+        uint32_t sample;          /* the sampling of the last record */
+        uint64_t capacity;        /* the records the ring has room for */
+        volatile uint64_t written;
+        /* When the file was created, as gethrtime() and in wall clock */
+        uint64_t start_ns;
+        uint64_t start_usec;      /* since the epoch */
+        uint8_t pad[16];
+    } workload_trace_header_t;
+
+    typedef struct {
+        uint64_t time_ns;         /* since start_ns */
+        uint64_t key;             /* the hash of the key */
+        uint32_t nvalue;          /* the body after the extras and the key */
+        uint32_t exptime;         /* the TTL of the request, 0 if none */
+        uint16_t nkey;
+        uint16_t vbucket;
+        uint8_t opcode;
+        uint8_t reserved[3];
+    } workload_trace_record_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,165 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <cerrno>
+#include <cmath>
+#include <inttypes.h>
+#include <string.h>
+
+#include "programs/bench_results.h"
+
+void Histogram::add(uint64_t value) {
+    ++buckets[index(value)];
+    ++count;
+    sum += value;
+    if (value > max) {
+        max = value;
+    }
+}
+
+void Histogram::merge(const Histogram &other) {
+    for (size_t ii = 0; ii < NBUCKETS; ++ii) {
+        buckets[ii] += other.buckets[ii];
+    }
+    count += other.count;
+    sum += other.sum;
+    if (other.max > max) {
+        max = other.max;
+    }
+}
+
+uint64_t Histogram::getPercentile(double fraction) const {
+    uint64_t rank = (uint64_t)std::ceil(fraction * count);
+    uint64_t seen = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    for (size_t ii = 0; ii < NBUCKETS; ++ii) {
+        seen += buckets[ii];
+        if (seen >= rank && buckets[ii] != 0) {
+            uint64_t upper = lowerBound(ii + 1) - 1;
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+size_t Histogram::index(uint64_t value) {
+    if (value < (2 << SUB_BITS)) {
+        return (size_t)value;
+    }
+#ifdef _MSC_VER
+    int msb = 0;
+    for (uint64_t v = value; v > 1; v >>= 1) {
+        ++msb;
+    }
+#else
+    int msb = 63 - __builtin_clzll(value);
+#endif
+    int shift = msb - SUB_BITS;
+    return (size_t)((shift + 1) << SUB_BITS) +
+           (size_t)((value >> shift) - (1 << SUB_BITS));
+}
+
+uint64_t Histogram::lowerBound(size_t idx) {
+    if (idx < (2 << SUB_BITS)) {
+        return idx;
+    }
+    int shift = (int)(idx >> SUB_BITS) - 1;
+    uint64_t sub = (idx & ((1 << SUB_BITS) - 1)) + (1 << SUB_BITS);
+    return sub << shift;
+}
+
+ResultsWriter::ResultsWriter(FILE *fp_) : fp(fp_), members(1, false) {
+    fprintf(fp, "{");
+}
+
+void ResultsWriter::finish() {
+    while (!members.empty()) {
+        end();
+    }
+    fprintf(fp, "\n");
+}
+
+void ResultsWriter::next() {
+    fprintf(fp, "%s\n%*s", members.back() ? "," : "",
+            (int)(2 * members.size()), "");
+    members.back() = true;
+}
+
+void ResultsWriter::begin(const char *name) {
+    next();
+    fprintf(fp, "\"%s\": {", name);
+    members.push_back(false);
+}
+
+void ResultsWriter::end() {
+    members.pop_back();
+    fprintf(fp, "\n%*s}", (int)(2 * members.size()), "");
+}
+
+void ResultsWriter::add(const char *name, uint64_t value) {
+    next();
+    fprintf(fp, "\"%s\": %" PRIu64, name, value);
+}
+
+void ResultsWriter::add(const char *name, int value) {
+    next();
+    fprintf(fp, "\"%s\": %d", name, value);
+}
+
+void ResultsWriter::add(const char *name, unsigned int value) {
+    next();
+    fprintf(fp, "\"%s\": %u", name, value);
+}
+
+void ResultsWriter::add(const char *name, bool value) {
+    next();
+    fprintf(fp, "\"%s\": %s", name, value ? "true" : "false");
+}
+
+void ResultsWriter::add(const char *name, const char *value) {
+    next();
+    fprintf(fp, "\"%s\": \"%s\"", name, value);
+}
+
+void ResultsWriter::add(const char *name, const std::string &value) {
+    add(name, value.c_str());
+}
+
+void ResultsWriter::add(const char *name, double value, int precision) {
+    next();
+    fprintf(fp, "\"%s\": %.*f", name, precision, value);
+}
+
+void ResultsWriter::addLatency(const char *name, const Histogram &h) {
+    begin(name);
+    add("mean", h.getMean() / 1000, 1);
+    add("p50", h.getPercentile(0.5) / 1000.0, 1);
+    add("p90", h.getPercentile(0.9) / 1000.0, 1);
+    add("p99", h.getPercentile(0.99) / 1000.0, 1);
+    add("p999", h.getPercentile(0.999) / 1000.0, 1);
+    add("p9999", h.getPercentile(0.9999) / 1000.0, 1);
+    add("max", h.getMax() / 1000.0, 1);
+    end();
+}
+
+FILE *open_results(const std::string &path) {
+    FILE *fp;
+
+    if (path.empty()) {
+        return stdout;
+    }
+    if ((fp = fopen(path.c_str(), "w")) == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path.c_str(),
+                strerror(errno));
+    }
+    return fp;
+}
+
+void close_results(FILE *fp) {
+    if (fp != stdout) {
+        fclose(fp);
+    }
+}
@@ -0,0 +1,104 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * What the load generating programs (mcbench, mcreplay, mcreplbench)
+ * share to report their results: the latency histogram, and a writer
+ * of the JSON document they print to stdout or to the -o file.
+ */
+#pragma once
+
+#include <cstdio>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Latency histogram with buckets of about 3% of their value: the values
+ * below 64 get a bucket of their own, and every power of two above that
+ * is split in 32 buckets.
+ */
+class Histogram {
+public:
+    Histogram() : buckets(NBUCKETS, 0), count(0), sum(0), max(0) {
+    }
+
+    void add(uint64_t value);
+    void merge(const Histogram &other);
+
+    uint64_t getCount() const {
+        return count;
+    }
+
+    uint64_t getMax() const {
+        return max;
+    }
+
+    double getMean() const {
+        return count == 0 ? 0 : (double)sum / count;
+    }
+
+    /**
+     * The value below which the given fraction of the values are (the
+     * upper bound of its bucket, so it's never below the real value)
+     */
+    uint64_t getPercentile(double fraction) const;
+
+private:
+    static const int SUB_BITS = 5;
+    static const size_t NBUCKETS = 64 * (1 << SUB_BITS);
+
+    static size_t index(uint64_t value);
+    static uint64_t lowerBound(size_t idx);
+
+    std::vector<uint64_t> buckets;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+/**
+ * Writes the results as a JSON document, two spaces of indentation per
+ * level. The members are separated as they are added, so the callers
+ * only list them.
+ */
+class ResultsWriter {
+public:
+    /** Start the document */
+    explicit ResultsWriter(FILE *fp);
+
+    /** End it, closing the objects still open */
+    void finish();
+
+    /** Open (or close) an object member of the current object */
+    void begin(const char *name);
+    void end();
+
+    void add(const char *name, uint64_t value);
+    void add(const char *name, int value);
+    void add(const char *name, unsigned int value);
+    void add(const char *name, bool value);
+    void add(const char *name, const char *value);
+    void add(const char *name, const std::string &value);
+    /** A number with the given digits after the point */
+    void add(const char *name, double value, int precision);
+
+    /**
+     * The mean, the percentiles (50 to 99.99) and the max of nanosecond
+     * latencies, in microseconds
+     */
+    void addLatency(const char *name, const Histogram &h);
+
+private:
+    /* Separate the member to come from the previous one and indent it */
+    void next();
+
+    FILE *fp;
+    /* Whether the object of each level has a member yet */
+    std::vector<bool> members;
+};
+
+/**
+ * The file to print the results to: stdout if path is empty. NULL (with
+ * the reason printed) if it can't be created.
+ */
+FILE *open_results(const std::string &path);
+void close_results(FILE *fp);
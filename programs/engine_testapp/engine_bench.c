@@ -0,0 +1,405 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Every thread gets a cookie of its own and runs the operation on random
+ * keys until the time is up, timing every call. The bucket is created
+ * (and its keys stored) once per thread count, so the operations of a
+ * row all see the same data.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <platform/platform.h>
+#include <memcached/protocol_binary.h>
+
+#include "engine_bench.h"
+
+/*
+ * Latency histogram (nanoseconds) with buckets of about 3% of their
+ * value: the values below 64 get a bucket of their own, and every power
+ * of two above that is split in 32 buckets.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+struct histogram {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+static int hist_index(uint64_t value) {
+    int msb, shift;
+
+    if (value < (2 << HIST_SUB_BITS)) {
+        return (int)value;
+    }
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) +
+           (int)((value >> shift) - (1 << HIST_SUB_BITS));
+}
+
+static uint64_t hist_lower_bound(int idx) {
+    int shift;
+
+    if (idx < (2 << HIST_SUB_BITS)) {
+        return idx;
+    }
+    shift = (idx >> HIST_SUB_BITS) - 1;
+    return ((uint64_t)(idx & ((1 << HIST_SUB_BITS) - 1)) +
+            (1 << HIST_SUB_BITS)) << shift;
+}
+
+static void hist_add(struct histogram *h, uint64_t value) {
+    ++h->buckets[hist_index(value)];
+    ++h->count;
+    h->sum += value;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+static void hist_merge(struct histogram *h, const struct histogram *other) {
+    int ii;
+
+    for (ii = 0; ii < HIST_BUCKETS; ++ii) {
+        h->buckets[ii] += other->buckets[ii];
+    }
+    h->count += other->count;
+    h->sum += other->sum;
+    if (other->max > h->max) {
+        h->max = other->max;
+    }
+}
+
+/* The upper bound of the bucket of the given fraction of the values */
+static uint64_t hist_percentile(const struct histogram *h, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * h->count + 0.5);
+    uint64_t seen = 0;
+    int ii;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (ii = 0; ii < HIST_BUCKETS; ++ii) {
+        seen += h->buckets[ii];
+        if (seen >= rank && h->buckets[ii] != 0) {
+            uint64_t upper = hist_lower_bound(ii + 1) - 1;
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+struct bench_run;
+
+struct bench_thread {
+    struct bench_run *run;
+    cb_thread_t tid;
+    const void *cookie;
+    uint64_t seed;
+    uint64_t ops;
+    uint64_t errors;
+    struct histogram latency;
+};
+
+typedef ENGINE_ERROR_CODE (*BENCH_FUNC)(struct bench_thread *t,
+                                        const char *key, size_t nkey);
+
+struct bench_op {
+    const char *name;
+    /* The keys the operation runs on: "item:N" are stored up front */
+    const char *prefix;
+    BENCH_FUNC func;
+};
+
+struct bench_run {
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *h1;
+    const struct engine_bench_config *config;
+    const struct bench_op *op;
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+    int ready;
+    bool started;
+    volatile bool stop;
+};
+
+static ENGINE_ERROR_CODE bench_allocate(struct bench_thread *t,
+                                        const char *key, size_t nkey) {
+    struct bench_run *run = t->run;
+    item *it = NULL;
+    ENGINE_ERROR_CODE ret;
+
+    ret = run->h1->allocate(run->h, t->cookie, &it, key, nkey,
+                            run->config->value_size, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES);
+    if (ret == ENGINE_SUCCESS) {
+        run->h1->release(run->h, t->cookie, it);
+    }
+    return ret;
+}
+
+static ENGINE_ERROR_CODE bench_store(struct bench_thread *t,
+                                     const char *key, size_t nkey) {
+    struct bench_run *run = t->run;
+    item *it = NULL;
+    uint64_t cas = 0;
+    ENGINE_ERROR_CODE ret;
+
+    ret = run->h1->allocate(run->h, t->cookie, &it, key, nkey,
+                            run->config->value_size, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES);
+    if (ret == ENGINE_SUCCESS) {
+        ret = run->h1->store(run->h, t->cookie, it, &cas, OPERATION_SET, 0);
+        run->h1->release(run->h, t->cookie, it);
+    }
+    return ret;
+}
+
+static ENGINE_ERROR_CODE bench_get(struct bench_thread *t,
+                                   const char *key, size_t nkey) {
+    struct bench_run *run = t->run;
+    item *it = NULL;
+    ENGINE_ERROR_CODE ret;
+
+    ret = run->h1->get(run->h, t->cookie, &it, key, (int)nkey, 0);
+    if (ret == ENGINE_SUCCESS) {
+        run->h1->release(run->h, t->cookie, it);
+    }
+    return ret;
+}
+
+static ENGINE_ERROR_CODE bench_arithmetic(struct bench_thread *t,
+                                          const char *key, size_t nkey) {
+    struct bench_run *run = t->run;
+    item *it = NULL;
+    uint64_t result;
+    ENGINE_ERROR_CODE ret;
+
+    ret = run->h1->arithmetic(run->h, t->cookie, key, (int)nkey, true, true,
+                              1, 0, 0, &it, PROTOCOL_BINARY_RAW_BYTES,
+                              &result, 0);
+    if (ret == ENGINE_SUCCESS && it != NULL) {
+        run->h1->release(run->h, t->cookie, it);
+    }
+    return ret;
+}
+
+static const struct bench_op bench_ops[] = {
+    { "allocate", "item", bench_allocate },
+    { "store", "item", bench_store },
+    { "get", "item", bench_get },
+    { "arithmetic", "counter", bench_arithmetic },
+    { NULL, NULL, NULL }
+};
+
+/* xorshift64*, so the threads don't share the state of rand() */
+static uint64_t bench_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+static void bench_thread_main(void *arg) {
+    struct bench_thread *t = arg;
+    struct bench_run *run = t->run;
+    const struct bench_op *op = run->op;
+    char key[64];
+
+    cb_mutex_enter(&run->mutex);
+    ++run->ready;
+    cb_cond_broadcast(&run->cond);
+    while (!run->started) {
+        cb_cond_wait(&run->cond, &run->mutex);
+    }
+    cb_mutex_exit(&run->mutex);
+
+    while (!run->stop) {
+        uint64_t id = bench_random(&t->seed) % run->config->keys;
+        int nkey = snprintf(key, sizeof(key), "%s:%" PRIu64, op->prefix, id);
+        hrtime_t start = gethrtime();
+        ENGINE_ERROR_CODE ret = op->func(t, key, nkey);
+        hist_add(&t->latency, gethrtime() - start);
+        ++t->ops;
+        if (ret != ENGINE_SUCCESS) {
+            ++t->errors;
+        }
+    }
+}
+
+static bool bench_preload(struct bench_run *run, const void *cookie) {
+    struct bench_thread t;
+    char key[64];
+    int ii;
+
+    memset(&t, 0, sizeof(t));
+    t.run = run;
+    t.cookie = cookie;
+    for (ii = 0; ii < run->config->keys; ++ii) {
+        int nkey = snprintf(key, sizeof(key), "item:%d", ii);
+        if (bench_store(&t, key, nkey) != ENGINE_SUCCESS) {
+            fprintf(stderr, "Failed to store %s\n", key);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool bench_run_op(struct test_harness *harness, struct bench_run *run,
+                         int nthreads) {
+    struct bench_thread *threads = calloc(nthreads, sizeof(*threads));
+    struct histogram *latency = calloc(1, sizeof(*latency));
+    uint64_t ops = 0, errors = 0;
+    hrtime_t start, elapsed;
+    int ii;
+
+    if (threads == NULL || latency == NULL) {
+        free(threads);
+        free(latency);
+        fprintf(stderr, "Failed to allocate memory\n");
+        return false;
+    }
+
+    run->ready = 0;
+    run->started = false;
+    run->stop = false;
+    for (ii = 0; ii < nthreads; ++ii) {
+        threads[ii].run = run;
+        threads[ii].cookie = harness->create_cookie();
+        threads[ii].seed = (uint64_t)gethrtime() + ii + 1;
+        if (cb_create_thread(&threads[ii].tid, bench_thread_main,
+                             &threads[ii], 0) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            abort();
+        }
+    }
+
+    cb_mutex_enter(&run->mutex);
+    while (run->ready < nthreads) {
+        cb_cond_wait(&run->cond, &run->mutex);
+    }
+    run->started = true;
+    cb_cond_broadcast(&run->cond);
+    cb_mutex_exit(&run->mutex);
+
+    start = gethrtime();
+    sleep(run->config->duration);
+    run->stop = true;
+    for (ii = 0; ii < nthreads; ++ii) {
+        cb_join_thread(threads[ii].tid);
+    }
+    elapsed = gethrtime() - start;
+
+    for (ii = 0; ii < nthreads; ++ii) {
+        ops += threads[ii].ops;
+        errors += threads[ii].errors;
+        hist_merge(latency, &threads[ii].latency);
+        harness->destroy_cookie(threads[ii].cookie);
+    }
+
+    printf("%-12s %8d %12.0f %10.3f %10.3f %10.3f %10.3f %10" PRIu64 "\n",
+           run->op->name, nthreads, ops / ((double)elapsed / 1e9),
+           latency->count ? (double)latency->sum / latency->count / 1000 : 0,
+           hist_percentile(latency, 0.5) / 1000.0,
+           hist_percentile(latency, 0.99) / 1000.0,
+           hist_percentile(latency, 0.999) / 1000.0,
+           errors);
+    fflush(stdout);
+
+    free(threads);
+    free(latency);
+    return true;
+}
+
+/* Whether name is one of the comma separated names of the list */
+static bool bench_selected(const char *list, const char *name) {
+    size_t len = strlen(name);
+    const char *ptr = list;
+
+    if (strcmp(list, "all") == 0) {
+        return true;
+    }
+    while ((ptr = strstr(ptr, name)) != NULL) {
+        if ((ptr == list || ptr[-1] == ',') &&
+            (ptr[len] == '\0' || ptr[len] == ',')) {
+            return true;
+        }
+        ptr += len;
+    }
+    return false;
+}
+
+int run_engine_bench(struct test_harness *harness,
+                     const struct engine_bench_config *config) {
+    struct bench_run run;
+    const char *ptr = config->threads;
+    int ii, rc = 0;
+
+    for (ii = 0; bench_ops[ii].name != NULL; ++ii) {
+        if (bench_selected(config->ops, bench_ops[ii].name)) {
+            break;
+        }
+    }
+    if (bench_ops[ii].name == NULL || config->keys <= 0 ||
+        config->duration <= 0) {
+        fprintf(stderr, "Nothing to benchmark\n");
+        return 1;
+    }
+
+    memset(&run, 0, sizeof(run));
+    run.config = config;
+    cb_mutex_initialize(&run.mutex);
+    cb_cond_initialize(&run.cond);
+
+    printf("%-12s %8s %12s %10s %10s %10s %10s %10s\n", "op", "threads",
+           "ops/sec", "mean usec", "p50 usec", "p99 usec", "p999 usec",
+           "errors");
+
+    while (rc == 0 && *ptr != '\0') {
+        char *end;
+        int nthreads = (int)strtol(ptr, &end, 10);
+        const void *cookie;
+
+        if (nthreads <= 0 || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Invalid thread count: %s\n", ptr);
+            rc = 1;
+            break;
+        }
+        ptr = *end == ',' ? end + 1 : end;
+
+        run.h1 = harness->create_bucket(true, harness->default_engine_cfg);
+        if (run.h1 == NULL) {
+            fprintf(stderr, "Failed to create bucket\n");
+            rc = 1;
+            break;
+        }
+        run.h = (ENGINE_HANDLE*)run.h1;
+
+        cookie = harness->create_cookie();
+        if (!bench_preload(&run, cookie)) {
+            rc = 1;
+        }
+        harness->destroy_cookie(cookie);
+
+        for (ii = 0; rc == 0 && bench_ops[ii].name != NULL; ++ii) {
+            if (bench_selected(config->ops, bench_ops[ii].name)) {
+                run.op = &bench_ops[ii];
+                if (!bench_run_op(harness, &run, nthreads)) {
+                    rc = 1;
+                }
+            }
+        }
+        harness->destroy_bucket(run.h, run.h1, false);
+    }
+
+    cb_cond_destroy(&run.cond);
+    cb_mutex_destroy(&run.mutex);
+    return rc;
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The benchmark mode of engine_testapp (-B): measure the throughput and
+ * latency of the engine API calls with a number of threads hammering a
+ * bucket, without the network and the front end getting in the way.
+ */
+#ifndef ENGINE_BENCH_H
+#define ENGINE_BENCH_H
+
+#include <memcached/engine_testapp.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+struct engine_bench_config {
+    /* Comma separated operations to run, or "all" */
+    const char *ops;
+    /* Comma separated thread counts to run them with */
+    const char *threads;
+    /* Seconds to run each operation for, with each thread count */
+    int duration;
+    /* Number of keys, and the size of their values */
+    int keys;
+    int value_size;
+};
+
+/*
+ * Run the benchmarks against buckets created through the harness (with
+ * the engine already loaded), and print the results on stdout.
+ * Returns 0 on success.
+ */
+int run_engine_bench(struct test_harness *harness,
+                     const struct engine_bench_config *config);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif  /* ENGINE_BENCH_H */
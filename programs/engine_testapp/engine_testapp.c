@@ -14,6 +14,7 @@
 #include <memcached/engine_testapp.h>
 #include <memcached/extension_loggers.h>
 #include "mock_server.h"
+#include "engine_bench.h"
 
 #include <daemon/alloc_hooks.h>
 
@@ -102,6 +103,98 @@ static ENGINE_ERROR_CODE mock_allocate(ENGINE_HANDLE* handle,
     return ret;
 }
 
+static ENGINE_ERROR_CODE mock_get_multi(ENGINE_HANDLE* handle,
+                                        const void* cookie,
+                                        item_get_request *requests,
+                                        size_t nrequests) {
+    struct mock_engine *me = get_handle(handle);
+    struct mock_connstruct *c = (void*)cookie;
+    ENGINE_ERROR_CODE ret;
+
+    if (c == NULL) {
+        c = (void*)create_mock_cookie();
+    }
+
+    ret = me->the_engine->get_multi((ENGINE_HANDLE*)me->the_engine, c,
+                                    requests, nrequests);
+
+    if (c != cookie) {
+        destroy_mock_cookie(c);
+    }
+
+    return ret;
+}
+
+static void mock_prefetch(ENGINE_HANDLE* handle,
+                          const void* cookie,
+                          const void* key,
+                          const int nkey,
+                          uint16_t vbucket,
+                          ENGINE_PREFETCH_STAGE stage) {
+    struct mock_engine *me = get_handle(handle);
+    struct mock_connstruct *c = (void*)cookie;
+
+    if (c == NULL) {
+        c = (void*)create_mock_cookie();
+    }
+
+    me->the_engine->prefetch((ENGINE_HANDLE*)me->the_engine, c,
+                             key, nkey, vbucket, stage);
+
+    if (c != cookie) {
+        destroy_mock_cookie(c);
+    }
+}
+
+static ENGINE_ERROR_CODE mock_store_multi(ENGINE_HANDLE* handle,
+                                          const void *cookie,
+                                          item_store_request *requests,
+                                          size_t nrequests) {
+    struct mock_engine *me = get_handle(handle);
+    struct mock_connstruct *c = (void*)cookie;
+    ENGINE_ERROR_CODE ret;
+
+    if (c == NULL) {
+        c = (void*)create_mock_cookie();
+    }
+
+    ret = me->the_engine->store_multi((ENGINE_HANDLE*)me->the_engine, c,
+                                      requests, nrequests);
+
+    if (c != cookie) {
+        destroy_mock_cookie(c);
+    }
+
+    return ret;
+}
+
+static ENGINE_ERROR_CODE mock_splice(ENGINE_HANDLE* handle,
+                                     const void *cookie,
+                                     item* item,
+                                     uint64_t *cas,
+                                     size_t offset,
+                                     size_t length,
+                                     const void *data,
+                                     size_t ndata,
+                                     uint16_t vbucket) {
+    struct mock_engine *me = get_handle(handle);
+    struct mock_connstruct *c = (void*)cookie;
+    ENGINE_ERROR_CODE ret;
+
+    if (c == NULL) {
+        c = (void*)create_mock_cookie();
+    }
+
+    ret = me->the_engine->splice((ENGINE_HANDLE*)me->the_engine, c, item,
+                                 cas, offset, length, data, ndata, vbucket);
+
+    if (c != cookie) {
+        destroy_mock_cookie(c);
+    }
+
+    return ret;
+}
+
 static ENGINE_ERROR_CODE mock_remove(ENGINE_HANDLE* handle,
                                      const void* cookie,
                                      const void* key,
@@ -145,6 +238,15 @@ static void mock_release(ENGINE_HANDLE* handle,
     me->the_engine->release((ENGINE_HANDLE*)me->the_engine, cookie, item);
 }
 
+static void mock_release_multi(ENGINE_HANDLE* handle,
+                               const void *cookie,
+                               item **items,
+                               size_t nitems) {
+    struct mock_engine *me = get_handle(handle);
+    me->the_engine->release_multi((ENGINE_HANDLE*)me->the_engine, cookie,
+                                  items, nitems);
+}
+
 static ENGINE_ERROR_CODE mock_get(ENGINE_HANDLE* handle,
                                   const void* cookie,
                                   item** item,
@@ -368,6 +470,23 @@ static bool mock_get_item_info(ENGINE_HANDLE *handle, const void *cookie,
                                          cookie, item, item_info);
 }
 
+static bool mock_get_item_view(ENGINE_HANDLE *handle, const void *cookie,
+                               const item* item, item_view *item_view)
+{
+    struct mock_engine *me = get_handle(handle);
+    return me->the_engine->get_item_view((ENGINE_HANDLE*)me->the_engine,
+                                         cookie, item, item_view);
+}
+
+static bool mock_get_item_segment(ENGINE_HANDLE *handle, const void *cookie,
+                                  const item* item, uint16_t index,
+                                  struct iovec *segment)
+{
+    struct mock_engine *me = get_handle(handle);
+    return me->the_engine->get_item_segment((ENGINE_HANDLE*)me->the_engine,
+                                            cookie, item, index, segment);
+}
+
 static void *mock_get_stats_struct(ENGINE_HANDLE* handle, const void* cookie)
 {
     struct mock_engine *me = get_handle(handle);
@@ -821,6 +940,16 @@ static void usage(void) {
     printf("-v                           verbose output\n");
     printf("-X                           Use stderr logger instead of /dev/zero");
     printf("\n");
+    printf("-B <ops>                     Benchmark the engine rather than run\n");
+    printf("                             tests: comma separated operations out\n");
+    printf("                             of allocate, store, get, arithmetic or\n");
+    printf("                             all (-T isn't needed).\n");
+    printf("-N <threads>                 Comma separated thread counts to run\n");
+    printf("                             the benchmarks with (1,2,4,8).\n");
+    printf("-D <seconds>                 Duration of each benchmark (5).\n");
+    printf("-K <keys>                    Number of keys (100000).\n");
+    printf("-S <size>                    Size of the values (256).\n");
+    printf("\n");
 }
 
 static int report_test(const char *name, time_t duration, enum test_result r, bool quiet, bool compact) {
@@ -927,8 +1056,13 @@ static ENGINE_HANDLE_V1* create_bucket(bool initialize, const char* cfg) {
         mock_engine->me.allocate = mock_allocate;
         mock_engine->me.remove = mock_remove;
         mock_engine->me.release = mock_release;
+        mock_engine->me.release_multi = mock_release_multi;
         mock_engine->me.get = mock_get;
+        mock_engine->me.get_multi = mock_get_multi;
+        mock_engine->me.prefetch = mock_prefetch;
         mock_engine->me.store = mock_store;
+        mock_engine->me.store_multi = mock_store_multi;
+        mock_engine->me.splice = mock_splice;
         mock_engine->me.arithmetic = mock_arithmetic;
         mock_engine->me.flush = mock_flush;
         mock_engine->me.get_stats = mock_get_stats;
@@ -940,6 +1074,8 @@ static ENGINE_HANDLE_V1* create_bucket(bool initialize, const char* cfg) {
         mock_engine->me.get_tap_iterator = mock_get_tap_iterator;
         mock_engine->me.item_set_cas = mock_item_set_cas;
         mock_engine->me.get_item_info = mock_get_item_info;
+        mock_engine->me.get_item_view = mock_get_item_view;
+        mock_engine->me.get_item_segment = mock_get_item_segment;
         mock_engine->me.dcp.step = mock_dcp_step;
         mock_engine->me.dcp.open = mock_dcp_open;
         mock_engine->me.dcp.add_stream = mock_dcp_add_stream;
@@ -979,6 +1115,25 @@ static ENGINE_HANDLE_V1* create_bucket(bool initialize, const char* cfg) {
         if (mock_engine->the_engine->get_tap_iterator == NULL) {
             mock_engine->me.get_tap_iterator = NULL;
         }
+        if (mock_engine->the_engine->release_multi == NULL) {
+            mock_engine->me.release_multi = NULL;
+        }
+        if (mock_engine->the_engine->get_multi == NULL) {
+            mock_engine->me.get_multi = NULL;
+        }
+        if (mock_engine->the_engine->prefetch == NULL) {
+            mock_engine->me.prefetch = NULL;
+        }
+        if (mock_engine->the_engine->store_multi == NULL) {
+            mock_engine->me.store_multi = NULL;
+        }
+        if (mock_engine->the_engine->splice == NULL) {
+            mock_engine->me.splice = NULL;
+        }
+        if (mock_engine->the_engine->get_item_view == NULL) {
+            mock_engine->me.get_item_view = NULL;
+            mock_engine->me.get_item_segment = NULL;
+        }
 
         if (initialize) {
             if(!init_engine_instance(handle, cfg, logger_descriptor)) {
@@ -1172,6 +1327,46 @@ static int safe_append(char *buffer, const char *txt) {
     return len;
 }
 
+/*
+ * The cookies of the benchmark go through ON_CONNECT (and ON_DISCONNECT)
+ * like the connections of the server, which the bucket engine relies on
+ */
+static const void *create_connected_cookie(void) {
+    const void *cookie = create_mock_cookie();
+    get_mock_server_api()->callback->perform_callbacks(ON_CONNECT, NULL,
+                                                       cookie);
+    return cookie;
+}
+
+static void destroy_connected_cookie(const void *cookie) {
+    get_mock_server_api()->callback->perform_callbacks(ON_DISCONNECT, NULL,
+                                                       cookie);
+    destroy_mock_cookie(cookie);
+}
+
+static int run_bench(const char *engine, const char *engine_args,
+                     const struct engine_bench_config *bench) {
+    struct test_harness harness;
+    int rc;
+
+    memset(&harness, 0, sizeof(harness));
+    harness.default_engine_cfg = engine_args;
+    harness.engine_path = engine;
+    harness.create_cookie = create_connected_cookie;
+    harness.destroy_cookie = destroy_connected_cookie;
+    harness.create_bucket = create_bucket;
+    harness.destroy_bucket = destroy_bucket;
+
+    init_mock_server();
+    if (!start_your_engine(engine)) {
+        return 1;
+    }
+    rc = run_engine_bench(&harness, bench);
+    stop_your_engine();
+    destroy_mock_event_callbacks();
+    return rc;
+}
+
 int main(int argc, char **argv) {
     int c, exitcode = 0, num_cases = 0, timeout = 0, loop_count = 0;
     bool verbose = false;
@@ -1190,6 +1385,7 @@ int main(int argc, char **argv) {
     struct test_harness harness;
     int test_case_id = -1;
     char *cmdline;
+    struct engine_bench_config bench;
 
     /* Hack to remove the warning from C99 */
     union {
@@ -1216,6 +1412,11 @@ int main(int argc, char **argv) {
     memset(&my_get_test, 0, sizeof(my_get_test));
     memset(&my_setup_suite, 0, sizeof(my_setup_suite));
     memset(&my_teardown_suite, 0, sizeof(my_teardown_suite));
+    memset(&bench, 0, sizeof(bench));
+    bench.threads = "1,2,4,8";
+    bench.duration = 5;
+    bench.keys = 100000;
+    bench.value_size = 256;
 
     logger_descriptor = get_null_logger();
     color_enabled = getenv("TESTAPP_ENABLE_COLOR") != NULL;
@@ -1242,6 +1443,11 @@ int main(int argc, char **argv) {
                        "C:" /* Test case id */
                        "s" /* spinlock the program */
                        "X" /* Use stderr logger */
+                       "B:" /* Benchmark operations */
+                       "N:" /* Benchmark thread counts */
+                       "D:" /* Benchmark duration */
+                       "K:" /* Benchmark keys */
+                       "S:" /* Benchmark value size */
                        )) != -1) {
         switch (c) {
         case 's' : {
@@ -1290,6 +1496,21 @@ int main(int argc, char **argv) {
         case 'X':
             logger_descriptor = get_stderr_logger();
             break;
+        case 'B':
+            bench.ops = optarg;
+            break;
+        case 'N':
+            bench.threads = optarg;
+            break;
+        case 'D':
+            bench.duration = atoi(optarg);
+            break;
+        case 'K':
+            bench.keys = atoi(optarg);
+            break;
+        case 'S':
+            bench.value_size = atoi(optarg);
+            break;
         default:
             fprintf(stderr, "Illegal argument \"%c\"\n", c);
             return 1;
@@ -1302,6 +1523,10 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    if (bench.ops != NULL) {
+        return run_bench(engine, engine_args, &bench);
+    }
+
     if (test_suite == NULL) {
         fprintf(stderr, "You must provide a path to the testsuite library.\n");
         return 1;
@@ -1335,6 +1560,7 @@ int main(int argc, char **argv) {
     harness.destroy_cookie = destroy_mock_cookie;
     harness.set_ewouldblock_handling = mock_set_ewouldblock_handling;
     harness.set_mutation_extras_handling = mock_set_mutation_extras_handling;
+    harness.set_exptime_ms_handling = mock_set_exptime_ms_handling;
     harness.lock_cookie = lock_mock_cookie;
     harness.unlock_cookie = unlock_mock_cookie;
     harness.waitfor_cookie = waitfor_mock_cookie;
@@ -7,6 +7,7 @@
 #include <memcached/extension_loggers.h>
 #include <memcached/allocator_hooks.h>
 #include "daemon/alloc_hooks.h"
+#include "utilities/executor.h"
 
 #include "mock_server.h"
 
@@ -72,6 +73,12 @@ static bool mock_is_mutation_extras_supported(const void *cookie) {
     return c->handle_mutation_extras;
 }
 
+static bool mock_is_exptime_ms_supported(const void *cookie) {
+    struct mock_connstruct *c = (struct mock_connstruct *)cookie;
+    cb_assert(c == NULL || c->magic == CONN_MAGIC);
+    return c->handle_exptime_ms;
+}
+
 static uint8_t mock_get_opcode_if_ewouldblock_set(const void *cookie) {
     struct mock_connstruct *c = (struct mock_connstruct *)cookie;
     cb_assert(c == NULL || c->magic == CONN_MAGIC);
@@ -132,8 +139,19 @@ static const char *mock_get_server_version(void) {
 }
 
 static uint32_t mock_hash( const void *key, size_t length, const uint32_t initval) {
-    /*this is a very stupid hash indeed */
-    return 1;
+    /*
+     * FNV-1a: the keys need to be spread over the hash table and the item
+     * locks for engine_testapp -B to measure anything sensible
+     */
+    const uint8_t *ptr = key;
+    uint32_t hv = 2166136261U ^ initval;
+    size_t ii;
+
+    for (ii = 0; ii < length; ++ii) {
+        hv ^= ptr[ii];
+        hv *= 16777619U;
+    }
+    return hv;
 }
 
 /* time-sensitive callers can call it by hand with this, outside the
@@ -151,6 +169,30 @@ static rel_time_t mock_get_current_time(void) {
     return result;
 }
 
+static uint64_t mock_get_current_time_ms(void) {
+    uint64_t result;
+    cb_mutex_enter(&time_mutex);
+#ifdef WIN32
+    result = (uint64_t)(time(NULL) - process_started + time_travel_offset) * 1000;
+#else
+    {
+        struct timeval timer;
+        gettimeofday(&timer, NULL);
+        result = (uint64_t)(timer.tv_sec - process_started + time_travel_offset) * 1000 +
+            (uint64_t)timer.tv_usec / 1000;
+    }
+#endif
+    cb_mutex_exit(&time_mutex);
+    return result;
+}
+
+static uint64_t mock_realtime_ms(const time_t exptime) {
+    if ((exptime & 0x80000000u) == 0) {
+        return 0;
+    }
+    return mock_get_current_time_ms() + (uint64_t)(exptime & 0x7fffffff);
+}
+
 static rel_time_t mock_realtime(const time_t exptime) {
     /* no. of seconds in 30 days - largest possible delta exptime */
 
@@ -181,6 +223,15 @@ static void mock_notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status
     }
 }
 
+static void mock_notify_io_complete_multi(const void * const *cookies,
+                                          const ENGINE_ERROR_CODE *status,
+                                          int ncookies) {
+    int ii;
+    for (ii = 0; ii < ncookies; ++ii) {
+        mock_notify_io_complete(cookies[ii], status[ii]);
+    }
+}
+
 static time_t mock_abstime(const rel_time_t exptime)
 {
     return process_started + exptime;
@@ -342,17 +393,21 @@ SERVER_HANDLE_V1 *get_mock_server_api(void)
       core_api.get_current_time = mock_get_current_time;
       core_api.abstime = mock_abstime;
       core_api.parse_config = mock_parse_config;
+      core_api.get_current_time_ms = mock_get_current_time_ms;
+      core_api.realtime_ms = mock_realtime_ms;
 
       server_cookie_api.get_auth_data = mock_get_auth_data;
       server_cookie_api.store_engine_specific = mock_store_engine_specific;
       server_cookie_api.get_engine_specific = mock_get_engine_specific;
       server_cookie_api.is_datatype_supported = mock_is_datatype_supported;
       server_cookie_api.is_mutation_extras_supported = mock_is_mutation_extras_supported;
+      server_cookie_api.is_exptime_ms_supported = mock_is_exptime_ms_supported;
       server_cookie_api.get_opcode_if_ewouldblock_set = mock_get_opcode_if_ewouldblock_set;
       server_cookie_api.validate_session_cas = mock_validate_session_cas;
       server_cookie_api.decrement_session_ctr = mock_decrement_session_ctr;
       server_cookie_api.get_socket_fd = mock_get_socket_fd;
       server_cookie_api.notify_io_complete = mock_notify_io_complete;
+      server_cookie_api.notify_io_complete_multi = mock_notify_io_complete_multi;
       server_cookie_api.reserve = mock_cookie_reserve;
       server_cookie_api.release = mock_cookie_release;
       server_cookie_api.set_priority = mock_set_priority;
@@ -379,6 +434,7 @@ SERVER_HANDLE_V1 *get_mock_server_api(void)
       hooks_api.get_detailed_stats = mc_get_detailed_stats;
       hooks_api.release_free_memory = mc_release_free_memory;
       hooks_api.enable_thread_cache = mc_enable_thread_cache;
+      hooks_api.use_thread_arena = mc_use_thread_arena;
 
       rv.interface = 1;
       rv.core = &core_api;
@@ -387,6 +443,7 @@ SERVER_HANDLE_V1 *get_mock_server_api(void)
       rv.callback = &callback_api;
       rv.cookie = &server_cookie_api;
       rv.alloc_hooks = &hooks_api;
+      rv.executor = get_executor_api();
    }
 
    return &rv;
@@ -461,6 +518,11 @@ void mock_set_mutation_extras_handling(const void *cookie, bool enable) {
     v->handle_mutation_extras = enable;
 }
 
+void mock_set_exptime_ms_handling(const void *cookie, bool enable) {
+    struct mock_connstruct *v = (void *)cookie;
+    v->handle_exptime_ms = enable;
+}
+
 void lock_mock_cookie(const void *cookie) {
    struct mock_connstruct *c = (void*)cookie;
    cb_mutex_enter(&c->mutex);
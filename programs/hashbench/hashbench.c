@@ -0,0 +1,122 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * hashbench compares the time it takes the hash functions selectable with
+ * the "hash_algorithm" setting to hash keys of different sizes, and how
+ * evenly they spread the keys over the buckets of a hash table.
+ */
+#include "config.h"
+
+#include <platform/platform.h>
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "daemon/hash.h"
+
+static const struct {
+    const char *name;
+    hash_algorithm_t algorithm;
+} algorithms[] = {
+    { "jenkins", HASH_JENKINS },
+    { "crc32c", HASH_CRC32C }
+};
+
+static const size_t key_sizes[] = { 8, 16, 32, 64, 128, 250 };
+
+/* Keys the way clients tend to build them: a prefix and a counter */
+static void make_key(char *key, size_t nkey, unsigned long ii) {
+    char num[32];
+    size_t len = (size_t)snprintf(num, sizeof(num), "%lu", ii);
+    memset(key, 'k', nkey);
+    if (len > nkey) {
+        len = nkey;
+    }
+    memcpy(key + nkey - len, num, len);
+}
+
+static void run(const char *name, size_t nkey, unsigned long nkeys,
+                unsigned int hashpower) {
+    const uint32_t mask = (1U << hashpower) - 1;
+    uint32_t *buckets = calloc(mask + 1, sizeof(uint32_t));
+    char *keys = malloc(nkey * nkeys);
+    volatile uint32_t sum = 0;
+    uint32_t longest = 0;
+    double expected = (double)nkeys / (mask + 1);
+    double chi = 0;
+    hrtime_t start, stop;
+    unsigned long ii;
+
+    if (buckets == NULL || keys == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (ii = 0; ii < nkeys; ++ii) {
+        make_key(keys + ii * nkey, nkey, ii);
+    }
+
+    start = gethrtime();
+    for (ii = 0; ii < nkeys; ++ii) {
+        sum += hash(keys + ii * nkey, nkey, 0);
+    }
+    stop = gethrtime();
+
+    for (ii = 0; ii < nkeys; ++ii) {
+        uint32_t *b = &buckets[hash(keys + ii * nkey, nkey, 0) & mask];
+        if (++*b > longest) {
+            longest = *b;
+        }
+    }
+    for (ii = 0; ii <= mask; ++ii) {
+        chi += (buckets[ii] - expected) * (buckets[ii] - expected) / expected;
+    }
+
+    printf("%-16s %4lu %10.2f %12.3f %8u\n", name, (unsigned long)nkey,
+           (double)(stop - start) / nkeys, chi / (mask + 1), longest);
+
+    free(keys);
+    free(buckets);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: hashbench [-n keys] [-p hashpower]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    unsigned long nkeys = 1000000;
+    unsigned int hashpower = 16;
+    size_t ii, jj;
+    int cmd;
+
+    while ((cmd = getopt(argc, argv, "n:p:")) != EOF) {
+        switch (cmd) {
+        case 'n':
+            nkeys = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            hashpower = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (nkeys == 0 || hashpower == 0 || hashpower > 30) {
+        usage();
+    }
+
+    /* chi2/bucket is about 1 for a hash spreading the keys at random */
+    printf("%-16s %4s %10s %12s %8s\n", "hash", "nkey", "ns/key",
+           "chi2/bucket", "longest");
+    for (jj = 0; jj < sizeof(key_sizes) / sizeof(key_sizes[0]); ++jj) {
+        for (ii = 0; ii < sizeof(algorithms) / sizeof(algorithms[0]); ++ii) {
+            const char *impl = hash_init(algorithms[ii].algorithm);
+            run(impl != NULL ? impl : algorithms[ii].name, key_sizes[jj],
+                nkeys, hashpower);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
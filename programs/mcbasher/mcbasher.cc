@@ -4,6 +4,14 @@
 // the correctness of the response it gets, because it's inteded to be used
 // with different mock engines and all we care about is if we're able to
 // run the commands or not.
+//
+// With -V it runs a verifying stress test instead (against a real engine):
+// a number of threads run a random mix of get, set, cas, append, incr,
+// subdoc and delete on keys of their own, and check every response
+// against a model of what the keys must hold. Every thread also bumps a
+// counter shared by all of them, which must have the sum of their
+// increments in the end. The throughput is printed every second, and the
+// inconsistencies found as they are (the exit code is 1 if there are any).
 
 #include "config.h"
 
@@ -15,12 +23,19 @@
 #include <string>
 #include <string.h>
 #include <list>
+#include <map>
+#include <vector>
+#include <atomic>
+#include <random>
 #include <cassert>
+#include <stdint.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <cerrno>
+#include <cstdarg>
 #include <platform/platform.h>
 
 using namespace std;
@@ -401,6 +416,611 @@ static Connection *createGetSetConnection(const char *host, const char *port)
     return new Connection(host, port, message, msgsize, true);
 }
 
+/**
+ * A verifying client: a blocking connection running one request at a
+ * time, and the model of the keys it owns.
+ */
+class Verifier {
+public:
+    Verifier(const string &_host, const string &_port, int _id, int _nkeys,
+             const string &_counter) :
+        ops(0), errors(0), increments(0), host(_host), port(_port), id(_id),
+        nkeys(_nkeys), counter(_counter), sock(INVALID_SOCKET), opaque(0),
+        rnd(_id), running(true)
+    {
+        for (int ii = 0; ii < nkeys; ++ii) {
+            char name[64];
+            snprintf(name, sizeof(name), "mcbasher:%d:%d", id, ii);
+            keys.push_back(Key(name, static_cast<Kind>(ii % 3)));
+        }
+    }
+
+    ~Verifier() {
+        if (sock != INVALID_SOCKET) {
+            closesocket(sock);
+        }
+    }
+
+    void main(void) {
+        if (!connect() || !reset()) {
+            fprintf(stderr, "mcbasher %d: failed to set up the keys\n", id);
+            errors.fetch_add(1);
+            return;
+        }
+        while (running.load() && sock != INVALID_SOCKET) {
+            Key &k = keys[rnd() % keys.size()];
+            bool ok;
+            if (rnd() % 16 == 0) {
+                ok = incrShared();
+            } else if (k.kind == Blob) {
+                ok = blobOp(k);
+            } else if (k.kind == Counter) {
+                ok = counterOp(k);
+            } else {
+                ok = jsonOp(k);
+            }
+            if (!ok) {
+                break;
+            }
+            ops.fetch_add(1);
+        }
+    }
+
+    void stop(void) {
+        running.store(false);
+    }
+
+    /** Read the shared counter (0 if it doesn't exist) */
+    bool readCounter(uint64_t &value) {
+        Response rsp;
+        if (!connect() ||
+            !call(PROTOCOL_BINARY_CMD_GET, counter, "", "", 0, rsp)) {
+            return false;
+        }
+        if (rsp.status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT) {
+            value = 0;
+            return true;
+        }
+        value = strtoull(rsp.value.c_str(), NULL, 10);
+        return rsp.status == PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    }
+
+    bool deleteCounter(void) {
+        Response rsp;
+        return connect() &&
+            call(PROTOCOL_BINARY_CMD_DELETE, counter, "", "", 0, rsp);
+    }
+
+    std::atomic<uint64_t> ops;
+    std::atomic<uint64_t> errors;
+    uint64_t increments;
+
+protected:
+    enum Kind { Blob, Counter, Json };
+
+    struct Key {
+        Key(const string &n, Kind k) : name(n), kind(k), exists(false),
+                                       cas(0), number(0) { }
+        string name;
+        Kind kind;
+        bool exists;
+        uint64_t cas;
+        string value;                   // Blob
+        uint64_t number;                // Counter
+        map<string, uint64_t> fields;   // Json
+    };
+
+    struct Response {
+        uint8_t opcode;
+        uint16_t status;
+        uint64_t cas;
+        string extras;
+        string value;
+    };
+
+    bool connect(void) {
+        struct addrinfo *ai = NULL;
+        struct addrinfo hints;
+
+        if (sock != INVALID_SOCKET) {
+            return true;
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_protocol = IPPROTO_TCP;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &ai) != 0) {
+            return false;
+        }
+        for (struct addrinfo *e = ai; e != NULL; e = e->ai_next) {
+            if ((sock = socket(e->ai_family, e->ai_socktype,
+                               e->ai_protocol)) != -1) {
+                if (::connect(sock, e->ai_addr, e->ai_addrlen) == 0) {
+                    break;
+                }
+                close(sock);
+                sock = -1;
+            }
+        }
+        freeaddrinfo(ai);
+        return sock != INVALID_SOCKET;
+    }
+
+    bool sendAll(const char *ptr, size_t len) {
+        while (len > 0) {
+            ssize_t nw = send(sock, ptr, len, 0);
+            if (nw <= 0) {
+                if (nw == -1 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            ptr += nw;
+            len -= nw;
+        }
+        return true;
+    }
+
+    bool recvAll(char *ptr, size_t len) {
+        while (len > 0) {
+            ssize_t nr = recv(sock, ptr, len, 0);
+            if (nr <= 0) {
+                if (nr == -1 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            ptr += nr;
+            len -= nr;
+        }
+        return true;
+    }
+
+    /**
+     * Send a request and wait for its response
+     * @return false if the connection failed (it's closed)
+     */
+    bool call(uint8_t opcode, const string &key, const string &extras,
+              const string &value, uint64_t cas, Response &rsp) {
+        protocol_binary_request_header req;
+        memset(&req, 0, sizeof(req));
+        req.request.magic = PROTOCOL_BINARY_REQ;
+        req.request.opcode = opcode;
+        req.request.keylen = htons(static_cast<uint16_t>(key.size()));
+        req.request.extlen = static_cast<uint8_t>(extras.size());
+        req.request.bodylen = htonl(static_cast<uint32_t>(extras.size() +
+                                                          key.size() +
+                                                          value.size()));
+        req.request.opaque = ++opaque;
+        req.request.cas = htonll(cas);
+
+        string packet(reinterpret_cast<char*>(req.bytes), sizeof(req.bytes));
+        packet += extras + key + value;
+
+        protocol_binary_response_header hdr;
+        if (!sendAll(packet.data(), packet.size()) ||
+            !recvAll(reinterpret_cast<char*>(hdr.bytes), sizeof(hdr.bytes))) {
+            return disconnect("connection failed");
+        }
+        uint32_t bodylen = ntohl(hdr.response.bodylen);
+        uint16_t keylen = ntohs(hdr.response.keylen);
+        vector<char> body(bodylen);
+        if (bodylen > 0 && !recvAll(&body[0], bodylen)) {
+            return disconnect("connection failed");
+        }
+        if (hdr.response.magic != PROTOCOL_BINARY_RES ||
+            hdr.response.opcode != opcode ||
+            hdr.response.opaque != req.request.opaque ||
+            hdr.response.extlen + keylen > bodylen) {
+            inconsistent(key, "malformed response");
+            return disconnect("malformed response");
+        }
+        rsp.opcode = hdr.response.opcode;
+        rsp.status = ntohs(hdr.response.status);
+        rsp.cas = ntohll(hdr.response.cas);
+        rsp.extras.assign(body.begin(), body.begin() + hdr.response.extlen);
+        rsp.value.assign(body.begin() + hdr.response.extlen + keylen,
+                         body.end());
+        return true;
+    }
+
+    bool disconnect(const char *why) {
+        if (sock != INVALID_SOCKET) {
+            fprintf(stderr, "mcbasher %d: %s\n", id, why);
+            closesocket(sock);
+            sock = INVALID_SOCKET;
+        }
+        return false;
+    }
+
+    void inconsistent(const string &key, const char *fmt, ...) {
+        char buffer[256];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(buffer, sizeof(buffer), fmt, ap);
+        va_end(ap);
+        if (errors.fetch_add(1) < 100) {
+            fprintf(stderr, "mcbasher %d: %s: %s\n", id, key.c_str(), buffer);
+        }
+    }
+
+    /** Check the status, and the CAS of a successful get or store */
+    bool expect(const Key &k, const char *op, const Response &rsp,
+                uint16_t status, bool needCas = true) {
+        if (rsp.status != status) {
+            inconsistent(k.name, "%s returned 0x%02x, expected 0x%02x", op,
+                         rsp.status, status);
+            return false;
+        }
+        if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS && needCas &&
+            rsp.cas == 0) {
+            inconsistent(k.name, "%s returned no CAS", op);
+            return false;
+        }
+        return true;
+    }
+
+    /** Bring the keys to a known state: they don't exist */
+    bool reset(void) {
+        for (size_t ii = 0; ii < keys.size(); ++ii) {
+            Response rsp;
+            if (!call(PROTOCOL_BINARY_CMD_DELETE, keys[ii].name, "", "", 0,
+                      rsp)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static string storeExtras(void) {
+        return string(8, '\0');
+    }
+
+    static string incrExtras(uint64_t delta, uint64_t initial) {
+        char extras[20];
+        uint64_t d = htonll(delta);
+        uint64_t i = htonll(initial);
+        memcpy(extras, &d, 8);
+        memcpy(extras + 8, &i, 8);
+        memset(extras + 16, 0, 4);
+        return string(extras, sizeof(extras));
+    }
+
+    static string subdocExtras(const string &path) {
+        char extras[3];
+        uint16_t pathlen = htons(static_cast<uint16_t>(path.size()));
+        memcpy(extras, &pathlen, 2);
+        extras[2] = 0;
+        return string(extras, sizeof(extras));
+    }
+
+    string randomValue(void) {
+        string value(1 + rnd() % 64, 'a');
+        for (size_t ii = 0; ii < value.size(); ++ii) {
+            value[ii] = 'a' + rnd() % 26;
+        }
+        return value;
+    }
+
+    bool doGet(Key &k) {
+        Response rsp;
+        if (!call(PROTOCOL_BINARY_CMD_GET, k.name, "", "", 0, rsp)) {
+            return false;
+        }
+        if (!k.exists) {
+            expect(k, "get", rsp, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+            return true;
+        }
+        if (!expect(k, "get", rsp, PROTOCOL_BINARY_RESPONSE_SUCCESS)) {
+            return true;
+        }
+        if (rsp.cas != k.cas) {
+            inconsistent(k.name, "get returned CAS %" PRIu64 ", expected %"
+                         PRIu64, rsp.cas, k.cas);
+        } else if (k.kind == Blob && rsp.value != k.value) {
+            inconsistent(k.name, "get returned \"%s\", expected \"%s\"",
+                         rsp.value.c_str(), k.value.c_str());
+        } else if (k.kind == Counter &&
+                   strtoull(rsp.value.c_str(), NULL, 10) != k.number) {
+            inconsistent(k.name, "get returned %s, expected %" PRIu64,
+                         rsp.value.c_str(), k.number);
+        }
+        return true;
+    }
+
+    bool doDelete(Key &k) {
+        Response rsp;
+        if (!call(PROTOCOL_BINARY_CMD_DELETE, k.name, "", "", 0, rsp)) {
+            return false;
+        }
+        if (expect(k, "delete", rsp, k.exists ?
+                   PROTOCOL_BINARY_RESPONSE_SUCCESS :
+                   PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, false)) {
+            k.exists = false;
+            k.fields.clear();
+        }
+        return true;
+    }
+
+    /** Set the key to value, with a CAS unless it's 0 */
+    bool doSet(Key &k, const string &value, uint64_t cas) {
+        Response rsp;
+        if (!call(PROTOCOL_BINARY_CMD_SET, k.name, storeExtras(), value, cas,
+                  rsp)) {
+            return false;
+        }
+        uint16_t status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+        if (cas != 0 && !k.exists) {
+            status = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+        } else if (cas != 0 && cas != k.cas) {
+            status = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+        }
+        if (expect(k, cas ? "cas" : "set", rsp, status) &&
+            status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            k.exists = true;
+            k.cas = rsp.cas;
+            k.value = value;
+        }
+        return true;
+    }
+
+    bool blobOp(Key &k) {
+        switch (rnd() % 6) {
+        case 0:
+        case 1:
+            return doGet(k);
+        case 2:
+            return doSet(k, randomValue(), 0);
+        case 3:
+            // A CAS which is right half of the time
+            if (!k.exists) {
+                return doSet(k, randomValue(), 1 + rnd() % 1000);
+            }
+            return doSet(k, randomValue(), (rnd() & 1) ? k.cas : k.cas + 1);
+        case 4:
+            {
+                if (k.value.size() > 1024) {
+                    return doSet(k, randomValue(), 0);
+                }
+                string data = randomValue();
+                Response rsp;
+                if (!call(PROTOCOL_BINARY_CMD_APPEND, k.name, "", data, 0,
+                          rsp)) {
+                    return false;
+                }
+                if (expect(k, "append", rsp, k.exists ?
+                           PROTOCOL_BINARY_RESPONSE_SUCCESS :
+                           PROTOCOL_BINARY_RESPONSE_NOT_STORED) &&
+                    k.exists) {
+                    k.cas = rsp.cas;
+                    k.value += data;
+                }
+                return true;
+            }
+        default:
+            return doDelete(k);
+        }
+    }
+
+    /** incr with an initial value, which creates the missing keys */
+    bool doIncr(Key &k, uint64_t delta, uint64_t initial, uint64_t &value) {
+        Response rsp;
+        if (!call(PROTOCOL_BINARY_CMD_INCREMENT, k.name,
+                  incrExtras(delta, initial), "", 0, rsp)) {
+            return false;
+        }
+        if (!expect(k, "incr", rsp, PROTOCOL_BINARY_RESPONSE_SUCCESS)) {
+            return true;
+        }
+        if (rsp.value.size() != 8) {
+            inconsistent(k.name, "incr returned %u bytes",
+                         static_cast<unsigned int>(rsp.value.size()));
+            return true;
+        }
+        memcpy(&value, rsp.value.data(), 8);
+        value = ntohll(value);
+        k.exists = true;
+        k.cas = rsp.cas;
+        return true;
+    }
+
+    bool counterOp(Key &k) {
+        switch (rnd() % 4) {
+        case 0:
+            return doGet(k);
+        case 1:
+            return doDelete(k);
+        default:
+            {
+                uint64_t delta = 1 + rnd() % 100;
+                uint64_t initial = rnd() % 100;
+                uint64_t expected = k.exists ? k.number + delta : initial;
+                uint64_t value = expected;
+                if (!doIncr(k, delta, initial, value)) {
+                    return false;
+                }
+                if (value != expected) {
+                    inconsistent(k.name, "incr returned %" PRIu64
+                                 ", expected %" PRIu64, value, expected);
+                }
+                k.number = value;
+                return true;
+            }
+        }
+    }
+
+    static string toJson(const map<string, uint64_t> &fields) {
+        string json("{");
+        map<string, uint64_t>::const_iterator iter;
+        for (iter = fields.begin(); iter != fields.end(); ++iter) {
+            char field[64];
+            snprintf(field, sizeof(field), "%s\"%s\":%" PRIu64,
+                     iter == fields.begin() ? "" : ",",
+                     iter->first.c_str(), iter->second);
+            json += field;
+        }
+        return json + "}";
+    }
+
+    bool jsonOp(Key &k) {
+        char path[16];
+        snprintf(path, sizeof(path), "f%u",
+                 static_cast<unsigned int>(rnd() % 8));
+        Response rsp;
+
+        switch (rnd() % 5) {
+        case 0:
+            {
+                map<string, uint64_t> fields;
+                uint64_t cas = k.cas;
+                fields[path] = rnd() % 1000;
+                if (!doSet(k, toJson(fields), 0)) {
+                    return false;
+                }
+                if (k.cas != cas) {
+                    k.fields = fields;
+                }
+                return true;
+            }
+        case 1:
+            return doDelete(k);
+        case 2:
+            {
+                char value[32];
+                uint64_t number = rnd() % 1000;
+                snprintf(value, sizeof(value), "%" PRIu64, number);
+                if (!call(PROTOCOL_BINARY_CMD_SUBDOC_DICT_UPSERT, k.name,
+                          subdocExtras(path), string(path) + value, 0, rsp)) {
+                    return false;
+                }
+                if (expect(k, "subdoc upsert", rsp, k.exists ?
+                           PROTOCOL_BINARY_RESPONSE_SUCCESS :
+                           PROTOCOL_BINARY_RESPONSE_KEY_ENOENT) &&
+                    k.exists) {
+                    k.cas = rsp.cas;
+                    k.fields[path] = number;
+                }
+                return true;
+            }
+        default:
+            {
+                if (!call(PROTOCOL_BINARY_CMD_SUBDOC_GET, k.name,
+                          subdocExtras(path), path, 0, rsp)) {
+                    return false;
+                }
+                map<string, uint64_t>::iterator iter = k.fields.find(path);
+                uint16_t status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+                if (!k.exists) {
+                    status = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+                } else if (iter == k.fields.end()) {
+                    status = PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_ENOENT;
+                }
+                if (rsp.status != status) {
+                    inconsistent(k.name, "subdoc get %s returned 0x%02x, "
+                                 "expected 0x%02x", path, rsp.status, status);
+                } else if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS &&
+                           strtoull(rsp.value.c_str(), NULL, 10) !=
+                           iter->second) {
+                    inconsistent(k.name, "subdoc get %s returned %s, "
+                                 "expected %" PRIu64, path,
+                                 rsp.value.c_str(), iter->second);
+                }
+                return true;
+            }
+        }
+    }
+
+    /** Bump the counter all the threads share */
+    bool incrShared(void) {
+        Key k(counter, Counter);
+        uint64_t value;
+        if (!doIncr(k, 1, 1, value)) {
+            return false;
+        }
+        ++increments;
+        return true;
+    }
+
+    const string host;
+    const string port;
+    const int id;
+    const int nkeys;
+    const string counter;
+    int sock;
+    uint32_t opaque;
+    std::mt19937 rnd;
+    vector<Key> keys;
+    std::atomic<bool> running;
+};
+
+extern "C" {
+    static void verifier_main(void *arg) {
+        Verifier *v = reinterpret_cast<Verifier*>(arg);
+        v->main();
+    }
+}
+
+static int verify(const char *host, const char *port, int threads,
+                  int nkeys, int duration)
+{
+    const string counter("mcbasher:shared");
+    vector<Verifier*> verifiers;
+    vector<cb_thread_t> tids;
+    uint64_t start, value;
+
+    Verifier control(host, port, -1, 0, counter);
+    if (!control.deleteCounter() || !control.readCounter(start)) {
+        fprintf(stderr, "Failed to connect to %s:%s\n", host, port);
+        return 1;
+    }
+
+    for (int ii = 0; ii < threads; ++ii) {
+        cb_thread_t tid;
+        Verifier *v = new Verifier(host, port, ii, nkeys, counter);
+        cb_assert(cb_create_thread(&tid, verifier_main, v, 0) == 0);
+        verifiers.push_back(v);
+        tids.push_back(tid);
+    }
+
+    uint64_t last = 0, total = 0, errors = 0;
+    for (int sec = 1; sec <= duration; ++sec) {
+        sleep(1);
+        total = errors = 0;
+        for (size_t ii = 0; ii < verifiers.size(); ++ii) {
+            total += verifiers[ii]->ops.load();
+            errors += verifiers[ii]->errors.load();
+        }
+        fprintf(stdout, "%4d s: %" PRIu64 " ops/s, %" PRIu64
+                " inconsistencies\n", sec, total - last, errors);
+        fflush(stdout);
+        last = total;
+    }
+
+    uint64_t increments = 0;
+    total = errors = 0;
+    for (size_t ii = 0; ii < verifiers.size(); ++ii) {
+        verifiers[ii]->stop();
+        cb_assert(cb_join_thread(tids[ii]) == 0);
+        total += verifiers[ii]->ops.load();
+        errors += verifiers[ii]->errors.load();
+        increments += verifiers[ii]->increments;
+        delete verifiers[ii];
+    }
+
+    if (!control.readCounter(value)) {
+        fprintf(stderr, "Failed to read %s\n", counter.c_str());
+        ++errors;
+    } else if (value != increments) {
+        fprintf(stderr, "%s is %" PRIu64 " after %" PRIu64 " increments\n",
+                counter.c_str(), value, increments);
+        ++errors;
+    }
+
+    fprintf(stdout, "%" PRIu64 " ops in %d s (%" PRIu64 " ops/s), %" PRIu64
+            " inconsistencies\n", total, duration, total / duration, errors);
+    return errors == 0 ? 0 : 1;
+}
 
 /**
  * Program entry point. Connect to a memcached server and use the binary
@@ -416,12 +1036,16 @@ int main(int argc, char **argv)
     const char *port = "11211";
     const char *host = NULL;
     int connections = 10;
+    bool verifying = false;
+    int threads = 8;
+    int nkeys = 100;
+    int duration = 10;
     char *ptr;
 
     /* Initialize the socket subsystem */
     cb_initialize_sockets();
 
-    while ((cmd = getopt(argc, argv, "h:p:c:")) != EOF) {
+    while ((cmd = getopt(argc, argv, "h:p:c:Vt:k:d:")) != EOF) {
         switch (cmd) {
         case 'h' :
             host = optarg;
@@ -437,9 +1061,23 @@ int main(int argc, char **argv)
         case 'c' :
             connections = atoi(optarg);
             break;
+        case 'V' :
+            verifying = true;
+            break;
+        case 't' :
+            threads = atoi(optarg);
+            break;
+        case 'k' :
+            nkeys = atoi(optarg);
+            break;
+        case 'd' :
+            duration = atoi(optarg);
+            break;
         default:
             fprintf(stderr,
-                    "Usage mcbasher [-h host[:port]] [-p port] [-c connections]*\n");
+                    "Usage mcbasher [-h host[:port]] [-p port] [-c connections]\n"
+                    "               [-V [-t threads] [-k keys per thread]"
+                    " [-d seconds]]\n");
             return 1;
         }
     }
@@ -448,6 +1086,15 @@ int main(int argc, char **argv)
         host = "localhost";
     }
 
+    if (verifying) {
+        if (threads <= 0 || nkeys <= 0 || duration <= 0) {
+            fprintf(stderr, "The threads, keys and duration must be "
+                    "positive\n");
+            return 1;
+        }
+        return verify(host, port, threads, nkeys, duration);
+    }
+
     list<Connection*> conns;
     for (int ii = 0; ii < connections; ++ii) {
         Connection *c;
@@ -16,8 +16,28 @@
  */
 
 /*
- * mcbench is a program used to test the single frontend thread performance
- * on a memcached service
+ * mcbench is a load generator for a memcached service. It runs a number
+ * of threads, each driving a number of connections with a mix of binary
+ * GET and SET requests:
+ *
+ *  - the keys are picked from a keyspace with a uniform, zipfian or
+ *    hotspot distribution, and the values of the SETs have a fixed size,
+ *    a size picked uniformly from a range or from a weighted list
+ *  - every connection keeps up to the pipeline depth requests in flight
+ *  - by default the connections send their next request as soon as
+ *    there's room in the pipeline (closed loop). With a rate the requests
+ *    are scheduled at fixed intervals instead (open loop), and the
+ *    latency of a request is measured from when it should have been
+ *    sent, so a stalled server shows up in the latencies rather than
+ *    just in the throughput (the "coordinated omission" of closed loop
+ *    benchmarks)
+ *  - the GETs may be sent in batches of GETKQ ended by a NOOP (-b), be
+ *    SUBDOC_GETs of a path in JSON documents written by the SETs (-j),
+ *    and the connections may use TLS (-S)
+ *
+ * The results (throughput, hit ratio and latency percentiles of each
+ * operation) are written as JSON to stdout or to the given file, so they
+ * can be compared across runs.
  */
 #include "config.h"
 
@@ -28,127 +48,293 @@
 #include <cstdio>
 #include <string>
 #include <string.h>
-#include <list>
+#include <deque>
 #include <vector>
+#include <memory>
 #include <iostream>
 #include <stdint.h>
-#include <cassert>
+#include <inttypes.h>
 #include <sys/types.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <cerrno>
+#include <cmath>
 #include <chrono>
 #include <thread>
 #include <atomic>
+#include <random>
 #include <platform/platform.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 
+#include "programs/bench_results.h"
 
+typedef std::chrono::steady_clock Clock;
+typedef Clock::time_point TimePoint;
 
-class Connection;
-static void thread_main(Connection *c);
-
-
-class Connection {
+/**
+ * Picks the keys of the requests, as a number in [0, nkeys). Shared by
+ * all the threads, which bring their own random generator.
+ */
+class KeyDistribution {
 public:
-    Connection(const std::string &_host, const std::string &_port,
-               uint8_t *sndbuf, size_t sndbufsz) :
-        sendBuffer(sndbuf), sendBufferSize(sndbufsz),
-        sendBufferOffset(0),
-        sock(INVALID_SOCKET), host(_host), port(_port), currentOps(0)
+    KeyDistribution() : type(UNIFORM), nkeys(0), theta(0.99),
+        hotKeys(0), hotOps(0), zetan(0), alpha(0), eta(0)
     {
-        currentOps.store(0, std::memory_order_release);
-        recvBuffer.reserve(2 * 1024 * 1024);
     }
 
-    void start() {
-        running.store(true, std::memory_order_release);
-        tid = std::thread(thread_main, this);
+    /**
+     * Set up the distribution from its description: "uniform",
+     * "zipf[:theta]" or "hotspot[:key fraction[:op fraction]]"
+     * @return false if the description is invalid
+     */
+    bool parse(const std::string &spec, uint64_t keys) {
+        nkeys = keys;
+        description = spec;
+        if (spec == "uniform") {
+            type = UNIFORM;
+            return nkeys > 0;
+        } else if (spec.compare(0, 4, "zipf") == 0) {
+            type = ZIPF;
+            if (spec.size() > 4) {
+                if (spec[4] != ':') {
+                    return false;
+                }
+                theta = atof(spec.c_str() + 5);
+            }
+            if (theta <= 0 || theta >= 1 || nkeys < 2) {
+                return false;
+            }
+            initZipf();
+            return true;
+        } else if (spec.compare(0, 7, "hotspot") == 0) {
+            double keyFraction = 0.1;
+            type = HOTSPOT;
+            hotOps = 0.9;
+            if (spec.size() > 7) {
+                if (spec[7] != ':' ||
+                    sscanf(spec.c_str() + 8, "%lf:%lf", &keyFraction,
+                           &hotOps) < 1) {
+                    return false;
+                }
+            }
+            if (keyFraction <= 0 || keyFraction > 1 ||
+                hotOps < 0 || hotOps > 1 || nkeys == 0) {
+                return false;
+            }
+            hotKeys = (uint64_t)(keyFraction * nkeys);
+            if (hotKeys == 0) {
+                hotKeys = 1;
+            }
+            return true;
+        }
+        return false;
     }
 
+    uint64_t next(std::mt19937_64 &rnd) const {
+        std::uniform_real_distribution<double> real(0, 1);
 
-    void stop() {
-        running.store(false, std::memory_order_release);
-        tid.join();
-
+        switch (type) {
+        case UNIFORM:
+            return std::uniform_int_distribution<uint64_t>(0, nkeys - 1)(rnd);
+        case ZIPF:
+            return nextZipf(real(rnd));
+        case HOTSPOT:
+            if (hotKeys == nkeys || real(rnd) < hotOps) {
+                return std::uniform_int_distribution<uint64_t>(0, hotKeys - 1)(rnd);
+            }
+            return std::uniform_int_distribution<uint64_t>(hotKeys, nkeys - 1)(rnd);
+        }
+        return 0;
     }
 
-    size_t getOpsPerSec() const {
-        using namespace std::chrono;
+    const std::string &getDescription() const {
+        return description;
+    }
 
-        std::chrono::time_point<std::chrono::steady_clock> now;
-        if (running) {
-            now = steady_clock::now();
-        } else {
-            now = stopTime;
+private:
+    /*
+     * The zipfian generator of Gray et al., "Quickly Generating
+     * Billion-Record Synthetic Databases" (the one YCSB uses): key 0 is
+     * the most popular one, key 1 the next and so forth.
+     */
+    void initZipf() {
+        double zeta2 = 1 + std::pow(0.5, theta);
+        zetan = 0;
+        for (uint64_t ii = 1; ii <= nkeys; ++ii) {
+            zetan += 1 / std::pow((double)ii, theta);
         }
+        alpha = 1 / (1 - theta);
+        eta = (1 - std::pow(2.0 / nkeys, 1 - theta)) / (1 - zeta2 / zetan);
+    }
 
-        auto delta = duration_cast<seconds>(now - startTime).count();
-        if (delta == 0) {
-            return currentOps.load(std::memory_order_acquire);
-        } else {
-            return currentOps.load(std::memory_order_acquire) / delta;
+    uint64_t nextZipf(double u) const {
+        double uz = u * zetan;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, theta)) {
+            return 1;
         }
+        uint64_t key = (uint64_t)(nkeys * std::pow(eta * u - eta + 1, alpha));
+        return key < nkeys ? key : nkeys - 1;
     }
 
-    size_t getDuration() const {
-        using namespace std::chrono;
-        return duration_cast<seconds>(stopTime - startTime).count();
+    enum { UNIFORM, ZIPF, HOTSPOT } type;
+    std::string description;
+    uint64_t nkeys;
+    double theta;
+    uint64_t hotKeys;
+    double hotOps;
+    double zetan;
+    double alpha;
+    double eta;
+};
+
+/**
+ * Picks the size of the values of the SETs: "size", "min-max" (uniform)
+ * or "size:weight,size:weight,..."
+ */
+class SizeDistribution {
+public:
+    SizeDistribution() : minSize(0), maxSize(0) {
     }
 
-    size_t getTotalOps() const {
-        return currentOps.load(std::memory_order_acquire);
+    bool parse(const std::string &spec) {
+        unsigned long a, b;
+        int n;
+
+        description = spec;
+        sizes.clear();
+        if (spec.find(':') != std::string::npos) {
+            std::vector<double> weights;
+            const char *ptr = spec.c_str();
+            double w;
+            while (sscanf(ptr, "%lu:%lf%n", &a, &w, &n) == 2 && w >= 0) {
+                sizes.push_back(a);
+                weights.push_back(w);
+                ptr += n;
+                if (*ptr == '\0') {
+                    break;
+                } else if (*ptr++ != ',') {
+                    return false;
+                }
+            }
+            if (*ptr != '\0' || sizes.empty()) {
+                return false;
+            }
+            weighted = std::discrete_distribution<size_t>(weights.begin(),
+                                                          weights.end());
+            minSize = maxSize = sizes[0];
+            for (auto s : sizes) {
+                minSize = std::min(minSize, s);
+                maxSize = std::max(maxSize, s);
+            }
+        } else if (sscanf(spec.c_str(), "%lu-%lu%n", &a, &b, &n) == 2 &&
+                   spec[n] == '\0' && a <= b) {
+            minSize = a;
+            maxSize = b;
+        } else if (sscanf(spec.c_str(), "%lu%n", &a, &n) == 1 &&
+                   spec[n] == '\0') {
+            minSize = maxSize = a;
+        } else {
+            return false;
+        }
+        return maxSize <= 20 * 1024 * 1024;
     }
 
-    ~Connection() {
-        if (sock != INVALID_SOCKET) {
-            closesocket(sock);
+    size_t next(std::mt19937_64 &rnd) const {
+        if (!sizes.empty()) {
+            return sizes[weighted(rnd)];
+        } else if (minSize == maxSize) {
+            return minSize;
         }
+        return std::uniform_int_distribution<size_t>(minSize, maxSize)(rnd);
     }
 
-protected:
-    friend void thread_main(Connection *c);
+    size_t getMax() const {
+        return maxSize;
+    }
 
+    const std::string &getDescription() const {
+        return description;
+    }
 
-    void run(void) {
-        startTime = std::chrono::steady_clock::now();
+private:
+    std::string description;
+    std::vector<size_t> sizes;
+    mutable std::discrete_distribution<size_t> weighted;
+    size_t minSize;
+    size_t maxSize;
+};
 
-        while (running.load(std::memory_order_acquire)) {
-            if (sock == INVALID_SOCKET) {
-                connect();
-            }
+struct Options {
+    Options() : host("localhost"), port("12000"), duration(60), threads(1),
+        connections(1), getRatio(0.9), keys(100000), pipeline(1), rate(0),
+        preload(false), batch(1), ssl(NULL)
+    {
+        keyDistribution.parse("uniform", keys);
+        sizeDistribution.parse("256");
+    }
 
-            while (sock != INVALID_SOCKET && running.load(std::memory_order_acquire)) {
-                struct pollfd fds[1];
-                fds[0].fd = sock;
-                if (toSend == 0) {
-                    fds[0].events = POLLIN;
-                } else {
-                    fds[0].events = POLLIN | POLLOUT;
-                }
-                cb_assert(poll(fds, 1, -1) != -1);
+    std::string host;
+    std::string port;
+    int duration;
+    int threads;
+    int connections;
+    double getRatio;
+    uint64_t keys;
+    KeyDistribution keyDistribution;
+    SizeDistribution sizeDistribution;
+    int pipeline;
+    double rate; /* requests per second over all connections, 0 for none */
+    bool preload;
+    std::string output;
+    int batch; /* keys per GETKQ batch, 1 for plain GETs */
+    std::string jsonPath; /* SUBDOC_GET this path instead of GETs */
+    SSL_CTX *ssl;
+};
 
-                if (fds[0].revents & POLLIN) {
-                    drainInput();
-                } else if (fds[0].revents & POLLOUT) {
-                    doSendData();
-                } else {
-                    // what is this?
-                    abort();
-                }
-            }
-        }
-        stopTime = std::chrono::steady_clock::now();
+/** The results of a thread (or of all of them) */
+struct Results {
+    Results() : getHits(0), getMisses(0), sets(0), errors(0) {
+    }
+
+    void merge(const Results &other) {
+        getLatency.merge(other.getLatency);
+        setLatency.merge(other.setLatency);
+        getHits += other.getHits;
+        getMisses += other.getMisses;
+        sets += other.sets;
+        errors += other.errors;
     }
 
+    Histogram getLatency; /* nanoseconds */
+    Histogram setLatency;
+    uint64_t getHits;
+    uint64_t getMisses;
+    uint64_t sets;
+    uint64_t errors;
+};
+
+class Connection {
+public:
+    Connection() : sock(INVALID_SOCKET), ssl(NULL), sendOffset(0),
+        retry(Clock::now())
+    {
+    }
 
+    ~Connection() {
+        disconnect();
+    }
 
     /**
      * Try to connect to the server
      * @return false if we failed to connect to the server
      */
-    bool connect(void)
-    {
+    bool connect(const Options &options) {
         struct addrinfo *ai = NULL;
         struct addrinfo hints;
 
@@ -157,177 +343,675 @@ protected:
         hints.ai_protocol = IPPROTO_TCP;
         hints.ai_socktype = SOCK_STREAM;
 
-        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &ai) != 0) {
+        if (getaddrinfo(options.host.c_str(), options.port.c_str(),
+                        &hints, &ai) != 0) {
             return false;
         }
 
-        struct addrinfo *e = ai;
-        do {
+        for (struct addrinfo *e = ai; e != NULL; e = e->ai_next) {
             if ((sock = socket(e->ai_family, e->ai_socktype,
-                               e->ai_protocol)) != -1) {
-                if (::connect(sock, ai->ai_addr, ai->ai_addrlen) == -1) {
-                    close(sock);
-                    sock = -1;
+                               e->ai_protocol)) != INVALID_SOCKET) {
+                if (::connect(sock, e->ai_addr, e->ai_addrlen) == 0) {
+                    break;
                 }
+                closesocket(sock);
+                sock = INVALID_SOCKET;
             }
-            if (sock == -1) {
-                e = e->ai_next;
-            } else {
-                break;
-            }
-        } while (e) ;
+        }
+        freeaddrinfo(ai);
 
+        if (sock == INVALID_SOCKET) {
+            return false;
+        }
+        int flag = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&flag,
+                   sizeof(flag));
+
+        /* The handshakes are done before the socket goes non-blocking */
+        if (options.ssl != NULL) {
+            ssl = SSL_new(options.ssl);
+            if (ssl == NULL || SSL_set_fd(ssl, sock) != 1 ||
+                SSL_connect(ssl) != 1) {
+                ERR_print_errors_fp(stderr);
+                disconnect();
+                return false;
+            }
+        }
+        if (!options.jsonPath.empty() && !hello()) {
+            disconnect();
+            return false;
+        }
         fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        return true;
+    }
 
-        freeaddrinfo(ai);
+    /**
+     * Send data to the server, through TLS if enabled. Fails with
+     * EWOULDBLOCK when the socket (or the TLS connection) isn't ready.
+     */
+    ssize_t write(const void *buf, size_t len) {
+        if (ssl == NULL) {
+            return ::send(sock, buf, len, 0);
+        }
+        int nw = SSL_write(ssl, buf, (int)len);
+        return nw > 0 ? nw : sslError(nw);
+    }
+
+    /** Receive data from the server, same as write() */
+    ssize_t read(void *buf, size_t len) {
+        if (ssl == NULL) {
+            return ::recv(sock, buf, len, 0);
+        }
+        int nr = SSL_read(ssl, buf, (int)len);
+        return nr > 0 ? nr : sslError(nr);
+    }
+
+    void disconnect() {
+        if (ssl != NULL) {
+            SSL_free(ssl);
+            ssl = NULL;
+        }
+        if (sock != INVALID_SOCKET) {
+            closesocket(sock);
+            sock = INVALID_SOCKET;
+        }
+        sendBuffer.clear();
+        recvBuffer.clear();
+        sendOffset = 0;
+    }
+
+    struct Request {
+        TimePoint start;
+        uint8_t opcode;
+        /* A GETKQ batch: the number of keys, and of the answers so far */
+        uint32_t batch;
+        uint32_t answered;
+    };
+
+    SOCKET sock;
+    SSL *ssl;
+    std::vector<uint8_t> sendBuffer;
+    size_t sendOffset;
+    std::vector<uint8_t> recvBuffer;
+    /** The requests sent (or queued in the send buffer), in order */
+    std::deque<Request> pending;
+    /** Open loop: when the requests not sent yet were due */
+    std::deque<TimePoint> due;
+    TimePoint nextDue;
+    /** When to try to connect again */
+    TimePoint retry;
+
+private:
+    ssize_t sslError(int ret) {
+        switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EWOULDBLOCK;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            errno = ECONNRESET;
+            return -1;
+        }
+    }
 
-        sendBufferOffset = 0;
-        toSend = sendBufferSize - sendBufferOffset;
+    bool readFully(void *buf, size_t len) {
+        uint8_t *ptr = static_cast<uint8_t *>(buf);
+        while (len > 0) {
+            ssize_t nr = read(ptr, len);
+            if (nr <= 0) {
+                return false;
+            }
+            ptr += nr;
+            len -= nr;
+        }
         return true;
     }
 
-    void drainInput(void) {
-        ssize_t nr;
-        size_t currsize = recvBuffer.size();
-        recvBuffer.resize(2 * 1024 * 1024);
-        while ((nr = recv(sock, recvBuffer.data() + currsize,
-                          (2 * 1024 * 1024) - currsize, 0)) > 0) {
-            /* Parse packets */
-            recvBuffer.resize(currsize + nr);
-            size_t size = recvBuffer.size();
-            uint8_t *curr = recvBuffer.data();
-
-            while (size > 24) {
-                protocol_binary_response_no_extras *res;
-                res = reinterpret_cast<protocol_binary_response_no_extras *>(curr);
-                assert(res->message.header.response.magic == 0x81);
-                uint32_t bodylen = ntohl(res->message.header.response.bodylen);
-
-                if (size < (24 + bodylen)) {
+    /**
+     * Enable the datatype, so the SETs can store JSON documents (which
+     * is what SUBDOC_GET wants)
+     */
+    bool hello() {
+        static const char agent[] = "mcbench";
+        protocol_binary_request_header req;
+        protocol_binary_response_header res;
+        uint16_t feature = htons(PROTOCOL_BINARY_FEATURE_DATATYPE);
+        std::vector<uint8_t> packet;
+
+        memset(&req, 0, sizeof(req));
+        req.request.magic = PROTOCOL_BINARY_REQ;
+        req.request.opcode = PROTOCOL_BINARY_CMD_HELLO;
+        req.request.keylen = htons((uint16_t)(sizeof(agent) - 1));
+        req.request.bodylen = htonl((uint32_t)(sizeof(agent) - 1 +
+                                               sizeof(feature)));
+        packet.insert(packet.end(), req.bytes, req.bytes + sizeof(req.bytes));
+        packet.insert(packet.end(), agent, agent + sizeof(agent) - 1);
+        packet.insert(packet.end(), (uint8_t *)&feature,
+                      (uint8_t *)&feature + sizeof(feature));
+
+        for (size_t offset = 0; offset < packet.size(); ) {
+            ssize_t nw = write(packet.data() + offset, packet.size() - offset);
+            if (nw <= 0) {
+                return false;
+            }
+            offset += nw;
+        }
+
+        if (!readFully(res.bytes, sizeof(res.bytes))) {
+            return false;
+        }
+        std::vector<uint8_t> body(ntohl(res.response.bodylen));
+        if (!readFully(body.data(), body.size())) {
+            return false;
+        }
+        if (ntohs(res.response.status) != PROTOCOL_BINARY_RESPONSE_SUCCESS ||
+            body.size() != sizeof(feature) ||
+            memcmp(body.data(), &feature, sizeof(feature)) != 0) {
+            fprintf(stderr, "The server doesn't support the datatype\n");
+            return false;
+        }
+        return true;
+    }
+};
+
+class Worker {
+public:
+    Worker(const Options &_options, int _id, const std::string &_value) :
+        options(_options), id(_id), value(_value),
+        rnd(std::random_device()() + _id), interval(Clock::duration::zero()),
+        running(false), done(false), completed(0), loading(false),
+        preloadKey(_id)
+    {
+        for (int ii = 0; ii < options.connections; ++ii) {
+            connections.push_back(std::unique_ptr<Connection>(new Connection));
+        }
+        if (options.rate > 0) {
+            double perConnection = options.rate /
+                (options.threads * options.connections);
+            interval = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(1 / perConnection));
+        }
+    }
+
+    void start(bool preload) {
+        loading = preload;
+        running.store(true, std::memory_order_release);
+        tid = std::thread(thread_main, this);
+    }
+
+    void join() {
+        tid.join();
+    }
+
+    void stop() {
+        running.store(false, std::memory_order_release);
+    }
+
+    uint64_t getCompleted() const {
+        return completed.load(std::memory_order_relaxed);
+    }
+
+    const Results &getResults() const {
+        return results;
+    }
+
+    bool isDone() const {
+        return done.load(std::memory_order_acquire);
+    }
+
+private:
+    static void thread_main(Worker *w) {
+        w->run();
+    }
+
+    void run() {
+        TimePoint now = Clock::now();
+        std::vector<struct pollfd> fds(connections.size());
+
+        done.store(false, std::memory_order_release);
+        for (auto &c : connections) {
+            /* Spread the first requests of the connections over an interval */
+            c->nextDue = now + std::chrono::duration_cast<Clock::duration>(
+                interval * std::uniform_real_distribution<double>(0, 1)(rnd));
+            c->due.clear();
+        }
+
+        while (running.load(std::memory_order_acquire)) {
+            int timeout = 100;
+            bool idle = true;
+
+            now = Clock::now();
+            for (size_t ii = 0; ii < connections.size(); ++ii) {
+                Connection &c = *connections[ii];
+                fds[ii].fd = -1;
+                fds[ii].events = 0;
+                fds[ii].revents = 0;
+
+                if (c.sock == INVALID_SOCKET) {
+                    if (now < c.retry) {
+                        continue;
+                    }
+                    if (!c.connect(options)) {
+                        c.retry = now + std::chrono::milliseconds(100);
+                        continue;
+                    }
+                }
+
+                fill(c, now);
+                if (c.sendOffset < c.sendBuffer.size() && !send(c)) {
+                    fail(c);
+                    continue;
+                }
+                if (!c.pending.empty()) {
+                    idle = false;
+                }
+
+                fds[ii].fd = c.sock;
+                fds[ii].events = POLLIN;
+                if (c.sendOffset < c.sendBuffer.size()) {
+                    fds[ii].events |= POLLOUT;
+                }
+                if (options.rate > 0 && !loading) {
+                    timeout = std::min(timeout, millisUntil(c.nextDue, now));
+                }
+            }
+
+            if (loading && idle && preloadKey >= options.keys) {
+                break;
+            }
+
+            if (poll(fds.data(), fds.size(), timeout) == -1 && errno != EINTR) {
+                perror("poll");
+                abort();
+            }
+
+            now = Clock::now();
+            for (size_t ii = 0; ii < connections.size(); ++ii) {
+                Connection &c = *connections[ii];
+                if (fds[ii].fd == -1 || fds[ii].revents == 0) {
+                    continue;
+                }
+                if ((fds[ii].revents & POLLOUT) && !send(c)) {
+                    fail(c);
+                } else if ((fds[ii].revents & (POLLIN | POLLERR | POLLHUP)) &&
+                           !receive(c, now)) {
+                    fail(c);
+                }
+            }
+        }
+
+        for (auto &c : connections) {
+            /* Whatever is still in flight wasn't measured */
+            c->pending.clear();
+            c->disconnect();
+        }
+        done.store(true, std::memory_order_release);
+    }
+
+    /*
+     * Rounded down: we rather spin through the last millisecond than send
+     * late, which would count against the server
+     */
+    static int millisUntil(TimePoint when, TimePoint now) {
+        if (when <= now) {
+            return 0;
+        }
+        return (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+            when - now).count();
+    }
+
+    /**
+     * Queue the requests the connection has room for in its pipeline (the
+     * ones which are due in open loop mode)
+     */
+    void fill(Connection &c, TimePoint now) {
+        if (options.rate > 0 && !loading) {
+            while (c.nextDue <= now) {
+                c.due.push_back(c.nextDue);
+                c.nextDue += interval;
+            }
+        }
+
+        while (c.pending.size() < (size_t)options.pipeline) {
+            Connection::Request request;
+            request.batch = 1;
+            request.answered = 0;
+            if (loading) {
+                if (preloadKey >= options.keys) {
                     break;
                 }
+                request.opcode = PROTOCOL_BINARY_CMD_SET;
+                encode(c, request.opcode, preloadKey);
+                preloadKey += options.threads;
+                request.start = now;
+            } else {
+                if (options.rate > 0) {
+                    if (c.due.empty()) {
+                        break;
+                    }
+                    request.start = c.due.front();
+                    c.due.pop_front();
+                } else {
+                    request.start = now;
+                }
+                bool get = std::uniform_real_distribution<double>(0, 1)(rnd) <
+                           options.getRatio;
+                if (!get) {
+                    request.opcode = PROTOCOL_BINARY_CMD_SET;
+                } else if (options.batch > 1) {
+                    request.opcode = PROTOCOL_BINARY_CMD_GETKQ;
+                    request.batch = options.batch;
+                } else if (!options.jsonPath.empty()) {
+                    request.opcode = PROTOCOL_BINARY_CMD_SUBDOC_GET;
+                } else {
+                    request.opcode = PROTOCOL_BINARY_CMD_GET;
+                }
+                for (uint32_t ii = 0; ii < request.batch; ++ii) {
+                    encode(c, request.opcode, options.keyDistribution.next(rnd));
+                }
+                if (request.opcode == PROTOCOL_BINARY_CMD_GETKQ) {
+                    /* The quiet GETs only answer the hits, the NOOP tells
+                     * us the batch is done */
+                    encode(c, PROTOCOL_BINARY_CMD_NOOP, 0);
+                }
+            }
+            c.pending.push_back(request);
+        }
+    }
 
-                size -= (24 + bodylen);
-                currentOps.fetch_add(1, std::memory_order_release);;
-                curr += 24 + bodylen;
+    void encode(Connection &c, uint8_t opcode, uint64_t keyid) {
+        static const char jsonHead[] = "{\"pad\":\"";
+        char key[32];
+        char jsonTail[64];
+        int keylen = 0;
+        int taillen = 0;
+        size_t vallen = 0;
+        uint8_t extlen = 0;
+        uint8_t datatype = PROTOCOL_BINARY_RAW_BYTES;
+        protocol_binary_request_set req;
+
+        if (opcode != PROTOCOL_BINARY_CMD_NOOP) {
+            keylen = snprintf(key, sizeof(key), "mcbench:%" PRIu64, keyid);
+        }
+        if (opcode == PROTOCOL_BINARY_CMD_SET) {
+            vallen = options.sizeDistribution.next(rnd);
+            extlen = 8;
+            if (!options.jsonPath.empty()) {
+                /* {"pad":"xxx...","<path>":<keyid>}, as close to the size
+                 * as the overhead allows */
+                taillen = snprintf(jsonTail, sizeof(jsonTail), "\",\"%s\":%"
+                                   PRIu64 "}", options.jsonPath.c_str(),
+                                   keyid);
+                size_t overhead = sizeof(jsonHead) - 1 + taillen;
+                vallen = std::max(vallen, overhead) - overhead;
+                datatype = PROTOCOL_BINARY_DATATYPE_JSON;
             }
+        } else if (opcode == PROTOCOL_BINARY_CMD_SUBDOC_GET) {
+            extlen = 3;
+        }
+
+        memset(&req, 0, sizeof(req));
+        req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+        req.message.header.request.opcode = opcode;
+        req.message.header.request.keylen = htons((uint16_t)keylen);
+        req.message.header.request.extlen = extlen;
+        req.message.header.request.datatype = datatype;
+        req.message.body.flags = 0;
+        req.message.body.expiration = 0;
 
-            /* repack the buffer */
-            memmove(recvBuffer.data(), curr, size);
-            currsize = size;
-            recvBuffer.resize(2 * 1024 * 1024);
+        if (opcode == PROTOCOL_BINARY_CMD_SUBDOC_GET) {
+            protocol_binary_request_subdocument *subdoc =
+                reinterpret_cast<protocol_binary_request_subdocument *>(&req);
+            subdoc->message.extras.pathlen =
+                htons((uint16_t)options.jsonPath.size());
+            subdoc->message.extras.subdoc_flags = 0;
+            vallen = options.jsonPath.size();
         }
+        req.message.header.request.bodylen =
+            htonl((uint32_t)(extlen + keylen + vallen +
+                             (taillen ? sizeof(jsonHead) - 1 + taillen : 0)));
 
-        recvBuffer.resize(currsize);
+        c.sendBuffer.insert(c.sendBuffer.end(), req.bytes,
+                            req.bytes + sizeof(req.message.header) + extlen);
+        c.sendBuffer.insert(c.sendBuffer.end(), key, key + keylen);
+        if (opcode == PROTOCOL_BINARY_CMD_SUBDOC_GET) {
+            c.sendBuffer.insert(c.sendBuffer.end(), options.jsonPath.begin(),
+                                options.jsonPath.end());
+            return;
+        }
+        if (taillen) {
+            c.sendBuffer.insert(c.sendBuffer.end(), jsonHead,
+                                jsonHead + sizeof(jsonHead) - 1);
+        }
+        c.sendBuffer.insert(c.sendBuffer.end(), value.data(),
+                            value.data() + vallen);
+        c.sendBuffer.insert(c.sendBuffer.end(), jsonTail, jsonTail + taillen);
+    }
 
-        if ((nr == -1 && errno != EWOULDBLOCK) || nr == 0) {
-            close(sock);
-            sock = -1;
+    bool send(Connection &c) {
+        while (c.sendOffset < c.sendBuffer.size()) {
+            ssize_t nw = c.write(c.sendBuffer.data() + c.sendOffset,
+                                 c.sendBuffer.size() - c.sendOffset);
+            if (nw == -1) {
+                return errno == EWOULDBLOCK || errno == EAGAIN;
+            }
+            c.sendOffset += nw;
         }
+        c.sendBuffer.clear();
+        c.sendOffset = 0;
+        return true;
     }
 
-    void doSendData(void) {
-        ssize_t nw;
-        cb_assert(toSend > 0);
+    bool receive(Connection &c, TimePoint now) {
+        for (;;) {
+            size_t used = c.recvBuffer.size();
+            c.recvBuffer.resize(used + 64 * 1024);
+            ssize_t nr = c.read(c.recvBuffer.data() + used,
+                                c.recvBuffer.size() - used);
+            if (nr <= 0) {
+                c.recvBuffer.resize(used);
+                return nr == -1 && (errno == EWOULDBLOCK || errno == EAGAIN);
+            }
+            c.recvBuffer.resize(used + nr);
 
-        while ((nw = send(sock, sendBuffer+sendBufferOffset, toSend, 0)) > 0) {
-            sendBufferOffset += nw;
-            toSend = sendBufferSize - sendBufferOffset;
-            if (toSend == 0) {
-                sendBufferOffset = 0;
-                toSend = sendBufferSize - sendBufferOffset;
+            size_t offset = 0;
+            while (c.recvBuffer.size() - offset >=
+                   sizeof(protocol_binary_response_header)) {
+                protocol_binary_response_header res;
+                memcpy(&res, c.recvBuffer.data() + offset, sizeof(res));
+                size_t total = sizeof(res) + ntohl(res.response.bodylen);
+                if (res.response.magic != PROTOCOL_BINARY_RES ||
+                    c.pending.empty()) {
+                    fprintf(stderr, "Unexpected data from the server\n");
+                    return false;
+                }
+                if (c.recvBuffer.size() - offset < total) {
+                    break;
+                }
+                complete(c, res.response.opcode, ntohs(res.response.status),
+                         now);
+                offset += total;
             }
+            c.recvBuffer.erase(c.recvBuffer.begin(),
+                               c.recvBuffer.begin() + offset);
         }
+    }
+
+    void complete(Connection &c, uint8_t opcode, uint16_t status,
+                  TimePoint now) {
+        Connection::Request &request = c.pending.front();
+        uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            now - request.start).count();
 
-        if (nw == -1 && errno != EWOULDBLOCK) {
-            close(sock);
-            sock = -1;
+        if (request.opcode == PROTOCOL_BINARY_CMD_GETKQ) {
+            if (opcode == PROTOCOL_BINARY_CMD_GETKQ) {
+                /* One of the keys of the batch, more to come */
+                if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                    ++results.getHits;
+                } else {
+                    ++results.errors;
+                }
+                ++request.answered;
+                return;
+            }
+            /* The NOOP: the keys all get the latency of the batch, and the
+             * ones not answered were misses */
+            for (uint32_t ii = 0; ii < request.batch; ++ii) {
+                results.getLatency.add(latency);
+            }
+            results.getMisses += request.batch - request.answered;
+        } else if (!loading) {
+            if (request.opcode != PROTOCOL_BINARY_CMD_SET) {
+                results.getLatency.add(latency);
+                if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                    ++results.getHits;
+                } else if (status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT) {
+                    ++results.getMisses;
+                } else {
+                    ++results.errors;
+                }
+            } else {
+                results.setLatency.add(latency);
+                if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                    ++results.sets;
+                } else {
+                    ++results.errors;
+                }
+            }
         }
+        completed.fetch_add(request.batch, std::memory_order_relaxed);
+        c.pending.pop_front();
     }
 
-    uint8_t *sendBuffer;
-    size_t toSend;
-    size_t sendBufferSize;
-    size_t sendBufferOffset;
+    void fail(Connection &c) {
+        if (!loading) {
+            for (const auto &request : c.pending) {
+                results.errors += request.batch;
+            }
+        }
+        c.pending.clear();
+        c.disconnect();
+        c.retry = Clock::now() + std::chrono::milliseconds(100);
+    }
 
-    std::vector<uint8_t> recvBuffer;
-    int sock;
-    const std::string host;
-    const std::string port;
-    std::chrono::time_point<std::chrono::steady_clock> startTime;
-    std::chrono::time_point<std::chrono::steady_clock> stopTime;
-    std::atomic<size_t> currentOps;
+    const Options &options;
+    const int id;
+    const std::string &value;
+    std::mt19937_64 rnd;
+    std::vector<std::unique_ptr<Connection> > connections;
+    Clock::duration interval;
     std::thread tid;
     std::atomic<bool> running;
+    std::atomic<bool> done;
+    std::atomic<uint64_t> completed;
+    Results results;
+    bool loading;
+    uint64_t preloadKey;
 };
 
-static void thread_main(Connection *c)
-{
-    c->run();
+static void print_results(FILE *fp, const Options &options,
+                          const Results &results, double elapsed) {
+    uint64_t gets = results.getLatency.getCount();
+    uint64_t sets = results.setLatency.getCount();
+    ResultsWriter out(fp);
+
+    out.begin("config");
+    out.add("host", options.host);
+    out.add("port", options.port);
+    out.add("threads", options.threads);
+    out.add("connections", options.connections);
+    out.add("duration", options.duration);
+    out.add("get_ratio", options.getRatio, 3);
+    out.add("keys", options.keys);
+    out.add("key_distribution", options.keyDistribution.getDescription());
+    out.add("value_size", options.sizeDistribution.getDescription());
+    out.add("pipeline", options.pipeline);
+    out.add("rate", options.rate, 0);
+    out.add("preload", options.preload);
+    out.add("batch", options.batch);
+    out.add("json_path", options.jsonPath);
+    out.add("ssl", options.ssl != NULL);
+    out.end();
+    out.add("elapsed", elapsed, 3);
+    out.add("ops", gets + sets);
+    out.add("ops_per_sec", (gets + sets) / elapsed, 0);
+    out.add("errors", results.errors);
+    out.begin("get");
+    out.add("ops", gets);
+    out.add("hits", results.getHits);
+    out.add("misses", results.getMisses);
+    out.addLatency("latency_usec", results.getLatency);
+    out.end();
+    out.begin("set");
+    out.add("ops", sets);
+    out.addLatency("latency_usec", results.setLatency);
+    out.end();
+    out.finish();
 }
 
-static void buildSetStream(std::vector<uint8_t> &vector, size_t size) {
-    /* preformat a buffer that's roughly 2MB big */
-    vector.reserve(2 * 1024 * 1024);
-    while (vector.size() < (2 * 1024 * 1024)) {
-        protocol_binary_request_set req;
-        memset(&req, 0, sizeof(req));
+/**
+ * Run the workers until they're done (preload) or for the duration,
+ * showing the throughput on stderr every second
+ * @return the number of seconds they ran
+ */
+static double run_workers(std::vector<std::unique_ptr<Worker> > &workers,
+                          bool preload, int duration) {
+    TimePoint start = Clock::now();
+    TimePoint end = start + std::chrono::seconds(duration);
+    uint64_t last = 0;
 
-        req.message.header.request.magic = PROTOCOL_BINARY_REQ;
-        req.message.header.request.opcode = PROTOCOL_BINARY_CMD_SET;
-        req.message.header.request.keylen = htons(3);
-        req.message.header.request.extlen = 8;
-        req.message.header.request.bodylen = htonl(11 + size);
-        req.message.body.flags = 0;
-        req.message.body.expiration = 0;
+    for (auto &w : workers) {
+        last += w->getCompleted();
+        w->start(preload);
+    }
 
-        for (size_t ii = 0; ii < sizeof(req.bytes); ++ii) {
-            vector.push_back(req.bytes[ii]);
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        uint64_t total = 0;
+        bool done = true;
+        for (auto &w : workers) {
+            total += w->getCompleted();
+            done = done && w->isDone();
         }
+        fprintf(stderr, "\r%s: %" PRIu64 " ops/sec    ",
+                preload ? "Loading" : "Running", total - last);
+        fflush(stderr);
+        last = total;
+        if (preload ? done : Clock::now() >= end) {
+            break;
+        }
+    }
+    fprintf(stderr, "\n");
 
-        vector.push_back('f');
-        vector.push_back('o');
-        vector.push_back('o');
-
-        vector.resize(vector.size() + size, ' ');
+    for (auto &w : workers) {
+        w->stop();
+        w->join();
     }
+    return std::chrono::duration<double>(Clock::now() - start).count();
 }
 
-static void set_test(const std::string &host, const std::string &port, int duration) {
-    std::list<int> sizes;
-    sizes.push_back(256);
-    sizes.push_back(512);
-    sizes.push_back(1 * 1024);
-    sizes.push_back(2 * 1024);
-    sizes.push_back(4 * 1024);
-    sizes.push_back(8 * 1024);
-    sizes.push_back(16 * 1024);
-    sizes.push_back(512 * 1024);
-
-    for (auto iter = sizes.begin(); iter != sizes.end(); ++iter) {
-        std::vector<uint8_t> message;
-        buildSetStream(message, *iter);
-        Connection c(host, port, message.data(), message.size());
-
-        int end = time(NULL) + duration;
-        c.start();
-
-        while (time(NULL) < (end)) {
-            std::cout << "\rSet test with objects of " << *iter << " bytes: "
-                      << c.getOpsPerSec() << " set/sec";
-            std::cout.flush();
-            sleep(1);
-        }
-
-        // Loop and print stats for the duration
-        c.stop();
-
-        std::cout << "\r " << *iter << " bytes: "
-                  << "Duration " << c.getDuration()
-                  << "s Total ops " << c.getTotalOps()
-                  << " avg: " << c.getOpsPerSec() << std::endl;
-        std::cout.flush();
-    }
+static void usage(void) {
+    fprintf(stderr,
+            "Usage mcbench [-h host[:port]] [-p port] [-d duration]\n"
+            "              [-t threads] [-c connections per thread]\n"
+            "              [-g get ratio] [-k keys] [-K key distribution]\n"
+            "              [-s value size] [-P pipeline depth] [-r rate]\n"
+            "              [-l] [-o output file] [-b batch] [-j path] [-S]\n"
+            "\n"
+            "    -K uniform | zipf[:theta] | hotspot[:keys[:ops]]\n"
+            "       (hotspot: the fraction of the keys getting the given\n"
+            "        fraction of the requests, 0.1 and 0.9 by default)\n"
+            "    -s size | min-max | size:weight,size:weight,...\n"
+            "    -r requests per second over all the connections (open\n"
+            "       loop), by default they're sent as fast as the server\n"
+            "       answers them\n"
+            "    -l set all the keys before the run\n"
+            "    -b send the GETs as batches of GETKQ ended by a NOOP\n"
+            "    -j store JSON documents with the given (top level) field,\n"
+            "       and SUBDOC_GET it instead of getting the documents\n"
+            "    -S connect with TLS\n");
 }
 
 /**
@@ -340,38 +1024,131 @@ static void set_test(const std::string &host, const std::string &port, int durat
 int main(int argc, char **argv)
 {
     int cmd;
-    std::string host("localhost");
-    std::string port("12000");
-    int duration = 60;
+    Options options;
+    std::string keyDistribution("uniform");
     char *ptr;
 
     /* Initialize the socket subsystem */
     cb_initialize_sockets();
 
-    while ((cmd = getopt(argc, argv, "h:p:d:")) != EOF) {
+    bool ssl = false;
+    while ((cmd = getopt(argc, argv, "h:p:d:t:c:g:k:K:s:P:r:lo:b:j:S")) != EOF) {
         switch (cmd) {
         case 'h' :
             ptr = strchr(optarg, ':');
             if (ptr != NULL) {
                 *ptr = '\0';
-                port.assign(ptr + 1);
+                options.port.assign(ptr + 1);
             }
-            host.assign(optarg);
+            options.host.assign(optarg);
             break;
         case 'p' :
-            port.assign(optarg);
+            options.port.assign(optarg);
             break;
         case 'd':
-            duration = atoi(optarg);
+            options.duration = atoi(optarg);
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'c':
+            options.connections = atoi(optarg);
+            break;
+        case 'g':
+            options.getRatio = atof(optarg);
+            break;
+        case 'k':
+            options.keys = strtoull(optarg, NULL, 10);
+            break;
+        case 'K':
+            keyDistribution.assign(optarg);
+            break;
+        case 's':
+            if (!options.sizeDistribution.parse(optarg)) {
+                fprintf(stderr, "Invalid value size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'P':
+            options.pipeline = atoi(optarg);
+            break;
+        case 'r':
+            options.rate = atof(optarg);
+            break;
+        case 'l':
+            options.preload = true;
+            break;
+        case 'o':
+            options.output.assign(optarg);
+            break;
+        case 'b':
+            options.batch = atoi(optarg);
+            break;
+        case 'j':
+            options.jsonPath.assign(optarg);
+            break;
+        case 'S':
+            ssl = true;
             break;
         default:
-            fprintf(stderr,
-                    "Usage mcbench [-h host[:port]] [-p port] [-d duration]\n");
+            usage();
+            return 1;
+        }
+    }
+
+    if (options.duration <= 0 || options.threads <= 0 ||
+        options.connections <= 0 || options.pipeline <= 0 ||
+        options.getRatio < 0 || options.getRatio > 1 || options.rate < 0 ||
+        options.batch <= 0 || options.jsonPath.size() > 32 ||
+        (options.batch > 1 && !options.jsonPath.empty())) {
+        usage();
+        return 1;
+    }
+    if (!options.keyDistribution.parse(keyDistribution, options.keys)) {
+        fprintf(stderr, "Invalid key distribution: %s\n",
+                keyDistribution.c_str());
+        return 1;
+    }
+
+    if (ssl) {
+        SSL_library_init();
+        SSL_load_error_strings();
+        options.ssl = SSL_CTX_new(SSLv23_client_method());
+        if (options.ssl == NULL) {
+            ERR_print_errors_fp(stderr);
             return 1;
         }
+        SSL_CTX_set_mode(options.ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                         SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
     }
 
-    set_test(host, port, duration);
+    FILE *fp = open_results(options.output);
+    if (fp == NULL) {
+        return 1;
+    }
+
+    /* The values are all taken from the same buffer */
+    std::string value(options.sizeDistribution.getMax(), 'x');
+    std::vector<std::unique_ptr<Worker> > workers;
+    for (int ii = 0; ii < options.threads; ++ii) {
+        workers.push_back(std::unique_ptr<Worker>(new Worker(options, ii,
+                                                             value)));
+    }
+
+    if (options.preload) {
+        run_workers(workers, true, options.duration);
+    }
+    double elapsed = run_workers(workers, false, options.duration);
+
+    Results results;
+    for (auto &w : workers) {
+        results.merge(w->getResults());
+    }
+    print_results(fp, options, results, elapsed);
+    close_results(fp);
+    if (options.ssl != NULL) {
+        SSL_CTX_free(options.ssl);
+    }
 
     return 0;
 }
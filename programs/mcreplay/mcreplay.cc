@@ -0,0 +1,940 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * mcreplay replays the request traces captured by a server (the files
+ * of its "workload_trace_dir", see <memcached/workload_trace.h>) against
+ * a test server:
+ *
+ *  - the records of all the files are merged by time, and every request
+ *    is sent when it is due: its time in the trace divided by the
+ *    speedup (-x), so the popularity of the keys and the gaps between
+ *    the requests are the ones of the trace
+ *  - a key is a name made from its hash, of the length the original key
+ *    had, and the values are of the size the trace recorded. The quiet
+ *    commands are sent as their loud versions, so every request gets a
+ *    response
+ *  - the requests for a key always go through the same connection, so
+ *    they reach the server in the order of the trace
+ *  - it runs open loop: the latency of a request is measured from when
+ *    it was due, so a stalled server shows in the latencies
+ *  - with -l the keys read before they are written in the trace are set
+ *    first, so the first reads of the replay aren't all misses
+ *
+ * The trace only has a sample of the keys (1 in "workload_trace_sample"),
+ * a speedup of the sample ratio gets the load of the traced server back.
+ * The results (throughput, hit ratio and latency percentiles) are
+ * written as JSON to stdout or to the given file, so they can be
+ * compared across runs.
+ */
+#include "config.h"
+
+#include <memcached/protocol_binary.h>
+#include <memcached/workload_trace.h>
+
+#include <getopt.h>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <string.h>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <platform/platform.h>
+
+#include "programs/bench_results.h"
+
+typedef std::chrono::steady_clock Clock;
+typedef Clock::time_point TimePoint;
+
+/** The request of a record, as it is replayed */
+struct Request {
+    uint64_t due;       /* ns after the start of the replay */
+    uint64_t key;
+    uint32_t nvalue;
+    uint32_t exptime;
+    uint16_t nkey;
+    uint16_t vbucket;
+    uint8_t opcode;     /* what gets sent, see replay_opcode() */
+};
+
+struct Options {
+    Options() : host("localhost"), port("12000"), threads(1),
+        connections(4), speedup(1), pipeline(64), preload(false),
+        timeout(10)
+    {
+    }
+
+    std::string host;
+    std::string port;
+    int threads;
+    int connections;
+    double speedup;
+    int pipeline;  /* the requests in flight on a connection */
+    bool preload;
+    int timeout;   /* seconds to wait for the responses at the end */
+    std::string output;
+};
+
+/** The results of a thread (or of all of them) */
+struct Results {
+    Results() : getHits(0), getMisses(0), updates(0), updateFailures(0),
+        errors(0), late(0)
+    {
+    }
+
+    void merge(const Results &other) {
+        getLatency.merge(other.getLatency);
+        updateLatency.merge(other.updateLatency);
+        getHits += other.getHits;
+        getMisses += other.getMisses;
+        updates += other.updates;
+        updateFailures += other.updateFailures;
+        errors += other.errors;
+        late += other.late;
+    }
+
+    Histogram getLatency; /* nanoseconds */
+    Histogram updateLatency;
+    uint64_t getHits;
+    uint64_t getMisses;
+    uint64_t updates;
+    /* Updates the server refused (an ADD of a key which exists...) */
+    uint64_t updateFailures;
+    uint64_t errors;
+    /* Requests sent more than a millisecond after they were due */
+    uint64_t late;
+};
+
+/**
+ * The command a traced one is replayed as (the loud version of the quiet
+ * ones), or 0xff if it isn't replayed
+ */
+static uint8_t replay_opcode(uint8_t opcode) {
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+        return PROTOCOL_BINARY_CMD_GET;
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+        return PROTOCOL_BINARY_CMD_SET;
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+        return PROTOCOL_BINARY_CMD_ADD;
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+        return PROTOCOL_BINARY_CMD_REPLACE;
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+        return PROTOCOL_BINARY_CMD_APPEND;
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+        return PROTOCOL_BINARY_CMD_PREPEND;
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+        return PROTOCOL_BINARY_CMD_DELETE;
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+        return PROTOCOL_BINARY_CMD_INCREMENT;
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+        return PROTOCOL_BINARY_CMD_DECREMENT;
+    case PROTOCOL_BINARY_CMD_TOUCH:
+        return PROTOCOL_BINARY_CMD_TOUCH;
+    case PROTOCOL_BINARY_CMD_GAT:
+    case PROTOCOL_BINARY_CMD_GATQ:
+        return PROTOCOL_BINARY_CMD_GAT;
+    default:
+        return 0xff;
+    }
+}
+
+static bool is_read(uint8_t opcode) {
+    return opcode == PROTOCOL_BINARY_CMD_GET ||
+           opcode == PROTOCOL_BINARY_CMD_GAT;
+}
+
+/**
+ * Read the records of a trace file, the oldest first, with their time
+ * as gethrtime() of the server
+ * @return false if the file isn't a trace
+ */
+static bool load_trace(const char *path, std::vector<Request> &requests,
+                       std::vector<uint64_t> &times, uint64_t &skipped,
+                       uint32_t &sample) {
+    FILE *fp = fopen(path, "rb");
+    workload_trace_header_t header;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != WORKLOAD_TRACE_MAGIC ||
+        header.version != WORKLOAD_TRACE_VERSION ||
+        header.record_size != sizeof(workload_trace_record_t) ||
+        header.capacity == 0) {
+        fprintf(stderr, "%s is not a trace file\n", path);
+        fclose(fp);
+        return false;
+    }
+
+    std::vector<workload_trace_record_t> ring(header.capacity);
+    size_t nread = fread(ring.data(), sizeof(workload_trace_record_t),
+                         ring.size(), fp);
+    fclose(fp);
+
+    uint64_t written = header.written;
+    uint64_t count = std::min<uint64_t>(written, nread);
+    uint64_t first = written > header.capacity ?
+        written % header.capacity : 0;
+    if (header.sample > sample) {
+        sample = header.sample;
+    }
+
+    for (uint64_t ii = 0; ii < count; ++ii) {
+        const workload_trace_record_t &record =
+            ring[(first + ii) % header.capacity];
+        Request request;
+
+        request.opcode = replay_opcode(record.opcode);
+        if (request.opcode == 0xff || record.nkey == 0) {
+            ++skipped;
+            continue;
+        }
+        request.due = 0;
+        request.key = record.key;
+        request.nvalue = record.nvalue;
+        request.exptime = record.exptime;
+        request.nkey = record.nkey;
+        request.vbucket = record.vbucket;
+        requests.push_back(request);
+        times.push_back(header.start_ns + record.time_ns);
+    }
+    return true;
+}
+
+class Connection {
+public:
+    Connection() : sock(INVALID_SOCKET), sendOffset(0), next(0) {
+    }
+
+    ~Connection() {
+        disconnect();
+    }
+
+    bool connect(const Options &options) {
+        struct addrinfo *ai = NULL;
+        struct addrinfo hints;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_protocol = IPPROTO_TCP;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if (getaddrinfo(options.host.c_str(), options.port.c_str(),
+                        &hints, &ai) != 0) {
+            return false;
+        }
+
+        for (struct addrinfo *e = ai; e != NULL; e = e->ai_next) {
+            if ((sock = socket(e->ai_family, e->ai_socktype,
+                               e->ai_protocol)) != INVALID_SOCKET) {
+                if (::connect(sock, e->ai_addr, e->ai_addrlen) == 0) {
+                    break;
+                }
+                closesocket(sock);
+                sock = INVALID_SOCKET;
+            }
+        }
+        freeaddrinfo(ai);
+
+        if (sock == INVALID_SOCKET) {
+            return false;
+        }
+        int flag = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&flag,
+                   sizeof(flag));
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        return true;
+    }
+
+    void disconnect() {
+        if (sock != INVALID_SOCKET) {
+            closesocket(sock);
+            sock = INVALID_SOCKET;
+        }
+        sendBuffer.clear();
+        recvBuffer.clear();
+        sendOffset = 0;
+    }
+
+    struct Sent {
+        TimePoint due;
+        uint8_t opcode;
+    };
+
+    SOCKET sock;
+    std::vector<uint8_t> sendBuffer;
+    size_t sendOffset;
+    std::vector<uint8_t> recvBuffer;
+    /** The requests of the connection, in the order they are due */
+    std::vector<Request> requests;
+    size_t next;
+    /** The requests sent (or queued in the send buffer), in order */
+    std::deque<Sent> pending;
+};
+
+class Worker {
+public:
+    Worker(const Options &_options, const std::string &_value) :
+        options(_options), value(_value), done(false), completed(0)
+    {
+        for (int ii = 0; ii < options.connections; ++ii) {
+            connections.push_back(std::unique_ptr<Connection>(new Connection));
+        }
+    }
+
+    /** Take a request, of one of the keys of this worker */
+    void add(const Request &request) {
+        uint64_t conn = (request.key / options.threads) %
+            connections.size();
+        connections[conn]->requests.push_back(request);
+    }
+
+    bool connect() {
+        for (auto &c : connections) {
+            if (!c->connect(options)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void start(TimePoint _start) {
+        startTime = _start;
+        tid = std::thread(thread_main, this);
+    }
+
+    void join() {
+        tid.join();
+    }
+
+    uint64_t getCompleted() const {
+        return completed.load(std::memory_order_relaxed);
+    }
+
+    const Results &getResults() const {
+        return results;
+    }
+
+    bool isDone() const {
+        return done.load(std::memory_order_acquire);
+    }
+
+    TimePoint getFinishTime() const {
+        return finishTime;
+    }
+
+private:
+    static void thread_main(Worker *w) {
+        w->run();
+    }
+
+    void run() {
+        std::vector<struct pollfd> fds(connections.size());
+        TimePoint deadline = TimePoint::max();
+
+        for (;;) {
+            TimePoint now = Clock::now();
+            int timeout = 100;
+            bool busy = false;
+
+            for (size_t ii = 0; ii < connections.size(); ++ii) {
+                Connection &c = *connections[ii];
+                fds[ii].fd = -1;
+                fds[ii].events = 0;
+                fds[ii].revents = 0;
+                if (c.sock == INVALID_SOCKET) {
+                    continue;
+                }
+
+                TimePoint due = fill(c, now);
+                if (c.sendOffset < c.sendBuffer.size() && !send(c)) {
+                    fail(c);
+                    continue;
+                }
+                if (c.next < c.requests.size() || !c.pending.empty()) {
+                    busy = true;
+                }
+                if (c.next < c.requests.size() &&
+                    c.pending.size() < (size_t)options.pipeline) {
+                    timeout = std::min(timeout, millisUntil(due, now));
+                }
+
+                fds[ii].fd = c.sock;
+                fds[ii].events = POLLIN;
+                if (c.sendOffset < c.sendBuffer.size()) {
+                    fds[ii].events |= POLLOUT;
+                }
+            }
+
+            if (!busy) {
+                break;
+            }
+            if (allSent() && deadline == TimePoint::max()) {
+                deadline = now + std::chrono::seconds(options.timeout);
+            }
+            if (now >= deadline) {
+                /* The responses which didn't come are errors */
+                for (auto &c : connections) {
+                    fail(*c);
+                }
+                break;
+            }
+
+            if (poll(fds.data(), fds.size(), timeout) == -1 && errno != EINTR) {
+                perror("poll");
+                abort();
+            }
+
+            now = Clock::now();
+            for (size_t ii = 0; ii < connections.size(); ++ii) {
+                Connection &c = *connections[ii];
+                if (fds[ii].fd == -1 || fds[ii].revents == 0) {
+                    continue;
+                }
+                if ((fds[ii].revents & POLLOUT) && !send(c)) {
+                    fail(c);
+                } else if ((fds[ii].revents & (POLLIN | POLLERR | POLLHUP)) &&
+                           !receive(c, now)) {
+                    fail(c);
+                }
+            }
+        }
+
+        for (auto &c : connections) {
+            c->disconnect();
+        }
+        finishTime = Clock::now();
+        done.store(true, std::memory_order_release);
+    }
+
+    bool allSent() const {
+        for (const auto &c : connections) {
+            if (c->sock != INVALID_SOCKET && c->next < c->requests.size()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /*
+     * Rounded down: we rather spin through the last millisecond than send
+     * late, which would count against the server
+     */
+    static int millisUntil(TimePoint when, TimePoint now) {
+        if (when <= now) {
+            return 0;
+        }
+        return (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+            when - now).count();
+    }
+
+    TimePoint dueTime(const Request &request) const {
+        return startTime + std::chrono::nanoseconds(request.due);
+    }
+
+    /**
+     * Queue the requests of the connection which are due, as far as the
+     * pipeline allows
+     * @return when the next one is due
+     */
+    TimePoint fill(Connection &c, TimePoint now) {
+        while (c.next < c.requests.size() &&
+               c.pending.size() < (size_t)options.pipeline) {
+            const Request &request = c.requests[c.next];
+            TimePoint due = dueTime(request);
+            if (due > now) {
+                return due;
+            }
+            if (now - due > std::chrono::milliseconds(1)) {
+                ++results.late;
+            }
+            encode(c, request);
+            Connection::Sent sent;
+            sent.due = due;
+            sent.opcode = request.opcode;
+            c.pending.push_back(sent);
+            ++c.next;
+        }
+        return c.next < c.requests.size() ? dueTime(c.requests[c.next])
+                                          : TimePoint::max();
+    }
+
+    void encode(Connection &c, const Request &request) {
+        protocol_binary_request_header req;
+        uint8_t extras[20];
+        uint8_t extlen = 0;
+        uint32_t exptime = htonl(request.exptime);
+        size_t vallen = 0;
+        char key[256];
+        size_t keylen = request.nkey < sizeof(key) ? request.nkey
+                                                   : sizeof(key) - 1;
+
+        /* The hash in hex, padded to the length of the original key */
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016" PRIx64, request.key);
+        memset(key, '_', keylen);
+        memcpy(key, hex, std::min<size_t>(keylen, 16));
+
+        memset(extras, 0, sizeof(extras));
+        switch (request.opcode) {
+        case PROTOCOL_BINARY_CMD_SET:
+        case PROTOCOL_BINARY_CMD_ADD:
+        case PROTOCOL_BINARY_CMD_REPLACE:
+            extlen = 8;
+            memcpy(extras + 4, &exptime, sizeof(exptime));
+            vallen = request.nvalue;
+            break;
+        case PROTOCOL_BINARY_CMD_APPEND:
+        case PROTOCOL_BINARY_CMD_PREPEND:
+            vallen = request.nvalue;
+            break;
+        case PROTOCOL_BINARY_CMD_INCREMENT:
+        case PROTOCOL_BINARY_CMD_DECREMENT:
+            extlen = 20;
+            extras[7] = 1;  /* a delta of 1, created at 0 */
+            memcpy(extras + 16, &exptime, sizeof(exptime));
+            break;
+        case PROTOCOL_BINARY_CMD_TOUCH:
+        case PROTOCOL_BINARY_CMD_GAT:
+            extlen = 4;
+            memcpy(extras, &exptime, sizeof(exptime));
+            break;
+        }
+        vallen = std::min(vallen, value.size());
+
+        memset(&req, 0, sizeof(req));
+        req.request.magic = PROTOCOL_BINARY_REQ;
+        req.request.opcode = request.opcode;
+        req.request.keylen = htons((uint16_t)keylen);
+        req.request.extlen = extlen;
+        req.request.vbucket = htons(request.vbucket);
+        req.request.bodylen = htonl((uint32_t)(extlen + keylen + vallen));
+
+        c.sendBuffer.insert(c.sendBuffer.end(), req.bytes,
+                            req.bytes + sizeof(req.bytes));
+        c.sendBuffer.insert(c.sendBuffer.end(), extras, extras + extlen);
+        c.sendBuffer.insert(c.sendBuffer.end(), key, key + keylen);
+        c.sendBuffer.insert(c.sendBuffer.end(), value.data(),
+                            value.data() + vallen);
+    }
+
+    bool send(Connection &c) {
+        while (c.sendOffset < c.sendBuffer.size()) {
+            ssize_t nw = ::send(c.sock, c.sendBuffer.data() + c.sendOffset,
+                                c.sendBuffer.size() - c.sendOffset, 0);
+            if (nw == -1) {
+                return errno == EWOULDBLOCK || errno == EAGAIN;
+            }
+            c.sendOffset += nw;
+        }
+        c.sendBuffer.clear();
+        c.sendOffset = 0;
+        return true;
+    }
+
+    bool receive(Connection &c, TimePoint now) {
+        for (;;) {
+            size_t used = c.recvBuffer.size();
+            c.recvBuffer.resize(used + 64 * 1024);
+            ssize_t nr = ::recv(c.sock, c.recvBuffer.data() + used,
+                                c.recvBuffer.size() - used, 0);
+            if (nr <= 0) {
+                c.recvBuffer.resize(used);
+                return nr == -1 && (errno == EWOULDBLOCK || errno == EAGAIN);
+            }
+            c.recvBuffer.resize(used + nr);
+
+            size_t offset = 0;
+            while (c.recvBuffer.size() - offset >=
+                   sizeof(protocol_binary_response_header)) {
+                protocol_binary_response_header res;
+                memcpy(&res, c.recvBuffer.data() + offset, sizeof(res));
+                size_t total = sizeof(res) + ntohl(res.response.bodylen);
+                if (res.response.magic != PROTOCOL_BINARY_RES ||
+                    c.pending.empty()) {
+                    fprintf(stderr, "Unexpected data from the server\n");
+                    return false;
+                }
+                if (c.recvBuffer.size() - offset < total) {
+                    break;
+                }
+                complete(c, ntohs(res.response.status), now);
+                offset += total;
+            }
+            c.recvBuffer.erase(c.recvBuffer.begin(),
+                               c.recvBuffer.begin() + offset);
+        }
+    }
+
+    void complete(Connection &c, uint16_t status, TimePoint now) {
+        const Connection::Sent &sent = c.pending.front();
+        uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            now - sent.due).count();
+
+        if (is_read(sent.opcode)) {
+            results.getLatency.add(latency);
+            if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                ++results.getHits;
+            } else if (status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT) {
+                ++results.getMisses;
+            } else {
+                ++results.errors;
+            }
+        } else {
+            results.updateLatency.add(latency);
+            if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                ++results.updates;
+            } else if (status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT ||
+                       status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS ||
+                       status == PROTOCOL_BINARY_RESPONSE_NOT_STORED ||
+                       status == PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL) {
+                ++results.updateFailures;
+            } else {
+                ++results.errors;
+            }
+        }
+        completed.fetch_add(1, std::memory_order_relaxed);
+        c.pending.pop_front();
+    }
+
+    /** The connection is lost, with what was left of its requests */
+    void fail(Connection &c) {
+        if (c.sock != INVALID_SOCKET) {
+            results.errors += c.pending.size() + (c.requests.size() - c.next);
+            completed.fetch_add(c.pending.size() + (c.requests.size() - c.next),
+                                std::memory_order_relaxed);
+        }
+        c.pending.clear();
+        c.next = c.requests.size();
+        c.disconnect();
+    }
+
+    const Options &options;
+    const std::string &value;
+    std::vector<std::unique_ptr<Connection> > connections;
+    TimePoint startTime;
+    TimePoint finishTime;
+    std::thread tid;
+    std::atomic<bool> done;
+    std::atomic<uint64_t> completed;
+    Results results;
+};
+
+/**
+ * Set the keys which are read before they are written in the trace, with
+ * the size of their first write (or of the first value seen at all)
+ */
+static std::vector<Request> preload_requests(
+    const std::vector<Request> &requests) {
+    std::unordered_map<uint64_t, std::pair<bool, uint32_t> > keys;
+    std::vector<Request> sets;
+
+    for (const auto &request : requests) {
+        auto it = keys.find(request.key);
+        if (it == keys.end()) {
+            keys[request.key] = std::make_pair(is_read(request.opcode),
+                                               request.nvalue);
+        } else if (it->second.first && it->second.second == 0) {
+            it->second.second = request.nvalue;
+        }
+    }
+    for (const auto &request : requests) {
+        auto it = keys.find(request.key);
+        if (it != keys.end() && it->second.first) {
+            Request set = request;
+            set.due = 0;
+            set.opcode = PROTOCOL_BINARY_CMD_SET;
+            set.exptime = 0;
+            set.nvalue = it->second.second;
+            sets.push_back(set);
+            keys.erase(it);
+        }
+    }
+    return sets;
+}
+
+static void print_results(FILE *fp, const Options &options,
+                          const Results &results, double elapsed,
+                          double traced, uint64_t requests, uint64_t skipped,
+                          uint32_t sample) {
+    uint64_t gets = results.getLatency.getCount();
+    uint64_t updates = results.updateLatency.getCount();
+    ResultsWriter out(fp);
+
+    out.begin("config");
+    out.add("host", options.host);
+    out.add("port", options.port);
+    out.add("threads", options.threads);
+    out.add("connections", options.connections);
+    out.add("speedup", options.speedup, 3);
+    out.add("pipeline", options.pipeline);
+    out.add("preload", options.preload);
+    out.end();
+    out.begin("trace");
+    out.add("requests", requests);
+    out.add("skipped", skipped);
+    out.add("sample", (unsigned int)sample);
+    out.add("duration", traced, 3);
+    out.end();
+    out.add("elapsed", elapsed, 3);
+    out.add("ops", gets + updates);
+    out.add("ops_per_sec", elapsed > 0 ? (gets + updates) / elapsed : 0, 0);
+    out.add("errors", results.errors);
+    out.add("late", results.late);
+    out.begin("get");
+    out.add("ops", gets);
+    out.add("hits", results.getHits);
+    out.add("misses", results.getMisses);
+    out.addLatency("latency_usec", results.getLatency);
+    out.end();
+    out.begin("update");
+    out.add("ops", updates);
+    out.add("failed", results.updateFailures);
+    out.addLatency("latency_usec", results.updateLatency);
+    out.end();
+    out.finish();
+}
+
+/**
+ * Replay the requests split between the workers, showing the throughput
+ * on stderr every second
+ * @return the number of seconds it took, negative if the workers failed
+ *         to connect
+ */
+static double run_workers(const Options &options, const std::string &value,
+                          const std::vector<Request> &requests,
+                          Results &results, const char *what) {
+    std::vector<std::unique_ptr<Worker> > workers;
+    for (int ii = 0; ii < options.threads; ++ii) {
+        workers.push_back(std::unique_ptr<Worker>(new Worker(options, value)));
+    }
+    for (const auto &request : requests) {
+        workers[request.key % options.threads]->add(request);
+    }
+    for (auto &w : workers) {
+        if (!w->connect()) {
+            fprintf(stderr, "Failed to connect to %s:%s\n",
+                    options.host.c_str(), options.port.c_str());
+            return -1;
+        }
+    }
+
+    TimePoint start = Clock::now();
+    uint64_t last = 0;
+    for (auto &w : workers) {
+        w->start(start);
+    }
+
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        uint64_t total = 0;
+        bool done = true;
+        for (auto &w : workers) {
+            total += w->getCompleted();
+            done = done && w->isDone();
+        }
+        fprintf(stderr, "\r%s: %" PRIu64 " ops/sec, %" PRIu64 " of %zu    ",
+                what, total - last, total, requests.size());
+        fflush(stderr);
+        last = total;
+        if (done) {
+            break;
+        }
+    }
+    fprintf(stderr, "\n");
+
+    TimePoint finish = start;
+    for (auto &w : workers) {
+        w->join();
+        results.merge(w->getResults());
+        finish = std::max(finish, w->getFinishTime());
+    }
+    return std::chrono::duration<double>(finish - start).count();
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage mcreplay [-h host[:port]] [-p port] [-t threads]\n"
+            "               [-c connections per thread] [-x speedup]\n"
+            "               [-P pipeline depth] [-w timeout] [-l]\n"
+            "               [-o output file] trace file...\n"
+            "\n"
+            "    -x how many times faster than the trace to send the\n"
+            "       requests (2 halves the gaps between them)\n"
+            "    -P the requests in flight on a connection, the ones due\n"
+            "       meanwhile are sent late (and counted)\n"
+            "    -w seconds to wait for the last responses\n"
+            "    -l set the keys which are read before they are written\n"
+            "       in the trace first\n");
+}
+
+/**
+ * Program entry point.
+ *
+ * @param argc argument count
+ * @param argv argument vector
+ * @return 0 if success, error code otherwise
+ */
+int main(int argc, char **argv)
+{
+    int cmd;
+    Options options;
+    char *ptr;
+
+    /* Initialize the socket subsystem */
+    cb_initialize_sockets();
+
+    while ((cmd = getopt(argc, argv, "h:p:t:c:x:P:w:lo:")) != EOF) {
+        switch (cmd) {
+        case 'h' :
+            ptr = strchr(optarg, ':');
+            if (ptr != NULL) {
+                *ptr = '\0';
+                options.port.assign(ptr + 1);
+            }
+            options.host.assign(optarg);
+            break;
+        case 'p' :
+            options.port.assign(optarg);
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'c':
+            options.connections = atoi(optarg);
+            break;
+        case 'x':
+            options.speedup = atof(optarg);
+            break;
+        case 'P':
+            options.pipeline = atoi(optarg);
+            break;
+        case 'w':
+            options.timeout = atoi(optarg);
+            break;
+        case 'l':
+            options.preload = true;
+            break;
+        case 'o':
+            options.output.assign(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind == argc || options.threads <= 0 ||
+        options.connections <= 0 || options.speedup <= 0 ||
+        options.pipeline <= 0 || options.timeout < 0) {
+        usage();
+        return 1;
+    }
+
+    std::vector<Request> requests;
+    std::vector<uint64_t> times;
+    uint64_t skipped = 0;
+    uint32_t sample = 0;
+    for (int ii = optind; ii < argc; ++ii) {
+        if (!load_trace(argv[ii], requests, times, skipped, sample)) {
+            return 1;
+        }
+    }
+    if (requests.empty()) {
+        fprintf(stderr, "There is nothing to replay in the traces\n");
+        return 1;
+    }
+
+    /* Merge the threads of the trace by time, scaled by the speedup */
+    std::vector<size_t> order(requests.size());
+    for (size_t ii = 0; ii < order.size(); ++ii) {
+        order[ii] = ii;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&times](size_t a, size_t b) {
+                         return times[a] < times[b];
+                     });
+    uint64_t first = times[order.front()];
+    double traced = (times[order.back()] - first) / 1e9;
+    std::vector<Request> sorted;
+    sorted.reserve(requests.size());
+    uint32_t maxValue = 0;
+    for (size_t idx : order) {
+        Request request = requests[idx];
+        request.due = (uint64_t)((times[idx] - first) / options.speedup);
+        maxValue = std::max(maxValue, request.nvalue);
+        sorted.push_back(request);
+    }
+    requests.clear();
+    times.clear();
+
+    FILE *fp = open_results(options.output);
+    if (fp == NULL) {
+        return 1;
+    }
+
+    /* The values are all taken from the same buffer */
+    std::string value(std::min<uint32_t>(maxValue, 20 * 1024 * 1024), 'x');
+
+    if (options.preload) {
+        Results ignored;
+        if (run_workers(options, value, preload_requests(sorted), ignored,
+                        "Loading") < 0) {
+            return 1;
+        }
+    }
+
+    Results results;
+    double elapsed = run_workers(options, value, sorted, results,
+                                 "Replaying");
+    if (elapsed < 0) {
+        return 1;
+    }
+    print_results(fp, options, results, elapsed, traced, sorted.size(),
+                  skipped, sample);
+    close_results(fp);
+    return 0;
+}
@@ -0,0 +1,484 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * mcreplbench is the consumer side of a replication benchmark: it opens
+ * a DCP producer connection (or a TAP one with -t), streams the given
+ * vbuckets and counts what comes in until the streams end or the time
+ * is up. Against the tap_mock_engine in its benchmark mode (see
+ * engines/tap_mock_engine) this measures the throughput of the core's
+ * ship_dcp_log() / ship_tap_log(), their batching and the DCP flow
+ * control (-w, acknowledged every half window) on their own.
+ *
+ * The messages are read through a large buffer and only their headers
+ * are looked at, so the client isn't what limits the throughput. The
+ * results are written as JSON to stdout or to the given file.
+ */
+#include "config.h"
+
+#include <memcached/protocol_binary.h>
+
+#include <getopt.h>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <string.h>
+#include <vector>
+#include <stdint.h>
+#include <inttypes.h>
+#include <cerrno>
+#include <chrono>
+#include <platform/platform.h>
+
+#include "programs/bench_results.h"
+#include "programs/utilities.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    Options() : host("localhost"), port("11210"), user(NULL), pass(NULL),
+        secure(false), tap(false), vbuckets(1), window(0), duration(10),
+        items(0), name("mcreplbench")
+    {
+    }
+
+    std::string host;
+    std::string port;
+    const char *user;
+    const char *pass;
+    bool secure;
+    bool tap;
+    int vbuckets;
+    uint32_t window; /* DCP flow control buffer, 0 for none */
+    int duration;
+    uint64_t items;  /* stop after this many mutations, 0 for no limit */
+    std::string name;
+    std::string output;
+};
+
+struct Results {
+    Results() : messages(0), mutations(0), bytes(0), valueBytes(0),
+        snapshots(0), streamEnds(0), acks(0)
+    {
+    }
+
+    uint64_t messages;
+    uint64_t mutations;
+    uint64_t bytes;
+    uint64_t valueBytes;
+    uint64_t snapshots;
+    uint64_t streamEnds;
+    uint64_t acks;
+};
+
+/** Reads the packets off the connection through a large buffer */
+class Reader {
+public:
+    Reader(BIO *b) : bio(b), buffer(1024 * 1024), start(0), end(0) {
+    }
+
+    /**
+     * The next packet (its header in network byte order, then its
+     * body), valid until the next call
+     * @return NULL once the server closed the connection
+     */
+    const protocol_binary_request_header *next(uint32_t *size) {
+        const size_t header = sizeof(protocol_binary_request_header);
+        uint32_t bodylen;
+
+        if (!fill(header)) {
+            return NULL;
+        }
+        memcpy(&bodylen, &buffer[start] + 8, sizeof(bodylen));
+        *size = (uint32_t)header + ntohl(bodylen);
+        if (!fill(*size)) {
+            return NULL;
+        }
+        const protocol_binary_request_header *ret =
+            reinterpret_cast<const protocol_binary_request_header*>(
+                &buffer[start]);
+        start += *size;
+        return ret;
+    }
+
+private:
+    bool fill(size_t nbytes) {
+        if (end - start >= nbytes) {
+            return true;
+        }
+        if (start != 0) {
+            memmove(&buffer[0], &buffer[start], end - start);
+            end -= start;
+            start = 0;
+        }
+        if (buffer.size() < nbytes) {
+            buffer.resize(nbytes);
+        }
+        while (end < nbytes) {
+            int nr = BIO_read(bio, &buffer[end], (int)(buffer.size() - end));
+            if (nr <= 0) {
+                if (nr < 0 && BIO_should_retry(bio)) {
+                    continue;
+                }
+                return false;
+            }
+            end += nr;
+        }
+        return true;
+    }
+
+    BIO *bio;
+    std::vector<char> buffer;
+    size_t start;
+    size_t end;
+};
+
+static void send_request(BIO *bio, uint8_t opcode, uint16_t vbucket,
+                         uint32_t opaque, const void *extras, uint8_t nextras,
+                         const std::string &key, const std::string &value) {
+    protocol_binary_request_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.request.magic = PROTOCOL_BINARY_REQ;
+    header.request.opcode = opcode;
+    header.request.keylen = htons((uint16_t)key.length());
+    header.request.extlen = nextras;
+    header.request.vbucket = htons(vbucket);
+    header.request.opaque = opaque;
+    header.request.bodylen = htonl((uint32_t)(nextras + key.length() +
+                                              value.length()));
+    ensure_send(bio, &header, sizeof(header));
+    ensure_send(bio, extras, nextras);
+    ensure_send(bio, key.data(), (int)key.length());
+    ensure_send(bio, value.data(), (int)value.length());
+}
+
+/**
+ * Wait for the response to a request of the setup
+ * @return false (after telling why) if it failed
+ */
+static bool expect_success(Reader &reader, const char *what) {
+    const protocol_binary_request_header *packet;
+    uint32_t size;
+
+    if ((packet = reader.next(&size)) == NULL) {
+        fprintf(stderr, "Connection closed during %s\n", what);
+        return false;
+    }
+    const protocol_binary_response_header *response =
+        reinterpret_cast<const protocol_binary_response_header*>(packet);
+    uint16_t status = ntohs(response->response.status);
+    if (response->response.magic != PROTOCOL_BINARY_RES ||
+        status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        fprintf(stderr, "%s failed: 0x%02x\n", what, status);
+        return false;
+    }
+    return true;
+}
+
+static bool setup_dcp(BIO *bio, Reader &reader, const Options &options) {
+    protocol_binary_request_dcp_open open;
+    protocol_binary_request_dcp_stream_req req;
+
+    memset(&open, 0, sizeof(open));
+    open.message.body.flags = htonl(DCP_OPEN_PRODUCER);
+    send_request(bio, PROTOCOL_BINARY_CMD_DCP_OPEN, 0, 0,
+                 &open.message.body, sizeof(open.message.body),
+                 options.name, "");
+    if (!expect_success(reader, "DCP_OPEN")) {
+        return false;
+    }
+
+    if (options.window != 0) {
+        char value[16];
+        snprintf(value, sizeof(value), "%u", options.window);
+        send_request(bio, PROTOCOL_BINARY_CMD_DCP_CONTROL, 0, 0, NULL, 0,
+                     "connection_buffer_size", value);
+        if (!expect_success(reader, "DCP_CONTROL")) {
+            return false;
+        }
+    }
+
+    for (int vb = 0; vb < options.vbuckets; ++vb) {
+        memset(&req, 0, sizeof(req));
+        req.message.body.end_seqno = htonll(~0ULL);
+        send_request(bio, PROTOCOL_BINARY_CMD_DCP_STREAM_REQ, (uint16_t)vb,
+                     (uint32_t)vb, &req.message.body,
+                     sizeof(req.message.body), "", "");
+        if (!expect_success(reader, "DCP_STREAM_REQ")) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void setup_tap(BIO *bio, const Options &options) {
+    protocol_binary_request_tap_connect connect;
+
+    memset(&connect, 0, sizeof(connect));
+    send_request(bio, PROTOCOL_BINARY_CMD_TAP_CONNECT, 0, 0,
+                 &connect.message.body, sizeof(connect.message.body),
+                 options.name, "");
+}
+
+/**
+ * Count the messages until the streams end, the server disconnects,
+ * the time is up or we got the mutations asked for
+ * @return the number of seconds it ran
+ */
+static double consume(BIO *bio, Reader &reader, const Options &options,
+                      Results &results) {
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + std::chrono::seconds(options.duration);
+    Clock::time_point report = start + std::chrono::seconds(1);
+    uint64_t reported = 0;
+    uint32_t unacked = 0;
+
+    for (;;) {
+        const protocol_binary_request_header *packet;
+        uint32_t size;
+
+        if ((packet = reader.next(&size)) == NULL) {
+            break;
+        }
+        ++results.messages;
+        results.bytes += size;
+
+        uint8_t opcode = packet->request.opcode;
+        if (packet->request.magic != PROTOCOL_BINARY_REQ) {
+            /* Nothing we sent after the setup has a response */
+        } else if (opcode == PROTOCOL_BINARY_CMD_DCP_MUTATION ||
+                   opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION) {
+            uint32_t value = size - sizeof(*packet) -
+                packet->request.extlen - ntohs(packet->request.keylen);
+            if (opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION) {
+                const protocol_binary_request_tap_mutation *tap =
+                    reinterpret_cast<const protocol_binary_request_tap_mutation*>(packet);
+                uint16_t flags = ntohs(tap->message.body.tap.flags);
+                value -= ntohs(tap->message.body.tap.enginespecific_length);
+                if ((flags & TAP_FLAG_ACK) != 0) {
+                    protocol_binary_response_header ack;
+                    memset(&ack, 0, sizeof(ack));
+                    ack.response.magic = PROTOCOL_BINARY_RES;
+                    ack.response.opcode = opcode;
+                    ack.response.opaque = packet->request.opaque;
+                    ensure_send(bio, &ack, sizeof(ack));
+                    ++results.acks;
+                }
+            }
+            ++results.mutations;
+            results.valueBytes += value;
+        } else if (opcode == PROTOCOL_BINARY_CMD_DCP_SNAPSHOT_MARKER) {
+            ++results.snapshots;
+        } else if (opcode == PROTOCOL_BINARY_CMD_DCP_STREAM_END) {
+            ++results.streamEnds;
+        } else if (opcode == PROTOCOL_BINARY_CMD_DCP_NOOP) {
+            protocol_binary_response_header noop;
+            memset(&noop, 0, sizeof(noop));
+            noop.response.magic = PROTOCOL_BINARY_RES;
+            noop.response.opcode = opcode;
+            noop.response.opaque = packet->request.opaque;
+            ensure_send(bio, &noop, sizeof(noop));
+        }
+
+        if (!options.tap && options.window != 0) {
+            unacked += size;
+            if (unacked >= options.window / 2) {
+                protocol_binary_request_dcp_buffer_acknowledgement ack;
+                memset(&ack, 0, sizeof(ack));
+                ack.message.body.buffer_bytes = htonl(unacked);
+                send_request(bio,
+                             PROTOCOL_BINARY_CMD_DCP_BUFFER_ACKNOWLEDGEMENT,
+                             0, 0, &ack.message.body,
+                             sizeof(ack.message.body), "", "");
+                ++results.acks;
+                unacked = 0;
+            }
+        }
+
+        if ((options.items != 0 && results.mutations >= options.items) ||
+            (!options.tap &&
+             results.streamEnds == (uint64_t)options.vbuckets)) {
+            break;
+        }
+        if ((results.messages & 0xff) == 0) {
+            Clock::time_point now = Clock::now();
+            if (now >= report) {
+                fprintf(stderr, "\rRunning: %" PRIu64 " mutations/sec    ",
+                        results.mutations - reported);
+                fflush(stderr);
+                reported = results.mutations;
+                report += std::chrono::seconds(1);
+            }
+            if (now >= end) {
+                break;
+            }
+        }
+    }
+    fprintf(stderr, "\n");
+
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void print_results(FILE *fp, const Options &options,
+                          const Results &results, double elapsed) {
+    ResultsWriter out(fp);
+
+    out.begin("config");
+    out.add("host", options.host);
+    out.add("port", options.port);
+    out.add("protocol", options.tap ? "tap" : "dcp");
+    out.add("vbuckets", options.vbuckets);
+    out.add("window", options.window);
+    out.add("duration", options.duration);
+    out.add("items", options.items);
+    out.add("ssl", options.secure);
+    out.end();
+    out.add("elapsed", elapsed, 3);
+    out.add("messages", results.messages);
+    out.add("mutations", results.mutations);
+    out.add("mutations_per_sec", results.mutations / elapsed, 0);
+    out.add("bytes", results.bytes);
+    out.add("mbytes_per_sec", results.bytes / elapsed / (1024 * 1024), 2);
+    out.add("value_bytes", results.valueBytes);
+    out.add("snapshots", results.snapshots);
+    out.add("stream_ends", results.streamEnds);
+    out.add("acks", results.acks);
+    out.finish();
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage mcreplbench [-h host[:port]] [-p port] [-u user] [-P pass]\n"
+            "                  [-s] [-t] [-v vbuckets] [-w window]\n"
+            "                  [-d duration] [-n items] [-N name]\n"
+            "                  [-o output file]\n"
+            "\n"
+            "    -s connect with TLS\n"
+            "    -t use TAP instead of DCP\n"
+            "    -v stream the vbuckets 0 to vbuckets - 1 (DCP)\n"
+            "    -w DCP flow control buffer in bytes, acknowledged\n"
+            "       every half of it (0 for no flow control)\n"
+            "    -n stop after this many mutations\n");
+}
+
+/**
+ * Program entry point.
+ *
+ * @param argc argument count
+ * @param argv argument vector
+ * @return 0 if success, error code otherwise
+ */
+int main(int argc, char **argv)
+{
+    int cmd;
+    Options options;
+    char *ptr;
+
+    /* Initialize the socket subsystem */
+    cb_initialize_sockets();
+
+    while ((cmd = getopt(argc, argv, "h:p:u:P:stv:w:d:n:N:o:")) != EOF) {
+        switch (cmd) {
+        case 'h' :
+            ptr = strchr(optarg, ':');
+            if (ptr != NULL) {
+                *ptr = '\0';
+                options.port.assign(ptr + 1);
+            }
+            options.host.assign(optarg);
+            break;
+        case 'p' :
+            options.port.assign(optarg);
+            break;
+        case 'u':
+            options.user = optarg;
+            break;
+        case 'P':
+            options.pass = optarg;
+            break;
+        case 's':
+            options.secure = true;
+            break;
+        case 't':
+            options.tap = true;
+            break;
+        case 'v':
+            options.vbuckets = atoi(optarg);
+            break;
+        case 'w':
+            options.window = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            options.duration = atoi(optarg);
+            break;
+        case 'n':
+            options.items = strtoull(optarg, NULL, 10);
+            break;
+        case 'N':
+            options.name.assign(optarg);
+            break;
+        case 'o':
+            options.output.assign(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (options.duration <= 0 || options.vbuckets <= 0 ||
+        options.vbuckets > 1024 || options.name.empty()) {
+        usage();
+        return 1;
+    }
+
+    FILE *fp = open_results(options.output);
+    if (fp == NULL) {
+        return 1;
+    }
+
+    SSL_CTX* ctx;
+    BIO* bio;
+    if (create_ssl_connection(&ctx, &bio, options.host.c_str(),
+                              options.port.c_str(), options.user,
+                              options.pass, options.secure ? 1 : 0) != 0) {
+        return 1;
+    }
+    if (!enable_tcp_nodelay(bio)) {
+        return 1;
+    }
+
+    Reader reader(bio);
+    if (options.tap) {
+        setup_tap(bio, options);
+    } else if (!setup_dcp(bio, reader, options)) {
+        return 1;
+    }
+
+    Results results;
+    double elapsed = consume(bio, reader, options, results);
+    print_results(fp, options, results, elapsed);
+    close_results(fp);
+
+    BIO_free_all(bio);
+    if (options.secure) {
+        SSL_CTX_free(ctx);
+    }
+
+    return 0;
+}
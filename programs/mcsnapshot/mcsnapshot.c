@@ -0,0 +1,398 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/* mcsnapshot - dump the live items of the default engine to a file, or
+ *              load them from one, to move a warm cache between nodes.
+ *              The dump is split between a number of connections, each
+ *              asking for its share of the slices of the hash table
+ *              (SNAPSHOT_DUMP) and appending what it gets to the file.
+ *              The load sends the items back in batches (SNAPSHOT_LOAD),
+ *              in as many connections.
+ */
+#include "config.h"
+
+#include <memcached/protocol_binary.h>
+#include <memcached/openssl.h>
+#include <memcached/util.h>
+#include <platform/platform.h>
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "programs/utilities.h"
+
+/* The start of a snapshot file, followed by the items */
+#define SNAPSHOT_MAGIC "MCSNAP01"
+#define SNAPSHOT_MAGIC_LEN 8
+
+/* Send the items to load in batches of about this size */
+#define LOAD_BATCH_SIZE (1024 * 1024)
+
+#define MAX_THREADS 64
+
+struct worker {
+    BIO *bio;
+    SSL_CTX *ctx;
+    cb_thread_t tid;
+    uint32_t first;
+    uint32_t last;
+    bool failed;
+};
+
+/* Shared by the workers, and protected by the lock */
+static struct {
+    cb_mutex_t lock;
+    FILE *fp;
+    uint64_t items;
+    uint64_t bytes;
+    uint64_t stored;
+    uint64_t skipped;
+    bool eof;
+} snapshot;
+
+/* Read the response to a request, with the extras and the body in buffer */
+static uint16_t read_response(BIO *bio,
+                              protocol_binary_response_header *header,
+                              char **buffer, uint32_t *bodylen) {
+    ensure_recv(bio, header, sizeof(*header));
+    *bodylen = ntohl(header->response.bodylen);
+    *buffer = NULL;
+    if (*bodylen > 0) {
+        if ((*buffer = malloc(*bodylen)) == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        ensure_recv(bio, *buffer, *bodylen);
+    }
+    return ntohs(header->response.status);
+}
+
+static void print_error(uint16_t status) {
+    fprintf(stderr, "Error from server: %s\n",
+            memcached_protocol_errcode_2_text(status));
+}
+
+/* Ask for the slices [first, last), and get the data for some of them */
+static bool dump_request(BIO *bio, uint32_t first, uint32_t last,
+                         uint32_t *next, uint32_t *nslices,
+                         char **buffer, uint32_t *ndata) {
+    protocol_binary_request_snapshot_dump request;
+    protocol_binary_response_header header;
+    uint32_t bodylen;
+    uint16_t status;
+
+    memset(&request, 0, sizeof(request));
+    request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    request.message.header.request.opcode = PROTOCOL_BINARY_CMD_SNAPSHOT_DUMP;
+    request.message.header.request.extlen = 8;
+    request.message.header.request.bodylen = htonl(8);
+    request.message.body.first = htonl(first);
+    request.message.body.last = htonl(last);
+    ensure_send(bio, &request, sizeof(request.bytes));
+
+    status = read_response(bio, &header, buffer, &bodylen);
+    if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS ||
+        header.response.extlen != 8 || bodylen < 8) {
+        print_error(status);
+        free(*buffer);
+        return false;
+    }
+    memcpy(next, *buffer, sizeof(*next));
+    memcpy(nslices, *buffer + 4, sizeof(*nslices));
+    *next = ntohl(*next);
+    *nslices = ntohl(*nslices);
+    *ndata = bodylen - 8;
+    return true;
+}
+
+static void dump_main(void *arg) {
+    struct worker *worker = arg;
+    uint32_t next = worker->first;
+
+    while (next < worker->last) {
+        uint32_t nslices, ndata;
+        char *buffer;
+
+        if (!dump_request(worker->bio, next, worker->last, &next, &nslices,
+                          &buffer, &ndata)) {
+            worker->failed = true;
+            return;
+        }
+        /* The file is written one whole response after the other */
+        cb_mutex_enter(&snapshot.lock);
+        if (ndata > 0 &&
+            fwrite(buffer + 8, ndata, 1, snapshot.fp) != 1) {
+            worker->failed = true;
+        }
+        snapshot.bytes += ndata;
+        cb_mutex_exit(&snapshot.lock);
+        free(buffer);
+        if (worker->failed) {
+            fprintf(stderr, "Failed to write the snapshot\n");
+            return;
+        }
+    }
+}
+
+/*
+ * Read the next batch of whole items from the file into buffer (of size
+ * *size, grown as needed). The caller holds the lock.
+ */
+static bool load_read_batch(char **buffer, size_t *size, size_t *nbatch,
+                            uint32_t *nitems) {
+    *nbatch = 0;
+    *nitems = 0;
+    while (!snapshot.eof && *nbatch < LOAD_BATCH_SIZE) {
+        protocol_binary_snapshot_item item;
+        size_t len;
+        size_t nread = fread(&item, 1, sizeof(item), snapshot.fp);
+
+        if (nread == 0) {
+            snapshot.eof = true;
+            break;
+        }
+        if (nread != sizeof(item)) {
+            fprintf(stderr, "The snapshot is truncated\n");
+            return false;
+        }
+        len = sizeof(item) + ntohs(item.nkey) + ntohl(item.nbytes);
+        if (*nbatch + len > *size) {
+            size_t nsize = *nbatch + len > 2 * *size ? *nbatch + len : 2 * *size;
+            char *ptr = realloc(*buffer, nsize);
+            if (ptr == NULL) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                return false;
+            }
+            *buffer = ptr;
+            *size = nsize;
+        }
+        memcpy(*buffer + *nbatch, &item, sizeof(item));
+        if (fread(*buffer + *nbatch + sizeof(item), 1, len - sizeof(item),
+                  snapshot.fp) != len - sizeof(item)) {
+            fprintf(stderr, "The snapshot is truncated\n");
+            return false;
+        }
+        *nbatch += len;
+        ++*nitems;
+    }
+    return true;
+}
+
+static void load_main(void *arg) {
+    struct worker *worker = arg;
+    size_t size = LOAD_BATCH_SIZE;
+    char *batch = malloc(size);
+
+    if (batch == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        worker->failed = true;
+        return;
+    }
+
+    for (;;) {
+        protocol_binary_request_snapshot_load request;
+        protocol_binary_response_header header;
+        size_t nbatch;
+        uint32_t nitems, bodylen, stored, skipped;
+        uint16_t status;
+        char *buffer;
+        bool ok;
+
+        cb_mutex_enter(&snapshot.lock);
+        ok = load_read_batch(&batch, &size, &nbatch, &nitems);
+        snapshot.items += nitems;
+        cb_mutex_exit(&snapshot.lock);
+        if (!ok) {
+            worker->failed = true;
+            break;
+        }
+        if (nbatch == 0) {
+            break;
+        }
+
+        memset(&request, 0, sizeof(request));
+        request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+        request.message.header.request.opcode = PROTOCOL_BINARY_CMD_SNAPSHOT_LOAD;
+        request.message.header.request.bodylen = htonl((uint32_t)nbatch);
+        ensure_send(worker->bio, &request, sizeof(request.bytes));
+        ensure_send(worker->bio, batch, (int)nbatch);
+
+        status = read_response(worker->bio, &header, &buffer, &bodylen);
+        if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS || bodylen < 8) {
+            print_error(status);
+            free(buffer);
+            worker->failed = true;
+            break;
+        }
+        memcpy(&stored, buffer, sizeof(stored));
+        memcpy(&skipped, buffer + 4, sizeof(skipped));
+        free(buffer);
+
+        cb_mutex_enter(&snapshot.lock);
+        snapshot.stored += ntohl(stored);
+        snapshot.skipped += ntohl(skipped);
+        cb_mutex_exit(&snapshot.lock);
+    }
+    free(batch);
+}
+
+int main(int argc, char** argv) {
+    int cmd;
+    const char *port = "11210";
+    const char *host = "localhost";
+    const char *user = NULL;
+    const char *pass = NULL;
+    const char *dump = NULL;
+    const char *load = NULL;
+    int secure = 0;
+    int nthreads = 4;
+    char *ptr;
+    struct worker workers[MAX_THREADS];
+    char magic[SNAPSHOT_MAGIC_LEN];
+    uint32_t nslices = 0;
+    int ret = EXIT_SUCCESS;
+    int ii;
+
+    /* Initialize the socket subsystem */
+    cb_initialize_sockets();
+
+    while ((cmd = getopt(argc, argv, "h:p:u:b:P:st:d:l:")) != EOF) {
+        switch (cmd) {
+        case 'h' :
+            host = optarg;
+            ptr = strchr(optarg, ':');
+            if (ptr != NULL) {
+                *ptr = '\0';
+                port = ptr + 1;
+            }
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'b' :
+        case 'u' :
+            /* Currently -u and -b are synonymous - only allow the user to
+             * specify one. */
+            if (user == NULL) {
+                user = optarg;
+            } else {
+                fprintf(stderr, "Error: cannot specify both -u (user) and -b (bucket).\n");
+                return 1;
+            }
+            break;
+        case 'P':
+            pass = optarg;
+            break;
+        case 's':
+            secure = 1;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            dump = optarg;
+            break;
+        case 'l':
+            load = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: mcsnapshot [-h host[:port]] [-p port] [-b bucket] [-u user] [-P pass] [-s] [-t threads] -d file | -l file\n"
+                    "\n"
+                    "  -h hostname[:port]  Host (and optional port number) to connect to\n"
+                    "  -p port             Port number\n"
+                    "  -u username         Username (currently synonymous with -b)\n"
+                    "  -b bucket           Bucket name\n"
+                    "  -P password         Password (if bucket is password-protected)\n"
+                    "  -s                  Connect to node securely (using SSL)\n"
+                    "  -t threads          The number of connections to use (default 4)\n"
+                    "  -d file             Dump the items to the file\n"
+                    "  -l file             Load the items in the file (keeping the keys already there)\n");
+            return 1;
+        }
+    }
+
+    if ((dump == NULL) == (load == NULL)) {
+        fprintf(stderr, "You need to specify one of -d and -l\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1 || nthreads > MAX_THREADS) {
+        fprintf(stderr, "The number of threads must be from 1 to %d\n",
+                MAX_THREADS);
+        return EXIT_FAILURE;
+    }
+
+    /* Set up all of the connections before any thread starts */
+    memset(workers, 0, sizeof(workers));
+    for (ii = 0; ii < nthreads; ++ii) {
+        if (create_ssl_connection(&workers[ii].ctx, &workers[ii].bio, host,
+                                  port, user, pass, secure) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (dump != NULL) {
+        uint32_t next, ndata;
+        char *buffer;
+
+        /* An empty range to learn how many slices there are */
+        if (!dump_request(workers[0].bio, 0, 0, &next, &nslices,
+                          &buffer, &ndata)) {
+            return EXIT_FAILURE;
+        }
+        free(buffer);
+        if ((snapshot.fp = fopen(dump, "wb")) == NULL) {
+            fprintf(stderr, "Failed to open %s\n", dump);
+            return EXIT_FAILURE;
+        }
+        if (fwrite(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN, 1, snapshot.fp) != 1) {
+            fprintf(stderr, "Failed to write the snapshot\n");
+            return EXIT_FAILURE;
+        }
+    } else {
+        if ((snapshot.fp = fopen(load, "rb")) == NULL) {
+            fprintf(stderr, "Failed to open %s\n", load);
+            return EXIT_FAILURE;
+        }
+        if (fread(magic, SNAPSHOT_MAGIC_LEN, 1, snapshot.fp) != 1 ||
+            memcmp(magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) {
+            fprintf(stderr, "%s is not a snapshot\n", load);
+            return EXIT_FAILURE;
+        }
+    }
+
+    cb_mutex_initialize(&snapshot.lock);
+    for (ii = 0; ii < nthreads; ++ii) {
+        workers[ii].first = (uint32_t)((uint64_t)nslices * ii / nthreads);
+        workers[ii].last = (uint32_t)((uint64_t)nslices * (ii + 1) / nthreads);
+        if (cb_create_thread(&workers[ii].tid, dump ? dump_main : load_main,
+                             &workers[ii], 0) != 0) {
+            fprintf(stderr, "Failed to start a thread\n");
+            return EXIT_FAILURE;
+        }
+    }
+    for (ii = 0; ii < nthreads; ++ii) {
+        cb_join_thread(workers[ii].tid);
+        if (workers[ii].failed) {
+            ret = EXIT_FAILURE;
+        }
+        BIO_free_all(workers[ii].bio);
+        SSL_CTX_free(workers[ii].ctx);
+    }
+    cb_mutex_destroy(&snapshot.lock);
+
+    if (fclose(snapshot.fp) != 0) {
+        fprintf(stderr, "Failed to close the snapshot\n");
+        ret = EXIT_FAILURE;
+    }
+
+    if (dump != NULL) {
+        fprintf(stdout, "Dumped %lu bytes\n", (unsigned long)snapshot.bytes);
+    } else {
+        fprintf(stdout, "Loaded %lu items: %lu stored, %lu skipped\n",
+                (unsigned long)snapshot.items, (unsigned long)snapshot.stored,
+                (unsigned long)snapshot.skipped);
+    }
+    return ret;
+}
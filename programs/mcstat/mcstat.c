@@ -1,4 +1,19 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * mcstat prints the stats of a node, or with -n (or -j) queries a list of
+ * nodes in parallel and writes their stats as JSON, summed up across the
+ * nodes:
+ *
+ *  - every node gets all of its requests (SASL, HELLO and the stat groups)
+ *    in a single write, so a scrape takes one round trip per node, and up
+ *    to -c nodes are queried at the same time from a single poll() loop
+ *  - the numeric stats are aggregated into their sum, min and max, the
+ *    histograms (stats whose values are JSON arrays or objects of numbers)
+ *    are added up bucket by bucket, and the other values are counted by
+ *    value
+ *  - the nodes which fail or don't answer within the timeout are listed
+ *    with their error, and with -a the stats of every node are included
+ */
 #include "config.h"
 
 #include <memcached/protocol_binary.h>
@@ -10,7 +25,21 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
+#include <cJSON.h>
 
 #include "programs/utilities.h"
 
@@ -87,6 +116,738 @@ static void request_stat(BIO *bio, const char *key)
     } while (response.message.header.response.keylen != 0);
 }
 
+#ifndef WIN32
+/* The opaques of the requests, the stat groups come after them */
+#define OPAQUE_SASL 0
+#define OPAQUE_HELLO 1
+#define OPAQUE_GROUP 2
+
+enum node_state { NODE_IDLE, NODE_CONNECTING, NODE_ACTIVE, NODE_DONE };
+
+struct node_stat {
+    int group;
+    char *key;          /* NULL if the group failed, value is the error */
+    char *value;
+};
+
+struct node {
+    char *name;         /* host:port */
+    enum node_state state;
+    int fd;
+    char *out;
+    size_t nout;
+    size_t sent;
+    char *in;
+    size_t nin;
+    size_t insize;
+    int pending;        /* the responses still to come */
+    hrtime_t deadline;
+    char *error;
+    struct node_stat *stats;
+    size_t nstats;
+    size_t statsize;
+};
+
+/* A stat across all the nodes, with the values (owned by the nodes) */
+struct aggregate {
+    int group;
+    const char *key;
+    uint32_t hash;
+    struct aggregate *chain;
+    struct aggregate *next;
+    const char **values;
+    int nvalues;
+    int valuesize;
+};
+
+struct fleet {
+    const char **groups;
+    int ngroups;
+    const char *user;
+    const char *pass;
+    bool tcp_nodelay;
+    struct node *nodes;
+    int nnodes;
+    struct aggregate **table;
+    uint32_t mask;
+    uint32_t naggregates;
+    struct aggregate *first;
+    struct aggregate *last;
+};
+
+static void *xrealloc(void *ptr, size_t size) {
+    if ((ptr = realloc(ptr, size)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static char *xstrndup(const char *str, size_t len) {
+    char *ret = xrealloc(NULL, len + 1);
+    memcpy(ret, str, len);
+    ret[len] = '\0';
+    return ret;
+}
+
+static void append_request(struct node *n, uint8_t opcode, uint32_t opaque,
+                           const void *key, uint16_t keylen,
+                           const void *value, uint32_t valuelen) {
+    protocol_binary_request_header req;
+    size_t len = sizeof(req.bytes) + keylen + valuelen;
+
+    memset(&req, 0, sizeof(req));
+    req.request.magic = PROTOCOL_BINARY_REQ;
+    req.request.opcode = opcode;
+    req.request.keylen = htons(keylen);
+    req.request.bodylen = htonl(keylen + valuelen);
+    req.request.opaque = opaque;
+
+    n->out = xrealloc(n->out, n->nout + len);
+    memcpy(n->out + n->nout, req.bytes, sizeof(req.bytes));
+    memcpy(n->out + n->nout + sizeof(req.bytes), key, keylen);
+    memcpy(n->out + n->nout + sizeof(req.bytes) + keylen, value, valuelen);
+    n->nout += len;
+    n->pending++;
+}
+
+/* Queue all the requests of the node, to go out in a single write */
+static void build_requests(struct fleet *f, struct node *n) {
+    int ii;
+
+    if (f->user != NULL) {
+        size_t ulen = strlen(f->user);
+        size_t plen = f->pass ? strlen(f->pass) : 0;
+        char *auth = xrealloc(NULL, ulen + plen + 2);
+        auth[0] = '\0';
+        memcpy(auth + 1, f->user, ulen);
+        auth[ulen + 1] = '\0';
+        memcpy(auth + ulen + 2, f->pass, plen);
+        append_request(n, PROTOCOL_BINARY_CMD_SASL_AUTH, OPAQUE_SASL,
+                       "PLAIN", 5, auth, (uint32_t)(ulen + plen + 2));
+        free(auth);
+    }
+    if (f->tcp_nodelay) {
+        uint16_t feature = htons(PROTOCOL_BINARY_FEATURE_TCPNODELAY);
+        append_request(n, PROTOCOL_BINARY_CMD_HELLO, OPAQUE_HELLO,
+                       "mcstat", 6, &feature, sizeof(feature));
+    }
+    for (ii = 0; ii < f->ngroups; ++ii) {
+        const char *group = f->groups[ii];
+        append_request(n, PROTOCOL_BINARY_CMD_STAT, OPAQUE_GROUP + ii,
+                       group, group ? (uint16_t)strlen(group) : 0, NULL, 0);
+    }
+}
+
+static void node_close(struct node *n) {
+    if (n->fd != -1) {
+        close(n->fd);
+        n->fd = -1;
+    }
+    free(n->out);
+    free(n->in);
+    n->out = n->in = NULL;
+    n->state = NODE_DONE;
+}
+
+static void node_fail(struct node *n, const char *error) {
+    if (n->error == NULL) {
+        n->error = xstrndup(error, strlen(error));
+    }
+    node_close(n);
+}
+
+static void node_add_stat(struct node *n, int group, char *key, char *value) {
+    if (n->nstats == n->statsize) {
+        n->statsize = n->statsize ? n->statsize * 2 : 256;
+        n->stats = xrealloc(n->stats, n->statsize * sizeof(*n->stats));
+    }
+    n->stats[n->nstats].group = group;
+    n->stats[n->nstats].key = key;
+    n->stats[n->nstats].value = value;
+    n->nstats++;
+}
+
+static void node_start(struct fleet *f, struct node *n,
+                       hrtime_t timeout) {
+    struct addrinfo hints;
+    struct addrinfo *ai = NULL;
+    char host[256];
+    const char *port = "11210";
+    char *ptr;
+    int err;
+
+    snprintf(host, sizeof(host), "%s", n->name);
+    if ((ptr = strrchr(host, ':')) != NULL) {
+        *ptr = '\0';
+        port = ptr + 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, port, &hints, &ai)) != 0) {
+        node_fail(n, gai_strerror(err));
+        return;
+    }
+
+    n->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (n->fd == -1 ||
+        fcntl(n->fd, F_SETFL, fcntl(n->fd, F_GETFL) | O_NONBLOCK) == -1) {
+        freeaddrinfo(ai);
+        node_fail(n, strerror(errno));
+        return;
+    }
+    if (connect(n->fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        n->state = NODE_ACTIVE;
+    } else if (errno == EINPROGRESS) {
+        n->state = NODE_CONNECTING;
+    } else {
+        freeaddrinfo(ai);
+        node_fail(n, strerror(errno));
+        return;
+    }
+    freeaddrinfo(ai);
+
+    build_requests(f, n);
+    n->deadline = gethrtime() + timeout;
+}
+
+/* Handle the complete responses in the input buffer */
+static void node_parse(struct fleet *f, struct node *n) {
+    size_t offset = 0;
+
+    while (n->state == NODE_ACTIVE &&
+           n->nin - offset >= sizeof(protocol_binary_response_header)) {
+        protocol_binary_response_header hdr;
+        memcpy(hdr.bytes, n->in + offset, sizeof(hdr.bytes));
+        uint32_t bodylen = ntohl(hdr.response.bodylen);
+        uint16_t keylen = ntohs(hdr.response.keylen);
+        uint16_t status = ntohs(hdr.response.status);
+        uint32_t opaque = hdr.response.opaque;
+        const char *body = n->in + offset + sizeof(hdr.bytes);
+
+        if (n->nin - offset - sizeof(hdr.bytes) < bodylen) {
+            break;
+        }
+        offset += sizeof(hdr.bytes) + bodylen;
+
+        if (hdr.response.magic != PROTOCOL_BINARY_RES ||
+            (uint32_t)keylen + hdr.response.extlen > bodylen ||
+            opaque >= (uint32_t)(OPAQUE_GROUP + f->ngroups)) {
+            node_fail(n, "malformed response");
+            return;
+        }
+        body += hdr.response.extlen;
+        bodylen -= hdr.response.extlen;
+
+        if (opaque == OPAQUE_SASL) {
+            if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                node_fail(n, "Failed to authenticate to the server");
+                return;
+            }
+            n->pending--;
+        } else if (opaque == OPAQUE_HELLO) {
+            n->pending--;
+        } else if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            const char *error = memcached_protocol_errcode_2_text(status);
+            node_add_stat(n, opaque - OPAQUE_GROUP, NULL,
+                          xstrndup(error, strlen(error)));
+            n->pending--;
+        } else if (keylen == 0) {
+            n->pending--;
+        } else {
+            node_add_stat(n, opaque - OPAQUE_GROUP,
+                          xstrndup(body, keylen),
+                          xstrndup(body + keylen, bodylen - keylen));
+        }
+    }
+
+    if (n->state != NODE_ACTIVE) {
+        return;
+    }
+    memmove(n->in, n->in + offset, n->nin - offset);
+    n->nin -= offset;
+    if (n->pending == 0) {
+        node_close(n);
+    }
+}
+
+static void node_io(struct fleet *f, struct node *n, short revents) {
+    if (n->state == NODE_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (!(revents & (POLLOUT | POLLERR | POLLHUP))) {
+            return;
+        }
+        if (getsockopt(n->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+            err = errno;
+        }
+        if (err != 0) {
+            node_fail(n, strerror(err));
+            return;
+        }
+        n->state = NODE_ACTIVE;
+    }
+
+    while (n->sent < n->nout) {
+        ssize_t nw = send(n->fd, n->out + n->sent, n->nout - n->sent, 0);
+        if (nw == -1) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+                node_fail(n, strerror(errno));
+                return;
+            }
+            break;
+        }
+        n->sent += nw;
+    }
+
+    if (revents & (POLLIN | POLLERR | POLLHUP)) {
+        while (n->state == NODE_ACTIVE) {
+            ssize_t nr;
+            if (n->insize - n->nin < 8192) {
+                n->insize = n->insize ? n->insize * 2 : 65536;
+                n->in = xrealloc(n->in, n->insize);
+            }
+            nr = recv(n->fd, n->in + n->nin, n->insize - n->nin, 0);
+            if (nr == 0) {
+                node_fail(n, "Connection closed by the server");
+            } else if (nr == -1) {
+                if (errno != EWOULDBLOCK && errno != EAGAIN &&
+                    errno != EINTR) {
+                    node_fail(n, strerror(errno));
+                }
+                break;
+            } else {
+                n->nin += nr;
+                node_parse(f, n);
+            }
+        }
+    }
+}
+
+/* Query up to concurrency nodes at a time until they're all done */
+static void query_nodes(struct fleet *f, int concurrency, hrtime_t timeout) {
+    struct pollfd *fds = xrealloc(NULL, concurrency * sizeof(*fds));
+    struct node **active = xrealloc(NULL, concurrency * sizeof(*active));
+    int next = 0;
+    int nactive = 0;
+
+    while (next < f->nnodes || nactive > 0) {
+        hrtime_t now;
+        int wait = -1;
+        int ii;
+
+        while (nactive < concurrency && next < f->nnodes) {
+            struct node *n = &f->nodes[next++];
+            node_start(f, n, timeout);
+            if (n->state != NODE_DONE) {
+                active[nactive++] = n;
+            }
+        }
+
+        now = gethrtime();
+        for (ii = 0; ii < nactive; ++ii) {
+            struct node *n = active[ii];
+            int ms = n->deadline > now ?
+                (int)((n->deadline - now) / 1000000) + 1 : 0;
+            fds[ii].fd = n->fd;
+            fds[ii].events = POLLIN;
+            if (n->state == NODE_CONNECTING || n->sent < n->nout) {
+                fds[ii].events |= POLLOUT;
+            }
+            fds[ii].revents = 0;
+            if (wait == -1 || ms < wait) {
+                wait = ms;
+            }
+        }
+        if (nactive > 0 && poll(fds, nactive, wait) == -1 && errno != EINTR) {
+            fprintf(stderr, "poll: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        now = gethrtime();
+        for (ii = 0; ii < nactive; ++ii) {
+            struct node *n = active[ii];
+            if (fds[ii].revents != 0) {
+                node_io(f, n, fds[ii].revents);
+            }
+            if (n->state != NODE_DONE && now >= n->deadline) {
+                node_fail(n, "Timed out");
+            }
+        }
+        for (ii = 0; ii < nactive; ) {
+            if (active[ii]->state == NODE_DONE) {
+                active[ii] = active[--nactive];
+            } else {
+                ++ii;
+            }
+        }
+    }
+
+    free(fds);
+    free(active);
+}
+
+static uint32_t stat_hash(int group, const char *key) {
+    uint32_t h = 2166136261u ^ (uint32_t)group;
+    while (*key != '\0') {
+        h = (h ^ (uint8_t)*key++) * 16777619u;
+    }
+    return h;
+}
+
+static struct aggregate *get_aggregate(struct fleet *f, int group,
+                                       const char *key) {
+    uint32_t h = stat_hash(group, key);
+    struct aggregate *a;
+
+    for (a = f->table ? f->table[h & f->mask] : NULL; a; a = a->chain) {
+        if (a->hash == h && a->group == group && strcmp(a->key, key) == 0) {
+            return a;
+        }
+    }
+
+    if (f->naggregates >= (f->mask + 1) / 4 * 3) {
+        uint32_t size = f->table ? (f->mask + 1) * 2 : 1024;
+        struct aggregate *e;
+        free(f->table);
+        f->table = calloc(size, sizeof(*f->table));
+        if (f->table == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        f->mask = size - 1;
+        for (e = f->first; e; e = e->next) {
+            e->chain = f->table[e->hash & f->mask];
+            f->table[e->hash & f->mask] = e;
+        }
+    }
+
+    a = xrealloc(NULL, sizeof(*a));
+    memset(a, 0, sizeof(*a));
+    a->group = group;
+    a->key = key;
+    a->hash = h;
+    a->chain = f->table[h & f->mask];
+    f->table[h & f->mask] = a;
+    if (f->last) {
+        f->last->next = a;
+    } else {
+        f->first = a;
+    }
+    f->last = a;
+    f->naggregates++;
+    return a;
+}
+
+static void aggregate_nodes(struct fleet *f) {
+    int ii;
+    size_t jj;
+
+    for (ii = 0; ii < f->nnodes; ++ii) {
+        struct node *n = &f->nodes[ii];
+        if (n->error != NULL) {
+            continue;
+        }
+        for (jj = 0; jj < n->nstats; ++jj) {
+            struct aggregate *a;
+            if (n->stats[jj].key == NULL) {
+                continue;
+            }
+            a = get_aggregate(f, n->stats[jj].group, n->stats[jj].key);
+            if (a->nvalues == a->valuesize) {
+                a->valuesize = a->valuesize ? a->valuesize * 2 : 16;
+                a->values = xrealloc(a->values,
+                                     a->valuesize * sizeof(*a->values));
+            }
+            a->values[a->nvalues++] = n->stats[jj].value;
+        }
+    }
+}
+
+static void print_json_string(const char *str) {
+    fputc('"', stdout);
+    for (; *str != '\0'; ++str) {
+        unsigned char ch = (unsigned char)*str;
+        if (ch == '"' || ch == '\\') {
+            fprintf(stdout, "\\%c", ch);
+        } else if (ch < 0x20) {
+            fprintf(stdout, "\\u%04x", ch);
+        } else {
+            fputc(ch, stdout);
+        }
+    }
+    fputc('"', stdout);
+}
+
+static bool parse_integer(const char *str, int64_t *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(str, &end, 10);
+    return *str != '\0' && *end == '\0' && errno == 0;
+}
+
+static bool parse_double(const char *str, double *value) {
+    char *end;
+    *value = strtod(str, &end);
+    return *str != '\0' && *end == '\0';
+}
+
+/* Add the histogram src to dest, false if they don't have the same shape */
+static bool merge_histogram(cJSON *dest, cJSON *src) {
+    if (dest->type != src->type) {
+        return false;
+    }
+    switch (dest->type) {
+    case cJSON_Number:
+        dest->valuedouble += src->valuedouble;
+        dest->valueint = (int)dest->valuedouble;
+        return true;
+    case cJSON_String:
+        return strcmp(dest->valuestring, src->valuestring) == 0;
+    case cJSON_Array:
+    case cJSON_Object:
+        {
+            cJSON *d = dest->child;
+            cJSON *s = src->child;
+            for (; d != NULL && s != NULL; d = d->next, s = s->next) {
+                if ((dest->type == cJSON_Object &&
+                     strcmp(d->string, s->string) != 0) ||
+                    !merge_histogram(d, s)) {
+                    return false;
+                }
+            }
+            return d == NULL && s == NULL;
+        }
+    default:
+        return dest->type == cJSON_NULL || dest->type == cJSON_True ||
+            dest->type == cJSON_False;
+    }
+}
+
+static bool print_histogram(const struct aggregate *a) {
+    cJSON *sum;
+    char *text;
+    int ii;
+
+    if (a->values[0][0] != '[' && a->values[0][0] != '{') {
+        return false;
+    }
+    if ((sum = cJSON_Parse(a->values[0])) == NULL) {
+        return false;
+    }
+    for (ii = 1; ii < a->nvalues; ++ii) {
+        cJSON *h = cJSON_Parse(a->values[ii]);
+        bool ok = h != NULL && merge_histogram(sum, h);
+        cJSON_Delete(h);
+        if (!ok) {
+            cJSON_Delete(sum);
+            return false;
+        }
+    }
+    text = cJSON_PrintUnformatted(sum);
+    fprintf(stdout, "{\"histogram\":%s,\"nodes\":%d}", text, a->nvalues);
+    cJSON_Free(text);
+    cJSON_Delete(sum);
+    return true;
+}
+
+static void print_aggregate(const struct aggregate *a) {
+    int64_t isum = 0, imin = 0, imax = 0, ivalue;
+    double dsum = 0, dmin = 0, dmax = 0, dvalue;
+    bool integers = true, numbers = true;
+    int ii, jj;
+
+    for (ii = 0; ii < a->nvalues && numbers; ++ii) {
+        if (integers && parse_integer(a->values[ii], &ivalue)) {
+            isum += ivalue;
+            imin = (ii == 0 || ivalue < imin) ? ivalue : imin;
+            imax = (ii == 0 || ivalue > imax) ? ivalue : imax;
+        } else {
+            integers = false;
+        }
+        if (parse_double(a->values[ii], &dvalue)) {
+            dsum += dvalue;
+            dmin = (ii == 0 || dvalue < dmin) ? dvalue : dmin;
+            dmax = (ii == 0 || dvalue > dmax) ? dvalue : dmax;
+        } else {
+            numbers = false;
+        }
+    }
+
+    if (integers) {
+        fprintf(stdout, "{\"sum\":%" PRId64 ",\"min\":%" PRId64
+                ",\"max\":%" PRId64 ",\"nodes\":%d}", isum, imin, imax,
+                a->nvalues);
+    } else if (numbers) {
+        fprintf(stdout, "{\"sum\":%.17g,\"min\":%.17g,\"max\":%.17g,"
+                "\"nodes\":%d}", dsum, dmin, dmax, a->nvalues);
+    } else if (!print_histogram(a)) {
+        /* Count the nodes by value */
+        fputs("{\"values\":{", stdout);
+        for (ii = 0; ii < a->nvalues; ++ii) {
+            int count = 0;
+            for (jj = 0; jj < a->nvalues; ++jj) {
+                if (strcmp(a->values[ii], a->values[jj]) == 0) {
+                    if (jj < ii) {
+                        break;
+                    }
+                    ++count;
+                }
+            }
+            if (count > 0) {
+                fputs(ii == 0 ? "" : ",", stdout);
+                print_json_string(a->values[ii]);
+                fprintf(stdout, ":%d", count);
+            }
+        }
+        fprintf(stdout, "},\"nodes\":%d}", a->nvalues);
+    }
+}
+
+static const char *group_name(const struct fleet *f, int group) {
+    return f->groups[group] ? f->groups[group] : "all";
+}
+
+static void print_fleet(const struct fleet *f, bool per_node) {
+    const struct aggregate *a;
+    int ii, group, failed = 0;
+    size_t jj;
+
+    fprintf(stdout, "{\"nodes\":%d,\"failed\":{", f->nnodes);
+    for (ii = 0; ii < f->nnodes; ++ii) {
+        if (f->nodes[ii].error != NULL) {
+            fputs(failed++ ? "," : "", stdout);
+            print_json_string(f->nodes[ii].name);
+            fputc(':', stdout);
+            print_json_string(f->nodes[ii].error);
+        }
+    }
+
+    fputs("},\"errors\":{", stdout);
+    failed = 0;
+    for (ii = 0; ii < f->nnodes; ++ii) {
+        const struct node *n = &f->nodes[ii];
+        for (jj = 0; n->error == NULL && jj < n->nstats; ++jj) {
+            if (n->stats[jj].key == NULL) {
+                fputs(failed++ ? "," : "", stdout);
+                fputc('"', stdout);
+                fprintf(stdout, "%s %s", n->name,
+                        group_name(f, n->stats[jj].group));
+                fputs("\":", stdout);
+                print_json_string(n->stats[jj].value);
+            }
+        }
+    }
+
+    fputs("},\"aggregate\":{", stdout);
+    for (group = 0; group < f->ngroups; ++group) {
+        bool first = true;
+        fputs(group ? "," : "", stdout);
+        print_json_string(group_name(f, group));
+        fputs(":{", stdout);
+        for (a = f->first; a; a = a->next) {
+            if (a->group == group) {
+                fputs(first ? "" : ",", stdout);
+                first = false;
+                print_json_string(a->key);
+                fputc(':', stdout);
+                print_aggregate(a);
+            }
+        }
+        fputc('}', stdout);
+    }
+    fputc('}', stdout);
+
+    if (per_node) {
+        fputs(",\"per_node\":{", stdout);
+        for (ii = 0; ii < f->nnodes; ++ii) {
+            const struct node *n = &f->nodes[ii];
+            fputs(ii ? "," : "", stdout);
+            print_json_string(n->name);
+            fputs(":{", stdout);
+            for (group = 0; n->error == NULL && group < f->ngroups; ++group) {
+                bool first = true;
+                fputs(group ? "," : "", stdout);
+                print_json_string(group_name(f, group));
+                fputs(":{", stdout);
+                for (jj = 0; jj < n->nstats; ++jj) {
+                    if (n->stats[jj].group == group &&
+                        n->stats[jj].key != NULL) {
+                        fputs(first ? "" : ",", stdout);
+                        first = false;
+                        print_json_string(n->stats[jj].key);
+                        fputc(':', stdout);
+                        print_json_string(n->stats[jj].value);
+                    }
+                }
+                fputc('}', stdout);
+            }
+            fputc('}', stdout);
+        }
+        fputc('}', stdout);
+    }
+    fputs("}\n", stdout);
+    fflush(stdout);
+}
+
+/* Add the comma separated nodes (or the ones in @file, one per line) */
+static void add_nodes(struct fleet *f, const char *list) {
+    char *copy;
+    char *node;
+    char *save = NULL;
+
+    if (list[0] == '@') {
+        FILE *fp = fopen(list + 1, "r");
+        char line[1024];
+        if (fp == NULL) {
+            fprintf(stderr, "Failed to open %s: %s\n", list + 1,
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            line[strcspn(line, " \t\r\n#")] = '\0';
+            if (line[0] != '\0') {
+                add_nodes(f, line);
+            }
+        }
+        fclose(fp);
+        return;
+    }
+
+    copy = xstrndup(list, strlen(list));
+    for (node = strtok_r(copy, ",", &save); node != NULL;
+         node = strtok_r(NULL, ",", &save)) {
+        struct node *n;
+        f->nodes = xrealloc(f->nodes, (f->nnodes + 1) * sizeof(*f->nodes));
+        n = &f->nodes[f->nnodes++];
+        memset(n, 0, sizeof(*n));
+        n->name = xstrndup(node, strlen(node));
+        n->fd = -1;
+        n->state = NODE_IDLE;
+    }
+    free(copy);
+}
+
+static int stat_fleet(struct fleet *f, int concurrency, int timeout_ms,
+                      bool per_node) {
+    int ii, failed = 0;
+
+    query_nodes(f, concurrency, (hrtime_t)timeout_ms * 1000000);
+    aggregate_nodes(f);
+    print_fleet(f, per_node);
+
+    for (ii = 0; ii < f->nnodes; ++ii) {
+        if (f->nodes[ii].error != NULL) {
+            ++failed;
+        }
+    }
+    return failed == f->nnodes ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
+
 int main(int argc, char** argv) {
     int cmd;
     const char *port = "11210";
@@ -98,11 +859,16 @@ int main(int argc, char** argv) {
     SSL_CTX* ctx;
     BIO* bio;
     bool tcp_nodelay = false;
+    const char *nodes = NULL;
+    bool json = false;
+    bool per_node = false;
+    int concurrency = 64;
+    int timeout_ms = 5000;
 
     /* Initialize the socket subsystem */
     cb_initialize_sockets();
 
-    while ((cmd = getopt(argc, argv, "Th:p:u:b:P:s")) != EOF) {
+    while ((cmd = getopt(argc, argv, "Th:p:u:b:P:sn:jac:t:")) != EOF) {
         switch (cmd) {
         case 'T' :
             tcp_nodelay = true;
@@ -135,9 +901,25 @@ int main(int argc, char** argv) {
         case 's':
             secure = 1;
             break;
+        case 'n':
+            nodes = optarg;
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 'a':
+            per_node = true;
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 't':
+            timeout_ms = atoi(optarg);
+            break;
         default:
             fprintf(stderr,
                     "Usage: mcstat [-h host[:port]] [-p port] [-b bucket] [-u user] [-P pass] [-s] [-T] statkey ...\n"
+                    "       mcstat -n host[:port],... [-j] [-a] [-c nodes] [-t ms] [-b bucket] [-u user] [-P pass] [-T] statkey ...\n"
                     "\n"
                     "  -h hostname[:port]  Host (and optional port number) to retrieve stats from\n"
                     "  -p port             Port number\n"
@@ -146,11 +928,60 @@ int main(int argc, char** argv) {
                     "  -P password         Password (if bucket is password-protected)\n"
                     "  -s                  Connect to node securely (using SSL)\n"
                     "  -T                  Request TCP_NODELAY from the server\n"
+                    "  -n nodes            Query the comma separated nodes (or the ones\n"
+                    "                      listed in @file) in parallel, and print their\n"
+                    "                      stats summed up as JSON\n"
+                    "  -j                  Print the stats of -h as JSON, as with -n\n"
+                    "  -a                  Include the stats of every node in the JSON\n"
+                    "  -c nodes            Nodes to query at the same time (default 64)\n"
+                    "  -t ms               Timeout of a node (default 5000)\n"
                     "  statkey ...         Statistic(s) to request\n");
             return 1;
         }
     }
 
+    if (nodes != NULL || json) {
+#ifdef WIN32
+        fprintf(stderr, "Error: -n and -j are not supported on this platform\n");
+        return 1;
+#else
+        struct fleet fleet;
+        char node[1024];
+        static const char *all[] = { NULL };
+
+        if (secure) {
+            fprintf(stderr, "Error: -s is not supported with -n and -j\n");
+            return 1;
+        }
+        if (concurrency <= 0 || timeout_ms <= 0) {
+            fprintf(stderr, "Error: -c and -t must be positive\n");
+            return 1;
+        }
+        memset(&fleet, 0, sizeof(fleet));
+        fleet.user = user;
+        fleet.pass = pass;
+        fleet.tcp_nodelay = tcp_nodelay;
+        if (optind == argc) {
+            fleet.groups = all;
+            fleet.ngroups = 1;
+        } else {
+            fleet.groups = (const char **)(argv + optind);
+            fleet.ngroups = argc - optind;
+        }
+        if (nodes != NULL) {
+            add_nodes(&fleet, nodes);
+        } else {
+            snprintf(node, sizeof(node), "%s:%s", host, port);
+            add_nodes(&fleet, node);
+        }
+        if (fleet.nnodes == 0) {
+            fprintf(stderr, "Error: no nodes to query\n");
+            return 1;
+        }
+        return stat_fleet(&fleet, concurrency, timeout_ms, per_node);
+#endif
+    }
+
     if (create_ssl_connection(&ctx, &bio, host, port, user, pass, secure) != 0) {
         return 1;
     }
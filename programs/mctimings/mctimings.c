@@ -8,6 +8,11 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
 #include <cJSON.h>
 
 #include "programs/utilities.h"
@@ -30,6 +35,12 @@ typedef struct timings_st {
     uint32_t wayout;
 
     uint64_t total;
+
+    /* Percentiles and the slowest command (in ns, 0 if not reported) */
+    double p50;
+    double p99;
+    double p999;
+    double slowest;
 } timings_t;
 
 timings_t timings;
@@ -78,6 +89,43 @@ static void dump_histogram(void)
 
 }
 
+static double get_percentile(cJSON *o, const char *name)
+{
+    cJSON *i = cJSON_GetObjectItem(o, name);
+    return i ? i->valuedouble : 0;
+}
+
+static void dump_percentiles(FILE *fp)
+{
+    if (timings.slowest > 0) {
+        fprintf(fp, "p50 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus\n",
+                timings.p50 / 1000, timings.p99 / 1000,
+                timings.p999 / 1000, timings.slowest / 1000);
+    }
+}
+
+/* Servers with phase_timings enabled split the time in phases */
+static void dump_phases(FILE *fp, cJSON *r)
+{
+    cJSON *phases = cJSON_GetObjectItem(r, "phases");
+    cJSON *i;
+
+    if (phases == NULL) {
+        return;
+    }
+    for (i = phases->child; i != NULL; i = i->next) {
+        cJSON *o = cJSON_GetObjectItem(i, "percentiles");
+        cJSON *max = cJSON_GetObjectItem(i, "max");
+        if (o == NULL || max == NULL) {
+            continue;
+        }
+        fprintf(fp, "    %-12s p50 %.1fus, p99 %.1fus, p99.9 %.1fus, "
+                "max %.1fus\n", i->string, get_percentile(o, "50") / 1000,
+                get_percentile(o, "99") / 1000,
+                get_percentile(o, "99.9") / 1000, max->valuedouble / 1000);
+    }
+}
+
 static int json2internal(cJSON *r)
 {
     int ii;
@@ -168,25 +216,42 @@ static int json2internal(cJSON *r)
         timings.max = timings.wayout;
     }
 
+    /* Older servers don't report percentiles */
+    timings.p50 = timings.p99 = timings.p999 = timings.slowest = 0;
+    o = cJSON_GetObjectItem(r, "percentiles");
+    i = cJSON_GetObjectItem(r, "max");
+    if (o != NULL && i != NULL) {
+        timings.p50 = get_percentile(o, "50");
+        timings.p99 = get_percentile(o, "99");
+        timings.p999 = get_percentile(o, "99.9");
+        timings.slowest = i->valuedouble;
+    }
+
     return 0;
 }
 
-static void request_timings(BIO *bio, uint8_t opcode, int verbose, int skip)
+/*
+ * Get the timings of the opcode (or their breakdown) from the server,
+ * exits on failure
+ */
+static cJSON *fetch_json(BIO *bio, uint8_t opcode, uint8_t breakdown)
 {
     uint32_t buffsize;
     char *buffer;
-    protocol_binary_request_get_cmd_timer request;
+    protocol_binary_request_get_cmd_timer_breakdown request;
     protocol_binary_response_no_extras response;
     cJSON *json, *obj;
+    uint8_t extlen = breakdown == PROTOCOL_BINARY_CMD_TIMER_HISTOGRAM ? 1 : 2;
 
     memset(&request, 0, sizeof(request));
     request.message.header.request.magic = PROTOCOL_BINARY_REQ;
     request.message.header.request.opcode = PROTOCOL_BINARY_CMD_GET_CMD_TIMER;
-    request.message.header.request.extlen = 1;
-    request.message.header.request.bodylen = htonl(1);
+    request.message.header.request.extlen = extlen;
+    request.message.header.request.bodylen = htonl(extlen);
     request.message.body.opcode = opcode;
+    request.message.body.breakdown = breakdown;
 
-    ensure_send(bio, &request, sizeof(request.bytes));
+    ensure_send(bio, &request, sizeof(request.message.header) + extlen);
 
     ensure_recv(bio, &response, sizeof(response.bytes));
     buffsize = ntohl(response.message.header.response.bodylen);
@@ -209,44 +274,304 @@ static void request_timings(BIO *bio, uint8_t opcode, int verbose, int skip)
         fprintf(stderr, "Failed to parse json\n");
         exit(EXIT_FAILURE);
     }
+    free(buffer);
+
     obj = cJSON_GetObjectItem(json, "error");
-    if (obj == NULL) {
-        char buffer[8];
-        const char *cmd = memcached_opcode_2_text(opcode);
-        if (cmd == NULL) {
-            snprintf(buffer, sizeof(buffer), "0x%02x", opcode);
-            cmd = buffer;
-        }
+    if (obj != NULL) {
+        fprintf(stderr, "Error: %s\n", obj->valuestring);
+        exit(EXIT_FAILURE);
+    }
+    return json;
+}
+
+static cJSON *fetch_timings(BIO *bio, uint8_t opcode)
+{
+    cJSON *json = fetch_json(bio, opcode, PROTOCOL_BINARY_CMD_TIMER_HISTOGRAM);
+
+    if (json2internal(json) == -1) {
+        fprintf(stderr, "cJSON representation:\n%s\n", cJSON_Print(json));
+        exit(EXIT_FAILURE);
+    }
+    return json;
+}
 
-        if (json2internal(json) == -1) {
-            fprintf(stderr, "Payload received:\n%s\n", buffer);
-            fprintf(stderr, "cJSON representation:\n%s\n", cJSON_Print(json));
-            exit(EXIT_FAILURE);
+static const char *opcode_name(uint8_t opcode, char *buffer, size_t size)
+{
+    const char *cmd = memcached_opcode_2_text(opcode);
+    if (cmd == NULL) {
+        snprintf(buffer, size, "0x%02x", opcode);
+        cmd = buffer;
+    }
+    return cmd;
+}
+
+/* The percentiles of each size (or batch) class the server saw */
+static void dump_breakdown(BIO *bio, uint8_t opcode, uint8_t breakdown)
+{
+    cJSON *json = fetch_json(bio, opcode, breakdown);
+    cJSON *classes = cJSON_GetObjectItem(json, "classes");
+    const char *unit = breakdown == PROTOCOL_BINARY_CMD_TIMER_BY_SIZE ?
+        "bytes" : "keys";
+    cJSON *i;
+
+    for (i = classes ? classes->child : NULL; i != NULL; i = i->next) {
+        cJSON *from = cJSON_GetObjectItem(i, "from");
+        cJSON *to = cJSON_GetObjectItem(i, "to");
+        cJSON *count = cJSON_GetObjectItem(i, "count");
+        cJSON *o = cJSON_GetObjectItem(i, "percentiles");
+        cJSON *max = cJSON_GetObjectItem(i, "max");
+        char range[64];
+
+        if (from == NULL || count == NULL || o == NULL || max == NULL) {
+            continue;
         }
+        if (to == NULL) {
+            snprintf(range, sizeof(range), "%.0f - inf. %s",
+                     from->valuedouble, unit);
+        } else {
+            snprintf(range, sizeof(range), "%.0f - %.0f %s",
+                     from->valuedouble, to->valuedouble, unit);
+        }
+        fprintf(stderr, "    %-24s %10.0f ops, p50 %.1fus, p99 %.1fus, "
+                "p99.9 %.1fus, max %.1fus\n", range, count->valuedouble,
+                get_percentile(o, "50") / 1000,
+                get_percentile(o, "99") / 1000,
+                get_percentile(o, "99.9") / 1000, max->valuedouble / 1000);
+    }
+    cJSON_Delete(json);
+}
 
-        if (timings.max == 0) {
-            if (skip == 0) {
-                fprintf(stdout,
-                        "The server don't have information about \"%s\"\n",
-                        cmd);
-            }
+static void request_timings(BIO *bio, uint8_t opcode, int verbose, int skip,
+                            uint8_t breakdown)
+{
+    cJSON *json = fetch_timings(bio, opcode);
+    char buffer[8];
+    const char *cmd = opcode_name(opcode, buffer, sizeof(buffer));
+
+    if (timings.max == 0) {
+        if (skip == 0) {
+            fprintf(stdout,
+                    "The server don't have information about \"%s\"\n",
+                    cmd);
+        }
+    } else {
+        if (verbose) {
+            fprintf(stdout,
+                    "The following data is collected for \"%s\"\n",
+                    cmd);
+            dump_histogram();
+            fprintf(stderr, "Total: %"PRIu64" operations\n", timings.total);
+            dump_percentiles(stderr);
+            dump_phases(stderr, json);
         } else {
-            if (verbose) {
-                fprintf(stdout,
-                        "The following data is collected for \"%s\"\n",
-                        cmd);
-                dump_histogram();
-                fprintf(stderr, "Total: %"PRIu64" operations\n", timings.total);
-            } else {
-                fprintf(stderr, "%s: %"PRIu64" operations\n", cmd, timings.total);
-            }
+            fprintf(stderr, "%s: %"PRIu64" operations\n", cmd, timings.total);
+            dump_percentiles(stderr);
+        }
+        if (breakdown != PROTOCOL_BINARY_CMD_TIMER_HISTOGRAM) {
+            dump_breakdown(bio, opcode, breakdown);
+        }
+    }
+
+    cJSON_Delete(json);
+}
+
+/*
+ * Watch mode (-w): the histograms are fetched every interval, and the
+ * difference with the previous ones is shown, so the percentiles are the
+ * ones of the commands of the last interval. They're worked out from the
+ * histogram buckets (the upper bound of the bucket they fall in), so
+ * they're coarser than the lifetime ones from the server.
+ */
+#define WATCH_BUCKETS (1 + 100 + 49 + 10 + 1)
+
+/* The buckets of the timings, slowest last, and the highest ns in each */
+static void flatten_timings(uint64_t *counts, uint64_t *upper)
+{
+    int ii;
+    int idx = 0;
+
+    counts[idx] = timings.ns;
+    upper[idx++] = 999;
+    for (ii = 0; ii < 100; ++ii) {
+        counts[idx] = timings.us[ii];
+        upper[idx++] = (ii + 1) * 10000ULL - 1;
+    }
+    for (ii = 1; ii < 50; ++ii) {
+        counts[idx] = timings.ms[ii];
+        upper[idx++] = (ii + 1) * 1000000ULL - 1;
+    }
+    for (ii = 0; ii < 10; ++ii) {
+        counts[idx] = timings.halfsec[ii];
+        upper[idx++] = (ii + 1) * 500000000ULL - 1;
+    }
+    counts[idx] = timings.wayout;
+    upper[idx] = UINT64_MAX;
+}
+
+static uint64_t watch_percentile(const uint64_t *delta, const uint64_t *upper,
+                                 uint64_t total, double fraction)
+{
+    uint64_t wanted = (uint64_t)(fraction * total + 0.5);
+    uint64_t seen = 0;
+    int ii;
+
+    if (wanted == 0) {
+        wanted = 1;
+    }
+    for (ii = 0; ii < WATCH_BUCKETS; ++ii) {
+        seen += delta[ii];
+        if (seen >= wanted) {
+            return upper[ii];
         }
+    }
+    return UINT64_MAX;
+}
+
+static const char *format_ns(uint64_t ns, char *buffer, size_t size)
+{
+    if (ns == UINT64_MAX) {
+        snprintf(buffer, size, ">4.5s");
+    } else if (ns < 1000) {
+        snprintf(buffer, size, "<1us");
+    } else if (ns < 1000000) {
+        snprintf(buffer, size, "%.0fus", (ns + 1) / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buffer, size, "%.0fms", (ns + 1) / 1e6);
     } else {
-        fprintf(stderr, "Error: %s\n", obj->valuestring);
+        snprintf(buffer, size, "%.1fs", (ns + 1) / 1e9);
+    }
+    return buffer;
+}
+
+/* The columns of the heatmap, by the (exclusive) bound of their time */
+static const struct {
+    const char *name;
+    uint64_t bound;
+} heat_columns[] = {
+    { "1us", 1000ULL }, { "10us", 10000ULL }, { "20us", 20000ULL },
+    { "50us", 50000ULL }, { "100us", 100000ULL }, { "200us", 200000ULL },
+    { "500us", 500000ULL }, { "1ms", 1000000ULL }, { "2ms", 2000000ULL },
+    { "5ms", 5000000ULL }, { "10ms", 10000000ULL }, { "20ms", 20000000ULL },
+    { "50ms", 50000000ULL }, { "100ms", 100000000ULL },
+    { "500ms", 500000000ULL }, { "1s", 1000000000ULL },
+    { "5s", 5000000000ULL }, { "inf", UINT64_MAX }
+};
+
+#define HEAT_COLUMNS (sizeof(heat_columns) / sizeof(heat_columns[0]))
+
+/* A character per column, darker for a bigger share of the commands */
+static void format_heat(const uint64_t *delta, const uint64_t *upper,
+                        uint64_t total, char *out)
+{
+    static const char shades[] = " .:-=+*#%@";
+    uint64_t column[HEAT_COLUMNS];
+    size_t col = 0;
+    int ii;
+
+    memset(column, 0, sizeof(column));
+    for (ii = 0; ii < WATCH_BUCKETS; ++ii) {
+        while (col < HEAT_COLUMNS - 1 && upper[ii] >= heat_columns[col].bound) {
+            ++col;
+        }
+        column[col] += delta[ii];
+    }
+    for (col = 0; col < HEAT_COLUMNS; ++col) {
+        int shade = 0;
+        if (column[col] > 0) {
+            /* Anything at all shows, the rest is in tenths */
+            shade = 1 + (int)(column[col] * (sizeof(shades) - 3) / total);
+        }
+        out[col] = shades[shade];
+    }
+    out[HEAT_COLUMNS] = '\0';
+}
+
+static void watch_sleep(int seconds)
+{
+#ifdef WIN32
+    Sleep(seconds * 1000);
+#else
+    sleep(seconds);
+#endif
+}
+
+static void watch_timings(BIO *bio, const uint8_t *opcodes, int nopcodes,
+                          int interval, int count)
+{
+    uint64_t (*previous)[WATCH_BUCKETS];
+    uint64_t upper[WATCH_BUCKETS];
+    int iteration;
+    size_t col;
+    int ii;
+
+    previous = calloc(nopcodes, sizeof(*previous));
+    if (previous == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
         exit(EXIT_FAILURE);
     }
 
-    cJSON_Delete(json);
+    fprintf(stdout, "Heatmap columns (commands faster than):");
+    for (col = 0; col < HEAT_COLUMNS; ++col) {
+        fprintf(stdout, " %s", heat_columns[col].name);
+    }
+    fprintf(stdout, "\n");
+
+    for (iteration = 0; count == 0 || iteration <= count; ++iteration) {
+        char now[32];
+        time_t t = time(NULL);
+        int shown = 0;
+
+        strftime(now, sizeof(now), "%H:%M:%S", localtime(&t));
+        for (ii = 0; ii < nopcodes; ++ii) {
+            uint64_t current[WATCH_BUCKETS];
+            uint64_t delta[WATCH_BUCKETS];
+            uint64_t total = 0;
+            int jj;
+
+            cJSON_Delete(fetch_timings(bio, opcodes[ii]));
+            flatten_timings(current, upper);
+            for (jj = 0; jj < WATCH_BUCKETS; ++jj) {
+                /* A "stats reset" starts over from 0 */
+                delta[jj] = current[jj] >= previous[ii][jj] ?
+                    current[jj] - previous[ii][jj] : current[jj];
+                total += delta[jj];
+                previous[ii][jj] = current[jj];
+            }
+
+            /* The first fetch is the baseline */
+            if (iteration > 0 && total > 0) {
+                char name[8], p50[16], p99[16], p999[16];
+                char heat[HEAT_COLUMNS + 1];
+
+                if (shown++ == 0) {
+                    fprintf(stdout, "%-8s %-20s %10s %7s %7s %7s |%-*s|\n",
+                            now, "opcode", "ops/s", "p50", "p99", "p99.9",
+                            (int)HEAT_COLUMNS, "heatmap");
+                }
+                format_heat(delta, upper, total, heat);
+                fprintf(stdout, "%-8s %-20s %10.0f %7s %7s %7s |%s|\n", "",
+                        opcode_name(opcodes[ii], name, sizeof(name)),
+                        (double)total / interval,
+                        format_ns(watch_percentile(delta, upper, total, 0.5),
+                                  p50, sizeof(p50)),
+                        format_ns(watch_percentile(delta, upper, total, 0.99),
+                                  p99, sizeof(p99)),
+                        format_ns(watch_percentile(delta, upper, total, 0.999),
+                                  p999, sizeof(p999)),
+                        heat);
+            }
+        }
+        if (iteration > 0 && shown == 0) {
+            fprintf(stdout, "%-8s no commands\n", now);
+        }
+        fflush(stdout);
+
+        if (count == 0 || iteration < count) {
+            watch_sleep(interval);
+        }
+    }
+
+    free(previous);
 }
 
 int main(int argc, char** argv) {
@@ -257,6 +582,9 @@ int main(int argc, char** argv) {
     const char *pass = NULL;
     int verbose = 0;
     int secure = 0;
+    int interval = 0;
+    int count = 0;
+    uint8_t breakdown = PROTOCOL_BINARY_CMD_TIMER_HISTOGRAM;
     char *ptr;
     SSL_CTX* ctx;
     BIO* bio;
@@ -264,7 +592,7 @@ int main(int argc, char** argv) {
     /* Initialize the socket subsystem */
     cb_initialize_sockets();
 
-    while ((cmd = getopt(argc, argv, "h:p:u:P:sv")) != EOF) {
+    while ((cmd = getopt(argc, argv, "h:p:u:P:svw:n:b:")) != EOF) {
         switch (cmd) {
         case 'h' :
             host = optarg;
@@ -289,9 +617,34 @@ int main(int argc, char** argv) {
         case 'v':
             verbose = 1;
             break;
+        case 'w':
+            interval = atoi(optarg);
+            if (interval <= 0) {
+                fprintf(stderr, "Invalid interval: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            count = atoi(optarg);
+            if (count <= 0) {
+                fprintf(stderr, "Invalid count: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "size") == 0) {
+                breakdown = PROTOCOL_BINARY_CMD_TIMER_BY_SIZE;
+            } else if (strcmp(optarg, "batch") == 0) {
+                breakdown = PROTOCOL_BINARY_CMD_TIMER_BY_BATCH;
+            } else {
+                fprintf(stderr, "Invalid breakdown (size or batch): %s\n",
+                        optarg);
+                return 1;
+            }
+            break;
         default:
             fprintf(stderr,
-                    "Usage mctimings [-h host[:port]] [-p port] [-u user] [-P pass] [-s] -v [opcode]*\n");
+                    "Usage mctimings [-h host[:port]] [-p port] [-u user] [-P pass] [-s] -v [-b size|batch] [-w interval [-n count]] [opcode]*\n");
             return 1;
         }
     }
@@ -300,14 +653,28 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    if (optind == argc) {
+    if (interval > 0) {
+        uint8_t opcodes[256];
+        int nopcodes = 0;
+
+        if (optind == argc) {
+            for (int ii = 0; ii < 256; ++ii) {
+                opcodes[nopcodes++] = (uint8_t)ii;
+            }
+        } else {
+            for (; optind < argc && nopcodes < 256; ++optind) {
+                opcodes[nopcodes++] = memcached_text_2_opcode(argv[optind]);
+            }
+        }
+        watch_timings(bio, opcodes, nopcodes, interval, count);
+    } else if (optind == argc) {
         for (int ii = 0; ii < 256; ++ii) {
-            request_timings(bio, (uint8_t)ii, verbose, 1);
+            request_timings(bio, (uint8_t)ii, verbose, 1, breakdown);
         }
     } else {
         for (; optind < argc; ++optind) {
             request_timings(bio, memcached_text_2_opcode(argv[optind]),
-                            verbose, 0);
+                            verbose, 0, breakdown);
         }
     }
 
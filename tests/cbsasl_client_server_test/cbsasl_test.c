@@ -131,6 +131,15 @@ static void test_auth(const char *mech)
     }
 
     if (err == CBSASL_OK) {
+        if (serverlen) {
+            /* SCRAM lets the client verify the server too */
+            err = cbsasl_client_step(client, serverdata, serverlen,
+                                     NULL, &data, &len);
+            if (err != CBSASL_OK) {
+                fprintf(stderr, "cbsasl_client_step() failed: %d\n", err);
+                exit(EXIT_FAILURE);
+            }
+        }
         fprintf(stdout, "Authenticated\n");
         return;
     } else {
@@ -150,6 +159,11 @@ int main(void)
 
     test_auth("PLAIN");
     test_auth("CRAM-MD5");
+    test_auth("SCRAM-SHA1");
+    test_auth("SCRAM-SHA256");
+    test_auth("SCRAM-SHA512");
+    /* The secrets derived for the user are reused */
+    test_auth("SCRAM-SHA512");
 
     cbsasl_server_term();
     remove(cbpwfile);
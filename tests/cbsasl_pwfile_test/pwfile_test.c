@@ -37,18 +37,24 @@ static void test_pwfile()
 {
     char *cfg;
     char *password;
+    user_db_t *db;
 
     pwfile_init();
     create_pw_file();
     cb_assert(load_user_db() == CBSASL_OK);
-    password = find_pw(user1, &cfg);
+    password = find_pw(user1, &cfg, &db);
     cb_assert(strncmp(password, pass1, strlen(pass1)) == 0);
+    user_db_release(db);
 
-    password = find_pw(user2, &cfg);
+    password = find_pw(user2, &cfg, &db);
     cb_assert(strncmp(password, pass2, strlen(pass2)) == 0);
+    user_db_release(db);
 
-    password = find_pw(user3, &cfg);
+    password = find_pw(user3, &cfg, &db);
     cb_assert(strncmp(password, pass3, strlen(pass3)) == 0);
+    user_db_release(db);
+
+    cb_assert(find_pw("nobody", &cfg, &db) == NULL);
 
     remove_pw_file();
 }
@@ -66,7 +66,7 @@ static void test_list_mechs()
     unsigned len = 0;
     cbsasl_error_t err = cbsasl_list_mechs(&mechs, &len);
     cb_assert(err == CBSASL_OK);
-    cb_assert(strncmp(mechs, "CRAM-MD5 PLAIN", len) == 0);
+    cb_assert(strncmp(mechs, "SCRAM-SHA512 SCRAM-SHA256 SCRAM-SHA1 CRAM-MD5 PLAIN", len) == 0);
     cb_assert(strncmp(mechs, "CRDM-MD5 PLAIN", len) != 0);
 }
 
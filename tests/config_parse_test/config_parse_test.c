@@ -95,6 +95,14 @@ void calculate_maxconns(void) {
     /* do nothing */
 }
 
+void threads_resize(int nthreads) {
+    /* do nothing */
+}
+
+void rebind_interface(int idx, const struct interface *interf) {
+    /* do nothing */
+}
+
 bool load_extension(const char *soname, const char *config) {
     return true;
 }
@@ -181,6 +189,12 @@ static cJSON* get_baseline_settings(const char* temp_file)
     }
     cJSON_AddTrueToObject(baseline, "require_sasl");
     cJSON_AddFalseToObject(baseline, "require_init");
+    cJSON_AddFalseToObject(baseline, "reuseport");
+    cJSON_AddFalseToObject(baseline, "io_uring");
+    cJSON_AddFalseToObject(baseline, "arena_per_thread");
+    cJSON_AddNumberToObject(baseline, "dcp_threads", 0);
+    cJSON_AddNumberToObject(baseline, "sasl_threads", 0);
+    cJSON_AddStringToObject(baseline, "hash_algorithm", "jenkins");
     cJSON_AddNumberToObject(baseline, "default_reqs_per_event", 1);
     cJSON_AddNumberToObject(baseline, "reqs_per_event_low_priority", 5);
     cJSON_AddNumberToObject(baseline, "reqs_per_event_med_priority", 10);
@@ -409,6 +423,27 @@ static void test_interfaces_duplicate_port(struct test_ctx *ctx) {
     cb_assert(error_msg != NULL);
 }
 
+static void test_interfaces_path(struct test_ctx *ctx) {
+    /* A unix domain socket, authenticating its clients */
+    cJSON *iface = cJSON_GetArrayItem(cJSON_GetObjectItem(ctx->config,
+                                                          "interfaces"), 0);
+    cJSON_AddStringToObject(iface, "path", "@memcached");
+    cJSON_AddTrueToObject(iface, "peercred");
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg));
+    cb_assert(error_msg == NULL);
+    cb_assert(strcmp(settings.interfaces[0].path, "@memcached") == 0);
+    cb_assert(settings.interfaces[0].peercred);
+}
+
+static void test_interfaces_peercred_no_path(struct test_ctx *ctx) {
+    /* peercred only works on a unix domain socket */
+    cJSON *iface = cJSON_GetArrayItem(cJSON_GetObjectItem(ctx->config,
+                                                          "interfaces"), 0);
+    cJSON_AddTrueToObject(iface, "peercred");
+    cb_assert(!parse_JSON_config(ctx->config, &settings, &error_msg));
+    cb_assert(error_msg != NULL);
+}
+
 static void test_breakpad_1(struct test_ctx *ctx) {
     /* Test breakpad with baseline config (breakpad disabled). */
     cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg));
@@ -424,7 +459,7 @@ static void test_breakpad_2(struct test_ctx *ctx) {
 }
 
 static void test_breakpad_3(struct test_ctx *ctx) {
-    /* Content can only be 'default. */
+    /* Content can only be 'default' or 'minimal'. */
     cJSON *breakpad = cJSON_GetObjectItem(ctx->config, "breakpad");
     cJSON_ReplaceItemInObject(breakpad, "enabled", cJSON_CreateTrue());
     cJSON_AddStringToObject(breakpad, "minidump_dir", "minidump_dir");
@@ -433,6 +468,26 @@ static void test_breakpad_3(struct test_ctx *ctx) {
     cb_assert(error_msg != NULL);
 }
 
+static void test_breakpad_4(struct test_ctx *ctx) {
+    /* Minimal content, written by the helper process. */
+    cJSON *breakpad = cJSON_GetObjectItem(ctx->config, "breakpad");
+    cJSON_ReplaceItemInObject(breakpad, "enabled", cJSON_CreateTrue());
+    cJSON_AddStringToObject(breakpad, "minidump_dir", "minidump_dir");
+    cJSON_AddStringToObject(breakpad, "content", "minimal");
+    cJSON_AddTrueToObject(breakpad, "helper");
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg));
+    cb_assert(settings.breakpad.content == CONTENT_MINIMAL);
+    cb_assert(settings.breakpad.helper);
+}
+
+static void test_breakpad_5(struct test_ctx *ctx) {
+    /* helper is a boolean. */
+    cJSON *breakpad = cJSON_GetObjectItem(ctx->config, "breakpad");
+    cJSON_AddStringToObject(breakpad, "helper", "yes");
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+}
+
 static void test_dynamic_same(struct test_ctx *ctx) {
     /* Identity config should be valid */
     cb_assert(validate_dynamic_JSON_changes(ctx));
@@ -446,12 +501,43 @@ static void test_dynamic_admin(struct test_ctx *ctx) {
 }
 
 static void test_dynamic_threads(struct test_ctx *ctx) {
-    /* Threads cannot be changed */
+    /* Threads cannot go above max_threads */
+    cJSON_ReplaceItemInObject(ctx->dynamic, "threads", cJSON_CreateNumber(9));
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void test_dynamic_threads_max(struct test_ctx *ctx) {
+    /* CAN change threads up to max_threads */
+    settings.max_threads = 16;
+    cJSON_ReplaceItemInObject(ctx->dynamic, "threads", cJSON_CreateNumber(9));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cJSON_ReplaceItemInObject(ctx->dynamic, "threads", cJSON_CreateNumber(0));
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void test_dynamic_threads_reuseport(struct test_ctx *ctx) {
+    /* Cannot change threads with reuseport */
+    settings.max_threads = 16;
+    settings.reuseport = true;
+    cJSON_ReplaceItemInObject(ctx->dynamic, "reuseport", cJSON_CreateTrue());
     cJSON_ReplaceItemInObject(ctx->dynamic, "threads", cJSON_CreateNumber(9));
     cb_assert(validate_dynamic_JSON_changes(ctx) == false);
     cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
 }
 
+static void test_dynamic_max_threads(struct test_ctx *ctx) {
+    /* Cannot change max_threads */
+    settings.max_threads = 16;
+    cJSON_AddNumberToObject(ctx->dynamic, "max_threads", 16);
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cJSON_ReplaceItemInObject(ctx->dynamic, "max_threads",
+                              cJSON_CreateNumber(32));
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
 static void test_dynamic_interfaces_count(struct test_ctx *ctx) {
     /* Count of interfaces cannot be changed */
     cJSON *iface = cJSON_CreateObject();
@@ -462,9 +548,20 @@ static void test_dynamic_interfaces_count(struct test_ctx *ctx) {
 }
 
 static void test_dynamic_interfaces_host(struct test_ctx *ctx) {
-    /* Cannot change host at runtime */
+    /* CAN change host (the interface is rebound) */
+    cJSON *iface = cJSON_GetArrayItem(cJSON_GetObjectItem(ctx->dynamic,
+                                                          "interfaces"), 0);
+    cJSON_ReplaceItemInObject(iface, "host",
+                              cJSON_CreateString("different_host"));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+}
+
+static void test_dynamic_interfaces_host_reuseport(struct test_ctx *ctx) {
+    /* Cannot change host at runtime with reuseport */
     cJSON *iface = cJSON_GetArrayItem(cJSON_GetObjectItem(ctx->dynamic,
                                                           "interfaces"), 0);
+    settings.reuseport = true;
+    cJSON_ReplaceItemInObject(ctx->dynamic, "reuseport", cJSON_CreateTrue());
     cJSON_ReplaceItemInObject(iface, "host",
                               cJSON_CreateString("different_host"));
     cb_assert(validate_dynamic_JSON_changes(ctx) == false);
@@ -481,22 +578,29 @@ static void test_dynamic_interfaces_port(struct test_ctx *ctx) {
     cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
 }
 
-static void test_dynamic_interfaces_ipv4(struct test_ctx *ctx) {
-    /* Cannot change IPv4 at runtime */
+static void test_dynamic_interfaces_path(struct test_ctx *ctx) {
+    /* Cannot change path or peercred at runtime */
     cJSON *iface = cJSON_GetArrayItem(cJSON_GetObjectItem(ctx->dynamic,
                                                           "interfaces"), 0);
-    cJSON_ReplaceItemInObject(iface, "ipv4", cJSON_CreateFalse());
+    cJSON_AddStringToObject(iface, "path", "/tmp/memcached.sock");
     cb_assert(validate_dynamic_JSON_changes(ctx) == false);
     cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
 }
 
+static void test_dynamic_interfaces_ipv4(struct test_ctx *ctx) {
+    /* CAN change IPv4 */
+    cJSON *iface = cJSON_GetArrayItem(cJSON_GetObjectItem(ctx->dynamic,
+                                                          "interfaces"), 0);
+    cJSON_ReplaceItemInObject(iface, "ipv4", cJSON_CreateFalse());
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+}
+
 static void test_dynamic_interfaces_ipv6(struct test_ctx *ctx) {
-    /* Cannot change IPv6 at runtime */
+    /* CAN change IPv6 */
     cJSON *iface = cJSON_GetArrayItem(cJSON_GetObjectItem(ctx->dynamic,
                                                           "interfaces"), 0);
     cJSON_ReplaceItemInObject(iface, "ipv6", cJSON_CreateFalse());
-    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
-    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+    cb_assert(validate_dynamic_JSON_changes(ctx));
 }
 
 static void test_dynamic_interfaces_maxconn(struct test_ctx *ctx) {
@@ -539,6 +643,10 @@ static void test_dynamic_interfaces_ssl(struct test_ctx *ctx) {
     /* Change SSH cert */
     cJSON_ReplaceItemInObject(ssl, "cert", cJSON_CreateString(new_file));
     cb_assert(validate_dynamic_JSON_changes(ctx));
+
+    /* Enable kernel TLS */
+    cJSON_AddTrueToObject(ssl, "ktls");
+    cb_assert(validate_dynamic_JSON_changes(ctx));
     free(new_file);
 }
 
@@ -602,6 +710,36 @@ static void test_dynamic_require_init(struct test_ctx *ctx) {
     cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
 }
 
+static void test_dynamic_reuseport(struct test_ctx *ctx) {
+    /* Cannot change reuseport */
+    cJSON_ReplaceItemInObject(ctx->dynamic, "reuseport", cJSON_CreateTrue());
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void test_dynamic_hash_algorithm(struct test_ctx *ctx) {
+    /* Cannot change hash_algorithm */
+    cJSON_ReplaceItemInObject(ctx->dynamic, "hash_algorithm",
+                              cJSON_CreateString("crc32c"));
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void test_dynamic_io_uring(struct test_ctx *ctx) {
+    /* Cannot change io_uring */
+    cJSON_ReplaceItemInObject(ctx->dynamic, "io_uring", cJSON_CreateTrue());
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void test_dynamic_arena_per_thread(struct test_ctx *ctx) {
+    /* Cannot change arena_per_thread */
+    cJSON_ReplaceItemInObject(ctx->dynamic, "arena_per_thread",
+                              cJSON_CreateTrue());
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
 static void test_dynamic_reqs_per_event(struct test_ctx *ctx) {
     /* CAN change reqs_per_event */
     cJSON_ReplaceItemInObject(ctx->dynamic, "reqs_per_event", cJSON_CreateNumber(2));
@@ -672,35 +810,1609 @@ static void teardown_max_packet_size(struct test_ctx *ctx) {
     cJSON_Delete(ctx->config);
 }
 
-static void test_dynamic_ssl_cipher_list_1(struct test_ctx *ctx) {
-    cJSON_ReplaceItemInObject(ctx->dynamic, "ssl_cipher_list",
-                              cJSON_CreateString("DEFAULT"));
+static void test_dynamic_max_packet_size(struct test_ctx *ctx) {
+    /* CAN change max_packet_size */
+    cJSON_AddNumberToObject(ctx->dynamic, "max_packet_size", 40);
     cb_assert(validate_dynamic_JSON_changes(ctx));
     cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
 }
 
-static void test_dynamic_ssl_cipher_list_2(struct test_ctx *ctx) {
-    cJSON_ReplaceItemInObject(ctx->dynamic, "ssl_cipher_list",
-                              cJSON_CreateString(""));
+static void setup_zerocopy_threshold(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"zerocopy_threshold\": 16384}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_zerocopy_threshold(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.zerocopy_threshold);
+    cb_assert(settings.zerocopy_threshold == 16384);
+}
+
+static void teardown_zerocopy_threshold(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void setup_connection_dispatch(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"connection_dispatch\": \"least_load\"}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_connection_dispatch(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.connection_dispatch);
+    cb_assert(settings.connection_dispatch == DISPATCH_LEAST_LOAD);
+}
+
+static void setup_invalid_connection_dispatch(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"connection_dispatch\": \"random\"}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_connection_dispatch(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.connection_dispatch);
+    free(error_msg);
+}
+
+static void teardown_connection_dispatch(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_connection_dispatch(struct test_ctx *ctx) {
+    /* CAN change connection_dispatch */
+    cJSON_AddItemToObject(ctx->dynamic, "connection_dispatch",
+                          cJSON_CreateString("least_connections"));
     cb_assert(validate_dynamic_JSON_changes(ctx));
     cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
 }
 
-static void test_dynamic_breakpad_1(struct test_ctx *ctx) {
-    /* Check enabled can be changed from true -> false. */
-    cJSON *breakpad = cJSON_GetObjectItem(ctx->dynamic, "breakpad");
-    cJSON *enabled = cJSON_GetObjectItem(breakpad, "enabled");
-    cb_assert(enabled->type == cJSON_True);
-    cJSON_ReplaceItemInObject(breakpad, "enabled", cJSON_CreateFalse());
+static void setup_hash_algorithm(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"hash_algorithm\": \"crc32c\"}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_hash_algorithm(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.hash_algorithm);
+    cb_assert(settings.hash_algorithm == HASH_CRC32C);
+}
+
+static void setup_invalid_hash_algorithm(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"hash_algorithm\": \"md5\"}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_hash_algorithm(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.hash_algorithm);
+    free(error_msg);
+}
+
+static void teardown_hash_algorithm(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void setup_connection_migration_threshold(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"connection_migration_threshold\": 25}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_connection_migration_threshold(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.connection_migration_threshold);
+    cb_assert(settings.connection_migration_threshold == 25);
+}
+
+static void setup_invalid_connection_migration_threshold(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"connection_migration_threshold\": 101}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_connection_migration_threshold(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.connection_migration_threshold);
+    free(error_msg);
+}
+
+static void teardown_connection_migration_threshold(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_connection_migration_threshold(struct test_ctx *ctx) {
+    /* CAN change connection_migration_threshold */
+    cJSON_AddItemToObject(ctx->dynamic, "connection_migration_threshold",
+                          cJSON_CreateNumber(50));
     cb_assert(validate_dynamic_JSON_changes(ctx));
     cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
 }
 
-static void test_dynamic_breakpad_2(struct test_ctx *ctx) {
-    /* Check minidump_dir can be changed. */
-    cJSON *breakpad = cJSON_GetObjectItem(ctx->dynamic, "breakpad");
-    cJSON_ReplaceItemInObject(breakpad, "minidump_dir",
-                              cJSON_CreateString("new_minidump_dir"));
+static void setup_response_coalescing_usec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"response_coalescing_usec\": 200}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_response_coalescing_usec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.response_coalescing_usec);
+    cb_assert(settings.response_coalescing_usec == 200);
+}
+
+static void setup_invalid_response_coalescing_usec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"response_coalescing_usec\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_response_coalescing_usec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.response_coalescing_usec);
+    free(error_msg);
+}
+
+static void teardown_response_coalescing_usec(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_response_coalescing_usec(struct test_ctx *ctx) {
+    /* CAN change response_coalescing_usec */
+    cJSON_AddItemToObject(ctx->dynamic, "response_coalescing_usec",
+                          cJSON_CreateNumber(100));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_direct_receive_size(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"direct_receive_size\": 65536}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_direct_receive_size(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.direct_receive_size);
+    cb_assert(settings.direct_receive_size == 65536);
+}
+
+static void setup_invalid_direct_receive_size(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"direct_receive_size\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_direct_receive_size(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.direct_receive_size);
+    free(error_msg);
+}
+
+static void teardown_direct_receive_size(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_direct_receive_size(struct test_ctx *ctx) {
+    /* CAN change direct_receive_size */
+    cJSON_AddItemToObject(ctx->dynamic, "direct_receive_size",
+                          cJSON_CreateNumber(1048576));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_max_outstanding_commands(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"max_outstanding_commands\": 32}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_max_outstanding_commands(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.max_outstanding_commands);
+    cb_assert(settings.max_outstanding_commands == 32);
+}
+
+static void setup_invalid_max_outstanding_commands(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"max_outstanding_commands\": 1000}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_max_outstanding_commands(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.max_outstanding_commands);
+    free(error_msg);
+}
+
+static void teardown_max_outstanding_commands(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_max_outstanding_commands(struct test_ctx *ctx) {
+    /* CAN change max_outstanding_commands */
+    cJSON_AddItemToObject(ctx->dynamic, "max_outstanding_commands",
+                          cJSON_CreateNumber(0));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_compression_threshold(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"compression_threshold\": 128}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_compression_threshold(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.compression_threshold);
+    cb_assert(settings.compression_threshold == 128);
+}
+
+static void setup_invalid_compression_threshold(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"compression_threshold\": 10}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_compression_threshold(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.compression_threshold);
+    free(error_msg);
+}
+
+static void teardown_compression_threshold(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_compression_threshold(struct test_ctx *ctx) {
+    /* CAN change compression_threshold */
+    cJSON_AddItemToObject(ctx->dynamic, "compression_threshold",
+                          cJSON_CreateNumber(1024));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_inflate_cache_size(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"inflate_cache_size\": 4096}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_inflate_cache_size(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.inflate_cache_size);
+    cb_assert(settings.inflate_cache_size == 4096);
+}
+
+static void setup_invalid_inflate_cache_size(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"inflate_cache_size\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_inflate_cache_size(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.inflate_cache_size);
+    free(error_msg);
+}
+
+static void teardown_inflate_cache_size(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_inflate_cache_size(struct test_ctx *ctx) {
+    /* CAN change inflate_cache_size */
+    cJSON_AddItemToObject(ctx->dynamic, "inflate_cache_size",
+                          cJSON_CreateNumber(0));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_dictionary_compression(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"dictionary_compression_max\": 1024,"
+                              " \"dictionary_file\": \"/tmp/dictionaries\"}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_dictionary_compression(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.dictionary_compression_max);
+    cb_assert(settings.dictionary_compression_max == 1024);
+    /* It doesn't have to exist */
+    cb_assert(settings.has.dictionary_file);
+    cb_assert(strcmp(settings.dictionary_file, "/tmp/dictionaries") == 0);
+    free((char*)settings.dictionary_file);
+}
+
+static void setup_invalid_dictionary_compression(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"dictionary_compression_max\": 1000000}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_dictionary_compression(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.dictionary_compression_max);
+    free(error_msg);
+}
+
+static void teardown_dictionary_compression(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_dictionary_compression(struct test_ctx *ctx) {
+    /* CAN turn dictionary_compression_max off */
+    cJSON_AddItemToObject(ctx->dynamic, "dictionary_compression_max",
+                          cJSON_CreateNumber(0));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_stream_compression_level(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"stream_compression_level\": 3}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_stream_compression_level(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.stream_compression_level);
+    cb_assert(settings.stream_compression_level == 3);
+}
+
+static void setup_invalid_stream_compression_level(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"stream_compression_level\": 10}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_stream_compression_level(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.stream_compression_level);
+    free(error_msg);
+}
+
+static void teardown_stream_compression_level(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_stream_compression_level(struct test_ctx *ctx) {
+    /* CAN turn stream_compression_level off */
+    cJSON_AddItemToObject(ctx->dynamic, "stream_compression_level",
+                          cJSON_CreateNumber(0));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void test_dynamic_dictionary_file(struct test_ctx *ctx) {
+    /* Cannot change dictionary_file */
+    cJSON_AddStringToObject(ctx->dynamic, "dictionary_file",
+                            "/tmp/dictionaries");
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void test_dynamic_scripts_file(struct test_ctx *ctx) {
+    /* Cannot change scripts_file */
+    cJSON_AddStringToObject(ctx->dynamic, "scripts_file", "/tmp/scripts");
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void setup_subdoc_index_cache_size(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"subdoc_index_cache_size\": 65536}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_subdoc_index_cache_size(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.subdoc_index_cache_size);
+    cb_assert(settings.subdoc_index_cache_size == 65536);
+}
+
+static void setup_invalid_subdoc_index_cache_size(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"subdoc_index_cache_size\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_subdoc_index_cache_size(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.subdoc_index_cache_size);
+    free(error_msg);
+}
+
+static void teardown_subdoc_index_cache_size(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_subdoc_index_cache_size(struct test_ctx *ctx) {
+    /* CAN change subdoc_index_cache_size */
+    cJSON_AddItemToObject(ctx->dynamic, "subdoc_index_cache_size",
+                          cJSON_CreateNumber(0));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_prefetch_depth(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"prefetch_depth\": 8}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_prefetch_depth(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.prefetch_depth);
+    cb_assert(settings.prefetch_depth == 8);
+}
+
+static void setup_invalid_prefetch_depth(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"prefetch_depth\": 17}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_prefetch_depth(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.prefetch_depth);
+    free(error_msg);
+}
+
+static void teardown_prefetch_depth(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_prefetch_depth(struct test_ctx *ctx) {
+    /* CAN change prefetch_depth */
+    cJSON_AddItemToObject(ctx->dynamic, "prefetch_depth",
+                          cJSON_CreateNumber(0));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_stats_snapshot_msec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"stats_snapshot_msec\": 500}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_stats_snapshot_msec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.stats_snapshot_msec);
+    cb_assert(settings.stats_snapshot_msec == 500);
+}
+
+static void setup_invalid_stats_snapshot_msec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"stats_snapshot_msec\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_stats_snapshot_msec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.stats_snapshot_msec);
+    free(error_msg);
+}
+
+static void teardown_stats_snapshot_msec(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_stats_snapshot_msec(struct test_ctx *ctx) {
+    /* CAN change stats_snapshot_msec */
+    cJSON_AddItemToObject(ctx->dynamic, "stats_snapshot_msec",
+                          cJSON_CreateNumber(1000));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_max_threads(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"max_threads\": 16}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_max_threads(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.max_threads);
+    cb_assert(settings.max_threads == 16);
+}
+
+static void setup_invalid_max_threads(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"max_threads\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_max_threads(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.max_threads);
+    free(error_msg);
+}
+
+static void teardown_max_threads(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void setup_dcp_threads(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"dcp_threads\": 2}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_dcp_threads(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.dcp_threads);
+    cb_assert(settings.num_dcp_threads == 2);
+}
+
+static void setup_invalid_dcp_threads(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"dcp_threads\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_dcp_threads(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.dcp_threads);
+    free(error_msg);
+}
+
+static void teardown_dcp_threads(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_dcp_threads(struct test_ctx *ctx) {
+    /* Cannot change dcp_threads */
+    cJSON_ReplaceItemInObject(ctx->dynamic, "dcp_threads",
+                              cJSON_CreateNumber(2));
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void setup_scheduler_slice_usec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"scheduler_slice_usec\": 200}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_scheduler_slice_usec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.scheduler_slice_usec);
+    cb_assert(settings.scheduler_slice_usec == 200);
+}
+
+static void setup_invalid_scheduler_slice_usec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"scheduler_slice_usec\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_scheduler_slice_usec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.scheduler_slice_usec);
+    free(error_msg);
+}
+
+static void teardown_scheduler_slice_usec(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_scheduler_slice_usec(struct test_ctx *ctx) {
+    /* CAN change scheduler_slice_usec */
+    cJSON_AddItemToObject(ctx->dynamic, "scheduler_slice_usec",
+                          cJSON_CreateNumber(500));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_max_slice_usec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"max_slice_usec\": 2000}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_max_slice_usec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.max_slice_usec);
+    cb_assert(settings.max_slice_usec == 2000);
+}
+
+static void setup_invalid_max_slice_usec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"max_slice_usec\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_max_slice_usec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.max_slice_usec);
+    free(error_msg);
+}
+
+static void teardown_max_slice_usec(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_max_slice_usec(struct test_ctx *ctx) {
+    /* CAN change max_slice_usec */
+    cJSON_AddItemToObject(ctx->dynamic, "max_slice_usec",
+                          cJSON_CreateNumber(500));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_shed_inflight(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"shed_inflight\": 64}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_shed_inflight(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.shed_inflight);
+    cb_assert(settings.shed_inflight == 64);
+}
+
+static void setup_invalid_shed_inflight(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"shed_inflight\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_shed_inflight(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.shed_inflight);
+    free(error_msg);
+}
+
+static void teardown_shed_inflight(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_shed_inflight(struct test_ctx *ctx) {
+    /* CAN change shed_inflight */
+    cJSON_AddItemToObject(ctx->dynamic, "shed_inflight",
+                          cJSON_CreateNumber(500));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_shed_delay_usec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"shed_delay_usec\": 2000}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_shed_delay_usec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.shed_delay_usec);
+    cb_assert(settings.shed_delay_usec == 2000);
+}
+
+static void setup_invalid_shed_delay_usec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"shed_delay_usec\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_shed_delay_usec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.shed_delay_usec);
+    free(error_msg);
+}
+
+static void teardown_shed_delay_usec(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_shed_delay_usec(struct test_ctx *ctx) {
+    /* CAN change shed_delay_usec */
+    cJSON_AddItemToObject(ctx->dynamic, "shed_delay_usec",
+                          cJSON_CreateNumber(500));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_max_unsent_bytes(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"max_unsent_bytes\": 1048576}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_max_unsent_bytes(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.max_unsent_bytes);
+    cb_assert(settings.max_unsent_bytes == 1048576);
+}
+
+static void setup_invalid_max_unsent_bytes(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"max_unsent_bytes\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_max_unsent_bytes(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.max_unsent_bytes);
+    free(error_msg);
+}
+
+static void teardown_max_unsent_bytes(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_max_unsent_bytes(struct test_ctx *ctx) {
+    /* CAN change max_unsent_bytes */
+    cJSON_AddItemToObject(ctx->dynamic, "max_unsent_bytes",
+                          cJSON_CreateNumber(2097152));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_max_pinned_items(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"max_pinned_items\": 64}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_max_pinned_items(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.max_pinned_items);
+    cb_assert(settings.max_pinned_items == 64);
+}
+
+static void setup_invalid_max_pinned_items(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"max_pinned_items\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_max_pinned_items(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.max_pinned_items);
+    free(error_msg);
+}
+
+static void teardown_max_pinned_items(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_max_pinned_items(struct test_ctx *ctx) {
+    /* CAN change max_pinned_items */
+    cJSON_AddItemToObject(ctx->dynamic, "max_pinned_items",
+                          cJSON_CreateNumber(128));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_rate_limit_user_ops(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"rate_limit_user_ops\": 1000}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_rate_limit_user_ops(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.rate_limit_user_ops);
+    cb_assert(settings.rate_limit_user_ops == 1000);
+}
+
+static void setup_invalid_rate_limit_user_ops(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"rate_limit_user_ops\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_rate_limit_user_ops(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.rate_limit_user_ops);
+    free(error_msg);
+}
+
+static void teardown_rate_limit_user_ops(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_rate_limit_user_ops(struct test_ctx *ctx) {
+    /* CAN change rate_limit_user_ops */
+    cJSON_AddItemToObject(ctx->dynamic, "rate_limit_user_ops",
+                          cJSON_CreateNumber(500));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_rate_limit_user_bytes(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"rate_limit_user_bytes\": 1000}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_rate_limit_user_bytes(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.rate_limit_user_bytes);
+    cb_assert(settings.rate_limit_user_bytes == 1000);
+}
+
+static void setup_invalid_rate_limit_user_bytes(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"rate_limit_user_bytes\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_rate_limit_user_bytes(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.rate_limit_user_bytes);
+    free(error_msg);
+}
+
+static void teardown_rate_limit_user_bytes(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_rate_limit_user_bytes(struct test_ctx *ctx) {
+    /* CAN change rate_limit_user_bytes */
+    cJSON_AddItemToObject(ctx->dynamic, "rate_limit_user_bytes",
+                          cJSON_CreateNumber(500));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_rate_limit_bucket_ops(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"rate_limit_bucket_ops\": 1000}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_rate_limit_bucket_ops(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.rate_limit_bucket_ops);
+    cb_assert(settings.rate_limit_bucket_ops == 1000);
+}
+
+static void setup_invalid_rate_limit_bucket_ops(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"rate_limit_bucket_ops\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_rate_limit_bucket_ops(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.rate_limit_bucket_ops);
+    free(error_msg);
+}
+
+static void teardown_rate_limit_bucket_ops(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_rate_limit_bucket_ops(struct test_ctx *ctx) {
+    /* CAN change rate_limit_bucket_ops */
+    cJSON_AddItemToObject(ctx->dynamic, "rate_limit_bucket_ops",
+                          cJSON_CreateNumber(500));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_rate_limit_bucket_bytes(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"rate_limit_bucket_bytes\": 1000}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_rate_limit_bucket_bytes(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.rate_limit_bucket_bytes);
+    cb_assert(settings.rate_limit_bucket_bytes == 1000);
+}
+
+static void setup_invalid_rate_limit_bucket_bytes(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"rate_limit_bucket_bytes\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_rate_limit_bucket_bytes(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.rate_limit_bucket_bytes);
+    free(error_msg);
+}
+
+static void teardown_rate_limit_bucket_bytes(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_rate_limit_bucket_bytes(struct test_ctx *ctx) {
+    /* CAN change rate_limit_bucket_bytes */
+    cJSON_AddItemToObject(ctx->dynamic, "rate_limit_bucket_bytes",
+                          cJSON_CreateNumber(500));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_sasl_threads(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"sasl_threads\": 2}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_sasl_threads(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.sasl_threads);
+    cb_assert(settings.num_sasl_threads == 2);
+}
+
+static void setup_invalid_sasl_threads(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"sasl_threads\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_sasl_threads(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.sasl_threads);
+    free(error_msg);
+}
+
+static void teardown_sasl_threads(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_sasl_threads(struct test_ctx *ctx) {
+    /* Cannot change sasl_threads */
+    cJSON_ReplaceItemInObject(ctx->dynamic, "sasl_threads",
+                              cJSON_CreateNumber(2));
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void setup_trace_sample_rate(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"trace_sample_rate\": 1000}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_trace_sample_rate(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.trace_sample_rate);
+    cb_assert(settings.trace_sample_rate == 1000);
+}
+
+static void setup_invalid_trace_sample_rate(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"trace_sample_rate\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_trace_sample_rate(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.trace_sample_rate);
+    free(error_msg);
+}
+
+static void teardown_trace_sample_rate(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_trace_sample_rate(struct test_ctx *ctx) {
+    /* CAN change trace_sample_rate */
+    cJSON_AddItemToObject(ctx->dynamic, "trace_sample_rate",
+                          cJSON_CreateNumber(100));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_phase_timings(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"phase_timings\": true}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_phase_timings(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.phase_timings);
+    cb_assert(settings.phase_timings);
+}
+
+static void setup_invalid_phase_timings(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"phase_timings\": 1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_phase_timings(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.phase_timings);
+    free(error_msg);
+}
+
+static void teardown_phase_timings(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_phase_timings(struct test_ctx *ctx) {
+    /* CAN change phase_timings */
+    cJSON_AddItemToObject(ctx->dynamic, "phase_timings", cJSON_CreateTrue());
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_slow_command_threshold(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"slow_command_threshold\": 500}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_slow_command_threshold(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.slow_command_threshold);
+    cb_assert(settings.slow_command_threshold == 500);
+}
+
+static void setup_invalid_slow_command_threshold(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"slow_command_threshold\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_slow_command_threshold(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.slow_command_threshold);
+    free(error_msg);
+}
+
+static void teardown_slow_command_threshold(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_slow_command_threshold(struct test_ctx *ctx) {
+    /* CAN change slow_command_threshold */
+    cJSON_AddItemToObject(ctx->dynamic, "slow_command_threshold",
+                          cJSON_CreateNumber(100));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_idle_trim_sec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"idle_trim_sec\": 60}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_idle_trim_sec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.idle_trim_sec);
+    cb_assert(settings.idle_trim_sec == 60);
+}
+
+static void setup_invalid_idle_trim_sec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"idle_trim_sec\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_idle_trim_sec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.idle_trim_sec);
+    free(error_msg);
+}
+
+static void teardown_idle_trim_sec(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_idle_trim_sec(struct test_ctx *ctx) {
+    /* CAN change idle_trim_sec */
+    cJSON_AddItemToObject(ctx->dynamic, "idle_trim_sec",
+                          cJSON_CreateNumber(30));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_idle_timeout(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"idle_timeout\": 300}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_idle_timeout(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.idle_timeout);
+    cb_assert(settings.idle_timeout == 300);
+}
+
+static void setup_invalid_idle_timeout(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"idle_timeout\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_idle_timeout(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.idle_timeout);
+    free(error_msg);
+}
+
+static void teardown_idle_timeout(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_idle_timeout(struct test_ctx *ctx) {
+    /* CAN change idle_timeout */
+    cJSON_AddItemToObject(ctx->dynamic, "idle_timeout",
+                          cJSON_CreateNumber(60));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_free_memory_release(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"free_memory_release_pct\": 20,"
+                              " \"free_memory_release_rate\": 32}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_free_memory_release(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.free_memory_release_pct);
+    cb_assert(settings.free_memory_release_pct == 20);
+    cb_assert(settings.has.free_memory_release_rate);
+    cb_assert(settings.free_memory_release_rate == 32);
+}
+
+static void setup_invalid_free_memory_release_pct(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"free_memory_release_pct\": 101}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_free_memory_release_pct(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.free_memory_release_pct);
+    free(error_msg);
+}
+
+static void setup_invalid_free_memory_release_rate(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"free_memory_release_rate\": 0}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_free_memory_release_rate(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.free_memory_release_rate);
+    free(error_msg);
+}
+
+static void teardown_free_memory_release(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_free_memory_release(struct test_ctx *ctx) {
+    /* CAN change free_memory_release_pct and free_memory_release_rate */
+    cJSON_AddItemToObject(ctx->dynamic, "free_memory_release_pct",
+                          cJSON_CreateNumber(10));
+    cJSON_AddItemToObject(ctx->dynamic, "free_memory_release_rate",
+                          cJSON_CreateNumber(128));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_gather_writes(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"gather_writes\": false}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_gather_writes(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.gather_writes);
+    cb_assert(!settings.gather_writes);
+}
+
+static void setup_invalid_gather_writes(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"gather_writes\": 0}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_gather_writes(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.gather_writes);
+    free(error_msg);
+}
+
+static void teardown_gather_writes(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_gather_writes(struct test_ctx *ctx) {
+    /* CAN change gather_writes */
+    cJSON_AddItemToObject(ctx->dynamic, "gather_writes", cJSON_CreateFalse());
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_workload_trace(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"workload_trace_dir\": \"/tmp\","
+                              "\"workload_trace_file_size\": 2097152,"
+                              "\"workload_trace_sample\": 100}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_workload_trace(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.workload_trace_dir);
+    cb_assert(strcmp(settings.workload_trace_dir, "/tmp") == 0);
+    cb_assert(settings.has.workload_trace_file_size);
+    cb_assert(settings.workload_trace_file_size == 2097152);
+    cb_assert(settings.has.workload_trace_sample);
+    cb_assert(settings.workload_trace_sample == 100);
+    free((char*)settings.workload_trace_dir);
+}
+
+static void setup_invalid_workload_trace_file_size(struct test_ctx *ctx) {
+    char buffer[80];
+    snprintf(buffer, sizeof(buffer), "{\"workload_trace_file_size\": %d}",
+             WORKLOAD_TRACE_MIN_FILE_SIZE - 1);
+    ctx->config = cJSON_Parse(buffer);
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_workload_trace_file_size(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.workload_trace_file_size);
+    free(error_msg);
+}
+
+static void setup_invalid_workload_trace_sample(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"workload_trace_sample\": -1}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_workload_trace_sample(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.workload_trace_sample);
+    free(error_msg);
+}
+
+static void teardown_workload_trace(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void setup_vbucket_stats(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"vbucket_stats\": 64}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_vbucket_stats(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.vbucket_stats);
+    cb_assert(settings.vbucket_stats == 64);
+}
+
+static void setup_invalid_vbucket_stats(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"vbucket_stats\": 65537}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_vbucket_stats(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.vbucket_stats);
+    free(error_msg);
+}
+
+static void teardown_vbucket_stats(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_vbucket_stats(struct test_ctx *ctx) {
+    /* Cannot change vbucket_stats */
+    cJSON_AddNumberToObject(ctx->dynamic, "vbucket_stats", 16);
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void test_dynamic_workload_trace_dir(struct test_ctx *ctx) {
+    /* Cannot change workload_trace_dir */
+    cJSON_AddStringToObject(ctx->dynamic, "workload_trace_dir", "/tmp");
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void test_dynamic_workload_trace_sample(struct test_ctx *ctx) {
+    /* CAN change workload_trace_sample */
+    cJSON_AddNumberToObject(ctx->dynamic, "workload_trace_sample", 10);
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_thread_affinity(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"thread_affinity\": \"0-3,8\"}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_thread_affinity(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.thread_affinity);
+    cb_assert(strcmp(settings.thread_affinity, "0-3,8") == 0);
+    free((char*)settings.thread_affinity);
+}
+
+static void setup_invalid_thread_affinity(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"thread_affinity\": \"3-1\"}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_thread_affinity(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.thread_affinity);
+    free(error_msg);
+}
+
+static void teardown_thread_affinity(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_thread_affinity(struct test_ctx *ctx) {
+    /* Cannot change thread_affinity */
+    cJSON_AddStringToObject(ctx->dynamic, "thread_affinity", "auto");
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void setup_busy_poll_usec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"busy_poll_usec\": 50}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_busy_poll_usec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.busy_poll_usec);
+    cb_assert(settings.busy_poll_usec == 50);
+}
+
+static void setup_invalid_busy_poll_usec(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"busy_poll_usec\": 2000000}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_busy_poll_usec(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.busy_poll_usec);
+    free(error_msg);
+}
+
+static void teardown_busy_poll_usec(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_busy_poll_usec(struct test_ctx *ctx) {
+    /* CAN change busy_poll_usec */
+    cJSON_AddItemToObject(ctx->dynamic, "busy_poll_usec",
+                          cJSON_CreateNumber(20));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void setup_proxy(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"proxy\": {\"enabled\": true, "
+                              "\"username\": \"_proxy\", "
+                              "\"password\": \"secret\", "
+                              "\"hedge_usec\": 500}}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_proxy(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.proxy);
+    cb_assert(settings.proxy.enabled);
+    cb_assert(strcmp(settings.proxy.username, "_proxy") == 0);
+    cb_assert(strcmp(settings.proxy.password, "secret") == 0);
+    cb_assert(settings.proxy.hedge_usec == 500);
+}
+
+static void setup_proxy_no_username(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"proxy\": {\"enabled\": true}}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_proxy_no_username(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.proxy);
+    free(error_msg);
+}
+
+static void teardown_proxy(struct test_ctx *ctx) {
+    free_settings(&settings);
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_proxy(struct test_ctx *ctx) {
+    /* CAN turn proxy on and off, but not change who it logs in as */
+    cJSON *proxy = cJSON_CreateObject();
+    cJSON_AddFalseToObject(proxy, "enabled");
+    cJSON_AddNumberToObject(proxy, "hedge_usec", 200);
+    cJSON_AddItemToObject(ctx->dynamic, "proxy", proxy);
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+
+    cJSON_AddStringToObject(proxy, "username", "_proxy");
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void setup_near_cache_items(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"near_cache_items\": 256}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_near_cache_items(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == true);
+    cb_assert(error_msg == NULL);
+    cb_assert(settings.has.near_cache_items);
+    cb_assert(settings.near_cache_items == 256);
+}
+
+static void setup_invalid_near_cache_items(struct test_ctx *ctx) {
+    ctx->config = cJSON_Parse("{\"near_cache_items\": 100000}");
+    error_msg = NULL;
+    memset(&settings, 0, sizeof(settings));
+}
+
+static void test_invalid_near_cache_items(struct test_ctx *ctx) {
+    cb_assert(parse_JSON_config(ctx->config, &settings, &error_msg) == false);
+    cb_assert(error_msg != NULL);
+    cb_assert(!settings.has.near_cache_items);
+    free(error_msg);
+}
+
+static void teardown_near_cache_items(struct test_ctx *ctx) {
+    cJSON_Delete(ctx->config);
+}
+
+static void test_dynamic_near_cache_items(struct test_ctx *ctx) {
+    /* Cannot change near_cache_items */
+    cJSON_AddNumberToObject(ctx->dynamic, "near_cache_items", 128);
+    cb_assert(validate_dynamic_JSON_changes(ctx) == false);
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 1);
+}
+
+static void test_dynamic_ssl_cipher_list_1(struct test_ctx *ctx) {
+    cJSON_ReplaceItemInObject(ctx->dynamic, "ssl_cipher_list",
+                              cJSON_CreateString("DEFAULT"));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void test_dynamic_ssl_cipher_list_2(struct test_ctx *ctx) {
+    cJSON_ReplaceItemInObject(ctx->dynamic, "ssl_cipher_list",
+                              cJSON_CreateString(""));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void test_dynamic_breakpad_1(struct test_ctx *ctx) {
+    /* Check enabled can be changed from true -> false. */
+    cJSON *breakpad = cJSON_GetObjectItem(ctx->dynamic, "breakpad");
+    cJSON *enabled = cJSON_GetObjectItem(breakpad, "enabled");
+    cb_assert(enabled->type == cJSON_True);
+    cJSON_ReplaceItemInObject(breakpad, "enabled", cJSON_CreateFalse());
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void test_dynamic_breakpad_2(struct test_ctx *ctx) {
+    /* Check minidump_dir can be changed. */
+    cJSON *breakpad = cJSON_GetObjectItem(ctx->dynamic, "breakpad");
+    cJSON_ReplaceItemInObject(breakpad, "minidump_dir",
+                              cJSON_CreateString("new_minidump_dir"));
+    cb_assert(validate_dynamic_JSON_changes(ctx));
+    cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
+}
+
+static void test_dynamic_breakpad_3(struct test_ctx *ctx) {
+    /* Check helper can be changed. */
+    cJSON *breakpad = cJSON_GetObjectItem(ctx->dynamic, "breakpad");
+    cJSON_AddTrueToObject(breakpad, "helper");
     cb_assert(validate_dynamic_JSON_changes(ctx));
     cb_assert(cJSON_GetArraySize(ctx->errors) == 0);
 }
@@ -742,17 +2454,107 @@ int main(void)
         { "interfaces_6", setup_interfaces, test_interfaces_6, teardown },
         { "interfaces_7", setup_interfaces, test_interfaces_7, teardown },
         { "interfaces_duplicate", setup_interfaces, test_interfaces_duplicate_port, teardown },
+        { "interfaces_path", setup_interfaces, test_interfaces_path, teardown },
+        { "interfaces_peercred_no_path", setup_interfaces, test_interfaces_peercred_no_path, teardown },
         { "root invalid path", setup_invalid_root, test_invalid_root, teardown_invalid_root },
         { "max_packet_size", setup_max_packet_size, test_max_packet_size, teardown_max_packet_size },
+        { "zerocopy_threshold", setup_zerocopy_threshold, test_zerocopy_threshold, teardown_zerocopy_threshold },
+        { "connection_dispatch", setup_connection_dispatch, test_connection_dispatch, teardown_connection_dispatch },
+        { "connection_dispatch invalid", setup_invalid_connection_dispatch, test_invalid_connection_dispatch, teardown_connection_dispatch },
+        { "hash_algorithm", setup_hash_algorithm, test_hash_algorithm, teardown_hash_algorithm },
+        { "hash_algorithm invalid", setup_invalid_hash_algorithm, test_invalid_hash_algorithm, teardown_hash_algorithm },
+        { "connection_migration_threshold", setup_connection_migration_threshold, test_connection_migration_threshold, teardown_connection_migration_threshold },
+        { "connection_migration_threshold invalid", setup_invalid_connection_migration_threshold, test_invalid_connection_migration_threshold, teardown_connection_migration_threshold },
+        { "response_coalescing_usec", setup_response_coalescing_usec, test_response_coalescing_usec, teardown_response_coalescing_usec },
+        { "response_coalescing_usec invalid", setup_invalid_response_coalescing_usec, test_invalid_response_coalescing_usec, teardown_response_coalescing_usec },
+        { "direct_receive_size", setup_direct_receive_size, test_direct_receive_size, teardown_direct_receive_size },
+        { "direct_receive_size invalid", setup_invalid_direct_receive_size, test_invalid_direct_receive_size, teardown_direct_receive_size },
+        { "max_outstanding_commands", setup_max_outstanding_commands, test_max_outstanding_commands, teardown_max_outstanding_commands },
+        { "max_outstanding_commands invalid", setup_invalid_max_outstanding_commands, test_invalid_max_outstanding_commands, teardown_max_outstanding_commands },
+        { "compression_threshold", setup_compression_threshold, test_compression_threshold, teardown_compression_threshold },
+        { "compression_threshold invalid", setup_invalid_compression_threshold, test_invalid_compression_threshold, teardown_compression_threshold },
+        { "inflate_cache_size", setup_inflate_cache_size, test_inflate_cache_size, teardown_inflate_cache_size },
+        { "inflate_cache_size invalid", setup_invalid_inflate_cache_size, test_invalid_inflate_cache_size, teardown_inflate_cache_size },
+        { "dictionary_compression", setup_dictionary_compression, test_dictionary_compression, teardown_dictionary_compression },
+        { "dictionary_compression invalid", setup_invalid_dictionary_compression, test_invalid_dictionary_compression, teardown_dictionary_compression },
+        { "stream_compression_level", setup_stream_compression_level, test_stream_compression_level, teardown_stream_compression_level },
+        { "stream_compression_level invalid", setup_invalid_stream_compression_level, test_invalid_stream_compression_level, teardown_stream_compression_level },
+        { "subdoc_index_cache_size", setup_subdoc_index_cache_size, test_subdoc_index_cache_size, teardown_subdoc_index_cache_size },
+        { "subdoc_index_cache_size invalid", setup_invalid_subdoc_index_cache_size, test_invalid_subdoc_index_cache_size, teardown_subdoc_index_cache_size },
+        { "prefetch_depth", setup_prefetch_depth, test_prefetch_depth, teardown_prefetch_depth },
+        { "prefetch_depth invalid", setup_invalid_prefetch_depth, test_invalid_prefetch_depth, teardown_prefetch_depth },
+        { "stats_snapshot_msec", setup_stats_snapshot_msec, test_stats_snapshot_msec, teardown_stats_snapshot_msec },
+        { "stats_snapshot_msec invalid", setup_invalid_stats_snapshot_msec, test_invalid_stats_snapshot_msec, teardown_stats_snapshot_msec },
+        { "max_threads", setup_max_threads, test_max_threads, teardown_max_threads },
+        { "max_threads invalid", setup_invalid_max_threads, test_invalid_max_threads, teardown_max_threads },
+        { "dcp_threads", setup_dcp_threads, test_dcp_threads, teardown_dcp_threads },
+        { "dcp_threads invalid", setup_invalid_dcp_threads, test_invalid_dcp_threads, teardown_dcp_threads },
+        { "scheduler_slice_usec", setup_scheduler_slice_usec, test_scheduler_slice_usec, teardown_scheduler_slice_usec },
+        { "scheduler_slice_usec invalid", setup_invalid_scheduler_slice_usec, test_invalid_scheduler_slice_usec, teardown_scheduler_slice_usec },
+        { "max_slice_usec", setup_max_slice_usec, test_max_slice_usec, teardown_max_slice_usec },
+        { "max_slice_usec invalid", setup_invalid_max_slice_usec, test_invalid_max_slice_usec, teardown_max_slice_usec },
+        { "shed_inflight", setup_shed_inflight, test_shed_inflight, teardown_shed_inflight },
+        { "shed_inflight invalid", setup_invalid_shed_inflight, test_invalid_shed_inflight, teardown_shed_inflight },
+        { "shed_delay_usec", setup_shed_delay_usec, test_shed_delay_usec, teardown_shed_delay_usec },
+        { "shed_delay_usec invalid", setup_invalid_shed_delay_usec, test_invalid_shed_delay_usec, teardown_shed_delay_usec },
+        { "max_unsent_bytes", setup_max_unsent_bytes, test_max_unsent_bytes, teardown_max_unsent_bytes },
+        { "max_unsent_bytes invalid", setup_invalid_max_unsent_bytes, test_invalid_max_unsent_bytes, teardown_max_unsent_bytes },
+        { "max_pinned_items", setup_max_pinned_items, test_max_pinned_items, teardown_max_pinned_items },
+        { "max_pinned_items invalid", setup_invalid_max_pinned_items, test_invalid_max_pinned_items, teardown_max_pinned_items },
+        { "rate_limit_user_ops", setup_rate_limit_user_ops, test_rate_limit_user_ops, teardown_rate_limit_user_ops },
+        { "rate_limit_user_ops invalid", setup_invalid_rate_limit_user_ops, test_invalid_rate_limit_user_ops, teardown_rate_limit_user_ops },
+        { "rate_limit_user_bytes", setup_rate_limit_user_bytes, test_rate_limit_user_bytes, teardown_rate_limit_user_bytes },
+        { "rate_limit_user_bytes invalid", setup_invalid_rate_limit_user_bytes, test_invalid_rate_limit_user_bytes, teardown_rate_limit_user_bytes },
+        { "rate_limit_bucket_ops", setup_rate_limit_bucket_ops, test_rate_limit_bucket_ops, teardown_rate_limit_bucket_ops },
+        { "rate_limit_bucket_ops invalid", setup_invalid_rate_limit_bucket_ops, test_invalid_rate_limit_bucket_ops, teardown_rate_limit_bucket_ops },
+        { "rate_limit_bucket_bytes", setup_rate_limit_bucket_bytes, test_rate_limit_bucket_bytes, teardown_rate_limit_bucket_bytes },
+        { "rate_limit_bucket_bytes invalid", setup_invalid_rate_limit_bucket_bytes, test_invalid_rate_limit_bucket_bytes, teardown_rate_limit_bucket_bytes },
+        { "sasl_threads", setup_sasl_threads, test_sasl_threads, teardown_sasl_threads },
+        { "sasl_threads invalid", setup_invalid_sasl_threads, test_invalid_sasl_threads, teardown_sasl_threads },
+        { "trace_sample_rate", setup_trace_sample_rate, test_trace_sample_rate, teardown_trace_sample_rate },
+        { "trace_sample_rate invalid", setup_invalid_trace_sample_rate, test_invalid_trace_sample_rate, teardown_trace_sample_rate },
+        { "phase_timings", setup_phase_timings, test_phase_timings, teardown_phase_timings },
+        { "phase_timings invalid", setup_invalid_phase_timings, test_invalid_phase_timings, teardown_phase_timings },
+        { "slow_command_threshold", setup_slow_command_threshold, test_slow_command_threshold, teardown_slow_command_threshold },
+        { "slow_command_threshold invalid", setup_invalid_slow_command_threshold, test_invalid_slow_command_threshold, teardown_slow_command_threshold },
+        { "idle_trim_sec", setup_idle_trim_sec, test_idle_trim_sec, teardown_idle_trim_sec },
+        { "idle_trim_sec invalid", setup_invalid_idle_trim_sec, test_invalid_idle_trim_sec, teardown_idle_trim_sec },
+        { "idle_timeout", setup_idle_timeout, test_idle_timeout, teardown_idle_timeout },
+        { "idle_timeout invalid", setup_invalid_idle_timeout, test_invalid_idle_timeout, teardown_idle_timeout },
+        { "free_memory_release", setup_free_memory_release, test_free_memory_release, teardown_free_memory_release },
+        { "free_memory_release_pct invalid", setup_invalid_free_memory_release_pct, test_invalid_free_memory_release_pct, teardown_free_memory_release },
+        { "free_memory_release_rate invalid", setup_invalid_free_memory_release_rate, test_invalid_free_memory_release_rate, teardown_free_memory_release },
+        { "gather_writes", setup_gather_writes, test_gather_writes, teardown_gather_writes },
+        { "gather_writes invalid", setup_invalid_gather_writes, test_invalid_gather_writes, teardown_gather_writes },
+        { "workload_trace", setup_workload_trace, test_workload_trace, teardown_workload_trace },
+        { "workload_trace_file_size invalid", setup_invalid_workload_trace_file_size, test_invalid_workload_trace_file_size, teardown_workload_trace },
+        { "workload_trace_sample invalid", setup_invalid_workload_trace_sample, test_invalid_workload_trace_sample, teardown_workload_trace },
+        { "vbucket_stats", setup_vbucket_stats, test_vbucket_stats, teardown_vbucket_stats },
+        { "vbucket_stats invalid", setup_invalid_vbucket_stats, test_invalid_vbucket_stats, teardown_vbucket_stats },
+        { "thread_affinity", setup_thread_affinity, test_thread_affinity, teardown_thread_affinity },
+        { "thread_affinity invalid", setup_invalid_thread_affinity, test_invalid_thread_affinity, teardown_thread_affinity },
+        { "busy_poll_usec", setup_busy_poll_usec, test_busy_poll_usec, teardown_busy_poll_usec },
+        { "busy_poll_usec invalid", setup_invalid_busy_poll_usec, test_invalid_busy_poll_usec, teardown_busy_poll_usec },
+        { "proxy", setup_proxy, test_proxy, teardown_proxy },
+        { "proxy no username", setup_proxy_no_username, test_proxy_no_username, teardown_proxy },
+        { "near_cache_items", setup_near_cache_items, test_near_cache_items, teardown_near_cache_items },
+        { "near_cache_items invalid", setup_invalid_near_cache_items, test_invalid_near_cache_items, teardown_near_cache_items },
         { "breakpad_1", setup_breakpad, test_breakpad_1, teardown },
         { "breakpad_2", setup_breakpad, test_breakpad_2, teardown },
         { "breakpad_3", setup_breakpad, test_breakpad_3, teardown },
+        { "breakpad_4", setup_breakpad, test_breakpad_4, teardown },
+        { "breakpad_5", setup_breakpad, test_breakpad_5, teardown },
         { "dynamic_same", setup_dynamic, test_dynamic_same, teardown_dynamic },
         { "dynamic_admin", setup_dynamic, test_dynamic_admin, teardown_dynamic },
         { "dynamic_threads", setup_dynamic, test_dynamic_threads, teardown_dynamic },
+        { "dynamic_threads_max", setup_dynamic, test_dynamic_threads_max, teardown_dynamic },
+        { "dynamic_threads_reuseport", setup_dynamic, test_dynamic_threads_reuseport, teardown_dynamic },
+        { "dynamic_max_threads", setup_dynamic, test_dynamic_max_threads, teardown_dynamic },
         { "dynamic_interfaces_count", setup_dynamic, test_dynamic_interfaces_count, teardown_dynamic },
         { "dynamic_interfaces_host", setup_dynamic, test_dynamic_interfaces_host, teardown_dynamic },
+        { "dynamic_interfaces_host_reuseport", setup_dynamic, test_dynamic_interfaces_host_reuseport, teardown_dynamic },
         { "dynamic_interfaces_port", setup_dynamic, test_dynamic_interfaces_port, teardown_dynamic },
+        { "dynamic_interfaces_path", setup_dynamic, test_dynamic_interfaces_path, teardown_dynamic },
         { "dynamic_interfaces_ipv4", setup_dynamic, test_dynamic_interfaces_ipv4, teardown_dynamic },
         { "dynamic_interfaces_ipv6", setup_dynamic, test_dynamic_interfaces_ipv6, teardown_dynamic },
         { "dynamic_interfaces_maxconn", setup_dynamic, test_dynamic_interfaces_maxconn, teardown_dynamic },
@@ -766,6 +2568,10 @@ int main(void)
         { "dynamic_engine_config", setup_dynamic, test_dynamic_engine_config, teardown_dynamic },
         { "dynamic_require_sasl", setup_dynamic, test_dynamic_require_sasl, teardown_dynamic },
         { "dynamic_require_init", setup_dynamic, test_dynamic_require_init, teardown_dynamic },
+        { "dynamic_reuseport", setup_dynamic, test_dynamic_reuseport, teardown_dynamic },
+        { "dynamic_io_uring", setup_dynamic, test_dynamic_io_uring, teardown_dynamic },
+        { "dynamic_arena_per_thread", setup_dynamic, test_dynamic_arena_per_thread, teardown_dynamic },
+        { "dynamic_hash_algorithm", setup_dynamic, test_dynamic_hash_algorithm, teardown_dynamic },
         { "dynamic_reqs_per_event", setup_dynamic, test_dynamic_reqs_per_event, teardown_dynamic },
         { "dynamic_verbosity", setup_dynamic, test_dynamic_verbosity, teardown_dynamic },
         { "dynamic_bio_drain_buffer_sz", setup_dynamic, test_dynamic_bio_drain_buffer_sz, teardown_dynamic },
@@ -775,7 +2581,49 @@ int main(void)
         { "dynamic_ssl_cipher_list_2", setup_dynamic, test_dynamic_ssl_cipher_list_2, teardown_dynamic },
         { "dynamic_breakpad_1", setup_dynamic, test_dynamic_breakpad_1, teardown_dynamic },
         { "dynamic_breakpad_2", setup_dynamic, test_dynamic_breakpad_2, teardown_dynamic },
+        { "dynamic_breakpad_3", setup_dynamic, test_dynamic_breakpad_3, teardown_dynamic },
         { "dynamic_privilege_debug", setup_dynamic, test_dynamic_privilege_debug, teardown_dynamic },
+        { "dynamic_connection_dispatch", setup_dynamic, test_dynamic_connection_dispatch, teardown_dynamic },
+        { "dynamic_connection_migration_threshold", setup_dynamic, test_dynamic_connection_migration_threshold, teardown_dynamic },
+        { "dynamic_response_coalescing_usec", setup_dynamic, test_dynamic_response_coalescing_usec, teardown_dynamic },
+        { "dynamic_direct_receive_size", setup_dynamic, test_dynamic_direct_receive_size, teardown_dynamic },
+        { "dynamic_max_outstanding_commands", setup_dynamic, test_dynamic_max_outstanding_commands, teardown_dynamic },
+        { "dynamic_compression_threshold", setup_dynamic, test_dynamic_compression_threshold, teardown_dynamic },
+        { "dynamic_inflate_cache_size", setup_dynamic, test_dynamic_inflate_cache_size, teardown_dynamic },
+        { "dynamic_dictionary_compression", setup_dynamic, test_dynamic_dictionary_compression, teardown_dynamic },
+        { "dynamic_stream_compression_level", setup_dynamic, test_dynamic_stream_compression_level, teardown_dynamic },
+        { "dynamic_dictionary_file", setup_dynamic, test_dynamic_dictionary_file, teardown_dynamic },
+        { "dynamic_scripts_file", setup_dynamic, test_dynamic_scripts_file, teardown_dynamic },
+        { "dynamic_subdoc_index_cache_size", setup_dynamic, test_dynamic_subdoc_index_cache_size, teardown_dynamic },
+        { "dynamic_prefetch_depth", setup_dynamic, test_dynamic_prefetch_depth, teardown_dynamic },
+        { "dynamic_stats_snapshot_msec", setup_dynamic, test_dynamic_stats_snapshot_msec, teardown_dynamic },
+        { "dynamic_max_packet_size", setup_dynamic, test_dynamic_max_packet_size, teardown_dynamic },
+        { "dynamic_dcp_threads", setup_dynamic, test_dynamic_dcp_threads, teardown_dynamic },
+        { "dynamic_scheduler_slice_usec", setup_dynamic, test_dynamic_scheduler_slice_usec, teardown_dynamic },
+        { "dynamic_max_slice_usec", setup_dynamic, test_dynamic_max_slice_usec, teardown_dynamic },
+        { "dynamic_shed_inflight", setup_dynamic, test_dynamic_shed_inflight, teardown_dynamic },
+        { "dynamic_shed_delay_usec", setup_dynamic, test_dynamic_shed_delay_usec, teardown_dynamic },
+        { "dynamic_max_unsent_bytes", setup_dynamic, test_dynamic_max_unsent_bytes, teardown_dynamic },
+        { "dynamic_max_pinned_items", setup_dynamic, test_dynamic_max_pinned_items, teardown_dynamic },
+        { "dynamic_rate_limit_user_ops", setup_dynamic, test_dynamic_rate_limit_user_ops, teardown_dynamic },
+        { "dynamic_rate_limit_user_bytes", setup_dynamic, test_dynamic_rate_limit_user_bytes, teardown_dynamic },
+        { "dynamic_rate_limit_bucket_ops", setup_dynamic, test_dynamic_rate_limit_bucket_ops, teardown_dynamic },
+        { "dynamic_rate_limit_bucket_bytes", setup_dynamic, test_dynamic_rate_limit_bucket_bytes, teardown_dynamic },
+        { "dynamic_sasl_threads", setup_dynamic, test_dynamic_sasl_threads, teardown_dynamic },
+        { "dynamic_trace_sample_rate", setup_dynamic, test_dynamic_trace_sample_rate, teardown_dynamic },
+        { "dynamic_phase_timings", setup_dynamic, test_dynamic_phase_timings, teardown_dynamic },
+        { "dynamic_slow_command_threshold", setup_dynamic, test_dynamic_slow_command_threshold, teardown_dynamic },
+        { "dynamic_idle_trim_sec", setup_dynamic, test_dynamic_idle_trim_sec, teardown_dynamic },
+        { "dynamic_idle_timeout", setup_dynamic, test_dynamic_idle_timeout, teardown_dynamic },
+        { "dynamic_free_memory_release", setup_dynamic, test_dynamic_free_memory_release, teardown_dynamic },
+        { "dynamic_gather_writes", setup_dynamic, test_dynamic_gather_writes, teardown_dynamic },
+        { "dynamic_workload_trace_dir", setup_dynamic, test_dynamic_workload_trace_dir, teardown_dynamic },
+        { "dynamic_workload_trace_sample", setup_dynamic, test_dynamic_workload_trace_sample, teardown_dynamic },
+        { "dynamic_vbucket_stats", setup_dynamic, test_dynamic_vbucket_stats, teardown_dynamic },
+        { "dynamic_thread_affinity", setup_dynamic, test_dynamic_thread_affinity, teardown_dynamic },
+        { "dynamic_busy_poll_usec", setup_dynamic, test_dynamic_busy_poll_usec, teardown_dynamic },
+        { "dynamic_proxy", setup_dynamic, test_dynamic_proxy, teardown_dynamic },
+        { "dynamic_near_cache_items", setup_dynamic, test_dynamic_near_cache_items, teardown_dynamic },
 
     };
     int i;
@@ -0,0 +1,337 @@
+#!/usr/bin/python
+
+#     Copyright 2015 Couchbase, Inc
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#       http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+
+# Benchmarks the network front end of memcached (the memcached-frontend-bench
+# target).
+#
+# Starts memcached on loopback with a fixed configuration (default_engine,
+# a plain and a TLS interface) and drives it with mcbench through a fixed
+# matrix of workloads. For each one it records:
+#  * the throughput and the p50 / p99 latencies seen by mcbench
+#  * the CPU time memcached used per operation (from /proc)
+#  * the CPU cycles per operation, when perf can count them
+#
+# The results are written as JSON together with the commit they were taken
+# at, and compared with the results of a previous run if one is given, so
+# a change to the front end can be checked before it goes in.
+
+
+from __future__ import print_function
+import argparse
+import json
+import os
+import platform
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+
+# name, description, mcbench arguments, interface
+MATRIX = [
+    ("get", "small GET", ["-g", "1", "-s", "32"], "plain"),
+    ("set", "small SET", ["-g", "0", "-s", "32"], "plain"),
+    ("getkq", "pipelined GETKQ, 16 keys per batch",
+     ["-g", "1", "-s", "32", "-b", "16"], "plain"),
+    ("subdoc_get", "SUBDOC_GET of a field of 256 byte documents",
+     ["-g", "1", "-s", "256", "-j", "field"], "plain"),
+    ("tls_get", "small GET over TLS", ["-g", "1", "-s", "32", "-S"], "ssl"),
+]
+
+# Where the workload needs the keys to be there before it starts, and how
+# to store them
+PRELOAD = {
+    "get": ["-s", "32"],
+    "getkq": ["-s", "32"],
+    "subdoc_get": ["-s", "256", "-j", "field"],
+    "tls_get": ["-s", "32"],
+}
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--memcached", required=True)
+    parser.add_argument("--mcbench", required=True)
+    parser.add_argument("--engine", required=True,
+                        help="path to default_engine.so")
+    parser.add_argument("--source", default=None,
+                        help="source tree (to record the commit)")
+    parser.add_argument("--cert", default="tests/cert/testapp.cert")
+    parser.add_argument("--key", default="tests/cert/testapp.pem")
+    parser.add_argument("--port", type=int, default=12300,
+                        help="plain port, the TLS one is the next one")
+    parser.add_argument("--threads", type=int, default=4,
+                        help="memcached worker threads")
+    parser.add_argument("--clients", type=int, default=2,
+                        help="mcbench threads")
+    parser.add_argument("--connections", type=int, default=8,
+                        help="connections per mcbench thread")
+    parser.add_argument("--keys", type=int, default=100000)
+    parser.add_argument("--duration", type=int, default=10)
+    parser.add_argument("--only", default=None,
+                        help="comma separated workloads to run")
+    parser.add_argument("--output", default="frontend_bench.json")
+    parser.add_argument("--baseline",
+                        default=os.environ.get("FRONTEND_BENCH_BASELINE"),
+                        help="results of a previous run to compare with")
+    return parser.parse_args()
+
+
+def git_commit(source):
+    if source is None:
+        return None
+    try:
+        out = subprocess.check_output(["git", "-C", source, "describe",
+                                       "--always", "--dirty"],
+                                      stderr=subprocess.STDOUT)
+        return out.decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def cpu_model():
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    return line.split(":", 1)[1].strip()
+    except IOError:
+        pass
+    return platform.processor()
+
+
+def cpu_seconds(pid):
+    """User and system CPU time used by the process so far"""
+    with open("/proc/{0}/stat".format(pid)) as f:
+        # The command may contain spaces, the fields after it don't
+        fields = f.read().rsplit(")", 1)[1].split()
+    ticks = int(fields[11]) + int(fields[12])
+    return float(ticks) / os.sysconf("SC_CLK_TCK")
+
+
+def start_perf(pid):
+    """Count the cycles of the process until stop_perf(), if perf can"""
+    try:
+        out = tempfile.NamedTemporaryFile(delete=False)
+        out.close()
+        perf = subprocess.Popen(["perf", "stat", "-x", ",", "-e", "cycles",
+                                 "-p", str(pid), "-o", out.name],
+                                stdout=open(os.devnull, "w"),
+                                stderr=subprocess.STDOUT)
+        return (perf, out.name)
+    except OSError:
+        os.remove(out.name)
+        return None
+
+
+def stop_perf(handle):
+    if handle is None:
+        return None
+    (perf, name) = handle
+    perf.send_signal(signal.SIGINT)
+    perf.wait()
+    cycles = None
+    with open(name) as f:
+        for line in f:
+            fields = line.strip().split(",")
+            if len(fields) > 2 and fields[2].startswith("cycles"):
+                try:
+                    cycles = int(fields[0])
+                except ValueError:
+                    pass  # <not supported> or <not counted>
+    os.remove(name)
+    return cycles
+
+
+def write_config(args):
+    config = {"engine": {"module": os.path.abspath(args.engine),
+                         "config": "cache_size=1073741824"},
+              "interfaces": [{"port": args.port,
+                              "maxconn": 1000,
+                              "backlog": 1024,
+                              "host": "127.0.0.1",
+                              "tcp_nodelay": True},
+                             {"port": args.port + 1,
+                              "maxconn": 1000,
+                              "backlog": 1024,
+                              "host": "127.0.0.1",
+                              "tcp_nodelay": True,
+                              "ssl": {"key": os.path.abspath(args.key),
+                                      "cert": os.path.abspath(args.cert)}}],
+              "threads": args.threads,
+              "datatype_support": True,
+              "admin": ""}
+    config_file = tempfile.NamedTemporaryFile(mode="w", suffix=".json",
+                                              delete=False)
+    json.dump(config, config_file)
+    config_file.close()
+    return config_file.name
+
+
+def wait_for_port(memcached, port):
+    for _ in range(100):
+        if memcached.poll() is not None:
+            return False
+        try:
+            socket.create_connection(("127.0.0.1", port), 1).close()
+            return True
+        except socket.error:
+            time.sleep(0.1)
+    return False
+
+
+def mcbench(args, port, extra, duration, output=None):
+    cmd = [args.mcbench, "-h", "127.0.0.1", "-p", str(port),
+           "-t", str(args.clients), "-c", str(args.connections),
+           "-k", str(args.keys), "-d", str(duration)] + extra
+    if output is not None:
+        cmd += ["-o", output]
+    with open(os.devnull, "w") as devnull:
+        return subprocess.call(cmd, stdout=devnull, stderr=devnull) == 0
+
+
+def run_workload(args, memcached, name, extra, iface):
+    port = args.port + (1 if iface == "ssl" else 0)
+    ssl = ["-S"] if iface == "ssl" else []
+
+    if name in PRELOAD:
+        # Store all the keys, with an open loop rate low enough for the
+        # run after the preload to be negligible
+        if not mcbench(args, port, ssl + PRELOAD[name] + ["-l", "-r", "1"],
+                       1):
+            return None
+
+    result_file = tempfile.NamedTemporaryFile(suffix=".json", delete=False)
+    result_file.close()
+    cpu_before = cpu_seconds(memcached.pid)
+    perf = start_perf(memcached.pid)
+    ok = mcbench(args, port, extra, args.duration, result_file.name)
+    cycles = stop_perf(perf)
+    cpu = cpu_seconds(memcached.pid) - cpu_before
+
+    try:
+        if not ok:
+            return None
+        with open(result_file.name) as f:
+            res = json.load(f)
+    finally:
+        os.remove(result_file.name)
+
+    ops = res["ops"]
+    op = res["get"] if res["get"]["ops"] > 0 else res["set"]
+    return {"ops_per_sec": res["ops_per_sec"],
+            "errors": res["errors"],
+            "p50_usec": op["latency_usec"]["p50"],
+            "p99_usec": op["latency_usec"]["p99"],
+            "cpu_usec_per_op": cpu * 1e6 / ops if ops else None,
+            "cycles_per_op": float(cycles) / ops if cycles and ops else None}
+
+
+def print_results(results, baseline):
+    def fmt(value, spec):
+        return "-" if value is None else spec.format(value)
+
+    def delta(name, key, higher_is_better):
+        if baseline is None or name not in baseline.get("results", {}):
+            return ""
+        old = baseline["results"][name].get(key)
+        new = results[name][key]
+        if not old or new is None:
+            return ""
+        change = (new - old) * 100.0 / old
+        worse = change < 0 if higher_is_better else change > 0
+        return " ({0:+.1f}%{1})".format(change, "!" if worse and
+                                        abs(change) >= 5 else "")
+
+    print("{0:<12} {1:>20} {2:>18} {3:>18} {4:>18} {5:>16}".format(
+        "workload", "ops/sec", "p50 usec", "p99 usec", "cpu usec/op",
+        "cycles/op"))
+    for name in [m[0] for m in MATRIX]:
+        if name not in results:
+            continue
+        r = results[name]
+        if r is None:
+            print("{0:<12} failed".format(name))
+            continue
+        print("{0:<12} {1:>20} {2:>18} {3:>18} {4:>18} {5:>16}".format(
+            name,
+            fmt(r["ops_per_sec"], "{0:.0f}") +
+            delta(name, "ops_per_sec", True),
+            fmt(r["p50_usec"], "{0:.1f}") + delta(name, "p50_usec", False),
+            fmt(r["p99_usec"], "{0:.1f}") + delta(name, "p99_usec", False),
+            fmt(r["cpu_usec_per_op"], "{0:.2f}") +
+            delta(name, "cpu_usec_per_op", False),
+            fmt(r["cycles_per_op"], "{0:.0f}") +
+            delta(name, "cycles_per_op", False)))
+
+
+def main():
+    args = parse_args()
+    only = args.only.split(",") if args.only else None
+
+    baseline = None
+    if args.baseline is not None:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    config_name = write_config(args)
+    memcached = subprocess.Popen([args.memcached, "-C", config_name])
+    try:
+        if not wait_for_port(memcached, args.port):
+            print("FAIL - memcached didn't start", file=sys.stderr)
+            return 1
+
+        results = {}
+        for (name, description, extra, iface) in MATRIX:
+            if only is not None and name not in only:
+                continue
+            print("Running {0} ({1})...".format(name, description),
+                  file=sys.stderr)
+            results[name] = run_workload(args, memcached, name, extra, iface)
+            if memcached.poll() is not None:
+                print("FAIL - memcached died", file=sys.stderr)
+                return 1
+    finally:
+        if memcached.poll() is None:
+            memcached.terminate()
+            memcached.wait()
+        os.remove(config_name)
+
+    report = {"commit": git_commit(args.source),
+              "date": time.strftime("%Y-%m-%dT%H:%M:%S"),
+              "host": {"cpu": cpu_model(),
+                       "cpus": os.sysconf("SC_NPROCESSORS_ONLN")},
+              "config": {"threads": args.threads,
+                         "clients": args.clients,
+                         "connections": args.connections,
+                         "keys": args.keys,
+                         "duration": args.duration},
+              "results": results}
+    with open(args.output, "w") as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+
+    if baseline is not None:
+        print("Compared with {0} ({1}), ! marks a regression of 5% or "
+              "more".format(baseline.get("commit"), args.baseline))
+    print_results(results, baseline)
+    print("Results written to {0}".format(args.output))
+    return 0 if all(r is not None for r in results.values()) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -105,6 +105,55 @@ namespace BinaryProtocolValidator {
         EXPECT_EQ(-1, validate(PROTOCOL_BINARY_CMD_GETKQ));
     }
 
+    // Test GET_RANGE
+    class GetRangeValidatorTest : public ValidatorTest {
+        virtual void SetUp() override {
+            ValidatorTest::SetUp();
+            memset(&request, 0, sizeof(request));
+            request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+            request.message.header.request.extlen = 8;
+            request.message.header.request.keylen = htons(10);
+            request.message.header.request.bodylen = htonl(18);
+            request.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+        }
+
+    protected:
+        int validate() {
+            return ValidatorTest::validate(PROTOCOL_BINARY_CMD_GET_RANGE,
+                                           static_cast<void*>(&request));
+        }
+        protocol_binary_request_get_range request;
+    };
+
+    TEST_F(GetRangeValidatorTest, CorrectMessage) {
+        EXPECT_EQ(0, validate());
+    }
+    TEST_F(GetRangeValidatorTest, InvalidMagic) {
+        request.message.header.request.magic = 0;
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(GetRangeValidatorTest, InvalidExtlen) {
+        request.message.header.request.extlen = 0;
+        request.message.header.request.bodylen = htonl(10);
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(GetRangeValidatorTest, NoKey) {
+        request.message.header.request.keylen = 0;
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(GetRangeValidatorTest, WithValue) {
+        request.message.header.request.bodylen = htonl(20);
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(GetRangeValidatorTest, InvalidDatatype) {
+        request.message.header.request.datatype = PROTOCOL_BINARY_DATATYPE_JSON;
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(GetRangeValidatorTest, InvalidCas) {
+        request.message.header.request.cas = 1;
+        EXPECT_EQ(-1, validate());
+    }
+
     // Test ADD & ADDQ
     class AddValidatorTest : public ValidatorTest {
         virtual void SetUp() override {
@@ -1723,6 +1772,10 @@ namespace BinaryProtocolValidator {
         request.message.header.request.bodylen = htonl(4);
         EXPECT_EQ(-1, validate());
     }
+    TEST_F(DcpControlValidatorTest, KeyExceedsBody) {
+        request.message.header.request.bodylen = htonl(2);
+        EXPECT_EQ(-1, validate());
+    }
 
     // Test AssumeRole
     class AssumeRoleValidatorTest : public ValidatorTest {
@@ -2024,9 +2077,14 @@ namespace BinaryProtocolValidator {
         request.message.header.request.magic = 0;
         EXPECT_EQ(-1, validate());
     }
-    TEST_F(CmdTimerValidatorTest, InvalidExtlen) {
+    TEST_F(CmdTimerValidatorTest, CorrectBreakdown) {
         request.message.header.request.extlen = 2;
         request.message.header.request.bodylen = htonl(2);
+        EXPECT_EQ(0, validate());
+    }
+    TEST_F(CmdTimerValidatorTest, InvalidExtlen) {
+        request.message.header.request.extlen = 3;
+        request.message.header.request.bodylen = htonl(3);
         EXPECT_EQ(-1, validate());
     }
     TEST_F(CmdTimerValidatorTest, InvalidKey) {
@@ -2195,4 +2253,169 @@ namespace BinaryProtocolValidator {
         request.message.header.request.bodylen = htonl(4);
         EXPECT_EQ(-1, validate());
     }
+
+    // Test SETM
+    class SetmValidatorTest : public ValidatorTest {
+        virtual void SetUp() override {
+            ValidatorTest::SetUp();
+            memset(&request, 0, sizeof(request));
+            request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+            request.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+            length = 0;
+            add_entry(3, 5);
+            add_entry(4, 0);
+        }
+
+    protected:
+        void add_entry(uint16_t nkey, uint32_t nbytes) {
+            protocol_binary_setm_entry entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.nkey = htons(nkey);
+            entry.nbytes = htonl(nbytes);
+            memcpy(request.bytes + sizeof(request.message.header) + length,
+                   &entry, sizeof(entry));
+            length += sizeof(entry) + nkey + nbytes;
+            request.message.header.request.bodylen = htonl(length);
+        }
+
+        int validate() {
+            return ValidatorTest::validate(PROTOCOL_BINARY_CMD_SETM,
+                                           static_cast<void*>(&request));
+        }
+        union {
+            struct {
+                protocol_binary_request_header header;
+            } message;
+            uint8_t bytes[1024];
+        } request;
+        uint32_t length;
+    };
+
+    TEST_F(SetmValidatorTest, CorrectMessage) {
+        EXPECT_EQ(0, validate());
+    }
+    TEST_F(SetmValidatorTest, Datatype) {
+        request.message.header.request.datatype = PROTOCOL_BINARY_DATATYPE_JSON;
+        EXPECT_EQ(0, validate());
+    }
+    TEST_F(SetmValidatorTest, InvalidMagic) {
+        request.message.header.request.magic = 0;
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(SetmValidatorTest, InvalidExtlen) {
+        request.message.header.request.extlen = 2;
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(SetmValidatorTest, InvalidKey) {
+        request.message.header.request.keylen = htons(2);
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(SetmValidatorTest, InvalidCas) {
+        request.message.header.request.cas = 1;
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(SetmValidatorTest, InvalidEmptyBody) {
+        request.message.header.request.bodylen = 0;
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(SetmValidatorTest, InvalidTruncatedEntry) {
+        request.message.header.request.bodylen = htonl(length - 1);
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(SetmValidatorTest, InvalidTrailingBytes) {
+        request.message.header.request.bodylen = htonl(length + 4);
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(SetmValidatorTest, InvalidEntryKey) {
+        add_entry(0, 4);
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(SetmValidatorTest, InvalidEntryKeyLength) {
+        add_entry(PROTOCOL_BINARY_SETM_MAX_KEYLEN + 1, 0);
+        EXPECT_EQ(-1, validate());
+    }
+
+    class ScriptExecValidatorTest : public ValidatorTest {
+        virtual void SetUp() override {
+            ValidatorTest::SetUp();
+            memset(&request, 0, sizeof(request));
+            request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+            request.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+            request.message.header.request.keylen = htons(5);
+            length = 5;
+            request.message.header.request.bodylen = htonl(length);
+            add_arg(3);
+            add_arg(0);
+        }
+
+    protected:
+        void add_arg(uint16_t nbytes) {
+            protocol_binary_script_arg arg;
+            arg.length = htons(nbytes);
+            memcpy(request.bytes + sizeof(request.message.header) + length,
+                   &arg, sizeof(arg));
+            length += sizeof(arg) + nbytes;
+            request.message.header.request.bodylen = htonl(length);
+        }
+
+        int validate() {
+            return ValidatorTest::validate(PROTOCOL_BINARY_CMD_SCRIPT_EXEC,
+                                           static_cast<void*>(&request));
+        }
+        union {
+            struct {
+                protocol_binary_request_header header;
+            } message;
+            uint8_t bytes[1024];
+        } request;
+        uint32_t length;
+    };
+
+    TEST_F(ScriptExecValidatorTest, CorrectMessage) {
+        EXPECT_EQ(0, validate());
+    }
+    TEST_F(ScriptExecValidatorTest, NoArgs) {
+        request.message.header.request.bodylen = htonl(5);
+        EXPECT_EQ(0, validate());
+    }
+    TEST_F(ScriptExecValidatorTest, MaxArgs) {
+        for (int ii = 2; ii < PROTOCOL_BINARY_SCRIPT_MAX_ARGS; ++ii) {
+            add_arg(1);
+        }
+        EXPECT_EQ(0, validate());
+    }
+    TEST_F(ScriptExecValidatorTest, InvalidMagic) {
+        request.message.header.request.magic = 0;
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(ScriptExecValidatorTest, InvalidExtlen) {
+        request.message.header.request.extlen = 2;
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(ScriptExecValidatorTest, InvalidKey) {
+        request.message.header.request.keylen = 0;
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(ScriptExecValidatorTest, InvalidCas) {
+        request.message.header.request.cas = 1;
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(ScriptExecValidatorTest, InvalidDatatype) {
+        request.message.header.request.datatype = PROTOCOL_BINARY_DATATYPE_JSON;
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(ScriptExecValidatorTest, InvalidTruncatedArg) {
+        request.message.header.request.bodylen = htonl(length - 3);
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(ScriptExecValidatorTest, InvalidTruncatedLength) {
+        request.message.header.request.bodylen = htonl(length + 1);
+        EXPECT_EQ(-1, validate());
+    }
+    TEST_F(ScriptExecValidatorTest, InvalidTooManyArgs) {
+        for (int ii = 2; ii <= PROTOCOL_BINARY_SCRIPT_MAX_ARGS; ++ii) {
+            add_arg(1);
+        }
+        EXPECT_EQ(-1, validate());
+    }
 }
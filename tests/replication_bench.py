@@ -0,0 +1,243 @@
+#!/usr/bin/python
+
+#     Copyright 2015 Couchbase, Inc
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#       http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+
+# Benchmarks the replication paths of memcached (the
+# memcached-replication-bench target).
+#
+# Starts memcached on loopback with the tap_mock_engine in its benchmark
+# mode, which makes up the mutations itself, so what is measured is the
+# core shipping them (ship_dcp_log() / ship_tap_log()) and not a storage
+# engine. Every workload of a fixed matrix of value sizes, vbuckets and
+# DCP flow control windows is streamed by mcreplbench, and for each one
+# it records:
+#  * the mutations and megabytes per second seen by mcreplbench
+#  * the CPU time memcached used per mutation (from /proc)
+#
+# The results are written as JSON together with the commit they were taken
+# at, and compared with the results of a previous run if one is given.
+
+
+from __future__ import print_function
+import argparse
+import json
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+
+# name, description, engine configuration, mcreplbench arguments
+MATRIX = [
+    ("dcp_small", "DCP, 32 byte values",
+     "value_size=32", []),
+    ("dcp_large", "DCP, 4k values",
+     "value_size=4096", []),
+    ("dcp_vbuckets", "DCP, 32 byte values over 64 vbuckets",
+     "value_size=32", ["-v", "64"]),
+    ("dcp_window", "DCP, 32 byte values with a 64k flow control window",
+     "value_size=32", ["-w", "65536"]),
+    ("dcp_big_window", "DCP, 4k values with a 1M flow control window",
+     "value_size=4096", ["-w", "1048576"]),
+    ("dcp_batch", "DCP, 32 byte values in snapshots of 1024",
+     "value_size=32;batch=1024", []),
+    ("tap_small", "TAP, 32 byte values",
+     "value_size=32", ["-t"]),
+    ("tap_large", "TAP, 4k values",
+     "value_size=4096", ["-t"]),
+]
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--memcached", required=True)
+    parser.add_argument("--mcreplbench", required=True)
+    parser.add_argument("--engine", required=True,
+                        help="path to tap_mock_engine.so")
+    parser.add_argument("--source", default=None,
+                        help="source tree (to record the commit)")
+    parser.add_argument("--port", type=int, default=12310)
+    parser.add_argument("--threads", type=int, default=4,
+                        help="memcached worker threads")
+    parser.add_argument("--duration", type=int, default=10)
+    parser.add_argument("--only", default=None,
+                        help="comma separated workloads to run")
+    parser.add_argument("--output", default="replication_bench.json")
+    parser.add_argument("--baseline",
+                        default=os.environ.get("REPLICATION_BENCH_BASELINE"),
+                        help="results of a previous run to compare with")
+    return parser.parse_args()
+
+
+def git_commit(source):
+    if source is None:
+        return None
+    try:
+        out = subprocess.check_output(["git", "-C", source, "describe",
+                                       "--always", "--dirty"],
+                                      stderr=subprocess.STDOUT)
+        return out.decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def cpu_seconds(pid):
+    """User and system CPU time used by the process so far"""
+    with open("/proc/{0}/stat".format(pid)) as f:
+        # The command may contain spaces, the fields after it don't
+        fields = f.read().rsplit(")", 1)[1].split()
+    ticks = int(fields[11]) + int(fields[12])
+    return float(ticks) / os.sysconf("SC_CLK_TCK")
+
+
+def write_config(args, engine_config):
+    config = {"engine": {"module": os.path.abspath(args.engine),
+                         "config": "bench=true;" + engine_config},
+              "interfaces": [{"port": args.port,
+                              "maxconn": 1000,
+                              "backlog": 1024,
+                              "host": "127.0.0.1",
+                              "tcp_nodelay": True}],
+              "threads": args.threads,
+              "datatype_support": True,
+              "admin": ""}
+    config_file = tempfile.NamedTemporaryFile(mode="w", suffix=".json",
+                                              delete=False)
+    json.dump(config, config_file)
+    config_file.close()
+    return config_file.name
+
+
+def wait_for_port(memcached, port):
+    for _ in range(100):
+        if memcached.poll() is not None:
+            return False
+        try:
+            socket.create_connection(("127.0.0.1", port), 1).close()
+            return True
+        except socket.error:
+            time.sleep(0.1)
+    return False
+
+
+def run_workload(args, engine_config, extra):
+    """Stream the workload from a memcached of its own engine config"""
+    config_name = write_config(args, engine_config)
+    result_file = tempfile.NamedTemporaryFile(suffix=".json", delete=False)
+    result_file.close()
+    memcached = subprocess.Popen([args.memcached, "-C", config_name])
+    try:
+        if not wait_for_port(memcached, args.port):
+            print("FAIL - memcached didn't start", file=sys.stderr)
+            return None
+
+        cpu_before = cpu_seconds(memcached.pid)
+        cmd = [args.mcreplbench, "-h", "127.0.0.1", "-p", str(args.port),
+               "-d", str(args.duration), "-o", result_file.name] + extra
+        with open(os.devnull, "w") as devnull:
+            ok = subprocess.call(cmd, stdout=devnull, stderr=devnull) == 0
+        cpu = cpu_seconds(memcached.pid) - cpu_before
+        if not ok or memcached.poll() is not None:
+            return None
+
+        with open(result_file.name) as f:
+            res = json.load(f)
+    finally:
+        if memcached.poll() is None:
+            memcached.terminate()
+            memcached.wait()
+        os.remove(config_name)
+        os.remove(result_file.name)
+
+    mutations = res["mutations"]
+    return {"mutations_per_sec": res["mutations_per_sec"],
+            "mbytes_per_sec": res["mbytes_per_sec"],
+            "acks": res["acks"],
+            "cpu_usec_per_mutation":
+            cpu * 1e6 / mutations if mutations else None}
+
+
+def print_results(results, baseline):
+    def fmt(value, spec):
+        return "-" if value is None else spec.format(value)
+
+    def delta(name, key, higher_is_better):
+        if baseline is None or name not in baseline.get("results", {}):
+            return ""
+        old = baseline["results"][name].get(key)
+        new = results[name][key]
+        if not old or new is None:
+            return ""
+        change = (new - old) * 100.0 / old
+        worse = change < 0 if higher_is_better else change > 0
+        return " ({0:+.1f}%{1})".format(change, "!" if worse and
+                                        abs(change) >= 5 else "")
+
+    print("{0:<16} {1:>22} {2:>18} {3:>22}".format(
+        "workload", "mutations/sec", "MB/sec", "cpu usec/mutation"))
+    for name in [m[0] for m in MATRIX]:
+        if name not in results:
+            continue
+        r = results[name]
+        if r is None:
+            print("{0:<16} failed".format(name))
+            continue
+        print("{0:<16} {1:>22} {2:>18} {3:>22}".format(
+            name,
+            fmt(r["mutations_per_sec"], "{0:.0f}") +
+            delta(name, "mutations_per_sec", True),
+            fmt(r["mbytes_per_sec"], "{0:.1f}") +
+            delta(name, "mbytes_per_sec", True),
+            fmt(r["cpu_usec_per_mutation"], "{0:.3f}") +
+            delta(name, "cpu_usec_per_mutation", False)))
+
+
+def main():
+    args = parse_args()
+    only = args.only.split(",") if args.only else None
+
+    baseline = None
+    if args.baseline is not None:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    results = {}
+    for (name, description, engine_config, extra) in MATRIX:
+        if only is not None and name not in only:
+            continue
+        print("Running {0} ({1})...".format(name, description),
+              file=sys.stderr)
+        results[name] = run_workload(args, engine_config, extra)
+
+    report = {"commit": git_commit(args.source),
+              "date": time.strftime("%Y-%m-%dT%H:%M:%S"),
+              "config": {"threads": args.threads,
+                         "duration": args.duration},
+              "results": results}
+    with open(args.output, "w") as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+
+    if baseline is not None:
+        print("Compared with {0} ({1}), ! marks a regression of 5% or "
+              "more".format(baseline.get("commit"), args.baseline))
+    print_results(results, baseline)
+    print("Results written to {0}".format(args.output))
+    return 0 if all(r is not None for r in results.values()) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -15,7 +15,9 @@
 #include "testapp_subdoc.h"
 
 #include <memcached/util.h>
+#include <memcached/protocol_greenstack.h>
 #include <memcached/config_parser.h>
+#include "utilities/protocol2text.h"
 #include <cbsasl/cbsasl.h>
 #include "extensions/protocol/testapp_extension.h"
 #include <platform/platform.h>
@@ -37,6 +39,7 @@ static uint8_t write_command = 0xe2;
 char *config_string = NULL;
 char config_file[] = "memcached_testapp.json.XXXXXX";
 char rbac_file[] = "testapp_rbac.json.XXXXXX";
+char scripts_file[] = "testapp_scripts.json.XXXXXX";
 
 #define TMP_TEMPLATE "testapp_tmp_file.XXXXXXX"
 
@@ -58,6 +61,7 @@ static int phases_enabled = phase_setup | phase_plain | phase_ssl | phase_cleanu
 static pid_t server_pid;
 static in_port_t port = -1;
 static in_port_t ssl_port = -1;
+static const in_port_t greenstack_port = 11997;
 static SOCKET sock;
 static SOCKET sock_ssl;
 static bool allow_closed_read = false;
@@ -265,10 +269,13 @@ static cJSON *generate_config(void)
     char pem_path[256];
     char cert_path[256];
     char rbac_path[256];
+    char scripts_path[256];
 
     get_working_current_directory(pem_path, 256);
     strncpy(cert_path, pem_path, 256);
     snprintf(rbac_path, sizeof(rbac_path), "%s/%s", pem_path, rbac_file);
+    snprintf(scripts_path, sizeof(scripts_path), "%s/%s", pem_path,
+             scripts_file);
     strncat(pem_path, CERTIFICATE_PATH(testapp.pem), 256);
     strncat(cert_path, CERTIFICATE_PATH(testapp.cert), 256);
 
@@ -307,11 +314,20 @@ static cJSON *generate_config(void)
         cJSON_AddItemToObject(obj, "ssl", obj_ssl);
         cJSON_AddItemToArray(array, obj);
     }
+
+    obj = cJSON_CreateObject();
+    cJSON_AddNumberToObject(obj, "port", greenstack_port);
+    cJSON_AddNumberToObject(obj, "maxconn", MAX_CONNECTIONS);
+    cJSON_AddNumberToObject(obj, "backlog", BACKLOG);
+    cJSON_AddStringToObject(obj, "host", "*");
+    cJSON_AddStringToObject(obj, "protocol", "greenstack");
+    cJSON_AddItemToArray(array, obj);
     cJSON_AddItemToObject(root, "interfaces", array);
 
     cJSON_AddStringToObject(root, "admin", "");
     cJSON_AddTrueToObject(root, "datatype_support");
     cJSON_AddStringToObject(root, "rbac_file", rbac_path);
+    cJSON_AddStringToObject(root, "scripts_file", scripts_path);
 
     return root;
 }
@@ -506,7 +522,7 @@ start_server(in_port_t *port_out, in_port_t *ssl_port_out, bool daemon,
             cb_assert(safe_strtol(buffer + 10, &val));
             if (*port_out == (in_port_t)-1) {
                 *port_out = (in_port_t)val;
-            } else {
+            } else if (val != greenstack_port) {
                 *ssl_port_out = (in_port_t)val;
             }
         }
@@ -908,8 +924,126 @@ static enum test_return test_config_parser(void) {
     return TEST_PASS;
 }
 
+static enum test_return test_config_parser_schema(void) {
+    static struct config_schema *cache;
+    bool bool_val = false;
+    size_t size_val = 0;
+    float float_val = 0;
+    char *string_val = NULL;
+    const struct config_schema *schema;
+    struct config_schema *dup;
+    struct config_item items[5];
+
+    memset(&items, 0, sizeof(items));
+    items[0].key = "bool";
+    items[0].datatype = DT_BOOL;
+    items[0].value.dt_bool = &bool_val;
+    items[1].key = "size_t";
+    items[1].datatype = DT_SIZE;
+    items[1].value.dt_size = &size_val;
+    items[2].key = "float";
+    items[2].datatype = DT_FLOAT;
+    items[2].value.dt_float = &float_val;
+    items[3].key = "string";
+    items[3].datatype = DT_STRING;
+    items[3].value.dt_string = &string_val;
+    items[4].key = NULL;
+
+    schema = config_schema_get(&cache, items);
+    cb_assert(schema != NULL);
+    cb_assert(config_schema_get(&cache, items) == schema);
+
+    cb_assert(parse_config_schema(" bool = on ; size_t=2k;float=1.5;"
+                                  "string= s\\;v\\ ", schema, items,
+                                  NULL) == 0);
+    cb_assert(items[0].found && bool_val);
+    cb_assert(items[1].found && size_val == 2048);
+    cb_assert(items[2].found && float_val == 1.5f);
+    cb_assert(items[3].found && strcmp(string_val, "s;v ") == 0);
+    free(string_val);
+
+    /* Keys with a common prefix aren't mixed up */
+    cb_assert(parse_config_schema("boo=true", schema, items, NULL) == 1);
+    cb_assert(parse_config_schema("bools=true", schema, items, NULL) == 1);
+    cb_assert(parse_config_schema("size_t=x", schema, items, NULL) == -1);
+    cb_assert(parse_config_schema("size_t", schema, items, NULL) == -1);
+
+    /* Duplicate keys can't be compiled */
+    items[1].key = "bool";
+    dup = config_schema_compile(items);
+    cb_assert(dup == NULL);
+
+    return TEST_PASS;
+}
+
+static enum test_return test_protocol2text(void) {
+    protocol_binary_request_header req;
+    char packet[sizeof(req.bytes) + 3];
+    char buffer[256];
+    int opcode;
+
+    /* Both ways for all of the opcodes with a name */
+    for (opcode = 0; opcode < 256; ++opcode) {
+        const char *name = memcached_opcode_2_text((uint8_t)opcode);
+        if (name != NULL) {
+            cb_assert(memcached_text_2_opcode(name) == opcode);
+        }
+    }
+    cb_assert(memcached_text_2_opcode("get") == PROTOCOL_BINARY_CMD_GET);
+    cb_assert(memcached_text_2_opcode("LIST_BUCKETS") ==
+              PROTOCOL_BINARY_CMD_LIST_BUCKETS);
+    cb_assert(memcached_text_2_opcode("12") == 12);
+    cb_assert(memcached_text_2_opcode("NO_SUCH_COMMAND") == 0xff);
+    cb_assert(strcmp(memcached_status_2_text(PROTOCOL_BINARY_RESPONSE_KEY_ENOENT),
+                     "KEY_ENOENT") == 0);
+    cb_assert(memcached_status_2_text(0x1234) == NULL);
+
+    memset(&req, 0, sizeof(req));
+    req.request.magic = PROTOCOL_BINARY_REQ;
+    req.request.opcode = PROTOCOL_BINARY_CMD_GET;
+    req.request.keylen = htons(3);
+    req.request.vbucket = htons(5);
+    req.request.bodylen = htonl(3);
+    req.request.opaque = htonl(0xdeadbeef);
+    memcpy(packet, req.bytes, sizeof(req.bytes));
+    memcpy(packet + sizeof(req.bytes), "f\no", 3);
+    cb_assert(memcached_packet_2_trace(packet, sizeof(packet), buffer,
+                                       sizeof(buffer)) > 0);
+    cb_assert(strcmp(buffer, "REQ GET vb:5 opaque:0xdeadbeef "
+                     "cas:0x0000000000000000 ext:0 key:3 body:3 \"f.o\"") == 0);
+
+    req.request.magic = PROTOCOL_BINARY_RES;
+    req.request.vbucket = htons(PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    cb_assert(memcached_packet_2_trace(req.bytes, sizeof(req.bytes), buffer,
+                                       sizeof(buffer)) > 0);
+    cb_assert(strncmp(buffer, "RES GET KEY_ENOENT opaque:0xdeadbeef ", 37) == 0);
+
+    cb_assert(memcached_packet_2_trace(packet, 4, buffer,
+                                       sizeof(buffer)) > 0);
+    cb_assert(strcmp(buffer, "short packet (4 bytes)") == 0);
+    return TEST_PASS;
+}
+
 static char *isasl_file;
 
+/* The scripts of test_script_exec */
+static const char scripts_text[] =
+    "{\"scripts\": {"
+    " \"visit\": {\"steps\": ["
+    "   {\"op\": \"incr\", \"key\": \"$0\", \"initial\": 1},"
+    "   {\"op\": \"append\", \"key\": \"$1\", \"value\": \"$2\"},"
+    "   {\"op\": \"touch\", \"key\": \"$1\", \"exptime\": 600},"
+    "   {\"op\": \"get\", \"key\": \"$1\"}]},"
+    " \"create\": {\"steps\": ["
+    "   {\"op\": \"get\", \"key\": \"$0\", \"optional\": true},"
+    "   {\"op\": \"check\", \"exists\": false, \"status\": \"key_eexists\"},"
+    "   {\"op\": \"set\", \"key\": \"$0\", \"value\": \"$1\"}]},"
+    " \"spin\": {\"max_steps\": 2, \"steps\": ["
+    "   {\"op\": \"get\", \"key\": \"$0\", \"optional\": true},"
+    "   {\"op\": \"get\", \"key\": \"$0\", \"optional\": true},"
+    "   {\"op\": \"get\", \"key\": \"$0\", \"optional\": true}]}"
+    "}}";
+
 static enum test_return start_memcached_server(void) {
     cJSON *rbac = generate_rbac_config();
     char *rbac_text = cJSON_Print(rbac);
@@ -923,6 +1057,11 @@ static enum test_return start_memcached_server(void) {
     cJSON_Free(rbac_text);
     cJSON_Delete(rbac);
 
+    if (cb_mktemp(scripts_file) == NULL ||
+        write_config_to_file(scripts_text, scripts_file) == -1) {
+        return TEST_FAIL;
+    }
+
     if (cb_mktemp(config_file) == NULL) {
         return TEST_FAIL;
     }
@@ -984,6 +1123,7 @@ static enum test_return stop_memcached_server(void) {
     remove(isasl_file);
     free(isasl_file);
     remove(rbac_file);
+    remove(scripts_file);
 
     return TEST_PASS;
 }
@@ -2168,6 +2308,66 @@ static enum test_return test_concat_impl(const char *key, uint8_t cmd) {
     return TEST_PASS;
 }
 
+/* Append and prepend honour the cas and give the value a new one */
+static enum test_return test_concat_cas(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } send, receive;
+    const char *key = "test_concat_cas";
+    uint64_t cas;
+    char *ptr;
+    size_t len = storage_command(send.bytes, sizeof(send.bytes),
+                                 PROTOCOL_BINARY_CMD_SET,
+                                 key, strlen(key), "hello", 5, 0, 0);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cas = receive.response.message.header.response.cas;
+
+    len = raw_command(send.bytes, sizeof(send.bytes),
+                      PROTOCOL_BINARY_CMD_APPEND,
+                      key, strlen(key), " world", 6);
+    send.request.message.header.request.cas = cas;
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_APPEND,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(receive.response.message.header.response.cas != cas);
+
+    /* The cas the value had before the append is stale now */
+    len = raw_command(send.bytes, sizeof(send.bytes),
+                      PROTOCOL_BINARY_CMD_PREPEND,
+                      key, strlen(key), "well, ", 6);
+    send.request.message.header.request.cas = cas;
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_PREPEND,
+                             PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
+
+    len = raw_command(send.bytes, sizeof(send.bytes),
+                      PROTOCOL_BINARY_CMD_PREPEND,
+                      key, strlen(key), "well, ", 6);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_PREPEND,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    len = raw_command(send.bytes, sizeof(send.bytes), PROTOCOL_BINARY_CMD_GET,
+                      key, strlen(key), NULL, 0);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(receive.response.message.header.response.bodylen == 4 + 17);
+    ptr = receive.bytes + sizeof(receive.response) + 4;
+    cb_assert(memcmp(ptr, "well, hello world", 17) == 0);
+
+    return TEST_PASS;
+}
+
 static enum test_return test_append(void) {
     return test_concat_impl("test_append",
                                    PROTOCOL_BINARY_CMD_APPEND);
@@ -2230,6 +2430,325 @@ static enum test_return test_stat_connections(void) {
     return TEST_PASS;
 }
 
+static enum test_return test_stat_startup(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    const char *total = "startup_total_usec";
+    bool found = false;
+
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_STAT,
+                             "startup", strlen("startup"), NULL, 0);
+
+    safe_send(buffer.bytes, len, false);
+    do {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        if (buffer.response.message.header.response.keylen == strlen(total) &&
+            memcmp(buffer.bytes + sizeof(buffer.response), total,
+                   strlen(total)) == 0) {
+            found = true;
+        }
+    } while (buffer.response.message.header.response.keylen != 0);
+    cb_assert(found);
+
+    return TEST_PASS;
+}
+
+/*
+ * Return the value of the stat named name (or an empty string) from the
+ * response to "stats <group>"
+ */
+static void stat_group_value(const char *group, const char *name,
+                             char *value, size_t size) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_STAT,
+                             group, strlen(group), NULL, 0);
+
+    value[0] = '\0';
+    safe_send(buffer.bytes, len, false);
+    do {
+        uint16_t keylen;
+        uint32_t vallen;
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        keylen = buffer.response.message.header.response.keylen;
+        vallen = buffer.response.message.header.response.bodylen - keylen;
+        if (keylen == strlen(name) &&
+            memcmp(buffer.bytes + sizeof(buffer.response), name,
+                   keylen) == 0 && vallen < size) {
+            memcpy(value, buffer.bytes + sizeof(buffer.response) + keylen,
+                   vallen);
+            value[vallen] = '\0';
+        }
+    } while (buffer.response.message.header.response.keylen != 0);
+}
+
+/*
+ * The writes to a vbucket since the previous "stats hot_vbuckets" make it
+ * the hottest one, and are in its totals
+ */
+static enum test_return test_stat_hot_vbuckets(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    char value[64];
+    int ii;
+
+    /* Start a new window */
+    stat_group_value("hot_vbuckets", "hot_vbuckets:ops", value,
+                     sizeof(value));
+
+    for (ii = 0; ii < 5; ++ii) {
+        size_t len = storage_command(buffer.bytes, sizeof(buffer.bytes),
+                                     PROTOCOL_BINARY_CMD_SET,
+                                     "hot_vbucket", strlen("hot_vbucket"),
+                                     "value", 5, 0, 0);
+        uint16_t status;
+        buffer.request.message.header.request.vbucket = htons(7);
+        safe_send(buffer.bytes, len, false);
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        /* Counted whether or not the engine has the vbucket */
+        status = buffer.response.message.header.response.status;
+        cb_assert(buffer.response.message.header.response.opcode ==
+                  PROTOCOL_BINARY_CMD_SET);
+        cb_assert(status == PROTOCOL_BINARY_RESPONSE_SUCCESS ||
+                  status == PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET);
+    }
+
+    stat_group_value("hot_vbuckets 1", "hot_vbucket_0:vbucket", value,
+                     sizeof(value));
+    cb_assert(strcmp(value, "7") == 0);
+    stat_group_value("vbucket_traffic", "vb_7:write_ops", value,
+                     sizeof(value));
+    cb_assert(atoi(value) >= 5);
+
+    return TEST_PASS;
+}
+
+/*
+ * With more connections than go in a chunk of "stats connections", all of
+ * them must still be returned (and the connection must be usable after).
+ */
+static enum test_return test_stat_connections_chunked(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[2048];
+    } buffer;
+    SOCKET extra[150];
+    size_t len;
+    int ii;
+    int nconns = 0;
+
+    for (ii = 0; ii < 150; ++ii) {
+        /* A NOOP round trip, so the server has set the connection up */
+        extra[ii] = create_connect_plain_socket("127.0.0.1", port, false);
+        cb_assert(extra[ii] != INVALID_SOCKET);
+        len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                          PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+        cb_assert(send(extra[ii], buffer.bytes, (int)len, 0) == (int)len);
+        cb_assert(recv(extra[ii], buffer.bytes,
+                       sizeof(protocol_binary_response_header),
+                       MSG_WAITALL) ==
+                  sizeof(protocol_binary_response_header));
+    }
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_STAT,
+                      "connections", strlen("connections"), NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    do {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        if (buffer.response.message.header.response.keylen != 0) {
+            ++nconns;
+        }
+    } while (buffer.response.message.header.response.keylen != 0);
+    cb_assert(nconns > 150);
+
+    for (ii = 0; ii < 150; ++ii) {
+        closesocket(extra[ii]);
+    }
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    return TEST_PASS;
+}
+
+/* The modes of the ewouldblock engine (see EWB_Engine::Mode) */
+#define EWB_NEXT_N 0
+#define EWB_FIRST 2
+
+/* Switch the ewouldblock engine to the mode, there's no response */
+static void ewouldblock_mode(uint32_t mode, uint32_t value) {
+    union {
+        protocol_binary_request_no_extras request;
+        char bytes[1024];
+    } buffer;
+    uint32_t body[2];
+    size_t len;
+
+    body[0] = htonl(mode);
+    body[1] = htonl(value);
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes), 0xeb, NULL, 0,
+                      body, sizeof(body));
+    safe_send(buffer.bytes, len, false);
+}
+
+/* The commands the worker threads have run so far */
+static uint64_t threads_cmds(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    uint64_t total = 0;
+
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_STAT,
+                             "threads", strlen("threads"), NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    do {
+        uint16_t keylen;
+        uint32_t vallen;
+        char value[32];
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        keylen = buffer.response.message.header.response.keylen;
+        vallen = buffer.response.message.header.response.bodylen - keylen;
+        if (keylen > 5 && vallen < sizeof(value) &&
+            memcmp(buffer.bytes + sizeof(buffer.response) + keylen - 5,
+                   "_cmds", 5) == 0) {
+            memcpy(value, buffer.bytes + sizeof(buffer.response) + keylen,
+                   vallen);
+            value[vallen] = '\0';
+            total += strtoull(value, NULL, 10);
+        }
+    } while (buffer.response.message.header.response.keylen != 0);
+
+    return total;
+}
+
+/* Reload the configuration with the rate limit of each bucket */
+static void reload_rate_limit_bucket_ops(uint32_t ops) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    cJSON *dynamic = generate_config();
+    char *dyn_string;
+    size_t len;
+
+    cJSON_AddNumberToObject(dynamic, "rate_limit_bucket_ops", ops);
+    dyn_string = cJSON_Print(dynamic);
+    cJSON_Delete(dynamic);
+    cb_assert(write_config_to_file(dyn_string, config_file) != -1);
+    cJSON_Free(dyn_string);
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_CONFIG_RELOAD, NULL, 0, NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response,
+                             PROTOCOL_BINARY_CMD_CONFIG_RELOAD,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+}
+
+/*
+ * With every engine call blocking once (the ewouldblock engine's FIRST
+ * mode) the stores are resumed where they blocked: they get the result
+ * they get without blocking, and count as one command and one charge to
+ * the rate limiter each.
+ */
+static enum test_return test_ewouldblock_stores(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    const char *key = "ewouldblock_stores";
+    const char *added = "ewouldblock_stores_add";
+    const struct {
+        uint8_t opcode;
+        const char *key;
+        const char *data;
+    } stores[] = {
+        { PROTOCOL_BINARY_CMD_SET, key, "world" },
+        { PROTOCOL_BINARY_CMD_ADD, added, "new" },
+        { PROTOCOL_BINARY_CMD_APPEND, key, "!" },
+        { PROTOCOL_BINARY_CMD_PREPEND, key, "hello " }
+    };
+    const int nstores = (int)(sizeof(stores) / sizeof(stores[0]));
+    char value[32];
+    uint64_t cmds;
+    size_t len;
+    int ii;
+
+    cb_assert(store_object(key, "old") == TEST_PASS);
+    /* Whether it was there or not */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_DELETE, added, strlen(added),
+                      NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+
+    /* Each thread gets a token for each store, and no more */
+    stat_group_value("", "threads", value, sizeof(value));
+    reload_rate_limit_bucket_ops((uint32_t)(atoi(value) * nstores));
+
+    cmds = threads_cmds();
+    ewouldblock_mode(EWB_FIRST, 0);
+    for (ii = 0; ii < nstores; ++ii) {
+        if (stores[ii].opcode == PROTOCOL_BINARY_CMD_SET ||
+            stores[ii].opcode == PROTOCOL_BINARY_CMD_ADD) {
+            len = storage_command(buffer.bytes, sizeof(buffer.bytes),
+                                  stores[ii].opcode, stores[ii].key,
+                                  strlen(stores[ii].key), stores[ii].data,
+                                  strlen(stores[ii].data), 0, 0);
+        } else {
+            len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                              stores[ii].opcode, stores[ii].key,
+                              strlen(stores[ii].key), stores[ii].data,
+                              strlen(stores[ii].data));
+        }
+        safe_send(buffer.bytes, len, false);
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, stores[ii].opcode,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    }
+    ewouldblock_mode(EWB_NEXT_N, 0);
+    /* The stores, the two mode changes and the second "stats threads" */
+    cb_assert(threads_cmds() - cmds == (uint64_t)nstores + 3);
+
+    reload_rate_limit_bucket_ops(0);
+    validate_object(key, "hello world!");
+    validate_object(added, "new");
+    delete_object(added);
+    return delete_object(key);
+}
+
 static enum test_return test_scrub(void) {
     union {
         protocol_binary_request_no_extras request;
@@ -2524,34 +3043,126 @@ static enum test_return test_ioctl_set(void) {
     return TEST_PASS;
 }
 
-#if defined(HAVE_TCMALLOC)
-static enum test_return test_ioctl_tcmalloc_aggr_decommit(void) {
+static enum test_return test_ioctl_heap_profile(void) {
     union {
         protocol_binary_request_no_extras request;
         protocol_binary_response_no_extras response;
-        char bytes[1024];
+        char bytes[8192];
     } buffer;
+    char cmd[] = "heap_profile.sample_bytes";
+    bool found = false;
+    uint16_t status;
 
-    /* tcmalloc.aggressive_memory_decommit should return zero or one. */
-    char cmd[] = "tcmalloc.aggressive_memory_decommit";
-    size_t value;
+    /* Not a number */
     size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
-                             PROTOCOL_BINARY_CMD_IOCTL_GET, cmd, strlen(cmd),
-                             NULL, 0);
+                             PROTOCOL_BINARY_CMD_IOCTL_SET, cmd, strlen(cmd),
+                             "many", 4);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_IOCTL_SET,
+                             PROTOCOL_BINARY_RESPONSE_EINVAL);
 
+    /* Only with an allocator with hooks */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_IOCTL_SET, cmd, strlen(cmd),
+                      "4096", 4);
     safe_send(buffer.bytes, len, false);
     safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
-    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_IOCTL_GET,
+    status = buffer.response.message.header.response.status;
+    if (status == PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED) {
+        return TEST_PASS;
+    }
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_IOCTL_SET,
                              PROTOCOL_BINARY_RESPONSE_SUCCESS);
 
-    cb_assert(buffer.response.message.header.response.bodylen > 0);
-    value = atoi(buffer.bytes + sizeof(buffer.response));
-    cb_assert(value == 0 || value == 1);
-
-
-    /* Check that tcmalloc.aggressive_memory_decommit can be changed, and that
-       the value reads correctly. */
-    {
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_STAT,
+                      "heap_profile", strlen("heap_profile"), NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    do {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        if (buffer.response.message.header.response.keylen ==
+            strlen("heap_profile_sample_bytes") &&
+            memcmp(buffer.bytes + sizeof(buffer.response),
+                   "heap_profile_sample_bytes",
+                   strlen("heap_profile_sample_bytes")) == 0) {
+            found = true;
+        }
+    } while (buffer.response.message.header.response.keylen != 0);
+    cb_assert(found);
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_IOCTL_SET, cmd, strlen(cmd),
+                      "0", 1);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_IOCTL_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    return TEST_PASS;
+}
+
+static enum test_return test_ioctl_shm_ring(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    char cmd[] = "shm_ring";
+    char path[] = "/dev/null";
+    uint16_t status;
+
+    /* Only on a unix domain socket, and not with SSL */
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_IOCTL_SET, cmd, strlen(cmd),
+                             path, strlen(path));
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    status = buffer.response.message.header.response.status;
+    cb_assert(status == PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED ||
+              status == PROTOCOL_BINARY_RESPONSE_EINVAL);
+
+    /* The connection stays on the socket */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    return TEST_PASS;
+}
+
+#if defined(HAVE_TCMALLOC)
+static enum test_return test_ioctl_tcmalloc_aggr_decommit(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+
+    /* tcmalloc.aggressive_memory_decommit should return zero or one. */
+    char cmd[] = "tcmalloc.aggressive_memory_decommit";
+    size_t value;
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_IOCTL_GET, cmd, strlen(cmd),
+                             NULL, 0);
+
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_IOCTL_GET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    cb_assert(buffer.response.message.header.response.bodylen > 0);
+    value = atoi(buffer.bytes + sizeof(buffer.response));
+    cb_assert(value == 0 || value == 1);
+
+
+    /* Check that tcmalloc.aggressive_memory_decommit can be changed, and that
+       the value reads correctly. */
+    {
         char value_buf[16];
         size_t new_value = 1 - value; /* flip between 1 <-> 0 */
         snprintf(value_buf, sizeof(value_buf), "%zd", new_value);
@@ -3177,6 +3788,34 @@ static enum test_return test_datatype_json_without_support(void) {
     return TEST_PASS;
 }
 
+static enum test_return test_datatype_json_detection(void) {
+    static const struct {
+        const char *body;
+        bool json;
+    } values[] = {
+        { " [ 1, 2, { \"a\" : \"b\" } ]\r\n", true },
+        { "{\"a\":\"long enough to take more than one block \xc3\xa6\"}", true },
+        { "{ \"value\" : \"\x01\" }", false },
+        { "{ \"value\" : \"\xc0\x80\" }", false },
+        { "{ \"value\" : 1 ", false },
+        { "not json", false },
+        { "1234567890123456789012345678901234567890a", false }
+    };
+    size_t ii;
+
+    for (ii = 0; ii < sizeof(values) / sizeof(values[0]); ++ii) {
+        const char *body = values[ii].body;
+        set_datatype_feature(false);
+        store_object_w_datatype("myjson", body, strlen(body), false, false);
+        set_datatype_feature(true);
+        get_object_w_datatype("myjson", body, strlen(body), false,
+                              values[ii].json, false);
+    }
+    set_datatype_feature(false);
+
+    return TEST_PASS;
+}
+
 /* Compress the specified document, storing the compressed result in the
  * {deflated}.
  * Caller is responsible for free()ing deflated when no longer needed.
@@ -3628,6 +4267,55 @@ static enum test_return test_expiry_relative_with_clock_change_backwards(void) {
                        120, 2, (int)(0 - ((now - server_start_time) * 2)));
 }
 
+/* Store key with the expiry, wait for ms, and look for it */
+static void expiry_ms_check(const char *key, uint32_t expiry, int ms,
+                            uint16_t status) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } send, receive;
+    uint64_t value = 0xdeadbeefdeadcafe;
+    size_t len;
+
+    len = storage_command(send.bytes, sizeof(send.bytes), PROTOCOL_BINARY_CMD_SET,
+                          key, strlen(key), &value, sizeof(value), 0, expiry);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+#ifdef WIN32
+    Sleep((DWORD)ms);
+#else
+    usleep(ms * 1000);
+#endif
+
+    len = raw_command(send.bytes, sizeof(send.bytes), PROTOCOL_BINARY_CMD_GET,
+                      key, strlen(key), NULL, 0);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_GET,
+                             status);
+}
+
+/*
+ * An expiry with the top bit set is 200ms from now on a connection with
+ * PROTOCOL_BINARY_FEATURE_EXPTIME_MS, and an absolute time in 2038 on
+ * the others.
+ */
+static enum test_return test_expiry_ms(void) {
+    const char *key = "test_expiry_ms";
+
+    set_feature(PROTOCOL_BINARY_FEATURE_EXPTIME_MS, true);
+    expiry_ms_check(key, 0x80000000u | 200, 500,
+                    PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    set_feature(PROTOCOL_BINARY_FEATURE_EXPTIME_MS, false);
+    expiry_ms_check(key, 0x80000000u | 200, 500,
+                    PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    return TEST_PASS;
+}
+
 static enum test_return test_set_huge_impl(const char *key,
                                                 uint8_t cmd,
                                                 int result,
@@ -3879,6 +4567,380 @@ static enum test_return test_pipeline_set_del(void) {
     return rv;
 }
 
+/* With unordered execution enabled the responses may come back in any
+ * order, but a command doesn't pass one on the same key, and the commands
+ * which can't be reordered (NOOP) wait for all of the ones in front of them.
+ */
+static enum test_return test_unordered_execution(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    char pipeline[1024];
+    const char *key = "unordered_execution";
+    const char *missing = "unordered_execution_missing";
+    bool seen[3] = { false, false, false };
+    size_t offset = 0;
+    size_t len;
+    protocol_binary_request_header *req;
+    int ii;
+
+    set_feature(PROTOCOL_BINARY_FEATURE_UNORDERED_EXECUTION, true);
+
+    len = storage_command(pipeline, sizeof(pipeline), PROTOCOL_BINARY_CMD_SET,
+                          key, strlen(key), "value", 5, 0, 0);
+    ((protocol_binary_request_header*)pipeline)->request.opaque = htonl(0);
+    offset += len;
+
+    len = raw_command(pipeline + offset, sizeof(pipeline) - offset,
+                      PROTOCOL_BINARY_CMD_GET, key, strlen(key), NULL, 0);
+    req = (void*)(pipeline + offset);
+    req->request.opaque = htonl(1);
+    offset += len;
+
+    len = raw_command(pipeline + offset, sizeof(pipeline) - offset,
+                      PROTOCOL_BINARY_CMD_GET, missing, strlen(missing),
+                      NULL, 0);
+    req = (void*)(pipeline + offset);
+    req->request.opaque = htonl(2);
+    offset += len;
+
+    len = raw_command(pipeline + offset, sizeof(pipeline) - offset,
+                      PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    req = (void*)(pipeline + offset);
+    req->request.opaque = htonl(3);
+    offset += len;
+
+    safe_send(pipeline, offset, false);
+
+    for (ii = 0; ii < 3; ++ii) {
+        uint32_t opaque;
+        uint16_t status;
+
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        cb_assert(buffer.response.message.header.response.magic ==
+                  PROTOCOL_BINARY_RES);
+        opaque = ntohl(buffer.response.message.header.response.opaque);
+        status = buffer.response.message.header.response.status;
+        cb_assert(opaque < 3);
+        cb_assert(!seen[opaque]);
+        seen[opaque] = true;
+
+        switch (opaque) {
+        case 0:
+            cb_assert(buffer.response.message.header.response.opcode ==
+                      PROTOCOL_BINARY_CMD_SET);
+            cb_assert(status == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+            break;
+        case 1:
+            /* The GET of the same key must see the SET in front of it */
+            cb_assert(seen[0]);
+            cb_assert(buffer.response.message.header.response.opcode ==
+                      PROTOCOL_BINARY_CMD_GET);
+            cb_assert(status == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+            break;
+        default:
+            cb_assert(buffer.response.message.header.response.opcode ==
+                      PROTOCOL_BINARY_CMD_GET);
+            cb_assert(status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+        }
+    }
+
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    cb_assert(buffer.response.message.header.response.opcode ==
+              PROTOCOL_BINARY_CMD_NOOP);
+    cb_assert(ntohl(buffer.response.message.header.response.opaque) == 3);
+
+    set_feature(PROTOCOL_BINARY_FEATURE_UNORDERED_EXECUTION, false);
+    return delete_object(key);
+}
+
+static enum test_return test_compact_response(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        char bytes[1024];
+    } buffer;
+    /* As raw_command() puts it on the wire */
+    const uint32_t opaque = 0xdeadbeef;
+    const char *key = "compact_response";
+    uint8_t header[16];
+    uint8_t body[9];
+    size_t len;
+
+    cb_assert(store_object(key, "value") == TEST_PASS);
+    set_feature(PROTOCOL_BINARY_FEATURE_COMPACT_RESPONSE, true);
+
+    /* Only the opcode, the body length and the opaque */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv(header, 7);
+    cb_assert(header[0] == PROTOCOL_BINARY_COMPACT_OPAQUE);
+    cb_assert(header[1] == PROTOCOL_BINARY_CMD_NOOP);
+    cb_assert(header[2] == 0);
+    cb_assert(memcmp(header + 3, &opaque, 4) == 0);
+
+    /* A hit has the flags and the CAS as well */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_GET, key, strlen(key), NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv(header, 16);
+    cb_assert(header[0] == (PROTOCOL_BINARY_COMPACT_EXTLEN |
+                            PROTOCOL_BINARY_COMPACT_OPAQUE |
+                            PROTOCOL_BINARY_COMPACT_CAS));
+    cb_assert(header[1] == PROTOCOL_BINARY_CMD_GET);
+    cb_assert(header[2] == 4);
+    cb_assert(header[3] == sizeof(body));
+    cb_assert(memcmp(header + 4, &opaque, 4) == 0);
+    safe_recv(body, sizeof(body));
+    cb_assert(memcmp(body + 4, "value", 5) == 0);
+
+    /* A miss has the status */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_GET, "compact_missing",
+                      strlen("compact_missing"), NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv(header, 8);
+    cb_assert(header[0] == (PROTOCOL_BINARY_COMPACT_STATUS |
+                            PROTOCOL_BINARY_COMPACT_OPAQUE));
+    cb_assert(header[1] == PROTOCOL_BINARY_CMD_GET);
+    cb_assert(header[2] == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    len = header[3];
+    cb_assert(len > 0 && len < sizeof(buffer.bytes));
+    safe_recv(buffer.bytes, len);
+
+    set_feature(PROTOCOL_BINARY_FEATURE_COMPACT_RESPONSE, false);
+    return delete_object(key);
+}
+
+static enum test_return test_stream_compression_refused(void) {
+    union {
+        protocol_binary_request_hello request;
+        protocol_binary_response_hello response;
+        char bytes[1024];
+    } buffer;
+    const char *useragent = "testapp";
+    uint16_t feature = htons(PROTOCOL_BINARY_FEATURE_STREAM_COMPRESSION);
+    size_t len;
+
+    /* The server runs with stream_compression_level 0 */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_HELLO,
+                      useragent, strlen(useragent), &feature,
+                      sizeof(feature));
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response,
+                             PROTOCOL_BINARY_CMD_HELLO,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(buffer.response.message.header.response.bodylen == 0);
+
+    /* So the responses still come as they are */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    return TEST_PASS;
+}
+
+static enum test_return test_setm(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    char body[512];
+    const char *keys[] = { "test_setm_0", "test_setm_1", "test_setm_2" };
+    const char *value = "value";
+    size_t offset = 0;
+    size_t len;
+    int ii;
+
+    for (ii = 0; ii < 3; ++ii) {
+        protocol_binary_setm_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.nkey = htons((uint16_t)strlen(keys[ii]));
+        entry.nbytes = htonl((uint32_t)strlen(value));
+        memcpy(body + offset, &entry, sizeof(entry));
+        offset += sizeof(entry);
+        memcpy(body + offset, keys[ii], strlen(keys[ii]));
+        offset += strlen(keys[ii]);
+        memcpy(body + offset, value, strlen(value));
+        offset += strlen(value);
+    }
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_SETM, NULL, 0, body, offset);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_SETM,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    /* One bit per entry, all of them stored */
+    cb_assert(buffer.response.message.header.response.bodylen == 1);
+    cb_assert((uint8_t)buffer.bytes[sizeof(buffer.response)] == 0x07);
+
+    for (ii = 0; ii < 3; ++ii) {
+        len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                          PROTOCOL_BINARY_CMD_GET, keys[ii], strlen(keys[ii]),
+                          NULL, 0);
+        safe_send(buffer.bytes, len, false);
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_GET,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        cb_assert(buffer.response.message.header.response.bodylen ==
+                  4 + strlen(value));
+        cb_assert(memcmp(buffer.bytes + sizeof(buffer.response) + 4, value,
+                         strlen(value)) == 0);
+        delete_object(keys[ii]);
+    }
+
+    /* A truncated entry is a protocol error */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_SETM, NULL, 0, body, offset - 1);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_SETM,
+                             PROTOCOL_BINARY_RESPONSE_EINVAL);
+    reconnect_to_server(false);
+
+    return TEST_PASS;
+}
+
+/*
+ * Run the script with the arguments, and check the status and the value
+ * of the response (NULL for none).
+ */
+static void script_exec(const char *name, const char **args, int nargs,
+                        uint16_t status, const char *expected) {
+    union {
+        protocol_binary_request_script_exec request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    char body[512];
+    size_t offset = 0;
+    size_t len;
+    int ii;
+
+    for (ii = 0; ii < nargs; ++ii) {
+        protocol_binary_script_arg arg;
+        arg.length = htons((uint16_t)strlen(args[ii]));
+        memcpy(body + offset, &arg, sizeof(arg));
+        offset += sizeof(arg);
+        memcpy(body + offset, args[ii], strlen(args[ii]));
+        offset += strlen(args[ii]);
+    }
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_SCRIPT_EXEC, name, strlen(name),
+                      body, offset);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response,
+                             PROTOCOL_BINARY_CMD_SCRIPT_EXEC, status);
+    if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        return;
+    }
+    if (expected == NULL) {
+        cb_assert(buffer.response.message.header.response.extlen == 0);
+        cb_assert(buffer.response.message.header.response.bodylen == 0);
+    } else {
+        cb_assert(buffer.response.message.header.response.extlen == 4);
+        cb_assert(buffer.response.message.header.response.bodylen ==
+                  4 + strlen(expected));
+        cb_assert(memcmp(buffer.bytes + sizeof(buffer.response) + 4,
+                         expected, strlen(expected)) == 0);
+    }
+}
+
+static enum test_return test_script_exec(void) {
+    const char *visit[] = { "test_script_counter", "test_script_list", "b" };
+    const char *create[] = { "test_script_new", "x" };
+    const char *missing[] = { "test_script_missing" };
+    const char *spin[] = { "test_script_new" };
+
+    /* Bump the counter, append to the list, touch it and return it */
+    store_object("test_script_list", "a");
+    script_exec("visit", visit, 3, PROTOCOL_BINARY_RESPONSE_SUCCESS, "ab");
+    script_exec("visit", visit, 3, PROTOCOL_BINARY_RESPONSE_SUCCESS, "abb");
+    script_exec("create", visit, 1, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS,
+                NULL);
+
+    /* Only stores the key if it isn't there yet */
+    script_exec("create", create, 2, PROTOCOL_BINARY_RESPONSE_SUCCESS, NULL);
+    script_exec("create", create, 2, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS,
+                NULL);
+
+    /* An argument the script needs is missing */
+    script_exec("create", missing, 1, PROTOCOL_BINARY_RESPONSE_EINVAL, NULL);
+
+    /* Runs out of its budget of steps */
+    script_exec("spin", spin, 1, PROTOCOL_BINARY_RESPONSE_E2BIG, NULL);
+
+    script_exec("no_such_script", NULL, 0,
+                PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, NULL);
+
+    delete_object("test_script_counter");
+    delete_object("test_script_list");
+    delete_object("test_script_new");
+    return TEST_PASS;
+}
+
+static void get_range(const char *key, uint32_t offset, uint32_t length,
+                      uint16_t status, const char *expected) {
+    union {
+        protocol_binary_request_get_range request;
+        protocol_binary_response_get_range response;
+        char bytes[1024];
+    } buffer;
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_GET_RANGE, NULL, 0, NULL, 0);
+
+    buffer.request.message.header.request.extlen = 8;
+    buffer.request.message.header.request.keylen = htons((uint16_t)strlen(key));
+    buffer.request.message.header.request.bodylen = htonl((uint32_t)(8 + strlen(key)));
+    buffer.request.message.body.offset = htonl(offset);
+    buffer.request.message.body.length = htonl(length);
+    memcpy(buffer.bytes + sizeof(buffer.request), key, strlen(key));
+    len += 8 + strlen(key);
+
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header((void*)&buffer.response,
+                             PROTOCOL_BINARY_CMD_GET_RANGE, status);
+    if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        cb_assert(buffer.response.message.header.response.extlen == 8);
+        cb_assert(ntohl(buffer.response.message.body.nbytes) == 10);
+        cb_assert(buffer.response.message.header.response.bodylen ==
+                  8 + strlen(expected));
+        cb_assert(memcmp(buffer.bytes + sizeof(buffer.response), expected,
+                         strlen(expected)) == 0);
+    }
+}
+
+static enum test_return test_get_range(void) {
+    store_object("test_get_range", "0123456789");
+
+    get_range("test_get_range", 0, 4, PROTOCOL_BINARY_RESPONSE_SUCCESS,
+              "0123");
+    get_range("test_get_range", 6, 0, PROTOCOL_BINARY_RESPONSE_SUCCESS,
+              "6789");
+    /* The length is cut at the end of the value */
+    get_range("test_get_range", 8, 100, PROTOCOL_BINARY_RESPONSE_SUCCESS,
+              "89");
+    get_range("test_get_range", 10, 0, PROTOCOL_BINARY_RESPONSE_SUCCESS, "");
+    get_range("test_get_range", 11, 0, PROTOCOL_BINARY_RESPONSE_ERANGE, NULL);
+
+    delete_object("test_get_range");
+    get_range("test_get_range", 0, 0, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT,
+              NULL);
+
+    return TEST_PASS;
+}
+
 /* Send one character to the SSL port, then check memcached correctly closes
  * the connection (and doesn't hold it open for ever trying to read) more bytes
  * which will never come.
@@ -3922,9 +4984,12 @@ static enum test_return test_mb_12762_ssl_handshake_hang(void) {
     cb_assert(ready_fds == 1);
 
     /* Verify that attempting to read from the socket returns 0 (peer has
-     * indeed closed the connection).
+     * indeed closed the connection), after the alert OpenSSL sends for the
+     * broken handshake.
      */
-    len = recv(sock_ssl, buf, 1, 0);
+    do {
+        len = recv(sock_ssl, buf, sizeof(buf), 0);
+    } while (len > 0);
     cb_assert(len == 0);
 
     /* Restore the SSL connection to a sane state :) */
@@ -4102,6 +5167,101 @@ static enum test_return test_sasl_fail(void) {
     }
 }
 
+/* Send the command without a key or a body, and check its status */
+static void command_status(uint8_t cmd, const char *key, uint16_t status) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes), cmd,
+                             key, key ? strlen(key) : 0, NULL, 0);
+
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, cmd, status);
+}
+
+/*
+ * Write the RBAC configuration (NULL for a broken one) and reload it from
+ * a connection of its own, the one of the test may not be allowed to.
+ */
+static void reload_rbac_config(cJSON *rbac) {
+    char *text = rbac ? cJSON_Print(rbac) : NULL;
+    SOCKET test_sock = sock;
+
+    cb_assert(write_config_to_file(text ? text : "{ \"users\": [",
+                                   rbac_file) != -1);
+    cJSON_Free(text);
+
+    sock = create_connect_plain_socket("127.0.0.1", port, false);
+    command_status(PROTOCOL_BINARY_CMD_CONFIG_RELOAD, NULL,
+                   PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    closesocket(sock);
+    sock = test_sock;
+}
+
+/*
+ * A reload of the RBAC configuration updates the privileges of the live
+ * connections in place: only those whose user was removed go stale.
+ */
+static enum test_return test_config_reload_rbac(void) {
+    cJSON *rbac = generate_rbac_config();
+    cJSON *statistics = cJSON_GetObjectItem(
+        cJSON_GetObjectItem(cJSON_GetArrayItem(
+            cJSON_GetObjectItem(rbac, "profiles"), 1), "memcached"),
+        "allow");
+    cJSON *admin = cJSON_CreateObject();
+
+    /* Nothing changed, nothing to do for the connection */
+    reload_rbac_config(rbac);
+    command_status(PROTOCOL_BINARY_CMD_NOOP, NULL,
+                   PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /* The role the connection assumed gets NOOP on its next command */
+    command_status(PROTOCOL_BINARY_CMD_ASSUME_ROLE, "statistics",
+                   PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    command_status(PROTOCOL_BINARY_CMD_NOOP, NULL,
+                   PROTOCOL_BINARY_RESPONSE_EACCESS);
+    cJSON_AddItemToArray(statistics, cJSON_CreateString("noop"));
+    reload_rbac_config(rbac);
+    command_status(PROTOCOL_BINARY_CMD_NOOP, NULL,
+                   PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    command_status(PROTOCOL_BINARY_CMD_ASSUME_ROLE, NULL,
+                   PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /* A broken file leaves the running configuration (with NOOP) alone */
+    reload_rbac_config(NULL);
+    command_status(PROTOCOL_BINARY_CMD_ASSUME_ROLE, "statistics",
+                   PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    command_status(PROTOCOL_BINARY_CMD_NOOP, NULL,
+                   PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    command_status(PROTOCOL_BINARY_CMD_ASSUME_ROLE, NULL,
+                   PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cJSON_Delete(rbac);
+
+    /* The connection of a user removed from the file goes stale */
+    rbac = generate_rbac_config();
+    cJSON_AddStringToObject(admin, "login", "_admin");
+    cJSON_AddStringToObject(admin, "profiles", "system");
+    cJSON_AddItemToArray(cJSON_GetObjectItem(rbac, "users"), admin);
+    reload_rbac_config(rbac);
+    cJSON_Delete(rbac);
+    cb_assert(sasl_auth("_admin", "password") ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    command_status(PROTOCOL_BINARY_CMD_NOOP, NULL,
+                   PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    rbac = generate_rbac_config();
+    reload_rbac_config(rbac);
+    cJSON_Delete(rbac);
+    command_status(PROTOCOL_BINARY_CMD_NOOP, NULL,
+                   PROTOCOL_BINARY_RESPONSE_AUTH_STALE);
+
+    reconnect_to_server(false);
+    return test_noop();
+}
+
 static enum test_return test_exceed_max_packet_size(void)
 {
     union {
@@ -4125,6 +5285,124 @@ static enum test_return test_exceed_max_packet_size(void)
     return TEST_PASS;
 }
 
+static void greenstack_send(SOCKET s, uint32_t stream, const void *fields,
+                            uint16_t fieldlen, const void *packet,
+                            size_t len) {
+    char buffer[1024];
+    protocol_greenstack_frame_header *header = (void*)buffer;
+    size_t total = sizeof(header->bytes) + fieldlen + len;
+    size_t offset = 0;
+
+    cb_assert(total <= sizeof(buffer));
+    header->frame.magic = PROTOCOL_GREENSTACK_REQ;
+    header->frame.flags = 0;
+    header->frame.fieldlen = htons(fieldlen);
+    header->frame.stream = htonl(stream);
+    header->frame.bodylen = htonl((uint32_t)len);
+    if (fieldlen > 0) {
+        memcpy(buffer + sizeof(header->bytes), fields, fieldlen);
+    }
+    memcpy(buffer + sizeof(header->bytes) + fieldlen, packet, len);
+
+    while (offset < total) {
+        ssize_t nw = send(s, buffer + offset, total - offset, 0);
+        cb_assert(nw > 0);
+        offset += nw;
+    }
+}
+
+static void greenstack_recv_bytes(SOCKET s, void *buf, size_t len) {
+    size_t offset = 0;
+    while (offset < len) {
+        ssize_t nr = recv(s, (char*)buf + offset, len - offset, 0);
+        cb_assert(nr > 0);
+        offset += nr;
+    }
+}
+
+/*
+ * Read a response frame and validate that it echoes the stream and fields,
+ * and carries a single response packet with the given status.
+ */
+static void greenstack_recv(SOCKET s, uint32_t stream, const void *fields,
+                            uint16_t fieldlen, uint8_t cmd, uint16_t status) {
+    protocol_greenstack_frame_header header;
+    union {
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } receive;
+    char echoed[PROTOCOL_GREENSTACK_MAX_FIELDLEN];
+    uint32_t bodylen;
+
+    greenstack_recv_bytes(s, header.bytes, sizeof(header.bytes));
+    cb_assert(header.frame.magic == PROTOCOL_GREENSTACK_RES);
+    cb_assert(ntohl(header.frame.stream) == stream);
+    cb_assert(ntohs(header.frame.fieldlen) == fieldlen);
+    if (fieldlen > 0) {
+        greenstack_recv_bytes(s, echoed, fieldlen);
+        cb_assert(memcmp(echoed, fields, fieldlen) == 0);
+    }
+
+    bodylen = ntohl(header.frame.bodylen);
+    cb_assert(bodylen >= sizeof(receive.response) &&
+              bodylen <= sizeof(receive.bytes));
+    greenstack_recv_bytes(s, receive.bytes, bodylen);
+    receive.response.message.header.response.keylen =
+        ntohs(receive.response.message.header.response.keylen);
+    receive.response.message.header.response.status =
+        ntohs(receive.response.message.header.response.status);
+    receive.response.message.header.response.bodylen =
+        ntohl(receive.response.message.header.response.bodylen);
+    cb_assert(bodylen == sizeof(receive.response) +
+              receive.response.message.header.response.bodylen);
+    validate_response_header(&receive.response, cmd, status);
+}
+
+static enum test_return test_greenstack(void) {
+    static const char tag[] = { PROTOCOL_GREENSTACK_FIELD_TAG, 7,
+                                't', 'r', 'a', 'c', 'e', '-', '1' };
+    static const char unknown[] = { 0x05, 1, 'x' };
+    static const char mandatory[] = { PROTOCOL_GREENSTACK_FIELD_MANDATORY | 0x05,
+                                      1, 'x' };
+    union {
+        protocol_binary_request_no_extras request;
+        char bytes[1024];
+    } send;
+    SOCKET s = create_connect_plain_socket("127.0.0.1", greenstack_port,
+                                           false);
+    size_t noop_len;
+    size_t get_len;
+    cb_assert(s != INVALID_SOCKET);
+
+    noop_len = raw_command(send.bytes, sizeof(send.bytes),
+                           PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+
+    /* The stream and the tag are echoed back */
+    greenstack_send(s, 0xcafe, tag, sizeof(tag), send.bytes, noop_len);
+    greenstack_recv(s, 0xcafe, tag, sizeof(tag), PROTOCOL_BINARY_CMD_NOOP,
+                    PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /* Unknown fields are ignored, unless they're mandatory */
+    greenstack_send(s, 1, unknown, sizeof(unknown), send.bytes, noop_len);
+    greenstack_recv(s, 1, NULL, 0, PROTOCOL_BINARY_CMD_NOOP,
+                    PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    greenstack_send(s, 2, mandatory, sizeof(mandatory), send.bytes, noop_len);
+    greenstack_recv(s, 2, NULL, 0, PROTOCOL_BINARY_CMD_NOOP,
+                    PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
+
+    /* Pipelined frames each get their own response frame */
+    greenstack_send(s, 3, NULL, 0, send.bytes, noop_len);
+    get_len = raw_command(send.bytes, sizeof(send.bytes),
+                          PROTOCOL_BINARY_CMD_GET, "greenstack", 10, NULL, 0);
+    greenstack_send(s, 4, NULL, 0, send.bytes, get_len);
+    greenstack_recv(s, 3, NULL, 0, PROTOCOL_BINARY_CMD_NOOP,
+                    PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    greenstack_recv(s, 4, NULL, 0, PROTOCOL_BINARY_CMD_GET,
+                    PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+
+    closesocket(s);
+    return TEST_PASS;
+}
 
 typedef enum test_return (*TEST_FUNC)(void);
 struct testcase {
@@ -4168,6 +5446,8 @@ struct testcase testcases[] = {
     TESTCASE_PLAIN("strtoull", test_safe_strtoull),
     TESTCASE_PLAIN("vperror", test_vperror),
     TESTCASE_PLAIN("config_parser", test_config_parser),
+    TESTCASE_PLAIN("config_parser_schema", test_config_parser_schema),
+    TESTCASE_PLAIN("protocol2text", test_protocol2text),
     /* The following tests all run towards the same server */
     TESTCASE_SETUP("start_server", start_memcached_server),
     TESTCASE_PLAIN_AND_SSL("connect", test_connect_to_server),
@@ -4210,8 +5490,14 @@ struct testcase testcases[] = {
     TESTCASE_PLAIN_AND_SSL("appendq", test_appendq),
     TESTCASE_PLAIN_AND_SSL("prepend", test_prepend),
     TESTCASE_PLAIN_AND_SSL("prependq", test_prependq),
+    TESTCASE_PLAIN_AND_SSL("concat_cas", test_concat_cas),
     TESTCASE_PLAIN_AND_SSL("stat", test_stat),
     TESTCASE_PLAIN_AND_SSL("stat_connections", test_stat_connections),
+    TESTCASE_PLAIN_AND_SSL("stat_startup", test_stat_startup),
+    TESTCASE_PLAIN_AND_SSL("stat_hot_vbuckets", test_stat_hot_vbuckets),
+    TESTCASE_PLAIN_AND_SSL("stat_connections_chunked",
+                           test_stat_connections_chunked),
+    TESTCASE_PLAIN_AND_SSL("ewouldblock_stores", test_ewouldblock_stores),
     TESTCASE_PLAIN_AND_SSL("roles", test_roles),
     TESTCASE_PLAIN_AND_SSL("scrub", test_scrub),
     TESTCASE_PLAIN_AND_SSL("verbosity", test_verbosity),
@@ -4224,22 +5510,27 @@ struct testcase testcases[] = {
     TESTCASE_PLAIN_AND_SSL("isasl_refresh", test_isasl_refresh),
     TESTCASE_PLAIN_AND_SSL("ioctl_get", test_ioctl_get),
     TESTCASE_PLAIN_AND_SSL("ioctl_set", test_ioctl_set),
+    TESTCASE_PLAIN_AND_SSL("ioctl_heap_profile", test_ioctl_heap_profile),
+    TESTCASE_PLAIN_AND_SSL("ioctl_shm_ring", test_ioctl_shm_ring),
 #if defined(HAVE_TCMALLOC)
     TESTCASE_PLAIN_AND_SSL("ioctl_tcmalloc_aggr_decommit",
                            test_ioctl_tcmalloc_aggr_decommit),
 #endif
     TESTCASE_PLAIN_AND_SSL("config_validate", test_config_validate),
     TESTCASE_PLAIN("config_reload", test_config_reload),
+    TESTCASE_PLAIN("config_reload_rbac", test_config_reload_rbac),
     TESTCASE_SSL("config_reload_ssl", test_config_reload_ssl),
     TESTCASE_PLAIN_AND_SSL("audit_put", test_audit_put),
     TESTCASE_PLAIN("audit_config_reload", test_audit_config_reload),
     TESTCASE_PLAIN_AND_SSL("datatype_json", test_datatype_json),
     TESTCASE_PLAIN_AND_SSL("datatype_json_without_support", test_datatype_json_without_support),
+    TESTCASE_PLAIN_AND_SSL("datatype_json_detection", test_datatype_json_detection),
     TESTCASE_PLAIN_AND_SSL("datatype_compressed", test_datatype_compressed),
     TESTCASE_PLAIN_AND_SSL("datatype_compressed_json", test_datatype_compressed_json),
     TESTCASE_PLAIN_AND_SSL("invalid_datatype", test_invalid_datatype),
     TESTCASE_PLAIN_AND_SSL("session_ctrl_token", test_session_ctrl_token),
     TESTCASE_PLAIN_AND_SSL("expiry_relative_with_clock_change", test_expiry_relative_with_clock_change_backwards),
+    TESTCASE_PLAIN_AND_SSL("expiry_ms", test_expiry_ms),
     TESTCASE_PLAIN("pipeline_hickup", test_pipeline_hickup),
     TESTCASE_PLAIN_AND_SSL("set_huge", test_set_huge),
     TESTCASE_PLAIN_AND_SSL("setq_huge", test_setq_huge),
@@ -4248,7 +5539,15 @@ struct testcase testcases[] = {
     TESTCASE_SSL("pipeline_mb-11203",test_pipeline_set),
     TESTCASE_PLAIN_AND_SSL("pipeline_1", test_pipeline_set_get_del),
     TESTCASE_PLAIN_AND_SSL("pipeline_2", test_pipeline_set_del),
+    TESTCASE_PLAIN_AND_SSL("unordered_execution", test_unordered_execution),
+    TESTCASE_PLAIN_AND_SSL("compact_response", test_compact_response),
+    TESTCASE_PLAIN_AND_SSL("stream_compression_refused",
+                           test_stream_compression_refused),
+    TESTCASE_PLAIN_AND_SSL("setm", test_setm),
+    TESTCASE_PLAIN_AND_SSL("script_exec", test_script_exec),
+    TESTCASE_PLAIN_AND_SSL("get_range", test_get_range),
     TESTCASE_PLAIN("exceed_max_packet_size", test_exceed_max_packet_size),
+    TESTCASE_PLAIN("greenstack", test_greenstack),
     TESTCASE_CLEANUP("stop_server", stop_memcached_server),
     TESTCASE_PLAIN_AND_SSL("subdoc_get_binary_raw", test_subdoc_get_binary_raw),
     TESTCASE_PLAIN_AND_SSL("subdoc_get_binary_compressed", test_subdoc_get_binary_compressed),
@@ -4288,6 +5587,9 @@ struct testcase testcases[] = {
     TESTCASE_PLAIN_AND_SSL("subdoc_array_push_first_simple", test_subdoc_array_push_first_simple),
     TESTCASE_PLAIN_AND_SSL("subdoc_array_push_first_nested", test_subdoc_array_push_first_nested),
     TESTCASE_PLAIN_AND_SSL("subdoc_array_add_unique_simple", test_subdoc_array_add_unique_simple),
+    TESTCASE_PLAIN_AND_SSL("subdoc_multi_lookup", test_subdoc_multi_lookup),
+    TESTCASE_PLAIN_AND_SSL("subdoc_multi_mutation", test_subdoc_multi_mutation),
+    TESTCASE_PLAIN_AND_SSL("subdoc_lookup_repeated", test_subdoc_lookup_repeated),
     TESTCASE_PLAIN(NULL, NULL)
 };
 
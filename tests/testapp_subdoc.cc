@@ -1350,3 +1350,209 @@ enum test_return test_subdoc_array_add_unique_simple()
 
     return TEST_PASS;
 }
+
+// A spec of a multi-path command.
+struct SubdocMultiSpec {
+    protocol_binary_command cmd;
+    std::string path;
+    std::string value;
+    protocol_binary_subdoc_flag flags;
+};
+
+/* Encodes and sends a multi-path command, receives the response and validates
+ * that the status matches the expected one.
+ * @return the body of the response.
+ */
+static std::string expect_subdoc_multi_cmd(protocol_binary_command cmd,
+                                           const std::string& key,
+                                           const std::vector<SubdocMultiSpec>& specs,
+                                           protocol_binary_response_status expected_status) {
+    std::vector<char> send(sizeof(protocol_binary_request_header));
+    send.insert(send.end(), key.begin(), key.end());
+    for (const auto& spec : specs) {
+        if (cmd == PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION) {
+            protocol_binary_subdoc_multi_mutation_spec encoded;
+            encoded.opcode = spec.cmd;
+            encoded.subdoc_flags = spec.flags;
+            encoded.pathlen = htons(spec.path.size());
+            encoded.valuelen = htonl(spec.value.size());
+            const char* ptr = reinterpret_cast<const char*>(&encoded);
+            send.insert(send.end(), ptr, ptr + sizeof(encoded));
+        } else {
+            protocol_binary_subdoc_multi_lookup_spec encoded;
+            encoded.opcode = spec.cmd;
+            encoded.subdoc_flags = spec.flags;
+            encoded.pathlen = htons(spec.path.size());
+            const char* ptr = reinterpret_cast<const char*>(&encoded);
+            send.insert(send.end(), ptr, ptr + sizeof(encoded));
+        }
+        send.insert(send.end(), spec.path.begin(), spec.path.end());
+        send.insert(send.end(), spec.value.begin(), spec.value.end());
+    }
+
+    protocol_binary_request_header* header =
+            reinterpret_cast<protocol_binary_request_header*>(send.data());
+    memset(header, 0, sizeof(*header));
+    header->request.magic = PROTOCOL_BINARY_REQ;
+    header->request.opcode = cmd;
+    header->request.keylen = htons(key.size());
+    header->request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    header->request.bodylen = htonl(send.size() - sizeof(*header));
+    header->request.opaque = 0xdeadbeef;
+
+    union {
+        protocol_binary_response_subdocument response;
+        char bytes[2048];
+    } receive;
+
+    safe_send(send.data(), send.size(), false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+
+    validate_response_header((protocol_binary_response_no_extras*)&receive.response,
+                             cmd, expected_status);
+
+    const protocol_binary_response_header* rsp = &receive.response.message.header;
+    const char* val_ptr = receive.bytes + sizeof(*rsp) + rsp->response.extlen;
+    return std::string(val_ptr, val_ptr + rsp->response.bodylen);
+}
+
+// The result of a single lookup, as it is in the response to a multi-lookup.
+static std::string lookup_result(protocol_binary_response_status status,
+                                 const std::string& value) {
+    uint16_t encoded_status = htons(status);
+    uint32_t encoded_len = htonl(value.size());
+    std::string result(reinterpret_cast<const char*>(&encoded_status),
+                       sizeof(encoded_status));
+    result.append(reinterpret_cast<const char*>(&encoded_len),
+                  sizeof(encoded_len));
+    return result + value;
+}
+
+enum test_return test_subdoc_multi_lookup() {
+    const protocol_binary_subdoc_flag none = protocol_binary_subdoc_flag(0);
+
+    // a). Lookups on a non-existent document fail as a whole.
+    expect_subdoc_multi_cmd(PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP, "dict",
+                            {{PROTOCOL_BINARY_CMD_SUBDOC_GET, "int", "", none}},
+                            PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+
+    store_object("dict", "{\"int\":1,\"obj\":{\"str\":\"x\"},\"array\":[1,2]}",
+                 /*JSON*/true, /*compress*/false);
+
+    // b). Every lookup returns its own result, in order.
+    std::string body = expect_subdoc_multi_cmd(
+            PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP, "dict",
+            {{PROTOCOL_BINARY_CMD_SUBDOC_GET, "int", "", none},
+             {PROTOCOL_BINARY_CMD_SUBDOC_EXISTS, "obj.str", "", none},
+             {PROTOCOL_BINARY_CMD_SUBDOC_GET, "array[1]", "", none}},
+            PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    check_equal(body, lookup_result(PROTOCOL_BINARY_RESPONSE_SUCCESS, "1") +
+                      lookup_result(PROTOCOL_BINARY_RESPONSE_SUCCESS, "") +
+                      lookup_result(PROTOCOL_BINARY_RESPONSE_SUCCESS, "2"));
+
+    // c). A failed lookup doesn't affect the others.
+    body = expect_subdoc_multi_cmd(
+            PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP, "dict",
+            {{PROTOCOL_BINARY_CMD_SUBDOC_GET, "missing", "", none},
+             {PROTOCOL_BINARY_CMD_SUBDOC_GET, "obj", "", none}},
+            PROTOCOL_BINARY_RESPONSE_SUBDOC_MULTI_PATH_FAILURE);
+    check_equal(body, lookup_result(PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_ENOENT, "") +
+                      lookup_result(PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                                    "{\"str\":\"x\"}"));
+
+    // d). Mutations and too many paths are invalid.
+    expect_subdoc_multi_cmd(PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP, "dict",
+                            {{PROTOCOL_BINARY_CMD_SUBDOC_DELETE, "int", "", none}},
+                            PROTOCOL_BINARY_RESPONSE_EINVAL);
+    std::vector<SubdocMultiSpec> too_many(
+            PROTOCOL_BINARY_SUBDOC_MULTI_MAX_PATHS + 1,
+            {PROTOCOL_BINARY_CMD_SUBDOC_GET, "int", "", none});
+    expect_subdoc_multi_cmd(PROTOCOL_BINARY_CMD_SUBDOC_MULTI_LOOKUP, "dict",
+                            too_many, PROTOCOL_BINARY_RESPONSE_EINVAL);
+
+    delete_object("dict");
+
+    return TEST_PASS;
+}
+
+enum test_return test_subdoc_multi_mutation() {
+    const protocol_binary_subdoc_flag none = protocol_binary_subdoc_flag(0);
+
+    store_object("dict", "{\"int\":1}", /*JSON*/true, /*compress*/false);
+
+    // a). All of the mutations are applied.
+    std::string body = expect_subdoc_multi_cmd(
+            PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION, "dict",
+            {{PROTOCOL_BINARY_CMD_SUBDOC_DICT_ADD, "str", "\"x\"", none},
+             {PROTOCOL_BINARY_CMD_SUBDOC_REPLACE, "int", "2", none}},
+            PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    check_equal(body, "");
+    validate_object("dict", "{\"int\":2,\"str\":\"x\"}");
+
+    // b). Each mutation sees the ones before it.
+    expect_subdoc_multi_cmd(
+            PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION, "dict",
+            {{PROTOCOL_BINARY_CMD_SUBDOC_DICT_ADD, "new", "1", none},
+             {PROTOCOL_BINARY_CMD_SUBDOC_DELETE, "new", "", none}},
+            PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    validate_object("dict", "{\"int\":2,\"str\":\"x\"}");
+
+    // c). If one fails nothing is changed, and the response says which.
+    body = expect_subdoc_multi_cmd(
+            PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION, "dict",
+            {{PROTOCOL_BINARY_CMD_SUBDOC_REPLACE, "int", "3", none},
+             {PROTOCOL_BINARY_CMD_SUBDOC_DICT_ADD, "str", "1", none}},
+            PROTOCOL_BINARY_RESPONSE_SUBDOC_MULTI_PATH_FAILURE);
+    uint16_t failure = htons(PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_EEXISTS);
+    check_equal(body, std::string(1, '\x01') +
+                      std::string(reinterpret_cast<const char*>(&failure),
+                                  sizeof(failure)));
+    validate_object("dict", "{\"int\":2,\"str\":\"x\"}");
+
+    // d). Lookups are invalid.
+    expect_subdoc_multi_cmd(PROTOCOL_BINARY_CMD_SUBDOC_MULTI_MUTATION, "dict",
+                            {{PROTOCOL_BINARY_CMD_SUBDOC_GET, "int", "", none}},
+                            PROTOCOL_BINARY_RESPONSE_EINVAL);
+
+    delete_object("dict");
+
+    return TEST_PASS;
+}
+
+// Repeated lookups of the same paths (answered from the subdoc index cache
+// after the first time) see the changes to the document.
+enum test_return test_subdoc_lookup_repeated() {
+    store_object("dict", "{\"int\":1,\"str\":\"x\"}", /*JSON*/true,
+                 /*compress*/false);
+
+    // a). The same results every time.
+    for (int ii = 0; ii < 3; ii++) {
+        expect_subdoc_cmd(SubdocCmd(PROTOCOL_BINARY_CMD_SUBDOC_GET, "dict", "int"),
+                          PROTOCOL_BINARY_RESPONSE_SUCCESS, "1");
+        expect_subdoc_cmd(SubdocCmd(PROTOCOL_BINARY_CMD_SUBDOC_EXISTS, "dict", "str"),
+                          PROTOCOL_BINARY_RESPONSE_SUCCESS, "");
+        expect_subdoc_cmd(SubdocCmd(PROTOCOL_BINARY_CMD_SUBDOC_GET, "dict", "missing"),
+                          PROTOCOL_BINARY_RESPONSE_SUBDOC_PATH_ENOENT, "");
+    }
+
+    // b). A document of the same size, with other values.
+    store_object("dict", "{\"str\":\"y\",\"int\":2}", /*JSON*/true,
+                 /*compress*/false);
+    expect_subdoc_cmd(SubdocCmd(PROTOCOL_BINARY_CMD_SUBDOC_GET, "dict", "int"),
+                      PROTOCOL_BINARY_RESPONSE_SUCCESS, "2");
+    expect_subdoc_cmd(SubdocCmd(PROTOCOL_BINARY_CMD_SUBDOC_GET, "dict", "str"),
+                      PROTOCOL_BINARY_RESPONSE_SUCCESS, "\"y\"");
+
+    // c). A sub-document mutation of it.
+    expect_subdoc_cmd(SubdocCmd(PROTOCOL_BINARY_CMD_SUBDOC_DICT_UPSERT, "dict",
+                                "missing", "3"),
+                      PROTOCOL_BINARY_RESPONSE_SUCCESS, "");
+    expect_subdoc_cmd(SubdocCmd(PROTOCOL_BINARY_CMD_SUBDOC_GET, "dict", "missing"),
+                      PROTOCOL_BINARY_RESPONSE_SUCCESS, "3");
+    expect_subdoc_cmd(SubdocCmd(PROTOCOL_BINARY_CMD_SUBDOC_GET, "dict", "int"),
+                      PROTOCOL_BINARY_RESPONSE_SUCCESS, "2");
+
+    delete_object("dict");
+
+    return TEST_PASS;
+}
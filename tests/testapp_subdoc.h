@@ -74,6 +74,11 @@ enum test_return test_subdoc_array_push_first_nested();
 
 enum test_return test_subdoc_array_add_unique_simple();
 
+enum test_return test_subdoc_multi_lookup();
+enum test_return test_subdoc_multi_mutation();
+
+enum test_return test_subdoc_lookup_repeated();
+
 #if defined(__cplusplus)
 } // extern "C"
 #endif
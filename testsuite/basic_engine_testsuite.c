@@ -246,6 +246,208 @@ static enum test_result get_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result get_multi_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item_get_request requests[4];
+    const char *keys[] = { "multi_0", "multi_1", "multi_miss", "multi_3" };
+    uint64_t cas = 0;
+    int ii;
+
+    for (ii = 0; ii < 4; ++ii) {
+        item *it = NULL;
+        requests[ii].key = keys[ii];
+        requests[ii].nkey = (uint16_t)strlen(keys[ii]);
+        requests[ii].vbucket = 0;
+        if (ii == 2) {
+            continue;
+        }
+        cb_assert(h1->allocate(h, NULL, &it, keys[ii], strlen(keys[ii]),
+                               1, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    cb_assert(h1->get_multi != NULL);
+    cb_assert(h1->get_multi(h, NULL, requests, 4) == ENGINE_SUCCESS);
+    for (ii = 0; ii < 4; ++ii) {
+        if (ii == 2) {
+            cb_assert(requests[ii].status == ENGINE_KEY_ENOENT);
+            cb_assert(requests[ii].item == NULL);
+        } else {
+            item_info info;
+            info.nvalue = 1;
+            cb_assert(requests[ii].status == ENGINE_SUCCESS);
+            cb_assert(h1->get_item_info(h, NULL, requests[ii].item, &info));
+            cb_assert(info.nkey == requests[ii].nkey);
+            cb_assert(memcmp(info.key, keys[ii], info.nkey) == 0);
+            h1->release(h, NULL, requests[ii].item);
+        }
+    }
+
+    return SUCCESS;
+}
+
+static enum test_result release_multi_test(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    item *held[100];
+    item *batch[200];
+    char key[32];
+    uint64_t cas = 0;
+    int ii;
+
+    for (ii = 0; ii < 100; ++ii) {
+        item *it = NULL;
+        int nkey = snprintf(key, sizeof(key), "release_multi_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, nkey, 1, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+
+        cb_assert(h1->get(h, NULL, &held[ii], key, nkey, 0) == ENGINE_SUCCESS);
+        /* Two more references, the batch spreads them apart */
+        cb_assert(h1->get(h, NULL, &batch[ii], key, nkey, 0) == ENGINE_SUCCESS);
+        cb_assert(h1->get(h, NULL, &batch[199 - ii], key, nkey,
+                          0) == ENGINE_SUCCESS);
+    }
+
+    cb_assert(h1->release_multi != NULL);
+    h1->release_multi(h, NULL, batch, 200);
+
+    /* Every item is back to the one reference (splice needs it alone) */
+    for (ii = 0; ii < 100; ++ii) {
+        uint64_t new_cas = 0;
+        cb_assert(h1->splice(h, NULL, held[ii], &new_cas, 0, 1, "x", 1,
+                             0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, held[ii]);
+    }
+
+    return SUCCESS;
+}
+
+static enum test_result store_multi_test(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    item_store_request requests[5];
+    const char *keys[] = { "setm_0", "setm_1", "setm_2", "setm_1", "setm_0" };
+    const char *values[] = { "zero", "one", "two", "uno", "cero" };
+    ENGINE_STORE_OPERATION ops[] = { OPERATION_SET, OPERATION_SET,
+                                     OPERATION_SET, OPERATION_SET,
+                                     OPERATION_ADD };
+    const char *expected[] = { "zero", "uno", "two" };
+    int ii;
+
+    memset(requests, 0, sizeof(requests));
+    for (ii = 0; ii < 5; ++ii) {
+        requests[ii].key = keys[ii];
+        requests[ii].nkey = (uint16_t)strlen(keys[ii]);
+        requests[ii].value = values[ii];
+        requests[ii].nbytes = (uint32_t)strlen(values[ii]);
+        requests[ii].flags = ii;
+        requests[ii].datatype = PROTOCOL_BINARY_RAW_BYTES;
+        requests[ii].operation = ops[ii];
+    }
+
+    cb_assert(h1->store_multi != NULL);
+    cb_assert(h1->store_multi(h, NULL, requests, 5) == ENGINE_SUCCESS);
+    for (ii = 0; ii < 4; ++ii) {
+        cb_assert(requests[ii].status == ENGINE_SUCCESS);
+        cb_assert(requests[ii].cas != 0);
+    }
+    /* The key was stored by the first request of the batch */
+    cb_assert(requests[4].status == ENGINE_NOT_STORED);
+
+    /* The later request of the same key wins */
+    for (ii = 0; ii < 3; ++ii) {
+        item *it = NULL;
+        item_info info;
+        info.nvalue = 1;
+        cb_assert(h1->get(h, NULL, &it, keys[ii], (int)strlen(keys[ii]),
+                          0) == ENGINE_SUCCESS);
+        cb_assert(h1->get_item_info(h, NULL, it, &info));
+        cb_assert(info.value[0].iov_len == strlen(expected[ii]));
+        cb_assert(memcmp(info.value[0].iov_base, expected[ii],
+                         info.value[0].iov_len) == 0);
+        cb_assert(info.cas == requests[ii == 1 ? 3 : ii].cas);
+        h1->release(h, NULL, it);
+    }
+
+    return SUCCESS;
+}
+
+static enum test_result splice_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    item *other = NULL;
+    item_info info;
+    const char *key = "splice_test_key";
+    uint64_t cas = 0;
+    uint64_t new_cas = 0;
+
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 11, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &info));
+    memcpy(info.value[0].iov_base, "hello world", 11);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    /* Not while someone else holds a reference to it */
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    cb_assert(h1->get(h, NULL, &other, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    cb_assert(h1->splice != NULL);
+    cb_assert(h1->splice(h, NULL, it, &new_cas, 6, 5, "there", 5, 0) ==
+              ENGINE_NOT_STORED);
+    h1->release(h, NULL, other);
+
+    /* Grow the value, and get a new cas */
+    cb_assert(h1->splice(h, NULL, it, &new_cas, 6, 5, "there!", 6, 0) ==
+              ENGINE_SUCCESS);
+    cb_assert(new_cas != cas);
+    h1->release(h, NULL, it);
+
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &info));
+    cb_assert(info.cas == new_cas);
+    cb_assert(info.value[0].iov_len == 12);
+    cb_assert(memcmp(info.value[0].iov_base, "hello there!", 12) == 0);
+
+    /* Not once it's been replaced */
+    cb_assert(h1->allocate(h, NULL, &other, key, strlen(key), 1, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, other, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, other);
+    cb_assert(h1->splice(h, NULL, it, &new_cas, 0, 5, "howdy", 5, 0) ==
+              ENGINE_NOT_STORED);
+    h1->release(h, NULL, it);
+
+    return SUCCESS;
+}
+
+static enum test_result prefetch_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    const char *key = "prefetch_test_key";
+    const char *miss = "prefetch_test_miss";
+    uint64_t cas = 0;
+
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 1, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    /* Only a hint, which must not change anything */
+    cb_assert(h1->prefetch != NULL);
+    h1->prefetch(h, NULL, key, (int)strlen(key), 0, ENGINE_PREFETCH_INDEX);
+    h1->prefetch(h, NULL, key, (int)strlen(key), 0, ENGINE_PREFETCH_ITEM);
+    h1->prefetch(h, NULL, miss, (int)strlen(miss), 0, ENGINE_PREFETCH_INDEX);
+    h1->prefetch(h, NULL, miss, (int)strlen(miss), 0, ENGINE_PREFETCH_ITEM);
+
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    cb_assert(h1->get(h, NULL, &it, miss, (int)strlen(miss), 0) ==
+              ENGINE_KEY_ENOENT);
+
+    return SUCCESS;
+}
+
 static enum test_result expiry_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *test_item = NULL;
     item *test_item_get = NULL;
@@ -260,6 +462,58 @@ static enum test_result expiry_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+/*
+ * On a connection with millisecond expiry times, an exptime with the top
+ * bit set is in milliseconds from now, and the item expires within the
+ * second it is in
+ */
+static enum test_result expiry_ms_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = test_harness.create_cookie();
+    item *test_item = NULL;
+    item *test_item_get = NULL;
+    void *key = "get_test_key";
+    uint64_t cas = 0;
+
+    test_harness.set_exptime_ms_handling(cookie, true);
+    cb_assert(h1->allocate(h, cookie, &test_item, key, strlen(key), 1, 0,
+                           0x80000000u | 200,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, cookie, test_item, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, cookie, test_item);
+    cb_assert(h1->get(h, cookie, &test_item_get, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    h1->release(h, cookie, test_item_get);
+    usleep(300000);
+    cb_assert(h1->get(h, cookie, &test_item_get, key, (int)strlen(key), 0) == ENGINE_KEY_ENOENT);
+    test_harness.destroy_cookie(cookie);
+    return SUCCESS;
+}
+
+/*
+ * Without them the same exptime is an absolute time (in 2038), so the
+ * item is still there a day later
+ */
+static enum test_result expiry_abs_2038_test(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = test_harness.create_cookie();
+    item *test_item = NULL;
+    item *test_item_get = NULL;
+    void *key = "get_test_key";
+    uint64_t cas = 0;
+
+    test_harness.set_exptime_ms_handling(cookie, false);
+    cb_assert(h1->allocate(h, cookie, &test_item, key, strlen(key), 1, 0,
+                           0x80000000u | 200,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, cookie, test_item, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, cookie, test_item);
+    usleep(300000);
+    test_harness.time_travel(86400);
+    cb_assert(h1->get(h, cookie, &test_item_get, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    h1->release(h, cookie, test_item_get);
+    test_harness.destroy_cookie(cookie);
+    return SUCCESS;
+}
+
 /*
  * Make sure that we can release an item. For the most part all this test does
  * is ensure that thinds dont go splat when we call release. It does nothing to
@@ -377,6 +631,206 @@ static enum test_result mt_incr_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+struct mt_store_ctx {
+    ENGINE_HANDLE *h;
+    int id;
+};
+
+static void store_test_main(void *arg) {
+    struct mt_store_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    char key[32];
+    item *it;
+    uint64_t cas;
+    mutation_descr_t mut_info;
+    int ii;
+
+    for (ii = 0; ii < 1000; ++ii) {
+        size_t nkey = snprintf(key, sizeof(key), "mt_store_%d_%d", ctx->id, ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, nkey, 1, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    for (ii = 0; ii < 1000; ++ii) {
+        size_t nkey = snprintf(key, sizeof(key), "mt_store_%d_%d", ctx->id, ii);
+        cb_assert(h1->get(h, NULL, &it, key, (int)nkey, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+        if (ii % 2 == 0) {
+            cas = 0;
+            cb_assert(h1->remove(h, NULL, key, nkey, &cas, 0,
+                                 &mut_info) == ENGINE_SUCCESS);
+        }
+    }
+}
+
+/*
+ * Make sure concurrent stores, gets and removes on distinct keys work
+ * when the items are spread over multiple lock stripes
+ */
+static enum test_result mt_store_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+#define store_threads 8
+    cb_thread_t tid[store_threads];
+    struct mt_store_ctx ctx[store_threads];
+    item *it;
+    int ii;
+
+    for (ii = 0; ii < store_threads; ++ii) {
+        ctx[ii].h = h;
+        ctx[ii].id = ii;
+        cb_assert(cb_create_thread(&tid[ii], store_test_main, &ctx[ii], 0) == 0);
+    }
+
+    for (ii = 0; ii < store_threads; ++ii) {
+        cb_assert(cb_join_thread(tid[ii]) == 0);
+    }
+
+    cb_assert(h1->get(h, NULL, &it, "mt_store_0_0", 12, 0) == ENGINE_KEY_ENOENT);
+    cb_assert(h1->get(h, NULL, &it, "mt_store_0_1", 12, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    return SUCCESS;
+}
+
+/*
+ * Store enough items to get the hash table expanded a few times (split
+ * over several threads with hash_expand_threads), looking up the items
+ * stored so far while the buckets move.
+ */
+static enum test_result hash_expansion_test(ENGINE_HANDLE *h,
+                                            ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 200000;
+    char key[32];
+    item *it;
+    uint64_t cas;
+    int ii;
+
+    for (ii = 0; ii < nitems; ++ii) {
+        size_t nkey = snprintf(key, sizeof(key), "hash_expand_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, nkey, 1, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+        if (ii % 7 == 0) {
+            nkey = snprintf(key, sizeof(key), "hash_expand_%d", ii / 2);
+            cb_assert(h1->get(h, NULL, &it, key, (int)nkey, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        }
+    }
+
+    for (ii = 0; ii < nitems; ++ii) {
+        size_t nkey = snprintf(key, sizeof(key), "hash_expand_%d", ii);
+        cb_assert(h1->get(h, NULL, &it, key, (int)nkey, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    return SUCCESS;
+}
+
+#define cas_threads 8
+#define cas_stores 1000
+
+struct mt_cas_ctx {
+    ENGINE_HANDLE *h;
+    int id;
+    uint64_t cas[cas_stores];
+};
+
+static void cas_test_main(void *arg) {
+    struct mt_cas_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    char key[32];
+    item *it;
+    uint64_t cas;
+    int ii;
+
+    for (ii = 0; ii < cas_stores; ++ii) {
+        /* Every other store goes to the key all of the threads share */
+        size_t nkey;
+        if (ii % 2 == 0) {
+            nkey = snprintf(key, sizeof(key), "mt_cas_%d", ctx->id);
+        } else {
+            nkey = snprintf(key, sizeof(key), "mt_cas_shared");
+        }
+        cb_assert(h1->allocate(h, NULL, &it, key, nkey, 1, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+        ctx->cas[ii] = cas;
+    }
+}
+
+static int compare_cas(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/*
+ * Make sure the CAS values handed out to concurrent stores are unique,
+ * and go up with every store of the same key
+ */
+static enum test_result mt_cas_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    cb_thread_t tid[cas_threads];
+    struct mt_cas_ctx *ctx = calloc(cas_threads, sizeof(*ctx));
+    uint64_t *all = malloc(cas_threads * cas_stores * sizeof(*all));
+    item *it;
+    item_info info;
+    uint64_t shared = 0;
+    int ii, jj;
+
+    cb_assert(ctx != NULL && all != NULL);
+    for (ii = 0; ii < cas_threads; ++ii) {
+        ctx[ii].h = h;
+        ctx[ii].id = ii;
+        cb_assert(cb_create_thread(&tid[ii], cas_test_main, &ctx[ii], 0) == 0);
+    }
+
+    for (ii = 0; ii < cas_threads; ++ii) {
+        cb_assert(cb_join_thread(tid[ii]) == 0);
+    }
+
+    for (ii = 0; ii < cas_threads; ++ii) {
+        for (jj = 0; jj < cas_stores; ++jj) {
+            cb_assert(ctx[ii].cas[jj] != 0);
+            if (jj >= 2) {
+                /* Both keys were stored by this thread in this order */
+                cb_assert(ctx[ii].cas[jj] > ctx[ii].cas[jj - 2]);
+            }
+            all[ii * cas_stores + jj] = ctx[ii].cas[jj];
+        }
+    }
+
+    qsort(all, cas_threads * cas_stores, sizeof(*all), compare_cas);
+    for (ii = 1; ii < cas_threads * cas_stores; ++ii) {
+        cb_assert(all[ii] != all[ii - 1]);
+    }
+
+    /*
+     * The last store of the key shared by all of the threads is the one
+     * left, and it got the highest CAS of them
+     */
+    for (ii = 0; ii < cas_threads; ++ii) {
+        for (jj = 1; jj < cas_stores; jj += 2) {
+            if (ctx[ii].cas[jj] > shared) {
+                shared = ctx[ii].cas[jj];
+            }
+        }
+    }
+    cb_assert(h1->get(h, NULL, &it, "mt_cas_shared", 13, 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &info));
+    cb_assert(info.cas == shared);
+    h1->release(h, NULL, it);
+
+    free(all);
+    free(ctx);
+    return SUCCESS;
+}
+
 /*
  * Make sure we can arithmetic operations to set the initial value of a key and
  * to then later decrement that value
@@ -424,78 +878,640 @@ static enum test_result flush_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static uint64_t reclaim_passes;
+static uint64_t reclaim_reclaimed;
+
+static void flush_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[64];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+
+    if (klen == 20 && memcmp(key, "flush_reclaim:passes", klen) == 0) {
+        reclaim_passes = strtoull(buffer, NULL, 10);
+    } else if (klen == 23 &&
+               memcmp(key, "flush_reclaim:reclaimed", klen) == 0) {
+        reclaim_reclaimed = strtoull(buffer, NULL, 10);
+    }
+}
+
 /*
- * Make sure we can successfully retrieve the item info struct for an item and
- * that the contents of the item_info are as expected.
+ * Make sure an item stored right after a flush (in the same second) stays,
+ * and the flushed ones are reclaimed in the background
  */
-static enum test_result get_item_info_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+static enum test_result flush_reclaim_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *test_item = NULL;
-    char *key = "get_item_info_test_key";
     uint64_t cas = 0;
-    const rel_time_t exp = 1;
-    item_info ii;
-    ii.nvalue = 1;
+    int ii;
 
-    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1,0, exp,
-                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
-    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
-    /* Had this been actual code, there'd be a connection here */
-    cb_assert(h1->get_item_info(h, NULL, test_item, &ii) == true);
-    cb_assert(ii.cas == cas);
-    cb_assert(ii.flags == 0);
-    cb_assert(strcmp(key,ii.key) == 0);
-    cb_assert(ii.nkey == strlen(key));
-    cb_assert(ii.nbytes == 1);
-    cb_assert(ii.exptime == exp);
+    for (ii = 0; ii < 1000; ++ii) {
+        char key[32];
+        size_t nkey = snprintf(key, sizeof(key), "flush_reclaim_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, nkey, 1, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    cb_assert(h1->flush(h, NULL, 0) == ENGINE_SUCCESS);
+    cb_assert(h1->allocate(h, NULL, &test_item, "flush_reclaim_new", 17, 1,
+                           0, 0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    cb_assert(h1->get(h, NULL, &test_item, "flush_reclaim_999", 17, 0) == ENGINE_KEY_ENOENT);
+    cb_assert(h1->get(h, NULL, &test_item, "flush_reclaim_new", 17, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    reclaim_passes = reclaim_reclaimed = 0;
+    for (ii = 0; ii < 5000 && reclaim_passes == 0; ++ii) {
+        usleep(1000);
+        cb_assert(h1->get_stats(h, NULL, "flush", 5,
+                                flush_stats_handler) == ENGINE_SUCCESS);
+    }
+    cb_assert(reclaim_passes >= 1);
+    /* A couple may have gone when they were looked at (or evicted) */
+    cb_assert(reclaim_reclaimed >= 900);
+
+    cb_assert(h1->get(h, NULL, &test_item, "flush_reclaim_new", 17, 0) == ENGINE_SUCCESS);
     h1->release(h, NULL, test_item);
     return SUCCESS;
 }
 
-static enum test_result item_set_cas_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+static uint64_t expiry_reclaimed;
+static uint64_t expiry_curr_items;
+
+static void expiry_stats_handler(const char *key, const uint16_t klen,
+                                 const char *val, const uint32_t vlen,
+                                 const void *cookie) {
+    char buffer[64];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+
+    if (klen == 22 && memcmp(key, "expiry_index_reclaimed", klen) == 0) {
+        expiry_reclaimed = strtoull(buffer, NULL, 10);
+    } else if (klen == 10 && memcmp(key, "curr_items", klen) == 0) {
+        expiry_curr_items = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * Make sure the expiry index reclaims the expired items without anyone
+ * looking them up, and leaves the rest alone
+ */
+static enum test_result expiry_index_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *test_item = NULL;
-    char *key = "item_set_cas_test_key";
     uint64_t cas = 0;
-    const rel_time_t exp = 1;
-    uint64_t newcas;
-    item_info ii;
+    int ii;
 
-    ii.nvalue = 1;
-    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1,0, exp,
-                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
-    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
-    newcas = cas + 1;
-    h1->item_set_cas(h, NULL, test_item, newcas);
-    cb_assert(h1->get_item_info(h, NULL, test_item, &ii) == true);
-    cb_assert(ii.cas == newcas);
+    /* 100 expire soon, 5 in the second level of the wheel, 10 never */
+    for (ii = 0; ii < 115; ++ii) {
+        char key[32];
+        size_t nkey = snprintf(key, sizeof(key), "expiry_index_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, nkey, 1, 0,
+                               ii < 100 ? 2 : ii < 105 ? 600 : 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    test_harness.time_travel(3);
+    expiry_reclaimed = 0;
+    for (ii = 0; ii < 5000 && expiry_reclaimed < 100; ++ii) {
+        usleep(1000);
+        cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                                expiry_stats_handler) == ENGINE_SUCCESS);
+    }
+    cb_assert(expiry_reclaimed == 100);
+    cb_assert(expiry_curr_items == 15);
+
+    test_harness.time_travel(600);
+    for (ii = 0; ii < 5000 && expiry_reclaimed < 105; ++ii) {
+        usleep(1000);
+        cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                                expiry_stats_handler) == ENGINE_SUCCESS);
+    }
+    cb_assert(expiry_reclaimed == 105);
+    cb_assert(expiry_curr_items == 10);
+
+    cb_assert(h1->get(h, NULL, &test_item, "expiry_index_114", 16, 0) == ENGINE_SUCCESS);
     h1->release(h, NULL, test_item);
     return SUCCESS;
 }
 
-uint32_t evictions;
-static void eviction_stats_handler(const char *key, const uint16_t klen,
-                                   const char *val, const uint32_t vlen,
-                                   const void *cookie) {
-    if (memcmp(key, "evictions", klen) == 0) {
-        char buffer[1024];
+static uint64_t large_item_bytes;
+
+static void large_item_stats_handler(const char *key, const uint16_t klen,
+                                     const char *val, const uint32_t vlen,
+                                     const void *cookie) {
+    if (klen == 5 && memcmp(key, "bytes", klen) == 0) {
+        char buffer[64];
         memcpy(buffer, val, vlen);
         buffer[vlen] = '\0';
-        evictions = atoi(buffer);
+        large_item_bytes = strtoull(buffer, NULL, 10);
     }
 }
 
-static enum test_result lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+/* Check the value of a large item against the pattern it was written with */
+static bool large_item_check(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                             item *it, size_t nbytes) {
+    union {
+        item_info info;
+        char bytes[sizeof(item_info) + 15 * sizeof(struct iovec)];
+    } holder;
+    size_t offset = 0;
+    int ii;
+
+    holder.info.nvalue = 16;
+    if (!h1->get_item_info(h, NULL, it, &holder.info) ||
+        holder.info.nbytes != nbytes) {
+        return false;
+    }
+    for (ii = 0; ii < holder.info.nvalue; ++ii) {
+        const unsigned char *ptr = holder.info.value[ii].iov_base;
+        size_t jj;
+        for (jj = 0; jj < holder.info.value[ii].iov_len; ++jj, ++offset) {
+            if (ptr[jj] != (unsigned char)(offset % 251)) {
+                return false;
+            }
+        }
+    }
+    return offset == nbytes;
+}
+
+/*
+ * Make sure values larger than item_size_max are stored in chunks, and
+ * that the chunks are given back when the item goes
+ */
+static enum test_result large_item_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *key = "large_item_test";
+    const size_t nbytes = 5 * 1024 * 1024 / 2;
+    union {
+        item_info info;
+        char bytes[sizeof(item_info) + 15 * sizeof(struct iovec)];
+    } holder;
     item *test_item = NULL;
-    const char *hot_key = "hot_key";
     uint64_t cas = 0;
+    uint64_t bytes;
+    char tail[100];
+    size_t offset = 0;
+    mutation_descr_t mut_info;
     int ii;
-    int jj;
 
-    cb_assert(h1->allocate(h, NULL, &test_item,
-                        hot_key, strlen(hot_key), 4096, 0, 0,
-                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
-    cb_assert(h1->store(h, NULL, test_item,
-                     &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
-    h1->release(h, NULL, test_item);
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            large_item_stats_handler) == ENGINE_SUCCESS);
+    bytes = large_item_bytes;
+
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key),
+                           5 * 1024 * 1024, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_E2BIG);
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), nbytes,
+                           0, 0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+
+    /* The value doesn't fit in a single segment */
+    holder.info.nvalue = 1;
+    cb_assert(!h1->get_item_info(h, NULL, test_item, &holder.info));
+    holder.info.nvalue = 16;
+    cb_assert(h1->get_item_info(h, NULL, test_item, &holder.info));
+    cb_assert(holder.info.nvalue == 3);
+    for (ii = 0; ii < holder.info.nvalue; ++ii) {
+        unsigned char *ptr = holder.info.value[ii].iov_base;
+        size_t jj;
+        for (jj = 0; jj < holder.info.value[ii].iov_len; ++jj, ++offset) {
+            ptr[jj] = (unsigned char)(offset % 251);
+        }
+    }
+    cb_assert(offset == nbytes);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            large_item_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(large_item_bytes > bytes + nbytes);
+
+    cb_assert(h1->get(h, NULL, &test_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    cb_assert(large_item_check(h, h1, test_item, nbytes));
+    h1->release(h, NULL, test_item);
+
+    /* Append to it, which copies it to a new chain */
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), sizeof(tail),
+                           0, 0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    holder.info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, test_item, &holder.info));
+    for (ii = 0; ii < (int)sizeof(tail); ++ii) {
+        tail[ii] = (char)((nbytes + ii) % 251);
+    }
+    memcpy(holder.info.value[0].iov_base, tail, sizeof(tail));
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_APPEND, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    cb_assert(h1->get(h, NULL, &test_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    cb_assert(large_item_check(h, h1, test_item, nbytes + sizeof(tail)));
+    h1->release(h, NULL, test_item);
+
+    cb_assert(h1->remove(h, NULL, key, strlen(key), &cas, 0,
+                         &mut_info) == ENGINE_SUCCESS);
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            large_item_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(large_item_bytes == bytes);
+    return SUCCESS;
+}
+
+/*
+ * Make sure get_item_view and get_item_segment give the same metadata
+ * and segments as get_item_info, for a small and a chained value
+ */
+static enum test_result item_view_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *key = "item_view_test";
+    const size_t sizes[] = { 10, 5 * 1024 * 1024 / 2 };
+    union {
+        item_info info;
+        char bytes[sizeof(item_info) + 15 * sizeof(struct iovec)];
+    } holder;
+    item_view view;
+    struct iovec segment;
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    int ii, jj;
+
+    cb_assert(h1->get_item_view != NULL && h1->get_item_segment != NULL);
+    for (ii = 0; ii < 2; ++ii) {
+        cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key),
+                               sizes[ii], 0x1234, 0,
+                               PROTOCOL_BINARY_DATATYPE_JSON) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,
+                            0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+
+        cb_assert(h1->get(h, NULL, &test_item, key, strlen(key),
+                          0) == ENGINE_SUCCESS);
+        holder.info.nvalue = 16;
+        cb_assert(h1->get_item_info(h, NULL, test_item, &holder.info));
+        cb_assert(h1->get_item_view(h, NULL, test_item, &view));
+        cb_assert(view.cas == holder.info.cas && view.cas == cas);
+        cb_assert(view.nbytes == sizes[ii]);
+        cb_assert(view.flags == holder.info.flags);
+        cb_assert(view.datatype == PROTOCOL_BINARY_DATATYPE_JSON);
+        cb_assert(view.nkey == strlen(key));
+        cb_assert(memcmp(view.key, key, view.nkey) == 0);
+        cb_assert(view.nsegments == holder.info.nvalue);
+        cb_assert(view.nsegments == (ii == 0 ? 1 : 3));
+        cb_assert(view.value.iov_base == holder.info.value[0].iov_base);
+        cb_assert(view.value.iov_len == holder.info.value[0].iov_len);
+        for (jj = 0; jj < view.nsegments; ++jj) {
+            cb_assert(h1->get_item_segment(h, NULL, test_item,
+                                           (uint16_t)jj, &segment));
+            cb_assert(segment.iov_base == holder.info.value[jj].iov_base);
+            cb_assert(segment.iov_len == holder.info.value[jj].iov_len);
+        }
+        cb_assert(!h1->get_item_segment(h, NULL, test_item,
+                                        view.nsegments, &segment));
+        h1->release(h, NULL, test_item);
+    }
+    return SUCCESS;
+}
+
+static uint64_t sizes_total;
+static int sizes_buckets;
+
+static void sizes_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    if (klen > 0 && key[0] >= '0' && key[0] <= '9') {
+        sizes_total += strtoull(val, NULL, 10);
+        ++sizes_buckets;
+    }
+}
+
+static void sizes_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    sizes_total = 0;
+    sizes_buckets = 0;
+    cb_assert(h1->get_stats(h, NULL, "sizes", 5,
+                            sizes_stats_handler) == ENGINE_SUCCESS);
+}
+
+/*
+ * The size histogram follows the items as they are stored, replaced
+ * and deleted.
+ */
+static enum test_result sizes_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const size_t nbytes[] = { 100, 2000 };
+    mutation_descr_t mut_info;
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[32];
+    int ii, jj;
+
+    sizes_stats(h, h1);
+    cb_assert(sizes_total == 0 && sizes_buckets == 0);
+    for (jj = 0; jj < 2; ++jj) {
+        for (ii = 0; ii < 10; ++ii) {
+            snprintf(key, sizeof(key), "sizes_test_%d", ii);
+            cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key),
+                                   nbytes[jj], 0, 0,
+                                   PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+            cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,
+                                0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, test_item);
+        }
+        sizes_stats(h, h1);
+        cb_assert(sizes_total == 10 && sizes_buckets == 1);
+    }
+
+    for (ii = 0; ii < 4; ++ii) {
+        snprintf(key, sizeof(key), "sizes_test_%d", ii);
+        cas = 0;
+        cb_assert(h1->remove(h, NULL, key, strlen(key), &cas, 0,
+                             &mut_info) == ENGINE_SUCCESS);
+    }
+    sizes_stats(h, h1);
+    cb_assert(sizes_total == 6 && sizes_buckets == 1);
+    return SUCCESS;
+}
+
+static uint64_t ext_items_written;
+static uint64_t ext_reads;
+
+static void ext_stats_handler(const char *key, const uint16_t klen,
+                              const char *val, const uint32_t vlen,
+                              const void *cookie) {
+    char buffer[64];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 17 && memcmp(key, "ext_items_written", klen) == 0) {
+        ext_items_written = strtoull(buffer, NULL, 10);
+    } else if (klen == 9 && memcmp(key, "ext_reads", klen) == 0) {
+        ext_reads = strtoull(buffer, NULL, 10);
+    }
+}
+
+/* Wait for the writer to have moved count values to the extended storage */
+static void ext_wait_written(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                             uint64_t count) {
+    int ii;
+    ext_items_written = 0;
+    for (ii = 0; ii < 5000 && ext_items_written < count; ++ii) {
+        usleep(1000);
+        cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                                ext_stats_handler) == ENGINE_SUCCESS);
+    }
+    cb_assert(ext_items_written == count);
+}
+
+/*
+ * Make sure idle values are moved to the extended storage, and are read
+ * back (with their CAS) when the item is used again
+ */
+static enum test_result ext_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *key = "ext_test";
+    const size_t nbytes = 4096;
+    item *test_item = NULL;
+    item_info info;
+    uint64_t cas = 0;
+    uint64_t stored_cas;
+    size_t ii;
+
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), nbytes,
+                           0, 0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+    for (ii = 0; ii < nbytes; ++ii) {
+        ((char*)info.value[0].iov_base)[ii] = (char)(ii % 251);
+    }
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    stored_cas = cas;
+
+    ext_wait_written(h, h1, 1);
+
+    /* The get waits for the value to be read back */
+    cb_assert(h1->get(h, NULL, &test_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+    cb_assert(info.nbytes == nbytes && info.cas == stored_cas);
+    for (ii = 0; ii < nbytes; ++ii) {
+        cb_assert(((char*)info.value[0].iov_base)[ii] == (char)(ii % 251));
+    }
+    h1->release(h, NULL, test_item);
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            ext_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(ext_reads >= 1);
+
+    /* Once it's written out again, append to it */
+    ext_wait_written(h, h1, 2);
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1,
+                           0, 0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+    memcpy(info.value[0].iov_base, "!", 1);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_APPEND, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    cb_assert(cas != stored_cas);
+
+    cb_assert(h1->get(h, NULL, &test_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+    cb_assert(info.nbytes == nbytes + 1 && info.cas == cas);
+    cb_assert(memcmp((char*)info.value[0].iov_base + nbytes, "!", 1) == 0);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
+}
+
+#define RESTART_TEST_FILE "/tmp/default_engine_restart_test"
+#define RESTART_TEST_CFG "cache_size=8388608;preallocate=true;" \
+    "large_item_size_max=2097152;restart_file=" RESTART_TEST_FILE
+
+static uint64_t restart_items;
+
+static void restart_stats_handler(const char *key, const uint16_t klen,
+                                  const char *val, const uint32_t vlen,
+                                  const void *cookie) {
+    char buffer[64];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 13 && memcmp(key, "restart_items", klen) == 0) {
+        restart_items = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * Make sure the items stored before a clean shutdown are found again (with
+ * their CAS) by the next bucket using the same restart file, and that the
+ * deleted ones are not
+ */
+static enum test_result restart_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    uint64_t cas[100];
+    uint64_t max_cas = 0;
+    uint64_t large_cas = 0;
+    const size_t large = 1536 * 1024;
+    size_t offset = 0;
+    mutation_descr_t mut_info;
+    item *test_item = NULL;
+    item_info info;
+    union {
+        item_info info;
+        char bytes[sizeof(item_info) + 15 * sizeof(struct iovec)];
+    } holder;
+    char key[32];
+    int ii;
+
+    unlink(RESTART_TEST_FILE);
+    h1 = test_harness.create_bucket(true, RESTART_TEST_CFG);
+    h = (ENGINE_HANDLE*)h1;
+    cb_assert(h1 != NULL);
+    for (ii = 0; ii < 100; ++ii) {
+        size_t nkey = (size_t)sprintf(key, "restart_test_%d", ii);
+        cas[ii] = 0;
+        cb_assert(h1->allocate(h, NULL, &test_item, key, nkey, 100,
+                               0, 0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+        memset(info.value[0].iov_base, 'a' + ii % 26, info.value[0].iov_len);
+        cb_assert(h1->store(h, NULL, test_item, &cas[ii], OPERATION_SET,
+                            0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        if (cas[ii] > max_cas) {
+            max_cas = cas[ii];
+        }
+    }
+    cb_assert(h1->remove(h, NULL, "restart_test_0", 14, &cas[0], 0,
+                         &mut_info) == ENGINE_SUCCESS);
+
+    /* A value stored in a chain of chunks */
+    cb_assert(h1->allocate(h, NULL, &test_item, "restart_test_large", 18,
+                           large, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    holder.info.nvalue = 16;
+    cb_assert(h1->get_item_info(h, NULL, test_item, &holder.info));
+    for (ii = 0; ii < holder.info.nvalue; ++ii) {
+        unsigned char *ptr = holder.info.value[ii].iov_base;
+        size_t jj;
+        for (jj = 0; jj < holder.info.value[ii].iov_len; ++jj, ++offset) {
+            ptr[jj] = (unsigned char)(offset % 251);
+        }
+    }
+    cb_assert(h1->store(h, NULL, test_item, &large_cas, OPERATION_SET,
+                        0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    if (large_cas > max_cas) {
+        max_cas = large_cas;
+    }
+    test_harness.destroy_bucket(h, h1, false);
+
+    h1 = test_harness.create_bucket(true, RESTART_TEST_CFG);
+    h = (ENGINE_HANDLE*)h1;
+    cb_assert(h1 != NULL);
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            restart_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(restart_items == 100);
+    cb_assert(h1->get(h, NULL, &test_item, "restart_test_0", 14,
+                      0) == ENGINE_KEY_ENOENT);
+    for (ii = 1; ii < 100; ++ii) {
+        size_t nkey = (size_t)sprintf(key, "restart_test_%d", ii);
+        size_t jj;
+        cb_assert(h1->get(h, NULL, &test_item, key, nkey, 0) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+        cb_assert(info.nbytes == 100 && info.cas == cas[ii]);
+        for (jj = 0; jj < info.nbytes; ++jj) {
+            cb_assert(((char*)info.value[0].iov_base)[jj] == 'a' + ii % 26);
+        }
+        h1->release(h, NULL, test_item);
+    }
+
+    cb_assert(h1->get(h, NULL, &test_item, "restart_test_large", 18,
+                      0) == ENGINE_SUCCESS);
+    cb_assert(large_item_check(h, h1, test_item, large));
+    holder.info.nvalue = 16;
+    cb_assert(h1->get_item_info(h, NULL, test_item, &holder.info));
+    cb_assert(holder.info.cas == large_cas);
+    h1->release(h, NULL, test_item);
+
+    /* The CAS values go on from the ones restored */
+    cb_assert(h1->allocate(h, NULL, &test_item, "restart_test_0", 14, 1,
+                           0, 0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item, &cas[0], OPERATION_SET,
+                        0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    cb_assert(max_cas == 0 || cas[0] > max_cas);
+    test_harness.destroy_bucket(h, h1, false);
+    unlink(RESTART_TEST_FILE);
+    return SUCCESS;
+}
+
+/*
+ * Make sure we can successfully retrieve the item info struct for an item and
+ * that the contents of the item_info are as expected.
+ */
+static enum test_result get_item_info_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    char *key = "get_item_info_test_key";
+    uint64_t cas = 0;
+    const rel_time_t exp = 1;
+    item_info ii;
+    ii.nvalue = 1;
+
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1,0, exp,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+    /* Had this been actual code, there'd be a connection here */
+    cb_assert(h1->get_item_info(h, NULL, test_item, &ii) == true);
+    cb_assert(ii.cas == cas);
+    cb_assert(ii.flags == 0);
+    cb_assert(strcmp(key,ii.key) == 0);
+    cb_assert(ii.nkey == strlen(key));
+    cb_assert(ii.nbytes == 1);
+    cb_assert(ii.exptime == exp);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
+}
+
+static enum test_result item_set_cas_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    char *key = "item_set_cas_test_key";
+    uint64_t cas = 0;
+    const rel_time_t exp = 1;
+    uint64_t newcas;
+    item_info ii;
+
+    ii.nvalue = 1;
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1,0, exp,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+    newcas = cas + 1;
+    h1->item_set_cas(h, NULL, test_item, newcas);
+    cb_assert(h1->get_item_info(h, NULL, test_item, &ii) == true);
+    cb_assert(ii.cas == newcas);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
+}
+
+uint32_t evictions;
+static void eviction_stats_handler(const char *key, const uint16_t klen,
+                                   const char *val, const uint32_t vlen,
+                                   const void *cookie) {
+    if (memcmp(key, "evictions", klen) == 0) {
+        char buffer[1024];
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        evictions = atoi(buffer);
+    }
+}
+
+static enum test_result lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    const char *hot_key = "hot_key";
+    uint64_t cas = 0;
+    int ii;
+    int jj;
+
+    cb_assert(h1->allocate(h, NULL, &test_item,
+                        hot_key, strlen(hot_key), 4096, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item,
+                     &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
 
     for (ii = 0; ii < 250; ++ii) {
         char key[1024];
@@ -535,62 +1551,292 @@ static enum test_result lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
-static enum test_result get_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    return PENDING;
-}
+/*
+ * Fill a slab class and read back every item in it, so the whole LRU is
+ * made of active items: a store must still get to evict one of them.
+ */
+static enum test_result evict_active_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[64];
+    size_t keylen;
+    int ii;
+    int nitems;
 
-static enum test_result reset_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    return PENDING;
+    evictions = 0;
+    for (ii = 0; ii < 1000 && evictions == 0; ++ii) {
+        keylen = snprintf(key, sizeof(key), "evict_active_%08d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 4096, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item, &cas,
+                            OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                                eviction_stats_handler) == ENGINE_SUCCESS);
+    }
+    cb_assert(evictions == 1);
+    nitems = ii;
+
+    /* Far enough from the stores for the reads to flag the items */
+    test_harness.time_travel(61);
+    for (ii = 1; ii < nitems; ++ii) {
+        keylen = snprintf(key, sizeof(key), "evict_active_%08d", ii);
+        cb_assert(h1->get(h, NULL, &test_item, key, (int)keylen,
+                          0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    for (ii = nitems; ii < nitems + 10; ++ii) {
+        keylen = snprintf(key, sizeof(key), "evict_active_%08d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 4096, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item, &cas,
+                            OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            eviction_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(evictions == 11);
+    return SUCCESS;
 }
 
-static enum test_result get_stats_struct_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    return PENDING;
+static unsigned int sample_evicted;
+static unsigned int sample_evicted_unfetched;
+static unsigned int sample_accessed;
+static unsigned int sample_ttl_64;
+
+static void ages_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    char name[64];
+    const char *stat;
+    unsigned int count;
+
+    cb_assert(klen < sizeof(name));
+    memcpy(name, key, klen);
+    name[klen] = '\0';
+    if ((stat = strchr(name, ':')) == NULL) {
+        return;
+    }
+    count = (unsigned int)strtoul(val, NULL, 10);
+    if (strcmp(stat, ":evicted") == 0) {
+        sample_evicted += count;
+    } else if (strcmp(stat, ":evicted_unfetched") == 0) {
+        sample_evicted_unfetched += count;
+    } else if (strcmp(stat, ":accessed") == 0) {
+        sample_accessed += count;
+    } else if (strcmp(stat, ":access_ttl:64") == 0) {
+        sample_ttl_64 += count;
+    }
 }
 
-static enum test_result aggregate_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    return PENDING;
+/*
+ * With every key sampled the histograms should see the evictions of the
+ * LRU test (of items never read), and the TTL left on the items read.
+ */
+static enum test_result item_sample_test(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1) {
+    const char *key = "sample_ttl_key";
+    item *test_item = NULL;
+    uint64_t cas = 0;
+
+    cb_assert(lru_test(h, h1) == SUCCESS);
+    sample_evicted = sample_evicted_unfetched = sample_accessed = 0;
+    cb_assert(h1->get_stats(h, NULL, "ages", 4,
+                            ages_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(sample_evicted == 2);
+    cb_assert(sample_evicted_unfetched == 2);
+    cb_assert(sample_accessed > 2);
+
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1, 0, 100,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) ==
+              ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    cb_assert(h1->get(h, NULL, &test_item, key, (int)strlen(key), 0) ==
+              ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    sample_ttl_64 = 0;
+    cb_assert(h1->get_stats(h, NULL, "ages", 4,
+                            ages_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(sample_ttl_64 == 1);
+    return SUCCESS;
 }
 
-static protocol_binary_response_header *last_response;
+static uint64_t partition_count;
+static uint64_t partition_items;
+static uint64_t partition_maxbytes;
+static bool partition_slabs;
 
-static void release_last_response(void) {
-    free(last_response);
-    last_response = NULL;
+static void partition_stats_handler(const char *key, const uint16_t klen,
+                                    const char *val, const uint32_t vlen,
+                                    const void *cookie) {
+    if (klen == 10 && memcmp(key, "partitions", klen) == 0) {
+        partition_count = strtoull(val, NULL, 10);
+    } else if (klen == 10 && memcmp(key, "curr_items", klen) == 0) {
+        partition_items = strtoull(val, NULL, 10);
+    } else if (klen == 15 && memcmp(key, "engine_maxbytes", klen) == 0) {
+        partition_maxbytes = strtoull(val, NULL, 10);
+    } else if (klen > 12 && memcmp(key, "partition_3:", 12) == 0) {
+        partition_slabs = true;
+    }
 }
 
-static bool response_handler(const void *key, uint16_t keylen,
-                             const void *ext, uint8_t extlen,
-                             const void *body, uint32_t bodylen,
-                             uint8_t datatype, uint16_t status,
-                             uint64_t cas, const void *cookie)
-{
-    protocol_binary_response_header *r;
-    char *ptr;
+/*
+ * The keys are spread over the partitions, which the stats are summed up
+ * over, and the batched calls are split up between them.
+ */
+static enum test_result partitions_test(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    char key[32];
+    uint64_t cas = 0;
+    int ii;
 
-    cb_assert(last_response == NULL);
-    last_response = malloc(sizeof(*last_response) + keylen + extlen + bodylen);
-    if (last_response == NULL) {
-        return false;
+    for (ii = 0; ii < 200; ++ii) {
+        item *it = NULL;
+        int nkey = snprintf(key, sizeof(key), "partition_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, nkey, 1, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) ==
+                  ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
     }
 
-    r = last_response;
-    r->response.magic = PROTOCOL_BINARY_RES;
-    r->response.opcode = 0xff; /* we don't know this! */
-    r->response.keylen = htons(keylen);
-    r->response.extlen = extlen;
-    r->response.datatype = PROTOCOL_BINARY_RAW_BYTES;
-    r->response.status = htons(status);
-    r->response.bodylen = htonl(keylen + extlen + bodylen);
-    r->response.opaque = 0xffffff; /* we don't know this */
-    r->response.cas = cas;
-    ptr = (void*)(r + 1);
-    memcpy(ptr, ext, extlen);
-    ptr += extlen;
-    memcpy(ptr, key, keylen);
-    ptr += keylen;
-    memcpy(ptr, body, bodylen);
+    partition_count = partition_items = partition_maxbytes = 0;
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            partition_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(partition_count == 4);
+    cb_assert(partition_items == 200);
+    cb_assert(partition_maxbytes == 64 * 1024 * 1024);
+    partition_slabs = false;
+    cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                            partition_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(partition_slabs);
 
-    return true;
+    cb_assert(get_multi_test(h, h1) == SUCCESS);
+    cb_assert(store_multi_test(h, h1) == SUCCESS);
+    cb_assert(release_multi_test(h, h1) == SUCCESS);
+
+    cb_assert(h1->flush(h, NULL, 0) == ENGINE_SUCCESS);
+    for (ii = 0; ii < 200; ++ii) {
+        item *it = NULL;
+        int nkey = snprintf(key, sizeof(key), "partition_%d", ii);
+        cb_assert(h1->get(h, NULL, &it, key, nkey, 0) == ENGINE_KEY_ENOENT);
+    }
+    return SUCCESS;
+}
+
+static unsigned int reserved_items;
+
+static void reserve_stats_handler(const char *key, const uint16_t klen,
+                                  const char *val, const uint32_t vlen,
+                                  const void *cookie) {
+    char buffer[32];
+    if (klen > 9 && memcmp(key + klen - 9, ":reserved", 9) == 0 &&
+        vlen < sizeof(buffer)) {
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        reserved_items += (unsigned int)strtoul(buffer, NULL, 10);
+    }
+}
+
+/*
+ * Fill the cache, and make sure the LRU maintainer evicts ahead of the
+ * allocations to keep free chunks in the slab class
+ */
+static enum test_result evict_reserve_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[64];
+    size_t keylen;
+    int ii;
+
+    for (ii = 0; ii < 300; ++ii) {
+        keylen = snprintf(key, sizeof(key), "evict_reserve_%08d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 4096, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item, &cas,
+                            OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    for (ii = 0; ii < 5000; ++ii) {
+        reserved_items = 0;
+        cb_assert(h1->get_stats(h, NULL, "items", 5,
+                                reserve_stats_handler) == ENGINE_SUCCESS);
+        if (reserved_items >= 8) {
+            break;
+        }
+        usleep(1000);
+    }
+    cb_assert(reserved_items >= 8);
+
+    /* The oldest items went first, the last one stored is still there */
+    cb_assert(h1->get(h, NULL, &test_item, "evict_reserve_00000000", 22,
+                      0) == ENGINE_KEY_ENOENT);
+    keylen = snprintf(key, sizeof(key), "evict_reserve_%08d", 299);
+    cb_assert(h1->get(h, NULL, &test_item, key, (int)keylen,
+                      0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
+}
+
+static enum test_result get_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return PENDING;
+}
+
+static enum test_result reset_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return PENDING;
+}
+
+static enum test_result get_stats_struct_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return PENDING;
+}
+
+static enum test_result aggregate_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return PENDING;
+}
+
+static protocol_binary_response_header *last_response;
+
+static void release_last_response(void) {
+    free(last_response);
+    last_response = NULL;
+}
+
+static bool response_handler(const void *key, uint16_t keylen,
+                             const void *ext, uint8_t extlen,
+                             const void *body, uint32_t bodylen,
+                             uint8_t datatype, uint16_t status,
+                             uint64_t cas, const void *cookie)
+{
+    protocol_binary_response_header *r;
+    char *ptr;
+
+    cb_assert(last_response == NULL);
+    last_response = malloc(sizeof(*last_response) + keylen + extlen + bodylen);
+    if (last_response == NULL) {
+        return false;
+    }
+
+    r = last_response;
+    r->response.magic = PROTOCOL_BINARY_RES;
+    r->response.opcode = 0xff; /* we don't know this! */
+    r->response.keylen = htons(keylen);
+    r->response.extlen = extlen;
+    r->response.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    r->response.status = htons(status);
+    r->response.bodylen = htonl(keylen + extlen + bodylen);
+    r->response.opaque = 0xffffff; /* we don't know this */
+    r->response.cas = cas;
+    ptr = (void*)(r + 1);
+    memcpy(ptr, ext, extlen);
+    ptr += extlen;
+    memcpy(ptr, key, keylen);
+    ptr += keylen;
+    memcpy(ptr, body, bodylen);
+
+    return true;
 }
 
 static enum test_result touch_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
@@ -833,6 +2079,2079 @@ static enum test_result test_datatype(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+#define reassign_value_size 2000
+
+static unsigned int slab_pages[64];
+static unsigned int reassign_clsid;
+static uint64_t slabs_moved;
+static uint64_t slab_compact_pages;
+
+static void slab_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    char buffer[1024];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+
+    if (klen == 11 && memcmp(key, "slabs_moved", klen) == 0) {
+        slabs_moved = strtoull(buffer, NULL, 10);
+    } else if (klen == 18 && memcmp(key, "slab_compact_pages", klen) == 0) {
+        slab_compact_pages = strtoull(buffer, NULL, 10);
+    } else if (klen > 12 && memcmp(key + klen - 12, ":total_pages", 12) == 0) {
+        unsigned int id = atoi(key);
+        if (id < 64) {
+            slab_pages[id] = atoi(buffer);
+        }
+    } else if (klen > 11 && memcmp(key + klen - 11, ":chunk_size", 11) == 0) {
+        if (reassign_clsid == 0 && atoi(buffer) > reassign_value_size) {
+            reassign_clsid = atoi(key);
+        }
+    }
+}
+
+static uint16_t slab_reassign(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                              uint32_t src, uint32_t dst) {
+    protocol_binary_request_slab_reassign r;
+    uint16_t status;
+
+    memset(&r, 0, sizeof(r));
+    r.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.message.header.request.opcode = PROTOCOL_BINARY_CMD_SLAB_REASSIGN;
+    r.message.header.request.extlen = 8;
+    r.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    r.message.header.request.bodylen = htonl(8);
+    r.message.body.src = htonl(src);
+    r.message.body.dst = htonl(dst);
+
+    cb_assert(h1->unknown_command(h, NULL, &r.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    status = ntohs(last_response->response.status);
+    release_last_response();
+    return status;
+}
+
+/*
+ * Fill a few slab pages of one class, and move one of them to the
+ * smallest slab class.
+ */
+static enum test_result slab_reassign_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    unsigned int src_pages, dst_pages;
+    uint64_t cas = 0;
+    int ii;
+    int found = 0;
+
+    for (ii = 0; ii < 1200; ++ii) {
+        char key[64];
+        item *test_item = NULL;
+        size_t keylen = snprintf(key, sizeof(key), "slab_reassign_%08d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen,
+                               reassign_value_size, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item, &cas,
+                            OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    memset(slab_pages, 0, sizeof(slab_pages));
+    cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                            slab_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(reassign_clsid > 1 && reassign_clsid < 64);
+    src_pages = slab_pages[reassign_clsid];
+    dst_pages = slab_pages[1];
+    cb_assert(src_pages > 1);
+
+    cb_assert(slab_reassign(h, h1, reassign_clsid, reassign_clsid) ==
+              PROTOCOL_BINARY_RESPONSE_EINVAL);
+    cb_assert(slab_reassign(h, h1, reassign_clsid, 1) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    for (ii = 0; ii < 5000 && slabs_moved == 0; ++ii) {
+        usleep(1000);
+        cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                                slab_stats_handler) == ENGINE_SUCCESS);
+    }
+    cb_assert(slabs_moved == 1);
+    cb_assert(slab_pages[reassign_clsid] == src_pages - 1);
+    cb_assert(slab_pages[1] == dst_pages + 1);
+
+    /* The items in the moved page are gone, the rest is still there */
+    for (ii = 0; ii < 1200; ++ii) {
+        char key[64];
+        item *test_item = NULL;
+        size_t keylen = snprintf(key, sizeof(key), "slab_reassign_%08d", ii);
+        if (h1->get(h, NULL, &test_item, key, (int)keylen, 0) == ENGINE_SUCCESS) {
+            h1->release(h, NULL, test_item);
+            ++found;
+        }
+    }
+    cb_assert(found > 0 && found < 1200);
+
+    return SUCCESS;
+}
+
+/*
+ * Fill a few slab pages of one class and delete two items out of three:
+ * the compactor moves the rest out of a page, and gives the page up
+ * without losing any of them.
+ */
+static enum test_result slab_compact_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    mutation_descr_t mut_info;
+    item_info info;
+    unsigned int pages;
+    uint64_t cas = 0;
+    int ii;
+
+    info.nvalue = 1;
+
+    for (ii = 0; ii < 1200; ++ii) {
+        char key[64];
+        item *test_item = NULL;
+        size_t keylen = snprintf(key, sizeof(key), "slab_compact_%08d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen,
+                               reassign_value_size, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+        memset(info.value[0].iov_base, 'a' + ii % 26, reassign_value_size);
+        cb_assert(h1->store(h, NULL, test_item, &cas,
+                            OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    for (ii = 0; ii < 1200; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "slab_compact_%08d", ii);
+        if (ii % 3 != 0) {
+            cas = 0;
+            cb_assert(h1->remove(h, NULL, key, keylen, &cas, 0,
+                                 &mut_info) == ENGINE_SUCCESS);
+        }
+    }
+
+    memset(slab_pages, 0, sizeof(slab_pages));
+    slab_compact_pages = 0;
+    cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                            slab_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(reassign_clsid > 1 && reassign_clsid < 64);
+    pages = slab_pages[reassign_clsid];
+    cb_assert(pages > 2);
+
+    for (ii = 0; ii < 5000 && slab_compact_pages == 0; ++ii) {
+        usleep(1000);
+        cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                                slab_stats_handler) == ENGINE_SUCCESS);
+    }
+    cb_assert(slab_compact_pages > 0);
+    cb_assert(slab_pages[reassign_clsid] < pages);
+
+    for (ii = 0; ii < 1200; ii += 3) {
+        char key[64];
+        item *test_item = NULL;
+        size_t keylen = snprintf(key, sizeof(key), "slab_compact_%08d", ii);
+        cb_assert(h1->get(h, NULL, &test_item, key, (int)keylen, 0) == ENGINE_SUCCESS);
+        cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+        cb_assert(info.nbytes == reassign_value_size);
+        cb_assert(((char*)info.value[0].iov_base)[0] == 'a' + ii % 26);
+        cb_assert(((char*)info.value[0].iov_base)[reassign_value_size - 1] ==
+                  'a' + ii % 26);
+        h1->release(h, NULL, test_item);
+    }
+
+    return SUCCESS;
+}
+
+static uint64_t pool_pages, pool_given, pool_steals;
+
+static void pool_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    char buffer[1024];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+
+    if (klen == 17 && memcmp(key, "shared_pool_pages", klen) == 0) {
+        pool_pages = strtoull(buffer, NULL, 10);
+    } else if (klen == 23 && memcmp(key, "shared_pool_pages_given", klen) == 0) {
+        pool_given = strtoull(buffer, NULL, 10);
+    } else if (klen == 18 && memcmp(key, "shared_pool_steals", klen) == 0) {
+        pool_steals = strtoull(buffer, NULL, 10);
+    }
+}
+
+static void pool_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    pool_pages = pool_given = pool_steals = 0;
+    cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                            pool_stats_handler) == ENGINE_SUCCESS);
+}
+
+/* Store the items first to last, waiting for memory if there is none */
+static void pool_fill(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                      const char *prefix, int first, int last) {
+    uint64_t cas = 0;
+    int ii, tries;
+
+    for (ii = first; ii < last; ++ii) {
+        char key[64];
+        item *test_item = NULL;
+        size_t keylen = snprintf(key, sizeof(key), "%s_%08d", prefix, ii);
+        ENGINE_ERROR_CODE ret = ENGINE_ENOMEM;
+        for (tries = 0; tries < 5000 && ret == ENGINE_ENOMEM; ++tries) {
+            ret = h1->allocate(h, NULL, &test_item, key, keylen,
+                               reassign_value_size, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES);
+            if (ret == ENGINE_ENOMEM) {
+                usleep(1000);
+            }
+        }
+        cb_assert(ret == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item, &cas,
+                            OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+}
+
+#define SHARED_POOL_CFG "shared_pool_size=4194304;cache_size=2097152"
+
+/*
+ * The bucket of the test (1MB soft and 3MB hard quota) fills up the
+ * shared pool of 4MB up to its hard quota, and a second bucket (2MB soft
+ * quota) gets the page left and then takes one of the first bucket's.
+ */
+static enum test_result shared_pool_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    ENGINE_HANDLE_V1 *h2;
+    int ii;
+
+    pool_fill(h, h1, "shared_pool_a", 0, 3000);
+    pool_stats(h, h1);
+    cb_assert(pool_pages == 3);
+
+    h2 = test_harness.create_bucket(true, SHARED_POOL_CFG);
+    cb_assert(h2 != NULL);
+    for (ii = 0; ii < 5000; ++ii) {
+        pool_fill((ENGINE_HANDLE*)h2, h2, "shared_pool_b", ii * 100,
+                  ii * 100 + 100);
+        pool_stats((ENGINE_HANDLE*)h2, h2);
+        if (pool_pages == 2) {
+            break;
+        }
+        usleep(1000);
+    }
+    cb_assert(pool_pages == 2);
+    cb_assert(pool_steals > 0);
+
+    pool_stats(h, h1);
+    cb_assert(pool_pages == 2);
+    cb_assert(pool_given == 1);
+
+    /* Its pages go back to the pool with it */
+    test_harness.destroy_bucket((ENGINE_HANDLE*)h2, h2, false);
+    pool_fill(h, h1, "shared_pool_a", 0, 3000);
+    pool_stats(h, h1);
+    cb_assert(pool_pages == 3);
+
+    return SUCCESS;
+}
+
+/* Send a snapshot request, the response is left in last_response */
+static void snapshot_request(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                             uint8_t opcode, uint32_t first, uint32_t last,
+                             const char *data, size_t ndata) {
+    protocol_binary_request_snapshot_dump *req;
+    char *buffer = malloc(sizeof(req->bytes) + ndata);
+    size_t extlen = opcode == PROTOCOL_BINARY_CMD_SNAPSHOT_DUMP ? 8 : 0;
+
+    cb_assert(buffer != NULL);
+    req = (void*)buffer;
+    memset(req, 0, sizeof(req->bytes));
+    req->message.header.request.magic = PROTOCOL_BINARY_REQ;
+    req->message.header.request.opcode = opcode;
+    req->message.header.request.extlen = (uint8_t)extlen;
+    req->message.header.request.bodylen = htonl((uint32_t)(extlen + ndata));
+    req->message.body.first = htonl(first);
+    req->message.body.last = htonl(last);
+    memcpy(buffer + sizeof(req->message.header) + extlen, data, ndata);
+    cb_assert(h1->unknown_command(h, NULL, &req->message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    free(buffer);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(last_response->response.extlen == 8);
+}
+
+/*
+ * Dump all of the items in a snapshot, and check that loading it brings
+ * back the ones flushed in between (and skips the ones still there).
+ */
+static enum test_result snapshot_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    protocol_binary_response_snapshot_dump *dump;
+    protocol_binary_response_snapshot_load *load;
+    char *data = NULL;
+    size_t ndata = 0;
+    uint32_t next = 0, nslices;
+    item *test_item = NULL;
+    item_info info;
+    uint64_t cas;
+    char key[32];
+    int ii;
+
+    for (ii = 0; ii < 200; ++ii) {
+        size_t nkey = (size_t)sprintf(key, "snapshot_test_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, nkey, 64,
+                               ii, 0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+        memset(info.value[0].iov_base, 'a' + ii % 26, info.value[0].iov_len);
+        cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,
+                            0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    /* An empty range tells the number of slices */
+    snapshot_request(h, h1, PROTOCOL_BINARY_CMD_SNAPSHOT_DUMP, 0, 0, NULL, 0);
+    dump = (void*)last_response;
+    nslices = ntohl(dump->message.body.nslices);
+    cb_assert(nslices > 0 && ntohl(dump->message.body.next) == 0);
+    cb_assert(ntohl(last_response->response.bodylen) == 8);
+    release_last_response();
+
+    while (next < nslices) {
+        uint32_t nbody;
+        snapshot_request(h, h1, PROTOCOL_BINARY_CMD_SNAPSHOT_DUMP, next,
+                         nslices, NULL, 0);
+        dump = (void*)last_response;
+        cb_assert(ntohl(dump->message.body.next) > next);
+        next = ntohl(dump->message.body.next);
+        nbody = ntohl(last_response->response.bodylen) - 8;
+        data = realloc(data, ndata + nbody);
+        cb_assert(data != NULL);
+        memcpy(data + ndata, dump + 1, nbody);
+        ndata += nbody;
+        release_last_response();
+    }
+    cb_assert(ndata == 200 * (sizeof(protocol_binary_snapshot_item) + 64) +
+              10 * 15 + 90 * 16 + 100 * 17);
+
+    cb_assert(h1->flush(h, NULL, 0) == ENGINE_SUCCESS);
+    snapshot_request(h, h1, PROTOCOL_BINARY_CMD_SNAPSHOT_LOAD, 0, 0,
+                     data, ndata);
+    load = (void*)last_response;
+    cb_assert(ntohl(load->message.body.stored) == 200);
+    cb_assert(ntohl(load->message.body.skipped) == 0);
+    release_last_response();
+
+    for (ii = 0; ii < 200; ++ii) {
+        size_t nkey = (size_t)sprintf(key, "snapshot_test_%d", ii);
+        size_t jj;
+        cb_assert(h1->get(h, NULL, &test_item, key, nkey, 0) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+        cb_assert(info.nbytes == 64 && info.flags == (uint32_t)ii);
+        for (jj = 0; jj < info.nbytes; ++jj) {
+            cb_assert(((char*)info.value[0].iov_base)[jj] == 'a' + ii % 26);
+        }
+        h1->release(h, NULL, test_item);
+    }
+
+    /* The keys already there are kept */
+    snapshot_request(h, h1, PROTOCOL_BINARY_CMD_SNAPSHOT_LOAD, 0, 0,
+                     data, ndata);
+    load = (void*)last_response;
+    cb_assert(ntohl(load->message.body.stored) == 0);
+    cb_assert(ntohl(load->message.body.skipped) == 200);
+    release_last_response();
+    free(data);
+    return SUCCESS;
+}
+
+static void set_vbucket_state(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                              uint16_t vbucket, vbucket_state_t state) {
+    protocol_binary_request_set_vbucket r;
+
+    memset(&r, 0, sizeof(r));
+    r.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.message.header.request.opcode = PROTOCOL_BINARY_CMD_SET_VBUCKET;
+    r.message.header.request.vbucket = htons(vbucket);
+    r.message.header.request.bodylen = htonl(sizeof(state));
+    r.message.body.state = (vbucket_state_t)htonl(state);
+
+    cb_assert(h1->unknown_command(h, NULL, &r.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    release_last_response();
+}
+
+static uint16_t get_replica(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                            const char *key, uint16_t vbucket) {
+    union {
+        protocol_binary_request_no_extras req;
+        char buffer[512];
+    } r;
+    size_t keylen = strlen(key);
+    uint16_t status;
+
+    memset(r.buffer, 0, sizeof(r));
+    r.req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.req.message.header.request.opcode = PROTOCOL_BINARY_CMD_GET_REPLICA;
+    r.req.message.header.request.keylen = htons((uint16_t)keylen);
+    r.req.message.header.request.vbucket = htons(vbucket);
+    r.req.message.header.request.bodylen = htonl((uint32_t)keylen);
+    memcpy(r.buffer + sizeof(r.req.bytes), key, keylen);
+
+    cb_assert(h1->unknown_command(h, NULL, &r.req.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    status = ntohs(last_response->response.status);
+    if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        cb_assert(last_response->response.extlen == 4);
+        cb_assert(ntohl(last_response->response.bodylen) == 4 + 1);
+    }
+    release_last_response();
+    return status;
+}
+
+/*
+ * GET_REPLICA only reads from the vbuckets this node is a replica of,
+ * the ones plain gets are refused for.
+ */
+static enum test_result get_replica_test(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1) {
+    const char *key = "replica_test_key";
+    item *test_item = NULL;
+    uint64_t cas = 0;
+
+    set_vbucket_state(h, h1, 1, vbucket_state_active);
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 1) ==
+              ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    cb_assert(get_replica(h, h1, key, 1) ==
+              PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET);
+
+    set_vbucket_state(h, h1, 1, vbucket_state_replica);
+    cb_assert(h1->get(h, NULL, &test_item, key, (int)strlen(key), 1) ==
+              ENGINE_NOT_MY_VBUCKET);
+    cb_assert(get_replica(h, h1, key, 1) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(get_replica(h, h1, "replica_test_missing", 1) ==
+              PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    return SUCCESS;
+}
+
+static bool lease_stale;
+
+static uint16_t get_lease(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                          const char *key, uint64_t *token) {
+    union {
+        protocol_binary_request_get_lease lease;
+        char buffer[512];
+    } r;
+    size_t keylen = strlen(key);
+    uint16_t status;
+
+    memset(r.buffer, 0, sizeof(r));
+    r.lease.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.lease.message.header.request.opcode = PROTOCOL_BINARY_CMD_GET_LEASE;
+    r.lease.message.header.request.keylen = htons((uint16_t)keylen);
+    r.lease.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    r.lease.message.header.request.bodylen = htonl((uint32_t)keylen);
+    memcpy(r.buffer + sizeof(r.lease.bytes), key, keylen);
+
+    cb_assert(h1->unknown_command(h, NULL, &r.lease.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    status = ntohs(last_response->response.status);
+    *token = last_response->response.cas;
+    lease_stale = false;
+    if (last_response->response.extlen == 8) {
+        protocol_binary_response_get_lease *rsp = (void*)last_response;
+        lease_stale = (ntohl(rsp->message.body.lease_flags) &
+                       PROTOCOL_BINARY_GET_LEASE_STALE) != 0;
+    }
+    release_last_response();
+    return status;
+}
+
+/*
+ * Only the first client missing a key gets a lease on it, the others are
+ * told to retry until the key is stored with the lease (or it expires).
+ */
+static enum test_result lease_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *key = "lease_test_key";
+    item *test_item = NULL;
+    mutation_descr_t mut_info;
+    uint64_t token, other, cas;
+
+    cb_assert(get_lease(h, h1, key, &token) ==
+              PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    cb_assert(token != 0);
+    cb_assert(get_lease(h, h1, key, &other) ==
+              PROTOCOL_BINARY_RESPONSE_ETMPFAIL);
+
+    /* A stale lease doesn't store the key */
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    h1->item_set_cas(h, NULL, test_item, token + 1000);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_CAS, 0) ==
+              ENGINE_KEY_ENOENT);
+    h1->item_set_cas(h, NULL, test_item, token);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_CAS, 0) ==
+              ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    /* Everyone gets the value now */
+    cb_assert(get_lease(h, h1, key, &other) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(other == cas);
+
+    /* A lease which isn't used times out */
+    cas = 0;
+    cb_assert(h1->remove(h, NULL, key, strlen(key), &cas, 0,
+                         &mut_info) == ENGINE_SUCCESS);
+    cb_assert(get_lease(h, h1, key, &token) ==
+              PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    cb_assert(token != 0);
+    test_harness.time_travel(11);
+    cb_assert(get_lease(h, h1, key, &other) ==
+              PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    cb_assert(other != 0 && other != token);
+    return SUCCESS;
+}
+
+/*
+ * An expired item is still handed out (flagged as stale) during the grace
+ * period, and the first client to see it gets the lease to refresh it.
+ */
+static enum test_result stale_lease_test(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1) {
+    const char *key = "stale_test_key";
+    item *test_item = NULL;
+    uint64_t token, other, cas = 0;
+
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1, 0, 5,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) ==
+              ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    cb_assert(get_lease(h, h1, key, &other) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(!lease_stale && other == cas);
+
+    test_harness.time_travel(6);
+    cb_assert(h1->get(h, NULL, &test_item, key, (int)strlen(key), 0) ==
+              ENGINE_KEY_ENOENT);
+    cb_assert(get_lease(h, h1, key, &token) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(lease_stale && token != 0);
+    cb_assert(get_lease(h, h1, key, &other) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(lease_stale && other == 0);
+
+    /* Storing it with the lease replaces the stale copy */
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    h1->item_set_cas(h, NULL, test_item, token);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_CAS, 0) ==
+              ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    cb_assert(get_lease(h, h1, key, &other) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(!lease_stale && other == cas);
+
+    /* Past the grace period it's gone */
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1, 0, 5,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) ==
+              ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    test_harness.time_travel(40);
+    cb_assert(get_lease(h, h1, key, &token) ==
+              PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    cb_assert(!lease_stale && token != 0);
+    return SUCCESS;
+}
+
+static uint16_t delete_namespace(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                 const char *ns, uint32_t flags,
+                                 uint64_t *nitems) {
+    union {
+        protocol_binary_request_namespace_delete req;
+        char buffer[512];
+    } r;
+    size_t keylen = strlen(ns);
+    uint16_t status;
+
+    memset(r.buffer, 0, sizeof(r));
+    r.req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.req.message.header.request.opcode = PROTOCOL_BINARY_CMD_NAMESPACE_DELETE;
+    r.req.message.header.request.extlen = 4;
+    r.req.message.header.request.keylen = htons((uint16_t)keylen);
+    r.req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    r.req.message.header.request.bodylen = htonl((uint32_t)keylen + 4);
+    r.req.message.body.flags = htonl(flags);
+    memcpy(r.buffer + sizeof(r.req.bytes), ns, keylen);
+
+    cb_assert(h1->unknown_command(h, NULL, &r.req.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    status = ntohs(last_response->response.status);
+    if (last_response->response.extlen == 8) {
+        uint64_t items;
+        memcpy(&items, last_response + 1, sizeof(items));
+        *nitems = ntohll(items);
+    }
+    release_last_response();
+    return status;
+}
+
+static void store_key(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                      const char *key) {
+    item *it = NULL;
+    uint64_t cas;
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 1, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+}
+
+static ENGINE_ERROR_CODE get_key(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                 const char *key) {
+    item *it = NULL;
+    ENGINE_ERROR_CODE ret = h1->get(h, NULL, &it, key, (int)strlen(key), 0);
+    if (ret == ENGINE_SUCCESS) {
+        h1->release(h, NULL, it);
+    }
+    return ret;
+}
+
+/*
+ * What the DCP streams of a test sent, through the message producers
+ * below. The mutations hold a reference on their item, like in the core.
+ */
+static ENGINE_HANDLE *dcp_h;
+static ENGINE_HANDLE_V1 *dcp_h1;
+static int dcp_markers;
+static uint64_t dcp_marker_start;
+static uint64_t dcp_marker_end;
+static uint32_t dcp_marker_flags;
+static int dcp_mutations;
+static int dcp_deletions;
+static int dcp_stream_ends;
+static char dcp_keys[64][32];
+static uint64_t dcp_seqnos[64];
+/* The snapshot (the number of markers so far) each message was sent in */
+static int dcp_snapshots[64];
+/* Called with the number of mutations sent so far, to change the cache */
+static void (*dcp_on_mutation)(int mutations);
+
+static void dcp_reset(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    dcp_h = h;
+    dcp_h1 = h1;
+    dcp_markers = dcp_mutations = dcp_deletions = dcp_stream_ends = 0;
+    dcp_on_mutation = NULL;
+}
+
+static void dcp_record(const void *key, size_t nkey, uint64_t seqno) {
+    int ii = dcp_mutations + dcp_deletions;
+    cb_assert(ii < 64 && nkey < 32);
+    memcpy(dcp_keys[ii], key, nkey);
+    dcp_keys[ii][nkey] = '\0';
+    dcp_seqnos[ii] = seqno;
+    dcp_snapshots[ii] = dcp_markers;
+}
+
+/*
+ * The number of messages for the key in the snapshot (any with 0), and
+ * the seqno of the last one
+ */
+static int dcp_sent_in(const char *key, int snapshot, uint64_t *seqno) {
+    int ii, count = 0;
+    for (ii = 0; ii < dcp_mutations + dcp_deletions; ++ii) {
+        if (strcmp(dcp_keys[ii], key) == 0 &&
+            (snapshot == 0 || dcp_snapshots[ii] == snapshot)) {
+            ++count;
+            if (seqno != NULL) {
+                *seqno = dcp_seqnos[ii];
+            }
+        }
+    }
+    return count;
+}
+
+static int dcp_sent(const char *key, uint64_t *seqno) {
+    return dcp_sent_in(key, 0, seqno);
+}
+
+static ENGINE_ERROR_CODE dcp_marker(const void *cookie, uint32_t opaque,
+                                    uint16_t vbucket, uint64_t start_seqno,
+                                    uint64_t end_seqno, uint32_t flags) {
+    ++dcp_markers;
+    dcp_marker_start = start_seqno;
+    dcp_marker_end = end_seqno;
+    dcp_marker_flags = flags;
+    return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE dcp_mutation(const void* cookie, uint32_t opaque,
+                                      item *itm, uint16_t vbucket,
+                                      uint64_t by_seqno, uint64_t rev_seqno,
+                                      uint32_t lock_time, const void *meta,
+                                      uint16_t nmeta, uint8_t nru) {
+    item_info info;
+    info.nvalue = 1;
+    cb_assert(dcp_h1->get_item_info(dcp_h, NULL, itm, &info));
+    dcp_record(info.key, info.nkey, by_seqno);
+    ++dcp_mutations;
+    dcp_h1->release(dcp_h, NULL, itm);
+    if (dcp_on_mutation != NULL) {
+        dcp_on_mutation(dcp_mutations);
+    }
+    return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE dcp_deletion(const void* cookie, uint32_t opaque,
+                                      const void *key, uint16_t nkey,
+                                      uint64_t cas, uint16_t vbucket,
+                                      uint64_t by_seqno, uint64_t rev_seqno,
+                                      const void *meta, uint16_t nmeta) {
+    dcp_record(key, nkey, by_seqno);
+    ++dcp_deletions;
+    return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE dcp_stream_end(const void *cookie, uint32_t opaque,
+                                        uint16_t vbucket, uint32_t flags) {
+    ++dcp_stream_ends;
+    return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE dcp_failover_log(vbucket_failover_t *entries,
+                                          size_t nentries,
+                                          const void *cookie) {
+    cb_assert(nentries == 1);
+    return ENGINE_SUCCESS;
+}
+
+static struct dcp_message_producers dcp_producers = {
+    .marker = dcp_marker,
+    .mutation = dcp_mutation,
+    .deletion = dcp_deletion,
+    .stream_end = dcp_stream_end
+};
+
+static ENGINE_ERROR_CODE dcp_stream(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                    const void *cookie, uint64_t start_seqno,
+                                    uint64_t end_seqno) {
+    uint64_t rollback_seqno = 1;
+    ENGINE_ERROR_CODE ret;
+    ret = h1->dcp.stream_req(h, cookie, 0, 0xdeadbeef, 0, start_seqno,
+                             end_seqno, 0, 0, 0, &rollback_seqno,
+                             dcp_failover_log);
+    if (ret == ENGINE_ROLLBACK) {
+        cb_assert(rollback_seqno == 0);
+    }
+    return ret;
+}
+
+/*
+ * Step the connection until the stream sent n messages (with the helper
+ * threads they may take a while to be prepared)
+ */
+static void dcp_step_until(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                           const void *cookie, int n) {
+    int ii;
+    for (ii = 0; ii < 5000; ++ii) {
+        ENGINE_ERROR_CODE ret = h1->dcp.step(h, cookie, &dcp_producers);
+        cb_assert(ret == ENGINE_SUCCESS || ret == ENGINE_WANT_MORE);
+        if (dcp_markers + dcp_mutations + dcp_deletions +
+            dcp_stream_ends >= n) {
+            break;
+        }
+        usleep(1000);
+    }
+    cb_assert(dcp_markers + dcp_mutations + dcp_deletions +
+              dcp_stream_ends == n);
+}
+
+/*
+ * A DCP producer takes streams once it's open, and sends them until they
+ * end. The connection stays open without streams, and the producer goes
+ * away with it.
+ */
+static enum test_result dcp_producer_test(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = test_harness.create_cookie();
+    char key[32];
+    int ii;
+
+    dcp_reset(h, h1);
+    for (ii = 0; ii < 10; ++ii) {
+        snprintf(key, sizeof(key), "dcp_%d", ii);
+        store_key(h, h1, key);
+    }
+
+    /* Only producers, and the streams need an open connection */
+    cb_assert(h1->dcp.open(h, cookie, 0, 0, 0, "test",
+                           4) == ENGINE_ENOTSUP);
+    cb_assert(dcp_stream(h, h1, cookie, 0, 0) == ENGINE_EINVAL);
+    cb_assert(h1->dcp.open(h, cookie, 0, 0, DCP_OPEN_PRODUCER, "test",
+                           4) == ENGINE_SUCCESS);
+    cb_assert(h1->dcp.open(h, cookie, 0, 0, DCP_OPEN_PRODUCER, "test",
+                           4) == ENGINE_KEY_EEXISTS);
+    cb_assert(h1->dcp.step(h, cookie, &dcp_producers) == ENGINE_SUCCESS);
+
+    /* The changes since 5 aren't kept, but a stream from 0 backfills */
+    cb_assert(dcp_stream(h, h1, cookie, 5, 0) == ENGINE_ROLLBACK);
+    cb_assert(dcp_stream(h, h1, cookie, 0, 0) == ENGINE_SUCCESS);
+    dcp_step_until(h, h1, cookie, 1 + 10 + 1);
+    cb_assert(dcp_markers == 1 && dcp_mutations == 10);
+    for (ii = 0; ii < 10; ++ii) {
+        snprintf(key, sizeof(key), "dcp_%d", ii);
+        cb_assert(dcp_sent(key, NULL) == 1);
+    }
+    cb_assert(dcp_stream_ends == 1);
+    cb_assert(h1->dcp.step(h, cookie, &dcp_producers) == ENGINE_SUCCESS);
+
+    /* The producer (and what it holds) goes with the connection */
+    cb_assert(dcp_stream(h, h1, cookie, 0, 0) == ENGINE_SUCCESS);
+    test_harness.destroy_cookie(cookie);
+    cookie = test_harness.create_cookie();
+    cb_assert(dcp_stream(h, h1, cookie, 0, 0) == ENGINE_EINVAL);
+    test_harness.destroy_cookie(cookie);
+    return SUCCESS;
+}
+
+/* Changes a key already sent, and adds one, during the first pass */
+static void dcp_backfill_change(int mutations) {
+    if (mutations == 2) {
+        store_key(dcp_h, dcp_h1, dcp_keys[0]);
+        store_key(dcp_h, dcp_h1, "dcp_new");
+    }
+}
+
+/*
+ * A stream from 0 without the seqlog backfills the hash table. The keys
+ * changed while the first snapshot is sent come again in a second one,
+ * and the stream ends once a snapshot went by without changes.
+ */
+static enum test_result dcp_backfill_test(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = test_harness.create_cookie();
+    char key[32];
+    int ii;
+
+    dcp_reset(h, h1);
+    for (ii = 0; ii < 10; ++ii) {
+        snprintf(key, sizeof(key), "dcp_%d", ii);
+        store_key(h, h1, key);
+    }
+
+    cb_assert(h1->dcp.open(h, cookie, 0, 0, DCP_OPEN_PRODUCER, "test",
+                           4) == ENGINE_SUCCESS);
+    cb_assert(dcp_stream(h, h1, cookie, 0, 0) == ENGINE_SUCCESS);
+    dcp_on_mutation = dcp_backfill_change;
+    dcp_step_until(h, h1, cookie, 1 + 10 + 1 + 2 + 1);
+    cb_assert(dcp_markers == 2);
+    cb_assert(dcp_marker_flags == DCP_MARKER_FLAG_DISK);
+    for (ii = 0; ii < 10; ++ii) {
+        snprintf(key, sizeof(key), "dcp_%d", ii);
+        cb_assert(dcp_sent_in(key, 1, NULL) == 1);
+    }
+    cb_assert(dcp_sent_in("dcp_new", 1, NULL) == 0);
+    cb_assert(dcp_sent_in(dcp_keys[0], 2, NULL) == 1);
+    cb_assert(dcp_sent_in("dcp_new", 2, NULL) == 1);
+    cb_assert(dcp_stream_ends == 1);
+
+    test_harness.destroy_cookie(cookie);
+    return SUCCESS;
+}
+
+/*
+ * With the seqlog a stream is served from the logged changes: each batch
+ * is a memory snapshot sending the last change of every key in it once,
+ * with its seqno. It goes on with the changes made after it caught up,
+ * and it ends at end_seqno.
+ */
+static enum test_result dcp_log_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = test_harness.create_cookie();
+    const void *bounded = test_harness.create_cookie();
+    mutation_descr_t mut_info;
+    uint64_t cas = 0;
+    uint64_t seqno = 0;
+    char key[32];
+    int ii;
+
+    dcp_reset(h, h1);
+    /* seqnos 1 to 5, then 6 and 7, and the delete is 8 */
+    for (ii = 0; ii < 5; ++ii) {
+        snprintf(key, sizeof(key), "dcp_%d", ii);
+        store_key(h, h1, key);
+    }
+    store_key(h, h1, "dcp_1");
+    store_key(h, h1, "dcp_1");
+    cb_assert(h1->remove(h, NULL, "dcp_2", 5, &cas, 0,
+                         &mut_info) == ENGINE_SUCCESS);
+    cb_assert(mut_info.seqno == 8);
+
+    cb_assert(h1->dcp.open(h, cookie, 0, 0, DCP_OPEN_PRODUCER, "test",
+                           4) == ENGINE_SUCCESS);
+    cb_assert(dcp_stream(h, h1, cookie, 0, 0) == ENGINE_SUCCESS);
+    dcp_step_until(h, h1, cookie, 1 + 5);
+    cb_assert(dcp_marker_flags == DCP_MARKER_FLAG_MEMORY);
+    cb_assert(dcp_marker_start == 1 && dcp_marker_end == 8);
+    cb_assert(dcp_mutations == 4 && dcp_deletions == 1);
+    cb_assert(dcp_sent("dcp_1", &seqno) == 1 && seqno == 7);
+    cb_assert(dcp_sent("dcp_2", &seqno) == 1 && seqno == 8);
+    cb_assert(dcp_sent("dcp_4", &seqno) == 1 && seqno == 5);
+
+    store_key(h, h1, "dcp_5");
+    dcp_step_until(h, h1, cookie, 1 + 5 + 2);
+    cb_assert(dcp_marker_start == 9 && dcp_marker_end == 9);
+    cb_assert(dcp_sent("dcp_5", &seqno) == 1 && seqno == 9);
+    cb_assert(dcp_stream_ends == 0);
+
+    /* From 3 up to 6: dcp_3, dcp_4 and dcp_1, and the stream end */
+    dcp_reset(h, h1);
+    cb_assert(h1->dcp.open(h, bounded, 0, 0, DCP_OPEN_PRODUCER, "test",
+                           4) == ENGINE_SUCCESS);
+    cb_assert(dcp_stream(h, h1, bounded, 3, 6) == ENGINE_SUCCESS);
+    dcp_step_until(h, h1, bounded, 1 + 3 + 1);
+    cb_assert(dcp_marker_start == 4 && dcp_marker_end == 6);
+    cb_assert(dcp_sent("dcp_1", &seqno) == 1 && seqno == 6);
+    cb_assert(dcp_sent("dcp_3", NULL) == 1 && dcp_sent("dcp_4", NULL) == 1);
+    cb_assert(dcp_stream_ends == 1);
+
+    /* Past the end of the log */
+    cb_assert(dcp_stream(h, h1, bounded, 10, 0) == ENGINE_ROLLBACK);
+
+    test_harness.destroy_cookie(bounded);
+    test_harness.destroy_cookie(cookie);
+    return SUCCESS;
+}
+
+/*
+ * A key changed all through the log is sent once per batch, with the
+ * seqno of its last change there, and the keys around it all once (every
+ * key lands in the same dedup slot with the mock hash).
+ */
+static enum test_result dcp_dedup_test(ENGINE_HANDLE *h,
+                                      ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = test_harness.create_cookie();
+    uint64_t seqno = 0;
+    char key[32];
+    int ii;
+
+    dcp_reset(h, h1);
+    /* dcp_hot gets the even seqnos up to 80 */
+    for (ii = 0; ii < 40; ++ii) {
+        snprintf(key, sizeof(key), "dcp_%d", ii);
+        store_key(h, h1, key);
+        store_key(h, h1, "dcp_hot");
+    }
+
+    cb_assert(h1->dcp.open(h, cookie, 0, 0, DCP_OPEN_PRODUCER, "test",
+                           4) == ENGINE_SUCCESS);
+    cb_assert(dcp_stream(h, h1, cookie, 0, 80) == ENGINE_SUCCESS);
+    dcp_step_until(h, h1, cookie, 3 + 40 + 3 + 1);
+    cb_assert(dcp_markers == 3 && dcp_marker_end == 80);
+    cb_assert(dcp_sent_in("dcp_hot", 1, &seqno) == 1 && seqno == 32);
+    cb_assert(dcp_sent_in("dcp_hot", 2, &seqno) == 1 && seqno == 64);
+    cb_assert(dcp_sent_in("dcp_hot", 3, &seqno) == 1 && seqno == 80);
+    for (ii = 0; ii < 40; ++ii) {
+        snprintf(key, sizeof(key), "dcp_%d", ii);
+        cb_assert(dcp_sent(key, &seqno) == 1 && seqno == (uint64_t)ii * 2 + 1);
+    }
+    cb_assert(dcp_stream_ends == 1);
+
+    test_harness.destroy_cookie(cookie);
+    return SUCCESS;
+}
+
+/*
+ * Deleting a namespace drops the items stored in it so far, and only
+ * those: not the ones of other namespaces (or of a deeper separator), nor
+ * the ones stored after it.
+ */
+static enum test_result namespace_delete_test(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    uint64_t nitems = 0;
+    int ii;
+
+    store_key(h, h1, "user:1");
+    store_key(h, h1, "user:2:x");
+    store_key(h, h1, "userx:1");
+    store_key(h, h1, "user");
+    store_key(h, h1, "group:1");
+
+    cb_assert(delete_namespace(h, h1, "user", PROTOCOL_BINARY_NAMESPACE_DELETE_LAZY,
+                               &nitems) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(nitems == 2);
+    cb_assert(get_key(h, h1, "user:1") == ENGINE_KEY_ENOENT);
+    cb_assert(get_key(h, h1, "user:2:x") == ENGINE_KEY_ENOENT);
+    cb_assert(get_key(h, h1, "userx:1") == ENGINE_SUCCESS);
+    cb_assert(get_key(h, h1, "user") == ENGINE_SUCCESS);
+    cb_assert(get_key(h, h1, "group:1") == ENGINE_SUCCESS);
+
+    /* The namespace is used again */
+    store_key(h, h1, "user:1");
+    cb_assert(get_key(h, h1, "user:1") == ENGINE_SUCCESS);
+    cb_assert(delete_namespace(h, h1, "nobody", 0, &nitems) ==
+              PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+
+    /* Reclaimed in the background */
+    cb_assert(delete_namespace(h, h1, "group", 0, &nitems) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(nitems == 1);
+    for (ii = 0; ii < 200; ++ii) {
+        if (delete_namespace(h, h1, "group", 0, &nitems) ==
+            PROTOCOL_BINARY_RESPONSE_KEY_ENOENT) {
+            break;
+        }
+        usleep(10000);
+    }
+    cb_assert(ii < 200);
+    cb_assert(get_key(h, h1, "group:1") == ENGINE_KEY_ENOENT);
+    return SUCCESS;
+}
+
+static uint64_t namespace_prefix_bytes;
+static uint64_t namespace_entry_bytes;
+
+static void namespace_stats_handler(const char *key, const uint16_t klen,
+                                    const char *val, const uint32_t vlen,
+                                    const void *cookie) {
+    char buffer[32];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 22 && memcmp(key, "namespace_prefix_bytes", klen) == 0) {
+        namespace_prefix_bytes = strtoull(buffer, NULL, 10);
+    } else if (klen == 21 &&
+               memcmp(key, "namespace_entry_bytes", klen) == 0) {
+        namespace_entry_bytes = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * The bytes of the key prefixes of the items, which storing them once
+ * would save, and of the entries holding them once.
+ */
+static enum test_result namespace_prefix_bytes_test(ENGINE_HANDLE *h,
+                                                    ENGINE_HANDLE_V1 *h1) {
+    uint64_t entry_bytes;
+    mutation_descr_t mut_info;
+    uint64_t cas = 0;
+
+    store_key(h, h1, "tenant:1");
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            namespace_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(namespace_prefix_bytes == 7);
+    entry_bytes = namespace_entry_bytes;
+    cb_assert(entry_bytes > 6);
+
+    store_key(h, h1, "tenant:2");
+    store_key(h, h1, "tenant:3");
+    store_key(h, h1, "other");
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            namespace_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(namespace_prefix_bytes == 21);
+    cb_assert(namespace_entry_bytes == entry_bytes);
+
+    cb_assert(h1->remove(h, NULL, "tenant:1", 8, &cas, 0,
+                         &mut_info) == ENGINE_SUCCESS);
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            namespace_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(namespace_prefix_bytes == 14);
+    return SUCCESS;
+}
+
+static enum test_result namespace_disabled_test(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    uint64_t nitems;
+    store_key(h, h1, "user:1");
+    cb_assert(delete_namespace(h, h1, "user", 0, &nitems) ==
+              PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
+    cb_assert(get_key(h, h1, "user:1") == ENGINE_SUCCESS);
+    return SUCCESS;
+}
+
+static uint64_t miss_filter_negatives;
+
+static void miss_filter_stats_handler(const char *key, const uint16_t klen,
+                                      const char *val, const uint32_t vlen,
+                                      const void *cookie) {
+    if (klen == 21 && memcmp(key, "miss_filter_negatives", klen) == 0) {
+        char buffer[32];
+        cb_assert(vlen < sizeof(buffer));
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        miss_filter_negatives = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * The misses are answered by the filter, and it never hides a key, even
+ * while the key is replaced or after it was deleted and stored again.
+ */
+static enum test_result miss_filter_test(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1) {
+    mutation_descr_t mut_info;
+    uint64_t cas;
+    char key[32];
+    int ii;
+
+    for (ii = 0; ii < 100; ++ii) {
+        snprintf(key, sizeof(key), "filter_%d", ii);
+        store_key(h, h1, key);
+    }
+    for (ii = 0; ii < 100; ++ii) {
+        snprintf(key, sizeof(key), "filter_%d", ii);
+        cb_assert(get_key(h, h1, key) == ENGINE_SUCCESS);
+        store_key(h, h1, key);
+        cb_assert(get_key(h, h1, key) == ENGINE_SUCCESS);
+        snprintf(key, sizeof(key), "filter_miss_%d", ii);
+        cb_assert(get_key(h, h1, key) == ENGINE_KEY_ENOENT);
+    }
+
+    miss_filter_negatives = 0;
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            miss_filter_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(miss_filter_negatives > 90);
+
+    cas = 0;
+    cb_assert(h1->remove(h, NULL, "filter_0", 8, &cas, 0,
+                         &mut_info) == ENGINE_SUCCESS);
+    cb_assert(get_key(h, h1, "filter_0") == ENGINE_KEY_ENOENT);
+    store_key(h, h1, "filter_0");
+    cb_assert(get_key(h, h1, "filter_0") == ENGINE_SUCCESS);
+    return SUCCESS;
+}
+
+static uint64_t mrc_gets;
+static double mrc_small_miss_ratio;
+static double mrc_large_miss_ratio;
+
+static void mrc_stats_handler(const char *key, const uint16_t klen,
+                              const char *val, const uint32_t vlen,
+                              const void *cookie) {
+    char buffer[32];
+    cb_assert(vlen < sizeof(buffer));
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 8 && memcmp(key, "mrc_gets", klen) == 0) {
+        mrc_gets = strtoull(buffer, NULL, 10);
+    } else if (klen == 21 && memcmp(key, "mrc_miss_ratio_524288", klen) == 0) {
+        mrc_small_miss_ratio = atof(buffer);
+    } else if (klen == 22 &&
+               memcmp(key, "mrc_miss_ratio_1048576", klen) == 0) {
+        mrc_large_miss_ratio = atof(buffer);
+    }
+}
+
+/*
+ * Reading 200 items of 4k over and over, a cache of 512k misses all of
+ * the gets, and one of 1M only the first get of every key.
+ */
+static enum test_result mrc_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    uint64_t cas;
+    char key[32];
+    int ii, jj;
+
+    for (ii = 0; ii < 200; ++ii) {
+        snprintf(key, sizeof(key), "mrc_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 4000, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET,
+                            0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    for (jj = 0; jj < 5; ++jj) {
+        for (ii = 0; ii < 200; ++ii) {
+            snprintf(key, sizeof(key), "mrc_%d", ii);
+            cb_assert(get_key(h, h1, key) == ENGINE_SUCCESS);
+        }
+    }
+
+    mrc_gets = 0;
+    mrc_small_miss_ratio = mrc_large_miss_ratio = -1;
+    cb_assert(h1->get_stats(h, NULL, "mrc", 3,
+                            mrc_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(mrc_gets == 1000);
+    cb_assert(mrc_small_miss_ratio == 1.0);
+    cb_assert(mrc_large_miss_ratio > 0.19 && mrc_large_miss_ratio < 0.21);
+    return SUCCESS;
+}
+
+/*
+ * Scan a batch of the keys with the prefix from the cursor, marking the
+ * ones found in seen (by the number after the prefix). Returns the next
+ * cursor, or 0 once the scan is done.
+ */
+static uint32_t scan_keys(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                          uint32_t cursor, uint32_t count,
+                          const char *prefix, int *seen, int nseen) {
+    union {
+        protocol_binary_request_scan_keys req;
+        char buffer[512];
+    } r;
+    size_t nprefix = strlen(prefix);
+    const char *ptr, *end;
+    uint32_t next, nslices;
+
+    memset(r.buffer, 0, sizeof(r));
+    r.req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.req.message.header.request.opcode = PROTOCOL_BINARY_CMD_SCAN_KEYS;
+    r.req.message.header.request.extlen = 8;
+    r.req.message.header.request.keylen = htons((uint16_t)nprefix);
+    r.req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    r.req.message.header.request.bodylen = htonl((uint32_t)nprefix + 8);
+    r.req.message.body.cursor = htonl(cursor);
+    r.req.message.body.count = htonl(count);
+    memcpy(r.buffer + sizeof(r.req.bytes), prefix, nprefix);
+
+    cb_assert(h1->unknown_command(h, NULL, &r.req.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(last_response->response.extlen == 8);
+    ptr = (const char*)(last_response + 1);
+    memcpy(&next, ptr, 4);
+    memcpy(&nslices, ptr + 4, 4);
+    next = ntohl(next);
+    nslices = ntohl(nslices);
+    cb_assert(next > cursor && next <= nslices);
+
+    end = ptr + ntohl(last_response->response.bodylen);
+    ptr += 8;
+    while (ptr < end) {
+        protocol_binary_snapshot_item entry;
+        char key[64];
+        uint16_t nkey;
+        int num;
+
+        cb_assert(ptr + sizeof(entry) <= end);
+        memcpy(&entry, ptr, sizeof(entry));
+        nkey = ntohs(entry.nkey);
+        ptr += sizeof(entry);
+        cb_assert(ptr + nkey <= end && nkey < sizeof(key));
+        memcpy(key, ptr, nkey);
+        key[nkey] = '\0';
+        ptr += nkey;
+
+        cb_assert(strncmp(key, prefix, nprefix) == 0);
+        cb_assert(ntohl(entry.nbytes) == 1 && entry.cas != 0);
+        num = atoi(key + nprefix);
+        cb_assert(num >= 0 && num < nseen);
+        cb_assert(seen[num] == 0);
+        seen[num] = 1;
+    }
+    release_last_response();
+    return next == nslices ? 0 : next;
+}
+
+/*
+ * A scan lists every key with the prefix exactly once, a batch at a
+ * time, and the batches end at a slice.
+ */
+static enum test_result scan_keys_test(ENGINE_HANDLE *h,
+                                       ENGINE_HANDLE_V1 *h1) {
+    int seen[200];
+    char key[32];
+    uint32_t cursor = 0;
+    int ii, batches = 0;
+
+    for (ii = 0; ii < 200; ++ii) {
+        snprintf(key, sizeof(key), "%s%d", ii < 150 ? "scan_a_" : "scan_b_",
+                 ii < 150 ? ii : ii - 150);
+        store_key(h, h1, key);
+    }
+
+    memset(seen, 0, sizeof(seen));
+    do {
+        cursor = scan_keys(h, h1, cursor, 10, "scan_a_", seen, 150);
+        ++batches;
+    } while (cursor != 0);
+    for (ii = 0; ii < 150; ++ii) {
+        cb_assert(seen[ii] == 1);
+    }
+    cb_assert(batches > 1);
+
+    memset(seen, 0, sizeof(seen));
+    cb_assert(scan_keys(h, h1, 0, 1000000, "scan_b_", seen, 50) == 0);
+    for (ii = 0; ii < 50; ++ii) {
+        cb_assert(seen[ii] == 1);
+    }
+    return SUCCESS;
+}
+
+static bool scrub_running;
+static uint64_t scrub_visited;
+
+static void scrub_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[64];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+
+    if (klen == 15 && memcmp(key, "scrubber:status", klen) == 0) {
+        scrub_running = strcmp(buffer, "running") == 0;
+    } else if (klen == 16 && memcmp(key, "scrubber:visited", klen) == 0) {
+        scrub_visited = strtoull(buffer, NULL, 10);
+    }
+}
+
+static uint16_t scrub_start(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    protocol_binary_request_no_extras r;
+    uint16_t status;
+
+    memset(&r, 0, sizeof(r));
+    r.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.message.header.request.opcode = PROTOCOL_BINARY_CMD_SCRUB;
+    cb_assert(h1->unknown_command(h, NULL, &r.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    status = ntohs(last_response->response.status);
+    release_last_response();
+    return status;
+}
+
+/*
+ * The scrubber runs as a task on the executor of the (mock) server, and
+ * may be started again once it's done
+ */
+static enum test_result scrub_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    char key[32];
+    int ii, run;
+
+    for (ii = 0; ii < 100; ++ii) {
+        snprintf(key, sizeof(key), "scrub_%d", ii);
+        store_key(h, h1, key);
+    }
+
+    for (run = 0; run < 2; ++run) {
+        cb_assert(scrub_start(h, h1) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        scrub_running = true;
+        for (ii = 0; ii < 5000 && scrub_running; ++ii) {
+            usleep(1000);
+            cb_assert(h1->get_stats(h, NULL, "scrub", 5,
+                                    scrub_stats_handler) == ENGINE_SUCCESS);
+        }
+        cb_assert(!scrub_running);
+        cb_assert(scrub_visited >= 100);
+    }
+
+    /* Destroyed with a scrub going on */
+    cb_assert(scrub_start(h, h1) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    return SUCCESS;
+}
+
+static size_t incrm_entry(char *buf, const char *key, uint64_t delta,
+                          uint64_t initial, uint32_t expiration,
+                          uint16_t flags) {
+    protocol_binary_incrm_entry entry;
+    entry.delta = htonll(delta);
+    entry.initial = htonll(initial);
+    entry.expiration = htonl(expiration);
+    entry.nkey = htons((uint16_t)strlen(key));
+    entry.flags = htons(flags);
+    memcpy(buf, &entry, sizeof(entry));
+    memcpy(buf + sizeof(entry), key, strlen(key));
+    return sizeof(entry) + strlen(key);
+}
+
+/*
+ * The counters of a batch are incremented (and created) like with INCR
+ * and DECR, all of them in the same call, and a counter growing by a
+ * digit stays in its item.
+ */
+static enum test_result incrm_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    union {
+        protocol_binary_request_incrm req;
+        char buffer[1024];
+    } r;
+    protocol_binary_incrm_result results[5];
+    char *body = r.buffer + sizeof(r.req.bytes);
+    size_t len = 0;
+    uint64_t value;
+    item *it = NULL;
+    item *grown = NULL;
+    item_info info;
+
+    cb_assert(h1->arithmetic(h, NULL, "incrm_a", 7, true, true, 0, 9, 0,
+                             &it, 0, &value, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    store_key(h, h1, "incrm_text");
+
+    len += incrm_entry(body + len, "incrm_a", 1, 0, 0xffffffff, 0);
+    len += incrm_entry(body + len, "incrm_b", 5, 100, 0, 0);
+    len += incrm_entry(body + len, "incrm_c", 5, 100, 0xffffffff, 0);
+    len += incrm_entry(body + len, "incrm_a", 3, 0, 0xffffffff,
+                       PROTOCOL_BINARY_INCRM_DECR);
+    len += incrm_entry(body + len, "incrm_text", 1, 0, 0xffffffff, 0);
+
+    memset(&r.req, 0, sizeof(r.req));
+    r.req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.req.message.header.request.opcode = PROTOCOL_BINARY_CMD_INCRM;
+    r.req.message.header.request.bodylen = htonl((uint32_t)len);
+    cb_assert(h1->unknown_command(h, NULL, &r.req.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(ntohl(last_response->response.bodylen) == sizeof(results));
+    memcpy(results, last_response + 1, sizeof(results));
+    release_last_response();
+
+    cb_assert(ntohs(results[0].status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(ntohll(results[0].value) == 10);
+    cb_assert(ntohs(results[1].status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(ntohll(results[1].value) == 100);
+    cb_assert(ntohs(results[2].status) == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    cb_assert(ntohs(results[3].status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(ntohll(results[3].value) == 7);
+    cb_assert(ntohll(results[3].cas) != ntohll(results[0].cas));
+    cb_assert(ntohs(results[4].status) == PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL);
+
+    /* 99 to 100 */
+    cb_assert(h1->arithmetic(h, NULL, "incrm_d", 7, true, true, 0, 99, 0,
+                             &it, 0, &value, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    cb_assert(h1->get(h, NULL, &it, "incrm_d", 7, 0) == ENGINE_SUCCESS);
+    cb_assert(h1->arithmetic(h, NULL, "incrm_d", 7, true, false, 1, 0, 0,
+                             &grown, 0, &value, 0) == ENGINE_SUCCESS);
+    cb_assert(value == 100);
+    /* Not in place while someone else has it */
+    cb_assert(grown != it);
+    h1->release(h, NULL, it);
+    h1->release(h, NULL, grown);
+    cb_assert(h1->arithmetic(h, NULL, "incrm_d", 7, true, false, 900, 0, 0,
+                             &it, 0, &value, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    /* The item of 100 is now 1000 */
+    cb_assert(it == grown);
+    cb_assert(h1->get(h, NULL, &grown, "incrm_d", 7, 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, grown, &info));
+    cb_assert(info.nbytes == 4);
+    cb_assert(memcmp(info.value[0].iov_base, "1000", 4) == 0);
+    h1->release(h, NULL, grown);
+    return SUCCESS;
+}
+
+static size_t casm_entry(char *buf, const char *key, uint64_t cas,
+                         const char *value) {
+    protocol_binary_casm_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.cas = htonll(cas);
+    entry.nbytes = htonl((uint32_t)strlen(value));
+    entry.nkey = htons((uint16_t)strlen(key));
+    memcpy(buf, &entry, sizeof(entry));
+    memcpy(buf + sizeof(entry), key, strlen(key));
+    memcpy(buf + sizeof(entry) + strlen(key), value, strlen(value));
+    return sizeof(entry) + strlen(key) + strlen(value);
+}
+
+static uint16_t casm_send(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                          const char *body, size_t len,
+                          protocol_binary_casm_result *results, size_t n) {
+    union {
+        protocol_binary_request_casm req;
+        char buffer[1024];
+    } r;
+    uint16_t status;
+
+    memset(&r.req, 0, sizeof(r.req));
+    r.req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.req.message.header.request.opcode = PROTOCOL_BINARY_CMD_CASM;
+    r.req.message.header.request.bodylen = htonl((uint32_t)len);
+    memcpy(r.buffer + sizeof(r.req.bytes), body, len);
+    cb_assert(h1->unknown_command(h, NULL, &r.req.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    status = ntohs(last_response->response.status);
+    cb_assert(ntohl(last_response->response.bodylen) == n * sizeof(*results));
+    memcpy(results, last_response + 1, n * sizeof(*results));
+    release_last_response();
+    return status;
+}
+
+static uint64_t get_cas(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                        const char *key, char *value) {
+    item *it = NULL;
+    item_info info;
+
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &info));
+    memcpy(value, info.value[0].iov_base, info.nbytes);
+    value[info.nbytes] = '\0';
+    h1->release(h, NULL, it);
+    return info.cas;
+}
+
+/*
+ * The items of a CASM batch are either all replaced, or none of them is
+ * if one of them changed in the meantime.
+ */
+static enum test_result casm_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    protocol_binary_casm_result results[3];
+    char body[512];
+    char value[16];
+    size_t len = 0;
+    uint64_t cas_a, cas_b;
+
+    store_key(h, h1, "casm_a");
+    store_key(h, h1, "casm_b");
+    cas_a = get_cas(h, h1, "casm_a", value);
+    cas_b = get_cas(h, h1, "casm_b", value);
+
+    len += casm_entry(body + len, "casm_a", cas_a, "1");
+    len += casm_entry(body + len, "casm_b", cas_b, "2");
+    len += casm_entry(body + len, "casm_c", 0, "3");
+    cb_assert(casm_send(h, h1, body, len, results, 3) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(ntohs(results[0].status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(ntohll(results[0].cas) == get_cas(h, h1, "casm_a", value));
+    cb_assert(strcmp(value, "1") == 0);
+    cb_assert(ntohll(results[1].cas) == get_cas(h, h1, "casm_b", value));
+    cb_assert(strcmp(value, "2") == 0);
+    cb_assert(ntohll(results[2].cas) == get_cas(h, h1, "casm_c", value));
+    cb_assert(strcmp(value, "3") == 0);
+
+    /* casm_a changed, casm_b is left alone */
+    cas_b = ntohll(results[1].cas);
+    len = 0;
+    len += casm_entry(body + len, "casm_a", cas_a, "4");
+    len += casm_entry(body + len, "casm_b", cas_b, "5");
+    len += casm_entry(body + len, "casm_d", 0, "6");
+    cb_assert(casm_send(h, h1, body, len, results, 3) ==
+              PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
+    cb_assert(ntohs(results[0].status) == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
+    cb_assert(ntohs(results[1].status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(get_cas(h, h1, "casm_b", value) == cas_b);
+    cb_assert(strcmp(value, "2") == 0);
+    cb_assert(get_key(h, h1, "casm_d") == ENGINE_KEY_ENOENT);
+
+    /* An existing key with a CAS of 0, and a missing one with a CAS */
+    len = 0;
+    len += casm_entry(body + len, "casm_c", 0, "7");
+    len += casm_entry(body + len, "casm_e", 1, "8");
+    cb_assert(casm_send(h, h1, body, len, results, 2) !=
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(ntohs(results[0].status) == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
+    cb_assert(ntohs(results[1].status) == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+
+    /* A key twice */
+    len = 0;
+    len += casm_entry(body + len, "casm_b", cas_b, "9");
+    len += casm_entry(body + len, "casm_b", cas_b, "9");
+    cb_assert(casm_send(h, h1, body, len, results, 2) ==
+              PROTOCOL_BINARY_RESPONSE_EINVAL);
+    cb_assert(get_cas(h, h1, "casm_b", value) == cas_b);
+    return SUCCESS;
+}
+
+static size_t touchm_entry(char *buf, const char *key) {
+    protocol_binary_touchm_entry entry;
+    entry.nkey = htons((uint16_t)strlen(key));
+    memcpy(buf, &entry, sizeof(entry));
+    memcpy(buf + sizeof(entry), key, strlen(key));
+    return sizeof(entry) + strlen(key);
+}
+
+static uint16_t touchm_send(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                            uint8_t opcode, const char *body, size_t len,
+                            char *rsp, size_t nrsp) {
+    union {
+        protocol_binary_request_touchm req;
+        char buffer[1024];
+    } r;
+    uint16_t status;
+
+    memset(&r.req, 0, sizeof(r.req));
+    r.req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.req.message.header.request.opcode = opcode;
+    r.req.message.header.request.extlen = 4;
+    r.req.message.header.request.bodylen = htonl((uint32_t)(4 + len));
+    r.req.message.body.expiration = htonl(3600);
+    memcpy(r.buffer + sizeof(r.req.bytes), body, len);
+    cb_assert(h1->unknown_command(h, NULL, &r.req.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    status = ntohs(last_response->response.status);
+    if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        cb_assert(ntohl(last_response->response.bodylen) == nrsp);
+        memcpy(rsp, last_response + 1, nrsp);
+    }
+    release_last_response();
+    return status;
+}
+
+/*
+ * TOUCHM gives all the keys found the expiration in one call, GATM sends
+ * their values along.
+ */
+static enum test_result touchm_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    protocol_binary_gatm_result result;
+    char body[128];
+    char rsp[64];
+    char value[16];
+    size_t len = 0;
+    item *it = NULL;
+    item_info info;
+
+    store_key(h, h1, "touchm_a");
+    store_key(h, h1, "touchm_b");
+
+    len += touchm_entry(body + len, "touchm_a");
+    len += touchm_entry(body + len, "touchm_c");
+    len += touchm_entry(body + len, "touchm_b");
+    cb_assert(touchm_send(h, h1, PROTOCOL_BINARY_CMD_TOUCHM, body, len,
+                          rsp, 1) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(rsp[0] == 0x05);
+
+    cb_assert(h1->get(h, NULL, &it, "touchm_b", 8, 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &info));
+    cb_assert(info.exptime != 0);
+    h1->release(h, NULL, it);
+
+    len = touchm_entry(body, "touchm_c");
+    len += touchm_entry(body + len, "touchm_a");
+    cb_assert(touchm_send(h, h1, PROTOCOL_BINARY_CMD_GATM, body, len,
+                          rsp, 1 + sizeof(result) + 1) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(rsp[0] == 0x02);
+    memcpy(&result, rsp + 1, sizeof(result));
+    cb_assert(ntohll(result.cas) == get_cas(h, h1, "touchm_a", value));
+    cb_assert(ntohl(result.nbytes) == 1);
+
+    /* A key must have at least a byte */
+    len = touchm_entry(body, "");
+    cb_assert(touchm_send(h, h1, PROTOCOL_BINARY_CMD_TOUCHM, body, len,
+                          rsp, 0) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    return SUCCESS;
+}
+
+static char arena_page_type[64];
+
+static void arena_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    if (klen == 15 && memcmp(key, "arena_page_type", klen) == 0) {
+        cb_assert(vlen < sizeof(arena_page_type));
+        memcpy(arena_page_type, val, vlen);
+        arena_page_type[vlen] = '\0';
+    }
+}
+
+/*
+ * The arena is mapped with transparent huge pages if the platform
+ * supports it, and the engine should work just as with malloc.
+ */
+static enum test_result arena_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    arena_page_type[0] = '\0';
+    cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                            arena_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(strcmp(arena_page_type, "transparent_hugepage") == 0 ||
+              strcmp(arena_page_type, "default") == 0);
+    return get_test(h, h1);
+}
+
+static uint64_t arena_prefaulted_bytes;
+
+static void prefault_stats_handler(const char *key, const uint16_t klen,
+                                   const char *val, const uint32_t vlen,
+                                   const void *cookie) {
+    if (klen == 22 && memcmp(key, "arena_prefaulted_bytes", klen) == 0) {
+        arena_prefaulted_bytes = strtoull(val, NULL, 10);
+    }
+}
+
+/*
+ * All of the arena is touched by the prefault threads before the engine
+ * is used, and then it works as usual.
+ */
+static enum test_result prefault_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    arena_prefaulted_bytes = 0;
+    cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                            prefault_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(arena_prefaulted_bytes == 134217728);
+    return get_test(h, h1);
+}
+
+static uint64_t item_header_size;
+static bool header_bytes_saved;
+
+static void compact_stats_handler(const char *key, const uint16_t klen,
+                                  const char *val, const uint32_t vlen,
+                                  const void *cookie) {
+    if (klen == 16 && memcmp(key, "item_header_size", klen) == 0) {
+        item_header_size = strtoull(val, NULL, 10);
+    } else if (klen == 18 && memcmp(key, "header_bytes_saved", klen) == 0) {
+        header_bytes_saved = true;
+    }
+}
+
+/*
+ * Compact items link through 32 bit handles, so the header should be
+ * smaller than the pointer based one, and items should work as usual.
+ */
+static enum test_result compact_items_test(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    item_header_size = 0;
+    header_bytes_saved = false;
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            compact_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(item_header_size > 0 && item_header_size < 48);
+    cb_assert(get_test(h, h1) == SUCCESS);
+    cb_assert(h1->get_stats(h, NULL, "sizes", 5,
+                            compact_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(header_bytes_saved);
+    return SUCCESS;
+}
+
+static unsigned int tiny_chunk_size;
+
+static void tiny_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    if (klen == 12 && memcmp(key, "1:chunk_size", klen) == 0) {
+        char buffer[32];
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        tiny_chunk_size = atoi(buffer);
+    }
+}
+
+static uint8_t tiny_store(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                          const char *key, size_t nbytes) {
+    item *test_item = NULL;
+    item_info info;
+    uint64_t cas = 0;
+    uint8_t clsid;
+
+    info.nvalue = 1;
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), nbytes,
+                           0, 0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+    memset(info.value[0].iov_base, '1', nbytes);
+    clsid = info.clsid;
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,
+                        0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    return clsid;
+}
+
+/*
+ * With tiny_items the items with the largest tiny key and value go to
+ * the first slab class, which is no larger than they need (rounded up
+ * to a cache line), and the larger ones to the next classes.
+ */
+static enum test_result tiny_items_test(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    cb_assert(tiny_store(h, h1, "tiny_counter_key", 8) == 1);
+    cb_assert(tiny_store(h, h1, "tiny", 1) == 1);
+    tiny_chunk_size = 0;
+    cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                            tiny_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(tiny_chunk_size > 0 && tiny_chunk_size <= 48 + 8 + 16 + 8);
+
+    /* Grown out of it */
+    cb_assert(tiny_store(h, h1, "tiny_counter_key", 9) > 1);
+    cb_assert(tiny_store(h, h1, "tiny_counter_key_", 8) > 1);
+    return SUCCESS;
+}
+
+/*
+ * With slab_sizes the slab classes have those chunk sizes (and the last
+ * one item_size_max), and the sizes must grow in steps of 8 bytes
+ */
+static enum test_result slab_sizes_test(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    ENGINE_HANDLE_V1 *h2;
+
+    cb_assert(tiny_store(h, h1, "slab_sizes_key", 1) == 1);
+    cb_assert(tiny_store(h, h1, "slab_sizes_key", 500) == 2);
+    cb_assert(tiny_store(h, h1, "slab_sizes_key", 10000) == 3);
+    cb_assert(tiny_store(h, h1, "slab_sizes_key", 300000) == 4);
+
+    h2 = test_harness.create_bucket(true, "slab_sizes=1024-128");
+    cb_assert(h2 == NULL);
+    h2 = test_harness.create_bucket(true, "slab_sizes=128-1020");
+    cb_assert(h2 == NULL);
+    h2 = test_harness.create_bucket(true, "slab_sizes=128;1024");
+    cb_assert(h2 == NULL);
+    return SUCCESS;
+}
+
+static uint64_t est_slack_bytes;
+static uint64_t learned_slack_bytes;
+static bool learned_slab_sizes;
+static int slab_sizes_learned;
+
+static void slab_sizes_stats_handler(const char *key, const uint16_t klen,
+                                     const char *val, const uint32_t vlen,
+                                     const void *cookie) {
+    char buffer[64];
+    if (klen == 18 && memcmp(key, "learned_slab_sizes", klen) == 0) {
+        /* The list of sizes, it may be longer than the buffer */
+        learned_slab_sizes = vlen > 0;
+        return;
+    }
+    if (vlen >= sizeof(buffer)) {
+        return;
+    }
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 15 && memcmp(key, "est_slack_bytes", klen) == 0) {
+        est_slack_bytes = strtoull(buffer, NULL, 10);
+    } else if (klen == 19 && memcmp(key, "learned_slack_bytes", klen) == 0) {
+        learned_slack_bytes = strtoull(buffer, NULL, 10);
+    } else if (klen == 18 && memcmp(key, "slab_sizes_learned", klen) == 0) {
+        slab_sizes_learned = atoi(buffer);
+    }
+}
+
+/* Store items of two sizes only */
+static void slab_learn_store(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    char key[32];
+    int ii;
+
+    for (ii = 0; ii < 200; ++ii) {
+        sprintf(key, "slab_learn_%03d", ii);
+        tiny_store(h, h1, key, ii % 2 == 0 ? 100 : 3000);
+    }
+}
+
+static void slab_learn_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    est_slack_bytes = learned_slack_bytes = 0;
+    learned_slab_sizes = false;
+    slab_sizes_learned = -1;
+    cb_assert(h1->get_stats(h, NULL, "slab_sizes", 10,
+                            slab_sizes_stats_handler) == ENGINE_SUCCESS);
+}
+
+/*
+ * The classes learned from items of two sizes have a class for each, so
+ * they waste nothing past the ends of the items (as the histogram sees
+ * them), unlike the geometric ones
+ */
+static enum test_result slab_learn_test(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    slab_learn_stats(h, h1);
+    cb_assert(!learned_slab_sizes && slab_sizes_learned == 0);
+
+    slab_learn_store(h, h1);
+    slab_learn_stats(h, h1);
+    cb_assert(learned_slab_sizes);
+    cb_assert(est_slack_bytes > 0 && learned_slack_bytes == 0);
+    return SUCCESS;
+}
+
+/*
+ * With slab_learn the classes learned at a clean shutdown are the ones of
+ * the next bucket using the restart file, which starts out empty
+ */
+static enum test_result slab_learn_restart_test(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    const char *cfg = RESTART_TEST_CFG ";slab_learn=true";
+
+    unlink(RESTART_TEST_FILE);
+    h1 = test_harness.create_bucket(true, cfg);
+    h = (ENGINE_HANDLE*)h1;
+    cb_assert(h1 != NULL);
+    slab_learn_store(h, h1);
+    test_harness.destroy_bucket(h, h1, false);
+
+    h1 = test_harness.create_bucket(true, cfg);
+    h = (ENGINE_HANDLE*)h1;
+    cb_assert(h1 != NULL);
+    restart_items = 1;
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            restart_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(restart_items == 0);
+    slab_learn_stats(h, h1);
+    cb_assert(slab_sizes_learned == 1);
+
+    /* Nothing better to learn from the same items, they are kept */
+    slab_learn_store(h, h1);
+    test_harness.destroy_bucket(h, h1, false);
+    h1 = test_harness.create_bucket(true, cfg);
+    h = (ENGINE_HANDLE*)h1;
+    cb_assert(h1 != NULL);
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            restart_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(restart_items == 200);
+    slab_learn_stats(h, h1);
+    cb_assert(slab_sizes_learned == 1 && learned_slack_bytes == 0);
+    test_harness.destroy_bucket(h, h1, false);
+    unlink(RESTART_TEST_FILE);
+    return SUCCESS;
+}
+
+static uint64_t vb0_high_seqno;
+
+static void seqno_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    if (klen == 15 && memcmp(key, "vb_0:high_seqno", klen) == 0) {
+        vb0_high_seqno = strtoull(val, NULL, 10);
+    }
+}
+
+/*
+ * Every change in a vbucket gets the next sequence number of the
+ * vbucket, and deletions return theirs.
+ */
+static enum test_result seqno_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *key = "seqno_test_key";
+    mutation_descr_t mut_info;
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    int ii;
+
+    vb0_high_seqno = 1;
+    cb_assert(h1->get_stats(h, NULL, "vbucket-seqno", 13,
+                            seqno_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(vb0_high_seqno == 0);
+
+    for (ii = 0; ii < 3; ++ii) {
+        cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) ==
+                  ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    cb_assert(h1->get_stats(h, NULL, "vbucket-seqno", 13,
+                            seqno_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(vb0_high_seqno == 3);
+
+    cas = 0;
+    cb_assert(h1->remove(h, NULL, key, strlen(key), &cas, 0, &mut_info) ==
+              ENGINE_SUCCESS);
+    cb_assert(mut_info.seqno == 4);
+    cb_assert(h1->get_stats(h, NULL, "vbucket-seqno", 13,
+                            seqno_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(vb0_high_seqno == 4);
+    return SUCCESS;
+}
+
+static uint64_t vb1_items;
+static uint64_t vb2_items;
+
+static void vbucket_details_handler(const char *key, const uint16_t klen,
+                                    const char *val, const uint32_t vlen,
+                                    const void *cookie) {
+    if (klen == 14 && memcmp(key, "vb_1:num_items", klen) == 0) {
+        vb1_items = strtoull(val, NULL, 10);
+    } else if (klen == 14 && memcmp(key, "vb_2:num_items", klen) == 0) {
+        vb2_items = strtoull(val, NULL, 10);
+    }
+}
+
+static void vbucket_details(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    vb1_items = vb2_items = UINT64_MAX;
+    cb_assert(h1->get_stats(h, NULL, "vbucket-details", 15,
+                            vbucket_details_handler) == ENGINE_SUCCESS);
+}
+
+static void vbucket_store(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                          const char *key, uint16_t vbucket) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,
+                        vbucket) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+}
+
+/*
+ * With the vbucket index the items of every vbucket are counted, and
+ * the ones of a deleted vbucket are unlinked in the background.
+ */
+static enum test_result vbucket_index_test(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    protocol_binary_request_header r;
+    item *test_item = NULL;
+    item *result_item = NULL;
+    uint64_t res = 0;
+    int ii;
+
+    set_vbucket_state(h, h1, 1, vbucket_state_active);
+    set_vbucket_state(h, h1, 2, vbucket_state_active);
+    vbucket_store(h, h1, "vbucket_a", 1);
+    vbucket_store(h, h1, "vbucket_b", 1);
+    vbucket_store(h, h1, "vbucket_c", 2);
+    /* A new version stays in the vbucket */
+    vbucket_store(h, h1, "vbucket_a", 1);
+    cb_assert(h1->arithmetic(h, NULL, "vbucket_d", 9, true, true, 0, 1, 0,
+                             &result_item, PROTOCOL_BINARY_RAW_BYTES, &res,
+                             1) == ENGINE_SUCCESS);
+    h1->release(h, NULL, result_item);
+    vbucket_details(h, h1);
+    cb_assert(vb1_items == 3);
+    cb_assert(vb2_items == 1);
+
+    memset(&r, 0, sizeof(r));
+    r.request.magic = PROTOCOL_BINARY_REQ;
+    r.request.opcode = PROTOCOL_BINARY_CMD_DEL_VBUCKET;
+    r.request.vbucket = htons(1);
+    cb_assert(h1->unknown_command(h, NULL, &r, response_handler) ==
+              ENGINE_SUCCESS);
+    release_last_response();
+
+    for (ii = 0; ii < 5000; ++ii) {
+        vbucket_details(h, h1);
+        if (vb1_items == 0) {
+            break;
+        }
+        usleep(1000);
+    }
+    cb_assert(vb1_items == 0);
+    cb_assert(vb2_items == 1);
+
+    set_vbucket_state(h, h1, 1, vbucket_state_active);
+    cb_assert(h1->get(h, NULL, &test_item, "vbucket_a", 9, 1) ==
+              ENGINE_KEY_ENOENT);
+    cb_assert(h1->get(h, NULL, &test_item, "vbucket_c", 9, 2) ==
+              ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
+}
+
+/* With the vbucket index a backfill only sends the items of its vbucket */
+static enum test_result dcp_backfill_vbucket_test(ENGINE_HANDLE *h,
+                                                  ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = test_harness.create_cookie();
+    uint64_t rollback_seqno = 0;
+
+    dcp_reset(h, h1);
+    set_vbucket_state(h, h1, 1, vbucket_state_active);
+    vbucket_store(h, h1, "dcp_vb0", 0);
+    vbucket_store(h, h1, "dcp_vb1", 1);
+
+    cb_assert(h1->dcp.open(h, cookie, 0, 0, DCP_OPEN_PRODUCER, "test",
+                           4) == ENGINE_SUCCESS);
+    cb_assert(h1->dcp.stream_req(h, cookie, 0, 0, 1, 0, 0, 0, 0, 0,
+                                 &rollback_seqno,
+                                 dcp_failover_log) == ENGINE_SUCCESS);
+    dcp_step_until(h, h1, cookie, 1 + 1 + 1);
+    cb_assert(dcp_mutations == 1);
+    cb_assert(dcp_sent("dcp_vb1", NULL) == 1);
+    cb_assert(dcp_sent("dcp_vb0", NULL) == 0);
+    cb_assert(dcp_stream_ends == 1);
+
+    test_harness.destroy_cookie(cookie);
+    return SUCCESS;
+}
+
 MEMCACHED_PUBLIC_API
 engine_test_t* get_tests(void) {
     static engine_test_t tests[]  = {
@@ -847,16 +4166,98 @@ engine_test_t* get_tests(void) {
         TEST_CASE("prepend test", prepend_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("store test", store_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("get test", get_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("get multi test", get_multi_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("release multi test", release_multi_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("store multi test", store_multi_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("splice test", splice_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("prefetch test", prefetch_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("expiry test", expiry_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("expiry test (milliseconds)", expiry_ms_test, NULL, NULL,
+                  NULL, NULL, NULL),
+        TEST_CASE("expiry test (absolute time in 2038)", expiry_abs_2038_test,
+                  NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("remove test", remove_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("release test", release_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("incr test", incr_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("mt incr test", mt_incr_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("mt store test", mt_store_test, NULL, NULL,
+                  "lock_stripes=64", NULL, NULL),
+        TEST_CASE("mt store test (bucketed index)", mt_store_test, NULL, NULL,
+                  "lock_stripes=64;bucketed_index=true", NULL, NULL),
+        TEST_CASE("mt store test (magazines)", mt_store_test, NULL, NULL,
+                  "lock_stripes=64;slab_magazine_size=16", NULL, NULL),
+        TEST_CASE("mt store test (compact items)", mt_store_test, NULL, NULL,
+                  "lock_stripes=64;preallocate=true;compact_items=true",
+                  NULL, NULL),
+        TEST_CASE("hash expansion test", hash_expansion_test, NULL, NULL,
+                  "lock_stripes=64;hash_expand_threads=4", NULL, NULL),
+        TEST_CASE("hash expansion test (bucketed index)", hash_expansion_test,
+                  NULL, NULL,
+                  "lock_stripes=64;bucketed_index=true;hash_expand_threads=4",
+                  NULL, NULL),
+        TEST_CASE("hash expansion test (presized)", hash_expansion_test,
+                  NULL, NULL, "lock_stripes=64;expected_items=200000",
+                  NULL, NULL),
+        TEST_CASE("mt cas test", mt_cas_test, NULL, NULL,
+                  "lock_stripes=16", NULL, NULL),
         TEST_CASE("decr test", decr_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("flush test", flush_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("flush reclaim test", flush_reclaim_test, NULL, NULL, NULL,
+                  NULL, NULL),
+        TEST_CASE("scrub", scrub_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("expiry index", expiry_index_test, NULL, NULL,
+                  "expiry_index_size=1024", NULL, NULL),
+        TEST_CASE("large item test", large_item_test, NULL, NULL,
+                  "large_item_size_max=4194304", NULL, NULL),
+        TEST_CASE("item view test", item_view_test, NULL, NULL,
+                  "large_item_size_max=4194304", NULL, NULL),
+        TEST_CASE("stats sizes test", sizes_test, NULL, NULL, NULL, NULL,
+                  NULL),
+        TEST_CASE("extended storage test", ext_test, NULL, NULL,
+                  "ext_path=/tmp/default_engine_ext_test;ext_size=2097152;"
+                  "ext_segment_size=1048576;ext_item_min=1024;ext_item_age=0",
+                  NULL, NULL),
+        TEST_CASE("warm restart test", restart_test, NULL, NULL, NULL,
+                  NULL, NULL),
+        TEST_CASE("snapshot test", snapshot_test, NULL, NULL, NULL,
+                  NULL, NULL),
         TEST_CASE("get item info test", get_item_info_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("set cas test", item_set_cas_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("LRU test", lru_test, NULL, NULL, "cache_size=48", NULL, NULL),
+        TEST_CASE("LRU test (maintainer)", lru_test, NULL, NULL,
+                  "cache_size=48;lru_maintainer=true", NULL, NULL),
+        TEST_CASE("LRU test (magazines)", lru_test, NULL, NULL,
+                  "cache_size=48;lock_stripes=16;slab_magazine_size=16",
+                  NULL, NULL),
+        TEST_CASE("LRU test (compact items)", lru_test, NULL, NULL,
+                  "cache_size=1048576;preallocate=true;compact_items=true",
+                  NULL, NULL),
+        TEST_CASE("LRU test (lru policy)", lru_test, NULL, NULL,
+                  "cache_size=48;eviction_policy=lru", NULL, NULL),
+        TEST_CASE("LRU test (tinylfu policy)", lru_test, NULL, NULL,
+                  "cache_size=48;eviction_policy=tinylfu", NULL, NULL),
+        TEST_CASE("evict active items", evict_active_test, NULL, NULL,
+                  "cache_size=48", NULL, NULL),
+        TEST_CASE("evict active items (tinylfu policy)", evict_active_test,
+                  NULL, NULL, "cache_size=48;eviction_policy=tinylfu",
+                  NULL, NULL),
+        TEST_CASE("dcp producer", dcp_producer_test, NULL, NULL, NULL,
+                  NULL, NULL),
+        TEST_CASE("dcp producer (helper threads)", dcp_producer_test, NULL,
+                  NULL, "dcp_helper_threads=2", NULL, NULL),
+        TEST_CASE("dcp backfill", dcp_backfill_test, NULL, NULL, NULL,
+                  NULL, NULL),
+        TEST_CASE("dcp backfill (helper threads)", dcp_backfill_test, NULL,
+                  NULL, "dcp_helper_threads=2", NULL, NULL),
+        TEST_CASE("dcp stream from the log", dcp_log_test, NULL, NULL,
+                  "seqlog_size=64", NULL, NULL),
+        TEST_CASE("dcp stream from the log (helper threads)", dcp_log_test,
+                  NULL, NULL, "seqlog_size=64;dcp_helper_threads=2",
+                  NULL, NULL),
+        TEST_CASE("dcp stream dedup", dcp_dedup_test, NULL, NULL,
+                  "seqlog_size=128", NULL, NULL),
+        TEST_CASE("evict reserve", evict_reserve_test, NULL, NULL,
+                  "cache_size=48;evict_reserve=8", NULL, NULL),
         TEST_CASE("get stats test", get_stats_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("reset stats test", reset_stats_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("get stats struct test", get_stats_struct_test, NULL, NULL, NULL, NULL, NULL),
@@ -865,6 +4266,57 @@ engine_test_t* get_tests(void) {
         TEST_CASE("Get And Touch", gat_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("Get And Touch Quiet", gatq_test, NULL, NULL, NULL, NULL, NULL),
         TEST_CASE("Test datatype", test_datatype, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("namespace delete", namespace_delete_test, NULL, NULL,
+                  "namespace_separator=:", NULL, NULL),
+        TEST_CASE("namespace prefix bytes", namespace_prefix_bytes_test, NULL,
+                  NULL, "namespace_separator=:", NULL, NULL),
+        TEST_CASE("namespace delete (disabled)", namespace_disabled_test,
+                  NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("miss filter", miss_filter_test, NULL, NULL,
+                  "miss_filter_items=1000", NULL, NULL),
+        TEST_CASE("miss ratio curve", mrc_test, NULL, NULL,
+                  "mrc_keys=1000;cache_size=4194304", NULL, NULL),
+        TEST_CASE("scan keys", scan_keys_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("incrm", incrm_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("casm", casm_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("touchm", touchm_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("lease", lease_test, NULL, NULL, "lease_timeout=10",
+                  NULL, NULL),
+        TEST_CASE("stale lease", stale_lease_test, NULL, NULL,
+                  "lease_timeout=10;stale_grace=30", NULL, NULL),
+        TEST_CASE("get replica", get_replica_test, NULL, NULL, NULL,
+                  NULL, NULL),
+        TEST_CASE("slab reassign", slab_reassign_test, NULL, NULL,
+                  "slab_reassign=true", NULL, NULL),
+        TEST_CASE("slab compact", slab_compact_test, NULL, NULL,
+                  "slab_reassign=true;slab_compact=true", NULL, NULL),
+        TEST_CASE("shared slab pool", shared_pool_test, NULL, NULL,
+                  "shared_pool_size=4194304;cache_size=1048576;"
+                  "hard_quota=3145728", NULL, NULL),
+        TEST_CASE("preallocated arena (hugepages)", arena_test, NULL, NULL,
+                  "preallocate=true;hugepages=transparent", NULL, NULL),
+        TEST_CASE("prefaulted arena", prefault_test, NULL, NULL,
+                  "preallocate=true;cache_size=134217728;prefault_threads=4",
+                  NULL, NULL),
+        TEST_CASE("compact items", compact_items_test, NULL, NULL,
+                  "preallocate=true;compact_items=true", NULL, NULL),
+        TEST_CASE("vbucket seqnos", seqno_test, NULL, NULL, "seqlog_size=16",
+                  NULL, NULL),
+        TEST_CASE("tiny items", tiny_items_test, NULL, NULL,
+                  "tiny_items=true", NULL, NULL),
+        TEST_CASE("slab sizes", slab_sizes_test, NULL, NULL,
+                  "slab_sizes=128-1024-65536", NULL, NULL),
+        TEST_CASE("slab learn", slab_learn_test, NULL, NULL, NULL, NULL, NULL),
+        TEST_CASE("slab learn (warm restart)", slab_learn_restart_test, NULL,
+                  NULL, NULL, NULL, NULL),
+        TEST_CASE("vbucket index", vbucket_index_test, NULL, NULL,
+                  "vbucket_index=true", NULL, NULL),
+        TEST_CASE("dcp backfill (vbucket index)", dcp_backfill_vbucket_test,
+                  NULL, NULL, "vbucket_index=true", NULL, NULL),
+        TEST_CASE("item sample", item_sample_test, NULL, NULL,
+                  "cache_size=48;item_sample=1", NULL, NULL),
+        TEST_CASE("partitions", partitions_test, NULL, NULL, "partitions=4",
+                  NULL, NULL),
         TEST_CASE(NULL, NULL, NULL, NULL, NULL, NULL, NULL)
     };
     return tests;
@@ -25,9 +25,31 @@
 
 #include <memcached/isotime.h>
 
-int ISOTime::generatetimestamp(ISO8601String &destination,
-                               time_t now, uint32_t frac_of_second)
-{
+#ifdef WIN32
+#define ISOTIME_THREAD_LOCAL __declspec(thread)
+#else
+#define ISOTIME_THREAD_LOCAL __thread
+#endif
+
+/*
+ * The last second a thread formatted. Only the fraction changes within
+ * a second, and working out the local time and its offset from UTC
+ * costs far more than the formatting (the audit daemon and the file
+ * logger stamp every event), so the rest is only redone when the second
+ * changes. A change of TZ is seen from the next second on.
+ */
+struct timestamp_cache {
+    bool valid;
+    time_t second;
+    char prefix[24];    /* YYYY-MM-DDTHH:MM:SS. */
+    int nprefix;
+    char zone[8];       /* Z or +HH:MM */
+    int nzone;
+};
+
+static ISOTIME_THREAD_LOCAL struct timestamp_cache cache;
+
+static void format_second(struct timestamp_cache &c, time_t now) {
     struct tm utc_time;
     struct tm local_time;
 #ifdef WIN32
@@ -49,32 +71,55 @@ int ISOTime::generatetimestamp(ISO8601String &destination,
     int32_t hours = (int32_t)(total_minutes_diff / 60);
     int32_t minutes = (int32_t)(total_minutes_diff) % 60;
 
-    int offset = snprintf(destination.data(), destination.size(),
-                          "%04u-"
-                          "%02u-"
-                          "%02uT"
-                          "%02u:%02u:%02u.%06u",
-                          local_time.tm_year + 1900,
-                          local_time.tm_mon+1,
-                          local_time.tm_mday,
-                          local_time.tm_hour,
-                          local_time.tm_min,
-                          local_time.tm_sec,
-                          frac_of_second);
+    c.nprefix = snprintf(c.prefix, sizeof(c.prefix),
+                         "%04u-"
+                         "%02u-"
+                         "%02uT"
+                         "%02u:%02u:%02u.",
+                         local_time.tm_year + 1900,
+                         local_time.tm_mon+1,
+                         local_time.tm_mday,
+                         local_time.tm_hour,
+                         local_time.tm_min,
+                         local_time.tm_sec);
 
     if (total_seconds_diff == 0.0) {
-        strcat(destination.data(), "Z");
-        ++offset;
+        c.nzone = snprintf(c.zone, sizeof(c.zone), "Z");
     } else if (total_seconds_diff < 0.0) {
-        offset += snprintf(destination.data() + offset,
-                           destination.size() - offset,
-                           "-%02u:%02u", abs(hours), abs(minutes));
+        c.nzone = snprintf(c.zone, sizeof(c.zone), "-%02u:%02u",
+                           abs(hours), abs(minutes));
     } else {
-        offset += snprintf(destination.data() + offset,
-                           destination.size() - offset,
-                           "+%02u:%02u", hours, minutes);
+        c.nzone = snprintf(c.zone, sizeof(c.zone), "+%02u:%02u",
+                           hours, minutes);
+    }
+    c.second = now;
+    c.valid = true;
+}
+
+int ISOTime::generatetimestamp(ISO8601String &destination,
+                               time_t now, uint32_t frac_of_second)
+{
+    char *ptr = destination.data();
+    int ii;
+
+    if (!cache.valid || cache.second != now) {
+        format_second(cache, now);
+    }
+
+    memcpy(ptr, cache.prefix, cache.nprefix);
+    ptr += cache.nprefix;
+    if (frac_of_second > 999999) {
+        // Not a fraction of a second, and there is only room for 6 digits
+        frac_of_second = 999999;
+    }
+    for (ii = 5; ii >= 0; --ii) {
+        ptr[ii] = (char)('0' + frac_of_second % 10);
+        frac_of_second /= 10;
     }
-    return offset;
+    ptr += 6;
+    memcpy(ptr, cache.zone, cache.nzone + 1);
+    ptr += cache.nzone;
+    return (int)(ptr - destination.data());
 }
 
 int ISOTime::generatetimestamp(ISO8601String &destination) {
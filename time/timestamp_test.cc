@@ -45,5 +45,30 @@ int main(void)
                   << "  got      [" << timestamp << "]" << std::endl;
         return EXIT_FAILURE;
     }
+
+    // The same second again (from the cache), and the next ones
+    struct {
+        time_t now;
+        uint32_t frac;
+        const char *expected;
+    } stamps[] = {
+        { now, 123456, "2015-03-13T02:36:00.123456-07:00" },
+        { now + 1, 7, "2015-03-13T02:36:01.000007-07:00" },
+        { now + 86400 * 180, 999999, "2015-09-09T02:36:00.999999-07:00" },
+        { now, 0, "2015-03-13T02:36:00.000000-07:00" }
+    };
+    for (size_t ii = 0; ii < sizeof(stamps) / sizeof(stamps[0]); ++ii) {
+        ISOTime::ISO8601String buffer;
+        int len = ISOTime::generatetimestamp(buffer, stamps[ii].now,
+                                             stamps[ii].frac);
+        if (strcmp(buffer.data(), stamps[ii].expected) != 0 ||
+            len != (int)strlen(stamps[ii].expected)) {
+            std::cerr << "Comparison failed" << std::endl
+                      << "  Expected [" << stamps[ii].expected << "]"
+                      << std::endl
+                      << "  got      [" << buffer.data() << "]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
     return EXIT_SUCCESS;
 }
@@ -9,6 +9,9 @@
 #endif
 
 #include "memcached_dtrace.h"
+#elif defined(ENABLE_USDT)
+/* Generated from memcached_dtrace.d by generate_usdt.py */
+#include "memcached_usdt.h"
 #else
 #define MEMCACHED_ASSOC_DELETE(arg0, arg1, arg2)
 #define MEMCACHED_ASSOC_DELETE_ENABLED() (0)
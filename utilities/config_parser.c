@@ -11,74 +11,223 @@
 #include <memcached/config_parser.h>
 #include <memcached/util.h>
 
+/* The longest key and (but for strings) value we accept */
+#define CONFIG_KEY_MAX 80
+#define CONFIG_VALUE_MAX 1024
+
+/* Give up on a table size after that many seeds, and on tables that big */
+#define CONFIG_SCHEMA_SEEDS 64
+#define CONFIG_SCHEMA_MAX_SLOTS (1 << 16)
+
+struct config_slot {
+   const char *key;
+   size_t nkey;
+   /* The index of the item, -1 if the slot is empty */
+   int index;
+};
+
+struct config_schema {
+   uint32_t seed;
+   uint32_t mask;
+   struct config_slot slots[];
+};
+
 static int read_config_file(const char *fname, struct config_item items[],
-                            FILE *error);
+                            const struct config_schema *schema, FILE *error);
 
-/**
- * Copy a string and trim of leading and trailing white space characters.
- * Allow the user to escape out the stop character by putting a backslash before
- * the character.
- * @param dest where to store the result
- * @param size size of the result buffer
- * @param src where to copy data from
- * @param end the last character parsed is returned here
- * @param stop the character to stop copying.
- * @return 0 if success, -1 otherwise
- */
-static int trim_copy(char *dest, size_t size, const char *src,
-                     const char **end, char stop) {
-   size_t n = 0;
-   bool escape = false;
-   int ret = 0;
-   const char *lastchar;
+static uint32_t schema_hash(const char *key, size_t nkey, uint32_t seed) {
+   uint32_t h = 2166136261U ^ (seed * 0x9e3779b1U);
+   size_t ii;
 
-   while (isspace(*src)) {
-      ++src;
+   for (ii = 0; ii < nkey; ++ii) {
+      h ^= (unsigned char)key[ii];
+      h *= 16777619U;
+   }
+   h ^= h >> 15;
+   h *= 0x85ebca6bU;
+   h ^= h >> 13;
+   return h;
+}
+
+/* Try to place all of the keys with the seed, false on a collision */
+static bool schema_place(struct config_schema *schema,
+                         const struct config_item items[]) {
+   int ii;
+
+   for (ii = 0; ii <= (int)schema->mask; ++ii) {
+      schema->slots[ii].index = -1;
+   }
+
+   for (ii = 0; items[ii].key != NULL; ++ii) {
+      size_t nkey = strlen(items[ii].key);
+      struct config_slot *slot = &schema->slots[
+         schema_hash(items[ii].key, nkey, schema->seed) & schema->mask];
+      if (slot->index != -1) {
+         return false;
+      }
+      slot->key = items[ii].key;
+      slot->nkey = nkey;
+      slot->index = ii;
    }
+   return true;
+}
 
-   /* Find the last non-escaped non-space character */
-   lastchar = src + strlen(src) - 1;
-   while (lastchar > src && isspace(*lastchar)) {
-       lastchar--;
+struct config_schema *config_schema_compile(const struct config_item items[]) {
+   size_t nitems = 0;
+   size_t nslots = 8;
+
+   while (items[nitems].key != NULL) {
+      ++nitems;
    }
-   if (lastchar < src || *lastchar == '\\') {
-       lastchar++;
+   while (nslots < nitems * 4) {
+      nslots <<= 1;
    }
-   cb_assert(lastchar >= src);
 
-   do {
-      if ((*dest = *src) == '\\') {
-         escape = true;
-      } else {
-         escape = false;
-         ++dest;
+   for (; nslots <= CONFIG_SCHEMA_MAX_SLOTS; nslots <<= 1) {
+      struct config_schema *schema;
+      uint32_t seed;
+
+      schema = malloc(sizeof(*schema) + nslots * sizeof(struct config_slot));
+      if (schema == NULL) {
+         return NULL;
       }
-      ++n;
-      ++src;
+      schema->mask = (uint32_t)(nslots - 1);
+      for (seed = 0; seed < CONFIG_SCHEMA_SEEDS; ++seed) {
+         schema->seed = seed;
+         if (schema_place(schema, items)) {
+            return schema;
+         }
+      }
+      free(schema);
+   }
+
+   /* Duplicate keys never get a slot of their own */
+   return NULL;
+}
+
+void config_schema_free(struct config_schema *schema) {
+   free(schema);
+}
 
-   } while (!(n == size || src > lastchar || ((*src == stop) && !escape) || *src == '\0'));
-   *end = src;
+const struct config_schema *config_schema_get(struct config_schema **cache,
+                                              const struct config_item items[]) {
+   struct config_schema *schema = *cache;
 
-   if (n == size) {
-       --dest;
-       ret = -1;
+   if (schema == NULL) {
+      schema = config_schema_compile(items);
+      if (schema != NULL &&
+          !__sync_bool_compare_and_swap(cache, NULL, schema)) {
+         /* Someone else got there first */
+         config_schema_free(schema);
+         schema = *cache;
+      }
    }
-   *dest = '\0';
+   return schema;
+}
 
-   return ret;
+/* The index of the item with the key, -1 if none */
+static int find_item(const char *key, size_t nkey,
+                     const struct config_item items[],
+                     const struct config_schema *schema) {
+   int ii;
+
+   if (schema != NULL) {
+      const struct config_slot *slot = &schema->slots[
+         schema_hash(key, nkey, schema->seed) & schema->mask];
+      if (slot->index != -1 && slot->nkey == nkey &&
+          memcmp(slot->key, key, nkey) == 0) {
+         cb_assert(strcmp(items[slot->index].key, slot->key) == 0);
+         return slot->index;
+      }
+      return -1;
+   }
+
+   for (ii = 0; items[ii].key != NULL; ++ii) {
+      if (strncmp(items[ii].key, key, nkey) == 0 &&
+          items[ii].key[nkey] == '\0') {
+         return ii;
+      }
+   }
+   return -1;
+}
+
+/**
+ * Find the end of a token: the first stop character or '\0' not escaped
+ * with a backslash.
+ */
+static const char *token_end(const char *src, char stop) {
+   while (*src != '\0' && *src != stop) {
+      if (*src == '\\' && src[1] != '\0') {
+         ++src;
+      }
+      ++src;
+   }
+   return src;
 }
 
+/**
+ * Copy the token from src to end without the leading (already skipped by
+ * the caller) and trailing white space, dropping the backslashes of the
+ * escaped characters (an escaped space is kept).
+ * @param dest where to store the result, or NULL to only get its length
+ * @return the length of the result (not terminated)
+ */
+static size_t unescape(char *dest, const char *src, const char *end) {
+   size_t n = 0;
+   size_t keep = 0;
 
-int parse_config(const char *str, struct config_item *items, FILE *error) {
-   const char *end;
-   char key[80];
-      char value[1024];
+   while (src < end) {
+      bool escaped = false;
+      if (*src == '\\') {
+         if (++src == end) {
+            break;
+         }
+         escaped = true;
+      }
+      if (dest != NULL) {
+         dest[n] = *src;
+      }
+      ++n;
+      if (escaped || !isspace((unsigned char)*src)) {
+         keep = n;
+      }
+      ++src;
+   }
+   return keep;
+}
+
+/* Copy the token into the buffer and terminate it, -1 if it doesn't fit */
+static int copy_token(char *dest, size_t size, const char *src,
+                      const char *end) {
+   if (unescape(NULL, src, end) >= size) {
+      return -1;
+   }
+   dest[unescape(dest, src, end)] = '\0';
+   return 0;
+}
+
+/**
+ * Parse the string into the items, looking the keys up in the schema if
+ * we've got one. The keys are looked up right in the string (they rarely
+ * have an escape), and the values are converted from a stack copy with the
+ * escapes removed; the only allocation is the one the caller gets for a
+ * DT_STRING.
+ */
+static int parse_items(const char *str, struct config_item *items,
+                       const struct config_schema *schema, FILE *error) {
+   char keybuf[CONFIG_KEY_MAX];
+   char value[CONFIG_VALUE_MAX];
    int ret = 0;
    const char *ptr = str;
-   int ii;
 
    while (*ptr != '\0') {
-      while (isspace(*ptr)) {
+      const char *key;
+      const char *end;
+      const char *vend;
+      size_t nkey;
+      int ii;
+
+      while (isspace((unsigned char)*ptr)) {
          ++ptr;
       }
       if (*ptr == '\0') {
@@ -86,36 +235,62 @@ int parse_config(const char *str, struct config_item *items, FILE *error) {
          return 0;
       }
 
-      if (trim_copy(key, sizeof(key), ptr, &end, '=') == -1) {
+      end = token_end(ptr, '=');
+      nkey = unescape(NULL, ptr, end);
+      if (*end != '=' || nkey >= sizeof(keybuf)) {
          if (error != NULL) {
             fprintf(error, "ERROR: Invalid key, starting at: <%s>\n", ptr);
          }
          return -1;
       }
+      if (memchr(ptr, '\\', end - ptr) == NULL) {
+         key = ptr;
+      } else {
+         unescape(keybuf, ptr, end);
+         key = keybuf;
+      }
 
       ptr = end + 1;
-      if (trim_copy(value, sizeof(value), ptr, &end, ';') == -1) {
+      while (isspace((unsigned char)*ptr)) {
+         ++ptr;
+      }
+      vend = token_end(ptr, ';');
+
+      ii = find_item(key, nkey, items, schema);
+      if (ii == -1) {
          if (error != NULL) {
-            fprintf(error, "ERROR: Invalid value, starting at: <%s>\n", ptr);
+            fprintf(error, "Unsupported key: <%.*s>\n", (int)nkey, key);
          }
-         return -1;
-      }
-      if (*end == ';') {
-         ptr = end + 1;
+         ret = 1;
       } else {
-         ptr = end;
-      }
+         if (items[ii].found) {
+            if (error != NULL) {
+               fprintf(error, "WARNING: Found duplicate entry for \"%s\"\n",
+                       items[ii].key);
+            }
+         }
 
-      ii = 0;
-      while (items[ii].key != NULL) {
-         if (strcmp(key, items[ii].key) == 0) {
-            if (items[ii].found) {
+         if (items[ii].datatype == DT_STRING) {
+            size_t len = unescape(NULL, ptr, vend);
+            char *s = malloc(len + 1);
+            if (s == NULL) {
                if (error != NULL) {
-                  fprintf(error, "WARNING: Found duplicate entry for \"%s\"\n",
-                          items[ii].key);
+                  fprintf(error, "ERROR: Failed to allocate the value of "
+                          "\"%s\"\n", items[ii].key);
                }
+               return -1;
             }
-
+            unescape(s, ptr, vend);
+            s[len] = '\0';
+            *items[ii].value.dt_string = s;
+            items[ii].found = true;
+         } else if (copy_token(value, sizeof(value), ptr, vend) == -1) {
+            if (error != NULL) {
+               fprintf(error, "ERROR: Invalid value, starting at: <%s>\n",
+                       ptr);
+            }
+            return -1;
+         } else {
             switch (items[ii].datatype) {
             case DT_SIZE:
                {
@@ -157,10 +332,6 @@ int parse_config(const char *str, struct config_item *items, FILE *error) {
                   }
                }
                break;
-            case DT_STRING:
-               *items[ii].value.dt_string = strdup(value);
-               items[ii].found = true;
-               break;
             case DT_BOOL:
                if (strcasecmp(value, "true") == 0 || strcasecmp(value, "on") == 0) {
                   *items[ii].value.dt_bool = true;
@@ -174,7 +345,7 @@ int parse_config(const char *str, struct config_item *items, FILE *error) {
                break;
             case DT_CONFIGFILE:
                {
-                  int r = read_config_file(value, items, error);
+                  int r = read_config_file(value, items, schema, error);
                   if (r != 0) {
                      ret = r;
                   }
@@ -187,27 +358,33 @@ int parse_config(const char *str, struct config_item *items, FILE *error) {
             if (ret == -1) {
                if (error != NULL) {
                   fprintf(error, "Invalid entry, Key: <%s> Value: <%s>\n",
-                          key, value);
+                          items[ii].key, value);
                }
                return ret;
             }
-            break;
          }
-         ++ii;
       }
 
-      if (items[ii].key == NULL) {
-         if (error != NULL) {
-            fprintf(error, "Unsupported key: <%s>\n", key);
-         }
-         ret = 1;
+      if (*vend == ';') {
+         ptr = vend + 1;
+      } else {
+         ptr = vend;
       }
    }
    return ret;
 }
 
+int parse_config(const char *str, struct config_item *items, FILE *error) {
+   return parse_items(str, items, NULL, error);
+}
+
+int parse_config_schema(const char *str, const struct config_schema *schema,
+                        struct config_item *items, FILE *error) {
+   return parse_items(str, items, schema, error);
+}
+
 static int read_config_file(const char *fname, struct config_item items[],
-                            FILE *error) {
+                            const struct config_schema *schema, FILE *error) {
    char line[1024];
    int ret = 0;
    FILE *fp = fopen(fname, "r");
@@ -225,7 +402,7 @@ static int read_config_file(const char *fname, struct config_item items[],
          continue;
       }
 
-      r = parse_config(line, items, error);
+      r = parse_items(line, items, schema, error);
       if (r != 0) {
          ret = r;
       }
@@ -0,0 +1,286 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The background task executor the server shares between its engines: a
+ * fixed pool of threads taking the tasks from a queue per priority. A task
+ * is skipped (and stays in its queue) while its owner already has as many
+ * tasks running as its limit, so the tasks of one bucket can't take all
+ * of the threads.
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "utilities/executor.h"
+#include <platform/platform.h>
+
+#define EXECUTOR_DEFAULT_THREADS 4
+
+struct executor_task {
+    uint64_t id;
+    struct executor_owner *owner;
+    EXECUTOR_TASK task;
+    void *arg;
+    struct executor_task *next;
+};
+
+struct executor_owner {
+    const void *owner;
+    int limit;           /* of the tasks running at once, 0 for none */
+    int running;
+    bool cancelled;
+    struct executor_owner *next;
+};
+
+static struct executor {
+    cb_mutex_t mutex;
+    cb_cond_t cond;      /* a task was queued (or may run now) */
+    cb_cond_t done;      /* a task returned */
+    struct executor_task *head[EXECUTOR_PRIORITIES];
+    struct executor_task *tail[EXECUTOR_PRIORITIES];
+    struct executor_owner *owners;
+    uint64_t next_id;
+    int nthreads;
+    int started;
+    bool shutdown;
+    cb_thread_t *threads;
+} executor;
+
+static struct executor_owner *find_owner(const void *owner, bool create) {
+    struct executor_owner *o;
+    for (o = executor.owners; o != NULL; o = o->next) {
+        if (o->owner == owner) {
+            return o;
+        }
+    }
+    if (create && (o = calloc(1, sizeof(*o))) != NULL) {
+        o->owner = owner;
+        o->next = executor.owners;
+        executor.owners = o;
+    }
+    return o;
+}
+
+/* The first task of the highest priority whose owner may run one more */
+static struct executor_task *next_task(void) {
+    int pri;
+    for (pri = 0; pri < EXECUTOR_PRIORITIES; ++pri) {
+        struct executor_task *prev = NULL;
+        struct executor_task *t;
+        for (t = executor.head[pri]; t != NULL; prev = t, t = t->next) {
+            if (t->owner->limit == 0 || t->owner->running < t->owner->limit) {
+                if (prev == NULL) {
+                    executor.head[pri] = t->next;
+                } else {
+                    prev->next = t->next;
+                }
+                if (executor.tail[pri] == t) {
+                    executor.tail[pri] = prev;
+                }
+                return t;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void executor_main(void *arg) {
+    (void)arg;
+    cb_mutex_enter(&executor.mutex);
+    while (!executor.shutdown) {
+        struct executor_task *t = next_task();
+        if (t == NULL) {
+            cb_cond_wait(&executor.cond, &executor.mutex);
+            continue;
+        }
+        t->owner->running++;
+        cb_mutex_exit(&executor.mutex);
+
+        t->task(t->arg);
+
+        cb_mutex_enter(&executor.mutex);
+        t->owner->running--;
+        free(t);
+        cb_cond_broadcast(&executor.done);
+        /* Another task of the owner may have waited for this one */
+        cb_cond_signal(&executor.cond);
+    }
+    cb_mutex_exit(&executor.mutex);
+}
+
+/* Called with the mutex held */
+static void start_threads(void) {
+    if (executor.threads != NULL) {
+        return;
+    }
+    executor.threads = calloc(executor.nthreads, sizeof(cb_thread_t));
+    if (executor.threads == NULL) {
+        return;
+    }
+    while (executor.started < executor.nthreads &&
+           cb_create_thread(&executor.threads[executor.started],
+                            executor_main, NULL, 0) == 0) {
+        ++executor.started;
+    }
+}
+
+static uint64_t executor_submit(const void *owner, EXECUTOR_PRIORITY priority,
+                                EXECUTOR_TASK task, void *arg) {
+    struct executor_owner *o;
+    struct executor_task *t;
+    uint64_t id = 0;
+    int pri = (int)priority;
+
+    if (pri < 0 || pri >= EXECUTOR_PRIORITIES) {
+        pri = EXECUTOR_PRIORITY_NORMAL;
+    }
+
+    cb_mutex_enter(&executor.mutex);
+    start_threads();
+    o = find_owner(owner, true);
+    if (executor.started > 0 && !executor.shutdown && o != NULL &&
+        !o->cancelled && (t = calloc(1, sizeof(*t))) != NULL) {
+        t->id = id = executor.next_id++;
+        t->owner = o;
+        t->task = task;
+        t->arg = arg;
+        if (executor.tail[pri] == NULL) {
+            executor.head[pri] = t;
+        } else {
+            executor.tail[pri]->next = t;
+        }
+        executor.tail[pri] = t;
+        cb_cond_signal(&executor.cond);
+    }
+    cb_mutex_exit(&executor.mutex);
+    return id;
+}
+
+/*
+ * Unlink the queued tasks with the id, of the owner (or all of them if
+ * both are 0 / NULL), with the mutex held. Returns the number dropped.
+ */
+static int drop_tasks(uint64_t id, const struct executor_owner *o) {
+    int dropped = 0;
+    int pri;
+    for (pri = 0; pri < EXECUTOR_PRIORITIES; ++pri) {
+        struct executor_task **prev = &executor.head[pri];
+        struct executor_task *t;
+        executor.tail[pri] = NULL;
+        while ((t = *prev) != NULL) {
+            if ((id == 0 && o == NULL) || t->id == id || t->owner == o) {
+                *prev = t->next;
+                free(t);
+                ++dropped;
+            } else {
+                executor.tail[pri] = t;
+                prev = &t->next;
+            }
+        }
+    }
+    return dropped;
+}
+
+static bool executor_cancel(uint64_t id) {
+    bool ret;
+    cb_mutex_enter(&executor.mutex);
+    ret = id != 0 && drop_tasks(id, NULL) != 0;
+    cb_mutex_exit(&executor.mutex);
+    return ret;
+}
+
+static void executor_cancel_all(const void *owner) {
+    struct executor_owner *o;
+    struct executor_owner **prev;
+
+    cb_mutex_enter(&executor.mutex);
+    o = find_owner(owner, false);
+    if (o != NULL) {
+        o->cancelled = true;
+        drop_tasks(0, o);
+        while (o->running > 0) {
+            cb_cond_wait(&executor.done, &executor.mutex);
+        }
+        /* The owner may come back (a bucket of the same address) */
+        for (prev = &executor.owners; *prev != o; prev = &(*prev)->next) {
+        }
+        *prev = o->next;
+        free(o);
+    }
+    cb_mutex_exit(&executor.mutex);
+}
+
+static bool executor_is_cancelled(const void *owner) {
+    struct executor_owner *o;
+    bool ret;
+    cb_mutex_enter(&executor.mutex);
+    o = find_owner(owner, false);
+    ret = executor.shutdown || (o != NULL && o->cancelled);
+    cb_mutex_exit(&executor.mutex);
+    return ret;
+}
+
+static void executor_set_limit(const void *owner, int running) {
+    struct executor_owner *o;
+    cb_mutex_enter(&executor.mutex);
+    if ((o = find_owner(owner, true)) != NULL) {
+        o->limit = running < 0 ? 0 : running;
+        cb_cond_broadcast(&executor.cond);
+    }
+    cb_mutex_exit(&executor.mutex);
+}
+
+SERVER_EXECUTOR_API *get_executor_api(void) {
+    static SERVER_EXECUTOR_API api;
+    static int init;
+
+    /* By the server as it starts, like the rest of its server api */
+    if (!init) {
+        init = 1;
+        cb_mutex_initialize(&executor.mutex);
+        cb_cond_initialize(&executor.cond);
+        cb_cond_initialize(&executor.done);
+        executor.nthreads = EXECUTOR_DEFAULT_THREADS;
+        executor.next_id = 1;
+
+        api.submit = executor_submit;
+        api.cancel = executor_cancel;
+        api.cancel_all = executor_cancel_all;
+        api.is_cancelled = executor_is_cancelled;
+        api.set_limit = executor_set_limit;
+    }
+    return &api;
+}
+
+void executor_set_threads(int nthreads) {
+    get_executor_api();
+    cb_mutex_enter(&executor.mutex);
+    if (executor.threads == NULL && nthreads > 0) {
+        executor.nthreads = nthreads;
+    }
+    cb_mutex_exit(&executor.mutex);
+}
+
+void executor_shutdown(void) {
+    int ii;
+
+    get_executor_api();
+    cb_mutex_enter(&executor.mutex);
+    executor.shutdown = true;
+    drop_tasks(0, NULL);
+    cb_cond_broadcast(&executor.cond);
+    cb_mutex_exit(&executor.mutex);
+
+    for (ii = 0; ii < executor.started; ++ii) {
+        cb_join_thread(executor.threads[ii]);
+    }
+
+    cb_mutex_enter(&executor.mutex);
+    while (executor.owners != NULL) {
+        struct executor_owner *o = executor.owners;
+        executor.owners = o->next;
+        free(o);
+    }
+    free(executor.threads);
+    executor.threads = NULL;
+    executor.started = 0;
+    cb_mutex_exit(&executor.mutex);
+}
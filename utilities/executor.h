@@ -0,0 +1,34 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <memcached/engine.h>
+#include <memcached/visibility.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    The executor of the server (see SERVER_EXECUTOR_API), for the servers
+    to hand out to their engines. There's one pool per process, and its
+    threads are started by the first task.
+*/
+MEMCACHED_PUBLIC_API SERVER_EXECUTOR_API *get_executor_api(void);
+
+/*
+    Set the number of threads of the pool, before its first task.
+*/
+MEMCACHED_PUBLIC_API void executor_set_threads(int nthreads);
+
+/*
+    Drop the tasks still queued, and stop the threads once the running
+    ones return.
+*/
+MEMCACHED_PUBLIC_API void executor_shutdown(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
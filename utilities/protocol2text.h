@@ -2,8 +2,13 @@
 #ifndef PROTOCOL2TEXT_H
 #define PROTOCOL2TEXT_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <memcached/visibility.h>
 
+/* The number of bytes of the key memcached_packet_2_trace shows */
+#define TRACE_KEY_PREFIX 32
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -11,6 +16,26 @@ extern "C" {
     const char *memcached_opcode_2_text(uint8_t opcode);
     MEMCACHED_PUBLIC_API
     uint8_t memcached_text_2_opcode(const char *txt);
+
+    /* The name of the status ("KEY_ENOENT"), NULL if unknown */
+    MEMCACHED_PUBLIC_API
+    const char *memcached_status_2_text(uint16_t status);
+
+    /**
+     * Render a one line summary of a binary protocol packet (in network
+     * byte order, the header and whatever follows it) for the traces:
+     *
+     *     REQ GET vb:0 opaque:0x00000001 cas:0x0000000000000000 ext:0 key:3 body:3 "foo"
+     *     RES GET KEY_ENOENT opaque:0x00000001 cas:... ext:0 key:0 body:9
+     *
+     * with the printable part of the first TRACE_KEY_PREFIX bytes of the
+     * key if the packet has them. Doesn't allocate.
+     *
+     * @return what snprintf would return for the line, -1 on error
+     */
+    MEMCACHED_PUBLIC_API
+    int memcached_packet_2_trace(const void *packet, size_t size,
+                                 char *dest, size_t destsz);
 #ifdef __cplusplus
 }
 #endif
@@ -210,6 +210,8 @@ const char *memcached_protocol_errcode_2_text(protocol_binary_response_status er
         return "No access";
     case PROTOCOL_BINARY_RESPONSE_NOT_INITIALIZED:
         return "Node not initialized";
+    case PROTOCOL_BINARY_RESPONSE_RATE_LIMITED:
+        return "Rate limited";
     case PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND:
         return "Unknown command";
     case PROTOCOL_BINARY_RESPONSE_ENOMEM:
@@ -246,6 +248,8 @@ const char *memcached_protocol_errcode_2_text(protocol_binary_response_status er
          return "Subdoc: Document path already exists";
     case PROTOCOL_BINARY_RESPONSE_SUBDOC_VALUE_ETOODEEP:
         return "Subdoc: Inserting value would make document too deep";
+    case PROTOCOL_BINARY_RESPONSE_SUBDOC_MULTI_PATH_FAILURE:
+        return "Subdoc: One or more paths in a multi-path command failed";
 
     default:
         return "Unknown error code";